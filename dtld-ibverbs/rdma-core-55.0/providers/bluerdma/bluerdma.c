@@ -183,29 +183,23 @@ static int bluerdma_dereg_mr(struct verbs_mr *vmr)
 
 static int bluerdma_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 {
-	verbs_info(verbs_get_ctx(ibcq->context), "bluerdma poll cq\n");
-
 	return 0;
 }
 
 static int bluerdma_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr_list,
 			      struct ibv_send_wr **bad_wr)
 {
-	verbs_info(verbs_get_ctx(ibqp->context), "bluerdma post send\n");
-
 	return 0;
 }
 
 static int bluerdma_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *recv_wr,
 			      struct ibv_recv_wr **bad_wr)
 {
-	verbs_info(verbs_get_ctx(ibqp->context), "bluerdma post recv\n");
 	return 0;
 }
 
 static int bluerdma_req_notify_cq(struct ibv_cq *ibcq, int solicited_only)
 {
-	verbs_info(verbs_get_ctx(ibcq->context), "bluerdma req notify cq\n");
 	return 0;
 }
 
@@ -245,6 +239,83 @@ static struct verbs_context_ops bluerdma_ctx_ops = {
 	.free_context = bluerdma_free_context,
 };
 
+static struct ibv_cq *bluerdma_ring_create_cq(struct ibv_context *context,
+					      int cqe,
+					      struct ibv_comp_channel *channel,
+					      int comp_vector)
+{
+	struct bluerdma_device *dev = to_bdev(context->device);
+	struct bluerdma_context *ctx = to_bctx(context);
+	struct ibv_cq *ibcq;
+
+	ibcq = dev->driver_create_cq(context, cqe, channel, comp_vector);
+	if (ibcq && ibcq->handle < BLUERDMA_MAX_CQ)
+		ctx->cq_rings[ibcq->handle] = dev->driver_cq_ring(ibcq);
+
+	return ibcq;
+}
+
+static int bluerdma_ring_destroy_cq(struct ibv_cq *ibcq)
+{
+	struct bluerdma_device *dev = to_bdev(ibcq->context->device);
+	struct bluerdma_context *ctx = to_bctx(ibcq->context);
+
+	if (ibcq->handle < BLUERDMA_MAX_CQ)
+		ctx->cq_rings[ibcq->handle] = NULL;
+
+	return dev->driver_destroy_cq(ibcq);
+}
+
+/*
+ * Polls the completion ring of the CQ without calling into the driver. An
+ * empty ring is polled through the driver, so that the driver still makes
+ * progress on the work it does in poll_cq while the CQ is idle.
+ */
+static int bluerdma_ring_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
+{
+	struct bluerdma_device *dev = to_bdev(ibcq->context->device);
+	struct bluerdma_context *ctx = to_bctx(ibcq->context);
+	struct bluerdma_wc_ring *ring = NULL;
+	uint32_t head, tail, n, i;
+
+	if (ibcq->handle < BLUERDMA_MAX_CQ)
+		ring = ctx->cq_rings[ibcq->handle];
+	if (!ring || ne <= 0 ||
+	    !atomic_load_explicit(&ring->in_place, memory_order_acquire))
+		return dev->driver_poll_cq(ibcq, ne, wc);
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	n = head - tail;
+	if (!n)
+		return dev->driver_poll_cq(ibcq, ne, wc);
+	if (n > (uint32_t)ne)
+		n = ne;
+
+	for (i = 0; i < n; i++)
+		wc[i] = ring->entries[(tail + i) & ring->mask];
+	atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+
+	return n;
+}
+
+/* Polls the completion rings of the driver in place, if it exposes them */
+static void bluerdma_set_ring_ops(struct bluerdma_device *dev, void *dl_handler,
+				  struct verbs_context_ops *ops)
+{
+	dev->driver_cq_ring = dlsym(dl_handler, "bluerdma_cq_ring");
+	if (!dev->driver_cq_ring || !ops->create_cq || !ops->destroy_cq ||
+	    !ops->poll_cq)
+		return;
+
+	dev->driver_create_cq = ops->create_cq;
+	dev->driver_destroy_cq = ops->destroy_cq;
+	dev->driver_poll_cq = ops->poll_cq;
+	ops->create_cq = bluerdma_ring_create_cq;
+	ops->destroy_cq = bluerdma_ring_destroy_cq;
+	ops->poll_cq = bluerdma_ring_poll_cq;
+}
+
 static void bluerdma_set_ops(void *dl_handler, struct verbs_context_ops *ops)
 {
 #define SET_OP(op)                                                             \
@@ -430,6 +501,7 @@ bluerdma_device_alloc(struct verbs_sysfs_dev *sysfs_dev)
 	}
 
 	bluerdma_set_ops(dl_handler, ops);
+	bluerdma_set_ring_ops(dev, dl_handler, ops);
 	dev->ops = ops;
 
 	printf("bluerdma device allocated\n");
@@ -37,12 +37,27 @@
 #define __BLUERDMA_H__
 
 #include <infiniband/driver.h>
+#include <stdatomic.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <rdma/bluerdma-abi.h>
 
-#define MAX_WR_IN_SINGLE_POST_REQUEST 1
-#define MAX_SG_LIST_LENGTH_FOR_WR 1
+#define MAX_WR_IN_SINGLE_POST_REQUEST 64
+#define MAX_SG_LIST_LENGTH_FOR_WR 8
+#define BLUERDMA_MAX_CQ 1024
+
+/*
+ * Completion ring of a CQ, written by the driver's completion worker and
+ * polled in place by the provider. Must match `WcRing` of the Rust driver.
+ */
+struct bluerdma_wc_ring {
+	_Atomic uint32_t head __attribute__((aligned(64)));
+	_Atomic uint32_t tail __attribute__((aligned(64)));
+	uint32_t mask __attribute__((aligned(64)));
+	/* cleared once completions need the bookkeeping of the driver */
+	_Atomic uint32_t in_place;
+	struct ibv_wc *entries;
+};
 
 struct bluerdma_device {
 	struct verbs_device ibv_dev;
@@ -54,10 +69,19 @@ struct bluerdma_device {
 	void *dl_handle;
 	void *(*driver_new)(char *);
 	void (*driver_free)(void *);
+
+	/* CQ ops of the driver, wrapped to poll the completion rings in place */
+	struct ibv_cq *(*driver_create_cq)(struct ibv_context *, int,
+					   struct ibv_comp_channel *, int);
+	int (*driver_destroy_cq)(struct ibv_cq *);
+	int (*driver_poll_cq)(struct ibv_cq *, int, struct ibv_wc *);
+	struct bluerdma_wc_ring *(*driver_cq_ring)(struct ibv_cq *);
 };
 
 struct bluerdma_context {
 	struct verbs_context ibv_ctx;
+	/* completion rings indexed by CQ handle, NULL if polled by the driver */
+	struct bluerdma_wc_ring *cq_rings[BLUERDMA_MAX_CQ];
 };
 
 struct bluerdma_cq {
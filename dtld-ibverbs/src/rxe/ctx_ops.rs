@@ -32,6 +32,68 @@ pub unsafe extern "C" fn dealloc_pd(pd: *mut ffi::ibv_pd) -> ::std::os::raw::c_i
     BlueRdmaCore::dealloc_pd(pd)
 }
 
+#[unsafe(export_name = "bluerdma_create_ah")]
+pub unsafe extern "C" fn create_ah(
+    pd: *mut ffi::ibv_pd,
+    attr: *mut ffi::ibv_ah_attr,
+) -> *mut ffi::ibv_ah {
+    log::info!("Creating address handle");
+    BlueRdmaCore::create_ah(pd, attr)
+}
+
+#[unsafe(export_name = "bluerdma_destroy_ah")]
+pub unsafe extern "C" fn destroy_ah(ah: *mut ffi::ibv_ah) -> ::std::os::raw::c_int {
+    log::info!("Destroying address handle");
+    BlueRdmaCore::destroy_ah(ah)
+}
+
+#[unsafe(export_name = "bluerdma_attach_mcast")]
+pub unsafe extern "C" fn attach_mcast(
+    qp: *mut ffi::ibv_qp,
+    gid: *const ffi::ibv_gid,
+    lid: u16,
+) -> ::std::os::raw::c_int {
+    log::info!("Attaching QP to multicast group");
+    BlueRdmaCore::attach_mcast(qp, gid, lid)
+}
+
+#[unsafe(export_name = "bluerdma_detach_mcast")]
+pub unsafe extern "C" fn detach_mcast(
+    qp: *mut ffi::ibv_qp,
+    gid: *const ffi::ibv_gid,
+    lid: u16,
+) -> ::std::os::raw::c_int {
+    log::info!("Detaching QP from multicast group");
+    BlueRdmaCore::detach_mcast(qp, gid, lid)
+}
+
+#[unsafe(export_name = "bluerdma_create_flow")]
+pub unsafe extern "C" fn create_flow(qp: *mut ffi::ibv_qp, flow_attr: *mut ffi::ibv_flow_attr) -> *mut ffi::ibv_flow {
+    log::info!("Creating flow");
+    BlueRdmaCore::create_flow(qp, flow_attr)
+}
+
+#[unsafe(export_name = "bluerdma_destroy_flow")]
+pub unsafe extern "C" fn destroy_flow(flow_id: *mut ffi::ibv_flow) -> ::std::os::raw::c_int {
+    log::info!("Destroying flow");
+    BlueRdmaCore::destroy_flow(flow_id)
+}
+
+#[unsafe(export_name = "bluerdma_alloc_mw")]
+pub unsafe extern "C" fn alloc_mw(
+    pd: *mut ffi::ibv_pd,
+    type_: core::ffi::c_uint,
+) -> *mut ffi::ibv_mw {
+    log::info!("Allocating memory window");
+    BlueRdmaCore::alloc_mw(pd, type_)
+}
+
+#[unsafe(export_name = "bluerdma_dealloc_mw")]
+pub unsafe extern "C" fn dealloc_mw(mw: *mut ffi::ibv_mw) -> ::std::os::raw::c_int {
+    log::info!("Deallocating memory window");
+    BlueRdmaCore::dealloc_mw(mw)
+}
+
 #[unsafe(export_name = "bluerdma_query_device_ex")]
 pub unsafe extern "C" fn query_device_ex(
     blue_context: *mut ffi::ibv_context,
@@ -43,6 +105,14 @@ pub unsafe extern "C" fn query_device_ex(
     BlueRdmaCore::query_device_ex(blue_context, input, device_attr, attr_size)
 }
 
+#[unsafe(export_name = "bluerdma_query_rt_values")]
+pub unsafe extern "C" fn query_rt_values(
+    blue_context: *mut ffi::ibv_context,
+    values: *mut ffi::ibv_values_ex,
+) -> ::std::os::raw::c_int {
+    BlueRdmaCore::query_rt_values(blue_context, values)
+}
+
 #[unsafe(export_name = "bluerdma_query_port")]
 pub unsafe extern "C" fn query_port(
     blue_context: *mut ffi::ibv_context,
@@ -64,18 +134,56 @@ pub unsafe extern "C" fn create_cq(
     BlueRdmaCore::create_cq(blue_context, cqe, channel, comp_vector)
 }
 
+#[unsafe(export_name = "bluerdma_create_cq_ex")]
+pub unsafe extern "C" fn create_cq_ex(
+    blue_context: *mut ffi::ibv_context,
+    cq_attr: *mut ffi::ibv_cq_init_attr_ex,
+) -> *mut ffi::ibv_cq_ex {
+    log::info!("Creating extended completion queue");
+    BlueRdmaCore::create_cq_ex(blue_context, cq_attr)
+}
+
 #[unsafe(export_name = "bluerdma_destroy_cq")]
 pub unsafe extern "C" fn destroy_cq(cq: *mut ffi::ibv_cq) -> ::std::os::raw::c_int {
     log::info!("Destroying completion queue");
     BlueRdmaCore::destroy_cq(cq)
 }
 
+#[unsafe(export_name = "bluerdma_resize_cq")]
+pub unsafe extern "C" fn resize_cq(
+    cq: *mut ffi::ibv_cq,
+    cqe: ::std::os::raw::c_int,
+) -> ::std::os::raw::c_int {
+    log::info!("Resizing completion queue");
+    BlueRdmaCore::resize_cq(cq, cqe)
+}
+
 #[unsafe(export_name = "bluerdma_create_qp")]
 pub unsafe extern "C" fn create_qp(pd: *mut ffi::ibv_pd, init_attr: *mut ffi::ibv_qp_init_attr) -> *mut ffi::ibv_qp {
     log::info!("Creating queue pair");
     BlueRdmaCore::create_qp(pd, init_attr)
 }
 
+#[unsafe(export_name = "bluerdma_create_qps")]
+pub unsafe extern "C" fn create_qps(
+    pd: *mut ffi::ibv_pd,
+    init_attrs: *mut ffi::ibv_qp_init_attr,
+    num_qps: u32,
+    qps: *mut *mut ffi::ibv_qp,
+) -> ::std::os::raw::c_int {
+    log::info!("Creating queue pairs");
+    BlueRdmaCore::create_qps(pd, init_attrs, num_qps, qps)
+}
+
+#[unsafe(export_name = "bluerdma_create_qp_ex")]
+pub unsafe extern "C" fn create_qp_ex(
+    blue_context: *mut ffi::ibv_context,
+    qp_attr: *mut ffi::ibv_qp_init_attr_ex,
+) -> *mut ffi::ibv_qp {
+    log::info!("Creating extended queue pair");
+    BlueRdmaCore::create_qp_ex(blue_context, qp_attr)
+}
+
 #[unsafe(export_name = "bluerdma_destroy_qp")]
 pub unsafe extern "C" fn destroy_qp(qp: *mut ffi::ibv_qp) -> ::std::os::raw::c_int {
     log::info!("Destroying queue pair");
@@ -92,6 +200,35 @@ pub unsafe extern "C" fn modify_qp(
     BlueRdmaCore::modify_qp(qp, attr, attr_mask)
 }
 
+#[unsafe(export_name = "bluerdma_modify_qps")]
+pub unsafe extern "C" fn modify_qps(
+    qps: *mut *mut ffi::ibv_qp,
+    attrs: *mut ffi::ibv_qp_attr,
+    attr_mask: core::ffi::c_int,
+    num_qps: u32,
+    bad_index: *mut u32,
+) -> ::std::os::raw::c_int {
+    log::info!("Modifying queue pairs");
+    BlueRdmaCore::modify_qps(qps, attrs, attr_mask, num_qps, bad_index)
+}
+
+#[unsafe(export_name = "bluerdma_modify_qp_rate_limit")]
+pub unsafe extern "C" fn modify_qp_rate_limit(
+    qp: *mut ffi::ibv_qp,
+    attr: *mut ffi::ibv_qp_rate_limit_attr,
+) -> ::std::os::raw::c_int {
+    log::info!("Modifying queue pair rate limit");
+    BlueRdmaCore::modify_qp_rate_limit(qp, attr)
+}
+
+#[unsafe(export_name = "bluerdma_modify_qp_chunk_size")]
+pub unsafe extern "C" fn modify_qp_chunk_size(
+    qp: *mut ffi::ibv_qp,
+    chunk_size: u32,
+) -> ::std::os::raw::c_int {
+    BlueRdmaCore::modify_qp_chunk_size(qp, chunk_size)
+}
+
 #[unsafe(export_name = "bluerdma_query_qp")]
 pub unsafe extern "C" fn query_qp(
     qp: *mut ffi::ibv_qp,
@@ -121,6 +258,71 @@ pub unsafe extern "C" fn dereg_mr(mr: *mut ffi::ibv_mr) -> ::std::os::raw::c_int
     BlueRdmaCore::dereg_mr(mr)
 }
 
+#[unsafe(export_name = "bluerdma_rereg_mr")]
+pub unsafe extern "C" fn rereg_mr(
+    mr: *mut ffi::ibv_mr,
+    flags: core::ffi::c_int,
+    pd: *mut ffi::ibv_pd,
+    addr: *mut ::std::os::raw::c_void,
+    length: usize,
+    access: core::ffi::c_int,
+) -> ::std::os::raw::c_int {
+    log::info!("Re-registering memory region");
+    BlueRdmaCore::rereg_mr(mr, flags, pd, addr, length, access)
+}
+
+#[unsafe(export_name = "bluerdma_reg_dmabuf_mr")]
+pub unsafe extern "C" fn reg_dmabuf_mr(
+    pd: *mut ffi::ibv_pd,
+    offset: u64,
+    length: usize,
+    iova: u64,
+    fd: core::ffi::c_int,
+    access: core::ffi::c_int,
+) -> *mut ffi::ibv_mr {
+    log::info!("Registering dma-buf memory region");
+    BlueRdmaCore::reg_dmabuf_mr(pd, offset, length, iova, fd, access)
+}
+
+#[unsafe(export_name = "bluerdma_alloc_dm")]
+pub unsafe extern "C" fn alloc_dm(
+    context: *mut ffi::ibv_context,
+    attr: *mut ffi::ibv_alloc_dm_attr,
+) -> *mut ffi::ibv_dm {
+    log::info!("Allocating device memory");
+    BlueRdmaCore::alloc_dm(context, attr)
+}
+
+#[unsafe(export_name = "bluerdma_free_dm")]
+pub unsafe extern "C" fn free_dm(dm: *mut ffi::ibv_dm) -> ::std::os::raw::c_int {
+    log::info!("Freeing device memory");
+    BlueRdmaCore::free_dm(dm)
+}
+
+#[unsafe(export_name = "bluerdma_reg_dm_mr")]
+pub unsafe extern "C" fn reg_dm_mr(
+    pd: *mut ffi::ibv_pd,
+    dm: *mut ffi::ibv_dm,
+    dm_offset: u64,
+    length: usize,
+    access: core::ffi::c_uint,
+) -> *mut ffi::ibv_mr {
+    log::info!("Registering device memory region");
+    BlueRdmaCore::reg_dm_mr(pd, dm, dm_offset, length, access)
+}
+
+#[unsafe(export_name = "bluerdma_advise_mr")]
+pub unsafe extern "C" fn advise_mr(
+    pd: *mut ffi::ibv_pd,
+    advice: core::ffi::c_uint,
+    flags: u32,
+    sg_list: *mut ffi::ibv_sge,
+    num_sge: u32,
+) -> ::std::os::raw::c_int {
+    log::trace!("Advising memory region");
+    BlueRdmaCore::advise_mr(pd, advice, flags, sg_list, num_sge)
+}
+
 #[unsafe(export_name = "bluerdma_post_send")]
 pub unsafe extern "C" fn post_send(
     qp: *mut ffi::ibv_qp,
@@ -146,3 +348,171 @@ pub unsafe extern "C" fn poll_cq(cq: *mut ffi::ibv_cq, num_entries: i32, wc: *mu
     log::trace!("Polling completion queue");
     BlueRdmaCore::poll_cq(cq, num_entries, wc)
 }
+
+#[unsafe(export_name = "bluerdma_req_notify_cq")]
+pub unsafe extern "C" fn req_notify_cq(cq: *mut ffi::ibv_cq, solicited_only: core::ffi::c_int) -> ::std::os::raw::c_int {
+    log::trace!("Requesting completion notification");
+    BlueRdmaCore::req_notify_cq(cq, solicited_only)
+}
+
+#[unsafe(export_name = "bluerdma_modify_cq")]
+pub unsafe extern "C" fn modify_cq(cq: *mut ffi::ibv_cq, attr: *mut ffi::ibv_modify_cq_attr) -> ::std::os::raw::c_int {
+    log::info!("Modifying completion queue");
+    BlueRdmaCore::modify_cq(cq, attr)
+}
+
+#[unsafe(export_name = "bluerdma_create_srq")]
+pub unsafe extern "C" fn create_srq(pd: *mut ffi::ibv_pd, srq_init_attr: *mut ffi::ibv_srq_init_attr) -> *mut ffi::ibv_srq {
+    log::info!("Creating shared receive queue");
+    BlueRdmaCore::create_srq(pd, srq_init_attr)
+}
+
+#[unsafe(export_name = "bluerdma_modify_srq")]
+pub unsafe extern "C" fn modify_srq(
+    srq: *mut ffi::ibv_srq,
+    srq_attr: *mut ffi::ibv_srq_attr,
+    srq_attr_mask: core::ffi::c_int,
+) -> ::std::os::raw::c_int {
+    log::info!("Modifying shared receive queue");
+    BlueRdmaCore::modify_srq(srq, srq_attr, srq_attr_mask)
+}
+
+#[unsafe(export_name = "bluerdma_query_srq")]
+pub unsafe extern "C" fn query_srq(srq: *mut ffi::ibv_srq, srq_attr: *mut ffi::ibv_srq_attr) -> ::std::os::raw::c_int {
+    log::info!("Querying shared receive queue");
+    BlueRdmaCore::query_srq(srq, srq_attr)
+}
+
+#[unsafe(export_name = "bluerdma_destroy_srq")]
+pub unsafe extern "C" fn destroy_srq(srq: *mut ffi::ibv_srq) -> ::std::os::raw::c_int {
+    log::info!("Destroying shared receive queue");
+    BlueRdmaCore::destroy_srq(srq)
+}
+
+#[unsafe(export_name = "bluerdma_post_srq_recv")]
+pub unsafe extern "C" fn post_srq_recv(
+    srq: *mut ffi::ibv_srq,
+    recv_wr: *mut ffi::ibv_recv_wr,
+    bad_recv_wr: *mut *mut ffi::ibv_recv_wr,
+) -> ::std::os::raw::c_int {
+    log::trace!("Posting shared receive work request");
+    BlueRdmaCore::post_srq_recv(srq, recv_wr, bad_recv_wr)
+}
+
+#[unsafe(export_name = "bluerdma_open_xrcd")]
+pub unsafe extern "C" fn open_xrcd(
+    context: *mut ffi::ibv_context,
+    xrcd_init_attr: *mut ffi::ibv_xrcd_init_attr,
+) -> *mut ffi::ibv_xrcd {
+    log::info!("Opening XRC domain");
+    BlueRdmaCore::open_xrcd(context, xrcd_init_attr)
+}
+
+#[unsafe(export_name = "bluerdma_close_xrcd")]
+pub unsafe extern "C" fn close_xrcd(xrcd: *mut ffi::ibv_xrcd) -> ::std::os::raw::c_int {
+    log::info!("Closing XRC domain");
+    BlueRdmaCore::close_xrcd(xrcd)
+}
+
+#[unsafe(export_name = "bluerdma_create_srq_ex")]
+pub unsafe extern "C" fn create_srq_ex(
+    context: *mut ffi::ibv_context,
+    srq_init_attr_ex: *mut ffi::ibv_srq_init_attr_ex,
+) -> *mut ffi::ibv_srq {
+    log::info!("Creating extended shared receive queue");
+    BlueRdmaCore::create_srq_ex(context, srq_init_attr_ex)
+}
+
+#[unsafe(export_name = "bluerdma_get_srq_num")]
+pub unsafe extern "C" fn get_srq_num(srq: *mut ffi::ibv_srq, srq_num: *mut u32) -> ::std::os::raw::c_int {
+    log::info!("Getting shared receive queue number");
+    BlueRdmaCore::get_srq_num(srq, srq_num)
+}
+
+#[unsafe(export_name = "bluerdma_alloc_td")]
+pub unsafe extern "C" fn alloc_td(
+    context: *mut ffi::ibv_context,
+    init_attr: *mut ffi::ibv_td_init_attr,
+) -> *mut ffi::ibv_td {
+    log::info!("Allocating thread domain");
+    BlueRdmaCore::alloc_td(context, init_attr)
+}
+
+#[unsafe(export_name = "bluerdma_dealloc_td")]
+pub unsafe extern "C" fn dealloc_td(td: *mut ffi::ibv_td) -> ::std::os::raw::c_int {
+    log::info!("Deallocating thread domain");
+    BlueRdmaCore::dealloc_td(td)
+}
+
+#[unsafe(export_name = "bluerdma_alloc_parent_domain")]
+pub unsafe extern "C" fn alloc_parent_domain(
+    context: *mut ffi::ibv_context,
+    attr: *mut ffi::ibv_parent_domain_init_attr,
+) -> *mut ffi::ibv_pd {
+    log::info!("Allocating parent domain");
+    BlueRdmaCore::alloc_parent_domain(context, attr)
+}
+
+#[unsafe(export_name = "bluerdma_create_counters")]
+pub unsafe extern "C" fn create_counters(
+    context: *mut ffi::ibv_context,
+    init_attr: *mut ffi::ibv_counters_init_attr,
+) -> *mut ffi::ibv_counters {
+    log::info!("Creating counters");
+    BlueRdmaCore::create_counters(context, init_attr)
+}
+
+#[unsafe(export_name = "bluerdma_destroy_counters")]
+pub unsafe extern "C" fn destroy_counters(counters: *mut ffi::ibv_counters) -> ::std::os::raw::c_int {
+    log::info!("Destroying counters");
+    BlueRdmaCore::destroy_counters(counters)
+}
+
+#[unsafe(export_name = "bluerdma_read_counters")]
+pub unsafe extern "C" fn read_counters(
+    counters: *mut ffi::ibv_counters,
+    counters_value: *mut u64,
+    ncounters: u32,
+    flags: u32,
+) -> ::std::os::raw::c_int {
+    log::trace!("Reading counters");
+    BlueRdmaCore::read_counters(counters, counters_value, ncounters, flags)
+}
+
+#[unsafe(export_name = "bluerdma_dump_counters")]
+pub unsafe extern "C" fn dump_counters(
+    context: *mut ffi::ibv_context,
+    buf: *mut c_char,
+    len: usize,
+) -> ::std::os::raw::c_int {
+    log::trace!("Dumping counters");
+    BlueRdmaCore::dump_counters(context, buf, len)
+}
+
+#[unsafe(export_name = "bluerdma_dump_memory")]
+pub unsafe extern "C" fn dump_memory(
+    context: *mut ffi::ibv_context,
+    buf: *mut c_char,
+    len: usize,
+) -> ::std::os::raw::c_int {
+    log::trace!("Dumping memory usage");
+    BlueRdmaCore::dump_memory(context, buf, len)
+}
+
+#[unsafe(export_name = "bluerdma_dump_trace")]
+pub unsafe extern "C" fn dump_trace(buf: *mut c_char, len: usize) -> ::std::os::raw::c_int {
+    log::trace!("Dumping trace");
+    BlueRdmaCore::dump_trace(buf, len)
+}
+
+#[unsafe(export_name = "bluerdma_dump_desc_trace")]
+pub unsafe extern "C" fn dump_desc_trace(path: *const c_char) -> ::std::os::raw::c_int {
+    log::trace!("Dumping descriptor trace");
+    BlueRdmaCore::dump_desc_trace(path)
+}
+
+#[unsafe(export_name = "bluerdma_cq_ring")]
+pub unsafe extern "C" fn cq_ring(cq: *mut ffi::ibv_cq) -> *const c_void {
+    log::trace!("Getting completion ring");
+    BlueRdmaCore::cq_ring(cq)
+}
@@ -0,0 +1,952 @@
+/*
+ * Bandwidth and latency benchmark in the style of perftest.
+ *
+ *   server: ./rdma_bench [-d dev] [-p port] [-G ip]
+ *   client: ./rdma_bench -t write_bw [options] <server>
+ *
+ * The server takes the test parameters from the client, only the client
+ * reports results.
+ */
+#include <arpa/inet.h>
+#include <endian.h>
+#include <getopt.h>
+#include <infiniband/verbs.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 18515
+#define DEFAULT_ITERS 5000
+#define DEFAULT_TX_DEPTH 128
+#define DEFAULT_CQ_MOD 100
+#define DEFAULT_MAX_SIZE (8U << 20)
+#define MIN_SWEEP_SIZE 2
+#define CQ_POLL_BATCH 16
+#define MAX_THREADS 64
+
+enum bench_test {
+  TEST_WRITE_BW,
+  TEST_WRITE_LAT,
+  TEST_SEND_BW,
+  TEST_SEND_LAT,
+};
+
+static const char *const test_names[] = {
+    [TEST_WRITE_BW] = "write_bw",
+    [TEST_WRITE_LAT] = "write_lat",
+    [TEST_SEND_BW] = "send_bw",
+    [TEST_SEND_LAT] = "send_lat",
+};
+
+/* Parameters of a run, sent by the client to the server. Only u32 fields. */
+struct bench_params {
+  uint32_t test;
+  uint32_t num_qps;
+  uint32_t num_threads;
+  uint32_t iters;
+  uint32_t tx_depth;
+  uint32_t cq_mod;
+  uint32_t inline_size;
+  uint32_t min_size;
+  uint32_t max_size;
+  uint32_t mtu;
+};
+
+/* Connection info of a QP, exchanged over the control socket */
+struct qp_info {
+  uint32_t qpn;
+  uint32_t rkey;
+  uint32_t ip;
+  uint32_t reserved;
+  uint64_t addr;
+};
+
+struct bench_qp {
+  struct ibv_qp *qp;
+  uint32_t index;
+  /* Slot the local WRs read from */
+  char *tx;
+  /* Slot the peer writes to */
+  volatile char *rx;
+  struct qp_info remote;
+  uint64_t posted;
+  uint64_t last_signaled;
+  uint64_t completed;
+  uint64_t received;
+};
+
+struct bench_ctx;
+
+struct bench_thread {
+  pthread_t tid;
+  struct bench_ctx *ctx;
+  struct ibv_cq *cq;
+  uint32_t size;
+};
+
+struct bench_ctx {
+  struct bench_params params;
+  bool is_server;
+  bool csv;
+  struct ibv_context *ctx;
+  struct ibv_pd *pd;
+  struct ibv_mr *mr;
+  char *buf;
+  size_t buf_len;
+  struct bench_qp *qps;
+  struct bench_thread *threads;
+  pthread_barrier_t start;
+  int sock;
+  uint32_t local_ip;
+};
+
+static void die(const char *reason) {
+  perror(reason);
+  exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+	  "Usage: %s [options] [server]\n"
+	  "  -t <test>     write_bw (default), write_lat, send_bw, send_lat\n"
+	  "  -s <size>     message size, K/M suffixes accepted\n"
+	  "  -a            sweep sizes from 2 bytes to the -S size\n"
+	  "  -S <size>     largest size of a sweep (default 8M)\n"
+	  "  -n <iters>    WRs per QP and size (default %d)\n"
+	  "  -q <qps>      number of QPs (default 1)\n"
+	  "  -T <threads>  posting threads, each polls a CQ of its own (default 1)\n"
+	  "  -D <depth>    outstanding WRs per QP (default %d)\n"
+	  "  -Q <n>        request a completion every n WRs (default %d)\n"
+	  "  -I <size>     send messages up to size inline (default 0)\n"
+	  "  -m <mtu>      path MTU, 256 to 4096 (default 4096)\n"
+	  "  -d <dev>      IB device (default the first one)\n"
+	  "  -p <port>     control port (default %d)\n"
+	  "  -G <ip>       IPv4 address of the local RDMA device, default the\n"
+	  "                address of the control connection\n"
+	  "  -C            print results as CSV\n"
+	  "The server takes all test options from the client.\n",
+	  prog, DEFAULT_ITERS, DEFAULT_TX_DEPTH, DEFAULT_CQ_MOD, DEFAULT_PORT);
+  exit(EXIT_FAILURE);
+}
+
+static uint32_t parse_size(const char *arg) {
+  char *end;
+  unsigned long long val = strtoull(arg, &end, 0);
+
+  switch (*end) {
+  case 'k':
+  case 'K':
+    val <<= 10;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    val <<= 20;
+    end++;
+    break;
+  default:
+    break;
+  }
+  if (*end != '\0' || val == 0 || val > UINT32_MAX) {
+    fprintf(stderr, "invalid size: %s\n", arg);
+    exit(EXIT_FAILURE);
+  }
+  return (uint32_t)val;
+}
+
+static enum ibv_mtu parse_mtu(uint32_t mtu) {
+  switch (mtu) {
+  case 256:
+    return IBV_MTU_256;
+  case 512:
+    return IBV_MTU_512;
+  case 1024:
+    return IBV_MTU_1024;
+  case 2048:
+    return IBV_MTU_2048;
+  case 4096:
+    return IBV_MTU_4096;
+  default:
+    fprintf(stderr, "invalid mtu: %u\n", mtu);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static bool is_lat_test(uint32_t test) {
+  return test == TEST_WRITE_LAT || test == TEST_SEND_LAT;
+}
+
+static bool is_send_test(uint32_t test) {
+  return test == TEST_SEND_BW || test == TEST_SEND_LAT;
+}
+
+/* Control connection */
+
+static void ctrl_write(int sock, const void *buf, size_t len) {
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = send(sock, p, len, 0);
+    if (n <= 0)
+      die("Failed to write control socket");
+    p += n;
+    len -= (size_t)n;
+  }
+}
+
+static void ctrl_read(int sock, void *buf, size_t len) {
+  char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = recv(sock, p, len, 0);
+    if (n <= 0)
+      die("Failed to read control socket");
+    p += n;
+    len -= (size_t)n;
+  }
+}
+
+/* Returns once the peer reached the same point */
+static void ctrl_sync(int sock) {
+  char token = 0;
+
+  ctrl_write(sock, &token, sizeof(token));
+  ctrl_read(sock, &token, sizeof(token));
+}
+
+static int ctrl_listen(int port) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  int opt = 1;
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+			     .sin_addr.s_addr = INADDR_ANY,
+			     .sin_port = htons(port)};
+
+  if (sock < 0)
+    die("Failed to create control socket");
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+    die("setsockopt");
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    die("Failed to bind control socket");
+  if (listen(sock, 1) < 0)
+    die("Failed to listen on control socket");
+
+  printf("Waiting for client on port %d...\n", port);
+  fflush(stdout);
+  int client = accept(sock, NULL, NULL);
+  if (client < 0)
+    die("Failed to accept client");
+  close(sock);
+  return client;
+}
+
+static int ctrl_connect(const char *server, int port) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+
+  if (sock < 0)
+    die("Failed to create control socket");
+  if (inet_pton(AF_INET, server, &addr.sin_addr) != 1) {
+    fprintf(stderr, "invalid server address: %s\n", server);
+    exit(EXIT_FAILURE);
+  }
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    die("Failed to connect to server");
+  return sock;
+}
+
+/* Returns the local IPv4 address of the control connection, host order */
+static uint32_t ctrl_local_ip(int sock) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+
+  if (getsockname(sock, (struct sockaddr *)&addr, &len) < 0)
+    die("getsockname");
+  return ntohl(addr.sin_addr.s_addr);
+}
+
+static void params_convert(struct bench_params *params, bool to_net) {
+  uint32_t *words = (uint32_t *)params;
+
+  for (size_t i = 0; i < sizeof(*params) / sizeof(uint32_t); i++)
+    words[i] = to_net ? htonl(words[i]) : ntohl(words[i]);
+}
+
+static void exchange_params(struct bench_ctx *bench) {
+  struct bench_params params = bench->params;
+
+  if (bench->is_server) {
+    ctrl_read(bench->sock, &params, sizeof(params));
+    params_convert(&params, false);
+    if (params.test > TEST_SEND_LAT || params.num_qps == 0 ||
+	params.num_threads == 0 || params.num_threads > MAX_THREADS) {
+      fprintf(stderr, "invalid parameters from client\n");
+      exit(EXIT_FAILURE);
+    }
+    bench->params = params;
+  } else {
+    params_convert(&params, true);
+    ctrl_write(bench->sock, &params, sizeof(params));
+  }
+}
+
+static void exchange_qp_info(struct bench_ctx *bench) {
+  for (uint32_t i = 0; i < bench->params.num_qps; i++) {
+    struct bench_qp *qp = &bench->qps[i];
+    struct qp_info local = {
+	.qpn = htonl(qp->qp->qp_num),
+	.rkey = htonl(bench->mr->rkey),
+	.ip = htonl(bench->local_ip),
+	.addr = htobe64((uint64_t)(uintptr_t)qp->rx),
+    };
+    struct qp_info remote;
+
+    ctrl_write(bench->sock, &local, sizeof(local));
+    ctrl_read(bench->sock, &remote, sizeof(remote));
+    qp->remote.qpn = ntohl(remote.qpn);
+    qp->remote.rkey = ntohl(remote.rkey);
+    qp->remote.ip = ntohl(remote.ip);
+    qp->remote.addr = be64toh(remote.addr);
+  }
+}
+
+/* Verbs resources */
+
+static struct ibv_context *open_device(const char *name) {
+  struct ibv_device **dev_list = ibv_get_device_list(NULL);
+  struct ibv_context *ctx = NULL;
+
+  if (!dev_list)
+    die("Failed to get IB devices list");
+  for (int i = 0; dev_list[i]; i++) {
+    if (!name || strcmp(ibv_get_device_name(dev_list[i]), name) == 0) {
+      ctx = ibv_open_device(dev_list[i]);
+      break;
+    }
+  }
+  ibv_free_device_list(dev_list);
+  if (!ctx) {
+    fprintf(stderr, "Failed to open IB device %s\n", name ? name : "");
+    exit(EXIT_FAILURE);
+  }
+  return ctx;
+}
+
+static char *alloc_buffer(size_t len) {
+  char *buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+		   -1, 0);
+
+  if (buf == MAP_FAILED)
+    buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (buf == MAP_FAILED)
+    die("Failed to map buffer");
+  return buf;
+}
+
+static void setup_ib(struct bench_ctx *bench, const char *dev_name) {
+  struct bench_params *params = &bench->params;
+  uint32_t depth = params->tx_depth;
+
+  bench->ctx = open_device(dev_name);
+  bench->pd = ibv_alloc_pd(bench->ctx);
+  if (!bench->pd)
+    die("Failed to allocate PD");
+
+  /* A tx and an rx slot of the largest size per QP */
+  bench->buf_len = (size_t)params->num_qps * params->max_size * 2;
+  bench->buf = alloc_buffer(bench->buf_len);
+  memset(bench->buf, 0, bench->buf_len);
+  bench->mr = ibv_reg_mr(bench->pd, bench->buf, bench->buf_len,
+			 IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+			     IBV_ACCESS_REMOTE_READ);
+  if (!bench->mr)
+    die("Failed to register MR");
+
+  bench->threads = calloc(params->num_threads, sizeof(*bench->threads));
+  bench->qps = calloc(params->num_qps, sizeof(*bench->qps));
+  if (!bench->threads || !bench->qps)
+    die("calloc");
+
+  for (uint32_t i = 0; i < params->num_threads; i++) {
+    uint32_t qps = (params->num_qps + params->num_threads - 1 - i) /
+		   params->num_threads;
+    struct bench_thread *t = &bench->threads[i];
+
+    t->ctx = bench;
+    /* Every QP of the thread may have depth sends and depth receives */
+    t->cq = ibv_create_cq(bench->ctx, (int)(qps * depth * 2), NULL, NULL, 0);
+    if (!t->cq)
+      die("Failed to create CQ");
+  }
+
+  for (uint32_t i = 0; i < params->num_qps; i++) {
+    struct bench_qp *qp = &bench->qps[i];
+    struct ibv_cq *cq = bench->threads[i % params->num_threads].cq;
+    struct ibv_qp_init_attr attr = {.send_cq = cq,
+				    .recv_cq = cq,
+				    .cap = {.max_send_wr = depth,
+					    .max_recv_wr = depth,
+					    .max_send_sge = 1,
+					    .max_recv_sge = 1,
+					    .max_inline_data =
+						params->inline_size},
+				    .qp_type = IBV_QPT_RC};
+
+    qp->index = i;
+    qp->tx = bench->buf + (size_t)i * params->max_size * 2;
+    qp->rx = qp->tx + params->max_size;
+    qp->qp = ibv_create_qp(bench->pd, &attr);
+    if (!qp->qp)
+      die("Failed to create QP");
+  }
+}
+
+static void set_dgid(struct ibv_ah_attr *ah_attr, uint32_t ip) {
+  ah_attr->is_global = 1;
+  ah_attr->port_num = 1;
+  ah_attr->grh.dgid.raw[10] = 0xFF;
+  ah_attr->grh.dgid.raw[11] = 0xFF;
+  ah_attr->grh.dgid.raw[12] = (ip >> 24) & 0xFF;
+  ah_attr->grh.dgid.raw[13] = (ip >> 16) & 0xFF;
+  ah_attr->grh.dgid.raw[14] = (ip >> 8) & 0xFF;
+  ah_attr->grh.dgid.raw[15] = ip & 0xFF;
+}
+
+static void connect_qp(struct bench_ctx *bench, struct bench_qp *qp) {
+  struct ibv_qp_attr attr = {.qp_state = IBV_QPS_INIT,
+			     .pkey_index = 0,
+			     .port_num = 1,
+			     .qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+						IBV_ACCESS_REMOTE_WRITE |
+						IBV_ACCESS_REMOTE_READ};
+
+  if (ibv_modify_qp(qp->qp, &attr,
+		    IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT |
+			IBV_QP_ACCESS_FLAGS))
+    die("Failed to transition QP to INIT");
+
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_RTR;
+  attr.path_mtu = parse_mtu(bench->params.mtu);
+  attr.dest_qp_num = qp->remote.qpn;
+  attr.rq_psn = 0;
+  attr.max_dest_rd_atomic = 1;
+  attr.min_rnr_timer = 12;
+  set_dgid(&attr.ah_attr, qp->remote.ip);
+  if (ibv_modify_qp(qp->qp, &attr,
+		    IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+			IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+			IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER))
+    die("Failed to transition QP to RTR");
+
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_RTS;
+  attr.timeout = 14;
+  attr.retry_cnt = 7;
+  attr.rnr_retry = 7;
+  attr.sq_psn = 0;
+  attr.max_rd_atomic = 1;
+  set_dgid(&attr.ah_attr, qp->remote.ip);
+  if (ibv_modify_qp(qp->qp, &attr,
+		    IBV_QP_STATE | IBV_QP_AV | IBV_QP_TIMEOUT |
+			IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
+			IBV_QP_MAX_QP_RD_ATOMIC))
+    die("Failed to transition QP to RTS");
+}
+
+static void teardown_ib(struct bench_ctx *bench) {
+  for (uint32_t i = 0; i < bench->params.num_qps; i++)
+    ibv_destroy_qp(bench->qps[i].qp);
+  for (uint32_t i = 0; i < bench->params.num_threads; i++)
+    ibv_destroy_cq(bench->threads[i].cq);
+  ibv_dereg_mr(bench->mr);
+  munmap(bench->buf, bench->buf_len);
+  ibv_dealloc_pd(bench->pd);
+  ibv_close_device(bench->ctx);
+  free(bench->qps);
+  free(bench->threads);
+}
+
+/* Data path */
+
+static void post_recv(struct bench_ctx *bench, struct bench_qp *qp,
+		      uint32_t size) {
+  struct ibv_sge sge = {.addr = (uint64_t)(uintptr_t)qp->rx,
+			.length = size,
+			.lkey = bench->mr->lkey};
+  struct ibv_recv_wr wr = {
+      .wr_id = qp->index, .sg_list = &sge, .num_sge = 1};
+  struct ibv_recv_wr *bad_wr;
+
+  if (ibv_post_recv(qp->qp, &wr, &bad_wr))
+    die("Failed to post recv");
+}
+
+/*
+ * Posts the next WR of the QP. Every cq_mod-th WR and the last one are
+ * signaled, the wr_id of a signaled WR carries the QP index and the number
+ * of WRs its completion retires.
+ */
+static void post_one(struct bench_ctx *bench, struct bench_qp *qp,
+		     uint32_t size) {
+  struct bench_params *params = &bench->params;
+  uint64_t n = qp->posted + 1;
+  bool signaled = n % params->cq_mod == 0 || n == params->iters;
+  struct ibv_sge sge = {.addr = (uint64_t)(uintptr_t)qp->tx,
+			.length = size,
+			.lkey = bench->mr->lkey};
+  struct ibv_send_wr wr = {
+      .wr_id = ((uint64_t)qp->index << 32) | (n - qp->last_signaled),
+      .sg_list = &sge,
+      .num_sge = 1,
+      .opcode = is_send_test(params->test) ? IBV_WR_SEND : IBV_WR_RDMA_WRITE};
+  struct ibv_send_wr *bad_wr;
+
+  if (signaled) {
+    wr.send_flags |= IBV_SEND_SIGNALED;
+    qp->last_signaled = n;
+  }
+  if (size <= params->inline_size)
+    wr.send_flags |= IBV_SEND_INLINE;
+  if (!is_send_test(params->test)) {
+    wr.wr.rdma.remote_addr = qp->remote.addr;
+    wr.wr.rdma.rkey = qp->remote.rkey;
+  }
+  if (ibv_post_send(qp->qp, &wr, &bad_wr))
+    die("Failed to post send");
+  qp->posted = n;
+}
+
+/*
+ * Polls a batch of completions. Send completions retire WRs of their QP,
+ * receive completions are counted and reposted while more are expected.
+ *
+ * Returns the number of WRs retired or received.
+ */
+static uint64_t poll_batch(struct bench_thread *t) {
+  struct bench_ctx *bench = t->ctx;
+  struct ibv_wc wc[CQ_POLL_BATCH];
+  uint64_t done = 0;
+  int n = ibv_poll_cq(t->cq, CQ_POLL_BATCH, wc);
+
+  if (n < 0)
+    die("Failed to poll CQ");
+  for (int i = 0; i < n; i++) {
+    if (wc[i].status != IBV_WC_SUCCESS) {
+      fprintf(stderr, "completion error: %s, wr_id 0x%llx\n",
+	      ibv_wc_status_str(wc[i].status),
+	      (unsigned long long)wc[i].wr_id);
+      exit(EXIT_FAILURE);
+    }
+    if (wc[i].opcode & IBV_WC_RECV) {
+      struct bench_qp *qp = &bench->qps[wc[i].wr_id];
+      qp->received++;
+      if (qp->received + bench->params.tx_depth <= bench->params.iters)
+	post_recv(bench, qp, t->size);
+      done++;
+    } else {
+      struct bench_qp *qp = &bench->qps[wc[i].wr_id >> 32];
+      uint64_t retired = (uint32_t)wc[i].wr_id;
+      qp->completed += retired;
+      done += retired;
+    }
+  }
+  return done;
+}
+
+/* Resets the counters of the QPs of the thread and preposts receives */
+static void prepare_qps(struct bench_thread *t, bool post_recvs) {
+  struct bench_ctx *bench = t->ctx;
+  struct bench_params *params = &bench->params;
+  uint32_t index = (uint32_t)(t - bench->threads);
+
+  for (uint32_t i = index; i < params->num_qps; i += params->num_threads) {
+    struct bench_qp *qp = &bench->qps[i];
+    uint32_t recvs =
+	params->iters < params->tx_depth ? params->iters : params->tx_depth;
+
+    qp->posted = 0;
+    qp->last_signaled = 0;
+    qp->completed = 0;
+    qp->received = 0;
+    for (uint32_t j = 0; post_recvs && j < recvs; j++)
+      post_recv(bench, qp, t->size);
+  }
+}
+
+static void *bw_thread(void *arg) {
+  struct bench_thread *t = arg;
+  struct bench_ctx *bench = t->ctx;
+  struct bench_params *params = &bench->params;
+  uint32_t index = (uint32_t)(t - bench->threads);
+  uint64_t total = 0;
+  uint64_t done = 0;
+
+  for (uint32_t i = index; i < params->num_qps; i += params->num_threads)
+    total += params->iters;
+
+  pthread_barrier_wait(&bench->start);
+  while (done < total) {
+    if (!bench->is_server) {
+      for (uint32_t i = index; i < params->num_qps; i += params->num_threads) {
+	struct bench_qp *qp = &bench->qps[i];
+	while (qp->posted < params->iters &&
+	       qp->posted - qp->completed < params->tx_depth)
+	  post_one(bench, qp, t->size);
+      }
+    }
+    done += poll_batch(t);
+  }
+  return NULL;
+}
+
+/* Runs the threads of a bandwidth test, returns the elapsed time in ns */
+static uint64_t run_bw(struct bench_ctx *bench, uint32_t size) {
+  struct bench_params *params = &bench->params;
+  bool server_idle = bench->is_server && params->test == TEST_WRITE_BW;
+  uint64_t start;
+  uint64_t end;
+
+  for (uint32_t i = 0; i < params->num_threads; i++) {
+    bench->threads[i].size = size;
+    prepare_qps(&bench->threads[i],
+		bench->is_server && params->test == TEST_SEND_BW);
+  }
+  ctrl_sync(bench->sock);
+  if (server_idle) {
+    /* RDMA writes complete on the client only */
+    ctrl_sync(bench->sock);
+    return 0;
+  }
+
+  pthread_barrier_init(&bench->start, NULL, params->num_threads + 1);
+  for (uint32_t i = 0; i < params->num_threads; i++) {
+    if (pthread_create(&bench->threads[i].tid, NULL, bw_thread,
+		       &bench->threads[i]))
+      die("pthread_create");
+  }
+  pthread_barrier_wait(&bench->start);
+  start = now_ns();
+  for (uint32_t i = 0; i < params->num_threads; i++)
+    pthread_join(bench->threads[i].tid, NULL);
+  end = now_ns();
+  pthread_barrier_destroy(&bench->start);
+
+  ctrl_sync(bench->sock);
+  return end - start;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Waits for the next receive of a latency test, retiring sends meanwhile */
+static void wait_recv(struct bench_thread *t, struct bench_qp *qp,
+		      uint64_t expected) {
+  while (qp->received < expected)
+    (void)poll_batch(t);
+}
+
+/*
+ * Ping-pong on the first QP. RDMA write latency is measured by polling the
+ * last byte of the rx slot, send latency by polling the receive completion.
+ * Each sample is half a round trip.
+ */
+static void run_lat(struct bench_ctx *bench, uint32_t size, uint64_t *samples) {
+  struct bench_params *params = &bench->params;
+  struct bench_thread *t = &bench->threads[0];
+  struct bench_qp *qp = &bench->qps[0];
+  bool is_send = params->test == TEST_SEND_LAT;
+
+  t->size = size;
+  memset((char *)qp->rx, 0, size);
+  prepare_qps(t, is_send);
+  ctrl_sync(bench->sock);
+
+  for (uint32_t i = 0; i < params->iters; i++) {
+    char seq = (char)(i % 255 + 1);
+    uint64_t start = now_ns();
+
+    if (bench->is_server) {
+      if (is_send)
+	wait_recv(t, qp, i + 1);
+      else
+	while (qp->rx[size - 1] != seq)
+	  ;
+    }
+    while (qp->posted - qp->completed >= params->tx_depth)
+      (void)poll_batch(t);
+    qp->tx[size - 1] = seq;
+    post_one(bench, qp, size);
+    if (!bench->is_server) {
+      if (is_send)
+	wait_recv(t, qp, i + 1);
+      else
+	while (qp->rx[size - 1] != seq)
+	  ;
+      samples[i] = (now_ns() - start) / 2;
+    }
+  }
+  while (qp->completed < qp->posted)
+    (void)poll_batch(t);
+
+  ctrl_sync(bench->sock);
+}
+
+/* Reports */
+
+static void print_bw_header(struct bench_ctx *bench) {
+  if (bench->csv) {
+    printf("test,bytes,iterations,qps,threads,bw_gbps,bw_mib_s,msg_rate_mpps\n");
+    return;
+  }
+  printf("---------------------------------------------------------------------------\n");
+  printf(" %s, %u QPs, %u threads, tx depth %u, CQ moderation %u, inline %u\n",
+	 test_names[bench->params.test], bench->params.num_qps,
+	 bench->params.num_threads, bench->params.tx_depth,
+	 bench->params.cq_mod, bench->params.inline_size);
+  printf("---------------------------------------------------------------------------\n");
+  printf(" %-10s %-12s %-16s %-20s %-14s\n", "#bytes", "#iterations",
+	 "BW[Gb/sec]", "BW average[MiB/sec]", "MsgRate[Mpps]");
+}
+
+static void print_bw(struct bench_ctx *bench, uint32_t size,
+		     uint64_t elapsed_ns) {
+  struct bench_params *params = &bench->params;
+  double msgs = (double)params->iters * params->num_qps;
+  double secs = (double)elapsed_ns / 1e9;
+  double bytes = msgs * size;
+
+  if (bench->csv)
+    printf("%s,%u,%u,%u,%u,%.3f,%.2f,%.6f\n", test_names[params->test], size,
+	   params->iters, params->num_qps, params->num_threads,
+	   bytes * 8 / secs / 1e9, bytes / secs / (1 << 20),
+	   msgs / secs / 1e6);
+  else
+    printf(" %-10u %-12u %-16.3f %-20.2f %-14.6f\n", size, params->iters,
+	   bytes * 8 / secs / 1e9, bytes / secs / (1 << 20),
+	   msgs / secs / 1e6);
+  fflush(stdout);
+}
+
+static void print_lat_header(struct bench_ctx *bench) {
+  if (bench->csv) {
+    printf("test,bytes,iterations,min_us,median_us,avg_us,p99_us,max_us\n");
+    return;
+  }
+  printf("---------------------------------------------------------------------------\n");
+  printf(" %s, CQ moderation %u, inline %u\n", test_names[bench->params.test],
+	 bench->params.cq_mod, bench->params.inline_size);
+  printf("---------------------------------------------------------------------------\n");
+  printf(" %-10s %-12s %-10s %-12s %-10s %-10s %-10s\n", "#bytes",
+	 "#iterations", "t_min[us]", "t_typical[us]", "t_avg[us]", "t_99%[us]",
+	 "t_max[us]");
+}
+
+static void print_lat(struct bench_ctx *bench, uint32_t size,
+		      uint64_t *samples) {
+  uint32_t iters = bench->params.iters;
+  double sum = 0;
+
+  qsort(samples, iters, sizeof(*samples), compare_u64);
+  for (uint32_t i = 0; i < iters; i++)
+    sum += (double)samples[i];
+
+  double min = samples[0] / 1e3;
+  double median = samples[iters / 2] / 1e3;
+  double avg = sum / iters / 1e3;
+  double p99 = samples[(uint64_t)iters * 99 / 100] / 1e3;
+  double max = samples[iters - 1] / 1e3;
+
+  if (bench->csv)
+    printf("%s,%u,%u,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+	   test_names[bench->params.test], size, iters, min, median, avg, p99,
+	   max);
+  else
+    printf(" %-10u %-12u %-10.3f %-12.3f %-10.3f %-10.3f %-10.3f\n", size,
+	   iters, min, median, avg, p99, max);
+  fflush(stdout);
+}
+
+static void run(struct bench_ctx *bench) {
+  struct bench_params *params = &bench->params;
+  bool is_lat = is_lat_test(params->test);
+  uint64_t *samples = NULL;
+
+  if (is_lat) {
+    samples = calloc(params->iters, sizeof(*samples));
+    if (!samples)
+      die("calloc");
+  }
+  if (!bench->is_server) {
+    if (is_lat)
+      print_lat_header(bench);
+    else
+      print_bw_header(bench);
+  }
+
+  for (uint64_t size = params->min_size; size <= params->max_size;
+       size *= 2) {
+    if (is_lat) {
+      run_lat(bench, (uint32_t)size, samples);
+      if (!bench->is_server)
+	print_lat(bench, (uint32_t)size, samples);
+    } else {
+      uint64_t elapsed = run_bw(bench, (uint32_t)size);
+      if (!bench->is_server)
+	print_bw(bench, (uint32_t)size, elapsed);
+    }
+  }
+  free(samples);
+}
+
+int main(int argc, char *argv[]) {
+  struct bench_ctx bench = {
+      .params = {.test = TEST_WRITE_BW,
+		 .num_qps = 1,
+		 .num_threads = 1,
+		 .iters = DEFAULT_ITERS,
+		 .tx_depth = DEFAULT_TX_DEPTH,
+		 .cq_mod = DEFAULT_CQ_MOD,
+		 .inline_size = 0,
+		 .min_size = 65536,
+		 .max_size = 65536,
+		 .mtu = 4096},
+  };
+  const char *dev_name = NULL;
+  const char *local_ip = NULL;
+  int port = DEFAULT_PORT;
+  bool sweep = false;
+  uint32_t sweep_max = DEFAULT_MAX_SIZE;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:s:aS:n:q:T:D:Q:I:m:d:p:G:Ch")) != -1) {
+    switch (opt) {
+    case 't': {
+      bool found = false;
+      for (uint32_t i = 0; i <= TEST_SEND_LAT; i++) {
+	if (strcmp(optarg, test_names[i]) == 0) {
+	  bench.params.test = i;
+	  found = true;
+	}
+      }
+      if (!found)
+	usage(argv[0]);
+      break;
+    }
+    case 's':
+      bench.params.min_size = bench.params.max_size = parse_size(optarg);
+      break;
+    case 'a':
+      sweep = true;
+      break;
+    case 'S':
+      sweep_max = parse_size(optarg);
+      break;
+    case 'n':
+      bench.params.iters = parse_size(optarg);
+      break;
+    case 'q':
+      bench.params.num_qps = parse_size(optarg);
+      break;
+    case 'T':
+      bench.params.num_threads = parse_size(optarg);
+      break;
+    case 'D':
+      bench.params.tx_depth = parse_size(optarg);
+      break;
+    case 'Q':
+      bench.params.cq_mod = parse_size(optarg);
+      break;
+    case 'I':
+      bench.params.inline_size = (uint32_t)strtoul(optarg, NULL, 0);
+      break;
+    case 'm':
+      bench.params.mtu = parse_size(optarg);
+      (void)parse_mtu(bench.params.mtu);
+      break;
+    case 'd':
+      dev_name = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'G':
+      local_ip = optarg;
+      break;
+    case 'C':
+      bench.csv = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind < argc - 1)
+    usage(argv[0]);
+  bench.is_server = optind == argc;
+
+  if (sweep) {
+    bench.params.min_size = MIN_SWEEP_SIZE;
+    bench.params.max_size = sweep_max;
+  }
+  if (is_lat_test(bench.params.test) && bench.params.num_qps > 1) {
+    fprintf(stderr, "latency tests run on a single QP\n");
+    bench.params.num_qps = 1;
+  }
+  if (is_lat_test(bench.params.test))
+    bench.params.num_threads = 1;
+  if (bench.params.num_threads > bench.params.num_qps)
+    bench.params.num_threads = bench.params.num_qps;
+  if (bench.params.num_threads > MAX_THREADS) {
+    fprintf(stderr, "at most %d threads\n", MAX_THREADS);
+    return EXIT_FAILURE;
+  }
+  if (bench.params.cq_mod > bench.params.tx_depth)
+    bench.params.cq_mod = bench.params.tx_depth;
+
+  if (bench.is_server)
+    bench.sock = ctrl_listen(port);
+  else
+    bench.sock = ctrl_connect(argv[optind], port);
+  exchange_params(&bench);
+
+  if (local_ip) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, local_ip, &addr) != 1) {
+      fprintf(stderr, "invalid address: %s\n", local_ip);
+      return EXIT_FAILURE;
+    }
+    bench.local_ip = ntohl(addr.s_addr);
+  } else {
+    bench.local_ip = ctrl_local_ip(bench.sock);
+  }
+
+  setup_ib(&bench, dev_name);
+  exchange_qp_info(&bench);
+  for (uint32_t i = 0; i < bench.params.num_qps; i++)
+    connect_qp(&bench, &bench.qps[i]);
+
+  run(&bench);
+
+  teardown_ib(&bench);
+  close(bench.sock);
+  return EXIT_SUCCESS;
+}
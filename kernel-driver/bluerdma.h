@@ -8,11 +8,18 @@
 #include <rdma/ib_verbs.h>
 #include <linux/sysfs.h>
 #include <linux/device.h>
+#include <linux/miscdevice.h>
 
 #define BLUERDMA_DEFAULT_MTU 1500
+/* Largest frame of the simple NIC slots, a jumbo frame */
+#define BLUERDMA_MAX_MTU 9000
 #define BLUERDMA_MAC_PREFIX 0x02, 0xBD, 0xBD, 0x00, 0x00
 #define BLUERDMA_GID_TABLE_SIZE 16
 #define BLUERDMA_GID_PREFIX_DEFAULT 0xfe80
+/* Pages of the queue area each user context maps through its ucontext */
+#define BLUERDMA_UCTX_QUEUE_PAGES 16
+/* MSI-X vectors requested per card, one per meta report channel */
+#define BLUERDMA_MAX_IRQ_VECTORS 4
 
 struct bluerdma_gid_entry {
 	union ib_gid gid;
@@ -20,6 +27,17 @@ struct bluerdma_gid_entry {
 	bool valid;
 };
 
+/* MSI-X vector of a meta report channel, see irq.c */
+struct bluerdma_irq_vector {
+	unsigned int irq;
+	/* Bit 0 is set while the vector is unmasked */
+	unsigned long armed;
+	spinlock_t lock;
+	/* Signaled by the interrupts of the vector, bound by owner */
+	struct eventfd_ctx *trigger;
+	struct file *owner;
+};
+
 struct bluerdma_dev {
 	struct ib_device ibdev;
 	struct net_device *netdev;
@@ -43,6 +61,14 @@ struct bluerdma_dev {
 	/* sysfs attributes */
 	struct device_attribute gids_attr;
 	struct device_attribute mac_attr;
+
+	/* Meta report interrupts, exposed to the provider as /dev/bluerdma_irqN */
+	struct bluerdma_irq_vector irq_vectors[BLUERDMA_MAX_IRQ_VECTORS];
+	int num_irq_vectors;
+	/* TPH is enabled, with the steering tags in the entries of the vectors */
+	bool tph;
+	struct miscdevice irq_misc;
+	char irq_misc_name[32];
 };
 
 static inline struct bluerdma_dev *to_bdev(struct ib_device *ibdev)
@@ -62,8 +88,85 @@ struct bluerdma_qp {
 	struct ib_qp ibqp;
 };
 
+struct bluerdma_mr {
+	struct ib_mr ibmr;
+	/* Pages pinned by reg_user_mr, NULL for the DMA MR */
+	struct ib_umem *umem;
+	/* Card the pages are mapped for, NULL if handed by physical address */
+	struct device *dma_dev;
+};
+
+static inline struct bluerdma_mr *to_bmr(struct ib_mr *ibmr)
+{
+	return container_of(ibmr, struct bluerdma_mr, ibmr);
+}
+
 struct bluerdma_ucontext {
 	struct ib_ucontext ibuc;
+	/* Queue area of the context, mapped by the provider */
+	struct rdma_user_mmap_entry *queue_entry;
+};
+
+static inline struct bluerdma_ucontext *to_buctx(struct ib_ucontext *ibuc)
+{
+	return container_of(ibuc, struct bluerdma_ucontext, ibuc);
+}
+
+struct bluerdma_user_mmap_entry {
+	struct rdma_user_mmap_entry rdma_entry;
+	void *cpu_addr;
+	size_t size;
+};
+
+static inline struct bluerdma_user_mmap_entry *
+to_bentry(struct rdma_user_mmap_entry *rdma_entry)
+{
+	return container_of(rdma_entry, struct bluerdma_user_mmap_entry,
+			    rdma_entry);
+}
+
+/* Response of alloc_ucontext, read by the provider */
+struct bluerdma_alloc_ucontext_resp {
+	__aligned_u64 queue_mmap_offset;
+	__u32 queue_size;
+	__u32 reserved;
+};
+
+/*
+ * Driver data of reg_mr. The DMA address of each page of 1 << page_shift bytes
+ * of the MR is written to the page_list array of page_list_len entries.
+ */
+struct bluerdma_reg_mr_cmd {
+	__aligned_u64 page_list;
+	__u32 page_list_len;
+	__u32 page_shift;
+};
+
+/* Response of reg_mr, read by the provider */
+struct bluerdma_reg_mr_resp {
+	__u32 num_pages;
+	__u32 reserved;
+};
+
+/* Binds an eventfd to a meta report vector of /dev/bluerdma_irqN, fd -1 unbinds it */
+struct bluerdma_irq_bind {
+	__u32 vector;
+	__s32 fd;
 };
 
+#define BLUERDMA_IOCTL_MAGIC 'B'
+#define BLUERDMA_IOCTL_BIND_IRQ \
+	_IOW(BLUERDMA_IOCTL_MAGIC, 0x01, struct bluerdma_irq_bind)
+/* Unmasks a vector, each interrupt masks its vector until it is armed again */
+#define BLUERDMA_IOCTL_ARM_IRQ _IOW(BLUERDMA_IOCTL_MAGIC, 0x02, __u32)
+
+/* Steers the interrupt and the TPH tag of the writes of a vector to a cpu */
+struct bluerdma_irq_steer {
+	__u32 vector;
+	__u32 cpu;
+};
+
+#define BLUERDMA_IOCTL_STEER_IRQ \
+	_IOW(BLUERDMA_IOCTL_MAGIC, 0x03, struct bluerdma_irq_steer)
+
 #endif // __BLUERDMA_H__
@@ -18,10 +18,14 @@ static netdev_tx_t bluerdma_netdev_xmit(struct sk_buff *skb,
 
 	spin_lock_irqsave(&dev->tx_lock, flags);
 
-	/* TODO: DMA the packet to hardware */
+	/*
+	 * TODO: DMA the packet to hardware. The simple NIC rings are owned by
+	 * the user space driver, which sends its ACK frames on them, so the
+	 * packet is dropped until the module maps the device and the rings are
+	 * handed over to it.
+	 */
 
-	netdev->stats.tx_packets++;
-	netdev->stats.tx_bytes += skb->len;
+	netdev->stats.tx_dropped++;
 
 	spin_unlock_irqrestore(&dev->tx_lock, flags);
 
@@ -62,6 +66,12 @@ static int bluerdma_netdev_stop(struct net_device *netdev)
 	return 0;
 }
 
+/*
+ * The frames of the netdev are carried by the simple NIC of the user space
+ * driver, which sizes its slots from its configuration and sets the MTU of
+ * the netdev to match when it opens the device. The core has already checked
+ * new_mtu against min_mtu and max_mtu.
+ */
 static int bluerdma_netdev_change_mtu(struct net_device *netdev, int new_mtu)
 {
 	pr_info("bluerdma_netdev_change_mtu: changing MTU from %d to %d\n",
@@ -102,11 +112,14 @@ static void bluerdma_netdev_setup(struct net_device *netdev)
 	netdev->features = netdev->hw_features;
 
 	netdev->min_mtu = ETH_MIN_MTU;
-	netdev->max_mtu = ETH_MAX_MTU;
+	netdev->max_mtu = BLUERDMA_MAX_MTU;
 	netdev->mtu = BLUERDMA_DEFAULT_MTU;
 
 	netif_napi_add(netdev, &dev->napi, bluerdma_napi_poll);
 
+	spin_lock_init(&dev->tx_lock);
+	spin_lock_init(&dev->mac_lock);
+
 	/* TODO: Read MAC address from device */
 	eth_hw_addr_random(netdev);
 
@@ -114,9 +127,6 @@ static void bluerdma_netdev_setup(struct net_device *netdev)
 	memcpy(dev->mac_addr, netdev->dev_addr, ETH_ALEN);
 	spin_unlock(&dev->mac_lock);
 
-	spin_lock_init(&dev->tx_lock);
-	spin_lock_init(&dev->mac_lock);
-
 	netif_carrier_off(netdev);
 }
 
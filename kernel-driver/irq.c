@@ -0,0 +1,333 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-3-Clause
+
+#include <linux/eventfd.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/interrupt.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0) && IS_ENABLED(CONFIG_PCIE_TPH)
+#include <linux/pci-tph.h>
+#define BLUERDMA_HAS_TPH
+#endif
+
+#include "irq.h"
+
+#define PCI_VENDOR_ID_BLUERDMA 0x1172
+#define PCI_DEVICE_ID_BLUERDMA 0x0000
+
+/*
+ * The queues of the cards are driven from user space, the module only takes
+ * the MSI-X vectors of the meta report channels. Each interrupt masks its
+ * vector and signals the eventfd bound to it, the provider polls the channel
+ * until it is idle and arms the vector again before it sleeps, as NAPI does.
+ *
+ * With TPH the card takes the steering tag of a meta report write from the
+ * entry of the vector of the channel, so steering a vector to the core of the
+ * poller places the reports in the cache of that core.
+ */
+
+static struct bluerdma_dev **irq_devs;
+static int num_irq_devs;
+static int next_irq_dev;
+
+static irqreturn_t bluerdma_irq_handler(int irq, void *data)
+{
+	struct bluerdma_irq_vector *vec = data;
+
+	disable_irq_nosync(irq);
+	clear_bit(0, &vec->armed);
+
+	spin_lock(&vec->lock);
+	if (vec->trigger)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+		eventfd_signal(vec->trigger, 1);
+#else
+		eventfd_signal(vec->trigger);
+#endif
+	spin_unlock(&vec->lock);
+
+	return IRQ_HANDLED;
+}
+
+static void bluerdma_irq_set_trigger(struct bluerdma_irq_vector *vec,
+				     struct eventfd_ctx *trigger,
+				     struct file *owner)
+{
+	struct eventfd_ctx *prev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vec->lock, flags);
+	prev = vec->trigger;
+	vec->trigger = trigger;
+	vec->owner = owner;
+	spin_unlock_irqrestore(&vec->lock, flags);
+
+	if (prev)
+		eventfd_ctx_put(prev);
+}
+
+static struct bluerdma_dev *irq_file_dev(struct file *file)
+{
+	struct miscdevice *misc = file->private_data;
+
+	return container_of(misc, struct bluerdma_dev, irq_misc);
+}
+
+static long bluerdma_irq_ioctl_bind(struct bluerdma_dev *dev,
+				    struct file *file, void __user *arg)
+{
+	struct bluerdma_irq_bind bind;
+	struct bluerdma_irq_vector *vec;
+	struct eventfd_ctx *trigger = NULL;
+
+	if (copy_from_user(&bind, arg, sizeof(bind)))
+		return -EFAULT;
+	if (bind.vector >= dev->num_irq_vectors)
+		return -EINVAL;
+	vec = &dev->irq_vectors[bind.vector];
+	if (vec->owner && vec->owner != file)
+		return -EBUSY;
+
+	if (bind.fd >= 0) {
+		trigger = eventfd_ctx_fdget(bind.fd);
+		if (IS_ERR(trigger))
+			return PTR_ERR(trigger);
+	}
+	bluerdma_irq_set_trigger(vec, trigger, trigger ? file : NULL);
+
+	return 0;
+}
+
+static long bluerdma_irq_ioctl_arm(struct bluerdma_dev *dev,
+				   struct file *file, void __user *arg)
+{
+	struct bluerdma_irq_vector *vec;
+	__u32 vector;
+
+	if (get_user(vector, (__u32 __user *)arg))
+		return -EFAULT;
+	if (vector >= dev->num_irq_vectors)
+		return -EINVAL;
+	vec = &dev->irq_vectors[vector];
+	if (vec->owner != file)
+		return -EPERM;
+
+	if (!test_and_set_bit(0, &vec->armed))
+		enable_irq(vec->irq);
+
+	return 0;
+}
+
+static long bluerdma_irq_ioctl_steer(struct bluerdma_dev *dev,
+				     struct file *file, void __user *arg)
+{
+	struct bluerdma_irq_steer steer;
+	struct bluerdma_irq_vector *vec;
+	int ret;
+#ifdef BLUERDMA_HAS_TPH
+	u16 tag;
+#endif
+
+	if (copy_from_user(&steer, arg, sizeof(steer)))
+		return -EFAULT;
+	if (steer.vector >= dev->num_irq_vectors)
+		return -EINVAL;
+	if (steer.cpu >= nr_cpu_ids || !cpu_online(steer.cpu))
+		return -EINVAL;
+	vec = &dev->irq_vectors[steer.vector];
+	if (vec->owner != file)
+		return -EPERM;
+
+	ret = irq_set_affinity_and_hint(vec->irq, cpumask_of(steer.cpu));
+	if (ret)
+		return ret;
+
+#ifdef BLUERDMA_HAS_TPH
+	if (!dev->tph)
+		return -EOPNOTSUPP;
+	ret = pcie_tph_get_cpu_st(dev->pdev, TPH_MEM_TYPE_VM, steer.cpu, &tag);
+	if (ret)
+		return ret;
+	return pcie_tph_set_st_entry(dev->pdev, steer.vector, tag);
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+static long bluerdma_irq_ioctl(struct file *file, unsigned int cmd,
+			       unsigned long arg)
+{
+	struct bluerdma_dev *dev = irq_file_dev(file);
+
+	switch (cmd) {
+	case BLUERDMA_IOCTL_BIND_IRQ:
+		return bluerdma_irq_ioctl_bind(dev, file, (void __user *)arg);
+	case BLUERDMA_IOCTL_ARM_IRQ:
+		return bluerdma_irq_ioctl_arm(dev, file, (void __user *)arg);
+	case BLUERDMA_IOCTL_STEER_IRQ:
+		return bluerdma_irq_ioctl_steer(dev, file, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int bluerdma_irq_release(struct inode *inode, struct file *file)
+{
+	struct bluerdma_dev *dev = irq_file_dev(file);
+	int i;
+
+	/* The vectors of a process that is gone are free for the next one */
+	for (i = 0; i < dev->num_irq_vectors; i++) {
+		if (dev->irq_vectors[i].owner == file)
+			bluerdma_irq_set_trigger(&dev->irq_vectors[i], NULL,
+						 NULL);
+	}
+
+	return 0;
+}
+
+static const struct file_operations bluerdma_irq_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = bluerdma_irq_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.release = bluerdma_irq_release,
+};
+
+static void bluerdma_irq_free_vectors(struct bluerdma_dev *dev, int num)
+{
+	struct bluerdma_irq_vector *vec;
+
+	while (--num >= 0) {
+		vec = &dev->irq_vectors[num];
+		irq_set_affinity_and_hint(vec->irq, NULL);
+		free_irq(vec->irq, vec);
+		bluerdma_irq_set_trigger(vec, NULL, NULL);
+	}
+}
+
+static int bluerdma_irq_probe(struct pci_dev *pdev,
+			      const struct pci_device_id *ent)
+{
+	struct bluerdma_irq_vector *vec;
+	struct bluerdma_dev *dev;
+	int ret, nvec, i;
+
+	if (next_irq_dev >= num_irq_devs) {
+		pr_warn("no device left for %s\n", pci_name(pdev));
+		return -ENODEV;
+	}
+	dev = irq_devs[next_irq_dev];
+
+	ret = pci_enable_device(pdev);
+	if (ret) {
+		pr_err("pci_enable_device failed for %s\n", pci_name(pdev));
+		return ret;
+	}
+	pci_set_master(pdev);
+
+	nvec = pci_alloc_irq_vectors(pdev, 1, BLUERDMA_MAX_IRQ_VECTORS,
+				     PCI_IRQ_MSIX);
+	if (nvec < 0) {
+		pr_err("pci_alloc_irq_vectors failed for %s: %d\n",
+		       pci_name(pdev), nvec);
+		ret = nvec;
+		goto err_disable;
+	}
+
+	for (i = 0; i < nvec; i++) {
+		vec = &dev->irq_vectors[i];
+		vec->irq = pci_irq_vector(pdev, i);
+		vec->armed = 1;
+		spin_lock_init(&vec->lock);
+		ret = request_irq(vec->irq, bluerdma_irq_handler, 0, "bluerdma",
+				  vec);
+		if (ret) {
+			pr_err("request_irq failed for vector %d: %d\n", i, ret);
+			goto err_free;
+		}
+	}
+	dev->num_irq_vectors = nvec;
+#ifdef BLUERDMA_HAS_TPH
+	/* Drops to untagged writes if the card or the root port has no TPH */
+	dev->tph = !pcie_enable_tph(pdev, PCI_TPH_ST_IV_MODE);
+#endif
+
+	snprintf(dev->irq_misc_name, sizeof(dev->irq_misc_name),
+		 "bluerdma_irq%d", dev->id);
+	dev->irq_misc.minor = MISC_DYNAMIC_MINOR;
+	dev->irq_misc.name = dev->irq_misc_name;
+	dev->irq_misc.fops = &bluerdma_irq_fops;
+	ret = misc_register(&dev->irq_misc);
+	if (ret) {
+		pr_err("misc_register failed for %s: %d\n", dev->irq_misc_name,
+		       ret);
+		goto err_free;
+	}
+
+	dev->pdev = pdev;
+	pci_set_drvdata(pdev, dev);
+	next_irq_dev++;
+	pr_info("%s: %d meta report vectors on %s, tph %d\n",
+		dev->irq_misc_name, nvec, pci_name(pdev), dev->tph);
+
+	return 0;
+
+err_free:
+#ifdef BLUERDMA_HAS_TPH
+	if (dev->tph)
+		pcie_disable_tph(pdev);
+	dev->tph = false;
+#endif
+	bluerdma_irq_free_vectors(dev, i);
+	dev->num_irq_vectors = 0;
+	pci_free_irq_vectors(pdev);
+err_disable:
+	pci_disable_device(pdev);
+	return ret;
+}
+
+static void bluerdma_irq_remove(struct pci_dev *pdev)
+{
+	struct bluerdma_dev *dev = pci_get_drvdata(pdev);
+
+	misc_deregister(&dev->irq_misc);
+#ifdef BLUERDMA_HAS_TPH
+	if (dev->tph)
+		pcie_disable_tph(pdev);
+	dev->tph = false;
+#endif
+	bluerdma_irq_free_vectors(dev, dev->num_irq_vectors);
+	dev->num_irq_vectors = 0;
+	pci_free_irq_vectors(pdev);
+	pci_disable_device(pdev);
+	dev->pdev = NULL;
+}
+
+static const struct pci_device_id bluerdma_irq_pci_tbl[] = {
+	{ PCI_DEVICE(PCI_VENDOR_ID_BLUERDMA, PCI_DEVICE_ID_BLUERDMA) },
+	{}
+};
+MODULE_DEVICE_TABLE(pci, bluerdma_irq_pci_tbl);
+
+static struct pci_driver bluerdma_irq_pci_driver = {
+	.name = "bluerdma",
+	.id_table = bluerdma_irq_pci_tbl,
+	.probe = bluerdma_irq_probe,
+	.remove = bluerdma_irq_remove,
+};
+
+/* Takes the MSI-X vectors of the cards, the Nth card probed goes to devs[N] */
+int bluerdma_irq_register_driver(struct bluerdma_dev **devs, int num)
+{
+	irq_devs = devs;
+	num_irq_devs = num;
+	next_irq_dev = 0;
+
+	return pci_register_driver(&bluerdma_irq_pci_driver);
+}
+
+void bluerdma_irq_unregister_driver(void)
+{
+	pci_unregister_driver(&bluerdma_irq_pci_driver);
+}
@@ -0,0 +1,11 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-3-Clause
+
+#ifndef __BLUERDMA_IRQ_H__
+#define __BLUERDMA_IRQ_H__
+
+#include "bluerdma.h"
+
+int bluerdma_irq_register_driver(struct bluerdma_dev **devs, int num);
+void bluerdma_irq_unregister_driver(void);
+
+#endif // __BLUERDMA_IRQ_H__
@@ -7,6 +7,7 @@
 #include "bluerdma.h"
 #include "verbs.h"
 #include "ethernet.h"
+#include "irq.h"
 
 MODULE_AUTHOR("Hange Shen <Foreverhighness@gmail.com>");
 MODULE_DESCRIPTION("DatenLord RDMA adapter driver");
@@ -14,15 +15,31 @@ MODULE_LICENSE("Dual BSD/GPL");
 
 #pragma region ib device
 
-#define N_TESTING 2
-static struct bluerdma_dev *testing_dev[N_TESTING] = {};
+#define BLUERDMA_MAX_DEVS 8
+
+/* One IB device and netdev is registered per card, bluerdmaN and blueN */
+static uint num_devs = 2;
+module_param(num_devs, uint, 0444);
+MODULE_PARM_DESC(num_devs, "Number of devices to register, one per card (default 2, max 8)");
+
+static struct bluerdma_dev *testing_dev[BLUERDMA_MAX_DEVS] = {};
+
+/* Meta report interrupts of the cards, polled from user space when not set */
+static bool msix;
+module_param(msix, bool, 0444);
+MODULE_PARM_DESC(msix, "Take the MSI-X vectors of the cards for meta report interrupts (default off)");
 
 static int bluerdma_new_testing(void)
 {
 	struct bluerdma_dev *dev;
 	int i, ret;
 
-	for (i = 0; i < N_TESTING; i++) {
+	if (num_devs == 0 || num_devs > BLUERDMA_MAX_DEVS) {
+		pr_err("num_devs must be between 1 and %d\n", BLUERDMA_MAX_DEVS);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < num_devs; i++) {
 		dev = ib_alloc_device(bluerdma_dev, ibdev);
 		if (!dev) {
 			pr_err("ib_alloc_device failed for index %d\n", i);
@@ -59,7 +76,7 @@ static int bluerdma_new_testing(void)
 static void bluerdma_free_testing(void)
 {
 	int i;
-	for (i = 0; i < N_TESTING; i++) {
+	for (i = 0; i < num_devs; i++) {
 		if (testing_dev[i]) {
 			if (testing_dev[i]->netdev)
 				bluerdma_destroy_netdev(testing_dev[i]);
@@ -105,6 +122,8 @@ static const struct ib_device_ops bluerdma_device_ops = {
 	// uverbs required methods
 	.alloc_ucontext = bluerdma_alloc_ucontext,
 	.dealloc_ucontext = bluerdma_dealloc_ucontext,
+	.mmap = bluerdma_mmap,
+	.mmap_free = bluerdma_mmap_free,
 
 	.query_gid = bluerdma_query_gid,
 	.query_pkey = bluerdma_query_pkey,
@@ -132,7 +151,7 @@ static int bluerdma_ib_device_add(struct pci_dev *pdev)
 		return ret;
 	}
 
-	for (i = 0; i < N_TESTING; i++) {
+	for (i = 0; i < num_devs; i++) {
 		ibdev = &testing_dev[i]->ibdev;
 
 		strscpy(ibdev->node_desc, "bluerdma", sizeof(ibdev->node_desc));
@@ -192,7 +211,7 @@ static int bluerdma_ib_device_add(struct pci_dev *pdev)
 static void bluerdma_ib_device_remove(struct pci_dev *pdev)
 {
 	// struct bluerdma_dev *dev = pci_get_drvdata(pdev);
-	for (int i = 0; i < N_TESTING; i++) {
+	for (int i = 0; i < num_devs; i++) {
 		if (testing_dev[i]) {
 			device_remove_file(&testing_dev[i]->ibdev.dev,
 					   &testing_dev[i]->gids_attr);
@@ -264,6 +283,11 @@ static int __init bluerdma_init_module(void)
 	ret = request_module("ib_uverbs");
 	// ret = pci_register_driver(&bluerdma_pci_driver);
 	ret = bluerdma_probe(NULL, NULL);
+	if (!ret && msix) {
+		ret = bluerdma_irq_register_driver(testing_dev, num_devs);
+		if (ret)
+			pr_err("bluerdma_irq_register_driver failed %d\n", ret);
+	}
 
 	return 0;
 }
@@ -272,6 +296,8 @@ static void __exit bluerdma_exit_module(void)
 {
 	pr_info("DatenLord RDMA driver unloaded\n");
 
+	if (msix)
+		bluerdma_irq_unregister_driver();
 	bluerdma_remove(NULL);
 	// pci_unregister_driver(&bluerdma_pci_driver);
 }
@@ -1,7 +1,11 @@
 // SPDX-License-Identifier: GPL-2.0 OR BSD-3-Clause
 #include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/dma-mapping.h>
 
 #include <rdma/ib_mad.h>
+#include <rdma/ib_umem.h>
 
 #include "bluerdma.h"
 #include "verbs.h"
@@ -69,10 +73,23 @@ int bluerdma_dealloc_pd(struct ib_pd *pd, struct ib_udata *udata)
 	return 0;
 }
 
+/*
+ * The rings of the card are driven by the provider in user space, which owns
+ * the queues, the retransmission and the completions. A QP of a kernel ULP
+ * would never be serviced, so it is refused at creation instead of accepting
+ * work requests that never complete. Only the GSI QP of the MAD layer is
+ * created for the kernel, its sends are dropped.
+ */
 int bluerdma_create_qp(struct ib_qp *qp, struct ib_qp_init_attr *init_attr,
 		       struct ib_udata *udata)
 {
 	pr_info("bluerdma_create_qp\n");
+
+	if (!udata && init_attr->qp_type != IB_QPT_GSI) {
+		pr_warn_once("bluerdma: kernel QPs are not supported\n");
+		return -EOPNOTSUPP;
+	}
+
 	return 0;
 }
 int bluerdma_destroy_qp(struct ib_qp *qp, struct ib_udata *udata)
@@ -132,7 +149,7 @@ int bluerdma_req_notify_cq(struct ib_cq *ibcq, enum ib_cq_notify_flags flags)
 
 struct ib_mr *bluerdma_get_dma_mr(struct ib_pd *ibpd, int access)
 {
-	struct ib_mr *mr;
+	struct bluerdma_mr *mr;
 
 	pr_info("bluerdma_get_dma_mr\n");
 
@@ -140,29 +157,185 @@ struct ib_mr *bluerdma_get_dma_mr(struct ib_pd *ibpd, int access)
 	if (!mr)
 		return ERR_PTR(-ENOMEM);
 
-	return mr;
+	return &mr->ibmr;
+}
+
+#pragma region user mr
+
+/* Entries of the page list copied to user space at a time */
+#define BLUERDMA_PAGE_LIST_CHUNK (PAGE_SIZE / sizeof(u64))
+
+static struct sg_table *bluerdma_umem_sgt(struct ib_umem *umem)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0)
+	return &umem->sg_head;
+#else
+	return &umem->sgt_append.sgt;
+#endif
+}
+
+/*
+ * The IB device is registered without a DMA device, so ib_umem_get only pins
+ * the pages. They are mapped for the probed card here, or handed to the card
+ * by physical address if it is not probed by the module.
+ */
+static int bluerdma_mr_map_dma(struct bluerdma_dev *dev,
+			       struct bluerdma_mr *mr)
+{
+	struct sg_table *sgt = bluerdma_umem_sgt(mr->umem);
+	struct scatterlist *sg;
+	int i, ret;
+
+	if (dev->pdev) {
+		ret = dma_map_sgtable(&dev->pdev->dev, sgt, DMA_BIDIRECTIONAL,
+				      0);
+		if (ret)
+			return ret;
+		mr->dma_dev = get_device(&dev->pdev->dev);
+		return 0;
+	}
+
+	for_each_sgtable_sg(sgt, sg, i) {
+		sg_dma_address(sg) = sg_phys(sg);
+		sg_dma_len(sg) = sg->length;
+	}
+	sgt->nents = sgt->orig_nents;
+
+	return 0;
+}
+
+static void bluerdma_mr_unmap_dma(struct bluerdma_mr *mr)
+{
+	if (!mr->dma_dev)
+		return;
+	dma_unmap_sgtable(mr->dma_dev, bluerdma_umem_sgt(mr->umem),
+			  DMA_BIDIRECTIONAL, 0);
+	put_device(mr->dma_dev);
+	mr->dma_dev = NULL;
+}
+
+/* Writes the DMA address of each page of pgsz bytes of the MR to list */
+static int bluerdma_mr_copy_pages(struct bluerdma_mr *mr, unsigned long pgsz,
+				  u64 __user *list)
+{
+	struct ib_block_iter biter;
+	size_t n = 0;
+	int ret = 0;
+	u64 *buf;
+
+	buf = (u64 *)__get_free_page(GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	rdma_umem_for_each_dma_block(mr->umem, &biter, pgsz) {
+		buf[n++] = rdma_block_iter_dma_address(&biter);
+		if (n < BLUERDMA_PAGE_LIST_CHUNK)
+			continue;
+		if (copy_to_user(list, buf, n * sizeof(*buf))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		list += n;
+		n = 0;
+	}
+	if (n && copy_to_user(list, buf, n * sizeof(*buf)))
+		ret = -EFAULT;
+
+out:
+	free_page((unsigned long)buf);
+	return ret;
 }
+
+/*
+ * The MRs of the device are set up by the provider, which only asks the
+ * module to pin the pages. ib_umem_get takes a FOLL_LONGTERM pin, so the pages
+ * stay in place under compaction and migration until the MR is deregistered,
+ * and the DMA addresses are returned in the page list of the provider.
+ */
 struct ib_mr *bluerdma_reg_user_mr(struct ib_pd *pd, u64 start, u64 length,
 				   u64 virt_addr, int access_flags,
 				   struct ib_udata *udata)
 {
-	struct ib_mr *mr;
-	pr_info("bluerdma_reg_user_mr\n");
+	struct bluerdma_dev *dev = to_bdev(pd->device);
+	struct bluerdma_reg_mr_resp resp = {};
+	struct bluerdma_reg_mr_cmd cmd;
+	struct bluerdma_mr *mr;
+	unsigned long pgsz;
+	size_t num_pages;
+	int ret;
+
+	pr_debug("bluerdma_reg_user_mr: start 0x%llx, length 0x%llx\n", start,
+		 length);
+
+	if (!udata || udata->inlen < sizeof(cmd))
+		return ERR_PTR(-EINVAL);
+	if (ib_copy_from_udata(&cmd, udata, sizeof(cmd)))
+		return ERR_PTR(-EFAULT);
+	if (cmd.page_shift < PAGE_SHIFT || cmd.page_shift >= BITS_PER_LONG)
+		return ERR_PTR(-EINVAL);
 
 	mr = kzalloc(sizeof(*mr), GFP_KERNEL);
 	if (!mr)
 		return ERR_PTR(-ENOMEM);
 
-	return mr;
+	mr->umem = ib_umem_get(pd->device, start, length, access_flags);
+	if (IS_ERR(mr->umem)) {
+		ret = PTR_ERR(mr->umem);
+		goto err_free_mr;
+	}
+
+	ret = bluerdma_mr_map_dma(dev, mr);
+	if (ret)
+		goto err_release;
+
+	/* Fails if the pages are not contiguous in blocks of the page size */
+	pgsz = ib_umem_find_best_pgsz(mr->umem, BIT_ULL(cmd.page_shift),
+				      virt_addr);
+	if (!pgsz) {
+		ret = -EINVAL;
+		goto err_unmap;
+	}
+	num_pages = ib_umem_num_dma_blocks(mr->umem, pgsz);
+	if (num_pages > cmd.page_list_len) {
+		ret = -ENOSPC;
+		goto err_unmap;
+	}
+	ret = bluerdma_mr_copy_pages(mr, pgsz, u64_to_user_ptr(cmd.page_list));
+	if (ret)
+		goto err_unmap;
+
+	resp.num_pages = num_pages;
+	ret = ib_copy_to_udata(udata, &resp, min(sizeof(resp), udata->outlen));
+	if (ret)
+		goto err_unmap;
+
+	return &mr->ibmr;
+
+err_unmap:
+	bluerdma_mr_unmap_dma(mr);
+err_release:
+	ib_umem_release(mr->umem);
+err_free_mr:
+	kfree(mr);
+	return ERR_PTR(ret);
 }
-int bluerdma_dereg_mr(struct ib_mr *mr, struct ib_udata *udata)
+
+int bluerdma_dereg_mr(struct ib_mr *ibmr, struct ib_udata *udata)
 {
-	pr_info("bluerdma_dereg_mr\n");
+	struct bluerdma_mr *mr = to_bmr(ibmr);
+
+	pr_debug("bluerdma_dereg_mr\n");
 
+	if (mr->umem) {
+		bluerdma_mr_unmap_dma(mr);
+		ib_umem_release(mr->umem);
+	}
 	kfree(mr);
 	return 0;
 }
 
+#pragma endregion user mr
+
 int bluerdma_get_port_immutable(struct ib_device *ibdev, u32 port_num,
 				struct ib_port_immutable *immutable)
 {
@@ -192,15 +365,95 @@ err_out:
 	return err;
 }
 
+/*
+ * Each user context owns a queue area the provider maps through the ucontext,
+ * so that processes do not share the queues of one privileged mapping of the
+ * BAR. The area is freed by bluerdma_mmap_free once it is removed and no
+ * longer mapped.
+ */
 int bluerdma_alloc_ucontext(struct ib_ucontext *ibuc, struct ib_udata *udata)
 {
+	struct bluerdma_ucontext *uctx = to_buctx(ibuc);
+	struct bluerdma_alloc_ucontext_resp resp = {};
+	struct bluerdma_user_mmap_entry *entry;
+	int ret;
+
 	pr_info("bluerdma_alloc_ucontext\n");
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
+
+	entry->size = BLUERDMA_UCTX_QUEUE_PAGES * PAGE_SIZE;
+	entry->cpu_addr = vmalloc_user(entry->size);
+	if (!entry->cpu_addr) {
+		ret = -ENOMEM;
+		goto err_free_entry;
+	}
+
+	ret = rdma_user_mmap_entry_insert(ibuc, &entry->rdma_entry,
+					  entry->size);
+	if (ret)
+		goto err_free_queue;
+	uctx->queue_entry = &entry->rdma_entry;
+
+	resp.queue_mmap_offset = rdma_user_mmap_get_offset(&entry->rdma_entry);
+	resp.queue_size = entry->size;
+	if (udata && udata->outlen) {
+		ret = ib_copy_to_udata(udata, &resp,
+				       min(sizeof(resp), udata->outlen));
+		if (ret) {
+			/* The entry is freed by bluerdma_mmap_free */
+			rdma_user_mmap_entry_remove(uctx->queue_entry);
+			uctx->queue_entry = NULL;
+			return ret;
+		}
+	}
+
 	return 0;
+
+err_free_queue:
+	vfree(entry->cpu_addr);
+err_free_entry:
+	kfree(entry);
+	return ret;
 }
 
 void bluerdma_dealloc_ucontext(struct ib_ucontext *ibuc)
 {
+	struct bluerdma_ucontext *uctx = to_buctx(ibuc);
+
 	pr_info("bluerdma_dealloc_ucontext\n");
+
+	rdma_user_mmap_entry_remove(uctx->queue_entry);
+	uctx->queue_entry = NULL;
+}
+
+int bluerdma_mmap(struct ib_ucontext *ibuc, struct vm_area_struct *vma)
+{
+	struct rdma_user_mmap_entry *rdma_entry;
+	struct bluerdma_user_mmap_entry *entry;
+	int ret;
+
+	rdma_entry = rdma_user_mmap_entry_get(ibuc, vma);
+	if (!rdma_entry) {
+		pr_err("bluerdma_mmap: invalid offset 0x%lx\n", vma->vm_pgoff);
+		return -EINVAL;
+	}
+	entry = to_bentry(rdma_entry);
+
+	ret = remap_vmalloc_range(vma, entry->cpu_addr, 0);
+	rdma_user_mmap_entry_put(rdma_entry);
+
+	return ret;
+}
+
+void bluerdma_mmap_free(struct rdma_user_mmap_entry *rdma_entry)
+{
+	struct bluerdma_user_mmap_entry *entry = to_bentry(rdma_entry);
+
+	vfree(entry->cpu_addr);
+	kfree(entry);
 }
 
 int bluerdma_query_pkey(struct ib_device *ibdev, u32 port_num, u16 index,
@@ -55,6 +55,8 @@ int bluerdma_get_port_immutable(struct ib_device *ibdev, u32 port_num,
 
 int bluerdma_alloc_ucontext(struct ib_ucontext *ibuc, struct ib_udata *udata);
 void bluerdma_dealloc_ucontext(struct ib_ucontext *ibuc);
+int bluerdma_mmap(struct ib_ucontext *ibuc, struct vm_area_struct *vma);
+void bluerdma_mmap_free(struct rdma_user_mmap_entry *rdma_entry);
 
 int bluerdma_query_pkey(struct ib_device *ibdev, u32 port_num, u16 index,
 			u16 *pkey);
@@ -0,0 +1,61 @@
+//! ACKs through the `AckResponder` and frames through the simple NIC transmit queue.
+//!
+//! The cost of a frame splits into its build, measured with the frames dropped, the copy
+//! into its slot, measured with the doorbell rung once every 32 frames, and the doorbell,
+//! the difference with the doorbell rung for every frame. The loopback device takes the
+//! doorbell as a plain store, an MMIO write of the card costs more.
+
+use blue_rdma_driver::test_wrapper::bench::ack::{BenchAckResponder, BenchAckTx, BenchFrameTx};
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+
+const NUM_QPS: [usize; 3] = [1, 64, 1024];
+/// ACKs merged into one frame, 1 sends every ACK
+const MAX_ACKS: [u32; 3] = [1, 4, 16];
+const ACKS_PER_ITER: usize = 1024;
+const TXS: [(&str, BenchAckTx); 2] = [
+    ("build", BenchAckTx::Null),
+    ("loopback", BenchAckTx::Loopback),
+];
+/// Frames queued per doorbell
+const BATCHES: [usize; 3] = [1, 8, 32];
+
+/// The throughput is the ACKs fed to the responder, the frames sent are fewer once merged
+fn benchmark_ack_responder(c: &mut Criterion) {
+    for (tx_name, tx) in TXS {
+        let mut group = c.benchmark_group(format!("ack responder {tx_name}"));
+        let _ = group.throughput(Throughput::Elements(ACKS_PER_ITER as u64));
+        for num_qps in NUM_QPS {
+            for max_acks in MAX_ACKS {
+                let mut responder = BenchAckResponder::new(tx, num_qps, max_acks)
+                    .expect("failed to create ack responder");
+                let id = BenchmarkId::new(format!("{num_qps} qps"), format!("merge {max_acks}"));
+                let _ = group.bench_function(id, |b| b.iter(|| responder.acks(ACKS_PER_ITER)));
+            }
+            let mut responder =
+                BenchAckResponder::new(tx, num_qps, 1).expect("failed to create ack responder");
+            let id = BenchmarkId::new(format!("{num_qps} qps"), "nak");
+            let _ = group.bench_function(id, |b| b.iter(|| responder.naks(ACKS_PER_ITER)));
+        }
+        group.finish();
+    }
+}
+
+/// The throughput is the frames rung, the time per element is the time per frame
+fn benchmark_frame_tx(c: &mut Criterion) {
+    let mut tx = BenchFrameTx::new().expect("failed to create frame tx queue");
+    let mut group = c.benchmark_group("simple nic tx");
+    let _ = group.throughput(Throughput::Elements(ACKS_PER_ITER as u64));
+    for batch in BATCHES {
+        let id = BenchmarkId::new("frames per doorbell", batch);
+        let _ = group.bench_function(id, |b| {
+            b.iter(|| {
+                tx.send(ACKS_PER_ITER, batch)
+                    .expect("failed to send frames")
+            });
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, benchmark_ack_responder, benchmark_frame_tx);
+criterion_main!(benches);
@@ -0,0 +1,17 @@
+use blue_rdma_driver::test_wrapper::bench::{BenchMpscHop, BenchSpscHop};
+use criterion::{black_box, criterion_group, criterion_main, Criterion};
+
+/// Round trip of a task through a pair of channels to an echo thread, two channel hops
+fn benchmark_channel_hop(c: &mut Criterion) {
+    let mpsc = BenchMpscHop::new();
+    c.bench_function("channel hop mpsc round trip", |b| {
+        b.iter(|| mpsc.round_trip(black_box(1)))
+    });
+    let mut spsc = BenchSpscHop::new();
+    c.bench_function("channel hop spsc round trip", |b| {
+        b.iter(|| spsc.round_trip(black_box(1)))
+    });
+}
+
+criterion_group!(benches, benchmark_channel_hop);
+criterion_main!(benches);
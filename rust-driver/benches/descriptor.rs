@@ -1,5 +1,12 @@
-use blue_rdma_driver::test_wrapper::bench::descs::MetaReportQueueDescBthRethWrapper;
-use criterion::{black_box, criterion_group, criterion_main, Criterion};
+use blue_rdma_driver::test_wrapper::bench::{
+    descs::MetaReportQueueDescBthRethWrapper, meta::BenchMetaTrace,
+};
+use criterion::{black_box, criterion_group, criterion_main, Criterion, Throughput};
+
+/// QPs of the traces the reports are classified from
+const NUM_QPS: usize = 64;
+/// Messages of each trace, spread over its QPs
+const NUM_MSGS: usize = 1 << 12;
 
 #[allow(clippy::unit_arg)]
 fn benchmark_descriptor_load(c: &mut Criterion) {
@@ -13,5 +20,48 @@ fn benchmark_descriptor_set(c: &mut Criterion) {
     c.bench_function("desc set", |b| b.iter(|| black_box(desc.set_all())));
 }
 
-criterion_group!(benches, benchmark_descriptor_load, benchmark_descriptor_set);
+/// Reports decoded per second from the descriptors of the meta report queues, for the mixes
+/// of the receive side of a few workloads
+fn benchmark_meta_classify(c: &mut Criterion) {
+    let build = |f: &dyn Fn(&mut BenchMetaTrace, usize, usize)| {
+        let mut trace = BenchMetaTrace::new(NUM_QPS);
+        for i in 0..NUM_MSGS {
+            f(&mut trace, i % NUM_QPS, i);
+        }
+        trace
+    };
+    let traces = [
+        ("write", build(&|t, qp, _| t.write(qp, 1, false))),
+        ("write 16 packets", build(&|t, qp, _| t.write(qp, 16, true))),
+        ("ack bitmap", build(&|t, qp, _| t.write_acked(qp, 64, true))),
+        ("read request", build(&|t, qp, _| t.read_request(qp, 4096))),
+        (
+            "loss 1/4",
+            build(&|t, qp, _| t.write_lossy(qp, 8, false, 4)),
+        ),
+        (
+            "mixed",
+            build(&|t, qp, i| match i & 3 {
+                0 => t.write(qp, 1, true),
+                1 => t.write_acked(qp, 16, true),
+                2 => t.read_request(qp, 512),
+                _ => t.write_lossy(qp, 8, false, 4),
+            }),
+        ),
+    ];
+
+    let mut group = c.benchmark_group("meta classify");
+    for (name, trace) in &traces {
+        let _ = group.throughput(Throughput::Elements(trace.num_reports() as u64));
+        let _ = group.bench_function(*name, |b| b.iter(|| trace.decode_all()));
+    }
+    group.finish();
+}
+
+criterion_group!(
+    benches,
+    benchmark_descriptor_load,
+    benchmark_descriptor_set,
+    benchmark_meta_classify
+);
 criterion_main!(benches);
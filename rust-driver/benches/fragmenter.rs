@@ -0,0 +1,48 @@
+use blue_rdma_driver::test_wrapper::bench::BenchFragmenter;
+use criterion::{black_box, criterion_group, criterion_main, Criterion};
+
+/// Length of a large RDMA write
+const LENGTH: u32 = 8 << 20;
+/// Number of packets of the write with a 4096 bytes PMTU
+const NUM_PSN: u32 = LENGTH >> 12;
+
+fn benchmark_fragmenter(c: &mut Criterion) {
+    let cases = [
+        (0x1_0000, 0x1000, "64K chunks"),
+        (0x1000, 0x1000, "4K packets"),
+    ];
+    for (segment_size, align, name) in cases {
+        let length = u64::from(LENGTH);
+        assert_eq!(
+            BenchFragmenter::count_segments(segment_size, align, 0x10, length),
+            BenchFragmenter::plan_segments(segment_size, align, 0x10, length)
+        );
+        c.bench_function(&format!("fragmenter 8M {name} iterator count"), |b| {
+            b.iter(|| BenchFragmenter::count_segments(segment_size, align, black_box(0x10), length))
+        });
+        c.bench_function(&format!("fragmenter 8M {name} closed form plan"), |b| {
+            b.iter(|| BenchFragmenter::plan_segments(segment_size, align, black_box(0x10), length))
+        });
+    }
+
+    let fragmenter = BenchFragmenter::new(0x10_0000, 0x20_0000, LENGTH);
+    assert_eq!(
+        fragmenter.last_packet_walk(),
+        fragmenter.last_packet(NUM_PSN)
+    );
+    c.bench_function("fragmenter 8M last packet by walking", |b| {
+        b.iter(|| black_box(&fragmenter).last_packet_walk())
+    });
+    c.bench_function("fragmenter 8M last packet by skipping", |b| {
+        b.iter(|| black_box(&fragmenter).last_packet(NUM_PSN))
+    });
+    for chunk_size in [0x1_0000, 0x10_0000, LENGTH] {
+        c.bench_function(
+            &format!("fragmenter 8M write in {}K chunks", chunk_size >> 10),
+            |b| b.iter(|| black_box(&fragmenter).build_chunks(chunk_size)),
+        );
+    }
+}
+
+criterion_group!(benches, benchmark_fragmenter);
+criterion_main!(benches);
@@ -0,0 +1,217 @@
+//! Loopback RDMA writes on a card dropping packets on purpose, over a sweep of drop
+//! thresholds and message sizes.
+//!
+//! Each point reports the goodput, the bytes and the timeouts of the retransmissions, and the
+//! p99 latency from the doorbell to the completion, which is what the retransmit and timeout
+//! policies are tuned against. Needs a card and the `debug_csrs` feature:
+//!
+//! ```text
+//! cargo bench --features debug_csrs --bench loss_injection
+//! ```
+#![allow(unsafe_code, clippy::as_conversions)]
+
+use std::{
+    collections::HashMap,
+    env,
+    net::Ipv4Addr,
+    time::{Duration, Instant},
+};
+
+use blue_rdma_driver::native::{CompletionQueue, Device, Op, QueuePair, RegisteredBuf};
+use ibverbs_sys::{ibv_access_flags, ibv_qp_attr, ibv_qp_attr_mask, ibv_qp_state};
+
+/// Drop thresholds of the sweep, from no injected loss
+const DROP_THRESHOLDS: [u8; 6] = [0, 1, 2, 4, 8, 16];
+const MSG_SIZES: [usize; 4] = [64, 4096, 64 << 10, 1 << 20];
+/// Bytes written at each point, at least `MIN_MSGS` messages
+const BYTES_PER_POINT: usize = 256 << 20;
+const MIN_MSGS: usize = 4096;
+/// Writes in flight
+const DEPTH: usize = 64;
+/// Seed of the random drops of the card, the same at every point
+const SEED: u32 = 0x3131_3131;
+/// A point still missing completions after this long is reported as stalled
+const POINT_TIMEOUT: Duration = Duration::from_secs(60);
+/// Environment variable naming the device, `uverbs0` by default
+const DEV_ENV: &str = "BLUE_RDMA_BENCH_DEV";
+/// Environment variable holding the IP address of the device, which the card loops back
+const IP_ENV: &str = "BLUE_RDMA_BENCH_IP";
+
+/// Results of a point of the sweep
+struct Point {
+    goodput_gbps: f64,
+    retransmit_bytes: u64,
+    timeouts: u64,
+    p99: Duration,
+    stalled: bool,
+}
+
+/// Moves a QP of the loopback pair to RTS towards `dest_qpn` on the same card
+fn connect(qp: &QueuePair, dest_qpn: u32, ip: Ipv4Addr) {
+    // SAFETY: the attributes are plain data, all zeros is a valid value
+    let mut attr: ibv_qp_attr = unsafe { std::mem::zeroed() };
+    attr.qp_state = ibv_qp_state::IBV_QPS_INIT;
+    attr.port_num = 1;
+    attr.qp_access_flags = ibv_access_flags::IBV_ACCESS_LOCAL_WRITE.0
+        | ibv_access_flags::IBV_ACCESS_REMOTE_WRITE.0
+        | ibv_access_flags::IBV_ACCESS_REMOTE_READ.0;
+    qp.modify(
+        &attr,
+        ibv_qp_attr_mask::IBV_QP_STATE.0
+            | ibv_qp_attr_mask::IBV_QP_PKEY_INDEX.0
+            | ibv_qp_attr_mask::IBV_QP_PORT.0
+            | ibv_qp_attr_mask::IBV_QP_ACCESS_FLAGS.0,
+    )
+    .expect("failed to move qp to init");
+
+    attr.qp_state = ibv_qp_state::IBV_QPS_RTS;
+    attr.path_mtu = ibverbs_sys::IBV_MTU_4096;
+    attr.dest_qp_num = dest_qpn;
+    attr.ah_attr.port_num = 1;
+    attr.ah_attr.is_global = 1;
+    // ::ffff:a.b.c.d
+    let mut gid = [0; 16];
+    gid[10] = 0xff;
+    gid[11] = 0xff;
+    gid[12..].copy_from_slice(&ip.octets());
+    attr.ah_attr.grh.dgid.raw = gid;
+    qp.modify(
+        &attr,
+        ibv_qp_attr_mask::IBV_QP_STATE.0
+            | ibv_qp_attr_mask::IBV_QP_AV.0
+            | ibv_qp_attr_mask::IBV_QP_PATH_MTU.0
+            | ibv_qp_attr_mask::IBV_QP_DEST_QPN.0
+            | ibv_qp_attr_mask::IBV_QP_RQ_PSN.0
+            | ibv_qp_attr_mask::IBV_QP_SQ_PSN.0,
+    )
+    .expect("failed to move qp to rts");
+}
+
+/// Returns the counter `name` of the device
+fn counter(device: &Device, name: &str) -> u64 {
+    device
+        .counters()
+        .expect("failed to read counters")
+        .into_iter()
+        .find_map(|(n, value)| (n == name).then_some(value))
+        .unwrap_or(0)
+}
+
+/// Writes `BYTES_PER_POINT` from `src` to `dst` with `DEPTH` writes in flight. The `wr_id`s
+/// go on from `next_wr_id`, so the late completions of a stalled point are ignored.
+fn run_point(
+    next_wr_id: &mut u64,
+    device: &Device,
+    qp: &QueuePair,
+    cq: &CompletionQueue,
+    src: &RegisteredBuf<u8>,
+    dst: &RegisteredBuf<u8>,
+) -> Point {
+    let num_msgs = (BYTES_PER_POINT / src.len()).max(MIN_MSGS);
+    let retransmit_bytes = counter(device, "retransmit_bytes");
+    let timeouts = counter(device, "timeouts");
+    let mut ring = qp
+        .submission_ring(DEPTH)
+        .expect("failed to create submission ring");
+    let op = Op::write(src, dst.addr(), dst.key()).expect("failed to build write");
+    let mut rung: HashMap<u64, Instant> = HashMap::with_capacity(DEPTH);
+    let mut latencies = Vec::with_capacity(num_msgs);
+    let mut reaped = Vec::with_capacity(DEPTH);
+    let mut posted = 0;
+    let start = Instant::now();
+    let mut stalled = false;
+
+    while latencies.len() < num_msgs {
+        let mut pushed = Vec::new();
+        while posted < num_msgs && rung.len() + pushed.len() < DEPTH {
+            let wr_id = *next_wr_id;
+            if !ring.push(op, wr_id).expect("failed to push write") {
+                break;
+            }
+            pushed.push(wr_id);
+            *next_wr_id += 1;
+            posted += 1;
+        }
+        if !pushed.is_empty() {
+            let _num = ring.doorbell().expect("failed to ring doorbell");
+            let now = Instant::now();
+            rung.extend(pushed.into_iter().map(|wr_id| (wr_id, now)));
+        }
+        reaped.clear();
+        let _num = cq.reap(&mut reaped);
+        let now = Instant::now();
+        latencies.extend(
+            reaped
+                .iter()
+                .filter_map(|&(wr_id, _)| rung.remove(&wr_id))
+                .map(|t| now.duration_since(t)),
+        );
+        if start.elapsed() > POINT_TIMEOUT {
+            stalled = true;
+            break;
+        }
+    }
+    let elapsed = start.elapsed();
+    latencies.sort_unstable();
+    let p99 = latencies
+        .get(latencies.len().saturating_sub(1) * 99 / 100)
+        .copied()
+        .unwrap_or_default();
+    let bytes = latencies.len() * src.len();
+
+    Point {
+        goodput_gbps: bytes as f64 * 8.0 / elapsed.as_secs_f64() / 1e9,
+        retransmit_bytes: counter(device, "retransmit_bytes") - retransmit_bytes,
+        timeouts: counter(device, "timeouts") - timeouts,
+        p99,
+        stalled,
+    }
+}
+
+fn main() {
+    let dev = env::var(DEV_ENV).unwrap_or_else(|_| "uverbs0".into());
+    let ip: Ipv4Addr = env::var(IP_ENV)
+        .unwrap_or_else(|_| "17.34.51.10".into())
+        .parse()
+        .expect("invalid ip address");
+    let device = Device::open(&dev).expect("failed to open device");
+    let cq = device
+        .create_cq(4 * DEPTH as u32)
+        .expect("failed to create cq");
+    let qp0 = device.create_qp(&cq).expect("failed to create qp");
+    let qp1 = device.create_qp(&cq).expect("failed to create qp");
+    connect(&qp0, qp1.qpn(), ip);
+    connect(&qp1, qp0.qpn(), ip);
+    let max_size = MSG_SIZES.iter().copied().max().unwrap_or_default();
+    let dst = device
+        .register(vec![0u8; max_size].into_boxed_slice())
+        .expect("failed to register buffer");
+
+    let mut next_wr_id = 0;
+    println!(
+        "{:>6} {:>8} {:>10} {:>14} {:>9} {:>10}",
+        "thresh", "size", "gbps", "retx_bytes", "timeouts", "p99_us"
+    );
+    for size in MSG_SIZES {
+        let src = device
+            .register(vec![0xa5u8; size].into_boxed_slice())
+            .expect("failed to register buffer");
+        for thresh in DROP_THRESHOLDS {
+            device
+                .inject_loss(true, SEED, thresh)
+                .expect("failed to set drop threshold");
+            let point = run_point(&mut next_wr_id, &device, &qp0, &cq, &src, &dst);
+            println!(
+                "{thresh:>6} {size:>8} {:>10.3} {:>14} {:>9} {:>10.1}{}",
+                point.goodput_gbps,
+                point.retransmit_bytes,
+                point.timeouts,
+                point.p99.as_secs_f64() * 1e6,
+                if point.stalled { " stalled" } else { "" },
+            );
+        }
+    }
+    device
+        .inject_loss(true, SEED, 0)
+        .expect("failed to clear drop threshold");
+}
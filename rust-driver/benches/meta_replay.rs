@@ -0,0 +1,111 @@
+use std::{env, hint::black_box, time::Instant};
+
+use blue_rdma_driver::test_wrapper::bench::{
+    meta::{BenchMetaReplay, BenchMetaTrace},
+    wire::{BenchWire, BenchWireConfig},
+};
+use criterion::{criterion_group, criterion_main, Criterion, Throughput};
+
+const NUM_QPS: [usize; 3] = [1, 64, 1024];
+/// Messages of a synthetic trace, spread over its QPs
+const NUM_MSGS: usize = 1 << 14;
+/// Environment variable naming a trace recorded from the hardware
+const TRACE_ENV: &str = "BLUE_RDMA_META_TRACE";
+/// Environment variable naming a descriptor trace dumped by a driver built with the
+/// `desc_trace` feature
+const DESC_TRACE_ENV: &str = "BLUE_RDMA_DESC_TRACE";
+/// QPs of the traces of the simulated wire
+const WIRE_QPS: usize = 10_000;
+/// Writes of a trace of the simulated wire, of 1 to 4 packets
+const WIRE_MSGS: usize = 1 << 18;
+/// Loss and reordering probabilities of the simulated wire
+const WIRE_IMPAIRMENTS: [(f64, f64); 4] = [(0.0, 0.0), (1e-3, 0.0), (0.0, 1e-2), (1e-2, 1e-2)];
+
+/// Synthetic traces of the receive side, messages are interleaved over the QPs
+fn synthetic_traces(num_qps: usize) -> Vec<(&'static str, BenchMetaTrace)> {
+    let build = |f: &dyn Fn(&mut BenchMetaTrace, usize, usize)| {
+        let mut trace = BenchMetaTrace::new(num_qps);
+        for i in 0..NUM_MSGS {
+            f(&mut trace, i % num_qps, i);
+        }
+        trace
+    };
+    vec![
+        ("write imm", build(&|t, qp, _| t.write(qp, 1, true))),
+        ("write", build(&|t, qp, _| t.write(qp, 1, false))),
+        ("write 16 packets", build(&|t, qp, _| t.write(qp, 16, true))),
+        ("ack bitmap", build(&|t, qp, _| t.write_acked(qp, 64, true))),
+        ("read request", build(&|t, qp, _| t.read_request(qp, 4096))),
+        (
+            "loss 1/32",
+            build(&|t, qp, _| t.write_lossy(qp, 64, true, 32)),
+        ),
+        (
+            "mixed",
+            build(&|t, qp, i| match i & 3 {
+                0 => t.write(qp, 1, true),
+                1 => t.write_acked(qp, 16, true),
+                2 => t.read_request(qp, 512),
+                _ => t.write_lossy(qp, 8, false, 4),
+            }),
+        ),
+    ]
+}
+
+/// Trace of `WIRE_MSGS` writes over `WIRE_QPS` QPs received from a simulated 100 Gbit/s link
+fn wire_trace(loss: f64, reorder: f64) -> BenchMetaTrace {
+    let config = BenchWireConfig {
+        loss,
+        reorder,
+        ..BenchWireConfig::default()
+    };
+    let mut wire = BenchWire::new(WIRE_QPS, config);
+    for i in 0..WIRE_MSGS {
+        wire.write(i % WIRE_QPS, 1 + (i as u32 & 3), true);
+    }
+    wire.finish().0
+}
+
+/// Reports per second turned into completions, each iteration replays the whole trace
+fn bench_trace(c: &mut Criterion, group: &str, name: &str, trace: &BenchMetaTrace) {
+    let mut replay = BenchMetaReplay::new(trace).expect("failed to create replay pipeline");
+    let mut group = c.benchmark_group(group);
+    let _ = group.throughput(Throughput::Elements(trace.num_reports() as u64));
+    let _ = group.bench_function(name, |b| {
+        b.iter_custom(|iters| {
+            (0..iters)
+                .map(|_| {
+                    replay.prepare();
+                    let start = Instant::now();
+                    let _ = black_box(replay.replay());
+                    start.elapsed()
+                })
+                .sum()
+        });
+    });
+    group.finish();
+}
+
+fn benchmark_meta_replay(c: &mut Criterion) {
+    for num_qps in NUM_QPS {
+        for (name, trace) in synthetic_traces(num_qps) {
+            bench_trace(c, &format!("meta replay {num_qps} qps"), name, &trace);
+        }
+    }
+    let group = format!("meta replay wire {WIRE_QPS} qps");
+    for (loss, reorder) in WIRE_IMPAIRMENTS {
+        let trace = wire_trace(loss, reorder);
+        bench_trace(c, &group, &format!("loss {loss} reorder {reorder}"), &trace);
+    }
+    if let Ok(path) = env::var(TRACE_ENV) {
+        let trace = BenchMetaTrace::load(&path).expect("failed to load trace");
+        bench_trace(c, "meta replay recorded", &path, &trace);
+    }
+    if let Ok(path) = env::var(DESC_TRACE_ENV) {
+        let trace = BenchMetaTrace::load_recording(&path).expect("failed to load desc trace");
+        bench_trace(c, "meta replay recorded", &path, &trace);
+    }
+}
+
+criterion_group!(benches, benchmark_meta_replay);
+criterion_main!(benches);
@@ -0,0 +1,55 @@
+use blue_rdma_driver::test_wrapper::bench::BenchPgtAlloc;
+use criterion::{criterion_group, criterion_main, BatchSize, Criterion};
+use rand::{rngs::StdRng, Rng, SeedableRng};
+
+/// Maximum number of live allocations of the churn workload
+const MAX_LIVE: usize = 512;
+/// Number of alloc or dealloc operations per iteration
+const NUM_OPS: usize = 10_000;
+
+/// Mixed MR sizes in PGT entries: small buffers, 1 GiB of 2M pages, 1 GiB of 4K pages / 16
+fn mixed_size(rng: &mut StdRng) -> usize {
+    match rng.gen_range(0..10) {
+        0..=6 => rng.gen_range(1..=16),
+        7 | 8 => rng.gen_range(256..=512),
+        _ => rng.gen_range(4096..=16384),
+    }
+}
+
+fn churn(alloc: &mut BenchPgtAlloc, rng: &mut StdRng) {
+    let mut live: Vec<(usize, usize)> = Vec::with_capacity(MAX_LIVE);
+    for _ in 0..NUM_OPS {
+        if live.len() < MAX_LIVE && rng.gen_bool(0.55) {
+            let len = mixed_size(rng);
+            if let Some(index) = alloc.alloc(len) {
+                live.push((index, len));
+                continue;
+            }
+        }
+        if !live.is_empty() {
+            let (index, len) = live.swap_remove(rng.gen_range(0..live.len()));
+            assert!(alloc.dealloc(index, len));
+        }
+    }
+}
+
+fn benchmark_pgt_alloc_churn(c: &mut Criterion) {
+    let mut rng = StdRng::seed_from_u64(0);
+    let mut alloc = BenchPgtAlloc::new();
+    churn(&mut alloc, &mut rng);
+    eprintln!(
+        "pgt fragmentation after {NUM_OPS} mixed-size ops: {:.3}",
+        alloc.fragmentation()
+    );
+
+    c.bench_function("pgt_alloc mixed-size churn", |b| {
+        b.iter_batched(
+            || (BenchPgtAlloc::new(), StdRng::seed_from_u64(0)),
+            |(mut alloc, mut rng)| churn(&mut alloc, &mut rng),
+            BatchSize::SmallInput,
+        )
+    });
+}
+
+criterion_group!(benches, benchmark_pgt_alloc_churn);
+criterion_main!(benches);
@@ -0,0 +1,67 @@
+//! Aggregate post and poll rate of application threads each driving its own QP and CQ through
+//! the `RdmaCtxOps` entry points of one device.
+//!
+//! The threads share nothing but the device, so a rate that doesn't grow with the number of
+//! threads comes from the driver: the device lock taken by the verbs, the locks of the QP
+//! tables and the channels shared by the QPs. Runs on the mock device:
+//!
+//! ```text
+//! cargo bench --no-default-features --features mock,page_size_2m --bench post_poll_contention
+//! ```
+
+use std::{net::Ipv4Addr, thread, time::Instant};
+
+use blue_rdma_driver::test_wrapper::bench::verbs::{BenchVerbsDevice, BenchVerbsLoopback};
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+
+const NUM_THREADS: [usize; 5] = [1, 2, 4, 8, 16];
+/// Bytes of each write
+const MSG_LEN: u32 = 64;
+/// Writes in flight on each QP
+const DEPTH: u64 = 32;
+
+/// Completes `num` writes on `lp`, keeping `DEPTH` of them in flight
+fn drive(lp: &mut BenchVerbsLoopback, num: u64) {
+    let mut posted = 0;
+    let mut completed = 0;
+    while completed < num {
+        while posted < num && posted - completed < DEPTH {
+            assert!(lp.post_write(posted), "failed to post write");
+            posted += 1;
+        }
+        completed += lp.poll() as u64;
+    }
+}
+
+/// Completed writes per second of all threads, each iteration completes a write on every QP
+fn benchmark_post_poll_contention(c: &mut Criterion) {
+    let device = BenchVerbsDevice::open("uverbs0").expect("failed to open device");
+    let max_threads = NUM_THREADS.iter().copied().max().unwrap_or(1);
+    let mut loopbacks: Vec<_> = (0..max_threads)
+        .map(|_| {
+            device
+                .loopback(Ipv4Addr::LOCALHOST, MSG_LEN)
+                .expect("failed to create loopback")
+        })
+        .collect();
+
+    let mut group = c.benchmark_group("post poll contention");
+    for num_threads in NUM_THREADS {
+        let _ = group.throughput(Throughput::Elements(num_threads as u64));
+        let _ = group.bench_function(BenchmarkId::from_parameter(num_threads), |b| {
+            b.iter_custom(|iters| {
+                let start = Instant::now();
+                thread::scope(|s| {
+                    for lp in &mut loopbacks[..num_threads] {
+                        let _handle = s.spawn(move || drive(lp, iters));
+                    }
+                });
+                start.elapsed()
+            });
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, benchmark_post_poll_contention);
+criterion_main!(benches);
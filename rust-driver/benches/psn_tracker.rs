@@ -0,0 +1,70 @@
+use blue_rdma_driver::test_wrapper::bench::BenchPsnTracker;
+use criterion::{black_box, criterion_group, criterion_main, BatchSize, Criterion};
+
+/// Size of the 24 bits PSN space
+const PSN_SPACE: u32 = 1 << 24;
+/// Number of 128 PSN bitmaps acknowledged per iteration
+const NUM_BITMAPS: u32 = 1024;
+/// First PSN of each iteration, the acknowledged PSNs wrap around halfway
+const START_PSN: u32 = PSN_SPACE - NUM_BITMAPS * 64;
+
+fn psn(offset: u32) -> u32 {
+    START_PSN.wrapping_add(offset) % PSN_SPACE
+}
+
+/// Every bitmap is complete and arrives in order, the base PSN advances by 128 each time
+fn in_order(tracker: &mut BenchPsnTracker) {
+    for i in 0..NUM_BITMAPS {
+        let _ = black_box(tracker.ack_bitmap(psn(i * 128), u128::MAX));
+    }
+}
+
+/// The odd bitmaps arrive first and are held back by the missing even ones, then each even
+/// bitmap releases two windows
+fn out_of_order(tracker: &mut BenchPsnTracker) {
+    for i in (1..NUM_BITMAPS).step_by(2) {
+        let _ = black_box(tracker.ack_bitmap(psn(i * 128), u128::MAX));
+    }
+    for i in (0..NUM_BITMAPS).step_by(2) {
+        let _ = black_box(tracker.ack_bitmap(psn(i * 128), u128::MAX));
+    }
+}
+
+/// Bitmaps overlapping the previous one by half, with every other PSN of the tail missing
+fn sliding(tracker: &mut BenchPsnTracker) {
+    let holes = !0u128 >> 64 | 0x5555_5555_5555_5555_5555_5555_5555_5555;
+    for i in 0..NUM_BITMAPS * 2 {
+        let _ = black_box(tracker.ack_bitmap(psn(i * 64), holes));
+    }
+}
+
+/// Single PSN acks of every PSN, as for the received packets of a send
+fn single(tracker: &mut BenchPsnTracker) {
+    for i in 0..NUM_BITMAPS * 128 {
+        let _ = black_box(tracker.ack_one(psn(i)));
+    }
+}
+
+fn benchmark_psn_tracker(c: &mut Criterion) {
+    let cases: [(&str, fn(&mut BenchPsnTracker)); 4] = [
+        ("psn_tracker in-order bitmaps wrap-around", in_order),
+        ("psn_tracker out-of-order bitmaps wrap-around", out_of_order),
+        ("psn_tracker sliding bitmaps wrap-around", sliding),
+        ("psn_tracker single acks wrap-around", single),
+    ];
+    for (name, case) in cases {
+        let mut tracker = BenchPsnTracker::new(START_PSN);
+        case(&mut tracker);
+        assert_ne!(tracker.base_psn(), START_PSN, "{name} did not advance");
+        c.bench_function(name, |b| {
+            b.iter_batched(
+                || BenchPsnTracker::new(START_PSN),
+                |mut tracker| case(&mut tracker),
+                BatchSize::SmallInput,
+            )
+        });
+    }
+}
+
+criterion_group!(benches, benchmark_psn_tracker);
+criterion_main!(benches);
@@ -0,0 +1,122 @@
+//! Time of `reg_mr` and `dereg_mr` through the `RdmaCtxOps` entry points, from 4 KiB to 64 GiB.
+//!
+//! A registration pins the pages of the region, resolves their physical addresses, allocates
+//! its MTT and PGT entries and writes them to the device through the command queue. The
+//! backend and the page size are those of the build:
+//!
+//! ```text
+//! cargo bench --no-default-features --features mock,page_size_4k --bench reg_mr
+//! cargo bench --no-default-features --features mock,page_size_2m --bench reg_mr
+//! cargo bench --no-default-features --features hw,page_size_4k --bench reg_mr
+//! cargo bench --no-default-features --features hw,page_size_2m --bench reg_mr
+//! ```
+//!
+//! The regions are mapped without reserving memory but registering one commits it, sizes
+//! above `BLUE_RDMA_REG_MR_MAX` bytes (1 GiB by default) are skipped. The MR cache of the
+//! configuration applies, disable it to time cold registrations only.
+
+use std::{
+    env,
+    ffi::c_void,
+    ptr,
+    time::{Duration, Instant},
+};
+
+use blue_rdma_driver::test_wrapper::bench::verbs::BenchVerbsDevice;
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+
+/// Region sizes, from 4 KiB to 64 GiB
+const SIZES: [usize; 7] = [
+    4 << 10,
+    64 << 10,
+    1 << 20,
+    16 << 20,
+    256 << 20,
+    4 << 30,
+    64 << 30,
+];
+/// Environment variable holding the largest region size to register
+const MAX_SIZE_ENV: &str = "BLUE_RDMA_REG_MR_MAX";
+const DEFAULT_MAX_SIZE: usize = 1 << 30;
+
+/// An anonymous mapping the MRs are registered on, backed by huge pages in `page_size_2m`
+/// builds if the system has enough of them
+struct Region {
+    addr: *mut c_void,
+    len: usize,
+}
+
+impl Region {
+    fn map(len: usize) -> Option<Self> {
+        let flags = libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_NORESERVE;
+        let huge = if cfg!(feature = "page_size_2m") {
+            libc::MAP_HUGETLB | libc::MAP_HUGE_2MB
+        } else {
+            0
+        };
+        let prot = libc::PROT_READ | libc::PROT_WRITE;
+        let mmap = |flags| {
+            // SAFETY: anonymous mapping without a fixed address
+            let addr = unsafe { libc::mmap(ptr::null_mut(), len, prot, flags, -1, 0) };
+            (addr != libc::MAP_FAILED).then_some(Self { addr, len })
+        };
+        mmap(flags | huge).or_else(|| mmap(flags))
+    }
+}
+
+impl Drop for Region {
+    fn drop(&mut self) {
+        // SAFETY: the mapping was created by `map`
+        let _ignore = unsafe { libc::munmap(self.addr, self.len) };
+    }
+}
+
+fn benchmark_reg_mr(c: &mut Criterion) {
+    let device = BenchVerbsDevice::open("uverbs0").expect("failed to open device");
+    let max_size = env::var(MAX_SIZE_ENV)
+        .ok()
+        .and_then(|x| x.parse().ok())
+        .unwrap_or(DEFAULT_MAX_SIZE);
+
+    let mut group = c.benchmark_group("reg_mr");
+    let _ = group.sample_size(10);
+    for size in SIZES.into_iter().filter(|&x| x <= max_size) {
+        let Some(region) = Region::map(size) else {
+            eprintln!("skipping {size} bytes: failed to map the region");
+            continue;
+        };
+        let _ = group.throughput(Throughput::Bytes(size as u64));
+        let _ = group.bench_function(BenchmarkId::new("reg", size), |b| {
+            b.iter_custom(|iters| {
+                let mut elapsed = Duration::ZERO;
+                for _ in 0..iters {
+                    let start = Instant::now();
+                    let mr = device
+                        .reg_mr(region.addr, size)
+                        .expect("failed to register");
+                    elapsed += start.elapsed();
+                    assert!(mr.dereg(), "failed to deregister");
+                }
+                elapsed
+            });
+        });
+        let _ = group.bench_function(BenchmarkId::new("dereg", size), |b| {
+            b.iter_custom(|iters| {
+                let mut elapsed = Duration::ZERO;
+                for _ in 0..iters {
+                    let mr = device
+                        .reg_mr(region.addr, size)
+                        .expect("failed to register");
+                    let start = Instant::now();
+                    assert!(mr.dereg(), "failed to deregister");
+                    elapsed += start.elapsed();
+                }
+                elapsed
+            });
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, benchmark_reg_mr);
+criterion_main!(benches);
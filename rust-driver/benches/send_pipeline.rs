@@ -0,0 +1,61 @@
+use blue_rdma_driver::test_wrapper::bench::send::{BenchMode, BenchSendPipeline};
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+
+const MODES: [(&str, BenchMode); 3] = [
+    ("100G", BenchMode::Mode100G),
+    ("200G", BenchMode::Mode200G),
+    ("400G", BenchMode::Mode400G),
+];
+const NUM_QPS: [usize; 4] = [1, 4, 64, 1024];
+/// Message sizes from 8B to 8MB
+const MSG_SIZES: [u32; 6] = [8, 512, 4096, 1 << 16, 1 << 20, 8 << 20];
+/// Posting paths, through the `SendWorker`s or straight to the send queues
+const PATHS: [(&str, bool); 2] = [("worker", false), ("direct", true)];
+
+/// One WR per QP of each iteration, the throughput is the posted message bytes
+fn benchmark_send_throughput(c: &mut Criterion) {
+    for (mode_name, mode) in MODES {
+        for (path, direct) in PATHS {
+            let mut pipeline = BenchSendPipeline::new(mode, NUM_QPS[3], direct)
+                .expect("failed to create send pipeline");
+            let mut group = c.benchmark_group(format!("send throughput {mode_name} {path}"));
+            for num_qps in NUM_QPS {
+                for len in MSG_SIZES {
+                    let _ = group.throughput(Throughput::Bytes(u64::from(len) * num_qps as u64));
+                    let id = BenchmarkId::new(format!("{num_qps} qps"), len);
+                    let _ = group.bench_function(id, |b| {
+                        b.iter(|| pipeline.write_many(num_qps, len));
+                    });
+                }
+            }
+            group.finish();
+        }
+    }
+}
+
+/// A single WR of each iteration, rotating over the QPs, from posting to the doorbell
+fn benchmark_send_latency(c: &mut Criterion) {
+    for (mode_name, mode) in MODES {
+        for (path, direct) in PATHS {
+            let mut pipeline = BenchSendPipeline::new(mode, NUM_QPS[3], direct)
+                .expect("failed to create send pipeline");
+            let mut group = c.benchmark_group(format!("send latency {mode_name} {path}"));
+            for num_qps in NUM_QPS {
+                for len in MSG_SIZES {
+                    let id = BenchmarkId::new(format!("{num_qps} qps"), len);
+                    let mut qp = 0;
+                    let _ = group.bench_function(id, |b| {
+                        b.iter(|| {
+                            pipeline.write(qp, len);
+                            qp = (qp + 1) % num_qps;
+                        });
+                    });
+                }
+            }
+            group.finish();
+        }
+    }
+}
+
+criterion_group!(benches, benchmark_send_throughput, benchmark_send_latency);
+criterion_main!(benches);
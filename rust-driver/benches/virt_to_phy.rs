@@ -1,7 +1,45 @@
 use blue_rdma_driver::test_wrapper::bench::{
-    virt_to_phy_bench_range_wrapper, virt_to_phy_bench_wrapper,
+    virt_to_phy_bench_pages_wrapper, virt_to_phy_bench_range_wrapper, virt_to_phy_bench_wrapper,
 };
-use criterion::{black_box, criterion_group, criterion_main, Criterion};
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion};
+
+const GIB: usize = 1 << 30;
+const PAGE_SIZE_4K: usize = 0x1000;
+const PAGE_SIZE_2M: usize = 0x20_0000;
+
+/// Anonymous mapping populated at creation
+struct Region {
+    ptr: *mut libc::c_void,
+    len: usize,
+}
+
+impl Region {
+    fn new(len: usize, huge: bool) -> Option<Self> {
+        let mut flags = libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_POPULATE;
+        if huge {
+            flags |= libc::MAP_HUGETLB | libc::MAP_HUGE_2MB;
+        }
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                flags,
+                -1,
+                0,
+            )
+        };
+        (ptr != libc::MAP_FAILED).then_some(Self { ptr, len })
+    }
+}
+
+impl Drop for Region {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.ptr, self.len);
+        }
+    }
+}
 
 fn benchmark_virt_to_phy_batch(c: &mut Criterion) {
     let data: Vec<Vec<u8>> = (0..100).map(|_| vec![0u8; 4096]).collect();
@@ -30,10 +68,33 @@ fn benchmark_virt_to_phy_range_batch(c: &mut Criterion) {
     });
 }
 
+fn benchmark_virt_to_phy_large_mr(c: &mut Criterion) {
+    let mut group = c.benchmark_group("virt_to_phy large MR");
+    group.sample_size(10);
+    for (label, page_size, huge) in [("4K", PAGE_SIZE_4K, false), ("2M", PAGE_SIZE_2M, true)] {
+        for num_gib in [1, 4] {
+            let len = num_gib * GIB;
+            let Some(region) = Region::new(len, huge) else {
+                eprintln!("skip {label} pages {num_gib} GiB: mmap failed");
+                continue;
+            };
+            let start = region.ptr.cast::<u8>().cast_const();
+            let num_pages = len / page_size;
+            group.bench_with_input(
+                BenchmarkId::new(format!("{label} pages"), format!("{num_gib} GiB")),
+                &num_pages,
+                |b, &n| b.iter(|| virt_to_phy_bench_pages_wrapper(start, n, page_size as u64)),
+            );
+        }
+    }
+    group.finish();
+}
+
 criterion_group!(
     benches,
     benchmark_virt_to_phy_batch,
     benchmark_virt_to_phy_single,
-    benchmark_virt_to_phy_range_batch
+    benchmark_virt_to_phy_range_batch,
+    benchmark_virt_to_phy_large_mr
 );
 criterion_main!(benches);
@@ -0,0 +1,66 @@
+#![allow(warnings)]
+
+//! Prints the latency histograms of a process running the driver with the `latency_stats`
+//! feature.
+//!
+//! Usage: `bluerdma-stats [<pid> | <stats file>] [<interval secs>]`, the stats file defaults
+//! to `BLUE_RDMA_STATS_FILE`. With an interval the histograms are printed repeatedly.
+
+use std::{env, path::PathBuf, thread, time::Duration};
+
+use blue_rdma_driver::latency::{Stage, StatsFile};
+
+/// Quantiles printed for each stage, as `(label, numerator, denominator)`
+const QUANTILES: [(&str, u64, u64); 4] = [
+    ("p50", 1, 2),
+    ("p90", 9, 10),
+    ("p99", 99, 100),
+    ("p99.9", 999, 1000),
+];
+
+fn stats_path(arg: Option<String>) -> PathBuf {
+    match arg {
+        Some(pid) if pid.parse::<u32>().is_ok() => {
+            PathBuf::from(format!("/dev/shm/bluerdma-stats-{pid}"))
+        }
+        Some(path) => PathBuf::from(path),
+        None => PathBuf::from(
+            env::var("BLUE_RDMA_STATS_FILE")
+                .expect("usage: bluerdma-stats [<pid> | <stats file>] [<interval secs>]"),
+        ),
+    }
+}
+
+fn print(stats: &StatsFile) {
+    print!("{:<12}{:>12}", "stage", "count");
+    for (label, _, _) in QUANTILES {
+        print!("{label:>12}");
+    }
+    println!("{:>12}", "max");
+    for stage in Stage::ALL {
+        let histogram = stats.histogram(stage);
+        print!("{:<12}{:>12}", stage.name(), histogram.count());
+        for (_, num, den) in QUANTILES {
+            print!("{:>10}ns", histogram.quantile_ns(num, den));
+        }
+        println!("{:>10}ns", histogram.max_ns());
+    }
+}
+
+fn main() {
+    let mut args = env::args().skip(1);
+    let path = stats_path(args.next());
+    let interval = args
+        .next()
+        .map(|secs| Duration::from_secs(secs.parse().expect("invalid interval")));
+    loop {
+        let stats = StatsFile::open(&path)
+            .unwrap_or_else(|err| panic!("failed to read {}: {err}", path.display()));
+        print(&stats);
+        let Some(interval) = interval else {
+            break;
+        };
+        println!();
+        thread::sleep(interval);
+    }
+}
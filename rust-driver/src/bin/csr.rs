@@ -1,5 +1,10 @@
 #![allow(warnings)]
 
+//! Reads and writes the CSRs of the card or of the emulator.
+//!
+//! `csr top [--sim <addr>] [<interval ms>]` samples the head and tail CSRs of every ring and
+//! shows their occupancy, rates and stalls, refreshed every interval.
+
 use std::{
     env,
     fmt::Debug,
@@ -7,8 +12,11 @@ use std::{
     net::{SocketAddr, UdpSocket},
     path::{Path, PathBuf},
     sync::Arc,
+    thread,
+    time::Duration,
 };
 
+use blue_rdma_driver::csr::monitor::{RingMonitor, RingReport};
 use pci_info::PciInfo;
 use serde::{Deserialize, Serialize};
 
@@ -70,6 +78,13 @@ impl DebugInfoFetcher {
 
         Ok(Self { bar: mmap })
     }
+
+    fn read_csr(&self, addr: usize) -> io::Result<u32> {
+        if addr + 4 > self.bar.len() {
+            return Err(io::ErrorKind::InvalidInput.into());
+        }
+        Ok(unsafe { self.bar.as_ptr().add(addr).cast::<u32>().read_volatile() })
+    }
 }
 
 impl FetchDebugInfo for DebugInfoFetcher {
@@ -370,6 +385,71 @@ fn run_sim1() {
     }
 }
 
+/// Prints the rings sampled by the monitor like `top`, the driver side of each ring is
+/// marked by the arrow of its direction
+fn print_rings(reports: &[RingReport], interval: Duration) {
+    print!("\x1b[2J\x1b[H");
+    println!("ring occupancy every {}ms", interval.as_millis());
+    println!(
+        "{:<10}{:>6}{:>8}{:>8}{:>10}{:>8}{:>12}{:>12}{:>8}{:>8}",
+        "ring", "dir", "head", "tail", "occupancy", "fill", "head/s", "tail/s", "stalls", "full"
+    );
+    for r in reports {
+        println!(
+            "{:<10}{:>6}{:>8}{:>8}{:>10}{:>7.1}%{:>12.0}{:>12.0}{:>8}{:>8}",
+            r.name,
+            if r.to_card { "->card" } else { "->host" },
+            r.head,
+            r.tail,
+            r.occupancy,
+            r.fill(),
+            r.head_rate,
+            r.tail_rate,
+            r.stalls,
+            r.full
+        );
+    }
+}
+
+fn run_top<F: Fn(usize) -> io::Result<u32>>(read_csr: F, interval: Duration) {
+    let mut monitor = RingMonitor::new(&read_csr).expect("failed to read the device mode");
+    loop {
+        let reports = monitor
+            .sample(&read_csr)
+            .expect("failed to read the ring CSRs");
+        print_rings(&reports, interval);
+        thread::sleep(interval);
+    }
+}
+
 fn main() {
-    run_sim1();
+    let mut args = env::args().skip(1);
+    if args.next().as_deref() != Some("top") {
+        run_sim1();
+        return;
+    }
+    let mut sim = None;
+    let mut interval = Duration::from_secs(1);
+    while let Some(arg) = args.next() {
+        match arg.as_str() {
+            "--sim" => {
+                sim = Some(
+                    args.next()
+                        .expect("usage: csr top [--sim <addr>] [<interval ms>]"),
+                )
+            }
+            ms => interval = Duration::from_millis(ms.parse().expect("invalid interval")),
+        }
+    }
+    match sim {
+        Some(addr) => {
+            let dev = EmulatedDevice::new_with_addr(&addr);
+            run_top(|addr| dev.read_csr(addr), interval);
+        }
+        None => {
+            let dev = PciHwDevice::open_default().unwrap();
+            let fetcher = DebugInfoFetcher::new(dev.sysfs_path).unwrap();
+            run_top(|addr| fetcher.read_csr(addr), interval);
+        }
+    }
 }
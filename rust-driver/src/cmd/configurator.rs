@@ -1,16 +1,20 @@
 use std::{
-    io,
+    hint, io,
     net::{IpAddr, Ipv4Addr},
-    sync::atomic::{fence, Ordering},
+    sync::{
+        atomic::{fence, AtomicU64, Ordering},
+        Arc,
+    },
+    thread,
     time::Duration,
 };
-use log::debug;
+use log::{debug, error};
 
 use ipnetwork::IpNetwork;
 use parking_lot::Mutex;
 
 use crate::{
-    constants::CARD_MAC_ADDRESS,
+    constants::{CARD_MAC_ADDRESS, CMD_WAIT_SPIN_COUNT},
     csr::{
         proxy::{CmdQueueCsrProxy, CmdRespQueueCsrProxy},
         CsrBaseAddrAdaptor, CsrReaderAdaptor, CsrWriterAdaptor, DeviceAdaptor,
@@ -21,7 +25,7 @@ use crate::{
         CmdQueueReqDescSetRawPacketReceiveMeta,
     },
     mem::{page::ContiguousPages, DmaBuf, PageWithPhysAddr},
-    net::config::NetworkConfig,
+    net::{bond::BondPeers, config::NetworkConfig},
     ringbuf::DescRingBuffer,
 };
 
@@ -31,24 +35,98 @@ use super::{
 };
 
 /// Controller of the command queue
+///
+/// Commands are executed by the device in submission order, so a command is identified by its
+/// position in the submission sequence. The request ring lock is only held while descriptors are
+/// inserted, responses are drained by whichever waiter acquires the response ring.
 pub(crate) struct CommandConfigurator<Dev> {
-    /// Command queue pair
-    cmd_qp: Mutex<CmdQp>,
+    /// Command request queue
+    req_queue: Mutex<ReqQueue>,
+    /// Command response queue
+    resp_queue: Mutex<CmdRespQueue>,
+    /// Number of commands that have been responded by the device
+    completed: AtomicU64,
     /// Proxy for accessing command queue CSRs
     req_csr_proxy: CmdQueueCsrProxy<Dev>,
     /// Proxy for accessing command response queue CSRs
     resp_csr_proxy: CmdRespQueueCsrProxy<Dev>,
+    /// Command queue of the second card of a bonded pair
+    mirror: Option<Box<Mirror<Dev>>>,
+}
+
+/// Command queue of a second card receiving a copy of every command.
+///
+/// The copies are submitted while the request ring of the first card is locked, so both cards
+/// execute the same commands in the same order and a ticket of the first card resolves once
+/// both cards have responded.
+struct Mirror<Dev> {
+    /// Controller of the command queue of the second card
+    inner: CommandConfigurator<Dev>,
+    /// Peers of the second card
+    peers: Arc<BondPeers>,
+    /// Commands submitted to the second card before it was attached, minus the commands
+    /// submitted to the first card
+    offset: u64,
 }
 
+impl<Dev: DeviceAdaptor> Mirror<Dev> {
+    /// Returns the ticket of the second card matching `ticket` of the first card
+    fn ticket(&self, ticket: CmdTicket) -> CmdTicket {
+        CmdTicket(ticket.0.wrapping_add(self.offset))
+    }
+
+    /// Returns the copy of `desc` for the second card, QPs are connected to the peers on the
+    /// subnet of the second card
+    fn translate(&self, desc: CmdQueueDesc) -> CmdQueueDesc {
+        match desc {
+            CmdQueueDesc::ManageQP(mut qp) => {
+                let ip_addr = self.peers.peer_ip(qp.ip_addr());
+                qp.set_ip_addr(ip_addr);
+                if ip_addr != 0 {
+                    match self.peers.resolve(ip_addr) {
+                        Some(mac) => qp.set_peer_mac_addr(mac),
+                        None => error!("no neighbour entry for {ip_addr:#x} on the second card"),
+                    }
+                }
+                CmdQueueDesc::ManageQP(qp)
+            }
+            CmdQueueDesc::SetNetworkParam(_) => self.peers.network().into(),
+            desc => desc,
+        }
+    }
+}
+
+/// Command request queue with its submission sequence
+struct ReqQueue {
+    /// The command request queue
+    inner: CmdQueue,
+    /// Number of commands that have been submitted
+    submitted: u64,
+}
+
+/// Ticket of submitted commands, resolved when the device has responded to all of them
+#[must_use]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub(crate) struct CmdTicket(u64);
+
 impl<Dev: DeviceAdaptor> CommandConfigurator<Dev> {
 
     /// Creates a new command controller instance
     ///
     /// # Returns
-    /// A new `CommandConfigurator` with an initialized command queue
-    pub(crate) fn init(dev: &Dev, req_buf: DmaBuf, resp_buf: DmaBuf) -> io::Result<Self> {
-        let mut req_queue = CmdQueue::new(DescRingBuffer::new(req_buf.buf));
-        let mut resp_queue = CmdRespQueue::new(DescRingBuffer::new(resp_buf.buf));
+    /// A new `CommandConfigurator` with an initialized command queue of `depth` descriptors
+    pub(crate) fn init(
+        dev: &Dev,
+        req_buf: DmaBuf,
+        resp_buf: DmaBuf,
+        depth: usize,
+    ) -> io::Result<Self> {
+        let req_ring =
+            DescRingBuffer::with_depth(req_buf.buf, depth).recorded("cmd_req".into(), true);
+        let resp_ring =
+            DescRingBuffer::with_depth(resp_buf.buf, depth).recorded("cmd_resp".into(), false);
+        let req_queue = CmdQueue::new(req_ring);
+        let resp_queue = CmdRespQueue::new(resp_ring);
         let req_csr_proxy = CmdQueueCsrProxy(dev.clone());
         let resp_csr_proxy = CmdRespQueueCsrProxy(dev.clone());
         debug!("cmd req queue pa = 0x{:x}", req_buf.phys_addr);
@@ -57,12 +135,32 @@ impl<Dev: DeviceAdaptor> CommandConfigurator<Dev> {
         resp_csr_proxy.write_base_addr(resp_buf.phys_addr)?;
 
         Ok(Self {
-            cmd_qp: Mutex::new(CmdQp::new(req_queue, resp_queue)),
+            req_queue: Mutex::new(ReqQueue {
+                inner: req_queue,
+                submitted: 0,
+            }),
+            resp_queue: Mutex::new(resp_queue),
+            completed: AtomicU64::new(0),
             req_csr_proxy,
             resp_csr_proxy,
+            mirror: None,
         })
     }
 
+    /// Copies the commands submitted from now on to the command queue of a second card
+    pub(crate) fn set_mirror(&mut self, inner: CommandConfigurator<Dev>, peers: Arc<BondPeers>) {
+        let offset = inner
+            .req_queue
+            .get_mut()
+            .submitted
+            .wrapping_sub(self.req_queue.get_mut().submitted);
+        self.mirror = Some(Box::new(Mirror {
+            inner,
+            peers,
+            offset,
+        }));
+    }
+
     /// Flush cmd request queue pointer to device
     pub(crate) fn flush_req_queue(&self, req_queue: &CmdQueue) -> io::Result<()> {
         self.req_csr_proxy.write_head(req_queue.head())
@@ -75,8 +173,140 @@ impl<Dev: DeviceAdaptor> CommandConfigurator<Dev> {
 }
 
 impl<Dev: DeviceAdaptor> CommandConfigurator<Dev> {
+    /// Submits commands to the device without waiting for the responses.
+    ///
+    /// The doorbell is rung once after all descriptors are inserted. If the request ring is full,
+    /// the pending descriptors are flushed and the responses are polled until space is available.
+    ///
+    /// # Returns
+    /// A ticket that resolves when the device has responded to all submitted commands
+    pub(crate) fn submit<I>(&self, descs: I) -> CmdTicket
+    where
+        I: IntoIterator<Item = CmdQueueDesc>,
+    {
+        let mut req_queue = self.req_queue.lock();
+        let mut pushed = false;
+        let mut mirrored = Vec::new();
+        for desc in descs {
+            while !req_queue.inner.push(desc) {
+                self.flush(&mut req_queue.inner);
+                let _num = self.poll();
+                hint::spin_loop();
+            }
+            req_queue.submitted += 1;
+            pushed = true;
+            if let Some(mirror) = self.mirror.as_deref() {
+                mirrored.push(mirror.translate(desc));
+            }
+        }
+        if pushed {
+            self.flush(&mut req_queue.inner);
+        }
+        if let Some(mirror) = self.mirror.as_deref() {
+            let _ticket = mirror.inner.submit(mirrored);
+        }
+
+        CmdTicket(req_queue.submitted)
+    }
+
+    /// Submits a batch of commands and waits until the device has responded to all of them
+    pub(crate) fn submit_batch<I>(&self, descs: I)
+    where
+        I: IntoIterator<Item = CmdQueueDesc>,
+    {
+        let ticket = self.submit(descs);
+        self.wait(ticket);
+    }
+
+    /// Returns `true` if the device has responded to all commands of the ticket
+    pub(crate) fn is_complete(&self, ticket: CmdTicket) -> bool {
+        self.completed.load(Ordering::Acquire) >= ticket.0
+            && self.mirror.as_deref().map_or(true, |mirror| {
+                mirror.inner.is_complete(mirror.ticket(ticket))
+            })
+    }
+
+    /// Waits until the device has responded to all commands of the ticket
+    pub(crate) fn wait(&self, ticket: CmdTicket) {
+        let mut idle = 0usize;
+        while !self.is_complete(ticket) {
+            if self.poll() != 0 {
+                idle = 0;
+            } else if idle < CMD_WAIT_SPIN_COUNT {
+                idle += 1;
+                hint::spin_loop();
+            } else {
+                thread::yield_now();
+            }
+        }
+    }
+
+    /// Drains available responses from the response queue, and from the one of the mirror.
+    ///
+    /// Returns immediately if another thread is polling the response queue.
+    ///
+    /// # Returns
+    /// Number of responses drained
+    pub(crate) fn poll(&self) -> u64 {
+        let mirrored = self
+            .mirror
+            .as_deref()
+            .map_or(0, |mirror| mirror.inner.poll());
+        let Some(mut resp_queue) = self.resp_queue.try_lock() else {
+            return mirrored;
+        };
+        let mut num = 0u64;
+        while resp_queue.try_pop().is_some() {
+            num += 1;
+        }
+        if num == 0 {
+            return mirrored;
+        }
+        if let Err(err) = self.resp_csr_proxy.write_tail(resp_queue.tail()) {
+            error!("failed to write cmd resp queue tail: {err}");
+        }
+        if let Ok(head_ptr) = self.resp_csr_proxy.read_head() {
+            resp_queue.set_head(head_ptr);
+        }
+        let _prev = self.completed.fetch_add(num, Ordering::Release);
+
+        num + mirrored
+    }
+
+    /// Writes the head pointer to the device and updates the tail pointer of the request queue
+    fn flush(&self, req_queue: &mut CmdQueue) {
+        if let Err(err) = self.req_csr_proxy.write_head(req_queue.head()) {
+            error!("failed to write cmd req queue head: {err}");
+        }
+        if let Ok(tail_ptr) = self.req_csr_proxy.read_tail() {
+            req_queue.set_tail(tail_ptr);
+        }
+    }
+
     pub(crate) fn update_mtt(&self, update: MttUpdate) {
-        let update_mr_table = CmdQueueReqDescUpdateMrTable::new(
+        self.submit_batch([update.into()]);
+    }
+
+    pub(crate) fn update_pgt(&self, update: PgtUpdate) {
+        self.submit_batch([update.into()]);
+    }
+
+    pub(crate) fn update_qp(&self, entry: UpdateQp) {
+        self.submit_batch([entry.into()]);
+    }
+
+    pub(crate) fn set_network(&self, param: NetworkConfig) {
+        self.submit_batch([param.into()]);
+    }
+
+    pub(crate) fn set_raw_packet_recv_buffer(&self, meta: RecvBufferMeta) {
+        self.submit_batch([meta.into()]);
+    }
+}
+
+impl From<MttUpdate> for CmdQueueDesc {
+    fn from(update: MttUpdate) -> Self {
+        CmdQueueDesc::UpdateMrTable(CmdQueueReqDescUpdateMrTable::new(
             0,
             update.mr_base_va,
             update.mr_length,
@@ -84,30 +314,24 @@ impl<Dev: DeviceAdaptor> CommandConfigurator<Dev> {
             update.pd_handler,
             update.acc_flags,
             update.base_pgt_offset,
-        );
-        let mut qp = self.cmd_qp.lock();
-        let mut qp_update = qp.update();
-        qp_update.push(CmdQueueDesc::UpdateMrTable(update_mr_table));
-        qp_update.flush(&self.req_csr_proxy);
-        qp_update.wait(&self.resp_csr_proxy);
+        ))
     }
+}
 
-    pub(crate) fn update_pgt(&self, update: PgtUpdate) {
-        let desc = CmdQueueReqDescUpdatePGT::new(
+impl From<PgtUpdate> for CmdQueueDesc {
+    fn from(update: PgtUpdate) -> Self {
+        CmdQueueDesc::UpdatePGT(CmdQueueReqDescUpdatePGT::new(
             0,
             update.dma_addr,
             update.pgt_offset,
             update.zero_based_entry_count,
-        );
-        let mut qp = self.cmd_qp.lock();
-        let mut qp_update = qp.update();
-        qp_update.push(CmdQueueDesc::UpdatePGT(desc));
-        qp_update.flush(&self.req_csr_proxy);
-        qp_update.wait(&self.resp_csr_proxy);
+        ))
     }
+}
 
-    pub(crate) fn update_qp(&self, entry: UpdateQp) {
-        let desc = CmdQueueReqDescQpManagement::new(
+impl From<UpdateQp> for CmdQueueDesc {
+    fn from(entry: UpdateQp) -> Self {
+        CmdQueueDesc::ManageQP(CmdQueueReqDescQpManagement::new(
             0,
             entry.ip_addr,
             entry.qpn,
@@ -119,104 +343,28 @@ impl<Dev: DeviceAdaptor> CommandConfigurator<Dev> {
             entry.pmtu,
             entry.local_udp_port,
             entry.peer_mac_addr,
-        );
-
-        let mut qp = self.cmd_qp.lock();
-        let mut update = qp.update();
-        update.push(CmdQueueDesc::ManageQP(desc));
-        update.flush(&self.req_csr_proxy);
-        update.wait(&self.resp_csr_proxy);
+            entry.max_dest_rd_atomic,
+        ))
     }
+}
 
-    pub(crate) fn set_network(&self, param: NetworkConfig) {
-        let network = param.ip;
-        let desc = CmdQueueReqDescSetNetworkParam::new(
+impl From<NetworkConfig> for CmdQueueDesc {
+    fn from(param: NetworkConfig) -> Self {
+        CmdQueueDesc::SetNetworkParam(CmdQueueReqDescSetNetworkParam::new(
             0,
             param.gateway.map_or(0, Ipv4Addr::to_bits),
             param.ip.mask().to_bits(),
             param.ip.ip().to_bits(),
             CARD_MAC_ADDRESS,
-        );
-        let mut qp = self.cmd_qp.lock();
-        let mut update = qp.update();
-        update.push(CmdQueueDesc::SetNetworkParam(desc));
-        update.flush(&self.req_csr_proxy);
-        update.wait(&self.resp_csr_proxy);
-    }
-
-    pub(crate) fn set_raw_packet_recv_buffer(&self, meta: RecvBufferMeta) {
-        let desc = CmdQueueReqDescSetRawPacketReceiveMeta::new(0, meta.phys_addr);
-        let mut qp = self.cmd_qp.lock();
-        let mut update = qp.update();
-        update.push(CmdQueueDesc::SetRawPacketReceiveMeta(desc));
-        update.flush(&self.req_csr_proxy);
-        update.wait(&self.resp_csr_proxy);
-    }
-}
-
-/// Command queue pair
-struct CmdQp {
-    /// The command request queue
-    req_queue: CmdQueue,
-    /// The command response queue
-    resp_queue: CmdRespQueue,
-}
-
-impl CmdQp {
-    /// Creates a new command queue pair
-    fn new(req_queue: CmdQueue, resp_queue: CmdRespQueue) -> Self {
-        Self {
-            req_queue,
-            resp_queue,
-        }
-    }
-
-    /// Creates a queue pair update handle to process commands
-    fn update(&mut self) -> QpUpdate<'_> {
-        QpUpdate {
-            num: 0,
-            req_queue: &mut self.req_queue,
-            resp_queue: &mut self.resp_queue,
-        }
+        ))
     }
 }
 
-/// An updates handle
-struct QpUpdate<'a> {
-    /// Number of updates
-    num: usize,
-    /// The command request queue
-    req_queue: &'a mut CmdQueue,
-    /// The command response queue
-    resp_queue: &'a mut CmdRespQueue,
-}
-
-impl QpUpdate<'_> {
-    /// Pushes a new command queue descriptor to the queue.
-    fn push(&mut self, desc: CmdQueueDesc) {
-        self.num = self.num.wrapping_add(1);
-        //FIXME: handle failed condition
-        let _ignore = self.req_queue.push(desc);
-    }
-
-    /// Flushes the command queue by writing the head pointer to the CSR proxy.
-    fn flush<Dev: DeviceAdaptor>(&mut self, req_csr_proxy: &CmdQueueCsrProxy<Dev>) {
-        req_csr_proxy.write_head(self.req_queue.head());
-        if let Ok(tail_ptr) = req_csr_proxy.read_tail() {
-            self.req_queue.set_tail(tail_ptr);
-        }
-    }
-
-    /// Waits for responses to all pushed commands.
-    fn wait<Dev: DeviceAdaptor>(mut self, resp_csr_proxy: &CmdRespQueueCsrProxy<Dev>) {
-        while self.num != 0 {
-            if let Some(resp) = self.resp_queue.try_pop() {
-                self.num = self.num.wrapping_sub(1);
-                resp_csr_proxy.write_tail(self.resp_queue.tail());
-                if let Ok(head_ptr) = resp_csr_proxy.read_head() {
-                    self.resp_queue.set_head(head_ptr);
-                }
-            }
-        }
+impl From<RecvBufferMeta> for CmdQueueDesc {
+    fn from(meta: RecvBufferMeta) -> Self {
+        CmdQueueDesc::SetRawPacketReceiveMeta(CmdQueueReqDescSetRawPacketReceiveMeta::new(
+            0,
+            meta.phys_addr,
+        ))
     }
 }
@@ -1,5 +1,7 @@
 mod configurator;
+mod pgt;
 mod types;
 
-pub(crate) use configurator::CommandConfigurator;
+pub(crate) use configurator::{CmdTicket, CommandConfigurator};
+pub(crate) use pgt::{PgtStaging, PgtWriter};
 pub(crate) use types::*;
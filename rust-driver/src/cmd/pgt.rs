@@ -0,0 +1,191 @@
+use std::collections::VecDeque;
+
+use log::debug;
+
+use crate::{
+    csr::DeviceAdaptor,
+    mem::{DmaBuf, PAGE_SIZE},
+};
+
+use super::{CmdQueueDesc, CmdTicket, CommandConfigurator, MttUpdate, PgtUpdate};
+
+/// Maximum number of Page Table entries (PGT entries) that can be allocated in a single `PCIe` transaction.
+/// A `PCIe` transaction size is 128 bytes, and each PGT entry is a u64 (8 bytes).
+/// Therefore, 128 bytes / 8 bytes per entry = 16 entries per allocation.
+const MAX_NUM_PGT_ENTRY_PER_ALLOC: usize = 16;
+
+/// Size of the staging area used by a single PGT update
+const PGT_UPDATE_BYTES: usize = MAX_NUM_PGT_ENTRY_PER_ALLOC * size_of::<u64>();
+
+/// Number of parts of the staging buffer, a batch of PGT updates is staged in each part
+const NUM_STAGING_PARTS: usize = 4;
+
+/// Staging buffer of the PGT updates, along with the last commands reading it
+#[derive(Debug)]
+pub(crate) struct PgtStaging {
+    buf: DmaBuf,
+    /// Ticket of the commands submitted by the last `PgtWriter::submit`, waited for before
+    /// the buffer is written again
+    busy: Option<CmdTicket>,
+}
+
+impl PgtStaging {
+    pub(crate) fn new(buf: DmaBuf) -> Self {
+        Self { buf, busy: None }
+    }
+}
+
+/// Streams the page table of a memory region to the device.
+///
+/// Each PGT update reads from its own 128 byte slot of the staging buffer, the entries are
+/// written to the slot as they are appended. The buffer is a ring of `NUM_STAGING_PARTS`
+/// parts. Once a part is full its batch of updates is submitted, and the next part is filled
+/// while the device consumes the batches of the others. A part is only waited for when the
+/// ring wraps around to it.
+pub(crate) struct PgtWriter<'a, Dev> {
+    /// Command queue controller
+    cmd: &'a CommandConfigurator<Dev>,
+    /// Staging buffer read by the device
+    staging: &'a mut PgtStaging,
+    /// Number of parts of the staging buffer
+    num_parts: usize,
+    /// Number of update slots in each part of the staging buffer
+    part_slots: usize,
+    /// Commands staged but not yet submitted
+    pending: Vec<CmdQueueDesc>,
+    /// Number of entries written to the slot being filled
+    num_entries: usize,
+    /// PGT index of the first entry of the slot being filled
+    next_index: u32,
+    /// Part of the staging buffer being filled
+    part: usize,
+    /// Next free slot in the current part
+    slot: usize,
+    /// Tickets of the submitted batches, oldest first
+    in_flight: VecDeque<CmdTicket>,
+}
+
+impl<'a, Dev: DeviceAdaptor> PgtWriter<'a, Dev> {
+    /// Creates a new writer, the MTT update is submitted together with the first PGT updates
+    pub(crate) fn new(
+        cmd: &'a CommandConfigurator<Dev>,
+        staging: &'a mut PgtStaging,
+        mtt_update: MttUpdate,
+    ) -> Self {
+        let mut this = Self::at(cmd, staging, mtt_update.base_pgt_offset);
+        this.pending.push(mtt_update.into());
+        this
+    }
+
+    /// Creates a new writer that overwrites the page table starting at `pgt_index`
+    pub(crate) fn at(
+        cmd: &'a CommandConfigurator<Dev>,
+        staging: &'a mut PgtStaging,
+        pgt_index: u32,
+    ) -> Self {
+        if let Some(ticket) = staging.busy.take() {
+            cmd.wait(ticket);
+        }
+        let num_slots = (staging.buf.buf.len / PGT_UPDATE_BYTES).max(1);
+        let num_parts = NUM_STAGING_PARTS.min(num_slots);
+        Self {
+            cmd,
+            staging,
+            num_parts,
+            part_slots: num_slots / num_parts,
+            pending: Vec::new(),
+            num_entries: 0,
+            next_index: pgt_index,
+            part: 0,
+            slot: 0,
+            in_flight: VecDeque::with_capacity(num_parts),
+        }
+    }
+
+    /// Appends physical addresses of the next pages of the memory region
+    pub(crate) fn extend(&mut self, phys_addrs: &[u64]) {
+        for &phys_addr in phys_addrs {
+            self.push(phys_addr);
+        }
+    }
+
+    /// Appends `num_pages` pages that all map to `phys_addr`
+    pub(crate) fn fill(&mut self, phys_addr: u64, num_pages: usize) {
+        for _ in 0..num_pages {
+            self.push(phys_addr);
+        }
+    }
+
+    /// Appends `num_pages` physically contiguous pages starting at `phys_addr`
+    pub(crate) fn extend_contiguous(&mut self, phys_addr: u64, num_pages: usize) {
+        for i in 0..num_pages {
+            self.push(phys_addr + (i * PAGE_SIZE) as u64);
+        }
+    }
+
+    /// Submits the remaining updates and waits until the device has responded to all of them
+    pub(crate) fn finish(self) {
+        let cmd = self.cmd;
+        let ticket = self.submit();
+        cmd.wait(ticket);
+    }
+
+    /// Submits the remaining updates without waiting for the device, the staging buffer is
+    /// waited for by the next writer
+    ///
+    /// # Returns
+    ///
+    /// The ticket of the updates, commands complete in order so it also covers all previous
+    /// batches
+    pub(crate) fn submit(mut self) -> CmdTicket {
+        if self.num_entries != 0 {
+            self.stage();
+        }
+        let ticket = self.cmd.submit(self.pending.drain(..));
+        self.staging.busy = Some(ticket);
+        ticket
+    }
+
+    /// Returns the offset of the slot being filled in the staging buffer
+    fn slot_offset(&self) -> usize {
+        (self.part * self.part_slots + self.slot) * PGT_UPDATE_BYTES
+    }
+
+    /// Writes the next entry to the slot being filled
+    fn push(&mut self, phys_addr: u64) {
+        if self.num_entries == 0 && self.slot == 0 && self.in_flight.len() == self.num_parts {
+            // Waits for the batch that previously used this part
+            if let Some(ticket) = self.in_flight.pop_front() {
+                self.cmd.wait(ticket);
+            }
+        }
+        let offset = self.slot_offset() + self.num_entries * size_of::<u64>();
+        self.staging.buf.buf.write_u64(offset, phys_addr);
+        self.num_entries += 1;
+        if self.num_entries == MAX_NUM_PGT_ENTRY_PER_ALLOC {
+            self.stage();
+        }
+    }
+
+    /// Queues the PGT update of the slot being filled
+    fn stage(&mut self) {
+        let count = self.num_entries as u32;
+        let offset = self.slot_offset();
+        let pgt_update = PgtUpdate::new(
+            self.staging.buf.phys_addr + offset as u64,
+            self.next_index,
+            count - 1,
+        );
+        debug!("new pgt update request: {pgt_update:?}");
+        self.pending.push(pgt_update.into());
+        self.next_index += count;
+        self.num_entries = 0;
+        self.slot += 1;
+        if self.slot == self.part_slots {
+            self.in_flight
+                .push_back(self.cmd.submit(self.pending.drain(..)));
+            self.part = (self.part + 1) % self.num_parts;
+            self.slot = 0;
+        }
+    }
+}
@@ -90,9 +90,9 @@ impl CmdRespQueue {
         self.inner.pop()
     }
 
-    /// Return tail pointer
+    /// Return tail pointer to report to the device
     pub(crate) fn tail(&self) -> u32 {
-        self.inner.tail() as u32
+        self.inner.released() as u32
     }
 
     pub(crate) fn set_head(&mut self, head: u32) {
@@ -130,6 +130,12 @@ impl MttUpdate {
             base_pgt_offset,
         }
     }
+
+    /// Creates an update that invalidates the entry of `mr_key`, accesses through a zero
+    /// length entry without access flags are rejected by the device
+    pub(crate) fn invalidate(mr_key: u32) -> Self {
+        Self::new(0, 0, mr_key, 0, 0, 0)
+    }
 }
 
 #[derive(Debug, Clone, Copy)]
@@ -161,6 +167,9 @@ pub(crate) struct UpdateQp {
     pub(crate) pmtu: u8,
     pub(crate) local_udp_port: u16,
     pub(crate) peer_mac_addr: u64,
+    /// Number of RDMA READ requests of the peer the hardware responder serves at once, 0 if
+    /// the reads are served by the driver
+    pub(crate) max_dest_rd_atomic: u8,
 }
 
 /// Receive buffer
@@ -1,8 +1,24 @@
+use std::collections::HashMap;
+
 use serde::{Deserialize, Serialize};
 
-use crate::{net::config::NetworkConfig, workers::qp_timeout::AckTimeoutConfig};
+use crate::{
+    constants::{
+        DEFAULT_BOND_STRIPE_MIN_BYTES, DEFAULT_DC_CONTEXTS, DEFAULT_MAX_QP, DEFAULT_PSN_WINDOW,
+        DEFAULT_SIMPLE_NIC_SLOT_SIZE, DEFAULT_STRIPE_MIN_BYTES, ETH_HEADER_LEN, ETH_MIN_MTU,
+        MAX_PSN_WINDOW, MAX_QP_CNT, MAX_SIMPLE_NIC_SLOT_SIZE, MIN_SIMPLE_NIC_SLOT_SIZE,
+        MIN_WR_CHUNK_SIZE, SIMPLE_NIC_MAX_MTU, WR_CHUNK_SIZE,
+    },
+    csr::mode::Mode,
+    net::config::NetworkConfig,
+    ringbuf::{MAX_RING_BUF_LEN, RING_BUF_LEN},
+    workers::{
+        qp_timeout::AckTimeoutConfig,
+        spawner::{ChannelPolicy, PollPolicy},
+    },
+};
 
-use log::warn;
+use log::{warn, LevelFilter};
 
 const DEFAULT_CONFIG_PATH: &str = "/etc/bluerdma/config.toml";
 
@@ -13,17 +29,1133 @@ pub enum ConfigError {
 
     #[error("Parse error: {0}")]
     ParseError(#[from] toml::de::Error),
+
+    #[error("Invalid value: {0}")]
+    InvalidValue(String),
 }
 
 #[derive(Debug, Default, Clone, Serialize, Deserialize)]
 pub(crate) struct DeviceConfig {
     pub(crate) ack: AckTimeoutConfig,
+    /// Post WRs and ring the send queue doorbell on the calling thread for newly created QPs
+    #[serde(default)]
+    pub(crate) direct_doorbell: bool,
+    /// Backoff policy of the polling workers
+    #[serde(default)]
+    pub(crate) poll: PollPolicy,
+    /// Capacity and batching of the task channels of the workers
+    #[serde(default)]
+    pub(crate) channel: ChannelPolicy,
+    /// CPU affinity of the worker threads
+    #[serde(default)]
+    pub(crate) affinity: AffinityConfig,
+    /// Memory region registration cache
+    #[serde(default)]
+    pub(crate) mr_cache: MrCacheConfig,
+    /// Staging of sends from unregistered buffers
+    #[serde(default)]
+    pub(crate) staging: StagingConfig,
+    /// Send queue doorbell batching
+    #[serde(default)]
+    pub(crate) doorbell: DoorbellConfig,
+    /// Coalescing of the ACK frames generated by the driver
+    #[serde(default)]
+    pub(crate) ack_coalesce: AckCoalesceConfig,
+    /// Merging of consecutive small RDMA writes of a QP
+    #[serde(default)]
+    pub(crate) write_coalesce: WriteCoalesceConfig,
+    /// Go-back-N retransmission after an ACK timeout
+    #[serde(default)]
+    pub(crate) retransmit: RetransmitConfig,
+    /// Large sends pulled by the receiver with RDMA reads
+    #[serde(default)]
+    pub(crate) rendezvous: RendezvousConfig,
+    /// Depth of the descriptor rings
+    #[serde(default)]
+    pub(crate) rings: RingConfig,
+    /// Frame slots of the simple NIC buffers
+    #[serde(default)]
+    pub(crate) simple_nic: SimpleNicConfig,
+    /// Size of the chunks the WRs are split into
+    #[serde(default)]
+    pub(crate) chunk: ChunkConfig,
+    /// Advertise posted receive WRs to the peer with RDMA writes to its receive WR rings,
+    /// instead of a TCP connection per QP. Both ends of a QP must use the same setting
+    #[serde(default)]
+    pub(crate) in_band_recv: bool,
+    /// Split the receive WRs of the QPs into strides of this many bytes, consecutive sends
+    /// fill successive strides of a receive WR and their completions report the offset of the
+    /// message in `src_qp`. 0 takes a whole receive WR per send. Both ends of a QP must use the
+    /// same setting
+    #[serde(default)]
+    pub(crate) recv_stride: u32,
+    /// DCQCN congestion control of the send path
+    #[serde(default)]
+    pub(crate) congestion: CongestionConfig,
+    /// Spraying of the traffic of each QP over the ECMP paths of the fabric
+    #[serde(default)]
+    pub(crate) multipath: MultipathConfig,
+    /// Interrupts of the meta report channels, waited on by the parked `MetaWorker`s
+    #[serde(default)]
+    pub(crate) interrupt: InterruptConfig,
+    /// Replay every PSN of the range reported by a NAK, instead of only the PSNs missing from
+    /// the bitmaps of the NAK
+    #[serde(default)]
+    pub(crate) range_retransmit: bool,
+    /// Generate the completions and the ACK frames of the received metas on the `MetaWorker`
+    /// thread, instead of handing them to the `CompletionWorker` and the `AckResponder`
+    #[serde(default)]
+    pub(crate) fused_pipeline: bool,
+    /// Poll each meta report queue with its own `MetaWorker`, ignored by the fused pipeline
+    #[serde(default)]
+    pub(crate) meta_worker_per_channel: bool,
+    /// Threads the `CompletionWorker` and the `RdmaWriteWorker` are each split into, a QP is
+    /// served by the thread `qpn_to_index(qpn) % worker_shards`. 0 runs a single thread of
+    /// each, the fused pipeline keeps a single `CompletionWorker`
+    #[serde(default)]
+    pub(crate) worker_shards: usize,
+    /// Maximum number of QPs of the device, 0 selects `DEFAULT_MAX_QP`
+    #[serde(default)]
+    pub(crate) max_qp: usize,
+    /// PSNs tracked past the base PSN of each direction of a QP, rounded up to a power of
+    /// two, 0 selects `DEFAULT_PSN_WINDOW`. The PSNs acknowledged or received beyond the
+    /// window are dropped and counted in `psn_window_drops`
+    #[serde(default)]
+    pub(crate) psn_window: usize,
+    /// Sharing of the device between processes
+    #[serde(default)]
+    pub(crate) partition: PartitionConfig,
+    /// Keep the context of a closed device in the process while it holds no resources, the
+    /// next open of the device reuses it instead of resetting and initializing the device
+    #[serde(default)]
+    pub(crate) resident: bool,
+    /// Directory of the snapshots of the connected QPs and the MR keys of the shares of the
+    /// device, such as a tmpfs or hugetlbfs mount, `None` keeps no snapshot. A process opening
+    /// a share whose snapshot holds connected QPs does not reset the device, it can reattach
+    /// the QPs and resume their connections
+    #[serde(default)]
+    pub(crate) snapshot_dir: Option<String>,
+    /// Let the hardware serve the RDMA READ requests of the remote peers from the MTT, instead
+    /// of converting each request into an RDMA WRITE of the response on the driver's threads.
+    /// Requires a bitstream with the READ responder.
+    #[serde(default)]
+    pub(crate) native_read: bool,
+    /// Copy the RDMA writes and reads of a QP connected to another QP of the context between
+    /// their MRs on the posting thread, instead of sending them through the card and back
+    #[serde(default)]
+    pub(crate) loopback_copy: bool,
+    /// Complete the signaled sends and RDMA writes of the newly created QPs as soon as the
+    /// peer acknowledged all their PSNs, instead of in the order they were posted, so that a
+    /// WR waiting on a retransmission does not hold back the completions of the WRs behind it.
+    /// The send queue slots of the WRs are still released in order
+    #[serde(default)]
+    pub(crate) relaxed_completion: bool,
+    /// Contexts of the dynamically connected QPs
+    #[serde(default)]
+    pub(crate) dc: DcConfig,
+    /// Second card carrying part of the large RDMA writes
+    #[serde(default)]
+    pub(crate) bond: BondConfig,
+    /// Striping of the large RDMA writes of a QP over the send channels
+    #[serde(default)]
+    pub(crate) stripe: StripeConfig,
+    /// Copy of the small sends from registered buffers to the bounce buffer
+    #[serde(default)]
+    pub(crate) send_path: SendPathConfig,
+    /// Map the registered memory into the IOMMU domain of the device through VFIO at IOVA =
+    /// VA, instead of pinning the pages and translating them through `/proc/self/pagemap`.
+    /// Requires the cards to be bound to `vfio-pci`
+    #[serde(default)]
+    pub(crate) vfio_iommu: bool,
+    /// Pin the registered memory through the kernel module, which takes long term pins the
+    /// pages can't be migrated under and returns their DMA addresses, instead of locking them
+    /// and translating them through `/proc/self/pagemap`
+    #[serde(default)]
+    pub(crate) kernel_pin: bool,
+    /// Number of send channels withheld from the `SendWorker`s, each can be lent to a QP whose
+    /// descriptors are built by a GPU in its own memory and whose doorbell is rung by the GPU.
+    /// The context keeps at least one channel for the driver
+    #[serde(default)]
+    pub(crate) gpu_channels: usize,
+    /// Maximum level of the log records, such as `warn` or `debug`, `None` keeps the level of
+    /// `RUST_LOG`
+    #[serde(default)]
+    pub(crate) log_level: Option<String>,
+}
+
+/// The settings a running context applies when the configuration file changes.
+///
+/// The other settings size or lay out the resources of the context, they only take effect
+/// in the contexts opened afterwards. The check interval of the ACK timeouts is the period
+/// of the timer worker and is kept as well.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct Tunables {
+    pub(crate) ack: AckTimeoutConfig,
+    pub(crate) ack_coalesce: AckCoalesceConfig,
+    pub(crate) congestion: CongestionConfig,
+    pub(crate) poll: PollPolicy,
+    pub(crate) log_level: Option<LevelFilter>,
+}
+
+/// Depth of the descriptor rings in number of descriptors, for example:
+///
+/// ```toml
+/// [rings]
+/// cmd = 4096
+/// send = 8192
+/// meta_report = 8192
+/// simple_nic = 4096
+/// ```
+///
+/// Each depth is a power of two. The queues have no size CSR, so a depth must match the depth
+/// the corresponding hardware queue is built with.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct RingConfig {
+    /// Depth of the command request and response queues
+    pub(crate) cmd: usize,
+    /// Depth of each send queue
+    pub(crate) send: usize,
+    /// Depth of each meta report queue
+    pub(crate) meta_report: usize,
+    /// Depth of the simple NIC tx and rx queues
+    pub(crate) simple_nic: usize,
+}
+
+impl Default for RingConfig {
+    fn default() -> Self {
+        Self {
+            cmd: RING_BUF_LEN,
+            send: RING_BUF_LEN,
+            meta_report: RING_BUF_LEN,
+            simple_nic: RING_BUF_LEN,
+        }
+    }
+}
+
+impl RingConfig {
+    /// Checks that every depth is a supported power of two
+    pub(crate) fn validate(&self) -> Result<(), ConfigError> {
+        for (name, depth) in [
+            ("cmd", self.cmd),
+            ("send", self.send),
+            ("meta_report", self.meta_report),
+            ("simple_nic", self.simple_nic),
+        ] {
+            if !depth.is_power_of_two() || !(2..=MAX_RING_BUF_LEN).contains(&depth) {
+                return Err(ConfigError::InvalidValue(format!(
+                    "rings.{name} = {depth}, expected a power of two in 2..={MAX_RING_BUF_LEN}"
+                )));
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Frame slots of the simple NIC buffers, for example:
+///
+/// ```toml
+/// [simple_nic]
+/// slot_size = 16384
+/// mtu = 9000
+/// offload = true
+/// ```
+///
+/// Each frame sent or received through the simple NIC takes a slot of `slot_size` bytes, a
+/// power of two of at least 128. The tx and rx buffers hold a slot per descriptor of their
+/// ring. The card writes a received frame at the offset of its slot index, so the slot size
+/// must match the slot size the rx queue of the card is built with.
+///
+/// `mtu` is set on the netdev of the card when the device is opened, up to a 9000 bytes jumbo
+/// frame and to the largest payload that fits a slot with its Ethernet header. Without it the
+/// netdev keeps its MTU, and a tap device of the simple NIC takes the largest MTU of a slot.
+///
+/// `offload` opens the tap device of the simple NIC with virtio net headers, which hands the
+/// transport checksums and the TCP segmentation over from the kernel to the tx worker, and
+/// lets the rx worker pass the consecutive segments of a TCP flow as one super-frame.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct SimpleNicConfig {
+    /// Size in bytes of a frame slot
+    pub(crate) slot_size: usize,
+    /// MTU of the netdev, left unchanged if not set
+    pub(crate) mtu: Option<usize>,
+    /// Checksum and segmentation offload of the tap device
+    pub(crate) offload: bool,
+}
+
+impl Default for SimpleNicConfig {
+    fn default() -> Self {
+        Self {
+            slot_size: DEFAULT_SIMPLE_NIC_SLOT_SIZE,
+            mtu: None,
+            offload: false,
+        }
+    }
+}
+
+impl SimpleNicConfig {
+    /// Returns the largest MTU of the frames fitting a slot
+    pub(crate) fn max_mtu(&self) -> usize {
+        self.slot_size
+            .saturating_sub(ETH_HEADER_LEN)
+            .min(SIMPLE_NIC_MAX_MTU)
+    }
+
+    /// Returns the configured MTU, or the largest MTU of a slot
+    pub(crate) fn mtu(&self) -> usize {
+        self.mtu.unwrap_or_else(|| self.max_mtu())
+    }
+
+    /// Returns the length of a buffer holding a slot per descriptor of a ring of `depth`
+    pub(crate) fn buffer_len(&self, depth: usize) -> usize {
+        depth.saturating_mul(self.slot_size)
+    }
+
+    pub(crate) fn validate(&self) -> Result<(), ConfigError> {
+        if !self.slot_size.is_power_of_two()
+            || !(MIN_SIMPLE_NIC_SLOT_SIZE..=MAX_SIMPLE_NIC_SLOT_SIZE).contains(&self.slot_size)
+        {
+            return Err(ConfigError::InvalidValue(format!(
+                "simple_nic.slot_size = {}, expected a power of two in \
+                 {MIN_SIMPLE_NIC_SLOT_SIZE}..={MAX_SIMPLE_NIC_SLOT_SIZE}",
+                self.slot_size
+            )));
+        }
+        if let Some(mtu) = self.mtu {
+            if !(ETH_MIN_MTU..=self.max_mtu()).contains(&mtu) {
+                return Err(ConfigError::InvalidValue(format!(
+                    "simple_nic.mtu = {mtu}, expected {ETH_MIN_MTU}..={} for slot_size = {}",
+                    self.max_mtu(),
+                    self.slot_size
+                )));
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Size of the chunks the WRs are split into by the driver, for example:
+///
+/// ```toml
+/// [chunk]
+/// size = 0x10000
+/// max_size = 0x100000
+/// ```
+///
+/// Each chunk takes a pair of send queue descriptors, the device segments a chunk into PMTU
+/// packets. `max_size` is the largest chunk the hardware is built to segment, `size` the
+/// chunk size of new QPs, which `bluerdma_modify_qp_chunk_size` changes per QP up to
+/// `max_size`. Both are powers of two of at least the largest PMTU.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct ChunkConfig {
+    /// Chunk size in bytes of new QPs
+    pub(crate) size: u32,
+    /// Largest chunk size in bytes of a QP
+    pub(crate) max_size: u32,
+}
+
+impl Default for ChunkConfig {
+    fn default() -> Self {
+        Self {
+            size: WR_CHUNK_SIZE,
+            max_size: WR_CHUNK_SIZE,
+        }
+    }
+}
+
+impl ChunkConfig {
+    /// Returns `true` if a QP may use chunks of `chunk_size` bytes
+    pub(crate) fn allows(&self, chunk_size: u32) -> bool {
+        chunk_size.is_power_of_two() && (MIN_WR_CHUNK_SIZE..=self.max_size).contains(&chunk_size)
+    }
+
+    pub(crate) fn validate(&self) -> Result<(), ConfigError> {
+        if !self.max_size.is_power_of_two() || self.max_size < MIN_WR_CHUNK_SIZE {
+            return Err(ConfigError::InvalidValue(format!(
+                "chunk.max_size = {:#x}, expected a power of two of at least {MIN_WR_CHUNK_SIZE:#x}",
+                self.max_size
+            )));
+        }
+        if !self.allows(self.size) {
+            return Err(ConfigError::InvalidValue(format!(
+                "chunk.size = {:#x}, expected a power of two in {MIN_WR_CHUNK_SIZE:#x}..={:#x}",
+                self.size, self.max_size
+            )));
+        }
+        Ok(())
+    }
+}
+
+/// Send queue doorbell batching of the `SendWorker`s, for example:
+///
+/// ```toml
+/// [doorbell]
+/// batch = 32
+/// max_delay_us = 5
+/// tail_sync_interval_us = 1
+/// write_combining = true
+/// ```
+///
+/// A worker with fewer than `batch` unrung descriptors rings the doorbell once it runs out of
+/// work, or once the oldest descriptor has waited for `max_delay_us`.
+///
+/// With `write_combining` the head registers are written through the write-combined mapping
+/// of the BAR, which is only provided by the kernel if the BAR is prefetchable.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct DoorbellConfig {
+    /// Number of descriptors written before the head CSR is written
+    pub(crate) batch: usize,
+    /// Maximum time in microseconds a written descriptor waits for the doorbell
+    pub(crate) max_delay_us: u64,
+    /// Minimum time in microseconds between two tail CSR reads while the send queue is full
+    pub(crate) tail_sync_interval_us: u64,
+    /// Write the head registers through a write-combined mapping
+    pub(crate) write_combining: bool,
+}
+
+impl Default for DoorbellConfig {
+    fn default() -> Self {
+        Self {
+            batch: 1,
+            max_delay_us: 5,
+            tail_sync_interval_us: 1,
+            write_combining: false,
+        }
+    }
+}
+
+/// Coalescing of the ACK frames of the `AckResponder`, for example:
+///
+/// ```toml
+/// [ack_coalesce]
+/// max_acks = 16
+/// max_delay_us = 5
+/// ```
+///
+/// Consecutive ACKs of a QP are merged into one cumulative ACK of the highest PSN. The ACK is
+/// sent once `max_acks` ACKs are merged, once the first of them has waited for
+/// `max_delay_us`, or once the responder runs out of work. NAKs are never delayed. A
+/// `max_acks` of 1 sends every ACK.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct AckCoalesceConfig {
+    /// Maximum number of ACKs of a QP merged into one frame
+    pub(crate) max_acks: u32,
+    /// Maximum time in microseconds the first merged ACK waits for its frame
+    pub(crate) max_delay_us: u64,
+}
+
+impl Default for AckCoalesceConfig {
+    fn default() -> Self {
+        Self {
+            max_acks: 16,
+            max_delay_us: 5,
+        }
+    }
+}
+
+/// Merging of consecutive small RDMA writes of a QP by the `RdmaWriteWorker`, for example:
+///
+/// ```toml
+/// [write_coalesce]
+/// enabled = true
+/// max_bytes = 4096
+/// max_delay_us = 2
+/// ```
+///
+/// An unsignaled RDMA write without flags whose local and remote ranges follow those of the
+/// previous write of the QP is merged into it, up to `max_bytes`, so that the writes share
+/// descriptors and packets. The merged write is posted once a WR doesn't extend it, once the
+/// first merged write has waited for `max_delay_us`, or once the worker runs out of work.
+/// The writes of QPs in direct doorbell mode are never merged.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct WriteCoalesceConfig {
+    /// Merge the writes
+    pub(crate) enabled: bool,
+    /// Maximum length of a merged write
+    pub(crate) max_bytes: u32,
+    /// Maximum time in microseconds the first merged write waits for the following ones
+    pub(crate) max_delay_us: u64,
+}
+
+impl Default for WriteCoalesceConfig {
+    fn default() -> Self {
+        Self {
+            enabled: false,
+            max_bytes: 4096,
+            max_delay_us: 2,
+        }
+    }
+}
+
+/// Go-back-N retransmission of a QP after an ACK timeout, for example:
+///
+/// ```toml
+/// [retransmit]
+/// window = 256
+/// min_window = 16
+/// min_hold_us = 10
+/// ```
+///
+/// At most `window` retransmitted packets of a QP are unacknowledged at a time, the following
+/// packets are retransmitted as the ACKs advance the base PSN. The window halves with each
+/// timeout without an ACK in between, down to `min_window`.
+///
+/// The NAKs of the packets received after a hole all report the hole. A PSN retransmitted for
+/// a NAK is not retransmitted again for the following NAKs until the smoothed RTT of the QP,
+/// and at least `min_hold_us`, has passed.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct RetransmitConfig {
+    /// Maximum number of unacknowledged retransmitted packets
+    pub(crate) window: u32,
+    /// Window after successive timeouts
+    pub(crate) min_window: u32,
+    /// Minimum time in microseconds the NAKs of a retransmitted PSN are ignored
+    pub(crate) min_hold_us: u64,
+}
+
+impl Default for RetransmitConfig {
+    fn default() -> Self {
+        Self {
+            window: 256,
+            min_window: 16,
+            min_hold_us: 10,
+        }
+    }
+}
+
+impl RetransmitConfig {
+    /// Returns the window after `timeouts` successive timeouts, at least one packet
+    pub(crate) fn window_after(&self, timeouts: u32) -> u32 {
+        self.window
+            .checked_shr(timeouts)
+            .unwrap_or(0)
+            .max(self.min_window.min(self.window))
+            .max(1)
+    }
+}
+
+/// Rendezvous of the large sends, for example:
+///
+/// ```toml
+/// [rendezvous]
+/// enabled = true
+/// threshold = 65536
+/// ```
+///
+/// A send of at least `threshold` bytes is not written to the receive WR by the sender. The
+/// sender hands the address of its buffer to the receiver over the post receive channel, and
+/// the receiver pulls the message into the receive WR with an RDMA read. The send completes
+/// once the read response is acknowledged. The send buffers must be registered with remote
+/// read access. Only used with the TCP post receive channels and driver served RDMA reads.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct RendezvousConfig {
+    /// Pull the large sends
+    pub(crate) enabled: bool,
+    /// Minimum length in bytes of a pulled send
+    pub(crate) threshold: u32,
+}
+
+impl Default for RendezvousConfig {
+    fn default() -> Self {
+        Self {
+            enabled: false,
+            threshold: 65536,
+        }
+    }
+}
+
+impl RendezvousConfig {
+    /// Returns `true` if a send of `length` bytes is pulled by the receiver
+    pub(crate) fn applies(&self, length: u32) -> bool {
+        self.enabled && length >= self.threshold
+    }
+}
+
+/// ECMP multipath of the QPs, for example:
+///
+/// ```toml
+/// [multipath]
+/// enabled = true
+/// paths = 8
+/// flowlet_gap_us = 50
+/// ```
+///
+/// Each QP is given a set of `paths` UDP source ports, which the switches hash onto different
+/// paths. A post following `flowlet_gap_us` microseconds without any post to the QP starts a
+/// new flowlet on the next port of the set. The source port is part of the QP context, so it
+/// changes per flowlet rather than per chunk.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct MultipathConfig {
+    /// Move the QPs to another path on each flowlet
+    pub(crate) enabled: bool,
+    /// Number of UDP source ports of each QP
+    pub(crate) paths: u32,
+    /// Idle time in microseconds ending a flowlet
+    pub(crate) flowlet_gap_us: u64,
+}
+
+impl Default for MultipathConfig {
+    fn default() -> Self {
+        Self {
+            enabled: false,
+            paths: 8,
+            flowlet_gap_us: 50,
+        }
+    }
+}
+
+/// Meta report interrupts, for example:
+///
+/// ```toml
+/// [interrupt]
+/// enabled = true
+/// moderation_us = 20
+/// steering = true
+/// ```
+///
+/// Needs the kernel module loaded with `msix=1`. A `MetaWorker` polls while the reports keep
+/// coming, and once its poll policy parks it, it arms the MSI-X vectors of its channels and
+/// sleeps until an interrupt. A worker woken within `moderation_us` microseconds of its
+/// previous wakeup sleeps the rest of the period first, so that the reports of a burst are
+/// taken in one pass.
+///
+/// With `steering`, the vectors of the channels of a `MetaWorker` pinned to a single core are
+/// steered to that core. On kernels with TPH support the card then tags the meta report writes
+/// with the steering tag of the core, and they land in its cache.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct InterruptConfig {
+    /// Wait for interrupts instead of the park timeout of the poll policy
+    pub(crate) enabled: bool,
+    /// Minimum time in microseconds between two wakeups by an interrupt
+    pub(crate) moderation_us: u64,
+    /// Steer the interrupts and the meta report writes to the cores of the workers
+    pub(crate) steering: bool,
+}
+
+impl Default for InterruptConfig {
+    fn default() -> Self {
+        Self {
+            enabled: false,
+            moderation_us: 0,
+            steering: false,
+        }
+    }
+}
+
+/// DCQCN congestion control of the send path, for example:
+///
+/// ```toml
+/// [congestion]
+/// enabled = true
+/// line_rate_mbps = 100000
+/// min_rate_mbps = 100
+/// alpha_update_us = 55
+/// rate_increase_us = 300
+/// byte_counter = 10485760
+/// fast_recovery_stages = 5
+/// ai_rate_mbps = 40
+/// hai_rate_mbps = 400
+/// burst_bytes = 65536
+/// ```
+///
+/// Chunks are sent ECN capable, and a QP reported by a CNP is paced by the `SendWorker` until
+/// its rate recovers to `line_rate_mbps`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct CongestionConfig {
+    /// React to CNPs and mark the chunks ECN capable
+    pub(crate) enabled: bool,
+    /// Rate of a QP that is not paced
+    pub(crate) line_rate_mbps: u64,
+    /// Lowest rate a QP is cut to
+    pub(crate) min_rate_mbps: u64,
+    /// Period in microseconds of the alpha decay while no CNP arrives
+    pub(crate) alpha_update_us: u64,
+    /// Period in microseconds of the rate increase timer
+    pub(crate) rate_increase_us: u64,
+    /// Number of bytes sent between two byte counter rate increases
+    pub(crate) byte_counter: u64,
+    /// Number of fast recovery stages before the additive increase
+    pub(crate) fast_recovery_stages: u32,
+    /// Target rate increase of the additive increase stage
+    pub(crate) ai_rate_mbps: u64,
+    /// Target rate increase of the hyper increase stage
+    pub(crate) hai_rate_mbps: u64,
+    /// Capacity of the token bucket of a paced QP
+    pub(crate) burst_bytes: u64,
+}
+
+impl Default for CongestionConfig {
+    fn default() -> Self {
+        Self {
+            enabled: true,
+            line_rate_mbps: 100_000,
+            min_rate_mbps: 100,
+            alpha_update_us: 55,
+            rate_increase_us: 300,
+            byte_counter: 10 << 20,
+            fast_recovery_stages: 5,
+            ai_rate_mbps: 40,
+            hai_rate_mbps: 400,
+            burst_bytes: 64 << 10,
+        }
+    }
+}
+
+/// Memory region registration cache, for example:
+///
+/// ```toml
+/// [mr_cache]
+/// capacity = 1024
+/// ```
+#[derive(Debug, Default, Clone, Copy, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct MrCacheConfig {
+    /// Maximum number of deregistered MRs kept for reuse, 0 disables the cache
+    pub(crate) capacity: usize,
+}
+
+/// Contexts of the dynamically connected QPs, for example:
+///
+/// ```toml
+/// [dc]
+/// contexts = 8
+/// ```
+///
+/// A DC QP connects a context to each remote DC QP it posts to, and the remote driver
+/// connects a context for it in return. Each end holds at most `contexts` contexts of each
+/// kind, the least recently used idle context is reused for a new peer.
+#[derive(Debug, Default, Clone, Copy, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct DcConfig {
+    /// Maximum number of contexts of a DC QP, 0 selects `DEFAULT_DC_CONTEXTS`
+    pub(crate) contexts: usize,
+}
+
+impl DcConfig {
+    pub(crate) fn contexts(&self) -> usize {
+        if self.contexts == 0 {
+            DEFAULT_DC_CONTEXTS
+        } else {
+            self.contexts
+        }
+    }
+}
+
+/// Bonding of a second card with the card of the device, for example:
+///
+/// ```toml
+/// [bond]
+/// secondary = 1
+/// stripe_min_bytes = 1048576
+/// ```
+///
+/// `secondary` is the index of the second card, `1` for `bluerdma1`. The middle chunks of the
+/// RDMA writes of at least `stripe_min_bytes` alternate between the two cards, the first and
+/// the last chunk are sent through the card of the device. The peer must be bonded as well, its
+/// second card keeping the host part of its address on the subnet of the second card.
+#[derive(Debug, Default, Clone, Copy, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct BondConfig {
+    /// Index of the second card, `None` disables bonding
+    pub(crate) secondary: Option<usize>,
+    /// Minimum length of the striped WRs, 0 selects `DEFAULT_BOND_STRIPE_MIN_BYTES`
+    pub(crate) stripe_min_bytes: u32,
+}
+
+impl BondConfig {
+    pub(crate) fn stripe_min_bytes(&self) -> u32 {
+        if self.stripe_min_bytes == 0 {
+            DEFAULT_BOND_STRIPE_MIN_BYTES
+        } else {
+            self.stripe_min_bytes
+        }
+    }
+}
+
+/// Striping of the large RDMA writes of a QP over the send channels of the card, for example:
+///
+/// ```toml
+/// [stripe]
+/// enabled = true
+/// min_bytes = 1048576
+/// channels = 4
+/// ```
+///
+/// The chunks of a QP are otherwise all sent through the channel the QP is assigned to. The
+/// middle chunks of the RDMA writes of at least `min_bytes` go round `channels` send channels
+/// from the channel of the QP, 0 for all the channels not dedicated to a thread domain. The
+/// receiver takes the chunks of a QP in any order, the peer needs no setting. QPs posting
+/// through the direct doorbell, pinned to a thread domain or paced are not striped.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct StripeConfig {
+    /// Spread the middle chunks of the large RDMA writes over the channels
+    pub(crate) enabled: bool,
+    /// Minimum length of the striped WRs, 0 selects `DEFAULT_STRIPE_MIN_BYTES`
+    pub(crate) min_bytes: u32,
+    /// Number of channels of the stripes, 0 for all of them
+    pub(crate) channels: usize,
+}
+
+impl StripeConfig {
+    pub(crate) fn min_bytes(&self) -> u32 {
+        if self.min_bytes == 0 {
+            DEFAULT_STRIPE_MIN_BYTES
+        } else {
+            self.min_bytes
+        }
+    }
+}
+
+/// Copy of the small sends from registered buffers, for example:
+///
+/// ```toml
+/// [send_path]
+/// auto_copy = true
+/// copy_max = 1024
+/// ```
+///
+/// A send from registered buffers is otherwise read by the card, a copied send is written to
+/// a slot of the bounce buffer like an inline send, which saves the card a round trip over
+/// PCIe. The sends of up to `copy_max` bytes are copied, up to the largest slot of the inline
+/// and staging slots. Without `copy_max`, the largest copied send is tuned when the device is
+/// opened against the round trip of a CSR read, see `dump_counters`. A QP with half of its
+/// send queue outstanding does not copy its sends.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct SendPathConfig {
+    /// Copy the small sends from registered buffers
+    pub(crate) auto_copy: bool,
+    /// Largest copied send, tuned at startup if not set
+    pub(crate) copy_max: Option<usize>,
+}
+
+/// Staging of two-sided sends from unregistered buffers, for example:
+///
+/// ```toml
+/// [staging]
+/// slots = 256
+/// ```
+///
+/// A send of up to 64KB from buffers that are not all registered is copied to a slot of the
+/// smallest size class from 64B to 64KB holding it. The slots are registered once with the
+/// inline bounce buffer and a slot is reused once the packets of its send are acknowledged.
+#[derive(Debug, Default, Clone, Copy, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct StagingConfig {
+    /// Number of slots of each size class, 0 disables staging
+    pub(crate) slots: usize,
+}
+
+/// Sharing of the device between the processes of a host, for example:
+///
+/// ```toml
+/// [partition]
+/// contexts = 4
+/// index = 1
+/// ```
+///
+/// The send and meta report channels, the QPNs, the MR keys and the page table entries are
+/// split in `contexts` shares, each opened context owns one of them. A context without
+/// `index` claims the first share no other process holds. Only a context opened while no
+/// other process holds a share resets the device.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct PartitionConfig {
+    /// Number of shares, 0 gives the whole device to a single context
+    pub(crate) contexts: usize,
+    /// Share owned by the context, the first free one if not set
+    pub(crate) index: Option<usize>,
+}
+
+impl PartitionConfig {
+    /// Returns the number of shares, at least one
+    pub(crate) fn contexts(&self) -> usize {
+        self.contexts.max(1)
+    }
+
+    /// Checks that the index is one of the shares and that the channels can be split
+    pub(crate) fn validate(&self) -> Result<(), ConfigError> {
+        let max = Mode::Mode400G.num_channel();
+        if self.contexts() > max {
+            return Err(ConfigError::InvalidValue(format!(
+                "partition.contexts = {}, expected at most {max}, the number of channels",
+                self.contexts
+            )));
+        }
+        if let Some(index) = self.index.filter(|&x| x >= self.contexts()) {
+            return Err(ConfigError::InvalidValue(format!(
+                "partition.index = {index}, expected less than {}",
+                self.contexts()
+            )));
+        }
+        Ok(())
+    }
+}
+
+/// CPU affinity of the driver worker threads, for example:
+///
+/// ```toml
+/// [affinity]
+/// default = [0, 1, 2, 3]
+///
+/// [affinity.workers]
+/// SendWorker0 = [4]
+/// MetaWorker = [5]
+/// ```
+#[derive(Debug, Default, Clone, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct AffinityConfig {
+    /// Core lists keyed by worker name
+    pub(crate) workers: HashMap<String, Vec<usize>>,
+    /// Cores of the workers without an entry, defaults to the cores local to the device
+    pub(crate) default: Option<Vec<usize>>,
 }
 
 impl DeviceConfig {
     pub(crate) fn ack(&self) -> AckTimeoutConfig {
         self.ack
     }
+
+    pub(crate) fn direct_doorbell(&self) -> bool {
+        self.direct_doorbell
+    }
+
+    pub(crate) fn poll(&self) -> PollPolicy {
+        self.poll
+    }
+
+    pub(crate) fn channel(&self) -> ChannelPolicy {
+        self.channel
+    }
+
+    pub(crate) fn affinity(&self) -> &AffinityConfig {
+        &self.affinity
+    }
+
+    pub(crate) fn mr_cache(&self) -> MrCacheConfig {
+        self.mr_cache
+    }
+
+    pub(crate) fn staging(&self) -> StagingConfig {
+        self.staging
+    }
+
+    pub(crate) fn doorbell(&self) -> DoorbellConfig {
+        self.doorbell
+    }
+
+    pub(crate) fn ack_coalesce(&self) -> AckCoalesceConfig {
+        self.ack_coalesce
+    }
+
+    pub(crate) fn write_coalesce(&self) -> WriteCoalesceConfig {
+        self.write_coalesce
+    }
+
+    pub(crate) fn retransmit(&self) -> RetransmitConfig {
+        self.retransmit
+    }
+
+    pub(crate) fn rendezvous(&self) -> RendezvousConfig {
+        self.rendezvous
+    }
+
+    pub(crate) fn rings(&self) -> RingConfig {
+        self.rings
+    }
+
+    pub(crate) fn simple_nic(&self) -> SimpleNicConfig {
+        self.simple_nic
+    }
+
+    pub(crate) fn chunk(&self) -> ChunkConfig {
+        self.chunk
+    }
+
+    pub(crate) fn in_band_recv(&self) -> bool {
+        self.in_band_recv
+    }
+
+    pub(crate) fn recv_stride(&self) -> u32 {
+        self.recv_stride
+    }
+
+    pub(crate) fn congestion(&self) -> CongestionConfig {
+        self.congestion
+    }
+
+    pub(crate) fn multipath(&self) -> MultipathConfig {
+        self.multipath
+    }
+
+    pub(crate) fn interrupt(&self) -> InterruptConfig {
+        self.interrupt
+    }
+
+    pub(crate) fn range_retransmit(&self) -> bool {
+        self.range_retransmit
+    }
+
+    pub(crate) fn fused_pipeline(&self) -> bool {
+        self.fused_pipeline
+    }
+
+    pub(crate) fn meta_worker_per_channel(&self) -> bool {
+        self.meta_worker_per_channel
+    }
+
+    pub(crate) fn worker_shards(&self) -> usize {
+        self.worker_shards.max(1)
+    }
+
+    pub(crate) fn max_qp(&self) -> usize {
+        if self.max_qp == 0 {
+            DEFAULT_MAX_QP
+        } else {
+            self.max_qp
+        }
+    }
+
+    pub(crate) fn psn_window(&self) -> usize {
+        if self.psn_window == 0 {
+            DEFAULT_PSN_WINDOW
+        } else {
+            self.psn_window
+        }
+    }
+
+    pub(crate) fn partition(&self) -> PartitionConfig {
+        self.partition
+    }
+
+    pub(crate) fn resident(&self) -> bool {
+        self.resident
+    }
+
+    pub(crate) fn snapshot_dir(&self) -> Option<&str> {
+        self.snapshot_dir.as_deref()
+    }
+
+    pub(crate) fn native_read(&self) -> bool {
+        self.native_read
+    }
+
+    pub(crate) fn loopback_copy(&self) -> bool {
+        self.loopback_copy
+    }
+
+    pub(crate) fn relaxed_completion(&self) -> bool {
+        self.relaxed_completion
+    }
+
+    pub(crate) fn dc(&self) -> DcConfig {
+        self.dc
+    }
+
+    pub(crate) fn bond(&self) -> BondConfig {
+        self.bond
+    }
+
+    pub(crate) fn stripe(&self) -> StripeConfig {
+        self.stripe
+    }
+
+    pub(crate) fn send_path(&self) -> SendPathConfig {
+        self.send_path
+    }
+
+    pub(crate) fn vfio_iommu(&self) -> bool {
+        self.vfio_iommu
+    }
+
+    pub(crate) fn kernel_pin(&self) -> bool {
+        self.kernel_pin
+    }
+
+    pub(crate) fn gpu_channels(&self) -> usize {
+        self.gpu_channels
+    }
+
+    /// Returns the maximum log level, `None` if it isn't set or not a level
+    pub(crate) fn log_level(&self) -> Option<LevelFilter> {
+        self.log_level
+            .as_deref()
+            .and_then(|level| level.parse().ok())
+    }
+
+    pub(crate) fn tunables(&self) -> Tunables {
+        Tunables {
+            ack: self.ack,
+            ack_coalesce: self.ack_coalesce,
+            congestion: self.congestion,
+            poll: self.poll,
+            log_level: self.log_level(),
+        }
+    }
+
+    /// Checks that the values are supported by the driver
+    pub(crate) fn validate(&self) -> Result<(), ConfigError> {
+        self.rings.validate()?;
+        self.simple_nic.validate()?;
+        self.chunk.validate()?;
+        self.partition.validate()?;
+        // The receive WR rings of every context would be registered with the one reserved key
+        if self.in_band_recv && self.partition.contexts() > 1 {
+            return Err(ConfigError::InvalidValue(
+                "in_band_recv requires partition.contexts = 1".into(),
+            ));
+        }
+        // The command queue of the second card is set up by the context opening the device
+        if self.bond.secondary.is_some() && self.partition.contexts() > 1 {
+            return Err(ConfigError::InvalidValue(
+                "bond.secondary requires partition.contexts = 1".into(),
+            ));
+        }
+        // The card bound to vfio-pci is not probed by the kernel module
+        if self.kernel_pin && self.vfio_iommu {
+            return Err(ConfigError::InvalidValue(
+                "kernel_pin can't be used with vfio_iommu".into(),
+            ));
+        }
+        let max = Mode::Mode400G.num_channel();
+        if self.gpu_channels >= max {
+            return Err(ConfigError::InvalidValue(format!(
+                "gpu_channels = {}, expected less than {max}, the number of channels",
+                self.gpu_channels
+            )));
+        }
+        if let Some(level) = self.log_level.as_deref() {
+            if level.parse::<LevelFilter>().is_err() {
+                return Err(ConfigError::InvalidValue(format!(
+                    "log_level = {level}, expected off, error, warn, info, debug or trace"
+                )));
+            }
+        }
+        if self.max_qp > MAX_QP_CNT {
+            return Err(ConfigError::InvalidValue(format!(
+                "max_qp = {}, expected at most {MAX_QP_CNT}",
+                self.max_qp
+            )));
+        }
+        if self.psn_window > MAX_PSN_WINDOW {
+            return Err(ConfigError::InvalidValue(format!(
+                "psn_window = {}, expected at most {MAX_PSN_WINDOW}",
+                self.psn_window
+            )));
+        }
+        Ok(())
+    }
 }
 
 pub(crate) struct ConfigLoader;
@@ -34,6 +1166,11 @@ impl ConfigLoader {
         Self::load_from_path(DEFAULT_CONFIG_PATH)
     }
 
+    /// Returns the path `load_default` reads
+    pub(crate) fn default_path() -> &'static str {
+        DEFAULT_CONFIG_PATH
+    }
+
     /// Loads the configuration from the specified path.
     pub(crate) fn load_from_path(path: &str) -> Result<DeviceConfig, ConfigError> {
         let Ok(content) = std::fs::read_to_string(path) else {
@@ -41,6 +1178,7 @@ impl ConfigLoader {
             return Ok(DeviceConfig::default());
         };
         let config: DeviceConfig = toml::from_str(&content)?;
+        config.validate()?;
         Ok(config)
     }
 }
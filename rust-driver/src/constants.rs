@@ -6,31 +6,106 @@ pub(crate) const MAX_PSN_SIZE_BITS: usize = 24;
 pub(crate) const MAX_PSN_WINDOW: usize = 1 << (MAX_PSN_SIZE_BITS - 1);
 /// Bit mask used to extract the PSN value from a 32-bit number.
 pub(crate) const PSN_MASK: u32 = (1 << MAX_PSN_SIZE_BITS) - 1;
+/// PSNs tracked past the base PSN of each direction of a QP if the configuration sets none
+pub(crate) const DEFAULT_PSN_WINDOW: usize = 4096;
 
 /// Maximum number of bits used to represent a MSN.
 pub(crate) const MAX_MSN_SIZE_BITS: usize = 16;
 /// Maximum size of the PSN window. This represents the maximum number outstanding PSNs.
 pub(crate) const MAX_MSN_WINDOW: usize = 1 << (MAX_MSN_SIZE_BITS - 1);
 
-pub(crate) const MAX_QP_CNT: usize = 1024;
 pub(crate) const QPN_KEY_PART_WIDTH: u32 = 8;
+/// Upper bound of the QP index space, a QPN carried in a BTH is 24 bits wide
+pub(crate) const MAX_QP_CNT: usize = 1 << (24 - QPN_KEY_PART_WIDTH);
+/// Number of QPs of a device if the configuration sets no limit
+pub(crate) const DEFAULT_MAX_QP: usize = 1024;
+/// Number of contexts of a DC QP if the configuration sets no limit
+pub(crate) const DEFAULT_DC_CONTEXTS: usize = 8;
+/// Minimum length of the WRs striped across bonded cards if the configuration sets none
+pub(crate) const DEFAULT_BOND_STRIPE_MIN_BYTES: u32 = 1 << 20;
+/// Minimum length of the WRs striped over the send channels if the configuration sets none
+pub(crate) const DEFAULT_STRIPE_MIN_BYTES: u32 = 1 << 20;
 pub(crate) const QPN_IDX_PART_WIDTH: u32 = 32 - QPN_KEY_PART_WIDTH;
 
 pub(crate) const MAX_CQ_CNT: usize = 1024;
+/// Maximum number of entries in a single CQ
+pub(crate) const MAX_CQE: usize = 4096;
+/// Minimum number of entries allocated for a CQ, smaller requests are rounded up
+pub(crate) const MIN_CQE: usize = 64;
+
+/// Maximum number of shared receive queues
+pub(crate) const MAX_SRQ_CNT: usize = 256;
+/// Maximum number of outstanding WRs of a single SRQ
+pub(crate) const MAX_SRQ_WR: usize = 0x8000;
+/// Maximum number of WRs of a SRQ advertised to the peer of each attached QP
+pub(crate) const SRQ_QP_WINDOW: usize = 4;
+
+/// Number of times a command waiter spins on an empty response queue before yielding
+pub(crate) const CMD_WAIT_SPIN_COUNT: usize = 1024;
+
+/// Memory regions of at least this size are pinned and translated by multiple threads
+pub(crate) const PARALLEL_REG_MIN_BYTES: usize = 1 << 30;
+/// Size of the slice of a memory region pinned and translated by a registration worker at once
+pub(crate) const REG_SLICE_BYTES: usize = 256 << 20;
+/// Maximum number of registration worker threads
+pub(crate) const MAX_REG_WORKERS: usize = 8;
+/// Maximum number of deregistered memory regions waiting for their invalidation to complete
+pub(crate) const MAX_DEFERRED_DEREG: usize = 64;
+
+/// Maximum number of descriptors drained from a meta report queue at once
+pub(crate) const META_REPORT_BURST: usize = 32;
 
 /// Maximum number of outstanding send work requests (WRs) that can be posted to a Queue Pair (QP).
 pub(crate) const MAX_SEND_WR: usize = 0x8000;
+/// Maximum number of WRs staged for the `RdmaWriteWorker` at once, the WRs past it are boxed
+pub(crate) const MAX_STAGED_WR: usize = 4096;
+/// Number of receive WRs of the remote end a QP buffers before the posting thread takes them,
+/// the WRs past it are handed over under the lock of the queue
+pub(crate) const RECV_WR_RING_LEN: usize = 1024;
 
 pub(crate) const TEST_CARD_IP_ADDRESS: u32 = 0x1122_330A;
 
-// TODO: implement ARP MAC resolution
+/// MAC address of the card, also used as the peer MAC address until the neighbour table
+/// resolves the next hop
 pub(crate) const CARD_MAC_ADDRESS: u64 = 0xAABB_CCDD_EE0A;
 pub(crate) const CARD_MAC_ADDRESS_OCTETS: [u8; 6] = [0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0x0A];
 
 pub(crate) const MAX_PD_CNT: usize = 256;
 
-/// (Max) size of a single WR chunk
+/// Maximum number of scatter-gather elements in a single work request
+pub(crate) const MAX_SGE: usize = 8;
+
+/// Maximum payload in bytes of a send WR posted with `IBV_SEND_INLINE`
+pub(crate) const MAX_INLINE_DATA: usize = 256;
+/// Number of slots of the bounce buffer holding inline payloads
+pub(crate) const INLINE_SLOTS: usize = 4096;
+/// Slot sizes of the staging classes of the bounce buffer, holding the payloads of sends from
+/// unregistered buffers
+pub(crate) const STAGING_SLOT_SIZES: [usize; 6] = [64, 256, 1 << 10, 4 << 10, 16 << 10, 64 << 10];
+
+/// Size of a frame slot of the simple NIC buffers if the configuration sets none
+pub(crate) const DEFAULT_SIMPLE_NIC_SLOT_SIZE: usize = 128;
+/// Smallest frame slot of the simple NIC buffers
+pub(crate) const MIN_SIMPLE_NIC_SLOT_SIZE: usize = 128;
+/// Largest frame slot of the simple NIC buffers, holds a jumbo frame
+pub(crate) const MAX_SIMPLE_NIC_SLOT_SIZE: usize = 16 << 10;
+/// Largest MTU of the simple NIC and of the netdev, a jumbo frame
+pub(crate) const SIMPLE_NIC_MAX_MTU: usize = 9000;
+/// Bytes of the Ethernet header of a frame sent by the simple NIC, which the MTU excludes
+pub(crate) const ETH_HEADER_LEN: usize = 14;
+/// Smallest MTU of a netdev, as in the kernel
+pub(crate) const ETH_MIN_MTU: usize = 68;
+
+/// Default size of a single WR chunk
 pub(crate) const WR_CHUNK_SIZE: u32 = 0x10000;
+/// Smallest size of a WR chunk, the largest PMTU
+pub(crate) const MIN_WR_CHUNK_SIZE: u32 = 0x1000;
+/// Backlog difference between send channels above which a quiescent QP is moved to the least
+/// loaded channel
+pub(crate) const SEND_CHANNEL_REBALANCE_THRESHOLD: usize = 64;
+/// Number of consecutive pushes of quiescent QPs finding every send channel empty before the
+/// last active channel is retired
+pub(crate) const SEND_CHANNEL_SCALE_DOWN_IDLE_PUSHES: u32 = 1024;
 
 /// Ack timeout config
 pub(crate) const DEFAULT_INIT_RETRY_COUNT: usize = 5;
@@ -40,18 +115,36 @@ pub(crate) const DEFAULT_LOCAL_ACK_TIMEOUT: u8 = 50;
 pub(crate) const POST_RECV_TCP_LOOP_BACK_SERVER_ADDRESS: Ipv4Addr = Ipv4Addr::new(127, 0, 0, 1);
 pub(crate) const POST_RECV_TCP_LOOP_BACK_CLIENT_ADDRESS: Ipv4Addr = Ipv4Addr::new(127, 0, 0, 2);
 
-pub(crate) const BLUE_RDMA_SYSFS_PATH: &str = "/sys/class/infiniband/bluerdma0";
-pub(crate) const BLUE_RDMA_NETDEV_INTERFACE_NAME: &str = "blue0";
+/// Name of the IB device of a card without its index, the card `N` is `bluerdmaN`
+pub(crate) const BLUE_RDMA_IBDEV_NAME_PREFIX: &str = "bluerdma";
+pub(crate) const BLUE_RDMA_SYSFS_CLASS_PATH: &str = "/sys/class/infiniband";
+/// Netdev of a card without its index, the card `N` is `blueN`
+pub(crate) const BLUE_RDMA_NETDEV_INTERFACE_PREFIX: &str = "blue";
+/// Directory of the uverbs char devices, each links to the IB device it belongs to
+pub(crate) const UVERBS_SYSFS_CLASS_PATH: &str = "/sys/class/infiniband_verbs";
+/// Directory of the uverbs char devices
+pub(crate) const UVERBS_DEV_PATH: &str = "/dev/infiniband";
 
-pub(crate) const U_DMA_BUF_CLASS_PATH: &str = "/sys/class/u-dma-buf/udmabuf0";
+/// Directory of the u-dma-bufs reserved by the kernel module, the region `N` is `udmabufN`
+pub(crate) const U_DMA_BUF_CLASS_PATH: &str = "/sys/class/u-dma-buf";
 
 pub(crate) const PAGE_SIZE_2MB: usize = 1 << 21;
 
 pub(crate) const MAX_MR_CNT: usize = 8192;
 pub(crate) const LR_KEY_KEY_PART_WIDTH: u32 = 8;
 pub(crate) const LR_KEY_IDX_PART_WIDTH: u32 = 32 - LR_KEY_KEY_PART_WIDTH;
+/// Key of the memory region holding the in-band receive WR rings, reserved on every device so
+/// that the peer addresses the rings without a key exchange
+pub(crate) const RECV_RING_MR_KEY: u32 = ((MAX_MR_CNT - 1) as u32) << LR_KEY_KEY_PART_WIDTH;
+/// Device address of the in-band receive WR rings
+pub(crate) const RECV_RING_IOVA: u64 = 0x7f00_0000_0000;
+/// Number of slots of the in-band receive WR ring of each QP
+pub(crate) const RECV_RING_DEPTH: usize = 64;
 /// Maximum number of entries in the secodn stage table
 pub(crate) const PGT_LEN: usize = 0x20000;
+/// Bytes of the device memory of a context, a single huge page so that it stays physically
+/// contiguous
+pub(crate) const DM_ARENA_SIZE: usize = PAGE_SIZE_2MB;
 
 pub(crate) const VENDER_ID: u16 = 0x1172;
 pub(crate) const DEVICE_ID: u16 = 0x0000;
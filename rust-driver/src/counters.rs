@@ -0,0 +1,240 @@
+use std::{
+    fmt, iter,
+    sync::atomic::{AtomicU64, AtomicUsize, Ordering},
+};
+
+use crate::rdma_utils::qp::qpn_to_index;
+
+/// Number of per-thread slots of the device counters, threads beyond it share slots
+const NUM_THREAD_SLOTS: usize = 16;
+
+/// Number of counters of `Counter`
+pub(crate) const NUM_COUNTERS: usize = 10;
+
+/// A counter of the driver, the discriminant is the index read by `ibv_read_counters`
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum Counter {
+    /// Packets written to the send rings, including retransmissions
+    TxPackets,
+    /// Payload bytes written to the send rings, including retransmissions
+    TxBytes,
+    /// Packets handed to the send rings again after a NAK or an ACK timeout
+    Retransmits,
+    /// NAKs reported by the hardware or received from the remote end
+    NaksReceived,
+    /// ACK timeouts of the transport timer
+    Timeouts,
+    /// Sends queued because the remote end had no receive WR posted
+    RnrEvents,
+    /// Completions dropped because their CQ was full
+    CqOverruns,
+    /// Writes rejected by a full send ring, each stalls the send worker until the tail moves
+    RingFullStalls,
+    /// Payload bytes handed to the send rings again after a NAK or an ACK timeout
+    RetransmitBytes,
+    /// PSNs acknowledged or received beyond the tracking window of their QP, dropped
+    PsnWindowDrops,
+}
+
+impl Counter {
+    /// All counters, in the order read by `ibv_read_counters`
+    pub(crate) const ALL: [Counter; NUM_COUNTERS] = [
+        Counter::TxPackets,
+        Counter::TxBytes,
+        Counter::Retransmits,
+        Counter::NaksReceived,
+        Counter::Timeouts,
+        Counter::RnrEvents,
+        Counter::CqOverruns,
+        Counter::RingFullStalls,
+        Counter::RetransmitBytes,
+        Counter::PsnWindowDrops,
+    ];
+
+    /// Returns the name of the counter in the text dump
+    pub(crate) fn name(self) -> &'static str {
+        match self {
+            Counter::TxPackets => "tx_packets",
+            Counter::TxBytes => "tx_bytes",
+            Counter::Retransmits => "retransmits",
+            Counter::NaksReceived => "naks_received",
+            Counter::Timeouts => "timeouts",
+            Counter::RnrEvents => "rnr_events",
+            Counter::CqOverruns => "cq_overruns",
+            Counter::RingFullStalls => "ring_full_stalls",
+            Counter::RetransmitBytes => "retransmit_bytes",
+            Counter::PsnWindowDrops => "psn_window_drops",
+        }
+    }
+}
+
+/// The counters of one thread or of one QP, alone in its cache line
+#[repr(align(64))]
+#[derive(Debug, Default)]
+struct CounterSlot([AtomicU64; NUM_COUNTERS]);
+
+impl CounterSlot {
+    fn add(&self, counter: Counter, value: u64) {
+        if let Some(x) = self.0.get(counter as usize) {
+            let _prev = x.fetch_add(value, Ordering::Relaxed);
+        }
+    }
+
+    fn read(&self) -> [u64; NUM_COUNTERS] {
+        let mut values = [0; NUM_COUNTERS];
+        for (value, x) in values.iter_mut().zip(&self.0) {
+            *value = x.load(Ordering::Relaxed);
+        }
+        values
+    }
+
+    fn reset(&self) {
+        for x in &self.0 {
+            x.store(0, Ordering::Relaxed);
+        }
+    }
+}
+
+/// Returns the per-thread slot of the calling thread
+fn thread_slot() -> usize {
+    /// Slot of the next thread that counts
+    static NEXT_SLOT: AtomicUsize = AtomicUsize::new(0);
+    thread_local! {
+        static SLOT: usize = NEXT_SLOT.fetch_add(1, Ordering::Relaxed) % NUM_THREAD_SLOTS;
+    }
+    SLOT.with(|x| *x)
+}
+
+/// Per-device and per-QP counters of the driver.
+///
+/// Device counters are kept in per-thread slots so that the workers never write to the same
+/// cache line, they are summed on read. Counters of a QP are kept in a slot of their own,
+/// reset when the QPN is reused.
+#[derive(Debug)]
+pub(crate) struct DeviceCounters {
+    /// Device counters of each thread
+    threads: Box<[CounterSlot]>,
+    /// Counters of each QP, indexed by `qpn_to_index`
+    qps: Box<[CounterSlot]>,
+}
+
+impl DeviceCounters {
+    /// Creates the counters of a device with up to `max_qp` QPs
+    pub(crate) fn new(max_qp: usize) -> Self {
+        Self {
+            threads: iter::repeat_with(CounterSlot::default)
+                .take(NUM_THREAD_SLOTS)
+                .collect(),
+            qps: iter::repeat_with(CounterSlot::default)
+                .take(max_qp)
+                .collect(),
+        }
+    }
+
+    /// Adds `value` to the counter of the device and of `qpn`
+    pub(crate) fn add(&self, qpn: u32, counter: Counter, value: u64) {
+        self.add_device(counter, value);
+        if let Some(qp) = self.qps.get(qpn_to_index(qpn)) {
+            qp.add(counter, value);
+        }
+    }
+
+    /// Adds `value` to the counter of the device only
+    pub(crate) fn add_device(&self, counter: Counter, value: u64) {
+        if let Some(slot) = self.threads.get(thread_slot()) {
+            slot.add(counter, value);
+        }
+    }
+
+    /// Returns the device counters, in the order of `Counter::ALL`
+    pub(crate) fn read(&self) -> [u64; NUM_COUNTERS] {
+        self.threads
+            .iter()
+            .fold([0; NUM_COUNTERS], |mut sum, slot| {
+                for (x, value) in sum.iter_mut().zip(slot.read()) {
+                    *x = x.wrapping_add(value);
+                }
+                sum
+            })
+    }
+
+    /// Returns the counters of `qpn`, in the order of `Counter::ALL`
+    pub(crate) fn read_qp(&self, qpn: u32) -> Option<[u64; NUM_COUNTERS]> {
+        self.qps.get(qpn_to_index(qpn)).map(CounterSlot::read)
+    }
+
+    /// Clears the counters of a newly created QP
+    pub(crate) fn reset_qp(&self, qpn: u32) {
+        if let Some(qp) = self.qps.get(qpn_to_index(qpn)) {
+            qp.reset();
+        }
+    }
+}
+
+/// Dumps the counters as `<name> <value>` lines, device counters first and then the counters
+/// of each QP that counted anything as `qp<index>/<name> <value>`
+impl fmt::Display for DeviceCounters {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        for (counter, value) in Counter::ALL.into_iter().zip(self.read()) {
+            writeln!(f, "{} {value}", counter.name())?;
+        }
+        for (index, qp) in self.qps.iter().enumerate() {
+            let values = qp.read();
+            if values.iter().all(|x| *x == 0) {
+                continue;
+            }
+            for (counter, value) in Counter::ALL.into_iter().zip(values) {
+                writeln!(f, "qp{index}/{} {value}", counter.name())?;
+            }
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{sync::Arc, thread};
+
+    use super::*;
+
+    #[test]
+    fn counters_sum_threads_and_track_qps() {
+        let counters = Arc::new(DeviceCounters::new(4));
+        let handles: Vec<_> = (0..NUM_THREAD_SLOTS + 2)
+            .map(|_| {
+                let counters = Arc::clone(&counters);
+                thread::spawn(move || {
+                    counters.add(1 << 8, Counter::TxPackets, 2);
+                    counters.add_device(Counter::RingFullStalls, 1);
+                })
+            })
+            .collect();
+        for handle in handles {
+            handle.join().unwrap();
+        }
+        let threads = (NUM_THREAD_SLOTS + 2) as u64;
+        assert_eq!(counters.read(), [2 * threads, 0, 0, 0, 0, 0, 0, threads, 0]);
+        assert_eq!(
+            counters.read_qp(1 << 8).unwrap(),
+            [2 * threads, 0, 0, 0, 0, 0, 0, 0, 0]
+        );
+        // Out of range QPs only count for the device
+        counters.add(9 << 8, Counter::Timeouts, 1);
+        assert!(counters.read_qp(9 << 8).is_none());
+        assert_eq!(counters.read(), [2 * threads, 0, 0, 0, 1, 0, 0, threads, 0]);
+
+        counters.reset_qp(1 << 8);
+        assert_eq!(counters.read_qp(1 << 8).unwrap(), [0; NUM_COUNTERS]);
+    }
+
+    #[test]
+    fn dump_lists_device_and_active_qps() {
+        let counters = DeviceCounters::new(4);
+        counters.add(2 << 8, Counter::NaksReceived, 3);
+        let dump = counters.to_string();
+        assert!(dump.starts_with("tx_packets 0\n"));
+        assert!(dump.contains("\nnaks_received 3\n"));
+        assert!(dump.contains("\nqp2/naks_received 3\n"));
+        assert!(!dump.contains("qp1/"));
+    }
+}
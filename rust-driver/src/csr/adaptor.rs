@@ -26,6 +26,23 @@ pub(crate) trait DeviceAdaptor: Clone {
     ///
     /// Returns `Ok(())` on successful write, or an error if the write operation fails
     fn write_csr(&self, addr: usize, data: u32) -> io::Result<()>;
+
+    /// Writes the head pointer register of a host to card ring buffer.
+    ///
+    /// Adaptors may post the write through a write-combined mapping, the write is flushed to
+    /// the device before returning.
+    fn write_doorbell(&self, addr: usize, data: u32) -> io::Result<()> {
+        self.write_csr(addr, data)
+    }
+
+    /// Reads the CSRs at `addrs`, adaptors may pipeline the reads.
+    fn read_csrs<const N: usize>(&self, addrs: [usize; N]) -> io::Result<[u32; N]> {
+        let mut values = [0; N];
+        for (value, addr) in values.iter_mut().zip(addrs) {
+            *value = self.read_csr(addr)?;
+        }
+        Ok(values)
+    }
 }
 
 /// Trait for types that have ring buffer CSR addresses
@@ -76,7 +93,7 @@ where
     <T as DeviceProxy>::Device: DeviceAdaptor,
 {
     fn write_head(&self, data: u32) -> io::Result<()> {
-        self.device().write_csr(self.head(), data)
+        self.device().write_doorbell(self.head(), data)
     }
 
     fn read_tail(&self) -> io::Result<u32> {
@@ -105,8 +122,9 @@ where
 {
     #[allow(clippy::arithmetic_side_effects)]
     fn read_base_addr(&self) -> io::Result<u64> {
-        let lo = self.device().read_csr(self.base_addr_low())?;
-        let hi = self.device().read_csr(self.base_addr_high())?;
+        let [lo, hi] = self
+            .device()
+            .read_csrs([self.base_addr_low(), self.base_addr_high()])?;
         Ok(u64::from(lo) + (u64::from(hi) << 32))
     }
 
@@ -1,3 +1,5 @@
+mod shm;
+
 use std::{
     io,
     net::{SocketAddr, UdpSocket},
@@ -5,6 +7,7 @@ use std::{
 };
 
 use log::debug;
+use parking_lot::Mutex;
 use serde::{Deserialize, Serialize};
 
 use crate::csr::constants::{
@@ -12,6 +15,8 @@ use crate::csr::constants::{
     CSR_ADDR_CMD_RESP_QUEUE_ADDR_HIGH, CSR_ADDR_CMD_RESP_QUEUE_ADDR_LOW,
 };
 
+use shm::ShmMailbox;
+
 use super::{
     constants::{
         CSR_ADDR_CMD_REQ_QUEUE_HEAD, CSR_ADDR_CMD_REQ_QUEUE_TAIL, CSR_ADDR_CMD_RESP_QUEUE_HEAD,
@@ -20,8 +25,50 @@ use super::{
     CsrReaderAdaptor, CsrWriterAdaptor, DeviceAdaptor,
 };
 
+/// Environment variable selecting the transport of the simulator RPC, `binary` for
+/// [`RpcCodec::Binary`], `shm` for the shared memory mailbox, JSON otherwise
+const RPC_CODEC_ENV: &str = "BLUE_RDMA_SIM_RPC";
+
+/// Length in bytes of a binary CSR access record
+const RECORD_LEN: usize = 16;
+
+/// Maximum number of records in a binary datagram
+const MAX_BATCH: usize = 64;
+
+const RECORD_READ: u8 = 0;
+const RECORD_WRITE: u8 = 1;
+
+/// Wire format of the CSR accesses
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum RpcCodec {
+    /// One JSON `CsrAccessRpcMessage` per datagram, every read waits for its reply
+    Json,
+    /// Datagrams of up to `MAX_BATCH` fixed size records.
+    ///
+    /// A record is the opcode byte (0 for a read, 1 for a write), 3 reserved bytes, the
+    /// little-endian 32 bits value and the little-endian 64 bits address. Writes are queued
+    /// and sent with the next doorbell or read, in order. The simulator answers a datagram
+    /// containing reads with one datagram holding the read records, in order, with their
+    /// values filled in, and does not answer writes.
+    Binary,
+}
+
+impl RpcCodec {
+    fn from_env() -> Self {
+        match std::env::var(RPC_CODEC_ENV).as_deref() {
+            Ok("binary") => Self::Binary,
+            _ => Self::Json,
+        }
+    }
+}
+
 #[derive(Debug, Clone)]
-pub(super) struct RpcClient(Arc<UdpSocket>);
+pub(super) struct RpcClient {
+    socket: Arc<UdpSocket>,
+    codec: RpcCodec,
+    /// Records of the queued writes, only used by `RpcCodec::Binary`
+    pending: Arc<Mutex<Vec<u8>>>,
+}
 
 #[derive(Debug, Serialize, Deserialize)]
 struct CsrAccessRpcMessage {
@@ -30,15 +77,41 @@ struct CsrAccessRpcMessage {
     value: u32,
 }
 
+#[allow(clippy::as_conversions)]
+fn encode_record(buf: &mut Vec<u8>, op: u8, addr: usize, value: u32) {
+    buf.extend_from_slice(&[op, 0, 0, 0]);
+    buf.extend_from_slice(&value.to_le_bytes());
+    buf.extend_from_slice(&(addr as u64).to_le_bytes());
+}
+
+/// Decodes the address and value of a record
+#[allow(clippy::as_conversions)]
+fn decode_record(record: &[u8]) -> Option<(usize, u32)> {
+    let value = u32::from_le_bytes(record.get(4..8)?.try_into().ok()?);
+    let addr = u64::from_le_bytes(record.get(8..RECORD_LEN)?.try_into().ok()?);
+    Some((addr as usize, value))
+}
+
 impl RpcClient {
     pub(super) fn new(server_addr: SocketAddr) -> io::Result<Self> {
-        debug!("connect to: {server_addr}");
+        Self::with_codec(server_addr, RpcCodec::from_env())
+    }
+
+    fn with_codec(server_addr: SocketAddr, codec: RpcCodec) -> io::Result<Self> {
+        debug!("connect to: {server_addr}, codec: {codec:?}");
         let socket = UdpSocket::bind("0.0.0.0:0")?;
         socket.connect(server_addr)?;
-        Ok(Self(socket.into()))
+        Ok(Self {
+            socket: socket.into(),
+            codec,
+            pending: Arc::new(Mutex::new(Vec::with_capacity(MAX_BATCH * RECORD_LEN))),
+        })
     }
 
     pub(super) fn read_csr(&self, addr: usize) -> io::Result<u32> {
+        if self.codec == RpcCodec::Binary {
+            return self.read_csrs([addr]).map(|[value]| value);
+        }
         let msg = CsrAccessRpcMessage {
             is_write: false,
             addr,
@@ -47,10 +120,10 @@ impl RpcClient {
 
         debug!("send msg: {msg:?}");
         let send_buf = serde_json::to_vec(&msg)?;
-        let _: usize = self.0.send(&send_buf)?;
+        let _: usize = self.socket.send(&send_buf)?;
 
         let mut recv_buf = [0; 128];
-        let (recv_cnt, _addr) = self.0.recv_from(&mut recv_buf)?;
+        let (recv_cnt, _addr) = self.socket.recv_from(&mut recv_buf)?;
         // the length of CsrAccessRpcMessage is fixed,
         #[allow(clippy::indexing_slicing)]
         let response = serde_json::from_slice::<CsrAccessRpcMessage>(&recv_buf[..recv_cnt])?;
@@ -58,7 +131,64 @@ impl RpcClient {
         Ok(response.value)
     }
 
+    /// Reads the CSRs at `addrs` in one round trip.
+    ///
+    /// With `RpcCodec::Json` the reads are issued one after another.
+    pub(super) fn read_csrs<const N: usize>(&self, addrs: [usize; N]) -> io::Result<[u32; N]> {
+        let mut values = [0; N];
+        if self.codec == RpcCodec::Json {
+            for (value, addr) in values.iter_mut().zip(addrs) {
+                *value = self.read_csr(addr)?;
+            }
+            return Ok(values);
+        }
+
+        // The lock is held until the reply is received, so that concurrent readers don't
+        // receive the replies of each other
+        let mut pending = self.pending.lock();
+        if pending.len() + N * RECORD_LEN > MAX_BATCH * RECORD_LEN {
+            self.flush_locked(&mut pending)?;
+        }
+        for addr in addrs {
+            encode_record(&mut pending, RECORD_READ, addr, 0);
+        }
+        debug!("send batch with {N} reads");
+        let result = self.socket.send(&pending);
+        pending.clear();
+        let _: usize = result?;
+
+        let mut recv_buf = [0; MAX_BATCH * RECORD_LEN];
+        let recv_cnt = self.socket.recv(&mut recv_buf)?;
+        let invalid = || io::Error::new(io::ErrorKind::InvalidData, "unexpected CSR read reply");
+        let records = recv_buf.get(..recv_cnt).ok_or_else(invalid)?;
+        if records.len() != N * RECORD_LEN {
+            return Err(invalid());
+        }
+        for ((value, addr), record) in values
+            .iter_mut()
+            .zip(addrs)
+            .zip(records.chunks_exact(RECORD_LEN))
+        {
+            match decode_record(record) {
+                Some((x, v)) if x == addr => *value = v,
+                _ => return Err(invalid()),
+            }
+        }
+
+        Ok(values)
+    }
+
+    /// Writes a CSR, with `RpcCodec::Binary` the write is queued until the next flush
     pub(super) fn write_csr(&self, addr: usize, data: u32) -> io::Result<()> {
+        if self.codec == RpcCodec::Binary {
+            let mut pending = self.pending.lock();
+            encode_record(&mut pending, RECORD_WRITE, addr, data);
+            if pending.len() >= MAX_BATCH * RECORD_LEN {
+                self.flush_locked(&mut pending)?;
+            }
+            return Ok(());
+        }
+
         let msg = CsrAccessRpcMessage {
             is_write: true,
             addr,
@@ -67,31 +197,148 @@ impl RpcClient {
         debug!("send msg write: {msg:?}");
 
         let send_buf = serde_json::to_vec(&msg)?;
-        let _: usize = self.0.send(&send_buf)?;
+        let _: usize = self.socket.send(&send_buf)?;
         Ok(())
     }
+
+    /// Writes a doorbell, sending it together with the queued writes
+    pub(super) fn write_doorbell(&self, addr: usize, data: u32) -> io::Result<()> {
+        if self.codec == RpcCodec::Json {
+            return self.write_csr(addr, data);
+        }
+        let mut pending = self.pending.lock();
+        encode_record(&mut pending, RECORD_WRITE, addr, data);
+        self.flush_locked(&mut pending)
+    }
+
+    fn flush_locked(&self, pending: &mut Vec<u8>) -> io::Result<()> {
+        if pending.is_empty() {
+            return Ok(());
+        }
+        debug!("send batch with {} writes", pending.len() / RECORD_LEN);
+        let result = self.socket.send(pending);
+        pending.clear();
+        result.map(|_| ())
+    }
+}
+
+#[derive(Clone, Debug)]
+enum Transport {
+    Udp(RpcClient),
+    /// Mailbox in a shared memory object of the simulator
+    Shm(Arc<ShmMailbox>),
 }
 
 #[non_exhaustive]
 #[derive(Clone, Debug)]
-pub(crate) struct EmulatedDevice(RpcClient);
+pub(crate) struct EmulatedDevice(Transport);
 
 impl EmulatedDevice {
+    /// Connects to the simulator listening on `addr`.
+    ///
+    /// With the `shm` transport, the mailbox of the simulator is found by the port of `addr`.
     #[allow(clippy::expect_used)]
     pub(crate) fn new_with_addr(addr: &str) -> Self {
-        EmulatedDevice(
-            RpcClient::new(addr.parse().expect("invalid socket addr"))
-                .expect("failed to connect to emulator"),
-        )
+        let addr: SocketAddr = addr.parse().expect("invalid socket addr");
+        let transport = if std::env::var(RPC_CODEC_ENV).as_deref() == Ok("shm") {
+            Transport::Shm(Arc::new(
+                ShmMailbox::open(addr.port()).expect("failed to open emulator mailbox"),
+            ))
+        } else {
+            Transport::Udp(RpcClient::new(addr).expect("failed to connect to emulator"))
+        };
+        EmulatedDevice(transport)
     }
 }
 
 impl DeviceAdaptor for EmulatedDevice {
     fn read_csr(&self, addr: usize) -> io::Result<u32> {
-        self.0.read_csr(addr)
+        match &self.0 {
+            Transport::Udp(client) => client.read_csr(addr),
+            Transport::Shm(mailbox) => mailbox.read_csr(addr),
+        }
     }
 
     fn write_csr(&self, addr: usize, data: u32) -> io::Result<()> {
-        self.0.write_csr(addr, data)
+        match &self.0 {
+            Transport::Udp(client) => client.write_csr(addr, data),
+            Transport::Shm(mailbox) => mailbox.write_csr(addr, data),
+        }
+    }
+
+    fn write_doorbell(&self, addr: usize, data: u32) -> io::Result<()> {
+        match &self.0 {
+            Transport::Udp(client) => client.write_doorbell(addr, data),
+            Transport::Shm(mailbox) => mailbox.write_csr(addr, data),
+        }
+    }
+
+    fn read_csrs<const N: usize>(&self, addrs: [usize; N]) -> io::Result<[u32; N]> {
+        let Transport::Udp(client) = &self.0 else {
+            let mut values = [0; N];
+            for (value, addr) in values.iter_mut().zip(addrs) {
+                *value = self.read_csr(addr)?;
+            }
+            return Ok(values);
+        };
+        client.read_csrs(addrs)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::thread;
+
+    use super::*;
+
+    /// Answers the reads of a binary datagram with `addr + 1`, returns the received records
+    #[allow(clippy::as_conversions, clippy::unwrap_used, clippy::indexing_slicing)]
+    fn serve_one(server: &UdpSocket) -> Vec<(u8, usize, u32)> {
+        let mut buf = [0; MAX_BATCH * RECORD_LEN];
+        let (len, peer) = server.recv_from(&mut buf).unwrap();
+        let records: Vec<_> = buf[..len]
+            .chunks_exact(RECORD_LEN)
+            .map(|r| {
+                let (addr, value) = decode_record(r).unwrap();
+                (r[0], addr, value)
+            })
+            .collect();
+        let mut reply = Vec::new();
+        for &(op, addr, _) in &records {
+            if op == RECORD_READ {
+                encode_record(&mut reply, RECORD_READ, addr, addr as u32 + 1);
+            }
+        }
+        if !reply.is_empty() {
+            let _ignore = server.send_to(&reply, peer).unwrap();
+        }
+        records
+    }
+
+    #[test]
+    #[allow(clippy::unwrap_used)]
+    fn binary_writes_are_batched_before_reads() {
+        let server = UdpSocket::bind("127.0.0.1:0").unwrap();
+        let client = RpcClient::with_codec(server.local_addr().unwrap(), RpcCodec::Binary).unwrap();
+        client.write_csr(0x10, 1).unwrap();
+        client.write_csr(0x14, 2).unwrap();
+        let handle = thread::spawn(move || (serve_one(&server), serve_one(&server)));
+        assert_eq!(client.read_csrs([0x20, 0x24]).unwrap(), [0x21, 0x25]);
+        client.write_csr(0x18, 3).unwrap();
+        client.write_doorbell(0x1c, 4).unwrap();
+        let (first, second) = handle.join().unwrap();
+        assert_eq!(
+            first,
+            vec![
+                (RECORD_WRITE, 0x10, 1),
+                (RECORD_WRITE, 0x14, 2),
+                (RECORD_READ, 0x20, 0),
+                (RECORD_READ, 0x24, 0),
+            ]
+        );
+        assert_eq!(
+            second,
+            vec![(RECORD_WRITE, 0x18, 3), (RECORD_WRITE, 0x1c, 4)]
+        );
     }
 }
@@ -0,0 +1,329 @@
+//! Shared memory mailbox for the CSR accesses to the simulator.
+//!
+//! The simulator listening on port `P` creates the POSIX shared memory object
+//! `/bluesim-csr-P` holding a [`Mailbox`], and writes `MAILBOX_MAGIC` once the rings are
+//! initialized. The driver is the producer of the request ring and the consumer of the
+//! response ring.
+//!
+//! A ring is single producer single consumer. The producer writes the slot `head % RING_LEN`
+//! and then increments `head`, the consumer reads the slot `tail % RING_LEN` and then
+//! increments `tail`. A consumer finding the ring empty spins for a while, then sets
+//! `waiting` and sleeps on the `head` futex. A producer that finds `waiting` set after
+//! publishing a record clears it and wakes the futex.
+//!
+//! Each slot holds a record in the layout of the binary UDP protocol: the opcode (0 for a
+//! read, 1 for a write) in a 32 bits word, the 32 bits value and the 64 bits address. Every
+//! read request is answered by one record in the response ring, writes are not answered.
+
+#![allow(unsafe_code)]
+
+use std::{
+    cell::UnsafeCell,
+    ffi::CString,
+    hint, io,
+    mem::size_of,
+    ptr::{self, NonNull},
+    sync::atomic::{AtomicU32, Ordering},
+    thread,
+};
+
+use log::debug;
+use parking_lot::Mutex;
+
+use super::{RECORD_READ, RECORD_WRITE};
+
+/// Written by the simulator once the mailbox is initialized
+const MAILBOX_MAGIC: u32 = 0x4253_4d42;
+
+/// Number of slots of a ring
+const RING_LEN: usize = 256;
+
+/// Number of polls of an empty ring before waiting on the futex
+const SPIN_LIMIT: usize = 1024;
+
+#[derive(Debug, Clone, Copy)]
+#[repr(C)]
+struct Record {
+    op: u32,
+    value: u32,
+    addr: u64,
+}
+
+/// Cache line written by the producer
+#[repr(C, align(64))]
+struct ProducerLine {
+    head: AtomicU32,
+}
+
+/// Cache line written by the consumer
+#[repr(C, align(64))]
+struct ConsumerLine {
+    tail: AtomicU32,
+    waiting: AtomicU32,
+}
+
+#[repr(C)]
+struct Ring {
+    producer: ProducerLine,
+    consumer: ConsumerLine,
+    slots: [UnsafeCell<Record>; RING_LEN],
+}
+
+#[repr(C, align(64))]
+struct Header {
+    magic: AtomicU32,
+}
+
+/// Layout of the shared memory object
+#[repr(C)]
+struct Mailbox {
+    header: Header,
+    req: Ring,
+    resp: Ring,
+}
+
+#[allow(clippy::as_conversions, clippy::arithmetic_side_effects)]
+impl Ring {
+    /// Publishes a record, waits for a free slot if the ring is full
+    fn push(&self, record: Record) {
+        let head = self.producer.head.load(Ordering::Relaxed);
+        while head.wrapping_sub(self.consumer.tail.load(Ordering::Acquire)) as usize == RING_LEN {
+            thread::yield_now();
+        }
+        let slot = self
+            .slots
+            .get(head as usize % RING_LEN)
+            .unwrap_or_else(|| unreachable!());
+        // SAFETY: the slot is owned by the producer until `head` is published
+        unsafe { ptr::write_volatile(slot.get(), record) };
+        self.producer
+            .head
+            .store(head.wrapping_add(1), Ordering::SeqCst);
+        if self.consumer.waiting.swap(0, Ordering::SeqCst) != 0 {
+            futex_wake(&self.producer.head);
+        }
+    }
+
+    /// Takes the next record, waits for the producer if the ring is empty
+    fn pop(&self) -> Record {
+        let tail = self.consumer.tail.load(Ordering::Relaxed);
+        let mut spins = 0;
+        while self.producer.head.load(Ordering::Acquire) == tail {
+            if spins < SPIN_LIMIT {
+                spins += 1;
+                hint::spin_loop();
+                continue;
+            }
+            self.consumer.waiting.store(1, Ordering::SeqCst);
+            if self.producer.head.load(Ordering::SeqCst) == tail {
+                futex_wait(&self.producer.head, tail);
+            }
+            self.consumer.waiting.store(0, Ordering::Relaxed);
+        }
+        let slot = self
+            .slots
+            .get(tail as usize % RING_LEN)
+            .unwrap_or_else(|| unreachable!());
+        // SAFETY: the slot is owned by the consumer until `tail` is published
+        let record = unsafe { ptr::read_volatile(slot.get()) };
+        self.consumer
+            .tail
+            .store(tail.wrapping_add(1), Ordering::Release);
+        record
+    }
+}
+
+/// Sleeps until `word` is woken, returns immediately if it no longer holds `expected`
+fn futex_wait(word: &AtomicU32, expected: u32) {
+    // The futex is shared with the simulator process, it must not be private
+    // SAFETY: the word stays mapped during the call
+    let _ignore = unsafe {
+        libc::syscall(
+            libc::SYS_futex,
+            word.as_ptr(),
+            libc::FUTEX_WAIT,
+            expected,
+            ptr::null::<libc::timespec>(),
+        )
+    };
+}
+
+fn futex_wake(word: &AtomicU32) {
+    // SAFETY: the word stays mapped during the call
+    let _ignore = unsafe { libc::syscall(libc::SYS_futex, word.as_ptr(), libc::FUTEX_WAKE, 1) };
+}
+
+/// Driver side of a mailbox
+#[derive(Debug)]
+pub(super) struct ShmMailbox {
+    mailbox: NonNull<Mailbox>,
+    /// Serializes the accesses, the rings have a single producer and consumer
+    lock: Mutex<()>,
+}
+
+// SAFETY: the mailbox is only accessed through the atomics and the slots owned by the side
+// holding `lock`
+unsafe impl Send for ShmMailbox {}
+// SAFETY: see above
+unsafe impl Sync for ShmMailbox {}
+
+impl ShmMailbox {
+    /// Maps the mailbox of the simulator listening on `port`
+    pub(super) fn open(port: u16) -> io::Result<Self> {
+        let path = format!("/bluesim-csr-{port}");
+        debug!("open csr mailbox: {path}");
+        let name = CString::new(path).map_err(|err| io::Error::new(io::ErrorKind::Other, err))?;
+        // SAFETY: `name` is a valid C string
+        let fd = unsafe { libc::shm_open(name.as_ptr(), libc::O_RDWR, 0o600) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        // SAFETY: `fd` is a valid shared memory object of the simulator
+        let addr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                size_of::<Mailbox>(),
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED,
+                fd,
+                0,
+            )
+        };
+        let err = io::Error::last_os_error();
+        // SAFETY: the mapping keeps its own reference to the object
+        let _ignore = unsafe { libc::close(fd) };
+        if addr == libc::MAP_FAILED {
+            return Err(err);
+        }
+        let mailbox = Self::from_ptr(addr.cast());
+        if mailbox.mailbox().header.magic.load(Ordering::Acquire) != MAILBOX_MAGIC {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "csr mailbox is not initialized",
+            ));
+        }
+
+        Ok(mailbox)
+    }
+
+    fn from_ptr(ptr: *mut Mailbox) -> Self {
+        Self {
+            mailbox: NonNull::new(ptr).unwrap_or_else(|| unreachable!("mmap returned null")),
+            lock: Mutex::new(()),
+        }
+    }
+
+    fn mailbox(&self) -> &Mailbox {
+        // SAFETY: the mailbox is mapped until `self` is dropped
+        unsafe { self.mailbox.as_ref() }
+    }
+
+    #[allow(clippy::as_conversions)]
+    pub(super) fn read_csr(&self, addr: usize) -> io::Result<u32> {
+        let _guard = self.lock.lock();
+        let mailbox = self.mailbox();
+        mailbox.req.push(Record {
+            op: u32::from(RECORD_READ),
+            value: 0,
+            addr: addr as u64,
+        });
+        let resp = mailbox.resp.pop();
+        if resp.addr != addr as u64 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "unexpected CSR read reply",
+            ));
+        }
+
+        Ok(resp.value)
+    }
+
+    #[allow(clippy::as_conversions)]
+    pub(super) fn write_csr(&self, addr: usize, data: u32) -> io::Result<()> {
+        let _guard = self.lock.lock();
+        self.mailbox().req.push(Record {
+            op: u32::from(RECORD_WRITE),
+            value: data,
+            addr: addr as u64,
+        });
+        Ok(())
+    }
+}
+
+impl Drop for ShmMailbox {
+    fn drop(&mut self) {
+        // SAFETY: the mapping was created by `open`, and is not used after this point
+        let _ignore = unsafe { libc::munmap(self.mailbox.as_ptr().cast(), size_of::<Mailbox>()) };
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Arc;
+
+    use super::*;
+
+    /// Mailbox in an anonymous mapping, answering the reads with `addr + 1`
+    struct Simulator(ShmMailbox);
+
+    #[allow(
+        clippy::as_conversions,
+        clippy::arithmetic_side_effects,
+        clippy::cast_possible_truncation
+    )]
+    impl Simulator {
+        fn new() -> Self {
+            // SAFETY: anonymous mappings are zeroed, zeroed rings are empty
+            let addr = unsafe {
+                libc::mmap(
+                    ptr::null_mut(),
+                    size_of::<Mailbox>(),
+                    libc::PROT_READ | libc::PROT_WRITE,
+                    libc::MAP_SHARED | libc::MAP_ANONYMOUS,
+                    -1,
+                    0,
+                )
+            };
+            assert_ne!(addr, libc::MAP_FAILED);
+            Self(ShmMailbox::from_ptr(addr.cast()))
+        }
+
+        fn serve(&self, num_requests: usize) -> Vec<Record> {
+            let mailbox = self.0.mailbox();
+            (0..num_requests)
+                .map(|_| {
+                    let record = mailbox.req.pop();
+                    if record.op == u32::from(RECORD_READ) {
+                        mailbox.resp.push(Record {
+                            value: record.addr as u32 + 1,
+                            ..record
+                        });
+                    }
+                    record
+                })
+                .collect()
+        }
+    }
+
+    #[test]
+    #[allow(clippy::unwrap_used)]
+    fn mailbox_serves_requests_in_order() {
+        let sim = Arc::new(Simulator::new());
+        let num_requests = RING_LEN * 3;
+        let sim_c = Arc::clone(&sim);
+        let handle = thread::spawn(move || sim_c.serve(num_requests));
+        let client = &sim.0;
+        for i in 0..RING_LEN {
+            client.write_csr(i * 8, 7).unwrap();
+            assert_eq!(client.read_csr(i * 8 + 4).unwrap(), i as u32 * 8 + 5);
+            client.write_csr(i * 8, 9).unwrap();
+        }
+        let records = handle.join().unwrap();
+        assert_eq!(records.len(), num_requests);
+        assert!(records.chunks_exact(3).enumerate().all(|(i, r)| r
+            .iter()
+            .map(|x| x.op)
+            .eq([1, 0, 1])
+            && r.iter().all(|x| x.addr / 8 == i as u64)));
+    }
+}
@@ -1,6 +1,5 @@
-use log::debug;
+use log::{debug, warn};
 use memmap2::{MmapMut, MmapOptions};
-use parking_lot::Mutex;
 use pci_driver::{
     backends::vfio::VfioPciDevice,
     device::PciDevice,
@@ -11,7 +10,11 @@ use std::{
     fs::{self, File, OpenOptions},
     io,
     path::{Path, PathBuf},
-    sync::Arc,
+    ptr::NonNull,
+    sync::{
+        atomic::{fence, Ordering},
+        Arc,
+    },
 };
 
 use crate::mem::{
@@ -59,9 +62,71 @@ impl DeviceAdaptor for VfioPciCsrAdaptor {
     }
 }
 
+/// A mapping of the BAR accessed without locking.
+///
+/// CSRs are independent 32-bit registers, each access is a single aligned volatile load or
+/// store, so the queues of different channels write their doorbells concurrently.
+#[derive(Debug)]
+struct BarMapping {
+    /// Keeps the mapping alive
+    mmap: MmapMut,
+    /// Start of the mapping
+    base: NonNull<u8>,
+}
+
+// SAFETY: the mapping is only accessed through aligned 32-bit volatile loads and stores of
+// device registers, which need no synchronization between threads
+#[allow(unsafe_code)]
+unsafe impl Send for BarMapping {}
+
+// SAFETY: see `Send`
+#[allow(unsafe_code)]
+unsafe impl Sync for BarMapping {}
+
+#[allow(unsafe_code, clippy::cast_ptr_alignment)]
+impl BarMapping {
+    fn new(mut mmap: MmapMut) -> Self {
+        let base = NonNull::new(mmap.as_mut_ptr()).unwrap_or_else(|| unreachable!("null mmap"));
+        Self { mmap, base }
+    }
+
+    /// Returns the pointer to the register at `addr`, checked to be aligned and mapped
+    fn register(&self, addr: usize) -> io::Result<NonNull<u32>> {
+        if addr % 4 != 0 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "unaligned access",
+            ));
+        }
+        if addr.saturating_add(4) > self.mmap.len() {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                format!("CSR 0x{addr:x} is out of the BAR"),
+            ));
+        }
+        // SAFETY: the register is within the mapping
+        Ok(unsafe { self.base.add(addr) }.cast())
+    }
+
+    fn read(&self, addr: usize) -> io::Result<u32> {
+        let ptr = self.register(addr)?;
+        // SAFETY: the register is aligned and mapped
+        Ok(unsafe { ptr.as_ptr().read_volatile() })
+    }
+
+    fn write(&self, addr: usize, data: u32) -> io::Result<()> {
+        let ptr = self.register(addr)?;
+        // SAFETY: the register is aligned and mapped
+        unsafe { ptr.as_ptr().write_volatile(data) };
+        Ok(())
+    }
+}
+
 #[derive(Clone, Debug)]
 pub(crate) struct SysfsPciCsrAdaptor {
-    bar: Arc<Mutex<MmapMut>>,
+    bar: Arc<BarMapping>,
+    /// Write-combined mapping of the same BAR, only used for doorbell writes
+    wc_bar: Option<Arc<BarMapping>>,
 }
 
 #[allow(unsafe_code)]
@@ -73,44 +138,70 @@ impl SysfsPciCsrAdaptor {
         let mmap = unsafe { MmapOptions::new().map_mut(&file)? };
 
         Ok(Self {
-            bar: Arc::new(Mutex::new(mmap)),
+            bar: Arc::new(BarMapping::new(mmap)),
+            wc_bar: None,
         })
     }
+
+    /// Creates an adaptor that writes doorbells through a write-combined mapping of the BAR.
+    ///
+    /// The kernel only provides the write-combined resource for prefetchable BARs, falls back to
+    /// the uncached mapping if it is not available.
+    pub(crate) fn new_write_combined(sysfs_path: impl AsRef<Path>) -> io::Result<Self> {
+        let mut adaptor = Self::new(sysfs_path.as_ref())?;
+        let wc_path = sysfs_path.as_ref().join(format!("resource{BAR_INDEX}_wc"));
+        let file = match OpenOptions::new().read(true).write(true).open(&wc_path) {
+            Ok(file) => file,
+            Err(err) => {
+                warn!("failed to open {wc_path:?}: {err}, doorbells are not write-combined");
+                return Ok(adaptor);
+            }
+        };
+        let mmap = unsafe { MmapOptions::new().map_mut(&file)? };
+        adaptor.wc_bar = Some(Arc::new(BarMapping::new(mmap)));
+
+        Ok(adaptor)
+    }
+}
+
+/// Maps the page of the BAR of the device at `sysfs_path` holding the CSR at `offset`
+#[allow(unsafe_code, clippy::as_conversions)]
+pub(crate) fn map_bar_page(sysfs_path: impl AsRef<Path>, offset: usize) -> io::Result<MmapMut> {
+    let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+    let bar_path = sysfs_path.as_ref().join(format!("resource{BAR_INDEX}"));
+    let file = OpenOptions::new().read(true).write(true).open(&bar_path)?;
+    let mmap = unsafe {
+        MmapOptions::new()
+            .offset((offset - offset % page_size) as u64)
+            .len(page_size)
+            .map_mut(&file)?
+    };
+    debug!("mapped csr page of offset 0x{offset:x} from {bar_path:?}");
+
+    Ok(mmap)
 }
 
-#[allow(unsafe_code, clippy::cast_ptr_alignment)]
 impl DeviceAdaptor for SysfsPciCsrAdaptor {
     fn read_csr(&self, addr: usize) -> io::Result<u32> {
-        if addr % 4 != 0 {
-            return Err(io::Error::new(
-                io::ErrorKind::InvalidInput,
-                "unaligned access",
-            ));
-        }
-
-        let bar = self.bar.lock();
-        unsafe {
-            let ptr = bar.as_ptr().add(addr);
-            let ret = ptr.cast::<u32>().read_volatile();
-            debug!("read csr: addr=0x{:x}, bar_offset=0x{:x}, val=0x{:x}", ptr as usize, addr, ret);
-            Ok(ret)
-        }
+        let ret = self.bar.read(addr)?;
+        debug!("read csr: bar_offset=0x{addr:x}, val=0x{ret:x}");
+        Ok(ret)
     }
 
     fn write_csr(&self, addr: usize, data: u32) -> io::Result<()> {
-        if addr % 4 != 0 {
-            return Err(io::Error::new(
-                io::ErrorKind::InvalidInput,
-                "unaligned access",
-            ));
-        }
+        debug!("write csr: bar_offset=0x{addr:x}, val=0x{data:x}");
+        self.bar.write(addr, data)
+    }
 
-        let mut bar = self.bar.lock();
-        unsafe {
-            let ptr = bar.as_mut_ptr().add(addr);
-            debug!("write csr: addr=0x{:x}, bar_offset=0x{:x}, val=0x{:x}", ptr as usize, addr, data);
-            ptr.cast::<u32>().write_volatile(data);
-        }
+    fn write_doorbell(&self, addr: usize, data: u32) -> io::Result<()> {
+        let Some(wc_bar) = self.wc_bar.as_ref() else {
+            return self.write_csr(addr, data);
+        };
+        // Write-combined stores are not ordered with the preceding descriptor writes
+        fence(Ordering::SeqCst);
+        wc_bar.write(addr, data)?;
+        // Flushes the write-combining buffer
+        fence(Ordering::SeqCst);
 
         Ok(())
     }
@@ -130,14 +221,14 @@ impl CustomCsrConfigurator {
         Ok(Self { bar: mmap })
     }
 
-    pub(crate) fn set_loopback(&mut self) {
+    pub(crate) fn set_loopback(&mut self, enable: bool) {
         const ADDR: usize = 0x180;
         unsafe {
             self.bar
                 .as_mut_ptr()
                 .add(ADDR)
                 .cast::<u32>()
-                .write_volatile(1);
+                .write_volatile(u32::from(enable));
         }
     }
 
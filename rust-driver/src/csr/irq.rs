@@ -0,0 +1,200 @@
+use std::{
+    fs::{File, OpenOptions},
+    io,
+    os::fd::{AsRawFd, FromRawFd, OwnedFd},
+    sync::Arc,
+    thread,
+    time::{Duration, Instant},
+};
+
+use log::{debug, warn};
+use nix::ioctl_write_ptr;
+use parking_lot::Mutex;
+
+use crate::workers::spawner::Interrupt;
+
+/// Interrupt device of the card `N`, `IRQ_DEV_PATH_PREFIX` followed by `N`
+const IRQ_DEV_PATH_PREFIX: &str = "/dev/bluerdma_irq";
+
+const IRQ_IOCTL_TYPE: u8 = b'B';
+const IRQ_BIND_NR: u8 = 0x01;
+const IRQ_ARM_NR: u8 = 0x02;
+const IRQ_STEER_NR: u8 = 0x03;
+
+/// `struct bluerdma_irq_bind` of the kernel module
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct IrqBind {
+    vector: u32,
+    fd: i32,
+}
+
+/// `struct bluerdma_irq_steer` of the kernel module
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct IrqSteer {
+    vector: u32,
+    cpu: u32,
+}
+
+ioctl_write_ptr!(irq_bind_ioctl, IRQ_IOCTL_TYPE, IRQ_BIND_NR, IrqBind);
+ioctl_write_ptr!(irq_arm_ioctl, IRQ_IOCTL_TYPE, IRQ_ARM_NR, u32);
+ioctl_write_ptr!(irq_steer_ioctl, IRQ_IOCTL_TYPE, IRQ_STEER_NR, IrqSteer);
+
+/// MSI-X vectors of the meta report channels of a card, one per channel.
+///
+/// Each interrupt masks its vector until it is armed again, the channel is polled in between.
+/// With TPH steering, the card tags the meta report writes of a channel with the steering tag
+/// of its vector, so that they land in the cache of the core polling the channel.
+pub(crate) struct MetaInterrupts {
+    file: Arc<File>,
+    /// Minimum time between two wakeups by an interrupt
+    moderation: Duration,
+    /// Steer the vectors to the cores of the workers
+    steering: bool,
+}
+
+impl MetaInterrupts {
+    /// Opens the interrupt device of the card `index`
+    pub(crate) fn open(index: usize, moderation: Duration, steering: bool) -> io::Result<Self> {
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .open(format!("{IRQ_DEV_PATH_PREFIX}{index}"))?;
+        Ok(Self {
+            file: Arc::new(file),
+            moderation,
+            steering,
+        })
+    }
+
+    /// Returns the interrupt of the worker polling the channels `channel_ids`, the vectors of
+    /// all the channels signal the same event fd
+    pub(crate) fn bind(&self, channel_ids: &[usize]) -> io::Result<MetaInterrupt> {
+        // The vectors bound before a failure are unbound by the drop
+        let mut interrupt = MetaInterrupt {
+            file: Arc::clone(&self.file),
+            vectors: Vec::with_capacity(channel_ids.len()),
+            eventfd: eventfd()?,
+            moderation: self.moderation,
+            steering: self.steering,
+            last_wakeup: Mutex::new(None),
+        };
+        for &id in channel_ids {
+            let vector = u32::try_from(id).map_err(|_err| io::ErrorKind::InvalidInput)?;
+            set_trigger(&self.file, vector, interrupt.eventfd.as_raw_fd())?;
+            interrupt.vectors.push(vector);
+        }
+
+        Ok(interrupt)
+    }
+}
+
+/// Interrupt of the channels of a `MetaWorker`, unbound once dropped
+#[derive(Debug)]
+pub(crate) struct MetaInterrupt {
+    file: Arc<File>,
+    vectors: Vec<u32>,
+    /// Signaled by the vectors, and by `notify`
+    eventfd: OwnedFd,
+    moderation: Duration,
+    steering: bool,
+    /// Time the worker was last woken up by the event fd
+    last_wakeup: Mutex<Option<Instant>>,
+}
+
+impl Interrupt for MetaInterrupt {
+    fn arm(&self) {
+        for vector in &self.vectors {
+            if let Err(err) = unsafe { irq_arm_ioctl(self.file.as_raw_fd(), vector) } {
+                warn!("failed to arm meta report vector {vector}: {err}");
+            }
+        }
+    }
+
+    fn wait(&self, timeout: Duration) {
+        let mut pollfd = libc::pollfd {
+            fd: self.eventfd.as_raw_fd(),
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        let timeout = libc::timespec {
+            tv_sec: timeout.as_secs() as libc::time_t,
+            tv_nsec: timeout.subsec_nanos() as libc::c_long,
+        };
+        let num = unsafe { libc::ppoll(&mut pollfd, 1, &timeout, std::ptr::null()) };
+        if num <= 0 {
+            return;
+        }
+        let mut value = [0u8; 8];
+        let _ignore = unsafe {
+            libc::read(
+                self.eventfd.as_raw_fd(),
+                value.as_mut_ptr().cast(),
+                value.len(),
+            )
+        };
+        let now = Instant::now();
+        let last = self.last_wakeup.lock().replace(now);
+        // Reports arriving within the period are left to the next pass
+        if let Some(left) = last.and_then(|t| self.moderation.checked_sub(now.duration_since(t))) {
+            thread::sleep(left);
+        }
+    }
+
+    fn notify(&self) {
+        let value = 1u64.to_ne_bytes();
+        let _ignore =
+            unsafe { libc::write(self.eventfd.as_raw_fd(), value.as_ptr().cast(), value.len()) };
+    }
+
+    fn steer(&self, core: usize) {
+        if !self.steering {
+            return;
+        }
+        for &vector in &self.vectors {
+            match self.steer_vector(vector, core) {
+                Ok(()) => debug!("meta report vector {vector} steered to core {core}"),
+                Err(err) => {
+                    warn!("failed to steer meta report vector {vector} to core {core}: {err}")
+                }
+            }
+        }
+    }
+}
+
+impl MetaInterrupt {
+    fn steer_vector(&self, vector: u32, core: usize) -> io::Result<()> {
+        let steer = IrqSteer {
+            vector,
+            cpu: u32::try_from(core).map_err(|_err| io::ErrorKind::InvalidInput)?,
+        };
+        let _ret = unsafe { irq_steer_ioctl(self.file.as_raw_fd(), &raw const steer)? };
+        Ok(())
+    }
+}
+
+impl Drop for MetaInterrupt {
+    fn drop(&mut self) {
+        for &vector in &self.vectors {
+            if let Err(err) = set_trigger(&self.file, vector, -1) {
+                warn!("failed to unbind meta report vector {vector}: {err}");
+            }
+        }
+    }
+}
+
+fn set_trigger(file: &File, vector: u32, fd: i32) -> io::Result<()> {
+    let bind = IrqBind { vector, fd };
+    let _ret = unsafe { irq_bind_ioctl(file.as_raw_fd(), &raw const bind)? };
+    Ok(())
+}
+
+/// Creates a non-blocking event fd
+fn eventfd() -> io::Result<OwnedFd> {
+    let fd = unsafe { libc::eventfd(0, libc::EFD_CLOEXEC | libc::EFD_NONBLOCK) };
+    if fd < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(unsafe { OwnedFd::from_raw_fd(fd) })
+}
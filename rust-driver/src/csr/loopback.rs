@@ -0,0 +1,123 @@
+use std::{
+    io,
+    sync::{
+        atomic::{AtomicU32, AtomicU64, Ordering},
+        Arc,
+    },
+};
+
+use super::{
+    constants::{
+        CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_HEAD, CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_TAIL,
+        NUM_QPS, QP_WQE_HEAD, QP_WQE_TAIL,
+    },
+    DeviceAdaptor,
+};
+
+/// A device that consumes the descriptors of a send queue, or of the simple NIC transmit
+/// queue, as soon as its head CSR is written.
+///
+/// A read of a tail CSR of these queues returns the last head written to the queue, all other
+/// CSRs read as 0. Measures the driver side of the send path without hardware.
+#[derive(Debug, Clone)]
+pub(crate) struct LoopbackDevice {
+    inner: Arc<LoopbackInner>,
+}
+
+#[derive(Debug)]
+struct LoopbackInner {
+    /// Last head written to each send queue
+    heads: [AtomicU32; NUM_QPS],
+    /// Number of descriptors rung on all send queues
+    rung: AtomicU64,
+    /// Last head written to the simple NIC transmit queue
+    frame_head: AtomicU32,
+    /// Number of frames rung on the simple NIC transmit queue
+    frames: AtomicU64,
+    /// Mask of the head pointers, one bit wider than the index of a slot
+    wrap_mask: u32,
+}
+
+impl LoopbackDevice {
+    /// Creates a device with send queues of `depth` descriptors, `depth` must be a power of two
+    #[allow(clippy::as_conversions, clippy::cast_possible_truncation)]
+    pub(crate) fn new(depth: usize) -> Self {
+        Self {
+            inner: Arc::new(LoopbackInner {
+                heads: Default::default(),
+                rung: AtomicU64::new(0),
+                frame_head: AtomicU32::new(0),
+                frames: AtomicU64::new(0),
+                wrap_mask: ((depth << 1) - 1) as u32,
+            }),
+        }
+    }
+
+    /// Returns the number of descriptors rung on all send queues
+    pub(crate) fn rung(&self) -> u64 {
+        self.inner.rung.load(Ordering::Acquire)
+    }
+
+    /// Returns the number of frames rung on the simple NIC transmit queue
+    pub(crate) fn frames(&self) -> u64 {
+        self.inner.frames.load(Ordering::Acquire)
+    }
+
+    fn head(&self, csrs: &[usize; NUM_QPS], addr: usize) -> Option<&AtomicU32> {
+        csrs.iter()
+            .position(|&x| x == addr)
+            .and_then(|i| self.inner.heads.get(i))
+    }
+}
+
+impl DeviceAdaptor for LoopbackDevice {
+    fn read_csr(&self, addr: usize) -> io::Result<u32> {
+        if addr == CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_TAIL {
+            return Ok(self.inner.frame_head.load(Ordering::Acquire));
+        }
+        Ok(self
+            .head(&QP_WQE_TAIL, addr)
+            .map_or(0, |x| x.load(Ordering::Acquire)))
+    }
+
+    fn write_csr(&self, addr: usize, data: u32) -> io::Result<()> {
+        if let Some(head) = self.head(&QP_WQE_HEAD, addr) {
+            let prev = head.swap(data, Ordering::AcqRel);
+            let num = data.wrapping_sub(prev) & self.inner.wrap_mask;
+            let _prev = self.inner.rung.fetch_add(u64::from(num), Ordering::AcqRel);
+        } else if addr == CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_HEAD {
+            let prev = self.inner.frame_head.swap(data, Ordering::AcqRel);
+            let num = data.wrapping_sub(prev) & self.inner.wrap_mask;
+            let _prev = self
+                .inner
+                .frames
+                .fetch_add(u64::from(num), Ordering::AcqRel);
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn tail_follows_head() {
+        let dev = LoopbackDevice::new(8);
+        dev.write_csr(QP_WQE_HEAD[1], 6).unwrap();
+        assert_eq!(dev.read_csr(QP_WQE_TAIL[1]).unwrap(), 6);
+        assert_eq!(dev.read_csr(QP_WQE_TAIL[0]).unwrap(), 0);
+        // Wraps around the 16 head values of a ring of 8
+        dev.write_csr(QP_WQE_HEAD[1], 2).unwrap();
+        assert_eq!(dev.rung(), 6 + 12);
+
+        dev.write_csr(CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_HEAD, 3)
+            .unwrap();
+        assert_eq!(
+            dev.read_csr(CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_TAIL)
+                .unwrap(),
+            3
+        );
+        assert_eq!((dev.rung(), dev.frames()), (18, 3));
+    }
+}
@@ -11,12 +11,22 @@ pub(crate) mod emulated;
 /// CSR proxy types
 pub(crate) mod proxy;
 
+/// Loopback device adaptor
+pub(crate) mod loopback;
+
 /// Adaptors
 pub(crate) mod adaptor;
 
 /// Device mode reader
 pub(crate) mod mode;
 
+/// Meta report interrupts of the kernel module
+#[allow(unsafe_code)]
+pub(crate) mod irq;
+
+/// Ring occupancy sampling of the `csr` tool
+pub mod monitor;
+
 pub(crate) use adaptor::*;
 
 /// Memory-mapped I/O addresses of device registers
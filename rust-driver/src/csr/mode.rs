@@ -1,6 +1,9 @@
+use std::io;
+
 use super::{constants::CSR_DEVICE_MODE_ADDR, DeviceAdaptor};
 
-#[derive(Default, Clone, Copy)]
+/// Link speed of the bitstream, which sets the number of send and meta report channels
+#[derive(Default, Debug, Clone, Copy, PartialEq, Eq)]
 pub(crate) enum Mode {
     Mode400G,
     Mode200G,
@@ -26,21 +29,20 @@ impl Mode {
     }
 }
 
-struct ModeProxy<Dev> {
-    dev: Dev,
-}
+/// Reads the mode of the bitstream
+#[derive(Clone, Debug)]
+pub(crate) struct ModeProxy<Dev>(pub(crate) Dev);
 
 impl<Dev: DeviceAdaptor> ModeProxy<Dev> {
-    pub(crate) fn mode(&self) -> Mode {
-        let mode = self
-            .dev
-            .read_csr(CSR_DEVICE_MODE_ADDR)
-            .unwrap_or_else(|_| unreachable!("failed to read mode from device"));
-        match mode {
-            0 => Mode::Mode100G,
-            1 => Mode::Mode200G,
-            2 => Mode::Mode400G,
-            _ => unreachable!("invalid mode"),
+    pub(crate) fn mode(&self) -> io::Result<Mode> {
+        match self.0.read_csr(CSR_DEVICE_MODE_ADDR)? {
+            0 => Ok(Mode::Mode100G),
+            1 => Ok(Mode::Mode200G),
+            2 => Ok(Mode::Mode400G),
+            mode => Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                format!("invalid device mode: {mode}"),
+            )),
         }
     }
 }
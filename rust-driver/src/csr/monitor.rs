@@ -0,0 +1,283 @@
+//! Sampling of the head and tail CSRs of the rings of the device, for the live monitor of the
+//! `csr` tool.
+//!
+//! The producer of a ring writes its head and the consumer its tail, both wrap around at twice
+//! the depth of the ring. The driver is the producer of the send, command request and simple
+//! NIC tx rings, and the consumer of the meta report, command response and simple NIC rx
+//! rings. A ring holding entries whose tail doesn't move between two samples is stalled on its
+//! consumer: the card for the rings to the card, a driver thread for the rings to the host.
+
+use std::{io, time::Instant};
+
+use log::warn;
+
+use crate::config::{DeviceConfig, RingConfig};
+
+use super::{
+    mode::{Mode, ModeProxy},
+    proxy::{
+        build_meta_report_queue_proxies, build_send_queue_proxies, CmdQueueCsrProxy,
+        CmdRespQueueCsrProxy, SimpleNicRxQueueCsrProxy, SimpleNicTxQueueCsrProxy,
+    },
+    DeviceAdaptor, RingBufferCsrAddr,
+};
+
+/// Device read through the CSR accessor of the tool, the monitor never writes a CSR
+#[derive(Clone, Copy)]
+struct ReadOnly<'a, F>(&'a F);
+
+impl<F> DeviceAdaptor for ReadOnly<'_, F>
+where
+    F: Fn(usize) -> io::Result<u32>,
+{
+    fn read_csr(&self, addr: usize) -> io::Result<u32> {
+        (self.0)(addr)
+    }
+
+    fn write_csr(&self, _addr: usize, _data: u32) -> io::Result<()> {
+        Err(io::ErrorKind::PermissionDenied.into())
+    }
+}
+
+/// A ring of the device and its last sample
+#[derive(Debug)]
+struct MonitoredRing {
+    name: String,
+    head_addr: usize,
+    tail_addr: usize,
+    to_card: bool,
+    depth: u32,
+    /// Head and tail of the last sample
+    last: Option<(u32, u32)>,
+    stalls: u64,
+    full: u64,
+}
+
+/// One ring in one sample of the monitor
+#[derive(Debug, Clone, PartialEq)]
+#[non_exhaustive]
+pub struct RingReport {
+    /// Name of the ring, such as `send0` or `cmd_req`
+    pub name: String,
+    /// Whether the driver produces the ring and the card consumes it
+    pub to_card: bool,
+    /// Head CSR
+    pub head: u32,
+    /// Tail CSR
+    pub tail: u32,
+    /// Number of entries between the tail and the head
+    pub occupancy: u32,
+    /// Number of entries of the ring
+    pub depth: u32,
+    /// Entries produced per second since the last sample, each head write is a doorbell
+    pub head_rate: f64,
+    /// Entries consumed per second since the last sample
+    pub tail_rate: f64,
+    /// Samples that found the ring holding entries with its tail unchanged
+    pub stalls: u64,
+    /// Samples that found the ring full
+    pub full: u64,
+}
+
+impl RingReport {
+    /// Returns the occupancy of the ring in percent
+    #[must_use]
+    pub fn fill(&self) -> f64 {
+        f64::from(self.occupancy) * 100.0 / f64::from(self.depth.max(1))
+    }
+}
+
+/// Samples the rings of a device.
+///
+/// Rates are computed from the advance of the head and the tail between two samples, a ring
+/// advanced by more than twice its depth between them is undercounted.
+#[derive(Debug)]
+pub struct RingMonitor {
+    rings: Vec<MonitoredRing>,
+    /// Time of the last sample
+    last: Option<Instant>,
+}
+
+impl RingMonitor {
+    /// Creates the monitor of the rings of the device read through `read_csr`, with the depths
+    /// of the driver configuration
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the mode of the device cannot be read
+    #[inline]
+    pub fn new<F>(read_csr: F) -> io::Result<Self>
+    where
+        F: Fn(usize) -> io::Result<u32>,
+    {
+        let mode = ModeProxy(ReadOnly(&read_csr)).mode()?;
+        let depths = DeviceConfig::load_default()
+            .map(|config| config.rings())
+            .unwrap_or_else(|err| {
+                warn!("failed to load config, using the default ring depths: {err}");
+                RingConfig::default()
+            });
+        Ok(Self::with_rings(mode, depths))
+    }
+
+    fn with_rings(mode: Mode, depths: RingConfig) -> Self {
+        let mut rings = Vec::new();
+        let mut add = |name: String, csr: &dyn RingBufferCsrAddr, to_card: bool, depth: usize| {
+            rings.push(MonitoredRing {
+                name,
+                head_addr: csr.head(),
+                tail_addr: csr.tail(),
+                to_card,
+                depth: u32::try_from(depth).unwrap_or(u32::MAX),
+                last: None,
+                stalls: 0,
+                full: 0,
+            });
+        };
+        let channel_ids = mode.channel_ids();
+        for (id, proxy) in channel_ids
+            .iter()
+            .zip(build_send_queue_proxies((), channel_ids))
+        {
+            add(format!("send{id}"), &proxy, true, depths.send);
+        }
+        for (id, proxy) in channel_ids
+            .iter()
+            .zip(build_meta_report_queue_proxies((), channel_ids))
+        {
+            add(format!("meta{id}"), &proxy, false, depths.meta_report);
+        }
+        add("cmd_req".into(), &CmdQueueCsrProxy(()), true, depths.cmd);
+        add(
+            "cmd_resp".into(),
+            &CmdRespQueueCsrProxy(()),
+            false,
+            depths.cmd,
+        );
+        add(
+            "nic_tx".into(),
+            &SimpleNicTxQueueCsrProxy(()),
+            true,
+            depths.simple_nic,
+        );
+        add(
+            "nic_rx".into(),
+            &SimpleNicRxQueueCsrProxy(()),
+            false,
+            depths.simple_nic,
+        );
+
+        Self { rings, last: None }
+    }
+
+    /// Reads the head and the tail of every ring, the rates of the first sample are 0
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if a CSR cannot be read
+    #[inline]
+    pub fn sample<F>(&mut self, read_csr: F) -> io::Result<Vec<RingReport>>
+    where
+        F: Fn(usize) -> io::Result<u32>,
+    {
+        let now = Instant::now();
+        let elapsed = self
+            .last
+            .replace(now)
+            .map_or(0.0, |last| now.duration_since(last).as_secs_f64());
+        let dev = ReadOnly(&read_csr);
+        self.rings
+            .iter_mut()
+            .map(|ring| {
+                let [head, tail] = dev.read_csrs([ring.head_addr, ring.tail_addr])?;
+                Ok(ring.update(head, tail, elapsed))
+            })
+            .collect()
+    }
+}
+
+impl MonitoredRing {
+    fn update(&mut self, head: u32, tail: u32, elapsed: f64) -> RingReport {
+        let occupancy = self.distance(tail, head);
+        let (produced, consumed) = self.last.map_or((0, 0), |(last_head, last_tail)| {
+            (
+                self.distance(last_head, head),
+                self.distance(last_tail, tail),
+            )
+        });
+        if self.last.is_some() && occupancy != 0 && consumed == 0 {
+            self.stalls += 1;
+        }
+        if occupancy >= self.depth {
+            self.full += 1;
+        }
+        self.last = Some((head, tail));
+        let rate = |n: u32| {
+            if elapsed > 0.0 {
+                f64::from(n) / elapsed
+            } else {
+                0.0
+            }
+        };
+
+        RingReport {
+            name: self.name.clone(),
+            to_card: self.to_card,
+            head,
+            tail,
+            occupancy,
+            depth: self.depth,
+            head_rate: rate(produced),
+            tail_rate: rate(consumed),
+            stalls: self.stalls,
+            full: self.full,
+        }
+    }
+
+    /// Returns the number of entries from index `from` to index `to`
+    fn distance(&self, from: u32, to: u32) -> u32 {
+        let wrap = self.depth.wrapping_mul(2).wrapping_sub(1);
+        to.wrapping_sub(from) & wrap
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn samples_track_occupancy_and_stalls() {
+        let mut monitor = RingMonitor::with_rings(Mode::Mode100G, RingConfig::default());
+        let names: Vec<_> = monitor.rings.iter().map(|r| r.name.as_str()).collect();
+        assert_eq!(
+            names,
+            ["send0", "meta0", "cmd_req", "cmd_resp", "nic_tx", "nic_rx"]
+        );
+        let ring = monitor
+            .rings
+            .first_mut()
+            .unwrap_or_else(|| unreachable!("no send ring"));
+        let depth = ring.depth;
+
+        let report = ring.update(8, 0, 0.0);
+        assert_eq!(
+            (report.occupancy, report.head_rate, report.stalls),
+            (8, 0.0, 0)
+        );
+        let report = ring.update(16, 0, 0.5);
+        assert_eq!(
+            (report.occupancy, report.head_rate, report.stalls),
+            (16, 16.0, 1)
+        );
+        // Both indices wrap around at twice the depth
+        let report = ring.update(1, 2 * depth - 4, 1.0);
+        assert_eq!(report.occupancy, 5);
+        assert_eq!(report.tail_rate, f64::from(2 * depth - 4));
+        assert_eq!(report.stalls, 1);
+        let report = ring.update(depth - 4, 2 * depth - 4, 1.0);
+        assert_eq!(
+            (report.occupancy, report.full, report.stalls),
+            (depth, 1, 2)
+        );
+    }
+}
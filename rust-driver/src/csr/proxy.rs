@@ -10,18 +10,15 @@ use crate::csr::{
     CsrReaderAdaptor, CsrWriterAdaptor, DeviceAdaptor, RingBufferCsrAddr, ToCard, ToHost,
 };
 
-use super::{
-    constants::{
-        CSR_ADDR_OFFSET_SIMPLE_NIC_RX_Q_RINGBUF_BASE_ADDR_HIGH,
-        CSR_ADDR_OFFSET_SIMPLE_NIC_RX_Q_RINGBUF_BASE_ADDR_LOW,
-        CSR_ADDR_OFFSET_SIMPLE_NIC_RX_Q_RINGBUF_HEAD, CSR_ADDR_OFFSET_SIMPLE_NIC_RX_Q_RINGBUF_TAIL,
-        CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_BASE_ADDR_HIGH,
-        CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_BASE_ADDR_LOW,
-        CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_HEAD, CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_TAIL,
-        NUM_QPS, QP_RECV_ADDR_HIGH, QP_RECV_ADDR_LOW, QP_RECV_HEAD, QP_RECV_TAIL, QP_WQE_ADDR_HIGH,
-        QP_WQE_ADDR_LOW, QP_WQE_HEAD, QP_WQE_TAIL,
-    },
-    mode::Mode,
+use super::constants::{
+    CSR_ADDR_OFFSET_SIMPLE_NIC_RX_Q_RINGBUF_BASE_ADDR_HIGH,
+    CSR_ADDR_OFFSET_SIMPLE_NIC_RX_Q_RINGBUF_BASE_ADDR_LOW,
+    CSR_ADDR_OFFSET_SIMPLE_NIC_RX_Q_RINGBUF_HEAD, CSR_ADDR_OFFSET_SIMPLE_NIC_RX_Q_RINGBUF_TAIL,
+    CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_BASE_ADDR_HIGH,
+    CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_BASE_ADDR_LOW,
+    CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_HEAD, CSR_ADDR_OFFSET_SIMPLE_NIC_TX_Q_RINGBUF_TAIL,
+    NUM_QPS, QP_RECV_ADDR_HIGH, QP_RECV_ADDR_LOW, QP_RECV_HEAD, QP_RECV_TAIL, QP_WQE_ADDR_HIGH,
+    QP_WQE_ADDR_LOW, QP_WQE_HEAD, QP_WQE_TAIL,
 };
 
 /// Trait for proxying access to an underlying RDMA device.
@@ -227,9 +224,9 @@ impl<Dev> DeviceProxy for MetaReportQueueProxy<Dev> {
 
 pub(crate) fn build_send_queue_proxies<Dev: Clone>(
     dev: Dev,
-    mode: Mode,
+    channel_ids: &[usize],
 ) -> Vec<SendQueueProxy<Dev>> {
-    mode.channel_ids()
+    channel_ids
         .iter()
         .copied()
         .map(|id| SendQueueProxy {
@@ -241,9 +238,9 @@ pub(crate) fn build_send_queue_proxies<Dev: Clone>(
 
 pub(crate) fn build_meta_report_queue_proxies<Dev: Clone>(
     dev: Dev,
-    mode: Mode,
+    channel_ids: &[usize],
 ) -> Vec<MetaReportQueueProxy<Dev>> {
-    mode.channel_ids()
+    channel_ids
         .iter()
         .copied()
         .map(|id| MetaReportQueueProxy {
@@ -255,15 +252,23 @@ pub(crate) fn build_meta_report_queue_proxies<Dev: Clone>(
 
 #[cfg(test)]
 mod test {
+    use crate::csr::mode::Mode;
+
     use super::*;
 
     #[test]
     fn test_build_different_mode() {
-        assert_eq!(build_send_queue_proxies((), Mode::Mode400G).len(), 4);
-        assert_eq!(build_send_queue_proxies((), Mode::Mode200G).len(), 2);
-        assert_eq!(build_send_queue_proxies((), Mode::Mode100G).len(), 1);
-        assert_eq!(build_meta_report_queue_proxies((), Mode::Mode400G).len(), 4);
-        assert_eq!(build_meta_report_queue_proxies((), Mode::Mode200G).len(), 2);
-        assert_eq!(build_meta_report_queue_proxies((), Mode::Mode100G).len(), 1);
+        for (mode, num_channel) in [
+            (Mode::Mode400G, 4),
+            (Mode::Mode200G, 2),
+            (Mode::Mode100G, 1),
+        ] {
+            let channel_ids = mode.channel_ids();
+            assert_eq!(build_send_queue_proxies((), channel_ids).len(), num_channel);
+            assert_eq!(
+                build_meta_report_queue_proxies((), channel_ids).len(),
+                num_channel
+            );
+        }
     }
 }
@@ -266,7 +266,8 @@ struct CmdQueueReqDescQpManagementChunk0 {
 #[bitsize(64)]
 #[derive(Clone, Copy, DebugBits, FromBits)]
 struct CmdQueueReqDescQpManagementChunk1 {
-    reserved4: u16,
+    reserved4: u8,
+    pub max_dest_rd_atomic: u8,
     reserved3: u5,
     pub pmtu: u3,
     reserved2: u4,
@@ -316,6 +317,7 @@ impl CmdQueueReqDescQpManagement {
         pmtu: u8,
         local_udp_port: u16,
         peer_mac_addr: u64,
+        max_dest_rd_atomic: u8,
     ) -> Self {
         let common_header = RingBufDescCommonHead::new_cmd_desc(CmdQueueDescOperators::ManageQp);
         let cmd_queue_common_header = RingbufDescCmdQueueCommonHead::new_with_user_data(user_data);
@@ -330,6 +332,7 @@ impl CmdQueueReqDescQpManagement {
         );
         let c1 = CmdQueueReqDescQpManagementChunk1::new(
             0,
+            max_dest_rd_atomic,
             u5::from_u8(0),
             u3::masked_new(pmtu),
             u4::from_u8(0),
@@ -399,6 +402,14 @@ impl CmdQueueReqDescQpManagement {
         self.c1.set_rq_access_flags(val);
     }
 
+    pub(crate) fn max_dest_rd_atomic(&self) -> u8 {
+        self.c1.max_dest_rd_atomic()
+    }
+
+    pub(crate) fn set_max_dest_rd_atomic(&mut self, val: u8) {
+        self.c1.set_max_dest_rd_atomic(val);
+    }
+
     pub(crate) fn qp_type(&self) -> u8 {
         self.c1.qp_type().into()
     }
@@ -35,10 +35,12 @@ enum RdmaOpCode {
     Resync = 0x15,
     SendLastWithInvalidate = 0x16,
     SendOnlyWithInvalidate = 0x17,
+    Flush = 0x1c,
+    AtomicWrite = 0x1d,
 }
 
 impl RdmaOpCode {
-    fn from_u8(value: u8) -> Option<Self> {
+    const fn from_u8(value: u8) -> Option<Self> {
         let variant = match value {
             0x00 => Self::SendFirst,
             0x01 => Self::SendMiddle,
@@ -64,12 +66,14 @@ impl RdmaOpCode {
             0x15 => Self::Resync,
             0x16 => Self::SendLastWithInvalidate,
             0x17 => Self::SendOnlyWithInvalidate,
+            0x1c => Self::Flush,
+            0x1d => Self::AtomicWrite,
             _ => return None,
         };
         Some(variant)
     }
 
-    fn is_packet(self) -> bool {
+    const fn is_packet(self) -> bool {
         matches!(
             self,
             RdmaOpCode::SendFirst
@@ -89,10 +93,24 @@ impl RdmaOpCode {
                 | RdmaOpCode::RdmaReadResponseMiddle
                 | RdmaOpCode::RdmaReadResponseLast
                 | RdmaOpCode::RdmaReadResponseOnly
+                | RdmaOpCode::CompareSwap
+                | RdmaOpCode::FetchAdd
+                | RdmaOpCode::Flush
+                | RdmaOpCode::AtomicWrite
         )
     }
 
-    fn packet_pos(self) -> Option<PacketPos> {
+    const fn is_atomic(self) -> bool {
+        matches!(
+            self,
+            RdmaOpCode::CompareSwap
+                | RdmaOpCode::FetchAdd
+                | RdmaOpCode::Flush
+                | RdmaOpCode::AtomicWrite
+        )
+    }
+
+    const fn packet_pos(self) -> Option<PacketPos> {
         match self {
             RdmaOpCode::SendFirst
             | RdmaOpCode::RdmaWriteFirst
@@ -112,79 +130,245 @@ impl RdmaOpCode {
             | RdmaOpCode::RdmaWriteOnlyWithImmediate
             | RdmaOpCode::RdmaReadResponseOnly
             | RdmaOpCode::SendOnlyWithImmediate
-            | RdmaOpCode::SendOnlyWithInvalidate => Some(PacketPos::Only),
+            | RdmaOpCode::SendOnlyWithInvalidate
+            | RdmaOpCode::CompareSwap
+            | RdmaOpCode::FetchAdd
+            | RdmaOpCode::Flush
+            | RdmaOpCode::AtomicWrite => Some(PacketPos::Only),
             RdmaOpCode::RdmaReadRequest
             | RdmaOpCode::Acknowledge
             | RdmaOpCode::AtomicAcknowledge
-            | RdmaOpCode::CompareSwap
-            | RdmaOpCode::FetchAdd
             | RdmaOpCode::Resync => None,
         }
     }
 
-    fn is_ack(self) -> bool {
+    const fn is_ack(self) -> bool {
         matches!(
             self,
             RdmaOpCode::Acknowledge | RdmaOpCode::AtomicAcknowledge
         )
     }
+
+    #[allow(clippy::wildcard_enum_match_arm)]
+    const fn header_type(self) -> Option<HeaderType> {
+        let header_type = match self {
+            RdmaOpCode::RdmaWriteFirst
+            | RdmaOpCode::RdmaWriteMiddle
+            | RdmaOpCode::RdmaWriteLast
+            | RdmaOpCode::RdmaWriteOnly => HeaderType::Write,
+            RdmaOpCode::RdmaWriteLastWithImmediate | RdmaOpCode::RdmaWriteOnlyWithImmediate => {
+                HeaderType::WriteWithImm
+            }
+            RdmaOpCode::SendFirst
+            | RdmaOpCode::SendMiddle
+            | RdmaOpCode::SendLast
+            | RdmaOpCode::SendOnly => HeaderType::Send,
+            RdmaOpCode::SendLastWithImmediate | RdmaOpCode::SendOnlyWithImmediate => {
+                HeaderType::SendWithImm
+            }
+            RdmaOpCode::RdmaReadResponseFirst
+            | RdmaOpCode::RdmaReadResponseMiddle
+            | RdmaOpCode::RdmaReadResponseLast
+            | RdmaOpCode::RdmaReadResponseOnly => HeaderType::ReadResp,
+            RdmaOpCode::CompareSwap => HeaderType::CompareSwap,
+            RdmaOpCode::FetchAdd => HeaderType::FetchAdd,
+            RdmaOpCode::Flush => HeaderType::Flush,
+            RdmaOpCode::AtomicWrite => HeaderType::AtomicWrite,
+            _ => return None,
+        };
+        Some(header_type)
+    }
 }
 
-/// Meta report queue descriptor types that can be submitted
-#[derive(Debug, Clone, Copy)]
-pub(crate) enum MetaReportQueueDescFirst {
-    /// Basic packet header info
-    PacketInfo(MetaReportQueuePacketBasicInfoDesc),
-    /// Ack info
-    Ack(MetaReportQueueAckDesc),
-}
-
-impl MetaReportQueueDescFirst {
-    pub(crate) fn has_next(&self) -> bool {
-        match *self {
-            MetaReportQueueDescFirst::PacketInfo(d) => d.common_header().has_next(),
-            MetaReportQueueDescFirst::Ack(d) => d.common_header().has_next(),
+/// Role of a descriptor in a meta report, by its opcode
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum DescKind {
+    /// Header of a packet, or extended info of a read request
+    Packet,
+    /// Header of an atomic request, or its extended info
+    Atomic,
+    /// ACK or NAK, or its extra info
+    Ack,
+    /// ACK of an atomic request
+    AtomicAck,
+    /// Opcode the meta report queue doesn't carry
+    Invalid,
+}
+
+impl DescKind {
+    /// Bits of a kind in a `MetaClass` key
+    const BITS: u32 = 3;
+    const MASK: usize = (1 << Self::BITS) - 1;
+
+    const fn of(opcode: RdmaOpCode) -> Self {
+        if opcode.is_atomic() {
+            Self::Atomic
+        } else if opcode.is_packet() {
+            Self::Packet
+        } else if matches!(opcode, RdmaOpCode::AtomicAcknowledge) {
+            Self::AtomicAck
+        } else if opcode.is_ack() {
+            Self::Ack
+        } else {
+            Self::Invalid
+        }
+    }
+
+    const fn from_bits(bits: usize) -> Self {
+        match bits {
+            0 => Self::Packet,
+            1 => Self::Atomic,
+            2 => Self::Ack,
+            3 => Self::AtomicAck,
+            _ => Self::Invalid,
         }
     }
 }
 
-/// Meta report queue descriptor types that can be submitted
+/// What a meta report descriptor tells from its opcode
 #[derive(Debug, Clone, Copy)]
-pub(crate) enum MetaReportQueueDescNext {
-    /// Extended info for READ
-    ReadInfo(MetaReportQueueReadReqExtendInfoDesc),
-    /// Extra Ack info, used for NAK
-    AckExtra(MetaReportQueueAckExtraDesc),
-}
-
-impl DescDeserialize for MetaReportQueueDescFirst {
-    fn deserialize(d: [u8; 32]) -> Self {
-        let head = RingBufDescCommonHead::from(u16::from_le_bytes([d[30], d[31]]));
-        let rdma_opcode = RdmaOpCode::from_u8(head.op_code())
-            .unwrap_or_else(|| unreachable!("invalid opcode, desc: {:?}", d));
-        match rdma_opcode {
-            op if rdma_opcode.is_packet() => {
-                Self::PacketInfo(MetaReportQueuePacketBasicInfoDesc::deserialize(d))
+struct OpcodeInfo {
+    kind: DescKind,
+    pos: Option<PacketPos>,
+    header_type: Option<HeaderType>,
+}
+
+impl OpcodeInfo {
+    /// Infos indexed by opcode, decoded at build time
+    #[allow(clippy::indexing_slicing)] // `op` is below the length of the table
+    const TABLE: [Self; 1 << u8::BITS] = {
+        let mut table = [Self {
+            kind: DescKind::Invalid,
+            pos: None,
+            header_type: None,
+        }; 1 << u8::BITS];
+        let mut op = 0;
+        while op < table.len() {
+            if let Some(opcode) = RdmaOpCode::from_u8(op as u8) {
+                table[op] = Self {
+                    kind: DescKind::of(opcode),
+                    pos: opcode.packet_pos(),
+                    header_type: opcode.header_type(),
+                };
             }
-            op if rdma_opcode.is_ack() => Self::Ack(MetaReportQueueAckDesc::deserialize(d)),
-            _ => unreachable!("opcode unsupported"),
+            op += 1;
         }
+        table
+    };
+
+    fn of(op_code: u8) -> Self {
+        Self::TABLE
+            .get(usize::from(op_code))
+            .copied()
+            .unwrap_or_else(|| unreachable!("table covers all opcodes"))
+    }
+
+    /// Returns the info of the opcode of the raw descriptor `desc`
+    fn of_desc(desc: &[u8; 32]) -> Self {
+        Self::of(last_chunk(desc).common_header().op_code())
     }
 }
 
-impl DescDeserialize for MetaReportQueueDescNext {
-    fn deserialize(d: [u8; 32]) -> Self {
-        let head = RingBufDescCommonHead::from(u16::from_le_bytes([d[30], d[31]]));
-        let rdma_opcode =
-            RdmaOpCode::from_u8(head.op_code()).unwrap_or_else(|| unreachable!("invalid opcode"));
-        match rdma_opcode {
-            op if rdma_opcode.is_packet() => {
-                Self::ReadInfo(MetaReportQueueReadReqExtendInfoDesc::deserialize(d))
-            }
-            op if rdma_opcode.is_ack() => {
-                Self::AckExtra(MetaReportQueueAckExtraDesc::deserialize(d))
+/// Returns the last chunk of a raw descriptor, its layout up to the common header depends on
+/// the descriptor
+fn last_chunk(desc: &[u8; 32]) -> MetaReportQueueAckExtraDescChunk3 {
+    let [.., c3]: [u64; 4] = bytemuck::cast(*desc);
+    c3.into()
+}
+
+/// The meta a meta report decodes to.
+///
+/// The class of a report depends on the kinds of its descriptors, the ECN bit of a packet and
+/// the origin bits of an ACK. These are gathered in a key without branching, the class of each
+/// key is decoded at build time.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum MetaClass {
+    /// Header of a write, send or read response packet
+    Write,
+    /// Header of a packet marked with ECN
+    Cnp,
+    /// Header of a read request
+    Read,
+    /// Header of an atomic request
+    Atomic,
+    /// ACK generated by the remote driver
+    AckRemoteDriver,
+    /// ACK generated by the local hardware
+    AckLocalHw,
+    /// ACK of an atomic request, with the original value
+    AtomicAck,
+    /// NAK generated by the remote driver
+    NakRemoteDriver,
+    /// NAK generated by the local hardware
+    NakLocalHw,
+    /// NAK generated by the remote hardware
+    NakRemoteHw,
+    /// Descriptors the hardware never reports together
+    Invalid,
+}
+
+impl MetaClass {
+    /// Bits of a key: the kind of the first descriptor, the kind of the next descriptor plus
+    /// one or 0 if there is none, then the ECN, driver and local hardware bits
+    const KEY_BITS: u32 = 2 * DescKind::BITS + 3;
+    const FLAGS_SHIFT: u32 = 2 * DescKind::BITS;
+
+    /// Classes indexed by key
+    #[allow(clippy::indexing_slicing)] // `key` is below the length of the table
+    const TABLE: [Self; 1 << Self::KEY_BITS] = {
+        let mut table = [Self::Invalid; 1 << Self::KEY_BITS];
+        let mut key = 0;
+        while key < table.len() {
+            table[key] = Self::classify(key);
+            key += 1;
+        }
+        table
+    };
+
+    /// Classifies the report made of `first` and, if its next bit is set, `next`
+    #[inline]
+    pub(crate) fn of(first: &[u8; 32], next: Option<&[u8; 32]>) -> Self {
+        let [.., c3]: [u64; 4] = bytemuck::cast(*first);
+        let packet = MetaReportQueuePacketBasicInfoDescChunk3::from(c3);
+        let ack = MetaReportQueueAckDescChunk3::from(c3);
+        let next_kind = next.map_or(0, |d| OpcodeInfo::of_desc(d).kind as usize + 1);
+        let key = OpcodeInfo::of(packet.common_header().op_code()).kind as usize
+            | next_kind << DescKind::BITS
+            | usize::from(packet.ecn_marked()) << Self::FLAGS_SHIFT
+            | usize::from(ack.is_send_by_driver()) << (Self::FLAGS_SHIFT + 1)
+            | usize::from(ack.is_send_by_local_hw()) << (Self::FLAGS_SHIFT + 2);
+        Self::TABLE.get(key).copied().unwrap_or(Self::Invalid)
+    }
+
+    const fn classify(key: usize) -> Self {
+        let first = DescKind::from_bits(key & DescKind::MASK);
+        let next = match (key >> DescKind::BITS) & DescKind::MASK {
+            0 => None,
+            bits => Some(DescKind::from_bits(bits - 1)),
+        };
+        let ecn_marked = (key >> Self::FLAGS_SHIFT) & 1 != 0;
+        let by_driver = (key >> (Self::FLAGS_SHIFT + 1)) & 1 != 0;
+        let by_local_hw = (key >> (Self::FLAGS_SHIFT + 2)) & 1 != 0;
+        match (first, next) {
+            (DescKind::Packet | DescKind::Atomic, None) if ecn_marked => Self::Cnp,
+            (DescKind::Packet | DescKind::Atomic, None) => Self::Write,
+            (DescKind::Packet | DescKind::Atomic, Some(DescKind::Packet)) => Self::Read,
+            (DescKind::Packet | DescKind::Atomic, Some(DescKind::Atomic)) => Self::Atomic,
+            (DescKind::Ack | DescKind::AtomicAck, None) => match (by_driver, by_local_hw) {
+                (true, false) => Self::AckRemoteDriver,
+                (false, true) => Self::AckLocalHw,
+                (false, false) | (true, true) => Self::Invalid,
+            },
+            (DescKind::AtomicAck, Some(DescKind::Ack | DescKind::AtomicAck)) => Self::AtomicAck,
+            (DescKind::Ack, Some(DescKind::Ack | DescKind::AtomicAck)) => {
+                match (by_driver, by_local_hw) {
+                    (true, false) => Self::NakRemoteDriver,
+                    (false, true) => Self::NakLocalHw,
+                    (false, false) => Self::NakRemoteHw,
+                    (true, true) => Self::Invalid,
+                }
             }
-            _ => unreachable!("opcode unsupported"),
+            _ => Self::Invalid,
         }
     }
 }
@@ -234,39 +418,17 @@ pub(crate) struct MetaReportQueuePacketBasicInfoDesc {
 
 impl MetaReportQueuePacketBasicInfoDesc {
     pub(crate) fn packet_pos(&self) -> PacketPos {
-        RdmaOpCode::from_u8(self.c3.common_header().op_code())
-            .and_then(RdmaOpCode::packet_pos)
+        OpcodeInfo::of(self.c3.common_header().op_code())
+            .pos
             .unwrap_or_else(|| {
                 unreachable!("packet position info should always exists for this descriptor")
             })
     }
 
-    #[allow(clippy::wildcard_enum_match_arm)]
     pub(crate) fn header_type(&self) -> HeaderType {
-        let opcode = RdmaOpCode::from_u8(self.c3.common_header().op_code()).unwrap_or_else(|| {
-            unreachable!("packet position info should always exists for this descriptor")
-        });
-        match opcode {
-            RdmaOpCode::RdmaWriteFirst
-            | RdmaOpCode::RdmaWriteMiddle
-            | RdmaOpCode::RdmaWriteLast
-            | RdmaOpCode::RdmaWriteOnly => HeaderType::Write,
-            RdmaOpCode::RdmaWriteLastWithImmediate | RdmaOpCode::RdmaWriteOnlyWithImmediate => {
-                HeaderType::WriteWithImm
-            }
-            RdmaOpCode::SendFirst
-            | RdmaOpCode::SendMiddle
-            | RdmaOpCode::SendLast
-            | RdmaOpCode::SendOnly => HeaderType::Send,
-            RdmaOpCode::SendLastWithImmediate | RdmaOpCode::SendOnlyWithImmediate => {
-                HeaderType::SendWithImm
-            }
-            RdmaOpCode::RdmaReadResponseFirst
-            | RdmaOpCode::RdmaReadResponseMiddle
-            | RdmaOpCode::RdmaReadResponseLast
-            | RdmaOpCode::RdmaReadResponseOnly => HeaderType::ReadResp,
-            _ => unreachable!("unsupported header type"),
-        }
+        OpcodeInfo::of(self.c3.common_header().op_code())
+            .header_type
+            .unwrap_or_else(|| unreachable!("unsupported header type"))
     }
 
     pub(crate) fn msn(&self) -> u16 {
@@ -424,6 +586,60 @@ impl MetaReportQueueReadReqExtendInfoDesc {
     }
 }
 
+#[bitsize(64)]
+#[derive(Clone, Copy, DebugBits, FromBits)]
+struct MetaReportQueueAtomicReqExtendInfoDescChunk0 {
+    pub swap: u64,
+}
+
+#[bitsize(64)]
+#[derive(Clone, Copy, DebugBits, FromBits)]
+struct MetaReportQueueAtomicReqExtendInfoDescChunk1 {
+    pub compare_add: u64,
+}
+
+#[bitsize(64)]
+#[derive(Clone, Copy, DebugBits, FromBits)]
+struct MetaReportQueueAtomicReqExtendInfoDescChunk2 {
+    reserved2: u64,
+}
+
+#[bitsize(64)]
+#[derive(Clone, Copy, DebugBits, FromBits)]
+struct MetaReportQueueAtomicReqExtendInfoDescChunk3 {
+    reserved1: u32,
+    reserved0: u16,
+    pub common_header: RingBufDescCommonHead,
+}
+
+/// Operands of an atomic request, the AtomicETH of the packet
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct MetaReportQueueAtomicReqExtendInfoDesc {
+    c0: MetaReportQueueAtomicReqExtendInfoDescChunk0,
+    c1: MetaReportQueueAtomicReqExtendInfoDescChunk1,
+    c2: MetaReportQueueAtomicReqExtendInfoDescChunk2,
+    c3: MetaReportQueueAtomicReqExtendInfoDescChunk3,
+}
+
+impl MetaReportQueueAtomicReqExtendInfoDesc {
+    pub(crate) fn swap(&self) -> u64 {
+        self.c0.swap()
+    }
+
+    pub(crate) fn set_swap(&mut self, val: u64) {
+        self.c0.set_swap(val);
+    }
+
+    pub(crate) fn compare_add(&self) -> u64 {
+        self.c1.compare_add()
+    }
+
+    pub(crate) fn set_compare_add(&mut self, val: u64) {
+        self.c1.set_compare_add(val);
+    }
+}
+
 #[bitsize(64)]
 #[derive(Clone, Copy, DebugBits, FromBits)]
 struct MetaReportQueueAckDescChunk0 {
@@ -468,6 +684,13 @@ pub(crate) struct MetaReportQueueAckDesc {
 }
 
 impl MetaReportQueueAckDesc {
+    /// Returns whether the ACK answers an atomic request, its extra descriptor carries the
+    /// original value
+    pub(crate) fn is_atomic_ack(&self) -> bool {
+        RdmaOpCode::from_u8(self.c3.common_header().op_code())
+            == Some(RdmaOpCode::AtomicAcknowledge)
+    }
+
     pub(crate) fn is_send_by_local_hw(&self) -> bool {
         self.c3.is_send_by_local_hw()
     }
@@ -595,6 +818,53 @@ impl MetaReportQueueAckExtraDesc {
 impl_desc_serde!(
     MetaReportQueuePacketBasicInfoDesc,
     MetaReportQueueReadReqExtendInfoDesc,
+    MetaReportQueueAtomicReqExtendInfoDesc,
     MetaReportQueueAckDesc,
     MetaReportQueueAckExtraDesc
 );
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn with_op_code(mut desc: [u8; 32], op_code: u8) -> [u8; 32] {
+        desc[30] = op_code;
+        desc
+    }
+
+    #[test]
+    fn reports_are_classified_by_their_descriptors() {
+        let mut packet = MetaReportQueuePacketBasicInfoDesc::deserialize([0; 32]);
+        let write = with_op_code(packet.serialize(), 0x0a);
+        assert_eq!(MetaClass::of(&write, None), MetaClass::Write);
+        packet.set_ecn_marked(true);
+        let cnp = with_op_code(packet.serialize(), 0x0a);
+        assert_eq!(MetaClass::of(&cnp, None), MetaClass::Cnp);
+        let read = with_op_code([0; 32], 0x0c);
+        assert_eq!(MetaClass::of(&read, Some(&read)), MetaClass::Read);
+        let atomic = with_op_code([0; 32], 0x13);
+        assert_eq!(MetaClass::of(&atomic, Some(&atomic)), MetaClass::Atomic);
+
+        let mut ack = MetaReportQueueAckDesc::deserialize([0; 32]);
+        ack.set_is_send_by_local_hw(true);
+        let local_hw = with_op_code(ack.serialize(), 0x11);
+        let remote_hw = with_op_code([0; 32], 0x11);
+        assert_eq!(MetaClass::of(&local_hw, None), MetaClass::AckLocalHw);
+        assert_eq!(
+            MetaClass::of(&local_hw, Some(&remote_hw)),
+            MetaClass::NakLocalHw
+        );
+        assert_eq!(
+            MetaClass::of(&remote_hw, Some(&remote_hw)),
+            MetaClass::NakRemoteHw
+        );
+        let atomic_ack = with_op_code([0; 32], 0x12);
+        assert_eq!(
+            MetaClass::of(&atomic_ack, Some(&remote_hw)),
+            MetaClass::AtomicAck
+        );
+
+        assert_eq!(MetaClass::of(&remote_hw, None), MetaClass::Invalid);
+        assert_eq!(MetaClass::of(&write, Some(&remote_hw)), MetaClass::Invalid);
+    }
+}
@@ -96,6 +96,13 @@ impl SendQueueReqDescSeg0 {
         Self { c0, c1, c2, c3 }
     }
 
+    /// Sets the op code of the common header, the next bit stays set
+    pub(crate) fn set_op_code(&mut self, op_code: WorkReqOpCode) {
+        let mut common_header = RingBufDescCommonHead::new_send_desc(op_code);
+        common_header.set_has_next(true);
+        self.c3.set_common_header(common_header);
+    }
+
     pub(crate) fn msn(&self) -> u16 {
         self.c3.msn()
     }
@@ -268,6 +275,12 @@ impl SendQueueReqDescSeg1 {
         Self { c0, c1, c2, c3 }
     }
 
+    /// Sets the op code of the common header
+    pub(crate) fn set_op_code(&mut self, op_code: WorkReqOpCode) {
+        self.c3
+            .set_common_header(RingBufDescCommonHead::new_send_desc(op_code));
+    }
+
     pub(crate) fn pmtu(&self) -> u8 {
         self.c3.pmtu().into()
     }
@@ -32,6 +32,10 @@ pub enum RdmaError {
     #[error("Connection error: {0}")]
     ConnectionError(String),
 
+    /// Queue full, retried once its entries complete
+    #[error("Queue full: {0}")]
+    QueueFull(String),
+
     /// Memory registration error
     #[error("Memory registration error: {0}")]
     MemoryError(String),
@@ -80,7 +84,7 @@ impl RdmaError {
             RdmaError::NotFound(_) => libc::ENOENT,
             RdmaError::ResourceExhausted(_) => libc::ENOSPC,
             RdmaError::ConnectionError(_) => libc::ECONNREFUSED,
-            RdmaError::MemoryError(_) => libc::ENOMEM,
+            RdmaError::QueueFull(_) | RdmaError::MemoryError(_) => libc::ENOMEM,
             RdmaError::Timeout(_) => libc::ETIMEDOUT,
             RdmaError::IoError(ref e) => e.raw_os_error().unwrap_or(libc::EIO),
             _ => libc::EIO,
@@ -0,0 +1,405 @@
+use std::{fs, io, path::Path};
+
+/// Magic of the stats file, "BLUESTAT"
+const MAGIC: u64 = 0x5441_5453_4555_4c42;
+/// Layout version of the stats file
+const VERSION: u64 = 1;
+/// Number of `u64` words of the stats file header
+const HEADER_WORDS: usize = 8;
+/// Number of bits of precision of a bucket, values below `1 << SUB_BITS` are exact
+const SUB_BITS: u32 = 6;
+/// Number of buckets with a width of one
+const SUB_BUCKETS: usize = 1 << SUB_BITS;
+/// Number of buckets of each power of two above `SUB_BUCKETS`
+const HALF_BUCKETS: usize = SUB_BUCKETS / 2;
+/// Number of buckets of a histogram, covers the whole `u64` range
+pub const NUM_BUCKETS: usize = SUB_BUCKETS + (64 - SUB_BITS as usize) * HALF_BUCKETS;
+/// Environment variable overriding the path of the stats file
+#[cfg(feature = "latency_stats")]
+const STATS_FILE_ENV: &str = "BLUE_RDMA_STATS_FILE";
+
+/// A stage of the hot path with its own latency histogram
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[non_exhaustive]
+pub enum Stage {
+    /// From `post_send` to the dequeue of the WR by the `RdmaWriteWorker`
+    Dequeue,
+    /// From `post_send` to the write of the descriptors of a chunk to the send ring
+    RingWrite,
+    /// From the write of the oldest unrung descriptor to the head CSR write
+    Doorbell,
+    /// From the arrival of the meta report acknowledging a WR to the CQ push
+    Completion,
+    /// From the CQ push to the return of the completion by `poll_cq`
+    PollCq,
+}
+
+impl Stage {
+    /// All stages, in the order of the stats file
+    pub const ALL: [Stage; 5] = [
+        Stage::Dequeue,
+        Stage::RingWrite,
+        Stage::Doorbell,
+        Stage::Completion,
+        Stage::PollCq,
+    ];
+
+    /// Returns the name of the stage
+    #[must_use]
+    pub fn name(self) -> &'static str {
+        match self {
+            Stage::Dequeue => "dequeue",
+            Stage::RingWrite => "ring_write",
+            Stage::Doorbell => "doorbell",
+            Stage::Completion => "completion",
+            Stage::PollCq => "poll_cq",
+        }
+    }
+}
+
+/// A timestamp on the hot path.
+///
+/// Zero sized and free to take unless the `latency_stats` feature is enabled, a default stamp
+/// is not taken and records nothing. Stamps always compare equal so that the types carrying
+/// them keep their equality.
+#[derive(Debug, Clone, Copy, Default)]
+pub(crate) struct Stamp {
+    /// Cycle counter at the time of the stamp, 0 if not taken
+    #[cfg(feature = "latency_stats")]
+    tsc: u64,
+}
+
+impl PartialEq for Stamp {
+    fn eq(&self, _other: &Self) -> bool {
+        true
+    }
+}
+
+impl Eq for Stamp {}
+
+impl Stamp {
+    /// Takes a stamp of the current time
+    #[inline]
+    pub(crate) fn now() -> Self {
+        Self {
+            #[cfg(feature = "latency_stats")]
+            tsc: recorder::cycles().max(1),
+        }
+    }
+
+    /// Records the time elapsed since the stamp in the histogram of `stage`
+    #[inline]
+    #[allow(clippy::unused_self, unused_variables)]
+    pub(crate) fn record(self, stage: Stage) {
+        #[cfg(feature = "latency_stats")]
+        if self.tsc != 0 {
+            recorder::record(stage, recorder::cycles().saturating_sub(self.tsc));
+        }
+    }
+}
+
+/// Opens the stats file of the process, a no-op unless the `latency_stats` feature is enabled.
+///
+/// The file is `BLUE_RDMA_STATS_FILE` or `/dev/shm/bluerdma-stats-<pid>` by default. Contexts
+/// of the process share the file, it is created by the first one.
+pub(crate) fn init() {
+    #[cfg(feature = "latency_stats")]
+    recorder::init();
+}
+
+/// The writer side of the stats file
+#[cfg(feature = "latency_stats")]
+mod recorder {
+    use std::{
+        fs::OpenOptions,
+        path::{Path, PathBuf},
+        sync::{
+            atomic::{AtomicU64, Ordering},
+            OnceLock,
+        },
+        time::{Duration, Instant},
+    };
+
+    use log::{error, info};
+
+    use super::{bucket_index, Stage, HEADER_WORDS, MAGIC, NUM_BUCKETS, STATS_FILE_ENV, VERSION};
+
+    /// Histogram counters of all stages, `None` if the file could not be created
+    static COUNTS: OnceLock<Option<&'static [AtomicU64]>> = OnceLock::new();
+
+    /// Returns the cycle counter
+    #[cfg(target_arch = "x86_64")]
+    #[allow(unsafe_code)]
+    #[inline]
+    pub(super) fn cycles() -> u64 {
+        // SAFETY: `rdtsc` is available on all x86_64 CPUs
+        unsafe { core::arch::x86_64::_rdtsc() }
+    }
+
+    /// Returns the nanoseconds elapsed since the first call, used as the cycle counter on
+    /// targets without a TSC
+    #[cfg(not(target_arch = "x86_64"))]
+    #[inline]
+    pub(super) fn cycles() -> u64 {
+        crate::workers::completion::device_clock_ns()
+    }
+
+    /// Returns the frequency of the cycle counter in kHz
+    fn calibrate() -> u64 {
+        let start = Instant::now();
+        let start_cycles = cycles();
+        std::thread::sleep(Duration::from_millis(10));
+        let elapsed = u64::try_from(start.elapsed().as_nanos()).unwrap_or(u64::MAX);
+        let ticks = cycles().saturating_sub(start_cycles);
+        (u128::from(ticks) * 1_000_000 / u128::from(elapsed.max(1)))
+            .try_into()
+            .unwrap_or(u64::MAX)
+            .max(1)
+    }
+
+    pub(super) fn init() {
+        let _counts = COUNTS.get_or_init(|| {
+            let path = std::env::var_os(STATS_FILE_ENV).map_or_else(
+                || PathBuf::from(format!("/dev/shm/bluerdma-stats-{}", std::process::id())),
+                PathBuf::from,
+            );
+            match create(&path) {
+                Ok(counts) => {
+                    info!("latency stats written to {}", path.display());
+                    Some(counts)
+                }
+                Err(err) => {
+                    error!("failed to create stats file {}: {err}", path.display());
+                    None
+                }
+            }
+        });
+    }
+
+    /// Creates the stats file and maps it for the lifetime of the process
+    #[allow(unsafe_code)]
+    fn create(path: &Path) -> std::io::Result<&'static [AtomicU64]> {
+        let num_words = HEADER_WORDS + Stage::ALL.len() * NUM_BUCKETS;
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(true)
+            .open(path)?;
+        file.set_len((num_words * size_of::<u64>()) as u64)?;
+        // SAFETY: the file is created by this process, readers only read it
+        let map = Box::leak(Box::new(unsafe { memmap2::MmapMut::map_mut(&file)? }));
+        // SAFETY: the mapping is page aligned, zero filled, `num_words` words long and never
+        // unmapped, it is only accessed through the atomics
+        let words =
+            unsafe { std::slice::from_raw_parts(map.as_mut_ptr().cast::<AtomicU64>(), num_words) };
+        let (header, _counts) = words.split_at(HEADER_WORDS);
+        let fields = [
+            VERSION,
+            calibrate(),
+            Stage::ALL.len() as u64,
+            NUM_BUCKETS as u64,
+        ];
+        for (word, value) in header.iter().skip(1).zip(fields) {
+            word.store(value, Ordering::Relaxed);
+        }
+        // The magic is written last, readers ignore files without it
+        header
+            .first()
+            .unwrap_or_else(|| unreachable!("empty header"))
+            .store(MAGIC, Ordering::Release);
+
+        Ok(words)
+    }
+
+    /// Counts a sample of `ticks` cycles in the histogram of `stage`
+    #[inline]
+    pub(super) fn record(stage: Stage, ticks: u64) {
+        let Some(Some(counts)) = COUNTS.get() else {
+            return;
+        };
+        let index = HEADER_WORDS + stage as usize * NUM_BUCKETS + bucket_index(ticks);
+        if let Some(count) = counts.get(index) {
+            let _prev = count.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+}
+
+/// Returns the bucket of `value`
+fn bucket_index(value: u64) -> usize {
+    if value < SUB_BUCKETS as u64 {
+        return value as usize;
+    }
+    let shift = 64 - value.leading_zeros() - SUB_BITS;
+    SUB_BUCKETS + (shift as usize - 1) * HALF_BUCKETS + ((value >> shift) as usize - HALF_BUCKETS)
+}
+
+/// Returns the lowest value of bucket `index`
+fn bucket_value(index: usize) -> u64 {
+    if index < SUB_BUCKETS {
+        return index as u64;
+    }
+    let offset = index - SUB_BUCKETS;
+    let shift = offset / HALF_BUCKETS + 1;
+    ((offset % HALF_BUCKETS + HALF_BUCKETS) as u64) << shift
+}
+
+/// A stats file written by a process running the driver with the `latency_stats` feature
+#[derive(Debug)]
+pub struct StatsFile {
+    /// Words of the file
+    words: Vec<u64>,
+    /// Frequency of the cycle counter of the samples in kHz
+    tsc_khz: u64,
+}
+
+impl StatsFile {
+    /// Reads the stats file at `path`, a snapshot of the histograms at the time of the call
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the file cannot be read or is not a stats file
+    pub fn open<P: AsRef<Path>>(path: P) -> io::Result<Self> {
+        let words: Vec<u64> = fs::read(path)?
+            .chunks_exact(size_of::<u64>())
+            .map(|b| u64::from_ne_bytes(b.try_into().unwrap_or_else(|_| unreachable!())))
+            .collect();
+        let invalid = || io::Error::new(io::ErrorKind::InvalidData, "not a stats file");
+        let Some(&[magic, version, tsc_khz, num_stages, num_buckets, ..]) =
+            words.get(..HEADER_WORDS)
+        else {
+            return Err(invalid());
+        };
+        let expected = HEADER_WORDS + Stage::ALL.len() * NUM_BUCKETS;
+        if magic != MAGIC
+            || version != VERSION
+            || tsc_khz == 0
+            || num_stages != Stage::ALL.len() as u64
+            || num_buckets != NUM_BUCKETS as u64
+            || words.len() != expected
+        {
+            return Err(invalid());
+        }
+
+        Ok(Self { words, tsc_khz })
+    }
+
+    /// Returns the histogram of `stage`
+    #[must_use]
+    pub fn histogram(&self, stage: Stage) -> Histogram {
+        let start = HEADER_WORDS + stage as usize * NUM_BUCKETS;
+        let counts = self
+            .words
+            .get(start..start + NUM_BUCKETS)
+            .unwrap_or_else(|| unreachable!("stats file size checked on open"))
+            .to_vec();
+        Histogram {
+            counts,
+            tsc_khz: self.tsc_khz,
+        }
+    }
+}
+
+/// A latency histogram of a stage, with a relative precision of 1/32
+#[derive(Debug, Clone)]
+pub struct Histogram {
+    /// Number of samples of each bucket
+    counts: Vec<u64>,
+    /// Frequency of the cycle counter of the samples in kHz
+    tsc_khz: u64,
+}
+
+impl Histogram {
+    /// Returns the number of samples
+    #[must_use]
+    pub fn count(&self) -> u64 {
+        self.counts.iter().sum()
+    }
+
+    /// Returns the latency in nanoseconds below which `num / den` of the samples fall, 0 if
+    /// the histogram is empty
+    #[must_use]
+    pub fn quantile_ns(&self, num: u64, den: u64) -> u64 {
+        let total = self.count();
+        if total == 0 || den == 0 {
+            return 0;
+        }
+        let rank = (u128::from(total) * u128::from(num.min(den))).div_ceil(u128::from(den));
+        let rank = u64::try_from(rank).unwrap_or(u64::MAX).max(1);
+        let mut seen = 0u64;
+        let index = self
+            .counts
+            .iter()
+            .position(|&c| {
+                seen += c;
+                seen >= rank
+            })
+            .unwrap_or(0);
+        self.to_ns(bucket_value(index))
+    }
+
+    /// Returns the highest latency in nanoseconds, 0 if the histogram is empty
+    #[must_use]
+    pub fn max_ns(&self) -> u64 {
+        self.counts
+            .iter()
+            .rposition(|&c| c != 0)
+            .map_or(0, |index| self.to_ns(bucket_value(index)))
+    }
+
+    /// Converts cycles to nanoseconds
+    fn to_ns(&self, ticks: u64) -> u64 {
+        (u128::from(ticks) * 1_000_000 / u128::from(self.tsc_khz))
+            .try_into()
+            .unwrap_or(u64::MAX)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn bucket_index_covers_the_u64_range() {
+        assert_eq!(bucket_index(0), 0);
+        assert_eq!(bucket_index(63), 63);
+        assert_eq!(bucket_index(64), 64);
+        assert_eq!(bucket_index(u64::MAX), NUM_BUCKETS - 1);
+        let mut prev = 0;
+        for shift in 0..64 {
+            for value in [1u64 << shift, (1u64 << shift) + 1, (2u64 << shift) - 1] {
+                let index = bucket_index(value);
+                assert!(index >= prev && index < NUM_BUCKETS);
+                prev = index;
+            }
+        }
+    }
+
+    #[test]
+    fn bucket_value_is_within_precision() {
+        for value in [0, 1, 63, 64, 65, 127, 128, 1000, 123_456_789, u64::MAX] {
+            let low = bucket_value(bucket_index(value));
+            assert!(low <= value);
+            assert!(value - low <= low / HALF_BUCKETS as u64);
+        }
+    }
+
+    #[test]
+    fn histogram_quantiles() {
+        let mut counts = vec![0; NUM_BUCKETS];
+        for value in 1..=100 {
+            if let Some(count) = counts.get_mut(bucket_index(value)) {
+                *count += 1;
+            }
+        }
+        let histogram = Histogram {
+            counts,
+            tsc_khz: 1_000_000,
+        };
+        assert_eq!(histogram.count(), 100);
+        assert_eq!(histogram.quantile_ns(1, 2), 50);
+        assert_eq!(histogram.quantile_ns(99, 100), 98);
+        assert_eq!(histogram.max_ns(), 100);
+        assert_eq!(histogram.quantile_ns(1, 0), 0);
+    }
+}
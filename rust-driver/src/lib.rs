@@ -168,20 +168,33 @@ mod cmd;
 mod config;
 /// Constants used throughout the driver
 mod constants;
-mod csr;
+/// Per-device and per-QP counters of the driver
+mod counters;
+/// Control and status registers of the device
+pub mod csr;
 mod descriptors;
 /// Error types and handling
 mod error;
+/// Latency histograms of the hot path stages
+pub mod latency;
 /// Memory operation components
 #[allow(unsafe_code)]
 mod mem;
 /// Network implementations
 pub mod net;
 pub(crate) mod rdma_utils;
+/// Reload of the tunables when the configuration file changes
+mod reload;
 mod ringbuf;
+/// Statically defined tracepoints of the hot paths
+mod sdt;
+/// Time spent in the phases of a device open
+mod startup;
+/// Tracing of the hot paths into an in-memory ring
+pub mod trace;
 mod verbs;
 mod workers;
 
 pub use error::{RdmaError, Result};
-pub use verbs::{core::BlueRdmaCore, ffi::RdmaCtxOps};
+pub use verbs::{core::BlueRdmaCore, ffi::RdmaCtxOps, native};
 pub mod test_wrapper;
@@ -3,11 +3,14 @@ use nix::ioctl_write_ptr;
 use nix::sys::memfd::{memfd_create, MemFdCreateFlag};
 use std::fs::{File, OpenOptions};
 use std::io;
-use std::os::unix::io::{FromRawFd, IntoRawFd};
+use std::os::unix::io::{FromRawFd, IntoRawFd, RawFd};
 
 use crate::constants::PAGE_SIZE_2MB;
 
-use super::page::{ContiguousPages, MmapMut, PageAllocator};
+use super::{
+    page::{ContiguousPages, MmapMut, PageAllocator},
+    virt_to_phy::get_base_page_size,
+};
 
 const UDMABUF_IOCTL_TYPE: u8 = b'u';
 const UDMABUF_CREATE_NR: u8 = 0x42;
@@ -85,6 +88,51 @@ impl DmaBufAllocator {
     }
 }
 
+/// A mapping of a range of an imported dma-buf
+pub(crate) struct DmabufMapping {
+    /// Mapping of the base pages covering the range
+    mmap: MmapMut,
+    /// Offset of the range from the start of the mapping
+    offset: usize,
+}
+
+impl DmabufMapping {
+    /// Maps `length` bytes at `offset` of the dma-buf `fd` and populates the page tables, so
+    /// that the pages of the range are resolvable through the pagemap
+    #[allow(clippy::as_conversions, clippy::cast_possible_wrap)]
+    pub(crate) fn map(fd: RawFd, offset: u64, length: usize) -> io::Result<Self> {
+        let map_offset = offset - offset % get_base_page_size();
+        let in_page = (offset - map_offset) as usize;
+        let len = in_page
+            .checked_add(length)
+            .ok_or(io::Error::from(io::ErrorKind::InvalidInput))?;
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED | libc::MAP_POPULATE,
+                fd,
+                map_offset as libc::off_t,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+
+        Ok(Self {
+            mmap: MmapMut::new(ptr, len),
+            offset: in_page,
+        })
+    }
+
+    /// Returns the virtual address of the first byte of the range
+    #[allow(clippy::as_conversions)]
+    pub(crate) fn addr(&self) -> u64 {
+        self.mmap.as_ptr() as u64 + self.offset as u64
+    }
+}
+
 impl PageAllocator<1> for DmaBufAllocator {
     fn alloc(&mut self) -> io::Result<ContiguousPages<1>> {
         Self::create().map(ContiguousPages::new)
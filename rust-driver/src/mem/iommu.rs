@@ -0,0 +1,88 @@
+use std::{io, path::Path};
+
+use log::debug;
+use parking_lot::Mutex;
+use pci_driver::{backends::vfio::VfioPciDevice, device::PciDevice, regions::Permissions};
+
+use super::pinned_ranges::PinnedRanges;
+
+/// IOMMU domain of a device opened through VFIO.
+///
+/// The registered memory is mapped at IOVA = VA, so the device is handed virtual addresses and
+/// no page is translated through the pagemap. The mappings pin their pages, a page is mapped
+/// once however many registrations reference it.
+pub(crate) struct IommuDomain {
+    device: VfioPciDevice,
+    mappings: Mutex<PinnedRanges<()>>,
+}
+
+impl IommuDomain {
+    /// Opens the VFIO device at `sysfs_path`, which must be bound to `vfio-pci`
+    pub(crate) fn open(sysfs_path: impl AsRef<Path>) -> io::Result<Self> {
+        let device = VfioPciDevice::open(sysfs_path.as_ref()).map_err(|err| {
+            io::Error::new(
+                io::ErrorKind::Other,
+                format!("Failed to open VFIO device: {err}"),
+            )
+        })?;
+        if device.iommu().is_none() {
+            return Err(io::Error::new(
+                io::ErrorKind::Unsupported,
+                "VFIO device has no IOMMU",
+            ));
+        }
+
+        Ok(Self {
+            device,
+            mappings: Mutex::new(PinnedRanges::default()),
+        })
+    }
+
+    /// Maps the pages of the range at IOVA = VA, the pages already mapped are kept
+    pub(crate) fn map(&self, addr: u64, length: usize) -> io::Result<()> {
+        let mut mappings = self.mappings.lock();
+        for (start, len) in mappings.gaps(addr, length) {
+            self.map_dma(start, start, len)?;
+            mappings.insert(start, len, ());
+        }
+        mappings.acquire(addr, length);
+
+        Ok(())
+    }
+
+    /// Maps `length` bytes at `addr` at the IOVA `iova`, for memory the device is handed the
+    /// physical address of
+    pub(crate) fn map_at(&self, iova: u64, addr: u64, length: usize) -> io::Result<()> {
+        self.map_dma(iova, addr, length)
+    }
+
+    /// Releases the pages of the range, which no registration references anymore. The mappings
+    /// left without a referenced page are unmapped
+    pub(crate) fn unmap(&self, addr: u64, length: usize) -> io::Result<()> {
+        let mut mappings = self.mappings.lock();
+        for (start, len, ()) in mappings.release(addr, length) {
+            self.iommu()?.unmap(start, len)?;
+            debug!("iommu unmap: iova=0x{start:x}, len=0x{len:x}");
+        }
+
+        Ok(())
+    }
+
+    #[allow(unsafe_code, clippy::as_conversions)]
+    fn map_dma(&self, iova: u64, addr: u64, length: usize) -> io::Result<()> {
+        // SAFETY: the pages are pinned by the mapping until they are unmapped, the device only
+        // accesses them through the registrations referencing them
+        unsafe {
+            self.iommu()?
+                .map(iova, length, addr as *const u8, Permissions::ReadWrite)?;
+        }
+        debug!("iommu map: iova=0x{iova:x}, va=0x{addr:x}, len=0x{length:x}");
+        Ok(())
+    }
+
+    fn iommu(&self) -> io::Result<pci_driver::iommu::PciIommu<'_>> {
+        self.device
+            .iommu()
+            .ok_or_else(|| io::Error::new(io::ErrorKind::Unsupported, "VFIO device has no IOMMU"))
+    }
+}
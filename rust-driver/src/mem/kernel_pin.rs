@@ -0,0 +1,296 @@
+use std::{
+    fs::{self, File, OpenOptions},
+    io,
+    os::fd::{AsRawFd, FromRawFd, OwnedFd},
+    path::PathBuf,
+};
+
+use log::{debug, warn};
+use parking_lot::Mutex;
+
+use crate::constants::{BLUE_RDMA_IBDEV_NAME_PREFIX, UVERBS_DEV_PATH, UVERBS_SYSFS_CLASS_PATH};
+
+use super::{pinned_ranges::PinnedRanges, PAGE_SIZE, PAGE_SIZE_BITS};
+
+/// Commands of `enum ib_uverbs_write_cmds`
+const IB_USER_VERBS_CMD_GET_CONTEXT: u32 = 0;
+const IB_USER_VERBS_CMD_ALLOC_PD: u32 = 3;
+const IB_USER_VERBS_CMD_REG_MR: u32 = 9;
+const IB_USER_VERBS_CMD_DEREG_MR: u32 = 13;
+
+/// `IBV_ACCESS_LOCAL_WRITE`, the pages are pinned for writing
+const ACCESS_LOCAL_WRITE: u32 = 1;
+
+/// `struct ib_uverbs_cmd_hdr`, the lengths are in words of 4 bytes and include the header
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct CmdHdr {
+    command: u32,
+    in_words: u16,
+    out_words: u16,
+}
+
+impl CmdHdr {
+    #[allow(clippy::as_conversions, clippy::cast_possible_truncation)]
+    fn new<C, R>(command: u32) -> Self {
+        Self {
+            command,
+            in_words: (size_of::<C>() / 4) as u16,
+            out_words: (size_of::<R>() / 4) as u16,
+        }
+    }
+}
+
+/// `struct ib_uverbs_get_context` and `struct ib_uverbs_alloc_pd`
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct ResponseCmd {
+    hdr: CmdHdr,
+    response: u64,
+}
+
+/// `struct ib_uverbs_get_context_resp` followed by `struct bluerdma_alloc_ucontext_resp`
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy)]
+struct GetContextResp {
+    async_fd: i32,
+    num_comp_vectors: u32,
+    queue_mmap_offset: u64,
+    queue_size: u32,
+    reserved: u32,
+}
+
+/// `struct ib_uverbs_alloc_pd_resp`
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy)]
+struct AllocPdResp {
+    pd_handle: u32,
+}
+
+/// `struct ib_uverbs_reg_mr` followed by `struct bluerdma_reg_mr_cmd`
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct RegMrCmd {
+    hdr: CmdHdr,
+    response: u64,
+    start: u64,
+    length: u64,
+    hca_va: u64,
+    pd_handle: u32,
+    access_flags: u32,
+    page_list: u64,
+    page_list_len: u32,
+    page_shift: u32,
+}
+
+/// `struct ib_uverbs_reg_mr_resp` followed by `struct bluerdma_reg_mr_resp`
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy)]
+struct RegMrResp {
+    mr_handle: u32,
+    lkey: u32,
+    rkey: u32,
+    num_pages: u32,
+    reserved: u32,
+}
+
+/// `struct ib_uverbs_dereg_mr`
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct DeregMrCmd {
+    hdr: CmdHdr,
+    mr_handle: u32,
+}
+
+/// Registration of a pinned range with the kernel module
+#[derive(Debug)]
+struct KernelMr {
+    handle: u32,
+    /// DMA address of each page of the range
+    dma_addrs: Vec<u64>,
+}
+
+/// Pins the registered memory through the uverbs device of a card.
+///
+/// The kernel module pins the pages with `FOLL_LONGTERM`, so they can't be migrated or
+/// compacted while registered, and returns their DMA addresses, no page is translated through
+/// the pagemap. A page is registered once however many registrations reference it.
+pub(crate) struct KernelPinner {
+    file: File,
+    /// Event fd of the uverbs context, closed with the context
+    _async_fd: OwnedFd,
+    pd_handle: u32,
+    mrs: Mutex<PinnedRanges<KernelMr>>,
+}
+
+impl KernelPinner {
+    /// Opens a uverbs context on the IB device of the card `index`
+    pub(crate) fn open(index: usize) -> io::Result<Self> {
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .open(uverbs_dev_path(index)?)?;
+
+        let mut context = GetContextResp::default();
+        let cmd = ResponseCmd {
+            hdr: CmdHdr::new::<ResponseCmd, GetContextResp>(IB_USER_VERBS_CMD_GET_CONTEXT),
+            response: addr_of_mut(&mut context),
+        };
+        write_cmd(&file, &cmd)?;
+        #[allow(unsafe_code)]
+        // SAFETY: the fd is installed for the process by the command and owned by nothing else
+        let async_fd = unsafe { OwnedFd::from_raw_fd(context.async_fd) };
+
+        let mut pd = AllocPdResp::default();
+        let cmd = ResponseCmd {
+            hdr: CmdHdr::new::<ResponseCmd, AllocPdResp>(IB_USER_VERBS_CMD_ALLOC_PD),
+            response: addr_of_mut(&mut pd),
+        };
+        write_cmd(&file, &cmd)?;
+
+        Ok(Self {
+            file,
+            _async_fd: async_fd,
+            pd_handle: pd.pd_handle,
+            mrs: Mutex::new(PinnedRanges::default()),
+        })
+    }
+
+    /// Registers the pages of the range that are not registered yet
+    pub(crate) fn pin(&self, addr: u64, length: usize) -> io::Result<()> {
+        let mut mrs = self.mrs.lock();
+        for (start, len) in mrs.gaps(addr, length) {
+            let mr = self.reg_mr(start, len)?;
+            mrs.insert(start, len, mr);
+        }
+        mrs.acquire(addr, length);
+
+        Ok(())
+    }
+
+    /// Releases the pages of the range, which no registration references anymore. The kernel
+    /// registrations left without a referenced page are deregistered
+    pub(crate) fn unpin(&self, addr: u64, length: usize) -> io::Result<()> {
+        let mut mrs = self.mrs.lock();
+        let mut result = Ok(());
+        for (start, len, mr) in mrs.release(addr, length) {
+            if let Err(err) = self.dereg_mr(mr.handle) {
+                warn!("failed to deregister pinned range 0x{start:x}, len=0x{len:x}: {err}");
+                result = Err(err);
+            }
+        }
+
+        result
+    }
+
+    /// Returns the DMA address of `addr`, `None` if its page is not pinned
+    #[allow(clippy::as_conversions, clippy::cast_possible_truncation)]
+    pub(crate) fn translate(&self, addr: u64) -> Option<u64> {
+        let page = PAGE_SIZE as u64;
+        let mrs = self.mrs.lock();
+        let (start, mr) = mrs.get(addr)?;
+        let index = ((addr - start) / page) as usize;
+        mr.dma_addrs
+            .get(index)
+            .map(|dma_addr| dma_addr + addr % page)
+    }
+
+    #[allow(clippy::as_conversions, clippy::cast_possible_truncation)]
+    fn reg_mr(&self, start: u64, length: usize) -> io::Result<KernelMr> {
+        let mut dma_addrs = vec![0u64; length / PAGE_SIZE];
+        let mut resp = RegMrResp::default();
+        let cmd = RegMrCmd {
+            hdr: CmdHdr::new::<RegMrCmd, RegMrResp>(IB_USER_VERBS_CMD_REG_MR),
+            response: addr_of_mut(&mut resp),
+            start,
+            length: length as u64,
+            hca_va: start,
+            pd_handle: self.pd_handle,
+            access_flags: ACCESS_LOCAL_WRITE,
+            page_list: dma_addrs.as_mut_ptr() as u64,
+            page_list_len: dma_addrs.len() as u32,
+            page_shift: PAGE_SIZE_BITS.into(),
+        };
+        write_cmd(&self.file, &cmd)?;
+        if resp.num_pages as usize != dma_addrs.len() {
+            let _ignore = self.dereg_mr(resp.mr_handle);
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                format!(
+                    "kernel pinned {} pages, expected {}",
+                    resp.num_pages,
+                    dma_addrs.len()
+                ),
+            ));
+        }
+        debug!("kernel pin: addr=0x{start:x}, len=0x{length:x}");
+
+        Ok(KernelMr {
+            handle: resp.mr_handle,
+            dma_addrs,
+        })
+    }
+
+    fn dereg_mr(&self, handle: u32) -> io::Result<()> {
+        let cmd = DeregMrCmd {
+            hdr: CmdHdr::new::<DeregMrCmd, ()>(IB_USER_VERBS_CMD_DEREG_MR),
+            mr_handle: handle,
+        };
+        write_cmd(&self.file, &cmd)
+    }
+}
+
+/// Returns the uverbs char device of the IB device of the card `index`
+fn uverbs_dev_path(index: usize) -> io::Result<PathBuf> {
+    let ibdev = format!("{BLUE_RDMA_IBDEV_NAME_PREFIX}{index}");
+    for entry in fs::read_dir(UVERBS_SYSFS_CLASS_PATH)? {
+        let entry = entry?;
+        let name = fs::read_to_string(entry.path().join("ibdev")).unwrap_or_default();
+        if name.trim() == ibdev {
+            return Ok(PathBuf::from(UVERBS_DEV_PATH).join(entry.file_name()));
+        }
+    }
+
+    Err(io::Error::new(
+        io::ErrorKind::NotFound,
+        format!("no uverbs device for {ibdev}"),
+    ))
+}
+
+#[allow(clippy::as_conversions)]
+fn addr_of_mut<T>(resp: &mut T) -> u64 {
+    (resp as *mut T) as u64
+}
+
+/// Issues a write command, the kernel writes the response to the address it holds
+#[allow(unsafe_code, clippy::as_conversions, clippy::cast_sign_loss)]
+fn write_cmd<C>(file: &File, cmd: &C) -> io::Result<()> {
+    let len = size_of::<C>();
+    // SAFETY: the command is plain data of `len` bytes, and the buffers it points to outlive
+    // the call
+    let ret = unsafe { libc::write(file.as_raw_fd(), (cmd as *const C).cast(), len) };
+    if ret < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    if ret as usize != len {
+        return Err(io::Error::new(
+            io::ErrorKind::WriteZero,
+            "short uverbs command write",
+        ));
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn commands_match_the_uverbs_abi() {
+        assert_eq!(size_of::<ResponseCmd>(), 16);
+        assert_eq!(size_of::<RegMrCmd>(), 64);
+        assert_eq!(size_of::<DeregMrCmd>(), 12);
+        let hdr = CmdHdr::new::<RegMrCmd, RegMrResp>(IB_USER_VERBS_CMD_REG_MR);
+        assert_eq!((hdr.in_words, hdr.out_words), (16, 5));
+    }
+}
@@ -1,6 +1,7 @@
 use std::{
     io,
     ops::{Deref, DerefMut},
+    sync::Arc,
 };
 
 /// Tools for converting virtual address to physicall address
@@ -15,9 +16,30 @@ pub(crate) mod u_dma_buf;
 
 mod utils;
 
+/// Reference counts of pinned pages
+mod pin_count;
+
+/// Background pinning of prefetched pages
+pub(crate) mod prefetch;
+
+/// Mappings of the registered memory in the VFIO IOMMU domain of the device
+pub(crate) mod iommu;
+
+/// Pinning of the registered memory by the kernel module
+pub(crate) mod kernel_pin;
+
+/// Ranges pinned as a whole and the pages referenced in them
+mod pinned_ranges;
+
 pub(crate) mod sim_alloc;
 
+/// Accounting of the memory held by the driver
+pub(crate) mod usage;
+
+use iommu::IommuDomain;
+use kernel_pin::KernelPinner;
 use page::MmapMut;
+pub(crate) use pin_count::PinCount;
 pub(crate) use utils::*;
 use virt_to_phy::{AddressResolver, PhysAddrResolverEmulated, PhysAddrResolverLinuxX86};
 
@@ -134,20 +156,55 @@ pub(crate) trait MemoryPinner {
 
 pub(crate) trait UmemHandler: AddressResolver + MemoryPinner {}
 
+/// How the pages of the registered memory are pinned and handed to the device
+enum HostPinning {
+    /// Locks the pages and translates them through the pagemap
+    Pagemap,
+    /// Maps the pages at IOVA = VA instead of locking and translating them
+    Iommu(Arc<IommuDomain>),
+    /// Registers the pages with the kernel module, which returns their DMA addresses
+    Kernel(Arc<KernelPinner>),
+}
+
 pub(crate) struct HostUmemHandler {
     resolver: PhysAddrResolverLinuxX86,
+    pinning: HostPinning,
 }
 
 impl HostUmemHandler {
     pub(crate) fn new() -> Self {
         Self {
             resolver: PhysAddrResolverLinuxX86,
+            pinning: HostPinning::Pagemap,
+        }
+    }
+
+    /// Creates a handler that maps the pages into the IOMMU domain, the address of a page for
+    /// the device is its virtual address
+    pub(crate) fn with_iommu(iommu: Arc<IommuDomain>) -> Self {
+        Self {
+            resolver: PhysAddrResolverLinuxX86,
+            pinning: HostPinning::Iommu(iommu),
+        }
+    }
+
+    /// Creates a handler that pins the pages through the kernel module, the address of a page
+    /// for the device is the DMA address returned by the module
+    pub(crate) fn with_kernel_pin(pinner: Arc<KernelPinner>) -> Self {
+        Self {
+            resolver: PhysAddrResolverLinuxX86,
+            pinning: HostPinning::Kernel(pinner),
         }
     }
 }
 
 impl MemoryPinner for HostUmemHandler {
     fn pin_pages(&self, addr: u64, length: usize) -> io::Result<()> {
+        match self.pinning {
+            HostPinning::Pagemap => {}
+            HostPinning::Iommu(ref iommu) => return iommu.map(addr, length),
+            HostPinning::Kernel(ref pinner) => return pinner.pin(addr, length),
+        }
         let result = unsafe { libc::mlock(addr as *const std::ffi::c_void, length) };
         if result != 0 {
             return Err(io::Error::new(io::ErrorKind::Other, "failed to lock pages"));
@@ -156,6 +213,11 @@ impl MemoryPinner for HostUmemHandler {
     }
 
     fn unpin_pages(&self, addr: u64, length: usize) -> io::Result<()> {
+        match self.pinning {
+            HostPinning::Pagemap => {}
+            HostPinning::Iommu(ref iommu) => return iommu.unmap(addr, length),
+            HostPinning::Kernel(ref pinner) => return pinner.unpin(addr, length),
+        }
         let result = unsafe { libc::munlock(addr as *const std::ffi::c_void, length) };
         if result != 0 {
             return Err(io::Error::new(
@@ -169,7 +231,11 @@ impl MemoryPinner for HostUmemHandler {
 
 impl AddressResolver for HostUmemHandler {
     fn virt_to_phys(&self, virt_addr: u64) -> io::Result<Option<u64>> {
-        self.resolver.virt_to_phys(virt_addr)
+        match self.pinning {
+            HostPinning::Pagemap => self.resolver.virt_to_phys(virt_addr),
+            HostPinning::Iommu(_) => Ok(Some(virt_addr)),
+            HostPinning::Kernel(ref pinner) => Ok(pinner.translate(virt_addr)),
+        }
     }
 
     fn virt_to_phys_range(
@@ -177,7 +243,14 @@ impl AddressResolver for HostUmemHandler {
         start_addr: u64,
         num_pages: usize,
     ) -> io::Result<Vec<Option<u64>>> {
-        self.resolver.virt_to_phys_range(start_addr, num_pages)
+        let pages = (0..num_pages).map(|i| start_addr + (i * PAGE_SIZE) as u64);
+        match self.pinning {
+            HostPinning::Pagemap => self.resolver.virt_to_phys_range(start_addr, num_pages),
+            HostPinning::Iommu(_) => Ok(pages.map(Some).collect()),
+            HostPinning::Kernel(ref pinner) => {
+                Ok(pages.map(|addr| pinner.translate(addr)).collect())
+            }
+        }
     }
 }
 
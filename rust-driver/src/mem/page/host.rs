@@ -5,6 +5,7 @@ use std::ops::{Deref, DerefMut};
 use std::arch::x86_64::{_mm_clflush, _mm_mfence};
 
 use crate::constants::PAGE_SIZE_2MB;
+use crate::mem::virt_to_phy::{get_base_page_size, PhysAddrResolverLinuxX86};
 use crate::mem::{PAGE_SIZE, PAGE_SIZE_BITS};
 
 use super::{ContiguousPages, MmapMut, PageAllocator};
@@ -22,12 +23,6 @@ impl<const N: usize> PageAllocator<N> for HostPageAllocator<N> {
 
 #[allow(unsafe_code)]
 impl<const N: usize> HostPageAllocator<N> {
-    /// TODO: implements allocating multiple consecutive pages
-    const _OK: () = assert!(
-        N == 1,
-        "allocating multiple contiguous pages is currently unsupported"
-    );
-
     /// Creates a new `HostPageAllocator`
     pub(crate) fn new() -> Self {
         Self
@@ -44,6 +39,9 @@ impl<const N: usize> HostPageAllocator<N> {
     }
 
     /// Reserves memory pages using mmap.
+    ///
+    /// The pages are populated by the kernel, which zeroes anonymous pages, and locked so that
+    /// their physical addresses stay valid.
     fn reserve(num_pages: usize) -> io::Result<MmapMut> {
         /// Number of bits representing a 4K page size
         let len = PAGE_SIZE_2MB
@@ -55,7 +53,11 @@ impl<const N: usize> HostPageAllocator<N> {
                 std::ptr::null_mut(),
                 len,
                 libc::PROT_READ | libc::PROT_WRITE,
-                libc::MAP_SHARED | libc::MAP_ANON | libc::MAP_HUGETLB | libc::MAP_HUGE_2MB,
+                libc::MAP_SHARED
+                    | libc::MAP_ANON
+                    | libc::MAP_POPULATE
+                    | libc::MAP_HUGETLB
+                    | libc::MAP_HUGE_2MB,
                 -1,
                 0,
             )
@@ -66,7 +68,7 @@ impl<const N: usize> HostPageAllocator<N> {
                 std::ptr::null_mut(),
                 len,
                 libc::PROT_READ | libc::PROT_WRITE,
-                libc::MAP_SHARED | libc::MAP_ANON,
+                libc::MAP_SHARED | libc::MAP_ANON | libc::MAP_POPULATE,
                 -1,
                 0,
             )
@@ -75,12 +77,7 @@ impl<const N: usize> HostPageAllocator<N> {
         if ptr == libc::MAP_FAILED {
             return Err(io::Error::last_os_error());
         }
-
-        for i in 0..len {
-            unsafe {
-                *ptr.cast::<u8>().add(i) = 0;
-            }
-        }
+        let mmap = MmapMut::new(ptr, len);
 
         unsafe {
             if libc::mlock(ptr, len) != 0 {
@@ -88,13 +85,47 @@ impl<const N: usize> HostPageAllocator<N> {
             }
         }
 
-        Ok(MmapMut::new(ptr, len))
+        Ok(mmap)
     }
 
     /// Checks if the physical pages backing the memory mapping are consecutive.
-    #[allow(clippy::unnecessary_wraps)] // casting usize ot u64 is safe
+    #[allow(clippy::as_conversions)] // converting *mut c_void to u64
     fn ensure_consecutive(mmap: &MmapMut) -> io::Result<bool> {
-        // TODO: implement
-        Ok(true)
+        let base_page_size = get_base_page_size();
+        let num_pages = mmap.len() / base_page_size as usize;
+        let phys_addrs = PhysAddrResolverLinuxX86::virt_to_phys_pages(
+            mmap.as_ptr() as u64,
+            num_pages,
+            base_page_size,
+        )?;
+
+        Ok(is_consecutive(&phys_addrs, base_page_size))
+    }
+}
+
+/// Returns `true` if all pages of `page_size` bytes are present and follow each other in
+/// physical memory
+fn is_consecutive(phys_addrs: &[Option<u64>], page_size: u64) -> bool {
+    let Some(&Some(first)) = phys_addrs.first() else {
+        return false;
+    };
+    phys_addrs
+        .iter()
+        .zip((first..).step_by(page_size as usize))
+        .all(|(addr, expected)| *addr == Some(expected))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn consecutive_pages_are_detected() {
+        let page = 0x1000;
+        let pages = [Some(0x4000), Some(0x5000), Some(0x6000)];
+        assert!(is_consecutive(&pages, page));
+        assert!(!is_consecutive(&[Some(0x4000), Some(0x6000)], page));
+        assert!(!is_consecutive(&[Some(0x4000), None], page));
+        assert!(!is_consecutive(&[], page));
     }
 }
@@ -12,6 +12,7 @@ use std::{
     io,
     ops::{Deref, DerefMut},
     ptr, slice,
+    sync::Arc,
 };
 
 /// A trait for allocating contiguous physical memory pages.
@@ -68,12 +69,34 @@ pub(crate) struct MmapMut {
     pub(crate) ptr: *mut c_void,
     /// Length of the mapped memory region in bytes
     pub(crate) len: usize,
+    /// Mapping the region is carved from, unmapped once its last region is dropped
+    parent: Option<Arc<MmapMut>>,
 }
 
 impl MmapMut {
     /// Creates a new `MmapMut`
     pub(crate) fn new(ptr: *mut c_void, len: usize) -> Self {
-        Self { ptr, len }
+        Self {
+            ptr,
+            len,
+            parent: None,
+        }
+    }
+
+    /// Returns the `len` bytes of `parent` starting at `offset`, the region keeps `parent`
+    /// mapped
+    #[allow(unsafe_code)]
+    pub(crate) fn carve(parent: &Arc<MmapMut>, offset: usize, len: usize) -> Self {
+        assert!(
+            offset.saturating_add(len) <= parent.len,
+            "carve beyond mmap boundaries"
+        );
+        Self {
+            // SAFETY: the region is within the mapping
+            ptr: unsafe { parent.ptr.cast::<u8>().add(offset).cast() },
+            len,
+            parent: Some(Arc::clone(parent)),
+        }
     }
 
     pub(crate) fn len(&self) -> usize {
@@ -96,6 +119,19 @@ impl MmapMut {
         }
     }
 
+    /// Writes `value` at `offset`, which must be a multiple of 8
+    #[allow(unsafe_code, clippy::needless_pass_by_ref_mut)]
+    pub(crate) fn write_u64(&mut self, offset: usize, value: u64) {
+        assert!(
+            offset.saturating_add(size_of::<u64>()) <= self.len && offset % size_of::<u64>() == 0,
+            "unaligned write or beyond mmap boundaries"
+        );
+        // SAFETY: the word is within the mapping, which is page aligned
+        unsafe {
+            ptr::write_volatile(self.ptr.cast::<u8>().add(offset).cast::<u64>(), value);
+        }
+    }
+
     pub(crate) fn get(&self, offset: usize, len: usize) -> Vec<u8> {
         assert!(
             offset.saturating_add(len) <= self.len,
@@ -131,7 +167,22 @@ mod mmap_mut_impl {
 
     impl Drop for MmapMut {
         fn drop(&mut self) {
-            let _ignore = unsafe { libc::munmap(self.ptr, self.len) };
+            // A carved region is unmapped with its parent
+            if self.parent.is_none() {
+                let _ignore = unsafe { libc::munmap(self.ptr, self.len) };
+            }
+        }
+    }
+
+    impl MmapMut {
+        /// Returns `len` bytes of the region starting at `offset`, the caller must own them so
+        /// that the device does not write them while they are borrowed
+        pub(crate) fn slice(&self, offset: usize, len: usize) -> &[u8] {
+            assert!(
+                offset.saturating_add(len) <= self.len,
+                "slice beyond mmap boundaries"
+            );
+            unsafe { slice::from_raw_parts(self.ptr.cast::<u8>().add(offset), len) }
         }
     }
 
@@ -0,0 +1,102 @@
+use std::collections::{hash_map::Entry, HashMap};
+
+use super::{
+    get_num_page,
+    usage::{self, Pool},
+    PAGE_SIZE,
+};
+
+/// Reference counts of pinned pages.
+///
+/// `mlock` does not nest, unlocking a range unlocks every page in it. A page is only unpinned
+/// once no registration referencing it is left.
+#[derive(Default)]
+pub(crate) struct PinCount {
+    /// Number of references of each pinned page, keyed by page address
+    pages: HashMap<u64, usize>,
+}
+
+impl PinCount {
+    /// Creates a new `PinCount`
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    /// Takes a reference to each page of the range
+    pub(crate) fn acquire(&mut self, addr: u64, length: usize) {
+        let mut pinned = 0;
+        for page in pages(addr, length) {
+            let count = self.pages.entry(page).or_default();
+            if *count == 0 {
+                pinned += PAGE_SIZE;
+            }
+            *count += 1;
+        }
+        usage::alloc(Pool::PinnedPages, pinned);
+    }
+
+    /// Drops a reference to each page of the range
+    ///
+    /// # Returns
+    ///
+    /// The ranges of pages that are no longer referenced and should be unpinned
+    pub(crate) fn release(&mut self, addr: u64, length: usize) -> Vec<(u64, usize)> {
+        let mut ranges: Vec<(u64, usize)> = Vec::new();
+        for page in pages(addr, length) {
+            let Entry::Occupied(mut entry) = self.pages.entry(page) else {
+                continue;
+            };
+            *entry.get_mut() -= 1;
+            if *entry.get() != 0 {
+                continue;
+            }
+            let _count = entry.remove();
+            match ranges.last_mut() {
+                Some((start, len)) if *start + *len as u64 == page => *len += PAGE_SIZE,
+                _ => ranges.push((page, PAGE_SIZE)),
+            }
+        }
+        usage::free(Pool::PinnedPages, ranges.iter().map(|&(_, len)| len).sum());
+        ranges
+    }
+}
+
+/// Returns the page addresses of a range
+fn pages(addr: u64, length: usize) -> impl Iterator<Item = u64> {
+    let start = addr - addr % PAGE_SIZE as u64;
+    let num_pages = if length == 0 {
+        0
+    } else {
+        get_num_page(addr, length)
+    };
+    (0..num_pages).map(move |i| start + (i * PAGE_SIZE) as u64)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn shared_pages_are_unpinned_on_last_release() {
+        let page = PAGE_SIZE as u64;
+        let mut pins = PinCount::new();
+        pins.acquire(page + 8, 2 * PAGE_SIZE);
+        pins.acquire(2 * page, PAGE_SIZE);
+        assert_eq!(
+            pins.release(page + 8, 2 * PAGE_SIZE),
+            [(page, PAGE_SIZE), (3 * page, PAGE_SIZE)]
+        );
+        assert_eq!(pins.release(2 * page, PAGE_SIZE), [(2 * page, PAGE_SIZE)]);
+        assert!(pins.release(2 * page, PAGE_SIZE).is_empty());
+        assert!(pins.pages.is_empty());
+    }
+
+    #[test]
+    fn released_pages_are_coalesced() {
+        let page = PAGE_SIZE as u64;
+        let mut pins = PinCount::new();
+        pins.acquire(0, 4 * PAGE_SIZE);
+        assert_eq!(pins.release(0, 4 * PAGE_SIZE), [(0, 4 * PAGE_SIZE)]);
+        assert!(pins.release(page, 0).is_empty());
+    }
+}
@@ -0,0 +1,144 @@
+use std::collections::{BTreeMap, BTreeSet};
+
+use super::PAGE_SIZE;
+
+/// Page aligned ranges pinned as a whole, such as IOMMU mappings or kernel registrations, and
+/// the pages referenced in them.
+///
+/// A page is pinned by a single range however many registrations reference it. A range can't
+/// be released in part, it is released once none of its pages is referenced.
+#[derive(Debug)]
+pub(crate) struct PinnedRanges<V> {
+    /// Length and value of each range, keyed by start address
+    ranges: BTreeMap<u64, (usize, V)>,
+    /// Pages referenced by a registration
+    pages: BTreeSet<u64>,
+}
+
+impl<V> Default for PinnedRanges<V> {
+    fn default() -> Self {
+        Self {
+            ranges: BTreeMap::new(),
+            pages: BTreeSet::new(),
+        }
+    }
+}
+
+impl<V> PinnedRanges<V> {
+    /// Returns the page aligned ranges of the range that are not pinned
+    pub(crate) fn gaps(&self, addr: u64, length: usize) -> Vec<(u64, usize)> {
+        let (start, end) = page_range(addr, length);
+        let mut gaps = Vec::new();
+        let mut pos = start;
+        for (&s, &(len, _)) in self.ranges.range(self.first(start)..end) {
+            let e = s + len as u64;
+            if e <= pos {
+                continue;
+            }
+            if s > pos {
+                gaps.push((pos, (s - pos) as usize));
+            }
+            pos = e;
+        }
+        if pos < end {
+            gaps.push((pos, (end - pos) as usize));
+        }
+        gaps
+    }
+
+    /// Adds a range returned by `gaps` once it is pinned
+    pub(crate) fn insert(&mut self, start: u64, len: usize, value: V) {
+        let _ignore = self.ranges.insert(start, (len, value));
+    }
+
+    /// References the pages of the range, which must be pinned
+    pub(crate) fn acquire(&mut self, addr: u64, length: usize) {
+        let (start, end) = page_range(addr, length);
+        self.pages.extend((start..end).step_by(PAGE_SIZE));
+    }
+
+    /// Returns the start and the value of the range pinning the page at `addr`
+    pub(crate) fn get(&self, addr: u64) -> Option<(u64, &V)> {
+        self.ranges
+            .range(..=addr)
+            .next_back()
+            .filter(|&(&s, &(len, _))| addr < s + len as u64)
+            .map(|(&s, (_, value))| (s, value))
+    }
+
+    /// Drops the pages of the range, which are no longer referenced
+    ///
+    /// # Returns
+    ///
+    /// The ranges left without a referenced page, which are removed
+    pub(crate) fn release(&mut self, addr: u64, length: usize) -> Vec<(u64, usize, V)> {
+        let (start, end) = page_range(addr, length);
+        for page in (start..end).step_by(PAGE_SIZE) {
+            let _ignore = self.pages.remove(&page);
+        }
+        let unused: Vec<_> = self
+            .ranges
+            .range(self.first(start)..end)
+            .map(|(&s, &(len, _))| (s, len))
+            .filter(|&(s, len)| {
+                s + len as u64 > start && self.pages.range(s..s + len as u64).next().is_none()
+            })
+            .collect();
+        unused
+            .into_iter()
+            .filter_map(|(s, len)| self.ranges.remove(&s).map(|(_, value)| (s, len, value)))
+            .collect()
+    }
+
+    /// Returns the start of the range containing `start`, or `start` if there is none
+    fn first(&self, start: u64) -> u64 {
+        self.ranges
+            .range(..=start)
+            .next_back()
+            .map_or(start, |(&s, _)| s)
+    }
+}
+
+/// Returns the start and the end of the pages of a range
+fn page_range(addr: u64, length: usize) -> (u64, u64) {
+    let page = PAGE_SIZE as u64;
+    let start = addr - addr % page;
+    let end = (addr + length as u64).next_multiple_of(page);
+    (start, end)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn shared_pages_are_pinned_once() {
+        let page = PAGE_SIZE as u64;
+        let mut ranges = PinnedRanges::default();
+        assert_eq!(
+            ranges.gaps(page + 8, 2 * PAGE_SIZE),
+            [(page, 3 * PAGE_SIZE)]
+        );
+        ranges.insert(page, 3 * PAGE_SIZE, 1);
+        ranges.acquire(page + 8, 2 * PAGE_SIZE);
+        // only the pages past the first range are pinned again
+        assert_eq!(
+            ranges.gaps(2 * page, 4 * PAGE_SIZE),
+            [(4 * page, 2 * PAGE_SIZE)]
+        );
+        ranges.insert(4 * page, 2 * PAGE_SIZE, 2);
+        ranges.acquire(2 * page, 4 * PAGE_SIZE);
+        assert_eq!(ranges.get(3 * page + 8), Some((page, &1)));
+        assert_eq!(ranges.get(5 * page), Some((4 * page, &2)));
+        assert_eq!(ranges.get(6 * page), None);
+
+        // the first range is kept while its pages are referenced by the second registration
+        assert!(ranges.release(page, PAGE_SIZE).is_empty());
+        assert_eq!(
+            ranges.release(2 * page, 4 * PAGE_SIZE),
+            [(page, 3 * PAGE_SIZE, 1), (4 * page, 2 * PAGE_SIZE, 2)]
+        );
+        assert!(ranges.ranges.is_empty());
+        assert!(ranges.pages.is_empty());
+    }
+}
@@ -0,0 +1,145 @@
+use std::{io, sync::mpsc, thread};
+
+use log::debug;
+
+use super::UmemHandler;
+
+/// Pages of an on-demand paging MR to pin
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct PrefetchJob {
+    /// Key of the MR
+    pub(crate) mr_key: u32,
+    /// PGT index of the first page of the MR, identifies the registration the job belongs to
+    pub(crate) base_index: u32,
+    /// PGT index of the first page of the job
+    pub(crate) pgt_index: u32,
+    /// Address of the first page
+    pub(crate) addr: u64,
+    /// Length in bytes
+    pub(crate) length: usize,
+    /// Number of pages
+    pub(crate) num_pages: usize,
+}
+
+/// A job whose pages have been pinned
+#[derive(Debug)]
+pub(crate) struct PrefetchDone {
+    /// The job
+    pub(crate) job: PrefetchJob,
+    /// Physical addresses of the pages
+    pub(crate) result: io::Result<Vec<u64>>,
+}
+
+/// Pins the pages of asynchronous `advise_mr` prefetches on a background thread.
+///
+/// Only the pinning and the translation run in the background. The pinned pages are handed
+/// back to the device context, which writes their PGT entries and tracks the pins. The thread
+/// exits once the `Prefetcher` is dropped.
+pub(crate) struct Prefetcher {
+    /// Jobs to the background thread
+    job_tx: mpsc::Sender<PrefetchJob>,
+    /// Jobs done by the background thread
+    done_rx: mpsc::Receiver<PrefetchDone>,
+    /// Number of jobs submitted and not yet taken back
+    pending: usize,
+}
+
+impl Prefetcher {
+    /// Spawns the background thread
+    pub(crate) fn spawn<U>(handler: U) -> io::Result<Self>
+    where
+        U: UmemHandler + Send + 'static,
+    {
+        let (job_tx, job_rx) = mpsc::channel::<PrefetchJob>();
+        let (done_tx, done_rx) = mpsc::channel();
+        let _handle = thread::Builder::new()
+            .name("odp-prefetch".into())
+            .spawn(move || {
+                for job in job_rx {
+                    let result = pin_and_resolve(&handler, &job);
+                    if done_tx.send(PrefetchDone { job, result }).is_err() {
+                        break;
+                    }
+                }
+                debug!("odp prefetch thread exited");
+            })?;
+
+        Ok(Self {
+            job_tx,
+            done_rx,
+            pending: 0,
+        })
+    }
+
+    /// Queues a job, returns it back if the background thread is gone
+    pub(crate) fn submit(&mut self, job: PrefetchJob) -> Result<(), PrefetchJob> {
+        self.job_tx.send(job).map_err(|err| err.0)?;
+        self.pending = self.pending.saturating_add(1);
+        Ok(())
+    }
+
+    /// Returns `true` if every submitted job has been taken back
+    pub(crate) fn is_idle(&self) -> bool {
+        self.pending == 0
+    }
+
+    /// Takes back the jobs done so far
+    pub(crate) fn take_done(&mut self) -> Vec<PrefetchDone> {
+        if self.is_idle() {
+            return Vec::new();
+        }
+        let done: Vec<_> = self.done_rx.try_iter().collect();
+        self.pending = self.pending.saturating_sub(done.len());
+        done
+    }
+}
+
+/// Pins the pages of the job and translates them, partially pinned pages are left pinned
+fn pin_and_resolve<U: UmemHandler>(handler: &U, job: &PrefetchJob) -> io::Result<Vec<u64>> {
+    handler.pin_pages(job.addr, job.length)?;
+    handler
+        .virt_to_phys_range(job.addr, job.num_pages)?
+        .into_iter()
+        .collect::<Option<Vec<_>>>()
+        .ok_or(io::Error::new(
+            io::ErrorKind::NotFound,
+            "physical address not found",
+        ))
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::{Duration, Instant};
+
+    use crate::{mem::PAGE_SIZE, verbs::mock::MockUmemHandler};
+
+    use super::*;
+
+    #[test]
+    #[allow(clippy::unwrap_used)]
+    fn jobs_are_handed_back_in_order() {
+        let mut prefetcher = Prefetcher::spawn(MockUmemHandler).unwrap();
+        assert!(prefetcher.take_done().is_empty());
+        let jobs: Vec<_> = (0..4)
+            .map(|i| PrefetchJob {
+                mr_key: 1,
+                base_index: 16,
+                pgt_index: 16 + i,
+                addr: u64::from(i) * 0x1000,
+                length: PAGE_SIZE,
+                num_pages: 1,
+            })
+            .collect();
+        for &job in &jobs {
+            prefetcher.submit(job).unwrap();
+        }
+        let deadline = Instant::now() + Duration::from_secs(5);
+        let mut done = Vec::new();
+        while !prefetcher.is_idle() && Instant::now() < deadline {
+            done.extend(prefetcher.take_done());
+            thread::yield_now();
+        }
+        assert!(done.iter().map(|x| x.job).eq(jobs));
+        assert!(done.iter().all(|x| x.result.as_ref().unwrap().len() == 1));
+    }
+}
@@ -8,7 +8,9 @@
 
 use std::{
     alloc::{GlobalAlloc, Layout},
+    cell::Cell,
     ffi::c_void,
+    ptr::{self, NonNull},
 };
 
 use buddy_system_allocator::LockedHeap;
@@ -17,6 +19,8 @@ pub(crate) use ctor;
 
 const ORDER: usize = 32;
 const SHM_PATHS: [&str; 2] = ["/bluesim1\0", "/bluesim2\0"];
+/// Number of emulated devices, each maps a shared memory block of its own
+pub(crate) const NUM_EMULATED_DEVICES: usize = SHM_PATHS.len();
 const SHM_BLOCK_SIZE: usize = 1024 * 1024 * 256;
 //pub(crate) static mut SHM_START_ADDR: usize = 0;
 const SHM_START_ADDR: usize = 0x7f7e_8e60_0000;
@@ -38,15 +42,144 @@ const HEAP_START_ADDR_OFFSET: usize = 1024 * 1024 * 192;
 /// Offset of the address space used by the page allocator
 const PAGE_START_ADDR_OFFSET: usize = 1024 * 1024 * 128;
 
+/// Smallest size class of the thread caches
+const MIN_CLASS_SHIFT: usize = 4;
+/// Number of size classes, from 16 bytes to 2KB
+const NUM_CLASSES: usize = 8;
+/// Maximum number of blocks cached by a thread for each size class
+const CACHE_CAP: usize = 64;
+/// Number of blocks moved between a thread cache and the heap at once
+const CACHE_BATCH: usize = 16;
+
+/// Free block of a thread cache, linked through its first word
+struct FreeBlock {
+    next: *mut FreeBlock,
+}
+
+/// Blocks of a size class cached by a thread
+struct Bin {
+    head: Cell<*mut FreeBlock>,
+    len: Cell<usize>,
+}
+
+impl Bin {
+    const fn new() -> Self {
+        Self {
+            head: Cell::new(ptr::null_mut()),
+            len: Cell::new(0),
+        }
+    }
+
+    fn pop(&self) -> Option<*mut u8> {
+        let block = self.head.get();
+        if block.is_null() {
+            return None;
+        }
+        unsafe { self.head.set((*block).next) };
+        self.len.set(self.len.get() - 1);
+        Some(block.cast())
+    }
+
+    fn push(&self, ptr: *mut u8) {
+        let block = ptr.cast::<FreeBlock>();
+        let next = self.head.get();
+        unsafe { block.write(FreeBlock { next }) };
+        self.head.set(block);
+        self.len.set(self.len.get() + 1);
+    }
+}
+
+/// Small blocks freed by a thread, handed out again without taking the heap lock.
+///
+/// The cache has no destructor, so accessing it never allocates. The blocks cached by an
+/// exiting thread are not returned to the heap, at most `CACHE_CAP` blocks per class.
+struct ThreadCache {
+    bins: [Bin; NUM_CLASSES],
+}
+
+impl ThreadCache {
+    const fn new() -> Self {
+        Self {
+            bins: [const { Bin::new() }; NUM_CLASSES],
+        }
+    }
+}
+
+thread_local! {
+    static THREAD_CACHE: ThreadCache = const { ThreadCache::new() };
+}
+
+/// Returns the size class of a layout, `None` if it is served by the heap directly
+fn size_class(layout: Layout) -> Option<usize> {
+    let size = layout.size().max(layout.align()).max(1 << MIN_CLASS_SHIFT);
+    let class = size.next_power_of_two().trailing_zeros() as usize - MIN_CLASS_SHIFT;
+    (class < NUM_CLASSES).then_some(class)
+}
+
+fn class_layout(class: usize) -> Layout {
+    let size = 1 << (class + MIN_CLASS_SHIFT);
+    unsafe { Layout::from_size_align_unchecked(size, size) }
+}
+
 /// Handle to the allocator
 ///
 /// This type implements the `GlobalAlloc` trait, allowing usage a global allocator.
+///
+/// Small allocations are served from per-thread caches of size classes, which are refilled
+/// from and flushed to the shared heap in batches, so the hot paths of the worker threads
+/// rarely contend on the heap lock. All blocks stay within the shared region. As the caches
+/// are per thread rather than per allocator, a process uses a single `Simalloc`, the global
+/// allocator.
 pub(crate) struct Simalloc(LockedHeap<ORDER>);
 
 impl Simalloc {
     pub(crate) const fn new() -> Self {
         Self(LockedHeap::new())
     }
+
+    /// Takes a block of `class` from the cache of the current thread, refilling it from the
+    /// heap if empty
+    unsafe fn alloc_small(&self, class: usize) -> *mut u8 {
+        let layout = class_layout(class);
+        let cached = THREAD_CACHE.try_with(|cache| {
+            let bin = &cache.bins[class];
+            if let Some(ptr) = bin.pop() {
+                return ptr;
+            }
+            let mut heap = self.0.lock();
+            for _ in 0..CACHE_BATCH {
+                match heap.alloc(layout) {
+                    Ok(block) => bin.push(block.as_ptr()),
+                    Err(()) => break,
+                }
+            }
+            bin.pop().unwrap_or(ptr::null_mut())
+        });
+        // The cache of the thread is being destroyed
+        cached.unwrap_or_else(|_| self.0.alloc(layout))
+    }
+
+    /// Returns a block of `class` to the cache of the current thread, flushing a batch to the
+    /// heap if full
+    unsafe fn dealloc_small(&self, ptr: *mut u8, class: usize) {
+        let layout = class_layout(class);
+        let cached = THREAD_CACHE.try_with(|cache| {
+            let bin = &cache.bins[class];
+            bin.push(ptr);
+            if bin.len.get() <= CACHE_CAP {
+                return;
+            }
+            let mut heap = self.0.lock();
+            for _ in 0..CACHE_BATCH {
+                if let Some(block) = bin.pop() {
+                    heap.dealloc(NonNull::new_unchecked(block), layout);
+                }
+            }
+        });
+        if cached.is_err() {
+            self.0.dealloc(ptr, layout);
+        }
+    }
 }
 
 impl Default for Simalloc {
@@ -58,22 +191,42 @@ impl Default for Simalloc {
 unsafe impl GlobalAlloc for Simalloc {
     #[inline]
     unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
-        self.0.alloc(layout)
+        match size_class(layout) {
+            Some(class) => self.alloc_small(class),
+            None => self.0.alloc(layout),
+        }
     }
 
     #[inline]
     unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
-        self.0.alloc_zeroed(layout)
+        // Cached blocks are not zeroed
+        let ptr = self.alloc(layout);
+        if !ptr.is_null() {
+            ptr::write_bytes(ptr, 0, layout.size());
+        }
+        ptr
     }
 
     #[inline]
     unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
-        self.0.dealloc(ptr, layout)
+        match size_class(layout) {
+            Some(class) => self.dealloc_small(ptr, class),
+            None => self.0.dealloc(ptr, layout),
+        }
     }
 
     #[inline]
     unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
-        self.0.realloc(ptr, layout, new_size)
+        let new_layout = Layout::from_size_align_unchecked(new_size, layout.align());
+        if size_class(layout).is_some_and(|class| size_class(new_layout) == Some(class)) {
+            return ptr;
+        }
+        let new_ptr = self.alloc(new_layout);
+        if !new_ptr.is_null() {
+            ptr::copy_nonoverlapping(ptr, new_ptr, layout.size().min(new_size));
+            self.dealloc(ptr, layout);
+        }
+        new_ptr
     }
 }
 
@@ -135,3 +288,29 @@ pub(crate) fn init_global_allocator(index: usize, allocator: &Simalloc) {
         allocator.0.lock().init(heap_start_addr(), heap_size);
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn small_blocks_are_reused_from_the_thread_cache() {
+        let region = vec![0u64; 1 << 17];
+        let start = region.as_ptr() as usize;
+        let size = region.len() * 8;
+        let alloc = Simalloc::new();
+        unsafe {
+            alloc.0.lock().init(start, size);
+            let layout = Layout::from_size_align(24, 8).unwrap();
+            let a = alloc.alloc(layout);
+            assert!((start..start + size).contains(&(a as usize)));
+            alloc.dealloc(a, layout);
+            assert_eq!(alloc.alloc(layout), a);
+            assert_eq!(alloc.realloc(a, layout, 32), a);
+            let large = Layout::from_size_align(1 << 16, 8).unwrap();
+            let b = alloc.realloc(a, layout, large.size());
+            assert!((start..start + size).contains(&(b as usize)));
+            alloc.dealloc(b, large);
+        }
+    }
+}
@@ -1,115 +1,274 @@
 use std::{
     fs::{self, File, OpenOptions},
     io::{self, Read},
+    ops::Range,
     os::{fd::AsRawFd, unix::fs::OpenOptionsExt},
-    path::PathBuf,
+    path::Path,
     ptr,
+    sync::Arc,
 };
 
-use crate::constants::U_DMA_BUF_CLASS_PATH;
+use crate::constants::{PAGE_SIZE_2MB, U_DMA_BUF_CLASS_PATH};
 
 use super::{
-    page::{ContiguousPages, MmapMut, PageAllocator},
-    DmaBuf, DmaBufAllocator, PageWithPhysAddr,
+    page::MmapMut,
+    usage::{self, Pool},
+    virt_to_phy::get_base_page_size,
+    DmaBuf, DmaBufAllocator,
 };
 
+/// Allocator of the DMA buffers of the device from the u-dma-bufs reserved by the kernel
+/// module, loaded with `udmabufN=<size>` for each region.
+///
+/// Each region is mapped and populated once and the buffers are carved from the mappings at
+/// base page aligned offsets. A buffer is aligned to its size class, the smallest power of
+/// two holding it up to a 2MB huge page, so that a buffer of up to a huge page never
+/// straddles two of them. The gaps left by the alignment are filled by the smaller buffers
+/// allocated afterwards. The regions on the NUMA node of the device are used first, a buffer
+/// not fitting in them is allocated from the other regions.
 pub(crate) struct UDmaBufAllocator {
-    fd: File,
-    offset: usize,
+    /// Regions by order of preference
+    regions: Vec<Region>,
+    /// Bytes handed out, rounded up to base pages
+    allocated: usize,
 }
 
-impl UDmaBufAllocator {
-    pub(crate) fn open() -> io::Result<Self> {
-        let fd = OpenOptions::new()
-            .read(true)
-            .write(true)
-            .custom_flags(libc::O_SYNC)
-            .open("/dev/udmabuf0")?;
+/// A u-dma-buf, mapped whole
+struct Region {
+    _fd: File,
+    /// Mapping of the whole u-dma-buf, unmapped once the allocator and the buffers carved from
+    /// it are dropped
+    mmap: Arc<MmapMut>,
+    /// Physical address of the u-dma-buf
+    phys_addr: u64,
+    numa_node: Option<u32>,
+    space: Space,
+}
 
-        Ok(Self { fd, offset: 0 })
-    }
+impl UDmaBufAllocator {
+    /// Maps the u-dma-bufs, the ones on `numa_node` first
+    pub(crate) fn open(numa_node: Option<u32>) -> io::Result<Self> {
+        let mut names = fs::read_dir(U_DMA_BUF_CLASS_PATH)?
+            .filter_map(|entry| entry.ok()?.file_name().into_string().ok())
+            .filter_map(|name| {
+                let index: u32 = name.strip_prefix("udmabuf")?.parse().ok()?;
+                Some((index, name))
+            })
+            .collect::<Vec<_>>();
+        names.sort_unstable();
+        let mut regions = names
+            .into_iter()
+            .map(|(_, name)| Region::open(&name))
+            .collect::<io::Result<Vec<_>>>()?;
+        if regions.is_empty() {
+            return Err(io::Error::new(
+                io::ErrorKind::NotFound,
+                "no u-dma-buf found, is the u-dma-buf kernel module loaded?",
+            ));
+        }
+        if numa_node.is_some() {
+            regions.sort_by_key(|region| region.numa_node != numa_node);
+        }
 
-    pub(crate) fn size_total() -> io::Result<usize> {
-        Self::read_attribute("size")?.parse().map_err(|e| {
-            io::Error::new(
-                io::ErrorKind::InvalidData,
-                format!("Failed to parse size: {e}"),
-            )
+        Ok(Self {
+            regions,
+            allocated: 0,
         })
     }
 
-    pub(crate) fn phys_addr() -> io::Result<u64> {
-        let str = Self::read_attribute("phys_addr")?;
-        u64::from_str_radix(str.trim_start_matches("0x"), 16).map_err(|e| {
-            io::Error::new(
-                io::ErrorKind::InvalidData,
-                format!("Failed to parse size: {e}"),
+    /// Returns the address of the mapping of each region, its size and its physical address
+    #[allow(clippy::as_conversions)]
+    pub(crate) fn regions(&self) -> impl Iterator<Item = (u64, usize, u64)> + '_ {
+        self.regions.iter().map(|region| {
+            (
+                region.mmap.as_ptr() as u64,
+                region.mmap.len(),
+                region.phys_addr,
             )
         })
     }
 
-    fn read_attribute(attr: &str) -> io::Result<String> {
-        let path = PathBuf::from(U_DMA_BUF_CLASS_PATH).join(attr);
-        let mut content = String::new();
-        let _ignore = File::open(&path)?.read_to_string(&mut content)?;
-        Ok(content.trim().to_owned())
+    /// Returns the NUMA node of the preferred region, if the platform reports one
+    pub(crate) fn numa_node(&self) -> Option<u32> {
+        self.regions.first().and_then(|region| region.numa_node)
     }
 
-    #[allow(clippy::cast_possible_wrap)]
+    #[allow(unsafe_code, clippy::as_conversions)]
     fn create(&mut self, len: usize) -> io::Result<DmaBuf> {
-        let size_total = Self::size_total()?;
-        if self.offset.checked_add(len).is_none_or(|x| x > size_total) {
-            return Err(io::Error::new(
+        let base_page_size = get_base_page_size() as usize;
+        let out_of_memory = || {
+            io::Error::new(
                 io::ErrorKind::OutOfMemory,
                 format!("Failed to allocate memory of length: {len} bytes"),
-            ));
+            )
+        };
+        if len == 0 {
+            return Err(out_of_memory());
         }
+        let rounded = len.next_multiple_of(base_page_size);
+        let align = len.next_power_of_two().clamp(base_page_size, PAGE_SIZE_2MB);
+        let (region, offset) = self
+            .regions
+            .iter_mut()
+            .find_map(|region| {
+                let offset = region.space.take(rounded, align)?;
+                Some((&*region, offset))
+            })
+            .ok_or_else(out_of_memory)?;
 
+        let mmap = MmapMut::carve(&region.mmap, offset, len);
+        // SAFETY: the range is within the mapping and not handed out yet
+        unsafe {
+            ptr::write_bytes(mmap.ptr.cast::<u8>(), 0, len);
+        }
+        let phys_addr = region.phys_addr + offset as u64;
+        self.allocated += rounded;
+        usage::alloc(Pool::Dma, rounded);
+
+        Ok(DmaBuf::new(mmap, phys_addr))
+    }
+}
+
+impl Region {
+    #[allow(unsafe_code)]
+    fn open(name: &str) -> io::Result<Self> {
+        let class = Path::new(U_DMA_BUF_CLASS_PATH).join(name);
+        let fd = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .custom_flags(libc::O_SYNC)
+            .open(Path::new("/dev").join(name))?;
+        let size = parse_attribute(&class, "size", str::parse::<usize>)?;
+        let phys_addr = parse_attribute(&class, "phys_addr", |s| {
+            u64::from_str_radix(s.trim_start_matches("0x"), 16)
+        })?;
+        let numa_node = read_attribute(&class, "device/numa_node")
+            .ok()
+            .and_then(|s| s.parse().ok());
         let ptr = unsafe {
             libc::mmap(
                 ptr::null_mut(),
-                len,
+                size,
                 libc::PROT_READ | libc::PROT_WRITE,
-                libc::MAP_SHARED,
-                self.fd.as_raw_fd(),
-                self.offset as i64,
+                libc::MAP_SHARED | libc::MAP_POPULATE,
+                fd.as_raw_fd(),
+                0,
             )
         };
-
         if ptr == libc::MAP_FAILED {
-            return Err(io::Error::new(io::ErrorKind::Other, "Failed to map memory"));
+            return Err(io::Error::last_os_error());
         }
 
-        unsafe {
-            ptr::write_bytes(ptr.cast::<u8>(), 0, len);
-        }
+        Ok(Self {
+            _fd: fd,
+            mmap: Arc::new(MmapMut::new(ptr, size)),
+            phys_addr,
+            numa_node,
+            space: Space::new(size, phys_addr),
+        })
+    }
+}
 
-        let mmap = MmapMut::new(ptr, len);
-        let phys_addr = Self::phys_addr()? + self.offset as u64;
+fn read_attribute(class: &Path, attr: &str) -> io::Result<String> {
+    let mut content = String::new();
+    let _ignore = File::open(class.join(attr))?.read_to_string(&mut content)?;
+    Ok(content.trim().to_owned())
+}
 
-        self.offset += len;
+fn parse_attribute<T, E, F>(class: &Path, attr: &str, parse: F) -> io::Result<T>
+where
+    E: std::fmt::Display,
+    F: FnOnce(&str) -> Result<T, E>,
+{
+    parse(&read_attribute(class, attr)?).map_err(|e| {
+        io::Error::new(
+            io::ErrorKind::InvalidData,
+            format!("Failed to parse {attr}: {e}"),
+        )
+    })
+}
 
-        Ok(DmaBuf::new(mmap, phys_addr))
+impl Drop for UDmaBufAllocator {
+    fn drop(&mut self) {
+        // The regions are unmapped once their buffers are dropped
+        usage::free(Pool::Dma, self.allocated);
     }
 }
 
+// SAFETY: the allocator only hands out each range of the mappings once
+#[allow(unsafe_code)]
+unsafe impl Send for UDmaBufAllocator {}
+
 impl DmaBufAllocator for UDmaBufAllocator {
     fn alloc(&mut self, len: usize) -> io::Result<DmaBuf> {
         self.create(len)
     }
 }
 
+/// Space of a region handed out to the buffers
+#[derive(Debug)]
+struct Space {
+    size: usize,
+    /// Physical address of the region, the buffers are aligned on their physical addresses
+    phys_addr: u64,
+    /// Offset of the first byte not allocated yet
+    offset: usize,
+    /// Ranges skipped to align the buffers after them
+    holes: Vec<Range<usize>>,
+}
+
+impl Space {
+    fn new(size: usize, phys_addr: u64) -> Self {
+        Self {
+            size,
+            phys_addr,
+            offset: 0,
+            holes: Vec::new(),
+        }
+    }
+
+    /// Returns the offset of `len` bytes at a physical address aligned to `align`, from the
+    /// first hole they fit in or else past the buffers allocated so far
+    fn take(&mut self, len: usize, align: usize) -> Option<usize> {
+        let fits = |start: usize, end: usize| start.checked_add(len).filter(|&x| x <= end);
+        let hole = self
+            .holes
+            .iter()
+            .position(|hole| fits(self.align_up(hole.start, align), hole.end).is_some());
+        if let Some(hole) = hole.map(|i| self.holes.swap_remove(i)) {
+            let start = self.align_up(hole.start, align);
+            let end = start + len;
+            self.holes.extend(
+                [hole.start..start, end..hole.end]
+                    .into_iter()
+                    .filter(|x| !x.is_empty()),
+            );
+            return Some(start);
+        }
+        let start = self.align_up(self.offset, align);
+        let end = fits(start, self.size)?;
+        if start > self.offset {
+            self.holes.push(self.offset..start);
+        }
+        self.offset = end;
+        Some(start)
+    }
+
+    #[allow(clippy::as_conversions)]
+    fn align_up(&self, offset: usize, align: usize) -> usize {
+        let addr = self.phys_addr + offset as u64;
+        (addr.next_multiple_of(align as u64) - self.phys_addr) as usize
+    }
+}
+
 #[cfg(test)]
 mod tests {
-    use crate::mem::virt_to_phy::{AddressResolver, PhysAddrResolverLinuxX86};
-
     use super::*;
-    use std::io::ErrorKind;
 
     #[test]
     #[allow(clippy::print_stderr)]
     fn allocate_pages() {
-        let Ok(mut allocator) = UDmaBufAllocator::open() else {
+        let Ok(mut allocator) = UDmaBufAllocator::open(None) else {
             eprintln!("WARN: test 'allocate_pages' was skipped as it needs u-dma-buf kernel module to be loaded");
             return;
         };
@@ -120,4 +279,16 @@ mod tests {
         assert_eq!(x.len(), 0x4000);
         x.copy_from(0, &[1; 1]);
     }
+
+    #[test]
+    fn alignment_gaps_are_filled_by_smaller_buffers() {
+        let mut space = Space::new(0x10_0000, 0x8000_1000);
+        assert_eq!(space.take(0x1000, 0x1000), Some(0));
+        // Aligned on the physical address, leaving a gap of 0x2000 bytes
+        assert_eq!(space.take(0x4000, 0x4000), Some(0x3000));
+        assert_eq!(space.take(0x1000, 0x1000), Some(0x1000));
+        assert_eq!(space.take(0x2000, 0x2000), Some(0x7000));
+        assert_eq!(space.take(0x1000, 0x1000), Some(0x2000));
+        assert!(space.take(0x10_0000, 0x1000).is_none());
+    }
 }
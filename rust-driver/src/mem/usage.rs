@@ -0,0 +1,137 @@
+use std::{
+    fmt,
+    sync::atomic::{AtomicUsize, Ordering},
+};
+
+/// Number of pools of `Pool`
+const NUM_POOLS: usize = 4;
+
+/// A memory pool of the driver accounted as it grows and shrinks
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum Pool {
+    /// Buffers carved out of the u-dma-buf: descriptor rings, the MTT buffer and the receive
+    /// rings
+    Dma,
+    /// Chunks of the per-QP tables of the context and of the workers
+    QpTables,
+    /// Send queue elements held by the `PacketRetransmitWorker` until they are acknowledged
+    RetransmitQueues,
+    /// Pages of the registered memory pinned by the driver
+    PinnedPages,
+}
+
+impl Pool {
+    /// All pools, in the order of the dump
+    pub(crate) const ALL: [Pool; NUM_POOLS] = [
+        Pool::Dma,
+        Pool::QpTables,
+        Pool::RetransmitQueues,
+        Pool::PinnedPages,
+    ];
+
+    /// Returns the name of the pool in the text dump
+    pub(crate) fn name(self) -> &'static str {
+        match self {
+            Pool::Dma => "dma",
+            Pool::QpTables => "qp_tables",
+            Pool::RetransmitQueues => "retransmit_queues",
+            Pool::PinnedPages => "pinned_pages",
+        }
+    }
+}
+
+/// The bytes of a pool, alone in its cache line
+#[repr(align(64))]
+#[derive(Debug)]
+struct PoolUsage {
+    bytes: AtomicUsize,
+    /// Highest value of `bytes`
+    peak: AtomicUsize,
+}
+
+impl PoolUsage {
+    const fn new() -> Self {
+        Self {
+            bytes: AtomicUsize::new(0),
+            peak: AtomicUsize::new(0),
+        }
+    }
+
+    fn alloc(&self, bytes: usize) {
+        let current = self.bytes.fetch_add(bytes, Ordering::Relaxed) + bytes;
+        let _prev = self.peak.fetch_max(current, Ordering::Relaxed);
+    }
+
+    fn free(&self, bytes: usize) {
+        let _prev = self
+            .bytes
+            .fetch_update(Ordering::Relaxed, Ordering::Relaxed, |x| {
+                Some(x.saturating_sub(bytes))
+            });
+    }
+
+    fn read(&self) -> (usize, usize) {
+        (
+            self.bytes.load(Ordering::Relaxed),
+            self.peak.load(Ordering::Relaxed),
+        )
+    }
+}
+
+/// Pools of the process, shared by its contexts.
+///
+/// Pools are only accounted when they allocate or release memory, never per work request, so
+/// the accounting stays off the hot path.
+static POOLS: [PoolUsage; NUM_POOLS] = [const { PoolUsage::new() }; NUM_POOLS];
+
+/// Accounts `bytes` allocated by `pool`
+pub(crate) fn alloc(pool: Pool, bytes: usize) {
+    if let Some(usage) = POOLS.get(pool as usize) {
+        usage.alloc(bytes);
+    }
+}
+
+/// Accounts `bytes` released by `pool`
+pub(crate) fn free(pool: Pool, bytes: usize) {
+    if let Some(usage) = POOLS.get(pool as usize) {
+        usage.free(bytes);
+    }
+}
+
+/// Returns the bytes held by `pool` and the highest number of bytes it held
+pub(crate) fn read(pool: Pool) -> (usize, usize) {
+    POOLS.get(pool as usize).map_or((0, 0), PoolUsage::read)
+}
+
+/// Memory held by the process, dumped as `<pool>_bytes <value>` and `<pool>_peak_bytes <value>`
+/// lines
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct MemoryUsage;
+
+impl fmt::Display for MemoryUsage {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        for pool in Pool::ALL {
+            let (bytes, peak) = read(pool);
+            writeln!(f, "{}_bytes {bytes}", pool.name())?;
+            writeln!(f, "{}_peak_bytes {peak}", pool.name())?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn pool_tracks_bytes_and_peak() {
+        let usage = PoolUsage::new();
+        usage.alloc(4096);
+        usage.alloc(8192);
+        usage.free(4096);
+        assert_eq!(usage.read(), (8192, 12288));
+        // Releases beyond the accounted bytes don't wrap around
+        usage.free(16384);
+        assert_eq!(usage.read(), (0, 12288));
+    }
+}
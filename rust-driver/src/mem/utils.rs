@@ -43,6 +43,38 @@ pub(crate) fn get_num_page(addr: u64, length: usize) -> usize {
     (end_page.saturating_sub(start_page) + 1) as usize
 }
 
+/// A run of physically contiguous pages
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct PhysRun {
+    /// Physical address of the first page
+    pub(crate) phys_addr: u64,
+    /// Number of pages in the run
+    pub(crate) num_pages: usize,
+}
+
+/// Coalesces physical addresses of consecutive pages into physically contiguous runs.
+#[allow(clippy::arithmetic_side_effects, clippy::as_conversions)]
+pub(crate) fn phys_runs(phys_addrs: &[u64]) -> Vec<PhysRun> {
+    let mut runs: Vec<PhysRun> = Vec::new();
+    for &phys_addr in phys_addrs {
+        match runs.last_mut() {
+            Some(run)
+                if run
+                    .phys_addr
+                    .checked_add((run.num_pages * PAGE_SIZE) as u64)
+                    .is_some_and(|next| next == phys_addr) =>
+            {
+                run.num_pages += 1;
+            }
+            _ => runs.push(PhysRun {
+                phys_addr,
+                num_pages: 1,
+            }),
+        }
+    }
+    runs
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -122,4 +154,19 @@ mod tests {
             (expected_end_page.saturating_sub(expected_start_page) + 1) as usize
         );
     }
+
+    #[test]
+    fn test_phys_runs() {
+        let page = PAGE_SIZE as u64;
+        assert!(phys_runs(&[]).is_empty());
+        let runs = phys_runs(&[page, 2 * page, 3 * page, 10 * page, 11 * page, 5 * page]);
+        assert_eq!(
+            runs,
+            [
+                PhysRun { phys_addr: page, num_pages: 3 },
+                PhysRun { phys_addr: 10 * page, num_pages: 2 },
+                PhysRun { phys_addr: 5 * page, num_pages: 1 },
+            ]
+        );
+    }
 }
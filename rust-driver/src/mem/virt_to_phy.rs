@@ -1,6 +1,8 @@
 use std::{
     fs::File,
-    io::{self, Read, Seek},
+    io,
+    os::unix::fs::FileExt,
+    sync::OnceLock,
 };
 
 use log::debug;
@@ -11,6 +13,8 @@ const PFN_MASK_SIZE: usize = 8;
 const PFN_MASK: u64 = (1 << 55) - 1;
 /// Bit indicating if a page is present in memory
 const PAGE_PRESENT_BIT: u8 = 63;
+/// Maximum number of pagemap entries read by a single `pread`
+const PAGEMAP_READ_ENTRIES: usize = 8192;
 
 #[cfg(feature = "page_size_2m")]
 const PAGE_SIZE: u64 = 0x20_0000;
@@ -19,7 +23,7 @@ const PAGE_SIZE: u64 = 0x1000;
 
 /// Returns the system's base page size in bytes.
 #[allow(unsafe_code, clippy::cast_sign_loss)]
-fn get_base_page_size() -> u64 {
+pub(super) fn get_base_page_size() -> u64 {
     unsafe { libc::sysconf(libc::_SC_PAGESIZE) as u64 }
 }
 
@@ -63,6 +67,9 @@ pub(crate) type PhysAddrResolver = PhysAddrResolverEmulated;
 #[cfg(not(emulation))]
 pub(crate) type PhysAddrResolver = PhysAddrResolverLinuxX86;
 
+/// Resolves physical addresses from the pagemap of the current process.
+///
+/// The pagemap file is opened on first use and kept open for the process lifetime.
 pub(crate) struct PhysAddrResolverLinuxX86;
 
 #[allow(
@@ -70,39 +77,41 @@ pub(crate) struct PhysAddrResolverLinuxX86;
     clippy::arithmetic_side_effects,
     clippy::host_endian_bytes
 )]
-impl AddressResolver for PhysAddrResolverLinuxX86 {
-    fn virt_to_phys(&self, virt_addr: u64) -> io::Result<Option<u64>> {
-        let base_page_size = get_base_page_size();
-        let mut file = File::open("/proc/self/pagemap")?;
-        let virt_pfn = virt_addr / base_page_size;
-        let offset = PFN_MASK_SIZE as u64 * virt_pfn;
-        let mut buf = [0u8; PFN_MASK_SIZE];
-
-        let mut get_pa_from_file = move |mut file: File| {
-            let _pos = file.seek(io::SeekFrom::Start(offset))?;
-            file.read_exact(&mut buf)?;
-            let entry = u64::from_ne_bytes(buf);
-
-            if (entry >> PAGE_PRESENT_BIT) & 1 != 0 {
-                let phy_pfn = entry & PFN_MASK;
-                let phys_addr = phy_pfn * base_page_size + virt_addr % base_page_size;
-                return Ok(Some(phys_addr));
-            }
-
-            Ok(None)
-        };
-
-        if let pa @ Some(_) = get_pa_from_file(file)? {
-            return Ok(pa);
+impl PhysAddrResolverLinuxX86 {
+    /// Converts the start addresses of `num_pages` pages of `page_size` bytes to physical
+    /// addresses
+    ///
+    /// The GPU pointer translator is only consulted if none of the pages is present in the
+    /// pagemap.
+    ///
+    /// # Errors
+    ///
+    /// Returns an IO error if reading the pagemap fails.
+    pub(crate) fn virt_to_phys_pages(
+        start_addr: u64,
+        num_pages: usize,
+        page_size: u64,
+    ) -> io::Result<Vec<Option<u64>>> {
+        let phys_addrs = read_pagemap(pagemap()?, start_addr, num_pages, page_size)?;
+        if phys_addrs.iter().any(Option::is_some) {
+            return Ok(phys_addrs);
         }
-
-        if let Ok(mut gpu_ptr_translator) = File::open("/dev/gpu_ptr_translator") {
-            if let res @ Ok(Some(_)) = get_pa_from_file(gpu_ptr_translator) {
-                return res;
+        if let Some(gpu_ptr_translator) = gpu_ptr_translator() {
+            if let Ok(gpu_addrs) = read_pagemap(gpu_ptr_translator, start_addr, num_pages, page_size)
+            {
+                return Ok(gpu_addrs);
             }
         }
 
-        Ok(None)
+        Ok(phys_addrs)
+    }
+}
+
+impl AddressResolver for PhysAddrResolverLinuxX86 {
+    fn virt_to_phys(&self, virt_addr: u64) -> io::Result<Option<u64>> {
+        Ok(Self::virt_to_phys_pages(virt_addr, 1, get_base_page_size())?
+            .pop()
+            .flatten())
     }
 
     fn virt_to_phys_range(
@@ -110,57 +119,72 @@ impl AddressResolver for PhysAddrResolverLinuxX86 {
         start_addr: u64,
         num_pages: usize,
     ) -> io::Result<Vec<Option<u64>>> {
-        let base_page_size = get_base_page_size();
-        let mut phy_addrs = vec![None; num_pages];
-        let mut file = File::open("/proc/self/pagemap")?;
-        let mut buf = [0u8; PFN_MASK_SIZE];
-
-        let mut maybe_gpu_ptr = true;
-
-        let mut addr = start_addr;
-        for pa in &mut phy_addrs {
-            let virt_pfn = addr / base_page_size;
-            let offset = PFN_MASK_SIZE as u64 * virt_pfn;
-            let _pos = file.seek(io::SeekFrom::Start(offset))?;
-            file.read_exact(&mut buf)?;
-            let entry = u64::from_ne_bytes(buf);
-            if (entry >> PAGE_PRESENT_BIT) & 1 != 0 {
-                let phys_pfn = entry & PFN_MASK;
-                let phys_addr = phys_pfn * base_page_size + start_addr % base_page_size;
-                *pa = Some(phys_addr);
-
-                maybe_gpu_ptr = false;
-            }
+        Self::virt_to_phys_pages(start_addr, num_pages, PAGE_SIZE)
+    }
+}
 
-            addr += PAGE_SIZE;
-        }
+/// Pagemap of the current process
+static PAGEMAP: OnceLock<File> = OnceLock::new();
 
-        if maybe_gpu_ptr {
-            debug_assert!(phy_addrs.iter().all(Option::is_none), "invalid address");
-
-            let Ok(mut gpu_ptr_translator) = File::open("/dev/gpu_ptr_translator") else {
-                return Ok(phy_addrs);
-            };
-
-            addr = start_addr;
-            for pa in &mut phy_addrs {
-                let virt_pfn = addr / base_page_size;
-                let offset = PFN_MASK_SIZE as u64 * virt_pfn;
-                let _pos = file.seek(io::SeekFrom::Start(offset))?;
-                file.read_exact(&mut buf)?;
-                let entry = u64::from_ne_bytes(buf);
-                if (entry >> PAGE_PRESENT_BIT) & 1 != 0 {
-                    let phys_pfn = entry & PFN_MASK;
-                    let phys_addr = phys_pfn * base_page_size + start_addr % base_page_size;
-                    *pa = Some(phys_addr);
-                }
-
-                addr += PAGE_SIZE;
-            }
-        }
+/// GPU pointer translator, `None` if the device is absent
+static GPU_PTR_TRANSLATOR: OnceLock<Option<File>> = OnceLock::new();
 
-        Ok(phy_addrs)
+/// Returns the pagemap file, opening it on first use
+fn pagemap() -> io::Result<&'static File> {
+    if let Some(file) = PAGEMAP.get() {
+        return Ok(file);
     }
+    let file = File::open("/proc/self/pagemap")?;
+
+    Ok(PAGEMAP.get_or_init(|| file))
+}
+
+/// Returns the GPU pointer translator, opening it on first use
+fn gpu_ptr_translator() -> Option<&'static File> {
+    GPU_PTR_TRANSLATOR
+        .get_or_init(|| File::open("/dev/gpu_ptr_translator").ok())
+        .as_ref()
+}
+
+/// Reads the pagemap entries of `num_pages` pages of `page_size` bytes.
+///
+/// Entries are read in runs of up to `PAGEMAP_READ_ENTRIES` with a single `pread` per run, only
+/// the entry of the first base page of each page is used.
+#[allow(
+    clippy::as_conversions,
+    clippy::arithmetic_side_effects,
+    clippy::cast_possible_truncation
+)]
+fn read_pagemap(
+    file: &File,
+    start_addr: u64,
+    num_pages: usize,
+    page_size: u64,
+) -> io::Result<Vec<Option<u64>>> {
+    let base_page_size = get_base_page_size();
+    let stride = (page_size / base_page_size).max(1) as usize;
+    let first_pfn = start_addr / base_page_size;
+    let page_offset = start_addr % base_page_size;
+    let pages_per_run = (PAGEMAP_READ_ENTRIES / stride).max(1);
+    let mut entries = vec![0u64; (pages_per_run - 1) * stride + 1];
+    let mut phys_addrs = Vec::with_capacity(num_pages);
+
+    while phys_addrs.len() < num_pages {
+        let num = pages_per_run.min(num_pages - phys_addrs.len());
+        // Only the last run may be shorter
+        entries.truncate((num - 1) * stride + 1);
+        let virt_pfn = first_pfn + (phys_addrs.len() * stride) as u64;
+        file.read_exact_at(
+            bytemuck::cast_slice_mut(&mut entries),
+            virt_pfn * PFN_MASK_SIZE as u64,
+        )?;
+        phys_addrs.extend(entries.iter().step_by(stride).map(|&entry| {
+            ((entry >> PAGE_PRESENT_BIT) & 1 != 0)
+                .then(|| (entry & PFN_MASK) * base_page_size + page_offset)
+        }));
+    }
+
+    Ok(phys_addrs)
 }
 
 pub(crate) struct PhysAddrResolverEmulated {
@@ -179,3 +203,27 @@ impl AddressResolver for PhysAddrResolverEmulated {
         Ok(virt_addr.checked_sub(self.heap_start_addr))
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn range_matches_single_page_lookups() {
+        let base_page_size = get_base_page_size();
+        let num_pages = PAGEMAP_READ_ENTRIES + 3;
+        let buf = vec![1u8; num_pages * base_page_size as usize];
+        let start_addr = buf.as_ptr() as u64;
+        let range = PhysAddrResolverLinuxX86::virt_to_phys_pages(
+            start_addr,
+            num_pages,
+            base_page_size,
+        )
+        .unwrap();
+        assert_eq!(range.len(), num_pages);
+        for (i, pa) in range.into_iter().enumerate() {
+            let addr = start_addr + i as u64 * base_page_size;
+            assert_eq!(PhysAddrResolverLinuxX86.virt_to_phys(addr).unwrap(), pa);
+        }
+    }
+}
@@ -0,0 +1,85 @@
+use std::net::Ipv4Addr;
+
+use ipnetwork::Ipv4Network;
+
+use super::{config::NetworkConfig, neigh::NeighbourTable};
+
+/// Peers of the second card of a bonded pair.
+///
+/// Both ends of a bonded connection attach their second cards to a subnet of their own, each
+/// card keeping the host part of the address of the first card of its end. The peer of a QP on
+/// the second subnet is found by moving the host part of its address on the first subnet over.
+pub(crate) struct BondPeers {
+    /// Network of the first card
+    primary: Ipv4Network,
+    /// Network of the second card
+    secondary: NetworkConfig,
+    /// Neighbours of the second card
+    neighbours: NeighbourTable,
+}
+
+impl BondPeers {
+    pub(crate) fn new(
+        primary: Ipv4Network,
+        secondary: NetworkConfig,
+        neighbours: NeighbourTable,
+    ) -> Self {
+        Self {
+            primary,
+            secondary,
+            neighbours,
+        }
+    }
+
+    /// Returns the network configuration of the second card
+    pub(crate) fn network(&self) -> NetworkConfig {
+        self.secondary
+    }
+
+    /// Returns the address of the peer `ip` of the first card on the second subnet, 0 stays 0
+    pub(crate) fn peer_ip(&self, ip: u32) -> u32 {
+        translate_ip(self.primary, self.secondary.ip, ip)
+    }
+
+    /// Resolves the MAC address frames from the second card to `ip` are sent to
+    pub(crate) fn resolve(&self, ip: u32) -> Option<u64> {
+        self.neighbours.resolve(Ipv4Addr::from_bits(ip))
+    }
+
+    /// Returns the cached MAC address frames from the second card to `ip` are sent to
+    pub(crate) fn lookup(&self, ip: u32) -> Option<u64> {
+        self.neighbours.lookup(Ipv4Addr::from_bits(ip))
+    }
+}
+
+/// Moves the host part of `ip` on the network `from` to the network `to`
+fn translate_ip(from: Ipv4Network, to: Ipv4Network, ip: u32) -> u32 {
+    if ip == 0 {
+        return 0;
+    }
+    let host = ip & !from.mask().to_bits();
+    to.network().to_bits() | host
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    #[allow(clippy::unwrap_used)]
+    fn peer_keeps_its_host_part() {
+        let from = Ipv4Network::new(Ipv4Addr::new(10, 0, 0, 2), 24).unwrap();
+        let to = Ipv4Network::new(Ipv4Addr::new(10, 0, 1, 2), 24).unwrap();
+        let peer = Ipv4Addr::new(10, 0, 0, 7).to_bits();
+        assert_eq!(
+            translate_ip(from, to, peer),
+            Ipv4Addr::new(10, 0, 1, 7).to_bits()
+        );
+        assert_eq!(translate_ip(from, to, 0), 0);
+        let wide = Ipv4Network::new(Ipv4Addr::new(172, 16, 0, 2), 16).unwrap();
+        assert_eq!(
+            translate_ip(from, wide, peer),
+            Ipv4Addr::new(172, 16, 0, 7).to_bits()
+        );
+    }
+}
@@ -0,0 +1,428 @@
+use std::{
+    collections::HashMap,
+    io,
+    net::{Ipv4Addr, SocketAddr, SocketAddrV4, UdpSocket},
+    time::{Duration, Instant},
+};
+
+use log::{debug, error};
+
+use crate::{
+    error::{RdmaError, Result},
+    rdma_utils::types::SendWr,
+};
+
+use super::recv_chan::qpn_to_port;
+
+/// Length of a control message
+const MSG_LEN: usize = 16;
+
+const MSG_BIND: u32 = 1;
+const MSG_BIND_ACK: u32 = 2;
+const MSG_BIND_NAK: u32 = 3;
+const MSG_UNBIND: u32 = 4;
+const MSG_XRC_BIND: u32 = 5;
+const MSG_XRC_READY: u32 = 6;
+
+/// Interval between the retransmissions of an unanswered bind request
+pub(crate) const BIND_RETRY: Duration = Duration::from_millis(10);
+
+/// Time after which a peer not answering a bind request is unreachable
+pub(crate) const BIND_TIMEOUT: Duration = Duration::from_secs(1);
+
+/// Number of RDMA READs of the peer a target context serves at once
+pub(crate) const CONTEXT_RD_ATOMIC: u8 = 16;
+
+/// A remote DC QP, the per-WR destination of a DC QP, or a SRQ behind a remote XRC TGT QP
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub(crate) struct DcPeer {
+    pub(crate) ip: Ipv4Addr,
+    pub(crate) qpn: u32,
+    /// SRQ of the TGT QP `qpn` receiving the WRs, `None` for DC QPs
+    pub(crate) srqn: Option<u32>,
+}
+
+/// A send WR of a DC QP, along with its destination
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct DcSendWr {
+    pub(crate) wr: SendWr,
+    /// Handle of the address handle of the destination
+    pub(crate) ah: u32,
+    pub(crate) remote_qpn: u32,
+}
+
+/// Control messages exchanged by the drivers to bind the contexts of their DC QPs
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum DcMsg {
+    /// Asks the DC QP `target` for a context connected to the context `initiator`
+    Bind { initiator: u32, target: u32 },
+    /// `context` of the target is connected to `initiator`
+    BindAck { initiator: u32, context: u32 },
+    /// The target has no context left for `initiator`
+    BindNak { initiator: u32 },
+    /// `initiator` is evicted, the context of the target connected to it can be freed
+    Unbind { initiator: u32 },
+    /// Asks the XRC TGT QP `target` for a context attached to its SRQ `srqn`
+    XrcBind {
+        initiator: u32,
+        target: u32,
+        srqn: u32,
+    },
+    /// `initiator` is connected and listens for the receive WRs of the SRQ, answered with
+    /// `BindAck` once the target context lends them
+    XrcReady { initiator: u32 },
+}
+
+impl DcMsg {
+    fn to_bytes(self) -> [u8; MSG_LEN] {
+        let words = match self {
+            DcMsg::Bind { initiator, target } => [MSG_BIND, initiator, target, 0],
+            DcMsg::BindAck { initiator, context } => [MSG_BIND_ACK, initiator, context, 0],
+            DcMsg::BindNak { initiator } => [MSG_BIND_NAK, initiator, 0, 0],
+            DcMsg::Unbind { initiator } => [MSG_UNBIND, initiator, 0, 0],
+            DcMsg::XrcBind {
+                initiator,
+                target,
+                srqn,
+            } => [MSG_XRC_BIND, initiator, target, srqn],
+            DcMsg::XrcReady { initiator } => [MSG_XRC_READY, initiator, 0, 0],
+        };
+        let mut bytes = [0; MSG_LEN];
+        for (chunk, word) in bytes.chunks_exact_mut(4).zip(words) {
+            chunk.copy_from_slice(&word.to_le_bytes());
+        }
+        bytes
+    }
+
+    fn from_bytes(bytes: &[u8]) -> Option<Self> {
+        let word = |i: usize| {
+            bytes
+                .get(i * 4..i * 4 + 4)
+                .and_then(|x| x.try_into().ok())
+                .map(u32::from_le_bytes)
+        };
+        let initiator = word(1)?;
+        match word(0)? {
+            MSG_BIND => Some(DcMsg::Bind {
+                initiator,
+                target: word(2)?,
+            }),
+            MSG_BIND_ACK => Some(DcMsg::BindAck {
+                initiator,
+                context: word(2)?,
+            }),
+            MSG_BIND_NAK => Some(DcMsg::BindNak { initiator }),
+            MSG_UNBIND => Some(DcMsg::Unbind { initiator }),
+            MSG_XRC_BIND => Some(DcMsg::XrcBind {
+                initiator,
+                target: word(2)?,
+                srqn: word(3)?,
+            }),
+            MSG_XRC_READY => Some(DcMsg::XrcReady { initiator }),
+            _ => None,
+        }
+    }
+}
+
+/// A context of a DC QP connected to a remote context
+#[derive(Debug, Clone, Copy)]
+struct PeerContext {
+    /// QPN of the hardware QP of the context
+    qpn: u32,
+    peer: DcPeer,
+    /// Time of the last WR posted to the context
+    last_post: Instant,
+}
+
+struct DcQp {
+    socket: UdpSocket,
+    send_cq: Option<u32>,
+    recv_cq: Option<u32>,
+    /// Contexts opened by the WRs of the QP, in no particular order
+    initiators: Vec<PeerContext>,
+    /// Contexts opened for the remote initiators, keyed by their address and context
+    targets: HashMap<(Ipv4Addr, u32), u32>,
+}
+
+/// Dynamically connected QPs of a context.
+///
+/// A DC QP reaches many remote DC QPs through the WRs naming their destination. Each remote
+/// QP in use is served by a context, an RC hardware QP connected to a context the remote
+/// driver opens for it, so that the hardware state grows with the active peers rather than
+/// with all peers. A QP holds at most a configured number of contexts, a WR to a new peer
+/// reuses the least recently used context once it has been idle for longer than the
+/// retransmissions of its last WR.
+///
+/// The contexts are bound with control messages sent to the UDP socket of the remote DC
+/// QP, bound to the card address at the port of its post receive channel. The messages are
+/// handled when the CQs are polled, and while a WR waits for its context.
+///
+/// The XRC INI and TGT QPs are held here as well, see `XrcDomains`: the contexts of an INI QP
+/// are keyed by the SRQ their WRs are sent to.
+#[derive(Default)]
+pub(crate) struct DcQps {
+    qps: HashMap<u32, DcQp>,
+}
+
+impl DcQps {
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    /// Binds the control socket of a new DC QP on the card address `ip`
+    pub(crate) fn create(
+        &mut self,
+        qpn: u32,
+        ip: Ipv4Addr,
+        send_cq: Option<u32>,
+        recv_cq: Option<u32>,
+    ) -> io::Result<()> {
+        let socket = UdpSocket::bind((ip, qpn_to_port(qpn)))?;
+        socket.set_nonblocking(true)?;
+        debug!("dc qp {qpn} bound to {:?}", socket.local_addr());
+        let qp = DcQp {
+            socket,
+            send_cq,
+            recv_cq,
+            initiators: Vec::new(),
+            targets: HashMap::new(),
+        };
+        let _ignore = self.qps.insert(qpn, qp);
+        Ok(())
+    }
+
+    /// Removes a DC QP, unbinds its contexts from their peers and returns their QPNs
+    pub(crate) fn destroy(&mut self, qpn: u32) -> Vec<u32> {
+        let Some(qp) = self.qps.remove(&qpn) else {
+            return Vec::new();
+        };
+        for context in &qp.initiators {
+            Self::send(
+                &qp.socket,
+                context.peer,
+                DcMsg::Unbind {
+                    initiator: context.qpn,
+                },
+            );
+        }
+        qp.initiators
+            .iter()
+            .map(|x| x.qpn)
+            .chain(qp.targets.into_values())
+            .collect()
+    }
+
+    pub(crate) fn contains(&self, qpn: u32) -> bool {
+        self.qps.contains_key(&qpn)
+    }
+
+    /// Returns `true` if no DC QP is created
+    pub(crate) fn is_empty(&self) -> bool {
+        self.qps.is_empty()
+    }
+
+    /// Returns the send and receive CQs of a DC QP, shared by its contexts
+    pub(crate) fn cqs(&self, qpn: u32) -> Result<(Option<u32>, Option<u32>)> {
+        let qp = self.get(qpn)?;
+        Ok((qp.send_cq, qp.recv_cq))
+    }
+
+    /// Returns the number of contexts opened by the WRs of a DC QP
+    pub(crate) fn num_initiators(&self, qpn: u32) -> usize {
+        self.qps.get(&qpn).map_or(0, |qp| qp.initiators.len())
+    }
+
+    /// Returns the context of a DC QP connected to `peer`, and marks it as used
+    pub(crate) fn lookup(&mut self, qpn: u32, peer: DcPeer) -> Option<u32> {
+        let context = self
+            .qps
+            .get_mut(&qpn)?
+            .initiators
+            .iter_mut()
+            .find(|x| x.peer == peer)?;
+        context.last_post = Instant::now();
+        Some(context.qpn)
+    }
+
+    /// Unbinds the least recently used context of a DC QP that has been idle for `idle`,
+    /// returns its QPN
+    pub(crate) fn evict(&mut self, qpn: u32, idle: Duration) -> Option<u32> {
+        let qp = self.qps.get_mut(&qpn)?;
+        let index = lru_index(&qp.initiators, Instant::now(), idle)?;
+        let context = qp.initiators.swap_remove(index);
+        debug!(
+            "dc qp {qpn} evicts context {} of {:?}",
+            context.qpn, context.peer
+        );
+        Self::send(
+            &qp.socket,
+            context.peer,
+            DcMsg::Unbind {
+                initiator: context.qpn,
+            },
+        );
+        Some(context.qpn)
+    }
+
+    /// Records the context of a DC QP connected to `peer`
+    pub(crate) fn insert_initiator(&mut self, qpn: u32, context: u32, peer: DcPeer) -> Result<()> {
+        self.get_mut(qpn)?.initiators.push(PeerContext {
+            qpn: context,
+            peer,
+            last_post: Instant::now(),
+        });
+        Ok(())
+    }
+
+    /// Returns the context of a DC QP opened for the context `initiator` at `ip`
+    pub(crate) fn target(&self, qpn: u32, ip: Ipv4Addr, initiator: u32) -> Option<u32> {
+        self.qps.get(&qpn)?.targets.get(&(ip, initiator)).copied()
+    }
+
+    /// Returns the number of contexts of a DC QP opened for remote initiators
+    pub(crate) fn num_targets(&self, qpn: u32) -> usize {
+        self.qps.get(&qpn).map_or(0, |qp| qp.targets.len())
+    }
+
+    pub(crate) fn insert_target(
+        &mut self,
+        qpn: u32,
+        ip: Ipv4Addr,
+        initiator: u32,
+        context: u32,
+    ) -> Result<()> {
+        let _ignore = self.get_mut(qpn)?.targets.insert((ip, initiator), context);
+        Ok(())
+    }
+
+    /// Removes the context of a DC QP opened for the context `initiator` at `ip`
+    pub(crate) fn remove_target(&mut self, qpn: u32, ip: Ipv4Addr, initiator: u32) -> Option<u32> {
+        self.qps.get_mut(&qpn)?.targets.remove(&(ip, initiator))
+    }
+
+    /// Sends a control message from a DC QP to `peer`
+    pub(crate) fn send_to(&self, qpn: u32, peer: DcPeer, msg: DcMsg) -> Result<()> {
+        Self::send(&self.get(qpn)?.socket, peer, msg);
+        Ok(())
+    }
+
+    /// Answers a control message received by a DC QP from `to`
+    pub(crate) fn reply(&self, qpn: u32, to: SocketAddrV4, msg: DcMsg) -> Result<()> {
+        let _len = self.get(qpn)?.socket.send_to(&msg.to_bytes(), to)?;
+        Ok(())
+    }
+
+    /// Returns the control messages received by all DC QPs, along with the QP they are sent
+    /// to and their sender
+    pub(crate) fn poll(&self) -> Vec<(u32, SocketAddrV4, DcMsg)> {
+        let mut msgs = Vec::new();
+        let mut buf = [0; MSG_LEN];
+        for (&qpn, qp) in &self.qps {
+            loop {
+                let (len, from) = match qp.socket.recv_from(&mut buf) {
+                    Ok(x) => x,
+                    Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                    Err(err) => {
+                        error!("failed to receive control message of dc qp {qpn}: {err}");
+                        break;
+                    }
+                };
+                let SocketAddr::V4(from) = from else {
+                    continue;
+                };
+                let Some(msg) = buf.get(..len).and_then(DcMsg::from_bytes) else {
+                    debug!("dc qp {qpn} dropped malformed message from {from}");
+                    continue;
+                };
+                msgs.push((qpn, from, msg));
+            }
+        }
+
+        msgs
+    }
+
+    fn send(socket: &UdpSocket, peer: DcPeer, msg: DcMsg) {
+        let addr = SocketAddrV4::new(peer.ip, qpn_to_port(peer.qpn));
+        if let Err(err) = socket.send_to(&msg.to_bytes(), addr) {
+            error!("failed to send {msg:?} to {addr}: {err}");
+        }
+    }
+
+    fn get(&self, qpn: u32) -> Result<&DcQp> {
+        self.qps
+            .get(&qpn)
+            .ok_or(RdmaError::QpError(format!("DC QP {qpn} not found")))
+    }
+
+    fn get_mut(&mut self, qpn: u32) -> Result<&mut DcQp> {
+        self.qps
+            .get_mut(&qpn)
+            .ok_or(RdmaError::QpError(format!("DC QP {qpn} not found")))
+    }
+}
+
+/// Returns the index of the least recently used context idle for at least `idle` at `now`
+fn lru_index(contexts: &[PeerContext], now: Instant, idle: Duration) -> Option<usize> {
+    contexts
+        .iter()
+        .enumerate()
+        .filter(|(_, x)| now.saturating_duration_since(x.last_post) >= idle)
+        .min_by_key(|(_, x)| x.last_post)
+        .map(|(i, _)| i)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn msg_roundtrip() {
+        for msg in [
+            DcMsg::Bind {
+                initiator: 0x100,
+                target: 0x201,
+            },
+            DcMsg::BindAck {
+                initiator: 0x100,
+                context: 0x302,
+            },
+            DcMsg::BindNak { initiator: 0x100 },
+            DcMsg::Unbind { initiator: 0x100 },
+            DcMsg::XrcBind {
+                initiator: 0x100,
+                target: 0x201,
+                srqn: 3,
+            },
+            DcMsg::XrcReady { initiator: 0x100 },
+        ] {
+            assert_eq!(DcMsg::from_bytes(&msg.to_bytes()), Some(msg));
+        }
+        assert!(DcMsg::from_bytes(&[0; MSG_LEN]).is_none());
+        assert!(DcMsg::from_bytes(&[1; 4]).is_none());
+    }
+
+    #[test]
+    fn lru_skips_busy_contexts() {
+        let now = Instant::now();
+        let peer = DcPeer {
+            ip: Ipv4Addr::LOCALHOST,
+            qpn: 0x100,
+            srqn: None,
+        };
+        let context = |qpn, ago| PeerContext {
+            qpn,
+            peer,
+            last_post: now - Duration::from_millis(ago),
+        };
+        let contexts = [context(1, 50), context(2, 300), context(3, 200)];
+        assert_eq!(
+            lru_index(&contexts, now, Duration::from_millis(100)),
+            Some(1)
+        );
+        assert_eq!(
+            lru_index(&contexts, now, Duration::from_millis(250)),
+            Some(1)
+        );
+        assert_eq!(lru_index(&contexts, now, Duration::from_millis(400)), None);
+    }
+}
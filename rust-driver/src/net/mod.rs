@@ -6,6 +6,32 @@ pub mod tap;
 
 pub(crate) mod reader;
 
+/// Peer MAC resolution through the kernel neighbour table
+pub(crate) mod neigh;
+
 pub(crate) mod simple_nic;
 
 pub(crate) mod recv_chan;
+
+pub(crate) mod recv_ring;
+
+/// Large sends pulled by the receiver with RDMA reads
+pub(crate) mod rendezvous;
+
+/// Spraying of the traffic of the QPs over the ECMP paths
+pub(crate) mod multipath;
+
+/// Unreliable datagram QPs carried by UDP sockets
+pub(crate) mod ud;
+
+/// Dynamically connected QPs multiplexed over per-peer contexts
+pub(crate) mod dc;
+
+/// Raw packet QPs receiving the frames steered to them from the simple NIC
+pub(crate) mod raw;
+
+/// XRC domains, send QPs reaching the SRQs behind a remote TGT QP
+pub(crate) mod xrc;
+
+/// Addressing of the second card of a bonded pair
+pub(crate) mod bond;
@@ -0,0 +1,112 @@
+use std::time::{Duration, Instant};
+
+use crate::{config::MultipathConfig, rdma_utils::qp::QpTableShared};
+
+/// UDP source port of the packets of the QPs outside of the multipath mode
+pub(crate) const DEFAULT_UDP_PORT: u16 = 0x100;
+
+/// First UDP source port of the port sets of the QPs
+const PORT_BASE: u16 = 0xC000;
+
+/// Number of UDP source ports the port sets are drawn from
+const PORT_RANGE: u32 = 0x4000;
+
+/// Flowlet of a QP
+#[derive(Debug, Default, Clone, Copy)]
+struct Flowlet {
+    /// Time of the latest post to the QP
+    last_post: Option<Instant>,
+    /// Index of the current path in the port set of the QP
+    path: u32,
+}
+
+/// Spreads the traffic of each QP over the ECMP paths of the fabric.
+///
+/// The switches select the path of a packet from the hash of its UDP source port. Each QP owns
+/// a set of source ports, and a post following an idle gap of the QP starts a new flowlet on
+/// the next port of the set. The packets of a flowlet stay on one path, the packets of
+/// different flowlets may be reordered, which the PSN tracking of the receiver tolerates.
+pub(crate) struct Multipath {
+    /// Number of ports of each QP
+    paths: u32,
+    /// Idle time ending a flowlet
+    gap: Duration,
+    flowlets: QpTableShared<Flowlet>,
+}
+
+impl Multipath {
+    pub(crate) fn new(config: MultipathConfig) -> Self {
+        Self {
+            paths: config.paths.max(1),
+            gap: Duration::from_micros(config.flowlet_gap_us),
+            flowlets: QpTableShared::new(),
+        }
+    }
+
+    /// Returns the port of the first flowlet of the QP
+    pub(crate) fn initial_port(&self, qpn: u32) -> u16 {
+        path_port(qpn, 0, self.paths)
+    }
+
+    /// Records a post to the QP at `now`
+    ///
+    /// # Returns
+    ///
+    /// The port of the next path if the post starts a new flowlet, `None` if the QP stays on
+    /// its current path
+    pub(crate) fn on_post(&self, qpn: u32, now: Instant) -> Option<u16> {
+        if self.paths == 1 {
+            return None;
+        }
+        self.flowlets
+            .map_qp_mut(qpn, |flowlet| {
+                let idle = flowlet
+                    .last_post
+                    .is_some_and(|last| now.saturating_duration_since(last) >= self.gap);
+                flowlet.last_post = Some(now);
+                idle.then(|| {
+                    flowlet.path = (flowlet.path + 1) % self.paths;
+                    path_port(qpn, flowlet.path, self.paths)
+                })
+            })
+            .flatten()
+    }
+
+    /// Puts a destroyed QP back on its first path
+    pub(crate) fn reset(&self, qpn: u32) {
+        let _ignore = self.flowlets.replace(qpn, Flowlet::default());
+    }
+}
+
+/// Returns the port of a path of the QP, the sets of consecutive QPs don't overlap
+fn path_port(qpn: u32, path: u32, paths: u32) -> u16 {
+    let offset = qpn.wrapping_mul(paths).wrapping_add(path) % PORT_RANGE;
+    PORT_BASE + u16::try_from(offset).unwrap_or_else(|_| unreachable!())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn idle_gaps_move_the_qp_to_its_next_path() {
+        let multipath = Multipath::new(MultipathConfig {
+            enabled: true,
+            paths: 2,
+            flowlet_gap_us: 50,
+        });
+        let start = Instant::now();
+        let at = |us| start + Duration::from_micros(us);
+        let (first, second) = (path_port(1, 0, 2), path_port(1, 1, 2));
+        assert_ne!(first, second);
+        assert_eq!(multipath.initial_port(1), first);
+        assert_eq!(multipath.on_post(1, at(0)), None);
+        assert_eq!(multipath.on_post(1, at(40)), None);
+        assert_eq!(multipath.on_post(1, at(90)), Some(second));
+        assert_eq!(multipath.on_post(1, at(200)), Some(first));
+        // the ports of the other QPs are not shared
+        assert_ne!(path_port(2, 0, 2), second);
+        multipath.reset(1);
+        assert_eq!(multipath.on_post(1, at(400)), None);
+    }
+}
@@ -0,0 +1,277 @@
+use std::{
+    collections::HashMap,
+    io,
+    net::Ipv4Addr,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc,
+    },
+    thread,
+};
+
+use log::{debug, error};
+use netlink_packet_core::{NetlinkMessage, NetlinkPayload, NLM_F_DUMP, NLM_F_REQUEST};
+use netlink_packet_route::{
+    neighbour::{NeighbourAddress, NeighbourAttribute, NeighbourMessage, NeighbourState},
+    AddressFamily, RouteNetlinkMessage,
+};
+use netlink_sys::{protocols::NETLINK_ROUTE, Socket, SocketAddr};
+use parking_lot::RwLock;
+
+use super::config::NetworkConfig;
+
+/// Multicast group of the neighbour table notifications
+const RTMGRP_NEIGH: u32 = 0x4;
+
+/// Size of the buffer receiving netlink messages
+const RECV_BUF_SIZE: usize = 64 * 1024;
+
+/// Peer MAC addresses resolved through the neighbour table of the kernel.
+///
+/// Lookups are served from a cache that is filled by dumping the neighbour table on a miss.
+/// A watcher thread keeps the cache up to date and reports the changed entries, so that the
+/// QPs already connected to a destination can be reconfigured without the lookups waiting
+/// on netlink.
+pub(crate) struct NeighbourTable {
+    /// Network the device is attached to, destinations outside it are reached through the
+    /// gateway
+    network: NetworkConfig,
+    /// MAC address of each resolved IP
+    cache: Arc<RwLock<HashMap<Ipv4Addr, u64>>>,
+    /// Next hops whose MAC address was added or changed by the kernel
+    changes: flume::Receiver<(Ipv4Addr, u64)>,
+    /// Whether `changes` may be non-empty, so that polling it costs one load
+    changed: Arc<AtomicBool>,
+}
+
+impl NeighbourTable {
+    /// Creates the table and spawns the thread watching the neighbour notifications
+    pub(crate) fn spawn(network: NetworkConfig) -> io::Result<Self> {
+        let cache = Arc::new(RwLock::new(HashMap::new()));
+        let (tx, rx) = flume::unbounded();
+        let mut socket = Socket::new(NETLINK_ROUTE)?;
+        socket.bind(&SocketAddr::new(0, RTMGRP_NEIGH))?;
+        let changed = Arc::new(AtomicBool::new(false));
+        let watched = Arc::clone(&cache);
+        let notify = Arc::clone(&changed);
+        let _handle = thread::Builder::new()
+            .name("neigh-watcher".into())
+            .spawn(move || watch(&socket, &watched, &tx, &notify))?;
+
+        Ok(Self {
+            network,
+            cache,
+            changes: rx,
+            changed,
+        })
+    }
+
+    /// Returns the next hop of `dst`, the gateway if `dst` is outside of the local network
+    fn next_hop(&self, dst: Ipv4Addr) -> Ipv4Addr {
+        match self.network.gateway {
+            Some(gateway) if !self.network.ip.contains(dst) => gateway,
+            _ => dst,
+        }
+    }
+
+    /// Resolves the MAC address frames to `dst` are sent to, `None` if the kernel has no
+    /// neighbour entry for its next hop yet
+    pub(crate) fn resolve(&self, dst: Ipv4Addr) -> Option<u64> {
+        let hop = self.next_hop(dst);
+        if let Some(mac) = self.cache.read().get(&hop) {
+            return Some(*mac);
+        }
+        match dump() {
+            Ok(entries) => {
+                let mut cache = self.cache.write();
+                cache.extend(entries);
+                cache.get(&hop).copied()
+            }
+            Err(err) => {
+                error!("failed to dump neighbour table: {err}");
+                None
+            }
+        }
+    }
+
+    /// Returns the cached MAC address frames to `dst` are sent to, without dumping the
+    /// neighbour table on a miss
+    pub(crate) fn lookup(&self, dst: Ipv4Addr) -> Option<u64> {
+        self.cache.read().get(&self.next_hop(dst)).copied()
+    }
+
+    /// Calls `f` with each next hop whose MAC address changed since the last call, without
+    /// blocking
+    pub(crate) fn for_each_change<F: FnMut(Ipv4Addr, u64)>(&self, mut f: F) {
+        if !self.changed.swap(false, Ordering::Acquire) {
+            return;
+        }
+        for (hop, mac) in self.changes.try_iter() {
+            f(hop, mac);
+        }
+    }
+
+    /// Returns whether frames to `dst` are sent to `hop`
+    pub(crate) fn is_reached_through(&self, dst: Ipv4Addr, hop: Ipv4Addr) -> bool {
+        self.next_hop(dst) == hop
+    }
+}
+
+/// Reads the neighbour notifications until the socket fails, updating the cache and reporting
+/// the changed entries
+fn watch(
+    socket: &Socket,
+    cache: &RwLock<HashMap<Ipv4Addr, u64>>,
+    changes: &flume::Sender<(Ipv4Addr, u64)>,
+    changed: &AtomicBool,
+) {
+    let mut buf = Vec::with_capacity(RECV_BUF_SIZE);
+    loop {
+        buf.clear();
+        if let Err(err) = socket.recv(&mut buf, 0) {
+            error!("failed to receive neighbour notification: {err}");
+            return;
+        }
+        let result = parse(&buf, |msg| {
+            let RouteNetlinkMessage::NewNeighbour(neigh) = msg else {
+                return;
+            };
+            let Some((ip, mac)) = entry(&neigh) else {
+                return;
+            };
+            let prev = cache.write().insert(ip, mac);
+            // New entries are reported too, for the QPs connected before their next hop was
+            // resolved
+            if prev != Some(mac) {
+                debug!("neighbour {ip} changed to {mac:#x}");
+                let _ignore = changes.send((ip, mac));
+                changed.store(true, Ordering::Release);
+            }
+        });
+        if let Err(err) = result {
+            error!("invalid neighbour notification: {err}");
+        }
+    }
+}
+
+/// Dumps the IPv4 entries of the neighbour table
+fn dump() -> io::Result<Vec<(Ipv4Addr, u64)>> {
+    let mut socket = Socket::new(NETLINK_ROUTE)?;
+    let _addr = socket.bind_auto()?;
+    socket.connect(&SocketAddr::new(0, 0))?;
+
+    let mut message = NeighbourMessage::default();
+    message.header.family = AddressFamily::Inet;
+    let mut req = NetlinkMessage::from(RouteNetlinkMessage::GetNeighbour(message));
+    req.header.flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.finalize();
+    let mut buffer = vec![0; req.buffer_len()];
+    req.serialize(&mut buffer);
+    let n = socket.send(&buffer, 0)?;
+    assert_eq!(n, buffer.len(), "failed to send entire buffer");
+
+    let mut entries = Vec::new();
+    let mut buf = Vec::with_capacity(RECV_BUF_SIZE);
+    loop {
+        buf.clear();
+        let _len = socket.recv(&mut buf, 0)?;
+        let done = parse(&buf, |msg| {
+            if let RouteNetlinkMessage::NewNeighbour(neigh) = msg {
+                entries.extend(entry(&neigh));
+            }
+        })?;
+        if done {
+            return Ok(entries);
+        }
+    }
+}
+
+/// Calls `f` with each route message in `buf`, returns whether the end of a dump was reached
+fn parse<F: FnMut(RouteNetlinkMessage)>(mut buf: &[u8], mut f: F) -> io::Result<bool> {
+    while !buf.is_empty() {
+        let msg = NetlinkMessage::<RouteNetlinkMessage>::deserialize(buf)
+            .map_err(|err| io::Error::new(io::ErrorKind::InvalidData, err))?;
+        let len = usize::try_from(msg.header.length).unwrap_or(usize::MAX);
+        if len == 0 {
+            break;
+        }
+        buf = buf.get(len..).unwrap_or_default();
+        match msg.payload {
+            NetlinkPayload::InnerMessage(msg) => f(msg),
+            NetlinkPayload::Done(_) => return Ok(true),
+            NetlinkPayload::Error(err) => {
+                return Err(io::Error::other(format!("netlink error: {err:?}")))
+            }
+            _ => {}
+        }
+    }
+    Ok(false)
+}
+
+/// Returns the IP and MAC address of a usable IPv4 neighbour entry
+fn entry(neigh: &NeighbourMessage) -> Option<(Ipv4Addr, u64)> {
+    if matches!(
+        neigh.header.state,
+        NeighbourState::Incomplete | NeighbourState::Failed
+    ) {
+        return None;
+    }
+    let ip = neigh.attributes.iter().find_map(|attr| match *attr {
+        NeighbourAttribute::Destination(NeighbourAddress::Inet(ip)) => Some(ip),
+        _ => None,
+    })?;
+    let mac = neigh.attributes.iter().find_map(|attr| match *attr {
+        NeighbourAttribute::LinkLocalAddress(ref addr) => mac_to_u64(addr),
+        _ => None,
+    })?;
+    Some((ip, mac))
+}
+
+/// Converts MAC address octets to the value written to the hardware, the first octet is the
+/// most significant byte of the 48 bits
+fn mac_to_u64(octets: &[u8]) -> Option<u64> {
+    (octets.len() == 6).then(|| {
+        octets
+            .iter()
+            .fold(0u64, |mac, octet| (mac << 8) | u64::from(*octet))
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use ipnetwork::Ipv4Network;
+
+    use crate::constants::{CARD_MAC_ADDRESS, CARD_MAC_ADDRESS_OCTETS};
+
+    use super::*;
+
+    #[test]
+    fn mac_octets_match_hardware_layout() {
+        assert_eq!(mac_to_u64(&CARD_MAC_ADDRESS_OCTETS), Some(CARD_MAC_ADDRESS));
+        assert_eq!(mac_to_u64(&[1, 2, 3]), None);
+    }
+
+    #[test]
+    fn remote_destinations_resolve_through_gateway() {
+        let (_tx, changes) = flume::unbounded();
+        let gateway = Ipv4Addr::new(10, 0, 0, 1);
+        let table = NeighbourTable {
+            network: NetworkConfig {
+                ip: Ipv4Network::new(Ipv4Addr::new(10, 0, 0, 2), 24).unwrap(),
+                gateway: Some(gateway),
+                ..NetworkConfig::default()
+            },
+            cache: Arc::new(RwLock::new(HashMap::new())),
+            changes,
+            changed: Arc::new(AtomicBool::new(false)),
+        };
+        let local = Ipv4Addr::new(10, 0, 0, 3);
+        let remote = Ipv4Addr::new(10, 1, 0, 3);
+        assert_eq!(table.next_hop(local), local);
+        assert_eq!(table.next_hop(remote), gateway);
+        let _ignore = table.cache.write().insert(gateway, 0x1234);
+        assert_eq!(table.resolve(remote), Some(0x1234));
+        assert_eq!(table.lookup(remote), Some(0x1234));
+        assert_eq!(table.lookup(local), None);
+    }
+}
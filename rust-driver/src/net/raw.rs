@@ -0,0 +1,509 @@
+use std::{
+    collections::{HashMap, VecDeque},
+    io,
+    mem::size_of,
+};
+
+use ibverbs_sys::ibv_send_wr;
+use log::debug;
+
+use crate::{
+    error::{RdmaError, Result},
+    rdma_utils::types::{RecvWr, SendWr, SendWrBase},
+    workers::{completion::Completion, send::WorkReqOpCode},
+};
+
+use super::simple_nic::{FrameRx, FrameTx};
+
+/// `enum ibv_flow_spec_type` of `verbs.h`
+const SPEC_ETH: u32 = 0x20;
+const SPEC_IPV4: u32 = 0x30;
+const SPEC_TCP: u32 = 0x40;
+const SPEC_UDP: u32 = 0x41;
+
+/// EtherType of IPv4
+const ETHER_TYPE_IPV4: u16 = 0x0800;
+/// IP protocols of the L4 specs
+const IP_PROTO_TCP: u8 = 6;
+const IP_PROTO_UDP: u8 = 17;
+
+/// Maximum number of frames received per poll
+const RX_BATCH: usize = 32;
+
+/// Returns the send WR of a raw packet QP, whose buffers hold a whole Ethernet frame
+pub(crate) fn raw_send_wr(wr: ibv_send_wr) -> Result<SendWrBase> {
+    match SendWr::new(wr)? {
+        SendWr::Send(base) if base.opcode == WorkReqOpCode::Send => Ok(base),
+        SendWr::Send(_) | SendWr::Rdma(_) => Err(RdmaError::InvalidInput(
+            "raw packet QPs only support sends without immediate data".into(),
+        )),
+    }
+}
+
+/// Value of a header field under its mask, a zero mask matches any value
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+struct Masked<T> {
+    value: T,
+    mask: T,
+}
+
+impl<T> Masked<T>
+where
+    T: Copy + PartialEq + std::ops::BitAnd<Output = T>,
+{
+    fn new(value: T, mask: T) -> Self {
+        Self {
+            value: value & mask,
+            mask,
+        }
+    }
+
+    fn matches(&self, field: T) -> bool {
+        field & self.mask == self.value
+    }
+}
+
+/// Returns the MAC address of `bytes` as an integer, the first byte the most significant
+fn mac(bytes: &[u8]) -> u64 {
+    bytes.iter().fold(0, |acc, &x| (acc << 8) | u64::from(x))
+}
+
+/// Headers of a received frame, in host order, `None` for the layers the frame lacks
+#[derive(Debug, Default, Clone, Copy)]
+struct FrameHeaders {
+    dst_mac: u64,
+    src_mac: u64,
+    ether_type: u16,
+    /// Source address, destination address and protocol of an IPv4 packet
+    ipv4: Option<(u32, u32, u8)>,
+    /// Source and destination ports of a TCP or UDP datagram
+    ports: Option<(u16, u16)>,
+}
+
+impl FrameHeaders {
+    fn parse(frame: &[u8]) -> Option<Self> {
+        let be16 = |bytes: &[u8], at: usize| {
+            bytes
+                .get(at..at + 2)
+                .and_then(|x| x.try_into().ok())
+                .map(u16::from_be_bytes)
+        };
+        let mut headers = Self {
+            dst_mac: mac(frame.get(0..6)?),
+            src_mac: mac(frame.get(6..12)?),
+            ether_type: be16(frame, 12)?,
+            ..Self::default()
+        };
+        if headers.ether_type != ETHER_TYPE_IPV4 {
+            return Some(headers);
+        }
+        let packet = frame.get(14..).unwrap_or_default();
+        let be32 = |at: usize| {
+            packet
+                .get(at..at + 4)
+                .and_then(|x| x.try_into().ok())
+                .map(u32::from_be_bytes)
+        };
+        let (Some(version_ihl), Some(&proto), Some(src_ip), Some(dst_ip)) =
+            (packet.first(), packet.get(9), be32(12), be32(16))
+        else {
+            return Some(headers);
+        };
+        headers.ipv4 = Some((src_ip, dst_ip, proto));
+        let ihl = usize::from(version_ihl & 0xf) * 4;
+        if proto == IP_PROTO_TCP || proto == IP_PROTO_UDP {
+            headers.ports = be16(packet, ihl).zip(be16(packet, ihl + 2));
+        }
+        Some(headers)
+    }
+}
+
+/// A steering rule of a raw packet QP, built from the specs of an `ibv_flow_attr`. The fields
+/// of the specs that are not given match any frame.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct FlowSpec {
+    priority: u16,
+    dst_mac: Masked<u64>,
+    src_mac: Masked<u64>,
+    ether_type: Masked<u16>,
+    /// Whether the frame must be an IPv4 packet
+    ipv4: bool,
+    src_ip: Masked<u32>,
+    dst_ip: Masked<u32>,
+    /// IP protocol of the L4 spec
+    proto: Option<u8>,
+    src_port: Masked<u16>,
+    dst_port: Masked<u16>,
+}
+
+impl FlowSpec {
+    /// Reads the Ethernet, IPv4, TCP and UDP specs following `attr`
+    ///
+    /// # Safety
+    ///
+    /// `attr` must be followed by its `num_of_specs` specs, as `ibv_create_flow` requires
+    #[allow(unsafe_code, clippy::as_conversions)]
+    pub(crate) unsafe fn from_ibv(attr: &ibverbs_sys::ibv_flow_attr) -> Result<Self> {
+        if attr.type_ != ibverbs_sys::IBV_FLOW_ATTR_NORMAL || attr.comp_mask != 0 {
+            return Err(RdmaError::Unimplemented(
+                "only normal flow rules are supported".into(),
+            ));
+        }
+        let mut spec = Self {
+            priority: attr.priority,
+            ..Self::default()
+        };
+        let mut next = std::ptr::from_ref(attr).cast::<u8>();
+        // SAFETY: the specs follow the attributes, each starts with its type and size
+        unsafe {
+            next = next.add(size_of::<ibverbs_sys::ibv_flow_attr>());
+            for _ in 0..attr.num_of_specs {
+                let type_ = next.cast::<u32>().read_unaligned();
+                let size = usize::from(next.add(4).cast::<u16>().read_unaligned());
+                let fits = |len: usize| {
+                    if size < len {
+                        return Err(RdmaError::InvalidInput(format!(
+                            "flow spec {type_:#x} of {size} bytes"
+                        )));
+                    }
+                    Ok(())
+                };
+                match type_ {
+                    SPEC_ETH => {
+                        fits(size_of::<ibverbs_sys::ibv_flow_spec_eth>())?;
+                        let eth = next
+                            .cast::<ibverbs_sys::ibv_flow_spec_eth>()
+                            .read_unaligned();
+                        spec.dst_mac = Masked::new(mac(&eth.val.dst_mac), mac(&eth.mask.dst_mac));
+                        spec.src_mac = Masked::new(mac(&eth.val.src_mac), mac(&eth.mask.src_mac));
+                        spec.ether_type = Masked::new(
+                            u16::from_be(eth.val.ether_type),
+                            u16::from_be(eth.mask.ether_type),
+                        );
+                    }
+                    SPEC_IPV4 => {
+                        fits(size_of::<ibverbs_sys::ibv_flow_spec_ipv4>())?;
+                        let ipv4 = next
+                            .cast::<ibverbs_sys::ibv_flow_spec_ipv4>()
+                            .read_unaligned();
+                        spec.ipv4 = true;
+                        spec.src_ip = Masked::new(
+                            u32::from_be(ipv4.val.src_ip),
+                            u32::from_be(ipv4.mask.src_ip),
+                        );
+                        spec.dst_ip = Masked::new(
+                            u32::from_be(ipv4.val.dst_ip),
+                            u32::from_be(ipv4.mask.dst_ip),
+                        );
+                    }
+                    SPEC_TCP | SPEC_UDP => {
+                        fits(size_of::<ibverbs_sys::ibv_flow_spec_tcp_udp>())?;
+                        let l4 = next
+                            .cast::<ibverbs_sys::ibv_flow_spec_tcp_udp>()
+                            .read_unaligned();
+                        spec.ipv4 = true;
+                        spec.proto = Some(if type_ == SPEC_TCP {
+                            IP_PROTO_TCP
+                        } else {
+                            IP_PROTO_UDP
+                        });
+                        spec.src_port = Masked::new(
+                            u16::from_be(l4.val.src_port),
+                            u16::from_be(l4.mask.src_port),
+                        );
+                        spec.dst_port = Masked::new(
+                            u16::from_be(l4.val.dst_port),
+                            u16::from_be(l4.mask.dst_port),
+                        );
+                    }
+                    _ => {
+                        return Err(RdmaError::Unimplemented(format!(
+                            "flow spec {type_:#x} not supported"
+                        )))
+                    }
+                }
+                next = next.add(size);
+            }
+        }
+        Ok(spec)
+    }
+
+    fn matches(&self, headers: &FrameHeaders) -> bool {
+        let l2 = self.dst_mac.matches(headers.dst_mac)
+            && self.src_mac.matches(headers.src_mac)
+            && self.ether_type.matches(headers.ether_type);
+        if !l2 || !self.ipv4 {
+            return l2;
+        }
+        let Some((src_ip, dst_ip, proto)) = headers.ipv4 else {
+            return false;
+        };
+        let l3 = self.src_ip.matches(src_ip) && self.dst_ip.matches(dst_ip);
+        let Some(want) = self.proto else {
+            return l3;
+        };
+        l3 && want == proto
+            && headers.ports.is_some_and(|(src_port, dst_port)| {
+                self.src_port.matches(src_port) && self.dst_port.matches(dst_port)
+            })
+    }
+}
+
+/// Raw packet QPs of a context.
+///
+/// The frames that are not RDMA traffic land in the receive ring of the simple NIC. The raw
+/// packet QPs take the frames matching their steering rules from that ring into their posted
+/// receive WRs when the CQs are polled, without the tap device and its system calls. A frame
+/// goes to the QP of the first matching rule, the rules of lower `priority` first. The frames
+/// matching no rule, or whose QP has no receive WR fitting them, are dropped.
+///
+/// The sends of a raw packet QP are whole Ethernet frames, queued on the transmit ring of the
+/// simple NIC behind the ACKs of the driver. The card has a single ring of each direction and
+/// no scatter to host buffers, so a frame is copied once between a slot of the ring and the
+/// buffer of its WR.
+#[derive(Debug, Default)]
+pub(crate) struct RawQps {
+    /// Posted receive WRs of each QP
+    qps: HashMap<u32, VecDeque<RecvWr>>,
+    next_flow: u32,
+    /// Steering rules and their QPs keyed by handle
+    flows: HashMap<u32, (u32, FlowSpec)>,
+    /// Handles of the rules, in matching order
+    order: Vec<u32>,
+    /// Largest frame of a slot of the simple NIC
+    max_frame: usize,
+    /// Staging buffer of the sent frames
+    buf: Vec<u8>,
+}
+
+impl RawQps {
+    pub(crate) fn new(max_frame: usize) -> Self {
+        Self {
+            max_frame,
+            ..Self::default()
+        }
+    }
+
+    pub(crate) fn create(&mut self, qpn: u32) {
+        let _ignore = self.qps.insert(qpn, VecDeque::new());
+    }
+
+    /// Forgets the QP along with its steering rules
+    pub(crate) fn destroy(&mut self, qpn: u32) {
+        if self.qps.remove(&qpn).is_none() {
+            return;
+        }
+        self.flows.retain(|_, &mut (x, _)| x != qpn);
+        let flows = &self.flows;
+        self.order.retain(|handle| flows.contains_key(handle));
+    }
+
+    pub(crate) fn contains(&self, qpn: u32) -> bool {
+        self.qps.contains_key(&qpn)
+    }
+
+    /// Returns `true` if no raw packet QP is created
+    pub(crate) fn is_empty(&self) -> bool {
+        self.qps.is_empty()
+    }
+
+    pub(crate) fn post_recv(&mut self, qpn: u32, wr: RecvWr) -> Result<()> {
+        self.get_mut(qpn)?.push_back(wr);
+        Ok(())
+    }
+
+    /// Steers the frames matching `spec` to the QP, returns the handle of the rule
+    pub(crate) fn create_flow(&mut self, qpn: u32, spec: FlowSpec) -> Result<u32> {
+        let _wrs = self.get_mut(qpn)?;
+        let handle = self.next_flow;
+        self.next_flow = self.next_flow.wrapping_add(1);
+        let _ignore = self.flows.insert(handle, (qpn, spec));
+        // Stable, the rules of a priority match in creation order
+        let flows = &self.flows;
+        let at = self.order.partition_point(|x| {
+            flows
+                .get(x)
+                .is_some_and(|&(_, y)| y.priority <= spec.priority)
+        });
+        self.order.insert(at, handle);
+        debug!("flow {handle} of raw packet qp {qpn}: {spec:?}");
+        Ok(handle)
+    }
+
+    pub(crate) fn destroy_flow(&mut self, handle: u32) -> Result<()> {
+        if self.flows.remove(&handle).is_none() {
+            return Err(RdmaError::NotFound(format!("flow {handle} not found")));
+        }
+        self.order.retain(|&x| x != handle);
+        Ok(())
+    }
+
+    /// Sends the frame of `wr` on `tx`
+    #[allow(unsafe_code, clippy::as_conversions)]
+    pub(crate) fn send<Tx: FrameTx>(&mut self, tx: &mut Tx, wr: &SendWrBase) -> Result<()> {
+        if wr.length as usize > self.max_frame {
+            return Err(RdmaError::InvalidInput(format!(
+                "frame length {} exceeds {}",
+                wr.length, self.max_frame
+            )));
+        }
+        self.buf.clear();
+        for sge in wr.sg_list.as_slice() {
+            // SAFETY: the SGEs are local buffers of the WR, readable until it completes
+            let data =
+                unsafe { std::slice::from_raw_parts(sge.addr as *const u8, sge.length as usize) };
+            self.buf.extend_from_slice(data);
+        }
+        tx.send(&self.buf)?;
+        Ok(())
+    }
+
+    /// Receives the frames waiting on `rx` into the receive WRs of their QPs, returns the
+    /// completions of the WRs
+    pub(crate) fn poll<Rx: FrameRx>(&mut self, rx: &mut Rx) -> io::Result<Vec<Completion>> {
+        let mut completions = Vec::new();
+        if self.order.is_empty() {
+            // The ring is left to the card, as without raw packet QPs
+            return Ok(completions);
+        }
+        let _num = rx.recv_many(RX_BATCH, |frame| {
+            completions.extend(self.receive(frame));
+            Ok(())
+        })?;
+        Ok(completions)
+    }
+
+    /// Copies a frame into the next receive WR of the QP of the first matching rule
+    #[allow(unsafe_code, clippy::as_conversions)]
+    fn receive(&mut self, frame: &[u8]) -> Option<Completion> {
+        let headers = FrameHeaders::parse(frame)?;
+        let &(qpn, _) = self
+            .order
+            .iter()
+            .filter_map(|handle| self.flows.get(handle))
+            .find(|(_, spec)| spec.matches(&headers))?;
+        let wrs = self.qps.get_mut(&qpn)?;
+        let wr = wrs.front().copied()?;
+        if frame.len() > wr.length as usize {
+            debug!(
+                "raw packet qp {qpn} dropped a frame of {} bytes, receive WR of {} bytes",
+                frame.len(),
+                wr.length
+            );
+            return None;
+        }
+        let _ignore = wrs.pop_front();
+        // SAFETY: the buffer of a posted receive WR is owned by the WR until it completes, and
+        // holds at least the frame
+        unsafe {
+            (wr.addr as *mut u8).copy_from_nonoverlapping(frame.as_ptr(), frame.len());
+        }
+        Some(Completion::Recv {
+            qpn,
+            wr_id: wr.wr_id,
+            imm: None,
+            byte_len: frame.len() as u32,
+            offset: 0,
+        })
+    }
+
+    fn get_mut(&mut self, qpn: u32) -> Result<&mut VecDeque<RecvWr>> {
+        self.qps
+            .get_mut(&qpn)
+            .ok_or(RdmaError::QpError(format!("raw packet QP {qpn} not found")))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Frames waiting to be received
+    struct Frames(VecDeque<Vec<u8>>);
+
+    impl FrameRx for Frames {
+        type Frame<'a>
+            = Vec<u8>
+        where
+            Self: 'a;
+
+        fn recv_nonblocking(&mut self) -> io::Result<Vec<u8>> {
+            self.0.pop_front().ok_or(io::ErrorKind::WouldBlock.into())
+        }
+    }
+
+    /// An Ethernet frame of a UDP datagram to `dst_port`
+    fn udp_frame(dst_mac: [u8; 6], dst_port: u16) -> Vec<u8> {
+        let mut frame = Vec::new();
+        frame.extend_from_slice(&dst_mac);
+        frame.extend_from_slice(&[2, 0, 0, 0, 0, 1]);
+        frame.extend_from_slice(&ETHER_TYPE_IPV4.to_be_bytes());
+        let mut ip = [0u8; 20];
+        ip[0] = 0x45;
+        ip[9] = IP_PROTO_UDP;
+        ip[12..16].copy_from_slice(&[10, 0, 0, 1]);
+        ip[16..20].copy_from_slice(&[10, 0, 0, 2]);
+        frame.extend_from_slice(&ip);
+        frame.extend_from_slice(&5000u16.to_be_bytes());
+        frame.extend_from_slice(&dst_port.to_be_bytes());
+        frame.extend_from_slice(&[0; 4]);
+        frame
+    }
+
+    #[test]
+    #[allow(clippy::as_conversions)]
+    fn frames_are_steered_by_priority() {
+        let mac = [2, 0, 0, 0, 0, 2];
+        let mut raw = RawQps::new(2048);
+        let (qp0, qp1) = (1 << 8, 2 << 8);
+        raw.create(qp0);
+        raw.create(qp1);
+        let by_mac = FlowSpec {
+            priority: 1,
+            dst_mac: Masked::new(0x0200_0000_0002, u64::MAX >> 16),
+            ..FlowSpec::default()
+        };
+        let by_port = FlowSpec {
+            priority: 0,
+            ipv4: true,
+            proto: Some(IP_PROTO_UDP),
+            dst_port: Masked::new(4791, u16::MAX),
+            ..FlowSpec::default()
+        };
+        let _mac_flow = raw.create_flow(qp1, by_mac).unwrap();
+        let port_flow = raw.create_flow(qp0, by_port).unwrap();
+        let mut bufs = [[0u8; 64]; 3];
+        for (i, buf) in bufs.iter_mut().enumerate() {
+            let qpn = if i == 0 { qp0 } else { qp1 };
+            let wr = RecvWr {
+                wr_id: i as u64,
+                addr: buf.as_mut_ptr() as u64,
+                length: 64,
+                lkey: 0,
+            };
+            raw.post_recv(qpn, wr).unwrap();
+        }
+        let frames = [
+            udp_frame(mac, 4791),
+            udp_frame(mac, 9),
+            udp_frame([2, 0, 0, 0, 0, 3], 9),
+        ];
+        let mut rx = Frames(frames.iter().cloned().collect());
+        let completions = raw.poll(&mut rx).unwrap();
+        assert_eq!(completions.len(), 2);
+        assert_eq!((completions[0].qpn(), completions[0].wr_id()), (qp0, 0));
+        assert_eq!((completions[1].qpn(), completions[1].wr_id()), (qp1, 1));
+        assert_eq!(&bufs[1][..frames[1].len()], frames[1].as_slice());
+
+        raw.destroy_flow(port_flow).unwrap();
+        assert!(raw.destroy_flow(port_flow).is_err());
+        let mut rx = Frames([udp_frame(mac, 4791)].into());
+        let completions = raw.poll(&mut rx).unwrap();
+        assert_eq!((completions[0].qpn(), completions[0].wr_id()), (qp1, 2));
+        raw.destroy(qp1);
+        assert!(raw
+            .poll(&mut Frames([udp_frame(mac, 9)].into()))
+            .unwrap()
+            .is_empty());
+    }
+}
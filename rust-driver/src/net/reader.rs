@@ -10,7 +10,9 @@ use ipnetwork::{IpNetwork, Ipv4Network};
 use pnet::datalink;
 
 use crate::{
-    constants::{BLUE_RDMA_NETDEV_INTERFACE_NAME, BLUE_RDMA_SYSFS_PATH},
+    constants::{
+        BLUE_RDMA_IBDEV_NAME_PREFIX, BLUE_RDMA_NETDEV_INTERFACE_PREFIX, BLUE_RDMA_SYSFS_CLASS_PATH,
+    },
     net::config::NetworkConfig,
 };
 
@@ -19,10 +21,12 @@ use super::config::MacAddress;
 pub(crate) struct NetConfigReader;
 
 impl NetConfigReader {
-    pub(crate) fn read() -> NetworkConfig {
+    /// Reads the network configuration of the netdev of card `index`
+    pub(crate) fn read(index: usize) -> NetworkConfig {
+        let name = format!("{BLUE_RDMA_NETDEV_INTERFACE_PREFIX}{index}");
         let interface = default_net::get_interfaces()
             .into_iter()
-            .find(|x| x.name == BLUE_RDMA_NETDEV_INTERFACE_NAME)
+            .find(|x| x.name == name)
             .expect("blue-rdma netdev not present");
 
         let ip = interface
@@ -46,8 +50,8 @@ impl NetConfigReader {
         }
     }
 
-    pub(crate) fn read_mac_sysfs() -> io::Result<u64> {
-        let mac = Self::read_attribute_sysfs("mac")?;
+    pub(crate) fn read_mac_sysfs(index: usize) -> io::Result<u64> {
+        let mac = Self::read_attribute_sysfs(index, "mac")?;
         let bytes = mac
             .split(':')
             .map(|s| u8::from_str_radix(s, 16))
@@ -64,8 +68,8 @@ impl NetConfigReader {
     }
 
     #[allow(clippy::indexing_slicing)]
-    pub(crate) fn read_ip_sysfs() -> io::Result<Option<u32>> {
-        let gids = Self::read_attribute_sysfs("gids")?;
+    pub(crate) fn read_ip_sysfs(index: usize) -> io::Result<Option<u32>> {
+        let gids = Self::read_attribute_sysfs(index, "gids")?;
         for gid in gids.lines() {
             let bytes = gid
                 .split(':')
@@ -89,8 +93,10 @@ impl NetConfigReader {
         Ok(None)
     }
 
-    fn read_attribute_sysfs(attr: &str) -> io::Result<String> {
-        let path = PathBuf::from(BLUE_RDMA_SYSFS_PATH).join(attr);
+    fn read_attribute_sysfs(index: usize, attr: &str) -> io::Result<String> {
+        let path = PathBuf::from(BLUE_RDMA_SYSFS_CLASS_PATH)
+            .join(format!("{BLUE_RDMA_IBDEV_NAME_PREFIX}{index}"))
+            .join(attr);
         let mut content = String::new();
         let _ignore = File::open(&path)?.read_to_string(&mut content)?;
         Ok(content.trim().to_owned())
@@ -1,21 +1,33 @@
 use std::{
-    collections::VecDeque,
+    collections::{HashMap, VecDeque},
     io::{self, Read, Write},
     net::{Ipv4Addr, TcpListener, TcpStream},
-    sync::Arc,
+    os::fd::{AsRawFd, OwnedFd, RawFd},
+    sync::{
+        atomic::{fence, AtomicBool, Ordering},
+        Arc,
+    },
     thread,
+    time::{Duration, Instant},
 };
 
 use bincode::{Decode, Encode};
-use log::debug;
+use log::{debug, error};
 use parking_lot::Mutex;
 use serde::{Deserialize, Serialize};
 
-use crate::rdma_utils::{
-    qp::{qpn_to_index, QpTable},
-    types::RecvWr,
+use crate::{
+    constants::{MAX_SEND_WR, RECV_WR_RING_LEN},
+    error::{RdmaError, Result},
+    rdma_utils::{
+        qp::{qpn_to_index, QpTable},
+        types::{RecvWr, SendWrBase, SendWrRdma},
+    },
+    workers::{rdma::RdmaWriteTask, spawner::TaskTx},
 };
 
+use super::rendezvous::{PullRequest, PULL_REQUEST_LEN};
+
 pub(crate) trait PostRecvChannel {
     type Tx: PostRecvTx;
     type Rx: PostRecvRx;
@@ -25,6 +37,12 @@ pub(crate) trait PostRecvChannel {
 pub(crate) trait PostRecvTx: Sized {
     fn connect(addr: Ipv4Addr, dqpn: u32) -> io::Result<Self>;
     fn send(&mut self, wr: RecvWr) -> io::Result<()>;
+    /// Passes the WRs of a chain posted at once
+    fn send_batch(&mut self, wrs: &[RecvWr]) -> io::Result<()> {
+        wrs.iter().try_for_each(|&wr| self.send(wr))
+    }
+    /// Asks the responder to read a send into one of its receive WRs
+    fn send_pull(&mut self, pull: PullRequest) -> io::Result<()>;
 }
 
 pub(crate) trait PostRecvRx: Sized {
@@ -34,6 +52,51 @@ pub(crate) trait PostRecvRx: Sized {
 
 const BASE_PORT: u16 = 60000;
 
+/// Length of the records of the post receive channels
+const RECORD_LEN: usize = 32;
+
+/// Offset of the payload in a record, after the type byte
+const RECORD_PAYLOAD: usize = 4;
+
+const RECORD_RECV: u8 = 0;
+const RECORD_PULL: u8 = 1;
+
+/// A record of the post receive channels
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum ChannelRecord {
+    /// A receive WR posted by the peer
+    Recv(RecvWr),
+    /// A send of the peer to read into a receive WR advertised to it
+    Pull(PullRequest),
+}
+
+impl ChannelRecord {
+    fn to_bytes(self) -> [u8; RECORD_LEN] {
+        let mut bytes = [0u8; RECORD_LEN];
+        let (kind, payload) = match self {
+            ChannelRecord::Recv(wr) => (RECORD_RECV, &wr.to_bytes()[..]),
+            ChannelRecord::Pull(pull) => (RECORD_PULL, &pull.to_bytes()[..]),
+        };
+        bytes[0] = kind;
+        bytes[RECORD_PAYLOAD..RECORD_PAYLOAD + payload.len()].copy_from_slice(payload);
+        bytes
+    }
+
+    #[allow(clippy::unwrap_used)]
+    fn from_bytes(bytes: &[u8; RECORD_LEN]) -> Option<Self> {
+        let payload = &bytes[RECORD_PAYLOAD..];
+        match bytes[0] {
+            RECORD_RECV => Some(ChannelRecord::Recv(RecvWr::from_bytes(
+                payload[..size_of::<RecvWr>()].try_into().unwrap(),
+            ))),
+            RECORD_PULL => Some(ChannelRecord::Pull(PullRequest::from_bytes(
+                payload[..PULL_REQUEST_LEN].try_into().unwrap(),
+            ))),
+            _ => None,
+        }
+    }
+}
+
 pub(crate) struct TcpChannel;
 
 impl PostRecvChannel for TcpChannel {
@@ -57,32 +120,120 @@ impl PostRecvTx for TcpChannelTx {
     }
 
     fn send(&mut self, wr: RecvWr) -> io::Result<()> {
+        self.write_record(ChannelRecord::Recv(wr))
+    }
+
+    /// Writes the records of the chain with a single write
+    fn send_batch(&mut self, wrs: &[RecvWr]) -> io::Result<()> {
+        let bytes: Vec<u8> = wrs
+            .iter()
+            .flat_map(|&wr| ChannelRecord::Recv(wr).to_bytes())
+            .collect();
+        self.stream()?.write_all(&bytes)
+    }
+
+    fn send_pull(&mut self, pull: PullRequest) -> io::Result<()> {
+        self.write_record(ChannelRecord::Pull(pull))
+    }
+}
+
+impl TcpChannelTx {
+    fn write_record(&mut self, record: ChannelRecord) -> io::Result<()> {
+        self.stream()?.write_all(&record.to_bytes())
+    }
+
+    /// Returns the stream to the peer, connected on the first record
+    fn stream(&mut self) -> io::Result<&mut TcpStream> {
         if self.inner.is_none() {
-            debug!("TcpChannelTx try connect {}:{}", self.addr, qpn_to_port(self.dqpn));
-            self.inner = Some(TcpStream::connect((self.addr, qpn_to_port(self.dqpn)))?);
+            debug!(
+                "TcpChannelTx try connect {}:{}",
+                self.addr,
+                qpn_to_port(self.dqpn)
+            );
+            let stream = TcpStream::connect((self.addr, qpn_to_port(self.dqpn)))?;
+            // Nagle would delay the small records until the previous one is acknowledged
+            stream.set_nodelay(true)?;
+            self.inner = Some(stream);
         }
-        let stream = self.inner.as_mut().unwrap_or_else(|| unreachable!());
-        stream.write_all(&wr.to_bytes())?;
-
-        Ok(())
+        Ok(self.inner.as_mut().unwrap_or_else(|| unreachable!()))
     }
 }
 
 pub(crate) struct TcpChannelRx {
-    inner: TcpListener,
+    /// Shared with the listener pool of the `RecvWorker`, which keeps it bound once the QP is
+    /// destroyed
+    inner: Arc<TcpListener>,
     stream: Option<TcpStream>,
-    buf: [u8; size_of::<RecvWr>()],
+    buf: [u8; RECORD_LEN],
+    /// Number of bytes of a partially read record in `buf`
+    filled: usize,
+}
+
+impl TcpChannelRx {
+    fn with_listener(inner: Arc<TcpListener>) -> Self {
+        Self {
+            inner,
+            stream: None,
+            buf: [0; RECORD_LEN],
+            filled: 0,
+        }
+    }
+
+    /// Returns the fd to wait on, the listener until the peer has connected
+    fn as_raw_fd(&self) -> RawFd {
+        self.stream
+            .as_ref()
+            .map_or(self.inner.as_raw_fd(), AsRawFd::as_raw_fd)
+    }
+
+    /// Accepts the peer connection, or reads all records available without blocking
+    ///
+    /// # Returns
+    ///
+    /// `false` if the peer has closed the connection
+    fn read_available(&mut self, records: &mut Vec<ChannelRecord>) -> io::Result<bool> {
+        let Some(stream) = self.stream.as_mut() else {
+            match self.inner.accept() {
+                Ok((stream, _socket_addr)) => {
+                    stream.set_nonblocking(true)?;
+                    self.stream = Some(stream);
+                }
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => {}
+                Err(err) => return Err(err),
+            }
+            return Ok(true);
+        };
+        let mut buf = [0u8; READ_BATCH * RECORD_LEN];
+        loop {
+            let len = match stream.read(&mut buf) {
+                Ok(0) => return Ok(false),
+                Ok(len) => len,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => return Ok(true),
+                Err(err) if err.kind() == io::ErrorKind::Interrupted => continue,
+                Err(err) => return Err(err),
+            };
+            for &byte in buf.iter().take(len) {
+                if let Some(x) = self.buf.get_mut(self.filled) {
+                    *x = byte;
+                }
+                self.filled += 1;
+                if self.filled == self.buf.len() {
+                    match ChannelRecord::from_bytes(&self.buf) {
+                        Some(record) => records.push(record),
+                        None => error!("invalid post recv channel record: {:?}", self.buf),
+                    }
+                    self.filled = 0;
+                }
+            }
+        }
+    }
 }
 
 impl PostRecvRx for TcpChannelRx {
     fn listen(addr: Ipv4Addr, qpn: u32) -> io::Result<Self> {
         debug!("TcpChannelRx bind port {}", qpn_to_port(qpn));
         let inner = TcpListener::bind((addr, qpn_to_port(qpn)))?;
-        Ok(Self {
-            inner,
-            stream: None,
-            buf: [0; size_of::<RecvWr>()],
-        })
+        Ok(Self::with_listener(Arc::new(inner)))
     }
 
     fn recv(&mut self) -> io::Result<RecvWr> {
@@ -92,7 +243,10 @@ impl PostRecvRx for TcpChannelRx {
         }
         let stream = self.stream.as_mut().unwrap_or_else(|| unreachable!());
         stream.read_exact(self.buf.as_mut())?;
-        Ok(RecvWr::from_bytes(&self.buf))
+        match ChannelRecord::from_bytes(&self.buf) {
+            Some(ChannelRecord::Recv(wr)) => Ok(wr),
+            Some(ChannelRecord::Pull(_)) | None => Err(io::ErrorKind::InvalidData.into()),
+        }
     }
 }
 
@@ -107,7 +261,7 @@ pub(crate) fn post_recv_channel<C: PostRecvChannel>(
     Ok((tx, rx))
 }
 
-fn qpn_to_port(qpn: u32) -> u16 {
+pub(super) fn qpn_to_port(qpn: u32) -> u16 {
     let index = qpn_to_index(qpn);
     BASE_PORT + index as u16
 }
@@ -116,7 +270,7 @@ pub(crate) struct PostRecvTxTable<Tx = TcpChannelTx> {
     inner: QpTable<Option<Tx>>,
 }
 
-impl<Tx> PostRecvTxTable<Tx> {
+impl<Tx: 'static> PostRecvTxTable<Tx> {
     pub(crate) fn new() -> Self {
         Self {
             inner: QpTable::new(),
@@ -130,61 +284,762 @@ impl<Tx> PostRecvTxTable<Tx> {
     pub(crate) fn get_qp_mut(&mut self, qpn: u32) -> Option<&mut Tx> {
         self.inner.get_qp_mut(qpn).and_then(Option::as_mut)
     }
+
+    /// Closes the channel of the QP, returns `true` if it had one
+    pub(crate) fn remove(&mut self, qpn: u32) -> bool {
+        self.inner.replace(qpn, None).flatten().is_some()
+    }
+}
+
+/// RNR NAK timer values of the `min_rnr_timer` encoding, in units of 10 microseconds
+const RNR_TIMER_10US: [u64; 32] = [
+    65536, 1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536,
+    2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576, 32768, 49152,
+];
+
+/// `rnr_retry` value that retries indefinitely
+const RNR_RETRY_INFINITE: u8 = 7;
+
+/// Returns how long a send may wait for a receive WR, `None` waits indefinitely
+fn rnr_budget(min_rnr_timer: u8, rnr_retry: u8) -> Option<Duration> {
+    if rnr_retry >= RNR_RETRY_INFINITE {
+        return None;
+    }
+    let timer = RNR_TIMER_10US
+        .get(usize::from(min_rnr_timer))
+        .copied()
+        .unwrap_or(0);
+    Some(Duration::from_micros(
+        timer * 10 * (u64::from(rnr_retry) + 1),
+    ))
+}
+
+/// A send posted while no receive WR of the remote end was available
+struct PendingSend {
+    wr: SendWrBase,
+    /// The RNR retries of the send are exhausted after this instant
+    deadline: Option<Instant>,
+}
+
+/// Receive WRs posted by the remote end, and the sends waiting for them.
+///
+/// A send posted while no receive WR is available is queued instead of failing, in place of
+/// the RNR retries of the requester. Once a send is queued, later sends queue behind it so that
+/// sends consume receive WRs in posting order.
+///
+/// With strides, consecutive sends fill successive strides of the receive WR at the front.
+#[derive(Default)]
+pub(crate) struct RecvWrQueue {
+    /// Receive WRs not yet consumed by a send
+    wrs: VecDeque<RecvWr>,
+    /// Sends waiting for a receive WR, in posting order
+    pending: VecDeque<PendingSend>,
+    /// `min_rnr_timer` of the QP
+    min_rnr_timer: u8,
+    /// `rnr_retry` of the QP
+    rnr_retry: u8,
+    /// Size of the strides of the receive WRs, 0 if a send takes a whole receive WR
+    stride: u32,
+    /// Bytes of the strides of the front receive WR filled by sends
+    filled: u32,
+}
+
+impl RecvWrQueue {
+    pub(crate) fn with_stride(stride: u32) -> Self {
+        Self {
+            stride,
+            ..Self::default()
+        }
+    }
+
+    /// Updates the RNR attributes of the QP, `None` keeps the current value
+    pub(crate) fn set_rnr(&mut self, min_rnr_timer: Option<u8>, rnr_retry: Option<u8>) {
+        self.min_rnr_timer = min_rnr_timer.unwrap_or(self.min_rnr_timer);
+        self.rnr_retry = rnr_retry.unwrap_or(self.rnr_retry);
+    }
+
+    /// Matches a send WR with the next receive WR without queueing it
+    ///
+    /// # Returns
+    ///
+    /// The resolved WR, or `None` if the send has to wait for a receive WR
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the lengths mismatch, or if the oldest waiting send has exhausted
+    /// its RNR retries
+    pub(crate) fn try_resolve(&mut self, wr: SendWrBase) -> Result<Option<SendWrRdma>> {
+        let now = Instant::now();
+        if self
+            .pending
+            .front()
+            .and_then(|x| x.deadline)
+            .is_some_and(|x| x <= now)
+        {
+            return Err(RdmaError::Timeout("RNR retry count exceeded".into()));
+        }
+        if !self.pending.is_empty() {
+            return Ok(None);
+        }
+        self.match_front(wr).transpose()
+    }
+
+    /// Matches a send WR with the next receive WR, or queues it until one arrives
+    ///
+    /// # Returns
+    ///
+    /// The resolved WR, or `None` if the send is queued
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the send can not be resolved nor queued
+    pub(crate) fn resolve(&mut self, wr: SendWrBase) -> Result<Option<SendWrRdma>> {
+        if let Some(x) = self.try_resolve(wr)? {
+            return Ok(Some(x));
+        }
+        if self.pending.len() >= MAX_SEND_WR {
+            return Err(RdmaError::ResourceExhausted(
+                "Too many sends waiting for receive WRs".into(),
+            ));
+        }
+        let deadline = rnr_budget(self.min_rnr_timer, self.rnr_retry).map(|x| Instant::now() + x);
+        self.pending.push_back(PendingSend { wr, deadline });
+
+        Ok(None)
+    }
+
+    /// Adds a receive WR posted by the remote end
+    ///
+    /// # Returns
+    ///
+    /// The waiting sends resolved against the WR, oldest first
+    pub(crate) fn push(&mut self, recv: RecvWr) -> Vec<Result<SendWrRdma>> {
+        self.wrs.push_back(recv);
+        let mut resolved = Vec::new();
+        while let Some(send) = self.pending.front() {
+            let Some(wr) = self.match_front(send.wr) else {
+                break;
+            };
+            let _ignore = self.pending.pop_front();
+            resolved.push(wr);
+        }
+        resolved
+    }
+
+    /// Matches a send WR with the receive WR at the front, `None` if there is none
+    fn match_front(&mut self, wr: SendWrBase) -> Option<Result<SendWrRdma>> {
+        if self.stride == 0 {
+            return self.wrs.pop_front().map(|x| match_recv(wr, x));
+        }
+        let front = loop {
+            let front = *self.wrs.front()?;
+            // The rest of a partially filled receive WR too short for the send is skipped
+            if self.filled == 0 || wr.length <= front.length.saturating_sub(self.filled) {
+                break front;
+            }
+            self.retire_front();
+        };
+        let recv = RecvWr {
+            addr: front.addr + u64::from(self.filled),
+            length: front.length.saturating_sub(self.filled),
+            ..front
+        };
+        let result = match_recv(wr, recv);
+        if result.is_ok() {
+            self.filled = self
+                .filled
+                .saturating_add(stride_span(self.stride, wr.length));
+            if front.length.saturating_sub(self.filled) < self.stride {
+                self.retire_front();
+            }
+        }
+        Some(result)
+    }
+
+    fn retire_front(&mut self) {
+        let _ignore = self.wrs.pop_front();
+        self.filled = 0;
+    }
 }
 
-pub(crate) type SharedRecvWrQueue = Arc<Mutex<VecDeque<RecvWr>>>;
+/// Returns the bytes of the strides a message of `length` bytes fills, a stride for an empty
+/// message
+pub(crate) fn stride_span(stride: u32, length: u32) -> u32 {
+    length.max(1).div_ceil(stride).saturating_mul(stride)
+}
+
+/// Resolves a send WR into an RDMA write targeting the receive buffer.
+///
+/// The send may be shorter than the buffer, it is written at the start of the buffer and the
+/// receive completion reports the length of the send.
+fn match_recv(wr: SendWrBase, recv: RecvWr) -> Result<SendWrRdma> {
+    if wr.length > recv.length {
+        return Err(RdmaError::InvalidInput(
+            "Send length exceeds receive length".into(),
+        ));
+    }
+    Ok(SendWrRdma::new_from_base(wr, recv.addr, recv.lkey))
+}
+
+/// The receive WR queue of a QP, fed by a single producer.
+///
+/// The `RecvWorker` pushes the receive WRs read from the channel of the QP into a bounded
+/// single producer ring, without taking the lock of the queue. The posting thread moves them
+/// to the queue as it matches its sends, so the lock is only taken by the posting thread while
+/// no send is waiting. Once a send waits for a receive WR, `pending` is set and the producer
+/// takes the lock to resolve the waiting sends with the WRs it pushes.
+pub(crate) struct SharedRecvWrQueue {
+    inner: Mutex<RecvWrMatcher>,
+    /// Whether sends are waiting, only changed under the lock
+    pending: AtomicBool,
+}
+
+/// The queue and the consuming end of the ring of its producer
+struct RecvWrMatcher {
+    queue: RecvWrQueue,
+    incoming: rtrb::Consumer<RecvWr>,
+}
+
+impl RecvWrMatcher {
+    /// Moves the receive WRs pushed by the producer to the queue
+    ///
+    /// # Returns
+    ///
+    /// The waiting sends resolved against the WRs, oldest first
+    fn drain(&mut self) -> Vec<Result<SendWrRdma>> {
+        let mut resolved = Vec::new();
+        while let Ok(recv) = self.incoming.pop() {
+            resolved.extend(self.queue.push(recv));
+        }
+        resolved
+    }
+
+    /// Moves the receive WRs pushed by the producer to the queue while no send is waiting, the
+    /// waiting sends are resolved by the producer
+    fn drain_idle(&mut self) {
+        if self.queue.pending.is_empty() {
+            let _none = self.drain();
+        }
+    }
+}
+
+impl SharedRecvWrQueue {
+    fn with_stride(stride: u32) -> Self {
+        let (_producer, incoming) = rtrb::RingBuffer::new(1);
+        Self {
+            inner: Mutex::new(RecvWrMatcher {
+                queue: RecvWrQueue::with_stride(stride),
+                incoming,
+            }),
+            pending: AtomicBool::new(false),
+        }
+    }
+
+    /// Publishes whether sends are waiting, the lock of the queue is held
+    fn publish_pending(&self, matcher: &RecvWrMatcher) {
+        self.pending
+            .store(!matcher.queue.pending.is_empty(), Ordering::Relaxed);
+    }
+
+    /// See [`RecvWrQueue::try_resolve`]
+    fn try_resolve(&self, wr: SendWrBase) -> Result<Option<SendWrRdma>> {
+        let mut matcher = self.inner.lock();
+        matcher.drain_idle();
+        matcher.queue.try_resolve(wr)
+    }
+
+    /// See [`RecvWrQueue::resolve`]
+    fn resolve(&self, wr: SendWrBase) -> Result<Option<SendWrRdma>> {
+        let mut matcher = self.inner.lock();
+        matcher.drain_idle();
+        if let Some(x) = matcher.queue.try_resolve(wr)? {
+            return Ok(Some(x));
+        }
+        // Announces the send before looking at the ring again, so that a WR pushed meanwhile
+        // is either seen here or resolves the send on the producer
+        self.pending.store(true, Ordering::Relaxed);
+        fence(Ordering::SeqCst);
+        matcher.drain_idle();
+        let resolved = matcher.queue.resolve(wr);
+        self.publish_pending(&matcher);
+        resolved
+    }
+
+    /// See [`RecvWrQueue::push`]
+    fn push(&self, recv: RecvWr) -> Vec<Result<SendWrRdma>> {
+        let mut matcher = self.inner.lock();
+        let mut resolved = matcher.drain();
+        resolved.extend(matcher.queue.push(recv));
+        self.publish_pending(&matcher);
+        resolved
+    }
+}
+
+/// Producer of the receive WRs of a QP, owned by its `RecvChannel`
+pub(crate) struct RecvWrProducer {
+    ring: rtrb::Producer<RecvWr>,
+    queue: Arc<SharedRecvWrQueue>,
+}
+
+impl RecvWrProducer {
+    /// Adds a receive WR posted by the remote end, the waiting sends are resolved by
+    /// `resolve_pending`
+    ///
+    /// # Returns
+    ///
+    /// The waiting sends resolved against the WR if the ring was full
+    fn push(&mut self, recv: RecvWr) -> Vec<Result<SendWrRdma>> {
+        match self.ring.push(recv) {
+            Ok(()) => Vec::new(),
+            // The posting thread is behind, the WR is handed over under the lock
+            Err(rtrb::PushError::Full(recv)) => self.queue.push(recv),
+        }
+    }
+
+    /// Resolves the waiting sends with the receive WRs pushed so far
+    ///
+    /// # Returns
+    ///
+    /// The resolved sends, oldest first
+    fn resolve_pending(&self) -> Vec<Result<SendWrRdma>> {
+        fence(Ordering::SeqCst);
+        if !self.queue.pending.load(Ordering::Relaxed) {
+            return Vec::new();
+        }
+        let mut matcher = self.queue.inner.lock();
+        let resolved = matcher.drain();
+        self.queue.publish_pending(&matcher);
+        resolved
+    }
+}
 
 pub(crate) struct RecvWrQueueTable {
-    inner: QpTable<SharedRecvWrQueue>,
+    inner: QpTable<Arc<SharedRecvWrQueue>>,
+    stride: u32,
 }
 
 impl RecvWrQueueTable {
-    pub(crate) fn new() -> Self {
+    /// Creates the queues of all QPs, see [`RecvWrQueue::with_stride`]
+    pub(crate) fn new(stride: u32) -> Self {
         Self {
-            inner: QpTable::new(),
+            inner: QpTable::new_with(move || Arc::new(SharedRecvWrQueue::with_stride(stride))),
+            stride,
         }
     }
 
-    pub(crate) fn clone_recv_wr_queue(&self, qpn: u32) -> Option<SharedRecvWrQueue> {
-        self.inner.get_qp(qpn).cloned()
+    /// Empties the queue of a destroyed QP for the next QP of its index. The producer of the
+    /// destroyed QP keeps the previous queue, so the WRs it still pushes are dropped with it.
+    pub(crate) fn reset(&mut self, qpn: u32) {
+        let queue = Arc::new(SharedRecvWrQueue::with_stride(self.stride));
+        let _ignore = self.inner.replace(qpn, queue);
+    }
+
+    /// Creates the producer of the receive WRs of a QP, in place of the previous one
+    pub(crate) fn new_producer(&mut self, qpn: u32) -> Option<RecvWrProducer> {
+        let queue = self.inner.get_qp_mut(qpn)?;
+        let (ring, incoming) = rtrb::RingBuffer::new(RECV_WR_RING_LEN);
+        let mut matcher = queue.inner.lock();
+        // The WRs left by the previous producer are kept, it resolved the waiting sends
+        matcher.drain_idle();
+        matcher.incoming = incoming;
+        drop(matcher);
+        Some(RecvWrProducer {
+            ring,
+            queue: Arc::clone(queue),
+        })
+    }
+
+    /// See [`RecvWrQueue::try_resolve`]
+    pub(crate) fn try_resolve(&self, qpn: u32, wr: SendWrBase) -> Result<Option<SendWrRdma>> {
+        self.queue(qpn)?.try_resolve(wr)
+    }
+
+    /// See [`RecvWrQueue::resolve`]
+    pub(crate) fn resolve(&self, qpn: u32, wr: SendWrBase) -> Result<Option<SendWrRdma>> {
+        self.queue(qpn)?.resolve(wr)
+    }
+
+    /// Adds a receive WR taken by the posting thread, such as those of the in-band rings, see
+    /// [`RecvWrQueue::push`]
+    pub(crate) fn push(&self, qpn: u32, recv: RecvWr) -> Vec<Result<SendWrRdma>> {
+        self.inner
+            .get_qp(qpn)
+            .map(|x| x.push(recv))
+            .unwrap_or_default()
     }
 
-    pub(crate) fn pop(&self, qpn: u32) -> Option<RecvWr> {
-        let queue = self.inner.get_qp(qpn)?;
-        queue.lock().pop_front()
+    /// Returns `true` if sends of the QP are waiting for a receive WR
+    pub(crate) fn has_pending(&self, qpn: u32) -> bool {
+        self.inner
+            .get_qp(qpn)
+            .is_some_and(|x| !x.inner.lock().queue.pending.is_empty())
+    }
+
+    /// Updates the RNR attributes of the QP, its queue is allocated so that it is not the
+    /// vacant entry shared by the QPs of its chunk
+    pub(crate) fn set_rnr(&mut self, qpn: u32, min_rnr_timer: Option<u8>, rnr_retry: Option<u8>) {
+        if let Some(queue) = self.inner.get_qp_mut(qpn) {
+            queue.inner.lock().queue.set_rnr(min_rnr_timer, rnr_retry);
+        }
+    }
+
+    fn queue(&self, qpn: u32) -> Result<&SharedRecvWrQueue> {
+        self.inner
+            .get_qp(qpn)
+            .map(AsRef::as_ref)
+            .ok_or(RdmaError::NotFound(format!("QP {qpn} not found")))
     }
 }
 
-pub(crate) struct RecvWorker<Rx = TcpChannelRx> {
-    rx: Rx,
-    wr_queue: SharedRecvWrQueue,
+/// Handle of the worker thread multiplexing the post receive channels of all QPs.
+///
+/// The worker waits on an epoll instance for the channels to become readable, and drains all
+/// records available on a channel at once. New channels are passed to the worker through
+/// `tx`, and `wake_fd` interrupts its wait.
+///
+/// The port of a channel only depends on the index of its QP, so the listener of a destroyed
+/// QP stays bound in `listeners` and is handed to the next QP of the index: connecting a QP
+/// then costs no socket setup, and the new QP does not race the closing of the old listener.
+pub(crate) struct RecvWorker {
+    /// Sends new channels to the worker
+    tx: flume::Sender<WorkerMsg>,
+    /// Event fd the worker waits on together with the channels
+    wake_fd: Arc<OwnedFd>,
+    /// Listener of each QP index, along with the address it is bound to
+    listeners: HashMap<usize, (Ipv4Addr, Arc<TcpListener>)>,
 }
 
-impl<Rx: PostRecvRx + Send + 'static> RecvWorker<Rx> {
-    pub(crate) fn new(rx: Rx, wr_queue: SharedRecvWrQueue) -> Self {
-        Self { rx, wr_queue }
-    }
+/// A change of the channels of the worker
+enum WorkerMsg {
+    Add(RecvChannel),
+    /// Closes the channel of the destroyed QP, its listener is kept
+    Remove(u32),
+}
 
-    // TODO: use tokio
-    pub(crate) fn spawn(self) {
+impl RecvWorker {
+    /// Spawns the worker thread
+    pub(crate) fn spawn() -> io::Result<Self> {
+        let epoll = epoll::Epoll::new()?;
+        let wake_fd = Arc::new(epoll::eventfd()?);
+        epoll.add(wake_fd.as_raw_fd(), WAKE_TOKEN)?;
+        let (tx, rx) = flume::unbounded();
+        let event_loop = RecvEventLoop {
+            epoll,
+            wake_fd: Arc::clone(&wake_fd),
+            rx,
+            channels: HashMap::new(),
+            tokens: HashMap::new(),
+            next_token: 0,
+        };
+        // TODO: use tokio
         let _handle = thread::Builder::new()
             .name("recv-worker".into())
-            .spawn(move || self.run())
-            .unwrap_or_else(|err| unreachable!("Failed to spawn rx thread: {err}"));
+            .spawn(move || event_loop.run())?;
+
+        Ok(Self {
+            tx,
+            wake_fd,
+            listeners: HashMap::new(),
+        })
+    }
+
+    /// Returns the receiving end of the channel of a QP, on the listener left by the previous
+    /// QP of its index if bound to the same address
+    pub(crate) fn listen(&mut self, addr: Ipv4Addr, qpn: u32) -> io::Result<TcpChannelRx> {
+        let index = qpn_to_index(qpn);
+        if let Some((bound, listener)) = self.listeners.get(&index) {
+            if *bound == addr {
+                return Ok(TcpChannelRx::with_listener(Arc::clone(listener)));
+            }
+        }
+        let listener = Arc::new(TcpListener::bind((addr, qpn_to_port(qpn)))?);
+        let _ignore = self.listeners.insert(index, (addr, Arc::clone(&listener)));
+        Ok(TcpChannelRx::with_listener(listener))
+    }
+
+    /// Adds the channel of a QP, receive WRs read from `rx` are pushed through `wr_queue`
+    pub(crate) fn add(
+        &self,
+        rx: TcpChannelRx,
+        wr_queue: RecvWrProducer,
+        qpn: u32,
+        rdma_write_tx: TaskTx<RdmaWriteTask>,
+    ) -> io::Result<()> {
+        rx.inner.set_nonblocking(true)?;
+        let channel = RecvChannel {
+            rx,
+            wr_queue,
+            qpn,
+            rdma_write_tx,
+        };
+        self.send(WorkerMsg::Add(channel))
     }
 
-    #[allow(clippy::needless_pass_by_value)] // consume the flag
+    /// Closes the channel of a destroyed QP
+    pub(crate) fn remove(&self, qpn: u32) -> io::Result<()> {
+        self.send(WorkerMsg::Remove(qpn))
+    }
+
+    fn send(&self, msg: WorkerMsg) -> io::Result<()> {
+        self.tx
+            .send(msg)
+            .map_err(|_err| io::Error::from(io::ErrorKind::BrokenPipe))?;
+        epoll::wake(&self.wake_fd)
+    }
+}
+
+/// Token of the event fd in the epoll instance
+const WAKE_TOKEN: u64 = u64::MAX;
+
+/// Maximum number of readiness events handled per wait
+const MAX_EVENTS: usize = 64;
+
+/// Number of records read from a socket at once
+const READ_BATCH: usize = 64;
+
+/// A post receive channel registered to the worker
+struct RecvChannel {
+    rx: TcpChannelRx,
+    wr_queue: RecvWrProducer,
+    /// Local QP of the channel
+    qpn: u32,
+    /// Submits the sends that were waiting for a receive WR
+    rdma_write_tx: TaskTx<RdmaWriteTask>,
+}
+
+impl RecvChannel {
+    /// Pushes received WRs to the queue, and submits the sends that were waiting for them and
+    /// the reads of the sends the peer asked to pull
+    fn deliver(&mut self, records: Vec<ChannelRecord>) {
+        if records.is_empty() {
+            return;
+        }
+        let mut writes = Vec::new();
+        let mut resolved = Vec::new();
+        for record in records {
+            match record {
+                ChannelRecord::Recv(wr) => resolved.extend(self.wr_queue.push(wr)),
+                ChannelRecord::Pull(pull) => writes.push(pull.read_wr()),
+            }
+        }
+        resolved.extend(self.wr_queue.resolve_pending());
+        for wr in resolved {
+            match wr {
+                Ok(wr) => writes.push(wr),
+                Err(err) => error!("failed to resolve pending send of qp {}: {err}", self.qpn),
+            }
+        }
+        if !writes.is_empty() {
+            self.rdma_write_tx
+                .send(RdmaWriteTask::new_write_batch(self.qpn, writes));
+        }
+    }
+}
+
+/// The loop of the worker thread
+struct RecvEventLoop {
+    epoll: epoll::Epoll,
+    wake_fd: Arc<OwnedFd>,
+    /// Receives the changes of the channels
+    rx: flume::Receiver<WorkerMsg>,
+    /// Registered channels keyed by epoll token
+    channels: HashMap<u64, RecvChannel>,
+    /// Epoll token of the channel of each QP
+    tokens: HashMap<u32, u64>,
+    /// Token of the next registered channel
+    next_token: u64,
+}
+
+impl RecvEventLoop {
     /// Run the handler loop
     fn run(mut self) {
-        while let Ok(wr) = self.rx.recv() {
-            self.wr_queue.lock().push_back(wr);
+        let mut events = [epoll::empty_event(); MAX_EVENTS];
+        loop {
+            let num = match self.epoll.wait(&mut events) {
+                Ok(num) => num,
+                Err(err) => {
+                    error!("recv worker failed to wait for channels: {err}");
+                    return;
+                }
+            };
+            for event in events.iter().take(num) {
+                let token = event.u64;
+                if token == WAKE_TOKEN {
+                    self.register_new();
+                } else {
+                    self.handle(token);
+                }
+            }
+        }
+    }
+
+    /// Applies the changes of the channels sent since the last wake up, in order, so that the
+    /// channel of a destroyed QP is gone before the next QP of its index takes the listener
+    fn register_new(&mut self) {
+        epoll::drain(&self.wake_fd);
+        while let Ok(msg) = self.rx.try_recv() {
+            match msg {
+                WorkerMsg::Add(channel) => self.register(channel),
+                WorkerMsg::Remove(qpn) => self.unregister(qpn),
+            }
+        }
+    }
+
+    fn register(&mut self, channel: RecvChannel) {
+        let token = self.next_token;
+        self.next_token += 1;
+        if let Err(err) = self.epoll.add(channel.rx.as_raw_fd(), token) {
+            error!("failed to register channel of qp {}: {err}", channel.qpn);
+            return;
+        }
+        let _ignore = self.tokens.insert(channel.qpn, token);
+        let _ignore = self.channels.insert(token, channel);
+    }
+
+    /// Drops the channel of a destroyed QP, the connections of its peer not yet accepted are
+    /// refused so that the next QP of the listener does not take them
+    fn unregister(&mut self, qpn: u32) {
+        let Some(channel) = self
+            .tokens
+            .remove(&qpn)
+            .and_then(|token| self.channels.remove(&token))
+        else {
+            return;
+        };
+        let _ignore = self.epoll.delete(channel.rx.as_raw_fd());
+        while channel.rx.inner.accept().is_ok() {}
+    }
+
+    /// Reads all available records of a readable channel
+    fn handle(&mut self, token: u64) {
+        let Some(channel) = self.channels.get_mut(&token) else {
+            return;
+        };
+        let fd = channel.rx.as_raw_fd();
+        let mut records = Vec::new();
+        let open = channel
+            .rx
+            .read_available(&mut records)
+            .unwrap_or_else(|err| {
+                error!("post recv channel of qp {} failed: {err}", channel.qpn);
+                false
+            });
+        channel.deliver(records);
+        let new_fd = channel.rx.as_raw_fd();
+        if !open {
+            debug!("post recv channel of qp {} closed", channel.qpn);
+            let _ignore = self.epoll.delete(fd);
+            if let Some(channel) = self.channels.remove(&token) {
+                let _ignore = self.tokens.remove(&channel.qpn);
+            }
+            return;
+        }
+        // The listener is replaced by the accepted stream
+        if new_fd != fd {
+            let result = self
+                .epoll
+                .delete(fd)
+                .and_then(|()| self.epoll.add(new_fd, token));
+            if let Err(err) = result {
+                error!("failed to register stream of qp {}: {err}", channel.qpn);
+            }
         }
     }
 }
 
+#[allow(unsafe_code)]
+/// Thin wrappers of the epoll and eventfd syscalls
+mod epoll {
+    use std::{
+        io,
+        os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd},
+    };
+
+    pub(super) struct Epoll {
+        fd: OwnedFd,
+    }
+
+    impl Epoll {
+        pub(super) fn new() -> io::Result<Self> {
+            let fd = unsafe { libc::epoll_create1(libc::EPOLL_CLOEXEC) };
+            if fd < 0 {
+                return Err(io::Error::last_os_error());
+            }
+            Ok(Self {
+                fd: unsafe { OwnedFd::from_raw_fd(fd) },
+            })
+        }
+
+        /// Registers `fd` for readability with level triggering
+        pub(super) fn add(&self, fd: RawFd, token: u64) -> io::Result<()> {
+            self.ctl(libc::EPOLL_CTL_ADD, fd, token)
+        }
+
+        pub(super) fn delete(&self, fd: RawFd) -> io::Result<()> {
+            self.ctl(libc::EPOLL_CTL_DEL, fd, 0)
+        }
+
+        /// Waits for readiness events, returns the number of events written to `events`
+        #[allow(clippy::cast_sign_loss)]
+        pub(super) fn wait(&self, events: &mut [libc::epoll_event]) -> io::Result<usize> {
+            let max = i32::try_from(events.len()).unwrap_or(i32::MAX);
+            let num =
+                unsafe { libc::epoll_wait(self.fd.as_raw_fd(), events.as_mut_ptr(), max, -1) };
+            if num >= 0 {
+                return Ok(num as usize);
+            }
+            let err = io::Error::last_os_error();
+            if err.kind() == io::ErrorKind::Interrupted {
+                return Ok(0);
+            }
+            Err(err)
+        }
+
+        fn ctl(&self, op: i32, fd: RawFd, token: u64) -> io::Result<()> {
+            let mut event = libc::epoll_event {
+                events: libc::EPOLLIN as u32,
+                u64: token,
+            };
+            if unsafe { libc::epoll_ctl(self.fd.as_raw_fd(), op, fd, &mut event) } < 0 {
+                return Err(io::Error::last_os_error());
+            }
+            Ok(())
+        }
+    }
+
+    pub(super) fn empty_event() -> libc::epoll_event {
+        libc::epoll_event { events: 0, u64: 0 }
+    }
+
+    /// Creates a non-blocking event fd
+    pub(super) fn eventfd() -> io::Result<OwnedFd> {
+        let fd = unsafe { libc::eventfd(0, libc::EFD_CLOEXEC | libc::EFD_NONBLOCK) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(unsafe { OwnedFd::from_raw_fd(fd) })
+    }
+
+    /// Signals the event fd
+    pub(super) fn wake(fd: &OwnedFd) -> io::Result<()> {
+        let value = 1u64.to_ne_bytes();
+        if unsafe { libc::write(fd.as_raw_fd(), value.as_ptr().cast(), value.len()) } < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(())
+    }
+
+    /// Resets the counter of the event fd
+    pub(super) fn drain(fd: &OwnedFd) {
+        let mut value = [0u8; 8];
+        let _ignore = unsafe { libc::read(fd.as_raw_fd(), value.as_mut_ptr().cast(), value.len()) };
+    }
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
+    use crate::workers::{send::WorkReqOpCode, spawner::task_channel};
     use std::{
         sync::{
             atomic::{AtomicBool, Ordering},
@@ -201,6 +1056,247 @@ mod tests {
         assert_eq!(qpn_to_port(2 << 8), BASE_PORT + 2);
     }
 
+    fn send_wr(wr_id: u64, length: u32) -> SendWrBase {
+        SendWrBase::new(wr_id, 0, 0x1000, length, 0, 0, WorkReqOpCode::Send)
+    }
+
+    fn recv_wr(addr: u64, length: u32) -> RecvWr {
+        RecvWr {
+            wr_id: 0,
+            addr,
+            length,
+            lkey: 1,
+        }
+    }
+
+    #[test]
+    fn test_rnr_budget() {
+        assert_eq!(rnr_budget(0, 0), Some(Duration::from_micros(655_360)));
+        assert_eq!(rnr_budget(1, 2), Some(Duration::from_micros(30)));
+        assert_eq!(rnr_budget(31, 0), Some(Duration::from_micros(491_520)));
+        assert_eq!(rnr_budget(1, RNR_RETRY_INFINITE), None);
+    }
+
+    #[test]
+    fn test_pending_sends_consume_recv_wrs_in_order() {
+        let mut queue = RecvWrQueue::default();
+        queue.set_rnr(None, Some(RNR_RETRY_INFINITE));
+        assert!(queue.resolve(send_wr(1, 8)).unwrap().is_none());
+        assert!(queue.resolve(send_wr(2, 8)).unwrap().is_none());
+        // a receive WR arriving later goes to the oldest pending send
+        assert!(queue.try_resolve(send_wr(3, 8)).unwrap().is_none());
+        let wr = queue.push(recv_wr(0x2000, 8)).pop().unwrap().unwrap();
+        assert_eq!((wr.base.wr_id, wr.raddr), (1, 0x2000));
+        let wr = queue.push(recv_wr(0x3000, 8)).pop().unwrap().unwrap();
+        assert_eq!((wr.base.wr_id, wr.raddr), (2, 0x3000));
+        assert!(queue.push(recv_wr(0x4000, 8)).is_empty());
+        let wr = queue.resolve(send_wr(3, 8)).unwrap().unwrap();
+        assert_eq!(wr.raddr, 0x4000);
+        assert!(queue.resolve(send_wr(4, 8)).unwrap().is_none());
+        assert!(queue.push(recv_wr(0x5000, 4)).pop().unwrap().is_err());
+    }
+
+    #[test]
+    fn test_sends_fit_larger_recv_wrs() {
+        let mut queue = RecvWrQueue::default();
+        assert!(queue.push(recv_wr(0x2000, 4096)).is_empty());
+        let wr = queue.resolve(send_wr(1, 100)).unwrap().unwrap();
+        assert_eq!((wr.raddr, wr.length()), (0x2000, 100));
+        assert!(queue.push(recv_wr(0x3000, 64)).is_empty());
+        assert!(queue.resolve(send_wr(2, 100)).is_err());
+    }
+
+    #[test]
+    fn test_sends_fill_successive_strides() {
+        let mut queue = RecvWrQueue::with_stride(64);
+        queue.set_rnr(None, Some(RNR_RETRY_INFINITE));
+        assert!(queue.push(recv_wr(0x1000, 256)).is_empty());
+        let raddr = |x: Result<Option<SendWrRdma>>| x.unwrap().unwrap().raddr;
+        assert_eq!(raddr(queue.resolve(send_wr(1, 10))), 0x1000);
+        assert_eq!(raddr(queue.resolve(send_wr(2, 100))), 0x1040);
+        // the last stride is too short, the send waits for the next receive WR
+        assert!(queue.resolve(send_wr(3, 100)).unwrap().is_none());
+        assert!(queue.resolve(send_wr(4, 0)).unwrap().is_none());
+        // a receive WR resolves all the waiting sends it fits
+        let raddrs: Vec<_> = queue
+            .push(recv_wr(0x2000, 192))
+            .into_iter()
+            .map(|x| x.unwrap().raddr)
+            .collect();
+        assert_eq!(raddrs, [0x2000, 0x2080]);
+        assert!(queue.resolve(send_wr(5, 8)).unwrap().is_none());
+        assert_eq!(stride_span(64, 0), 64);
+        assert_eq!(stride_span(64, 65), 128);
+    }
+
+    #[test]
+    fn test_exhausted_rnr_retries_fail_posts() {
+        let mut queue = RecvWrQueue::default();
+        queue.set_rnr(Some(1), Some(0));
+        assert!(queue.resolve(send_wr(1, 8)).unwrap().is_none());
+        thread::sleep(Duration::from_millis(1));
+        assert!(matches!(
+            queue.resolve(send_wr(2, 8)),
+            Err(RdmaError::Timeout(_))
+        ));
+    }
+
+    #[test]
+    fn test_producer_resolves_waiting_sends() {
+        let mut table = RecvWrQueueTable::new(0);
+        let qpn = 3 << 8;
+        table.set_rnr(qpn, None, Some(RNR_RETRY_INFINITE));
+        let mut producer = table.new_producer(qpn).unwrap();
+        // the WRs pushed through the ring are taken by the posting thread
+        assert!(producer.push(recv_wr(0x1000, 8)).is_empty());
+        assert!(producer.resolve_pending().is_empty());
+        let wr = table.resolve(qpn, send_wr(1, 8)).unwrap().unwrap();
+        assert_eq!(wr.raddr, 0x1000);
+
+        // a send waiting for a WR is resolved by the producer
+        assert!(table.resolve(qpn, send_wr(2, 8)).unwrap().is_none());
+        assert!(table.has_pending(qpn));
+        assert!(producer.push(recv_wr(0x2000, 8)).is_empty());
+        let wr = producer.resolve_pending().pop().unwrap().unwrap();
+        assert_eq!((wr.base.wr_id, wr.raddr), (2, 0x2000));
+        assert!(!table.has_pending(qpn));
+
+        // past the capacity of the ring, the WRs are handed over in order under the lock
+        for i in 0..=RECV_WR_RING_LEN as u64 {
+            assert!(producer.push(recv_wr(0x1000 * i, 8)).is_empty());
+        }
+        for i in 0..=RECV_WR_RING_LEN as u64 {
+            let wr = table.try_resolve(qpn, send_wr(3, 8)).unwrap().unwrap();
+            assert_eq!(wr.raddr, 0x1000 * i);
+        }
+        assert!(table.try_resolve(qpn, send_wr(3, 8)).unwrap().is_none());
+        // the queue of another QP is its own
+        assert!(table.try_resolve(4 << 8, send_wr(4, 8)).unwrap().is_none());
+    }
+
+    #[test]
+    fn test_recv_worker_multiplexes_channels() {
+        let worker = RecvWorker::spawn().unwrap();
+        let (rdma_write_tx, _rdma_write_rx) = task_channel();
+        let mut table = RecvWrQueueTable::new(0);
+        let qpns = [5 << 8, 6 << 8];
+        let mut txs = Vec::new();
+        // each channel is connected to itself
+        for qpn in qpns {
+            let (tx, rx) =
+                post_recv_channel::<TcpChannel>(Ipv4Addr::LOCALHOST, Ipv4Addr::LOCALHOST, qpn, qpn)
+                    .unwrap();
+            let producer = table.new_producer(qpn).unwrap();
+            worker
+                .add(rx, producer, qpn, rdma_write_tx.clone())
+                .unwrap();
+            txs.push(tx);
+        }
+        for (i, tx) in txs.iter_mut().enumerate() {
+            for wr_id in 0..=i as u64 {
+                tx.send(recv_wr(0x1000 * (wr_id + 1), 8)).unwrap();
+            }
+        }
+        for (i, qpn) in qpns.into_iter().enumerate() {
+            let mut received = 0;
+            for _ in 0..100 {
+                while received <= i && table.try_resolve(qpn, send_wr(1, 8)).unwrap().is_some() {
+                    received += 1;
+                }
+                if received == i + 1 {
+                    break;
+                }
+                thread::sleep(Duration::from_millis(10));
+            }
+            assert_eq!(received, i + 1);
+            assert!(table.try_resolve(qpn, send_wr(1, 8)).unwrap().is_none());
+        }
+    }
+
+    #[test]
+    fn test_channel_records_round_trip() {
+        let records = [
+            ChannelRecord::Recv(recv_wr(0x1000, 8)),
+            ChannelRecord::Pull(PullRequest {
+                addr: 0x2000,
+                lkey: 1,
+                raddr: 0x3000,
+                rkey: 2,
+                length: 1 << 20,
+            }),
+        ];
+        for record in records {
+            assert_eq!(ChannelRecord::from_bytes(&record.to_bytes()), Some(record));
+        }
+        assert!(ChannelRecord::from_bytes(&[0xff; RECORD_LEN]).is_none());
+    }
+
+    /// Polls the queue of the QP until a send is resolved against a receive WR
+    fn wait_resolve(table: &RecvWrQueueTable, qpn: u32) -> SendWrRdma {
+        for _ in 0..100 {
+            if let Some(wr) = table.try_resolve(qpn, send_wr(1, 8)).unwrap() {
+                return wr;
+            }
+            thread::sleep(Duration::from_millis(10));
+        }
+        panic!("no receive WR of qp {qpn}");
+    }
+
+    #[test]
+    fn test_recv_worker_reuses_the_listener_of_destroyed_qps() {
+        let mut worker = RecvWorker::spawn().unwrap();
+        let (rdma_write_tx, _rdma_write_rx) = task_channel();
+        let mut table = RecvWrQueueTable::new(0);
+        // two QPs of the same index, the second created once the first is destroyed
+        let (old, new) = ((9 << 8) | 1, (9 << 8) | 2);
+        let rx = worker.listen(Ipv4Addr::LOCALHOST, old).unwrap();
+        let mut tx = TcpChannelTx::connect(Ipv4Addr::LOCALHOST, old).unwrap();
+        let producer = table.new_producer(old).unwrap();
+        worker
+            .add(rx, producer, old, rdma_write_tx.clone())
+            .unwrap();
+        tx.send(recv_wr(0x1000, 8)).unwrap();
+        assert_eq!(wait_resolve(&table, old).raddr, 0x1000);
+        assert!(table.push(old, recv_wr(0x1500, 8)).is_empty());
+
+        worker.remove(old).unwrap();
+        table.reset(old);
+        drop(tx);
+        let rx = worker.listen(Ipv4Addr::LOCALHOST, new).unwrap();
+        assert!(Arc::ptr_eq(&rx.inner, &worker.listeners[&9].1));
+        let mut tx = TcpChannelTx::connect(Ipv4Addr::LOCALHOST, new).unwrap();
+        let producer = table.new_producer(new).unwrap();
+        worker.add(rx, producer, new, rdma_write_tx).unwrap();
+        // the WR left by the destroyed QP is gone
+        tx.send(recv_wr(0x2000, 8)).unwrap();
+        assert_eq!(wait_resolve(&table, new).raddr, 0x2000);
+        assert!(table.try_resolve(new, send_wr(1, 8)).unwrap().is_none());
+    }
+
+    #[test]
+    fn test_recv_worker_submits_pull_reads() {
+        let worker = RecvWorker::spawn().unwrap();
+        let (rdma_write_tx, rdma_write_rx) = task_channel();
+        let qpn = 7 << 8;
+        let (mut tx, rx) =
+            post_recv_channel::<TcpChannel>(Ipv4Addr::LOCALHOST, Ipv4Addr::LOCALHOST, qpn, qpn)
+                .unwrap();
+        let producer = RecvWrQueueTable::new(0).new_producer(qpn).unwrap();
+        worker.add(rx, producer, qpn, rdma_write_tx).unwrap();
+        let pull = PullRequest {
+            addr: 0x2000,
+            lkey: 1,
+            raddr: 0x3000,
+            rkey: 2,
+            length: 1 << 20,
+        };
+        tx.send_pull(pull).unwrap();
+        assert_eq!(
+            rdma_write_rx.recv(),
+            Some(RdmaWriteTask::new_write_batch(qpn, vec![pull.read_wr()]))
+        );
+    }
+
     #[test]
     fn test_tcp_channel_basic() {
         let local_addr = Ipv4Addr::LOCALHOST;
@@ -283,8 +1379,9 @@ mod tests {
 
         for test_wr in test_wrs.clone() {
             tx0.send(test_wr).unwrap();
-            tx1.send(test_wr).unwrap();
         }
+        // the records of a chain are written at once
+        tx1.send_batch(&test_wrs).unwrap();
 
         let rx0_received = rx0_handle.join().unwrap();
         let rx1_received = rx1_handle.join().unwrap();
@@ -0,0 +1,346 @@
+use std::collections::{BTreeSet, VecDeque};
+
+use crate::{
+    constants::{RECV_RING_DEPTH, RECV_RING_IOVA, RECV_RING_MR_KEY},
+    mem::DmaBuf,
+    rdma_utils::{
+        qp::{qpn_to_index, QpTable},
+        types::{RecvWr, SendWrBase, SendWrRdma},
+    },
+    workers::send::WorkReqOpCode,
+};
+
+/// Offset of the credit word written by the peer
+const CREDIT_IN: usize = 0;
+/// Offset of the credit word staged for the write to the peer
+const CREDIT_OUT: usize = 4;
+/// Size of the header of a region
+const HEADER_SIZE: usize = 64;
+/// Size of an advertisement slot, a `RecvWr` followed by its sequence number
+const SLOT_SIZE: usize = 32;
+/// Offset of the sequence number in a slot
+const SEQ_OFFSET: usize = size_of::<RecvWr>();
+/// Offset of the slots written by the peer
+const INCOMING: usize = HEADER_SIZE;
+/// Offset of the slots staged for the writes to the peer
+const OUTGOING: usize = INCOMING + RECV_RING_DEPTH * SLOT_SIZE;
+/// Size of the region of a QP
+const REGION_SIZE: usize = OUTGOING + RECV_RING_DEPTH * SLOT_SIZE;
+/// Number of consumed advertisements after which the credits are returned to the peer
+const CREDIT_BATCH: u32 = (RECV_RING_DEPTH / 2) as u32;
+
+/// Returns the size of the memory region holding the rings of `num_qp` QPs
+pub(crate) const fn recv_rings_size(num_qp: usize) -> usize {
+    num_qp * REGION_SIZE
+}
+
+/// Advertisement channel of a QP
+#[derive(Default)]
+struct RingState {
+    /// Peer QP, `None` until the QP is connected
+    dqpn: Option<u32>,
+    /// Number of advertisements read from the incoming ring
+    consumed: u32,
+    /// Value of `consumed` last written to the peer
+    credited: u32,
+    /// Number of advertisements written to the ring of the peer
+    produced: u32,
+    /// Receive WRs not yet advertised, waiting for the QP to connect or for credits
+    backlog: VecDeque<RecvWr>,
+}
+
+/// Rings carrying receive WRs from the responder to the requester in-band.
+///
+/// Each QP owns a region of a memory region registered with the reserved key
+/// `RECV_RING_MR_KEY` at `RECV_RING_IOVA`, so that the peer addresses the region of a QP
+/// from its QPN alone. A region consists of:
+/// - a header, holding the number of our advertisements consumed by the peer
+/// - the incoming ring, written by the peer with the receive WRs it posted
+/// - the outgoing slots, the source of the RDMA writes of our advertisements
+///
+/// Slots carry a sequence number and are reused only after the peer returned credits for
+/// them, so that the ring never overruns and no extra thread or socket is needed.
+pub(crate) struct RecvRings {
+    /// Registered memory of all regions
+    buf: DmaBuf,
+    /// Offset of the first region in `buf`, pages of the memory region start here
+    base: usize,
+    /// Advertisement channel of each QP
+    states: QpTable<RingState>,
+    /// QPs with unadvertised receive WRs or sends waiting for a receive WR
+    active: BTreeSet<u32>,
+}
+
+impl RecvRings {
+    /// Creates the rings in `buf`, the regions start at offset `base`
+    pub(crate) fn new(mut buf: DmaBuf, base: usize) -> Self {
+        let len = buf.buf.len().saturating_sub(base);
+        buf.buf.copy_from(base, &vec![0; len]);
+        Self {
+            buf,
+            base,
+            states: QpTable::new(),
+            active: BTreeSet::new(),
+        }
+    }
+
+    /// Connects the channel of a QP to the peer QP
+    pub(crate) fn connect(&mut self, qpn: u32, dqpn: u32) {
+        if let Some(state) = self.states.get_qp_mut(qpn) {
+            state.dqpn = Some(dqpn);
+        }
+    }
+
+    /// Clears the channel of a destroyed QP
+    pub(crate) fn reset(&mut self, qpn: u32) {
+        let _ignore = self.states.replace(qpn, RingState::default());
+        let _removed = self.active.remove(&qpn);
+        let offset = self.base + qpn_to_index(qpn) * REGION_SIZE;
+        self.buf.buf.copy_from(offset, &[0; REGION_SIZE]);
+    }
+
+    /// Queues a receive WR to be advertised to the peer
+    pub(crate) fn advertise(&mut self, qpn: u32, wr: RecvWr) {
+        if let Some(state) = self.states.get_qp_mut(qpn) {
+            state.backlog.push_back(wr);
+        }
+    }
+
+    /// Marks whether the QP has to make progress without being posted to
+    pub(crate) fn set_active(&mut self, qpn: u32, active: bool) {
+        if active {
+            let _new = self.active.insert(qpn);
+        } else {
+            let _removed = self.active.remove(&qpn);
+        }
+    }
+
+    /// Returns the QPs that have to make progress
+    pub(crate) fn active(&self) -> Vec<u32> {
+        self.active.iter().copied().collect()
+    }
+
+    /// Returns `true` if receive WRs of the QP are waiting to be advertised
+    pub(crate) fn has_backlog(&self, qpn: u32) -> bool {
+        self.states
+            .get_qp(qpn)
+            .is_some_and(|x| !x.backlog.is_empty())
+    }
+
+    /// Stages the queued receive WRs the peer has credits for
+    ///
+    /// # Returns
+    ///
+    /// The RDMA writes to the ring of the peer, one per contiguous run of slots
+    pub(crate) fn flush(&mut self, qpn: u32) -> Vec<SendWrRdma> {
+        let region = self.region(qpn);
+        let credit = self.read_u32(region + CREDIT_IN);
+        let Some(state) = self.states.get_qp_mut(qpn) else {
+            return Vec::new();
+        };
+        let Some(dqpn) = state.dqpn else {
+            return Vec::new();
+        };
+        let mut writes = Vec::new();
+        let mut run: Option<(usize, usize)> = None;
+        while state.produced.wrapping_sub(credit) < RECV_RING_DEPTH as u32 {
+            let Some(wr) = state.backlog.pop_front() else {
+                break;
+            };
+            let slot = state.produced as usize % RECV_RING_DEPTH;
+            state.produced = state.produced.wrapping_add(1);
+            let offset = region + OUTGOING + slot * SLOT_SIZE;
+            self.buf.buf.copy_from(offset, &wr.to_bytes());
+            self.buf
+                .buf
+                .copy_from(offset + SEQ_OFFSET, &state.produced.to_le_bytes());
+            // a run ends at the end of the ring
+            run = match run {
+                Some((first, num)) if first + num == slot => Some((first, num + 1)),
+                Some((first, num)) => {
+                    writes.push(Self::slot_write(qpn, dqpn, first, num));
+                    Some((slot, 1))
+                }
+                None => Some((slot, 1)),
+            };
+        }
+        if let Some((first, num)) = run {
+            writes.push(Self::slot_write(qpn, dqpn, first, num));
+        }
+        writes
+    }
+
+    /// Reads the receive WRs advertised by the peer
+    ///
+    /// # Returns
+    ///
+    /// The new receive WRs in posting order, and the write returning the credits of the
+    /// consumed slots to the peer if due
+    pub(crate) fn poll(&mut self, qpn: u32) -> (Vec<RecvWr>, Option<SendWrRdma>) {
+        let region = self.region(qpn);
+        let Some(state) = self.states.get_qp_mut(qpn) else {
+            return (Vec::new(), None);
+        };
+        let Some(dqpn) = state.dqpn else {
+            return (Vec::new(), None);
+        };
+        let mut wrs = Vec::new();
+        loop {
+            let slot = state.consumed as usize % RECV_RING_DEPTH;
+            let offset = region + INCOMING + slot * SLOT_SIZE;
+            let seq = self.buf.buf.get(offset + SEQ_OFFSET, 4);
+            let expected = state.consumed.wrapping_add(1);
+            if seq != expected.to_le_bytes() {
+                break;
+            }
+            let bytes = self.buf.buf.get(offset, size_of::<RecvWr>());
+            let Ok(bytes) = bytes.as_slice().try_into() else {
+                break;
+            };
+            wrs.push(RecvWr::from_bytes(bytes));
+            state.consumed = expected;
+        }
+        if state.consumed.wrapping_sub(state.credited) < CREDIT_BATCH {
+            return (wrs, None);
+        }
+        state.credited = state.consumed;
+        self.buf
+            .buf
+            .copy_from(region + CREDIT_OUT, &state.consumed.to_le_bytes());
+        let write = Self::rdma_write(
+            qpn,
+            region_iova(qpn) + CREDIT_OUT as u64,
+            region_iova(dqpn) + CREDIT_IN as u64,
+            size_of::<u32>() as u32,
+        );
+
+        (wrs, Some(write))
+    }
+
+    /// Returns the offset of the region of a QP in `buf`
+    fn region(&self, qpn: u32) -> usize {
+        self.base + qpn_to_index(qpn) * REGION_SIZE
+    }
+
+    fn read_u32(&self, offset: usize) -> u32 {
+        let mut bytes = [0; 4];
+        bytes.copy_from_slice(&self.buf.buf.get(offset, 4));
+        u32::from_le_bytes(bytes)
+    }
+
+    /// Builds the write of `num` staged slots starting at `first` to the ring of the peer
+    fn slot_write(qpn: u32, dqpn: u32, first: usize, num: usize) -> SendWrRdma {
+        let offset = (first * SLOT_SIZE) as u64;
+        Self::rdma_write(
+            qpn,
+            region_iova(qpn) + OUTGOING as u64 + offset,
+            region_iova(dqpn) + INCOMING as u64 + offset,
+            (num * SLOT_SIZE) as u32,
+        )
+    }
+
+    /// Builds an unsignaled RDMA write between the rings
+    fn rdma_write(qpn: u32, laddr: u64, raddr: u64, length: u32) -> SendWrRdma {
+        let base = SendWrBase::new(
+            0,
+            0,
+            laddr,
+            length,
+            RECV_RING_MR_KEY,
+            0,
+            WorkReqOpCode::RdmaWrite,
+        );
+        SendWrRdma::new_from_base(base, raddr, RECV_RING_MR_KEY)
+    }
+}
+
+/// Returns the device address of the region of a QP
+fn region_iova(qpn: u32) -> u64 {
+    RECV_RING_IOVA + (qpn_to_index(qpn) * REGION_SIZE) as u64
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::mem::page::MmapMut;
+
+    #[allow(unsafe_code)]
+    fn rings(num_qp: usize) -> RecvRings {
+        let len = recv_rings_size(num_qp);
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED | libc::MAP_ANON,
+                -1,
+                0,
+            )
+        };
+        RecvRings::new(DmaBuf::new(MmapMut::new(ptr, len), 0), 0)
+    }
+
+    fn recv_wr(wr_id: u64) -> RecvWr {
+        RecvWr {
+            wr_id,
+            addr: 0x1000 * wr_id,
+            length: 64,
+            lkey: 1,
+        }
+    }
+
+    /// Emulates the device executing the writes between the regions of the QPs
+    fn deliver(rings: &mut RecvRings, writes: &[SendWrRdma]) {
+        for wr in writes {
+            let src = (wr.laddr() - RECV_RING_IOVA) as usize;
+            let dst = (wr.raddr() - RECV_RING_IOVA) as usize;
+            let bytes = rings.buf.buf.get(src, wr.length() as usize);
+            rings.buf.buf.copy_from(dst, &bytes);
+        }
+    }
+
+    #[test]
+    fn advertisements_are_delivered_in_order() {
+        let mut rings = rings(2);
+        let (qp0, qp1) = (0, 1 << 8);
+        rings.advertise(qp0, recv_wr(1));
+        // not connected yet
+        assert!(rings.flush(qp0).is_empty());
+        rings.connect(qp0, qp1);
+        rings.connect(qp1, qp0);
+        rings.advertise(qp0, recv_wr(2));
+        let writes = rings.flush(qp0);
+        assert_eq!(writes.len(), 1);
+        assert_eq!(writes[0].length() as usize, 2 * SLOT_SIZE);
+        assert!(rings.poll(qp1).0.is_empty());
+        deliver(&mut rings, &writes);
+        let (wrs, credit) = rings.poll(qp1);
+        assert_eq!(wrs, [recv_wr(1), recv_wr(2)]);
+        assert!(credit.is_none());
+    }
+
+    #[test]
+    fn advertisements_wait_for_credits() {
+        let mut rings = rings(2);
+        let (qp0, qp1) = (0, 1 << 8);
+        rings.connect(qp0, qp1);
+        rings.connect(qp1, qp0);
+        let total = RECV_RING_DEPTH as u64 + 4;
+        for wr_id in 0..total {
+            rings.advertise(qp0, recv_wr(wr_id));
+        }
+        let writes = rings.flush(qp0);
+        assert!(rings.has_backlog(qp0));
+        deliver(&mut rings, &writes);
+        let (wrs, credit) = rings.poll(qp1);
+        assert_eq!(wrs.len(), RECV_RING_DEPTH);
+        deliver(&mut rings, &[credit.unwrap()]);
+        // the remaining WRs reuse the credited slots
+        let writes = rings.flush(qp0);
+        assert!(!rings.has_backlog(qp0));
+        deliver(&mut rings, &writes);
+        let (wrs, _credit) = rings.poll(qp1);
+        let ids: Vec<_> = wrs.iter().map(|x| x.wr_id).collect();
+        assert_eq!(ids, (RECV_RING_DEPTH as u64..total).collect::<Vec<_>>());
+    }
+}
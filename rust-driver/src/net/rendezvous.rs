@@ -0,0 +1,169 @@
+use std::{
+    collections::{HashMap, VecDeque},
+    sync::Arc,
+};
+
+use parking_lot::Mutex;
+
+use crate::{
+    rdma_utils::types::{SendWrBase, SendWrRdma},
+    workers::send::WorkReqOpCode,
+};
+
+/// Driver private send flag of the RDMA reads pulling a send of the peer into a receive WR,
+/// above the flags of `ibv_send_flags`
+pub(crate) const SEND_FLAG_PULL: u32 = 1 << 31;
+
+/// Length of an encoded `PullRequest`
+pub(crate) const PULL_REQUEST_LEN: usize = 28;
+
+/// A send resolved against a receive WR of the peer, for the peer to read
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct PullRequest {
+    /// Address of the receive WR at the receiver
+    pub(crate) addr: u64,
+    /// Key of the receive WR at the receiver
+    pub(crate) lkey: u32,
+    /// Address of the send buffer at the sender
+    pub(crate) raddr: u64,
+    /// Key of the send buffer at the sender
+    pub(crate) rkey: u32,
+    /// Length of the message in bytes
+    pub(crate) length: u32,
+}
+
+impl PullRequest {
+    /// Creates the request of a send resolved into a write to the receive WR
+    pub(crate) fn new(wr: &SendWrRdma) -> Self {
+        Self {
+            addr: wr.raddr(),
+            lkey: wr.rkey(),
+            raddr: wr.laddr(),
+            rkey: wr.lkey(),
+            length: wr.length(),
+        }
+    }
+
+    /// Returns the RDMA read of the receiver pulling the message into the receive WR
+    pub(crate) fn read_wr(self) -> SendWrRdma {
+        let flags = ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0 | SEND_FLAG_PULL;
+        let base = SendWrBase::new(
+            0,
+            flags,
+            self.addr,
+            self.length,
+            self.lkey,
+            0,
+            WorkReqOpCode::RdmaRead,
+        );
+        SendWrRdma::new_from_base(base, self.raddr, self.rkey)
+    }
+
+    pub(crate) fn to_bytes(self) -> [u8; PULL_REQUEST_LEN] {
+        let mut bytes = [0u8; PULL_REQUEST_LEN];
+        bytes[0..8].copy_from_slice(&self.addr.to_be_bytes());
+        bytes[8..12].copy_from_slice(&self.lkey.to_be_bytes());
+        bytes[12..20].copy_from_slice(&self.raddr.to_be_bytes());
+        bytes[20..24].copy_from_slice(&self.rkey.to_be_bytes());
+        bytes[24..28].copy_from_slice(&self.length.to_be_bytes());
+        bytes
+    }
+
+    #[allow(clippy::unwrap_used)]
+    pub(crate) fn from_bytes(bytes: &[u8; PULL_REQUEST_LEN]) -> Self {
+        Self {
+            addr: u64::from_be_bytes(bytes[0..8].try_into().unwrap()),
+            lkey: u32::from_be_bytes(bytes[8..12].try_into().unwrap()),
+            raddr: u64::from_be_bytes(bytes[12..20].try_into().unwrap()),
+            rkey: u32::from_be_bytes(bytes[20..24].try_into().unwrap()),
+            length: u32::from_be_bytes(bytes[24..28].try_into().unwrap()),
+        }
+    }
+}
+
+/// A send waiting for the peer to read it
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct PendingPull {
+    /// Address of the send buffer
+    pub(crate) addr: u64,
+    pub(crate) length: u32,
+    pub(crate) wr_id: u64,
+    pub(crate) send_flags: u32,
+}
+
+impl PendingPull {
+    pub(crate) fn new(wr: &SendWrRdma) -> Self {
+        Self {
+            addr: wr.laddr(),
+            length: wr.length(),
+            wr_id: wr.wr_id(),
+            send_flags: wr.send_flags(),
+        }
+    }
+}
+
+/// Sends handed to the peers as pull requests, shared by the device context posting them and
+/// the meta handlers answering the reads of the peers
+#[derive(Debug, Clone, Default)]
+pub(crate) struct PendingPulls {
+    inner: Arc<Mutex<HashMap<u32, VecDeque<PendingPull>>>>,
+}
+
+impl PendingPulls {
+    pub(crate) fn insert(&self, qpn: u32, pull: PendingPull) {
+        self.inner.lock().entry(qpn).or_default().push_back(pull);
+    }
+
+    /// Takes the oldest send of the QP the read of `length` bytes at `addr` pulls
+    pub(crate) fn take(&self, qpn: u32, addr: u64, length: u32) -> Option<PendingPull> {
+        let mut inner = self.inner.lock();
+        let pulls = inner.get_mut(&qpn)?;
+        let pos = pulls
+            .iter()
+            .position(|x| x.addr == addr && x.length == length)?;
+        let pull = pulls.remove(pos);
+        if pulls.is_empty() {
+            let _ignore = inner.remove(&qpn);
+        }
+        pull
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn pull_request_round_trip() {
+        let base = SendWrBase::new(7, 0, 0x1000, 4096, 0x11, 0, WorkReqOpCode::Send);
+        let wr = SendWrRdma::new_from_base(base, 0x8000, 0x22);
+        let request = PullRequest::new(&wr);
+        assert_eq!(PullRequest::from_bytes(&request.to_bytes()), request);
+        let read = request.read_wr();
+        assert_eq!(read.opcode(), WorkReqOpCode::RdmaRead);
+        assert_eq!((read.laddr(), read.lkey()), (0x8000, 0x22));
+        assert_eq!((read.raddr(), read.rkey()), (0x1000, 0x11));
+        assert_eq!(read.length(), 4096);
+        assert_ne!(read.send_flags() & SEND_FLAG_PULL, 0);
+    }
+
+    #[test]
+    fn pending_pulls_are_taken_by_their_reads() {
+        let pulls = PendingPulls::default();
+        let pull = |wr_id, addr| PendingPull {
+            addr,
+            length: 4096,
+            wr_id,
+            send_flags: 0,
+        };
+        pulls.insert(1, pull(1, 0x1000));
+        pulls.insert(1, pull(2, 0x2000));
+        pulls.insert(1, pull(3, 0x1000));
+        assert!(pulls.take(2, 0x1000, 4096).is_none());
+        assert!(pulls.take(1, 0x1000, 8).is_none());
+        assert_eq!(pulls.take(1, 0x1000, 4096).map(|x| x.wr_id), Some(1));
+        assert_eq!(pulls.take(1, 0x1000, 4096).map(|x| x.wr_id), Some(3));
+        assert_eq!(pulls.take(1, 0x2000, 4096).map(|x| x.wr_id), Some(2));
+        assert!(pulls.inner.lock().is_empty());
+    }
+}
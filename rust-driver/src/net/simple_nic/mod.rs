@@ -4,22 +4,33 @@ mod route;
 /// worker handling NIC frames
 mod worker;
 
+/// Checksum and segmentation offload of the tap device
+mod offload;
+
+/// Priority of the control frames over the tap frames
+mod priority;
+
 mod types;
 
 #[cfg(test)]
 mod tests;
 
-pub(crate) use worker::SimpleNicController;
+pub(crate) use priority::{split, BulkFrameTx};
+pub(crate) use worker::{FrameRxQueue, FrameTxQueue, SimpleNicController};
 
 use std::{
     io::{self},
+    ops::Deref,
+    os::fd::AsRawFd,
     sync::{atomic::AtomicBool, Arc},
 };
 
 use ipnetwork::IpNetwork;
 use worker::SimpleNicWorker;
 
-use crate::net::tap::TapDevice;
+use crate::{
+    config::SimpleNicConfig, constants::BLUE_RDMA_NETDEV_INTERFACE_PREFIX, net::tap::TapDevice,
+};
 
 #[allow(clippy::module_name_repetitions)]
 /// Configuration for the simple NIC device
@@ -27,14 +38,16 @@ use crate::net::tap::TapDevice;
 pub(crate) struct SimpleNicDeviceConfig {
     /// IP network assigned to the NIC
     network: IpNetwork,
+    /// Frame slots of the buffers of the NIC, which set its MTU and offload
+    slots: SimpleNicConfig,
 }
 
 impl SimpleNicDeviceConfig {
     /// Creates a new `SimpleNicDeviceConfig`
     #[inline]
     #[must_use]
-    pub(crate) fn new(network: IpNetwork) -> Self {
-        Self { network }
+    pub(crate) fn new(network: IpNetwork, slots: SimpleNicConfig) -> Self {
+        Self { network, slots }
     }
 }
 
@@ -49,38 +62,122 @@ struct SimpleNicDevice {
 impl SimpleNicDevice {
     /// Creates a new `SimpleNicDevice`
     fn new(config: SimpleNicDeviceConfig) -> io::Result<Self> {
-        let tun_dev = Arc::new(Self::create_tun(config.network)?);
+        let tun_dev = Arc::new(Self::create_tun(config.network, config.slots)?);
         Ok(Self { tun_dev, config })
     }
 
-    /// Creates a TUN device that operates at L2
+    /// Creates a TUN device that operates at L2, with the MTU of the frames fitting a slot
     #[allow(unused_results)] // ignore the config construction result
-    fn create_tun(network: IpNetwork) -> io::Result<tun::Device> {
+    fn create_tun(network: IpNetwork, slots: SimpleNicConfig) -> io::Result<tun::Device> {
         let mut config = tun::Configuration::default();
         config
             .layer(tun::Layer::L2)
             .address(network.ip())
             .netmask(network.mask())
+            .mtu(u16::try_from(slots.mtu()).unwrap_or(u16::MAX))
             .up();
 
         #[cfg(target_os = "linux")]
         config.platform_config(|platform| {
             // requiring root privilege to acquire complete functions
             platform.ensure_root_privileges(true);
+            platform.vnet_hdr(slots.offload);
         });
 
-        tun::create(&config).map_err(Into::into)
+        let dev = tun::create(&config)?;
+        if slots.offload {
+            offload::enable(dev.as_raw_fd())?;
+        }
+        Ok(dev)
+    }
+}
+
+/// Sets the MTU of the netdev of card `index` to the MTU of the simple NIC, so that the
+/// kernel doesn't hand it frames larger than a slot
+///
+/// # Errors
+///
+/// Returns an error if the netdev is not present or the caller lacks `CAP_NET_ADMIN`
+#[allow(unsafe_code, clippy::as_conversions, clippy::cast_possible_wrap)] // interface name to c_char
+pub(crate) fn set_netdev_mtu(index: usize, mtu: usize) -> io::Result<()> {
+    let name = format!("{BLUE_RDMA_NETDEV_INTERFACE_PREFIX}{index}");
+    let mut ifr_name = [0; libc::IFNAMSIZ];
+    if name.len() >= libc::IFNAMSIZ {
+        return Err(io::ErrorKind::InvalidInput.into());
+    }
+    ifr_name
+        .iter_mut()
+        .zip(name.bytes())
+        .for_each(|(d, s)| *d = s as libc::c_char);
+    let mut ifreq = libc::ifreq {
+        ifr_name,
+        ifr_ifru: libc::__c_anonymous_ifr_ifru {
+            ifru_mtu: libc::c_int::try_from(mtu).map_err(|_| io::ErrorKind::InvalidInput)?,
+        },
+    };
+    // SAFETY: FFI call, the socket is only used for the ioctl and closed below
+    let fd = unsafe { libc::socket(libc::AF_INET, libc::SOCK_DGRAM, 0) };
+    if fd < 0 {
+        return Err(io::Error::last_os_error());
     }
+    // SAFETY: `ifreq` is a valid `ifreq` for the duration of the call
+    let ret = unsafe { libc::ioctl(fd, libc::SIOCSIFMTU, &mut ifreq) };
+    let result = if ret == -1 {
+        Err(io::Error::last_os_error())
+    } else {
+        Ok(())
+    };
+    // SAFETY: `fd` was opened above
+    let _ignore = unsafe { libc::close(fd) };
+    result
 }
 
 /// Trait for transmitting frames
 pub(crate) trait FrameTx {
     /// Send a buffer of bytes as a frame
     fn send(&mut self, buf: &[u8]) -> io::Result<()>;
+
+    /// Send each buffer as a frame, in order
+    fn send_batch(&mut self, frames: &[&[u8]]) -> io::Result<()> {
+        for frame in frames {
+            self.send(frame)?;
+        }
+        Ok(())
+    }
+
+    /// Send the leading buffers as frames while fewer than `max_queued` frames wait to be
+    /// transmitted, returns the number of frames sent without blocking
+    fn send_bounded(&mut self, frames: &[&[u8]], _max_queued: usize) -> io::Result<usize> {
+        self.send_batch(frames).map(|()| frames.len())
+    }
 }
 
 /// Trait for receiving frames
 pub(crate) trait FrameRx {
+    /// A received frame, its buffer is given back to the receiver once dropped
+    type Frame<'a>: Deref<Target = [u8]>
+    where
+        Self: 'a;
+
     /// Try to receive a frame, returning immediately if none available
-    fn recv_nonblocking(&mut self) -> io::Result<Vec<u8>>;
+    fn recv_nonblocking(&mut self) -> io::Result<Self::Frame<'_>>;
+
+    /// Passes up to `max` received frames to `sink`, returning immediately if none available.
+    ///
+    /// Returns the number of frames received, stops at the first error of `sink`.
+    fn recv_many<F>(&mut self, max: usize, mut sink: F) -> io::Result<usize>
+    where
+        F: FnMut(&[u8]) -> io::Result<()>,
+    {
+        let mut num: usize = 0;
+        while num < max {
+            match self.recv_nonblocking() {
+                Ok(frame) => sink(&frame)?,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                Err(err) => return Err(err),
+            }
+            num = num.saturating_add(1);
+        }
+        Ok(num)
+    }
 }
@@ -0,0 +1,610 @@
+//! Checksum and segmentation offload of the tap device of the simple NIC.
+//!
+//! With the offload enabled, each frame of the tap device carries a virtio net header. The
+//! kernel hands over frames whose transport checksum is left to the device and TCP
+//! super-frames of up to 64KB, and takes coalesced TCP super-frames in return, so its stack is
+//! traversed once per super-frame instead of once per MTU.
+//!
+//! The card has neither checksum nor segmentation offload, and its descriptors carry no
+//! offload flags, so the frames are completed here. `segment` cuts a super-frame read from
+//! the tap into frames that fit a slot and fills in their checksums. `RxCoalescer` merges the
+//! consecutive segments of a TCP flow over IPv4 received from the card into one super-frame.
+#![allow(clippy::indexing_slicing, clippy::as_conversions)] // lengths are checked by the parsers
+
+use std::{io, os::fd::RawFd};
+
+use crate::constants::ETH_HEADER_LEN;
+
+/// Bytes of the virtio net header before each frame of the tap device
+pub(crate) const VNET_HDR_LEN: usize = 10;
+/// Largest frame read from or written to the tap device, a 64KB IP super-frame
+pub(crate) const MAX_SUPER_FRAME_LEN: usize = ETH_HEADER_LEN + u16::MAX as usize;
+
+/// Offload features of a tap device, from `linux/if_tun.h`
+const TUN_F_CSUM: libc::c_ulong = 0x01;
+const TUN_F_TSO4: libc::c_ulong = 0x02;
+const TUN_F_TSO6: libc::c_ulong = 0x04;
+
+/// Flags and GSO types of a virtio net header, from `linux/virtio_net.h`
+const VIRTIO_NET_HDR_F_NEEDS_CSUM: u8 = 1;
+const VIRTIO_NET_HDR_GSO_NONE: u8 = 0;
+const VIRTIO_NET_HDR_GSO_TCPV4: u8 = 1;
+const VIRTIO_NET_HDR_GSO_TCPV6: u8 = 4;
+const VIRTIO_NET_HDR_GSO_ECN: u8 = 0x80;
+
+const ETHERTYPE_IPV4: u16 = 0x0800;
+const ETHERTYPE_IPV6: u16 = 0x86dd;
+const IPPROTO_TCP: u8 = 6;
+const IPV4_HEADER_LEN: usize = 20;
+const IPV6_HEADER_LEN: usize = 40;
+const TCP_HEADER_LEN: usize = 20;
+/// Offset of the checksum in a TCP header
+const TCP_CHECKSUM_OFFSET: usize = 16;
+
+const TCP_FIN: u8 = 0x01;
+const TCP_PSH: u8 = 0x08;
+const TCP_ACK: u8 = 0x10;
+const TCP_CWR: u8 = 0x80;
+
+nix::ioctl_write_int!(tun_set_offload, b'T', 208);
+
+/// Lets the kernel hand the transport checksums and the TCP segmentation over to the tap
+/// device `fd`, opened with `IFF_VNET_HDR`
+///
+/// # Errors
+///
+/// Returns an error if the tap device doesn't accept the offload
+#[allow(unsafe_code)]
+pub(crate) fn enable(fd: RawFd) -> io::Result<()> {
+    // SAFETY: the argument is passed by value
+    unsafe { tun_set_offload(fd, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) }
+        .map(|_| ())
+        .map_err(Into::into)
+}
+
+/// Writes `frame` to the tap device `fd` after its virtio net header, in one call
+///
+/// # Errors
+///
+/// Returns an error if the write fails
+#[allow(unsafe_code)]
+pub(crate) fn write_frame(fd: RawFd, hdr: &[u8; VNET_HDR_LEN], frame: &[u8]) -> io::Result<()> {
+    let iov = [
+        libc::iovec {
+            iov_base: hdr.as_ptr().cast_mut().cast(),
+            iov_len: hdr.len(),
+        },
+        libc::iovec {
+            iov_base: frame.as_ptr().cast_mut().cast(),
+            iov_len: frame.len(),
+        },
+    ];
+    // SAFETY: the iovecs point to buffers valid for the duration of the call, which only
+    // reads them
+    if unsafe { libc::writev(fd, iov.as_ptr(), 2) } < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+/// The virtio net header of a frame of the tap device, in native endian
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub(crate) struct VnetHdr {
+    flags: u8,
+    gso_type: u8,
+    hdr_len: u16,
+    gso_size: u16,
+    csum_start: u16,
+    csum_offset: u16,
+}
+
+impl VnetHdr {
+    fn parse(bytes: &[u8]) -> Option<Self> {
+        let b = bytes.get(..VNET_HDR_LEN)?;
+        let word = |i: usize| u16::from_ne_bytes([b[i], b[i + 1]]);
+        Some(Self {
+            flags: b[0],
+            gso_type: b[1],
+            hdr_len: word(2),
+            gso_size: word(4),
+            csum_start: word(6),
+            csum_offset: word(8),
+        })
+    }
+
+    pub(crate) fn to_bytes(self) -> [u8; VNET_HDR_LEN] {
+        let mut b = [0; VNET_HDR_LEN];
+        b[0] = self.flags;
+        b[1] = self.gso_type;
+        for (i, word) in [
+            self.hdr_len,
+            self.gso_size,
+            self.csum_start,
+            self.csum_offset,
+        ]
+        .into_iter()
+        .enumerate()
+        {
+            b[2 + 2 * i..4 + 2 * i].copy_from_slice(&word.to_ne_bytes());
+        }
+        b
+    }
+}
+
+/// Ones' complement sum of `data` as big endian words, added to `sum`
+fn ones_sum(data: &[u8], mut sum: u64) -> u64 {
+    let mut words = data.chunks_exact(2);
+    for word in &mut words {
+        sum += u64::from(u16::from_be_bytes([word[0], word[1]]));
+    }
+    if let [last] = words.remainder() {
+        sum += u64::from(u16::from_be_bytes([*last, 0]));
+    }
+    sum
+}
+
+fn fold(mut sum: u64) -> u16 {
+    while sum > 0xffff {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    sum as u16
+}
+
+/// Sum of the pseudo header of a TCP segment of `l4_len` bytes behind the IP header `l3`
+fn pseudo_sum(l3: &[u8], ipv6: bool, l4_len: usize) -> u64 {
+    let addrs = if ipv6 { &l3[8..40] } else { &l3[12..20] };
+    ones_sum(addrs, u64::from(IPPROTO_TCP) + l4_len as u64)
+}
+
+fn ipv4_checksum(header: &mut [u8]) {
+    header[10..12].fill(0);
+    let csum = !fold(ones_sum(header, 0));
+    header[10..12].copy_from_slice(&csum.to_be_bytes());
+}
+
+/// Fills in the checksum of the frame at `csum_start + csum_offset`, over the frame from
+/// `csum_start`, which already holds the sum of the pseudo header
+fn complete_checksum(frame: &mut [u8], csum_start: usize, csum_offset: usize) -> bool {
+    let pos = csum_start + csum_offset;
+    if pos + 2 > frame.len() {
+        return false;
+    }
+    let csum = match !fold(ones_sum(&frame[csum_start..], 0)) {
+        // Zero disables the checksum of a UDP datagram
+        0 => 0xffff,
+        csum => csum,
+    };
+    frame[pos..pos + 2].copy_from_slice(&csum.to_be_bytes());
+    true
+}
+
+/// Cuts `packet`, a frame read from the tap device after its virtio net header, into frames of
+/// at most `slot_size` bytes. The frames are appended to `out` and their lengths to `lens`,
+/// each with its checksums filled in.
+///
+/// Returns `false` if the frame is malformed or doesn't fit, it is dropped.
+pub(crate) fn segment(
+    packet: &[u8],
+    slot_size: usize,
+    out: &mut Vec<u8>,
+    lens: &mut Vec<usize>,
+) -> bool {
+    let Some(hdr) = VnetHdr::parse(packet) else {
+        return false;
+    };
+    let frame = &packet[VNET_HDR_LEN..];
+    match hdr.gso_type & !VIRTIO_NET_HDR_GSO_ECN {
+        VIRTIO_NET_HDR_GSO_NONE => {
+            if frame.len() > slot_size {
+                return false;
+            }
+            let start = out.len();
+            out.extend_from_slice(frame);
+            if hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM != 0
+                && !complete_checksum(
+                    &mut out[start..],
+                    usize::from(hdr.csum_start),
+                    usize::from(hdr.csum_offset),
+                )
+            {
+                out.truncate(start);
+                return false;
+            }
+            lens.push(frame.len());
+            true
+        }
+        VIRTIO_NET_HDR_GSO_TCPV4 => segment_tcp(frame, false, hdr.gso_size, slot_size, out, lens),
+        VIRTIO_NET_HDR_GSO_TCPV6 => segment_tcp(frame, true, hdr.gso_size, slot_size, out, lens),
+        // The UDP segmentation is not offered to the kernel
+        _ => false,
+    }
+}
+
+/// Cuts a TCP super-frame into segments of `gso_size` bytes of payload at most, fewer if the
+/// headers and the payload wouldn't fit a slot
+fn segment_tcp(
+    frame: &[u8],
+    ipv6: bool,
+    gso_size: u16,
+    slot_size: usize,
+    out: &mut Vec<u8>,
+    lens: &mut Vec<usize>,
+) -> bool {
+    let l3 = ETH_HEADER_LEN;
+    let ethertype = if ipv6 { ETHERTYPE_IPV6 } else { ETHERTYPE_IPV4 };
+    if frame.len() < l3 + IPV4_HEADER_LEN || frame[12..14] != ethertype.to_be_bytes() {
+        return false;
+    }
+    let ip_hlen = if ipv6 {
+        IPV6_HEADER_LEN
+    } else {
+        usize::from(frame[l3] & 0xf) * 4
+    };
+    let l4 = l3 + ip_hlen;
+    if ip_hlen < IPV4_HEADER_LEN || frame.len() < l4 + TCP_HEADER_LEN {
+        return false;
+    }
+    let tcp_hlen = usize::from(frame[l4 + 12] >> 4) * 4;
+    let hlen = l4 + tcp_hlen;
+    let mss = usize::from(gso_size).min(slot_size.saturating_sub(hlen));
+    if tcp_hlen < TCP_HEADER_LEN || frame.len() < hlen || mss == 0 {
+        return false;
+    }
+    let seq = u32::from_be_bytes([frame[l4 + 4], frame[l4 + 5], frame[l4 + 6], frame[l4 + 7]]);
+    let id = u16::from_be_bytes([frame[l3 + 4], frame[l3 + 5]]);
+    let flags = frame[l4 + 13];
+    let payload = &frame[hlen..];
+    let num = payload.len().div_ceil(mss).max(1);
+    for i in 0..num {
+        let chunk = payload.get(i * mss..).unwrap_or_default();
+        let chunk = chunk.get(..mss).unwrap_or(chunk);
+        let start = out.len();
+        out.extend_from_slice(&frame[..hlen]);
+        out.extend_from_slice(chunk);
+        let seg = &mut out[start..];
+        let l4_len = tcp_hlen + chunk.len();
+        if ipv6 {
+            seg[l3 + 4..l3 + 6].copy_from_slice(&(l4_len as u16).to_be_bytes());
+        } else {
+            seg[l3 + 2..l3 + 4].copy_from_slice(&((ip_hlen + l4_len) as u16).to_be_bytes());
+            seg[l3 + 4..l3 + 6].copy_from_slice(&id.wrapping_add(i as u16).to_be_bytes());
+            ipv4_checksum(&mut seg[l3..l4]);
+        }
+        let seg_seq = seq.wrapping_add((i * mss) as u32);
+        seg[l4 + 4..l4 + 8].copy_from_slice(&seg_seq.to_be_bytes());
+        // FIN and PSH belong to the last segment, CWR to the first one
+        let mut seg_flags = flags;
+        if i + 1 < num {
+            seg_flags &= !(TCP_FIN | TCP_PSH);
+        }
+        if i > 0 {
+            seg_flags &= !TCP_CWR;
+        }
+        seg[l4 + 13] = seg_flags;
+        seg[l4 + TCP_CHECKSUM_OFFSET..l4 + TCP_CHECKSUM_OFFSET + 2].fill(0);
+        let sum = ones_sum(&seg[l4..], pseudo_sum(&seg[l3..l4], ipv6, l4_len));
+        seg[l4 + TCP_CHECKSUM_OFFSET..l4 + TCP_CHECKSUM_OFFSET + 2]
+            .copy_from_slice(&(!fold(sum)).to_be_bytes());
+        lens.push(seg.len());
+    }
+    true
+}
+
+/// Offsets of a TCP segment over IPv4 that may be merged with its neighbours
+#[derive(Debug, Clone, Copy)]
+struct TcpSegment {
+    /// Length of the frame without the Ethernet padding
+    len: usize,
+    /// Length of the Ethernet, IP and TCP headers
+    hlen: usize,
+    seq: u32,
+    flags: u8,
+}
+
+impl TcpSegment {
+    /// Offset of the TCP header of a mergeable segment, which has no IP options
+    const L4: usize = ETH_HEADER_LEN + IPV4_HEADER_LEN;
+
+    /// Parses a frame carrying a TCP segment with a payload, no other flag than ACK and PSH
+    /// and valid checksums, the checksums of the merged segments are not checked again
+    fn parse(frame: &[u8]) -> Option<Self> {
+        let (l3, l4) = (ETH_HEADER_LEN, Self::L4);
+        if frame.len() < l4 + TCP_HEADER_LEN
+            || frame[12..14] != ETHERTYPE_IPV4.to_be_bytes()
+            || frame[l3] != 0x45
+            || frame[l3 + 9] != IPPROTO_TCP
+            // not a fragment
+            || u16::from_be_bytes([frame[l3 + 6], frame[l3 + 7]]) & 0x3fff != 0
+        {
+            return None;
+        }
+        let len = l3 + usize::from(u16::from_be_bytes([frame[l3 + 2], frame[l3 + 3]]));
+        let tcp_hlen = usize::from(frame[l4 + 12] >> 4) * 4;
+        let hlen = l4 + tcp_hlen;
+        let flags = frame[l4 + 13];
+        if tcp_hlen < TCP_HEADER_LEN
+            || len > frame.len()
+            || len <= hlen
+            || flags & !(TCP_ACK | TCP_PSH) != 0
+            || flags & TCP_ACK == 0
+        {
+            return None;
+        }
+        let frame = &frame[..len];
+        if fold(ones_sum(&frame[l3..l4], 0)) != 0xffff
+            || fold(ones_sum(
+                &frame[l4..],
+                pseudo_sum(&frame[l3..l4], false, len - l4),
+            )) != 0xffff
+        {
+            return None;
+        }
+        Some(Self {
+            len,
+            hlen,
+            seq: u32::from_be_bytes([frame[l4 + 4], frame[l4 + 5], frame[l4 + 6], frame[l4 + 7]]),
+            flags,
+        })
+    }
+
+    fn payload_len(&self) -> usize {
+        self.len - self.hlen
+    }
+}
+
+/// Merges the consecutive segments of a TCP flow over IPv4 received from the card into a
+/// super-frame for the tap device, as LRO does.
+///
+/// A segment extends the super-frame if it continues its sequence with the same headers but
+/// for the lengths, the IP ID and the checksums, carries no more payload than the first
+/// segment and keeps the super-frame within 64KB. A segment with PSH or a shorter payload ends
+/// the super-frame. The super-frame is passed with a GSO header and a partial checksum, so the
+/// kernel takes it as verified; the checksums of its segments are checked on the way in.
+#[derive(Debug, Default)]
+pub(crate) struct RxCoalescer {
+    /// The super-frame being built, empty if none
+    buf: Vec<u8>,
+    /// Payload bytes of the first segment
+    mss: usize,
+    /// Headers length of the segments
+    hlen: usize,
+    /// Number of merged segments
+    num: usize,
+    /// Sequence number of the next segment
+    next_seq: u32,
+}
+
+impl RxCoalescer {
+    pub(crate) fn new() -> Self {
+        Self {
+            buf: Vec::with_capacity(MAX_SUPER_FRAME_LEN),
+            ..Self::default()
+        }
+    }
+
+    /// Passes a frame received from the card. The super-frames and the frames that can't be
+    /// merged reach `sink` with their virtio net header, in the order of their frames.
+    pub(crate) fn push<F>(&mut self, frame: &[u8], sink: &mut F) -> io::Result<()>
+    where
+        F: FnMut(&[u8; VNET_HDR_LEN], &[u8]) -> io::Result<()>,
+    {
+        let Some(seg) = TcpSegment::parse(frame) else {
+            self.flush(sink)?;
+            return sink(&VnetHdr::default().to_bytes(), frame);
+        };
+        if !self.buf.is_empty() && !self.extends(frame, &seg) {
+            self.flush(sink)?;
+        }
+        let payload = &frame[seg.hlen..seg.len];
+        if self.buf.is_empty() {
+            self.buf.extend_from_slice(&frame[..seg.len]);
+            self.mss = payload.len();
+            self.hlen = seg.hlen;
+            self.num = 1;
+        } else {
+            self.buf.extend_from_slice(payload);
+            self.buf[TcpSegment::L4 + 13] |= seg.flags & TCP_PSH;
+            self.num += 1;
+        }
+        self.next_seq = seg.seq.wrapping_add(payload.len() as u32);
+        if seg.flags & TCP_PSH != 0 || payload.len() < self.mss {
+            self.flush(sink)?;
+        }
+        Ok(())
+    }
+
+    /// Passes the super-frame being built to `sink`
+    pub(crate) fn flush<F>(&mut self, sink: &mut F) -> io::Result<()>
+    where
+        F: FnMut(&[u8; VNET_HDR_LEN], &[u8]) -> io::Result<()>,
+    {
+        if self.buf.is_empty() {
+            return Ok(());
+        }
+        let hdr = if self.num == 1 {
+            VnetHdr::default()
+        } else {
+            let (l3, l4) = (ETH_HEADER_LEN, TcpSegment::L4);
+            let ip_len = (self.buf.len() - l3) as u16;
+            self.buf[l3 + 2..l3 + 4].copy_from_slice(&ip_len.to_be_bytes());
+            ipv4_checksum(&mut self.buf[l3..l4]);
+            // A partial checksum holds the sum of the pseudo header
+            let pseudo = fold(pseudo_sum(&self.buf[l3..l4], false, self.buf.len() - l4));
+            self.buf[l4 + TCP_CHECKSUM_OFFSET..l4 + TCP_CHECKSUM_OFFSET + 2]
+                .copy_from_slice(&pseudo.to_be_bytes());
+            VnetHdr {
+                flags: VIRTIO_NET_HDR_F_NEEDS_CSUM,
+                gso_type: VIRTIO_NET_HDR_GSO_TCPV4,
+                hdr_len: self.hlen as u16,
+                gso_size: self.mss as u16,
+                csum_start: l4 as u16,
+                csum_offset: TCP_CHECKSUM_OFFSET as u16,
+            }
+        };
+        let result = sink(&hdr.to_bytes(), &self.buf);
+        self.buf.clear();
+        result
+    }
+
+    /// Returns whether the segment continues the super-frame being built
+    fn extends(&self, frame: &[u8], seg: &TcpSegment) -> bool {
+        let (l3, l4) = (ETH_HEADER_LEN, TcpSegment::L4);
+        let same = |range: std::ops::Range<usize>| self.buf[range.clone()] == frame[range];
+        seg.hlen == self.hlen
+            && seg.seq == self.next_seq
+            && seg.payload_len() <= self.mss
+            && self.buf.len() + seg.payload_len() <= MAX_SUPER_FRAME_LEN
+            // Ethernet header, TOS, TTL and protocol, addresses
+            && same(0..l3 + 2)
+            && same(l3 + 8..l3 + 10)
+            && same(l3 + 12..l4)
+            // ports, ACK number, data offset, window and options
+            && same(l4..l4 + 4)
+            && same(l4 + 8..l4 + 13)
+            && same(l4 + 14..l4 + 16)
+            && same(l4 + 20..seg.hlen)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// A TCP segment over IPv4 from 10.0.0.1:1000 to 10.0.0.2:2000 with valid checksums
+    fn tcp_frame(seq: u32, flags: u8, payload: &[u8]) -> Vec<u8> {
+        let mut frame = vec![0; TcpSegment::L4 + TCP_HEADER_LEN];
+        frame[12..14].copy_from_slice(&ETHERTYPE_IPV4.to_be_bytes());
+        let l3 = ETH_HEADER_LEN;
+        frame[l3] = 0x45;
+        frame[l3 + 8] = 64;
+        frame[l3 + 9] = IPPROTO_TCP;
+        frame[l3 + 12..l3 + 20].copy_from_slice(&[10, 0, 0, 1, 10, 0, 0, 2]);
+        let l4 = TcpSegment::L4;
+        frame[l4..l4 + 4].copy_from_slice(&[0x03, 0xe8, 0x07, 0xd0]);
+        frame[l4 + 4..l4 + 8].copy_from_slice(&seq.to_be_bytes());
+        frame[l4 + 12] = 5 << 4;
+        frame[l4 + 13] = flags;
+        frame.extend_from_slice(payload);
+        let ip_len = (frame.len() - l3) as u16;
+        frame[l3 + 2..l3 + 4].copy_from_slice(&ip_len.to_be_bytes());
+        ipv4_checksum(&mut frame[l3..l4]);
+        let sum = ones_sum(
+            &frame[l4..],
+            pseudo_sum(&frame[l3..l4], false, frame.len() - l4),
+        );
+        frame[l4 + 16..l4 + 18].copy_from_slice(&(!fold(sum)).to_be_bytes());
+        frame
+    }
+
+    fn coalesce(frames: &[Vec<u8>]) -> Vec<(VnetHdr, Vec<u8>)> {
+        let mut out = Vec::new();
+        let mut sink = |hdr: &[u8; VNET_HDR_LEN], frame: &[u8]| {
+            out.push((VnetHdr::parse(hdr).unwrap(), frame.to_vec()));
+            Ok(())
+        };
+        let mut coalescer = RxCoalescer::new();
+        for frame in frames {
+            coalescer.push(frame, &mut sink).unwrap();
+        }
+        coalescer.flush(&mut sink).unwrap();
+        out
+    }
+
+    #[test]
+    fn super_frame_is_cut_into_valid_segments() {
+        let payload: Vec<u8> = (0..1000u32).map(|i| i as u8).collect();
+        let mut frame = tcp_frame(7, TCP_ACK | TCP_PSH, &payload);
+        frame[ETH_HEADER_LEN + 2..ETH_HEADER_LEN + 4].fill(0);
+        let hdr = VnetHdr {
+            flags: VIRTIO_NET_HDR_F_NEEDS_CSUM,
+            gso_type: VIRTIO_NET_HDR_GSO_TCPV4,
+            gso_size: 400,
+            ..VnetHdr::default()
+        };
+        let mut packet = hdr.to_bytes().to_vec();
+        packet.extend_from_slice(&frame);
+        let (mut out, mut lens) = (Vec::new(), Vec::new());
+        // A slot of 256 bytes holds 202 bytes of payload behind the headers
+        assert!(segment(&packet, 256, &mut out, &mut lens));
+        assert_eq!(lens, [256, 256, 256, 256, 246]);
+        let mut rest = out.as_slice();
+        let mut merged = Vec::new();
+        for (i, len) in lens.iter().enumerate() {
+            let (seg, tail) = rest.split_at(*len);
+            rest = tail;
+            let parsed = TcpSegment::parse(seg).expect("invalid segment");
+            assert_eq!(parsed.seq, 7 + 202 * i as u32);
+            assert_eq!(parsed.flags & TCP_PSH != 0, i == lens.len() - 1);
+            merged.extend_from_slice(&seg[parsed.hlen..]);
+        }
+        assert_eq!(merged, payload);
+    }
+
+    #[test]
+    fn partial_checksum_is_completed() {
+        let frame = tcp_frame(1, TCP_ACK, b"hello");
+        let mut partial = frame.clone();
+        let l4 = TcpSegment::L4;
+        let pseudo = fold(pseudo_sum(
+            &frame[ETH_HEADER_LEN..l4],
+            false,
+            frame.len() - l4,
+        ));
+        partial[l4 + 16..l4 + 18].copy_from_slice(&pseudo.to_be_bytes());
+        let hdr = VnetHdr {
+            flags: VIRTIO_NET_HDR_F_NEEDS_CSUM,
+            csum_start: l4 as u16,
+            csum_offset: TCP_CHECKSUM_OFFSET as u16,
+            ..VnetHdr::default()
+        };
+        let mut packet = hdr.to_bytes().to_vec();
+        packet.extend_from_slice(&partial);
+        let (mut out, mut lens) = (Vec::new(), Vec::new());
+        assert!(segment(&packet, 128, &mut out, &mut lens));
+        assert_eq!(out, frame);
+        assert!(!segment(&packet, 32, &mut out, &mut lens));
+    }
+
+    #[test]
+    fn consecutive_segments_are_merged() {
+        let frames = [
+            tcp_frame(100, TCP_ACK, &[1; 50]),
+            tcp_frame(150, TCP_ACK, &[2; 50]),
+            tcp_frame(200, TCP_ACK | TCP_PSH, &[3; 20]),
+            // out of sequence
+            tcp_frame(300, TCP_ACK, &[4; 50]),
+            tcp_frame(400, TCP_ACK, &[5; 50]),
+        ];
+        let out = coalesce(&frames);
+        assert_eq!(out.len(), 3);
+        let (hdr, merged) = &out[0];
+        assert_eq!(hdr.gso_type, VIRTIO_NET_HDR_GSO_TCPV4);
+        assert_eq!(
+            (hdr.gso_size, hdr.hdr_len),
+            (50, TcpSegment::L4 as u16 + 20)
+        );
+        let mut payload = vec![1; 50];
+        payload.extend([2; 50]);
+        payload.extend([3; 20]);
+        assert_eq!(merged[TcpSegment::L4 + 20..], payload);
+        assert_ne!(merged[TcpSegment::L4 + 13] & TCP_PSH, 0);
+        assert_eq!(out[1], (VnetHdr::default(), frames[3].clone()));
+        assert_eq!(out[2], (VnetHdr::default(), frames[4].clone()));
+    }
+
+    #[test]
+    fn corrupted_and_other_frames_are_passed_through() {
+        let mut corrupted = tcp_frame(150, TCP_ACK, &[2; 50]);
+        *corrupted.last_mut().unwrap() ^= 1;
+        let frames = [
+            tcp_frame(100, TCP_ACK, &[1; 50]),
+            corrupted,
+            tcp_frame(150, TCP_ACK, &[2; 50]),
+            vec![0xff; 60],
+        ];
+        let out = coalesce(&frames);
+        assert_eq!(out.len(), 4);
+        assert!(out.iter().all(|(hdr, _)| *hdr == VnetHdr::default()));
+        assert_eq!(out[1].1, frames[1]);
+    }
+}
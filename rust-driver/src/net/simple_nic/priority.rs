@@ -0,0 +1,159 @@
+//! Priority of the control frames of the driver over the tap traffic on the simple NIC.
+//!
+//! The card has a single simple NIC TX ring, drained in order. When the ring also carries the
+//! frames of the tap device, the ACKs and NAKs of the `AckResponder` could queue behind a
+//! burst of IP traffic and make the senders time out. The ring is split into two handles:
+//! the control handle sends right away, once the tap frame being queued is written. The bulk
+//! handle keeps at most `BULK_MAX_QUEUED` frames waiting for the card, and steps aside
+//! whenever a control frame waits, so that a control frame is sent behind a bounded number
+//! of tap frames whatever the IP traffic.
+
+use std::{
+    io,
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Arc,
+    },
+    thread,
+};
+
+use parking_lot::Mutex;
+
+use super::FrameTx;
+
+/// Maximum number of tap frames waiting for the card, a control frame is sent behind at most
+/// these
+const BULK_MAX_QUEUED: usize = 16;
+
+/// Maximum number of tap frames queued under one lock of the ring
+const BULK_BURST: usize = 4;
+
+/// The ring shared by the two handles
+struct SharedTx<Tx> {
+    tx: Mutex<Tx>,
+    /// Number of control senders waiting for the ring
+    control_waiting: AtomicUsize,
+}
+
+/// Splits `tx` into the handles of the control frames and of the tap frames
+pub(crate) fn split<Tx: FrameTx>(tx: Tx) -> (ControlFrameTx<Tx>, BulkFrameTx<Tx>) {
+    let shared = Arc::new(SharedTx {
+        tx: Mutex::new(tx),
+        control_waiting: AtomicUsize::new(0),
+    });
+    (
+        ControlFrameTx {
+            shared: Arc::clone(&shared),
+        },
+        BulkFrameTx { shared },
+    )
+}
+
+/// Sends the control frames of the driver ahead of the tap frames
+pub(crate) struct ControlFrameTx<Tx> {
+    shared: Arc<SharedTx<Tx>>,
+}
+
+impl<Tx: FrameTx> FrameTx for ControlFrameTx<Tx> {
+    fn send(&mut self, buf: &[u8]) -> io::Result<()> {
+        self.send_batch(&[buf])
+    }
+
+    fn send_batch(&mut self, frames: &[&[u8]]) -> io::Result<()> {
+        let shared = &self.shared;
+        let _prev = shared.control_waiting.fetch_add(1, Ordering::AcqRel);
+        let result = shared.tx.lock().send_batch(frames);
+        let _prev = shared.control_waiting.fetch_sub(1, Ordering::AcqRel);
+        result
+    }
+}
+
+/// Sends the tap frames, behind the control frames
+pub(crate) struct BulkFrameTx<Tx> {
+    shared: Arc<SharedTx<Tx>>,
+}
+
+impl<Tx: FrameTx> FrameTx for BulkFrameTx<Tx> {
+    fn send(&mut self, buf: &[u8]) -> io::Result<()> {
+        self.send_batch(&[buf])
+    }
+
+    fn send_batch(&mut self, frames: &[&[u8]]) -> io::Result<()> {
+        let shared = &self.shared;
+        let mut rest = frames;
+        while !rest.is_empty() {
+            if shared.control_waiting.load(Ordering::Acquire) != 0 {
+                thread::yield_now();
+                continue;
+            }
+            let burst = rest.get(..BULK_BURST).unwrap_or(rest);
+            let sent = shared.tx.lock().send_bounded(burst, BULK_MAX_QUEUED)?;
+            rest = rest.get(sent..).unwrap_or_default();
+            if sent == 0 {
+                // The card has not consumed the queued frames yet, the lock is left to the
+                // control frames meanwhile
+                thread::yield_now();
+            }
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Records the frames sent, `queued` of them wait for the card until the test clears it
+    #[derive(Default)]
+    struct Ring {
+        sent: Vec<Vec<u8>>,
+        queued: usize,
+    }
+
+    impl FrameTx for Arc<Mutex<Ring>> {
+        fn send(&mut self, buf: &[u8]) -> io::Result<()> {
+            let mut ring = self.lock();
+            ring.sent.push(buf.to_vec());
+            ring.queued += 1;
+            Ok(())
+        }
+
+        fn send_bounded(&mut self, frames: &[&[u8]], max_queued: usize) -> io::Result<usize> {
+            let mut ring = self.lock();
+            let num = frames.len().min(max_queued.saturating_sub(ring.queued));
+            for frame in &frames[..num] {
+                ring.sent.push(frame.to_vec());
+            }
+            ring.queued += num;
+            Ok(num)
+        }
+    }
+
+    #[test]
+    fn control_frames_pass_the_queued_tap_frames() {
+        let ring = Arc::new(Mutex::new(Ring::default()));
+        let (mut control, mut bulk) = split(Arc::clone(&ring));
+        let tap: Vec<_> = (0..BULK_MAX_QUEUED as u8 + 8).map(|i| vec![i]).collect();
+        let sender = thread::spawn(move || {
+            let frames: Vec<&[u8]> = tap.iter().map(Vec::as_slice).collect();
+            bulk.send_batch(&frames)
+        });
+        // The tap frames stop once `BULK_MAX_QUEUED` of them wait for the card
+        while ring.lock().queued < BULK_MAX_QUEUED {
+            thread::yield_now();
+        }
+        control.send(b"ack").unwrap();
+        assert_eq!(ring.lock().sent.last().unwrap(), b"ack");
+        assert_eq!(ring.lock().sent.len(), BULK_MAX_QUEUED + 1);
+
+        // The card consumes the frames, the rest of the tap frames follow
+        ring.lock().queued = 0;
+        sender.join().unwrap().unwrap();
+        let ring = ring.lock();
+        assert_eq!(ring.sent.len(), BULK_MAX_QUEUED + 9);
+        assert!(ring.sent[..BULK_MAX_QUEUED]
+            .iter()
+            .enumerate()
+            .all(|(i, frame)| frame == &[i as u8]));
+    }
+}
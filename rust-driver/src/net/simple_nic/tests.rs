@@ -6,6 +6,7 @@ use std::{
 use ipnetwork::IpNetwork;
 
 use super::{worker::SimpleNicWorker, FrameRx, FrameTx, SimpleNicDevice, SimpleNicDeviceConfig};
+use crate::config::SimpleNicConfig;
 
 struct FrameTxSocket(UdpSocket);
 
@@ -21,6 +22,8 @@ struct FrameRxSocket {
 }
 
 impl FrameRx for FrameRxSocket {
+    type Frame<'a> = Vec<u8>;
+
     fn recv_nonblocking(&mut self) -> std::io::Result<Vec<u8>> {
         let len = self.buffer.len();
         self.buffer.resize(len + 2048, 0);
@@ -33,7 +36,8 @@ impl FrameRx for FrameRxSocket {
 #[allow(clippy::print_stderr)]
 fn worker_loopback() {
     let network = IpNetwork::new(Ipv4Addr::new(172, 16, 0, 0).into(), 24).unwrap();
-    let config = SimpleNicDeviceConfig::new(network);
+    let slots = SimpleNicConfig::default();
+    let config = SimpleNicDeviceConfig::new(network, slots);
     // Requires root
     let Ok(dev) = SimpleNicDevice::new(config) else {
         eprintln!("WARN: test 'worker_loopback' was skipped as it needs to be run as root");
@@ -49,6 +53,12 @@ fn worker_loopback() {
         socket: socket_rx,
     };
     let shutdown = Arc::new(AtomicBool::new(false));
-    let worker = SimpleNicWorker::new(dev.tun_dev, frame_tx, frame_rx, Arc::clone(&shutdown));
+    let worker = SimpleNicWorker::new(
+        dev.tun_dev,
+        frame_tx,
+        frame_rx,
+        slots,
+        Arc::clone(&shutdown),
+    );
     let handle = worker.run();
 }
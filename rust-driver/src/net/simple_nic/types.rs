@@ -50,4 +50,8 @@ impl SimpleNicRxQueue {
     pub(crate) fn pop(&mut self) -> Option<SimpleNicRxQueueDesc> {
         self.inner.pop()
     }
+
+    pub(crate) fn tail(&self) -> u32 {
+        self.inner.released() as u32
+    }
 }
@@ -1,5 +1,7 @@
 use std::{
     io::{self, Read},
+    ops::Deref,
+    os::fd::AsRawFd,
     sync::{
         atomic::{AtomicBool, Ordering},
         Arc,
@@ -7,13 +9,14 @@ use std::{
     thread::{self, JoinHandle},
 };
 
-use log::error;
+use log::{debug, error};
 
 use crate::{
+    config::SimpleNicConfig,
     descriptors::simple_nic::{SimpleNicRxQueueDesc, SimpleNicTxQueueDesc},
     csr::{
         proxy::{SimpleNicRxQueueCsrProxy, SimpleNicTxQueueCsrProxy},
-        CsrBaseAddrAdaptor, CsrWriterAdaptor, DeviceAdaptor,
+        CsrBaseAddrAdaptor, CsrReaderAdaptor, CsrWriterAdaptor, DeviceAdaptor,
     },
     mem::{
         page::{ContiguousPages, MmapMut},
@@ -23,6 +26,7 @@ use crate::{
 };
 
 use super::{
+    offload::{self, RxCoalescer, MAX_SUPER_FRAME_LEN, VNET_HDR_LEN},
     types::{SimpleNicRxQueue, SimpleNicTxQueue},
     FrameRx, FrameTx, SimpleNicDevice,
 };
@@ -39,17 +43,25 @@ impl<Dev: DeviceAdaptor> SimpleNicController<Dev> {
         rx_rb_buf: DmaBuf,
         tx_buffer: DmaBuf,
         rx_buffer: DmaBuf,
+        depth: usize,
+        slot_size: usize,
     ) -> io::Result<Self> {
-        let mut tx_queue = SimpleNicTxQueue::new(DescRingBuffer::new(tx_rb_buf.buf));
-        let mut rx_queue = SimpleNicRxQueue::new(DescRingBuffer::new(rx_rb_buf.buf));
+        let mut tx_queue = SimpleNicTxQueue::new(DescRingBuffer::with_depth(tx_rb_buf.buf, depth));
+        let mut rx_queue = SimpleNicRxQueue::new(DescRingBuffer::with_depth(rx_rb_buf.buf, depth));
         let req_csr_proxy = SimpleNicTxQueueCsrProxy(dev.clone());
         let resp_csr_proxy = SimpleNicRxQueueCsrProxy(dev.clone());
         req_csr_proxy.write_base_addr(tx_rb_buf.phys_addr)?;
         resp_csr_proxy.write_base_addr(rx_rb_buf.phys_addr)?;
 
         Ok(Self {
-            tx: FrameTxQueue::new(tx_queue, tx_buffer.buf, tx_buffer.phys_addr, req_csr_proxy),
-            rx: FrameRxQueue::new(rx_queue, rx_buffer.buf, resp_csr_proxy),
+            tx: FrameTxQueue::new(
+                tx_queue,
+                tx_buffer.buf,
+                tx_buffer.phys_addr,
+                slot_size,
+                req_csr_proxy,
+            ),
+            rx: FrameRxQueue::new(rx_queue, rx_buffer.buf, slot_size, resp_csr_proxy),
         })
     }
 }
@@ -65,8 +77,11 @@ impl<Dev> SimpleNicController<Dev> {
     }
 }
 
-/// A buffer slot size for a single frame
-const FRAME_SLOT_SIZE: usize = 128;
+/// Maximum number of frames the `TxWorker` queues per doorbell
+const TX_BATCH: usize = 32;
+
+/// Maximum number of frames the `RxWorker` receives per tail write
+const RX_BATCH: usize = 32;
 
 /// Send frame through `SimpleNicTxQueue`
 pub(crate) struct FrameTxQueue<Dev> {
@@ -80,6 +95,8 @@ pub(crate) struct FrameTxQueue<Dev> {
     buf_base_phys_addr: u64,
     /// Pointer to the next slot of the buffer
     buf_head: usize,
+    /// Size of a frame slot of the buffer
+    slot_size: usize,
 }
 
 impl<Dev> FrameTxQueue<Dev> {
@@ -88,6 +105,7 @@ impl<Dev> FrameTxQueue<Dev> {
         inner: SimpleNicTxQueue,
         buf: MmapMut,
         buf_base_phys_addr: u64,
+        slot_size: usize,
         csr_proxy: SimpleNicTxQueueCsrProxy<Dev>,
     ) -> Self {
         Self {
@@ -96,6 +114,7 @@ impl<Dev> FrameTxQueue<Dev> {
             buf,
             buf_base_phys_addr,
             buf_head: 0,
+            slot_size,
         }
     }
 
@@ -107,16 +126,55 @@ impl<Dev> FrameTxQueue<Dev> {
         Some(SimpleNicTxQueueDesc::new(addr, len))
     }
 
+    /// Returns whether a frame can be queued, as seen from the last tail read. The ring must
+    /// have a free descriptor, and the slot of the frame must not be used by an earlier frame
+    /// the device has not consumed yet.
+    fn has_room(&self) -> bool {
+        self.inner.remaining() > 0 && self.queued() < self.buf.len() / self.slot_size
+    }
+
+    /// Returns the number of frames the device has not consumed, as seen from the last tail
+    /// read
+    fn queued(&self) -> usize {
+        self.inner.depth().saturating_sub(self.inner.remaining())
+    }
+
+    /// Queues a frame, the ring must have room for it
+    fn push(&mut self, frame: &[u8]) {
+        let desc = self
+            .build_desc(frame)
+            .unwrap_or_else(|| unreachable!("buffer is smaller than u32::MAX"));
+        if !self.inner.push(desc) {
+            unreachable!("the ring has room for the frame");
+        }
+    }
+
+    /// Waits for the device to consume earlier frames until a frame can be queued
+    fn wait_room(&mut self) -> io::Result<()>
+    where
+        Dev: DeviceAdaptor,
+    {
+        // The frames queued so far must be visible to the device for the ring to drain
+        self.csr_proxy.write_head(self.inner.head())?;
+        loop {
+            self.inner.set_tail(self.csr_proxy.read_tail()?);
+            if self.has_room() {
+                return Ok(());
+            }
+            std::hint::spin_loop();
+        }
+    }
+
     #[allow(clippy::as_conversions)]
     fn write_next(&mut self, data: &[u8]) -> Option<u64> {
-        if data.len() > FRAME_SLOT_SIZE {
+        if data.len() > self.slot_size {
             return None;
         }
         let phys_addr = self.buf_base_phys_addr.wrapping_add(self.buf_head as u64);
         self.buf.copy_from(self.buf_head, data);
         self.buf_head = self
             .buf_head
-            .wrapping_add(FRAME_SLOT_SIZE)
+            .wrapping_add(self.slot_size)
             .checked_rem(self.buf.len())?;
         Some(phys_addr)
     }
@@ -124,18 +182,40 @@ impl<Dev> FrameTxQueue<Dev> {
 
 impl<Dev: DeviceAdaptor + Send + 'static> FrameTx for FrameTxQueue<Dev> {
     fn send(&mut self, buf: &[u8]) -> io::Result<()> {
-        let mut desc = self
-            .build_desc(buf)
-            .unwrap_or_else(|| unreachable!("buffer is smaller than u32::MAX"));
-        while !self.inner.push(desc) {
-            std::hint::spin_loop();
-        }
-        self.csr_proxy.write_head(self.inner.head());
-        if let Ok(tail_ptr) = self.csr_proxy.read_tail() {
-            self.inner.set_tail(tail_ptr);
+        self.send_batch(&[buf])
+    }
+
+    /// Queues the frames and writes the head CSR once, the tail CSR is only read while the
+    /// ring looks full
+    fn send_batch(&mut self, frames: &[&[u8]]) -> io::Result<()> {
+        for frame in frames {
+            if !self.has_room() {
+                self.wait_room()?;
+            }
+            self.push(frame);
         }
+        self.csr_proxy.write_head(self.inner.head())
+    }
 
-        Ok(())
+    /// Queues the frames while fewer than `max_queued` of them wait for the device, the tail
+    /// CSR is only read once the limit is reached
+    fn send_bounded(&mut self, frames: &[&[u8]], max_queued: usize) -> io::Result<usize> {
+        let mut num = 0;
+        for frame in frames {
+            let fits = |queue: &Self| queue.has_room() && queue.queued() < max_queued;
+            if !fits(self) {
+                self.inner.set_tail(self.csr_proxy.read_tail()?);
+                if !fits(self) {
+                    break;
+                }
+            }
+            self.push(frame);
+            num += 1;
+        }
+        if num > 0 {
+            self.csr_proxy.write_head(self.inner.head())?;
+        }
+        Ok(num)
     }
 }
 
@@ -145,6 +225,8 @@ pub(crate) struct FrameRxQueue<Dev> {
     rx_queue: SimpleNicRxQueue,
     /// Buffer for storing received frames
     rx_buf: MmapMut,
+    /// Size of a frame slot of the buffer
+    slot_size: usize,
     /// CSR Proxy
     csr_proxy: SimpleNicRxQueueCsrProxy<Dev>,
 }
@@ -154,31 +236,92 @@ impl<Dev> FrameRxQueue<Dev> {
     pub(crate) fn new(
         rx_queue: SimpleNicRxQueue,
         rx_buf: MmapMut,
+        slot_size: usize,
         csr_proxy: SimpleNicRxQueueCsrProxy<Dev>,
     ) -> Self {
         Self {
             rx_queue,
             rx_buf,
+            slot_size,
             csr_proxy,
         }
     }
 }
 
-impl<Dev: Send + 'static> FrameRx for FrameRxQueue<Dev> {
-    #[allow(clippy::arithmetic_side_effects)]
+impl<Dev> FrameRxQueue<Dev> {
+    /// Returns the frame of a descriptor in the receive buffer
     #[allow(clippy::as_conversions)] // converting u32 to usize
-    fn recv_nonblocking(&mut self) -> io::Result<Vec<u8>> {
-        let Some(desc) = self.rx_queue.pop() else {
-            return Err(io::ErrorKind::WouldBlock.into());
-        };
+    fn frame(&self, desc: &SimpleNicRxQueueDesc) -> &[u8] {
         let pos = (desc.slot_idx() as usize)
-            .checked_mul(FRAME_SLOT_SIZE)
+            .checked_mul(self.slot_size)
             .unwrap_or_else(|| unreachable!("invalid index"));
+        let len = (desc.len() as usize).min(self.slot_size);
+        self.rx_buf.slice(pos, len)
+    }
+}
+
+/// A frame in the receive buffer of a `FrameRxQueue`, its slot is given back to the device
+/// once dropped
+pub(crate) struct RxFrame<'a, Dev: DeviceAdaptor> {
+    /// The frame
+    frame: &'a [u8],
+    /// CSR Proxy
+    csr_proxy: &'a SimpleNicRxQueueCsrProxy<Dev>,
+    /// Tail of the queue after the descriptor of the frame
+    tail: u32,
+}
+
+impl<Dev: DeviceAdaptor> Deref for RxFrame<'_, Dev> {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        self.frame
+    }
+}
 
-        let len = desc.len() as usize;
-        let frame = self.rx_buf.get(pos, len);
+impl<Dev: DeviceAdaptor> Drop for RxFrame<'_, Dev> {
+    fn drop(&mut self) {
+        if let Err(err) = self.csr_proxy.write_tail(self.tail) {
+            error!("failed to release simple NIC rx slot: {err}");
+        }
+    }
+}
+
+impl<Dev: DeviceAdaptor + Send + 'static> FrameRx for FrameRxQueue<Dev> {
+    type Frame<'a> = RxFrame<'a, Dev>;
+
+    fn recv_nonblocking(&mut self) -> io::Result<RxFrame<'_, Dev>> {
+        let Some(desc) = self.rx_queue.pop() else {
+            return Err(io::ErrorKind::WouldBlock.into());
+        };
+        Ok(RxFrame {
+            frame: self.frame(&desc),
+            csr_proxy: &self.csr_proxy,
+            tail: self.rx_queue.tail(),
+        })
+    }
 
-        Ok(frame)
+    /// Passes the frames in place to `sink`, the tail CSR is written once for all of them
+    fn recv_many<F>(&mut self, max: usize, mut sink: F) -> io::Result<usize>
+    where
+        F: FnMut(&[u8]) -> io::Result<()>,
+    {
+        let mut num: usize = 0;
+        let mut result = Ok(());
+        while num < max {
+            let Some(desc) = self.rx_queue.pop() else {
+                break;
+            };
+            num = num.saturating_add(1);
+            result = sink(self.frame(&desc));
+            if result.is_err() {
+                break;
+            }
+        }
+        if num > 0 {
+            self.csr_proxy.write_tail(self.rx_queue.tail())?;
+        }
+        result.map(|()| num)
     }
 }
 
@@ -188,20 +331,37 @@ struct TxWorker<Tx> {
     dev: Arc<tun::Device>,
     /// Tx for transmitting frames to remote
     frame_tx: Tx,
+    /// Size of a frame slot of the tx buffer, the largest frame sent
+    slot_size: usize,
+    /// Whether the frames of the device carry virtio net headers
+    offload: bool,
     /// Flag to signal worker shutdown
     shutdown: Arc<AtomicBool>,
 }
 
 impl<Tx: FrameTx + Send + 'static> TxWorker<Tx> {
     /// Creates a new `TxWorker`
-    fn new(dev: Arc<tun::Device>, frame_tx: Tx, shutdown: Arc<AtomicBool>) -> Self {
+    fn new(
+        dev: Arc<tun::Device>,
+        frame_tx: Tx,
+        slots: SimpleNicConfig,
+        shutdown: Arc<AtomicBool>,
+    ) -> Self {
         Self {
             dev,
             frame_tx,
+            slot_size: slots.slot_size,
+            offload: slots.offload,
             shutdown,
         }
     }
 
+    /// Size of the buffer a frame of the tap device is read into, one byte more than a slot
+    /// to tell the frames that don't fit in a slot
+    fn recv_slot_size(&self) -> usize {
+        self.slot_size.saturating_add(1)
+    }
+
     /// Build the descriptor from the given buffer
     #[allow(clippy::as_conversions)] // convert *const u8 to u64 is safe
     fn build_desc(buf: &[u8]) -> Option<SimpleNicTxQueueDesc> {
@@ -209,11 +369,87 @@ impl<Tx: FrameTx + Send + 'static> TxWorker<Tx> {
         Some(SimpleNicTxQueueDesc::new(buf.as_ptr() as u64, len))
     }
 
-    /// Process a single frame by receiving from device and pushing to tx queue
-    #[allow(clippy::indexing_slicing)] // safe for indexing the buffer
-    fn process_frame(&mut self, buf: &mut [u8]) -> io::Result<()> {
-        let n = self.dev.recv(buf)?;
-        self.frame_tx.send(&buf[..n])
+    /// Returns whether a frame can be received from the device without blocking
+    #[allow(unsafe_code)]
+    fn readable(&self) -> bool {
+        let mut fd = libc::pollfd {
+            fd: self.dev.as_raw_fd(),
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        // SAFETY: `fd` is a valid `pollfd` for the duration of the call
+        unsafe { libc::poll(&mut fd, 1, 0) > 0 }
+    }
+
+    /// Process a batch of frames by receiving from device and pushing to tx queue. Blocks for
+    /// the first frame, and adds the frames already waiting on the device, up to `TX_BATCH`.
+    ///
+    /// Frames larger than a slot are dropped, they would be sent truncated otherwise.
+    fn process_frames(&mut self, buf: &mut [u8]) -> io::Result<()> {
+        let recv_slot_size = self.recv_slot_size();
+        let mut lens = [0; TX_BATCH];
+        let mut num_frames = 0;
+        let mut first = true;
+        while let (Some(slot), Some(len)) = (
+            buf.chunks_mut(recv_slot_size).nth(num_frames),
+            lens.get_mut(num_frames),
+        ) {
+            if !first && !self.readable() {
+                break;
+            }
+            first = false;
+            let n = self.dev.recv(slot)?;
+            if n > self.slot_size {
+                debug!("dropped a frame larger than a simple NIC slot");
+                continue;
+            }
+            *len = n;
+            num_frames = num_frames.saturating_add(1);
+        }
+        if num_frames == 0 {
+            return Ok(());
+        }
+        let mut frames: [&[u8]; TX_BATCH] = [&[]; TX_BATCH];
+        for ((frame, slot), len) in frames.iter_mut().zip(buf.chunks(recv_slot_size)).zip(lens) {
+            *frame = slot.get(..len).unwrap_or(slot);
+        }
+        self.frame_tx
+            .send_batch(frames.get(..num_frames).unwrap_or_default())
+    }
+
+    /// Process the frames of a device carrying virtio net headers. Blocks for the first frame,
+    /// and adds the frames already waiting on the device, up to `TX_BATCH` reads. Each frame is
+    /// cut into frames fitting a slot with their checksums filled in, which are queued
+    /// `TX_BATCH` per doorbell.
+    fn process_offloaded(
+        &mut self,
+        buf: &mut [u8],
+        out: &mut Vec<u8>,
+        lens: &mut Vec<usize>,
+    ) -> io::Result<()> {
+        out.clear();
+        lens.clear();
+        for i in 0..TX_BATCH {
+            if i > 0 && !self.readable() {
+                break;
+            }
+            let n = self.dev.recv(buf)?;
+            if !offload::segment(buf.get(..n).unwrap_or_default(), self.slot_size, out, lens) {
+                debug!("dropped a malformed or oversized frame of the tap device");
+            }
+        }
+        let mut rest = out.as_slice();
+        for batch in lens.chunks(TX_BATCH) {
+            let mut frames: [&[u8]; TX_BATCH] = [&[]; TX_BATCH];
+            for (frame, &len) in frames.iter_mut().zip(batch) {
+                let (head, tail) = rest.split_at(len.min(rest.len()));
+                *frame = head;
+                rest = tail;
+            }
+            self.frame_tx
+                .send_batch(frames.get(..batch.len()).unwrap_or_default())?;
+        }
+        Ok(())
     }
 
     /// Spawns the worker thread and returns its handle
@@ -221,9 +457,20 @@ impl<Tx: FrameTx + Send + 'static> TxWorker<Tx> {
         thread::Builder::new()
             .name("simple-nic-tx-worker".into())
             .spawn(move || {
-                let mut buf = vec![0; FRAME_SLOT_SIZE];
+                let mut buf = if self.offload {
+                    vec![0; VNET_HDR_LEN + MAX_SUPER_FRAME_LEN]
+                } else {
+                    vec![0; self.recv_slot_size() * TX_BATCH]
+                };
+                let mut out = Vec::new();
+                let mut lens = Vec::new();
                 while !self.shutdown.load(Ordering::Relaxed) {
-                    if let Err(err) = self.process_frame(&mut buf) {
+                    let result = if self.offload {
+                        self.process_offloaded(&mut buf, &mut out, &mut lens)
+                    } else {
+                        self.process_frames(&mut buf)
+                    };
+                    if let Err(err) = result {
                         error!("Tx processing error: {err}");
                         return Err(err);
                     }
@@ -240,16 +487,19 @@ struct RxWorker<Rx> {
     dev: Arc<tun::Device>,
     /// Rx for receiving frames from remote
     frame_rx: Rx,
+    /// Whether the frames of the device carry virtio net headers
+    offload: bool,
     /// Flag to signal worker shutdown
     shutdown: Arc<AtomicBool>,
 }
 
 impl<Rx: FrameRx + Send + 'static> RxWorker<Rx> {
     /// Creates a new `RxWorker`
-    fn new(dev: Arc<tun::Device>, frame_rx: Rx, shutdown: Arc<AtomicBool>) -> Self {
+    fn new(dev: Arc<tun::Device>, frame_rx: Rx, offload: bool, shutdown: Arc<AtomicBool>) -> Self {
         Self {
             dev,
             frame_rx,
+            offload,
             shutdown,
         }
     }
@@ -259,22 +509,32 @@ impl<Rx: FrameRx + Send + 'static> RxWorker<Rx> {
         thread::Builder::new()
             .name("simple-nic-rx-worker".into())
             .spawn(move || {
+                let mut coalescer = self.offload.then(RxCoalescer::new);
                 while !self.shutdown.load(Ordering::Relaxed) {
-                    let frame = match self.frame_rx.recv_nonblocking() {
-                        Ok(frame) => frame,
-                        Err(err) if matches!(err.kind(), io::ErrorKind::WouldBlock) => {
-                            thread::yield_now();
-                            continue;
+                    // Frames are written to the tun device straight from the receive buffer
+                    let dev = &self.dev;
+                    let result = match coalescer.as_mut() {
+                        Some(coalescer) => {
+                            let fd = dev.as_raw_fd();
+                            let mut sink = |hdr: &[u8; VNET_HDR_LEN], frame: &[u8]| {
+                                offload::write_frame(fd, hdr, frame)
+                            };
+                            // A super-frame doesn't outlive the batch of its segments
+                            self.frame_rx
+                                .recv_many(RX_BATCH, |frame| coalescer.push(frame, &mut sink))
+                                .and_then(|num| coalescer.flush(&mut sink).map(|()| num))
                         }
+                        None => self
+                            .frame_rx
+                            .recv_many(RX_BATCH, |frame| dev.send(frame).map(|_| ())),
+                    };
+                    match result {
+                        Ok(0) => thread::yield_now(),
+                        Ok(_) => {}
                         Err(err) => {
                             log::error!("Rx processing error: {err}");
                             return Err(err);
                         }
-                    };
-
-                    if let Err(err) = self.dev.send(&frame) {
-                        log::error!("Rx processing error: {err}");
-                        return Err(err);
                     }
                 }
                 Ok(())
@@ -291,6 +551,8 @@ pub(crate) struct SimpleNicWorker<Tx, Rx> {
     frame_tx: Tx,
     /// Rx for receiving frames from remote
     frame_rx: Rx,
+    /// Frame slots of the tx buffer and offload of the device
+    slots: SimpleNicConfig,
     ///// Queue for transmitting frames to the NIC
     //tx_queue: SimpleNicTxQueue,
     ///// Queue for receiving frames from the NIC
@@ -311,12 +573,14 @@ where
         dev: Arc<tun::Device>,
         frame_tx: Tx,
         frame_rx: Rx,
+        slots: SimpleNicConfig,
         shutdown: Arc<AtomicBool>,
     ) -> Self {
         Self {
             dev,
             frame_tx,
             frame_rx,
+            slots,
             shutdown,
         }
     }
@@ -326,9 +590,15 @@ where
         let tx_worker = TxWorker::new(
             Arc::clone(&self.dev),
             self.frame_tx,
+            self.slots,
             Arc::clone(&self.shutdown),
         );
-        let rx_worker = RxWorker::new(Arc::clone(&self.dev), self.frame_rx, self.shutdown);
+        let rx_worker = RxWorker::new(
+            Arc::clone(&self.dev),
+            self.frame_rx,
+            self.slots.offload,
+            self.shutdown,
+        );
 
         SimpleNicQueueHandle {
             tx: tx_worker.spawn(),
@@ -0,0 +1,680 @@
+use std::{
+    collections::{HashMap, VecDeque},
+    io,
+    net::{Ipv4Addr, SocketAddr, SocketAddrV4, UdpSocket},
+    os::fd::{AsRawFd, FromRawFd, OwnedFd},
+    ptr,
+};
+
+use ibverbs_sys::ibv_send_wr;
+use log::{debug, error};
+
+use crate::{
+    error::{RdmaError, Result},
+    rdma_utils::types::{RecvWr, SendWr, SendWrBase},
+    workers::{completion::Completion, send::WorkReqOpCode},
+};
+
+use super::recv_chan::qpn_to_port;
+
+/// Length of the GRH at the start of the receive buffers of UD QPs
+pub(crate) const GRH_LEN: u32 = 40;
+
+/// Maximum payload of a datagram, a single path MTU
+pub(crate) const UD_MAX_MSG: u32 = 4096;
+
+/// Length of the header preceding the payload of a datagram
+const HEADER_LEN: usize = 16;
+
+/// Port of the datagrams sent to a multicast group, below the ports of the QPs
+const MCAST_PORT: u16 = 59_999;
+
+const FLAG_IMM: u32 = 1;
+const FLAG_SOLICITED: u32 = 1 << 1;
+
+/// Bit of a WR `remote_qkey` selecting the Q_Key of the QP instead
+const QKEY_FROM_QP: u32 = 1 << 31;
+
+/// Header of a datagram, the DETH and the immediate data of the message
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+struct DatagramHeader {
+    src_qpn: u32,
+    qkey: u32,
+    imm: Option<u32>,
+    solicited: bool,
+}
+
+impl DatagramHeader {
+    fn to_bytes(self) -> [u8; HEADER_LEN] {
+        let mut flags = 0;
+        if self.imm.is_some() {
+            flags |= FLAG_IMM;
+        }
+        if self.solicited {
+            flags |= FLAG_SOLICITED;
+        }
+        let mut bytes = [0; HEADER_LEN];
+        for (chunk, word) in
+            bytes
+                .chunks_exact_mut(4)
+                .zip([self.src_qpn, self.qkey, self.imm.unwrap_or(0), flags])
+        {
+            chunk.copy_from_slice(&word.to_le_bytes());
+        }
+        bytes
+    }
+
+    fn from_bytes(bytes: &[u8]) -> Option<Self> {
+        let word = |i: usize| {
+            bytes
+                .get(i * 4..i * 4 + 4)
+                .and_then(|x| x.try_into().ok())
+                .map(u32::from_le_bytes)
+        };
+        let flags = word(3)?;
+        Some(Self {
+            src_qpn: word(0)?,
+            qkey: word(1)?,
+            imm: (flags & FLAG_IMM != 0).then_some(word(2)?),
+            solicited: flags & FLAG_SOLICITED != 0,
+        })
+    }
+}
+
+/// A send WR of a UD QP, along with its destination
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct UdSendWr {
+    pub(crate) base: SendWrBase,
+    /// Handle of the address handle of the destination
+    pub(crate) ah: u32,
+    pub(crate) remote_qpn: u32,
+    pub(crate) remote_qkey: u32,
+}
+
+impl UdSendWr {
+    #[allow(unsafe_code)]
+    pub(crate) fn new(wr: ibv_send_wr) -> Result<Self> {
+        let SendWr::Send(base) = SendWr::new(wr)? else {
+            return Err(RdmaError::InvalidInput(
+                "UD QPs only support send operations".into(),
+            ));
+        };
+        // SAFETY: the ud field is valid for the WRs of UD QPs
+        let ud = unsafe { wr.wr.ud };
+        // SAFETY: the AH is created by `ibv_create_ah` and alive while the WR is posted
+        let ah = unsafe { ud.ah.as_ref() }
+            .ok_or(RdmaError::InvalidInput("Missing address handle".into()))?;
+
+        Ok(Self {
+            base,
+            ah: ah.handle,
+            remote_qpn: ud.remote_qpn,
+            remote_qkey: ud.remote_qkey,
+        })
+    }
+}
+
+/// Address handles of a context, resolved to the IPv4 address of their destination
+#[derive(Debug, Default)]
+pub(crate) struct AhTable {
+    next_handle: u32,
+    dests: HashMap<u32, Ipv4Addr>,
+}
+
+impl AhTable {
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    /// Creates an address handle to `dest`, returns its handle
+    pub(crate) fn create(&mut self, dest: Ipv4Addr) -> u32 {
+        let handle = self.next_handle;
+        self.next_handle = self.next_handle.wrapping_add(1);
+        let _ignore = self.dests.insert(handle, dest);
+        handle
+    }
+
+    /// Destroys an address handle, returns `false` if it does not exist
+    pub(crate) fn destroy(&mut self, handle: u32) -> bool {
+        self.dests.remove(&handle).is_some()
+    }
+
+    pub(crate) fn get(&self, handle: u32) -> Option<Ipv4Addr> {
+        self.dests.get(&handle).copied()
+    }
+}
+
+struct UdQp {
+    socket: UdpSocket,
+    /// Card address the socket is bound to
+    ip: Ipv4Addr,
+    qkey: u32,
+    recv_wrs: VecDeque<RecvWr>,
+}
+
+/// A multicast group joined by some UD QPs of the context
+struct McastGroup {
+    /// Socket bound to the group, receiving one copy of each datagram for all attached QPs
+    socket: UdpSocket,
+    qpns: Vec<u32>,
+}
+
+/// Unreliable datagram QPs of a context.
+///
+/// The device has no UD transport, the datagrams of a UD QP are carried by a non-blocking
+/// UDP socket bound to the card address, at the port of the post receive channel of the QP.
+/// Datagrams are neither acknowledged nor retransmitted, so UD QPs have no PSN tracking or
+/// retransmission state: a send completes once its datagram is handed to the socket, and
+/// the datagrams are received into the posted receive WRs when the CQs are polled.
+///
+/// A multicast group is an IPv4 multicast address, joined on the card address of its QPs.
+/// A datagram sent to a group is replicated by the network to every host that joined it,
+/// and received once per context, then copied to the posted receive WR of each attached QP.
+#[derive(Default)]
+pub(crate) struct UdQps {
+    qps: HashMap<u32, UdQp>,
+    groups: HashMap<Ipv4Addr, McastGroup>,
+    /// Staging buffer of the sent and received datagrams
+    buf: Vec<u8>,
+}
+
+impl UdQps {
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    /// Binds the socket of a new UD QP on the card address `ip`
+    pub(crate) fn create(&mut self, qpn: u32, ip: Ipv4Addr) -> io::Result<()> {
+        let socket = UdpSocket::bind((ip, qpn_to_port(qpn)))?;
+        socket.set_nonblocking(true)?;
+        set_multicast_if(&socket, ip)?;
+        debug!("ud qp {qpn} bound to {:?}", socket.local_addr());
+        let qp = UdQp {
+            socket,
+            ip,
+            qkey: 0,
+            recv_wrs: VecDeque::new(),
+        };
+        let _ignore = self.qps.insert(qpn, qp);
+        Ok(())
+    }
+
+    pub(crate) fn destroy(&mut self, qpn: u32) {
+        let _ignore = self.qps.remove(&qpn);
+        self.groups.retain(|_, group| {
+            group.qpns.retain(|&x| x != qpn);
+            !group.qpns.is_empty()
+        });
+    }
+
+    /// Attaches a UD QP to the multicast group `group`, joining the group on the card address
+    /// of the QP if no other QP of the context is attached to it
+    pub(crate) fn attach_mcast(&mut self, qpn: u32, group: Ipv4Addr) -> Result<()> {
+        if !group.is_multicast() {
+            return Err(RdmaError::InvalidInput(format!(
+                "{group} is not a multicast address"
+            )));
+        }
+        let ip = self
+            .qps
+            .get(&qpn)
+            .ok_or(RdmaError::QpError(format!("UD QP {qpn} not found")))?
+            .ip;
+        if let Some(joined) = self.groups.get_mut(&group) {
+            if !joined.qpns.contains(&qpn) {
+                joined.qpns.push(qpn);
+            }
+            return Ok(());
+        }
+        let socket = bind_group(group)?;
+        socket.join_multicast_v4(&group, &ip)?;
+        debug!("ud qp {qpn} joined {group} on {ip}");
+        let _ignore = self.groups.insert(
+            group,
+            McastGroup {
+                socket,
+                qpns: vec![qpn],
+            },
+        );
+        Ok(())
+    }
+
+    /// Detaches a UD QP from the multicast group `group`, the group is left once no QP of the
+    /// context is attached to it
+    pub(crate) fn detach_mcast(&mut self, qpn: u32, group: Ipv4Addr) -> Result<()> {
+        let joined = self
+            .groups
+            .get_mut(&group)
+            .filter(|joined| joined.qpns.contains(&qpn))
+            .ok_or(RdmaError::InvalidInput(format!(
+                "UD QP {qpn} is not attached to {group}"
+            )))?;
+        joined.qpns.retain(|&x| x != qpn);
+        if joined.qpns.is_empty() {
+            let _ignore = self.groups.remove(&group);
+            debug!("left {group}");
+        }
+        Ok(())
+    }
+
+    pub(crate) fn contains(&self, qpn: u32) -> bool {
+        self.qps.contains_key(&qpn)
+    }
+
+    /// Returns `true` if no UD QP is created
+    pub(crate) fn is_empty(&self) -> bool {
+        self.qps.is_empty()
+    }
+
+    pub(crate) fn set_qkey(&mut self, qpn: u32, qkey: u32) -> Result<()> {
+        self.get_mut(qpn)?.qkey = qkey;
+        Ok(())
+    }
+
+    pub(crate) fn post_recv(&mut self, qpn: u32, wr: RecvWr) -> Result<()> {
+        self.get_mut(qpn)?.recv_wrs.push_back(wr);
+        Ok(())
+    }
+
+    /// Sends the message of `wr` to its remote QP at `dest`
+    #[allow(unsafe_code, clippy::as_conversions)]
+    pub(crate) fn send(&mut self, qpn: u32, dest: Ipv4Addr, wr: &UdSendWr) -> Result<()> {
+        if wr.base.length > UD_MAX_MSG {
+            return Err(RdmaError::InvalidInput(format!(
+                "UD message length {} exceeds {UD_MAX_MSG}",
+                wr.base.length
+            )));
+        }
+        let qp = self
+            .qps
+            .get(&qpn)
+            .ok_or(RdmaError::QpError(format!("UD QP {qpn} not found")))?;
+        let qkey = if wr.remote_qkey & QKEY_FROM_QP != 0 {
+            qp.qkey
+        } else {
+            wr.remote_qkey
+        };
+        let header = DatagramHeader {
+            src_qpn: qpn,
+            qkey,
+            imm: (wr.base.opcode == WorkReqOpCode::SendWithImm).then_some(wr.base.imm_data),
+            solicited: wr.base.send_flags & ibverbs_sys::ibv_send_flags::IBV_SEND_SOLICITED.0 != 0,
+        };
+        self.buf.clear();
+        self.buf.extend_from_slice(&header.to_bytes());
+        for sge in wr.base.sg_list.as_slice() {
+            // SAFETY: the SGEs are local buffers of the WR, readable until it completes
+            let data =
+                unsafe { std::slice::from_raw_parts(sge.addr as *const u8, sge.length as usize) };
+            self.buf.extend_from_slice(data);
+        }
+        // The remote QPN of a multicast send is the multicast QPN, the datagram is delivered
+        // to every QP attached to the group
+        let port = if dest.is_multicast() {
+            MCAST_PORT
+        } else {
+            qpn_to_port(wr.remote_qpn)
+        };
+        let _len = qp
+            .socket
+            .send_to(&self.buf, SocketAddrV4::new(dest, port))?;
+
+        Ok(())
+    }
+
+    /// Receives the datagrams waiting on the sockets of the QPs and of the multicast groups
+    /// that have posted receive WRs, returns their completions along with their solicited
+    /// flags.
+    ///
+    /// Datagrams with a wrong Q_Key, or that do not fit in the next receive WR, are dropped.
+    /// A multicast datagram is dropped by the attached QPs without a posted receive WR, and
+    /// is not received by the QP that sent it.
+    pub(crate) fn poll(&mut self) -> Vec<(Completion, bool)> {
+        let mut completions = Vec::new();
+        self.buf.resize(HEADER_LEN + UD_MAX_MSG as usize, 0);
+        for (&qpn, qp) in &mut self.qps {
+            while !qp.recv_wrs.is_empty() {
+                let len = match qp.socket.recv(&mut self.buf) {
+                    Ok(len) => len,
+                    Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                    Err(err) => {
+                        error!("failed to receive datagram of qp {qpn}: {err}");
+                        break;
+                    }
+                };
+                let Some(header) = DatagramHeader::from_bytes(&self.buf) else {
+                    continue;
+                };
+                let payload = self.buf.get(HEADER_LEN..len).unwrap_or_default();
+                completions.extend(receive(qpn, qp, header, payload));
+            }
+        }
+        for (group, joined) in &self.groups {
+            while joined
+                .qpns
+                .iter()
+                .any(|qpn| self.qps.get(qpn).is_some_and(|qp| !qp.recv_wrs.is_empty()))
+            {
+                let (len, src) = match joined.socket.recv_from(&mut self.buf) {
+                    Ok(x) => x,
+                    Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                    Err(err) => {
+                        error!("failed to receive datagram of group {group}: {err}");
+                        break;
+                    }
+                };
+                let Some(header) = DatagramHeader::from_bytes(&self.buf) else {
+                    continue;
+                };
+                let payload = self.buf.get(HEADER_LEN..len).unwrap_or_default();
+                for &qpn in &joined.qpns {
+                    let Some(qp) = self.qps.get_mut(&qpn) else {
+                        continue;
+                    };
+                    let sender = SocketAddrV4::new(qp.ip, qpn_to_port(qpn));
+                    let looped = header.src_qpn == qpn && src == SocketAddr::V4(sender);
+                    if looped || qp.recv_wrs.is_empty() {
+                        continue;
+                    }
+                    completions.extend(receive(qpn, qp, header, payload));
+                }
+            }
+        }
+
+        completions
+    }
+
+    fn get_mut(&mut self, qpn: u32) -> Result<&mut UdQp> {
+        self.qps
+            .get_mut(&qpn)
+            .ok_or(RdmaError::QpError(format!("UD QP {qpn} not found")))
+    }
+}
+
+/// Receives a datagram into the next receive WR of `qp`, returns its completion and solicited
+/// flag, or `None` if it is dropped
+#[allow(unsafe_code, clippy::as_conversions)]
+fn receive(
+    qpn: u32,
+    qp: &mut UdQp,
+    header: DatagramHeader,
+    payload: &[u8],
+) -> Option<(Completion, bool)> {
+    if header.qkey != qp.qkey {
+        debug!("qp {qpn} dropped datagram with qkey {:x}", header.qkey);
+        return None;
+    }
+    let byte_len = GRH_LEN + payload.len() as u32;
+    let wr = qp.recv_wrs.front().copied()?;
+    if byte_len > wr.length {
+        error!(
+            "qp {qpn} dropped datagram of {byte_len} bytes, receive WR of {} bytes",
+            wr.length
+        );
+        return None;
+    }
+    let _ignore = qp.recv_wrs.pop_front();
+    // SAFETY: the buffer of a posted receive WR is owned by the WR until it completes, and
+    // holds at least `byte_len` bytes
+    unsafe {
+        let dst = wr.addr as *mut u8;
+        dst.write_bytes(0, GRH_LEN as usize);
+        dst.add(GRH_LEN as usize)
+            .copy_from_nonoverlapping(payload.as_ptr(), payload.len());
+    }
+    let completion = Completion::RecvDatagram {
+        qpn,
+        wr_id: wr.wr_id,
+        imm: header.imm,
+        byte_len,
+        src_qp: header.src_qpn,
+    };
+    Some((completion, header.solicited))
+}
+
+/// Sends the multicast datagrams of `socket` through the interface of the card address `ip`
+#[allow(unsafe_code, clippy::as_conversions)]
+fn set_multicast_if(socket: &UdpSocket, ip: Ipv4Addr) -> io::Result<()> {
+    let addr = libc::in_addr {
+        s_addr: u32::from(ip).to_be(),
+    };
+    // SAFETY: `addr` is a valid `in_addr` for the duration of the call
+    let ret = unsafe {
+        libc::setsockopt(
+            socket.as_raw_fd(),
+            libc::IPPROTO_IP,
+            libc::IP_MULTICAST_IF,
+            ptr::from_ref(&addr).cast(),
+            size_of::<libc::in_addr>() as libc::socklen_t,
+        )
+    };
+    if ret != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+/// Binds a non-blocking socket to the multicast group `group`. The address is reused, as
+/// each context of the host joining the group binds its own socket to it.
+#[allow(unsafe_code, clippy::as_conversions)]
+fn bind_group(group: Ipv4Addr) -> io::Result<UdpSocket> {
+    // SAFETY: FFI call, the descriptor is owned by the returned socket
+    let fd = unsafe {
+        libc::socket(
+            libc::AF_INET,
+            libc::SOCK_DGRAM | libc::SOCK_NONBLOCK | libc::SOCK_CLOEXEC,
+            0,
+        )
+    };
+    if fd < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    // SAFETY: `fd` is a new socket owned by nothing else
+    let socket = UdpSocket::from(unsafe { OwnedFd::from_raw_fd(fd) });
+    let one: libc::c_int = 1;
+    let addr = libc::sockaddr_in {
+        sin_family: libc::AF_INET as libc::sa_family_t,
+        sin_port: MCAST_PORT.to_be(),
+        sin_addr: libc::in_addr {
+            s_addr: u32::from(group).to_be(),
+        },
+        sin_zero: [0; 8],
+    };
+    // SAFETY: `one` is a valid `c_int` for the duration of the call
+    let ret = unsafe {
+        libc::setsockopt(
+            fd,
+            libc::SOL_SOCKET,
+            libc::SO_REUSEADDR,
+            ptr::from_ref(&one).cast(),
+            size_of::<libc::c_int>() as libc::socklen_t,
+        )
+    };
+    if ret != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    // SAFETY: `addr` is a valid `sockaddr_in` for the duration of the call
+    let ret = unsafe {
+        libc::bind(
+            fd,
+            ptr::from_ref(&addr).cast(),
+            size_of::<libc::sockaddr_in>() as libc::socklen_t,
+        )
+    };
+    if ret != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(socket)
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::rdma_utils::types::SgList;
+
+    use super::*;
+
+    #[test]
+    fn datagram_header_roundtrip() {
+        let header = DatagramHeader {
+            src_qpn: 0x1234,
+            qkey: 0x11,
+            imm: Some(7),
+            solicited: true,
+        };
+        assert_eq!(DatagramHeader::from_bytes(&header.to_bytes()), Some(header));
+        let header = DatagramHeader {
+            imm: None,
+            solicited: false,
+            ..header
+        };
+        assert_eq!(DatagramHeader::from_bytes(&header.to_bytes()), Some(header));
+        assert!(DatagramHeader::from_bytes(&[0; 8]).is_none());
+    }
+
+    #[test]
+    #[allow(clippy::as_conversions, clippy::indexing_slicing, clippy::unwrap_used)]
+    fn datagrams_are_received_into_posted_wrs() {
+        let (src, dst) = (5 << 8, 6 << 8);
+        let ip = Ipv4Addr::LOCALHOST;
+        let mut qps = UdQps::new();
+        qps.create(src, ip).unwrap();
+        qps.create(dst, ip).unwrap();
+        qps.set_qkey(dst, 0x11).unwrap();
+        let payload = *b"datagram";
+        let base = SendWrBase::new_with_sg_list(
+            1,
+            0,
+            SgList::single(payload.as_ptr() as u64, payload.len() as u32, 0),
+            9,
+            WorkReqOpCode::SendWithImm,
+        )
+        .unwrap();
+        let wr = UdSendWr {
+            base,
+            ah: 0,
+            remote_qpn: dst,
+            remote_qkey: 0x11,
+        };
+        qps.send(src, ip, &wr).unwrap();
+        qps.send(
+            src,
+            ip,
+            &UdSendWr {
+                remote_qkey: 0x22,
+                ..wr
+            },
+        )
+        .unwrap();
+        qps.send(src, ip, &wr).unwrap();
+        // Nothing is received without a posted receive WR
+        assert!(qps.poll().is_empty());
+
+        let mut buf = [0xffu8; 64];
+        let recv_wr = RecvWr {
+            wr_id: 3,
+            addr: buf.as_mut_ptr() as u64,
+            length: buf.len() as u32,
+            lkey: 0,
+        };
+        qps.post_recv(dst, recv_wr).unwrap();
+        qps.post_recv(
+            dst,
+            RecvWr {
+                wr_id: 4,
+                ..recv_wr
+            },
+        )
+        .unwrap();
+        let mut completions = Vec::new();
+        for _ in 0..100 {
+            completions.extend(qps.poll());
+            if completions.len() == 2 {
+                break;
+            }
+            std::thread::sleep(std::time::Duration::from_millis(1));
+        }
+        assert_eq!(completions.len(), 2);
+        let (completion, solicited) = completions[0];
+        assert!(!solicited);
+        assert!(matches!(
+            completion,
+            Completion::RecvDatagram {
+                qpn,
+                wr_id: 3,
+                imm: Some(9),
+                byte_len: 48,
+                src_qp,
+            } if qpn == dst && src_qp == src
+        ));
+        assert!(buf[..GRH_LEN as usize].iter().all(|&x| x == 0));
+        assert_eq!(&buf[GRH_LEN as usize..48], &payload);
+    }
+
+    #[test]
+    #[allow(clippy::as_conversions, clippy::indexing_slicing, clippy::unwrap_used)]
+    fn multicast_datagrams_are_received_by_every_attached_qp() {
+        let (src, dst0, dst1) = (5 << 8, 6 << 8, 7 << 8);
+        let ip = Ipv4Addr::LOCALHOST;
+        let group = Ipv4Addr::new(239, 0, 0, 7);
+        let mut qps = UdQps::new();
+        for qpn in [src, dst0, dst1] {
+            qps.create(qpn, ip).unwrap();
+            qps.set_qkey(qpn, 0x11).unwrap();
+            qps.attach_mcast(qpn, group).unwrap();
+        }
+        assert!(qps.attach_mcast(src, Ipv4Addr::new(10, 0, 0, 1)).is_err());
+        qps.detach_mcast(dst1, group).unwrap();
+        assert!(qps.detach_mcast(dst1, group).is_err());
+        qps.attach_mcast(dst1, group).unwrap();
+
+        let mut bufs = [[0u8; 64]; 3];
+        for (qpn, buf) in [src, dst0, dst1].into_iter().zip(&mut bufs) {
+            let recv_wr = RecvWr {
+                wr_id: u64::from(qpn),
+                addr: buf.as_mut_ptr() as u64,
+                length: buf.len() as u32,
+                lkey: 0,
+            };
+            qps.post_recv(qpn, recv_wr).unwrap();
+        }
+        let payload = *b"update";
+        let base = SendWrBase::new_with_sg_list(
+            1,
+            0,
+            SgList::single(payload.as_ptr() as u64, payload.len() as u32, 0),
+            0,
+            WorkReqOpCode::Send,
+        )
+        .unwrap();
+        let wr = UdSendWr {
+            base,
+            ah: 0,
+            remote_qpn: 0xff_ffff,
+            remote_qkey: 0x11,
+        };
+        qps.send(src, group, &wr).unwrap();
+        let mut completions = Vec::new();
+        for _ in 0..100 {
+            completions.extend(qps.poll());
+            if !completions.is_empty() {
+                break;
+            }
+            std::thread::sleep(std::time::Duration::from_millis(1));
+        }
+        // Received once by the attached QPs other than the sender
+        let qpns: Vec<_> = completions
+            .iter()
+            .map(|(completion, _)| match *completion {
+                Completion::RecvDatagram { qpn, src_qp, .. } if src_qp == src => qpn,
+                _ => 0,
+            })
+            .collect();
+        assert_eq!(qpns, [dst0, dst1]);
+        assert_eq!(&bufs[1][GRH_LEN as usize..46], &payload);
+
+        qps.destroy(dst0);
+        qps.destroy(dst1);
+        qps.destroy(src);
+        assert!(qps.groups.is_empty());
+    }
+}
@@ -0,0 +1,174 @@
+use std::collections::{HashMap, HashSet};
+
+use ibverbs_sys::ibv_send_wr;
+
+use crate::{
+    error::{RdmaError, Result},
+    rdma_utils::types::SendWr,
+};
+
+/// A send WR of a XRC INI QP, along with the SRQ receiving it
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct XrcSendWr {
+    pub(crate) wr: SendWr,
+    /// SRQ number of the XRC SRQ behind the TGT QP the INI QP is connected to
+    pub(crate) remote_srqn: u32,
+}
+
+impl XrcSendWr {
+    #[allow(unsafe_code)]
+    pub(crate) fn new(wr: ibv_send_wr) -> Result<Self> {
+        // SAFETY: the xrc field is valid for the WRs of XRC INI QPs
+        let remote_srqn = unsafe { wr.qp_type.xrc.remote_srqn };
+        Ok(Self {
+            wr: SendWr::new(wr)?,
+            remote_srqn,
+        })
+    }
+}
+
+/// A SRQ of a XRC domain
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct XrcSrq {
+    pub(crate) xrcd: u32,
+    /// CQ of the receive completions of the SRQ, whichever TGT QP delivered the message
+    pub(crate) cq: u32,
+}
+
+/// XRC domains of a context.
+///
+/// A XRC INI QP is connected to a single TGT QP of a remote node and each of its WRs names a
+/// SRQ of the domain of that TGT QP, so a process needs one send QP per remote node rather
+/// than one per remote process. The INI and TGT QPs are QPs with contexts, like the DC QPs:
+/// the first WR to a SRQ binds a context of the INI QP to a context of the TGT QP attached
+/// to the SRQ, and the contexts are recycled once idle. The hardware state grows with the
+/// active SRQs of each node, the connections set up by the application with the nodes.
+///
+/// The SRQ number of an XRC SRQ is its handle. A domain belongs to the context that opened
+/// it, it is not shared with the other processes of the node.
+#[derive(Debug, Default)]
+pub(crate) struct XrcDomains {
+    next_handle: u32,
+    domains: HashSet<u32>,
+    /// XRC SRQs keyed by handle
+    srqs: HashMap<u32, XrcSrq>,
+    /// Domain of each TGT QP
+    targets: HashMap<u32, u32>,
+}
+
+impl XrcDomains {
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    /// Opens a domain, returns its handle
+    pub(crate) fn open(&mut self) -> u32 {
+        let handle = self.next_handle;
+        self.next_handle = self.next_handle.wrapping_add(1);
+        let _ignore = self.domains.insert(handle);
+        handle
+    }
+
+    /// Closes a domain, fails while SRQs or TGT QPs of the domain exist
+    pub(crate) fn close(&mut self, xrcd: u32) -> Result<()> {
+        if !self.domains.contains(&xrcd) {
+            return Err(RdmaError::NotFound(format!("XRCD {xrcd} not found")));
+        }
+        if self.srqs.values().any(|x| x.xrcd == xrcd) || self.targets.values().any(|&x| x == xrcd) {
+            return Err(RdmaError::InvalidInput(format!(
+                "XRCD {xrcd} still has SRQs or TGT QPs"
+            )));
+        }
+        let _ignore = self.domains.remove(&xrcd);
+        Ok(())
+    }
+
+    pub(crate) fn contains(&self, xrcd: u32) -> bool {
+        self.domains.contains(&xrcd)
+    }
+
+    /// Records the SRQ `handle` of the domain, completing to `cq`
+    pub(crate) fn insert_srq(&mut self, handle: u32, srq: XrcSrq) -> Result<()> {
+        if !self.contains(srq.xrcd) {
+            return Err(RdmaError::NotFound(format!("XRCD {} not found", srq.xrcd)));
+        }
+        let _ignore = self.srqs.insert(handle, srq);
+        Ok(())
+    }
+
+    pub(crate) fn remove_srq(&mut self, handle: u32) {
+        let _ignore = self.srqs.remove(&handle);
+    }
+
+    /// Returns the XRC SRQ of the handle, `None` for the SRQs outside of any domain
+    pub(crate) fn srq(&self, handle: u32) -> Option<XrcSrq> {
+        self.srqs.get(&handle).copied()
+    }
+
+    /// Records the TGT QP `qpn` of the domain
+    pub(crate) fn insert_target(&mut self, qpn: u32, xrcd: u32) -> Result<()> {
+        if !self.contains(xrcd) {
+            return Err(RdmaError::NotFound(format!("XRCD {xrcd} not found")));
+        }
+        let _ignore = self.targets.insert(qpn, xrcd);
+        Ok(())
+    }
+
+    pub(crate) fn remove_target(&mut self, qpn: u32) {
+        let _ignore = self.targets.remove(&qpn);
+    }
+
+    /// Returns the SRQ the TGT QP `qpn` delivers the messages naming `srqn` to
+    pub(crate) fn dispatch(&self, qpn: u32, srqn: u32) -> Result<XrcSrq> {
+        let xrcd = self
+            .targets
+            .get(&qpn)
+            .ok_or(RdmaError::QpError(format!("XRC TGT QP {qpn} not found")))?;
+        self.srq(srqn)
+            .filter(|x| x.xrcd == *xrcd)
+            .ok_or(RdmaError::NotFound(format!(
+                "SRQ {srqn} is not in the XRCD of TGT QP {qpn}"
+            )))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn targets_dispatch_within_their_domain() {
+        let mut domains = XrcDomains::new();
+        let (xrcd0, xrcd1) = (domains.open(), domains.open());
+        let (tgt, srq0, srq1) = (1 << 8, 3, 4);
+        domains.insert_target(tgt, xrcd0).unwrap();
+        domains
+            .insert_srq(srq0, XrcSrq { xrcd: xrcd0, cq: 7 })
+            .unwrap();
+        domains
+            .insert_srq(srq1, XrcSrq { xrcd: xrcd1, cq: 8 })
+            .unwrap();
+        assert_eq!(
+            domains.dispatch(tgt, srq0).unwrap(),
+            XrcSrq { xrcd: xrcd0, cq: 7 }
+        );
+        assert!(domains.dispatch(tgt, srq1).is_err());
+        assert!(domains.dispatch(2 << 8, srq0).is_err());
+        assert!(domains.insert_target(2 << 8, 99).is_err());
+    }
+
+    #[test]
+    fn domains_close_once_unused() {
+        let mut domains = XrcDomains::new();
+        let xrcd = domains.open();
+        domains.insert_srq(3, XrcSrq { xrcd, cq: 0 }).unwrap();
+        domains.insert_target(1 << 8, xrcd).unwrap();
+        assert!(domains.close(xrcd).is_err());
+        domains.remove_srq(3);
+        assert!(domains.close(xrcd).is_err());
+        domains.remove_target(1 << 8);
+        domains.close(xrcd).unwrap();
+        assert!(!domains.contains(xrcd));
+        assert!(domains.close(xrcd).is_err());
+    }
+}
@@ -0,0 +1,363 @@
+use std::{
+    collections::HashMap,
+    ops::Range,
+    sync::{
+        atomic::{fence, AtomicU64, Ordering},
+        Arc,
+    },
+};
+
+use parking_lot::{Mutex, RwLock};
+
+use crate::{rdma_utils::psn::Psn, workers::send::WorkReqOpCode};
+
+/// Length in bytes of the target of an atomic operation
+pub(crate) const ATOMIC_LEN: u32 = 8;
+
+/// Placement types of a flush, as `ibv_placement_type`
+pub(crate) const FLUSH_GLOBAL: u8 = 1 << 0;
+pub(crate) const FLUSH_PERSISTENT: u8 = 1 << 1;
+/// Selectivity level of a flush of the whole MR, as `IBV_FLUSH_MR`
+pub(crate) const FLUSH_MR: u8 = 1;
+
+/// Lines written back by a persistent flush
+#[cfg(target_arch = "x86_64")]
+const CACHE_LINE: u64 = 64;
+
+const ACCESS_REMOTE_WRITE: u8 = ibverbs_sys::ibv_access_flags::IBV_ACCESS_REMOTE_WRITE.0 as u8;
+const ACCESS_REMOTE_ATOMIC: u8 = ibverbs_sys::ibv_access_flags::IBV_ACCESS_REMOTE_ATOMIC.0 as u8;
+
+/// Operands of an atomic WR, as in the `atomic` member of `ibv_send_wr`.
+///
+/// The atomic writes and the flushes carry theirs in the same fields: the value of an atomic
+/// write takes `compare_add`, a flush has its length in `compare_add` and its placement type
+/// and selectivity level in the low bytes of `swap`.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct AtomicOperands {
+    /// Value compared for a compare-and-swap, value added for a fetch-and-add
+    pub(crate) compare_add: u64,
+    /// Value written by a compare-and-swap if the comparison succeeds
+    pub(crate) swap: u64,
+}
+
+impl AtomicOperands {
+    pub(crate) fn new(compare_add: u64, swap: u64) -> Self {
+        Self { compare_add, swap }
+    }
+
+    /// Operands of an atomic write of `value`
+    pub(crate) fn atomic_write(value: u64) -> Self {
+        Self::new(value, 0)
+    }
+
+    /// Operands of a flush of the `len` bytes at the remote address, `len` is ignored at the
+    /// `FLUSH_MR` selectivity level
+    pub(crate) fn flush(len: u64, placement: u8, level: u8) -> Self {
+        Self::new(len, u64::from(placement) | u64::from(level) << 8)
+    }
+
+    #[allow(clippy::as_conversions, clippy::cast_possible_truncation)]
+    fn placement(self) -> u8 {
+        self.swap as u8
+    }
+
+    #[allow(clippy::as_conversions, clippy::cast_possible_truncation)]
+    fn level(self) -> u8 {
+        (self.swap >> 8) as u8
+    }
+
+    /// Applies the operation of `opcode` to `target`, returns the original value
+    fn apply(self, opcode: WorkReqOpCode, target: &AtomicU64) -> Option<u64> {
+        #[allow(clippy::wildcard_enum_match_arm)]
+        match opcode {
+            WorkReqOpCode::AtomicCmpAndSwp => Some(
+                match target.compare_exchange(
+                    self.compare_add,
+                    self.swap,
+                    Ordering::SeqCst,
+                    Ordering::SeqCst,
+                ) {
+                    Ok(x) | Err(x) => x,
+                },
+            ),
+            WorkReqOpCode::AtomicFetchAndAdd => {
+                Some(target.fetch_add(self.compare_add, Ordering::SeqCst))
+            }
+            WorkReqOpCode::AtomicWrite => Some(target.swap(self.compare_add, Ordering::SeqCst)),
+            _ => None,
+        }
+    }
+}
+
+/// A MR the peers may target, with its access flags
+#[derive(Debug, Clone)]
+struct Target {
+    /// Addresses of the MR seen by the peers
+    range: Range<u64>,
+    /// Host address of the start of `range`, which differs from it for zero-based MRs
+    host_addr: u64,
+    access: u8,
+}
+
+impl Target {
+    /// Atomic writes and flushes need remote write access, the atomics remote atomic access
+    fn allows(&self, opcode: WorkReqOpCode) -> bool {
+        let required = match opcode {
+            WorkReqOpCode::AtomicWrite | WorkReqOpCode::Flush => ACCESS_REMOTE_WRITE,
+            _ => ACCESS_REMOTE_ATOMIC,
+        };
+        self.access & required != 0
+    }
+
+    /// Returns the host address of the remote address `raddr` of the MR
+    fn host_addr(&self, raddr: u64) -> u64 {
+        raddr - self.range.start + self.host_addr
+    }
+}
+
+/// State of the atomic operations of a context.
+///
+/// The responder executes the atomic requests of its peers on the CPU, against the memory of
+/// the MRs registered with remote atomic access, and returns the original value in the atomic
+/// ACK. The operations are atomic with each other but not with the DMA writes of the device,
+/// as `IBV_ATOMIC_HCA` allows. The requester writes the original value of an ACK to the
+/// local buffer of its WR before the WR completes.
+///
+/// The atomic writes and the flushes of the peers are executed the same way, against the MRs
+/// registered with remote write access, and are answered with an atomic ACK without a value.
+#[derive(Default, Clone)]
+pub(crate) struct Atomics {
+    /// MRs registered with remote atomic or remote write access, keyed by `rkey`
+    targets: Arc<RwLock<HashMap<u32, Target>>>,
+    /// Local buffers of the atomic WRs waiting for their ACK, keyed by QPN and PSN
+    results: Arc<Mutex<HashMap<(u32, u32), u64>>>,
+}
+
+impl Atomics {
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    /// Allows the requests executed by the responder on the MR `rkey`, as its `access` flags
+    /// permit
+    pub(crate) fn add_target(&self, rkey: u32, addr: u64, length: usize, access: u8) {
+        self.add_mapped_target(rkey, addr, addr, length, access);
+    }
+
+    /// Same as `add_target` for a MR the peers address from `iova`, the offset 0 of a
+    /// zero-based MR, rather than from its host address
+    pub(crate) fn add_mapped_target(
+        &self,
+        rkey: u32,
+        iova: u64,
+        host_addr: u64,
+        length: usize,
+        access: u8,
+    ) {
+        let end = iova.saturating_add(length as u64);
+        let target = Target {
+            range: iova..end,
+            host_addr,
+            access,
+        };
+        let _ignore = self.targets.write().insert(rkey, target);
+    }
+
+    /// Rejects atomic requests on the MR `rkey` from now on
+    pub(crate) fn remove_target(&self, rkey: u32) {
+        let _ignore = self.targets.write().remove(&rkey);
+    }
+
+    /// Executes an atomic request or an atomic write on the 8 bytes at `raddr` of the MR
+    /// `rkey`, or a flush of the MR.
+    ///
+    /// Returns the original value, 0 for a flush, `None` if the target is not aligned or
+    /// outside of a MR registered with the access the request needs.
+    #[allow(unsafe_code, clippy::as_conversions)]
+    pub(crate) fn execute(
+        &self,
+        rkey: u32,
+        raddr: u64,
+        opcode: WorkReqOpCode,
+        operands: AtomicOperands,
+    ) -> Option<u64> {
+        // The lock is held during the operation, so that the MR is not deregistered meanwhile
+        let targets = self.targets.read();
+        let target = targets.get(&rkey).filter(|target| target.allows(opcode))?;
+        let range = &target.range;
+        if opcode == WorkReqOpCode::Flush {
+            let flushed = if operands.level() == FLUSH_MR {
+                range.clone()
+            } else {
+                let end = raddr.checked_add(operands.compare_add)?;
+                if raddr < range.start || end > range.end {
+                    return None;
+                }
+                raddr..end
+            };
+            flush(
+                target.host_addr(flushed.start)..target.host_addr(flushed.end),
+                operands.placement(),
+            );
+            return Some(0);
+        }
+        let end = raddr.checked_add(u64::from(ATOMIC_LEN))?;
+        if raddr % u64::from(ATOMIC_LEN) != 0 || raddr < range.start || end > range.end {
+            return None;
+        }
+        // SAFETY: the target is aligned and within a registered MR of the process, whose
+        // pages stay mapped until the MR is deregistered
+        let target = unsafe { AtomicU64::from_ptr(target.host_addr(raddr) as *mut u64) };
+        operands.apply(opcode, target)
+    }
+
+    /// Records the local buffer the original value of the atomic WR at `psn` is written to
+    pub(crate) fn expect_result(&self, qpn: u32, psn: Psn, laddr: u64) {
+        let _ignore = self.results.lock().insert((qpn, psn.into_inner()), laddr);
+    }
+
+    /// Writes the original value of the atomic WR at `psn` to its local buffer.
+    ///
+    /// Returns `false` if no WR is waiting for the value, for example for the ACK of a
+    /// retransmitted request.
+    #[allow(unsafe_code, clippy::as_conversions)]
+    pub(crate) fn write_result(&self, qpn: u32, psn: Psn, value: u64) -> bool {
+        let Some(laddr) = self.results.lock().remove(&(qpn, psn.into_inner())) else {
+            return false;
+        };
+        // SAFETY: the buffer is the 8 bytes local SGE of the WR, registered with local write
+        // access and owned by the WR until it completes
+        unsafe { (laddr as *mut u64).write_unaligned(value) };
+        true
+    }
+
+    /// Drops the WRs of a destroyed QP waiting for their values
+    pub(crate) fn release_qp(&self, qpn: u32) {
+        self.results.lock().retain(|&(x, _), _| x != qpn);
+    }
+}
+
+/// Makes the bytes of `range` written by the device visible to the CPUs. With
+/// `FLUSH_PERSISTENT` the lines are also written back from the caches, so that they reach the
+/// persistence domain of a persistent memory mapping.
+#[allow(unsafe_code, clippy::as_conversions)]
+#[cfg_attr(not(target_arch = "x86_64"), allow(unused_variables))]
+fn flush(range: Range<u64>, placement: u8) {
+    #[cfg(target_arch = "x86_64")]
+    if placement & FLUSH_PERSISTENT != 0 {
+        let start = range.start & !(CACHE_LINE - 1);
+        for line in (start..range.end).step_by(CACHE_LINE as usize) {
+            // SAFETY: the line shares a page with the range, which is within a registered MR
+            // whose pages stay mapped until the MR is deregistered
+            unsafe { core::arch::x86_64::_mm_clflush(line as *const u8) };
+        }
+    }
+    fence(Ordering::SeqCst);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    #[allow(clippy::as_conversions)]
+    fn atomics_execute_on_registered_targets() {
+        let atomics = Atomics::new();
+        let mut words = [5u64, 0];
+        let addr = words.as_mut_ptr() as u64;
+        atomics.add_target(1, addr, 16, ACCESS_REMOTE_ATOMIC);
+        let cas = AtomicOperands::new(5, 9);
+        let faa = AtomicOperands::new(3, 0);
+        assert_eq!(
+            atomics.execute(1, addr, WorkReqOpCode::AtomicCmpAndSwp, cas),
+            Some(5)
+        );
+        assert_eq!(
+            atomics.execute(1, addr, WorkReqOpCode::AtomicCmpAndSwp, cas),
+            Some(9)
+        );
+        assert_eq!(
+            atomics.execute(1, addr + 8, WorkReqOpCode::AtomicFetchAndAdd, faa),
+            Some(0)
+        );
+        assert_eq!(words, [9, 3]);
+        let faa = AtomicOperands::new(1, 0);
+        assert!(atomics
+            .execute(1, addr + 4, WorkReqOpCode::AtomicFetchAndAdd, faa)
+            .is_none());
+        assert!(atomics
+            .execute(1, addr + 16, WorkReqOpCode::AtomicFetchAndAdd, faa)
+            .is_none());
+        atomics.remove_target(1);
+        assert!(atomics
+            .execute(1, addr, WorkReqOpCode::AtomicFetchAndAdd, faa)
+            .is_none());
+    }
+
+    #[test]
+    #[allow(clippy::as_conversions)]
+    fn results_are_written_once() {
+        let atomics = Atomics::new();
+        let mut result = 0u64;
+        atomics.expect_result(3, Psn(7), std::ptr::addr_of_mut!(result) as u64);
+        assert!(!atomics.write_result(3, Psn(8), 1));
+        assert!(atomics.write_result(3, Psn(7), 42));
+        assert!(!atomics.write_result(3, Psn(7), 43));
+        assert_eq!(result, 42);
+    }
+
+    #[test]
+    #[allow(clippy::as_conversions)]
+    fn atomic_writes_and_flushes_need_remote_write() {
+        let atomics = Atomics::new();
+        let mut words = [1u64, 2, 3, 4];
+        let addr = words.as_mut_ptr() as u64;
+        atomics.add_target(1, addr, 32, ACCESS_REMOTE_WRITE);
+        atomics.add_target(2, addr, 32, ACCESS_REMOTE_ATOMIC);
+        let write = AtomicOperands::atomic_write(7);
+        assert_eq!(
+            atomics.execute(1, addr + 8, WorkReqOpCode::AtomicWrite, write),
+            Some(2)
+        );
+        assert!(atomics
+            .execute(2, addr + 8, WorkReqOpCode::AtomicWrite, write)
+            .is_none());
+        assert!(atomics
+            .execute(1, addr, WorkReqOpCode::AtomicFetchAndAdd, write)
+            .is_none());
+        assert_eq!(words, [1, 7, 3, 4]);
+
+        let persistent = AtomicOperands::flush(16, FLUSH_PERSISTENT, 0);
+        assert_eq!(
+            atomics.execute(1, addr + 16, WorkReqOpCode::Flush, persistent),
+            Some(0)
+        );
+        assert!(atomics
+            .execute(1, addr + 24, WorkReqOpCode::Flush, persistent)
+            .is_none());
+        assert!(atomics
+            .execute(2, addr, WorkReqOpCode::Flush, persistent)
+            .is_none());
+        // The whole MR is flushed whatever the address and the length
+        let whole = AtomicOperands::flush(u64::MAX, FLUSH_GLOBAL, FLUSH_MR);
+        assert_eq!(atomics.execute(1, 0, WorkReqOpCode::Flush, whole), Some(0));
+    }
+
+    #[test]
+    #[allow(clippy::as_conversions)]
+    fn zero_based_targets_are_addressed_by_offset() {
+        let atomics = Atomics::new();
+        let mut words = [5u64, 0];
+        let addr = words.as_mut_ptr() as u64;
+        atomics.add_mapped_target(1, 0, addr, 16, ACCESS_REMOTE_ATOMIC);
+        let faa = AtomicOperands::new(3, 0);
+        assert_eq!(
+            atomics.execute(1, 8, WorkReqOpCode::AtomicFetchAndAdd, faa),
+            Some(0)
+        );
+        assert!(atomics
+            .execute(1, addr, WorkReqOpCode::AtomicFetchAndAdd, faa)
+            .is_none());
+        assert_eq!(words, [5, 3]);
+    }
+}
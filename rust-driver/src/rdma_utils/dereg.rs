@@ -0,0 +1,68 @@
+use std::collections::VecDeque;
+
+use crate::cmd::CmdTicket;
+
+/// A deregistered memory region waiting for the device to apply its invalidation
+pub(crate) struct DeferredMr {
+    /// Ticket of the invalidation command
+    ticket: CmdTicket,
+    /// Key of the memory region
+    pub(crate) mr_key: u32,
+    /// Pinned ranges referenced by the memory region
+    pub(crate) pins: Vec<(u64, usize)>,
+}
+
+/// Memory regions whose pages and PGT range are freed once their invalidation completes.
+///
+/// Invalidations are submitted without waiting for the device, completed entries are reclaimed
+/// in batches by later calls.
+#[derive(Default)]
+pub(crate) struct DeferredFreeList {
+    /// Entries in submission order
+    entries: VecDeque<DeferredMr>,
+}
+
+impl DeferredFreeList {
+    /// Creates a new `DeferredFreeList`
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    /// Adds a memory region invalidated by the commands of `ticket`
+    pub(crate) fn push(&mut self, ticket: CmdTicket, mr_key: u32, pins: Vec<(u64, usize)>) {
+        self.entries.push_back(DeferredMr {
+            ticket,
+            mr_key,
+            pins,
+        });
+    }
+
+    /// Returns the number of entries
+    pub(crate) fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    /// Returns `true` if there are no entries
+    pub(crate) fn is_empty(&self) -> bool {
+        self.entries.is_empty()
+    }
+
+    /// Returns the ticket of the latest invalidation
+    pub(crate) fn last_ticket(&self) -> Option<CmdTicket> {
+        self.entries.back().map(|x| x.ticket)
+    }
+
+    /// Removes the entries whose invalidation has completed
+    pub(crate) fn pop_completed<F>(&mut self, is_complete: F) -> Vec<DeferredMr>
+    where
+        F: Fn(CmdTicket) -> bool,
+    {
+        // Commands complete in order
+        let num = self
+            .entries
+            .iter()
+            .position(|x| !is_complete(x.ticket))
+            .unwrap_or(self.entries.len());
+        self.entries.drain(..num).collect()
+    }
+}
@@ -0,0 +1,143 @@
+use std::{collections::HashMap, ops::Range};
+
+use crate::{
+    error::{RdmaError, Result},
+    mem::PAGE_SIZE,
+};
+
+/// Device memory allocations of a context.
+///
+/// The card exposes no memory of its own to the host, so the device memory is an arena of
+/// pinned, physically contiguous host memory allocated on first use. An allocation is a page
+/// aligned range of the arena, accessed by the application through the `memcpy` entry points
+/// of `ibv_dm`, and registered as zero-based MRs that the device translates without pinning
+/// or resolving pages. The peers still reach it across PCIe, and their atomics are executed by
+/// the responder like those on any other MR.
+#[derive(Debug)]
+pub(crate) struct DeviceMemory {
+    size: usize,
+    next_handle: u32,
+    /// Range of the arena of each allocation
+    blocks: HashMap<u32, Range<usize>>,
+    /// Allocation of each MR registered on device memory
+    mrs: HashMap<u32, u32>,
+}
+
+impl DeviceMemory {
+    pub(crate) fn new(size: usize) -> Self {
+        Self {
+            size,
+            next_handle: 0,
+            blocks: HashMap::new(),
+            mrs: HashMap::new(),
+        }
+    }
+
+    /// Allocates `length` bytes aligned to `1 << log_align`, and at least to a page
+    ///
+    /// # Returns
+    ///
+    /// The handle of the allocation and its offset in the arena
+    pub(crate) fn alloc(&mut self, length: usize, log_align: u32) -> Result<(u32, usize)> {
+        let align = 1usize
+            .checked_shl(log_align)
+            .ok_or(RdmaError::InvalidInput(format!(
+                "unsupported device memory alignment 2^{log_align}"
+            )))?
+            .max(PAGE_SIZE);
+        if length == 0 || length > self.size {
+            return Err(RdmaError::InvalidInput(format!(
+                "device memory length {length} not in 1..={}",
+                self.size
+            )));
+        }
+        let mut used: Vec<_> = self.blocks.values().cloned().collect();
+        used.sort_unstable_by_key(|x| x.start);
+        let mut start = 0;
+        for block in used.iter().chain([&(self.size..self.size)]) {
+            if start + length <= block.start {
+                break;
+            }
+            start = block.end.next_multiple_of(align);
+        }
+        if start + length > self.size {
+            return Err(RdmaError::ResourceExhausted(format!(
+                "no {length} bytes of device memory left"
+            )));
+        }
+        let handle = self.next_handle;
+        self.next_handle = self.next_handle.wrapping_add(1);
+        let _ignore = self.blocks.insert(handle, start..start + length);
+        Ok((handle, start))
+    }
+
+    /// Frees an allocation, fails while MRs are registered on it
+    pub(crate) fn free(&mut self, handle: u32) -> Result<()> {
+        if !self.blocks.contains_key(&handle) {
+            return Err(RdmaError::NotFound(format!("DM {handle} not found")));
+        }
+        if self.mrs.values().any(|&x| x == handle) {
+            return Err(RdmaError::InvalidInput(format!(
+                "DM {handle} still has registered MRs"
+            )));
+        }
+        let _ignore = self.blocks.remove(&handle);
+        Ok(())
+    }
+
+    /// Returns the range of the arena of `length` bytes at `offset` of the allocation, fails
+    /// if they are outside of it or if `offset` is not page aligned
+    pub(crate) fn range(&self, handle: u32, offset: usize, length: usize) -> Result<Range<usize>> {
+        let block = self
+            .blocks
+            .get(&handle)
+            .ok_or(RdmaError::NotFound(format!("DM {handle} not found")))?;
+        let end = offset.checked_add(length).unwrap_or(usize::MAX);
+        if offset % PAGE_SIZE != 0 || length == 0 || end > block.len() {
+            return Err(RdmaError::InvalidInput(format!(
+                "DM {handle}: {length} bytes at offset {offset} cannot be registered"
+            )));
+        }
+        Ok(block.start + offset..block.start + end)
+    }
+
+    /// Records the MR `mr_key` registered on the allocation
+    pub(crate) fn insert_mr(&mut self, mr_key: u32, handle: u32) {
+        let _ignore = self.mrs.insert(mr_key, handle);
+    }
+
+    /// Forgets the MR, returns `true` if it was registered on device memory
+    pub(crate) fn remove_mr(&mut self, mr_key: u32) -> bool {
+        self.mrs.remove(&mr_key).is_some()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn allocations_fill_the_gaps_of_the_arena() {
+        let mut dm = DeviceMemory::new(8 * PAGE_SIZE);
+        let (dm0, offset0) = dm.alloc(100, 0).unwrap();
+        let (dm1, offset1) = dm.alloc(PAGE_SIZE, 0).unwrap();
+        assert_eq!((offset0, offset1), (0, PAGE_SIZE));
+        let log_align = PAGE_SIZE.trailing_zeros() + 2;
+        let (_dm2, offset2) = dm.alloc(2 * PAGE_SIZE, log_align).unwrap();
+        assert_eq!(offset2, 4 * PAGE_SIZE);
+        assert!(dm.alloc(3 * PAGE_SIZE, 0).is_err());
+        dm.free(dm0).unwrap();
+        assert_eq!(dm.alloc(PAGE_SIZE, 0).unwrap().1, 0);
+        assert!(dm.alloc(0, 0).is_err());
+        assert!(dm.alloc(PAGE_SIZE, 64).is_err());
+
+        assert!(dm.range(dm1, PAGE_SIZE / 2, 8).is_err());
+        assert!(dm.range(dm1, 0, PAGE_SIZE + 1).is_err());
+        assert_eq!(dm.range(dm1, 0, 8).unwrap(), PAGE_SIZE..PAGE_SIZE + 8);
+        dm.insert_mr(1 << 8, dm1);
+        assert!(dm.free(dm1).is_err());
+        assert!(dm.remove_mr(1 << 8));
+        dm.free(dm1).unwrap();
+        assert!(dm.free(dm1).is_err());
+    }
+}
@@ -1,5 +1,6 @@
 use crate::{
     constants::{PSN_MASK, WR_CHUNK_SIZE},
+    sdt::sdt_probe,
     workers::send::{ChunkPos, QpParams, WithIbvParams, WrChunk, WrChunkBuilder},
 };
 
@@ -10,9 +11,20 @@ pub(crate) struct WrChunkFragmenter {
 }
 
 impl WrChunkFragmenter {
-    pub(crate) fn new(wr: SendWrRdma, qp_param: QpParams, base_psn: Psn) -> Self {
+    /// Creates a fragmenter splitting the WR into chunks of `chunk_size` bytes, 0 selects
+    /// `WR_CHUNK_SIZE`.
+    ///
+    /// A chunk never spans two SGEs, so a chunk size of at least the WR length describes each
+    /// contiguous local buffer with a single chunk and leaves the segmentation into packets to
+    /// the device.
+    pub(crate) fn new(wr: SendWrRdma, qp_param: QpParams, base_psn: Psn, chunk_size: u32) -> Self {
+        let chunk_size = if chunk_size == 0 {
+            WR_CHUNK_SIZE
+        } else {
+            chunk_size
+        };
         Self {
-            inner: ChunkFragmenter::new(wr, qp_param, base_psn, WR_CHUNK_SIZE.into(), false),
+            inner: ChunkFragmenter::new(wr, qp_param, base_psn, chunk_size.into(), false),
         }
     }
 }
@@ -27,6 +39,23 @@ impl IntoIterator for WrChunkFragmenter {
     }
 }
 
+/// Returns the request packet of an RDMA read, which takes a single PSN whatever the length
+/// read
+pub(crate) fn read_request(wr: SendWrRdma, qp_param: QpParams, psn: Psn) -> WrChunk {
+    WrChunkBuilder::new_with_opcode(wr.opcode())
+        .set_qp_params(qp_param)
+        .set_ibv_params(
+            wr.send_flags() as u8,
+            wr.rkey(),
+            wr.length(),
+            wr.lkey(),
+            wr.imm(),
+        )
+        .set_chunk_meta(psn, wr.laddr(), wr.raddr(), wr.length(), ChunkPos::Only)
+        .set_posted(wr.posted())
+        .build()
+}
+
 pub(crate) struct WrPacketFragmenter {
     inner: ChunkFragmenter,
 }
@@ -40,6 +69,39 @@ impl WrPacketFragmenter {
             inner: ChunkFragmenter::new(wr, qp_param, base_psn, pmtu, true),
         }
     }
+
+    /// Returns the last packet of a WR whose packets end before `end_psn`, without building
+    /// the packets before it
+    pub(crate) fn last_packet(
+        wr: SendWrRdma,
+        qp_param: QpParams,
+        base_psn: Psn,
+        end_psn: Psn,
+    ) -> Option<WrChunk> {
+        let start_psn = if end_psn > base_psn {
+            end_psn - 1
+        } else {
+            base_psn
+        };
+        Self::new_from(wr, qp_param, base_psn, start_psn)
+            .into_iter()
+            .last()
+    }
+
+    /// Creates a fragmenter yielding the packets from `start_psn` on, the packets before it
+    /// are skipped without being built
+    pub(crate) fn new_from(
+        wr: SendWrRdma,
+        qp_param: QpParams,
+        base_psn: Psn,
+        start_psn: Psn,
+    ) -> Self {
+        let mut this = Self::new(wr, qp_param, base_psn);
+        if start_psn > base_psn {
+            this.inner.skip_packets = (start_psn - base_psn).into_inner();
+        }
+        this
+    }
 }
 
 impl IntoIterator for WrPacketFragmenter {
@@ -60,6 +122,8 @@ struct ChunkFragmenter {
     base_psn: Psn,
     chunk_size: u64,
     is_retry: bool,
+    /// Number of leading packets skipped, only set for the packet fragmenter
+    skip_packets: u32,
 }
 
 impl ChunkFragmenter {
@@ -76,6 +140,7 @@ impl ChunkFragmenter {
             base_psn,
             chunk_size,
             is_retry,
+            skip_packets: 0,
         }
     }
 }
@@ -100,48 +165,128 @@ impl IntoIterator for ChunkFragmenter {
             .unwrap_or_else(|| unreachable!("invalid ibv_mtu"))
             .into();
 
-        let f = Fragmenter::new(
-            self.chunk_size,
-            pmtu,
-            self.wr.raddr(),
-            self.wr.length().into(),
-        );
-        IntoIterChunk {
-            inner: f.into_iter(),
+        let mut iter = IntoIterChunk {
+            // starts with an empty fragment iterator, the first SGE is loaded on the first call to `next`
+            inner: Fragmenter::new(self.chunk_size, pmtu, self.wr.raddr(), 0).into_iter(),
             psn: self.base_psn,
             wr: self.wr,
             builder,
             laddr: self.wr.laddr(),
+            lkey: self.wr.lkey(),
+            next_sge: 0,
+            next_raddr: self.wr.raddr(),
+            chunk_size: self.chunk_size,
             pmtu,
+            is_first: true,
             is_retry: self.is_retry,
-        }
+        };
+        iter.skip_packets(self.skip_packets);
+
+        iter
     }
 }
 
+/// Iterator over the chunks of a work request.
+///
+/// The remote address range is split on chunk size and PMTU boundaries, and additionally
+/// on the boundaries of the local SGEs, so that each chunk refers to one contiguous local buffer.
 pub(crate) struct IntoIterChunk {
     inner: IntoIter,
     psn: Psn,
     wr: SendWrRdma,
     builder: WrChunkBuilder<WithIbvParams>,
     laddr: u64,
+    lkey: u32,
+    next_sge: usize,
+    next_raddr: u64,
+    chunk_size: u64,
     pmtu: u64,
+    is_first: bool,
     is_retry: bool,
 }
 
+impl IntoIterChunk {
+    /// Advances `inner` to the fragments of the next non-empty SGE
+    fn load_next_sge(&mut self) -> Option<()> {
+        loop {
+            let sge = *self.wr.sg_list().as_slice().get(self.next_sge)?;
+            self.next_sge += 1;
+            self.inner = Fragmenter::new(
+                self.chunk_size,
+                self.pmtu,
+                self.next_raddr,
+                sge.length.into(),
+            )
+            .into_iter();
+            self.laddr = sge.addr;
+            self.lkey = sge.lkey;
+            self.next_raddr += u64::from(sge.length);
+            if sge.length != 0 {
+                return Some(());
+            }
+        }
+    }
+
+    /// Skips the next `n` packets of a packet fragmenter, whose fragments are single packets.
+    ///
+    /// Whole SGEs are skipped at once, and the packets of a SGE are skipped by address.
+    fn skip_packets(&mut self, mut n: u32) {
+        while n > 0 {
+            if self.inner.count == 0 && self.load_next_sge().is_none() {
+                return;
+            }
+            let skip = usize::try_from(n).map_or(self.inner.count, |x| x.min(self.inner.count));
+            self.laddr += self.inner.skip_segments(skip);
+            let skipped = u32::try_from(skip).unwrap_or(u32::MAX);
+            self.psn += skipped;
+            n -= skipped;
+            self.is_first = false;
+        }
+    }
+
+    fn has_remaining_sge(&self) -> bool {
+        self.wr
+            .sg_list()
+            .as_slice()
+            .get(self.next_sge..)
+            .is_some_and(|rest| rest.iter().any(|sge| sge.length != 0))
+    }
+}
+
 impl Iterator for IntoIterChunk {
     type Item = WrChunk;
 
     fn next(&mut self) -> Option<Self::Item> {
-        let f = self.inner.next()?;
-        let builder =
-            self.builder
-                .set_chunk_meta(self.psn, self.laddr, f.addr, f.len as u32, f.pos);
+        let f = match self.inner.next() {
+            Some(f) => f,
+            None => {
+                self.load_next_sge()?;
+                self.inner.next()?
+            }
+        };
+        let is_last = self.inner.count == 0 && !self.has_remaining_sge();
+        let pos = match (self.is_first, is_last) {
+            (true, true) => ChunkPos::Only,
+            (true, false) => ChunkPos::First,
+            (false, true) => ChunkPos::Last,
+            (false, false) => ChunkPos::Middle,
+        };
+        self.is_first = false;
+        let mut builder = self
+            .builder
+            .set_chunk_meta(self.psn, self.laddr, f.addr, f.len as u32, pos)
+            .set_lkey(self.lkey);
+        if self.wr.opcode().is_executed_by_responder() {
+            builder = builder.set_atomic(self.wr.atomic());
+        }
         let chunk = if self.is_retry {
             builder.set_is_retry().build()
         } else {
-            builder.build()
+            builder.set_posted(self.wr.posted()).build()
         };
-        let num_packets = f.len.div_ceil(self.pmtu) as u32;
+        sdt_probe!("chunk", chunk.sqpn, chunk.psn.into_inner(), chunk.len);
+        // The PMTU is a power of two
+        let num_packets = ((f.len + self.pmtu - 1) >> self.pmtu.trailing_zeros()) as u32;
         self.psn += num_packets;
         self.laddr += f.len;
 
@@ -167,16 +312,43 @@ impl Fragmenter {
         }
     }
 
-    fn num_segments(&self) -> usize {
+    /// Returns the number of segments and the lengths of the first and the last segment in
+    /// constant time, all other segments are `segment_size` long
+    pub(crate) fn plan(&self) -> FragmentPlan {
         if self.base_addr >= self.end_addr {
-            return 0;
+            return FragmentPlan::default();
+        }
+        let first_end =
+            ((self.base_addr + self.segment_size) & !(self.align - 1)).min(self.end_addr);
+        let first_len = first_end - self.base_addr;
+        let rest = self.end_addr - first_end;
+        if rest == 0 {
+            return FragmentPlan {
+                count: 1,
+                first_len,
+                last_len: first_len,
+            };
+        }
+        let num_rest = rest.div_ceil(self.segment_size);
+        FragmentPlan {
+            count: num_rest as usize + 1,
+            first_len,
+            last_len: rest - (num_rest - 1) * self.segment_size,
         }
-        let first_aligned = ((self.base_addr + self.segment_size) & !(self.align - 1));
-        let remaining_after_first = self.end_addr.saturating_sub(first_aligned);
-        remaining_after_first.div_ceil(self.segment_size) as usize + 1
     }
 }
 
+/// Closed form of the segments of a `Fragmenter`
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct FragmentPlan {
+    /// Number of segments
+    pub(crate) count: usize,
+    /// Length of the first segment
+    pub(crate) first_len: u64,
+    /// Length of the last segment
+    pub(crate) last_len: u64,
+}
+
 pub(crate) struct IntoIter {
     segment_size: u64,
     align: u64,
@@ -192,7 +364,7 @@ impl IntoIterator for Fragmenter {
     type IntoIter = IntoIter;
 
     fn into_iter(self) -> Self::IntoIter {
-        let num_segments = self.num_segments();
+        let num_segments = self.plan().count;
         let current_pos = if num_segments == 1 {
             ChunkPos::Only
         } else {
@@ -203,13 +375,40 @@ impl IntoIterator for Fragmenter {
             align: self.align,
             current_addr: self.base_addr,
             end_addr: self.end_addr,
-            total_segments: self.num_segments(),
+            total_segments: num_segments,
             current_pos,
             count: num_segments,
         }
     }
 }
 
+impl IntoIter {
+    /// Skips the next `n` segments, returns the number of bytes skipped.
+    ///
+    /// Only the first segment may be shorter than `segment_size`, as `segment_size` is a
+    /// multiple of `align` for both chunks and packets.
+    fn skip_segments(&mut self, n: usize) -> u64 {
+        let n = n.min(self.count);
+        if n == 0 {
+            return 0;
+        }
+        let start = self.current_addr;
+        let first_end =
+            ((self.current_addr + self.segment_size) & !(self.align - 1)).min(self.end_addr);
+        let rest = u64::try_from(n - 1)
+            .unwrap_or(u64::MAX)
+            .saturating_mul(self.segment_size);
+        self.current_addr = first_end.saturating_add(rest).min(self.end_addr);
+        self.count -= n;
+        self.current_pos = if self.count == 1 {
+            ChunkPos::Last
+        } else {
+            ChunkPos::Middle
+        };
+        self.current_addr - start
+    }
+}
+
 impl Iterator for IntoIter {
     type Item = Fragment;
 
@@ -288,6 +487,123 @@ mod test {
         assert!(f.into_iter().zip(expect).all(|(x, y)| x == y));
     }
 
+    #[test]
+    fn chunk_fragmentation_multi_sge() {
+        use crate::{rdma_utils::types::{SendWrBase, Sge, SgList}, workers::send::WorkReqOpCode};
+
+        let sges = [
+            Sge::new(0x1_0000, 0x300, 1),
+            Sge::new(0x2_0000, 0, 2),
+            Sge::new(0x3_0000, 0x500, 3),
+        ];
+        let sg_list = SgList::from_slice(&sges).unwrap();
+        let base = SendWrBase::new_with_sg_list(0, 0, sg_list, 0, WorkReqOpCode::RdmaWrite)
+            .unwrap();
+        assert_eq!(base.length, 0x800);
+        let wr = SendWrRdma::new_from_base(base, 0x8000, 0);
+        // pmtu: 256
+        let qp_param = QpParams::new(0, 0, 0, 0, 0, 0, 1);
+        let chunks: Vec<_> = ChunkFragmenter::new(wr, qp_param, Psn(0), 0x400, false)
+            .into_iter()
+            .collect();
+        let expect = [
+            (0x8000, 0x1_0000, 0x300, 1, true, false),
+            (0x8300, 0x3_0000, 0x400, 3, false, false),
+            (0x8700, 0x3_0400, 0x100, 3, false, true),
+        ];
+        assert_eq!(chunks.len(), expect.len());
+        for (chunk, (raddr, laddr, len, lkey, is_first, is_last)) in chunks.iter().zip(expect) {
+            assert_eq!(chunk.raddr, raddr);
+            assert_eq!(chunk.laddr, laddr);
+            assert_eq!(chunk.len, len);
+            assert_eq!(chunk.lkey, lkey);
+            assert_eq!(chunk.is_first, is_first);
+            assert_eq!(chunk.is_last, is_last);
+        }
+        assert_eq!(chunks[0].psn, Psn(0));
+        assert_eq!(chunks[1].psn, Psn(3));
+        assert_eq!(chunks[2].psn, Psn(7));
+    }
+
+    #[test]
+    fn chunk_size_is_tunable() {
+        use crate::{rdma_utils::types::SendWrBase, workers::send::WorkReqOpCode};
+
+        let base = SendWrBase::new(0, 0, 0x10_0000, 0x80_0000, 1, 0, WorkReqOpCode::RdmaWrite);
+        let wr = SendWrRdma::new_from_base(base, 0x100_0000, 0);
+        // pmtu: 4096
+        let qp_param = QpParams::new(0, 0, 0, 0, 0, 0, 5);
+        let num_chunks = |chunk_size| {
+            WrChunkFragmenter::new(wr, qp_param, Psn(0), chunk_size)
+                .into_iter()
+                .count()
+        };
+        assert_eq!(num_chunks(0), 0x80);
+        assert_eq!(num_chunks(0x10_0000), 8);
+        let bulk: Vec<_> = WrChunkFragmenter::new(wr, qp_param, Psn(0), 0x80_0000)
+            .into_iter()
+            .collect();
+        assert_eq!(bulk.len(), 1);
+        assert_eq!(bulk[0].len, 0x80_0000);
+        assert!(bulk[0].is_first && bulk[0].is_last);
+    }
+
+    #[test]
+    fn packet_fragmentation_from_psn() {
+        use crate::{
+            rdma_utils::types::{SendWrBase, SgList, Sge},
+            workers::send::WorkReqOpCode,
+        };
+
+        let sges = [
+            Sge::new(0x1_0010, 0x310, 1),
+            Sge::new(0x2_0000, 0, 2),
+            Sge::new(0x3_0000, 0x500, 3),
+        ];
+        let sg_list = SgList::from_slice(&sges).unwrap();
+        let base =
+            SendWrBase::new_with_sg_list(0, 0, sg_list, 0, WorkReqOpCode::RdmaWrite).unwrap();
+        let wr = SendWrRdma::new_from_base(base, 0x8010, 0);
+        // pmtu: 256
+        let qp_param = QpParams::new(0, 0, 0, 0, 0, 0, 1);
+        let base_psn = Psn(100);
+        let key = |x: WrChunk| (x.psn, x.raddr, x.laddr, x.len, x.is_first, x.is_last);
+        let all: Vec<_> = WrPacketFragmenter::new(wr, qp_param, base_psn)
+            .into_iter()
+            .map(key)
+            .collect();
+        assert_eq!(all.len(), 10);
+        let last = WrPacketFragmenter::last_packet(wr, qp_param, base_psn, base_psn + 10);
+        assert_eq!(last.map(key), all.last().copied());
+        for skip in 0..12 {
+            let start = base_psn + skip;
+            let from: Vec<_> = WrPacketFragmenter::new_from(wr, qp_param, base_psn, start)
+                .into_iter()
+                .map(key)
+                .collect();
+            let expect: Vec<_> = all.iter().copied().filter(|x| x.0 >= start).collect();
+            assert_eq!(from, expect, "start: {start}");
+        }
+    }
+
+    #[test]
+    fn plan_matches_fragments() {
+        for (segment_size, align) in [(256, 256), (1024, 256), (0x1_0000, 0x1000)] {
+            for base_addr in [0, 1, 0xff, 0x100, 0x3ff, 0x1234] {
+                for length in [0, 1, 255, 256, 257, 4096, 0x1_0001, 0x3_4567] {
+                    let f = Fragmenter::new(segment_size, align, base_addr, length);
+                    let fragments: Vec<_> = f.into_iter().collect();
+                    let expect = FragmentPlan {
+                        count: fragments.len(),
+                        first_len: fragments.first().map_or(0, Fragment::len),
+                        last_len: fragments.last().map_or(0, Fragment::len),
+                    };
+                    assert_eq!(f.plan(), expect, "{segment_size:#x} {base_addr:#x}");
+                }
+            }
+        }
+    }
+
     #[test]
     fn fragmentation_len() {
         let f = Fragmenter::new(256, 256, 0x0, 4096);
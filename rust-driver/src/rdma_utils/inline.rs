@@ -0,0 +1,244 @@
+use std::sync::Arc;
+
+use parking_lot::Mutex;
+
+use crate::{constants::MAX_INLINE_DATA, mem::DmaBuf, rdma_utils::psn::Psn};
+
+/// Bounce buffer of inline and staged payloads, registered to the device as a memory region
+pub(crate) struct InlineBuf {
+    /// Backing memory, the slot at device address `addr` starts at byte `addr - buf.phys_addr`
+    pub(crate) buf: DmaBuf,
+    /// Key of the memory region
+    pub(crate) lkey: u32,
+}
+
+/// State of a bounce slot
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum SlotState {
+    /// Not used by any WR
+    Free,
+    /// Holds the payload of a WR that has not been assigned PSNs yet
+    Copied,
+    /// Holds the payload of a posted WR, reusable once `end_psn` is acknowledged
+    Posted { qpn: u32, end_psn: Psn },
+}
+
+/// Slot states of the bounce buffer of inline sends.
+///
+/// The payload of an inline WR is copied to a slot when the WR is posted, the device and the
+/// retransmission path read it from there. The buffer is split in size classes, a payload
+/// takes a slot of the smallest class it fits in, falling back to larger classes. Slots of a
+/// class are reused in FIFO order, a slot is only overwritten after all packets of its
+/// previous WR are acknowledged.
+#[derive(Default, Clone)]
+pub(crate) struct InlineSlots {
+    /// States shared by the posting thread and the `WrPoster`s
+    inner: Arc<Mutex<SlotsInner>>,
+}
+
+#[derive(Default)]
+struct SlotsInner {
+    /// Size classes in increasing slot size
+    classes: Vec<SlotClass>,
+}
+
+/// Slots of one size of the bounce buffer
+struct SlotClass {
+    /// Device address of the first slot
+    base: u64,
+    /// Size of a slot in bytes
+    slot_size: usize,
+    /// State of each slot
+    states: Vec<SlotState>,
+    /// Next slot to reserve
+    next: usize,
+}
+
+impl InlineSlots {
+    /// Creates an empty slot table
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    /// Returns `true` if the bounce buffer is set up
+    pub(crate) fn is_initialized(&self) -> bool {
+        !self.inner.lock().classes.is_empty()
+    }
+
+    /// Returns the length in bytes of a bounce buffer of `classes`, given as pairs of slot size
+    /// and number of slots
+    pub(crate) fn buffer_len(classes: &[(usize, usize)]) -> usize {
+        classes
+            .iter()
+            .map(|&(slot_size, num)| slot_size * num)
+            .sum()
+    }
+
+    /// Sets up the slots of `classes`, given as pairs of slot size and number of slots, laid
+    /// out one class after the other starting at device address `base`
+    pub(crate) fn init(&self, base: u64, classes: &[(usize, usize)]) {
+        let mut offset = 0;
+        let mut slot_classes: Vec<_> = classes
+            .iter()
+            .filter(|&&(slot_size, num)| slot_size != 0 && num != 0)
+            .map(|&(slot_size, num)| {
+                let class = SlotClass {
+                    base: base + offset as u64,
+                    slot_size,
+                    states: vec![SlotState::Free; num],
+                    next: 0,
+                };
+                offset += slot_size * num;
+                class
+            })
+            .collect();
+        slot_classes.sort_by_key(|class| class.slot_size);
+        self.inner.lock().classes = slot_classes;
+    }
+
+    /// Reserves the next slot of the smallest class holding `len` bytes with a free slot,
+    /// `is_acked` returns whether the packets before the PSN are acknowledged on the QP
+    ///
+    /// # Returns
+    ///
+    /// The device address of the slot, or `None` if the slots are still in use
+    pub(crate) fn reserve<F>(&self, len: usize, mut is_acked: F) -> Option<u64>
+    where
+        F: FnMut(u32, Psn) -> bool,
+    {
+        self.inner
+            .lock()
+            .classes
+            .iter_mut()
+            .filter(|class| class.slot_size >= len)
+            .find_map(|class| class.reserve(&mut is_acked))
+    }
+
+    /// Returns the size of the largest slot, 0 if the bounce buffer is not set up
+    pub(crate) fn max_slot_size(&self) -> usize {
+        self.inner
+            .lock()
+            .classes
+            .last()
+            .map_or(0, |class| class.slot_size)
+    }
+
+    /// Releases a reserved slot whose WR was not posted
+    pub(crate) fn cancel(&self, addr: u64) {
+        let mut inner = self.inner.lock();
+        if let Some(state) = inner.slot_mut(addr) {
+            *state = SlotState::Free;
+        }
+    }
+
+    /// Records the end PSN of the WR using the slot at `addr`
+    pub(crate) fn posted(&self, addr: u64, qpn: u32, end_psn: Psn) {
+        let mut inner = self.inner.lock();
+        if let Some(state) = inner.slot_mut(addr) {
+            if *state == SlotState::Copied {
+                *state = SlotState::Posted { qpn, end_psn };
+            }
+        }
+    }
+
+    /// Frees the slots of posted WRs of a destroyed QP
+    pub(crate) fn release_qp(&self, qpn: u32) {
+        let mut inner = self.inner.lock();
+        for state in inner.classes.iter_mut().flat_map(|class| &mut class.states) {
+            if matches!(*state, SlotState::Posted { qpn: x, .. } if x == qpn) {
+                *state = SlotState::Free;
+            }
+        }
+    }
+}
+
+impl SlotsInner {
+    /// Returns the state of the slot at device address `addr`
+    fn slot_mut(&mut self, addr: u64) -> Option<&mut SlotState> {
+        self.classes
+            .iter_mut()
+            .find_map(|class| class.slot_mut(addr))
+    }
+}
+
+impl SlotClass {
+    /// Reserves the next slot of the class, `None` if it is still in use
+    fn reserve<F>(&mut self, is_acked: &mut F) -> Option<u64>
+    where
+        F: FnMut(u32, Psn) -> bool,
+    {
+        let index = self.next;
+        let state = self.states.get_mut(index)?;
+        match *state {
+            SlotState::Free => {}
+            SlotState::Posted { qpn, end_psn } if is_acked(qpn, end_psn) => {}
+            SlotState::Copied | SlotState::Posted { .. } => return None,
+        }
+        *state = SlotState::Copied;
+        self.next = (index + 1) % self.states.len();
+
+        Some(self.base + (index * self.slot_size) as u64)
+    }
+
+    /// Returns the state of the slot at device address `addr`, `None` if the slot is not one of
+    /// the class
+    fn slot_mut(&mut self, addr: u64) -> Option<&mut SlotState> {
+        let offset = usize::try_from(addr.checked_sub(self.base)?).ok()?;
+        if offset % self.slot_size != 0 {
+            return None;
+        }
+        self.states.get_mut(offset / self.slot_size)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const BASE: u64 = 0x10_0000;
+
+    #[test]
+    fn slots_are_reused_after_ack() {
+        let slots = InlineSlots::new();
+        slots.init(BASE, &[(MAX_INLINE_DATA, 2)]);
+        let a = slots.reserve(1, |_, _| false).unwrap();
+        let b = slots.reserve(1, |_, _| false).unwrap();
+        assert_eq!(b - a, MAX_INLINE_DATA as u64);
+        // copied but not yet posted
+        assert!(slots.reserve(1, |_, _| true).is_none());
+        slots.posted(a, 1, Psn(10));
+        slots.posted(b, 1, Psn(20));
+        assert!(slots.reserve(1, |_, psn| psn <= Psn(5)).is_none());
+        assert_eq!(slots.reserve(1, |_, psn| psn <= Psn(10)), Some(a));
+        assert!(slots.reserve(1, |_, psn| psn <= Psn(10)).is_none());
+    }
+
+    #[test]
+    fn cancelled_and_destroyed_slots_are_freed() {
+        let slots = InlineSlots::new();
+        assert!(slots.reserve(1, |_, _| true).is_none());
+        slots.init(BASE, &[(MAX_INLINE_DATA, 2)]);
+        let a = slots.reserve(1, |_, _| false).unwrap();
+        let b = slots.reserve(1, |_, _| false).unwrap();
+        slots.cancel(a);
+        slots.posted(b, 3, Psn(1));
+        assert_eq!(slots.reserve(1, |_, _| false), Some(a));
+        slots.release_qp(3);
+        assert_eq!(slots.reserve(1, |_, _| false), Some(b));
+    }
+
+    #[test]
+    fn payloads_take_the_smallest_free_class() {
+        let slots = InlineSlots::new();
+        slots.init(BASE, &[(0x1000, 1), (64, 1)]);
+        assert_eq!(slots.max_slot_size(), 0x1000);
+        assert_eq!(slots.reserve(64, |_, _| false), Some(BASE + 0x1000));
+        // the full class falls back to the larger one
+        assert_eq!(slots.reserve(1, |_, _| false), Some(BASE));
+        assert!(slots.reserve(1, |_, _| false).is_none());
+        assert!(slots.reserve(0x1001, |_, _| true).is_none());
+        slots.cancel(BASE + 0x1000);
+        assert_eq!(slots.reserve(64, |_, _| false), Some(BASE + 0x1000));
+        assert_eq!(InlineSlots::buffer_len(&[(0x1000, 1), (64, 2)]), 0x1080);
+    }
+}
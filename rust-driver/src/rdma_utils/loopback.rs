@@ -0,0 +1,151 @@
+use ibverbs_sys::{
+    ibv_access_flags::{IBV_ACCESS_LOCAL_WRITE, IBV_ACCESS_REMOTE_READ, IBV_ACCESS_REMOTE_WRITE},
+    ibv_send_flags::IBV_SEND_INLINE,
+};
+
+use crate::{
+    net::rendezvous::SEND_FLAG_PULL,
+    rdma_utils::{mtt::PinnedMr, types::SendWrRdma},
+    workers::send::WorkReqOpCode,
+};
+
+/// A copy of `len` bytes from `src` to `dst`
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct LocalCopy {
+    pub(crate) src: u64,
+    pub(crate) dst: u64,
+    pub(crate) len: usize,
+}
+
+/// Returns the copies carrying out an RDMA write or read between two QPs of the context
+/// connected to each other, the MRs of the context being looked up by key with `mr`.
+///
+/// The WR reaches the peer through the card and back otherwise, with its payload crossing
+/// PCIe twice. Sends stay on the card, they consume receive WRs of the peer matched by the
+/// completion worker against the arriving PSNs.
+///
+/// # Returns
+///
+/// `None` if the WR goes through the card: it is not an RDMA write or read, it is inline or
+/// pulled, or one of its buffers is not in an MR pinned at registration with the access the
+/// WR needs
+pub(crate) fn plan<F>(wr: &SendWrRdma, mr: F) -> Option<Vec<LocalCopy>>
+where
+    F: Fn(u32) -> Option<PinnedMr>,
+{
+    #[allow(clippy::wildcard_enum_match_arm)]
+    let (write, remote_access, local_access) = match wr.opcode() {
+        WorkReqOpCode::RdmaWrite => (true, IBV_ACCESS_REMOTE_WRITE.0, 0),
+        WorkReqOpCode::RdmaRead => (false, IBV_ACCESS_REMOTE_READ.0, IBV_ACCESS_LOCAL_WRITE.0),
+        _ => return None,
+    };
+    if wr.send_flags() & (IBV_SEND_INLINE.0 | SEND_FLAG_PULL) != 0 {
+        return None;
+    }
+    let remote = mr(wr.rkey())?;
+    if !covers(
+        remote,
+        wr.raddr(),
+        wr.length() as usize,
+        remote_access as u8,
+    ) {
+        return None;
+    }
+    let mut raddr = wr.raddr();
+    wr.sg_list()
+        .as_slice()
+        .iter()
+        .filter(|sge| sge.length != 0)
+        .map(|sge| {
+            let len = sge.length as usize;
+            if !covers(mr(sge.lkey)?, sge.addr, len, local_access as u8) {
+                return None;
+            }
+            let (src, dst) = if write {
+                (sge.addr, raddr)
+            } else {
+                (raddr, sge.addr)
+            };
+            raddr += len as u64;
+            Some(LocalCopy { src, dst, len })
+        })
+        .collect()
+}
+
+/// Returns `true` if the `len` bytes at `addr` are in the MR, which grants `access`
+fn covers(mr: PinnedMr, addr: u64, len: usize, access: u8) -> bool {
+    mr.access & access == access
+        && addr >= mr.addr
+        && addr
+            .checked_add(len as u64)
+            .is_some_and(|end| end <= mr.addr + mr.length as u64)
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::{
+        latency::Stamp,
+        rdma_utils::types::{SendWrBase, SgList, Sge},
+    };
+
+    use super::*;
+
+    fn wr(opcode: WorkReqOpCode, sg_list: SgList) -> SendWrRdma {
+        let base = SendWrBase {
+            wr_id: 1,
+            send_flags: 0,
+            laddr: sg_list.as_slice().first().map_or(0, |sge| sge.addr),
+            length: sg_list.total_len().unwrap_or(0),
+            lkey: sg_list.as_slice().first().map_or(0, |sge| sge.lkey),
+            imm_data: 0,
+            opcode,
+            sg_list,
+            posted: Stamp::default(),
+        };
+        SendWrRdma::new_from_base(base, 0x10_0100, 2)
+    }
+
+    #[test]
+    fn copies_stay_within_the_mrs() {
+        let access = (IBV_ACCESS_LOCAL_WRITE.0 | IBV_ACCESS_REMOTE_WRITE.0) as u8;
+        let mrs = |key| match key {
+            1 => Some(PinnedMr {
+                addr: 0x1000,
+                length: 0x1000,
+                pd_handle: 0,
+                access,
+            }),
+            2 => Some(PinnedMr {
+                addr: 0x10_0000,
+                length: 0x1000,
+                pd_handle: 0,
+                access,
+            }),
+            _ => None,
+        };
+        let sges =
+            SgList::from_slice(&[Sge::new(0x1000, 0x100, 1), Sge::new(0x1800, 0x80, 1)]).unwrap();
+        assert_eq!(
+            plan(&wr(WorkReqOpCode::RdmaWrite, sges), mrs).unwrap(),
+            vec![
+                LocalCopy {
+                    src: 0x1000,
+                    dst: 0x10_0100,
+                    len: 0x100
+                },
+                LocalCopy {
+                    src: 0x1800,
+                    dst: 0x10_0200,
+                    len: 0x80
+                },
+            ]
+        );
+        // The remote MR grants no read access
+        assert!(plan(&wr(WorkReqOpCode::RdmaRead, sges), mrs).is_none());
+        assert!(plan(&wr(WorkReqOpCode::Send, sges), mrs).is_none());
+        let beyond = SgList::single(0x1f00, 0x200, 1);
+        assert!(plan(&wr(WorkReqOpCode::RdmaWrite, beyond), mrs).is_none());
+        let unknown = SgList::single(0x1000, 0x100, 3);
+        assert!(plan(&wr(WorkReqOpCode::RdmaWrite, unknown), mrs).is_none());
+    }
+}
@@ -1,8 +1,19 @@
+pub(crate) mod atomic;
+pub(crate) mod dereg;
+pub(crate) mod dm;
 pub(crate) mod fragmenter;
+pub(crate) mod inline;
+pub(crate) mod loopback;
+pub(crate) mod mr_cache;
 pub(crate) mod msn;
 pub(crate) mod mtt;
+pub(crate) mod mw;
 pub(crate) mod pd;
 pub(crate) mod psn;
 pub(crate) mod psn_tracker;
 pub(crate) mod qp;
+pub(crate) mod send_path;
+pub(crate) mod snapshot;
+pub(crate) mod srq;
+pub(crate) mod td;
 pub(crate) mod types;
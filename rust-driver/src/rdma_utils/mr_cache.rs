@@ -0,0 +1,277 @@
+use std::collections::{BTreeMap, BTreeSet, HashMap};
+
+/// Registration cache of memory regions.
+///
+/// A registration request covered by a cached registration with the same PD and a superset of
+/// the access flags reuses its `mr_key`. Deregistered entries are kept until they are evicted in
+/// LRU order once more than `capacity` unreferenced entries are cached.
+///
+/// The cache does not observe `munmap`, callers must validate an entry against the current
+/// address translation before reusing it, and invalidate it on mismatch.
+pub(crate) struct MrCache {
+    /// Maximum number of unreferenced entries, 0 disables the cache
+    capacity: usize,
+    /// Cached registrations keyed by `mr_key`
+    entries: HashMap<u32, CachedMr>,
+    /// Valid registrations ordered by start address
+    index: BTreeSet<(u64, u32)>,
+    /// Length of the longest indexed registration, bounds the index scan
+    max_length: u64,
+    /// Unreferenced registrations ordered by last use
+    lru: BTreeMap<u64, u32>,
+    /// Monotonic LRU clock
+    clock: u64,
+}
+
+/// A cached memory region registration
+pub(crate) struct CachedMr {
+    /// Start virtual address
+    pub(crate) addr: u64,
+    /// Length in bytes
+    pub(crate) length: u64,
+    /// Protection domain
+    pd_handle: u32,
+    /// Access flags
+    access: u8,
+    /// Physical addresses of the pages at registration time
+    pub(crate) phys_addrs: Vec<u64>,
+    /// Number of live registrations sharing this entry
+    refs: usize,
+    /// LRU stamp, `Some` if the entry is unreferenced
+    stamp: Option<u64>,
+    /// Whether the entry may be reused
+    valid: bool,
+}
+
+impl CachedMr {
+    /// Creates a new `CachedMr`
+    pub(crate) fn new(
+        addr: u64,
+        length: u64,
+        pd_handle: u32,
+        access: u8,
+        phys_addrs: Vec<u64>,
+    ) -> Self {
+        Self {
+            addr,
+            length,
+            pd_handle,
+            access,
+            phys_addrs,
+            refs: 1,
+            stamp: None,
+            valid: true,
+        }
+    }
+
+    /// Returns `true` if the entry covers the range with compatible PD and access flags
+    fn covers(&self, end: u64, pd_handle: u32, access: u8) -> bool {
+        self.valid
+            && self.pd_handle == pd_handle
+            && self.access & access == access
+            && self.addr.saturating_add(self.length) >= end
+    }
+}
+
+impl MrCache {
+    /// Creates a new `MrCache`
+    pub(crate) fn new(capacity: usize) -> Self {
+        Self {
+            capacity,
+            entries: HashMap::new(),
+            index: BTreeSet::new(),
+            max_length: 0,
+            lru: BTreeMap::new(),
+            clock: 0,
+        }
+    }
+
+    /// Returns `true` if new registrations should be cached
+    pub(crate) fn is_enabled(&self) -> bool {
+        self.capacity != 0
+    }
+
+    /// Finds a cached registration covering the range
+    pub(crate) fn find(
+        &self,
+        addr: u64,
+        length: u64,
+        pd_handle: u32,
+        access: u8,
+    ) -> Option<(u32, &CachedMr)> {
+        let end = addr.checked_add(length)?;
+        let lower = end.saturating_sub(self.max_length);
+        self.index
+            .range((lower, 0)..=(addr, u32::MAX))
+            .rev()
+            .filter_map(|&(_, mr_key)| self.entries.get(&mr_key).map(|mr| (mr_key, mr)))
+            .find(|(_, mr)| mr.covers(end, pd_handle, access))
+    }
+
+    /// Adds a new live registration to the cache
+    pub(crate) fn insert(&mut self, mr_key: u32, mr: CachedMr) {
+        self.max_length = self.max_length.max(mr.length);
+        let _new = self.index.insert((mr.addr, mr_key));
+        if let Some(old) = self.entries.insert(mr_key, mr) {
+            let _ignore = self.index.remove(&(old.addr, mr_key));
+        }
+    }
+
+    /// Takes a reference to a cached registration
+    pub(crate) fn acquire(&mut self, mr_key: u32) {
+        if let Some(mr) = self.entries.get_mut(&mr_key) {
+            mr.refs += 1;
+            if let Some(stamp) = mr.stamp.take() {
+                let _ignore = self.lru.remove(&stamp);
+            }
+        }
+    }
+
+    /// Returns `true` if the registration is cached and no longer referenced
+    pub(crate) fn is_unreferenced(&self, mr_key: u32) -> bool {
+        self.entries.get(&mr_key).is_some_and(|mr| mr.refs == 0)
+    }
+
+    /// Drops a reference to a cached registration
+    ///
+    /// # Returns
+    ///
+    /// `None` if the key is not cached, otherwise the keys of the registrations that should be
+    /// removed from the hardware
+    pub(crate) fn release(&mut self, mr_key: u32) -> Option<Vec<u32>> {
+        let mr = self.entries.get_mut(&mr_key)?;
+        mr.refs = mr.refs.saturating_sub(1);
+        if mr.refs != 0 {
+            return Some(Vec::new());
+        }
+        if !mr.valid {
+            self.remove(mr_key);
+            return Some(vec![mr_key]);
+        }
+        let stamp = self.clock;
+        self.clock += 1;
+        mr.stamp = Some(stamp);
+        let _ignore = self.lru.insert(stamp, mr_key);
+
+        Some(self.evict())
+    }
+
+    /// Takes a registration out of the cache, for a registration changed by its only user
+    ///
+    /// # Returns
+    ///
+    /// `false` if the registration is shared by several users and is kept
+    pub(crate) fn detach(&mut self, mr_key: u32) -> bool {
+        if self.entries.get(&mr_key).is_some_and(|mr| mr.refs > 1) {
+            return false;
+        }
+        self.remove(mr_key);
+
+        true
+    }
+
+    /// Marks a cached registration as no longer reusable
+    ///
+    /// # Returns
+    ///
+    /// `true` if the registration is unreferenced and should be removed from the hardware
+    pub(crate) fn invalidate(&mut self, mr_key: u32) -> bool {
+        let Some(mr) = self.entries.get_mut(&mr_key) else {
+            return false;
+        };
+        mr.valid = false;
+        let _ignore = self.index.remove(&(mr.addr, mr_key));
+        if mr.refs != 0 {
+            return false;
+        }
+        self.remove(mr_key);
+
+        true
+    }
+
+    /// Evicts least recently used entries exceeding the capacity
+    fn evict(&mut self) -> Vec<u32> {
+        let mut evicted = Vec::new();
+        while self.lru.len() > self.capacity {
+            let Some((_, mr_key)) = self.lru.pop_first() else {
+                break;
+            };
+            self.remove(mr_key);
+            evicted.push(mr_key);
+        }
+        evicted
+    }
+
+    /// Removes an entry from the cache
+    fn remove(&mut self, mr_key: u32) {
+        let Some(mr) = self.entries.remove(&mr_key) else {
+            return;
+        };
+        let _ignore = self.index.remove(&(mr.addr, mr_key));
+        if let Some(stamp) = mr.stamp {
+            let _ignore = self.lru.remove(&stamp);
+        }
+        if self.index.is_empty() {
+            self.max_length = 0;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const PD: u32 = 1;
+    const ACCESS_RW: u8 = 0b111;
+    const ACCESS_R: u8 = 0b100;
+
+    fn cached(addr: u64, length: u64) -> CachedMr {
+        CachedMr::new(addr, length, PD, ACCESS_RW, vec![])
+    }
+
+    #[test]
+    fn covered_range_reuses_key() {
+        let mut cache = MrCache::new(4);
+        cache.insert(1, cached(0x1000, 0x10000));
+        cache.insert(2, cached(0x8000, 0x1000));
+        assert_eq!(cache.find(0x2000, 0x1000, PD, ACCESS_R).map(|x| x.0), Some(1));
+        assert_eq!(cache.find(0x8000, 0x1000, PD, ACCESS_RW).map(|x| x.0), Some(2));
+        assert!(cache.find(0x8000, 0x10000, PD, ACCESS_RW).is_none());
+        assert!(cache.find(0x2000, 0x1000, PD + 1, ACCESS_R).is_none());
+    }
+
+    #[test]
+    fn incompatible_access_misses() {
+        let mut cache = MrCache::new(4);
+        cache.insert(1, CachedMr::new(0x1000, 0x1000, PD, ACCESS_R, vec![]));
+        assert!(cache.find(0x1000, 0x1000, PD, ACCESS_RW).is_none());
+        assert!(cache.find(0x1000, 0x1000, PD, ACCESS_R).is_some());
+    }
+
+    #[test]
+    fn unreferenced_entries_are_evicted_in_lru_order() {
+        let mut cache = MrCache::new(1);
+        cache.insert(1, cached(0x1000, 0x1000));
+        cache.insert(2, cached(0x2000, 0x1000));
+        cache.acquire(1);
+        assert_eq!(cache.release(1), Some(vec![]));
+        assert!(!cache.is_unreferenced(1));
+        assert_eq!(cache.release(1), Some(vec![]));
+        assert!(cache.is_unreferenced(1));
+        assert_eq!(cache.release(2), Some(vec![1]));
+        assert!(cache.find(0x1000, 0x1000, PD, ACCESS_RW).is_none());
+        cache.acquire(2);
+        assert!(cache.lru.is_empty());
+        assert_eq!(cache.release(3), None);
+    }
+
+    #[test]
+    fn invalidated_entry_is_removed_on_last_release() {
+        let mut cache = MrCache::new(4);
+        cache.insert(1, cached(0x1000, 0x1000));
+        assert!(!cache.invalidate(1));
+        assert!(cache.find(0x1000, 0x1000, PD, ACCESS_RW).is_none());
+        assert_eq!(cache.release(1), Some(vec![1]));
+        assert!(cache.entries.is_empty());
+    }
+}
@@ -1,10 +1,14 @@
-use std::{collections::HashMap, io, iter, mem::take};
+use std::{
+    collections::{BTreeMap, BTreeSet, HashMap},
+    io, iter,
+    mem::take,
+    ops::Range,
+};
 
-use bitvec::{array::BitArray, bitarr};
 use rand::Rng;
 
 use crate::{
-    constants::{LR_KEY_KEY_PART_WIDTH, MAX_MR_CNT, PGT_LEN},
+    constants::{LR_KEY_KEY_PART_WIDTH, MAX_MR_CNT, PGT_LEN, RECV_RING_MR_KEY},
     mem::{get_num_page, page::ContiguousPages, virt_to_phy::AddressResolver, PAGE_SIZE},
     RdmaError,
 };
@@ -20,8 +24,14 @@ pub(crate) struct Mtt {
 impl Mtt {
     /// Creates a new `Mtt`
     pub(crate) fn new() -> Self {
+        Self::with_shares(0..MAX_MR_CNT, 0..PGT_LEN)
+    }
+
+    /// Creates a `Mtt` allocating only the MR key indices of `mr_keys` and the page table
+    /// entries of `pgt`, the other entries belong to other contexts of the device
+    pub(crate) fn with_shares(mr_keys: Range<usize>, pgt: Range<usize>) -> Self {
         Self {
-            alloc: Alloc::new(),
+            alloc: Alloc::with_shares(mr_keys, pgt),
             mrkey_map: HashMap::new(),
         }
     }
@@ -40,8 +50,68 @@ impl Mtt {
         Ok((mr_key, pgt_entry))
     }
 
+    /// Register a memory region with the reserved key `RECV_RING_MR_KEY`
+    pub(crate) fn register_reserved(&mut self, num_pages: usize) -> io::Result<PgtEntry> {
+        if self.mrkey_map.contains_key(&RECV_RING_MR_KEY) {
+            return Err(io::ErrorKind::AlreadyExists.into());
+        }
+        let pgt_entry = self
+            .alloc
+            .alloc_pgt(num_pages)
+            .ok_or(io::Error::from(io::ErrorKind::OutOfMemory))?;
+        let _ignore = self.mrkey_map.insert(RECV_RING_MR_KEY, pgt_entry);
+
+        Ok(pgt_entry)
+    }
+
+    /// Allocates the key of a memory window, windows use the PGT entries of the MRs they are
+    /// bound to
+    pub(crate) fn register_window(&mut self) -> io::Result<u32> {
+        self.alloc
+            .alloc_mr_key()
+            .ok_or(io::Error::from(io::ErrorKind::OutOfMemory))
+    }
+
+    /// Returns the PGT range of a registered MR
+    pub(crate) fn pgt_entry(&self, mr_key: u32) -> Option<PgtEntry> {
+        self.mrkey_map.get(&mr_key).copied()
+    }
+
+    /// Makes the PGT range of a MR hold at least `num_pages` entries, the range is kept if it
+    /// is large enough, otherwise it is moved to a new range
+    #[allow(clippy::as_conversions)]
+    pub(crate) fn resize(&mut self, mr_key: u32, num_pages: usize) -> io::Result<PgtEntry> {
+        let entry = self
+            .pgt_entry(mr_key)
+            .ok_or(io::Error::from(io::ErrorKind::NotFound))?;
+        if num_pages <= entry.count as usize {
+            return Ok(entry);
+        }
+        let new_entry = self
+            .alloc
+            .alloc_pgt(num_pages)
+            .ok_or(io::Error::from(io::ErrorKind::OutOfMemory))?;
+        let _freed = self
+            .alloc
+            .pgt
+            .dealloc(entry.index as usize, entry.count as usize);
+        let _ignore = self.mrkey_map.insert(mr_key, new_entry);
+
+        Ok(new_entry)
+    }
+
+    /// Frees the key of a memory window
+    pub(crate) fn deregister_window(&mut self, mw_key: u32) {
+        self.alloc
+            .mr
+            .dealloc_mr_key(MrKeyIndex(mw_key >> LR_KEY_KEY_PART_WIDTH));
+    }
+
     /// Deregister a memory region
     pub(crate) fn deregister(&mut self, mr_key: u32) -> crate::error::Result<()> {
+        if mr_key == RECV_RING_MR_KEY {
+            return Err(RdmaError::InvalidInput("mr key is reserved".into()));
+        }
         let entry = self
             .mrkey_map
             .remove(&mr_key)
@@ -90,6 +160,81 @@ pub(crate) struct PgtEntry {
     pub(crate) count: u32,
 }
 
+/// A memory region registered with on-demand paging
+#[derive(Clone, Copy)]
+pub(crate) struct OdpMr {
+    /// Start virtual address
+    pub(crate) addr: u64,
+    /// Length in bytes
+    pub(crate) length: usize,
+    /// Protection domain
+    pub(crate) pd_handle: u32,
+    /// Page table range of the region
+    pub(crate) pgt_entry: PgtEntry,
+}
+
+impl OdpMr {
+    /// Returns the index of the first page and the number of pages of a range in the region
+    #[allow(clippy::arithmetic_side_effects, clippy::as_conversions)]
+    pub(crate) fn page_range(&self, addr: u64, length: usize) -> Option<(usize, usize)> {
+        let end = addr.checked_add(length as u64)?;
+        let mr_end = self.addr.checked_add(self.length as u64)?;
+        if length == 0 || addr < self.addr || end > mr_end {
+            return None;
+        }
+        let first = addr / PAGE_SIZE as u64 - self.addr / PAGE_SIZE as u64;
+        Some((first as usize, get_num_page(addr, length)))
+    }
+}
+
+/// A memory region pinned at registration
+#[derive(Clone, Copy)]
+pub(crate) struct PinnedMr {
+    /// Start virtual address
+    pub(crate) addr: u64,
+    /// Length in bytes
+    pub(crate) length: usize,
+    /// Protection domain
+    pub(crate) pd_handle: u32,
+    /// Access flags
+    pub(crate) access: u8,
+}
+
+impl PinnedMr {
+    /// Splits the pages of a new range of the region into runs of pages in order.
+    ///
+    /// Each run is given by the address of its first page, its number of pages, and whether
+    /// its pages are also pages of the current range, which are already pinned.
+    #[allow(clippy::arithmetic_side_effects, clippy::as_conversions)]
+    pub(crate) fn page_runs(&self, addr: u64, length: usize) -> Vec<(u64, usize, bool)> {
+        let page = PAGE_SIZE as u64;
+        let first = |addr: u64| addr / page;
+        let (old_first, new_first) = (first(self.addr), first(addr));
+        let old_end = old_first + get_num_page(self.addr, self.length) as u64;
+        let new_end = new_first + get_num_page(addr, length) as u64;
+        let kept = new_first.max(old_first)..new_end.min(old_end);
+        let runs = if kept.is_empty() {
+            [(new_first..new_end, false), (0..0, false), (0..0, false)]
+        } else {
+            [
+                (new_first..kept.start, false),
+                (kept.clone(), true),
+                (kept.end..new_end, false),
+            ]
+        };
+        runs.into_iter()
+            .filter(|(pages, _)| !pages.is_empty())
+            .map(|(pages, pinned)| {
+                (
+                    pages.start * page,
+                    (pages.end - pages.start) as usize,
+                    pinned,
+                )
+            })
+            .collect()
+    }
+}
+
 /// Table memory allocator for MTT
 pub(crate) struct Alloc {
     /// First stage table allocator
@@ -99,18 +244,23 @@ pub(crate) struct Alloc {
 }
 
 impl Alloc {
-    /// Creates a new allocator instance
-    pub(super) fn new() -> Self {
+    /// Creates an allocator of the MR key indices of `mr_keys` and the page table entries of
+    /// `pgt`
+    pub(super) fn with_shares(mr_keys: Range<usize>, pgt: Range<usize>) -> Self {
         Self {
-            mr: MrTableAlloc::new(),
-            pgt: PgtAlloc::new(),
+            mr: MrTableAlloc::with_share(mr_keys),
+            pgt: PgtAlloc::with_share(pgt),
         }
     }
 
     /// Allocates memory region and page table entries
     pub(super) fn alloc(&mut self, num_pages: usize) -> Option<(u32, PgtEntry)> {
-        self.alloc_mr_key()
-            .and_then(|x| self.alloc_pgt(num_pages).map(|y| (x, y)))
+        let mr_key = self.alloc_mr_key()?;
+        let Some(pgt_entry) = self.alloc_pgt(num_pages) else {
+            self.mr.dealloc_mr_key(MrKeyIndex(mr_key >> LR_KEY_KEY_PART_WIDTH));
+            return None;
+        };
+        Some((mr_key, pgt_entry))
     }
 
     /// Deallocates memory region and page table entries
@@ -156,8 +306,13 @@ pub(super) struct MrTableAlloc {
 impl MrTableAlloc {
     /// Creates a new `MrTableAlloc` instance with a pre-filled free list
     pub(super) fn new() -> Self {
+        Self::with_share(0..MAX_MR_CNT)
+    }
+
+    /// Creates a `MrTableAlloc` of the key indices of `share`
+    pub(super) fn with_share(share: Range<usize>) -> Self {
         Self {
-            free_list: Self::fill_up_free_list(),
+            free_list: Self::fill_up_free_list(share),
         }
     }
 
@@ -175,26 +330,54 @@ impl MrTableAlloc {
         self.free_list.push(key);
     }
 
-    /// Creates initial free list containing all possible memory region keys
-    fn fill_up_free_list() -> Vec<MrKeyIndex> {
-        (0..u32::try_from(MAX_MR_CNT).unwrap_or_else(|_| unreachable!("invalid  MAX_MR_CNT")))
+    /// Creates initial free list containing the memory region keys of `share` except the
+    /// reserved one
+    fn fill_up_free_list(share: Range<usize>) -> Vec<MrKeyIndex> {
+        let reserved = RECV_RING_MR_KEY >> LR_KEY_KEY_PART_WIDTH;
+        let end = share.end.min(MAX_MR_CNT);
+        (share.start..end)
+            .map(|x| u32::try_from(x).unwrap_or_else(|_| unreachable!("invalid  MAX_MR_CNT")))
+            .filter(|&x| x != reserved)
             .map(MrKeyIndex)
             .collect()
     }
 }
 
-/// A simple page table allocator that uses a bit array to track free/used entries
+/// Page table allocator tracking free extents
+///
+/// Free extents are indexed both by start index and by length. Allocation takes the smallest
+/// free extent that fits, freed extents are merged with their free neighbors. Both operations
+/// are O(log n) in the number of extents.
 pub(crate) struct PgtAlloc {
-    /// Bit array tracking which entries are free `false` or used `true`
-    free_list: BitArray<[usize; PGT_LEN / 64]>,
+    /// Free extents, maps start index to length
+    free_by_start: BTreeMap<usize, usize>,
+    /// Free extents ordered by `(length, start index)`
+    free_by_len: BTreeSet<(usize, usize)>,
+    /// Allocated extents, maps start index to length
+    allocated: HashMap<usize, usize>,
+    /// Total number of free entries
+    num_free: usize,
 }
 
 impl PgtAlloc {
-    /// Creates a new empty `SimplePgtAlloc` with all entries marked as free
+    /// Creates a new `PgtAlloc` with all entries free
     pub(crate) fn new() -> Self {
-        Self {
-            free_list: bitarr![0; PGT_LEN],
+        Self::with_share(0..PGT_LEN)
+    }
+
+    /// Creates a `PgtAlloc` with the entries of `share` free
+    pub(crate) fn with_share(share: Range<usize>) -> Self {
+        let mut this = Self {
+            free_by_start: BTreeMap::new(),
+            free_by_len: BTreeSet::new(),
+            allocated: HashMap::new(),
+            num_free: 0,
+        };
+        let end = share.end.min(PGT_LEN);
+        if share.start < end {
+            this.insert_free(share.start, end - share.start);
         }
+        this
     }
 
     /// Allocates a contiguous range of page table entries
@@ -207,26 +390,19 @@ impl PgtAlloc {
     ///
     /// * `Some(index)` - Starting index of allocated range if successful
     /// * `None` - If allocation failed
-    #[allow(clippy::arithmetic_side_effects, clippy::indexing_slicing)] // should never overflow
-    fn alloc(&mut self, len: usize) -> Option<usize> {
-        let mut count = 0;
-        let mut start = 0;
-
-        for i in 0..self.free_list.len() {
-            if self.free_list[i] {
-                count = 0;
-            } else {
-                if count == 0 {
-                    start = i;
-                }
-                count += 1;
-                if count == len {
-                    self.free_list[start..start + len].fill(true);
-                    return Some(start);
-                }
-            }
+    #[allow(clippy::arithmetic_side_effects)] // extents never exceed `PGT_LEN`
+    pub(crate) fn alloc(&mut self, len: usize) -> Option<usize> {
+        if len == 0 {
+            return None;
+        }
+        let &(extent_len, start) = self.free_by_len.range((len, 0)..).next()?;
+        self.remove_free(start, extent_len);
+        if extent_len > len {
+            self.insert_free(start + len, extent_len - len);
         }
-        None
+        let _ignore = self.allocated.insert(start, len);
+
+        Some(start)
     }
 
     /// Deallocates a previously allocated range of page table entries
@@ -239,17 +415,56 @@ impl PgtAlloc {
     /// # Returns
     ///
     /// * `true` - If deallocation was successful
-    /// * `false` - If deallocation failed (e.g. invalid range)
-    // TODO: track the size of allocated range and check in dealloc
-    fn dealloc(&mut self, index: usize, len: usize) -> bool {
-        let Some(end) = index.checked_add(len) else {
+    /// * `false` - If the range does not match an allocated range
+    #[allow(clippy::arithmetic_side_effects)] // extents never exceed `PGT_LEN`
+    pub(crate) fn dealloc(&mut self, index: usize, len: usize) -> bool {
+        if self.allocated.get(&index) != Some(&len) {
             return false;
-        };
-        if let Some(slice) = self.free_list.get_mut(index..end) {
-            slice.fill(false);
-            return true;
         }
-        false
+        let _ignore = self.allocated.remove(&index);
+        let mut start = index;
+        let mut end = index + len;
+        if let Some((&prev_start, &prev_len)) = self.free_by_start.range(..index).next_back() {
+            if prev_start + prev_len == index {
+                self.remove_free(prev_start, prev_len);
+                start = prev_start;
+            }
+        }
+        if let Some(&next_len) = self.free_by_start.get(&end) {
+            self.remove_free(end, next_len);
+            end += next_len;
+        }
+        self.insert_free(start, end - start);
+
+        true
+    }
+
+    /// Returns the fragmentation of the free entries
+    ///
+    /// The value is `1 - largest free extent / total free entries`, 0 means all free entries are
+    /// contiguous.
+    #[allow(clippy::as_conversions, clippy::cast_precision_loss)] // never exceeds `PGT_LEN`
+    pub(crate) fn fragmentation(&self) -> f64 {
+        let Some(&(largest, _)) = self.free_by_len.last() else {
+            return 0.0;
+        };
+        1.0 - largest as f64 / self.num_free as f64
+    }
+
+    /// Adds a free extent
+    #[allow(clippy::arithmetic_side_effects)]
+    fn insert_free(&mut self, start: usize, len: usize) {
+        let _ignore = self.free_by_start.insert(start, len);
+        let _new = self.free_by_len.insert((len, start));
+        self.num_free += len;
+    }
+
+    /// Removes a free extent
+    #[allow(clippy::arithmetic_side_effects)]
+    fn remove_free(&mut self, start: usize, len: usize) {
+        let _ignore = self.free_by_start.remove(&start);
+        let _removed = self.free_by_len.remove(&(len, start));
+        self.num_free -= len;
     }
 }
 
@@ -264,12 +479,29 @@ mod test {
             .take(MAX_MR_CNT)
             .flatten()
             .collect();
-        assert_eq!(mr_keys.len(), MAX_MR_CNT);
+        // one key is reserved for the receive WR rings
+        assert_eq!(mr_keys.len(), MAX_MR_CNT - 1);
         assert!(alloc.alloc_mr_key_idx().is_none());
         alloc.dealloc_mr_key(mr_keys[0]);
         alloc.alloc_mr_key_idx().unwrap();
     }
 
+    #[test]
+    fn shares_only_allocate_their_entries() {
+        let mut mr = MrTableAlloc::with_share(16..32);
+        let keys: Vec<_> = iter::repeat_with(|| mr.alloc_mr_key_idx())
+            .take(MAX_MR_CNT)
+            .flatten()
+            .collect();
+        assert_eq!(keys.len(), 16);
+        assert!(keys.iter().all(|key| (16..32).contains(&key.0)));
+
+        let mut pgt = PgtAlloc::with_share(100..200);
+        assert_eq!(pgt.alloc(10), Some(100));
+        assert!(pgt.alloc(91).is_none());
+        assert_eq!(pgt.alloc(90), Some(110));
+    }
+
     #[test]
     fn simple_pgt_alloc_dealloc_ok() {
         let mut alloc = PgtAlloc::new();
@@ -278,4 +510,90 @@ mod test {
         assert!(alloc.dealloc(index, 10));
         alloc.alloc(PGT_LEN).unwrap();
     }
+
+    #[test]
+    fn odp_mr_page_range() {
+        let page = PAGE_SIZE as u64;
+        let mr = OdpMr {
+            addr: page + 8,
+            length: 4 * PAGE_SIZE,
+            pd_handle: 0,
+            pgt_entry: PgtEntry { index: 0, count: 5 },
+        };
+        assert_eq!(mr.page_range(page + 8, 1), Some((0, 1)));
+        assert_eq!(mr.page_range(3 * page, PAGE_SIZE + 1), Some((2, 2)));
+        assert_eq!(mr.page_range(page, 16), None);
+        assert_eq!(mr.page_range(4 * page, PAGE_SIZE + 9), None);
+        assert_eq!(mr.page_range(2 * page, 0), None);
+    }
+
+    #[test]
+    fn rereg_pins_only_new_pages() {
+        let page = PAGE_SIZE as u64;
+        let mr = PinnedMr {
+            addr: 4 * page + 8,
+            length: 3 * PAGE_SIZE,
+            pd_handle: 0,
+            access: 0,
+        };
+        // Grows on both sides
+        assert_eq!(
+            mr.page_runs(2 * page, 6 * PAGE_SIZE),
+            [(2 * page, 2, false), (4 * page, 4, true)]
+        );
+        assert_eq!(
+            mr.page_runs(2 * page, 7 * PAGE_SIZE),
+            [
+                (2 * page, 2, false),
+                (4 * page, 4, true),
+                (8 * page, 1, false)
+            ]
+        );
+        // Shrinks
+        assert_eq!(mr.page_runs(5 * page, 8), [(5 * page, 1, true)]);
+        // Moves to disjoint pages
+        assert_eq!(
+            mr.page_runs(16 * page, PAGE_SIZE + 1),
+            [(16 * page, 2, false)]
+        );
+    }
+
+    #[test]
+    fn resize_keeps_large_enough_ranges() {
+        let mut mtt = Mtt::new();
+        let (mr_key, entry) = mtt.register(4).unwrap();
+        let kept = mtt.resize(mr_key, 2).unwrap();
+        assert_eq!((kept.index, kept.count), (entry.index, entry.count));
+        let moved = mtt.resize(mr_key, 8).unwrap();
+        assert_eq!(moved.count, 8);
+        assert_eq!(mtt.pgt_entry(mr_key).unwrap().index, moved.index);
+        mtt.deregister(mr_key).unwrap();
+    }
+
+    #[test]
+    fn pgt_dealloc_checks_allocated_size() {
+        let mut alloc = PgtAlloc::new();
+        let index = alloc.alloc(10).unwrap();
+        assert!(!alloc.dealloc(index, 5));
+        assert!(!alloc.dealloc(index + 1, 9));
+        assert!(alloc.dealloc(index, 10));
+        assert!(!alloc.dealloc(index, 10));
+    }
+
+    #[test]
+    fn pgt_freed_extents_are_merged() {
+        let mut alloc = PgtAlloc::new();
+        let a = alloc.alloc(4).unwrap();
+        let b = alloc.alloc(4).unwrap();
+        let c = alloc.alloc(4).unwrap();
+        assert!(alloc.dealloc(a, 4));
+        assert!(alloc.dealloc(c, 4));
+        assert!(alloc.fragmentation() > 0.0);
+        // best fit reuses the hole left by `a`
+        assert_eq!(alloc.alloc(2), Some(a));
+        assert!(alloc.dealloc(a, 2));
+        assert!(alloc.dealloc(b, 4));
+        assert!(alloc.fragmentation().abs() < f64::EPSILON);
+        assert_eq!(alloc.alloc(PGT_LEN), Some(0));
+    }
 }
@@ -0,0 +1,344 @@
+use std::collections::HashMap;
+
+use ibverbs_sys::{
+    ibv_access_flags::{IBV_ACCESS_LOCAL_WRITE, IBV_ACCESS_REMOTE_ATOMIC, IBV_ACCESS_REMOTE_WRITE},
+    ibv_send_wr,
+    ibv_wr_opcode::{IBV_WR_BIND_MW, IBV_WR_LOCAL_INV},
+};
+
+use crate::{
+    cmd::MttUpdate,
+    constants::LR_KEY_KEY_PART_WIDTH,
+    error::{RdmaError, Result},
+    mem::PAGE_SIZE,
+};
+
+/// A memory window operation posted to the send queue
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum MwWr {
+    /// Binds the window `handle` to a range of the MR `mr_key`, the window is accessed with
+    /// `rkey` from now on
+    Bind {
+        wr_id: u64,
+        send_flags: u32,
+        handle: u32,
+        rkey: u32,
+        mr_key: u32,
+        addr: u64,
+        length: u64,
+        access: u8,
+    },
+    /// Revokes the remote accesses through `rkey`
+    LocalInv {
+        wr_id: u64,
+        send_flags: u32,
+        rkey: u32,
+    },
+}
+
+impl MwWr {
+    /// Returns `true` if the opcode of a send WR is a memory window operation
+    pub(crate) fn is_mw_opcode(opcode: u32) -> bool {
+        opcode == IBV_WR_BIND_MW || opcode == IBV_WR_LOCAL_INV
+    }
+
+    #[allow(unsafe_code, clippy::as_conversions, clippy::cast_possible_truncation)]
+    pub(crate) fn new(wr: ibv_send_wr) -> Result<Self> {
+        match wr.opcode {
+            IBV_WR_BIND_MW => {
+                // SAFETY: the bind_mw field is valid for bind operations
+                let bind = unsafe { wr.__bindgen_anon_2.bind_mw };
+                // SAFETY: the verbs API requires `mw` and `mr` to be valid or null
+                let mw = unsafe { bind.mw.as_ref() }
+                    .ok_or(RdmaError::InvalidInput("Bind without a MW".into()))?;
+                let mr = unsafe { bind.bind_info.mr.as_ref() }
+                    .ok_or(RdmaError::InvalidInput("Bind without a MR".into()))?;
+                Ok(Self::Bind {
+                    wr_id: wr.wr_id,
+                    send_flags: wr.send_flags,
+                    handle: mw.handle,
+                    rkey: bind.rkey,
+                    mr_key: mr.lkey,
+                    addr: bind.bind_info.addr,
+                    length: bind.bind_info.length,
+                    access: bind.bind_info.mw_access_flags as u8,
+                })
+            }
+            IBV_WR_LOCAL_INV => Ok(Self::LocalInv {
+                wr_id: wr.wr_id,
+                send_flags: wr.send_flags,
+                // SAFETY: invalidate_rkey is valid for invalidate operations
+                rkey: unsafe { wr.__bindgen_anon_1.invalidate_rkey },
+            }),
+            _ => Err(RdmaError::InvalidInput(format!(
+                "Opcode {} is not a memory window operation",
+                wr.opcode
+            ))),
+        }
+    }
+
+    pub(crate) fn send_flags(&self) -> u32 {
+        match *self {
+            Self::Bind { send_flags, .. } | Self::LocalInv { send_flags, .. } => send_flags,
+        }
+    }
+}
+
+/// A MR registered with `IBV_ACCESS_MW_BIND`
+#[derive(Debug, Clone, Copy)]
+struct BindableMr {
+    addr: u64,
+    length: usize,
+    pd_handle: u32,
+    access: u8,
+    /// PGT entry of the first page of the MR
+    pgt_index: u32,
+}
+
+/// A type 2 memory window
+#[derive(Debug, Clone, Copy)]
+struct Window {
+    pd_handle: u32,
+    /// Key of the last bind, only its key part changes
+    rkey: u32,
+    /// MR the window is bound to
+    mr_key: Option<u32>,
+}
+
+/// Range of a MR a window grants remote access to
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct WindowBinding {
+    pub(crate) rkey: u32,
+    pub(crate) addr: u64,
+    pub(crate) length: usize,
+    pub(crate) access: u8,
+    /// MR table entry of the window
+    pub(crate) update: MttUpdate,
+}
+
+/// Type 2 memory windows of a context.
+///
+/// A window owns a MR table entry but no PGT entries. A bind writes the entry of the window
+/// with its range and the PGT entries of the MR covering that range, so granting and revoking
+/// remote access costs one command instead of a registration.
+#[derive(Debug, Default)]
+pub(crate) struct MwTable {
+    /// MRs windows can be bound to, keyed by `mr_key`
+    mrs: HashMap<u32, BindableMr>,
+    /// Windows keyed by the index part of their key
+    windows: HashMap<u32, Window>,
+}
+
+impl MwTable {
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    /// Allows windows to be bound to the MR if it has `IBV_ACCESS_MW_BIND` access
+    pub(crate) fn add_mr(
+        &mut self,
+        mr_key: u32,
+        addr: u64,
+        length: usize,
+        pd_handle: u32,
+        access: u8,
+        pgt_index: u32,
+    ) {
+        #[allow(clippy::as_conversions, clippy::cast_possible_truncation)]
+        const ACCESS_MW_BIND: u8 = ibverbs_sys::ibv_access_flags::IBV_ACCESS_MW_BIND.0 as u8;
+        if access & ACCESS_MW_BIND != 0 {
+            let mr = BindableMr {
+                addr,
+                length,
+                pd_handle,
+                access,
+                pgt_index,
+            };
+            let _ignore = self.mrs.insert(mr_key, mr);
+        }
+    }
+
+    pub(crate) fn remove_mr(&mut self, mr_key: u32) {
+        let _ignore = self.mrs.remove(&mr_key);
+    }
+
+    /// Returns `true` if a window is bound to the MR
+    pub(crate) fn is_bound(&self, mr_key: u32) -> bool {
+        self.windows.values().any(|w| w.mr_key == Some(mr_key))
+    }
+
+    /// Records a new unbound window of key `rkey`, returns its handle
+    pub(crate) fn alloc(&mut self, rkey: u32, pd_handle: u32) -> u32 {
+        let window = Window {
+            pd_handle,
+            rkey,
+            mr_key: None,
+        };
+        let _ignore = self.windows.insert(rkey >> LR_KEY_KEY_PART_WIDTH, window);
+        rkey
+    }
+
+    /// Removes a window, returns its last key if it is still bound
+    pub(crate) fn dealloc(&mut self, handle: u32) -> Result<Option<u32>> {
+        let window = self
+            .windows
+            .remove(&(handle >> LR_KEY_KEY_PART_WIDTH))
+            .ok_or(RdmaError::InvalidInput(format!("MW {handle} not present")))?;
+        Ok(window.mr_key.map(|_| window.rkey))
+    }
+
+    /// Binds the window `handle` to `length` bytes at `addr` of the MR `mr_key`.
+    ///
+    /// Returns the binding, and the key of the previous binding, which is no longer valid.
+    #[allow(
+        clippy::as_conversions,
+        clippy::cast_possible_truncation,
+        clippy::arithmetic_side_effects
+    )]
+    pub(crate) fn bind(
+        &mut self,
+        handle: u32,
+        rkey: u32,
+        mr_key: u32,
+        addr: u64,
+        length: u64,
+        access: u8,
+    ) -> Result<(WindowBinding, Option<u32>)> {
+        /// Remote accesses that write to the memory, the MR must allow local writes
+        const ACCESS_WRITES: u8 = (IBV_ACCESS_REMOTE_WRITE.0 | IBV_ACCESS_REMOTE_ATOMIC.0) as u8;
+        let index = handle >> LR_KEY_KEY_PART_WIDTH;
+        if rkey >> LR_KEY_KEY_PART_WIDTH != index {
+            return Err(RdmaError::InvalidInput(format!(
+                "Key {rkey:#x} does not belong to MW {handle}"
+            )));
+        }
+        let mr = self
+            .mrs
+            .get(&mr_key)
+            .ok_or(RdmaError::InvalidInput(format!(
+                "MR {mr_key} has no MW bind access"
+            )))?;
+        let window = self
+            .windows
+            .get_mut(&index)
+            .ok_or(RdmaError::InvalidInput(format!("MW {handle} not present")))?;
+        if window.pd_handle != mr.pd_handle {
+            return Err(RdmaError::InvalidInput("PD mismatch".into()));
+        }
+        if access & ACCESS_WRITES != 0 && mr.access & IBV_ACCESS_LOCAL_WRITE.0 as u8 == 0 {
+            return Err(RdmaError::InvalidInput(
+                "Remote writes through a MW require a MR with local write access".into(),
+            ));
+        }
+        let end = addr.checked_add(length);
+        let mr_end = mr.addr.saturating_add(mr.length as u64);
+        let length = u32::try_from(length)
+            .map_err(|_err| RdmaError::InvalidInput("Length too large".into()))?;
+        if addr < mr.addr || end.map_or(true, |end| end > mr_end) {
+            return Err(RdmaError::InvalidInput("Range out of MR bounds".into()));
+        }
+        // Pages are translated relative to the page of the base address of the entry
+        let first_page = addr / PAGE_SIZE as u64 - mr.addr / PAGE_SIZE as u64;
+        let update = MttUpdate::new(
+            addr,
+            length,
+            rkey,
+            mr.pd_handle,
+            access,
+            mr.pgt_index + first_page as u32,
+        );
+        let previous = window.mr_key.map(|_| window.rkey);
+        window.rkey = rkey;
+        window.mr_key = Some(mr_key);
+        let binding = WindowBinding {
+            rkey,
+            addr,
+            length: length as usize,
+            access,
+            update,
+        };
+
+        Ok((binding, previous.filter(|&x| x != rkey)))
+    }
+
+    /// Unbinds the window accessed with `rkey`
+    pub(crate) fn invalidate(&mut self, rkey: u32) -> Result<()> {
+        match self.windows.get_mut(&(rkey >> LR_KEY_KEY_PART_WIDTH)) {
+            Some(window) if window.rkey == rkey && window.mr_key.is_some() => {
+                window.mr_key = None;
+                Ok(())
+            }
+            _ => Err(RdmaError::InvalidInput(format!(
+                "Key {rkey:#x} is not a bound MW"
+            ))),
+        }
+    }
+}
+
+#[cfg(test)]
+#[allow(
+    clippy::unwrap_used,
+    clippy::as_conversions,
+    clippy::cast_possible_truncation
+)]
+mod tests {
+    use super::*;
+
+    const ACCESS_MW_BIND: u8 = ibverbs_sys::ibv_access_flags::IBV_ACCESS_MW_BIND.0 as u8;
+    const ACCESS_REMOTE_READ: u8 = ibverbs_sys::ibv_access_flags::IBV_ACCESS_REMOTE_READ.0 as u8;
+
+    #[test]
+    fn bind_references_the_pgt_entries_of_the_mr() {
+        let page = PAGE_SIZE as u64;
+        let mut table = MwTable::new();
+        table.add_mr(0x100, page + 8, 16 * PAGE_SIZE, 1, ACCESS_MW_BIND, 40);
+        let handle = table.alloc(0x300, 1);
+        let (binding, previous) = table
+            .bind(handle, 0x301, 0x100, 3 * page, 64, ACCESS_REMOTE_READ)
+            .unwrap();
+        assert!(previous.is_none());
+        assert_eq!(binding.update.base_pgt_offset, 42);
+        assert_eq!(binding.update.mr_key, 0x301);
+        assert!(table.is_bound(0x100));
+
+        // Rebinding revokes the previous key
+        let (_, previous) = table
+            .bind(handle, 0x302, 0x100, page + 8, 8, ACCESS_REMOTE_READ)
+            .unwrap();
+        assert_eq!(previous, Some(0x301));
+        assert!(table.invalidate(0x301).is_err());
+        table.invalidate(0x302).unwrap();
+        assert!(!table.is_bound(0x100));
+        assert_eq!(table.dealloc(handle).unwrap(), None);
+    }
+
+    #[test]
+    fn bind_checks_the_window_and_the_mr() {
+        let page = PAGE_SIZE as u64;
+        let mut table = MwTable::new();
+        table.add_mr(0x100, page, PAGE_SIZE, 1, ACCESS_MW_BIND, 0);
+        table.add_mr(0x200, page, PAGE_SIZE, 1, 0, 1);
+        let handle = table.alloc(0x300, 1);
+        let other_pd = table.alloc(0x400, 2);
+        // Out of the MR
+        assert!(table
+            .bind(handle, 0x301, 0x100, page, page + 1, ACCESS_REMOTE_READ)
+            .is_err());
+        // Without MW bind access
+        assert!(table
+            .bind(handle, 0x301, 0x200, page, 8, ACCESS_REMOTE_READ)
+            .is_err());
+        // Key of another window
+        assert!(table
+            .bind(handle, 0x401, 0x100, page, 8, ACCESS_REMOTE_READ)
+            .is_err());
+        assert!(table
+            .bind(other_pd, 0x401, 0x100, page, 8, ACCESS_REMOTE_READ)
+            .is_err());
+        // Remote writes without local write access
+        let remote_write = IBV_ACCESS_REMOTE_WRITE.0 as u8;
+        assert!(table
+            .bind(handle, 0x301, 0x100, page, 8, remote_write)
+            .is_err());
+    }
+}
@@ -22,6 +22,11 @@ impl PdTable {
         Some(index)
     }
 
+    /// Returns `true` if no PD is allocated
+    pub(crate) fn is_empty(&self) -> bool {
+        self.bitmap.count_ones() == 1
+    }
+
     pub(crate) fn dealloc(&mut self, handle: u32) -> bool {
         let index = handle as usize;
         let ret = self.bitmap.get(index).is_some_and(|x| *x);
@@ -1,7 +1,5 @@
-use bitvec::{bits, order::Lsb0, vec::BitVec, view::BitView};
-
 use crate::{
-    constants::{MAX_PSN_WINDOW, PSN_MASK},
+    constants::{DEFAULT_PSN_WINDOW, MAX_PSN_WINDOW, PSN_MASK},
     rdma_utils::psn::Psn,
 };
 
@@ -12,6 +10,22 @@ pub(crate) struct LocalAckTracker {
 }
 
 impl LocalAckTracker {
+    /// Creates a tracker of a window of `window` PSNs
+    pub(crate) fn new(window: usize) -> Self {
+        Self {
+            psn_tracker: PsnTracker::with_window(Psn::default(), window),
+            psn_pre: Psn::default(),
+        }
+    }
+
+    /// Creates a tracker of a QP resumed after the packets before `psn` were received
+    pub(crate) fn resume(psn: Psn, window: usize) -> Self {
+        Self {
+            psn_tracker: PsnTracker::with_window(psn, window),
+            psn_pre: psn,
+        }
+    }
+
     pub(crate) fn ack_one(&mut self, psn: Psn) -> Option<Psn> {
         self.psn_tracker.ack_one(psn)
     }
@@ -44,6 +58,11 @@ impl LocalAckTracker {
     pub(crate) fn base_psn(&self) -> Psn {
         self.psn_tracker.base_psn()
     }
+
+    /// Returns the number of PSNs dropped beyond the window since the last call
+    pub(crate) fn take_dropped(&mut self) -> u64 {
+        self.psn_tracker.take_dropped()
+    }
 }
 
 #[derive(Debug, Default)]
@@ -54,6 +73,25 @@ pub(crate) struct RemoteAckTracker {
 }
 
 impl RemoteAckTracker {
+    /// Creates a tracker of a window of `window` PSNs
+    pub(crate) fn new(window: usize) -> Self {
+        Self {
+            psn_tracker: PsnTracker::with_window(Psn::default(), window),
+            msn_pre: 0,
+            psn_pre: Psn::default(),
+        }
+    }
+
+    /// Creates a tracker of a QP resumed at the WR `msn` starting at `psn`, the WRs before
+    /// it acknowledged
+    pub(crate) fn resume(msn: u16, psn: Psn, window: usize) -> Self {
+        Self {
+            psn_tracker: PsnTracker::with_window(psn, window),
+            msn_pre: msn,
+            psn_pre: psn,
+        }
+    }
+
     pub(crate) fn ack_before(&mut self, psn: Psn) -> Option<Psn> {
         self.psn_tracker.ack_before(psn)
     }
@@ -77,16 +115,71 @@ impl RemoteAckTracker {
         }
         z.or(y).or(x)
     }
+
+    /// Returns the number of PSNs dropped beyond the window since the last call
+    pub(crate) fn take_dropped(&mut self) -> u64 {
+        self.psn_tracker.take_dropped()
+    }
 }
 
-#[derive(Default, Debug, Clone)]
+/// Number of PSNs tracked by a word of `PsnTracker`
+const WORD_BITS: u32 = u64::BITS;
+
+/// Smallest window of a tracker in words, so that the bitmap of a meta fits past the base PSN
+const MIN_WINDOW_WORDS: usize = 4;
+
+/// Tracks the acknowledged PSNs of a window starting at the base PSN.
+///
+/// The window is stored as a fixed ring of words aligned to multiples of `WORD_BITS` PSNs,
+/// the bits of the front word below the base PSN are set. A bitmap is ORed into at most three
+/// words, and the base PSN advances by counting the trailing ones from the front word,
+/// clearing the words that are fully acknowledged.
+///
+/// The ring is allocated by the first PSN acknowledged past the base PSN and never grows, so
+/// a QP holds a window of a few hundred bytes however far its PSNs are reordered. The PSNs
+/// acknowledged beyond the window are dropped and counted: a received packet is then left
+/// for the peer to retransmit, and a sent packet is acknowledged again by a later ACK.
+#[derive(Debug, Clone)]
 pub(crate) struct PsnTracker {
     base_psn: Psn,
-    inner: BitVec,
+    /// Ring of the words of the window, empty until the first acknowledgement
+    words: Box<[u64]>,
+    /// Index in `words` of the front word
+    head: usize,
+    /// Number of words of the window, a power of two
+    capacity: usize,
+    /// PSNs dropped beyond the window since the last `take_dropped`
+    dropped: u64,
+}
+
+impl Default for PsnTracker {
+    fn default() -> Self {
+        Self::new(Psn::default())
+    }
 }
 
 #[allow(clippy::cast_possible_wrap, clippy::cast_sign_loss)] // won't wrap since we only use 24bits of the Psn
 impl PsnTracker {
+    /// Creates a tracker whose first unacknowledged PSN is `base_psn`, with a window of
+    /// `DEFAULT_PSN_WINDOW` PSNs
+    pub(crate) fn new(base_psn: Psn) -> Self {
+        Self::with_window(base_psn, DEFAULT_PSN_WINDOW)
+    }
+
+    /// Creates a tracker whose first unacknowledged PSN is `base_psn`, tracking the PSNs of
+    /// a window of `window` PSNs rounded up to a power of two
+    pub(crate) fn with_window(base_psn: Psn, window: usize) -> Self {
+        let capacity = (window.min(MAX_PSN_WINDOW).next_power_of_two() / WORD_BITS as usize)
+            .max(MIN_WINDOW_WORDS);
+        Self {
+            base_psn,
+            words: Box::default(),
+            head: 0,
+            capacity,
+            dropped: 0,
+        }
+    }
+
     #[allow(clippy::as_conversions)] // Psn to usize
     /// Acknowledges a range of PSNs starting from `base_psn` using a bitmap.
     ///
@@ -94,20 +187,16 @@ impl PsnTracker {
     ///
     /// Returns `Some(PSN)` if the left edge of the PSN window is advanced, where the
     /// returned `PSN` is the new base PSN value after the advance.
-    pub(crate) fn ack_bitmap(&mut self, mut now_psn: Psn, mut bitmap: u128) -> Option<Psn> {
-        let rstart = self.rstart(now_psn);
-        let rend = rstart + 128;
-        if let Ok(x) = usize::try_from(rend) {
-            if x > self.inner.len() {
-                self.inner.resize(x, false);
-            }
-        }
-        for i in rstart.max(0)..rend {
-            let x = (i - rstart) as usize;
-            if bitmap.wrapping_shr(x as u32) & 1 == 1 {
-                self.inner.set(i as usize, true);
-            }
+    pub(crate) fn ack_bitmap(&mut self, now_psn: Psn, mut bitmap: u128) -> Option<Psn> {
+        let mut bit = i64::from(self.phase()) + i64::from(self.rstart(now_psn));
+        if bit < 0 {
+            // PSNs before the front word are acknowledged
+            bitmap = bitmap.checked_shr(bit.unsigned_abs() as u32).unwrap_or(0);
+            bit = 0;
         }
+        let bit = bit as usize;
+        self.or_word(bit, bitmap as u64);
+        self.or_word(bit + WORD_BITS as usize, (bitmap >> WORD_BITS) as u64);
 
         self.try_advance()
     }
@@ -123,12 +212,8 @@ impl PsnTracker {
         }
         let rstart: usize = usize::try_from(self.rstart(psn_low)).ok()?;
         let rend: usize = usize::try_from(self.rstart(psn_high)).ok()?;
-        if rend >= self.inner.len() {
-            self.inner.resize(rend + 1, false);
-        }
-        for i in rstart..rend {
-            self.inner.set(i, true);
-        }
+        let phase = self.phase() as usize;
+        self.set_range(phase + rstart, phase + rend);
         None
     }
 
@@ -140,10 +225,7 @@ impl PsnTracker {
     /// returned `PSN` is the new base PSN value after the advance.
     pub(crate) fn ack_one(&mut self, psn: Psn) -> Option<Psn> {
         let rstart: usize = usize::try_from(self.rstart(psn)).ok()?;
-        if rstart >= self.inner.len() {
-            self.inner.resize(rstart + 1, false);
-        }
-        self.inner.set(rstart, true);
+        self.or_word(self.phase() as usize + rstart, 1);
         self.try_advance()
     }
 
@@ -154,13 +236,8 @@ impl PsnTracker {
     /// Returns `Some(PSN)` if the left edge of the PSN window is advanced, where the
     /// returned `PSN` is the new base PSN value after the advance.
     pub(crate) fn ack_before(&mut self, psn: Psn) -> Option<Psn> {
-        let rstart: usize = usize::try_from(self.rstart(psn)).ok()?;
-        self.base_psn = psn;
-        if rstart >= self.inner.len() {
-            self.inner.fill(false);
-        } else {
-            self.inner.shift_left(rstart);
-        }
+        let rstart: u32 = u32::try_from(self.rstart(psn)).ok()?;
+        self.advance(rstart);
         Some(psn)
     }
 
@@ -168,8 +245,28 @@ impl PsnTracker {
         self.base_psn
     }
 
+    /// Returns `true` if `psn` is acknowledged, PSNs before the base PSN are
+    pub(crate) fn is_acked(&self, psn: Psn) -> bool {
+        let Ok(rstart) = usize::try_from(self.rstart(psn)) else {
+            return true;
+        };
+        let bit = self.phase() as usize + rstart;
+        let index = bit / WORD_BITS as usize;
+        index < self.capacity
+            && self
+                .words
+                .get(self.slot(index))
+                .is_some_and(|word| word >> (bit % WORD_BITS as usize) & 1 == 1)
+    }
+
+    /// Returns the number of PSNs dropped beyond the window since the last call
+    pub(crate) fn take_dropped(&mut self) -> u64 {
+        std::mem::take(&mut self.dropped)
+    }
+
+    /// Returns the signed distance from the base PSN to `psn`
     fn rstart(&self, psn: Psn) -> i32 {
-        let x = psn.into_inner().wrapping_sub(self.base_psn.into_inner());
+        let x = psn.into_inner().wrapping_sub(self.base_psn.into_inner()) & PSN_MASK;
         if ((x >> 23) & 1) != 0 {
             (x | 0xFF00_0000) as i32
         } else {
@@ -177,6 +274,86 @@ impl PsnTracker {
         }
     }
 
+    /// Position of the base PSN in the front word, the PSN space is a multiple of the word
+    /// size so that the words stay aligned across a wrap-around
+    fn phase(&self) -> u32 {
+        self.base_psn.into_inner() & (WORD_BITS - 1)
+    }
+
+    /// Returns the position in the ring of the word at `index` of the window
+    fn slot(&self, index: usize) -> usize {
+        (self.head + index) & (self.capacity - 1)
+    }
+
+    /// ORs `bits` into the word at `index` of the window, allocating the ring if needed, the
+    /// bits beyond the window are dropped
+    fn or_at(&mut self, index: usize, bits: u64) {
+        if index >= self.capacity {
+            self.dropped += u64::from(bits.count_ones());
+            return;
+        }
+        if self.words.is_empty() {
+            let mut words = vec![0; self.capacity];
+            if let Some(front) = words.first_mut() {
+                *front = low_mask(self.phase());
+            }
+            self.words = words.into_boxed_slice();
+            self.head = 0;
+        }
+        let slot = self.slot(index);
+        if let Some(word) = self.words.get_mut(slot) {
+            *word |= bits;
+        }
+    }
+
+    /// ORs `bits` into the window starting at bit `bit` of the front word
+    fn or_word(&mut self, bit: usize, bits: u64) {
+        if bits == 0 {
+            return;
+        }
+        let index = bit / WORD_BITS as usize;
+        let shift = (bit % WORD_BITS as usize) as u32;
+        self.or_at(index, bits << shift);
+        let carry = bits.checked_shr(WORD_BITS - shift).unwrap_or(0);
+        if shift != 0 && carry != 0 {
+            self.or_at(index + 1, carry);
+        }
+    }
+
+    /// Sets the bits `start..end` of the window
+    fn set_range(&mut self, start: usize, end: usize) {
+        let mut bit = start;
+        while bit < end {
+            let shift = (bit % WORD_BITS as usize) as u32;
+            let len = (end - bit).min((WORD_BITS - shift) as usize) as u32;
+            self.or_at(bit / WORD_BITS as usize, low_mask(len) << shift);
+            bit += len as usize;
+        }
+    }
+
+    /// Moves the base PSN forward by `num` PSNs
+    fn advance(&mut self, num: u32) {
+        let drop = (self.phase() as usize + num as usize) / WORD_BITS as usize;
+        if drop >= self.capacity {
+            self.words.fill(0);
+            self.head = 0;
+        } else {
+            for index in 0..drop {
+                let slot = self.slot(index);
+                if let Some(word) = self.words.get_mut(slot) {
+                    *word = 0;
+                }
+            }
+            self.head = self.slot(drop);
+        }
+        self.base_psn += num;
+        let mask = low_mask(self.phase());
+        let head = self.head;
+        if let Some(front) = self.words.get_mut(head) {
+            *front |= mask;
+        }
+    }
+
     /// Try to advance the base PSN to the next unacknowledged PSN.
     ///
     /// # Returns
@@ -184,27 +361,52 @@ impl PsnTracker {
     /// Returns `Some(PSN)` if `base_psn` was advanced, where the returned `PSN` is the new
     /// base PSN value after the advance.
     fn try_advance(&mut self) -> Option<Psn> {
-        let pos = self.inner.first_zero().unwrap_or(self.inner.len());
+        let mut ones = 0;
+        for index in 0..self.words.len() {
+            let word = self.words.get(self.slot(index)).copied().unwrap_or(0);
+            ones += word.trailing_ones();
+            if word != u64::MAX {
+                break;
+            }
+        }
+        let pos = ones.saturating_sub(self.phase());
         if pos == 0 {
             return None;
         }
-        self.inner.shift_left(pos);
-        let mut psn = self.base_psn;
-        self.base_psn += pos as u32;
+        self.advance(pos);
         Some(self.base_psn)
     }
 }
 
+/// Returns a word with the `len` low bits set
+fn low_mask(len: u32) -> u64 {
+    u64::MAX.checked_shr(WORD_BITS - len).unwrap_or(0)
+}
+
 #[cfg(test)]
 mod tests {
+    use rand::{rngs::StdRng, Rng, SeedableRng};
+
     use super::*;
 
+    #[test]
+    fn resumed_trackers_start_at_the_recorded_psn() {
+        let mut recv = LocalAckTracker::resume(Psn(1000), 256);
+        assert_eq!(recv.ack_one(Psn(1000)), Some(Psn(1001)));
+        assert_eq!(recv.base_psn(), Psn(1001));
+        // A new tracker drops the PSN beyond its window
+        let mut fresh = LocalAckTracker::new(256);
+        assert_eq!(fresh.ack_one(Psn(1000)), None);
+        let mut send = RemoteAckTracker::resume(7, Psn(1000), 256);
+        assert_eq!(send.ack_before(Psn(1004)), Some(Psn(1004)));
+    }
+
     #[test]
     fn test_ack_one() {
         let mut tracker = PsnTracker::default();
         tracker.ack_one(5.into());
-        assert!(!tracker.inner[0..5].iter().any(|b| *b));
-        assert!(tracker.inner[5]);
+        assert!(!(0..5).any(|psn| tracker.is_acked(psn.into())));
+        assert!(tracker.is_acked(5.into()));
     }
 
     #[test]
@@ -212,7 +414,7 @@ mod tests {
         let mut tracker = PsnTracker::default();
         tracker.ack_bitmap(0.into(), 0b11); // PSN 0 and 1
         assert_eq!(tracker.base_psn, 2.into());
-        assert!(tracker.inner.not_all());
+        assert!(!tracker.is_acked(tracker.base_psn));
 
         let mut tracker = PsnTracker {
             base_psn: 5.into(),
@@ -220,7 +422,7 @@ mod tests {
         };
         tracker.ack_bitmap(5.into(), 0b11);
         assert_eq!(tracker.base_psn, 7.into());
-        assert!(tracker.inner.not_all());
+        assert!(!tracker.is_acked(tracker.base_psn));
 
         let mut tracker = PsnTracker {
             base_psn: 10.into(),
@@ -228,11 +430,11 @@ mod tests {
         };
         tracker.ack_bitmap(5.into(), 0b11);
         assert_eq!(tracker.base_psn, 10.into());
-        assert!(tracker.inner.not_all());
+        assert!(!tracker.is_acked(tracker.base_psn));
         tracker.ack_bitmap(20.into(), 0b11);
         assert_eq!(tracker.base_psn, 10.into());
-        assert!(tracker.inner[10]);
-        assert!(tracker.inner[11]);
+        assert!(tracker.is_acked(20.into()));
+        assert!(tracker.is_acked(21.into()));
     }
 
     #[test]
@@ -242,5 +444,96 @@ mod tests {
             ..Default::default()
         };
         tracker.ack_bitmap(0.into(), 0b11);
+        assert_eq!(tracker.base_psn, (PSN_MASK - 1).into());
+        assert!(tracker.is_acked(1.into()));
+
+        // PSN_MASK - 1 and PSN_MASK, then 0 and 1 acked before
+        assert_eq!(
+            tracker.ack_bitmap((PSN_MASK - 1).into(), 0b11),
+            Some(2.into())
+        );
+        assert!(!tracker.is_acked(2.into()));
+    }
+
+    #[test]
+    fn test_ack_bitmap_across_words() {
+        let mut tracker = PsnTracker {
+            base_psn: (PSN_MASK - 99).into(),
+            ..Default::default()
+        };
+        // Straddles three words and the wrap-around, the base PSN is still missing
+        assert_eq!(tracker.ack_bitmap((PSN_MASK - 98).into(), u128::MAX), None);
+        assert!(tracker.is_acked(28.into()));
+        assert!(!tracker.is_acked(29.into()));
+        assert_eq!(tracker.ack_one((PSN_MASK - 99).into()), Some(29.into()));
+
+        assert_eq!(tracker.ack_range(40.into(), 200.into()), None);
+        assert_eq!(tracker.ack_bitmap(29.into(), 0x7ff), Some(200.into()));
+        assert_eq!(tracker.ack_before(300.into()), Some(300.into()));
+        assert!(!tracker.is_acked(300.into()));
+    }
+
+    #[test]
+    fn acks_beyond_the_window_are_dropped() {
+        let base = Psn(PSN_MASK - 63);
+        let mut tracker = PsnTracker::with_window(base, 200);
+        assert_eq!(tracker.ack_range(base + 1, base + 300), None);
+        assert_eq!(tracker.take_dropped(), 44);
+        assert_eq!(tracker.take_dropped(), 0);
+        assert!(tracker.is_acked(base + 255));
+        assert!(!tracker.is_acked(base + 256));
+
+        // The window moves with the base PSN, the ring keeps its size
+        assert_eq!(tracker.ack_one(base), Some(base + 256));
+        assert_eq!(tracker.ack_one(base + 300), None);
+        assert!(tracker.is_acked(base + 300));
+        assert_eq!(
+            tracker.ack_bitmap(base + 256, u128::MAX >> 84),
+            Some(base + 301)
+        );
+        assert_eq!(tracker.words.len(), 4);
+        assert_eq!(tracker.take_dropped(), 0);
+
+        assert_eq!(tracker.ack_before(base + 5000), Some(base + 5000));
+        assert!(!tracker.is_acked(base + 5001));
+        assert_eq!(tracker.ack_one(base + 5001), None);
+        assert_eq!(tracker.ack_one(base + 5000), Some(base + 5002));
+    }
+
+    #[test]
+    fn test_matches_reference() {
+        let mut rng = StdRng::seed_from_u64(0);
+        let start = PSN_MASK - 1000;
+        let mut tracker = PsnTracker {
+            base_psn: start.into(),
+            ..Default::default()
+        };
+        // Acknowledged offsets from `start`
+        let mut acked = vec![false; 1 << 16];
+        let mut base = 0;
+        for _ in 0..2000 {
+            let low = base + rng.gen_range(0..64);
+            let bitmap: u128 = rng.gen::<u128>() | rng.gen::<u128>();
+            let ret = if rng.gen_bool(0.9) {
+                for i in 0..128 {
+                    if bitmap >> i & 1 == 1 {
+                        acked[low + i] = true;
+                    }
+                }
+                tracker.ack_bitmap(Psn(start) + low as u32, bitmap)
+            } else {
+                acked[low] = true;
+                tracker.ack_one(Psn(start) + low as u32)
+            };
+            let old = base;
+            while acked[base] {
+                base += 1;
+            }
+            assert_eq!(ret, (base != old).then(|| Psn(start) + base as u32));
+            assert_eq!(tracker.base_psn(), Psn(start) + base as u32);
+            for i in base..base + 256 {
+                assert_eq!(tracker.is_acked(Psn(start) + i as u32), acked[i]);
+            }
+        }
     }
 }
@@ -1,8 +1,11 @@
 use std::{
-    iter, mem,
+    cell::UnsafeCell,
+    fmt, hint, iter, mem,
+    ops::Range,
+    ptr,
     sync::{
-        atomic::{AtomicU16, AtomicU32, AtomicU8, Ordering},
-        Arc,
+        atomic::{fence, AtomicU16, AtomicU32, AtomicU8, AtomicUsize, Ordering},
+        Arc, OnceLock,
     },
 };
 
@@ -13,23 +16,40 @@ use rand::Rng;
 
 use crate::{
     constants::{MAX_MSN_WINDOW, MAX_PSN_WINDOW, MAX_QP_CNT, MAX_SEND_WR, QPN_KEY_PART_WIDTH},
-    rdma_utils::psn::Psn,
+    mem::usage::{self, Pool},
+    rdma_utils::{psn::Psn, types::SgList},
 };
 
 /// Manages QPs
 pub(crate) struct QpManager {
     /// Bitmap tracking allocated QPNs
     bitmap: BitVec,
+    /// QP indices owned by the context, the others are held by other contexts of the device
+    share: Range<usize>,
 }
 
 #[allow(clippy::as_conversions, clippy::indexing_slicing)]
 impl QpManager {
-    /// Creates a new `QpManager`
-    pub(crate) fn new() -> Self {
-        let mut bitmap = BitVec::with_capacity(MAX_QP_CNT);
-        bitmap.resize(MAX_QP_CNT, false);
+    /// Creates a new `QpManager` allocating up to `max_qp` QPNs
+    pub(crate) fn new(max_qp: usize) -> Self {
+        Self::with_share(max_qp, 0..max_qp)
+    }
+
+    /// Creates a `QpManager` of a device with `max_qp` QPNs, allocating only the QP indices
+    /// of `share`
+    pub(crate) fn with_share(max_qp: usize, share: Range<usize>) -> Self {
+        let max_qp = max_qp.clamp(1, MAX_QP_CNT);
+        let share = share.start.min(max_qp)..share.end.min(max_qp);
+        let mut bitmap = BitVec::with_capacity(max_qp);
+        bitmap.resize(max_qp, true);
+        bitmap[share.clone()].fill(false);
         bitmap.set(0, true);
-        Self { bitmap }
+        Self { bitmap, share }
+    }
+
+    /// Returns the maximum number of QPs, including the reserved QPN 0
+    pub(crate) fn max_qp(&self) -> usize {
+        self.bitmap.len()
     }
 
     /// Allocates a new QP and returns its QPN
@@ -42,9 +62,35 @@ impl QpManager {
         Some(qpn)
     }
 
+    /// Allocates the QPN of a QP restored from a snapshot, returns `false` if its index is
+    /// outside the share or already allocated
+    pub(crate) fn reserve(&mut self, qpn: u32) -> bool {
+        let index = qpn_to_index(qpn);
+        let free = self.bitmap.get(index).is_some_and(|x| !*x);
+        if index == 0 || !self.share.contains(&index) || !free {
+            return false;
+        }
+        self.bitmap.set(index, true);
+
+        true
+    }
+
+    /// Returns the allocated QPs, as their QPN without the key part
+    #[allow(clippy::cast_possible_truncation)] // no larger than u32
+    pub(crate) fn iter_allocated(&self) -> impl Iterator<Item = u32> + '_ {
+        self.bitmap[self.share.clone()]
+            .iter_ones()
+            .map(|offset| offset + self.share.start)
+            .filter(|&index| index != 0)
+            .map(|index| (index as u32) << QPN_KEY_PART_WIDTH)
+    }
+
     /// Removes and returns the QP associated with the given QPN
     pub(crate) fn destroy_qp(&mut self, qpn: u32) -> bool {
         let index = qpn_to_index(qpn);
+        if index == 0 || !self.share.contains(&index) {
+            return false;
+        }
         let ret = self.bitmap.get(index).is_some_and(|x| *x);
         self.bitmap.set(index, false);
 
@@ -52,15 +98,29 @@ impl QpManager {
     }
 }
 
-#[derive(Default, Debug)]
+#[derive(Default, Debug, Clone)]
 pub(crate) struct SendQueueContext {
     pub(crate) msn: u16,
     pub(crate) psn: Psn,
     pub(crate) psn_acked: Psn,
     pub(crate) msn_acked: u16,
+    /// MSN following the latest completed WR
+    msn_completed: u16,
 }
 
 impl SendQueueContext {
+    /// Returns the context of a QP resumed at the WR `msn` starting at `psn`, the WRs before
+    /// it completed
+    pub(crate) fn resume(msn: u16, psn: Psn) -> Self {
+        Self {
+            msn,
+            psn,
+            psn_acked: psn,
+            msn_acked: msn,
+            msn_completed: msn,
+        }
+    }
+
     #[allow(clippy::similar_names)]
     pub(crate) fn next_wr(&mut self, num_psn: u32) -> Option<(u16, Psn)> {
         let outstanding_num_psn = self.psn - self.psn_acked;
@@ -84,8 +144,96 @@ impl SendQueueContext {
         self.psn_acked = psn;
     }
 
-    pub(crate) fn update_msn_acked(&mut self, msn: u16) {
+    /// Records the completion of the WR `msn`, returns the number of WRs it completes, the
+    /// unsignaled WRs preceding it included
+    pub(crate) fn update_msn_acked(&mut self, msn: u16) -> u32 {
         self.msn_acked = msn;
+        let next = msn.wrapping_add(1);
+        let completed = next.wrapping_sub(self.msn_completed);
+        self.msn_completed = next;
+        u32::from(completed)
+    }
+}
+
+/// Send queue credits of the QPs.
+///
+/// Each WR posted to a QP takes a credit, returned once the WR completes, so that no more
+/// than the `max_send_wr` of the QP are outstanding. A post finding no credit left fails
+/// instead of being queued behind the WRs in flight.
+#[derive(Debug)]
+pub(crate) struct SendCredits {
+    /// `max_send_wr` of each QP
+    limit: Box<[AtomicU32]>,
+    /// WRs of each QP posted and not completed yet
+    outstanding: Box<[AtomicU32]>,
+}
+
+impl SendCredits {
+    pub(crate) fn new() -> Self {
+        Self {
+            limit: iter::repeat_with(|| AtomicU32::new(MAX_SEND_WR as u32))
+                .take(MAX_QP_CNT)
+                .collect(),
+            outstanding: iter::repeat_with(|| AtomicU32::new(0))
+                .take(MAX_QP_CNT)
+                .collect(),
+        }
+    }
+
+    /// Gives a new QP `max_send_wr` credits, a QP created without a send queue size gets the
+    /// maximum
+    pub(crate) fn reset(&self, qpn: u32, max_send_wr: u32) {
+        let index = qpn_to_index(qpn);
+        let (Some(limit), Some(outstanding)) = (self.limit.get(index), self.outstanding.get(index))
+        else {
+            return;
+        };
+        let max_send_wr = match max_send_wr {
+            0 => MAX_SEND_WR as u32,
+            x => x.min(MAX_SEND_WR as u32),
+        };
+        limit.store(max_send_wr, Ordering::Relaxed);
+        outstanding.store(0, Ordering::Release);
+    }
+
+    /// Takes up to `num` credits of the QP, returns the number taken
+    pub(crate) fn take(&self, qpn: u32, num: usize) -> usize {
+        let index = qpn_to_index(qpn);
+        let (Some(limit), Some(outstanding)) = (self.limit.get(index), self.outstanding.get(index))
+        else {
+            return num;
+        };
+        let limit = limit.load(Ordering::Relaxed);
+        let num = u32::try_from(num).unwrap_or(u32::MAX);
+        let mut taken = 0;
+        let _ignore = outstanding.fetch_update(Ordering::AcqRel, Ordering::Acquire, |current| {
+            taken = limit.saturating_sub(current).min(num);
+            Some(current + taken)
+        });
+        taken as usize
+    }
+
+    /// Returns the WRs of the QP posted and not completed, along with its `max_send_wr`
+    pub(crate) fn occupancy(&self, qpn: u32) -> (u32, u32) {
+        let index = qpn_to_index(qpn);
+        let (Some(limit), Some(outstanding)) = (self.limit.get(index), self.outstanding.get(index))
+        else {
+            return (0, MAX_SEND_WR as u32);
+        };
+        (
+            outstanding.load(Ordering::Acquire),
+            limit.load(Ordering::Relaxed),
+        )
+    }
+
+    /// Returns `num` credits of the QP, of completed WRs or of WRs that failed to post
+    pub(crate) fn give_back(&self, qpn: u32, num: u32) {
+        if let Some(outstanding) = self.outstanding.get(qpn_to_index(qpn)) {
+            let _ignore =
+                outstanding.fetch_update(Ordering::AcqRel, Ordering::Acquire, |current| {
+                    Some(current.saturating_sub(num))
+                });
+        }
     }
 }
 
@@ -111,6 +259,18 @@ pub(crate) fn num_psn(pmtu: u8, addr: u64, length: u32) -> Option<u32> {
         .ok()
 }
 
+/// Calculate the number of psn required for a WR with multiple SGEs, each SGE is fragmented
+/// separately starting at its offset in the remote address range
+pub(crate) fn num_psn_sg_list(pmtu: u8, raddr: u64, sg_list: &SgList) -> Option<u32> {
+    let mut addr = raddr;
+    let mut total = 0u32;
+    for sge in sg_list.as_slice().iter().filter(|sge| sge.length != 0) {
+        total = total.checked_add(num_psn(pmtu, addr, sge.length)?)?;
+        addr = addr.checked_add(u64::from(sge.length))?;
+    }
+    Some(total)
+}
+
 pub(crate) fn convert_ibv_mtu_to_u16(ibv_mtu: u8) -> Option<u16> {
     let pmtu = match u32::from(ibv_mtu) {
         ibverbs_sys::IBV_MTU_256 => 256,
@@ -123,50 +283,109 @@ pub(crate) fn convert_ibv_mtu_to_u16(ibv_mtu: u8) -> Option<u16> {
     Some(pmtu)
 }
 
-#[derive(Debug)]
+/// Number of QPs of a chunk of the QP tables is `1 << QP_TABLE_CHUNK_WIDTH`
+const QP_TABLE_CHUNK_WIDTH: u32 = 6;
+const QP_TABLE_CHUNK_LEN: usize = 1 << QP_TABLE_CHUNK_WIDTH;
+
+/// A per-worker table of QP entries.
+///
+/// The entries are stored in chunks allocated on the first mutable access to one of their
+/// QPs, so that the memory grows with the QPNs in use rather than with `MAX_QP_CNT`. A QP
+/// whose chunk is not allocated reads as a freshly created entry.
 pub(crate) struct QpTable<T> {
-    inner: Box<[T]>,
+    chunks: Box<[Option<Box<[T]>>]>,
+    /// Creates the entries of a new chunk
+    init: Box<dyn Fn() -> T + Send + Sync>,
+    /// Entry returned for the QPs of unallocated chunks
+    vacant: T,
+}
+
+impl<T: fmt::Debug> fmt::Debug for QpTable<T> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("QpTable")
+            .field("allocated", &self.allocated())
+            .field("vacant", &self.vacant)
+            .finish()
+    }
 }
 
 impl<T> QpTable<T> {
-    pub(crate) fn new_with<F: FnMut() -> T>(f: F) -> Self {
+    pub(crate) fn new_with<F>(f: F) -> Self
+    where
+        F: Fn() -> T + Send + Sync + 'static,
+    {
         Self {
-            inner: iter::repeat_with(f).take(MAX_QP_CNT).collect(),
+            chunks: iter::repeat_with(|| None)
+                .take(MAX_QP_CNT >> QP_TABLE_CHUNK_WIDTH)
+                .collect(),
+            vacant: f(),
+            init: Box::new(f),
         }
     }
 
+    /// Replaces the function creating the entries, the allocated entries are kept
+    pub(crate) fn set_init<F>(&mut self, f: F)
+    where
+        F: Fn() -> T + Send + Sync + 'static,
+    {
+        self.vacant = f();
+        self.init = Box::new(f);
+    }
+
+    /// Returns the number of allocated entries
+    pub(crate) fn allocated(&self) -> usize {
+        self.chunks.iter().flatten().map(|x| x.len()).sum()
+    }
+
+    /// Iterates over the allocated entries
     pub(crate) fn iter(&self) -> impl Iterator<Item = &T> {
-        self.inner.iter()
+        self.chunks.iter().flatten().flat_map(|x| x.iter())
     }
 
+    /// Iterates over the allocated entries
     pub(crate) fn iter_mut(&mut self) -> impl Iterator<Item = &mut T> {
-        self.inner.iter_mut()
+        self.chunks.iter_mut().flatten().flat_map(|x| x.iter_mut())
     }
 
     pub(crate) fn get_qp(&self, qpn: u32) -> Option<&T> {
-        self.inner.get(qpn_to_index(qpn))
+        let index = qpn_to_index(qpn);
+        match self.chunks.get(index >> QP_TABLE_CHUNK_WIDTH)? {
+            Some(chunk) => chunk.get(index & (QP_TABLE_CHUNK_LEN - 1)),
+            None => Some(&self.vacant),
+        }
     }
 
+    /// Returns the entry of `qpn`, allocating its chunk if needed
     pub(crate) fn get_qp_mut(&mut self, qpn: u32) -> Option<&mut T> {
-        self.inner.get_mut(qpn_to_index(qpn))
+        let index = qpn_to_index(qpn);
+        let init = &self.init;
+        self.chunks
+            .get_mut(index >> QP_TABLE_CHUNK_WIDTH)?
+            .get_or_insert_with(|| {
+                usage::alloc(Pool::QpTables, QP_TABLE_CHUNK_LEN * size_of::<T>());
+                iter::repeat_with(|| init())
+                    .take(QP_TABLE_CHUNK_LEN)
+                    .collect()
+            })
+            .get_mut(index & (QP_TABLE_CHUNK_LEN - 1))
     }
 
     pub(crate) fn map_qp<R, F>(&self, qpn: u32, f: F) -> Option<R>
     where
         F: FnMut(&T) -> R,
     {
-        self.inner.get(qpn_to_index(qpn)).map(f)
+        self.get_qp(qpn).map(f)
     }
 
     pub(crate) fn map_qp_mut<R, F>(&mut self, qpn: u32, f: F) -> Option<R>
     where
         F: FnOnce(&mut T) -> R,
     {
-        self.inner.get_mut(qpn_to_index(qpn)).map(f)
+        self.get_qp_mut(qpn).map(f)
     }
 
     pub(crate) fn replace(&mut self, qpn: u32, mut t: T) -> Option<T> {
-        if let Some(x) = self.inner.get_mut(qpn_to_index(qpn)) {
+        if let Some(x) = self.get_qp_mut(qpn) {
             mem::swap(x, &mut t);
             Some(t)
         } else {
@@ -175,37 +394,124 @@ impl<T> QpTable<T> {
     }
 }
 
-impl<T: Default> QpTable<T> {
+impl<T> Drop for QpTable<T> {
+    fn drop(&mut self) {
+        usage::free(Pool::QpTables, self.allocated() * size_of::<T>());
+    }
+}
+
+impl<T: Default + 'static> QpTable<T> {
     pub(crate) fn new() -> Self {
         Self::default()
     }
 }
 
-impl<T: Default> Default for QpTable<T> {
+impl<T: Default + 'static> Default for QpTable<T> {
     fn default() -> Self {
         Self::new_with(T::default)
     }
 }
 
-#[derive(Debug, Clone)]
+/// Chunks of slots shared by the threads of a table, allocated on the first write to one of
+/// their QPs
+struct SharedChunks<S> {
+    chunks: Box<[OnceLock<Box<[S]>>]>,
+}
+
+impl<S> SharedChunks<S> {
+    fn new() -> Self {
+        Self {
+            chunks: iter::repeat_with(OnceLock::new)
+                .take(MAX_QP_CNT >> QP_TABLE_CHUNK_WIDTH)
+                .collect(),
+        }
+    }
+
+    /// Returns the slot of `index`, `Some(None)` if its chunk is not allocated
+    #[allow(clippy::indexing_slicing)]
+    fn get(&self, index: usize) -> Option<Option<&S>> {
+        let chunk = self.chunks.get(index >> QP_TABLE_CHUNK_WIDTH)?;
+        Some(chunk.get().map(|c| &c[index & (QP_TABLE_CHUNK_LEN - 1)]))
+    }
+
+    /// Returns the slot of `index`, allocating its chunk with `f` if needed
+    #[allow(clippy::indexing_slicing)]
+    fn get_or_alloc<F: Fn() -> S>(&self, index: usize, f: F) -> Option<&S> {
+        let chunk = self.chunks.get(index >> QP_TABLE_CHUNK_WIDTH)?;
+        let chunk = chunk.get_or_init(|| {
+            usage::alloc(Pool::QpTables, QP_TABLE_CHUNK_LEN * size_of::<S>());
+            iter::repeat_with(f).take(QP_TABLE_CHUNK_LEN).collect()
+        });
+        Some(&chunk[index & (QP_TABLE_CHUNK_LEN - 1)])
+    }
+
+    /// Iterates over the allocated slots
+    fn iter(&self) -> impl Iterator<Item = &S> {
+        self.chunks
+            .iter()
+            .filter_map(OnceLock::get)
+            .flat_map(|c| c.iter())
+    }
+
+    fn allocated(&self) -> usize {
+        self.chunks
+            .iter()
+            .filter_map(OnceLock::get)
+            .map(|c| c.len())
+            .sum()
+    }
+}
+
+impl<S> Drop for SharedChunks<S> {
+    fn drop(&mut self) {
+        usage::free(Pool::QpTables, self.allocated() * size_of::<S>());
+    }
+}
+
+/// A QP table shared between threads, each entry guarded by its own lock.
+///
+/// Like `QpTable`, the entries are allocated by chunks on the first write to one of their QPs,
+/// and a QP whose chunk is not allocated reads as a freshly created entry.
 pub(crate) struct QpTableShared<T> {
-    inner: Arc<[Mutex<T>]>,
+    inner: Arc<SharedChunks<Mutex<T>>>,
+    /// Creates the entries of a new chunk, and the entries read from unallocated chunks
+    init: Arc<dyn Fn() -> T + Send + Sync>,
+}
+
+impl<T> Clone for QpTableShared<T> {
+    fn clone(&self) -> Self {
+        Self {
+            inner: Arc::clone(&self.inner),
+            init: Arc::clone(&self.init),
+        }
+    }
+}
+
+impl<T> fmt::Debug for QpTableShared<T> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("QpTableShared")
+            .field("allocated", &self.inner.allocated())
+            .finish()
+    }
 }
 
 impl<T> QpTableShared<T> {
-    pub(crate) fn new_with<F: FnMut() -> T>(f: F) -> Self {
+    pub(crate) fn new_with<F>(f: F) -> Self
+    where
+        F: Fn() -> T + Send + Sync + 'static,
+    {
         Self {
-            inner: iter::repeat_with(f)
-                .take(MAX_QP_CNT)
-                .map(Mutex::new)
-                .collect(),
+            inner: Arc::new(SharedChunks::new()),
+            init: Arc::new(f),
         }
     }
 
+    /// Calls `f` on the allocated entries
     pub(crate) fn for_each<F: FnMut(&T)>(&self, mut f: F) {
         self.inner.iter().for_each(|x| f(&x.lock()));
     }
 
+    /// Calls `f` on the allocated entries
     pub(crate) fn for_each_mut<F: FnMut(&mut T)>(&self, mut f: F) {
         self.inner.iter().for_each(|x| f(&mut x.lock()));
     }
@@ -214,41 +520,315 @@ impl<T> QpTableShared<T> {
     where
         T: Copy,
     {
-        self.inner.get(qpn_to_index(qpn)).map(|x| *x.lock())
+        self.map_qp(qpn, |x| *x)
     }
 
     pub(crate) fn map_qp<R, F>(&self, qpn: u32, mut f: F) -> Option<R>
     where
         F: FnMut(&T) -> R,
     {
-        self.inner.get(qpn_to_index(qpn)).map(|x| f(&x.lock()))
+        match self.inner.get(qpn_to_index(qpn))? {
+            Some(x) => Some(f(&x.lock())),
+            None => Some(f(&(self.init)())),
+        }
     }
 
+    /// Updates the entry of `qpn`, allocating its chunk if needed
     pub(crate) fn map_qp_mut<R, F>(&self, qpn: u32, f: F) -> Option<R>
     where
         F: FnOnce(&mut T) -> R,
     {
-        self.inner.get(qpn_to_index(qpn)).map(|x| f(&mut x.lock()))
+        self.slot(qpn).map(|x| f(&mut x.lock()))
     }
 
-    pub(crate) fn replace(&self, qpn: u32, mut t: T) -> Option<T> {
-        if let Some(x) = self.inner.get(qpn_to_index(qpn)) {
-            mem::swap(&mut *x.lock(), &mut t);
-            Some(t)
-        } else {
-            None
+    pub(crate) fn replace(&self, qpn: u32, t: T) -> Option<T> {
+        self.map_qp_mut(qpn, |x| mem::replace(x, t))
+    }
+
+    fn slot(&self, qpn: u32) -> Option<&Mutex<T>> {
+        self.inner
+            .get_or_alloc(qpn_to_index(qpn), || Mutex::new((self.init)()))
+    }
+}
+
+impl<T: Default + 'static> QpTableShared<T> {
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+}
+
+impl<T: Default + 'static> Default for QpTableShared<T> {
+    fn default() -> Self {
+        Self::new_with(T::default)
+    }
+}
+
+/// A slot of `QpTableSeqLock`, aligned to a cache line so that adjacent QPs don't share one
+#[repr(align(64))]
+struct SeqSlot<T> {
+    /// Even while the value is stable, odd while a writer updates it
+    seq: AtomicUsize,
+    value: UnsafeCell<T>,
+}
+
+// SAFETY: the value is only written by the holder of the odd sequence, and readers discard
+// any copy that overlapped a write
+#[allow(unsafe_code)]
+unsafe impl<T: Copy + Send> Sync for SeqSlot<T> {}
+
+/// Releases the slot when the write ends, even if the writer panics
+struct SeqWriteGuard<'a> {
+    seq: &'a AtomicUsize,
+    start: usize,
+}
+
+impl Drop for SeqWriteGuard<'_> {
+    fn drop(&mut self) {
+        self.seq
+            .store(self.start.wrapping_add(2), Ordering::Release);
+    }
+}
+
+/// A read-mostly QP table guarded by per slot sequence locks.
+///
+/// Readers copy the value of a QP without taking a lock nor writing to shared memory, and
+/// retry if a writer updated the slot meanwhile. Writers, such as QP creation and
+/// modification, are serialized per slot. A slot is one cache line, so a reader fetches a
+/// single line whichever fields it needs. The slots are allocated by chunks on the first
+/// write to one of their QPs, a QP whose chunk is not allocated reads as a fresh value.
+pub(crate) struct QpTableSeqLock<T> {
+    inner: Arc<SharedChunks<SeqSlot<T>>>,
+    /// Creates the values of a new chunk, and the values read from unallocated chunks
+    init: Arc<dyn Fn() -> T + Send + Sync>,
+}
+
+impl<T> Clone for QpTableSeqLock<T> {
+    fn clone(&self) -> Self {
+        Self {
+            inner: Arc::clone(&self.inner),
+            init: Arc::clone(&self.init),
         }
     }
 }
 
-impl<T: Default> QpTableShared<T> {
+impl<T> fmt::Debug for QpTableSeqLock<T> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("QpTableSeqLock")
+            .field("allocated", &self.inner.allocated())
+            .finish()
+    }
+}
+
+#[allow(unsafe_code)]
+impl<T: Copy> QpTableSeqLock<T> {
+    pub(crate) fn new_with<F>(f: F) -> Self
+    where
+        F: Fn() -> T + Send + Sync + 'static,
+    {
+        Self {
+            inner: Arc::new(SharedChunks::new()),
+            init: Arc::new(f),
+        }
+    }
+
+    /// Returns a consistent copy of the value of `qpn`
+    pub(crate) fn get_qp(&self, qpn: u32) -> Option<T> {
+        let Some(slot) = self.inner.get(qpn_to_index(qpn))? else {
+            return Some((self.init)());
+        };
+        loop {
+            let seq = slot.seq.load(Ordering::Acquire);
+            if seq & 1 == 0 {
+                // SAFETY: the pointer is valid for the lifetime of the table. A concurrent
+                // write may tear the copy, `T: Copy` makes the torn copy harmless and it is
+                // discarded below as the sequence moved.
+                let value = unsafe { ptr::read_volatile(slot.value.get()) };
+                fence(Ordering::Acquire);
+                if slot.seq.load(Ordering::Relaxed) == seq {
+                    return Some(value);
+                }
+            }
+            hint::spin_loop();
+        }
+    }
+
+    pub(crate) fn map_qp<R, F>(&self, qpn: u32, f: F) -> Option<R>
+    where
+        F: FnOnce(&T) -> R,
+    {
+        self.get_qp(qpn).map(|value| f(&value))
+    }
+
+    /// Updates the value of `qpn`, readers see either the old or the new value
+    pub(crate) fn map_qp_mut<R, F>(&self, qpn: u32, f: F) -> Option<R>
+    where
+        F: FnOnce(&mut T) -> R,
+    {
+        let slot = self.inner.get_or_alloc(qpn_to_index(qpn), || SeqSlot {
+            seq: AtomicUsize::new(0),
+            value: UnsafeCell::new((self.init)()),
+        })?;
+        let start = loop {
+            let seq = slot.seq.load(Ordering::Relaxed);
+            if seq & 1 == 0
+                && slot
+                    .seq
+                    .compare_exchange_weak(seq, seq | 1, Ordering::Acquire, Ordering::Relaxed)
+                    .is_ok()
+            {
+                break seq;
+            }
+            hint::spin_loop();
+        };
+        let _guard = SeqWriteGuard {
+            seq: &slot.seq,
+            start,
+        };
+        // Orders the odd sequence before the writes of the value
+        fence(Ordering::Release);
+        // SAFETY: the odd sequence excludes the other writers, readers only copy the value
+        let mut value = unsafe { ptr::read_volatile(slot.value.get()) };
+        let ret = f(&mut value);
+        // SAFETY: as above
+        unsafe { ptr::write_volatile(slot.value.get(), value) };
+
+        Some(ret)
+    }
+
+    pub(crate) fn replace(&self, qpn: u32, t: T) -> Option<T> {
+        self.map_qp_mut(qpn, |x| mem::replace(x, t))
+    }
+}
+
+impl<T: Copy + Default + 'static> QpTableSeqLock<T> {
     pub(crate) fn new() -> Self {
         Self::default()
     }
 }
 
-impl<T: Default> Default for QpTableShared<T> {
+impl<T: Copy + Default + 'static> Default for QpTableSeqLock<T> {
     fn default() -> Self {
         Self::new_with(T::default)
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use std::thread;
+
+    use super::*;
+
+    #[test]
+    fn qp_manager_allocates_within_share() {
+        let mut manager = QpManager::with_share(16, 8..12);
+        let qpns: Vec<_> = iter::from_fn(|| manager.create_qp()).collect();
+        let indices: Vec<_> = qpns.iter().copied().map(qpn_to_index).collect();
+        assert_eq!(indices, [8, 9, 10, 11]);
+        assert_eq!(manager.iter_allocated().count(), 4);
+        assert!(!manager.destroy_qp(1 << QPN_KEY_PART_WIDTH));
+        assert!(manager.destroy_qp(qpns[0]));
+        assert_eq!(manager.create_qp().map(qpn_to_index), Some(8));
+        // The QPN of a restored QP is reserved with its key part
+        assert!(!manager.reserve(qpns[1]));
+        assert!(!manager.reserve((14 << QPN_KEY_PART_WIDTH) | 3));
+        assert!(manager.destroy_qp(qpns[1]));
+        assert!(manager.reserve(qpns[1]));
+        assert!(manager.create_qp().is_none());
+    }
+
+    #[test]
+    fn send_credits_are_returned_by_completions() {
+        let credits = SendCredits::new();
+        let qpn = 1 << QPN_KEY_PART_WIDTH;
+        credits.reset(qpn, 4);
+        assert_eq!(credits.take(qpn, 3), 3);
+        assert_eq!(credits.take(qpn, 3), 1);
+        assert_eq!(credits.take(qpn, 1), 0);
+
+        let mut ctx = SendQueueContext::default();
+        for _ in 0..4 {
+            let _wr = ctx.next_wr(1).unwrap();
+        }
+        // The signaled WR 2 completes the unsignaled WRs preceding it
+        credits.give_back(qpn, ctx.update_msn_acked(2));
+        assert_eq!(credits.take(qpn, 4), 3);
+        credits.give_back(qpn, ctx.update_msn_acked(3));
+        assert_eq!(credits.take(qpn, 4), 1);
+
+        credits.reset(qpn, 0);
+        assert_eq!(credits.take(qpn, MAX_SEND_WR + 1), MAX_SEND_WR);
+    }
+
+    #[test]
+    fn qp_table_allocates_chunks_on_write() {
+        let mut table = QpTable::new_with(|| 7u32);
+        let far = ((MAX_QP_CNT - 1) as u32) << QPN_KEY_PART_WIDTH;
+        assert_eq!(table.get_qp(far), Some(&7));
+        assert_eq!(table.allocated(), 0);
+
+        assert_eq!(table.replace(far, 1), Some(7));
+        assert_eq!(table.get_qp(far), Some(&1));
+        assert_eq!(table.get_qp(0), Some(&7));
+        assert_eq!(table.allocated(), QP_TABLE_CHUNK_LEN);
+
+        table
+            .map_qp_mut(1 << QPN_KEY_PART_WIDTH, |x| *x += 1)
+            .unwrap();
+        assert_eq!(table.allocated(), 2 * QP_TABLE_CHUNK_LEN);
+        assert_eq!(table.iter().filter(|x| **x != 7).count(), 2);
+
+        let beyond = (MAX_QP_CNT as u32) << QPN_KEY_PART_WIDTH;
+        assert!(table.get_qp(beyond).is_none());
+        assert!(table.get_qp_mut(beyond).is_none());
+    }
+
+    #[test]
+    fn shared_tables_allocate_chunks_on_write() {
+        let shared = QpTableShared::new_with(|| 7u32);
+        let seqlock = QpTableSeqLock::new_with(|| 7u32);
+        let far = ((MAX_QP_CNT - 1) as u32) << QPN_KEY_PART_WIDTH;
+        assert_eq!(shared.get_qp(far), Some(7));
+        assert_eq!(seqlock.get_qp(far), Some(7));
+        assert_eq!(shared.inner.allocated(), 0);
+        assert_eq!(seqlock.inner.allocated(), 0);
+
+        assert_eq!(shared.replace(far, 1), Some(7));
+        assert_eq!(seqlock.replace(far, 1), Some(7));
+        assert_eq!(shared.get_qp(far), Some(1));
+        assert_eq!(seqlock.get_qp(far), Some(1));
+        assert_eq!(shared.get_qp(0), Some(7));
+        assert_eq!(shared.inner.allocated(), QP_TABLE_CHUNK_LEN);
+        assert_eq!(seqlock.inner.allocated(), QP_TABLE_CHUNK_LEN);
+
+        let mut count = 0;
+        shared.for_each(|_| count += 1);
+        assert_eq!(count, QP_TABLE_CHUNK_LEN);
+        let beyond = (MAX_QP_CNT as u32) << QPN_KEY_PART_WIDTH;
+        assert!(shared.map_qp_mut(beyond, |x| *x = 0).is_none());
+        assert!(seqlock.map_qp_mut(beyond, |x| *x = 0).is_none());
+    }
+
+    #[test]
+    fn seqlock_table_reads_are_consistent() {
+        let table = QpTableSeqLock::<(u64, u64)>::new();
+        let writer = {
+            let table = table.clone();
+            thread::spawn(move || {
+                for i in 1..=10_000 {
+                    let _ignore = table.map_qp_mut(1, |x| *x = (i, i));
+                }
+            })
+        };
+        let mut last = 0;
+        while last < 10_000 {
+            let (a, b) = table.get_qp(1).unwrap();
+            assert_eq!(a, b, "torn read");
+            assert!(a >= last, "reads went backwards");
+            last = a;
+        }
+        writer.join().unwrap();
+        assert_eq!(table.replace(1, (0, 0)), Some((10_000, 10_000)));
+        assert_eq!(table.get_qp(1), Some((0, 0)));
+        assert!(table.get_qp(u32::MAX).is_none());
+    }
+}
@@ -0,0 +1,294 @@
+//! Choice of the path of each send WR.
+//!
+//! A send reaches the card by one of four paths: its payload is copied to an inline slot of the
+//! bounce buffer, copied to a staging slot, read by the card from the registered buffers of the
+//! WR, or pulled by the receiver with an RDMA read. A copied send saves the card the round trip
+//! of reading the payload over PCIe, at the cost of the copy on the posting thread, so small
+//! sends are copied even from registered buffers.
+//!
+//! The largest copied send is tuned when the device is opened: the round trip to the card is
+//! timed with CSR reads, and the copy of each bounce slot size with copies between two host
+//! buffers. A send is copied while its copy takes less than the round trip.
+
+use std::{
+    fmt,
+    hint::black_box,
+    io,
+    time::{Duration, Instant},
+};
+
+use crate::constants::{MAX_INLINE_DATA, STAGING_SLOT_SIZES};
+
+/// Samples timed of each cost, the median is kept
+const TUNE_SAMPLES: usize = 15;
+
+/// Copies timed by a sample, so that a sample of the small copies outlasts the clock reads
+const COPIES_PER_SAMPLE: usize = 16;
+
+/// Path of a send WR to the card
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum SendPath {
+    /// Copied to an inline slot of the bounce buffer
+    Inline,
+    /// Copied to a staging slot of the bounce buffer
+    Staged,
+    /// Read by the card from the buffers of the WR
+    Dma,
+    /// Pulled by the receiver from the buffers of the WR
+    Rendezvous,
+}
+
+impl SendPath {
+    const ALL: [SendPath; 4] = [
+        SendPath::Inline,
+        SendPath::Staged,
+        SendPath::Dma,
+        SendPath::Rendezvous,
+    ];
+
+    fn name(self) -> &'static str {
+        match self {
+            SendPath::Inline => "inline",
+            SendPath::Staged => "staged",
+            SendPath::Dma => "dma",
+            SendPath::Rendezvous => "rendezvous",
+        }
+    }
+}
+
+/// Costs measured to tune the thresholds
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub(crate) struct SendCosts {
+    /// Round trip of a CSR read of the card
+    pub(crate) round_trip: Duration,
+    /// Copy of each bounce slot size, by increasing size
+    pub(crate) copies: Vec<(usize, Duration)>,
+}
+
+impl SendCosts {
+    /// Times `read_csr` and the copies of the sizes of the bounce slots
+    pub(crate) fn measure<F, T>(mut read_csr: F) -> io::Result<Self>
+    where
+        F: FnMut() -> io::Result<T>,
+    {
+        let round_trip = median(|| {
+            let start = Instant::now();
+            let _value = black_box(read_csr()?);
+            Ok(start.elapsed())
+        })?;
+        let max_len = STAGING_SLOT_SIZES
+            .last()
+            .copied()
+            .unwrap_or(MAX_INLINE_DATA);
+        let src = vec![0xa5_u8; max_len];
+        let mut dst = vec![0_u8; max_len];
+        let copies = STAGING_SLOT_SIZES
+            .iter()
+            .map(|&len| {
+                let cost = median(|| {
+                    let start = Instant::now();
+                    for _ in 0..COPIES_PER_SAMPLE {
+                        copy(black_box(&src), black_box(&mut dst), len);
+                    }
+                    Ok(start.elapsed() / COPIES_PER_SAMPLE as u32)
+                })?;
+                Ok((len, cost))
+            })
+            .collect::<io::Result<_>>()?;
+
+        Ok(Self { round_trip, copies })
+    }
+}
+
+fn copy(src: &[u8], dst: &mut [u8], len: usize) {
+    if let (Some(src), Some(dst)) = (src.get(..len), dst.get_mut(..len)) {
+        dst.copy_from_slice(src);
+    }
+}
+
+/// Returns the median of `TUNE_SAMPLES` samples
+fn median<F>(mut sample: F) -> io::Result<Duration>
+where
+    F: FnMut() -> io::Result<Duration>,
+{
+    let mut samples = (0..TUNE_SAMPLES)
+        .map(|_| sample())
+        .collect::<io::Result<Vec<_>>>()?;
+    samples.sort_unstable();
+    Ok(samples.get(TUNE_SAMPLES / 2).copied().unwrap_or_default())
+}
+
+/// Thresholds of the paths
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct SendThresholds {
+    /// Largest send copied from registered buffers, 0 copies none
+    pub(crate) copy_max: usize,
+    /// Largest send copied from unregistered buffers, 0 without staging slots
+    pub(crate) staged_max: usize,
+    /// Smallest two-sided send pulled by the receiver, `None` pulls none
+    pub(crate) rendezvous_min: Option<u32>,
+}
+
+impl SendThresholds {
+    /// Copies the sends whose copy takes less than the round trip to the card, up to the
+    /// largest bounce slot. `staged_max` is the largest staging slot, 0 without staging slots.
+    pub(crate) fn tune(costs: &SendCosts, staged_max: usize, rendezvous_min: Option<u32>) -> Self {
+        let slot_max = staged_max.max(MAX_INLINE_DATA);
+        let copy_max = costs
+            .copies
+            .iter()
+            .take_while(|&&(_, cost)| cost <= costs.round_trip)
+            .map(|&(len, _)| len)
+            .filter(|&len| len <= slot_max)
+            .last()
+            .unwrap_or(0);
+        Self {
+            copy_max,
+            staged_max,
+            rendezvous_min,
+        }
+    }
+}
+
+/// Picks the path of each send WR and counts the sends of each path
+#[derive(Debug, Clone)]
+pub(crate) struct SendPolicy {
+    thresholds: SendThresholds,
+    /// Costs the thresholds were tuned from, `None` if they were configured
+    costs: Option<SendCosts>,
+    /// Sends of each path, in the order of `SendPath::ALL`
+    sent: [u64; 4],
+}
+
+impl SendPolicy {
+    pub(crate) fn new(thresholds: SendThresholds, costs: Option<SendCosts>) -> Self {
+        Self {
+            thresholds,
+            costs,
+            sent: [0; 4],
+        }
+    }
+
+    pub(crate) fn thresholds(&self) -> SendThresholds {
+        self.thresholds
+    }
+
+    /// Returns the path of a send of `len` bytes.
+    ///
+    /// `registered` is `false` if some buffers of the send are not registered, `two_sided` if
+    /// the send consumes a receive WR of the peer. A QP with `outstanding` of its `depth` WRs
+    /// posted and not completed does not copy its registered sends once half of its send
+    /// queue is outstanding, the card reads their payload while it sends the WRs before them.
+    pub(crate) fn choose(
+        &self,
+        len: usize,
+        registered: bool,
+        two_sided: bool,
+        (outstanding, depth): (u32, u32),
+    ) -> SendPath {
+        let thresholds = self.thresholds;
+        if !registered {
+            return if len <= thresholds.staged_max {
+                SendPath::Staged
+            } else {
+                SendPath::Dma
+            };
+        }
+        if len <= thresholds.copy_max && outstanding.saturating_mul(2) < depth {
+            return if len <= MAX_INLINE_DATA {
+                SendPath::Inline
+            } else {
+                SendPath::Staged
+            };
+        }
+        if two_sided
+            && thresholds
+                .rendezvous_min
+                .is_some_and(|min| len >= min as usize)
+        {
+            SendPath::Rendezvous
+        } else {
+            SendPath::Dma
+        }
+    }
+
+    /// Counts a send posted through `path`
+    pub(crate) fn record(&mut self, path: SendPath) {
+        if let Some(sent) = self.sent.get_mut(path as usize) {
+            *sent += 1;
+        }
+    }
+}
+
+impl fmt::Display for SendPolicy {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        writeln!(f, "send_path/copy_max_bytes {}", self.thresholds.copy_max)?;
+        writeln!(
+            f,
+            "send_path/rendezvous_min_bytes {}",
+            self.thresholds.rendezvous_min.unwrap_or(0)
+        )?;
+        if let Some(costs) = &self.costs {
+            writeln!(f, "send_path/round_trip_ns {}", costs.round_trip.as_nanos())?;
+            for &(len, cost) in &costs.copies {
+                writeln!(f, "send_path/copy_{len}_ns {}", cost.as_nanos())?;
+            }
+        }
+        for (path, sent) in SendPath::ALL.iter().zip(self.sent) {
+            writeln!(f, "send_path/{}_sends {sent}", path.name())?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn costs(round_trip_ns: u64) -> SendCosts {
+        SendCosts {
+            round_trip: Duration::from_nanos(round_trip_ns),
+            copies: STAGING_SLOT_SIZES
+                .iter()
+                .map(|&len| (len, Duration::from_nanos(len as u64 / 8)))
+                .collect(),
+        }
+    }
+
+    #[test]
+    fn sends_are_copied_while_cheaper_than_the_round_trip() {
+        // The copies of up to 4KB take 512ns
+        let thresholds = SendThresholds::tune(&costs(800), 64 << 10, Some(65536));
+        assert_eq!(thresholds.copy_max, 4 << 10);
+        assert_eq!(
+            SendThresholds::tune(&costs(800), 0, None).copy_max,
+            MAX_INLINE_DATA
+        );
+        assert_eq!(SendThresholds::tune(&costs(1), 64 << 10, None).copy_max, 0);
+
+        let policy = SendPolicy::new(thresholds, None);
+        assert_eq!(policy.choose(128, true, true, (0, 64)), SendPath::Inline);
+        assert_eq!(policy.choose(2048, true, true, (0, 64)), SendPath::Staged);
+        assert_eq!(policy.choose(2048, true, true, (32, 64)), SendPath::Dma);
+        assert_eq!(policy.choose(8192, true, true, (0, 64)), SendPath::Dma);
+        assert_eq!(policy.choose(128, false, true, (32, 64)), SendPath::Staged);
+        assert_eq!(policy.choose(1 << 20, false, true, (0, 64)), SendPath::Dma);
+        assert_eq!(
+            policy.choose(1 << 20, true, true, (0, 64)),
+            SendPath::Rendezvous
+        );
+        assert_eq!(policy.choose(1 << 20, true, false, (0, 64)), SendPath::Dma);
+    }
+
+    #[test]
+    fn costs_are_measured_against_the_csr_reads() {
+        let mut reads = 0;
+        let costs = SendCosts::measure(|| {
+            reads += 1;
+            Ok(0)
+        })
+        .unwrap();
+        assert_eq!(reads, TUNE_SAMPLES);
+        assert_eq!(costs.copies.len(), STAGING_SLOT_SIZES.len());
+    }
+}
@@ -0,0 +1,345 @@
+//! Snapshot of the connected QPs and the MR keys of a share of the device.
+//!
+//! The snapshot is a file mapped by the context, written as the QPs are connected and as
+//! their WRs complete, so that it is left in place by a process that exits without closing
+//! the device. The next process claiming the share finds the QPs the card still holds, it
+//! reattaches them at the positions recorded instead of resetting the device, and
+//! invalidates the keys of the MRs the pages died with.
+//!
+//! Each QP has a slot at its index, the fields are 32-bit words accessed through atomics: the
+//! connection is written by the verbs context, the positions by the completion workers.
+
+use std::{
+    fs::OpenOptions,
+    io,
+    path::{Path, PathBuf},
+    sync::atomic::{AtomicU32, Ordering},
+};
+
+use crate::{
+    constants::{LR_KEY_KEY_PART_WIDTH, MAX_MR_CNT, PAGE_SIZE_2MB},
+    rdma_utils::{psn::Psn, qp::qpn_to_index},
+};
+
+/// Magic of the header, "BLSN"
+const MAGIC: u32 = 0x4e53_4c42;
+
+/// Version of the layout, a snapshot of another version is discarded
+const VERSION: u32 = 1;
+
+/// Words of the header: magic, version, QPs and keys of the slots
+const HEADER_WORDS: usize = 16;
+
+/// Words of the slot of a QP
+const QP_WORDS: usize = 8;
+
+/// Offsets of the fields in the slot of a QP, the QPN is 0 in a free slot
+const QPN: usize = 0;
+const DQPN: usize = 1;
+const DQP_IP: usize = 2;
+/// `qp_type`, `pmtu`, `access_flags` and `max_rd_atomic`, a byte each
+const FLAGS: usize = 3;
+const MAX_DEST_RD_ATOMIC: usize = 4;
+const SEND_MSN: usize = 5;
+const SEND_PSN: usize = 6;
+const RECV_PSN: usize = 7;
+
+/// Set in the slot of a recorded key, the keys are below `MAX_MR_CNT << LR_KEY_KEY_PART_WIDTH`
+const KEY_VALID: u32 = 1 << 31;
+
+/// A connected QP recorded in the snapshot
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub(crate) struct QpRecord {
+    pub(crate) qpn: u32,
+    pub(crate) qp_type: u8,
+    pub(crate) dqpn: u32,
+    pub(crate) dqp_ip: u32,
+    pub(crate) pmtu: u8,
+    pub(crate) access_flags: u8,
+    pub(crate) max_rd_atomic: u8,
+    pub(crate) max_dest_rd_atomic: u8,
+    /// MSN of the first WR not completed
+    pub(crate) send_msn: u16,
+    /// First PSN of the first WR not completed
+    pub(crate) send_psn: Psn,
+    /// First PSN not received from the peer
+    pub(crate) recv_psn: Psn,
+}
+
+/// The snapshot of a share, mapped for the lifetime of the context
+#[derive(Debug)]
+pub(crate) struct StateSnapshot {
+    path: PathBuf,
+    map: memmap2::MmapMut,
+    max_qp: usize,
+}
+
+impl StateSnapshot {
+    /// Opens the snapshot of share `index` of `device` in `dir`, created empty if missing or
+    /// written for another number of QPs.
+    ///
+    /// The records of the previous owner of the share are kept, the positions of the free
+    /// slots are reset to those of the new QPs.
+    #[allow(unsafe_code, clippy::as_conversions)]
+    pub(crate) fn open(dir: &Path, device: &str, index: usize, max_qp: usize) -> io::Result<Self> {
+        let path = dir.join(format!("blue-rdma-{device}.{index}.state"));
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(false)
+            .open(&path)?;
+        // Files of hugetlbfs are sized in huge pages, those of tmpfs only take the pages written
+        let len = (num_words(max_qp) * size_of::<u32>()).next_multiple_of(PAGE_SIZE_2MB) as u64;
+        let stale = file.metadata()?.len() != len;
+        if stale {
+            file.set_len(0)?;
+            file.set_len(len)?;
+        }
+        // SAFETY: the file is only mapped by the holder of the share, which holds its lock
+        let map = unsafe { memmap2::MmapMut::map_mut(&file)? };
+        let snapshot = Self { path, map, max_qp };
+        let header = snapshot.header();
+        let valid = !stale
+            && header.first().map(|x| x.load(Ordering::Acquire)) == Some(MAGIC)
+            && header.get(1).map(|x| x.load(Ordering::Relaxed)) == Some(VERSION)
+            && header.get(2).map(|x| x.load(Ordering::Relaxed)) == Some(max_qp as u32);
+        if valid {
+            for slot in snapshot.qp_slots().filter(|slot| word(slot, QPN) == 0) {
+                for field in [SEND_MSN, SEND_PSN, RECV_PSN] {
+                    store(slot, field, 0);
+                }
+            }
+        } else {
+            snapshot.reset();
+        }
+        Ok(snapshot)
+    }
+
+    pub(crate) fn path(&self) -> &Path {
+        &self.path
+    }
+
+    /// Returns the QPs recorded as connected
+    pub(crate) fn qps(&self) -> Vec<QpRecord> {
+        self.qp_slots()
+            .filter(|slot| word(slot, QPN) != 0)
+            .map(|slot| {
+                let [qp_type, pmtu, access_flags, max_rd_atomic] = word(slot, FLAGS).to_le_bytes();
+                QpRecord {
+                    qpn: word(slot, QPN),
+                    qp_type,
+                    dqpn: word(slot, DQPN),
+                    dqp_ip: word(slot, DQP_IP),
+                    pmtu,
+                    access_flags,
+                    max_rd_atomic,
+                    max_dest_rd_atomic: u8::try_from(word(slot, MAX_DEST_RD_ATOMIC))
+                        .unwrap_or_default(),
+                    send_msn: u16::try_from(word(slot, SEND_MSN)).unwrap_or_default(),
+                    send_psn: Psn(word(slot, SEND_PSN)),
+                    recv_psn: Psn(word(slot, RECV_PSN)),
+                }
+            })
+            .collect()
+    }
+
+    /// Returns the recorded MR and MW keys
+    pub(crate) fn keys(&self) -> Vec<u32> {
+        self.key_slots()
+            .iter()
+            .map(|x| x.load(Ordering::Acquire))
+            .filter(|&x| x & KEY_VALID != 0)
+            .map(|x| x & !KEY_VALID)
+            .collect()
+    }
+
+    /// Records the connection of a QP, its positions are left to the completion workers
+    pub(crate) fn record_qp(&self, record: &QpRecord) {
+        let Some(slot) = self.qp_slot(record.qpn) else {
+            return;
+        };
+        let flags = u32::from_le_bytes([
+            record.qp_type,
+            record.pmtu,
+            record.access_flags,
+            record.max_rd_atomic,
+        ]);
+        store(slot, DQPN, record.dqpn);
+        store(slot, DQP_IP, record.dqp_ip);
+        store(slot, FLAGS, flags);
+        store(
+            slot,
+            MAX_DEST_RD_ATOMIC,
+            u32::from(record.max_dest_rd_atomic),
+        );
+        // The QPN is written last, a slot is read as connected only once complete
+        if let Some(qpn) = slot.get(QPN) {
+            qpn.store(record.qpn, Ordering::Release);
+        }
+    }
+
+    /// Removes a destroyed QP
+    pub(crate) fn clear_qp(&self, qpn: u32) {
+        if let Some(word) = self.qp_slot(qpn).and_then(|slot| slot.get(QPN)) {
+            let _ignore = word.compare_exchange(qpn, 0, Ordering::AcqRel, Ordering::Relaxed);
+        }
+    }
+
+    /// Records that the WRs of the QP before `msn` completed, the WR `msn` starting at `psn`
+    pub(crate) fn record_send(&self, qpn: u32, msn: u16, psn: Psn) {
+        if let Some(slot) = self.qp_slot(qpn) {
+            store(slot, SEND_MSN, u32::from(msn));
+            store(slot, SEND_PSN, psn.into_inner());
+        }
+    }
+
+    /// Records that the packets of the QP before `psn` were received
+    pub(crate) fn record_recv(&self, qpn: u32, psn: Psn) {
+        if let Some(slot) = self.qp_slot(qpn) {
+            store(slot, RECV_PSN, psn.into_inner());
+        }
+    }
+
+    /// Records a key written to the MTT of the device, in the slot of its index
+    pub(crate) fn record_key(&self, key: u32) {
+        if let Some(slot) = self.key_slot(key) {
+            slot.store(key | KEY_VALID, Ordering::Release);
+        }
+    }
+
+    /// Removes the key of the index of `key`, once invalidated on the device
+    pub(crate) fn clear_key(&self, key: u32) {
+        if let Some(slot) = self.key_slot(key) {
+            slot.store(0, Ordering::Release);
+        }
+    }
+
+    /// Empties the snapshot
+    #[allow(clippy::as_conversions)]
+    fn reset(&self) {
+        for x in self.words() {
+            x.store(0, Ordering::Relaxed);
+        }
+        let header = self.header();
+        for (x, value) in
+            header
+                .iter()
+                .skip(1)
+                .zip([VERSION, self.max_qp as u32, MAX_MR_CNT as u32])
+        {
+            x.store(value, Ordering::Relaxed);
+        }
+        // The magic is written last, a snapshot without it is discarded
+        if let Some(magic) = header.first() {
+            magic.store(MAGIC, Ordering::Release);
+        }
+    }
+
+    #[allow(unsafe_code, clippy::cast_ptr_alignment)]
+    fn words(&self) -> &[AtomicU32] {
+        // SAFETY: the mapping is page aligned and at least `num_words` words long, it lives as
+        // long as `self` and is only accessed through the atomics
+        unsafe {
+            std::slice::from_raw_parts(
+                self.map.as_ptr().cast::<AtomicU32>(),
+                num_words(self.max_qp),
+            )
+        }
+    }
+
+    fn header(&self) -> &[AtomicU32] {
+        self.words().get(..HEADER_WORDS).unwrap_or_default()
+    }
+
+    fn qp_slots(&self) -> impl Iterator<Item = &[AtomicU32]> {
+        self.words()
+            .get(HEADER_WORDS..HEADER_WORDS + self.max_qp * QP_WORDS)
+            .unwrap_or_default()
+            .chunks_exact(QP_WORDS)
+    }
+
+    fn qp_slot(&self, qpn: u32) -> Option<&[AtomicU32]> {
+        let start = HEADER_WORDS + qpn_to_index(qpn) * QP_WORDS;
+        self.words().get(start..start + QP_WORDS)
+    }
+
+    fn key_slots(&self) -> &[AtomicU32] {
+        self.words()
+            .get(HEADER_WORDS + self.max_qp * QP_WORDS..)
+            .unwrap_or_default()
+    }
+
+    fn key_slot(&self, key: u32) -> Option<&AtomicU32> {
+        self.key_slots()
+            .get(usize::try_from(key >> LR_KEY_KEY_PART_WIDTH).ok()?)
+    }
+}
+
+/// Returns the words of a snapshot of `max_qp` QPs
+fn num_words(max_qp: usize) -> usize {
+    HEADER_WORDS + max_qp * QP_WORDS + MAX_MR_CNT
+}
+
+fn word(slot: &[AtomicU32], field: usize) -> u32 {
+    slot.get(field).map_or(0, |x| x.load(Ordering::Acquire))
+}
+
+fn store(slot: &[AtomicU32], field: usize, value: u32) {
+    if let Some(x) = slot.get(field) {
+        x.store(value, Ordering::Relaxed);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn records_survive_the_mapping() {
+        let dir = std::env::temp_dir();
+        let device = format!("snapshot-test-{}", std::process::id());
+        let record = QpRecord {
+            qpn: (3 << 8) | 0x5a,
+            qp_type: 2,
+            dqpn: 0x1234,
+            dqp_ip: 0x0a00_0002,
+            pmtu: 5,
+            access_flags: 7,
+            max_rd_atomic: 4,
+            max_dest_rd_atomic: 8,
+            send_msn: 0,
+            send_psn: Psn(0),
+            recv_psn: Psn(0),
+        };
+        let snapshot = StateSnapshot::open(&dir, &device, 0, 16).unwrap();
+        snapshot.record_qp(&record);
+        snapshot.record_send(record.qpn, 10, Psn(100));
+        snapshot.record_recv(record.qpn, Psn(42));
+        // Positions of a free slot are reset by the next owner
+        snapshot.record_send(5 << 8, 3, Psn(9));
+        snapshot.record_key((7 << 8) | 1);
+        snapshot.record_key((9 << 8) | 2);
+        snapshot.clear_key((9 << 8) | 2);
+        drop(snapshot);
+
+        let snapshot = StateSnapshot::open(&dir, &device, 0, 16).unwrap();
+        let expected = QpRecord {
+            send_msn: 10,
+            send_psn: Psn(100),
+            recv_psn: Psn(42),
+            ..record
+        };
+        assert_eq!(snapshot.qps(), vec![expected]);
+        assert_eq!(snapshot.keys(), vec![(7 << 8) | 1]);
+        assert_eq!(word(snapshot.qp_slot(5 << 8).unwrap(), SEND_MSN), 0);
+        snapshot.clear_qp(record.qpn);
+        assert!(snapshot.qps().is_empty());
+        drop(snapshot);
+
+        // A snapshot of another number of QPs is discarded
+        let snapshot = StateSnapshot::open(&dir, &device, 0, 32).unwrap();
+        assert!(snapshot.keys().is_empty());
+        std::fs::remove_file(snapshot.path()).unwrap();
+    }
+}
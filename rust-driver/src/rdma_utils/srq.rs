@@ -0,0 +1,322 @@
+use std::collections::{BTreeMap, HashMap, VecDeque};
+
+use crate::{
+    constants::{MAX_SRQ_CNT, MAX_SRQ_WR, SRQ_QP_WINDOW},
+    error::{RdmaError, Result},
+};
+
+use super::types::RecvWr;
+
+/// Shared receive queues.
+///
+/// Receive WRs are matched by the requester, so every QP must have WRs advertised to its peer
+/// before the peer sends. A QP attached to an SRQ is lent at most `SRQ_QP_WINDOW` WRs of the
+/// shared pool, and the window is refilled from the pool as the QP consumes them. A consumer
+/// with `N` QPs of `D` pre-posted receives each needs `N * D` receive buffers, with an SRQ it
+/// needs a pool sized for the aggregate arrival rate, plus at most `N * SRQ_QP_WINDOW` WRs
+/// parked at idle peers.
+#[derive(Default)]
+pub(crate) struct SrqTable {
+    /// SRQs keyed by handle
+    srqs: HashMap<u32, Srq>,
+    /// SRQ of each attached QP
+    qp_srq: HashMap<u32, u32>,
+}
+
+/// A shared receive queue
+struct Srq {
+    /// Maximum number of outstanding WRs, lent WRs included
+    max_wr: usize,
+    /// Low watermark of the pool, 0 if the limit event is not armed
+    limit: usize,
+    /// WRs not yet lent to any QP
+    pool: VecDeque<RecvWr>,
+    /// Attached QPs
+    qps: BTreeMap<u32, LentWrs>,
+}
+
+/// WRs of a SRQ advertised to the peer of an attached QP
+#[derive(Default)]
+struct LentWrs {
+    /// Whether the post receive channel of the QP is connected
+    ready: bool,
+    /// Lent WRs in the order the peer consumes them
+    wrs: VecDeque<RecvWr>,
+}
+
+impl Srq {
+    /// Returns the number of outstanding WRs
+    fn len(&self) -> usize {
+        self.pool.len() + self.qps.values().map(|x| x.wrs.len()).sum::<usize>()
+    }
+}
+
+impl SrqTable {
+    /// Creates an empty `SrqTable`
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    /// Creates a SRQ holding up to `max_wr` WRs, with the limit event armed at `limit`
+    pub(crate) fn create(&mut self, max_wr: u32, limit: u32) -> Result<u32> {
+        let max_wr = max_wr as usize;
+        if max_wr == 0 || max_wr > MAX_SRQ_WR || limit as usize > max_wr {
+            return Err(RdmaError::InvalidInput(format!(
+                "Invalid SRQ size {max_wr} or limit {limit}"
+            )));
+        }
+        let handle = (0..MAX_SRQ_CNT as u32)
+            .find(|x| !self.srqs.contains_key(x))
+            .ok_or(RdmaError::ResourceExhausted("No SRQ available".into()))?;
+        let srq = Srq {
+            max_wr,
+            limit: limit as usize,
+            pool: VecDeque::new(),
+            qps: BTreeMap::new(),
+        };
+        let _ignore = self.srqs.insert(handle, srq);
+
+        Ok(handle)
+    }
+
+    /// Destroys a SRQ, fails if QPs are still attached to it
+    pub(crate) fn destroy(&mut self, handle: u32) -> Result<()> {
+        let srq = self.srq(handle)?;
+        if !srq.qps.is_empty() {
+            return Err(RdmaError::InvalidInput(format!(
+                "SRQ {handle} still has attached QPs"
+            )));
+        }
+        let _srq = self.srqs.remove(&handle);
+
+        Ok(())
+    }
+
+    /// Updates the size and arms the limit event of a SRQ
+    pub(crate) fn modify(
+        &mut self,
+        handle: u32,
+        max_wr: Option<u32>,
+        limit: Option<u32>,
+    ) -> Result<()> {
+        let srq = self.srq_mut(handle)?;
+        let max_wr = max_wr.map_or(srq.max_wr, |x| x as usize);
+        let limit = limit.map_or(srq.limit, |x| x as usize);
+        if max_wr > MAX_SRQ_WR || max_wr < srq.len() || limit > max_wr {
+            return Err(RdmaError::InvalidInput(format!(
+                "Invalid SRQ size {max_wr} or limit {limit}"
+            )));
+        }
+        srq.max_wr = max_wr;
+        srq.limit = limit;
+
+        Ok(())
+    }
+
+    /// Returns the size and the armed limit of a SRQ
+    pub(crate) fn query(&self, handle: u32) -> Result<(u32, u32)> {
+        let srq = self.srq(handle)?;
+
+        Ok((srq.max_wr as u32, srq.limit as u32))
+    }
+
+    /// Adds a WR to the pool of a SRQ
+    pub(crate) fn post(&mut self, handle: u32, wr: RecvWr) -> Result<()> {
+        let srq = self.srq_mut(handle)?;
+        if srq.len() >= srq.max_wr {
+            return Err(RdmaError::ResourceExhausted(format!(
+                "SRQ {handle} is full"
+            )));
+        }
+        srq.pool.push_back(wr);
+
+        Ok(())
+    }
+
+    /// Attaches a QP to a SRQ
+    pub(crate) fn attach(&mut self, handle: u32, qpn: u32) -> Result<()> {
+        let srq = self.srq_mut(handle)?;
+        let _ignore = srq.qps.insert(qpn, LentWrs::default());
+        let _ignore = self.qp_srq.insert(qpn, handle);
+
+        Ok(())
+    }
+
+    /// Detaches a QP, the WRs lent to it are returned to the front of the pool
+    pub(crate) fn detach(&mut self, qpn: u32) {
+        let Some(handle) = self.qp_srq.remove(&qpn) else {
+            return;
+        };
+        let Some(srq) = self.srqs.get_mut(&handle) else {
+            return;
+        };
+        if let Some(lent) = srq.qps.remove(&qpn) {
+            for wr in lent.wrs.into_iter().rev() {
+                srq.pool.push_front(wr);
+            }
+        }
+    }
+
+    /// Returns `true` if no QP is attached to any SRQ
+    pub(crate) fn is_empty(&self) -> bool {
+        self.qp_srq.is_empty()
+    }
+
+    /// Returns the SRQ the QP is attached to
+    pub(crate) fn srq_of(&self, qpn: u32) -> Option<u32> {
+        self.qp_srq.get(&qpn).copied()
+    }
+
+    /// Marks the post receive channel of an attached QP as connected
+    pub(crate) fn set_ready(&mut self, qpn: u32) {
+        if let Some(lent) = self.lent_mut(qpn) {
+            lent.ready = true;
+        }
+    }
+
+    /// Records that the peer of the QP consumed the oldest lent WR
+    pub(crate) fn consumed(&mut self, qpn: u32) {
+        if let Some(lent) = self.lent_mut(qpn) {
+            let _wr = lent.wrs.pop_front();
+        }
+    }
+
+    /// Lends WRs of the pool to the ready QPs of a SRQ until their windows are full.
+    ///
+    /// # Returns
+    ///
+    /// The WRs to post to each QP, and whether the pool dropped below the armed limit. The
+    /// limit is disarmed once reported.
+    pub(crate) fn refill(&mut self, handle: u32) -> (Vec<(u32, RecvWr)>, bool) {
+        let Some(srq) = self.srqs.get_mut(&handle) else {
+            return (Vec::new(), false);
+        };
+        let mut lent_wrs = Vec::new();
+        // Lends one WR per QP in each round, so that a burst of posts is spread evenly
+        loop {
+            let mut lent_any = false;
+            for (&qpn, lent) in srq.qps.iter_mut().filter(|(_, x)| x.ready) {
+                if lent.wrs.len() >= SRQ_QP_WINDOW {
+                    continue;
+                }
+                let Some(wr) = srq.pool.pop_front() else {
+                    break;
+                };
+                lent.wrs.push_back(wr);
+                lent_wrs.push((qpn, wr));
+                lent_any = true;
+            }
+            if !lent_any || srq.pool.is_empty() {
+                break;
+            }
+        }
+        let limit_reached = srq.limit != 0 && srq.pool.len() < srq.limit;
+        if limit_reached {
+            srq.limit = 0;
+        }
+
+        (lent_wrs, limit_reached)
+    }
+
+    /// Returns the lent WRs of an attached QP
+    fn lent_mut(&mut self, qpn: u32) -> Option<&mut LentWrs> {
+        let handle = self.qp_srq.get(&qpn)?;
+        self.srqs.get_mut(handle)?.qps.get_mut(&qpn)
+    }
+
+    /// Returns the SRQ of the handle
+    fn srq(&self, handle: u32) -> Result<&Srq> {
+        self.srqs
+            .get(&handle)
+            .ok_or(RdmaError::NotFound(format!("SRQ {handle} not found")))
+    }
+
+    /// Returns the SRQ of the handle
+    fn srq_mut(&mut self, handle: u32) -> Result<&mut Srq> {
+        self.srqs
+            .get_mut(&handle)
+            .ok_or(RdmaError::NotFound(format!("SRQ {handle} not found")))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn recv_wr(wr_id: u64) -> RecvWr {
+        RecvWr {
+            wr_id,
+            addr: 0x1000 * wr_id,
+            length: 64,
+            lkey: 1,
+        }
+    }
+
+    #[test]
+    fn pool_is_lent_in_windows() {
+        let mut table = SrqTable::new();
+        let srq = table.create(64, 0).unwrap();
+        let (qp0, qp1) = (1 << 8, 2 << 8);
+        table.attach(srq, qp0).unwrap();
+        table.attach(srq, qp1).unwrap();
+        for i in 0..(SRQ_QP_WINDOW * 2 + 1) as u64 {
+            table.post(srq, recv_wr(i)).unwrap();
+        }
+        // qp1 is not connected yet
+        table.set_ready(qp0);
+        let (lent, _) = table.refill(srq);
+        assert_eq!(lent.len(), SRQ_QP_WINDOW);
+        assert!(lent.iter().all(|&(qpn, _)| qpn == qp0));
+        table.set_ready(qp1);
+        let (lent, _) = table.refill(srq);
+        assert_eq!(lent.len(), SRQ_QP_WINDOW);
+        assert!(lent.iter().all(|&(qpn, _)| qpn == qp1));
+        table.consumed(qp0);
+        let (lent, _) = table.refill(srq);
+        assert_eq!(lent.iter().map(|x| x.0).collect::<Vec<_>>(), [qp0]);
+        assert!(table.refill(srq).0.is_empty());
+    }
+
+    #[test]
+    fn detached_wrs_return_to_pool() {
+        let mut table = SrqTable::new();
+        let srq = table.create(SRQ_QP_WINDOW as u32, 0).unwrap();
+        let (qp0, qp1) = (1 << 8, 2 << 8);
+        table.attach(srq, qp0).unwrap();
+        table.set_ready(qp0);
+        for i in 0..SRQ_QP_WINDOW as u64 {
+            table.post(srq, recv_wr(i)).unwrap();
+        }
+        assert!(table.post(srq, recv_wr(99)).is_err());
+        assert_eq!(table.refill(srq).0.len(), SRQ_QP_WINDOW);
+        table.consumed(qp0);
+        assert!(table.destroy(srq).is_err());
+        table.detach(qp0);
+        assert_eq!(table.srq_of(qp0), None);
+        table.attach(srq, qp1).unwrap();
+        table.set_ready(qp1);
+        let (lent, _) = table.refill(srq);
+        let ids: Vec<_> = lent.iter().map(|x| x.1.wr_id).collect();
+        assert_eq!(ids, (1..SRQ_QP_WINDOW as u64).collect::<Vec<_>>());
+    }
+
+    #[test]
+    fn limit_event_fires_once() {
+        let mut table = SrqTable::new();
+        let srq = table.create(64, 0).unwrap();
+        let qpn = 1 << 8;
+        table.attach(srq, qpn).unwrap();
+        table.set_ready(qpn);
+        for i in 0..(SRQ_QP_WINDOW + 2) as u64 {
+            table.post(srq, recv_wr(i)).unwrap();
+        }
+        table.modify(srq, None, Some(4)).unwrap();
+        assert_eq!(table.query(srq).unwrap(), (64, 4));
+        let (_, limit_reached) = table.refill(srq);
+        assert!(limit_reached);
+        assert_eq!(table.query(srq).unwrap(), (64, 0));
+        table.consumed(qpn);
+        assert!(!table.refill(srq).1);
+        assert!(table.modify(srq, Some(1), None).is_err());
+    }
+}
@@ -0,0 +1,82 @@
+use std::collections::HashMap;
+
+use crate::error::{RdmaError, Result};
+
+/// Thread domains of a context.
+///
+/// The QPs created under a thread domain are only posted to by one thread at a time. They
+/// post on the calling thread, whatever the `direct_doorbell` setting, into the send channel
+/// dedicated to their domain, so the send queue lock is not contended by the QPs of the other
+/// threads. A domain created once every channel but the first is dedicated shares the
+/// balanced channels.
+#[derive(Debug, Default)]
+pub(crate) struct ThreadDomains {
+    next_handle: u32,
+    /// Dedicated channel of each domain
+    domains: HashMap<u32, Option<usize>>,
+    /// Domain of each QP created under one
+    qps: HashMap<u32, u32>,
+}
+
+impl ThreadDomains {
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    /// Allocates a domain sending through `channel`, returns its handle
+    pub(crate) fn alloc(&mut self, channel: Option<usize>) -> u32 {
+        let handle = self.next_handle;
+        self.next_handle = self.next_handle.wrapping_add(1);
+        let _ignore = self.domains.insert(handle, channel);
+        handle
+    }
+
+    /// Deallocates a domain, fails while QPs of the domain exist
+    ///
+    /// # Returns
+    ///
+    /// The channel dedicated to the domain
+    pub(crate) fn dealloc(&mut self, td: u32) -> Result<Option<usize>> {
+        if !self.domains.contains_key(&td) {
+            return Err(RdmaError::NotFound(format!("TD {td} not found")));
+        }
+        if self.qps.values().any(|&x| x == td) {
+            return Err(RdmaError::InvalidInput(format!("TD {td} still has QPs")));
+        }
+        Ok(self.domains.remove(&td).flatten())
+    }
+
+    /// Records the QP `qpn` of the domain, returns the channel of the domain
+    pub(crate) fn attach(&mut self, qpn: u32, td: u32) -> Result<Option<usize>> {
+        let channel = *self
+            .domains
+            .get(&td)
+            .ok_or(RdmaError::NotFound(format!("TD {td} not found")))?;
+        let _ignore = self.qps.insert(qpn, td);
+        Ok(channel)
+    }
+
+    /// Forgets the QP, returns `true` if it was created under a domain
+    pub(crate) fn detach(&mut self, qpn: u32) -> bool {
+        self.qps.remove(&qpn).is_some()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn domains_dealloc_once_their_qps_are_gone() {
+        let mut domains = ThreadDomains::new();
+        let (td0, td1) = (domains.alloc(Some(3)), domains.alloc(None));
+        assert_eq!(domains.attach(1 << 8, td0).unwrap(), Some(3));
+        assert_eq!(domains.attach(2 << 8, td1).unwrap(), None);
+        assert!(domains.attach(3 << 8, 99).is_err());
+        assert!(domains.dealloc(td0).is_err());
+        assert!(domains.detach(1 << 8));
+        assert!(!domains.detach(1 << 8));
+        assert_eq!(domains.dealloc(td0).unwrap(), Some(3));
+        assert!(domains.dealloc(td0).is_err());
+    }
+}
@@ -2,13 +2,111 @@ use bincode::{Decode, Encode};
 use ibverbs_sys::{
     ibv_send_wr,
     ibv_wr_opcode::{
+        IBV_WR_ATOMIC_CMP_AND_SWP, IBV_WR_ATOMIC_FETCH_AND_ADD, IBV_WR_ATOMIC_WRITE, IBV_WR_FLUSH,
         IBV_WR_RDMA_READ, IBV_WR_RDMA_WRITE, IBV_WR_RDMA_WRITE_WITH_IMM, IBV_WR_SEND,
         IBV_WR_SEND_WITH_IMM,
     },
 };
 use serde::{Deserialize, Serialize};
 
-use crate::{workers::send::WorkReqOpCode, RdmaError};
+use crate::{
+    constants::MAX_SGE,
+    latency::Stamp,
+    rdma_utils::atomic::{AtomicOperands, ATOMIC_LEN, FLUSH_GLOBAL, FLUSH_MR, FLUSH_PERSISTENT},
+    workers::send::{QpParams, SendDescTemplate, WorkReqOpCode},
+    RdmaError,
+};
+
+/// A single scatter-gather element of a work request
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct Sge {
+    pub(crate) addr: u64,
+    pub(crate) length: u32,
+    pub(crate) lkey: u32,
+}
+
+impl Sge {
+    pub(crate) fn new(addr: u64, length: u32, lkey: u32) -> Self {
+        Self { addr, length, lkey }
+    }
+}
+
+/// Fixed capacity scatter-gather list, kept inline so that work requests stay `Copy`
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct SgList {
+    sges: [Sge; MAX_SGE],
+    len: usize,
+}
+
+impl SgList {
+    /// Creates a list containing a single SGE
+    pub(crate) fn single(addr: u64, length: u32, lkey: u32) -> Self {
+        let mut sges = [Sge::default(); MAX_SGE];
+        if let Some(first) = sges.first_mut() {
+            *first = Sge::new(addr, length, lkey);
+        }
+        Self { sges, len: 1 }
+    }
+
+    /// Creates a list from the given SGEs.
+    ///
+    /// Returns `None` if the number of SGEs exceeds `MAX_SGE`
+    pub(crate) fn from_slice(slice: &[Sge]) -> Option<Self> {
+        let mut sges = [Sge::default(); MAX_SGE];
+        sges.get_mut(..slice.len())?.copy_from_slice(slice);
+        Some(Self {
+            sges,
+            len: slice.len(),
+        })
+    }
+
+    #[allow(unsafe_code)]
+    /// Reads the SGEs of an ibverbs work request.
+    ///
+    /// # Safety
+    ///
+    /// `sg_list` must point to at least `num_sge` valid elements
+    pub(crate) unsafe fn from_ibv(
+        sg_list: *const ibverbs_sys::ibv_sge,
+        num_sge: i32,
+    ) -> crate::error::Result<Self> {
+        let num_sge = usize::try_from(num_sge)
+            .map_err(|e| RdmaError::InvalidInput(format!("Invalid SGE count: {e}")))?;
+        if num_sge == 0 || num_sge > MAX_SGE || sg_list.is_null() {
+            return Err(RdmaError::InvalidInput(format!(
+                "SGE count {num_sge} out of range, expected 1..={MAX_SGE}"
+            )));
+        }
+        // SAFETY: caller guarantees `sg_list` holds `num_sge` elements
+        let ibv_sges = unsafe { std::slice::from_raw_parts(sg_list, num_sge) };
+        let mut sges = [Sge::default(); MAX_SGE];
+        for (sge, ibv_sge) in sges.iter_mut().zip(ibv_sges) {
+            *sge = Sge::new(ibv_sge.addr, ibv_sge.length, ibv_sge.lkey);
+        }
+        Ok(Self { sges, len: num_sge })
+    }
+
+    /// Returns the SGEs as a slice
+    pub(crate) fn as_slice(&self) -> &[Sge] {
+        self.sges.get(..self.len).unwrap_or(&[])
+    }
+
+    /// Returns the number of SGEs
+    pub(crate) fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Returns the total length in bytes of all SGEs
+    pub(crate) fn total_len(&self) -> Option<u32> {
+        self.as_slice()
+            .iter()
+            .try_fold(0u32, |acc, sge| acc.checked_add(sge.length))
+    }
+
+    fn first(&self) -> Sge {
+        self.sges.first().copied().unwrap_or_default()
+    }
+}
 
 #[derive(Debug, Clone, Copy)]
 pub(crate) enum SendWr {
@@ -17,24 +115,21 @@ pub(crate) enum SendWr {
 }
 
 impl SendWr {
-    #[allow(unsafe_code)]
+    #[allow(unsafe_code, clippy::as_conversions)]
     /// Creates a new `SendWr`
     pub(crate) fn new(wr: ibv_send_wr) -> crate::error::Result<Self> {
-        let num_sge = usize::try_from(wr.num_sge)
-            .map_err(|e| RdmaError::InvalidInput(format!("Invalid SGE count: {e}")))?;
-        if num_sge != 1 {
-            return Err(RdmaError::Unimplemented(
-                "Only support for single SGE".into(),
-            ));
-        }
-        // SAFETY: sg_list is valid when num_sge > 0, which we've verified above
-        let sge = unsafe { *wr.sg_list };
+        // SAFETY: `sg_list` holds `num_sge` elements as required by the verbs API
+        let sg_list = unsafe { SgList::from_ibv(wr.sg_list, wr.num_sge) }?;
         let opcode = match wr.opcode {
             IBV_WR_RDMA_WRITE => WorkReqOpCode::RdmaWrite,
             IBV_WR_RDMA_WRITE_WITH_IMM => WorkReqOpCode::RdmaWriteWithImm,
             IBV_WR_RDMA_READ => WorkReqOpCode::RdmaRead,
             IBV_WR_SEND => WorkReqOpCode::Send,
             IBV_WR_SEND_WITH_IMM => WorkReqOpCode::SendWithImm,
+            IBV_WR_ATOMIC_CMP_AND_SWP => WorkReqOpCode::AtomicCmpAndSwp,
+            IBV_WR_ATOMIC_FETCH_AND_ADD => WorkReqOpCode::AtomicFetchAndAdd,
+            IBV_WR_ATOMIC_WRITE => WorkReqOpCode::AtomicWrite,
+            IBV_WR_FLUSH => WorkReqOpCode::Flush,
             _ => {
                 return Err(RdmaError::Unimplemented(format!(
                     "Opcode {} not supported",
@@ -43,16 +138,28 @@ impl SendWr {
             }
         };
 
-        let base = SendWrBase {
-            wr_id: wr.wr_id,
-            send_flags: wr.send_flags,
-            laddr: sge.addr,
-            length: sge.length,
-            lkey: sge.lkey,
+        // TODO: scatter RDMA read responses into multiple local buffers
+        if opcode == WorkReqOpCode::RdmaRead && sg_list.len() > 1 {
+            return Err(RdmaError::Unimplemented(
+                "Only support for single SGE in RDMA read".into(),
+            ));
+        }
+
+        let needs_operand = opcode.is_atomic() || opcode == WorkReqOpCode::AtomicWrite;
+        if needs_operand && (sg_list.len() != 1 || sg_list.total_len() != Some(ATOMIC_LEN)) {
+            return Err(RdmaError::InvalidInput(
+                "Atomic operations require a single 8 bytes SGE".into(),
+            ));
+        }
+
+        let base = SendWrBase::new_with_sg_list(
+            wr.wr_id,
+            wr.send_flags,
+            sg_list,
             // SAFETY: imm_data is valid for operations with immediate data
-            imm_data: unsafe { wr.__bindgen_anon_1.imm_data },
+            unsafe { wr.__bindgen_anon_1.imm_data },
             opcode,
-        };
+        )?;
 
         match wr.opcode {
             IBV_WR_RDMA_WRITE | IBV_WR_RDMA_WRITE_WITH_IMM | IBV_WR_RDMA_READ => {
@@ -61,6 +168,41 @@ impl SendWr {
                     // SAFETY: rdma field is valid for RDMA operations
                     raddr: unsafe { wr.wr.rdma.remote_addr },
                     rkey: unsafe { wr.wr.rdma.rkey },
+                    atomic: AtomicOperands::default(),
+                };
+                Ok(Self::Rdma(wr))
+            }
+            IBV_WR_ATOMIC_CMP_AND_SWP | IBV_WR_ATOMIC_FETCH_AND_ADD => {
+                // SAFETY: atomic field is valid for atomic operations
+                let atomic = unsafe { wr.wr.atomic };
+                let wr = SendWrRdma {
+                    base,
+                    raddr: atomic.remote_addr,
+                    rkey: atomic.rkey,
+                    atomic: AtomicOperands::new(atomic.compare_add, atomic.swap),
+                };
+                Ok(Self::Rdma(wr))
+            }
+            IBV_WR_ATOMIC_WRITE => {
+                // SAFETY: the SGE of an atomic write is a registered buffer of 8 bytes
+                let value = unsafe { (base.laddr as *const u64).read_unaligned() };
+                let wr = SendWrRdma {
+                    base,
+                    // SAFETY: rdma field is valid for atomic writes
+                    raddr: unsafe { wr.wr.rdma.remote_addr },
+                    rkey: unsafe { wr.wr.rdma.rkey },
+                    atomic: AtomicOperands::atomic_write(value),
+                };
+                Ok(Self::Rdma(wr))
+            }
+            // `ibv_send_wr` has no flush fields, the whole region is made persistent
+            IBV_WR_FLUSH => {
+                let wr = SendWrRdma {
+                    base,
+                    // SAFETY: rdma field is valid for flushes
+                    raddr: unsafe { wr.wr.rdma.remote_addr },
+                    rkey: unsafe { wr.wr.rdma.rkey },
+                    atomic: AtomicOperands::flush(0, FLUSH_GLOBAL | FLUSH_PERSISTENT, FLUSH_MR),
                 };
                 Ok(Self::Rdma(wr))
             }
@@ -129,6 +271,8 @@ pub(crate) struct SendWrRdma {
     pub(crate) base: SendWrBase,
     pub(crate) raddr: u64,
     pub(crate) rkey: u32,
+    /// Operands of an atomic WR, unused by the other opcodes
+    pub(crate) atomic: AtomicOperands,
 }
 
 impl std::fmt::Debug for SendWrRdma {
@@ -137,6 +281,7 @@ impl std::fmt::Debug for SendWrRdma {
             .field("base", &self.base)
             .field("raddr", &format_args!("{:x}", self.raddr))
             .field("rkey", &self.rkey)
+            .field("atomic", &self.atomic)
             .finish()
     }
 }
@@ -156,17 +301,8 @@ impl SendWrRdma {
             }
         }
 
-        let num_sge = usize::try_from(wr.num_sge)
-            .map_err(|e| RdmaError::InvalidInput(format!("Invalid SGE count: {e}")))?;
-
-        if num_sge != 1 {
-            return Err(RdmaError::Unimplemented(
-                "Only support for single SGE in RDMA operations".into(),
-            ));
-        }
-
-        // SAFETY: sg_list is valid when num_sge > 0, which we've verified above
-        let sge = unsafe { *wr.sg_list };
+        // SAFETY: `sg_list` holds `num_sge` elements as required by the verbs API
+        let sg_list = unsafe { SgList::from_ibv(wr.sg_list, wr.num_sge) }?;
 
         let opcode = match wr.opcode {
             IBV_WR_RDMA_WRITE => WorkReqOpCode::RdmaWrite,
@@ -178,24 +314,28 @@ impl SendWrRdma {
         };
 
         Ok(Self {
-            base: SendWrBase {
-                wr_id: wr.wr_id,
-                send_flags: wr.send_flags,
-                laddr: sge.addr,
-                length: sge.length,
-                lkey: sge.lkey,
+            base: SendWrBase::new_with_sg_list(
+                wr.wr_id,
+                wr.send_flags,
+                sg_list,
                 // SAFETY: imm_data is valid for operations with immediate data
-                imm_data: unsafe { wr.__bindgen_anon_1.imm_data },
+                unsafe { wr.__bindgen_anon_1.imm_data },
                 opcode,
-            },
+            )?,
             // SAFETY: rdma field is valid for RDMA operations
             raddr: unsafe { wr.wr.rdma.remote_addr },
             rkey: unsafe { wr.wr.rdma.rkey },
+            atomic: AtomicOperands::default(),
         })
     }
 
     pub(crate) fn new_from_base(base: SendWrBase, raddr: u64, rkey: u32) -> SendWrRdma {
-        Self { base, raddr, rkey }
+        Self {
+            base,
+            raddr,
+            rkey,
+            atomic: AtomicOperands::default(),
+        }
     }
 
     /// Returns the local address of the SGE buffer
@@ -216,6 +356,12 @@ impl SendWrRdma {
         self.base.lkey
     }
 
+    /// Returns the scatter-gather list of the local buffers
+    #[inline]
+    pub(crate) fn sg_list(&self) -> &SgList {
+        &self.base.sg_list
+    }
+
     /// Returns the remote memory address for RDMA operations
     #[inline]
     pub(crate) fn raddr(&self) -> u64 {
@@ -234,12 +380,24 @@ impl SendWrRdma {
         self.base.imm_data
     }
 
+    /// Returns the operands of an atomic WR
+    #[inline]
+    pub(crate) fn atomic(&self) -> AtomicOperands {
+        self.atomic
+    }
+
     /// Returns the send flags
     #[inline]
     pub(crate) fn send_flags(&self) -> u32 {
         self.base.send_flags
     }
 
+    /// Returns the time the WR was posted
+    #[inline]
+    pub(crate) fn posted(&self) -> Stamp {
+        self.base.posted
+    }
+
     /// Returns the ID associated with this WR
     #[inline]
     pub(crate) fn wr_id(&self) -> u64 {
@@ -260,6 +418,11 @@ pub(crate) struct SendWrBase {
     pub(crate) lkey: u32,
     pub(crate) imm_data: u32,
     pub(crate) opcode: WorkReqOpCode,
+    /// Local buffers of the WR, `laddr` and `lkey` refer to the first element and
+    /// `length` is the total length of all elements
+    pub(crate) sg_list: SgList,
+    /// Time the WR was posted
+    pub(crate) posted: Stamp,
 }
 
 impl std::fmt::Debug for SendWrBase {
@@ -272,6 +435,7 @@ impl std::fmt::Debug for SendWrBase {
             .field("lkey", &self.lkey)
             .field("imm_data", &self.imm_data)
             .field("opcode", &self.opcode)
+            .field("sg_list", &self.sg_list.as_slice())
             .finish()
     }
 }
@@ -294,8 +458,34 @@ impl SendWrBase {
             lkey,
             imm_data,
             opcode,
+            sg_list: SgList::single(laddr, length, lkey),
+            posted: Stamp::now(),
         }
     }
+
+    pub(crate) fn new_with_sg_list(
+        wr_id: u64,
+        send_flags: u32,
+        sg_list: SgList,
+        imm_data: u32,
+        opcode: WorkReqOpCode,
+    ) -> crate::error::Result<Self> {
+        let first = sg_list.first();
+        let length = sg_list
+            .total_len()
+            .ok_or(RdmaError::InvalidInput("Total SGE length overflow".into()))?;
+        Ok(Self {
+            wr_id,
+            send_flags,
+            laddr: first.addr,
+            length,
+            lkey: first.lkey,
+            imm_data,
+            opcode,
+            sg_list,
+            posted: Stamp::now(),
+        })
+    }
 }
 
 // ValidationError has been moved to the error module
@@ -357,8 +547,24 @@ pub(crate) struct QpAttr {
     pub(crate) mac_addr: u64,
     pub(crate) pmtu: u8,
     pub(crate) access_flags: u8,
+    /// Number of RDMA READ requests of the peer served at once by the hardware responder
+    pub(crate) max_dest_rd_atomic: u8,
+    /// Number of RDMA READ requests of the QP outstanding at once, a large read is split into
+    /// up to this many requests
+    pub(crate) max_rd_atomic: u8,
+    /// UDP source port of the packets of the QP, selects the ECMP path
+    pub(crate) udp_port: u16,
     pub(crate) send_cq: Option<u32>,
     pub(crate) recv_cq: Option<u32>,
+    /// Size in bytes of the chunks the WRs of the QP are split into, 0 selects `WR_CHUNK_SIZE`
+    pub(crate) chunk_size: u32,
+    /// Send descriptors of the QP, must be refreshed after a change to the fields it encodes
+    pub(crate) send_template: SendDescTemplate,
+    /// QPN reported by the completions of the QP instead of its own, the DC QP of a context
+    pub(crate) owner_qpn: Option<u32>,
+    /// Signaled sends and RDMA writes of the QP complete once their PSNs are acknowledged,
+    /// rather than after the WRs posted before them
+    pub(crate) relaxed_completion: bool,
 }
 
 impl QpAttr {
@@ -368,6 +574,33 @@ impl QpAttr {
             ..Default::default()
         }
     }
+
+    /// Encodes the QP type, QPN, MAC address, DQPN, destination IP and PMTU of the QP into its
+    /// send descriptor template
+    pub(crate) fn refresh_send_template(&mut self) {
+        self.send_template = SendDescTemplate::new(
+            self.qp_type,
+            self.qpn,
+            self.mac_addr,
+            self.dqpn,
+            self.dqp_ip,
+            self.pmtu,
+        );
+    }
+
+    /// Returns the parameters of a WR with the given `msn` posted to the QP
+    pub(crate) fn qp_params(&self, msn: u16) -> QpParams {
+        QpParams::with_template(
+            msn,
+            self.qp_type,
+            self.qpn,
+            self.mac_addr,
+            self.dqpn,
+            self.dqp_ip,
+            self.pmtu,
+            self.send_template,
+        )
+    }
 }
 
 #[allow(unsafe_code, clippy::wildcard_imports)]
@@ -377,20 +610,27 @@ pub(crate) mod ibv_qp_attr {
     use ibverbs_sys::*;
     use log::info;
 
+    #[derive(Clone, Copy)]
     pub(crate) struct IbvQpInitAttr {
         pub(crate) qp_type: u8,
         pub(crate) send_cq: Option<u32>,
         pub(crate) recv_cq: Option<u32>,
+        pub(crate) srq: Option<u32>,
+        /// Outstanding send WRs, zero if not set
+        pub(crate) max_send_wr: u32,
     }
 
     impl IbvQpInitAttr {
         pub(crate) fn new(attr: ibv_qp_init_attr) -> Self {
             let send_cq = unsafe { attr.send_cq.as_ref() }.map(|cq| cq.handle);
             let recv_cq = unsafe { attr.recv_cq.as_ref() }.map(|cq| cq.handle);
+            let srq = unsafe { attr.srq.as_ref() }.map(|srq| srq.handle);
             Self {
                 qp_type: attr.qp_type as u8,
                 send_cq,
                 recv_cq,
+                srq,
+                max_send_wr: attr.cap.max_send_wr,
             }
         }
 
@@ -399,6 +639,8 @@ pub(crate) mod ibv_qp_attr {
                 qp_type: ibv_qp_type::IBV_QPT_RC as u8,
                 send_cq: None,
                 recv_cq: None,
+                srq: None,
+                max_send_wr: 0,
             }
         }
 
@@ -413,6 +655,26 @@ pub(crate) mod ibv_qp_attr {
         pub(crate) fn recv_cq(&self) -> Option<u32> {
             self.recv_cq
         }
+
+        pub(crate) fn srq(&self) -> Option<u32> {
+            self.srq
+        }
+
+        pub(crate) fn max_send_wr(&self) -> u32 {
+            self.max_send_wr
+        }
+    }
+
+    /// Returns the IPv4 address of the destination GID of an address vector
+    pub(crate) fn ah_attr_ipv4(attr: &ibv_ah_attr) -> Option<Ipv4Addr> {
+        let gid = unsafe { attr.grh.dgid.raw };
+        info!("gid: {:x}", u128::from_be_bytes(gid));
+
+        // Format: ::ffff:a.b.c.d
+        let is_ipv4_mapped =
+            gid[..10].iter().all(|&x| x == 0) && gid[10] == 0xFF && gid[11] == 0xFF;
+
+        is_ipv4_mapped.then(|| Ipv4Addr::new(gid[12], gid[13], gid[14], gid[15]))
     }
 
     #[derive(Default, Copy, Clone)]
@@ -448,14 +710,7 @@ pub(crate) mod ibv_qp_attr {
     impl IbvQpAttr {
         pub(crate) fn new(attr: ibv_qp_attr, attr_mask: u32) -> Self {
             let dest_qp_ip = if attr_mask & ibv_qp_attr_mask::IBV_QP_AV.0 != 0 {
-                let gid = unsafe { attr.ah_attr.grh.dgid.raw };
-                info!("gid: {:x}", u128::from_be_bytes(gid));
-
-                // Format: ::ffff:a.b.c.d
-                let is_ipv4_mapped =
-                    gid[..10].iter().all(|&x| x == 0) && gid[10] == 0xFF && gid[11] == 0xFF;
-
-                is_ipv4_mapped.then(|| Ipv4Addr::new(gid[12], gid[13], gid[14], gid[15]))
+                ah_attr_ipv4(&attr.ah_attr)
             } else {
                 None
             };
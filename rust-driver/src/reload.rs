@@ -0,0 +1,299 @@
+//! Reload of the tunables of the running contexts.
+//!
+//! A watcher thread follows the configuration file through inotify. Once the file is
+//! written or replaced, the file is loaded and validated again, and its `Tunables` are
+//! applied to the context: the pacing parameters and the poll policies are replaced in
+//! place, and the workers owning their state, the ACK responder and the timeout worker,
+//! pick the new values up through a `TunablesWatch` between two batches. A file that
+//! doesn't load keeps the current values.
+//!
+//! The file is watched rather than waiting for `SIGHUP`, the signals belong to the
+//! application.
+
+use std::{
+    ffi::{CString, OsStr},
+    io, mem,
+    os::unix::ffi::OsStrExt,
+    path::Path,
+    sync::{
+        atomic::{AtomicBool, AtomicU64, Ordering},
+        Arc,
+    },
+    thread,
+};
+
+use log::{debug, info, warn};
+use parking_lot::Mutex;
+
+use crate::{
+    config::{ConfigLoader, Tunables},
+    workers::{send::RateControl, spawner::WorkerLauncher},
+};
+
+/// Period the watcher checks on the context when the file doesn't change, in milliseconds
+const WATCH_PERIOD_MS: i32 = 1000;
+
+/// The current tunables of a context and their version
+#[derive(Debug)]
+pub(crate) struct TunablesCell {
+    /// Bumped by every store that changes the tunables
+    version: AtomicU64,
+    current: Mutex<Tunables>,
+}
+
+impl TunablesCell {
+    pub(crate) fn new(tunables: Tunables) -> Arc<Self> {
+        Arc::new(Self {
+            version: AtomicU64::new(0),
+            current: Mutex::new(tunables),
+        })
+    }
+
+    /// Returns a watch that reports the tunables stored from now on
+    pub(crate) fn watch(self: &Arc<Self>) -> TunablesWatch {
+        TunablesWatch {
+            cell: Arc::clone(self),
+            seen: self.version.load(Ordering::Acquire),
+        }
+    }
+
+    pub(crate) fn load(&self) -> Tunables {
+        *self.current.lock()
+    }
+
+    /// Replaces the tunables, returns `false` if they are unchanged
+    pub(crate) fn store(&self, tunables: Tunables) -> bool {
+        let mut current = self.current.lock();
+        if *current == tunables {
+            return false;
+        }
+        *current = tunables;
+        let _prev = self.version.fetch_add(1, Ordering::Release);
+        true
+    }
+}
+
+/// Tunables seen by a worker, checking for a change costs one load
+#[derive(Debug)]
+pub(crate) struct TunablesWatch {
+    cell: Arc<TunablesCell>,
+    seen: u64,
+}
+
+impl TunablesWatch {
+    /// Returns the tunables if they changed since the last call
+    pub(crate) fn changed(&mut self) -> Option<Tunables> {
+        let version = self.cell.version.load(Ordering::Acquire);
+        if version == self.seen {
+            return None;
+        }
+        self.seen = version;
+        Some(self.cell.load())
+    }
+}
+
+/// Applies the tunables of the context the workers don't watch themselves
+struct ReloadTargets {
+    cell: Arc<TunablesCell>,
+    rate: Arc<RateControl>,
+    launcher: WorkerLauncher,
+}
+
+impl ReloadTargets {
+    fn apply(&self, tunables: Tunables) {
+        if !self.cell.store(tunables) {
+            debug!("config reloaded, tunables unchanged");
+            return;
+        }
+        self.rate.reconfigure(&tunables.congestion);
+        self.launcher.set_poll_policy(tunables.poll);
+        apply_log_level(tunables);
+        info!("config reloaded: {tunables:?}");
+    }
+}
+
+/// Sets the maximum log level if the tunables set one
+pub(crate) fn apply_log_level(tunables: Tunables) {
+    if let Some(level) = tunables.log_level {
+        log::set_max_level(level);
+    }
+}
+
+/// Watches the configuration file of a context, the watcher thread exits once it is dropped
+#[derive(Debug)]
+pub(crate) struct ConfigWatcher {
+    stop: Arc<AtomicBool>,
+}
+
+impl ConfigWatcher {
+    /// Spawns the thread reloading the tunables of the context from the default
+    /// configuration file
+    pub(crate) fn spawn(
+        cell: Arc<TunablesCell>,
+        rate: Arc<RateControl>,
+        launcher: WorkerLauncher,
+    ) -> io::Result<Self> {
+        let path = Path::new(ConfigLoader::default_path());
+        let (Some(dir), Some(name)) = (path.parent(), path.file_name()) else {
+            return Err(io::ErrorKind::InvalidInput.into());
+        };
+        let inotify = Inotify::watch(dir)?;
+        let name = name.to_owned();
+        let stop = Arc::new(AtomicBool::new(false));
+        let stopped = Arc::clone(&stop);
+        let targets = ReloadTargets {
+            cell,
+            rate,
+            launcher,
+        };
+        let _handle = thread::Builder::new()
+            .name("config-watcher".into())
+            .spawn(move || watch(&inotify, &name, &targets, &stopped))?;
+
+        Ok(Self { stop })
+    }
+}
+
+impl Drop for ConfigWatcher {
+    fn drop(&mut self) {
+        self.stop.store(true, Ordering::Relaxed);
+    }
+}
+
+/// Reloads the tunables whenever the file `name` is written, until the watcher is stopped
+fn watch(inotify: &Inotify, name: &OsStr, targets: &ReloadTargets, stop: &AtomicBool) {
+    let path = ConfigLoader::default_path();
+    while !stop.load(Ordering::Relaxed) {
+        match inotify.wait_for(name) {
+            Ok(true) => {}
+            Ok(false) => continue,
+            Err(err) => {
+                warn!("stopped watching {path}: {err}");
+                return;
+            }
+        }
+        match ConfigLoader::load_from_path(path) {
+            Ok(config) => targets.apply(config.tunables()),
+            Err(err) => warn!("failed to reload {path}, keeping the current tunables: {err}"),
+        }
+    }
+}
+
+/// An inotify instance watching the entries of a directory
+#[derive(Debug)]
+struct Inotify {
+    fd: libc::c_int,
+}
+
+impl Inotify {
+    /// Events of an entry written or moved into the directory, editors that save through a
+    /// temporary file rename it over the original
+    const MASK: u32 = libc::IN_CLOSE_WRITE | libc::IN_MOVED_TO;
+
+    #[allow(unsafe_code)]
+    fn watch(dir: &Path) -> io::Result<Self> {
+        let dir = CString::new(dir.as_os_str().as_bytes())
+            .map_err(|_err| io::Error::from(io::ErrorKind::InvalidInput))?;
+        // SAFETY: FFI call without pointer arguments
+        let fd = unsafe { libc::inotify_init1(libc::IN_CLOEXEC | libc::IN_NONBLOCK) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let inotify = Self { fd };
+        // SAFETY: `dir` is a valid C string
+        if unsafe { libc::inotify_add_watch(fd, dir.as_ptr(), Self::MASK) } < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(inotify)
+    }
+
+    /// Waits up to `WATCH_PERIOD_MS` for events, returns `true` if one of them is about the
+    /// entry `name`
+    #[allow(unsafe_code)]
+    fn wait_for(&self, name: &OsStr) -> io::Result<bool> {
+        let mut pollfd = libc::pollfd {
+            fd: self.fd,
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        // SAFETY: `pollfd` is valid for the duration of the call
+        if unsafe { libc::poll(&mut pollfd, 1, WATCH_PERIOD_MS) } <= 0 {
+            return Ok(false);
+        }
+        let mut buf = [0u8; 4096];
+        // SAFETY: `buf` is valid for writes of its length
+        let len = unsafe { libc::read(self.fd, buf.as_mut_ptr().cast(), buf.len()) };
+        let Ok(len) = usize::try_from(len) else {
+            let err = io::Error::last_os_error();
+            return match err.kind() {
+                io::ErrorKind::WouldBlock | io::ErrorKind::Interrupted => Ok(false),
+                _ => Err(err),
+            };
+        };
+        let found =
+            events(buf.get(..len).unwrap_or_default()).any(|entry| entry == name.as_bytes());
+        Ok(found)
+    }
+}
+
+impl Drop for Inotify {
+    #[allow(unsafe_code)]
+    fn drop(&mut self) {
+        // SAFETY: the fd is owned by the instance
+        let _ignore = unsafe { libc::close(self.fd) };
+    }
+}
+
+/// Iterates over the entry names of the inotify events in `buf`
+fn events(mut buf: &[u8]) -> impl Iterator<Item = &[u8]> {
+    let header = mem::size_of::<libc::inotify_event>();
+    std::iter::from_fn(move || {
+        // `len` follows `wd`, `mask` and `cookie`
+        let len = buf.get(12..16)?;
+        let len = u32::from_ne_bytes(len.try_into().ok()?) as usize;
+        let name = buf.get(header..header + len)?;
+        buf = buf.get(header + len..).unwrap_or_default();
+        // The name is padded with NULs
+        let end = name.iter().position(|&b| b == 0).unwrap_or(name.len());
+        Some(name.get(..end).unwrap_or_default())
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::config::DeviceConfig;
+
+    #[test]
+    fn watch_reports_each_change_once() {
+        let tunables = DeviceConfig::default().tunables();
+        let cell = TunablesCell::new(tunables);
+        let mut watch = cell.watch();
+        assert_eq!(watch.changed(), None);
+        assert!(!cell.store(tunables));
+        assert_eq!(watch.changed(), None);
+
+        let mut changed = tunables;
+        changed.ack_coalesce.max_acks += 1;
+        assert!(cell.store(changed));
+        assert_eq!(watch.changed(), Some(changed));
+        assert_eq!(watch.changed(), None);
+        assert_eq!(cell.watch().changed(), None);
+    }
+
+    #[test]
+    fn events_yield_the_entry_names() {
+        let header = mem::size_of::<libc::inotify_event>();
+        let mut buf = Vec::new();
+        for (name, padded) in [("config.toml", 16), ("", 0)] {
+            let mut event = vec![0u8; header];
+            event[12..16].copy_from_slice(&(padded as u32).to_ne_bytes());
+            let mut bytes = name.as_bytes().to_vec();
+            bytes.resize(padded, 0);
+            event.extend(bytes);
+            buf.extend(event);
+        }
+        let names: Vec<_> = events(&buf).collect();
+        assert_eq!(names, [b"config.toml".as_slice(), b""]);
+    }
+}
@@ -1,17 +1,30 @@
 use std::{
     io,
     ops::{Deref, DerefMut},
+    sync::Arc,
 };
 
 use crate::{
     descriptors::DESC_SIZE,
     mem::{
         page::{ContiguousPages, HostPageAllocator, MmapMut, PageAllocator},
-        DmaBuf, DmaBufAllocator,
+        DmaBuf, DmaBufAllocator, PAGE_SIZE,
     },
     ringbuf::dma_rb::{DmaRingBuf, RING_BUF_LEN},
 };
 
+/// Size of the slabs the rings are carved from
+const SLAB_LEN: usize = PAGE_SIZE;
+/// Alignment of the rings in a slab, the rings start at a 4KB boundary as with a buffer of
+/// their own
+const RING_ALIGN: usize = 4096;
+
+#[cfg(feature = "desc_trace")]
+use std::sync::Arc;
+
+#[cfg(feature = "desc_trace")]
+use super::record::RingRecorder;
+
 pub(crate) trait DescSerialize {
     fn serialize(&self) -> [u8; 32];
 }
@@ -20,52 +33,155 @@ pub(crate) trait DescDeserialize {
     fn deserialize(d: [u8; 32]) -> Self;
 }
 
-pub(crate) struct DescRingBuffer(DmaRingBuf<[u8; 32]>);
+/// Raw descriptors, decoded by their consumer
+impl DescDeserialize for [u8; 32] {
+    fn deserialize(d: [u8; 32]) -> Self {
+        d
+    }
+}
+
+pub(crate) struct DescRingBuffer {
+    inner: DmaRingBuf<[u8; 32]>,
+    /// Trace of the descriptors pushed to or popped from the ring, see `recorded`
+    #[cfg(feature = "desc_trace")]
+    recorder: Option<Arc<RingRecorder>>,
+}
 
 impl DescRingBuffer {
     pub(crate) fn new(buf: MmapMut) -> Self {
-        let rb = DmaRingBuf::new(buf);
-        Self(rb)
+        Self::with_depth(buf, RING_BUF_LEN)
+    }
+
+    /// Creates a ring buffer of `depth` descriptors, `depth` must be a power of two
+    pub(crate) fn with_depth(buf: MmapMut, depth: usize) -> Self {
+        Self {
+            inner: DmaRingBuf::with_depth(buf, depth),
+            #[cfg(feature = "desc_trace")]
+            recorder: None,
+        }
+    }
+
+    /// Records the descriptors of the ring as the ring `name`, the pushed descriptors if the
+    /// ring goes `to_card` and the popped ones otherwise. Does nothing unless the driver is
+    /// built with the `desc_trace` feature.
+    #[cfg_attr(not(feature = "desc_trace"), allow(unused_variables, unused_mut))]
+    pub(crate) fn recorded(mut self, name: String, to_card: bool) -> Self {
+        #[cfg(feature = "desc_trace")]
+        {
+            self.recorder = Some(RingRecorder::register(name, to_card));
+        }
+        self
+    }
+
+    #[inline]
+    fn record(&self, desc: &[u8; 32]) {
+        #[cfg(feature = "desc_trace")]
+        if let Some(recorder) = self.recorder.as_ref() {
+            recorder.record(desc);
+        }
+        #[cfg(not(feature = "desc_trace"))]
+        let _ignore = desc;
     }
 
     pub(crate) fn push<T: DescSerialize>(&mut self, value: &T) -> bool {
-        self.0.push(value.serialize())
+        let desc = value.serialize();
+        let pushed = self.inner.push(desc);
+        if pushed {
+            self.record(&desc);
+        }
+        pushed
+    }
+
+    /// Writes two serialized descriptors in adjacent slots, nothing is written unless both fit
+    pub(crate) fn push_pair(&mut self, descs: [[u8; 32]; 2]) -> bool {
+        let [first, second] = descs;
+        let pushed = self.inner.push_pair(first, second);
+        if pushed {
+            self.record(&first);
+            self.record(&second);
+        }
+        pushed
     }
 
     pub(crate) fn pop<T: DescDeserialize>(&mut self) -> Option<T> {
-        self.0.pop(Self::is_valid).map(DescDeserialize::deserialize)
+        let desc = self.inner.pop(Self::is_valid)?;
+        self.record(&desc);
+        Some(T::deserialize(desc))
     }
 
     pub(crate) fn pop_two<A: DescDeserialize, B: DescDeserialize>(
         &mut self,
     ) -> (Option<A>, Option<B>) {
-        let (a, b) = self.0.pop_two(Self::is_valid, Self::has_next);
+        let (a, b) = self.inner.pop_two(Self::is_valid, Self::has_next);
+        for desc in a.iter().chain(b.iter()) {
+            self.record(desc);
+        }
         (
             a.map(DescDeserialize::deserialize),
             b.map(DescDeserialize::deserialize),
         )
     }
 
+    /// Pops up to `max` valid descriptors, a descriptor with the next bit set is passed to
+    /// `sink` together with the descriptor after it
+    ///
+    /// # Returns
+    ///
+    /// The number of popped descriptors
+    pub(crate) fn pop_burst<A, B, S>(&mut self, max: usize, mut sink: S) -> usize
+    where
+        A: DescDeserialize,
+        B: DescDeserialize,
+        S: FnMut(A, Option<B>),
+    {
+        let mut first = None;
+        #[cfg(feature = "desc_trace")]
+        let recorder = self.recorder.as_deref();
+        self.inner
+            .pop_burst(max, Self::is_valid, Self::has_next, |desc| {
+                #[cfg(feature = "desc_trace")]
+                if let Some(recorder) = recorder {
+                    recorder.record(&desc);
+                }
+                match first.take() {
+                    Some(f) => sink(A::deserialize(f), Some(B::deserialize(desc))),
+                    None if Self::has_next(&desc) => first = Some(desc),
+                    None => sink(A::deserialize(desc), None),
+                }
+            })
+    }
+
     pub(crate) fn remaining(&self) -> usize {
-        self.0.remaining()
+        self.inner.remaining()
+    }
+
+    /// Returns the number of descriptors of the ring buffer
+    pub(crate) fn depth(&self) -> usize {
+        self.inner.depth()
     }
 
     pub(crate) fn set_tail(&mut self, tail: u32) {
-        self.0.set_tail(tail);
+        self.inner.set_tail(tail);
     }
 
     pub(crate) fn set_head(&mut self, head: u32) {
-        self.0.set_head(head);
+        self.inner.set_head(head);
     }
 
     /// Returns the current head index in the ring buffer
     pub(crate) fn head(&self) -> usize {
-        self.0.head()
+        self.inner.head()
     }
 
     /// Returns the current tail index in the ring buffer
     pub(crate) fn tail(&self) -> usize {
-        self.0.tail()
+        self.inner.tail()
+    }
+
+    /// Returns the tail to report to the device, the popped descriptors are given back a
+    /// cache line at a time
+    pub(crate) fn released(&self) -> usize {
+        self.inner.released()
     }
 
     fn is_valid(desc: &[u8; 32]) -> bool {
@@ -78,17 +194,78 @@ impl DescRingBuffer {
     }
 }
 
+/// Allocator of the buffers of the rings.
+///
+/// The buffers are carved from slabs of a page, so that the rings of a context share a few
+/// hugepages instead of taking one each, and fewer pages are translated by the host and the
+/// device. A buffer larger than a slab is allocated on its own.
 pub(crate) struct DescRingBufAllocator<A> {
     dma_buf_allocator: A,
+    /// Slab the buffers are carved from
+    slab: Option<Slab>,
+}
+
+/// A physically contiguous buffer holding the buffers of several rings
+struct Slab {
+    buf: Arc<MmapMut>,
+    phys_addr: u64,
+    /// Offset of the first byte not carved yet
+    offset: usize,
+}
+
+impl Slab {
+    /// Carves `len` bytes from the slab, returns `None` if they don't fit
+    fn carve(&mut self, len: usize) -> Option<DmaBuf> {
+        let start = self.offset.next_multiple_of(RING_ALIGN);
+        let end = start
+            .checked_add(len)
+            .filter(|&end| end <= self.buf.len())?;
+        self.offset = end;
+        let buf = MmapMut::carve(&self.buf, start, len);
+        Some(DmaBuf::new(buf, self.phys_addr + start as u64))
+    }
 }
 
 impl<A: DmaBufAllocator> DescRingBufAllocator<A> {
     pub(crate) fn new(dma_buf_allocator: A) -> Self {
-        Self { dma_buf_allocator }
+        Self {
+            dma_buf_allocator,
+            slab: None,
+        }
     }
 
     pub(crate) fn alloc(&mut self) -> io::Result<DmaBuf> {
-        self.dma_buf_allocator.alloc(RING_BUF_LEN * DESC_SIZE)
+        self.alloc_with_depth(RING_BUF_LEN)
+    }
+
+    /// Allocates the buffer of a ring of `depth` descriptors
+    pub(crate) fn alloc_with_depth(&mut self, depth: usize) -> io::Result<DmaBuf> {
+        self.alloc_bytes(depth * DESC_SIZE)
+    }
+
+    /// Allocates a buffer of `len` bytes shared with the device next to the rings, such as
+    /// the frame slots of the simple NIC
+    pub(crate) fn alloc_bytes(&mut self, len: usize) -> io::Result<DmaBuf> {
+        if len > SLAB_LEN {
+            return self.dma_buf_allocator.alloc(len);
+        }
+        if let Some(buf) = self.slab.as_mut().and_then(|slab| slab.carve(len)) {
+            return Ok(buf);
+        }
+        let buf = self.dma_buf_allocator.alloc(SLAB_LEN)?;
+        // The buffers of an allocator ignoring the requested length, such as the buffers of
+        // the mock device, are not carved
+        if buf.len() != SLAB_LEN {
+            return Ok(buf);
+        }
+        let mut slab = Slab {
+            phys_addr: buf.phys_addr,
+            buf: Arc::new(buf.buf),
+            offset: 0,
+        };
+        let carved = slab.carve(len);
+        self.slab = Some(slab);
+        carved.ok_or_else(|| io::ErrorKind::OutOfMemory.into())
     }
 }
 
@@ -97,6 +274,58 @@ mod tests {
     use super::*;
     use std::ptr::NonNull;
 
+    /// Maps buffers of the requested length, the physical address of the nth buffer is
+    /// `n << 32`
+    struct TestDmaBufAllocator {
+        allocated: u64,
+    }
+
+    impl DmaBufAllocator for TestDmaBufAllocator {
+        #[allow(unsafe_code)]
+        fn alloc(&mut self, len: usize) -> io::Result<DmaBuf> {
+            let ptr = unsafe {
+                libc::mmap(
+                    std::ptr::null_mut(),
+                    len,
+                    libc::PROT_READ | libc::PROT_WRITE,
+                    libc::MAP_PRIVATE | libc::MAP_ANON,
+                    -1,
+                    0,
+                )
+            };
+            if ptr == libc::MAP_FAILED {
+                return Err(io::Error::last_os_error());
+            }
+            self.allocated += 1;
+            Ok(DmaBuf::new(MmapMut::new(ptr, len), self.allocated << 32))
+        }
+    }
+
+    #[test]
+    fn rings_are_carved_from_shared_slabs() {
+        let mut rb_allocator = DescRingBufAllocator::new(TestDmaBufAllocator { allocated: 0 });
+        let per_slab = SLAB_LEN / RING_ALIGN;
+        let mut bufs: Vec<_> = (0..=per_slab)
+            .map(|_| rb_allocator.alloc_with_depth(64).unwrap())
+            .collect();
+        for (i, buf) in bufs.iter().enumerate() {
+            let slab = (i / per_slab) as u64 + 1;
+            let offset = (i % per_slab * RING_ALIGN) as u64;
+            assert_eq!(buf.phys_addr(), (slab << 32) + offset);
+            assert_eq!(buf.len(), 64 * DESC_SIZE);
+        }
+        let large = rb_allocator.alloc_bytes(SLAB_LEN + 1).unwrap();
+        assert_eq!(large.phys_addr(), 3 << 32);
+
+        // The slabs stay mapped as long as one of their buffers
+        drop(rb_allocator);
+        let last = bufs.pop().unwrap();
+        bufs.truncate(1);
+        bufs[0].copy_from(0, &[1]);
+        assert_eq!(bufs[0].get(0, 1), [1]);
+        drop(last);
+    }
+
     #[derive(Debug, Clone, Copy, PartialEq, Eq)]
     struct TestDesc {
         id: u32,
@@ -156,7 +385,7 @@ mod tests {
             )
         };
 
-        MmapMut { ptr, len }
+        MmapMut::new(ptr, len)
     }
 
     #[test]
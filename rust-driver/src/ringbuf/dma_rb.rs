@@ -1,21 +1,39 @@
 use std::sync::atomic::{fence, Ordering};
 
+#[cfg(target_arch = "x86_64")]
+use std::arch::x86_64::{_mm_prefetch, _MM_HINT_T0};
+
 use crate::mem::page::MmapMut;
 
 /// Number of bits used to represent the length of the ring buffer.
 const RING_BUF_LEN_BITS: u8 = 12;
 /// Highest bit of the ring buffer
 pub(crate) const RING_BUF_LEN: usize = 1 << RING_BUF_LEN_BITS;
-/// Mask used to calculate the length of the ring buffer
-const RING_BUF_LEN_MASK: usize = (1 << RING_BUF_LEN_BITS) - 1;
 /// Mask used to wrap indices around the ring buffer length.
 /// Allows the highest bit to overflow for convenient wraparound.
 const RING_BUF_LEN_WRAP_MASK: usize = (1 << (RING_BUF_LEN_BITS + 1)) - 1;
+/// Largest supported ring buffer depth
+pub(crate) const MAX_RING_BUF_LEN: usize = 1 << 16;
+/// Size of a cache line of the host
+const CACHE_LINE_SIZE: usize = 64;
+/// Number of cache lines ahead of the tail prefetched by a pop
+const PREFETCH_LINES: usize = 2;
 
 pub(crate) struct DmaRingBuf<T> {
     ptr: *mut T,
     head: usize,
     tail: usize,
+    /// Entries up to `released` have been zeroed and are given back to the producer, it trails
+    /// the tail by less than a cache line
+    released: usize,
+    /// Number of entries, a power of two
+    depth: usize,
+    /// Mask used to calculate the index of an entry
+    mask: usize,
+    /// Mask used to wrap head and tail, one bit wider than `mask`
+    wrap_mask: usize,
+    /// Number of entries in a cache line, entries are zeroed a cache line at a time
+    line: usize,
 
     _mmap: MmapMut,
 }
@@ -23,19 +41,31 @@ pub(crate) struct DmaRingBuf<T> {
 #[allow(unsafe_code)]
 impl<T: Copy> DmaRingBuf<T> {
     pub(crate) fn new(mmap: MmapMut) -> Self {
-        assert!(mmap.len >= RING_BUF_LEN * size_of::<T>(), "invalid length");
+        Self::with_depth(mmap, RING_BUF_LEN)
+    }
+
+    /// Creates a ring buffer of `depth` entries, `depth` must be a power of two
+    pub(crate) fn with_depth(mmap: MmapMut, depth: usize) -> Self {
+        assert!(depth.is_power_of_two(), "invalid depth");
+        assert!(mmap.len >= depth * size_of::<T>(), "invalid length");
         Self {
             ptr: mmap.ptr.cast(),
             head: 0,
             tail: 0,
+            released: 0,
+            depth,
+            mask: depth - 1,
+            wrap_mask: (depth << 1) - 1,
+            line: (CACHE_LINE_SIZE / size_of::<T>().max(1)).clamp(1, depth),
             _mmap: mmap,
         }
     }
 
     pub(crate) fn push(&mut self, value: T) -> bool {
-        if self.len() == RING_BUF_LEN {
+        if self.len() == self.depth {
             return false;
         }
+        self.reclaim(1);
         unsafe {
             self.ptr.add(self.head_idx()).write_volatile(value);
         }
@@ -45,6 +75,24 @@ impl<T: Copy> DmaRingBuf<T> {
         true
     }
 
+    /// Writes two entries in adjacent slots, nothing is written unless both fit
+    pub(crate) fn push_pair(&mut self, first: T, second: T) -> bool {
+        if self.remaining() < 2 {
+            return false;
+        }
+        self.reclaim(2);
+        unsafe {
+            self.ptr.add(self.head_idx()).write_volatile(first);
+        }
+        self.inc_head();
+        unsafe {
+            self.ptr.add(self.head_idx()).write_volatile(second);
+        }
+        self.inc_head();
+
+        true
+    }
+
     pub(crate) fn pop<F>(&mut self, cond: F) -> Option<T>
     where
         F: FnOnce(&T) -> bool,
@@ -54,6 +102,7 @@ impl<T: Copy> DmaRingBuf<T> {
             // Ensures that the value is read atomically from memory
             fence(Ordering::Acquire);
             let value = self.read_and_advance(self.tail_idx());
+            self.release();
             return Some(value);
         }
 
@@ -70,7 +119,7 @@ impl<T: Copy> DmaRingBuf<T> {
         R: FnMut(&T) -> bool,
     {
         let idx_first = self.tail_idx();
-        let idx_next = idx_first.wrapping_add(1) & RING_BUF_LEN_MASK;
+        let idx_next = idx_first.wrapping_add(1) & self.mask;
         let value_first = self.read_index(idx_first);
         let value_next = self.read_index(idx_next);
 
@@ -83,34 +132,134 @@ impl<T: Copy> DmaRingBuf<T> {
                 fence(Ordering::Acquire);
                 let value_first = self.read_and_advance(idx_first);
                 let value_next = self.read_and_advance(idx_next);
+                self.release();
                 (Some(value_first), Some(value_next))
             }
             (true, _, false) => {
                 fence(Ordering::Acquire);
                 let value_first = self.read_and_advance(idx_first);
+                self.release();
                 (Some(value_first), None)
             }
             (true, false, true) | (false, _, _) => (None, None),
         }
     }
 
-    fn read_index(&self, index: usize) -> T {
-        unsafe { self.ptr.add(index).read_volatile() }
+    /// Pops up to `max` consecutive valid entries and passes them to `sink` in order.
+    ///
+    /// An entry for which `require_next` returns `true` is only popped together with the entry
+    /// after it. All entries are popped with a single fence and the tail is advanced once, the
+    /// cache lines ahead of the burst are prefetched for the next one.
+    ///
+    /// # Returns
+    ///
+    /// The number of popped entries
+    pub(crate) fn pop_burst<F, R, S>(
+        &mut self,
+        max: usize,
+        mut cond: F,
+        mut require_next: R,
+        mut sink: S,
+    ) -> usize
+    where
+        F: FnMut(&T) -> bool,
+        R: FnMut(&T) -> bool,
+        S: FnMut(T),
+    {
+        let max = max.min(self.depth);
+        let start = self.tail_idx();
+        let mask = self.mask;
+        let idx = |i: usize| start.wrapping_add(i) & mask;
+        let mut num = 0;
+        while num < max {
+            let value = self.read_index(idx(num));
+            if !cond(&value) {
+                break;
+            }
+            if !require_next(&value) {
+                num += 1;
+                continue;
+            }
+            if num + 1 >= max || !cond(&self.read_index(idx(num + 1))) {
+                break;
+            }
+            num += 2;
+        }
+        if num == 0 {
+            return 0;
+        }
+        // Ensures that the values are read atomically from memory
+        fence(Ordering::Acquire);
+        for i in 0..num {
+            sink(self.read_index(idx(i)));
+        }
+        self.tail = self.tail.wrapping_add(num) & self.wrap_mask;
+        self.release();
+
+        num
     }
 
-    fn zero_index(&mut self, index: usize) {
-        unsafe {
-            self.ptr.add(index).write_volatile(std::mem::zeroed());
-        }
+    fn read_index(&self, index: usize) -> T {
+        unsafe { self.ptr.add(index).read_volatile() }
     }
 
     fn read_and_advance(&mut self, index: usize) -> T {
         let value = self.read_index(index);
-        self.zero_index(index);
         self.inc_tail();
         value
     }
 
+    /// Zeroes the consumed entries of the cache lines the tail has left, and prefetches the
+    /// lines ahead of the tail.
+    ///
+    /// Zeroing whole lines avoids a partial write to a line the device may be writing the next
+    /// entries to, the entries of the line the tail is in stay with the consumer until the tail
+    /// leaves it.
+    fn release(&mut self) {
+        let consumed = self.consumed();
+        self.zero_released(consumed - (self.tail & (self.line - 1)).min(consumed));
+        for i in 1..=PREFETCH_LINES {
+            self.prefetch(self.tail_idx().wrapping_add(i * self.line) & self.mask);
+        }
+    }
+
+    /// Releases all the consumed entries before `num` entries are pushed over them, only
+    /// needed when the ring is produced and consumed on the host
+    fn reclaim(&mut self, num: usize) {
+        let unreleased = self.head.wrapping_sub(self.released) & self.wrap_mask;
+        if self.depth - unreleased < num {
+            self.zero_released(self.consumed());
+        }
+    }
+
+    /// Returns the number of consumed entries not yet released
+    fn consumed(&self) -> usize {
+        self.tail.wrapping_sub(self.released) & self.wrap_mask
+    }
+
+    /// Zeroes the `num` entries from `released` and releases them
+    fn zero_released(&mut self, num: usize) {
+        if num == 0 {
+            return;
+        }
+        let start = self.released & self.mask;
+        let first = num.min(self.depth - start);
+        unsafe {
+            self.ptr.add(start).write_bytes(0, first);
+            self.ptr.write_bytes(0, num - first);
+        }
+        self.released = self.released.wrapping_add(num) & self.wrap_mask;
+    }
+
+    #[cfg(target_arch = "x86_64")]
+    fn prefetch(&self, index: usize) {
+        unsafe { _mm_prefetch::<_MM_HINT_T0>(self.ptr.add(index).cast::<i8>()) };
+    }
+
+    #[cfg(not(target_arch = "x86_64"))]
+    #[allow(clippy::unused_self)]
+    fn prefetch(&self, _index: usize) {}
+
     /// Returns the current head index in the ring buffer
     pub(crate) fn head(&self) -> usize {
         self.head
@@ -121,14 +270,24 @@ impl<T: Copy> DmaRingBuf<T> {
         self.tail
     }
 
+    /// Returns the tail to report to the producer, the entries before it have been zeroed
+    pub(crate) fn released(&self) -> usize {
+        self.released
+    }
+
     /// Returns the current length of data in the ring buffer
     pub(crate) fn len(&self) -> usize {
         let dlt = self.head.wrapping_sub(self.tail);
-        dlt & RING_BUF_LEN_WRAP_MASK
+        dlt & self.wrap_mask
     }
 
     pub(crate) fn remaining(&self) -> usize {
-        RING_BUF_LEN - self.len()
+        self.depth - self.len()
+    }
+
+    /// Returns the number of entries of the ring buffer
+    pub(crate) fn depth(&self) -> usize {
+        self.depth
     }
 
     /// Returns true if the ring buffer is empty
@@ -138,21 +297,22 @@ impl<T: Copy> DmaRingBuf<T> {
 
     /// Returns true if the ring buffer is full
     pub(crate) fn is_full(&self) -> bool {
-        self.head ^ self.tail == RING_BUF_LEN
+        self.head ^ self.tail == self.depth
     }
 
     /// Increments the head pointer of the ring buffer
     pub(crate) fn inc_head(&mut self) {
-        self.head = self.head.wrapping_add(1) & RING_BUF_LEN_WRAP_MASK;
+        self.head = self.head.wrapping_add(1) & self.wrap_mask;
     }
 
     /// Increments the tail pointer of the ring buffer
     pub(crate) fn inc_tail(&mut self) {
-        self.tail = self.tail.wrapping_add(1) & RING_BUF_LEN_WRAP_MASK;
+        self.tail = self.tail.wrapping_add(1) & self.wrap_mask;
     }
 
     pub(crate) fn set_tail(&mut self, tail: u32) {
         self.tail = tail as usize;
+        self.released = self.tail;
     }
 
     pub(crate) fn set_head(&mut self, head: u32) {
@@ -160,11 +320,11 @@ impl<T: Copy> DmaRingBuf<T> {
     }
 
     fn head_idx(&self) -> usize {
-        self.head & RING_BUF_LEN_MASK
+        self.head & self.mask
     }
 
     fn tail_idx(&self) -> usize {
-        self.tail & RING_BUF_LEN_MASK
+        self.tail & self.mask
     }
 }
 
@@ -189,7 +349,7 @@ mod tests {
             )
         };
 
-        MmapMut { ptr, len }
+        MmapMut::new(ptr, len)
     }
 
     #[test]
@@ -252,6 +412,26 @@ mod tests {
         assert!(!rb.is_full());
     }
 
+    #[test]
+    fn test_dma_ring_buf_push_pair() {
+        let mmap = create_test_mmap();
+        let mut rb = DmaRingBuf::<u32>::new(mmap);
+
+        for i in 0..RING_BUF_LEN - 1 {
+            assert!(rb.push(i as u32));
+        }
+        assert!(!rb.push_pair(1, 2));
+        assert_eq!(rb.remaining(), 1);
+
+        assert_eq!(rb.pop(|_| true), Some(0));
+        assert!(rb.push_pair(1, 2));
+        assert!(rb.is_full());
+        for _ in 1..RING_BUF_LEN - 1 {
+            let _ignore = rb.pop(|_| true);
+        }
+        assert_eq!(rb.pop_two(|_| true, |_| true), (Some(1), Some(2)));
+    }
+
     #[test]
     fn test_dma_ring_buf_wraparound() {
         let mmap = create_test_mmap();
@@ -336,6 +516,106 @@ mod tests {
         assert_eq!(rb.len(), 2);
     }
 
+    #[test]
+    fn test_dma_ring_buf_pop_burst() {
+        let mmap = create_test_mmap();
+        let mut rb = DmaRingBuf::<u32>::new(mmap);
+        rb.set_head(RING_BUF_LEN as u32 - 2);
+        rb.set_tail(RING_BUF_LEN as u32 - 2);
+
+        // odd values require the next entry, 0 is invalid
+        for x in [2, 3, 4, 6, 5, 8] {
+            assert!(rb.push(x));
+        }
+
+        let mut popped = Vec::new();
+        assert_eq!(
+            rb.pop_burst(4, |&x| x != 0, |&x| x % 2 == 1, |x| popped.push(x)),
+            4
+        );
+        assert_eq!(popped, [2, 3, 4, 6]);
+        // the pair at the end of the burst is not split
+        popped.clear();
+        assert_eq!(
+            rb.pop_burst(1, |&x| x != 0, |&x| x % 2 == 1, |x| popped.push(x)),
+            0
+        );
+        assert_eq!(
+            rb.pop_burst(8, |&x| x != 0, |&x| x % 2 == 1, |x| popped.push(x)),
+            2
+        );
+        assert_eq!(popped, [5, 8]);
+        assert!(rb.is_empty());
+        assert_eq!(rb.read_index(RING_BUF_LEN - 1), 0);
+        // the tail has not left the first line since the wrap
+        assert_eq!(rb.released(), RING_BUF_LEN);
+        assert_eq!(rb.read_index(0), 4);
+    }
+
+    #[test]
+    fn test_dma_ring_buf_releases_whole_cache_lines() {
+        let mmap = create_test_mmap();
+        let mut rb = DmaRingBuf::<u32>::new(mmap);
+        let line = CACHE_LINE_SIZE / size_of::<u32>();
+
+        for x in 1..=line as u32 + 1 {
+            assert!(rb.push(x));
+        }
+        for _ in 0..line - 1 {
+            assert!(rb.pop(|&x| x != 0).is_some());
+        }
+        assert_eq!(rb.released(), 0);
+        assert_eq!(rb.read_index(0), 1);
+
+        assert_eq!(rb.pop(|&x| x != 0), Some(line as u32));
+        assert_eq!(rb.released(), line);
+        assert!((0..line).all(|i| rb.read_index(i) == 0));
+        assert_eq!(rb.pop(|&x| x != 0), Some(line as u32 + 1));
+        assert_eq!(rb.released(), line);
+
+        rb.set_tail(7);
+        assert_eq!(rb.released(), 7);
+    }
+
+    #[test]
+    fn test_dma_ring_buf_pop_burst_stops_at_invalid() {
+        let mmap = create_test_mmap();
+        let mut rb = DmaRingBuf::<u32>::new(mmap);
+
+        for x in [2, 4, 0, 6] {
+            assert!(rb.push(x));
+        }
+        let mut popped = Vec::new();
+        assert_eq!(
+            rb.pop_burst(8, |&x| x != 0, |_| false, |x| popped.push(x)),
+            2
+        );
+        assert_eq!(popped, [2, 4]);
+        assert_eq!(rb.len(), 2);
+    }
+
+    #[test]
+    fn test_dma_ring_buf_custom_depth() {
+        let mmap = create_test_mmap();
+        let mut rb = DmaRingBuf::<u32>::with_depth(mmap, 8);
+
+        for i in 0..8 {
+            assert!(rb.push(i));
+        }
+        assert!(rb.is_full());
+        assert!(!rb.push(8));
+        assert_eq!(rb.pop(|_| true), Some(0));
+        assert!(rb.push(8));
+        assert_eq!(rb.head(), 9);
+        assert_eq!(rb.head_idx(), 1);
+
+        let mut popped = Vec::new();
+        assert_eq!(rb.pop_burst(16, |_| true, |_| false, |x| popped.push(x)), 8);
+        assert_eq!(popped, [1, 2, 3, 4, 5, 6, 7, 8]);
+        assert!(rb.is_empty());
+        assert_eq!(rb.remaining(), 8);
+    }
+
     #[test]
     fn test_dma_ring_buf_set_head_tail() {
         let mmap = create_test_mmap();
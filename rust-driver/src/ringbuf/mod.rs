@@ -1,4 +1,7 @@
 mod desc;
 mod dma_rb;
+/// Recording of the descriptors of the rings to a trace file
+pub(crate) mod record;
 
 pub(crate) use desc::{DescDeserialize, DescRingBufAllocator, DescRingBuffer, DescSerialize};
+pub(crate) use dma_rb::{MAX_RING_BUF_LEN, RING_BUF_LEN};
@@ -0,0 +1,321 @@
+//! Recording of the descriptors exchanged with the device through its rings.
+//!
+//! With the `desc_trace` feature, every descriptor pushed to a send or command request ring
+//! and every descriptor popped from a meta report or command response ring is copied with
+//! its time into a trace of its ring. Each ring has its own trace, written only by the thread
+//! owning the ring and read by `dump` without stopping it, so the recorder takes no lock.
+//! The oldest records of a trace are overwritten once it is full.
+//!
+//! `dump` writes the traces of all rings of the process to a file, in little endian:
+//!
+//! ```text
+//! magic "BRDT", version: u32, num_rings: u32
+//! for each ring:
+//!     name_len: u8, name: [u8; name_len], to_card: u8, dropped: u64, num_records: u64
+//!     for each record, oldest first:
+//!         time_ns: u64, desc: [u8; 32]
+//! ```
+//!
+//! `dropped` counts the records overwritten before the dump, a trace with dropped records
+//! may start in the middle of a descriptor pair.
+
+use std::{fs, io, path::Path};
+
+/// Magic of a trace file
+const MAGIC: [u8; 4] = *b"BRDT";
+/// Version of the trace file format
+const VERSION: u32 = 1;
+/// Number of records of the trace of a ring
+#[cfg(feature = "desc_trace")]
+const RING_RECORDS: usize = 1 << 16;
+
+/// The trace of a ring read from a trace file
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub(crate) struct RingRecording {
+    /// Name of the ring, such as `send0` or `cmd_resp`, as shown by the ring monitor
+    pub(crate) name: String,
+    /// Whether the driver produces the ring and the card consumes it
+    pub(crate) to_card: bool,
+    /// Records overwritten before the dump
+    pub(crate) dropped: u64,
+    /// Time in nanoseconds of the device clock and descriptor of each record, oldest first
+    pub(crate) records: Vec<(u64, [u8; 32])>,
+}
+
+/// Encodes traces in the format of the trace file
+pub(crate) fn encode(rings: &[RingRecording]) -> Vec<u8> {
+    let mut out = Vec::new();
+    out.extend_from_slice(&MAGIC);
+    out.extend_from_slice(&VERSION.to_le_bytes());
+    out.extend_from_slice(&u32::try_from(rings.len()).unwrap_or(u32::MAX).to_le_bytes());
+    for ring in rings {
+        let name = ring.name.as_bytes();
+        let name = name.get(..usize::from(u8::MAX)).unwrap_or(name);
+        out.push(u8::try_from(name.len()).unwrap_or(u8::MAX));
+        out.extend_from_slice(name);
+        out.push(u8::from(ring.to_card));
+        out.extend_from_slice(&ring.dropped.to_le_bytes());
+        out.extend_from_slice(&(ring.records.len() as u64).to_le_bytes());
+        for (ns, desc) in &ring.records {
+            out.extend_from_slice(&ns.to_le_bytes());
+            out.extend_from_slice(desc);
+        }
+    }
+    out
+}
+
+/// Decodes the traces of a trace file
+///
+/// # Errors
+///
+/// Returns an error if `bytes` is not a trace file of this version
+pub(crate) fn decode(bytes: &[u8]) -> io::Result<Vec<RingRecording>> {
+    let mut reader = Reader(bytes);
+    if reader.take::<4>()? != MAGIC {
+        return Err(invalid("not a descriptor trace"));
+    }
+    let version = u32::from_le_bytes(reader.take()?);
+    if version != VERSION {
+        return Err(invalid(&format!("unsupported trace version {version}")));
+    }
+    let num_rings = u32::from_le_bytes(reader.take()?);
+    let mut rings = Vec::new();
+    for _ in 0..num_rings {
+        let [name_len] = reader.take()?;
+        let name = reader.take_slice(usize::from(name_len))?;
+        let name = String::from_utf8_lossy(name).into_owned();
+        let [to_card] = reader.take()?;
+        let dropped = u64::from_le_bytes(reader.take()?);
+        let num_records = u64::from_le_bytes(reader.take()?);
+        let records = (0..num_records)
+            .map(|_| Ok((u64::from_le_bytes(reader.take()?), reader.take()?)))
+            .collect::<io::Result<_>>()?;
+        rings.push(RingRecording {
+            name,
+            to_card: to_card != 0,
+            dropped,
+            records,
+        });
+    }
+    if !reader.0.is_empty() {
+        return Err(invalid("trailing bytes after the last ring"));
+    }
+    Ok(rings)
+}
+
+/// Reads the traces of the trace file at `path`
+///
+/// # Errors
+///
+/// Returns an error if the file can't be read or is not a trace file of this version
+pub(crate) fn load<P: AsRef<Path>>(path: P) -> io::Result<Vec<RingRecording>> {
+    decode(&fs::read(path)?)
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+/// Bytes of a trace file not decoded yet
+struct Reader<'a>(&'a [u8]);
+
+impl<'a> Reader<'a> {
+    fn take_slice(&mut self, len: usize) -> io::Result<&'a [u8]> {
+        if self.0.len() < len {
+            return Err(invalid("truncated descriptor trace"));
+        }
+        let (head, rest) = self.0.split_at(len);
+        self.0 = rest;
+        Ok(head)
+    }
+
+    fn take<const N: usize>(&mut self) -> io::Result<[u8; N]> {
+        self.take_slice(N)
+            .map(|x| x.try_into().unwrap_or_else(|_| unreachable!()))
+    }
+}
+
+/// Writes the traces of all rings recorded so far to `path`, returns the number of records
+/// written.
+///
+/// # Errors
+///
+/// Returns an error if the file can't be written
+#[cfg(feature = "desc_trace")]
+pub(crate) fn dump<P: AsRef<Path>>(path: P) -> io::Result<usize> {
+    let rings: Vec<_> = recorder::RINGS
+        .lock()
+        .iter()
+        .map(|ring| ring.snapshot())
+        .collect();
+    fs::write(path, encode(&rings))?;
+    Ok(rings.iter().map(|ring| ring.records.len()).sum())
+}
+
+/// Fails as the driver is built without the `desc_trace` feature
+///
+/// # Errors
+///
+/// Always returns `io::ErrorKind::Unsupported`
+#[cfg(not(feature = "desc_trace"))]
+pub(crate) fn dump<P: AsRef<Path>>(_path: P) -> io::Result<usize> {
+    Err(io::Error::new(
+        io::ErrorKind::Unsupported,
+        "descriptor recording requires the desc_trace feature",
+    ))
+}
+
+#[cfg(feature = "desc_trace")]
+pub(crate) use recorder::RingRecorder;
+
+#[cfg(feature = "desc_trace")]
+mod recorder {
+    use std::{
+        iter,
+        sync::{
+            atomic::{fence, AtomicU64, Ordering},
+            Arc,
+        },
+    };
+
+    use parking_lot::Mutex;
+
+    use super::{RingRecording, RING_RECORDS};
+    use crate::workers::completion::device_clock_ns;
+
+    /// Words of a record: the sequence, the time and the descriptor
+    const RECORD_WORDS: usize = 2 + 4;
+
+    /// Traces of all rings created so far, kept after their rings are dropped so that the
+    /// descriptors of a closed context can still be dumped
+    pub(super) static RINGS: Mutex<Vec<Arc<RingRecorder>>> = Mutex::new(Vec::new());
+
+    /// The trace of a ring, written by the owner of the ring only
+    #[derive(Debug)]
+    pub(crate) struct RingRecorder {
+        name: String,
+        to_card: bool,
+        words: Box<[AtomicU64]>,
+        /// Sequence of the next record
+        next: AtomicU64,
+    }
+
+    impl RingRecorder {
+        /// Creates the trace of the ring `name` and registers it for `dump`
+        pub(crate) fn register(name: String, to_card: bool) -> Arc<Self> {
+            let recorder = Arc::new(Self {
+                name,
+                to_card,
+                words: iter::repeat_with(|| AtomicU64::new(0))
+                    .take(RING_RECORDS * RECORD_WORDS)
+                    .collect(),
+                next: AtomicU64::new(0),
+            });
+            RINGS.lock().push(Arc::clone(&recorder));
+            recorder
+        }
+
+        /// Records `desc` at the current time
+        #[inline]
+        pub(crate) fn record(&self, desc: &[u8; 32]) {
+            let seq = self.next.fetch_add(1, Ordering::Relaxed);
+            let start = (seq as usize % RING_RECORDS) * RECORD_WORDS;
+            let Some(words) = self.words.get(start..start + RECORD_WORDS) else {
+                return;
+            };
+            // Marks the record being written, a dump skips it meanwhile
+            if let Some(word) = words.first() {
+                word.store(0, Ordering::Relaxed);
+            }
+            fence(Ordering::Release);
+            let mut values = [0; RECORD_WORDS];
+            values[1] = device_clock_ns();
+            for (value, bytes) in values.iter_mut().skip(2).zip(desc.chunks_exact(8)) {
+                *value = u64::from_le_bytes(bytes.try_into().unwrap_or_else(|_| unreachable!()));
+            }
+            for (word, value) in words.iter().zip(values).skip(1) {
+                word.store(value, Ordering::Relaxed);
+            }
+            // The sequence is written last, a record is only dumped if it is complete
+            if let Some(word) = words.first() {
+                word.store(seq + 1, Ordering::Release);
+            }
+        }
+
+        /// Reads the complete records of the trace, oldest first
+        pub(super) fn snapshot(&self) -> RingRecording {
+            let end = self.next.load(Ordering::Acquire);
+            let start = end.saturating_sub(RING_RECORDS as u64);
+            let mut records = Vec::with_capacity((end - start) as usize);
+            for seq in start..end {
+                let offset = (seq as usize % RING_RECORDS) * RECORD_WORDS;
+                let Some(words) = self.words.get(offset..offset + RECORD_WORDS) else {
+                    continue;
+                };
+                let mut values = [0; RECORD_WORDS];
+                for (value, word) in values.iter_mut().zip(words) {
+                    *value = word.load(Ordering::Acquire);
+                }
+                fence(Ordering::Acquire);
+                let [record_seq, ns, desc_words @ ..] = values;
+                let rewritten = words.first().map(|word| word.load(Ordering::Relaxed));
+                // Skips records being written or already overwritten
+                if record_seq != seq + 1 || rewritten != Some(record_seq) {
+                    continue;
+                }
+                let mut desc = [0; 32];
+                for (bytes, word) in desc.chunks_exact_mut(8).zip(desc_words) {
+                    bytes.copy_from_slice(&word.to_le_bytes());
+                }
+                records.push((ns, desc));
+            }
+            RingRecording {
+                name: self.name.clone(),
+                to_card: self.to_card,
+                dropped: end - records.len() as u64,
+                records,
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn recordings_round_trip() {
+        let rings = vec![
+            RingRecording {
+                name: "send0".into(),
+                to_card: true,
+                dropped: 0,
+                records: vec![(10, [1; 32]), (20, [2; 32])],
+            },
+            RingRecording {
+                name: "meta0".into(),
+                to_card: false,
+                dropped: 3,
+                records: vec![(15, [0x80; 32])],
+            },
+        ];
+        let bytes = encode(&rings);
+        assert_eq!(decode(&bytes).unwrap(), rings);
+        assert!(decode(&bytes[..bytes.len() - 1]).is_err());
+        assert!(decode(b"BRDX\x01\0\0\0\0\0\0\0").is_err());
+    }
+
+    #[cfg(feature = "desc_trace")]
+    #[test]
+    fn recorder_keeps_the_latest_records() {
+        let recorder = RingRecorder::register("test".into(), true);
+        for i in 0..RING_RECORDS + 2 {
+            recorder.record(&[i as u8; 32]);
+        }
+        let ring = recorder.snapshot();
+        assert_eq!(ring.dropped, 2);
+        assert_eq!(ring.records.len(), RING_RECORDS);
+        assert_eq!(ring.records.first().map(|r| r.1), Some([2; 32]));
+        assert!(ring.records.windows(2).all(|w| w[0].0 <= w[1].0));
+    }
+}
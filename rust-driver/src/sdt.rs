@@ -0,0 +1,93 @@
+//! Statically defined tracepoints of the hot paths.
+//!
+//! `sdt_probe!` places a SystemTap SDT probe of the `bluerdma` provider: a `nop` at the probe
+//! site and a `.note.stapsdt` entry telling the tracer where the arguments of the probe are.
+//! An inactive probe costs the `nop` and keeping its arguments in registers, `perf` and
+//! `bpftrace` activate it by replacing the `nop` with a breakpoint, without rebuilding the
+//! driver:
+//!
+//! ```text
+//! bpftrace -e 'usdt:/usr/lib/libbluerdma_rust.so:bluerdma:post_send { @[arg0] = count(); }'
+//! ```
+//!
+//! The arguments are integers of up to 64 bits, `arg0` to `arg3` in the order of the macro.
+//! Probes compile to nothing but borrows of their arguments on other targets than x86_64
+//! Linux.
+
+/// Places the SDT probe `bluerdma:<name>` with up to four integer arguments.
+macro_rules! sdt_probe {
+    ($name:literal $(,)?) => {
+        $crate::sdt::sdt_probe!(@emit $name, "")
+    };
+    ($name:literal, $a0:expr $(,)?) => {
+        $crate::sdt::sdt_probe!(@emit $name, "8@{a0}", a0 = $a0)
+    };
+    ($name:literal, $a0:expr, $a1:expr $(,)?) => {
+        $crate::sdt::sdt_probe!(@emit $name, "8@{a0} 8@{a1}", a0 = $a0, a1 = $a1)
+    };
+    ($name:literal, $a0:expr, $a1:expr, $a2:expr $(,)?) => {
+        $crate::sdt::sdt_probe!(
+            @emit $name,
+            "8@{a0} 8@{a1} 8@{a2}",
+            a0 = $a0,
+            a1 = $a1,
+            a2 = $a2
+        )
+    };
+    ($name:literal, $a0:expr, $a1:expr, $a2:expr, $a3:expr $(,)?) => {
+        $crate::sdt::sdt_probe!(
+            @emit $name,
+            "8@{a0} 8@{a1} 8@{a2} 8@{a3}",
+            a0 = $a0,
+            a1 = $a1,
+            a2 = $a2,
+            a3 = $a3
+        )
+    };
+    (@emit $name:literal, $args:literal $(, $op:ident = $value:expr)*) => {{
+        #[cfg(all(target_arch = "x86_64", target_os = "linux"))]
+        {
+            #[allow(unsafe_code, clippy::inline_always)]
+            #[inline(always)]
+            fn probe($($op: u64),*) {
+                // SAFETY: the probe is a `nop` and a note describing it, the tracer only reads
+                // the registers of the arguments
+                unsafe {
+                    core::arch::asm!(
+                        ".ifndef _.stapsdt.base",
+                        ".pushsection .stapsdt.base, \"aGR\", \"progbits\", .stapsdt.base, comdat",
+                        ".weak _.stapsdt.base",
+                        ".hidden _.stapsdt.base",
+                        "_.stapsdt.base: .space 1",
+                        ".size _.stapsdt.base, 1",
+                        ".popsection",
+                        ".endif",
+                        "990: nop",
+                        ".pushsection .note.stapsdt, \"\", \"note\"",
+                        ".balign 4",
+                        ".4byte 992f-991f, 994f-993f, 3",
+                        "991: .asciz \"stapsdt\"",
+                        "992: .balign 4",
+                        "993: .8byte 990b",
+                        ".8byte _.stapsdt.base",
+                        ".8byte 0",
+                        ".asciz \"bluerdma\"",
+                        concat!(".asciz \"", $name, "\""),
+                        concat!(".asciz \"", $args, "\""),
+                        "994: .balign 4",
+                        ".popsection",
+                        $($op = in(reg) $op,)*
+                        options(att_syntax, nomem, nostack, preserves_flags)
+                    );
+                }
+            }
+            probe($(u64::from($value)),*);
+        }
+        #[cfg(not(all(target_arch = "x86_64", target_os = "linux")))]
+        {
+            let _ignore = ($(&$value,)*);
+        }
+    }};
+}
+
+pub(crate) use sdt_probe;
@@ -0,0 +1,103 @@
+//! Time spent in each phase of opening a device.
+//!
+//! The open marks the end of each phase, from loading the configuration to starting the
+//! watchers of the context. The durations are logged once the context is open and reported
+//! by `dump_counters` as `startup/<phase>_us <value>` lines.
+
+use std::{
+    fmt,
+    time::{Duration, Instant},
+};
+
+use log::info;
+
+/// Durations of the phases of a device open
+#[derive(Debug, Clone)]
+pub(crate) struct StartupTimings {
+    /// Each phase in the order they first ended, a phase ended again adds to its duration
+    phases: Vec<(&'static str, Duration)>,
+    /// End of the last phase, or start of the open
+    last: Instant,
+}
+
+impl StartupTimings {
+    /// Starts timing the first phase
+    pub(crate) fn start() -> Self {
+        Self {
+            phases: Vec::new(),
+            last: Instant::now(),
+        }
+    }
+
+    /// Ends the phase `name`, the next one starts now
+    pub(crate) fn phase(&mut self, name: &'static str) {
+        let now = Instant::now();
+        let elapsed = now.saturating_duration_since(self.last);
+        self.last = now;
+        if let Some(phase) = self.phases.iter_mut().find(|x| x.0 == name) {
+            phase.1 += elapsed;
+        } else {
+            self.phases.push((name, elapsed));
+        }
+    }
+
+    /// Duration of the phase `name`, if it ended
+    pub(crate) fn get(&self, name: &str) -> Option<Duration> {
+        self.phases.iter().find(|x| x.0 == name).map(|x| x.1)
+    }
+
+    /// Sum of the durations of the phases
+    pub(crate) fn total(&self) -> Duration {
+        self.phases.iter().map(|x| x.1).sum()
+    }
+
+    /// Logs the duration of each phase
+    pub(crate) fn log(&self) {
+        info!("device opened in {:?}", self.total());
+        for &(name, duration) in &self.phases {
+            info!("startup phase {name}: {duration:?}");
+        }
+    }
+}
+
+impl fmt::Display for StartupTimings {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        for &(name, duration) in &self.phases {
+            writeln!(f, "startup/{name}_us {}", duration.as_micros())?;
+        }
+        writeln!(f, "startup/total_us {}", self.total().as_micros())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::thread;
+
+    use super::*;
+
+    #[test]
+    fn phases_ended_again_add_up() {
+        let mut timings = StartupTimings::start();
+        thread::sleep(Duration::from_millis(2));
+        timings.phase("config");
+        timings.phase("alloc");
+        thread::sleep(Duration::from_millis(2));
+        timings.phase("alloc");
+        let config = timings.get("config").unwrap();
+        let alloc = timings.get("alloc").unwrap();
+        assert!(config >= Duration::from_millis(2));
+        assert!(alloc >= Duration::from_millis(2));
+        assert_eq!(timings.total(), config + alloc);
+        assert_eq!(timings.get("reset"), None);
+
+        let lines: Vec<_> = timings
+            .to_string()
+            .lines()
+            .map(|line| line.split(' ').next().unwrap().to_owned())
+            .collect();
+        assert_eq!(
+            lines,
+            ["startup/config_us", "startup/alloc_us", "startup/total_us"]
+        );
+    }
+}
@@ -0,0 +1,214 @@
+use std::{
+    hint, io,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc,
+    },
+};
+
+use crate::{
+    config::AckCoalesceConfig,
+    constants::{DEFAULT_SIMPLE_NIC_SLOT_SIZE, QPN_KEY_PART_WIDTH},
+    csr::loopback::LoopbackDevice,
+    mem::{page::MmapMut, DmaBuf, DmaBufAllocator},
+    net::simple_nic::{FrameTx, FrameTxQueue, SimpleNicController},
+    rdma_utils::{psn::Psn, qp::QpTableSeqLock, types::QpAttr},
+    ringbuf::RING_BUF_LEN,
+    verbs::mock::MockDmaBufAllocator,
+    workers::{
+        ack_responder::{AckResponder, AckResponse, ACK_FRAME_LEN},
+        spawner::SingleThreadTaskWorker,
+    },
+};
+
+/// ACKs fed to the responder between two of its idle passes
+const ACKS_PER_POLL: usize = 64;
+
+/// Frame slots of the transmit queue, the mock DMA buffers map 128KB
+const NUM_SLOTS: usize = 1024;
+
+/// Where the ACK frames of the responder go
+#[derive(Debug, Clone, Copy)]
+pub enum BenchAckTx {
+    /// Counted and dropped, measures the build of the frames alone
+    Null,
+    /// Queued to the simple NIC of a loopback device, which consumes each frame as soon as
+    /// it is rung
+    Loopback,
+}
+
+/// Counts the frames sent and drops them
+#[derive(Debug, Clone, Default)]
+struct NullFrameTx {
+    frames: Arc<AtomicU64>,
+}
+
+impl FrameTx for NullFrameTx {
+    fn send(&mut self, buf: &[u8]) -> io::Result<()> {
+        self.send_batch(&[buf])
+    }
+
+    fn send_batch(&mut self, frames: &[&[u8]]) -> io::Result<()> {
+        let _frames = hint::black_box(frames);
+        let _prev = self
+            .frames
+            .fetch_add(frames.len() as u64, Ordering::Relaxed);
+        Ok(())
+    }
+}
+
+/// Frames sent by the responder
+enum FrameCount {
+    Null(Arc<AtomicU64>),
+    Loopback(LoopbackDevice),
+}
+
+impl FrameCount {
+    fn get(&self) -> u64 {
+        match *self {
+            FrameCount::Null(ref frames) => frames.load(Ordering::Relaxed),
+            FrameCount::Loopback(ref dev) => dev.frames(),
+        }
+    }
+}
+
+/// Returns the transmit queue of the simple NIC of `dev`, with slots of the default size
+fn frame_tx_queue(dev: &LoopbackDevice) -> io::Result<FrameTxQueue<LoopbackDevice>> {
+    let mut alloc = || MockDmaBufAllocator.alloc(RING_BUF_LEN * 32);
+    let slots = |buf: DmaBuf| {
+        let len = NUM_SLOTS * DEFAULT_SIMPLE_NIC_SLOT_SIZE;
+        DmaBuf::new(MmapMut::carve(&Arc::new(buf.buf), 0, len), 0)
+    };
+    let controller = SimpleNicController::init(
+        dev,
+        alloc()?,
+        alloc()?,
+        slots(alloc()?),
+        slots(alloc()?),
+        RING_BUF_LEN,
+        DEFAULT_SIMPLE_NIC_SLOT_SIZE,
+    )?;
+    Ok(controller.into_split().0)
+}
+
+/// The `AckResponder` fed with synthetic ACKs of connected RC QPs, in turn.
+///
+/// The responder is polled for the merged ACKs every `ACKS_PER_POLL` ACKs, the way the meta
+/// report worker drains its batches.
+pub struct BenchAckResponder {
+    responder: AckResponder,
+    frames: FrameCount,
+    num_qps: usize,
+    psn: u32,
+}
+
+impl BenchAckResponder {
+    /// Creates the responder of `num_qps` QPs, merging up to `max_acks` ACKs of a QP
+    pub fn new(tx: BenchAckTx, num_qps: usize, max_acks: u32) -> io::Result<Self> {
+        let qp_table = QpTableSeqLock::new();
+        for qpn in (1..=num_qps).map(Self::qpn) {
+            let _ignore = qp_table.map_qp_mut(qpn, |attr: &mut QpAttr| {
+                attr.qp_type = ibverbs_sys::ibv_qp_type::IBV_QPT_RC as u8;
+                attr.qpn = qpn;
+                attr.dqpn = qpn;
+                attr.ip = 0x0a00_0001;
+                attr.dqp_ip = 0x0a00_0002;
+                attr.mac_addr = 0x0a0b_0c0d_0e0f;
+            });
+        }
+        let (frame_tx, frames): (Box<dyn FrameTx + Send>, _) = match tx {
+            BenchAckTx::Null => {
+                let tx = NullFrameTx::default();
+                let frames = FrameCount::Null(Arc::clone(&tx.frames));
+                (Box::new(tx), frames)
+            }
+            BenchAckTx::Loopback => {
+                let dev = LoopbackDevice::new(RING_BUF_LEN);
+                (Box::new(frame_tx_queue(&dev)?), FrameCount::Loopback(dev))
+            }
+        };
+        let config = AckCoalesceConfig {
+            max_acks,
+            // A second, only the count closes a window
+            max_delay_us: 1_000_000,
+        };
+
+        Ok(Self {
+            responder: AckResponder::new(qp_table, frame_tx, config),
+            frames,
+            num_qps,
+            psn: 0,
+        })
+    }
+
+    /// Feeds `num` ACKs, returns the number of frames sent
+    pub fn acks(&mut self, num: usize) -> u64 {
+        self.feed(num, |qpn, psn| AckResponse::Ack {
+            qpn,
+            msn: 0,
+            last_psn: psn,
+        })
+    }
+
+    /// Feeds `num` NAKs, each sent with its own doorbell, returns the number of frames sent
+    pub fn naks(&mut self, num: usize) -> u64 {
+        self.feed(num, |qpn, psn| AckResponse::Nak {
+            qpn,
+            base_psn: psn,
+            ack_req_packet_psn: psn + 1,
+        })
+    }
+
+    fn feed<F>(&mut self, num: usize, response: F) -> u64
+    where
+        F: Fn(u32, Psn) -> AckResponse,
+    {
+        let start = self.frames.get();
+        for i in 0..num {
+            let qpn = Self::qpn(i % self.num_qps + 1);
+            self.psn = self.psn.wrapping_add(1);
+            self.responder.process(response(qpn, Psn::from(self.psn)));
+            if (i + 1) % ACKS_PER_POLL == 0 {
+                self.responder.maintainance();
+            }
+        }
+        self.responder.maintainance();
+        self.frames.get() - start
+    }
+
+    fn qpn(index: usize) -> u32 {
+        (index as u32) << QPN_KEY_PART_WIDTH
+    }
+}
+
+/// The transmit queue of the simple NIC of a loopback device, sending copies of an ACK frame
+pub struct BenchFrameTx {
+    queue: FrameTxQueue<LoopbackDevice>,
+    dev: LoopbackDevice,
+    frame: [u8; ACK_FRAME_LEN],
+}
+
+impl BenchFrameTx {
+    pub fn new() -> io::Result<Self> {
+        let dev = LoopbackDevice::new(RING_BUF_LEN);
+        Ok(Self {
+            queue: frame_tx_queue(&dev)?,
+            dev,
+            frame: [0xa5; ACK_FRAME_LEN],
+        })
+    }
+
+    /// Sends `num` frames, ringing the doorbell once every `batch` of them, returns the
+    /// number of frames rung
+    pub fn send(&mut self, num: usize, batch: usize) -> io::Result<u64> {
+        let frames = vec![self.frame.as_slice(); batch.max(1)];
+        let start = self.dev.frames();
+        let mut left = num;
+        while left > 0 {
+            let n = left.min(frames.len());
+            self.queue.send_batch(frames.get(..n).unwrap_or_default())?;
+            left -= n;
+        }
+        Ok(self.dev.frames() - start)
+    }
+}
@@ -0,0 +1,723 @@
+use std::{
+    collections::{HashMap, HashSet},
+    fs, hint, io, iter,
+    path::Path,
+    ptr,
+    sync::Arc,
+};
+
+use crate::{
+    config::{AckCoalesceConfig, CongestionConfig},
+    constants::{DEFAULT_PSN_WINDOW, MAX_CQE, MAX_QP_CNT, PSN_MASK, QPN_KEY_PART_WIDTH},
+    counters::DeviceCounters,
+    csr::{loopback::LoopbackDevice, mode::Mode, proxy::build_meta_report_queue_proxies},
+    descriptors::{
+        MetaReportQueueAckDesc, MetaReportQueueAckExtraDesc, MetaReportQueuePacketBasicInfoDesc,
+        MetaReportQueueReadReqExtendInfoDesc,
+    },
+    mem::DmaBufAllocator,
+    net::{rendezvous::PendingPulls, simple_nic::FrameTx},
+    rdma_utils::{atomic::Atomics, qp::QpTableSeqLock, types::QpAttr},
+    ringbuf::{record, DescDeserialize, DescRingBuffer, DescSerialize, RING_BUF_LEN},
+    verbs::mock::MockDmaBufAllocator,
+    workers::{
+        ack_responder::AckResponder,
+        completion::{
+            completion_queue, AsyncEventQueue, CompletionQueue, CompletionTask, CompletionWorker,
+        },
+        meta_report::{
+            FusedWorkers, MetaHandler, MetaReportQueue, MetaReportQueueCtx, MetaReportQueueHandler,
+            MetaWorker, ReportMeta,
+        },
+        qp_timeout::{AckTimeoutTask, QpActivity},
+        rdma::RdmaWriteTask,
+        retransmit::PacketRetransmitTask,
+        send::RateControl,
+        spawner::{task_channel, SingleThreadPollingWorker, TaskRx},
+    },
+};
+
+const OPCODE_WRITE_FIRST: u8 = 0x06;
+const OPCODE_WRITE_MIDDLE: u8 = 0x07;
+const OPCODE_WRITE_LAST: u8 = 0x08;
+const OPCODE_WRITE_LAST_WITH_IMM: u8 = 0x09;
+const OPCODE_WRITE_ONLY: u8 = 0x0a;
+const OPCODE_WRITE_ONLY_WITH_IMM: u8 = 0x0b;
+const OPCODE_READ_REQUEST: u8 = 0x0c;
+const OPCODE_READ_RESPONSE_ONLY: u8 = 0x10;
+const OPCODE_ACKNOWLEDGE: u8 = 0x11;
+const OPCODE_ATOMIC_ACKNOWLEDGE: u8 = 0x12;
+
+/// Bits of the last byte of a descriptor
+const VALID: u8 = 1 << 7;
+const HAS_NEXT: u8 = 1 << 6;
+
+/// PSN offset of the ACK windows reported by the local hardware, see `MetaReportQueueHandler`
+const LOCAL_HW_PSN_OFFSET: u32 = 112;
+/// Number of PSNs of an ACK bitmap
+const WINDOW: u32 = u128::BITS;
+const PMTU: u32 = 4096;
+
+const RADDR: u64 = 0x2_0000_0000;
+const LADDR: u64 = 0x1_0000_0000;
+
+/// Next PSN and MSN of a QP of a synthetic trace
+#[derive(Debug, Clone, Copy, Default)]
+pub(super) struct QpSeq {
+    pub(super) psn: u32,
+    pub(super) msn: u16,
+}
+
+/// A stream of meta report descriptors, as written by the hardware to a meta report queue.
+///
+/// Synthetic streams report the packets received on the QPs `(i + 1) << 8`, each QP starting
+/// at PSN 0. Recorded streams are the raw 32 byte descriptors polled from the queue.
+pub struct BenchMetaTrace {
+    pub(super) descs: Vec<[u8; 32]>,
+    qps: Vec<QpSeq>,
+}
+
+impl BenchMetaTrace {
+    /// Creates an empty synthetic trace of `num_qps` QPs
+    pub fn new(num_qps: usize) -> Self {
+        Self {
+            descs: Vec::new(),
+            qps: vec![QpSeq::default(); num_qps.max(1)],
+        }
+    }
+
+    /// Loads a recorded trace.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the file can't be read or doesn't hold valid descriptors.
+    pub fn load<P: AsRef<Path>>(path: P) -> io::Result<Self> {
+        let bytes = fs::read(path)?;
+        let chunks = bytes.chunks_exact(32);
+        if !chunks.remainder().is_empty() {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "trace is not a sequence of descriptors",
+            ));
+        }
+        Self::recorded(
+            chunks
+                .map(|c| c.try_into().unwrap_or_else(|_| unreachable!()))
+                .collect(),
+        )
+    }
+
+    /// Loads the meta report rings of a descriptor trace dumped by the driver built with the
+    /// `desc_trace` feature, see `bluerdma_dump_desc_trace`.
+    ///
+    /// The reports of all meta report rings are merged in the order they were polled in. A
+    /// ring that dropped records is read from its first whole report.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the file can't be read or doesn't hold valid descriptors.
+    pub fn load_recording<P: AsRef<Path>>(path: P) -> io::Result<Self> {
+        let mut reports = Vec::new();
+        for ring in record::load(path)?
+            .into_iter()
+            .filter(|ring| !ring.to_card && ring.name.starts_with("meta"))
+        {
+            let mut records = ring.records.into_iter();
+            if ring.dropped != 0 {
+                // The first records may be the end of a report, skips up to a report boundary
+                for (_, desc) in records.by_ref() {
+                    if !has_next(&desc) {
+                        break;
+                    }
+                }
+            }
+            while let Some((ns, desc)) = records.next() {
+                let next = has_next(&desc).then(|| records.next()).flatten();
+                reports.push((ns, iter::once(desc).chain(next.map(|(_, d)| d))));
+            }
+        }
+        // Stable, the reports of a ring keep their order
+        reports.sort_by_key(|&(ns, _)| ns);
+        Self::recorded(reports.into_iter().flat_map(|(_, descs)| descs).collect())
+    }
+
+    /// Creates a trace of recorded descriptors
+    fn recorded(descs: Vec<[u8; 32]>) -> io::Result<Self> {
+        let mut expect_next = false;
+        for desc in &descs {
+            let op_code = desc[30];
+            if desc[31] & VALID == 0 || op_code > OPCODE_ATOMIC_ACKNOWLEDGE {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    format!("invalid descriptor: {desc:?}"),
+                ));
+            }
+            expect_next = !expect_next && desc[31] & HAS_NEXT != 0;
+        }
+        if expect_next {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "trace ends in the middle of a report",
+            ));
+        }
+
+        Ok(Self {
+            descs,
+            qps: Vec::new(),
+        })
+    }
+
+    /// Saves the trace in the format read by `load`
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the file can't be written.
+    pub fn save<P: AsRef<Path>>(&self, path: P) -> io::Result<()> {
+        fs::write(path, self.descs.concat())
+    }
+
+    /// Returns the number of reports, a report takes one or two descriptors
+    pub fn num_reports(&self) -> usize {
+        reports(&self.descs).count()
+    }
+
+    /// Decodes every report of the trace as the meta report queues do, without the queues,
+    /// returns the number of reports
+    pub fn decode_all(&self) -> usize {
+        let mut num = 0;
+        for (start, len) in reports(&self.descs) {
+            let next = (len == 2).then(|| self.descs[start + 1]);
+            let _meta = hint::black_box(ReportMeta::decode(self.descs[start], next));
+            num += 1;
+        }
+        num
+    }
+
+    /// Reports each packet of a write of `num_packets` packets, the last one carrying an
+    /// immediate if `with_imm` is set
+    pub fn write(&mut self, qp: usize, num_packets: u32, with_imm: bool) {
+        let (qpn, seq) = self.start_message(qp, num_packets);
+        for i in 0..num_packets {
+            self.header(qpn, seq, num_packets, i, with_imm, false);
+        }
+    }
+
+    /// Reports the first and the last packet of a write of `num_packets` packets, the middle
+    /// packets are acknowledged by the local hardware in ACK bitmaps
+    pub fn write_acked(&mut self, qp: usize, num_packets: u32, with_imm: bool) {
+        let (qpn, seq) = self.start_message(qp, num_packets);
+        self.header(qpn, seq, num_packets, 0, with_imm, false);
+        let mut psn = 1;
+        while psn + 1 < num_packets {
+            let num = (num_packets - 1 - psn).min(WINDOW);
+            self.ack(qpn, seq.psn + psn, bitmap(num));
+            psn += num;
+        }
+        if num_packets > 1 {
+            self.header(qpn, seq, num_packets, num_packets - 1, with_imm, false);
+        }
+    }
+
+    /// Reports a write of `num_packets` packets of which every `loss_interval`th packet is
+    /// lost.
+    ///
+    /// For each window of 128 PSNs, the received packets are reported, then a NAK of the local
+    /// hardware with the bitmap of the received packets, then the retransmitted packets.
+    pub fn write_lossy(&mut self, qp: usize, num_packets: u32, with_imm: bool, loss_interval: u32) {
+        let (qpn, seq) = self.start_message(qp, num_packets);
+        let loss_interval = loss_interval.max(1);
+        let mut start = 0;
+        while start < num_packets {
+            let num = (num_packets - start).min(WINDOW);
+            let lost = |i: u32| (start + i + 1) % loss_interval == 0;
+            let mut received = 0u128;
+            for i in (0..num).filter(|&i| !lost(i)) {
+                self.header(qpn, seq, num_packets, start + i, with_imm, false);
+                received |= 1 << i;
+            }
+            self.nak(qpn, seq.msn, seq.psn + start, received);
+            for i in (0..num).filter(|&i| lost(i)) {
+                self.header(qpn, seq, num_packets, start + i, with_imm, true);
+            }
+            start += num;
+        }
+    }
+
+    /// Reports a read request of `len` bytes, a read request takes a single PSN
+    pub fn read_request(&mut self, qp: usize, len: u32) {
+        let (qpn, seq) = self.start_message(qp, 1);
+        let mut first = MetaReportQueuePacketBasicInfoDesc::deserialize([0; 32]);
+        first.set_msn(seq.msn);
+        first.set_psn(seq.psn);
+        first.set_ack_req(true);
+        first.set_dqpn(qpn);
+        first.set_total_len(len);
+        first.set_raddr(RADDR);
+        first.set_rkey(1);
+        let mut next = MetaReportQueueReadReqExtendInfoDesc::deserialize([0; 32]);
+        next.set_total_len(len);
+        next.set_laddr(LADDR);
+        next.set_lkey(1);
+        self.descs
+            .push(header(first.serialize(), OPCODE_READ_REQUEST, true));
+        self.descs
+            .push(header(next.serialize(), OPCODE_READ_REQUEST, false));
+    }
+
+    /// Returns the QPN and the sequence state of the message, advances the state of the QP
+    #[allow(clippy::as_conversions, clippy::cast_possible_truncation)]
+    pub(super) fn start_message(&mut self, qp: usize, num_packets: u32) -> (u32, QpSeq) {
+        if self.qps.is_empty() {
+            self.qps.push(QpSeq::default());
+        }
+        let index = qp % self.qps.len();
+        let qpn = ((index + 1) as u32) << QPN_KEY_PART_WIDTH;
+        let Some(seq) = self.qps.get_mut(index) else {
+            unreachable!("index is below the number of QPs");
+        };
+        let current = *seq;
+        seq.psn = (seq.psn + num_packets.max(1)) & PSN_MASK;
+        seq.msn = seq.msn.wrapping_add(1);
+        (qpn, current)
+    }
+
+    /// Reports the header of the packet `index` of a write
+    pub(super) fn header(
+        &mut self,
+        qpn: u32,
+        seq: QpSeq,
+        num_packets: u32,
+        index: u32,
+        with_imm: bool,
+        is_retry: bool,
+    ) {
+        let is_last = index + 1 == num_packets;
+        let op_code = match (index == 0, is_last, with_imm) {
+            (true, true, false) => OPCODE_WRITE_ONLY,
+            (true, true, true) => OPCODE_WRITE_ONLY_WITH_IMM,
+            (true, false, _) => OPCODE_WRITE_FIRST,
+            (false, false, _) => OPCODE_WRITE_MIDDLE,
+            (false, true, false) => OPCODE_WRITE_LAST,
+            (false, true, true) => OPCODE_WRITE_LAST_WITH_IMM,
+        };
+        let mut desc = MetaReportQueuePacketBasicInfoDesc::deserialize([0; 32]);
+        desc.set_msn(seq.msn);
+        desc.set_psn((seq.psn + index) & PSN_MASK);
+        desc.set_ack_req(is_last);
+        desc.set_is_retry(is_retry);
+        desc.set_dqpn(qpn);
+        desc.set_total_len(num_packets * PMTU);
+        desc.set_raddr(RADDR + u64::from(index * PMTU));
+        desc.set_rkey(1);
+        desc.set_imm_data(u32::from(seq.msn));
+        self.descs.push(header(desc.serialize(), op_code, false));
+    }
+
+    /// Reports an ACK window of the local hardware
+    fn ack(&mut self, qpn: u32, psn: u32, bitmap: u128) {
+        let mut desc = MetaReportQueueAckDesc::deserialize([0; 32]);
+        desc.set_is_send_by_local_hw(true);
+        desc.set_psn_now((psn + LOCAL_HW_PSN_OFFSET) & PSN_MASK);
+        desc.set_qpn(qpn);
+        desc.set_now_bitmap(bitmap);
+        self.descs
+            .push(header(desc.serialize(), OPCODE_ACKNOWLEDGE, false));
+    }
+
+    /// Reports a NAK of the local hardware for the window starting at `psn`
+    pub(super) fn nak(&mut self, qpn: u32, msn: u16, psn: u32, bitmap: u128) {
+        let psn = (psn + LOCAL_HW_PSN_OFFSET) & PSN_MASK;
+        let mut first = MetaReportQueueAckDesc::deserialize([0; 32]);
+        first.set_is_send_by_local_hw(true);
+        first.set_is_packet_lost(true);
+        first.set_psn_before_slide(psn);
+        first.set_psn_now(psn);
+        first.set_qpn(qpn);
+        first.set_msn(msn);
+        first.set_now_bitmap(bitmap);
+        let mut next = MetaReportQueueAckExtraDesc::deserialize([0; 32]);
+        next.set_pre_bitmap(bitmap);
+        self.descs
+            .push(header(first.serialize(), OPCODE_ACKNOWLEDGE, true));
+        self.descs
+            .push(header(next.serialize(), OPCODE_ACKNOWLEDGE, false));
+    }
+}
+
+/// Returns a bitmap of the first `num` PSNs of a window
+fn bitmap(num: u32) -> u128 {
+    u128::MAX.checked_shr(WINDOW - num).unwrap_or(0)
+}
+
+/// Sets the common header of a descriptor
+fn header(mut desc: [u8; 32], op_code: u8, has_next: bool) -> [u8; 32] {
+    desc[30] = op_code;
+    desc[31] = VALID | if has_next { HAS_NEXT } else { 0 };
+    desc
+}
+
+fn has_next(desc: &[u8; 32]) -> bool {
+    desc[31] & HAS_NEXT != 0
+}
+
+/// Returns the start index and the number of descriptors of each report
+fn reports(descs: &[[u8; 32]]) -> impl Iterator<Item = (usize, usize)> + '_ {
+    let mut pos = 0;
+    iter::from_fn(move || {
+        let len = if has_next(descs.get(pos)?) { 2 } else { 1 };
+        let start = pos;
+        pos += len;
+        Some((start, len))
+    })
+}
+
+/// Returns the QPN of a report
+fn report_qpn(desc: &[u8; 32]) -> u32 {
+    if desc[30] <= OPCODE_READ_RESPONSE_ONLY {
+        MetaReportQueuePacketBasicInfoDesc::deserialize(*desc).dqpn()
+    } else {
+        MetaReportQueueAckDesc::deserialize(*desc).qpn()
+    }
+}
+
+/// Returns the QPN and the receive side PSN of a report, or `None` if the report belongs to
+/// the send side
+fn recv_psn(desc: &[u8; 32]) -> Option<(u32, u32, bool)> {
+    if desc[30] <= OPCODE_READ_RESPONSE_ONLY {
+        let d = MetaReportQueuePacketBasicInfoDesc::deserialize(*desc);
+        return Some((d.dqpn(), d.psn(), true));
+    }
+    let d = MetaReportQueueAckDesc::deserialize(*desc);
+    d.is_send_by_local_hw().then(|| {
+        // The window of a NAK starts at the PSN before the slide
+        let psn = if has_next(desc) {
+            d.psn_before_slide()
+        } else {
+            d.psn_now()
+        };
+        (
+            d.qpn(),
+            psn.wrapping_sub(LOCAL_HW_PSN_OFFSET) & PSN_MASK,
+            false,
+        )
+    })
+}
+
+/// Adds `offset` to the receive side PSNs of a report
+fn rebase(desc: &mut [u8; 32], offset: u32) {
+    if desc[30] <= OPCODE_READ_RESPONSE_ONLY {
+        let mut d = MetaReportQueuePacketBasicInfoDesc::deserialize(*desc);
+        d.set_psn(d.psn().wrapping_add(offset) & PSN_MASK);
+        *desc = d.serialize();
+        return;
+    }
+    let mut d = MetaReportQueueAckDesc::deserialize(*desc);
+    if d.is_send_by_local_hw() {
+        d.set_psn_now(d.psn_now().wrapping_add(offset) & PSN_MASK);
+        d.set_psn_before_slide(d.psn_before_slide().wrapping_add(offset) & PSN_MASK);
+        *desc = d.serialize();
+    }
+}
+
+/// Receive side PSNs of a QP of a trace
+#[derive(Debug, Clone, Copy)]
+struct QpSpan {
+    /// Lowest PSN reported
+    first: u32,
+    /// Number of PSNs up to the last packet reported
+    len: u32,
+    /// First PSN of the next replay
+    next: u32,
+}
+
+/// Drops the frames of the `AckResponder`
+struct DiscardFrames;
+
+impl FrameTx for DiscardFrames {
+    fn send(&mut self, _buf: &[u8]) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+/// Producer side of the meta report queue, written the way the hardware writes it
+struct MetaRing {
+    ptr: *mut [u8; 32],
+    mask: usize,
+    head: usize,
+}
+
+impl MetaRing {
+    /// Writes the reports that fit in the free slots, returns the number of descriptors
+    /// written.
+    ///
+    /// A slot is free once the driver has cleared it. The driver polls the queue on the same
+    /// thread in between fills, so the descriptors need no ordering.
+    #[allow(unsafe_code)]
+    fn fill(&mut self, descs: &[[u8; 32]]) -> usize {
+        let mut written = 0;
+        for (start, len) in reports(descs) {
+            let Some(report) = descs.get(start..start + len) else {
+                break;
+            };
+            let slot = |i: usize| unsafe { self.ptr.add((self.head + i) & self.mask) };
+            if (0..len).any(|i| unsafe { ptr::read_volatile(slot(i)) }[31] & VALID != 0) {
+                break;
+            }
+            for (i, desc) in report.iter().enumerate() {
+                unsafe { ptr::write_volatile(slot(i), *desc) };
+            }
+            self.head += len;
+            written += len;
+        }
+        written
+    }
+}
+
+/// Replays a meta report trace through a `MetaWorker` fused with its `CompletionWorker`.
+///
+/// The trace is written to the meta report queue of a loopback device, the worker is polled on
+/// the calling thread until the queue is drained and the completions it produced are popped
+/// from the CQ shared by all QPs. Each replay rebases the receive side PSNs of every QP after
+/// the last PSN of the previous replay, so a trace may be replayed any number of times. The
+/// PSNs of a QP must not wrap within a trace.
+pub struct BenchMetaReplay {
+    worker: MetaWorker<LoopbackDevice>,
+    ring: MetaRing,
+    cq: CompletionQueue,
+    retransmit_rx: TaskRx<PacketRetransmitTask>,
+    rdma_write_rx: TaskRx<RdmaWriteTask>,
+    timeout_rx: TaskRx<AckTimeoutTask>,
+    trace: Vec<[u8; 32]>,
+    spans: HashMap<u32, QpSpan>,
+    /// Rebased descriptors of the next replay
+    staged: Vec<[u8; 32]>,
+}
+
+impl BenchMetaReplay {
+    /// Creates the pipeline with the QPs reported by `trace`
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the meta report queue can't be allocated.
+    pub fn new(trace: &BenchMetaTrace) -> io::Result<Self> {
+        let mut spans: HashMap<u32, QpSpan> = HashMap::new();
+        let mut qpns = HashSet::new();
+        for desc in reports(&trace.descs).filter_map(|(start, _)| trace.descs.get(start)) {
+            let _ignore = qpns.insert(report_qpn(desc));
+            let Some((qpn, psn, is_packet)) = recv_psn(desc) else {
+                continue;
+            };
+            let end = if is_packet { psn + 1 } else { psn };
+            let span = spans.entry(qpn).or_insert(QpSpan {
+                first: psn,
+                len: 0,
+                next: 0,
+            });
+            let last = span.first + span.len;
+            span.first = span.first.min(psn);
+            span.len = last.max(end) - span.first;
+        }
+
+        let qp_table = QpTableSeqLock::new();
+        for qpn in qpns {
+            let _ignore = qp_table.map_qp_mut(qpn, |attr: &mut QpAttr| {
+                attr.qp_type = ibverbs_sys::ibv_qp_type::IBV_QPT_RC as u8;
+                attr.qpn = qpn;
+                attr.dqpn = qpn;
+                attr.ip = 0x0a00_0001;
+                attr.dqp_ip = 0x0a00_0002;
+                attr.send_cq = Some(0);
+                attr.recv_cq = Some(0);
+            });
+        }
+
+        let (ack_tx, ack_rx) = task_channel();
+        let (retransmit_tx, retransmit_rx) = task_channel();
+        let (completion_tx, completion_rx) = task_channel();
+        let (rdma_write_tx, rdma_write_rx) = task_channel();
+        let (timeout_tx, timeout_rx) = task_channel();
+        let (producer, cq) =
+            completion_queue(0, MAX_CQE).unwrap_or_else(|| unreachable!("MAX_CQE fits in a CQ"));
+        completion_tx.send(CompletionTask::CreateCq { producer });
+        let counters = Arc::new(DeviceCounters::new(MAX_QP_CNT));
+        let completion = CompletionWorker::new(
+            AsyncEventQueue::new(),
+            qp_table.clone(),
+            ack_tx.clone(),
+            timeout_tx,
+            rdma_write_tx.clone(),
+            Arc::clone(&counters),
+            0,
+        );
+        let ack_responder = AckResponder::new(
+            qp_table,
+            Box::new(DiscardFrames),
+            AckCoalesceConfig::default(),
+        );
+        let fused = FusedWorkers::new(completion, completion_rx, ack_responder, ack_rx);
+        let handler = MetaHandler::new(
+            ack_tx,
+            Arc::new(QpActivity::new()),
+            retransmit_tx,
+            completion_tx,
+            rdma_write_tx,
+            Arc::new(RateControl::new(&CongestionConfig::default())),
+            counters,
+            false,
+            false,
+            Atomics::new(),
+            PendingPulls::default(),
+            DEFAULT_PSN_WINDOW,
+        );
+
+        let buf = MockDmaBufAllocator.alloc(RING_BUF_LEN * 32)?;
+        let ring = MetaRing {
+            ptr: buf.buf.ptr.cast(),
+            mask: RING_BUF_LEN - 1,
+            head: 0,
+        };
+        let queue = MetaReportQueue::new(DescRingBuffer::with_depth(buf.buf, RING_BUF_LEN));
+        let proxy = build_meta_report_queue_proxies(
+            LoopbackDevice::new(RING_BUF_LEN),
+            Mode::Mode100G.channel_ids(),
+        )
+        .into_iter()
+        .next()
+        .unwrap_or_else(|| unreachable!("a mode has at least one channel"));
+        let inner = MetaReportQueueHandler::new(vec![MetaReportQueueCtx::new(queue, proxy)]);
+        let worker = MetaWorker::new(inner, handler, Some(fused));
+
+        Ok(Self {
+            worker,
+            ring,
+            cq,
+            retransmit_rx,
+            rdma_write_rx,
+            timeout_rx,
+            trace: trace.descs.clone(),
+            spans,
+            staged: Vec::with_capacity(trace.descs.len()),
+        })
+    }
+
+    /// Rebases the trace for the next replay
+    pub fn prepare(&mut self) {
+        self.staged.clone_from(&self.trace);
+        let mut offsets = HashMap::with_capacity(self.spans.len());
+        for (&qpn, span) in &mut self.spans {
+            let _ignore = offsets.insert(qpn, span.next.wrapping_sub(span.first));
+            span.next = (span.next + span.len) & PSN_MASK;
+        }
+        for (start, _) in reports(&self.trace) {
+            let Some(desc) = self.staged.get_mut(start) else {
+                continue;
+            };
+            if let Some(&offset) = recv_psn(desc).and_then(|(qpn, _, _)| offsets.get(&qpn)) {
+                rebase(desc, offset);
+            }
+        }
+    }
+
+    /// Replays the prepared trace, returns the number of completions produced
+    pub fn replay(&mut self) -> usize {
+        let mut pos = 0;
+        let mut num_cqe = 0;
+        loop {
+            pos += self.ring.fill(self.staged.get(pos..).unwrap_or_default());
+            let mut idle = true;
+            while let Some(meta) = self.worker.poll() {
+                self.worker.process(meta);
+                idle = false;
+            }
+            num_cqe += self.drain();
+            if idle && pos >= self.staged.len() {
+                return num_cqe;
+            }
+        }
+    }
+
+    /// Pops the completions and drops the tasks for the other workers
+    fn drain(&mut self) -> usize {
+        while self.retransmit_rx.try_recv().is_some() {}
+        while self.rdma_write_rx.try_recv().is_some() {}
+        while self.timeout_rx.try_recv().is_some() {}
+        iter::from_fn(|| self.cq.pop_front()).count()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn replay_completes_each_write_with_imm() {
+        let num_qps = 4;
+        let mut trace = BenchMetaTrace::new(num_qps);
+        for qp in 0..num_qps {
+            trace.write(qp, 1, true);
+            trace.write(qp, 3, false);
+            trace.write_acked(qp, 200, true);
+            trace.read_request(qp, 4096);
+            trace.write_lossy(qp, 150, true, 7);
+        }
+        let mut replay = BenchMetaReplay::new(&trace).unwrap();
+        for _ in 0..3 {
+            replay.prepare();
+            assert_eq!(replay.replay(), 3 * num_qps);
+        }
+    }
+
+    #[test]
+    fn saved_trace_loads_back() {
+        let mut trace = BenchMetaTrace::new(2);
+        trace.write_lossy(1, 10, true, 3);
+        trace.read_request(0, 64);
+        let path = std::env::temp_dir().join("bench_meta_trace_test.bin");
+        trace.save(&path).unwrap();
+        let loaded = BenchMetaTrace::load(&path).unwrap();
+        assert_eq!(loaded.descs, trace.descs);
+        assert_eq!(loaded.num_reports(), 10 + 1 + 1);
+        fs::write(&path, &trace.descs.concat()[..48]).unwrap();
+        assert!(BenchMetaTrace::load(&path).is_err());
+        let _ignore = fs::remove_file(&path);
+    }
+
+    #[test]
+    fn recorded_rings_merge_in_poll_order() {
+        let mut trace = BenchMetaTrace::new(2);
+        trace.write(0, 3, true);
+        trace.read_request(1, 64);
+        trace.write_lossy(1, 4, true, 2);
+        // Spreads the reports over two rings, in the order they were polled in
+        let mut rings: Vec<_> = (0..2)
+            .map(|id| record::RingRecording {
+                name: format!("meta{id}"),
+                to_card: false,
+                dropped: 0,
+                records: Vec::new(),
+            })
+            .collect();
+        for (i, (start, len)) in reports(&trace.descs).enumerate() {
+            for desc in &trace.descs[start..start + len] {
+                rings[i % 2].records.push((i as u64, *desc));
+            }
+        }
+        rings.push(record::RingRecording {
+            name: "send0".into(),
+            to_card: true,
+            dropped: 0,
+            records: vec![(0, [0; 32])],
+        });
+        let path = std::env::temp_dir().join("bench_meta_recording_test.bin");
+        fs::write(&path, record::encode(&rings)).unwrap();
+        let loaded = BenchMetaTrace::load_recording(&path).unwrap();
+        assert_eq!(loaded.descs, trace.descs);
+
+        // A ring that wrapped around is read from its first whole report
+        rings[0].dropped = 1;
+        fs::write(&path, record::encode(&rings)).unwrap();
+        let loaded = BenchMetaTrace::load_recording(&path).unwrap();
+        assert_eq!(loaded.num_reports(), trace.num_reports() - 1);
+        let _ignore = fs::remove_file(&path);
+    }
+}
@@ -12,13 +12,31 @@
     clippy::arithmetic_side_effects
 )]
 
+pub mod ack;
 pub mod descs;
+pub mod meta;
+pub mod send;
+pub mod verbs;
+pub mod wire;
 
-use std::io;
+use std::{io, thread};
 
-use crate::mem::{
-    page::{ContiguousPages, HostPageAllocator, PageAllocator},
-    virt_to_phy::{AddressResolver, PhysAddrResolverLinuxX86},
+use crate::{
+    mem::{
+        page::{ContiguousPages, HostPageAllocator, PageAllocator},
+        virt_to_phy::{AddressResolver, PhysAddrResolverLinuxX86},
+    },
+    rdma_utils::{
+        fragmenter::{Fragmenter, WrChunkFragmenter, WrPacketFragmenter},
+        mtt::PgtAlloc,
+        psn::Psn,
+        psn_tracker::PsnTracker,
+        types::{SendWrBase, SendWrRdma},
+    },
+    workers::{
+        send::{QpParams, WorkReqOpCode},
+        spawner::{spsc_task_channel, task_channel, PollPolicy, SpscRx, SpscTx, TaskRx, TaskTx},
+    },
 };
 
 #[inline]
@@ -42,6 +60,173 @@ pub fn virt_to_phy_bench_range_wrapper(
     resolver.virt_to_phys_range(start_addr as u64, num_pages)
 }
 
+#[inline]
+pub fn virt_to_phy_bench_pages_wrapper(
+    start_addr: *const u8,
+    num_pages: usize,
+    page_size: u64,
+) -> io::Result<Vec<Option<u64>>> {
+    PhysAddrResolverLinuxX86::virt_to_phys_pages(start_addr as u64, num_pages, page_size)
+}
+
+pub struct BenchPgtAlloc(PgtAlloc);
+
+impl BenchPgtAlloc {
+    #[inline]
+    pub fn new() -> Self {
+        Self(PgtAlloc::new())
+    }
+
+    #[inline]
+    pub fn alloc(&mut self, len: usize) -> Option<usize> {
+        self.0.alloc(len)
+    }
+
+    #[inline]
+    pub fn dealloc(&mut self, index: usize, len: usize) -> bool {
+        self.0.dealloc(index, len)
+    }
+
+    #[inline]
+    pub fn fragmentation(&self) -> f64 {
+        self.0.fragmentation()
+    }
+}
+
+/// Tracks acknowledged PSNs the way the meta handler does for each QP
+pub struct BenchPsnTracker(PsnTracker);
+
+impl BenchPsnTracker {
+    #[inline]
+    pub fn new(base_psn: u32) -> Self {
+        Self(PsnTracker::new(Psn(base_psn)))
+    }
+
+    #[inline]
+    pub fn ack_bitmap(&mut self, psn: u32, bitmap: u128) -> Option<u32> {
+        self.0.ack_bitmap(Psn(psn), bitmap).map(Psn::into_inner)
+    }
+
+    #[inline]
+    pub fn ack_one(&mut self, psn: u32) -> Option<u32> {
+        self.0.ack_one(Psn(psn)).map(Psn::into_inner)
+    }
+
+    #[inline]
+    pub fn base_psn(&self) -> u32 {
+        self.0.base_psn().into_inner()
+    }
+}
+
+/// Splits an RDMA write of a QP with a 4096 bytes PMTU the way the `RdmaWriteWorker` does
+pub struct BenchFragmenter {
+    wr: SendWrRdma,
+    qp_params: QpParams,
+}
+
+impl BenchFragmenter {
+    #[inline]
+    pub fn new(laddr: u64, raddr: u64, length: u32) -> Self {
+        let base = SendWrBase::new(0, 0, laddr, length, 1, 0, WorkReqOpCode::RdmaWrite);
+        Self {
+            wr: SendWrRdma::new_from_base(base, raddr, 1),
+            qp_params: QpParams::new(0, 0, 1, 0, 2, 0, ibverbs_sys::IBV_MTU_4096 as u8),
+        }
+    }
+
+    /// Returns the number of segments by walking the fragments
+    #[inline]
+    pub fn count_segments(segment_size: u64, align: u64, addr: u64, length: u64) -> usize {
+        Fragmenter::new(segment_size, align, addr, length)
+            .into_iter()
+            .count()
+    }
+
+    /// Returns the number of segments from the closed form plan
+    #[inline]
+    pub fn plan_segments(segment_size: u64, align: u64, addr: u64, length: u64) -> usize {
+        Fragmenter::new(segment_size, align, addr, length)
+            .plan()
+            .count
+    }
+
+    /// Builds the chunks of the write, returns their number
+    #[inline]
+    pub fn build_chunks(&self, chunk_size: u32) -> usize {
+        WrChunkFragmenter::new(self.wr, self.qp_params, Psn(0), chunk_size)
+            .into_iter()
+            .count()
+    }
+
+    /// Returns the PSN of the last packet by building every packet
+    #[inline]
+    pub fn last_packet_walk(&self) -> Option<u32> {
+        WrPacketFragmenter::new(self.wr, self.qp_params, Psn(0))
+            .into_iter()
+            .last()
+            .map(|x| x.psn.into_inner())
+    }
+
+    /// Returns the PSN of the last packet, the preceding packets are skipped
+    #[inline]
+    pub fn last_packet(&self, num_psn: u32) -> Option<u32> {
+        WrPacketFragmenter::last_packet(self.wr, self.qp_params, Psn(0), Psn(num_psn))
+            .map(|x| x.psn.into_inner())
+    }
+}
+
+/// Sends each task to an echo thread over the MPSC task channel and waits for it to come back
+pub struct BenchMpscHop {
+    tx: TaskTx<u64>,
+    rx: TaskRx<u64>,
+}
+
+impl BenchMpscHop {
+    #[inline]
+    pub fn new() -> Self {
+        let (tx, echo_rx) = task_channel();
+        let (echo_tx, rx) = task_channel();
+        let _handle = thread::spawn(move || {
+            while let Some(task) = echo_rx.recv() {
+                echo_tx.send(task);
+            }
+        });
+        Self { tx, rx }
+    }
+
+    #[inline]
+    pub fn round_trip(&self, task: u64) -> u64 {
+        self.tx.send(task);
+        self.rx.recv().unwrap()
+    }
+}
+
+/// Sends each task to an echo thread over the SPSC task channel and waits for it to come back
+pub struct BenchSpscHop {
+    tx: SpscTx<u64>,
+    rx: SpscRx<u64>,
+}
+
+impl BenchSpscHop {
+    #[inline]
+    pub fn new() -> Self {
+        let (tx, mut echo_rx) = spsc_task_channel(1024, 64, PollPolicy::default());
+        let (mut echo_tx, rx) = spsc_task_channel(1024, 64, PollPolicy::default());
+        let _handle = thread::spawn(move || {
+            while let Some(task) = echo_rx.recv() {
+                echo_tx.send(task);
+            }
+        });
+        Self { tx, rx }
+    }
+
+    #[inline]
+    pub fn round_trip(&mut self, task: u64) -> u64 {
+        self.tx.send(task);
+        self.rx.recv().unwrap()
+    }
+}
+
 #[derive(Debug, Clone, Copy)]
 pub struct BenchDesc {
     inner: [u8; 32],
@@ -0,0 +1,217 @@
+use std::{hint, io, iter, sync::Arc};
+
+use crate::{
+    config::{CongestionConfig, DoorbellConfig},
+    constants::QPN_KEY_PART_WIDTH,
+    counters::DeviceCounters,
+    csr::{loopback::LoopbackDevice, mode::Mode},
+    latency::Stamp,
+    mem::DmaBufAllocator,
+    rdma_utils::{
+        atomic::AtomicOperands,
+        inline::InlineSlots,
+        qp::{num_psn, QpTableSeqLock},
+        types::{QpAttr, SendWrBase, SendWrRdma, SgList},
+    },
+    ringbuf::RING_BUF_LEN,
+    verbs::mock::MockDmaBufAllocator,
+    workers::{
+        completion::CompletionTask,
+        qp_timeout::AckTimeoutTask,
+        rdma::{RdmaWriteTask, RdmaWriteWorker, WrPoster},
+        retransmit::PacketRetransmitTask,
+        send::{self, DirectDoorbell, QpPriorities, RateControl, SendHandle, WorkReqOpCode},
+        spawner::{
+            task_channel, AbortSignal, PollPolicy, SingleThreadTaskWorker, TaskRx, WorkerAffinity,
+        },
+    },
+};
+
+/// Channel configuration of the device
+#[derive(Debug, Clone, Copy)]
+pub enum BenchMode {
+    Mode100G,
+    Mode200G,
+    Mode400G,
+}
+
+impl From<BenchMode> for Mode {
+    fn from(mode: BenchMode) -> Self {
+        match mode {
+            BenchMode::Mode100G => Mode::Mode100G,
+            BenchMode::Mode200G => Mode::Mode200G,
+            BenchMode::Mode400G => Mode::Mode400G,
+        }
+    }
+}
+
+/// The send path from `post_send` to the descriptors rung in the send queues of a loopback
+/// device, which consumes each descriptor as soon as it is rung.
+///
+/// WRs are posted on the calling thread the way the `RdmaWriteWorker` posts them, the chunks
+/// are then written by the `SendWorker`s, or by the calling thread in direct doorbell mode.
+/// Every WR is acknowledged once its descriptors are rung, so the PSN window never fills up.
+pub struct BenchSendPipeline {
+    poster: WrPoster,
+    worker: RdmaWriteWorker,
+    handle: SendHandle,
+    doorbell: DirectDoorbell<LoopbackDevice>,
+    dev: LoopbackDevice,
+    timeout_rx: TaskRx<AckTimeoutTask>,
+    retransmit_rx: TaskRx<PacketRetransmitTask>,
+    completion_rx: TaskRx<CompletionTask>,
+    num_qps: usize,
+    direct: bool,
+    /// Number of descriptors written to the send queues
+    posted: u64,
+    _abort: AbortSignal,
+}
+
+impl BenchSendPipeline {
+    /// Creates the pipeline with `num_qps` connected RC QPs
+    pub fn new(mode: BenchMode, num_qps: usize, direct: bool) -> io::Result<Self> {
+        let mode = Mode::from(mode);
+        let dev = LoopbackDevice::new(RING_BUF_LEN);
+        let bufs = iter::repeat_with(|| MockDmaBufAllocator.alloc(RING_BUF_LEN * 32))
+            .take(mode.num_channel())
+            .collect::<io::Result<_>>()?;
+        let abort = AbortSignal::new();
+        let doorbell_config = DoorbellConfig {
+            // The loopback device consumes the descriptors as soon as they are rung
+            tail_sync_interval_us: 0,
+            ..DoorbellConfig::default()
+        };
+        let rate = RateControl::new(&CongestionConfig::default());
+        let (handle, doorbell) = send::spawn(
+            &dev,
+            bufs,
+            RING_BUF_LEN,
+            mode.channel_ids(),
+            &abort,
+            PollPolicy::default(),
+            doorbell_config,
+            rate.into(),
+            Arc::new(QpPriorities::new()),
+            &Arc::new(DeviceCounters::new(num_qps + 1)),
+            &WorkerAffinity::default(),
+        )?;
+
+        let qp_attr_table = QpTableSeqLock::new();
+        for qpn in (1..=num_qps).map(Self::qpn) {
+            let _ignore = qp_attr_table.map_qp_mut(qpn, |attr: &mut QpAttr| {
+                attr.qp_type = ibverbs_sys::ibv_qp_type::IBV_QPT_RC as u8;
+                attr.qpn = qpn;
+                attr.dqpn = qpn;
+                attr.ip = 0x0a00_0001;
+                attr.dqp_ip = 0x0a00_0002;
+                attr.mac_addr = 0x0a0b_0c0d_0e0f;
+                attr.pmtu = ibverbs_sys::IBV_MTU_4096 as u8;
+                attr.send_cq = Some(0);
+                attr.refresh_send_template();
+            });
+        }
+        let (timeout_tx, timeout_rx) = task_channel();
+        let (retransmit_tx, retransmit_rx) = task_channel();
+        let (completion_tx, completion_rx) = task_channel();
+        let poster = WrPoster::new(
+            qp_attr_table,
+            timeout_tx,
+            retransmit_tx,
+            completion_tx,
+            InlineSlots::new(),
+        );
+        let worker = RdmaWriteWorker::new(poster.clone(), handle.clone());
+
+        Ok(Self {
+            poster,
+            worker,
+            handle,
+            doorbell,
+            dev,
+            timeout_rx,
+            retransmit_rx,
+            completion_rx,
+            num_qps: num_qps.max(1),
+            direct,
+            posted: 0,
+            _abort: abort,
+        })
+    }
+
+    /// Posts a signaled RDMA write of `len` bytes to the QP `qp` modulo the number of QPs,
+    /// returns once its descriptors are rung
+    pub fn write(&mut self, qp: usize, len: u32) {
+        self.post(qp, len);
+        self.complete();
+    }
+
+    /// Posts a signaled RDMA write of `len` bytes to each of the first `num_qps` QPs, returns
+    /// once all descriptors are rung
+    pub fn write_many(&mut self, num_qps: usize, len: u32) {
+        for qp in 0..num_qps.min(self.num_qps) {
+            self.post(qp, len);
+        }
+        self.complete();
+    }
+
+    #[allow(clippy::as_conversions, clippy::cast_possible_truncation)]
+    fn qpn(index: usize) -> u32 {
+        (index as u32) << QPN_KEY_PART_WIDTH
+    }
+
+    fn post(&mut self, qp: usize, len: u32) {
+        const LADDR: u64 = 0x1_0000_0000;
+        const RADDR: u64 = 0x2_0000_0000;
+
+        let qpn = Self::qpn(qp % self.num_qps + 1);
+        let wr = SendWrRdma {
+            base: SendWrBase {
+                wr_id: 0,
+                send_flags: ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0,
+                laddr: LADDR,
+                length: len,
+                lkey: 1,
+                imm_data: 0,
+                opcode: WorkReqOpCode::RdmaWrite,
+                sg_list: SgList::single(LADDR, len, 1),
+                posted: Stamp::now(),
+            },
+            raddr: RADDR,
+            rkey: 1,
+            atomic: AtomicOperands::default(),
+        };
+        let mut chunks = Vec::new();
+        self.poster
+            .post(qpn, wr, |c| chunks.push(c))
+            .expect("failed to post WR");
+        self.posted += 2 * chunks.len() as u64;
+        if self.direct {
+            self.doorbell.submit(qpn, chunks);
+        } else {
+            chunks.into_iter().for_each(|c| self.handle.send(c));
+        }
+    }
+
+    /// Waits for the posted descriptors to be rung and acknowledges the posted WRs
+    fn complete(&mut self) {
+        while self.dev.rung() < self.posted {
+            hint::spin_loop();
+        }
+        while self.timeout_rx.try_recv().is_some() {}
+        while self.completion_rx.try_recv().is_some() {}
+        while let Some(task) = self.retransmit_rx.try_recv() {
+            let PacketRetransmitTask::NewWr { qpn, wr } = task else {
+                continue;
+            };
+            let qp_param = wr.qp_param();
+            let num_psn =
+                num_psn(qp_param.pmtu, wr.wr().raddr, wr.wr().base.length).expect("invalid WR");
+            self.worker
+                .process(RdmaWriteTask::new_ack(qpn, wr.psn() + num_psn));
+            self.worker.process(RdmaWriteTask::new_complete(
+                qpn,
+                qp_param.msn.wrapping_add(1),
+            ));
+        }
+    }
+}
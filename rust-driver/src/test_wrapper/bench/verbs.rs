@@ -0,0 +1,247 @@
+#![allow(unsafe_code)]
+
+use std::{
+    ffi::{c_void, CString},
+    net::Ipv4Addr,
+    ptr,
+};
+
+use ibverbs_sys::{
+    ibv_access_flags, ibv_context, ibv_cq, ibv_mr, ibv_pd, ibv_qp, ibv_qp_attr, ibv_qp_attr_mask,
+    ibv_qp_init_attr, ibv_qp_state, ibv_qp_type, ibv_send_flags, ibv_send_wr, ibv_sge, ibv_wc,
+    ibv_wc_status, ibv_wr_opcode,
+};
+
+use crate::{
+    verbs::{core::BlueRdmaCore, ffi::BlueRdmaDevice},
+    RdmaCtxOps,
+};
+
+/// Completions reaped by one `poll_cq` call
+const POLL_BATCH: usize = 16;
+
+/// A device opened through the `RdmaCtxOps` entry points with a context built the way the
+/// provider builds it, so every verb takes the same path as the verbs of an application
+pub struct BenchVerbsDevice {
+    driver: *mut c_void,
+    device: *mut BlueRdmaDevice,
+    context: *mut ibv_context,
+    pd: *mut ibv_pd,
+}
+
+// SAFETY: the driver data is shared by all threads of the process through the context, the
+// driver synchronizes the verbs itself
+unsafe impl Send for BenchVerbsDevice {}
+unsafe impl Sync for BenchVerbsDevice {}
+
+impl BenchVerbsDevice {
+    /// Opens the device `sysfs_name` of the device selected by the build features
+    #[inline]
+    pub fn open(sysfs_name: &str) -> Option<Self> {
+        BlueRdmaCore::init();
+        let name = CString::new(sysfs_name).ok()?;
+        let driver = BlueRdmaCore::new(name.as_ptr());
+        if driver.is_null() {
+            return None;
+        }
+        let device = Box::into_raw(Box::new(BlueRdmaDevice::new(driver)));
+        // SAFETY: the context is plain data, all zeros is a valid value
+        let mut context: ibv_context = unsafe { std::mem::zeroed() };
+        context.device = device.cast();
+        let context = Box::into_raw(Box::new(context));
+        let pd = BlueRdmaCore::alloc_pd(context);
+        let dev = Self {
+            driver,
+            device,
+            context,
+            pd,
+        };
+        (!pd.is_null()).then_some(dev)
+    }
+
+    /// Creates a pair of connected RC QPs sharing a CQ, the first one writes `len` bytes to
+    /// the second one. The QPs are connected through the address `ip` of the device.
+    #[inline]
+    pub fn loopback(&self, ip: Ipv4Addr, len: u32) -> Option<BenchVerbsLoopback> {
+        let cq = BlueRdmaCore::create_cq(self.context, 1024, ptr::null_mut(), 0);
+        if cq.is_null() {
+            return None;
+        }
+        let mut lp = BenchVerbsLoopback {
+            cq,
+            qps: [ptr::null_mut(); 2],
+            mr: ptr::null_mut(),
+            buf: vec![0; 2 * len as usize],
+            len,
+            wc: vec![unsafe { std::mem::zeroed() }; POLL_BATCH],
+        };
+        for qp in &mut lp.qps {
+            // SAFETY: the attributes are plain data, all zeros is a valid value
+            let mut init_attr: ibv_qp_init_attr = unsafe { std::mem::zeroed() };
+            init_attr.send_cq = cq;
+            init_attr.recv_cq = cq;
+            init_attr.qp_type = ibv_qp_type::IBV_QPT_RC;
+            init_attr.cap.max_send_wr = 1024;
+            init_attr.cap.max_recv_wr = 1024;
+            init_attr.cap.max_send_sge = 1;
+            init_attr.cap.max_recv_sge = 1;
+            *qp = BlueRdmaCore::create_qp(self.pd, &mut init_attr);
+            if qp.is_null() {
+                return None;
+            }
+        }
+        let access = ibv_access_flags::IBV_ACCESS_LOCAL_WRITE.0
+            | ibv_access_flags::IBV_ACCESS_REMOTE_WRITE.0
+            | ibv_access_flags::IBV_ACCESS_REMOTE_READ.0;
+        lp.mr = BlueRdmaCore::reg_mr(
+            self.pd,
+            lp.buf.as_mut_ptr().cast(),
+            lp.buf.len(),
+            lp.buf.as_ptr() as u64,
+            access as i32,
+        );
+        if lp.mr.is_null() {
+            return None;
+        }
+        let [qp, peer] = lp.qps;
+        // SAFETY: both QPs were created above
+        let (qpn, peer_qpn) = unsafe { ((*qp).qp_num, (*peer).qp_num) };
+        (connect(qp, peer_qpn, ip, access) && connect(peer, qpn, ip, access)).then_some(lp)
+    }
+
+    /// Registers the `len` bytes at `addr` for local and remote access
+    #[inline]
+    pub fn reg_mr(&self, addr: *mut c_void, len: usize) -> Option<BenchVerbsMr> {
+        let access = ibv_access_flags::IBV_ACCESS_LOCAL_WRITE.0
+            | ibv_access_flags::IBV_ACCESS_REMOTE_WRITE.0
+            | ibv_access_flags::IBV_ACCESS_REMOTE_READ.0;
+        let mr = BlueRdmaCore::reg_mr(self.pd, addr, len, addr as u64, access as i32);
+        (!mr.is_null()).then_some(BenchVerbsMr { mr })
+    }
+}
+
+/// A registered MR, deregistered when dropped
+pub struct BenchVerbsMr {
+    mr: *mut ibv_mr,
+}
+
+impl BenchVerbsMr {
+    /// Deregisters the MR, returns `false` if the driver failed to
+    #[inline]
+    pub fn dereg(self) -> bool {
+        let mr = self.mr;
+        std::mem::forget(self);
+        BlueRdmaCore::dereg_mr(mr) == 0
+    }
+}
+
+impl Drop for BenchVerbsMr {
+    #[inline]
+    fn drop(&mut self) {
+        let _ignore = BlueRdmaCore::dereg_mr(self.mr);
+    }
+}
+
+impl Drop for BenchVerbsDevice {
+    #[inline]
+    fn drop(&mut self) {
+        let _ignore = BlueRdmaCore::dealloc_pd(self.pd);
+        BlueRdmaCore::free(self.driver);
+        // SAFETY: both were boxed by `open`, the loopbacks borrowed the device
+        drop(unsafe { (Box::from_raw(self.context), Box::from_raw(self.device)) });
+    }
+}
+
+/// Moves `qp` to RTS towards `dest_qpn` at `ip`
+fn connect(qp: *mut ibv_qp, dest_qpn: u32, ip: Ipv4Addr, access: u32) -> bool {
+    // SAFETY: the attributes are plain data, all zeros is a valid value
+    let mut attr: ibv_qp_attr = unsafe { std::mem::zeroed() };
+    attr.qp_state = ibv_qp_state::IBV_QPS_INIT;
+    attr.port_num = 1;
+    attr.qp_access_flags = access;
+    let init_mask = ibv_qp_attr_mask::IBV_QP_STATE.0
+        | ibv_qp_attr_mask::IBV_QP_PKEY_INDEX.0
+        | ibv_qp_attr_mask::IBV_QP_PORT.0
+        | ibv_qp_attr_mask::IBV_QP_ACCESS_FLAGS.0;
+    if BlueRdmaCore::modify_qp(qp, &mut attr, init_mask as i32) != 0 {
+        return false;
+    }
+    attr.qp_state = ibv_qp_state::IBV_QPS_RTS;
+    attr.path_mtu = ibverbs_sys::IBV_MTU_4096;
+    attr.dest_qp_num = dest_qpn;
+    attr.ah_attr.port_num = 1;
+    attr.ah_attr.is_global = 1;
+    // ::ffff:a.b.c.d
+    attr.ah_attr.grh.dgid.raw = ip.to_ipv6_mapped().octets();
+    let rts_mask = ibv_qp_attr_mask::IBV_QP_STATE.0
+        | ibv_qp_attr_mask::IBV_QP_AV.0
+        | ibv_qp_attr_mask::IBV_QP_PATH_MTU.0
+        | ibv_qp_attr_mask::IBV_QP_DEST_QPN.0
+        | ibv_qp_attr_mask::IBV_QP_RQ_PSN.0
+        | ibv_qp_attr_mask::IBV_QP_SQ_PSN.0;
+    BlueRdmaCore::modify_qp(qp, &mut attr, rts_mask as i32) == 0
+}
+
+/// A QP writing to its peer on the same device and the CQ of both, to be driven by a single
+/// thread through `post_send` and `poll_cq`
+pub struct BenchVerbsLoopback {
+    cq: *mut ibv_cq,
+    qps: [*mut ibv_qp; 2],
+    mr: *mut ibv_mr,
+    /// Source of the writes followed by their destination
+    buf: Vec<u8>,
+    len: u32,
+    wc: Vec<ibv_wc>,
+}
+
+// SAFETY: the verbs objects belong to the loopback, the driver synchronizes the verbs
+unsafe impl Send for BenchVerbsLoopback {}
+
+impl BenchVerbsLoopback {
+    /// Posts a signaled write of the whole source to the peer
+    #[inline]
+    pub fn post_write(&mut self, wr_id: u64) -> bool {
+        // SAFETY: the MR was registered by `loopback`
+        let key = unsafe { (*self.mr).lkey };
+        let mut sge = ibv_sge {
+            addr: self.buf.as_ptr() as u64,
+            length: self.len,
+            lkey: key,
+        };
+        // SAFETY: the WR is plain data, all zeros is a valid value
+        let mut wr: ibv_send_wr = unsafe { std::mem::zeroed() };
+        wr.wr_id = wr_id;
+        wr.sg_list = &mut sge;
+        wr.num_sge = 1;
+        wr.opcode = ibv_wr_opcode::IBV_WR_RDMA_WRITE;
+        wr.send_flags = ibv_send_flags::IBV_SEND_SIGNALED.0;
+        wr.wr.rdma.remote_addr = self.buf.as_ptr() as u64 + u64::from(self.len);
+        wr.wr.rdma.rkey = key;
+        let mut bad_wr = ptr::null_mut();
+        BlueRdmaCore::post_send(self.qps[0], &mut wr, &mut bad_wr) == 0
+    }
+
+    /// Reaps the completions of the CQ, returns their number
+    #[inline]
+    pub fn poll(&mut self) -> usize {
+        let num = BlueRdmaCore::poll_cq(self.cq, POLL_BATCH as i32, self.wc.as_mut_ptr());
+        let num = usize::try_from(num).unwrap_or(0);
+        debug_assert!(self.wc[..num]
+            .iter()
+            .all(|wc| wc.status == ibv_wc_status::IBV_WC_SUCCESS));
+        num
+    }
+}
+
+impl Drop for BenchVerbsLoopback {
+    #[inline]
+    fn drop(&mut self) {
+        for qp in self.qps.into_iter().filter(|qp| !qp.is_null()) {
+            let _ignore = BlueRdmaCore::destroy_qp(qp);
+        }
+        if !self.mr.is_null() {
+            let _ignore = BlueRdmaCore::dereg_mr(self.mr);
+        }
+        let _ignore = BlueRdmaCore::destroy_cq(self.cq);
+    }
+}
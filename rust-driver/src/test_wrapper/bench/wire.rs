@@ -0,0 +1,272 @@
+use std::{
+    cmp::Reverse,
+    collections::{BinaryHeap, HashMap},
+};
+
+use rand::{rngs::StdRng, Rng, SeedableRng};
+
+use super::meta::{BenchMetaTrace, QpSeq};
+
+/// Bits of a packet, every packet of a simulated write carries a full PMTU
+const PACKET_BITS: f64 = 4096.0 * 8.0;
+/// Number of PSNs of a NAK bitmap
+const WINDOW: u32 = u128::BITS;
+
+/// Link between the sender and the receiver of a `BenchWire`
+#[derive(Debug, Clone, Copy)]
+pub struct BenchWireConfig {
+    /// One way latency of the link in nanoseconds
+    pub latency_ns: u64,
+    /// Bandwidth of the link in Gbit/s
+    pub gbps: f64,
+    /// Probability of a packet to be lost
+    pub loss: f64,
+    /// Probability of a packet to be held for `reorder_delay_ns`, the packets behind it
+    /// overtake it
+    pub reorder: f64,
+    pub reorder_delay_ns: u64,
+    /// Seed of the losses and of the reordering, the same seed gives the same trace
+    pub seed: u64,
+}
+
+impl Default for BenchWireConfig {
+    fn default() -> Self {
+        Self {
+            latency_ns: 1_000,
+            gbps: 100.0,
+            loss: 0.0,
+            reorder: 0.0,
+            reorder_delay_ns: 2_000,
+            seed: 0,
+        }
+    }
+}
+
+/// Counts of a simulated run
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct BenchWireStats {
+    /// Packets put on the link, including the retransmissions
+    pub packets: u64,
+    pub lost: u64,
+    pub reordered: u64,
+    pub retransmitted: u64,
+    /// NAKs reported by the receiver, one per lost packet
+    pub naks: u64,
+    /// Simulated time of the last report in nanoseconds
+    pub duration_ns: u64,
+}
+
+/// A packet of a simulated write
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+struct Packet {
+    qpn: u32,
+    /// First PSN and MSN of the write
+    psn: u32,
+    msn: u16,
+    num_packets: u32,
+    index: u32,
+    with_imm: bool,
+    is_retry: bool,
+}
+
+impl Packet {
+    fn seq(self) -> QpSeq {
+        QpSeq {
+            psn: self.psn,
+            msn: self.msn,
+        }
+    }
+
+    fn psn(self) -> u32 {
+        self.psn + self.index
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+enum WireEvent {
+    /// The packet reaches the receiver
+    Arrive(Packet),
+    /// The receiver finds the packet missing and NAKs its window
+    Missing(Packet),
+    /// The NAK of the packet reaches the sender
+    Resend(Packet),
+}
+
+/// Writes sent over a simulated link, turned into the meta reports of their receiver.
+///
+/// The writes are queued on the link in the order they are given and serialized at its
+/// bandwidth. A lost packet is found missing by the receiver one packet time after it was
+/// due, which reports a NAK of the local hardware for its window with the PSNs received so
+/// far. The sender resends the packet once the NAK reaches it, ahead of the queued writes. The
+/// reports are raised in the order of the simulated time, so a trace of any number of QPs and
+/// messages is built deterministically, without a device, and replayed through the real
+/// `MetaWorker` and `CompletionWorker` by `BenchMetaReplay`.
+pub struct BenchWire {
+    config: BenchWireConfig,
+    rng: StdRng,
+    trace: BenchMetaTrace,
+    /// Events by time, then by the order they were scheduled in
+    events: BinaryHeap<Reverse<(u64, u64, WireEvent)>>,
+    next_order: u64,
+    /// Serialization time of a packet in nanoseconds
+    packet_ns: u64,
+    /// Time the link is free for the next queued packet
+    link_free: u64,
+    /// Received PSNs of each window of each QP, by QPN and first PSN of the window
+    windows: HashMap<(u32, u32), u128>,
+    stats: BenchWireStats,
+}
+
+impl BenchWire {
+    /// Creates a link carrying the writes of `num_qps` QPs
+    pub fn new(num_qps: usize, config: BenchWireConfig) -> Self {
+        let config = BenchWireConfig {
+            loss: config.loss.clamp(0.0, 1.0),
+            reorder: config.reorder.clamp(0.0, 1.0),
+            ..config
+        };
+        Self {
+            rng: StdRng::seed_from_u64(config.seed),
+            trace: BenchMetaTrace::new(num_qps),
+            events: BinaryHeap::new(),
+            next_order: 0,
+            packet_ns: ((PACKET_BITS / config.gbps.max(f64::MIN_POSITIVE)) as u64).max(1),
+            link_free: 0,
+            windows: HashMap::new(),
+            stats: BenchWireStats::default(),
+            config,
+        }
+    }
+
+    /// Queues a write of `num_packets` packets on the link, the last one carrying an immediate
+    /// if `with_imm` is set
+    pub fn write(&mut self, qp: usize, num_packets: u32, with_imm: bool) {
+        let num_packets = num_packets.max(1);
+        let (qpn, seq) = self.trace.start_message(qp, num_packets);
+        for index in 0..num_packets {
+            self.link_free += self.packet_ns;
+            let packet = Packet {
+                qpn,
+                psn: seq.psn,
+                msn: seq.msn,
+                num_packets,
+                index,
+                with_imm,
+                is_retry: false,
+            };
+            self.transmit(packet, self.link_free);
+        }
+    }
+
+    /// Runs the link until every packet is received, returns the reports of the receiver
+    pub fn finish(mut self) -> (BenchMetaTrace, BenchWireStats) {
+        while let Some(Reverse((time, _, event))) = self.events.pop() {
+            self.stats.duration_ns = time;
+            match event {
+                WireEvent::Arrive(packet) => {
+                    let psn = packet.psn();
+                    *self
+                        .windows
+                        .entry((packet.qpn, psn & !(WINDOW - 1)))
+                        .or_default() |= 1 << (psn % WINDOW);
+                    self.trace.header(
+                        packet.qpn,
+                        packet.seq(),
+                        packet.num_packets,
+                        packet.index,
+                        packet.with_imm,
+                        packet.is_retry,
+                    );
+                }
+                WireEvent::Missing(packet) => {
+                    let base = packet.psn() & !(WINDOW - 1);
+                    let received = self.windows.get(&(packet.qpn, base)).copied().unwrap_or(0);
+                    self.trace.nak(packet.qpn, packet.msn, base, received);
+                    self.stats.naks += 1;
+                    self.schedule(time + self.config.latency_ns, WireEvent::Resend(packet));
+                }
+                WireEvent::Resend(packet) => {
+                    self.stats.retransmitted += 1;
+                    let packet = Packet {
+                        is_retry: true,
+                        ..packet
+                    };
+                    self.transmit(packet, time + self.packet_ns);
+                }
+            }
+        }
+        (self.trace, self.stats)
+    }
+
+    /// Puts a packet on the link, its last bit leaves at `sent`
+    fn transmit(&mut self, packet: Packet, sent: u64) {
+        self.stats.packets += 1;
+        let arrival = sent + self.config.latency_ns;
+        if self.rng.gen_bool(self.config.loss) {
+            self.stats.lost += 1;
+            self.schedule(arrival + self.packet_ns, WireEvent::Missing(packet));
+            return;
+        }
+        let delay = if self.rng.gen_bool(self.config.reorder) {
+            self.stats.reordered += 1;
+            self.config.reorder_delay_ns
+        } else {
+            0
+        };
+        self.schedule(arrival + delay, WireEvent::Arrive(packet));
+    }
+
+    fn schedule(&mut self, time: u64, event: WireEvent) {
+        self.events.push(Reverse((time, self.next_order, event)));
+        self.next_order += 1;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_wrapper::bench::meta::BenchMetaReplay;
+
+    fn run(config: BenchWireConfig) -> (BenchMetaTrace, BenchWireStats) {
+        let num_qps = 16;
+        let mut wire = BenchWire::new(num_qps, config);
+        for i in 0..256 {
+            wire.write(i % num_qps, 1 + (i as u32 % 5), true);
+        }
+        wire.finish()
+    }
+
+    #[test]
+    fn lossless_wire_serializes_the_packets() {
+        let (trace, stats) = run(BenchWireConfig::default());
+        let packets: u64 = (0..256).map(|i| 1 + (i % 5)).sum();
+        assert_eq!(stats.packets, packets);
+        assert_eq!(trace.num_reports() as u64, packets);
+        assert_eq!((stats.lost, stats.naks, stats.retransmitted), (0, 0, 0));
+        // 100 Gbit/s puts a 4096 bytes packet on the link every 327 ns
+        assert_eq!(stats.duration_ns, packets * 327 + 1_000);
+    }
+
+    #[test]
+    fn lossy_wire_is_deterministic_and_completes_every_write() {
+        let config = BenchWireConfig {
+            loss: 0.05,
+            reorder: 0.1,
+            seed: 7,
+            ..BenchWireConfig::default()
+        };
+        let (trace, stats) = run(config);
+        assert!(stats.lost > 0 && stats.reordered > 0);
+        assert_eq!(stats.naks, stats.lost);
+        assert_eq!(stats.retransmitted, stats.lost);
+        let (again, again_stats) = run(config);
+        assert_eq!(again.descs, trace.descs);
+        assert_eq!(again_stats, stats);
+
+        let mut replay = BenchMetaReplay::new(&trace).unwrap();
+        for _ in 0..2 {
+            replay.prepare();
+            assert_eq!(replay.replay(), 256);
+        }
+    }
+}
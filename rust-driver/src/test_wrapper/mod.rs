@@ -24,7 +24,7 @@ use crate::{
     descriptors::{SendQueueReqDescSeg0, SendQueueReqDescSeg1},
     net::config::{MacAddress, NetworkConfig},
     rdma_utils::psn::Psn,
-    ringbuf::{DescRingBufAllocator, DescRingBuffer},
+    ringbuf::{DescRingBufAllocator, DescRingBuffer, RING_BUF_LEN},
     verbs::dev::{EmulatedHwDevice, HwDevice},
     workers::send::{ChunkPos, QpParams, SendQueue, SendQueueDesc, WorkReqOpCode, WrChunkBuilder},
 };
@@ -34,9 +34,13 @@ pub fn test_full_rb() -> io::Result<()> {
     let adaptor = device.new_adaptor().unwrap();
     let mut allocator = device.new_dma_buf_allocator().unwrap();
     let mut rb_allocator = DescRingBufAllocator::new(allocator);
-    let cmd_controller =
-        CommandConfigurator::init(&adaptor, rb_allocator.alloc()?, rb_allocator.alloc()?)
-            .unwrap();
+    let cmd_controller = CommandConfigurator::init(
+        &adaptor,
+        rb_allocator.alloc()?,
+        rb_allocator.alloc()?,
+        RING_BUF_LEN,
+    )
+    .unwrap();
     let network_config = NetworkConfig {
         ip: Ipv4Network::new("10.0.0.2".parse().unwrap(), 24).unwrap(),
         peer_ip: "10.0.0.1".parse().unwrap(),
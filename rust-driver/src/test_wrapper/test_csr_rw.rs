@@ -5,7 +5,7 @@ use ipnetwork::Ipv4Network;
 use crate::{
     mem::{sim_alloc, DmaBufAllocator, PageWithPhysAddr},
     net::config::{MacAddress, NetworkConfig},
-    ringbuf::DescRingBufAllocator,
+    ringbuf::{DescRingBufAllocator, RING_BUF_LEN},
     verbs::dev::{EmulatedHwDevice, HwDevice, PciHwDevice},
 };
 
@@ -32,9 +32,13 @@ impl TestDevice {
         let adaptor = device.new_adaptor().unwrap();
         let mut allocator = device.new_dma_buf_allocator().unwrap();
         let mut rb_allocator = DescRingBufAllocator::new(allocator);
-        let cmd_controller =
-            CommandConfigurator::init(&adaptor, rb_allocator.alloc()?, rb_allocator.alloc()?)
-                .unwrap();
+        let cmd_controller = CommandConfigurator::init(
+            &adaptor,
+            rb_allocator.alloc()?,
+            rb_allocator.alloc()?,
+            RING_BUF_LEN,
+        )
+        .unwrap();
         let network_config = NetworkConfig {
             ip: Ipv4Network::new("10.0.0.2".parse().unwrap(), 24).unwrap(),
             peer_ip: "10.0.0.1".parse().unwrap(),
@@ -62,9 +66,13 @@ impl TestDevice {
         let adaptor = device.new_adaptor().unwrap();
         let mut allocator = device.new_dma_buf_allocator().unwrap();
         let mut rb_allocator = DescRingBufAllocator::new(allocator);
-        let cmd_controller =
-            CommandConfigurator::init(&adaptor, rb_allocator.alloc()?, rb_allocator.alloc()?)
-                .unwrap();
+        let cmd_controller = CommandConfigurator::init(
+            &adaptor,
+            rb_allocator.alloc()?,
+            rb_allocator.alloc()?,
+            RING_BUF_LEN,
+        )
+        .unwrap();
         let network_config = NetworkConfig {
             ip: Ipv4Network::new("10.0.0.2".parse().unwrap(), 24).unwrap(),
             peer_ip: "10.0.0.1".parse().unwrap(),
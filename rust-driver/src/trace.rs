@@ -0,0 +1,222 @@
+//! Tracing of the hot paths into an in-memory ring.
+//!
+//! `hot_trace!` records a static message and up to three integers, it compiles to nothing
+//! unless the `trace_ring` feature is enabled. With the feature, each call site has its own
+//! enable flag, resolved once against `BLUE_RDMA_TRACE` and read with a single load
+//! afterwards. Records are written to a ring of the process instead of stderr, so that
+//! threads tracing concurrently never serialize on a lock, and are read by `dump`.
+
+#[cfg(feature = "trace_ring")]
+use std::fmt::Write;
+
+/// Environment variable selecting the traced sites, a comma separated list of module path
+/// prefixes, or `all`
+#[cfg(feature = "trace_ring")]
+const TRACE_ENV: &str = "BLUE_RDMA_TRACE";
+
+/// Number of records of the ring, the oldest records are overwritten
+#[cfg(feature = "trace_ring")]
+const RING_RECORDS: usize = 1 << 16;
+
+/// A call site of `hot_trace!`
+#[derive(Debug)]
+pub(crate) struct TraceSite {
+    /// Module path of the site
+    pub(crate) module: &'static str,
+    /// Line of the site
+    pub(crate) line: u32,
+    /// Message of the site
+    pub(crate) msg: &'static str,
+    /// Index of the site in the site table, 0 if not resolved yet and `u32::MAX` if the site
+    /// is disabled
+    #[cfg(feature = "trace_ring")]
+    pub(crate) state: std::sync::atomic::AtomicU32,
+}
+
+/// Records `msg` and up to three integer arguments of the hot path.
+///
+/// Compiles to nothing but borrows of the arguments unless the `trace_ring` feature is
+/// enabled.
+macro_rules! hot_trace {
+    ($msg:literal $(, $arg:expr)* $(,)?) => {{
+        #[cfg(feature = "trace_ring")]
+        {
+            static SITE: $crate::trace::TraceSite = $crate::trace::TraceSite {
+                module: module_path!(),
+                line: line!(),
+                msg: $msg,
+                state: std::sync::atomic::AtomicU32::new(0),
+            };
+            $crate::trace::record(&SITE, &[$(u64::from($arg)),*]);
+        }
+        #[cfg(not(feature = "trace_ring"))]
+        {
+            let _ignore = ($(&$arg,)*);
+        }
+    }};
+}
+
+pub(crate) use hot_trace;
+
+/// Writes the record at `site`, if the site is enabled
+#[cfg(feature = "trace_ring")]
+#[inline]
+pub(crate) fn record(site: &'static TraceSite, args: &[u64]) {
+    ring::record(site, args);
+}
+
+/// Returns the traced records, oldest first, as `<ns> <module>:<line> <msg> <args..>` lines.
+/// Empty unless the `trace_ring` feature is enabled.
+#[cfg(feature = "trace_ring")]
+#[must_use]
+pub fn dump() -> String {
+    let mut out = String::new();
+    ring::for_each(|ns, site, args| {
+        let _ignore = write!(out, "{ns} {}:{} {}", site.module, site.line, site.msg);
+        for arg in args {
+            let _ignore = write!(out, " {arg:#x}");
+        }
+        out.push('\n');
+    });
+    out
+}
+
+/// Returns the traced records, always empty as the `trace_ring` feature is disabled
+#[cfg(not(feature = "trace_ring"))]
+#[must_use]
+pub fn dump() -> String {
+    String::new()
+}
+
+/// The ring of the process and the table of its sites
+#[cfg(feature = "trace_ring")]
+mod ring {
+    use std::{
+        iter,
+        sync::{
+            atomic::{AtomicU64, AtomicUsize, Ordering},
+            OnceLock,
+        },
+    };
+
+    use parking_lot::Mutex;
+
+    use super::{TraceSite, RING_RECORDS, TRACE_ENV};
+    use crate::workers::completion::device_clock_ns;
+
+    /// Number of arguments of a record
+    const NUM_ARGS: usize = 3;
+    /// Words of a record: the sequence, the time, the site and the arguments
+    const RECORD_WORDS: usize = 3 + NUM_ARGS;
+
+    /// Words of all records
+    static RECORDS: OnceLock<Box<[AtomicU64]>> = OnceLock::new();
+    /// Sequence of the next record
+    static NEXT: AtomicUsize = AtomicUsize::new(0);
+    /// Enabled sites, indexed by their state minus one
+    static SITES: Mutex<Vec<&'static TraceSite>> = Mutex::new(Vec::new());
+    /// Module path prefixes of `TRACE_ENV`
+    static FILTER: OnceLock<Vec<String>> = OnceLock::new();
+
+    /// Resolves the enable flag of a site, taken once per site
+    #[cold]
+    fn resolve(site: &'static TraceSite) -> u32 {
+        let filter = FILTER.get_or_init(|| {
+            std::env::var(TRACE_ENV)
+                .map(|x| x.split(',').map(str::to_owned).collect())
+                .unwrap_or_default()
+        });
+        let enabled = filter
+            .iter()
+            .any(|prefix| prefix == "all" || site.module.starts_with(prefix.as_str()));
+        let mut sites = SITES.lock();
+        // Another thread may have resolved the site meanwhile
+        let state = site.state.load(Ordering::Relaxed);
+        if state != 0 {
+            return state;
+        }
+        let state = if enabled {
+            sites.push(site);
+            u32::try_from(sites.len()).unwrap_or(u32::MAX)
+        } else {
+            u32::MAX
+        };
+        site.state.store(state, Ordering::Relaxed);
+        state
+    }
+
+    #[inline]
+    pub(super) fn record(site: &'static TraceSite, args: &[u64]) {
+        let mut state = site.state.load(Ordering::Relaxed);
+        if state == 0 {
+            state = resolve(site);
+        }
+        if state == u32::MAX {
+            return;
+        }
+        let records = RECORDS.get_or_init(|| {
+            iter::repeat_with(|| AtomicU64::new(0))
+                .take(RING_RECORDS * RECORD_WORDS)
+                .collect()
+        });
+        let seq = NEXT.fetch_add(1, Ordering::Relaxed);
+        let start = (seq % RING_RECORDS) * RECORD_WORDS;
+        let Some(words) = records.get(start..start + RECORD_WORDS) else {
+            return;
+        };
+        let mut values = [0, device_clock_ns(), u64::from(state), 0, 0, 0];
+        for (value, arg) in values.iter_mut().skip(3).zip(args) {
+            *value = *arg;
+        }
+        for (word, value) in words.iter().zip(values).skip(1) {
+            word.store(value, Ordering::Relaxed);
+        }
+        // The sequence is written last, a record is only dumped if it is complete
+        if let Some(word) = words.first() {
+            word.store(seq as u64 + 1, Ordering::Release);
+        }
+    }
+
+    pub(super) fn for_each<F: FnMut(u64, &TraceSite, &[u64])>(mut f: F) {
+        let Some(records) = RECORDS.get() else {
+            return;
+        };
+        let sites = SITES.lock().clone();
+        let end = NEXT.load(Ordering::Acquire);
+        for seq in end.saturating_sub(RING_RECORDS)..end {
+            let start = (seq % RING_RECORDS) * RECORD_WORDS;
+            let Some(words) = records.get(start..start + RECORD_WORDS) else {
+                continue;
+            };
+            let mut values = [0; RECORD_WORDS];
+            for (value, word) in values.iter_mut().zip(words) {
+                *value = word.load(Ordering::Acquire);
+            }
+            let [record_seq, ns, site, args @ ..] = values;
+            // Skips records being written or already overwritten
+            if record_seq != seq as u64 + 1 {
+                continue;
+            }
+            let site = usize::try_from(site).unwrap_or(usize::MAX);
+            if let Some(site) = site.checked_sub(1).and_then(|x| sites.get(x)) {
+                f(ns, site, &args);
+            }
+        }
+    }
+}
+
+#[cfg(all(test, feature = "trace_ring"))]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn enabled_sites_are_dumped() {
+        std::env::set_var(TRACE_ENV, "blue_rdma_driver::trace");
+        for i in 0..3u32 {
+            hot_trace!("traced", i, 7u32);
+        }
+        let dump = dump();
+        assert_eq!(dump.lines().filter(|x| x.contains(" traced 0x")).count(), 3);
+        assert!(dump.contains(" traced 0x2 0x7\n"));
+    }
+}
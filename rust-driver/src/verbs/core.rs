@@ -1,32 +1,56 @@
 use std::ptr::NonNull;
-use std::{io, net::Ipv4Addr, ptr};
+use std::{
+    io,
+    net::{Ipv4Addr, Ipv6Addr},
+    path::Path,
+    ptr,
+};
 
 use ipnetwork::{IpNetwork, Ipv4Network};
 use log::{error, info, debug};
+use parking_lot::RwLock;
 
 use crate::constants::{
-    POST_RECV_TCP_LOOP_BACK_CLIENT_ADDRESS, POST_RECV_TCP_LOOP_BACK_SERVER_ADDRESS,
-    TEST_CARD_IP_ADDRESS,
+    DEVICE_ID, DM_ARENA_SIZE, MAX_INLINE_DATA, POST_RECV_TCP_LOOP_BACK_CLIENT_ADDRESS,
+    POST_RECV_TCP_LOOP_BACK_SERVER_ADDRESS, TEST_CARD_IP_ADDRESS, VENDER_ID,
 };
 use crate::csr::emulated::EmulatedDevice;
-use crate::rdma_utils::types::ibv_qp_attr::{IbvQpAttr, IbvQpInitAttr};
-use crate::rdma_utils::types::{RecvWr, SendWr};
+use crate::net::raw::{raw_send_wr, FlowSpec};
+use crate::net::ud::UdSendWr;
+use crate::net::xrc::XrcSendWr;
+use crate::rdma_utils::mw::MwWr;
+use crate::rdma_utils::types::ibv_qp_attr::{ah_attr_ipv4, IbvQpAttr, IbvQpInitAttr};
+use crate::rdma_utils::types::{RecvWr, SendWr, Sge};
 use crate::RdmaCtxOps;
+use crate::RdmaError;
 use crate::{
     config::{ConfigLoader, DeviceConfig},
     mem::{
         page::EmulatedPageAllocator, sim_alloc, virt_to_phy::PhysAddrResolverEmulated,
-        EmulatedUmemHandler,
+        EmulatedUmemHandler, PAGE_SIZE,
     },
     net::config::{MacAddress, NetworkConfig},
-    workers::{completion::Completion, qp_timeout::AckTimeoutConfig},
+    rdma_utils::snapshot::StateSnapshot,
+    startup::StartupTimings,
+    workers::{
+        completion::{device_clock_ns, DEVICE_CLOCK_KHZ},
+        qp_timeout::AckTimeoutConfig,
+    },
 };
 
-use super::dev::{EmulatedHwDevice, PciHwDevice};
-use super::ffi::get_device;
+use super::cq_ex::BlueCqEx;
+use super::dev::{parse_index, EmulatedHwDevice, PciHwDevice};
+use super::dm::BlueDm;
+use super::ffi::{
+    get_device, get_device_shared, park_resident, post_send_batch, register_mr, take_resident,
+    DeviceCtx, DeviceLock,
+};
+use super::pd::BluePd;
+use super::qp_ex::BlueQpEx;
 use super::{
     ctx::{HwDeviceCtx, VerbsOps},
     mock::MockDeviceCtx,
+    partition::ClaimedPartition,
 };
 
 use crate::error::Result;
@@ -54,60 +78,325 @@ impl BlueRdmaCore {
         assert!(env_logger::try_init().is_err(), "global logger init failed");
     }
 
+    /// Creates the verbs context of the device selected by the build features
+    #[allow(clippy::let_and_return)]
+    pub(super) fn new_ctx(sysfs_name: &str) -> Result<DeviceCtx> {
+        #[cfg(feature = "hw")]
+        let ctx = Self::new_hw(sysfs_name);
+        #[cfg(feature = "sim")]
+        let ctx = Self::new_emulated(sysfs_name);
+        #[cfg(feature = "mock")]
+        let ctx = Self::new_mock(sysfs_name);
+        ctx
+    }
+
     #[allow(clippy::unwrap_used, clippy::unwrap_in_result)]
     fn new_hw(sysfs_name: &str) -> Result<HwDeviceCtx<PciHwDevice>> {
         Self::check_logger_inited();
+        let mut timings = StartupTimings::start();
         debug!("before load default");
         let config = ConfigLoader::load_default()?;
-        debug!("before open default");
-        let device = PciHwDevice::open_default()?;
-        
-        debug!("before reset device");
-        device.reset()?;
-        
+        timings.phase("config");
+        let index = PciHwDevice::device_index(sysfs_name)?;
+        timings.phase("pci_enumerate");
+        debug!("before open device {index}");
+        let mut device = PciHwDevice::open(index)?;
+        device.set_write_combining(config.doorbell().write_combining);
+        if config.vfio_iommu() {
+            device.enable_vfio_iommu()?;
+        }
+        if config.kernel_pin() {
+            device.enable_kernel_pin()?;
+        }
+        let secondary = match config.bond().secondary {
+            Some(secondary) if secondary == index => {
+                return Err(RdmaError::InvalidInput(format!(
+                    "device {index} can't be bonded with itself"
+                )));
+            }
+            Some(secondary) => {
+                let mut device = PciHwDevice::open(secondary)?;
+                device.set_write_combining(config.doorbell().write_combining);
+                if config.vfio_iommu() {
+                    device.enable_vfio_iommu()?;
+                }
+                if config.kernel_pin() {
+                    device.enable_kernel_pin()?;
+                }
+                Some(device)
+            }
+            None => None,
+        };
+        timings.phase("pci_open");
+        let partition = ClaimedPartition::claim(config.partition(), sysfs_name)?;
+        timings.phase("partition");
+        let snapshot = config
+            .snapshot_dir()
+            .map(|dir| {
+                StateSnapshot::open(
+                    Path::new(dir),
+                    sysfs_name,
+                    partition.partition().index(),
+                    config.max_qp(),
+                )
+            })
+            .transpose()?;
+        // The QPs a previous owner of the share left on the card are reattached, not reset
+        let restoring = snapshot.as_ref().is_some_and(|x| !x.qps().is_empty());
+        timings.phase("snapshot");
+
+        // Contexts opened while other processes own shares of the device must not reset it
+        if partition.is_sole_opener() && !restoring {
+            debug!("before reset device");
+            device.reset()?;
+            if let Some(secondary) = secondary.as_ref() {
+                secondary.reset()?;
+            }
+            timings.phase("reset");
+        }
+
         #[cfg(feature = "debug_csrs")]
         device.set_custom()?;
 
         debug!("before initialize HwDeviceCtx");
-        let mut ctx = HwDeviceCtx::initialize(device, config)?;
+        let mut ctx =
+            HwDeviceCtx::initialize(device, secondary, config, partition, snapshot, timings)?;
         Ok(ctx)
     }
 
     #[allow(clippy::unwrap_used, clippy::unwrap_in_result)]
     fn new_emulated(sysfs_name: &str) -> Result<HwDeviceCtx<EmulatedHwDevice>> {
-        let device = match sysfs_name {
-            "uverbs0" => {
-                sim_alloc::init_global_allocator(0, &HEAP_ALLOCATOR);
-                EmulatedHwDevice::new("127.0.0.1:7701".into())
-            }
-            "uverbs1" => {
-                sim_alloc::init_global_allocator(1, &HEAP_ALLOCATOR);
-                EmulatedHwDevice::new("127.0.0.1:7702".into())
-            }
-            _ => unreachable!("unexpected sysfs_name"),
-        };
-        let (post_recv_ip, post_recv_peer_ip) = match sysfs_name {
-            "uverbs0" => (
+        let index = parse_index(sysfs_name, "uverbs")
+            .filter(|&index| index < sim_alloc::NUM_EMULATED_DEVICES)
+            .ok_or_else(|| RdmaError::InvalidInput(format!("no emulated device {sysfs_name}")))?;
+        sim_alloc::init_global_allocator(index, &HEAP_ALLOCATOR);
+        let device = EmulatedHwDevice::new(format!("127.0.0.1:{}", 7701 + index));
+        // The emulated devices are paired over the loopback, the even one is the client
+        let (post_recv_ip, post_recv_peer_ip) = if index % 2 == 0 {
+            (
                 POST_RECV_TCP_LOOP_BACK_CLIENT_ADDRESS,
                 POST_RECV_TCP_LOOP_BACK_SERVER_ADDRESS,
-            ),
-            "uverbs1" => (
+            )
+        } else {
+            (
                 POST_RECV_TCP_LOOP_BACK_SERVER_ADDRESS,
                 POST_RECV_TCP_LOOP_BACK_CLIENT_ADDRESS,
-            ),
-            _ => unreachable!("unexpected sysfs_name"),
+            )
         };
 
         let ack = AckTimeoutConfig::new(16, 40, 2);
-        let config = DeviceConfig { ack };
+        let config = DeviceConfig {
+            ack,
+            ..Default::default()
+        };
         // (check_duration, local_ack_timeout) : (256ms, 1s) because emulator is slow
-        HwDeviceCtx::initialize(device, config)
+        HwDeviceCtx::initialize(
+            device,
+            None,
+            config,
+            ClaimedPartition::unclaimed(),
+            None,
+            StartupTimings::start(),
+        )
     }
 
     #[allow(clippy::unnecessary_wraps)]
     fn new_mock(sysfs_name: &str) -> Result<MockDeviceCtx> {
         Ok(MockDeviceCtx::default())
     }
+
+    /// Delivers the CQ events of a new CQ to `channel`, if any.
+    ///
+    /// Destroys the CQ and returns `false` on failure.
+    #[allow(unsafe_code)]
+    fn bind_comp_channel(
+        bluerdma: &mut DeviceCtx,
+        handle: u32,
+        channel: *mut ibverbs_sys::ibv_comp_channel,
+        cq_cookie: u64,
+    ) -> bool {
+        let Some(channel) = (unsafe { channel.as_ref() }) else {
+            return true;
+        };
+        if let Err(err) = bluerdma.bind_comp_channel(handle, channel.fd, cq_cookie) {
+            error!("Failed to bind CQ {handle} to completion channel: {err}");
+            let _ignore = bluerdma.destroy_cq(handle);
+            return false;
+        }
+        true
+    }
+
+    /// Copies `dump` to `buf` truncated and NUL terminated like `snprintf`, returns the
+    /// length of the whole dump
+    #[allow(unsafe_code)]
+    fn copy_dump(dump: &str, buf: *mut std::ffi::c_char, len: usize) -> ::std::os::raw::c_int {
+        if !buf.is_null() && len > 0 {
+            let copied = dump.len().min(len - 1);
+            unsafe {
+                ptr::copy_nonoverlapping(dump.as_ptr().cast(), buf, copied);
+                *buf.add(copied) = 0;
+            }
+        }
+        dump.len().try_into().unwrap_or(i32::MAX)
+    }
+
+    /// Allocates the `ibv_qp` handed to the application for the QP `qpn`.
+    ///
+    /// The QPs of a parent domain with an allocator are extended QPs placed by that allocator,
+    /// `destroy_qp` frees them through it.
+    #[allow(unsafe_code)]
+    fn alloc_qp(
+        context: *mut ibverbs_sys::ibv_context,
+        pd: *mut ibverbs_sys::ibv_pd,
+        init_attr: &ibverbs_sys::ibv_qp_init_attr,
+        qpn: u32,
+    ) -> Result<*mut ibverbs_sys::ibv_qp> {
+        let qp = ibverbs_sys::ibv_qp {
+            context,
+            qp_context: ptr::null_mut(),
+            pd,
+            send_cq: ptr::null_mut(),
+            recv_cq: ptr::null_mut(),
+            srq: init_attr.srq,
+            handle: 0,
+            qp_num: qpn,
+            state: ibverbs_sys::ibv_qp_state::IBV_QPS_INIT,
+            qp_type: init_attr.qp_type,
+            mutex: ibverbs_sys::pthread_mutex_t::default(),
+            cond: ibverbs_sys::pthread_cond_t::default(),
+            events_completed: 0,
+        };
+        // SAFETY: the PDs handed to the application are allocated as `BluePd`
+        match unsafe { BluePd::get(pd) }.and_then(|x| x.allocator()) {
+            Some(allocator) => BlueQpEx::alloc(qp, Some(allocator)),
+            None => Ok(Box::into_raw(Box::new(qp))),
+        }
+    }
+
+    /// Attaches the new QP `qpn` to the thread domain of its parent domain, the QP is
+    /// destroyed if it cannot be attached
+    #[allow(unsafe_code)]
+    fn attach_td(bluerdma: &mut DeviceCtx, pd: *mut ibverbs_sys::ibv_pd, qpn: u32) -> Result<()> {
+        // SAFETY: the PDs handed to the application are allocated as `BluePd`
+        let Some(td) = unsafe { BluePd::get(pd) }.and_then(|x| x.td()) else {
+            return Ok(());
+        };
+        bluerdma.attach_td(qpn, td).inspect_err(|_err| {
+            let _ignore = bluerdma.destroy_qp(qpn);
+        })
+    }
+
+    /// Parses the chain of send WRs starting at `wr` and posts it with `post`.
+    ///
+    /// Returns the first WR that was not posted along with the error, all WRs before it have
+    /// been posted.
+    #[allow(unsafe_code)]
+    fn post_send_chain<T>(
+        wr: *mut ibverbs_sys::ibv_send_wr,
+        parse: impl Fn(ibverbs_sys::ibv_send_wr) -> Result<T>,
+        post: impl FnOnce(&[T]) -> std::result::Result<(), (usize, RdmaError)>,
+    ) -> Option<(*mut ibverbs_sys::ibv_send_wr, RdmaError)> {
+        let mut wrs = Vec::new();
+        let mut wr_ptrs = Vec::new();
+        let mut invalid = None;
+        let mut current = wr;
+        while let Some(ibv_wr) = unsafe { current.as_ref() } {
+            match parse(*ibv_wr) {
+                Ok(x) => {
+                    wrs.push(x);
+                    wr_ptrs.push(current);
+                }
+                Err(err) => {
+                    invalid = Some((current, err));
+                    break;
+                }
+            }
+            current = ibv_wr.next;
+        }
+
+        // all WRs before the invalid one are posted
+        match (post(&wrs), invalid) {
+            (Err((index, err)), _) => Some((wr_ptrs.get(index).copied().unwrap_or(wr), err)),
+            (Ok(()), invalid) => invalid,
+        }
+    }
+
+    /// Posts a chain of send WRs to a QP of the device.
+    ///
+    /// The memory window operations, rejected by `SendWr::new`, end a batch. They are
+    /// executed by the driver once the WRs before them are posted, and the chain resumes
+    /// after them.
+    #[allow(unsafe_code)]
+    fn post_send_rc(
+        context: *mut ibverbs_sys::ibv_context,
+        qpn: u32,
+        wr: *mut ibverbs_sys::ibv_send_wr,
+    ) -> Option<(*mut ibverbs_sys::ibv_send_wr, RdmaError)> {
+        let mut current = wr;
+        loop {
+            let (failed, err) = Self::post_send_chain(current, SendWr::new, |wrs| {
+                post_send_batch(context, qpn, wrs)
+            })?;
+            let ibv_wr = unsafe { failed.as_ref() }
+                .filter(|x| MwWr::is_mw_opcode(x.opcode))
+                .copied();
+            let Some(ibv_wr) = ibv_wr else {
+                return Some((failed, err));
+            };
+            if let Err(err) = MwWr::new(ibv_wr).and_then(|x| get_device(context).post_mw(qpn, x)) {
+                return Some((failed, err));
+            }
+            if ibv_wr.next.is_null() {
+                return None;
+            }
+            current = ibv_wr.next;
+        }
+    }
+
+    /// Returns the IPv4 multicast group of a multicast GID, `::ffff:a.b.c.d`
+    #[allow(unsafe_code)]
+    fn mcast_group(gid: *const ibverbs_sys::ibv_gid) -> Option<Ipv4Addr> {
+        // SAFETY: the GID is a plain union, every variant is valid
+        let raw = unsafe { gid.as_ref()?.raw };
+        Ipv6Addr::from(raw)
+            .to_ipv4_mapped()
+            .filter(Ipv4Addr::is_multicast)
+    }
+
+    /// Returns the handle of a XRC domain opened by `open_xrcd`
+    #[allow(unsafe_code)]
+    fn xrcd_handle(xrcd: *mut ibverbs_sys::ibv_xrcd) -> Option<u32> {
+        // SAFETY: the XRCDs handed to the application are allocated as `BlueXrcd`
+        unsafe { xrcd.cast::<BlueXrcd>().as_ref() }.map(|x| x.handle)
+    }
+
+    /// Returns the handle of a thread domain allocated by `alloc_td`
+    #[allow(unsafe_code)]
+    fn td_handle(td: *mut ibverbs_sys::ibv_td) -> Option<u32> {
+        // SAFETY: the TDs handed to the application are allocated as `BlueTd`
+        unsafe { td.cast::<BlueTd>().as_ref() }.map(|x| x.handle)
+    }
+}
+
+/// A XRC domain, laid out as the rdma-core `verbs_xrcd`
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct BlueXrcd {
+    /// Must stay the first field, the consumer only sees a pointer to it
+    xrcd: ibverbs_sys::ibv_xrcd,
+    /// `comp_mask` of `verbs_xrcd`
+    #[allow(dead_code)]
+    comp_mask: u32,
+    handle: u32,
+}
+
+/// A thread domain
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct BlueTd {
+    /// Must stay the first field, the consumer only sees a pointer to it
+    td: ibverbs_sys::ibv_td,
+    handle: u32,
 }
 
 #[allow(unsafe_code)]
@@ -125,15 +414,14 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
                 .into_owned()
         };
 
+        if let Some(driver_data) = take_resident() {
+            debug!("reuse resident ctx for {name}");
+            return driver_data.as_ptr().cast();
+        }
+
         debug!("before create hardware ctx");
-        let ctx = BlueRdmaCore::new_hw(&name);
-        #[cfg(feature = "sim")]
-        let ctx = BlueRdmaCore::new_emulated(&name);
-        #[cfg(feature = "mock")]
-        let ctx = BlueRdmaCore::new_mock(&name);
-        
-        match ctx {
-            Ok(x) => Box::into_raw(Box::new(x)).cast(),
+        match BlueRdmaCore::new_ctx(&name) {
+            Ok(x) => Box::into_raw(Box::new(RwLock::new(x))).cast(),
             Err(err) => {
                 error!("Failed to initialize hw context: {err}");
                 ptr::null_mut()
@@ -143,26 +431,31 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
 
     #[inline]
     fn free(driver_data: *const std::ffi::c_void) {
-        if driver_data.is_null() {
+        let Some(driver_data) = NonNull::new(driver_data as *mut DeviceLock) else {
             error!("Failed to free driver data");
-        } else {
-            unsafe {
-                drop(Box::from_raw(
-                    driver_data as *mut HwDeviceCtx<EmulatedHwDevice>,
-                ));
+            return;
+        };
+        // SAFETY: the driver data was created by `new` and the device is closed
+        let reusable = unsafe { driver_data.as_ref() }.read().is_reusable();
+        let driver_data = if reusable {
+            match park_resident(driver_data) {
+                Ok(()) => return,
+                Err(driver_data) => driver_data,
             }
+        } else {
+            driver_data
+        };
+        unsafe {
+            drop(Box::from_raw(driver_data.as_ptr()));
         }
     }
 
     #[inline]
     fn alloc_pd(blue_context: *mut ibverbs_sys::ibv_context) -> *mut ibverbs_sys::ibv_pd {
-        let bluerdma = get_device(blue_context);
+        let mut bluerdma = get_device(blue_context);
 
         match bluerdma.alloc_pd() {
-            Ok(handle) => Box::into_raw(Box::new(ibverbs_sys::ibv_pd {
-                context: blue_context,
-                handle,
-            })),
+            Ok(handle) => BluePd::alloc(blue_context, handle),
             Err(err) => {
                 error!("Failed to alloc PD: {err}");
                 ptr::null_mut()
@@ -172,11 +465,23 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
 
     #[inline]
     fn dealloc_pd(pd: *mut ibverbs_sys::ibv_pd) -> ::std::os::raw::c_int {
+        let pd_ptr = pd;
+        let Some(blue_pd) = (unsafe { BluePd::get(pd_ptr) }) else {
+            return libc::EINVAL;
+        };
+        // A parent domain only refers to the handle of its protection domain
+        if blue_pd.is_parent() {
+            unsafe { BluePd::free(pd_ptr) };
+            return 0;
+        }
         let pd = deref_or_ret!(pd, libc::EINVAL);
-        let bluerdma = get_device(pd.context);
+        let mut bluerdma = get_device(pd.context);
 
         match bluerdma.dealloc_pd(pd.handle) {
-            Ok(()) => 0,
+            Ok(()) => {
+                unsafe { BluePd::free(pd_ptr) };
+                0
+            }
             Err(err) => {
                 error!("failed to dealloc PD");
                 err.to_errno()
@@ -184,26 +489,161 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
         }
     }
 
+    #[inline]
+    fn create_ah(
+        pd: *mut ibverbs_sys::ibv_pd,
+        attr: *mut ibverbs_sys::ibv_ah_attr,
+    ) -> *mut ibverbs_sys::ibv_ah {
+        let context = deref_or_ret!(pd, ptr::null_mut()).context;
+        let attr = deref_or_ret!(attr, ptr::null_mut());
+        let Some(dest) = ah_attr_ipv4(&attr) else {
+            error!("Failed to create AH: the destination GID is not an IPv4 address");
+            return ptr::null_mut();
+        };
+        match get_device(context).create_ah(dest) {
+            Ok(handle) => Box::into_raw(Box::new(ibverbs_sys::ibv_ah {
+                context,
+                pd,
+                handle,
+            })),
+            Err(err) => {
+                error!("Failed to create AH: {err}");
+                ptr::null_mut()
+            }
+        }
+    }
+
+    #[inline]
+    fn destroy_ah(ah: *mut ibverbs_sys::ibv_ah) -> ::std::os::raw::c_int {
+        let ibv_ah = deref_or_ret!(ah, libc::EINVAL);
+        if let Err(err) = get_device(ibv_ah.context).destroy_ah(ibv_ah.handle) {
+            error!("Failed to destroy AH {}: {err}", ibv_ah.handle);
+            return err.to_errno();
+        }
+        drop(unsafe { Box::from_raw(ah) });
+        0
+    }
+
+    #[inline]
+    fn alloc_mw(
+        pd: *mut ibverbs_sys::ibv_pd,
+        type_: core::ffi::c_uint,
+    ) -> *mut ibverbs_sys::ibv_mw {
+        let pd_deref = deref_or_ret!(pd, ptr::null_mut());
+        let context = pd_deref.context;
+        // Type 1 windows are bound by `ibv_bind_mw` outside of the send queue, which the
+        // device does not order with the WRs
+        if type_ != ibverbs_sys::ibv_mw_type::IBV_MW_TYPE_2 {
+            error!("Failed to alloc MW: only type 2 windows are supported");
+            return ptr::null_mut();
+        }
+        match get_device(context).alloc_mw(pd_deref.handle) {
+            Ok(handle) => Box::into_raw(Box::new(ibverbs_sys::ibv_mw {
+                context,
+                pd,
+                rkey: handle,
+                handle,
+                type_,
+            })),
+            Err(err) => {
+                error!("Failed to alloc MW: {err}");
+                ptr::null_mut()
+            }
+        }
+    }
+
+    #[inline]
+    fn dealloc_mw(mw: *mut ibverbs_sys::ibv_mw) -> ::std::os::raw::c_int {
+        let ibv_mw = deref_or_ret!(mw, libc::EINVAL);
+        if let Err(err) = get_device(ibv_mw.context).dealloc_mw(ibv_mw.handle) {
+            error!("Failed to dealloc MW {}: {err}", ibv_mw.handle);
+            return err.to_errno();
+        }
+        drop(unsafe { Box::from_raw(mw) });
+        0
+    }
+
     #[inline]
     fn query_device_ex(
-        _blue_context: *mut ibverbs_sys::ibv_context,
+        blue_context: *mut ibverbs_sys::ibv_context,
         _input: *const ibverbs_sys::ibv_query_device_ex_input,
         device_attr: *mut ibverbs_sys::ibv_device_attr,
-        _attr_size: usize,
+        attr_size: usize,
     ) -> ::std::os::raw::c_int {
+        let caps = get_device_shared(blue_context).caps();
+        let int = |x: usize| -> i32 { x.try_into().unwrap_or(i32::MAX) };
         unsafe {
             (*device_attr) = ibverbs_sys::ibv_device_attr {
-                max_qp: 256,
-                max_qp_wr: 64,
-                max_sge: 8,
-                max_cq: 256,
-                max_cqe: 4096,
-                max_mr: 256,
-                max_pd: 256,
+                vendor_id: VENDER_ID.into(),
+                vendor_part_id: DEVICE_ID.into(),
+                page_size_cap: PAGE_SIZE as u64,
+                max_qp: int(caps.max_qp),
+                max_qp_wr: int(caps.max_qp_wr),
+                max_sge: int(caps.max_sge),
+                // READs scatter through the same SGE lists as the sends
+                max_sge_rd: int(caps.max_sge),
+                max_cq: int(caps.max_cq),
+                max_cqe: int(caps.max_cqe),
+                max_mr: int(caps.max_mr),
+                max_pd: int(caps.max_pd),
+                max_qp_rd_atom: caps.max_qp_rd_atom.into(),
+                max_qp_init_rd_atom: caps.max_qp_rd_atom.into(),
+                max_res_rd_atom: int(caps.max_qp * usize::from(caps.max_qp_rd_atom)),
+                max_srq: int(caps.max_srq),
+                max_srq_wr: int(caps.max_srq_wr),
+                max_srq_sge: int(caps.max_sge),
                 phys_port_cnt: 1,
+                // Atomics are executed by the driver of the responder, atomic with each other
+                // but not with the other accesses of the device
+                atomic_cap: ibverbs_sys::ibv_atomic_cap::IBV_ATOMIC_HCA,
+                // The windows take their keys from the MR table
+                max_mw: int(caps.max_mr),
+                device_cap_flags: ibverbs_sys::ibv_device_cap_flags::IBV_DEVICE_MEM_WINDOW_TYPE_2B
+                    .0,
                 ..Default::default()
             };
         }
+        // The clock of the completion timestamps, for consumers passing an `ibv_device_attr_ex`
+        let clock_end = std::mem::offset_of!(ibverbs_sys::ibv_device_attr_ex, hca_core_clock)
+            + std::mem::size_of::<u64>();
+        if attr_size >= clock_end {
+            let attr_ex = device_attr.cast::<ibverbs_sys::ibv_device_attr_ex>();
+            unsafe {
+                (*attr_ex).completion_timestamp_mask = u64::MAX;
+                (*attr_ex).hca_core_clock = DEVICE_CLOCK_KHZ;
+            }
+        }
+        let dm_end = std::mem::offset_of!(ibverbs_sys::ibv_device_attr_ex, max_dm_size)
+            + std::mem::size_of::<u64>();
+        if attr_size >= dm_end {
+            let attr_ex = device_attr.cast::<ibverbs_sys::ibv_device_attr_ex>();
+            unsafe { (*attr_ex).max_dm_size = DM_ARENA_SIZE as u64 };
+        }
+        0
+    }
+
+    #[inline]
+    fn query_rt_values(
+        _blue_context: *mut ibverbs_sys::ibv_context,
+        values: *mut ibverbs_sys::ibv_values_ex,
+    ) -> ::std::os::raw::c_int {
+        let Some(values) = (unsafe { values.as_mut() }) else {
+            return libc::EINVAL;
+        };
+        let raw_clock = ibverbs_sys::ibv_values_mask::IBV_VALUES_MASK_RAW_CLOCK.0;
+        let requested = values.comp_mask;
+        values.comp_mask = 0;
+        if requested & raw_clock != 0 {
+            // As other providers do, the raw clock is returned in `tv_nsec` only
+            values.raw_clock = ibverbs_sys::timespec {
+                tv_sec: 0,
+                tv_nsec: device_clock_ns().try_into().unwrap_or(i64::MAX),
+            };
+            values.comp_mask = raw_clock;
+        }
+        if requested & !raw_clock != 0 {
+            return libc::EINVAL;
+        }
         0
     }
 
@@ -236,8 +676,12 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
         channel: *mut ibverbs_sys::ibv_comp_channel,
         comp_vector: core::ffi::c_int,
     ) -> *mut ibverbs_sys::ibv_cq {
-        let bluerdma = get_device(blue_context);
-        match bluerdma.create_cq() {
+        let mut bluerdma = get_device(blue_context);
+        let Ok(size) = u32::try_from(cqe) else {
+            error!("Invalid cq size: {cqe}");
+            return ptr::null_mut();
+        };
+        match bluerdma.create_cq(size) {
             Ok(handle) => {
                 let cq = ibverbs_sys::ibv_cq {
                     context: blue_context,
@@ -250,7 +694,12 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
                     comp_events_completed: 0,
                     async_events_completed: 0,
                 };
-                Box::into_raw(Box::new(cq))
+                let cq = Box::into_raw(Box::new(cq));
+                if !Self::bind_comp_channel(&mut *bluerdma, handle, channel, cq as u64) {
+                    drop(unsafe { Box::from_raw(cq) });
+                    return ptr::null_mut();
+                }
+                cq
             }
             Err(err) => {
                 error!("Failed to create cq");
@@ -259,10 +708,42 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
         }
     }
 
+    #[inline]
+    fn create_cq_ex(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        cq_attr: *mut ibverbs_sys::ibv_cq_init_attr_ex,
+    ) -> *mut ibverbs_sys::ibv_cq_ex {
+        let attr = deref_or_ret!(cq_attr, ptr::null_mut());
+        let mut bluerdma = get_device(blue_context);
+        let unsupported = attr.wc_flags & !BlueCqEx::supported_wc_flags();
+        if unsupported != 0 {
+            error!("Failed to create cq: wc_flags {unsupported:#x} are not supported");
+            return ptr::null_mut();
+        }
+        let Ok(cqe) = i32::try_from(attr.cqe) else {
+            error!("Invalid cq size: {}", attr.cqe);
+            return ptr::null_mut();
+        };
+        match bluerdma.create_cq_ex(attr.cqe, BlueCqEx::wants_timestamps(&attr)) {
+            Ok(handle) => {
+                let cq = BlueCqEx::alloc(blue_context, &attr, handle, cqe);
+                if !Self::bind_comp_channel(&mut *bluerdma, handle, attr.channel, cq as u64) {
+                    unsafe { BlueCqEx::free(cq) };
+                    return ptr::null_mut();
+                }
+                cq
+            }
+            Err(err) => {
+                error!("Failed to create cq: {err}");
+                ptr::null_mut()
+            }
+        }
+    }
+
     #[inline]
     fn destroy_cq(cq: *mut ibverbs_sys::ibv_cq) -> ::std::os::raw::c_int {
         let cq = deref_or_ret!(cq, libc::EINVAL);
-        let bluerdma = get_device(cq.context);
+        let mut bluerdma = get_device(cq.context);
 
         match bluerdma.destroy_cq(cq.handle) {
             Ok(()) => 0,
@@ -273,30 +754,208 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
         }
     }
 
+    #[inline]
+    fn resize_cq(cq: *mut ibverbs_sys::ibv_cq, cqe: core::ffi::c_int) -> ::std::os::raw::c_int {
+        let Some(cq) = (unsafe { cq.as_mut() }) else {
+            return libc::EINVAL;
+        };
+        let Ok(size) = u32::try_from(cqe) else {
+            error!("Invalid cq size: {cqe}");
+            return libc::EINVAL;
+        };
+        let mut bluerdma = get_device(cq.context);
+        match bluerdma.resize_cq(cq.handle, size) {
+            Ok(()) => {
+                cq.cqe = cqe;
+                0
+            }
+            Err(err) => {
+                error!("Failed to resize CQ {}: {err}", cq.handle);
+                err.to_errno()
+            }
+        }
+    }
+
     #[inline]
     fn create_qp(
         pd: *mut ibverbs_sys::ibv_pd,
         init_attr: *mut ibverbs_sys::ibv_qp_init_attr,
     ) -> *mut ibverbs_sys::ibv_qp {
         let context = deref_or_ret!(pd, ptr::null_mut()).context;
-        let bluerdma = get_device(context);
+        let mut bluerdma = get_device(context);
+        let attr_ptr = init_attr;
         let init_attr = deref_or_ret!(init_attr, ptr::null_mut());
-        match bluerdma.create_qp(IbvQpInitAttr::new(init_attr)) {
-            Ok(qpn) => Box::into_raw(Box::new(ibverbs_sys::ibv_qp {
-                context,
-                qp_context: ptr::null_mut(),
-                pd,
-                send_cq: ptr::null_mut(),
-                recv_cq: ptr::null_mut(),
-                srq: ptr::null_mut(),
-                handle: 0,
-                qp_num: qpn,
-                state: ibverbs_sys::ibv_qp_state::IBV_QPS_INIT,
-                qp_type: init_attr.qp_type,
-                mutex: ibverbs_sys::pthread_mutex_t::default(),
-                cond: ibverbs_sys::pthread_cond_t::default(),
-                events_completed: 0,
-            })),
+        if init_attr.cap.max_inline_data as usize > MAX_INLINE_DATA {
+            error!(
+                "Failed to create qp: max_inline_data {} exceeds {MAX_INLINE_DATA}",
+                init_attr.cap.max_inline_data
+            );
+            return ptr::null_mut();
+        }
+        let result = bluerdma
+            .create_qp(IbvQpInitAttr::new(init_attr))
+            .and_then(|qpn| Self::attach_td(&mut bluerdma, pd, qpn).map(|()| qpn));
+        match result {
+            Ok(qpn) => {
+                // Reports the supported inline size back to the caller
+                unsafe {
+                    (*attr_ptr).cap.max_inline_data = MAX_INLINE_DATA as u32;
+                }
+                Self::alloc_qp(context, pd, &init_attr, qpn).unwrap_or_else(|err| {
+                    error!("Failed to allocate qp {qpn}: {err}");
+                    let _ignore = bluerdma.destroy_qp(qpn);
+                    ptr::null_mut()
+                })
+            }
+            Err(err) => {
+                error!("Failed to create qp: {err}");
+                ptr::null_mut()
+            }
+        }
+    }
+
+    #[inline]
+    fn create_qps(
+        pd: *mut ibverbs_sys::ibv_pd,
+        init_attrs: *mut ibverbs_sys::ibv_qp_init_attr,
+        num_qps: u32,
+        qps: *mut *mut ibverbs_sys::ibv_qp,
+    ) -> ::std::os::raw::c_int {
+        let context = deref_or_ret!(pd, libc::EINVAL).context;
+        if init_attrs.is_null() || qps.is_null() {
+            return libc::EINVAL;
+        }
+        let init_attrs = unsafe { std::slice::from_raw_parts_mut(init_attrs, num_qps as usize) };
+        if let Some(attr) = init_attrs
+            .iter()
+            .find(|x| x.cap.max_inline_data as usize > MAX_INLINE_DATA)
+        {
+            error!(
+                "Failed to create qps: max_inline_data {} exceeds {MAX_INLINE_DATA}",
+                attr.cap.max_inline_data
+            );
+            return libc::EINVAL;
+        }
+        // The QPs of a parent domain are attached and allocated one at a time
+        if unsafe { BluePd::get(pd) }.is_some_and(|x| x.is_parent()) {
+            let qps = unsafe { std::slice::from_raw_parts_mut(qps, num_qps as usize) };
+            let mut created = 0;
+            for (qp, init_attr) in qps.iter_mut().zip(init_attrs.iter_mut()) {
+                *qp = Self::create_qp(pd, init_attr);
+                if qp.is_null() {
+                    break;
+                }
+                created += 1;
+            }
+            if created == qps.len() {
+                return 0;
+            }
+            for &qp in qps.iter().take(created) {
+                let _ignore = Self::destroy_qp(qp);
+            }
+            return libc::ENOMEM;
+        }
+        let attrs: Vec<_> = init_attrs.iter().map(|&x| IbvQpInitAttr::new(x)).collect();
+        let mut bluerdma = get_device(context);
+        match bluerdma.create_qps(&attrs) {
+            Ok(qpns) => {
+                let qps = unsafe { std::slice::from_raw_parts_mut(qps, num_qps as usize) };
+                for ((qp, init_attr), qpn) in qps.iter_mut().zip(init_attrs).zip(qpns) {
+                    // Reports the supported inline size back to the caller
+                    init_attr.cap.max_inline_data = MAX_INLINE_DATA as u32;
+                    // Only the QPs of a parent domain may fail to allocate
+                    *qp = Self::alloc_qp(context, pd, init_attr, qpn)
+                        .unwrap_or_else(|_err| unreachable!("boxed qp"));
+                }
+                0
+            }
+            Err(err) => {
+                error!("Failed to create qps: {err}");
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn create_qp_ex(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        qp_attr: *mut ibverbs_sys::ibv_qp_init_attr_ex,
+    ) -> *mut ibverbs_sys::ibv_qp {
+        let attr = deref_or_ret!(qp_attr, ptr::null_mut());
+        let mut bluerdma = get_device(blue_context);
+        let supported_mask = ibverbs_sys::ibv_qp_init_attr_mask::IBV_QP_INIT_ATTR_PD
+            | ibverbs_sys::ibv_qp_init_attr_mask::IBV_QP_INIT_ATTR_XRCD
+            | ibverbs_sys::ibv_qp_init_attr_mask::IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+        // A TGT QP belongs to a XRC domain rather than a PD
+        let xrc_target = attr.qp_type == ibverbs_sys::ibv_qp_type::IBV_QPT_XRC_RECV;
+        if attr.comp_mask & !supported_mask.0 != 0 || (attr.pd.is_null() && !xrc_target) {
+            error!(
+                "Failed to create qp: unsupported comp_mask {:#x}",
+                attr.comp_mask
+            );
+            return ptr::null_mut();
+        }
+        let unsupported = attr.send_ops_flags & !BlueQpEx::supported_send_ops();
+        if unsupported != 0 {
+            error!("Failed to create qp: send_ops_flags {unsupported:#x} are not supported");
+            return ptr::null_mut();
+        }
+        if attr.cap.max_inline_data as usize > MAX_INLINE_DATA {
+            error!(
+                "Failed to create qp: max_inline_data {} exceeds {MAX_INLINE_DATA}",
+                attr.cap.max_inline_data
+            );
+            return ptr::null_mut();
+        }
+        let init_attr = ibverbs_sys::ibv_qp_init_attr {
+            qp_context: attr.qp_context,
+            send_cq: attr.send_cq,
+            recv_cq: attr.recv_cq,
+            srq: attr.srq,
+            cap: attr.cap,
+            qp_type: attr.qp_type,
+            sq_sig_all: attr.sq_sig_all,
+        };
+        let result = if xrc_target {
+            let xrcd_mask = ibverbs_sys::ibv_qp_init_attr_mask::IBV_QP_INIT_ATTR_XRCD.0;
+            (attr.comp_mask & xrcd_mask != 0)
+                .then_some(attr.xrcd)
+                .and_then(Self::xrcd_handle)
+                .ok_or(RdmaError::InvalidInput("XRC TGT QPs need a XRCD".into()))
+                .and_then(|xrcd| bluerdma.create_xrc_target(xrcd))
+        } else {
+            bluerdma
+                .create_qp(IbvQpInitAttr::new(init_attr))
+                .and_then(|qpn| Self::attach_td(&mut bluerdma, attr.pd, qpn).map(|()| qpn))
+        };
+        match result {
+            Ok(qpn) => {
+                // Reports the supported inline size back to the caller
+                unsafe {
+                    (*qp_attr).cap.max_inline_data = MAX_INLINE_DATA as u32;
+                }
+                let allocator = unsafe { BluePd::get(attr.pd) }.and_then(|x| x.allocator());
+                let qp = ibverbs_sys::ibv_qp {
+                    context: blue_context,
+                    qp_context: attr.qp_context,
+                    pd: attr.pd,
+                    send_cq: attr.send_cq,
+                    recv_cq: attr.recv_cq,
+                    srq: attr.srq,
+                    handle: 0,
+                    qp_num: qpn,
+                    state: ibverbs_sys::ibv_qp_state::IBV_QPS_INIT,
+                    qp_type: attr.qp_type,
+                    mutex: ibverbs_sys::pthread_mutex_t::default(),
+                    cond: ibverbs_sys::pthread_cond_t::default(),
+                    events_completed: 0,
+                };
+                BlueQpEx::alloc(qp, allocator).unwrap_or_else(|err| {
+                    error!("Failed to allocate qp {qpn}: {err}");
+                    let _ignore = bluerdma.destroy_qp(qpn);
+                    ptr::null_mut()
+                })
+            }
             Err(err) => {
                 error!("Failed to create qp: {err}");
                 ptr::null_mut()
@@ -306,12 +965,19 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
 
     #[inline]
     fn destroy_qp(qp: *mut ibverbs_sys::ibv_qp) -> ::std::os::raw::c_int {
+        let qp_ptr = qp;
         let qp = deref_or_ret!(qp, libc::EINVAL);
         let context = qp.context;
-        let bluerdma = get_device(context);
+        let mut bluerdma = get_device(context);
         let qpn = qp.qp_num;
         match bluerdma.destroy_qp(qpn) {
-            Ok(()) => 0,
+            Ok(()) => {
+                // The QPs of a parent domain with an allocator are extended QPs
+                if unsafe { BluePd::get(qp.pd) }.is_some_and(|x| x.allocator().is_some()) {
+                    unsafe { BlueQpEx::free(qp_ptr) };
+                }
+                0
+            }
             Err(err) => {
                 error!("Failed to destroy QP: {qpn}");
                 err.to_errno()
@@ -329,7 +995,7 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
         let qp = deref_or_ret!(qp, libc::EINVAL);
         let attr = deref_or_ret!(attr, libc::EINVAL);
         let context = qp.context;
-        let bluerdma = get_device(context);
+        let mut bluerdma = get_device(context);
         let mask = attr_mask as u32;
         match bluerdma.update_qp(qp.qp_num, IbvQpAttr::new(attr, attr_mask as u32)) {
             Ok(()) => 0,
@@ -340,6 +1006,89 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
         }
     }
 
+    #[allow(clippy::cast_sign_loss)]
+    #[inline]
+    fn modify_qps(
+        qps: *mut *mut ibverbs_sys::ibv_qp,
+        attrs: *mut ibverbs_sys::ibv_qp_attr,
+        attr_mask: core::ffi::c_int,
+        num_qps: u32,
+        bad_index: *mut u32,
+    ) -> ::std::os::raw::c_int {
+        if qps.is_null() || attrs.is_null() || num_qps == 0 {
+            return libc::EINVAL;
+        }
+        let qps = unsafe { std::slice::from_raw_parts(qps, num_qps as usize) };
+        let attrs = unsafe { std::slice::from_raw_parts(attrs, num_qps as usize) };
+        let mut context = ptr::null_mut();
+        let mut updates = Vec::with_capacity(qps.len());
+        for (&qp, &attr) in qps.iter().zip(attrs) {
+            let qp = deref_or_ret!(qp, libc::EINVAL);
+            // The QPs are modified under a single lock of their device
+            if !context.is_null() && qp.context != context {
+                return libc::EINVAL;
+            }
+            context = qp.context;
+            updates.push((qp.qp_num, IbvQpAttr::new(attr, attr_mask as u32)));
+        }
+        let mut bluerdma = get_device(context);
+        match bluerdma.update_qps(&updates) {
+            Ok(()) => 0,
+            Err((i, err)) => {
+                let qpn = updates.get(i).map_or(0, |x| x.0);
+                error!("Failed to modify QPs: qpn=0x{qpn:x}, err={err:?}");
+                if let Some(bad_index) = unsafe { bad_index.as_mut() } {
+                    *bad_index = u32::try_from(i).unwrap_or_else(|_| unreachable!());
+                }
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn modify_qp_rate_limit(
+        qp: *mut ibverbs_sys::ibv_qp,
+        attr: *mut ibverbs_sys::ibv_qp_rate_limit_attr,
+    ) -> ::std::os::raw::c_int {
+        let qp = deref_or_ret!(qp, libc::EINVAL);
+        let attr = deref_or_ret!(attr, libc::EINVAL);
+        // A burst is only meaningful for a limited QP, the typical packet size is not used as
+        // the QP is paced per chunk
+        if attr.comp_mask != 0 || (attr.rate_limit == 0 && attr.max_burst_sz != 0) {
+            return libc::EINVAL;
+        }
+        let mut bluerdma = get_device(qp.context);
+        match bluerdma.modify_qp_rate_limit(qp.qp_num, attr.rate_limit, attr.max_burst_sz) {
+            Ok(()) => 0,
+            Err(err) => {
+                error!(
+                    "Failed to modify QP rate limit: qpn=0x{:x}, err={err}",
+                    qp.qp_num
+                );
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn modify_qp_chunk_size(
+        qp: *mut ibverbs_sys::ibv_qp,
+        chunk_size: u32,
+    ) -> ::std::os::raw::c_int {
+        let qp = deref_or_ret!(qp, libc::EINVAL);
+        let mut bluerdma = get_device(qp.context);
+        match bluerdma.modify_qp_chunk_size(qp.qp_num, chunk_size) {
+            Ok(()) => 0,
+            Err(err) => {
+                error!(
+                    "Failed to modify QP chunk size: qpn=0x{:x}, err={err}",
+                    qp.qp_num
+                );
+                err.to_errno()
+            }
+        }
+    }
+
     #[inline]
     fn query_qp(
         qp: *mut ibverbs_sys::ibv_qp,
@@ -349,14 +1098,96 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
     ) -> ::std::os::raw::c_int {
         let qp = deref_or_ret!(qp, libc::EINVAL);
         let context = qp.context;
-        let bluerdma = unsafe { get_device(context) };
+        let mut bluerdma = get_device(context);
 
         0
     }
 
-    #[allow(clippy::cast_sign_loss)]
     #[inline]
-    fn reg_mr(
+    fn attach_mcast(
+        qp: *mut ibverbs_sys::ibv_qp,
+        gid: *const ibverbs_sys::ibv_gid,
+        _lid: u16,
+    ) -> ::std::os::raw::c_int {
+        let qp = deref_or_ret!(qp, libc::EINVAL);
+        let Some(group) = Self::mcast_group(gid) else {
+            error!(
+                "Failed to attach QP {}: the GID is not an IPv4 multicast address",
+                qp.qp_num
+            );
+            return libc::EINVAL;
+        };
+        match get_device(qp.context).attach_mcast(qp.qp_num, group) {
+            Ok(()) => 0,
+            Err(err) => {
+                error!("Failed to attach QP {} to {group}: {err}", qp.qp_num);
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn detach_mcast(
+        qp: *mut ibverbs_sys::ibv_qp,
+        gid: *const ibverbs_sys::ibv_gid,
+        _lid: u16,
+    ) -> ::std::os::raw::c_int {
+        let qp = deref_or_ret!(qp, libc::EINVAL);
+        let Some(group) = Self::mcast_group(gid) else {
+            return libc::EINVAL;
+        };
+        match get_device(qp.context).detach_mcast(qp.qp_num, group) {
+            Ok(()) => 0,
+            Err(err) => {
+                error!("Failed to detach QP {} from {group}: {err}", qp.qp_num);
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn create_flow(
+        qp: *mut ibverbs_sys::ibv_qp,
+        flow_attr: *mut ibverbs_sys::ibv_flow_attr,
+    ) -> *mut ibverbs_sys::ibv_flow {
+        let qp = deref_or_ret!(qp, ptr::null_mut());
+        // The specs follow the attribute, it is read in place
+        let Some(attr) = (unsafe { flow_attr.as_ref() }) else {
+            return ptr::null_mut();
+        };
+        let result = unsafe { FlowSpec::from_ibv(attr) }
+            .and_then(|spec| get_device(qp.context).create_flow(qp.qp_num, spec));
+        match result {
+            Ok(handle) => Box::into_raw(Box::new(ibverbs_sys::ibv_flow {
+                comp_mask: 0,
+                context: qp.context,
+                handle,
+            })),
+            Err(err) => {
+                error!("Failed to create flow of QP {}: {err}", qp.qp_num);
+                ptr::null_mut()
+            }
+        }
+    }
+
+    #[inline]
+    fn destroy_flow(flow_id: *mut ibverbs_sys::ibv_flow) -> ::std::os::raw::c_int {
+        let flow = deref_or_ret!(flow_id, libc::EINVAL);
+        match get_device(flow.context).destroy_flow(flow.handle) {
+            Ok(()) => {
+                drop(unsafe { Box::from_raw(flow_id) });
+                0
+            }
+            Err(err) => {
+                error!("Failed to destroy flow {}: {err}", flow.handle);
+                err.to_errno()
+            }
+        }
+    }
+
+    #[allow(clippy::cast_sign_loss)]
+    #[inline]
+    fn reg_mr(
         pd: *mut ibverbs_sys::ibv_pd,
         addr: *mut ::std::os::raw::c_void,
         length: usize,
@@ -366,8 +1197,7 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
         let pd_deref = deref_or_ret!(pd, ptr::null_mut());
         let context = pd_deref.context;
         let pd_handle = pd_deref.handle;
-        let bluerdma = get_device(pd_deref.context);
-        match bluerdma.reg_mr(addr as u64, length, pd_handle, access as u8) {
+        match register_mr(context, addr as u64, length, pd_handle, access as u8) {
             Ok(mr_key) => {
                 let ibv_mr = Box::new(ibverbs_sys::ibv_mr {
                     context,
@@ -391,7 +1221,7 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
     fn dereg_mr(mr: *mut ibverbs_sys::ibv_mr) -> ::std::os::raw::c_int {
         let mr = deref_or_ret!(mr, libc::EINVAL);
         let pd = deref_or_ret!(mr.pd, libc::EINVAL);
-        let bluerdma = get_device(mr.context);
+        let mut bluerdma = get_device(mr.context);
         match bluerdma.dereg_mr(mr.handle) {
             Ok(()) => 0,
             Err(err) => {
@@ -401,6 +1231,192 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
         }
     }
 
+    #[allow(clippy::cast_sign_loss)]
+    #[inline]
+    fn rereg_mr(
+        mr: *mut ibverbs_sys::ibv_mr,
+        flags: core::ffi::c_int,
+        pd: *mut ibverbs_sys::ibv_pd,
+        addr: *mut ::std::os::raw::c_void,
+        length: usize,
+        access: core::ffi::c_int,
+    ) -> ::std::os::raw::c_int {
+        /// `enum ibv_rereg_mr_flags` of `verbs.h`
+        const CHANGE_TRANSLATION: core::ffi::c_int = 1 << 0;
+        const CHANGE_PD: core::ffi::c_int = 1 << 1;
+        const CHANGE_ACCESS: core::ffi::c_int = 1 << 2;
+        let mr = deref_or_ret!(mr, libc::EINVAL);
+        if flags & !(CHANGE_TRANSLATION | CHANGE_PD | CHANGE_ACCESS) != 0 {
+            return libc::EINVAL;
+        }
+        let pd_handle = if flags & CHANGE_PD != 0 {
+            Some(deref_or_ret!(pd, libc::EINVAL).handle)
+        } else {
+            None
+        };
+        let range = (flags & CHANGE_TRANSLATION != 0).then_some((addr as u64, length));
+        let access = (flags & CHANGE_ACCESS != 0).then_some(access as u8);
+        // `libibverbs` updates the PD and the range of `mr` on success
+        match get_device(mr.context).rereg_mr(mr.handle, pd_handle, range, access) {
+            Ok(()) => 0,
+            Err(err) => {
+                error!("Failed to re-register MR {}: {err}", mr.handle);
+                err.to_errno()
+            }
+        }
+    }
+
+    #[allow(clippy::cast_sign_loss)]
+    #[inline]
+    fn reg_dmabuf_mr(
+        pd: *mut ibverbs_sys::ibv_pd,
+        offset: u64,
+        length: usize,
+        iova: u64,
+        fd: core::ffi::c_int,
+        access: core::ffi::c_int,
+    ) -> *mut ibverbs_sys::ibv_mr {
+        let pd_deref = deref_or_ret!(pd, ptr::null_mut());
+        let context = pd_deref.context;
+        let mut bluerdma = get_device(pd_deref.context);
+        match bluerdma.reg_dmabuf_mr(fd, offset, length, iova, pd_deref.handle, access as u8) {
+            Ok(mr_key) => {
+                let ibv_mr = Box::new(ibverbs_sys::ibv_mr {
+                    context,
+                    pd,
+                    addr: offset as *mut ::std::os::raw::c_void,
+                    length,
+                    handle: mr_key,
+                    lkey: mr_key,
+                    rkey: mr_key,
+                });
+                Box::into_raw(ibv_mr)
+            }
+            Err(err) => {
+                error!("Failed to register dma-buf MR, {err}");
+                ptr::null_mut()
+            }
+        }
+    }
+
+    #[inline]
+    fn alloc_dm(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        dm_attr: *mut ibverbs_sys::ibv_alloc_dm_attr,
+    ) -> *mut ibverbs_sys::ibv_dm {
+        let attr = deref_or_ret!(dm_attr, ptr::null_mut());
+        if attr.comp_mask != 0 {
+            error!(
+                "Failed to alloc dm: unsupported comp_mask {:#x}",
+                attr.comp_mask
+            );
+            return ptr::null_mut();
+        }
+        match get_device(blue_context).alloc_dm(attr.length, attr.log_align_req) {
+            Ok((handle, addr)) => BlueDm::alloc(blue_context, handle, addr, attr.length),
+            Err(err) => {
+                error!("Failed to alloc dm: {err}");
+                ptr::null_mut()
+            }
+        }
+    }
+
+    #[inline]
+    fn free_dm(dm: *mut ibverbs_sys::ibv_dm) -> ::std::os::raw::c_int {
+        let Some(blue_dm) = (unsafe { BlueDm::get(dm) }) else {
+            return libc::EINVAL;
+        };
+        match get_device(blue_dm.context()).free_dm(blue_dm.handle()) {
+            Ok(()) => {
+                unsafe { BlueDm::free(dm) };
+                0
+            }
+            Err(err) => {
+                error!("Failed to free DM {}: {err}", blue_dm.handle());
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn reg_dm_mr(
+        pd: *mut ibverbs_sys::ibv_pd,
+        dm: *mut ibverbs_sys::ibv_dm,
+        dm_offset: u64,
+        length: usize,
+        access: core::ffi::c_uint,
+    ) -> *mut ibverbs_sys::ibv_mr {
+        /// The MRs on device memory are always zero-based, the flag is not passed to the
+        /// hardware
+        const ACCESS_ZERO_BASED: core::ffi::c_uint =
+            ibverbs_sys::ibv_access_flags::IBV_ACCESS_ZERO_BASED.0;
+        let pd_deref = deref_or_ret!(pd, ptr::null_mut());
+        let Some(blue_dm) = (unsafe { BlueDm::get(dm) }) else {
+            return ptr::null_mut();
+        };
+        let context = pd_deref.context;
+        let mut bluerdma = get_device(context);
+        match bluerdma.reg_dm_mr(
+            blue_dm.handle(),
+            dm_offset as usize,
+            length,
+            pd_deref.handle,
+            (access & !ACCESS_ZERO_BASED) as u8,
+        ) {
+            Ok(mr_key) => {
+                let ibv_mr = Box::new(ibverbs_sys::ibv_mr {
+                    context,
+                    pd,
+                    addr: ptr::null_mut(),
+                    length,
+                    handle: mr_key,
+                    lkey: mr_key,
+                    rkey: mr_key,
+                });
+                Box::into_raw(ibv_mr)
+            }
+            Err(err) => {
+                error!("Failed to register dm MR, {err}");
+                ptr::null_mut()
+            }
+        }
+    }
+
+    #[inline]
+    fn advise_mr(
+        pd: *mut ibverbs_sys::ibv_pd,
+        advice: core::ffi::c_uint,
+        flags: u32,
+        sg_list: *mut ibverbs_sys::ibv_sge,
+        num_sge: u32,
+    ) -> ::std::os::raw::c_int {
+        /// `enum ib_uverbs_advise_mr_advice` of `ib_user_ioctl_verbs.h`
+        const ADVICE_PREFETCH: core::ffi::c_uint = 0;
+        const ADVICE_PREFETCH_WRITE: core::ffi::c_uint = 1;
+        /// `enum ib_uverbs_advise_mr_flag` of `ib_user_ioctl_verbs.h`
+        const FLAG_FLUSH: u32 = 1 << 0;
+        let pd = deref_or_ret!(pd, libc::EINVAL);
+        if sg_list.is_null() || num_sge == 0 || flags & !FLAG_FLUSH != 0 {
+            return libc::EINVAL;
+        }
+        // `PREFETCH_NO_FAULT` only maps resident pages, the driver always faults them in
+        if advice != ADVICE_PREFETCH && advice != ADVICE_PREFETCH_WRITE {
+            return libc::EOPNOTSUPP;
+        }
+        let sges: Vec<_> = unsafe { std::slice::from_raw_parts(sg_list, num_sge as usize) }
+            .iter()
+            .map(|x| Sge::new(x.addr, x.length, x.lkey))
+            .collect();
+        let mut bluerdma = get_device(pd.context);
+        match bluerdma.advise_mr(pd.handle, flags & FLAG_FLUSH != 0, &sges) {
+            Ok(()) => 0,
+            Err(err) => {
+                error!("Failed to advise MR: {err}");
+                err.to_errno()
+            }
+        }
+    }
+
     #[inline]
     fn post_send(
         qp: *mut ibverbs_sys::ibv_qp,
@@ -408,20 +1424,46 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
         bad_wr: *mut *mut ibverbs_sys::ibv_send_wr,
     ) -> ::std::os::raw::c_int {
         let qp = deref_or_ret!(qp, libc::EINVAL);
-        let wr = deref_or_ret!(wr, libc::EINVAL);
+        if wr.is_null() {
+            return libc::EINVAL;
+        }
         let context = qp.context;
         let qp_num = qp.qp_num;
-        let bluerdma = get_device(context);
-        let wr = SendWr::new(wr).unwrap_or_else(|_| todo!("handle invalid input"));
-        match bluerdma.post_send(qp_num, wr) {
-            Ok(()) => 0,
-            Err(err) => {
-                error!("Failed to post send WR: {err}");
-                err.to_errno()
-            }
+
+        let failed = if qp.qp_type == ibverbs_sys::ibv_qp_type::IBV_QPT_UD {
+            Self::post_send_chain(wr, UdSendWr::new, |wrs| {
+                get_device(context).post_send_ud(qp_num, wrs)
+            })
+        } else if qp.qp_type == ibverbs_sys::ibv_qp_type::IBV_QPT_XRC_SEND {
+            Self::post_send_chain(wr, XrcSendWr::new, |wrs| {
+                get_device(context).post_send_xrc(qp_num, wrs)
+            })
+        } else if qp.qp_type == ibverbs_sys::ibv_qp_type::IBV_QPT_RAW_PACKET {
+            Self::post_send_chain(wr, raw_send_wr, |wrs| {
+                get_device(context).post_send_raw(qp_num, wrs)
+            })
+        } else if qp.qp_type == ibverbs_sys::ibv_qp_type::IBV_QPT_DRIVER {
+            // The WR chain has no room for both the remote address and the destination
+            Some((
+                wr,
+                RdmaError::InvalidInput(
+                    "DC QPs post through ibv_wr_* with ibv_wr_set_ud_addr".into(),
+                ),
+            ))
+        } else {
+            Self::post_send_rc(context, qp_num, wr)
+        };
+        let Some((failed, err)) = failed else {
+            return 0;
+        };
+        if let Some(bad_wr) = unsafe { bad_wr.as_mut() } {
+            *bad_wr = failed;
         }
+        error!("Failed to post send WR: {err}");
+        err.to_errno()
     }
 
+    /// Posts the chain of receive WRs at once, the WRs before an invalid one are posted
     #[inline]
     fn post_recv(
         qp: *mut ibverbs_sys::ibv_qp,
@@ -429,18 +1471,39 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
         bad_wr: *mut *mut ibverbs_sys::ibv_recv_wr,
     ) -> ::std::os::raw::c_int {
         let qp = deref_or_ret!(qp, libc::EINVAL);
-        let wr = deref_or_ret!(wr, libc::EINVAL);
+        if wr.is_null() {
+            return libc::EINVAL;
+        }
         let context = qp.context;
         let qp_num = qp.qp_num;
-        let bluerdma = unsafe { get_device(context) };
-        let wr = RecvWr::new(wr).unwrap_or_else(|| todo!("handle invalid input"));
-        match bluerdma.post_recv(qp_num, wr) {
-            Ok(()) => 0,
-            Err(err) => {
-                error!("Failed to post recv WR: {err}");
-                err.to_errno()
-            }
+        let mut wrs = Vec::new();
+        let mut wr_ptrs = Vec::new();
+        let mut invalid = None;
+        let mut current = wr;
+        while let Some(ibv_wr) = unsafe { current.as_ref() } {
+            let Some(x) = RecvWr::new(*ibv_wr) else {
+                let err = RdmaError::InvalidInput("Only a single SGE is supported".into());
+                invalid = Some((current, err));
+                break;
+            };
+            wrs.push(x);
+            wr_ptrs.push(current);
+            current = ibv_wr.next;
         }
+
+        let mut bluerdma = get_device(context);
+        let failed = match (bluerdma.post_recv_batch(qp_num, &wrs), invalid) {
+            (Err((index, err)), _) => Some((wr_ptrs.get(index).copied().unwrap_or(wr), err)),
+            (Ok(()), invalid) => invalid,
+        };
+        let Some((failed, err)) = failed else {
+            return 0;
+        };
+        if let Some(bad_wr) = unsafe { bad_wr.as_mut() } {
+            *bad_wr = failed;
+        }
+        error!("Failed to post recv WR: {err}");
+        err.to_errno()
     }
 
     #[allow(
@@ -455,32 +1518,471 @@ unsafe impl RdmaCtxOps for BlueRdmaCore {
         wc: *mut ibverbs_sys::ibv_wc,
     ) -> i32 {
         let cq = deref_or_ret!(cq, 0);
-        let bluerdma = get_device(cq.context);
-        let completions = bluerdma.poll_cq(cq.handle, num_entries as usize);
-        let num = completions.len() as i32;
-        for (i, c) in completions.into_iter().enumerate() {
-            if let Some(wc) = unsafe { wc.add(i).as_mut() } {
-                match c {
-                    Completion::Send { wr_id }
-                    | Completion::RdmaWrite { wr_id }
-                    | Completion::RdmaRead { wr_id } => {
-                        wc.wr_id = wr_id;
-                    }
-                    Completion::Recv { wr_id, imm } => {
-                        wc.wr_id = wr_id;
-                        if let Some(imm) = imm {
-                            wc.__bindgen_anon_1.imm_data = imm;
-                        }
-                    }
-                    Completion::RecvRdmaWithImm { imm } => {
-                        wc.__bindgen_anon_1.imm_data = imm;
-                    }
+        if wc.is_null() || num_entries <= 0 {
+            return 0;
+        }
+        let mut bluerdma = get_device(cq.context);
+        // SAFETY: the caller provides an array of at least `num_entries` work completions
+        let wc = unsafe { std::slice::from_raw_parts_mut(wc, num_entries as usize) };
+
+        bluerdma.poll_cq_into(cq.handle, wc) as i32
+    }
+
+    #[inline]
+    fn req_notify_cq(
+        cq: *mut ibverbs_sys::ibv_cq,
+        solicited_only: core::ffi::c_int,
+    ) -> ::std::os::raw::c_int {
+        let cq = deref_or_ret!(cq, libc::EINVAL);
+        let mut bluerdma = get_device(cq.context);
+        match bluerdma.req_notify_cq(cq.handle, solicited_only != 0) {
+            Ok(()) => 0,
+            Err(err) => {
+                error!("Failed to request notification of CQ {}: {err}", cq.handle);
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn modify_cq(
+        cq: *mut ibverbs_sys::ibv_cq,
+        attr: *mut ibverbs_sys::ibv_modify_cq_attr,
+    ) -> ::std::os::raw::c_int {
+        let cq = deref_or_ret!(cq, libc::EINVAL);
+        let attr = deref_or_ret!(attr, libc::EINVAL);
+        let moderate = ibverbs_sys::ibv_cq_attr_mask::IBV_CQ_ATTR_MODERATE.0;
+        if attr.attr_mask & !moderate != 0 {
+            return libc::EOPNOTSUPP;
+        }
+        if attr.attr_mask & moderate == 0 {
+            return 0;
+        }
+        let mut bluerdma = get_device(cq.context);
+        let moderation = attr.moderate;
+        match bluerdma.modify_cq(cq.handle, moderation.cq_count, moderation.cq_period) {
+            Ok(()) => 0,
+            Err(err) => {
+                error!("Failed to moderate CQ {}: {err}", cq.handle);
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn create_srq(
+        pd: *mut ibverbs_sys::ibv_pd,
+        srq_init_attr: *mut ibverbs_sys::ibv_srq_init_attr,
+    ) -> *mut ibverbs_sys::ibv_srq {
+        let context = deref_or_ret!(pd, ptr::null_mut()).context;
+        let init_attr = deref_or_ret!(srq_init_attr, ptr::null_mut());
+        let mut bluerdma = get_device(context);
+        let attr = init_attr.attr;
+        if attr.max_sge > 1 {
+            error!(
+                "Failed to create srq: max_sge {} is not supported",
+                attr.max_sge
+            );
+            return ptr::null_mut();
+        }
+        match bluerdma.create_srq(attr.max_wr, attr.srq_limit) {
+            Ok(handle) => Box::into_raw(Box::new(ibverbs_sys::ibv_srq {
+                context,
+                srq_context: init_attr.srq_context,
+                pd,
+                handle,
+                mutex: ibverbs_sys::pthread_mutex_t::default(),
+                cond: ibverbs_sys::pthread_cond_t::default(),
+                events_completed: 0,
+            })),
+            Err(err) => {
+                error!("Failed to create srq: {err}");
+                ptr::null_mut()
+            }
+        }
+    }
+
+    #[allow(clippy::cast_sign_loss)]
+    #[inline]
+    fn modify_srq(
+        srq: *mut ibverbs_sys::ibv_srq,
+        srq_attr: *mut ibverbs_sys::ibv_srq_attr,
+        srq_attr_mask: core::ffi::c_int,
+    ) -> ::std::os::raw::c_int {
+        let srq = deref_or_ret!(srq, libc::EINVAL);
+        let attr = deref_or_ret!(srq_attr, libc::EINVAL);
+        let mask = srq_attr_mask as u32;
+        let max_wr =
+            (mask & ibverbs_sys::ibv_srq_attr_mask::IBV_SRQ_MAX_WR.0 != 0).then_some(attr.max_wr);
+        let srq_limit =
+            (mask & ibverbs_sys::ibv_srq_attr_mask::IBV_SRQ_LIMIT.0 != 0).then_some(attr.srq_limit);
+        let mut bluerdma = get_device(srq.context);
+        match bluerdma.modify_srq(srq.handle, max_wr, srq_limit) {
+            Ok(()) => 0,
+            Err(err) => {
+                error!("Failed to modify SRQ {}: {err}", srq.handle);
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn query_srq(
+        srq: *mut ibverbs_sys::ibv_srq,
+        srq_attr: *mut ibverbs_sys::ibv_srq_attr,
+    ) -> ::std::os::raw::c_int {
+        let srq = deref_or_ret!(srq, libc::EINVAL);
+        if srq_attr.is_null() {
+            return libc::EINVAL;
+        }
+        let mut bluerdma = get_device(srq.context);
+        match bluerdma.query_srq(srq.handle) {
+            Ok((max_wr, srq_limit)) => {
+                unsafe {
+                    (*srq_attr) = ibverbs_sys::ibv_srq_attr {
+                        max_wr,
+                        max_sge: 1,
+                        srq_limit,
+                    };
                 }
-                wc.opcode = c.opcode();
-                wc.status = ibverbs_sys::ibv_wc_status::IBV_WC_SUCCESS;
+                0
+            }
+            Err(err) => {
+                error!("Failed to query SRQ {}: {err}", srq.handle);
+                err.to_errno()
             }
         }
+    }
 
-        num
+    #[inline]
+    fn destroy_srq(srq: *mut ibverbs_sys::ibv_srq) -> ::std::os::raw::c_int {
+        let srq = deref_or_ret!(srq, libc::EINVAL);
+        let mut bluerdma = get_device(srq.context);
+        match bluerdma.destroy_srq(srq.handle) {
+            Ok(()) => 0,
+            Err(err) => {
+                error!("Failed to destroy SRQ {}: {err}", srq.handle);
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn post_srq_recv(
+        srq: *mut ibverbs_sys::ibv_srq,
+        recv_wr: *mut ibverbs_sys::ibv_recv_wr,
+        bad_recv_wr: *mut *mut ibverbs_sys::ibv_recv_wr,
+    ) -> ::std::os::raw::c_int {
+        let srq = deref_or_ret!(srq, libc::EINVAL);
+        let mut bluerdma = get_device(srq.context);
+        let mut current = recv_wr;
+        while let Some(ibv_wr) = unsafe { current.as_ref() } {
+            let result = RecvWr::new(*ibv_wr)
+                .ok_or(RdmaError::InvalidInput(
+                    "Only a single SGE is supported".into(),
+                ))
+                .and_then(|wr| bluerdma.post_srq_recv(srq.handle, wr));
+            if let Err(err) = result {
+                if let Some(bad_wr) = unsafe { bad_recv_wr.as_mut() } {
+                    *bad_wr = current;
+                }
+                error!("Failed to post SRQ recv WR: {err}");
+                return err.to_errno();
+            }
+            current = ibv_wr.next;
+        }
+        0
+    }
+
+    #[inline]
+    fn open_xrcd(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        xrcd_init_attr: *mut ibverbs_sys::ibv_xrcd_init_attr,
+    ) -> *mut ibverbs_sys::ibv_xrcd {
+        let attr = deref_or_ret!(xrcd_init_attr, ptr::null_mut());
+        let fd_mask = ibverbs_sys::ibv_xrcd_init_attr_mask::IBV_XRCD_INIT_ATTR_FD.0;
+        if attr.comp_mask & fd_mask != 0 && attr.fd != -1 {
+            error!("Failed to open xrcd: sharing a XRCD with other processes is not supported");
+            return ptr::null_mut();
+        }
+        match get_device(blue_context).open_xrcd() {
+            Ok(handle) => Box::into_raw(Box::new(BlueXrcd {
+                xrcd: ibverbs_sys::ibv_xrcd {
+                    context: blue_context,
+                },
+                comp_mask: 0,
+                handle,
+            }))
+            .cast(),
+            Err(err) => {
+                error!("Failed to open xrcd: {err}");
+                ptr::null_mut()
+            }
+        }
+    }
+
+    #[inline]
+    fn close_xrcd(xrcd: *mut ibverbs_sys::ibv_xrcd) -> ::std::os::raw::c_int {
+        let xrcd_ptr = xrcd.cast::<BlueXrcd>();
+        let xrcd = deref_or_ret!(xrcd_ptr, libc::EINVAL);
+        match get_device(xrcd.xrcd.context).close_xrcd(xrcd.handle) {
+            Ok(()) => {
+                drop(unsafe { Box::from_raw(xrcd_ptr) });
+                0
+            }
+            Err(err) => {
+                error!("Failed to close XRCD {}: {err}", xrcd.handle);
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn create_srq_ex(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        srq_init_attr_ex: *mut ibverbs_sys::ibv_srq_init_attr_ex,
+    ) -> *mut ibverbs_sys::ibv_srq {
+        let init_attr = deref_or_ret!(srq_init_attr_ex, ptr::null_mut());
+        let mask = init_attr.comp_mask;
+        let type_mask = ibverbs_sys::ibv_srq_init_attr_mask::IBV_SRQ_INIT_ATTR_TYPE.0;
+        if mask & type_mask == 0 || init_attr.srq_type == ibverbs_sys::ibv_srq_type::IBV_SRQT_BASIC
+        {
+            // The extended attributes start with the `ibv_srq_init_attr` of a basic SRQ
+            return Self::create_srq(init_attr.pd, srq_init_attr_ex.cast());
+        }
+        let xrc_mask = ibverbs_sys::ibv_srq_init_attr_mask::IBV_SRQ_INIT_ATTR_XRCD
+            | ibverbs_sys::ibv_srq_init_attr_mask::IBV_SRQ_INIT_ATTR_CQ;
+        if init_attr.srq_type != ibverbs_sys::ibv_srq_type::IBV_SRQT_XRC
+            || mask & xrc_mask.0 != xrc_mask.0
+        {
+            error!("Failed to create srq: only basic and XRC SRQs are supported");
+            return ptr::null_mut();
+        }
+        let xrcd = Self::xrcd_handle(init_attr.xrcd);
+        let cq = unsafe { init_attr.cq.as_ref() }.map(|cq| cq.handle);
+        let (Some(xrcd), Some(cq)) = (xrcd, cq) else {
+            error!("Failed to create srq: a XRC SRQ needs a XRCD and a CQ");
+            return ptr::null_mut();
+        };
+        let attr = init_attr.attr;
+        if attr.max_sge > 1 {
+            error!(
+                "Failed to create srq: max_sge {} is not supported",
+                attr.max_sge
+            );
+            return ptr::null_mut();
+        }
+        match get_device(blue_context).create_xrc_srq(xrcd, cq, attr.max_wr, attr.srq_limit) {
+            Ok(handle) => Box::into_raw(Box::new(ibverbs_sys::ibv_srq {
+                context: blue_context,
+                srq_context: init_attr.srq_context,
+                pd: init_attr.pd,
+                handle,
+                mutex: ibverbs_sys::pthread_mutex_t::default(),
+                cond: ibverbs_sys::pthread_cond_t::default(),
+                events_completed: 0,
+            })),
+            Err(err) => {
+                error!("Failed to create srq: {err}");
+                ptr::null_mut()
+            }
+        }
+    }
+
+    #[inline]
+    fn get_srq_num(srq: *mut ibverbs_sys::ibv_srq, srq_num: *mut u32) -> ::std::os::raw::c_int {
+        let srq = deref_or_ret!(srq, libc::EINVAL);
+        if srq_num.is_null() {
+            return libc::EINVAL;
+        }
+        match get_device(srq.context).get_srq_num(srq.handle) {
+            Ok(num) => {
+                unsafe {
+                    *srq_num = num;
+                }
+                0
+            }
+            Err(err) => {
+                error!("Failed to get the number of SRQ {}: {err}", srq.handle);
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn alloc_td(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        init_attr: *mut ibverbs_sys::ibv_td_init_attr,
+    ) -> *mut ibverbs_sys::ibv_td {
+        let attr = deref_or_ret!(init_attr, ptr::null_mut());
+        if attr.comp_mask != 0 {
+            error!(
+                "Failed to alloc td: unsupported comp_mask {:#x}",
+                attr.comp_mask
+            );
+            return ptr::null_mut();
+        }
+        match get_device(blue_context).alloc_td() {
+            Ok(handle) => Box::into_raw(Box::new(BlueTd {
+                td: ibverbs_sys::ibv_td {
+                    context: blue_context,
+                },
+                handle,
+            }))
+            .cast(),
+            Err(err) => {
+                error!("Failed to alloc td: {err}");
+                ptr::null_mut()
+            }
+        }
+    }
+
+    #[inline]
+    fn dealloc_td(td: *mut ibverbs_sys::ibv_td) -> ::std::os::raw::c_int {
+        let td_ptr = td.cast::<BlueTd>();
+        let td = deref_or_ret!(td_ptr, libc::EINVAL);
+        match get_device(td.td.context).dealloc_td(td.handle) {
+            Ok(()) => {
+                drop(unsafe { Box::from_raw(td_ptr) });
+                0
+            }
+            Err(err) => {
+                error!("Failed to dealloc TD {}: {err}", td.handle);
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn alloc_parent_domain(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        attr: *mut ibverbs_sys::ibv_parent_domain_init_attr,
+    ) -> *mut ibverbs_sys::ibv_pd {
+        let attr = deref_or_ret!(attr, ptr::null_mut());
+        let pd = deref_or_ret!(attr.pd, ptr::null_mut());
+        let nested = unsafe { BluePd::get(attr.pd) }.is_some_and(|x| x.is_parent());
+        if nested || pd.context != blue_context {
+            error!("Failed to alloc parent domain: not a protection domain of the context");
+            return ptr::null_mut();
+        }
+        // A parent domain without a TD leaves the QPs as they are
+        let td = Self::td_handle(attr.td);
+        match BluePd::alloc_parent(&pd, td, &attr) {
+            Ok(parent) => parent,
+            Err(err) => {
+                error!("Failed to alloc parent domain: {err}");
+                ptr::null_mut()
+            }
+        }
+    }
+
+    #[inline]
+    fn create_counters(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        init_attr: *mut ibverbs_sys::ibv_counters_init_attr,
+    ) -> *mut ibverbs_sys::ibv_counters {
+        let init_attr = deref_or_ret!(init_attr, ptr::null_mut());
+        if init_attr.comp_mask != 0 {
+            error!("Unsupported counters comp_mask: {:x}", init_attr.comp_mask);
+            return ptr::null_mut();
+        }
+        // The counters are those of the device, there is nothing to allocate on the device
+        Box::into_raw(Box::new(ibverbs_sys::ibv_counters {
+            context: blue_context,
+        }))
+    }
+
+    #[inline]
+    fn destroy_counters(counters: *mut ibverbs_sys::ibv_counters) -> ::std::os::raw::c_int {
+        if counters.is_null() {
+            return libc::EINVAL;
+        }
+        drop(unsafe { Box::from_raw(counters) });
+        0
+    }
+
+    #[inline]
+    fn read_counters(
+        counters: *mut ibverbs_sys::ibv_counters,
+        counters_value: *mut u64,
+        ncounters: u32,
+        _flags: u32,
+    ) -> ::std::os::raw::c_int {
+        let counters = deref_or_ret!(counters, libc::EINVAL);
+        if counters_value.is_null() {
+            return libc::EINVAL;
+        }
+        let values = unsafe { std::slice::from_raw_parts_mut(counters_value, ncounters as usize) };
+        match get_device_shared(counters.context).read_counters(values) {
+            Ok(()) => 0,
+            Err(err) => {
+                error!("Failed to read counters: {err}");
+                err.to_errno()
+            }
+        }
+    }
+
+    #[inline]
+    fn dump_counters(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        buf: *mut std::ffi::c_char,
+        len: usize,
+    ) -> ::std::os::raw::c_int {
+        let dump = match get_device_shared(blue_context).dump_counters() {
+            Ok(dump) => dump,
+            Err(err) => {
+                error!("Failed to dump counters: {err}");
+                return -err.to_errno();
+            }
+        };
+        Self::copy_dump(&dump, buf, len)
+    }
+
+    #[inline]
+    fn dump_memory(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        buf: *mut std::ffi::c_char,
+        len: usize,
+    ) -> ::std::os::raw::c_int {
+        let dump = match get_device_shared(blue_context).dump_memory() {
+            Ok(dump) => dump,
+            Err(err) => {
+                error!("Failed to dump memory usage: {err}");
+                return -err.to_errno();
+            }
+        };
+        Self::copy_dump(&dump, buf, len)
+    }
+
+    #[inline]
+    fn dump_trace(buf: *mut std::ffi::c_char, len: usize) -> ::std::os::raw::c_int {
+        Self::copy_dump(&crate::trace::dump(), buf, len)
+    }
+
+    #[inline]
+    fn dump_desc_trace(path: *const std::ffi::c_char) -> ::std::os::raw::c_int {
+        if path.is_null() {
+            return -libc::EINVAL;
+        }
+        // SAFETY: the caller provides a NUL terminated path
+        let path = unsafe { std::ffi::CStr::from_ptr(path) }.to_string_lossy();
+        match crate::ringbuf::record::dump(path.as_ref()) {
+            Ok(num) => i32::try_from(num).unwrap_or(i32::MAX),
+            Err(err) => {
+                error!("Failed to dump descriptor trace to {path}: {err}");
+                -err.raw_os_error().unwrap_or(match err.kind() {
+                    io::ErrorKind::Unsupported => libc::ENOTSUP,
+                    _ => libc::EIO,
+                })
+            }
+        }
+    }
+
+    #[inline]
+    fn cq_ring(cq: *mut ibverbs_sys::ibv_cq) -> *const core::ffi::c_void {
+        let cq = deref_or_ret!(cq, ptr::null());
+        get_device(cq.context)
+            .shared_cq_ring(cq.handle)
+            .map_or(ptr::null(), |ring| ring.cast())
     }
 }
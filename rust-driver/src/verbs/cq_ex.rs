@@ -0,0 +1,219 @@
+use ibverbs_sys::ibv_create_cq_wc_flags as wc_flags;
+
+use crate::workers::completion::CqSlot;
+
+use super::{ctx::VerbsOps, ffi::get_device};
+
+/// An extended CQ.
+///
+/// The `ibv_cq_ex` handed to the consumer is followed by the slot polled by the last
+/// `ibv_start_poll` or `ibv_next_poll`, the `ibv_wc_read_*` callbacks decode only the field
+/// they are asked for from that slot, no `ibv_wc` is filled.
+#[repr(C)]
+pub(super) struct BlueCqEx {
+    /// Must stay the first field, the consumer only sees a pointer to it
+    cq: ibverbs_sys::ibv_cq_ex,
+    /// Completion being read, valid until the next `next_poll` or `end_poll`
+    current: Option<CqSlot>,
+}
+
+impl BlueCqEx {
+    /// Returns the `wc_flags` of `ibv_cq_init_attr_ex` that the extended CQ can report.
+    ///
+    /// Completions on RoCE carry no SL, SLID or DLID path bits, they are read as 0.
+    pub(super) fn supported_wc_flags() -> u64 {
+        let flags = wc_flags::IBV_WC_EX_WITH_BYTE_LEN
+            | wc_flags::IBV_WC_EX_WITH_IMM
+            | wc_flags::IBV_WC_EX_WITH_QP_NUM
+            | wc_flags::IBV_WC_EX_WITH_SRC_QP
+            | wc_flags::IBV_WC_EX_WITH_SLID
+            | wc_flags::IBV_WC_EX_WITH_SL
+            | wc_flags::IBV_WC_EX_WITH_DLID_PATH_BITS
+            | wc_flags::IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
+        u64::from(flags.0)
+    }
+
+    /// Returns `true` if the CQ must timestamp its completions
+    pub(super) fn wants_timestamps(attr: &ibverbs_sys::ibv_cq_init_attr_ex) -> bool {
+        attr.wc_flags & u64::from(wc_flags::IBV_WC_EX_WITH_COMPLETION_TIMESTAMP.0) != 0
+    }
+
+    /// Allocates the extended CQ of `handle`, the caller owns the returned pointer
+    pub(super) fn alloc(
+        context: *mut ibverbs_sys::ibv_context,
+        attr: &ibverbs_sys::ibv_cq_init_attr_ex,
+        handle: u32,
+        cqe: i32,
+    ) -> *mut ibverbs_sys::ibv_cq_ex {
+        let cq = ibverbs_sys::ibv_cq_ex {
+            context,
+            channel: attr.channel,
+            cq_context: attr.cq_context,
+            handle,
+            cqe,
+            mutex: ibverbs_sys::pthread_mutex_t::default(),
+            cond: ibverbs_sys::pthread_cond_t::default(),
+            comp_events_completed: 0,
+            async_events_completed: 0,
+            comp_mask: 0,
+            status: ibverbs_sys::ibv_wc_status::IBV_WC_SUCCESS,
+            wr_id: 0,
+            start_poll: Some(start_poll),
+            next_poll: Some(next_poll),
+            end_poll: Some(end_poll),
+            read_opcode: Some(read_opcode),
+            read_vendor_err: Some(read_vendor_err),
+            read_byte_len: Some(read_byte_len),
+            read_imm_data: Some(read_imm_data),
+            read_qp_num: Some(read_qp_num),
+            read_src_qp: Some(read_src_qp),
+            read_wc_flags: Some(read_wc_flags),
+            read_slid: Some(read_slid),
+            read_sl: Some(read_sl),
+            read_dlid_path_bits: Some(read_dlid_path_bits),
+            read_completion_ts: Self::wants_timestamps(attr).then_some(read_completion_ts),
+            read_cvlan: None,
+            read_flow_tag: None,
+            read_tm_info: None,
+            read_completion_wallclock_ns: None,
+        };
+        Box::into_raw(Box::new(Self { cq, current: None })).cast()
+    }
+
+    /// Frees an extended CQ returned by `alloc`
+    ///
+    /// # Safety
+    ///
+    /// `cq` must come from `alloc` and must not be used afterwards
+    #[allow(clippy::cast_ptr_alignment)]
+    pub(super) unsafe fn free(cq: *mut ibverbs_sys::ibv_cq_ex) {
+        drop(unsafe { Box::from_raw(cq.cast::<Self>()) });
+    }
+}
+
+/// Returns the extended CQ of `cq`
+///
+/// # Safety
+///
+/// `cq` must be null or come from `BlueCqEx::alloc`
+#[allow(clippy::cast_ptr_alignment)]
+unsafe fn as_cq_ex(cq: *mut ibverbs_sys::ibv_cq_ex) -> Option<&'static mut BlueCqEx> {
+    // The allocation is a `BlueCqEx`, which is aligned for its slot
+    unsafe { cq.cast::<BlueCqEx>().as_mut() }
+}
+
+/// Polls the next completion into the current slot of the extended CQ
+///
+/// # Safety
+///
+/// `cq` must be null or come from `BlueCqEx::alloc`
+unsafe fn poll(cq: *mut ibverbs_sys::ibv_cq_ex, start: bool) -> core::ffi::c_int {
+    let Some(cq) = (unsafe { as_cq_ex(cq) }) else {
+        return libc::EINVAL;
+    };
+    let mut bluerdma = get_device(cq.cq.context);
+    cq.current = bluerdma.poll_cq_slot(cq.cq.handle, start);
+    let Some(slot) = cq.current.as_ref() else {
+        return libc::ENOENT;
+    };
+    // Status and WR ID are read by the consumer straight from the `ibv_cq_ex`
+    cq.cq.status = ibverbs_sys::ibv_wc_status::IBV_WC_SUCCESS;
+    cq.cq.wr_id = slot.completion().wr_id();
+
+    0
+}
+
+/// Reads a field of the current slot, or the default value outside of a poll batch
+///
+/// # Safety
+///
+/// `cq` must be null or come from `BlueCqEx::alloc`
+unsafe fn read<R, F>(cq: *mut ibverbs_sys::ibv_cq_ex, f: F) -> R
+where
+    R: Default,
+    F: FnOnce(&CqSlot) -> R,
+{
+    unsafe { as_cq_ex(cq) }
+        .and_then(|x| x.current.as_ref())
+        .map_or_else(R::default, f)
+}
+
+/// `ibv_start_poll`, returns `ENOENT` if the CQ is empty
+unsafe extern "C" fn start_poll(
+    cq: *mut ibverbs_sys::ibv_cq_ex,
+    attr: *mut ibverbs_sys::ibv_poll_cq_attr,
+) -> core::ffi::c_int {
+    if unsafe { attr.as_ref() }.is_some_and(|x| x.comp_mask != 0) {
+        return libc::EINVAL;
+    }
+    unsafe { poll(cq, true) }
+}
+
+/// `ibv_next_poll`, returns `ENOENT` if the CQ is empty
+unsafe extern "C" fn next_poll(cq: *mut ibverbs_sys::ibv_cq_ex) -> core::ffi::c_int {
+    unsafe { poll(cq, false) }
+}
+
+/// `ibv_end_poll`
+unsafe extern "C" fn end_poll(cq: *mut ibverbs_sys::ibv_cq_ex) {
+    if let Some(cq) = unsafe { as_cq_ex(cq) } {
+        cq.current = None;
+    }
+}
+
+/// `ibv_wc_read_opcode`
+unsafe extern "C" fn read_opcode(
+    cq: *mut ibverbs_sys::ibv_cq_ex,
+) -> ibverbs_sys::ibv_wc_opcode::Type {
+    unsafe { read(cq, |x| x.completion().opcode()) }
+}
+
+/// `ibv_wc_read_vendor_err`, completions polled by the driver are always successful
+unsafe extern "C" fn read_vendor_err(_cq: *mut ibverbs_sys::ibv_cq_ex) -> u32 {
+    0
+}
+
+/// `ibv_wc_read_byte_len`
+unsafe extern "C" fn read_byte_len(cq: *mut ibverbs_sys::ibv_cq_ex) -> u32 {
+    unsafe { read(cq, |x| x.completion().byte_len()) }
+}
+
+/// `ibv_wc_read_imm_data`
+unsafe extern "C" fn read_imm_data(cq: *mut ibverbs_sys::ibv_cq_ex) -> ibverbs_sys::__be32 {
+    unsafe { read(cq, |x| x.completion().imm().unwrap_or(0)) }
+}
+
+/// `ibv_wc_read_qp_num`
+unsafe extern "C" fn read_qp_num(cq: *mut ibverbs_sys::ibv_cq_ex) -> u32 {
+    unsafe { read(cq, |x| x.completion().qpn()) }
+}
+
+/// `ibv_wc_read_src_qp`, only meaningful for UD QPs
+unsafe extern "C" fn read_src_qp(cq: *mut ibverbs_sys::ibv_cq_ex) -> u32 {
+    unsafe { read(cq, |x| x.completion().src_qp()) }
+}
+
+/// `ibv_wc_read_wc_flags`
+unsafe extern "C" fn read_wc_flags(cq: *mut ibverbs_sys::ibv_cq_ex) -> core::ffi::c_uint {
+    unsafe { read(cq, |x| x.completion().wc_flags()) }
+}
+
+/// `ibv_wc_read_slid`
+unsafe extern "C" fn read_slid(_cq: *mut ibverbs_sys::ibv_cq_ex) -> u32 {
+    0
+}
+
+/// `ibv_wc_read_sl`
+unsafe extern "C" fn read_sl(_cq: *mut ibverbs_sys::ibv_cq_ex) -> u8 {
+    0
+}
+
+/// `ibv_wc_read_dlid_path_bits`
+unsafe extern "C" fn read_dlid_path_bits(_cq: *mut ibverbs_sys::ibv_cq_ex) -> u8 {
+    0
+}
+
+/// `ibv_wc_read_completion_ts`, in nanoseconds of the device clock
+unsafe extern "C" fn read_completion_ts(cq: *mut ibverbs_sys::ibv_cq_ex) -> u64 {
+    unsafe { read(cq, CqSlot::timestamp) }
+}
@@ -1,88 +1,761 @@
 use std::{
+    collections::{BTreeMap, HashMap},
     io, iter,
-    net::Ipv4Addr,
-    sync::{atomic::AtomicBool, Arc},
-    thread::current,
-    time::Duration,
+    mem::ManuallyDrop,
+    net::{Ipv4Addr, SocketAddrV4},
+    num::NonZeroUsize,
+    os::fd::RawFd,
+    sync::{atomic::AtomicBool, mpsc, Arc},
+    task::Waker,
+    thread::{self, current},
+    time::{Duration, Instant},
 };
 
 use crossbeam_deque::Worker;
 use parking_lot::Mutex;
-use log::{debug, info};
+use log::{debug, error, info, log_enabled, warn, Level};
 
 use crate::{
-    cmd::{CommandConfigurator, MttUpdate, PgtUpdate, RecvBufferMeta, UpdateQp},
-    config::DeviceConfig,
-    constants::CARD_MAC_ADDRESS,
-    csr::{mode::Mode, DeviceAdaptor},
+    cmd::{
+        CmdTicket, CommandConfigurator, MttUpdate, PgtStaging, PgtWriter, RecvBufferMeta, UpdateQp,
+    },
+    config::{DeviceConfig, SendPathConfig},
+    constants::{
+        CARD_MAC_ADDRESS, DEFAULT_MAX_QP, DM_ARENA_SIZE, INLINE_SLOTS, MAX_CQE, MAX_CQ_CNT,
+        MAX_DEFERRED_DEREG, MAX_INLINE_DATA, MAX_MR_CNT, MAX_PD_CNT, MAX_REG_WORKERS, MAX_SEND_WR,
+        MAX_SGE, MAX_SRQ_CNT, MAX_SRQ_WR, MIN_WR_CHUNK_SIZE, PARALLEL_REG_MIN_BYTES, PGT_LEN,
+        RECV_RING_IOVA, RECV_RING_MR_KEY, REG_SLICE_BYTES, STAGING_SLOT_SIZES,
+    },
+    counters::{Counter, DeviceCounters},
+    csr::{irq::MetaInterrupts, mode::ModeProxy, DeviceAdaptor},
+    descriptors::DESC_SIZE,
+    latency,
     mem::{
-        get_num_page, page::PageAllocator, pin_pages, virt_to_phy::AddressResolver, DmaBuf,
-        DmaBufAllocator, MemoryPinner, PageWithPhysAddr, UmemHandler, PAGE_SIZE,
+        dmabuf::DmabufMapping,
+        get_num_page,
+        page::PageAllocator,
+        phys_runs, pin_pages,
+        prefetch::{PrefetchJob, Prefetcher},
+        usage::MemoryUsage,
+        virt_to_phy::AddressResolver,
+        DmaBuf, DmaBufAllocator, MemoryPinner, PageWithPhysAddr, PinCount, UmemHandler, PAGE_SIZE,
     },
-    net::{config::NetworkConfig, reader::NetConfigReader, recv_chan::{
-        post_recv_channel, PostRecvTx, PostRecvTxTable, RecvWorker, RecvWrQueueTable, TcpChannel,
-    }, simple_nic::SimpleNicController},
+    net::{bond::BondPeers, config::NetworkConfig, dc::{DcMsg, DcPeer, DcQps, DcSendWr, BIND_RETRY, BIND_TIMEOUT, CONTEXT_RD_ATOMIC}, neigh::NeighbourTable, reader::NetConfigReader, recv_chan::{
+        PostRecvTx, PostRecvTxTable, RecvWorker, RecvWrQueueTable, TcpChannelTx,
+    }, multipath::{Multipath, DEFAULT_UDP_PORT}, raw::{FlowSpec, RawQps}, recv_ring::{recv_rings_size, RecvRings}, rendezvous::{PendingPull, PendingPulls, PullRequest}, simple_nic::{self, set_netdev_mtu, BulkFrameTx, FrameRxQueue, FrameTxQueue, SimpleNicController}, ud::{AhTable, UdQps, UdSendWr}, xrc::{XrcDomains, XrcSendWr, XrcSrq}},
     rdma_utils::{
-        mtt::{Mtt, PgtEntry},
+        atomic::Atomics,
+        dereg::DeferredFreeList,
+        dm::DeviceMemory,
+        inline::{InlineBuf, InlineSlots},
+        loopback,
+        mr_cache::{CachedMr, MrCache},
+        mtt::{Mtt, OdpMr, PgtEntry, PinnedMr},
+        mw::{MwTable, MwWr},
         pd::PdTable,
-        qp::{QpManager, QpTableShared},
+        qp::{QpManager, QpTable, QpTableSeqLock},
+        send_path::{SendCosts, SendPath, SendPolicy, SendThresholds},
+        snapshot::{QpRecord, StateSnapshot},
+        srq::SrqTable,
+        td::ThreadDomains,
         types::{
             ibv_qp_attr::{IbvQpAttr, IbvQpInitAttr},
-            QpAttr, RecvWr, SendWr, SendWrBase, SendWrRdma,
+            QpAttr, RecvWr, SendWr, SendWrBase, SendWrRdma, Sge,
         },
     },
+    reload::{self, ConfigWatcher, TunablesCell},
     ringbuf::DescRingBufAllocator,
+    sdt::sdt_probe,
+    startup::StartupTimings,
+    trace::hot_trace,
     workers::{
         ack_responder::AckResponder,
+        comp_channel::{CompChannels, CqModerator},
         completion::{
-            Completion, CompletionQueueTable, CompletionTask, CompletionWorker, CqManager, Event,
-            PostRecvEvent,
+            completion_queue, shared_completion_queue, AsyncEvent, AsyncEventQueue, Completion,
+            CompletionQueue, CompletionQueueTable, CompletionTask, CompletionWorker, CqManager,
+            CqSlot, Event, PostRecvEvent,
         },
-        meta_report,
-        qp_timeout::QpAckTimeoutWorker,
-        rdma::{RdmaWriteTask, RdmaWriteWorker},
+        meta_report::{self, FusedWorkers},
+        qp_timeout::{AckTimeoutTask, QpAckTimeoutWorker, QpActivity},
+        rdma::{RdmaWriteTask, RdmaWriteWorker, WrPoster},
         retransmit::PacketRetransmitWorker,
-        send::{self, SendHandle},
-        spawner::{task_channel, AbortSignal, SingleThreadTaskWorker, TaskTx},
+        send::{
+            self, BondRail, ChannelStripe, DirectDoorbell, ExportedChannels, ExportedSendQueue,
+            QpPriorities, RateControl, SendHandle, WorkReqOpCode,
+        },
+        spawner::{
+            sharded_task_channel_with, task_channel_with, AbortSignal, SingleThreadTaskWorker,
+            TaskTx, WorkerAffinity, WorkerLauncher,
+        },
+        sq_ring::SqRing,
+        wc_ring::WcRing,
     },
     RdmaError,
 };
 
 use crate::error::Result;
 
-use super::dev::HwDevice;
+use super::{dev::HwDevice, partition::ClaimedPartition};
+
+/// Limits of a context, as reported by `ibv_query_device`
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct DeviceCaps {
+    /// Number of QPs, including the reserved QPN 0
+    pub(crate) max_qp: usize,
+    /// Outstanding send WRs of a QP
+    pub(crate) max_qp_wr: usize,
+    pub(crate) max_sge: usize,
+    pub(crate) max_cq: usize,
+    pub(crate) max_cqe: usize,
+    /// MR table entries of the context, shared by the MRs and the MWs
+    pub(crate) max_mr: usize,
+    pub(crate) max_pd: usize,
+    /// RDMA READs and atomics of the peer a QP serves at once
+    pub(crate) max_qp_rd_atom: u8,
+    pub(crate) max_srq: usize,
+    pub(crate) max_srq_wr: usize,
+    pub(crate) max_inline_data: usize,
+}
+
+impl Default for DeviceCaps {
+    fn default() -> Self {
+        Self::new(DEFAULT_MAX_QP, MAX_MR_CNT)
+    }
+}
+
+impl DeviceCaps {
+    /// Returns the limits of a context owning `max_qp` QPs and `max_mr` MR table entries
+    pub(crate) fn new(max_qp: usize, max_mr: usize) -> Self {
+        Self {
+            max_qp,
+            max_qp_wr: MAX_SEND_WR,
+            max_sge: MAX_SGE,
+            max_cq: MAX_CQ_CNT,
+            max_cqe: MAX_CQE,
+            max_mr,
+            max_pd: MAX_PD_CNT,
+            max_qp_rd_atom: CONTEXT_RD_ATOMIC,
+            max_srq: MAX_SRQ_CNT,
+            max_srq_wr: MAX_SRQ_WR,
+            max_inline_data: MAX_INLINE_DATA,
+        }
+    }
+}
 
 pub(crate) trait VerbsOps {
     fn reg_mr(&mut self, addr: u64, length: usize, pd_handle: u32, access: u8) -> Result<u32>;
+    /// Pins the pages of a MR and resolves their addresses while other threads may use the
+    /// context, `None` if the MR needs `reg_mr`, nothing is pinned then
+    fn pin_mr(&self, _addr: u64, _length: usize, _access: u8) -> Option<Result<PinnedPages>> {
+        None
+    }
+    /// Registers a MR whose pages were pinned by `pin_mr`, the MR is usable once the returned
+    /// ticket is complete, see `wait_cmd`
+    fn reg_pinned_mr(
+        &mut self,
+        _pages: PinnedPages,
+        _pd_handle: u32,
+        _access: u8,
+    ) -> Result<(u32, CmdTicket)> {
+        Err(RdmaError::Unimplemented("reg_pinned_mr".into()))
+    }
+    /// Waits until the device has responded to the commands of `ticket`
+    fn wait_cmd(&self, _ticket: CmdTicket) {}
     fn dereg_mr(&mut self, mr_key: u32) -> Result<()>;
+    /// Changes the PD, the range or the access flags of a MR in place, `None` keeps the
+    /// current value. The `mr_key` is kept.
+    fn rereg_mr(
+        &mut self,
+        _mr_key: u32,
+        _pd_handle: Option<u32>,
+        _range: Option<(u64, usize)>,
+        _access: Option<u8>,
+    ) -> Result<()> {
+        Err(RdmaError::Unimplemented("rereg_mr".into()))
+    }
+    /// Registers `length` bytes at `offset` of the dma-buf `fd`, accessed at `iova`
+    fn reg_dmabuf_mr(
+        &mut self,
+        _fd: i32,
+        _offset: u64,
+        _length: usize,
+        _iova: u64,
+        _pd_handle: u32,
+        _access: u8,
+    ) -> Result<u32> {
+        Err(RdmaError::Unimplemented("reg_dmabuf_mr".into()))
+    }
+    /// Allocates `length` bytes of device memory aligned to `1 << log_align`, returns its
+    /// handle and the address the application copies from and to
+    fn alloc_dm(&mut self, _length: usize, _log_align: u32) -> Result<(u32, u64)> {
+        Err(RdmaError::Unimplemented("alloc_dm".into()))
+    }
+    /// Frees device memory, fails while MRs are registered on it
+    fn free_dm(&mut self, _handle: u32) -> Result<()> {
+        Err(RdmaError::Unimplemented("free_dm".into()))
+    }
+    /// Registers `length` bytes at `offset` of the device memory `handle` as a zero-based MR
+    fn reg_dm_mr(
+        &mut self,
+        _handle: u32,
+        _offset: usize,
+        _length: usize,
+        _pd_handle: u32,
+        _access: u8,
+    ) -> Result<u32> {
+        Err(RdmaError::Unimplemented("reg_dm_mr".into()))
+    }
+    /// Returns the limits of the context
+    fn caps(&self) -> DeviceCaps {
+        DeviceCaps::default()
+    }
     fn create_qp(&mut self, attr: IbvQpInitAttr) -> Result<u32>;
+    /// Creates a QP for each of the attributes, either all of them or none
+    fn create_qps(&mut self, attrs: &[IbvQpInitAttr]) -> Result<Vec<u32>> {
+        let mut qpns = Vec::with_capacity(attrs.len());
+        for &attr in attrs {
+            match self.create_qp(attr) {
+                Ok(qpn) => qpns.push(qpn),
+                Err(err) => {
+                    for qpn in qpns {
+                        let _ignore = self.destroy_qp(qpn);
+                    }
+                    return Err(err);
+                }
+            }
+        }
+        Ok(qpns)
+    }
+    /// Creates a RC QP whose context is only written to the device by its first
+    /// modification, so that a QP created and brought to RTS by a single `update_qp` takes
+    /// one command. The post receive channel is listening once this returns.
+    ///
+    /// # Returns
+    ///
+    /// The QP number and the local address of the QP, to hand to the peer
+    fn create_pending_qp(&mut self, _attr: IbvQpInitAttr) -> Result<(u32, Ipv4Addr)> {
+        Err(RdmaError::Unimplemented("create_pending_qp".into()))
+    }
     fn update_qp(&mut self, qpn: u32, attr: IbvQpAttr) -> Result<()>;
+    /// Returns the QPs a previous owner of the share left connected on the card, recorded in
+    /// the snapshot of the share and not reattached yet
+    fn restored_qps(&self) -> Vec<u32> {
+        Vec::new()
+    }
+    /// Creates the restored QP `qpn` again, connected as recorded. The QP resumes at its first
+    /// WR not completed before the restart, `attr` holds the settings the snapshot does not
+    /// record, such as the transport timers.
+    fn reattach_qp(&mut self, _qpn: u32, _init: IbvQpInitAttr, _attr: IbvQpAttr) -> Result<()> {
+        Err(RdmaError::Unimplemented("reattach_qp".into()))
+    }
+    /// Modifies many QPs at once.
+    ///
+    /// On failure, returns the index of the first update that was not applied, all updates
+    /// before it have been applied.
+    fn update_qps(
+        &mut self,
+        updates: &[(u32, IbvQpAttr)],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        for (i, &(qpn, attr)) in updates.iter().enumerate() {
+            self.update_qp(qpn, attr).map_err(|err| (i, err))?;
+        }
+        Ok(())
+    }
     fn destroy_qp(&mut self, qpn: u32) -> Result<()>;
-    fn create_cq(&mut self) -> Result<u32>;
+    fn create_cq(&mut self, cqe: u32) -> Result<u32>;
+    /// Creates a CQ polled through `ibv_cq_ex`, `timestamps` records the time each
+    /// completion is generated
+    fn create_cq_ex(&mut self, _cqe: u32, _timestamps: bool) -> Result<u32> {
+        Err(RdmaError::Unimplemented("create_cq_ex".into()))
+    }
     fn destroy_cq(&mut self, handle: u32) -> Result<()>;
+    /// Resizes the CQ to hold at least `cqe` completions, the completions it holds are kept
+    fn resize_cq(&mut self, _handle: u32, _cqe: u32) -> Result<()> {
+        Err(RdmaError::Unimplemented("resize_cq".into()))
+    }
+    /// Returns the completion ring the C provider polls in place, `None` if the CQ is only
+    /// polled through the driver
+    fn shared_cq_ring(&mut self, _handle: u32) -> Option<*const WcRing> {
+        None
+    }
+    /// Prefetches pages of on-demand paging MRs so that the device can access them.
+    ///
+    /// The pages are pinned before returning if `flush` is set, otherwise in the background.
+    fn advise_mr(&mut self, _pd_handle: u32, _flush: bool, _sg_list: &[Sge]) -> Result<()> {
+        Err(RdmaError::Unimplemented("advise_mr".into()))
+    }
     fn poll_cq(&mut self, handle: u32, max_num_entries: usize) -> Vec<Completion>;
+    /// Polls completions directly into the caller provided `ibv_wc` array without allocating.
+    ///
+    /// Returns the number of entries written.
+    fn poll_cq_into(&mut self, handle: u32, wc: &mut [ibverbs_sys::ibv_wc]) -> usize {
+        let completions = self.poll_cq(handle, wc.len());
+        for (entry, completion) in wc.iter_mut().zip(&completions) {
+            completion.fill_wc(entry);
+        }
+        completions.len()
+    }
+    /// Pops a single completion along with its timestamp, for `ibv_start_poll` and
+    /// `ibv_next_poll`. `start` is set for the first completion of a poll batch.
+    fn poll_cq_slot(&mut self, handle: u32, _start: bool) -> Option<CqSlot> {
+        self.poll_cq(handle, 1)
+            .pop()
+            .map(|completion| CqSlot::new(completion, 0))
+    }
+    /// Arms the CQ to generate a CQ event on its completion channel for the next completion,
+    /// or for the next solicited completion
+    fn req_notify_cq(&mut self, _handle: u32, _solicited_only: bool) -> Result<()> {
+        Err(RdmaError::Unimplemented("req_notify_cq".into()))
+    }
+    /// Moderates the CQ events of the CQ, an event is generated once `count` completions were
+    /// pushed or `period_us` microseconds elapsed since the first of them
+    fn modify_cq(&mut self, _handle: u32, _count: u16, _period_us: u16) -> Result<()> {
+        Err(RdmaError::Unimplemented("modify_cq".into()))
+    }
+    /// Delivers the CQ events of the CQ to the completion channel `channel_fd`, `cq_cookie` is
+    /// the CQ reported by `ibv_get_cq_event`
+    fn bind_comp_channel(
+        &mut self,
+        _handle: u32,
+        _channel_fd: RawFd,
+        _cq_cookie: u64,
+    ) -> Result<()> {
+        Err(RdmaError::Unimplemented("bind_comp_channel".into()))
+    }
+    /// Wakes `waker` on the next completion pushed to the CQ, for the futures of the native API
+    fn register_cq_waker(&mut self, _handle: u32, _waker: &Waker) -> Result<()> {
+        Err(RdmaError::Unimplemented("register_cq_waker".into()))
+    }
+    /// Returns the next pending asynchronous event, if any
+    fn get_async_event(&mut self) -> Option<AsyncEvent> {
+        None
+    }
     fn post_send(&mut self, qpn: u32, wr: SendWr) -> Result<()>;
+    /// Posts a chain of send work requests to the QP in a single submission.
+    ///
+    /// On failure, returns the index of the first WR that was not posted, all WRs
+    /// before it have been submitted.
+    fn post_send_batch(
+        &mut self,
+        qpn: u32,
+        wrs: &[SendWr],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        for (i, wr) in wrs.iter().copied().enumerate() {
+            self.post_send(qpn, wr).map_err(|err| (i, err))?;
+        }
+        Ok(())
+    }
+    /// Posts a chain of send WRs while other threads may post to the context, `None` if the
+    /// chain needs `post_send_batch`, nothing is posted then
+    fn post_send_shared(
+        &self,
+        _qpn: u32,
+        _wrs: &[SendWr],
+    ) -> Option<std::result::Result<(), (usize, RdmaError)>> {
+        None
+    }
+    /// Posts the entries published to the submission ring of the QP, a single doorbell for
+    /// all of them
+    fn ring_sq_doorbell(&self, _qpn: u32, _ring: &Arc<SqRing>) -> Result<()> {
+        Err(RdmaError::Unimplemented("ring_sq_doorbell".into()))
+    }
+    /// Lends a send channel withheld by `gpu_channels` to the QP, whose descriptors are then
+    /// written by a GPU to `length` bytes at `offset` of the dma-buf `fd`.
+    ///
+    /// The range must be contiguous for the device, and the QP must have no work request in
+    /// flight. The QP can't be posted to by the driver until the channel is released.
+    fn export_send_queue(
+        &mut self,
+        _qpn: u32,
+        _fd: i32,
+        _offset: u64,
+        _length: usize,
+    ) -> Result<ExportedSendQueue> {
+        Err(RdmaError::Unimplemented("export_send_queue".into()))
+    }
+    /// Takes back the send channel lent to the QP by `export_send_queue`
+    fn release_send_queue(&mut self, _qpn: u32) -> Result<()> {
+        Err(RdmaError::Unimplemented("release_send_queue".into()))
+    }
     fn post_recv(&mut self, qpn: u32, wr: RecvWr) -> Result<()>;
+    /// Posts a chain of receive WRs, failures are reported like `post_send_batch`
+    fn post_recv_batch(
+        &mut self,
+        qpn: u32,
+        wrs: &[RecvWr],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        for (i, wr) in wrs.iter().copied().enumerate() {
+            self.post_recv(qpn, wr).map_err(|err| (i, err))?;
+        }
+        Ok(())
+    }
+    /// Creates an address handle to the card at `dest`, returns its handle
+    fn create_ah(&mut self, _dest: Ipv4Addr) -> Result<u32> {
+        Err(RdmaError::Unimplemented("create_ah".into()))
+    }
+    fn destroy_ah(&mut self, _handle: u32) -> Result<()> {
+        Err(RdmaError::Unimplemented("destroy_ah".into()))
+    }
+    /// Posts a chain of send WRs to a UD QP, failures are reported like `post_send_batch`
+    fn post_send_ud(
+        &mut self,
+        _qpn: u32,
+        _wrs: &[UdSendWr],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        Err((0, RdmaError::Unimplemented("post_send_ud".into())))
+    }
+    /// Attaches a UD QP to the IPv4 multicast group `group`, the datagrams sent to the group
+    /// are received by every QP attached to it
+    fn attach_mcast(&mut self, _qpn: u32, _group: Ipv4Addr) -> Result<()> {
+        Err(RdmaError::Unimplemented("attach_mcast".into()))
+    }
+    fn detach_mcast(&mut self, _qpn: u32, _group: Ipv4Addr) -> Result<()> {
+        Err(RdmaError::Unimplemented("detach_mcast".into()))
+    }
+    /// Posts a chain of send WRs to a raw packet QP, each sending the Ethernet frame held by
+    /// its buffers. Failures are reported like `post_send_batch`.
+    fn post_send_raw(
+        &mut self,
+        _qpn: u32,
+        _wrs: &[SendWrBase],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        Err((0, RdmaError::Unimplemented("post_send_raw".into())))
+    }
+    /// Steers the received frames matching `spec` to the raw packet QP, returns the handle of
+    /// the rule
+    fn create_flow(&mut self, _qpn: u32, _spec: FlowSpec) -> Result<u32> {
+        Err(RdmaError::Unimplemented("create_flow".into()))
+    }
+    fn destroy_flow(&mut self, _handle: u32) -> Result<()> {
+        Err(RdmaError::Unimplemented("destroy_flow".into()))
+    }
+    /// Posts a chain of send WRs to a DC QP, failures are reported like `post_send_batch`
+    fn post_send_dc(
+        &mut self,
+        _qpn: u32,
+        _wrs: &[DcSendWr],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        Err((0, RdmaError::Unimplemented("post_send_dc".into())))
+    }
+    /// Posts a chain of send WRs to a XRC INI QP, failures are reported like `post_send_batch`
+    fn post_send_xrc(
+        &mut self,
+        _qpn: u32,
+        _wrs: &[XrcSendWr],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        Err((0, RdmaError::Unimplemented("post_send_xrc".into())))
+    }
+    /// Allocates a type 2 memory window, returns its handle, which is also its initial key
+    fn alloc_mw(&mut self, _pd_handle: u32) -> Result<u32> {
+        Err(RdmaError::Unimplemented("alloc_mw".into()))
+    }
+    fn dealloc_mw(&mut self, _handle: u32) -> Result<()> {
+        Err(RdmaError::Unimplemented("dealloc_mw".into()))
+    }
+    /// Executes a memory window operation posted to the send queue of the QP
+    fn post_mw(&mut self, _qpn: u32, _wr: MwWr) -> Result<()> {
+        Err(RdmaError::Unimplemented("post_mw".into()))
+    }
+    /// Creates a shared receive queue of up to `max_wr` WRs, returns its handle
+    fn create_srq(&mut self, _max_wr: u32, _srq_limit: u32) -> Result<u32> {
+        Err(RdmaError::Unimplemented("create_srq".into()))
+    }
+    fn destroy_srq(&mut self, _handle: u32) -> Result<()> {
+        Err(RdmaError::Unimplemented("destroy_srq".into()))
+    }
+    /// Resizes a SRQ and arms its limit event, `None` leaves the attribute unchanged
+    fn modify_srq(
+        &mut self,
+        _handle: u32,
+        _max_wr: Option<u32>,
+        _srq_limit: Option<u32>,
+    ) -> Result<()> {
+        Err(RdmaError::Unimplemented("modify_srq".into()))
+    }
+    /// Returns the `max_wr` and the armed `srq_limit` of a SRQ
+    fn query_srq(&mut self, _handle: u32) -> Result<(u32, u32)> {
+        Err(RdmaError::Unimplemented("query_srq".into()))
+    }
+    fn post_srq_recv(&mut self, _handle: u32, _wr: RecvWr) -> Result<()> {
+        Err(RdmaError::Unimplemented("post_srq_recv".into()))
+    }
+    /// Opens a XRC domain, returns its handle
+    fn open_xrcd(&mut self) -> Result<u32> {
+        Err(RdmaError::Unimplemented("open_xrcd".into()))
+    }
+    /// Closes a XRC domain, fails while SRQs or TGT QPs of the domain exist
+    fn close_xrcd(&mut self, _handle: u32) -> Result<()> {
+        Err(RdmaError::Unimplemented("close_xrcd".into()))
+    }
+    /// Creates a SRQ of the XRC domain `xrcd`, its receive completions are pushed to `cq`
+    fn create_xrc_srq(
+        &mut self,
+        _xrcd: u32,
+        _cq: u32,
+        _max_wr: u32,
+        _srq_limit: u32,
+    ) -> Result<u32> {
+        Err(RdmaError::Unimplemented("create_xrc_srq".into()))
+    }
+    /// Returns the SRQ number the remote INI QPs name in their WRs to reach a XRC SRQ
+    fn get_srq_num(&mut self, _handle: u32) -> Result<u32> {
+        Err(RdmaError::Unimplemented("get_srq_num".into()))
+    }
+    /// Creates a XRC TGT QP of the domain `xrcd`, returns its QPN
+    fn create_xrc_target(&mut self, _xrcd: u32) -> Result<u32> {
+        Err(RdmaError::Unimplemented("create_xrc_target".into()))
+    }
+    /// Allocates a thread domain, returns its handle
+    fn alloc_td(&mut self) -> Result<u32> {
+        Err(RdmaError::Unimplemented("alloc_td".into()))
+    }
+    /// Deallocates a thread domain, fails while QPs of the domain exist
+    fn dealloc_td(&mut self, _handle: u32) -> Result<()> {
+        Err(RdmaError::Unimplemented("dealloc_td".into()))
+    }
+    /// Moves a QP without posted WRs under the thread domain `td`
+    fn attach_td(&mut self, _qpn: u32, _td: u32) -> Result<()> {
+        Err(RdmaError::Unimplemented("attach_td".into()))
+    }
+    /// Caps the send rate of a QP, a `rate_kbps` of 0 removes the limit
+    fn modify_qp_rate_limit(&mut self, _qpn: u32, _rate_kbps: u32, _max_burst: u32) -> Result<()> {
+        Err(RdmaError::Unimplemented("modify_qp_rate_limit".into()))
+    }
+    /// Sets the size of the chunks the WRs posted to a QP from now on are split into, a
+    /// `chunk_size` of 0 restores the configured size
+    fn modify_qp_chunk_size(&mut self, _qpn: u32, _chunk_size: u32) -> Result<()> {
+        Err(RdmaError::Unimplemented("modify_qp_chunk_size".into()))
+    }
+    /// Reads the device counters in the order of `Counter::ALL`, counters beyond those of
+    /// the device are zeroed
+    fn read_counters(&self, _values: &mut [u64]) -> Result<()> {
+        Err(RdmaError::Unimplemented("read_counters".into()))
+    }
+    /// Dumps the device and per-QP counters as `<name> <value>` lines, followed by the
+    /// durations of the phases of the open as `startup/<phase>_us <value>` and the utilization
+    /// of the workers as `worker/<name>/<counter> <value>`
+    fn dump_counters(&self) -> Result<String> {
+        Err(RdmaError::Unimplemented("dump_counters".into()))
+    }
+    /// Dumps the memory held by the driver as `<pool>_bytes <value>` lines, with the highest
+    /// value of each pool as `<pool>_peak_bytes <value>`
+    fn dump_memory(&self) -> Result<String> {
+        Err(RdmaError::Unimplemented("dump_memory".into()))
+    }
+    /// Sets the loopback and the packet drops injected by the card, see
+    /// `HwDevice::inject_loss`
+    #[cfg(feature = "debug_csrs")]
+    fn inject_loss(&self, _loopback: bool, _seed: u32, _drop_thresh: u8) -> Result<()> {
+        Err(RdmaError::Unimplemented("inject_loss".into()))
+    }
+    /// Returns whether the context may be kept after its device is closed and handed to the
+    /// next open of the device
+    fn is_reusable(&self) -> bool {
+        false
+    }
     fn alloc_pd(&mut self) -> Result<u32>;
     fn dealloc_pd(&mut self, handle: u32) -> Result<()>;
 }
 
+/// Pages of a MR pinned by `VerbsOps::pin_mr`, referenced in the pin counts of the context
+#[derive(Debug)]
+pub(crate) struct PinnedPages {
+    addr: u64,
+    length: usize,
+    /// Physical address of each page
+    phys_addrs: Vec<u64>,
+}
+
 pub(crate) struct HwDeviceCtx<H: HwDevice> {
     device: H,
+    /// Second card of a bonded pair, mirroring the commands of `device`
+    secondary: Option<H>,
     mtt: Mtt,
-    mtt_buffer: DmaBuf,
+    mtt_buffer: PgtStaging,
+    /// Registrations reused across `reg_mr` calls
+    mr_cache: MrCache,
+    /// Pinned ranges referenced by each MR registered to the hardware
+    mr_pins: HashMap<u32, Vec<(u64, usize)>>,
+    /// Reference counts of pinned pages shared between MRs, also taken by `pin_mr` under the
+    /// shared lock
+    pin_count: Mutex<PinCount>,
+    /// Deregistered MRs waiting for their invalidation to complete
+    deferred_free: DeferredFreeList,
+    /// Mappings of registered dma-bufs keyed by `mr_key`
+    dmabuf_maps: HashMap<u32, DmabufMapping>,
+    /// On-demand paging MRs keyed by `mr_key`
+    odp_mrs: HashMap<u32, OdpMr>,
+    /// MRs pinned at registration keyed by `mr_key`, the MRs that can be re-registered
+    pinned_mrs: HashMap<u32, PinnedMr>,
+    /// Page mapped by the PGT entries of ODP pages that are not prefetched
+    odp_blank_page: Option<DmaBuf>,
+    /// Pins the pages of asynchronous prefetches, spawned on first use
+    prefetcher: Option<Prefetcher>,
+    /// Bounce buffer of inline sends, registered on first use
+    inline_buf: Option<InlineBuf>,
+    /// Slot states of `inline_buf`, shared with the `WrPoster`s
+    inline_slots: InlineSlots,
+    /// Path of the sends posted without `IBV_SEND_INLINE`
+    send_policy: SendPolicy,
+    /// MRs the peers may target with atomic requests, shared with the `MetaHandler`s
+    atomics: Atomics,
     qp_manager: QpManager,
-    qp_attr_table: QpTableShared<QpAttr>,
+    /// Limits reported to the applications, from the share of the context
+    caps: DeviceCaps,
+    qp_attr_table: QpTableSeqLock<QpAttr>,
     cq_manager: CqManager,
     cq_table: CompletionQueueTable,
+    /// Completion channels the CQs are bound to
+    comp_channels: CompChannels,
+    /// Enforces the moderation periods of the CQs, spawned on first use
+    cq_moderator: Option<CqModerator>,
+    async_events: AsyncEventQueue,
     cmd_controller: CommandConfigurator<H::Adaptor>,
     post_recv_tx_table: PostRecvTxTable,
     recv_wr_queue_table: RecvWrQueueTable,
+    /// In-band receive WR rings, registered on first use
+    recv_rings: Option<RecvRings>,
+    /// Worker reading the post receive channels of all QPs, spawned on first use
+    recv_worker: Option<RecvWorker>,
+    /// Large sends waiting for the peers to read them
+    pulls: PendingPulls,
+    /// Shared receive queues and the windows lent to their QPs
+    srq_table: SrqTable,
+    /// Address handles of the UD QPs
+    ah_table: AhTable,
+    ud_qps: UdQps,
+    raw_qps: RawQps,
+    /// Frames of the raw packet QPs, sent behind the ACKs on the simple NIC ring
+    raw_tx: BulkFrameTx<FrameTxQueue<H::Adaptor>>,
+    /// Receive ring of the simple NIC, read for the raw packet QPs. The buffer is never
+    /// unmapped, the card keeps writing to it.
+    raw_rx: ManuallyDrop<FrameRxQueue<H::Adaptor>>,
+    dc_qps: DcQps,
+    /// XRC domains, their SRQs and TGT QPs
+    xrc: XrcDomains,
+    /// Thread domains and the QPs created under them
+    tds: ThreadDomains,
+    /// Device memory allocations and the MRs registered on them
+    dm: DeviceMemory,
+    /// Arena of the device memory, allocated on first use
+    dm_arena: Option<DmaBuf>,
+    mw_table: MwTable,
     rdma_write_tx: TaskTx<RdmaWriteTask>,
+    /// Sets the `timeout` and the `retry_cnt` of the transport timers of the QPs
+    ack_timeout_tx: TaskTx<AckTimeoutTask>,
     completion_tx: TaskTx<CompletionTask>,
+    /// Posts WRs of direct doorbell QPs on the calling thread
+    poster: WrPoster,
+    doorbell: DirectDoorbell<H::Adaptor>,
+    /// Send channels withheld from the `SendWorker`s, lent to the QPs posted to by a GPU
+    exported: ExportedChannels<H::Adaptor>,
+    /// Starts the worker threads once the first QP is created
+    launcher: WorkerLauncher,
+    /// Send rate limits of the QPs, enforced by the `SendWorker`s
+    rate: Arc<RateControl>,
+    /// Priority classes of the QPs, served in order by the `SendWorker`s
+    priorities: Arc<QpPriorities>,
+    /// Counters of the device and of its QPs
+    counters: Arc<DeviceCounters>,
+    /// Durations of the phases of the open, reported with the counters
+    startup: StartupTimings,
+    /// Whether a QP rings the send queue doorbell directly
+    direct_qps: QpTable<bool>,
+    /// Latest configuration command submitted for each QP
+    qp_cmd_tickets: QpTable<Option<CmdTicket>>,
+    /// Peer MAC addresses from the kernel neighbour table, `None` if it cannot be watched
+    neighbours: Option<NeighbourTable>,
+    /// Reloads the tunables when the configuration file changes, `None` if it cannot be
+    /// watched
+    config_watcher: Option<ConfigWatcher>,
+    /// Flowlets of the QPs spread over the ECMP paths, `None` outside of the multipath mode
+    multipath: Option<Multipath>,
     config: DeviceConfig,
     allocator: H::DmaBufAllocator,
     pd_table: PdTable,
+    /// Share of the device owned by the context, held until the context is dropped
+    partition: ClaimedPartition,
+    /// Snapshot of the connected QPs and of the keys, `None` without `snapshot_dir`
+    snapshot: Option<Arc<StateSnapshot>>,
+    /// QPs of the previous owner of the share, their QPNs are reserved until reattached
+    restored_qps: HashMap<u32, QpRecord>,
+}
+
+/// Second card of a bonded pair brought up by `HwDeviceCtx::initialize`.
+///
+/// The rings of the card are allocated from the DMA buffer of the first card, both cards reach
+/// the host memory the same way.
+struct BondedCard<H: HwDevice> {
+    device: H,
+    adaptor: H::Adaptor,
+    cmd_controller: CommandConfigurator<H::Adaptor>,
+    meta_bufs: Vec<DmaBuf>,
+    /// Handle of the send workers on the channels of the context
+    send: SendHandle,
+    peers: Arc<BondPeers>,
+}
+
+impl<H> BondedCard<H>
+where
+    H: HwDevice,
+    H::Adaptor: DeviceAdaptor + Send + 'static,
+{
+    /// Sets the network of the card and spawns its send workers
+    #[allow(clippy::too_many_arguments)]
+    fn init<A: DmaBufAllocator>(
+        device: H,
+        rb_allocator: &mut DescRingBufAllocator<A>,
+        config: &DeviceConfig,
+        channel_ids: &[usize],
+        primary: NetworkConfig,
+        abort: &AbortSignal,
+        rate: Arc<RateControl>,
+        priorities: Arc<QpPriorities>,
+        counters: &Arc<DeviceCounters>,
+        affinity: &WorkerAffinity,
+    ) -> Result<Self> {
+        let net_config = NetConfigReader::read(device.net_index());
+        let adaptor = device.new_adaptor()?;
+        let rings = config.rings();
+        let cmd_controller = CommandConfigurator::init(
+            &adaptor,
+            rb_allocator.alloc_with_depth(rings.cmd)?,
+            rb_allocator.alloc_with_depth(rings.cmd)?,
+            rings.cmd,
+        )?;
+        cmd_controller.set_network(net_config);
+        let send_bufs = iter::repeat_with(|| rb_allocator.alloc_with_depth(rings.send))
+            .take(channel_ids.len())
+            .collect::<std::result::Result<_, _>>()?;
+        let meta_bufs = iter::repeat_with(|| rb_allocator.alloc_with_depth(rings.meta_report))
+            .take(channel_ids.len())
+            .collect::<std::result::Result<_, _>>()?;
+        let (send, _doorbell) = send::spawn(
+            &adaptor,
+            send_bufs,
+            rings.send,
+            channel_ids,
+            abort,
+            config.poll(),
+            config.doorbell(),
+            rate,
+            priorities,
+            counters,
+            affinity,
+        )?;
+        let neighbours = NeighbourTable::spawn(net_config)?;
+        debug!("second card {} initialized...", device.net_index());
+
+        Ok(Self {
+            device,
+            adaptor,
+            cmd_controller,
+            meta_bufs,
+            send,
+            peers: Arc::new(BondPeers::new(primary.ip, net_config, neighbours)),
+        })
+    }
 }
 
 #[allow(private_bounds)]
@@ -93,367 +766,1283 @@ where
     H::DmaBufAllocator: DmaBufAllocator,
     H::UmemHandler: UmemHandler,
 {
-    pub(crate) fn initialize(device: H, config: DeviceConfig) -> Result<Self> {
+    /// Initializes the device, `secondary` is bonded with it if set, see `BondConfig`
+    ///
+    /// The phases of the initialization are added to `timings`, which holds those of the
+    /// open so far. The QPs recorded in `snapshot` resume their connections, the device must
+    /// not have been reset then.
+    pub(crate) fn initialize(
+        device: H,
+        secondary: Option<H>,
+        config: DeviceConfig,
+        partition: ClaimedPartition,
+        snapshot: Option<StateSnapshot>,
+        mut timings: StartupTimings,
+    ) -> Result<Self> {
         debug!("begin initializ...");
-        let mode = Mode::default();
-        let net_config = NetConfigReader::read();
         debug!("begin device adaptor initializ...");
         let adaptor = device.new_adaptor()?;
         debug!("device adaptor initialized...");
+        let mode = ModeProxy(adaptor.clone()).mode()?;
+        debug!("device mode: {mode:?}");
+        timings.phase("adaptor");
+        let share = partition.partition();
+        let channel_ids = share.channels(mode.channel_ids());
+        if channel_ids.is_empty() {
+            return Err(RdmaError::ResourceExhausted(format!(
+                "{} channels can't be split between {} contexts",
+                mode.num_channel(),
+                share.contexts()
+            )));
+        }
+        // The channels lent to the GPUs are taken from the end of the share
+        let Some(num_sw) = channel_ids
+            .len()
+            .checked_sub(config.gpu_channels())
+            .filter(|&n| n > 0)
+        else {
+            return Err(RdmaError::ResourceExhausted(format!(
+                "gpu_channels = {} leaves none of the {} channels to the driver",
+                config.gpu_channels(),
+                channel_ids.len()
+            )));
+        };
+        let (sw_channel_ids, gpu_channel_ids) = channel_ids.split_at(num_sw);
+        let net_config = NetConfigReader::read(device.net_index());
+        timings.phase("net_config");
         let mut allocator = device.new_dma_buf_allocator()?;
         let mut rb_allocator = DescRingBufAllocator::new(&mut allocator);
-        let cmd_controller =
-            CommandConfigurator::init(&adaptor, rb_allocator.alloc()?, rb_allocator.alloc()?)?;
+        let rings = config.rings();
+        let cmd_req_buf = rb_allocator.alloc_with_depth(rings.cmd)?;
+        let cmd_resp_buf = rb_allocator.alloc_with_depth(rings.cmd)?;
+        timings.phase("alloc_cmd_rings");
+        let mut cmd_controller =
+            CommandConfigurator::init(&adaptor, cmd_req_buf, cmd_resp_buf, rings.cmd)?;
+        timings.phase("cmd_init");
         debug!("command queue request controller initialized...");
-        let send_bufs = iter::repeat_with(|| rb_allocator.alloc())
-            .take(mode.num_channel())
+        let send_bufs = iter::repeat_with(|| rb_allocator.alloc_with_depth(rings.send))
+            .take(sw_channel_ids.len())
             .collect::<std::result::Result<_, _>>()?;
-        let meta_bufs = iter::repeat_with(|| rb_allocator.alloc())
-            .take(mode.num_channel())
+        timings.phase("alloc_send_rings");
+        let meta_bufs = iter::repeat_with(|| rb_allocator.alloc_with_depth(rings.meta_report))
+            .take(channel_ids.len())
             .collect::<std::result::Result<_, _>>()?;
+        timings.phase("alloc_meta_rings");
 
-        let (rdma_write_tx, rdma_write_rx) = task_channel();
-        let (completion_tx, completion_rx) = task_channel();
-        let (ack_timeout_tx, ack_timeout_rx) = task_channel();
-        let (packet_retransmit_tx, packet_retransmit_rx) = task_channel();
-        let (ack_tx, ack_rx) = task_channel();
+        // The fused pipeline drains the completions of all QPs on the `MetaWorker`
+        let completion_shards = if config.fused_pipeline() {
+            1
+        } else {
+            config.worker_shards()
+        };
+        let (rdma_write_tx, rdma_write_rxs) = sharded_task_channel_with(
+            config.channel(),
+            config.worker_shards(),
+            RdmaWriteTask::shard_key,
+        );
+        let (completion_tx, mut completion_rxs) = sharded_task_channel_with(
+            config.channel(),
+            completion_shards,
+            CompletionTask::shard_key,
+        );
+        let (ack_timeout_tx, ack_timeout_rx) = task_channel_with(config.channel());
+        let (packet_retransmit_tx, packet_retransmit_rx) = task_channel_with(config.channel());
+        let (ack_tx, ack_rx) = task_channel_with(config.channel());
 
+        latency::init();
         let abort = AbortSignal::new();
-        let rx_buffer = rb_allocator.alloc()?;
+        // The workers of the data path are started by the first QP
+        let launcher = WorkerLauncher::new();
+        let affinity = WorkerAffinity::new(
+            config.affinity().workers.clone(),
+            config
+                .affinity()
+                .default
+                .clone()
+                .or_else(|| device.local_cpus())
+                .unwrap_or_default(),
+        )
+        .with_launcher(launcher.clone());
+        let simple_nic = config.simple_nic();
+        let rx_buffer = rb_allocator.alloc_bytes(simple_nic.buffer_len(rings.simple_nic))?;
         let rx_buffer_pa = rx_buffer.phys_addr;
-        let qp_attr_table =
-            QpTableShared::new_with(|| QpAttr::new_with_ip(net_config.ip.ip().to_bits()));
+        timings.phase("alloc_simple_nic_rx");
+        let ip = net_config.ip.ip().to_bits();
+        let qp_attr_table = QpTableSeqLock::new_with(move || QpAttr::new_with_ip(ip));
         
         debug!("qp table initialized...");
-        let qp_manager = QpManager::new();
+        let mut qp_manager =
+            QpManager::with_share(config.max_qp(), share.share(config.max_qp()));
+        let snapshot = snapshot.map(Arc::new);
+        let restored: Vec<_> = snapshot
+            .as_deref()
+            .map(StateSnapshot::qps)
+            .unwrap_or_default()
+            .into_iter()
+            .filter(|qp| qp_manager.reserve(qp.qpn))
+            .collect();
+        let counters = Arc::new(DeviceCounters::new(qp_manager.max_qp()));
         let cq_manager = CqManager::new();
         let cq_table = CompletionQueueTable::new();
+        let async_events = AsyncEventQueue::new();
+        timings.phase("tables");
+        let simple_nic_tx_ring = rb_allocator.alloc_with_depth(rings.simple_nic)?;
+        let simple_nic_rx_ring = rb_allocator.alloc_with_depth(rings.simple_nic)?;
+        let simple_nic_tx_buffer =
+            rb_allocator.alloc_bytes(simple_nic.buffer_len(rings.simple_nic))?;
+        timings.phase("alloc_simple_nic_rings");
         let simple_nic_controller = SimpleNicController::init(
             &adaptor,
-            rb_allocator.alloc()?,
-            rb_allocator.alloc()?,
-            rb_allocator.alloc()?,
+            simple_nic_tx_ring,
+            simple_nic_rx_ring,
+            simple_nic_tx_buffer,
             rx_buffer,
+            rings.simple_nic,
+            simple_nic.slot_size,
         )?;
+        // The frames of the netdev larger than a slot would be dropped by the card
+        if let Some(mtu) = simple_nic.mtu {
+            if let Err(err) = set_netdev_mtu(device.net_index(), mtu) {
+                warn!("failed to set the netdev MTU to {mtu}: {err}");
+            }
+        }
+        timings.phase("simple_nic_init");
         debug!("simple_nic_controller initialized...");
         let (simple_nic_tx, simple_nic_rx) = simple_nic_controller.into_split();
-        let handle = send::spawn(&adaptor, send_bufs, mode, &abort)?;
-        AckResponder::new(qp_attr_table.clone(), Box::new(simple_nic_tx)).spawn(
-            ack_rx,
-            "AckResponder",
-            abort.clone(),
-        );
-        PacketRetransmitWorker::new(handle.clone()).spawn(
-            packet_retransmit_rx,
-            "PacketRetransmitWorker",
-            abort.clone(),
-        );
-        QpAckTimeoutWorker::new(packet_retransmit_tx.clone(), config.ack()).spawn_polling(
+        let (control_tx, raw_tx) = simple_nic::split(simple_nic_tx);
+        let tunables = TunablesCell::new(config.tunables());
+        reload::apply_log_level(tunables.load());
+        let rate = Arc::new(RateControl::new(&config.congestion()));
+        let priorities = Arc::new(QpPriorities::new());
+        let (handle, doorbell) = send::spawn(
+            &adaptor,
+            send_bufs,
+            rings.send,
+            sw_channel_ids,
+            &abort,
+            config.poll(),
+            config.doorbell(),
+            Arc::clone(&rate),
+            Arc::clone(&priorities),
+            &counters,
+            &affinity,
+        )?;
+        timings.phase("spawn_send_workers");
+        let bonded = secondary
+            .map(|card| {
+                BondedCard::init(
+                    card,
+                    &mut rb_allocator,
+                    &config,
+                    &channel_ids,
+                    net_config,
+                    &abort,
+                    Arc::clone(&rate),
+                    Arc::clone(&priorities),
+                    &counters,
+                    &affinity,
+                )
+            })
+            .transpose()?;
+        timings.phase("bond");
+        // Set before the handle is cloned, so that retransmitted chunks are striped as well
+        let handle = match bonded.as_ref() {
+            Some(card) => handle.with_rail(BondRail::new(
+                card.send.clone(),
+                Arc::clone(&card.peers),
+                config.bond().stripe_min_bytes(),
+            )),
+            None => handle,
+        };
+        let handle = if config.stripe().enabled {
+            handle.with_stripe(ChannelStripe::new(config.stripe()))
+        } else {
+            handle
+        };
+        let ack_responder = AckResponder::new(
+            qp_attr_table.clone(),
+            Box::new(control_tx),
+            config.ack_coalesce(),
+        )
+        .with_tunables(tunables.watch());
+        let activity = Arc::new(QpActivity::new());
+        PacketRetransmitWorker::new(handle.clone(), config.retransmit(), Arc::clone(&activity))
+            .spawn(
+                packet_retransmit_rx,
+                "PacketRetransmitWorker",
+                abort.clone(),
+                &affinity,
+            );
+        QpAckTimeoutWorker::new(
+            packet_retransmit_tx.clone(),
+            config.ack(),
+            Arc::clone(&activity),
+            Arc::clone(&counters),
+        )
+        .with_tunables(tunables.watch())
+        .spawn_polling(
             ack_timeout_rx,
             "QpAckTimeoutWorker",
             abort.clone(),
             Duration::from_nanos(4096u64 << config.ack().check_duration_exp),
+            &affinity,
         );
         
-        RdmaWriteWorker::new(
+        let inline_slots = InlineSlots::new();
+        let atomics = Atomics::new();
+        let pulls = PendingPulls::default();
+        let poster = WrPoster::new(
             qp_attr_table.clone(),
-            handle,
             ack_timeout_tx.clone(),
             packet_retransmit_tx.clone(),
             completion_tx.clone(),
-        )
-        .spawn(rdma_write_rx, "RdmaWriteWorker", abort.clone());
+            inline_slots.clone(),
+            atomics.clone(),
+        );
+        for qp in &restored {
+            poster.resume(qp.qpn, qp.send_msn, qp.send_psn);
+        }
+        let num_write_shards = rdma_write_rxs.len();
+        for (index, rx) in rdma_write_rxs.into_iter().enumerate() {
+            let name = shard_name("RdmaWriteWorker", index, num_write_shards);
+            RdmaWriteWorker::new(poster.clone(), handle.clone())
+                .with_write_coalesce(config.write_coalesce())
+                .spawn(rx, &name, abort.clone(), &affinity);
+        }
 
-        CompletionWorker::new(
-            cq_table.clone_arc(),
+        let completion_worker = CompletionWorker::new(
+            async_events.clone(),
             qp_attr_table.clone(),
             ack_tx.clone(),
             ack_timeout_tx.clone(),
             rdma_write_tx.clone(),
+            Arc::clone(&counters),
+            config.recv_stride(),
         )
-        .spawn(completion_rx, "CompletionWorker", abort.clone());
+        .with_snapshot(snapshot.clone());
+        let fused = if config.fused_pipeline() {
+            let completion_rx = completion_rxs.pop().unwrap_or_else(|| unreachable!());
+            Some(FusedWorkers::new(
+                completion_worker,
+                completion_rx,
+                ack_responder,
+                ack_rx,
+            ))
+        } else {
+            ack_responder.spawn(ack_rx, "AckResponder", abort.clone(), &affinity);
+            let num_completion_shards = completion_rxs.len();
+            let shards: Vec<_> = iter::repeat_with(|| completion_worker.new_shard())
+                .take(num_completion_shards - 1)
+                .collect();
+            let workers = iter::once(completion_worker).chain(shards);
+            for (index, (worker, rx)) in workers.zip(completion_rxs).enumerate() {
+                let name = shard_name("CompletionWorker", index, num_completion_shards);
+                worker.spawn(rx, &name, abort.clone(), &affinity);
+            }
+            None
+        };
+        timings.phase("spawn_workers");
 
         meta_report::spawn(
             &adaptor,
             meta_bufs,
-            mode,
+            rings.meta_report,
+            &channel_ids,
             ack_tx.clone(),
-            ack_timeout_tx.clone(),
+            Arc::clone(&activity),
             packet_retransmit_tx.clone(),
             completion_tx.clone(),
             rdma_write_tx.clone(),
+            Arc::clone(&rate),
+            Arc::clone(&counters),
+            config.range_retransmit(),
+            config.native_read(),
+            atomics.clone(),
+            pulls.clone(),
+            config.psn_window(),
+            &restored,
+            fused,
+            config.meta_worker_per_channel(),
             abort.clone(),
+            config.poll(),
+            meta_interrupts(&device, &config)?.as_ref(),
+            &affinity,
         )?;
+        timings.phase("spawn_meta_workers");
         debug!("meta_report worker spawn called...");
+        let exported = ExportedChannels::new(adaptor.clone(), gpu_channel_ids);
 
-        cmd_controller.set_network(net_config);
-        debug!("set network param finished...");
-        cmd_controller.set_raw_packet_recv_buffer(RecvBufferMeta::new(rx_buffer_pa));
-        debug!("set_raw_packet_recv_buffer finished...");
+        cmd_controller.submit_batch([
+            net_config.into(),
+            RecvBufferMeta::new(rx_buffer_pa).into(),
+        ]);
+        timings.phase("set_network");
+        debug!("set network param and raw packet recv buffer finished...");
+
+        // The reports of the second card go to the same workers, so that the chunks of a WR
+        // are tracked together whichever card carried them
+        let secondary = match bonded {
+            Some(card) => {
+                meta_report::spawn(
+                    &card.adaptor,
+                    card.meta_bufs,
+                    rings.meta_report,
+                    &channel_ids,
+                    ack_tx.clone(),
+                    activity,
+                    packet_retransmit_tx.clone(),
+                    completion_tx.clone(),
+                    rdma_write_tx.clone(),
+                    Arc::clone(&rate),
+                    Arc::clone(&counters),
+                    config.range_retransmit(),
+                    config.native_read(),
+                    atomics.clone(),
+                    pulls.clone(),
+                    config.psn_window(),
+                    &restored,
+                    None,
+                    config.meta_worker_per_channel(),
+                    abort.clone(),
+                    config.poll(),
+                    meta_interrupts(&card.device, &config)?.as_ref(),
+                    &affinity,
+                )?;
+                cmd_controller.set_mirror(card.cmd_controller, card.peers);
+                Some(card.device)
+            }
+            None => None,
+        };
+        timings.phase("spawn_meta_workers");
+        if let Some(snapshot) = snapshot.as_deref() {
+            invalidate_recorded_keys(&cmd_controller, snapshot, !restored.is_empty());
+            timings.phase("invalidate_keys");
+        }
+        if !restored.is_empty() {
+            info!("{} QPs of the snapshot can be reattached", restored.len());
+        }
 
-        #[allow(clippy::mem_forget)]
-        std::mem::forget(simple_nic_rx); // prevent libc::munmap being called
+        let neighbours = NeighbourTable::spawn(net_config)
+            .map_err(|err| error!("failed to watch neighbour table: {err}"))
+            .ok();
+        let config_watcher = ConfigWatcher::spawn(tunables, Arc::clone(&rate), launcher.clone())
+            .map_err(|err| warn!("config reload disabled, failed to watch the config: {err}"))
+            .ok();
+        timings.phase("watchers");
+        let mtt_buffer = PgtStaging::new(rb_allocator.alloc()?);
+        timings.phase("alloc_mtt_buffer");
+        let send_policy = tune_send_policy(&ModeProxy(adaptor.clone()), &config);
+        timings.phase("tune_send_path");
+        timings.log();
+
+        let mr_keys = share.share(MAX_MR_CNT);
+        // The key of the receive WR rings is reserved in the last share
+        let reserved = usize::from(mr_keys.contains(&(MAX_MR_CNT - 1)));
+        let caps = DeviceCaps::new(qp_manager.max_qp(), mr_keys.len() - reserved);
 
         Ok(Self {
             device,
+            secondary,
             cmd_controller,
             qp_manager,
+            caps,
             qp_attr_table,
             cq_manager,
             cq_table,
-            mtt_buffer: rb_allocator.alloc()?,
-            mtt: Mtt::new(),
+            comp_channels: CompChannels::new(),
+            cq_moderator: None,
+            async_events,
+            mtt_buffer,
+            mtt: Mtt::with_shares(mr_keys, share.share(PGT_LEN)),
+            mr_cache: MrCache::new(config.mr_cache().capacity),
+            mr_pins: HashMap::new(),
+            pin_count: Mutex::new(PinCount::new()),
+            deferred_free: DeferredFreeList::new(),
+            dmabuf_maps: HashMap::new(),
+            odp_mrs: HashMap::new(),
+            pinned_mrs: HashMap::new(),
+            odp_blank_page: None,
+            prefetcher: None,
+            inline_buf: None,
+            inline_slots,
+            send_policy,
+            atomics,
             post_recv_tx_table: PostRecvTxTable::new(),
-            recv_wr_queue_table: RecvWrQueueTable::new(),
+            recv_wr_queue_table: RecvWrQueueTable::new(config.recv_stride()),
+            recv_rings: None,
+            recv_worker: None,
+            pulls,
+            srq_table: SrqTable::new(),
+            ah_table: AhTable::new(),
+            ud_qps: UdQps::new(),
+            raw_qps: RawQps::new(simple_nic.slot_size),
+            raw_tx,
+            raw_rx: ManuallyDrop::new(simple_nic_rx),
+            dc_qps: DcQps::new(),
+            xrc: XrcDomains::new(),
+            tds: ThreadDomains::new(),
+            dm: DeviceMemory::new(DM_ARENA_SIZE),
+            dm_arena: None,
+            mw_table: MwTable::new(),
             rdma_write_tx,
+            ack_timeout_tx,
             completion_tx,
+            poster,
+            doorbell,
+            exported,
+            launcher,
+            rate,
+            priorities,
+            counters,
+            startup: timings,
+            direct_qps: QpTable::new(),
+            qp_cmd_tickets: QpTable::new(),
+            neighbours,
+            config_watcher,
+            multipath: config
+                .multipath()
+                .enabled
+                .then(|| Multipath::new(config.multipath())),
             config,
             allocator,
             pd_table: PdTable::new(),
+            partition,
+            snapshot,
+            restored_qps: restored.into_iter().map(|qp| (qp.qpn, qp)).collect(),
         })
     }
 }
 
-impl<H: HwDevice> HwDeviceCtx<H> {
-    fn send(&self, qpn: u32, mut wr: SendWrBase) -> Result<()> {
-        match self.recv_wr_queue_table.pop(qpn) {
-            Some(x) => {
-                if wr.length != x.length {
-                    return Err(RdmaError::InvalidInput(
-                        "Send length does not match receive length".into(),
-                    ));
-                }
-                let wr = SendWrRdma::new_from_base(wr, x.addr, x.lkey);
-                self.rdma_write(qpn, wr);
+impl<H> HwDeviceCtx<H>
+where
+    H: HwDevice,
+    H::Adaptor: DeviceAdaptor,
+    H::DmaBufAllocator: DmaBufAllocator,
+    H::UmemHandler: UmemHandler + Send + 'static,
+{
+    fn send(&mut self, qpn: u32, wr: SendWrBase) -> Result<()> {
+        match self.resolve_send(qpn, wr)? {
+            Some(wr) if self.offer_pull(qpn, &wr) => Ok(()),
+            Some(wr) => self.rdma_write(qpn, wr),
+            None => Ok(()),
+        }
+    }
 
-                Ok(())
+    /// Asks the peer to read a large send resolved against one of its receive WRs, instead of
+    /// writing it.
+    ///
+    /// The peer reads the send buffer into the receive WR, and the response to the read
+    /// completes the send once acknowledged.
+    ///
+    /// # Returns
+    ///
+    /// `false` if the send is to be written
+    fn offer_pull(&mut self, qpn: u32, wr: &SendWrRdma) -> bool {
+        let pulled = self
+            .send_policy
+            .thresholds()
+            .rendezvous_min
+            .is_some_and(|min| wr.length() >= min);
+        // The copied sends were counted once staged
+        if !pulled || wr.send_flags() & ibverbs_sys::ibv_send_flags::IBV_SEND_INLINE.0 != 0 {
+            return false;
+        }
+        if wr.opcode() != WorkReqOpCode::Send
+            || wr.sg_list().len() > 1
+            || self.config.native_read()
+            || self.config.recv_stride() != 0
+            || self.is_direct(qpn)
+        {
+            self.send_policy.record(SendPath::Dma);
+            return false;
+        }
+        let Some(tx) = self.post_recv_tx_table.get_qp_mut(qpn) else {
+            self.send_policy.record(SendPath::Dma);
+            return false;
+        };
+        let pull = PendingPull::new(wr);
+        self.pulls.insert(qpn, pull);
+        if let Err(err) = tx.send_pull(PullRequest::new(wr)) {
+            error!("failed to send pull request of qp {qpn}: {err}");
+            let _ignore = self.pulls.take(qpn, pull.addr, pull.length);
+            self.send_policy.record(SendPath::Dma);
+            return false;
+        }
+        self.send_policy.record(SendPath::Rendezvous);
+
+        true
+    }
+
+    /// Resolves a send WR into an RDMA write targeting the next posted receive buffer
+    ///
+    /// # Returns
+    ///
+    /// `None` if no receive buffer is posted yet, the send is then submitted by the
+    /// `RecvWorker`, or by the progress of the in-band rings, once the remote end posts one
+    fn resolve_send(&mut self, qpn: u32, wr: SendWrBase) -> Result<Option<SendWrRdma>> {
+        self.wait_qp_configured(qpn);
+        self.steer_flowlet(qpn);
+        self.progress_recv_ring(qpn);
+        let resolved = self.recv_wr_queue_table.resolve(qpn, wr)?;
+        if resolved.is_none() {
+            self.counters.add(qpn, Counter::RnrEvents, 1);
+            if let Some(rings) = self.recv_rings.as_mut() {
+                rings.set_active(qpn, true);
             }
-            None => todo!("return rnr error"),
         }
+
+        Ok(resolved)
     }
 
-    fn rdma_read(&self, qpn: u32, wr: SendWrRdma) {
-        let task = RdmaWriteTask::new_write(qpn, wr);
-        self.rdma_write_tx.send(task);
+    /// Exchanges the in-band receive WR advertisements of a QP with its peer.
+    ///
+    /// Receive WRs waiting for credits are advertised to the peer, and the receive WRs
+    /// advertised by the peer are matched with the sends waiting for them.
+    fn progress_recv_ring(&mut self, qpn: u32) {
+        let Some(rings) = self.recv_rings.as_mut() else {
+            return;
+        };
+        let mut writes = rings.flush(qpn);
+        let (recv_wrs, credit) = rings.poll(qpn);
+        writes.extend(credit);
+        for recv_wr in recv_wrs {
+            for wr in self.recv_wr_queue_table.push(qpn, recv_wr) {
+                match wr {
+                    Ok(wr) => writes.push(wr),
+                    Err(err) => error!("failed to resolve pending send of qp {qpn}: {err}"),
+                }
+            }
+        }
+        let active = rings.has_backlog(qpn) || self.recv_wr_queue_table.has_pending(qpn);
+        rings.set_active(qpn, active);
+        if !writes.is_empty() {
+            self.wait_qp_configured(qpn);
+            self.rdma_write_tx
+                .send(RdmaWriteTask::new_write_batch(qpn, writes));
+        }
     }
 
-    fn rdma_write(&self, qpn: u32, wr: SendWrRdma) {
-        let task = RdmaWriteTask::new_write(qpn, wr);
-        self.rdma_write_tx.send(task);
+    /// Returns the MAC address of the next hop to `ip`, the card address if it is not
+    /// resolved yet
+    fn peer_mac(&self, ip: u32) -> u64 {
+        self.neighbours
+            .as_ref()
+            .filter(|_| ip != 0)
+            .and_then(|neighbours| neighbours.resolve(Ipv4Addr::from_bits(ip)))
+            .unwrap_or(CARD_MAC_ADDRESS)
     }
-}
 
-impl<H> VerbsOps for HwDeviceCtx<H>
-where
-    H: HwDevice,
-    H::Adaptor: DeviceAdaptor + Send + 'static,
-    H::UmemHandler: UmemHandler,
-{
-    fn reg_mr(&mut self, addr: u64, length: usize, pd_handle: u32, access: u8) -> Result<u32> {
-        fn chunks(entry: PgtEntry) -> Vec<PgtEntry> {
-            /// Maximum number of Page Table entries (PGT entries) that can be allocated in a single `PCIe` transaction.
-            /// A `PCIe` transaction size is 128 bytes, and each PGT entry is a u64 (8 bytes).
-            /// Therefore, 128 bytes / 8 bytes per entry = 16 entries per allocation.
-            const MAX_NUM_PGT_ENTRY_PER_ALLOC: usize = 16;
-
-            let base_index = entry.index;
-            let end_index = base_index + entry.count;
-            (base_index..end_index)
-                .step_by(MAX_NUM_PGT_ENTRY_PER_ALLOC)
-                .map(|index| PgtEntry {
-                    index,
-                    count: (MAX_NUM_PGT_ENTRY_PER_ALLOC as u32).min(end_index - index),
-                })
-                .collect()
+    /// Reconfigures the connected QPs whose next hop got a new MAC address.
+    ///
+    /// The commands are not waited for, nor recorded as the latest command of the QPs, so
+    /// that posts to the QPs do not stall on them.
+    fn apply_neighbour_changes(&mut self) {
+        let Some(neighbours) = self.neighbours.as_ref() else {
+            return;
+        };
+        let mut entries = Vec::new();
+        neighbours.for_each_change(|hop, mac| {
+            for key in self.qp_manager.iter_allocated() {
+                let entry = self.qp_attr_table.map_qp_mut(key, |current| {
+                    let dst = Ipv4Addr::from_bits(current.dqp_ip);
+                    if current.dqp_ip == 0
+                        || current.mac_addr == mac
+                        || !neighbours.is_reached_through(dst, hop)
+                    {
+                        return None;
+                    }
+                    current.mac_addr = mac;
+                    current.refresh_send_template();
+                    Some(qp_context(current))
+                });
+                entries.extend(entry.flatten());
+            }
+        });
+        if !entries.is_empty() {
+            debug!("neighbour change updates {} QPs", entries.len());
+            let _ticket = self
+                .cmd_controller
+                .submit(entries.into_iter().map(Into::into));
         }
+    }
 
-        let umem_handler = self.device.new_umem_handler();
-        umem_handler.pin_pages(addr, length)?;
-        let num_pages = get_num_page(addr, length);
-        debug!("generate page table entries: addr=0x{addr:x}, length=0x{length:x} --> num_pages={num_pages}");
-        let (mr_key, pgt_entry) = self.mtt.register(num_pages)?;
-        let length_u32 = u32::try_from(length)
-            .map_err(|_err| RdmaError::InvalidInput("Length too large".into()))?;
-        let phys_addrs = umem_handler
-            .virt_to_phys_range(addr, num_pages)?
-            .into_iter()
-            .collect::<Option<Vec<_>>>()
-            .ok_or(RdmaError::MemoryError("Physical address not found".into()))?;
-        let phys_addrs_for_debug = phys_addrs.clone();
-            // .into_iter();
-        let buf = &mut self.mtt_buffer.buf;
-        let base_index = pgt_entry.index;
-        let mtt_update = MttUpdate::new(addr, length_u32, mr_key, pd_handle, access, base_index);
-        // TODO: makes updates atomic
-        self.cmd_controller.update_mtt(mtt_update);
-        let mut phys_addrs = phys_addrs.into_iter();
-        for PgtEntry { index, count } in chunks(pgt_entry) {
-            let bytes: Vec<u8> = phys_addrs
-                .by_ref()
-                .take(count as usize)
-                .flat_map(u64::to_ne_bytes)
-                .collect();
-            buf.copy_from(0, &bytes);
-            let pgt_update = PgtUpdate::new(self.mtt_buffer.phys_addr, index, count - 1);
-            debug!("new pgt update request: {pgt_update:?}");
-            let mut va_start_for_debug = addr & (!(PAGE_SIZE as u64));
-            for phy_addr in &phys_addrs_for_debug {
-                debug!("pgt map va -> pa: 0x{va_start_for_debug:x} -> 0x{phy_addr:x}");
-                va_start_for_debug += (PAGE_SIZE as u64);
-            }
-            self.cmd_controller.update_pgt(pgt_update);
+    /// Creates a CQ, `shared` keeps its entries in a ring the C provider polls in place
+    fn alloc_cq(&mut self, cqe: u32, timestamps: bool, shared: bool) -> Result<u32> {
+        let handle = self
+            .cq_manager
+            .create_cq()
+            .ok_or(RdmaError::ResourceExhausted("No CQ available".into()))?;
+        let queue = if shared
+            && self.srq_table.is_empty()
+            && self.ud_qps.is_empty()
+            && self.raw_qps.is_empty()
+            && self.dc_qps.is_empty()
+        {
+            shared_completion_queue(handle, cqe as usize)
+        } else {
+            completion_queue(handle, cqe as usize)
+        };
+        let Some((mut producer, cq)) = queue else {
+            let _ignore = self.cq_manager.destroy_cq(handle);
+            return Err(RdmaError::InvalidInput(format!(
+                "CQ size {cqe} exceeds the maximum of {MAX_CQE}"
+            )));
+        };
+        if timestamps {
+            producer.enable_timestamps();
         }
+        self.cq_table.insert(handle, cq);
+        self.completion_tx
+            .send(CompletionTask::CreateCq { producer });
 
-        Ok(mr_key)
+        Ok(handle)
     }
 
-    fn dereg_mr(&mut self, mr_key: u32) -> Result<()> {
-        self.mtt.deregister(mr_key)
+    /// Allocates a QP, returns the QP context to write to the device, `None` for QPs without
+    /// a device context
+    fn alloc_qp(&mut self, attr: IbvQpInitAttr) -> Result<(u32, Option<UpdateQp>)> {
+        self.alloc_qp_at(attr, None)
     }
 
-    fn create_qp(&mut self, attr: IbvQpInitAttr) -> Result<u32> {
-        let qpn = self
-            .qp_manager
-            .create_qp()
-            .ok_or(RdmaError::ResourceExhausted(
-                "No QP numbers available".into(),
-            ))?;
+    /// Allocates a QP at `reserved`, the QPN of a restored QP, or else at a new QPN
+    fn alloc_qp_at(
+        &mut self,
+        attr: IbvQpInitAttr,
+        reserved: Option<u32>,
+    ) -> Result<(u32, Option<UpdateQp>)> {
+        if let Some(srq) = attr.srq() {
+            let _attr = self.srq_table.query(srq)?;
+        }
+        if attr.max_send_wr() as usize > MAX_SEND_WR {
+            return Err(RdmaError::InvalidInput(format!(
+                "max_send_wr {} exceeds {MAX_SEND_WR}",
+                attr.max_send_wr()
+            )));
+        }
+        let qpn = match reserved {
+            Some(qpn) => qpn,
+            None => self
+                .qp_manager
+                .create_qp()
+                .ok_or(RdmaError::ResourceExhausted(
+                    "No QP numbers available".into(),
+                ))?,
+        };
+        self.launcher.start();
+        self.counters.reset_qp(qpn);
+        self.poster.credits().reset(qpn, attr.max_send_wr());
+        let chunk_size = self.config.chunk().size;
+        let relaxed_completion = self.config.relaxed_completion();
+        let udp_port = self
+            .multipath
+            .as_ref()
+            .map_or(DEFAULT_UDP_PORT, |x| x.initial_port(qpn));
         let _ignore = self.qp_attr_table.map_qp_mut(qpn, |current| {
             current.qpn = qpn;
+            current.chunk_size = chunk_size;
+            current.udp_port = udp_port;
             current.qp_type = attr.qp_type();
             current.send_cq = attr.send_cq();
             current.recv_cq = attr.recv_cq();
             current.mac_addr = CARD_MAC_ADDRESS;
             current.pmtu = ibverbs_sys::IBV_MTU_4096 as u8;
+            current.owner_qpn = None;
+            current.relaxed_completion = relaxed_completion;
+            current.refresh_send_template();
         });
+        if attr.qp_type() == ibverbs_sys::ibv_qp_type::IBV_QPT_UD as u8 {
+            return self.create_ud_qp(qpn, attr).map(|qpn| (qpn, None));
+        }
+        if attr.qp_type() == ibverbs_sys::ibv_qp_type::IBV_QPT_RAW_PACKET as u8 {
+            return self.create_raw_qp(qpn, attr).map(|qpn| (qpn, None));
+        }
+        if attr.qp_type() == ibverbs_sys::ibv_qp_type::IBV_QPT_DRIVER as u8
+            || is_xrc(attr.qp_type())
+        {
+            return self.create_dc_qp(qpn, attr).map(|qpn| (qpn, None));
+        }
         let entry = UpdateQp {
             ip_addr: 0,
             peer_mac_addr: 0,
-            local_udp_port: 0x100,
+            local_udp_port: udp_port,
             qp_type: attr.qp_type(),
             qpn,
             ..Default::default()
         };
-        self.cmd_controller.update_qp(entry);
+        let direct = self.config.direct_doorbell();
+        let _ignore = self.direct_qps.replace(qpn, direct);
+        if let Some(srq) = attr.srq() {
+            self.srq_table.attach(srq, qpn)?;
+        }
+
+        Ok((qpn, Some(entry)))
+    }
+
+    /// Opens the datagram socket of a new UD QP, no QP context is written to the device
+    fn create_ud_qp(&mut self, qpn: u32, attr: IbvQpInitAttr) -> Result<u32> {
+        let ip = self.qp_attr_table.map_qp(qpn, |current| current.ip);
+        let result = if attr.srq().is_some() {
+            Err(RdmaError::InvalidInput(
+                "UD QPs can't receive from a SRQ".into(),
+            ))
+        } else {
+            ip.ok_or(RdmaError::NotFound(format!("QP {qpn} not found")))
+                .and_then(|ip| {
+                    self.ud_qps
+                        .create(qpn, Ipv4Addr::from_bits(ip))
+                        .map_err(Into::into)
+                })
+        };
+        if let Err(err) = result {
+            let _ignore = self.qp_manager.destroy_qp(qpn);
+            return Err(err);
+        }
+        // Datagrams are received when the CQs are polled through the driver
+        self.poll_rings_through_driver();
 
         Ok(qpn)
     }
 
-    fn update_qp(&mut self, qpn: u32, attr: IbvQpAttr) -> Result<()> {
-        // TODO: This is a workaround for read-to-write conversion. Consider modifying the
-        // hardware to allow remote writes for read responses.
-        let rq_access_flags = (ibverbs_sys::ibv_access_flags::IBV_ACCESS_LOCAL_WRITE.0
+    /// Creates a raw packet QP, no QP context is written to the device
+    fn create_raw_qp(&mut self, qpn: u32, attr: IbvQpInitAttr) -> Result<u32> {
+        if attr.srq().is_some() {
+            let _ignore = self.qp_manager.destroy_qp(qpn);
+            return Err(RdmaError::InvalidInput(
+                "raw packet QPs can't receive from a SRQ".into(),
+            ));
+        }
+        self.raw_qps.create(qpn);
+        // Frames are received when the CQs are polled through the driver
+        self.poll_rings_through_driver();
+
+        Ok(qpn)
+    }
+
+    /// Makes the applications poll the shared CQ rings through the driver from now on
+    fn poll_rings_through_driver(&self) {
+        for ring in self
+            .cq_table
+            .iter()
+            .filter_map(CompletionQueue::shared_ring)
+        {
+            ring.poll_through_driver();
+        }
+    }
+
+    /// Opens the control socket of a new DC or XRC QP, its contexts are created when peers
+    /// are bound
+    fn create_dc_qp(&mut self, qpn: u32, attr: IbvQpInitAttr) -> Result<u32> {
+        let ip = self.qp_attr_table.map_qp(qpn, |current| current.ip);
+        let result = if attr.srq().is_some() {
+            Err(RdmaError::InvalidInput(
+                "DC QPs can't receive from a SRQ".into(),
+            ))
+        } else {
+            ip.ok_or(RdmaError::NotFound(format!("QP {qpn} not found")))
+                .and_then(|ip| {
+                    self.dc_qps
+                        .create(qpn, Ipv4Addr::from_bits(ip), attr.send_cq(), attr.recv_cq())
+                        .map_err(Into::into)
+                })
+        };
+        if let Err(err) = result {
+            let _ignore = self.qp_manager.destroy_qp(qpn);
+            return Err(err);
+        }
+        // Bind requests of the peers are answered when the CQs are polled through the driver
+        self.poll_rings_through_driver();
+
+        Ok(qpn)
+    }
+
+    /// Creates a RC QP of the TGT QP attached to the XRC SRQ `srqn`, unconnected.
+    ///
+    /// The receive completions report the QPN of the context rather than that of the TGT QP,
+    /// the windows of the SRQ are refilled per context.
+    fn create_xrc_context(&mut self, tgt_qpn: u32, srqn: u32) -> Result<u32> {
+        let XrcSrq { cq, .. } = self.xrc.dispatch(tgt_qpn, srqn)?;
+        self.create_qp(IbvQpInitAttr {
+            qp_type: ibverbs_sys::ibv_qp_type::IBV_QPT_RC as u8,
+            send_cq: None,
+            recv_cq: Some(cq),
+            srq: Some(srqn),
+            max_send_wr: 0,
+        })
+    }
+
+    /// Creates a RC QP completing to the CQs of the DC QP, unconnected
+    fn create_dc_context(&mut self, dc_qpn: u32) -> Result<u32> {
+        let (send_cq, recv_cq) = self.dc_qps.cqs(dc_qpn)?;
+        let context = self.create_qp(IbvQpInitAttr {
+            qp_type: ibverbs_sys::ibv_qp_type::IBV_QPT_RC as u8,
+            send_cq,
+            recv_cq,
+            srq: None,
+            max_send_wr: 0,
+        })?;
+        let _ignore = self.qp_attr_table.map_qp_mut(context, |current| {
+            current.owner_qpn = Some(dc_qpn);
+        });
+        Ok(context)
+    }
+
+    /// Writes the new attributes of the QP to the hardware, the command is not waited
+    fn configure_qp(&mut self, qpn: u32, attr: &IbvQpAttr) -> Result<()> {
+        let entry = self.qp_update_entry(qpn, attr)?;
+        let ticket = self.cmd_controller.submit([entry.into()]);
+        let _ignore = self.qp_cmd_tickets.replace(qpn, Some(ticket));
+
+        Ok(())
+    }
+
+    /// Records the new attributes of the QP, returns the QP context to write to the device
+    fn qp_update_entry(&mut self, qpn: u32, attr: &IbvQpAttr) -> Result<UpdateQp> {
+        let native_read = self.config.native_read();
+        // Without the hardware READ responder, the responses are RDMA WRITEs of the responder
+        // into the requester's buffer, so remote writes must be allowed on the QP.
+        let converted_read_flags = (ibverbs_sys::ibv_access_flags::IBV_ACCESS_LOCAL_WRITE.0
             | ibverbs_sys::ibv_access_flags::IBV_ACCESS_REMOTE_READ.0
             | ibverbs_sys::ibv_access_flags::IBV_ACCESS_REMOTE_WRITE.0)
             as u8;
 
+        self.apply_neighbour_changes();
+        let ip_addr = attr
+            .dest_qp_ip()
+            .map(Ipv4Addr::to_bits)
+            .or_else(|| self.qp_attr_table.map_qp(qpn, |current| current.dqp_ip))
+            .unwrap_or(0);
+        let peer_mac_addr = self.peer_mac(ip_addr);
+
         debug!("before modify qp_attr_table");
         let entry = self
             .qp_attr_table
             .map_qp_mut(qpn, |current| {
-                let current_ip = (current.dqp_ip != 0).then_some(current.dqp_ip);
-                let attr_ip = attr.dest_qp_ip().map(Ipv4Addr::to_bits);
-                let ip_addr = attr_ip.or(current_ip).unwrap_or(0);
+                let (rq_access_flags, max_dest_rd_atomic) = if native_read {
+                    (
+                        attr.qp_access_flags()
+                            .map_or(current.access_flags, |x| x as u8),
+                        attr.max_dest_rd_atomic()
+                            .unwrap_or(current.max_dest_rd_atomic),
+                    )
+                } else {
+                    (converted_read_flags, 0)
+                };
                 let entry = UpdateQp {
                     qpn,
                     ip_addr,
-                    local_udp_port: 0x100,
-                    peer_mac_addr: CARD_MAC_ADDRESS,
+                    local_udp_port: current.udp_port,
+                    peer_mac_addr,
                     qp_type: current.qp_type,
                     peer_qpn: attr.dest_qp_num().unwrap_or(current.dqpn),
                     rq_access_flags,
                     pmtu: attr.path_mtu().map_or(current.pmtu, |x| x as u8),
+                    max_dest_rd_atomic,
                 };
                 current.dqpn = entry.peer_qpn;
                 current.access_flags = rq_access_flags;
+                current.max_dest_rd_atomic = max_dest_rd_atomic;
+                if let Some(max_rd_atomic) = attr.max_rd_atomic() {
+                    current.max_rd_atomic = max_rd_atomic;
+                }
                 current.pmtu = entry.pmtu;
                 current.dqp_ip = ip_addr;
+                current.mac_addr = peer_mac_addr;
+                // Chunks posted from now on are encoded with the new attributes
+                current.refresh_send_template();
                 entry
             })
             .ok_or(RdmaError::NotFound(format!("QP {qpn} not found",)))?;
 
-        debug!("before send qp update request to hardware");
-        self.cmd_controller.update_qp(entry);
+        self.recv_wr_queue_table
+            .set_rnr(qpn, attr.min_rnr_timer(), attr.rnr_retry());
+
+        Ok(entry)
+    }
+
+    /// Applies the new attributes of the QP, returns the QP context to write to the device,
+    /// `None` if the QP has no device context
+    fn prepare_qp_update(&mut self, qpn: u32, attr: &IbvQpAttr) -> Result<Option<UpdateQp>> {
+        if self.raw_qps.contains(qpn) {
+            // Raw packet QPs have no connection, each frame carries its own headers
+            return Ok(None);
+        }
+        if self.ud_qps.contains(qpn) {
+            // UD QPs have no connection, the destination is given by each WR
+            return attr
+                .qkey()
+                .map_or(Ok(()), |qkey| self.ud_qps.set_qkey(qpn, qkey))
+                .map(|()| None);
+        }
+        if self.dc_qps.contains(qpn) {
+            // The contexts of a DC QP are connected when their peers are bound, those of a XRC
+            // INI QP to the SRQs behind its TGT QP
+            let _ignore = self.qp_attr_table.map_qp_mut(qpn, |current| {
+                if let Some(ip) = attr.dest_qp_ip() {
+                    current.dqp_ip = ip.to_bits();
+                }
+                if let Some(dqpn) = attr.dest_qp_num() {
+                    current.dqpn = dqpn;
+                }
+            });
+            return Ok(None);
+        }
+        let entry = self.qp_update_entry(qpn, attr)?;
+        if let Some(ah_attr) = attr.ah_attr() {
+            self.priorities.set_from_ah(qpn, &ah_attr);
+        }
+        if attr.timeout().is_some() || attr.retry_cnt().is_some() {
+            self.ack_timeout_tx.send(AckTimeoutTask::set_timeout(
+                qpn,
+                attr.timeout(),
+                attr.retry_cnt(),
+            ));
+        }
+
+        Ok(Some(entry))
+    }
 
+    /// Opens the receive channel of a connected QP once its context has been submitted
+    fn complete_qp_update(&mut self, qpn: u32) -> Result<()> {
         let qp = self
             .qp_attr_table
             .get_qp(qpn)
             .ok_or(RdmaError::NotFound(format!("QP {qpn} not found",)))?;
 
-        if qp.dqpn != 0 && qp.dqp_ip != 0 && self.post_recv_tx_table.get_qp_mut(qpn).is_none() {
+        if qp.dqpn != 0 && qp.dqp_ip != 0 && self.config.in_band_recv() {
+            self.recv_rings()?.connect(qpn, qp.dqpn);
+            self.progress_recv_ring(qpn);
+        } else if qp.dqpn != 0
+            && qp.dqp_ip != 0
+            && self.post_recv_tx_table.get_qp_mut(qpn).is_none()
+        {
             let dqp_ip = Ipv4Addr::from_bits(qp.dqp_ip);
             debug!("update_qp get dqp_ip={dqp_ip:?}");
-            let (tx, rx) =
-                post_recv_channel::<TcpChannel>(qp.ip.into(), qp.dqp_ip.into(), qpn, qp.dqpn)?;
+            let tx = TcpChannelTx::connect(dqp_ip, qp.dqpn)?;
+            // The listener left by a destroyed QP of the same index is reused
+            let rx = self.recv_worker()?.listen(qp.ip.into(), qpn)?;
             debug!("after create post recv tx and rx table");
             self.post_recv_tx_table.insert(qpn, tx);
             let wr_queue =
                 self.recv_wr_queue_table
-                    .clone_recv_wr_queue(qpn)
+                    .new_producer(qpn)
                     .ok_or(RdmaError::NotFound(format!(
                         "Receive WR queue for QP {qpn} not found",
                     )))?;
             
-            debug!("before spawn RecvWorker");
-            RecvWorker::new(rx, wr_queue).spawn();
+            let rdma_write_tx = self.rdma_write_tx.clone();
+            self.recv_worker()?.add(rx, wr_queue, qpn, rdma_write_tx)?;
+        }
+        if let Some(srq) = self.srq_table.srq_of(qpn) {
+            if qp.dqpn != 0 && qp.dqp_ip != 0 {
+                self.srq_table.set_ready(qpn);
+                self.refill_srq(srq)?;
+            }
         }
 
         Ok(())
     }
 
-    fn destroy_qp(&mut self, qpn: u32) -> Result<()> {
-        if self.qp_manager.destroy_qp(qpn) {
-            Ok(())
-        } else {
-            Err(RdmaError::InvalidInput(format!("QPN {qpn} not present")))
+    /// Records a connected RC QP in the snapshot, so that it can be reattached after a restart.
+    /// The contexts of the DC QPs and the QPs of SRQs are left out, their peers and SRQs are
+    /// not recorded.
+    fn checkpoint_qp(&self, qpn: u32) {
+        let Some(snapshot) = self.snapshot.as_deref() else {
+            return;
+        };
+        let Some(qp) = self.qp_attr_table.get_qp(qpn) else {
+            return;
+        };
+        if qp.qp_type != ibverbs_sys::ibv_qp_type::IBV_QPT_RC as u8
+            || qp.dqpn == 0
+            || qp.dqp_ip == 0
+            || qp.owner_qpn.is_some()
+            || self.srq_table.srq_of(qpn).is_some()
+        {
+            return;
         }
+        snapshot.record_qp(&QpRecord {
+            qpn,
+            qp_type: qp.qp_type,
+            dqpn: qp.dqpn,
+            dqp_ip: qp.dqp_ip,
+            pmtu: qp.pmtu,
+            access_flags: qp.access_flags,
+            max_rd_atomic: qp.max_rd_atomic,
+            max_dest_rd_atomic: qp.max_dest_rd_atomic,
+            ..QpRecord::default()
+        });
     }
 
-    fn create_cq(&mut self) -> Result<u32> {
-        self.cq_manager
-            .create_cq()
-            .ok_or(RdmaError::ResourceExhausted("No CQ available".into()))
+    /// Connects a context to the context of the peer, no post receive channel is opened: the
+    /// contexts of the DC QPs only carry RDMA operations, and the contexts of the XRC TGT QPs
+    /// open theirs once their initiator is ready
+    fn connect_context(&mut self, context: u32, ip: Ipv4Addr, dqpn: u32) -> Result<()> {
+        self.configure_qp(context, &context_attr(ip, dqpn))
     }
 
-    fn destroy_cq(&mut self, handle: u32) -> Result<()> {
-        if self.cq_manager.destroy_cq(handle) {
-            Ok(())
+    /// Answers the control messages received by the DC QPs
+    fn progress_dc(&mut self) {
+        if self.dc_qps.is_empty() {
+            return;
+        }
+        for (qpn, from, msg) in self.dc_qps.poll() {
+            self.handle_dc_msg(qpn, from, msg);
+        }
+    }
+
+    fn handle_dc_msg(&mut self, qpn: u32, from: SocketAddrV4, msg: DcMsg) {
+        let ip = *from.ip();
+        match msg {
+            DcMsg::Bind { initiator, target } => {
+                self.reply_bind(qpn, from, initiator, target, None);
+            }
+            DcMsg::XrcBind {
+                initiator,
+                target,
+                srqn,
+            } => {
+                self.reply_bind(qpn, from, initiator, target, Some(srqn));
+            }
+            DcMsg::XrcReady { initiator } => {
+                // Only the contexts of the TGT QPs are attached to a SRQ
+                let context = self
+                    .dc_qps
+                    .target(qpn, ip, initiator)
+                    .filter(|&x| self.srq_table.srq_of(x).is_some());
+                let reply = match context.map(|x| (x, self.complete_qp_update(x))) {
+                    Some((context, Ok(()))) => DcMsg::BindAck { initiator, context },
+                    Some((_, Err(err))) => {
+                        error!("xrc qp {qpn} failed to lend wrs to {initiator} of {ip}: {err}");
+                        DcMsg::BindNak { initiator }
+                    }
+                    None => DcMsg::BindNak { initiator },
+                };
+                if let Err(err) = self.dc_qps.reply(qpn, from, reply) {
+                    error!("failed to reply ready message of {from}: {err}");
+                }
+            }
+            DcMsg::Unbind { initiator } => {
+                if let Some(context) = self.dc_qps.remove_target(qpn, ip, initiator) {
+                    if let Err(err) = self.destroy_qp(context) {
+                        error!("failed to destroy context {context} of dc qp {qpn}: {err}");
+                    }
+                }
+            }
+            DcMsg::BindAck { initiator, .. } | DcMsg::BindNak { initiator } => {
+                debug!("dc qp {qpn} dropped stale reply for context {initiator}");
+            }
+        }
+    }
+
+    /// Answers the bind request of the initiator context of `from`
+    fn reply_bind(
+        &mut self,
+        qpn: u32,
+        from: SocketAddrV4,
+        initiator: u32,
+        target: u32,
+        srqn: Option<u32>,
+    ) {
+        let ip = *from.ip();
+        let reply = if target == qpn {
+            match self.bind_target(qpn, ip, initiator, srqn) {
+                Ok(context) => DcMsg::BindAck { initiator, context },
+                Err(err) => {
+                    error!("dc qp {qpn} rejected context {initiator} of {ip}: {err}");
+                    DcMsg::BindNak { initiator }
+                }
+            }
         } else {
-            Err(RdmaError::InvalidInput(format!(
-                "CQ handle {handle} not present"
-            )))
+            DcMsg::BindNak { initiator }
+        };
+        if let Err(err) = self.dc_qps.reply(qpn, from, reply) {
+            error!("failed to reply bind request of {from}: {err}");
         }
     }
 
-    fn post_send(&mut self, qpn: u32, wr: SendWr) -> Result<()> {
-        match wr {
-            SendWr::Rdma(wr) => {
-                self.rdma_write(qpn, wr);
-                Ok(())
+    /// Returns the target context serving the initiator context of the peer, creates it if
+    /// the peer is not bound yet. The context of a XRC TGT QP is attached to the SRQ `srqn`,
+    /// it lends receive WRs once the initiator is ready.
+    fn bind_target(
+        &mut self,
+        qpn: u32,
+        ip: Ipv4Addr,
+        initiator: u32,
+        srqn: Option<u32>,
+    ) -> Result<u32> {
+        // Retransmitted requests are answered with the context already bound
+        if let Some(context) = self.dc_qps.target(qpn, ip, initiator) {
+            return Ok(context);
+        }
+        if self.dc_qps.num_targets(qpn) >= self.config.dc().contexts() {
+            return Err(RdmaError::ResourceExhausted(format!(
+                "All target contexts of DC QP {qpn} in use"
+            )));
+        }
+        let context = match srqn {
+            Some(srqn) => self.create_xrc_context(qpn, srqn)?,
+            None => self.create_dc_context(qpn)?,
+        };
+        let result = self.connect_context(context, ip, initiator).and_then(|()| {
+            self.wait_qp_configured(context);
+            self.dc_qps.insert_target(qpn, ip, initiator, context)
+        });
+        if let Err(err) = result {
+            let _ignore = self.destroy_qp(context);
+            return Err(err);
+        }
+
+        Ok(context)
+    }
+
+    /// Binds a context of the DC QP to the peer, evicting the least recently used idle context
+    /// if all of them are in use
+    fn bind_initiator(&mut self, qpn: u32, peer: DcPeer) -> Result<u32> {
+        if self.dc_qps.num_initiators(qpn) >= self.config.dc().contexts() {
+            // A context is only reused once its WRs can no longer be retransmitted
+            let victim = self
+                .dc_qps
+                .evict(qpn, self.config.ack().retransmit_span())
+                .ok_or(RdmaError::ResourceExhausted(format!(
+                    "All contexts of DC QP {qpn} are busy"
+                )))?;
+            self.destroy_qp(victim)?;
+        }
+        let context = self.create_dc_context(qpn)?;
+        let request = match peer.srqn {
+            Some(srqn) => DcMsg::XrcBind {
+                initiator: context,
+                target: peer.qpn,
+                srqn,
+            },
+            None => DcMsg::Bind {
+                initiator: context,
+                target: peer.qpn,
+            },
+        };
+        let result = self
+            .request_bind(qpn, context, peer, request)
+            .and_then(|target| {
+                if peer.srqn.is_some() {
+                    // Sends consume the receive WRs lent through the post receive channel,
+                    // which listens before the target lends them
+                    self.update_qp(context, context_attr(peer.ip, target))?;
+                    self.wait_qp_configured(context);
+                    let ready = DcMsg::XrcReady { initiator: context };
+                    let _target = self.request_bind(qpn, context, peer, ready)?;
+                } else {
+                    self.connect_context(context, peer.ip, target)?;
+                }
+                self.dc_qps.insert_initiator(qpn, context, peer)
+            });
+        if let Err(err) = result {
+            let _ignore = self.destroy_qp(context);
+            return Err(err);
+        }
+
+        Ok(context)
+    }
+
+    /// Sends `request` for the context until the peer answers, returns the target context
+    fn request_bind(
+        &mut self,
+        qpn: u32,
+        context: u32,
+        peer: DcPeer,
+        request: DcMsg,
+    ) -> Result<u32> {
+        let deadline = Instant::now() + BIND_TIMEOUT;
+        let mut next_send = Instant::now();
+        while Instant::now() < deadline {
+            if Instant::now() >= next_send {
+                self.dc_qps.send_to(qpn, peer, request)?;
+                next_send = Instant::now() + BIND_RETRY;
+            }
+            for (dc_qpn, from, msg) in self.dc_qps.poll() {
+                match msg {
+                    DcMsg::BindAck {
+                        initiator,
+                        context: target,
+                    } if dc_qpn == qpn && initiator == context => {
+                        return Ok(target);
+                    }
+                    DcMsg::BindNak { initiator } if dc_qpn == qpn && initiator == context => {
+                        return Err(RdmaError::ResourceExhausted(format!(
+                            "Peer {peer:?} refused to bind DC QP {qpn}"
+                        )));
+                    }
+                    _ => self.handle_dc_msg(dc_qpn, from, msg),
+                }
             }
-            SendWr::Send(wr) => self.send(qpn, wr),
+            thread::yield_now();
         }
+
+        Err(RdmaError::Timeout(format!(
+            "Peer {peer:?} did not answer bind request of DC QP {qpn}"
+        )))
     }
 
-    fn poll_cq(&mut self, handle: u32, max_num_entries: usize) -> Vec<Completion> {
-        let Some(cq) = self.cq_table.get_cq(handle) else {
-            return vec![];
+    /// Makes progress on the in-band rings of the QPs that wait for their peers
+    fn progress_recv_rings(&mut self) {
+        let Some(rings) = self.recv_rings.as_ref() else {
+            return;
         };
-        iter::repeat_with(|| cq.pop_front())
-            .take_while(Option::is_some)
-            .take(max_num_entries)
-            .flatten()
-            .collect()
+        for qpn in rings.active() {
+            self.progress_recv_ring(qpn);
+        }
     }
 
-    fn post_recv(&mut self, qpn: u32, wr: RecvWr) -> Result<()> {
-        let qp = self
-            .qp_attr_table
-            .get_qp(qpn)
-            .ok_or(RdmaError::QpError(format!("QP {qpn} not found",)))?;
-        let event = Event::PostRecv(PostRecvEvent::new(qpn, wr.wr_id));
+    /// Receives the datagrams of the UD QPs and the frames of the raw packet QPs into their
+    /// posted receive WRs
+    fn progress_datagrams(&mut self) {
+        for (completion, solicited) in self.ud_qps.poll() {
+            self.completion_tx.send(CompletionTask::Untracked {
+                qpn: completion.qpn(),
+                completion,
+                solicited,
+            });
+        }
+        let frames = self.raw_qps.poll(&mut *self.raw_rx).unwrap_or_else(|err| {
+            error!("failed to receive frames of raw packet qps: {err}");
+            Vec::new()
+        });
+        for completion in frames {
+            self.completion_tx.send(CompletionTask::Untracked {
+                qpn: completion.qpn(),
+                completion,
+                solicited: false,
+            });
+        }
+    }
+
+    /// Returns the worker reading the post receive channels, spawns it on first use
+    fn recv_worker(&mut self) -> Result<&mut RecvWorker> {
+        let worker = match self.recv_worker.take() {
+            Some(worker) => worker,
+            None => RecvWorker::spawn()?,
+        };
+        Ok(self.recv_worker.insert(worker))
+    }
+
+    /// Returns the in-band receive WR rings, registers them on first use
+    fn recv_rings(&mut self) -> Result<&mut RecvRings> {
+        let rings = match self.recv_rings.take() {
+            Some(rings) => rings,
+            None => self.register_recv_rings()?,
+        };
+        Ok(self.recv_rings.insert(rings))
+    }
+
+    /// Advertises a receive WR of the QP to its peer
+    fn advertise_recv(&mut self, qpn: u32, wr: RecvWr) -> Result<()> {
+        let event = Event::PostRecv(PostRecvEvent::new(qpn, wr.wr_id, wr.addr, wr.length));
         self.completion_tx
             .send(CompletionTask::Register { qpn, event });
+        if self.config.in_band_recv() {
+            self.recv_rings()?.advertise(qpn, wr);
+            self.progress_recv_ring(qpn);
+            return Ok(());
+        }
         let tx = self
             .post_recv_tx_table
             .get_qp_mut(qpn)
@@ -465,19 +2054,2535 @@ where
         Ok(())
     }
 
-    fn alloc_pd(&mut self) -> Result<u32> {
-        self.pd_table
-            .alloc()
-            .ok_or(RdmaError::ResourceExhausted("No PD available".into()))
+    /// Registers a chain of receive WRs in a single completion task, and passes them to the
+    /// peer with a single write of the post receive channel
+    fn advertise_recvs(&mut self, qpn: u32, wrs: &[RecvWr]) -> Result<()> {
+        let events = wrs
+            .iter()
+            .map(|wr| PostRecvEvent::new(qpn, wr.wr_id, wr.addr, wr.length))
+            .collect();
+        self.completion_tx
+            .send(CompletionTask::RegisterRecvs { qpn, events });
+        if self.config.in_band_recv() {
+            let rings = self.recv_rings()?;
+            for &wr in wrs {
+                rings.advertise(qpn, wr);
+            }
+            self.progress_recv_ring(qpn);
+            return Ok(());
+        }
+        let tx = self
+            .post_recv_tx_table
+            .get_qp_mut(qpn)
+            .ok_or(RdmaError::QpError(format!(
+                "Post receive channel for QP {qpn} not found",
+            )))?;
+        tx.send_batch(wrs)?;
+
+        Ok(())
     }
 
-    fn dealloc_pd(&mut self, handle: u32) -> Result<()> {
-        if self.pd_table.dealloc(handle) {
+    /// Lends WRs of a SRQ to the windows of its QPs, and reports the SRQ limit event
+    fn refill_srq(&mut self, handle: u32) -> Result<()> {
+        let (lent, limit_reached) = self.srq_table.refill(handle);
+        if limit_reached {
+            self.async_events.push(AsyncEvent::SrqLimit { handle });
+        }
+        for (qpn, wr) in lent {
+            self.advertise_recv(qpn, wr)?;
+        }
+
+        Ok(())
+    }
+
+    /// Refills the windows of the SRQ attached QPs that received messages
+    fn srq_consumed<I>(&mut self, qpns: I)
+    where
+        I: IntoIterator<Item = u32>,
+    {
+        let mut handles = Vec::new();
+        for qpn in qpns {
+            if let Some(handle) = self.srq_table.srq_of(qpn) {
+                self.srq_table.consumed(qpn);
+                if !handles.contains(&handle) {
+                    handles.push(handle);
+                }
+            }
+        }
+        for handle in handles {
+            if let Err(err) = self.refill_srq(handle) {
+                error!("failed to refill srq {handle}: {err}");
+            }
+        }
+    }
+
+    /// Registers the in-band receive WR rings of all QPs with the reserved `RECV_RING_MR_KEY`.
+    ///
+    /// The peer addresses the rings at `RECV_RING_IOVA`, so the rings start at a page
+    /// boundary of the buffer to translate with whole pages.
+    fn register_recv_rings(&mut self) -> Result<RecvRings> {
+        let length = recv_rings_size(self.qp_manager.max_qp());
+        let buf = self.allocator.alloc(length + PAGE_SIZE)?;
+        let phys_base = buf.phys_addr.next_multiple_of(PAGE_SIZE as u64);
+        let num_pages = get_num_page(RECV_RING_IOVA, length);
+        let pgt_entry = self.mtt.register_reserved(num_pages)?;
+        let access = (ibverbs_sys::ibv_access_flags::IBV_ACCESS_LOCAL_WRITE.0
+            | ibverbs_sys::ibv_access_flags::IBV_ACCESS_REMOTE_WRITE.0) as u8;
+        let mtt_update = MttUpdate::new(
+            RECV_RING_IOVA,
+            length as u32,
+            RECV_RING_MR_KEY,
+            0,
+            access,
+            pgt_entry.index,
+        );
+        let mut writer = PgtWriter::new(&self.cmd_controller, &mut self.mtt_buffer, mtt_update);
+        writer.extend_contiguous(phys_base, num_pages);
+        writer.finish();
+        debug!("receive WR rings registered: phys_addr=0x{phys_base:x}");
+        let offset = (phys_base - buf.phys_addr) as usize;
+
+        Ok(RecvRings::new(buf, offset))
+    }
+
+    fn rdma_read(&self, qpn: u32, wr: SendWrRdma) {
+        self.wait_qp_configured(qpn);
+        self.steer_flowlet(qpn);
+        let task = RdmaWriteTask::new_write(qpn, wr);
+        self.rdma_write_tx.send(task);
+    }
+
+    fn rdma_write(&self, qpn: u32, wr: SendWrRdma) -> Result<()> {
+        self.wait_qp_configured(qpn);
+        self.steer_flowlet(qpn);
+        if self.is_direct(qpn) {
+            return self.post_direct(qpn, wr);
+        }
+        let task = RdmaWriteTask::new_write(qpn, wr);
+        self.rdma_write_tx.send(task);
+
+        Ok(())
+    }
+
+    /// Copies the payload of an inline WR to a bounce slot and points the WR at the slot.
+    ///
+    /// The `lkey`s of an inline WR are ignored, the payload is read from the virtual addresses
+    /// of the calling process. The sends the `SendPolicy` copies are staged the same way, and
+    /// are marked inline so that their slot is recycled once they are acknowledged. Other WRs
+    /// are returned unchanged.
+    #[allow(unsafe_code)]
+    fn stage_inline(&mut self, qpn: u32, wr: SendWr) -> Result<SendWr> {
+        let mut base = match wr {
+            SendWr::Rdma(wr) => wr.base,
+            SendWr::Send(wr) => wr,
+        };
+        // A send copied from registered buffers falls back to the read by the card once the
+        // slots are exhausted
+        let mut optional = false;
+        let mut path = SendPath::Inline;
+        if base.send_flags & ibverbs_sys::ibv_send_flags::IBV_SEND_INLINE.0 == 0 {
+            path = self.send_path(qpn, &wr, &base);
+            match path {
+                SendPath::Inline | SendPath::Staged => {}
+                SendPath::Dma => {
+                    self.send_policy.record(path);
+                    return Ok(wr);
+                }
+                // Counted once offered to the peer
+                SendPath::Rendezvous => return Ok(wr),
+            }
+            optional = self.is_registered(&base);
+            base.send_flags |= ibverbs_sys::ibv_send_flags::IBV_SEND_INLINE.0;
+        } else if base.length as usize > MAX_INLINE_DATA {
+            return Err(RdmaError::InvalidInput(format!(
+                "Inline length {} exceeds {MAX_INLINE_DATA}",
+                base.length
+            )));
+        }
+        if base.opcode == WorkReqOpCode::RdmaRead {
+            return Err(RdmaError::InvalidInput(
+                "RDMA read can't be posted inline".into(),
+            ));
+        }
+        if base.opcode.is_executed_by_responder() {
+            return Err(RdmaError::InvalidInput(
+                "Atomic operations can't be posted inline".into(),
+            ));
+        }
+        let lkey = self.inline_lkey()?;
+        let len = base.length as usize;
+        let Some(addr) = self
+            .inline_slots
+            .reserve(len, |qpn, psn| self.poster.is_acked(qpn, psn))
+        else {
+            if optional {
+                self.send_policy.record(SendPath::Dma);
+                return Ok(wr);
+            }
+            return Err(RdmaError::ResourceExhausted("No free inline slot".into()));
+        };
+        self.send_policy.record(path);
+        let inline_buf = self
+            .inline_buf
+            .as_mut()
+            .ok_or(RdmaError::MemoryError("Inline buffer not allocated".into()))?;
+        let mut offset = (addr - inline_buf.buf.phys_addr) as usize;
+        for sge in base.sg_list.as_slice().iter().filter(|sge| sge.length != 0) {
+            // SAFETY: the verbs API requires the buffers of an inline WR to be readable, and
+            // staged sends read the buffers the application posts from
+            let payload =
+                unsafe { std::slice::from_raw_parts(sge.addr as *const u8, sge.length as usize) };
+            inline_buf.buf.copy_from(offset, payload);
+            offset += payload.len();
+        }
+        let staged = SendWrBase::new(
+            base.wr_id,
+            base.send_flags,
+            addr,
+            base.length,
+            lkey,
+            base.imm_data,
+            base.opcode,
+        );
+
+        Ok(match wr {
+            SendWr::Rdma(wr) => SendWrRdma::new_from_base(staged, wr.raddr, wr.rkey).into(),
+            SendWr::Send(_) => staged.into(),
+        })
+    }
+
+    /// Returns the path of a send posted without `IBV_SEND_INLINE`, only the two-sided sends
+    /// from unregistered buffers are staged
+    fn send_path(&self, qpn: u32, wr: &SendWr, base: &SendWrBase) -> SendPath {
+        let two_sided = matches!(wr, SendWr::Send(_));
+        let registered = self.is_registered(base);
+        if base.opcode == WorkReqOpCode::RdmaRead
+            || base.opcode.is_executed_by_responder()
+            || (!two_sided && !registered)
+        {
+            return SendPath::Dma;
+        }
+        self.send_policy.choose(
+            base.length as usize,
+            registered,
+            two_sided,
+            self.poster.credits().occupancy(qpn),
+        )
+    }
+
+    /// Returns `true` if all buffers of a send are registered
+    fn is_registered(&self, wr: &SendWrBase) -> bool {
+        wr.sg_list
+            .as_slice()
+            .iter()
+            .all(|sge| sge.length == 0 || self.mr_pins.contains_key(&sge.lkey))
+    }
+
+    /// Returns the slot classes of the bounce buffer, the inline slots followed by the staging
+    /// slots if configured
+    fn bounce_classes(&self) -> Vec<(usize, usize)> {
+        let slots = self.config.staging().slots;
+        iter::once((MAX_INLINE_DATA, INLINE_SLOTS))
+            .chain(STAGING_SLOT_SIZES.iter().map(|&size| (size, slots)))
+            .filter(|&(_, num)| num != 0)
+            .collect()
+    }
+
+    /// Frees the bounce slot of an inline WR that was not posted
+    fn cancel_inline(&self, send_flags: u32, laddr: u64) {
+        if send_flags & ibverbs_sys::ibv_send_flags::IBV_SEND_INLINE.0 != 0 {
+            self.inline_slots.cancel(laddr);
+        }
+    }
+
+    /// Returns the key of the bounce buffer, registers it on first use.
+    ///
+    /// The buffer is registered at its physical address, so that the page offsets seen by the
+    /// device match the contiguous DMA buffer. The device does not bind QPs to a PD, the buffer
+    /// is shared by all QPs.
+    fn inline_lkey(&mut self) -> Result<u32> {
+        if let Some(inline_buf) = &self.inline_buf {
+            return Ok(inline_buf.lkey);
+        }
+        let classes = self.bounce_classes();
+        let length = InlineSlots::buffer_len(&classes);
+        let buf = self.allocator.alloc(length)?;
+        let iova = buf.phys_addr;
+        let num_pages = get_num_page(iova, length);
+        let (lkey, pgt_entry) = self.register_mtt(num_pages)?;
+        let mtt_update = MttUpdate::new(iova, length as u32, lkey, 0, 0, pgt_entry.index);
+        let page_base = iova - iova % PAGE_SIZE as u64;
+        let mut writer = PgtWriter::new(&self.cmd_controller, &mut self.mtt_buffer, mtt_update);
+        writer.extend_contiguous(page_base, num_pages);
+        writer.finish();
+        self.inline_slots.init(iova, &classes);
+        self.inline_buf = Some(InlineBuf { buf, lkey });
+        debug!("inline buffer registered: iova=0x{iova:x}, lkey={lkey}");
+
+        Ok(lkey)
+    }
+
+    /// Pins the pages of a memory region and passes their physical addresses to `sink` in page
+    /// order.
+    ///
+    /// Regions of at least `PARALLEL_REG_MIN_BYTES` are split into slices that are pinned and
+    /// resolved by scoped worker threads. A slice is passed to `sink` as soon as all preceding
+    /// slices are resolved, so the PGT updates are streamed while later slices are in progress.
+    fn pin_and_resolve<F>(
+        device: &H,
+        addr: u64,
+        length: usize,
+        num_pages: usize,
+        mut sink: F,
+    ) -> Result<()>
+    where
+        F: FnMut(&[u64]),
+    {
+        if length < PARALLEL_REG_MIN_BYTES {
+            let handler = device.new_umem_handler();
+            sink(&pin_and_resolve_slice(&handler, addr, length, num_pages)?);
+            return Ok(());
+        }
+        let slice_pages = (REG_SLICE_BYTES / PAGE_SIZE).max(1);
+        let num_slices = num_pages.div_ceil(slice_pages);
+        let num_workers = thread::available_parallelism()
+            .map_or(1, NonZeroUsize::get)
+            .min(MAX_REG_WORKERS)
+            .min(num_slices);
+        let end = addr + length as u64;
+        // Returns the address, length and number of pages of a slice
+        let slice = move |i: usize| {
+            let first_page = i * slice_pages;
+            let start = addr + (first_page * PAGE_SIZE) as u64;
+            let pages = slice_pages.min(num_pages - first_page);
+            let slice_end = end.min(start + (pages * PAGE_SIZE) as u64);
+            (start, (slice_end - start) as usize, pages)
+        };
+        debug!("pin and resolve {num_slices} slices with {num_workers} workers");
+
+        thread::scope(|s| -> Result<()> {
+            let (tx, rx) = mpsc::channel();
+            for worker in 0..num_workers {
+                let handler = device.new_umem_handler();
+                let tx = tx.clone();
+                let _handle = s.spawn(move || {
+                    for i in (worker..num_slices).step_by(num_workers) {
+                        let (start, len, pages) = slice(i);
+                        let result = pin_and_resolve_slice(&handler, start, len, pages);
+                        let failed = result.is_err();
+                        if tx.send((i, result)).is_err() || failed {
+                            break;
+                        }
+                    }
+                });
+            }
+            drop(tx);
+            let mut ready = BTreeMap::new();
+            let mut next = 0;
+            for (i, result) in rx {
+                let _ignore = ready.insert(i, result?);
+                while let Some(phys_addrs) = ready.remove(&next) {
+                    sink(&phys_addrs);
+                    next += 1;
+                }
+            }
             Ok(())
-        } else {
-            Err(RdmaError::InvalidInput(format!(
-                "PD handle {handle} not present"
-            )))
+        })
+    }
+
+    /// Reuses a cached registration covering the range.
+    ///
+    /// The cache is not notified of `munmap`, so the pages of the cached registration are
+    /// resolved again and the entry is only reused if they still map to the same physical
+    /// addresses.
+    fn reg_mr_cached(
+        &mut self,
+        addr: u64,
+        length: usize,
+        pd_handle: u32,
+        access: u8,
+    ) -> Result<Option<u32>> {
+        let Some((mr_key, mr)) = self.mr_cache.find(addr, length as u64, pd_handle, access) else {
+            return Ok(None);
+        };
+        let current = self
+            .device
+            .new_umem_handler()
+            .virt_to_phys_range(mr.addr, mr.phys_addrs.len())?;
+        if current.into_iter().eq(mr.phys_addrs.iter().copied().map(Some)) {
+            self.mr_cache.acquire(mr_key);
+            debug!("reuse cached mr {mr_key} for addr=0x{addr:x}, length=0x{length:x}");
+            return Ok(Some(mr_key));
+        }
+        debug!("cached mr {mr_key} is stale");
+        if self.mr_cache.invalidate(mr_key) {
+            self.free_mr(mr_key);
+        }
+
+        Ok(None)
+    }
+
+    /// Registers an on-demand paging MR.
+    ///
+    /// The MTT and PGT ranges are reserved without pinning or translating the pages. All PGT
+    /// entries map to a blank page until the pages are prefetched by `advise_mr`.
+    fn reg_mr_odp(&mut self, addr: u64, length: usize, pd_handle: u32, access: u8) -> Result<u32> {
+        let blank_page = self.odp_blank_page()?;
+        let num_pages = get_num_page(addr, length);
+        let length_u32 = u32::try_from(length)
+            .map_err(|_err| RdmaError::InvalidInput("Length too large".into()))?;
+        let (mr_key, pgt_entry) = self.register_mtt(num_pages)?;
+        let mtt_update =
+            MttUpdate::new(addr, length_u32, mr_key, pd_handle, access, pgt_entry.index);
+        let mut writer = PgtWriter::new(&self.cmd_controller, &mut self.mtt_buffer, mtt_update);
+        writer.fill(blank_page, num_pages);
+        writer.finish();
+        let _ignore = self.mr_pins.insert(mr_key, Vec::new());
+        let mr = OdpMr {
+            addr,
+            length,
+            pd_handle,
+            pgt_entry,
+        };
+        let _ignore = self.odp_mrs.insert(mr_key, mr);
+        self.add_atomic_target(mr_key, addr, length, access);
+        self.mw_table
+            .add_mr(mr_key, addr, length, pd_handle, access, pgt_entry.index);
+        debug!("odp mr {mr_key}: addr=0x{addr:x}, length=0x{length:x}, num_pages={num_pages}");
+
+        Ok(mr_key)
+    }
+
+    /// Allows the atomic requests of the peers on the MR if it has remote atomic access, and
+    /// their atomic writes and flushes if it has remote write access
+    fn add_atomic_target(&self, mr_key: u32, addr: u64, length: usize, access: u8) {
+        self.add_mapped_atomic_target(mr_key, addr, addr, length, access);
+    }
+
+    /// Same as `add_atomic_target` for a MR the peers address from `iova`
+    fn add_mapped_atomic_target(
+        &self,
+        mr_key: u32,
+        iova: u64,
+        host_addr: u64,
+        length: usize,
+        access: u8,
+    ) {
+        const ACCESS_REMOTE: u8 = (ibverbs_sys::ibv_access_flags::IBV_ACCESS_REMOTE_ATOMIC.0
+            | ibverbs_sys::ibv_access_flags::IBV_ACCESS_REMOTE_WRITE.0)
+            as u8;
+        if access & ACCESS_REMOTE != 0 {
+            self.atomics
+                .add_mapped_target(mr_key, iova, host_addr, length, access);
+        }
+    }
+
+    /// Invalidates the entry of a window and waits for the device, so that no remote access
+    /// through `rkey` succeeds once the caller returns
+    fn revoke_window(&self, rkey: u32) {
+        self.atomics.remove_target(rkey);
+        let ticket = self
+            .cmd_controller
+            .submit([MttUpdate::invalidate(rkey).into()]);
+        self.cmd_controller.wait(ticket);
+    }
+
+    /// Returns the physical address of the blank page, allocates it on first use
+    fn odp_blank_page(&mut self) -> Result<u64> {
+        if let Some(page) = &self.odp_blank_page {
+            return Ok(page.phys_addr);
+        }
+        let page = self.allocator.alloc(PAGE_SIZE)?;
+        let phys_addr = page.phys_addr;
+        self.odp_blank_page = Some(page);
+
+        Ok(phys_addr)
+    }
+
+    /// Returns the job prefetching the pages of an ODP MR covering the range, `None` if the
+    /// pages are already pinned by a previous prefetch
+    fn prefetch_job(&self, pd_handle: u32, sge: Sge) -> Result<Option<PrefetchJob>> {
+        let mr = self
+            .odp_mrs
+            .get(&sge.lkey)
+            .copied()
+            .ok_or(RdmaError::InvalidInput(format!(
+                "MR {} is not an on-demand paging MR",
+                sge.lkey
+            )))?;
+        if mr.pd_handle != pd_handle {
+            return Err(RdmaError::InvalidInput("PD mismatch".into()));
+        }
+        let (first, num_pages) = mr
+            .page_range(sge.addr, sge.length as usize)
+            .ok_or(RdmaError::InvalidInput("Range out of MR bounds".into()))?;
+        // Page `i` of the MR is resolved at `mr.addr + i * PAGE_SIZE`, the same address
+        // `reg_mr` uses
+        let start = mr.addr + (first * PAGE_SIZE) as u64;
+        let page_base = mr.addr - mr.addr % PAGE_SIZE as u64;
+        let end = page_base + ((first + num_pages) * PAGE_SIZE) as u64;
+        let job = PrefetchJob {
+            mr_key: sge.lkey,
+            base_index: mr.pgt_entry.index,
+            pgt_index: mr.pgt_entry.index + first as u32,
+            addr: start,
+            length: (end - start) as usize,
+            num_pages,
+        };
+        let pinned = self.mr_pins.get(&sge.lkey).is_some_and(|pins| {
+            pins.iter()
+                .any(|&(addr, length)| addr <= start && end <= addr + length as u64)
+        });
+
+        Ok((!pinned).then_some(job))
+    }
+
+    /// Pins the pages of an ODP MR covering the range and updates their PGT entries
+    fn prefetch_odp(&mut self, job: PrefetchJob) -> Result<()> {
+        let mut writer = PgtWriter::at(&self.cmd_controller, &mut self.mtt_buffer, job.pgt_index);
+        let result =
+            Self::pin_and_resolve(&self.device, job.addr, job.length, job.num_pages, |pages| {
+                writer.extend(pages)
+            });
+        writer.finish();
+        self.track_prefetch(&job);
+        debug!(
+            "prefetch odp mr {}: {} pages at 0x{:x}",
+            job.mr_key, job.num_pages, job.addr
+        );
+
+        result
+    }
+
+    /// Queues a prefetch to the background thread, which is spawned on first use
+    fn prefetch_odp_async(&mut self, job: PrefetchJob) -> Result<()> {
+        if self.prefetcher.is_none() {
+            self.prefetcher = Some(Prefetcher::spawn(self.device.new_umem_handler())?);
+        }
+        let prefetcher = self
+            .prefetcher
+            .as_mut()
+            .unwrap_or_else(|| unreachable!("prefetcher spawned above"));
+        if let Err(job) = prefetcher.submit(job) {
+            error!("odp prefetch thread exited, prefetching synchronously");
+            self.prefetcher = None;
+            return self.prefetch_odp(job);
+        }
+
+        Ok(())
+    }
+
+    /// Writes the PGT entries of the prefetches pinned in the background.
+    ///
+    /// A prefetch of an MR deregistered in the meantime is dropped and its pages are unpinned,
+    /// unless they are referenced by other MRs.
+    fn progress_prefetches(&mut self) {
+        let Some(prefetcher) = self.prefetcher.as_mut() else {
+            return;
+        };
+        for done in prefetcher.take_done() {
+            let job = done.job;
+            let registered = self
+                .odp_mrs
+                .get(&job.mr_key)
+                .is_some_and(|mr| mr.pgt_entry.index == job.base_index);
+            let handler = self.device.new_umem_handler();
+            if !registered {
+                self.pin_count.get_mut().acquire(job.addr, job.length);
+                for (start, len) in self.pin_count.get_mut().release(job.addr, job.length) {
+                    if let Err(err) = handler.unpin_pages(start, len) {
+                        error!("failed to unpin pages of mr {}: {err}", job.mr_key);
+                    }
+                }
+                continue;
+            }
+            // Pinned without the context, another MR may have unpinned shared pages since,
+            // locking the resident pages again is cheap
+            let result = done
+                .result
+                .and_then(|pages| handler.pin_pages(job.addr, job.length).map(|()| pages));
+            match result {
+                Ok(pages) => {
+                    let mut writer =
+                        PgtWriter::at(&self.cmd_controller, &mut self.mtt_buffer, job.pgt_index);
+                    writer.extend(&pages);
+                    writer.finish();
+                    debug!(
+                        "prefetch odp mr {} in background: {} pages at 0x{:x}",
+                        job.mr_key, job.num_pages, job.addr
+                    );
+                }
+                Err(err) => error!("failed to prefetch odp mr {}: {err}", job.mr_key),
+            }
+            self.track_prefetch(&job);
+        }
+    }
+
+    /// Tracks the pins of a prefetch, also of a partially pinned range so that it is unpinned
+    /// on deregistration
+    fn track_prefetch(&mut self, job: &PrefetchJob) {
+        self.pin_count.get_mut().acquire(job.addr, job.length);
+        if let Some(pins) = self.mr_pins.get_mut(&job.mr_key) {
+            pins.push((job.addr, job.length));
+        }
+    }
+
+    /// Records a MR registered to the hardware in the tables of the context.
+    ///
+    /// `phys_addrs` holds the addresses of its pages if kept for the cache or the report of
+    /// the contiguous runs, which is logged if `report_runs`.
+    fn record_mr(
+        &mut self,
+        mr_key: u32,
+        mr: PinnedMr,
+        base_index: u32,
+        phys_addrs: Vec<u64>,
+        report_runs: bool,
+    ) {
+        let PinnedMr {
+            addr,
+            length,
+            pd_handle,
+            access,
+        } = mr;
+        if report_runs {
+            // The MR table has no page size or extent field, every page still takes one PGT
+            // entry. Contiguous runs are only reported.
+            let runs = phys_runs(&phys_addrs);
+            let num_pages = phys_addrs.len();
+            debug!(
+                "mr 0x{addr:x}: {num_pages} pages in {} contiguous runs",
+                runs.len()
+            );
+            let mut va_start_for_debug = addr & (!(PAGE_SIZE as u64));
+            for run in &runs {
+                hot_trace!(
+                    "pgt map va -> pa",
+                    va_start_for_debug,
+                    run.phys_addr,
+                    run.num_pages as u64
+                );
+                va_start_for_debug += (run.num_pages * PAGE_SIZE) as u64;
+            }
+        }
+        if self.mr_cache.is_enabled() {
+            let mr = CachedMr::new(addr, length as u64, pd_handle, access, phys_addrs);
+            self.mr_cache.insert(mr_key, mr);
+        }
+        self.add_atomic_target(mr_key, addr, length, access);
+        self.mw_table
+            .add_mr(mr_key, addr, length, pd_handle, access, base_index);
+        let _ignore = self.pinned_mrs.insert(mr_key, mr);
+    }
+
+    /// Drops the references of `pin_mr` to a range, unpinning the pages no other MR references
+    fn release_pins(&self, addr: u64, length: usize) {
+        let released = self.pin_count.lock().release(addr, length);
+        let handler = self.device.new_umem_handler();
+        for (start, len) in released {
+            if let Err(err) = handler.unpin_pages(start, len) {
+                error!("failed to unpin pages at 0x{start:x}: {err}");
+            }
+        }
+    }
+
+    /// Allocates a `mr_key` and a PGT range, reclaims deferred MRs if the table is exhausted
+    fn register_mtt(&mut self, num_pages: usize) -> Result<(u32, PgtEntry)> {
+        self.reclaim_mrs(false);
+        let (mr_key, pgt_entry) = match self.mtt.register(num_pages) {
+            Ok(entry) => entry,
+            Err(_err) if !self.deferred_free.is_empty() => {
+                self.reclaim_mrs(true);
+                self.mtt.register(num_pages)?
+            }
+            Err(err) => return Err(err.into()),
+        };
+        if let Some(snapshot) = self.snapshot.as_deref() {
+            snapshot.record_key(mr_key);
+        }
+
+        Ok((mr_key, pgt_entry))
+    }
+
+    /// Invalidates the hardware entry of a MR.
+    ///
+    /// The invalidation is submitted without waiting for the device. The pages and the PGT
+    /// range of the MR are reclaimed once the device has applied it.
+    fn free_mr(&mut self, mr_key: u32) {
+        self.atomics.remove_target(mr_key);
+        self.mw_table.remove_mr(mr_key);
+        let _pinned = self.pinned_mrs.remove(&mr_key);
+        let pins = self.mr_pins.remove(&mr_key).unwrap_or_default();
+        let ticket = self
+            .cmd_controller
+            .submit([MttUpdate::invalidate(mr_key).into()]);
+        self.deferred_free.push(ticket, mr_key, pins);
+        if self.deferred_free.len() > MAX_DEFERRED_DEREG {
+            self.reclaim_mrs(true);
+        }
+    }
+
+    /// Unpins and frees the PGT ranges of deferred MRs whose invalidation has completed
+    ///
+    /// Waits for all pending invalidations if `wait` is `true`
+    fn reclaim_mrs(&mut self, wait: bool) {
+        if self.deferred_free.is_empty() {
+            return;
+        }
+        match self.deferred_free.last_ticket() {
+            Some(ticket) if wait => self.cmd_controller.wait(ticket),
+            _ => {
+                let _num = self.cmd_controller.poll();
+            }
+        }
+        let completed = self
+            .deferred_free
+            .pop_completed(|ticket| self.cmd_controller.is_complete(ticket));
+        if completed.is_empty() {
+            return;
+        }
+        let handler = self.device.new_umem_handler();
+        for mr in completed {
+            for (addr, length) in mr.pins {
+                for (start, len) in self.pin_count.get_mut().release(addr, length) {
+                    if let Err(err) = handler.unpin_pages(start, len) {
+                        error!("failed to unpin pages of mr {}: {err}", mr.mr_key);
+                    }
+                }
+            }
+            if let Err(err) = self.mtt.deregister(mr.mr_key) {
+                error!("failed to free mr {}: {err}", mr.mr_key);
+            }
+            if let Some(snapshot) = self.snapshot.as_deref() {
+                snapshot.clear_key(mr.mr_key);
+            }
+            let _mapping = self.dmabuf_maps.remove(&mr.mr_key);
+        }
+    }
+
+    /// Moves a pinned MR to a new range, only the pages not in the current range are pinned.
+    ///
+    /// The PGT range is kept if it is large enough, and the entries of the pages kept at the
+    /// same position are not written again. The MTT entry still has to be updated to the
+    /// returned PGT index.
+    #[allow(clippy::as_conversions, clippy::arithmetic_side_effects)]
+    fn remap_mr(&mut self, mr_key: u32, mr: PinnedMr, addr: u64, length: usize) -> Result<u32> {
+        let num_pages = get_num_page(addr, length);
+        let handler = self.device.new_umem_handler();
+        let mut phys_addrs = Vec::with_capacity(num_pages);
+        let result = mr.page_runs(addr, length).into_iter().try_for_each(
+            |(start, pages, pinned)| -> Result<()> {
+                let run = if pinned {
+                    handler
+                        .virt_to_phys_range(start, pages)?
+                        .into_iter()
+                        .collect::<Option<Vec<_>>>()
+                        .ok_or(RdmaError::MemoryError("Physical address not found".into()))?
+                } else {
+                    pin_and_resolve_slice(&handler, start, pages * PAGE_SIZE, pages)?
+                };
+                phys_addrs.extend(run);
+                Ok(())
+            },
+        );
+        // Also tracks a partially pinned range so that the new pages are unpinned on failure
+        self.pin_count.get_mut().acquire(addr, length);
+        let old_entry = self
+            .mtt
+            .pgt_entry(mr_key)
+            .unwrap_or_else(|| unreachable!("pinned MR without PGT range"));
+        let entry = result.and_then(|()| Ok(self.mtt.resize(mr_key, num_pages)?));
+        let entry = match entry {
+            Ok(entry) => entry,
+            Err(err) => {
+                for (start, len) in self.pin_count.get_mut().release(addr, length) {
+                    if let Err(err) = handler.unpin_pages(start, len) {
+                        error!("failed to unpin pages of mr {mr_key}: {err}");
+                    }
+                }
+                return Err(err);
+            }
+        };
+        let page = PAGE_SIZE as u64;
+        let skip = if entry.index == old_entry.index && addr / page == mr.addr / page {
+            get_num_page(mr.addr, mr.length).min(num_pages)
+        } else {
+            0
+        };
+        let mut writer = PgtWriter::at(
+            &self.cmd_controller,
+            &mut self.mtt_buffer,
+            entry.index + skip as u32,
+        );
+        writer.extend(phys_addrs.get(skip..).unwrap_or_default());
+        writer.finish();
+        debug!(
+            "remap mr {mr_key}: addr=0x{addr:x}, length=0x{length:x}, {} PGT entries written",
+            num_pages - skip
+        );
+
+        Ok(entry.index)
+    }
+
+    /// Waits until the hardware has applied the latest configuration of the QP
+    fn wait_qp_configured(&self, qpn: u32) {
+        if let Some(&Some(ticket)) = self.qp_cmd_tickets.get_qp(qpn) {
+            self.cmd_controller.wait(ticket);
+        }
+    }
+
+    /// Moves the QP to its next ECMP path if the post starts a new flowlet.
+    ///
+    /// The command is not waited, chunks posted before the device applies it still leave on
+    /// the previous path.
+    fn steer_flowlet(&self, qpn: u32) {
+        let Some(multipath) = self.multipath.as_ref() else {
+            return;
+        };
+        let Some(port) = multipath.on_post(qpn, Instant::now()) else {
+            return;
+        };
+        let entry = self.qp_attr_table.map_qp_mut(qpn, |current| {
+            current.udp_port = port;
+            qp_context(current)
+        });
+        if let Some(entry) = entry {
+            let _ticket = self.cmd_controller.submit([entry.into()]);
+        }
+    }
+
+    /// Refuses the posts of the driver to a QP whose send queue is written by a GPU
+    /// Returns `true` if the QP is connected to a QP of the context, the RC QPs of the pair
+    /// pointing at each other on the same address
+    fn has_local_peer(&self, qpn: u32) -> bool {
+        let rc = ibverbs_sys::ibv_qp_type::IBV_QPT_RC as u8;
+        let Some(attr) = self.qp_attr_table.get_qp(qpn) else {
+            return false;
+        };
+        let Some(peer) = self.qp_attr_table.get_qp(attr.dqpn) else {
+            return false;
+        };
+        attr.qpn == qpn
+            && attr.qp_type == rc
+            && peer.qpn == attr.dqpn
+            && peer.qp_type == rc
+            && peer.dqpn == qpn
+            && attr.dqp_ip == attr.ip
+            && peer.ip == attr.ip
+            && peer.dqp_ip == attr.ip
+    }
+
+    /// Copies a chain of RDMA writes and reads of the QP between the MRs of the context when
+    /// the QP is connected to a QP of the context, and generates their completions.
+    ///
+    /// The chain is only copied while the QP has no WR in flight, a copied WR would complete
+    /// before the WRs posted to the card ahead of it otherwise.
+    ///
+    /// # Returns
+    ///
+    /// `false` if the chain goes through the card, nothing is copied then
+    #[allow(unsafe_code)]
+    fn copy_to_local_peer(&self, qpn: u32, wrs: &[SendWr]) -> bool {
+        if !self.config.loopback_copy()
+            || self.poster.credits().occupancy(qpn).0 != 0
+            || !self.has_local_peer(qpn)
+        {
+            return false;
+        }
+        let mut plans = Vec::with_capacity(wrs.len());
+        for wr in wrs {
+            let SendWr::Rdma(wr) = *wr else {
+                return false;
+            };
+            let Some(copies) = loopback::plan(&wr, |key| self.pinned_mrs.get(&key).copied()) else {
+                return false;
+            };
+            plans.push((wr, copies));
+        }
+        for (wr, copies) in plans {
+            for copy in copies {
+                // SAFETY: both ranges are in MRs pinned at registration, which are not
+                // deregistered while the context is borrowed. Overlapping ranges are copied
+                // as by `memmove`.
+                unsafe { std::ptr::copy(copy.src as *const u8, copy.dst as *mut u8, copy.len) };
+            }
+            if wr.send_flags() & ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0 != 0 {
+                let wr_id = wr.wr_id();
+                #[allow(clippy::wildcard_enum_match_arm)]
+                let completion = match wr.opcode() {
+                    WorkReqOpCode::RdmaRead => Completion::RdmaRead { qpn, wr_id },
+                    _ => Completion::RdmaWrite { qpn, wr_id },
+                };
+                self.completion_tx.send(CompletionTask::Untracked {
+                    qpn,
+                    completion,
+                    solicited: false,
+                });
+            }
+        }
+
+        true
+    }
+
+    fn check_posted_by_driver(&self, qpn: u32) -> Result<()> {
+        if self.exported.owns(qpn) {
+            return Err(RdmaError::QpError(format!(
+                "send queue of QP {qpn} is exported to a GPU"
+            )));
+        }
+        Ok(())
+    }
+
+    /// Takes the send queue credit of a WR of the QP
+    fn take_send_credit(&self, qpn: u32) -> Result<()> {
+        if self.poster.credits().take(qpn, 1) == 0 {
+            return Err(send_queue_full(qpn));
+        }
+        Ok(())
+    }
+
+    fn is_direct(&self, qpn: u32) -> bool {
+        self.direct_qps.get_qp(qpn).is_some_and(|x| *x)
+    }
+
+    /// Builds the chunks of the WR on the calling thread and writes them to the send queue
+    fn post_direct(&self, qpn: u32, wr: SendWrRdma) -> Result<()> {
+        let mut chunks = Vec::new();
+        self.poster.post(qpn, wr, |c| chunks.push(c))?;
+        self.doorbell.submit(qpn, chunks);
+
+        Ok(())
+    }
+}
+
+impl<H> VerbsOps for HwDeviceCtx<H>
+where
+    H: HwDevice,
+    H::Adaptor: DeviceAdaptor + Send + 'static,
+    H::DmaBufAllocator: DmaBufAllocator,
+    H::UmemHandler: UmemHandler + Send + 'static,
+{
+    fn reg_mr(&mut self, addr: u64, length: usize, pd_handle: u32, access: u8) -> Result<u32> {
+        /// Access flag of on-demand paging MRs, not passed to the hardware
+        const ACCESS_ON_DEMAND: u8 = ibverbs_sys::ibv_access_flags::IBV_ACCESS_ON_DEMAND.0 as u8;
+        if access & ACCESS_ON_DEMAND != 0 {
+            return self.reg_mr_odp(addr, length, pd_handle, access & !ACCESS_ON_DEMAND);
+        }
+        if let Some(mr_key) = self.reg_mr_cached(addr, length, pd_handle, access)? {
+            return Ok(mr_key);
+        }
+        let num_pages = get_num_page(addr, length);
+        debug!("generate page table entries: addr=0x{addr:x}, length=0x{length:x} --> num_pages={num_pages}");
+        let length_u32 = u32::try_from(length)
+            .map_err(|_err| RdmaError::InvalidInput("Length too large".into()))?;
+        let (mr_key, pgt_entry) = self.register_mtt(num_pages)?;
+        let base_index = pgt_entry.index;
+        let mtt_update = MttUpdate::new(addr, length_u32, mr_key, pd_handle, access, base_index);
+        // TODO: makes updates atomic
+        let mut writer = PgtWriter::new(&self.cmd_controller, &mut self.mtt_buffer, mtt_update);
+        // The addresses are only kept for the cache and the report of the contiguous runs
+        let report_runs = cfg!(feature = "trace_ring") || log_enabled!(Level::Debug);
+        let keep_pages = report_runs || self.mr_cache.is_enabled();
+        let mut phys_addrs = Vec::with_capacity(if keep_pages { num_pages } else { 0 });
+        let result = Self::pin_and_resolve(&self.device, addr, length, num_pages, |pages| {
+            writer.extend(pages);
+            if keep_pages {
+                phys_addrs.extend_from_slice(pages);
+            }
+        });
+        writer.finish();
+        self.pin_count.get_mut().acquire(addr, length);
+        let _ignore = self.mr_pins.insert(mr_key, vec![(addr, length)]);
+        if let Err(err) = result {
+            // The MTT entry may already be applied, and some pages may be pinned
+            self.free_mr(mr_key);
+            return Err(err);
+        }
+        let mr = PinnedMr {
+            addr,
+            length,
+            pd_handle,
+            access,
+        };
+        self.record_mr(mr_key, mr, base_index, phys_addrs, report_runs);
+
+        Ok(mr_key)
+    }
+
+    fn pin_mr(&self, addr: u64, length: usize, access: u8) -> Option<Result<PinnedPages>> {
+        /// Access flag of on-demand paging MRs, not passed to the hardware
+        const ACCESS_ON_DEMAND: u8 = ibverbs_sys::ibv_access_flags::IBV_ACCESS_ON_DEMAND.0 as u8;
+        // On-demand paging MRs are not pinned, and the cache is looked up before pinning, both
+        // need exclusive access to the context
+        if access & ACCESS_ON_DEMAND != 0 || self.mr_cache.is_enabled() {
+            return None;
+        }
+        if u32::try_from(length).is_err() {
+            return Some(Err(RdmaError::InvalidInput("Length too large".into())));
+        }
+        let num_pages = get_num_page(addr, length);
+        // Referenced before they are pinned, so that the deregistration of a MR sharing pages
+        // does not unpin them in between
+        self.pin_count.lock().acquire(addr, length);
+        let mut phys_addrs = Vec::with_capacity(num_pages);
+        let result = Self::pin_and_resolve(&self.device, addr, length, num_pages, |pages| {
+            phys_addrs.extend_from_slice(pages);
+        });
+        Some(match result {
+            Ok(()) => Ok(PinnedPages {
+                addr,
+                length,
+                phys_addrs,
+            }),
+            Err(err) => {
+                self.release_pins(addr, length);
+                Err(err)
+            }
+        })
+    }
+
+    fn reg_pinned_mr(
+        &mut self,
+        pages: PinnedPages,
+        pd_handle: u32,
+        access: u8,
+    ) -> Result<(u32, CmdTicket)> {
+        let PinnedPages {
+            addr,
+            length,
+            phys_addrs,
+        } = pages;
+        let (mr_key, pgt_entry) = match self.register_mtt(phys_addrs.len()) {
+            Ok(x) => x,
+            Err(err) => {
+                self.release_pins(addr, length);
+                return Err(err);
+            }
+        };
+        let base_index = pgt_entry.index;
+        let mtt_update = MttUpdate::new(addr, length as u32, mr_key, pd_handle, access, base_index);
+        let mut writer = PgtWriter::new(&self.cmd_controller, &mut self.mtt_buffer, mtt_update);
+        writer.extend(&phys_addrs);
+        // The device is waited for by the caller, once the context is unlocked
+        let ticket = writer.submit();
+        let _ignore = self.mr_pins.insert(mr_key, vec![(addr, length)]);
+        let report_runs = cfg!(feature = "trace_ring") || log_enabled!(Level::Debug);
+        let mr = PinnedMr {
+            addr,
+            length,
+            pd_handle,
+            access,
+        };
+        self.record_mr(mr_key, mr, base_index, phys_addrs, report_runs);
+
+        Ok((mr_key, ticket))
+    }
+
+    fn wait_cmd(&self, ticket: CmdTicket) {
+        self.cmd_controller.wait(ticket);
+    }
+
+    fn dereg_mr(&mut self, mr_key: u32) -> Result<()> {
+        self.reclaim_mrs(false);
+        self.progress_prefetches();
+        if !self.mr_pins.contains_key(&mr_key) {
+            return Err(RdmaError::InvalidInput(format!(
+                "MR {mr_key} not registered"
+            )));
+        }
+        if self.mw_table.is_bound(mr_key) {
+            return Err(RdmaError::InvalidInput(format!(
+                "MR {mr_key} has bound memory windows"
+            )));
+        }
+        let _odp = self.odp_mrs.remove(&mr_key);
+        let _dm = self.dm.remove_mr(mr_key);
+        let freed = self
+            .mr_cache
+            .release(mr_key)
+            .unwrap_or_else(|| vec![mr_key]);
+        for key in freed {
+            self.free_mr(key);
+        }
+
+        Ok(())
+    }
+
+    fn rereg_mr(
+        &mut self,
+        mr_key: u32,
+        pd_handle: Option<u32>,
+        range: Option<(u64, usize)>,
+        access: Option<u8>,
+    ) -> Result<()> {
+        /// Access flag of on-demand paging MRs, not passed to the hardware
+        const ACCESS_ON_DEMAND: u8 = ibverbs_sys::ibv_access_flags::IBV_ACCESS_ON_DEMAND.0 as u8;
+        // On-demand paging and dma-buf MRs are not pinned, they are registered again instead
+        let mut mr = self
+            .pinned_mrs
+            .get(&mr_key)
+            .copied()
+            .ok_or(RdmaError::InvalidInput(format!(
+                "MR {mr_key} cannot be re-registered"
+            )))?;
+        if access.is_some_and(|access| access & ACCESS_ON_DEMAND != 0) {
+            return Err(RdmaError::InvalidInput(
+                "MRs cannot be re-registered as on-demand paging".into(),
+            ));
+        }
+        if self.mw_table.is_bound(mr_key) {
+            return Err(RdmaError::InvalidInput(format!(
+                "MR {mr_key} has bound memory windows"
+            )));
+        }
+        let length = range.map_or(mr.length, |(_, length)| length);
+        let length_u32 = u32::try_from(length)
+            .map_err(|_err| RdmaError::InvalidInput("Length too large".into()))?;
+        // A registration shared through the cache is also referenced by other MRs
+        if !self.mr_cache.detach(mr_key) {
+            return Err(RdmaError::InvalidInput(format!(
+                "MR {mr_key} is shared by other registrations"
+            )));
+        }
+        let base_index = match range {
+            Some((addr, length)) => self.remap_mr(mr_key, mr, addr, length)?,
+            None => {
+                self.mtt
+                    .pgt_entry(mr_key)
+                    .unwrap_or_else(|| unreachable!("pinned MR without PGT range"))
+                    .index
+            }
+        };
+        let old = mr;
+        if let Some(pd_handle) = pd_handle {
+            mr.pd_handle = pd_handle;
+        }
+        if let Some((addr, length)) = range {
+            mr.addr = addr;
+            mr.length = length;
+        }
+        if let Some(access) = access {
+            mr.access = access;
+        }
+        self.cmd_controller.update_mtt(MttUpdate::new(
+            mr.addr,
+            length_u32,
+            mr_key,
+            mr.pd_handle,
+            mr.access,
+            base_index,
+        ));
+        if range.is_some() {
+            // The pages of the new range are already referenced
+            let handler = self.device.new_umem_handler();
+            let pins = self
+                .mr_pins
+                .insert(mr_key, vec![(mr.addr, mr.length)])
+                .unwrap_or_default();
+            for (addr, length) in pins {
+                for (start, len) in self.pin_count.get_mut().release(addr, length) {
+                    if let Err(err) = handler.unpin_pages(start, len) {
+                        error!("failed to unpin pages of mr {mr_key}: {err}");
+                    }
+                }
+            }
+        }
+        self.atomics.remove_target(mr_key);
+        self.add_atomic_target(mr_key, mr.addr, mr.length, mr.access);
+        self.mw_table.remove_mr(mr_key);
+        self.mw_table.add_mr(
+            mr_key,
+            mr.addr,
+            mr.length,
+            mr.pd_handle,
+            mr.access,
+            base_index,
+        );
+        let _ignore = self.pinned_mrs.insert(mr_key, mr);
+        debug!(
+            "rereg mr {mr_key}: addr=0x{:x} -> 0x{:x}, length=0x{:x} -> 0x{length:x}",
+            old.addr, mr.addr, old.length
+        );
+
+        Ok(())
+    }
+
+    fn reg_dmabuf_mr(
+        &mut self,
+        fd: i32,
+        offset: u64,
+        length: usize,
+        iova: u64,
+        pd_handle: u32,
+        access: u8,
+    ) -> Result<u32> {
+        let length_u32 = u32::try_from(length)
+            .map_err(|_err| RdmaError::InvalidInput("Length too large".into()))?;
+        // The exporter keeps the pages resident while they are mapped, the mapping lives until
+        // the invalidation of the MR completes
+        let mapping = DmabufMapping::map(fd, offset, length)?;
+        let num_pages = get_num_page(iova, length);
+        // Like `reg_mr`, page `i` of the MR is resolved at `i * PAGE_SIZE` from the start of
+        // the range
+        let phys_addrs = self
+            .device
+            .new_umem_handler()
+            .virt_to_phys_range(mapping.addr(), num_pages)?
+            .into_iter()
+            .collect::<Option<Vec<_>>>()
+            .ok_or(RdmaError::MemoryError("dma-buf page not mapped".into()))?;
+        let (mr_key, pgt_entry) = self.register_mtt(num_pages)?;
+        let mtt_update =
+            MttUpdate::new(iova, length_u32, mr_key, pd_handle, access, pgt_entry.index);
+        let mut writer = PgtWriter::new(&self.cmd_controller, &mut self.mtt_buffer, mtt_update);
+        writer.extend(&phys_addrs);
+        writer.finish();
+        let _ignore = self.mr_pins.insert(mr_key, Vec::new());
+        let _ignore = self.dmabuf_maps.insert(mr_key, mapping);
+        debug!(
+            "dmabuf mr {mr_key}: fd={fd}, offset=0x{offset:x}, iova=0x{iova:x}, num_pages={num_pages}"
+        );
+
+        Ok(mr_key)
+    }
+
+    fn alloc_dm(&mut self, length: usize, log_align: u32) -> Result<(u32, u64)> {
+        let (handle, offset) = self.dm.alloc(length, log_align)?;
+        if self.dm_arena.is_none() {
+            match self.allocator.alloc(DM_ARENA_SIZE) {
+                Ok(arena) => self.dm_arena = Some(arena),
+                Err(err) => {
+                    let _ignore = self.dm.free(handle);
+                    return Err(err.into());
+                }
+            }
+        }
+        let arena = self.dm_arena.as_ref().unwrap_or_else(|| unreachable!());
+        let addr = arena.as_ptr() as u64 + offset as u64;
+        debug!("dm {handle}: {length} bytes at offset 0x{offset:x} of the arena");
+
+        Ok((handle, addr))
+    }
+
+    fn free_dm(&mut self, handle: u32) -> Result<()> {
+        self.dm.free(handle)
+    }
+
+    fn reg_dm_mr(
+        &mut self,
+        handle: u32,
+        offset: usize,
+        length: usize,
+        pd_handle: u32,
+        access: u8,
+    ) -> Result<u32> {
+        let range = self.dm.range(handle, offset, length)?;
+        let length_u32 = u32::try_from(length)
+            .map_err(|_err| RdmaError::InvalidInput("Length too large".into()))?;
+        let arena = self.dm_arena.as_ref().unwrap_or_else(|| unreachable!());
+        let (phys_addr, host_addr) = (
+            arena.phys_addr + range.start as u64,
+            arena.as_ptr() as u64 + range.start as u64,
+        );
+        // The arena is contiguous and the range page aligned, a zero-based MR maps page `i` at
+        // `i * PAGE_SIZE` from its physical address
+        let num_pages = get_num_page(0, length);
+        let (mr_key, pgt_entry) = self.register_mtt(num_pages)?;
+        let mtt_update = MttUpdate::new(0, length_u32, mr_key, pd_handle, access, pgt_entry.index);
+        let mut writer = PgtWriter::new(&self.cmd_controller, &mut self.mtt_buffer, mtt_update);
+        writer.extend_contiguous(phys_addr, num_pages);
+        writer.finish();
+        let _ignore = self.mr_pins.insert(mr_key, Vec::new());
+        self.dm.insert_mr(mr_key, handle);
+        self.add_mapped_atomic_target(mr_key, 0, host_addr, length, access);
+        debug!("dm mr {mr_key}: dm={handle}, offset=0x{offset:x}, num_pages={num_pages}");
+
+        Ok(mr_key)
+    }
+
+    fn advise_mr(&mut self, pd_handle: u32, flush: bool, sg_list: &[Sge]) -> Result<()> {
+        self.progress_prefetches();
+        // Read and write prefetches are handled the same, `mlock` breaks the copy on write of
+        // private pages
+        for &sge in sg_list {
+            let Some(job) = self.prefetch_job(pd_handle, sge)? else {
+                continue;
+            };
+            if flush {
+                self.prefetch_odp(job)?;
+            } else {
+                self.prefetch_odp_async(job)?;
+            }
+        }
+
+        Ok(())
+    }
+
+    fn caps(&self) -> DeviceCaps {
+        self.caps
+    }
+
+    /// Reusable if configured resident and holding no resources other than the unreferenced
+    /// registrations of the MR cache, which stay valid for the next open of the process
+    fn is_reusable(&self) -> bool {
+        self.config.resident()
+            && self.qp_manager.iter_allocated().next().is_none()
+            && self.cq_manager.is_empty()
+            && self.pd_table.is_empty()
+            && self.srq_table.is_empty()
+            && self
+                .mr_pins
+                .keys()
+                .all(|&mr_key| self.mr_cache.is_unreferenced(mr_key))
+    }
+
+    fn create_qp(&mut self, attr: IbvQpInitAttr) -> Result<u32> {
+        let (qpn, entry) = self.alloc_qp(attr)?;
+        if let Some(entry) = entry {
+            // The command is not waited here, so that setups of many QPs overlap. Posting to
+            // the QP waits for the ticket instead.
+            let ticket = self.cmd_controller.submit([entry.into()]);
+            let _ignore = self.qp_cmd_tickets.replace(qpn, Some(ticket));
+        }
+
+        Ok(qpn)
+    }
+
+    fn create_qps(&mut self, attrs: &[IbvQpInitAttr]) -> Result<Vec<u32>> {
+        let mut qpns = Vec::with_capacity(attrs.len());
+        let mut entries = Vec::with_capacity(attrs.len());
+        for &attr in attrs {
+            match self.alloc_qp(attr) {
+                Ok((qpn, entry)) => {
+                    qpns.push(qpn);
+                    entries.extend(entry);
+                }
+                Err(err) => {
+                    // Nothing has been written to the device yet
+                    for qpn in qpns {
+                        let _ignore = self.destroy_qp(qpn);
+                    }
+                    return Err(err);
+                }
+            }
+        }
+        // The QP contexts are written to the device with a single doorbell
+        let ticket = self
+            .cmd_controller
+            .submit(entries.iter().map(|&entry| entry.into()));
+        for entry in entries {
+            let _ignore = self.qp_cmd_tickets.replace(entry.qpn, Some(ticket));
+        }
+
+        Ok(qpns)
+    }
+
+    fn create_pending_qp(&mut self, attr: IbvQpInitAttr) -> Result<(u32, Ipv4Addr)> {
+        if attr.qp_type() != ibverbs_sys::ibv_qp_type::IBV_QPT_RC as u8 {
+            return Err(RdmaError::InvalidInput(
+                "only RC QPs can be created pending".into(),
+            ));
+        }
+        // The context of the creation is not written, the context written by the first
+        // update carries all of it
+        let (qpn, _entry) = self.alloc_qp(attr)?;
+        let ip = self
+            .qp_attr_table
+            .map_qp(qpn, |current| Ipv4Addr::from_bits(current.ip))
+            .ok_or(RdmaError::NotFound(format!("QP {qpn} not found")))?;
+        if !self.config.in_band_recv() {
+            // The listener is bound while the peer address is exchanged, the peer may post
+            // receives as soon as its side is connected
+            let listening = self
+                .recv_worker()
+                .and_then(|worker| worker.listen(ip, qpn).map_err(Into::into));
+            if let Err(err) = listening {
+                let _ignore = self.destroy_qp(qpn);
+                return Err(err);
+            }
+        }
+
+        Ok((qpn, ip))
+    }
+
+    fn update_qp(&mut self, qpn: u32, attr: IbvQpAttr) -> Result<()> {
+        let Some(entry) = self.prepare_qp_update(qpn, &attr)? else {
+            return Ok(());
+        };
+        let ticket = self.cmd_controller.submit([entry.into()]);
+        let _ignore = self.qp_cmd_tickets.replace(qpn, Some(ticket));
+        self.complete_qp_update(qpn)?;
+        self.checkpoint_qp(qpn);
+
+        Ok(())
+    }
+
+    fn restored_qps(&self) -> Vec<u32> {
+        let mut qpns: Vec<_> = self.restored_qps.keys().copied().collect();
+        qpns.sort_unstable();
+        qpns
+    }
+
+    fn reattach_qp(&mut self, qpn: u32, init: IbvQpInitAttr, attr: IbvQpAttr) -> Result<()> {
+        let record = self
+            .restored_qps
+            .get(&qpn)
+            .copied()
+            .ok_or(RdmaError::NotFound(format!("QP {qpn} was not restored")))?;
+        if init.qp_type() != record.qp_type || init.srq().is_some() {
+            return Err(RdmaError::InvalidInput(format!(
+                "QP {qpn} was recorded as a RC QP without SRQ"
+            )));
+        }
+        // The context of the creation is not written, the context written by the update
+        // carries all of it
+        let (qpn, _entry) = self.alloc_qp_at(init, Some(qpn))?;
+        let _restored = self.restored_qps.remove(&qpn);
+        let conn = IbvQpAttr {
+            qp_state: Some(ibverbs_sys::ibv_qp_state::IBV_QPS_RTS),
+            path_mtu: Some(ibverbs_sys::ibv_mtu::from(record.pmtu)),
+            dest_qp_num: Some(record.dqpn),
+            dest_qp_ip: Some(Ipv4Addr::from_bits(record.dqp_ip)),
+            qp_access_flags: Some(u32::from(record.access_flags)),
+            max_rd_atomic: Some(record.max_rd_atomic),
+            max_dest_rd_atomic: Some(record.max_dest_rd_atomic),
+            ..attr
+        };
+        self.update_qp(qpn, conn)
+    }
+
+    fn update_qps(
+        &mut self,
+        updates: &[(u32, IbvQpAttr)],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        let mut result = Ok(());
+        let mut staged = Vec::with_capacity(updates.len());
+        for (i, &(qpn, attr)) in updates.iter().enumerate() {
+            match self.prepare_qp_update(qpn, &attr) {
+                Ok(Some(entry)) => staged.push((i, entry)),
+                Ok(None) => {}
+                Err(err) => {
+                    result = Err((i, err));
+                    break;
+                }
+            }
+        }
+        // Updates preceding the failed one are still applied. The QP contexts are written to
+        // the device with a single doorbell.
+        let ticket = self
+            .cmd_controller
+            .submit(staged.iter().map(|&(_, entry)| entry.into()));
+        for &(_, entry) in &staged {
+            let _ignore = self.qp_cmd_tickets.replace(entry.qpn, Some(ticket));
+        }
+        for (i, entry) in staged {
+            self.complete_qp_update(entry.qpn).map_err(|err| (i, err))?;
+            self.checkpoint_qp(entry.qpn);
+        }
+
+        result
+    }
+
+    fn destroy_qp(&mut self, qpn: u32) -> Result<()> {
+        if self.qp_manager.destroy_qp(qpn) {
+            let _restored = self.restored_qps.remove(&qpn);
+            if let Some(snapshot) = self.snapshot.as_deref() {
+                snapshot.clear_qp(qpn);
+            }
+            self.inline_slots.release_qp(qpn);
+            self.atomics.release_qp(qpn);
+            if let Some(rings) = self.recv_rings.as_mut() {
+                rings.reset(qpn);
+            }
+            // The worker side state is reset for the next QP of the index, the listener of
+            // the post receive channel stays bound
+            if self.post_recv_tx_table.remove(qpn) {
+                if let Some(worker) = self.recv_worker.as_ref() {
+                    if let Err(err) = worker.remove(qpn) {
+                        error!("failed to close post recv channel of qp {qpn}: {err}");
+                    }
+                }
+            }
+            self.recv_wr_queue_table.reset(qpn);
+            let _ignore = self.direct_qps.replace(qpn, false);
+            let _ignore = self.exported.release(qpn);
+            let _ignore = self.qp_cmd_tickets.replace(qpn, None);
+            if let Some(multipath) = self.multipath.as_ref() {
+                multipath.reset(qpn);
+            }
+            self.rate.reset(qpn);
+            self.priorities.set(qpn, 0);
+            self.ud_qps.destroy(qpn);
+            self.raw_qps.destroy(qpn);
+            self.xrc.remove_target(qpn);
+            if self.tds.detach(qpn) {
+                self.doorbell.scheduler().unpin(qpn);
+            }
+            for context in self.dc_qps.destroy(qpn) {
+                if let Err(err) = self.destroy_qp(context) {
+                    error!("failed to destroy context {context} of dc qp {qpn}: {err}");
+                }
+            }
+            // The WRs lent to the QP are lent to the other QPs of the SRQ
+            if let Some(srq) = self.srq_table.srq_of(qpn) {
+                self.srq_table.detach(qpn);
+                if let Err(err) = self.refill_srq(srq) {
+                    error!("failed to refill srq {srq}: {err}");
+                }
+            }
+            Ok(())
+        } else {
+            Err(RdmaError::InvalidInput(format!("QPN {qpn} not present")))
+        }
+    }
+
+    fn create_cq(&mut self, cqe: u32) -> Result<u32> {
+        // Completions of shared rings skip the latency histograms, so they are only shared
+        // when the latency is not measured
+        self.alloc_cq(cqe, false, !cfg!(feature = "latency_stats"))
+    }
+
+    fn create_cq_ex(&mut self, cqe: u32, timestamps: bool) -> Result<u32> {
+        self.alloc_cq(cqe, timestamps, false)
+    }
+
+    fn shared_cq_ring(&mut self, handle: u32) -> Option<*const WcRing> {
+        self.cq_table
+            .get_cq_mut(handle)?
+            .shared_ring()
+            .map(Arc::as_ptr)
+    }
+
+    fn destroy_cq(&mut self, handle: u32) -> Result<()> {
+        if self.cq_manager.destroy_cq(handle) {
+            let _ignore = self.cq_table.remove(handle);
+            if let Some(moderator) = self.cq_moderator.as_ref() {
+                moderator.unwatch(handle);
+            }
+            self.completion_tx
+                .send(CompletionTask::DestroyCq { handle });
+            Ok(())
+        } else {
+            Err(RdmaError::InvalidInput(format!(
+                "CQ handle {handle} not present"
+            )))
+        }
+    }
+
+    fn resize_cq(&mut self, handle: u32, cqe: u32) -> Result<()> {
+        let cq = self
+            .cq_table
+            .get_cq_mut(handle)
+            .ok_or_else(|| RdmaError::InvalidInput(format!("CQ handle {handle} not present")))?;
+        let producer = cq.resize(handle, cqe as usize).ok_or_else(|| {
+            RdmaError::InvalidInput(format!("CQ size {cqe} exceeds the maximum of {MAX_CQE}"))
+        })?;
+        self.completion_tx
+            .send(CompletionTask::ResizeCq { producer });
+        Ok(())
+    }
+
+    fn post_send(&mut self, qpn: u32, wr: SendWr) -> Result<()> {
+        sdt_probe!("post_send", qpn, wr.length());
+        self.check_posted_by_driver(qpn)?;
+        if self.copy_to_local_peer(qpn, &[wr]) {
+            return Ok(());
+        }
+        self.take_send_credit(qpn)?;
+        let result = self.stage_inline(qpn, wr).and_then(|wr| {
+            let result = match wr {
+                SendWr::Rdma(wr) => self.rdma_write(qpn, wr),
+                SendWr::Send(wr) => self.send(qpn, wr),
+            };
+            if result.is_err() {
+                self.cancel_inline(wr.send_flags(), wr.laddr());
+            }
+            result
+        });
+        // A WR that failed to post never completes
+        if result.is_err() {
+            self.poster.credits().give_back(qpn, 1);
+        }
+
+        result
+    }
+
+    fn post_send_batch(
+        &mut self,
+        qpn: u32,
+        wrs: &[SendWr],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        self.check_posted_by_driver(qpn).map_err(|err| (0, err))?;
+        if self.copy_to_local_peer(qpn, wrs) {
+            return Ok(());
+        }
+        self.progress_recv_ring(qpn);
+        let mut resolved = Vec::with_capacity(wrs.len());
+        let mut result = Ok(());
+        let mut wrs = wrs.iter().copied().enumerate();
+        let mut backlogged = None;
+        for (i, wr) in wrs.by_ref() {
+            if let Err(err) = self.take_send_credit(qpn) {
+                result = Err((i, err));
+                break;
+            }
+            let wr = match self.stage_inline(qpn, wr) {
+                Ok(SendWr::Rdma(wr)) => Ok(wr),
+                Ok(SendWr::Send(wr)) => match self.recv_wr_queue_table.try_resolve(qpn, wr) {
+                    Ok(Some(wr)) if self.offer_pull(qpn, &wr) => continue,
+                    Ok(Some(wr)) => Ok(wr),
+                    Ok(None) => {
+                        backlogged = Some((i, wr));
+                        break;
+                    }
+                    Err(err) => {
+                        self.cancel_inline(wr.send_flags, wr.laddr);
+                        Err(err)
+                    }
+                },
+                Err(err) => Err(err),
+            };
+            match wr {
+                Ok(wr) => resolved.push(wr),
+                Err(err) => {
+                    self.poster.credits().give_back(qpn, 1);
+                    result = Err((i, err));
+                    break;
+                }
+            }
+        }
+        // WRs preceding the failed one are still submitted, as required by the verbs semantics
+        self.wait_qp_configured(qpn);
+        self.steer_flowlet(qpn);
+        if self.is_direct(qpn) {
+            let num = resolved.len() + usize::from(backlogged.is_some());
+            for (i, wr) in resolved.into_iter().enumerate() {
+                if let Err(err) = self.post_direct(qpn, wr) {
+                    self.cancel_inline(wr.send_flags(), wr.laddr());
+                    // Neither the failed WR nor the WRs following it are posted
+                    self.poster.credits().give_back(qpn, (num - i) as u32);
+                    return Err((i, err));
+                }
+            }
+        } else if !resolved.is_empty() {
+            self.rdma_write_tx
+                .send(RdmaWriteTask::new_write_batch(qpn, resolved));
+        }
+        // A send waiting for a receive WR is queued only after the preceding WRs are submitted,
+        // the rest of the chain is posted one by one behind it
+        if let Some((i, wr)) = backlogged {
+            if let Err(err) = self.send(qpn, wr) {
+                self.cancel_inline(wr.send_flags, wr.laddr);
+                self.poster.credits().give_back(qpn, 1);
+                return Err((i, err));
+            }
+            for (i, wr) in wrs {
+                self.post_send(qpn, wr).map_err(|err| (i, err))?;
+            }
+        }
+
+        result
+    }
+
+    fn post_send_shared(
+        &self,
+        qpn: u32,
+        wrs: &[SendWr],
+    ) -> Option<std::result::Result<(), (usize, RdmaError)>> {
+        // Sends are matched with the receive WRs of the peer, and inline WRs may register the
+        // bounce buffer, both need exclusive access to the context. RDMA WRs only touch the
+        // per-QP send queue state.
+        if let Err(err) = self.check_posted_by_driver(qpn) {
+            return Some(Err((0, err)));
+        }
+        if self.copy_to_local_peer(qpn, wrs) {
+            return Some(Ok(()));
+        }
+        let mut resolved = Vec::with_capacity(wrs.len());
+        for wr in wrs {
+            match *wr {
+                SendWr::Rdma(wr)
+                    if wr.send_flags() & ibverbs_sys::ibv_send_flags::IBV_SEND_INLINE.0 == 0 =>
+                {
+                    resolved.push(wr);
+                }
+                _ => return None,
+            }
+        }
+        // The WRs finding no credit fail, the preceding ones are still submitted
+        let taken = self.poster.credits().take(qpn, resolved.len());
+        let result = if taken < resolved.len() {
+            Err((taken, send_queue_full(qpn)))
+        } else {
+            Ok(())
+        };
+        resolved.truncate(taken);
+        self.wait_qp_configured(qpn);
+        self.steer_flowlet(qpn);
+        if self.is_direct(qpn) {
+            for (i, wr) in resolved.into_iter().enumerate() {
+                if let Err(err) = self.post_direct(qpn, wr) {
+                    self.poster.credits().give_back(qpn, (taken - i) as u32);
+                    return Some(Err((i, err)));
+                }
+            }
+        } else if !resolved.is_empty() {
+            self.rdma_write_tx
+                .send(RdmaWriteTask::new_write_batch(qpn, resolved));
+        }
+
+        Some(result)
+    }
+
+    fn ring_sq_doorbell(&self, qpn: u32, ring: &Arc<SqRing>) -> Result<()> {
+        if self.qp_attr_table.get_qp(qpn).is_none() {
+            return Err(RdmaError::QpError(format!("QP {qpn} not found")));
+        }
+        self.check_posted_by_driver(qpn)?;
+        self.wait_qp_configured(qpn);
+        self.steer_flowlet(qpn);
+        if self.is_direct(qpn) {
+            while let Some(entry) = ring.pop() {
+                let wr = entry.to_wr().ok_or_else(|| {
+                    RdmaError::Unimplemented("opcode not supported by the SQ ring".into())
+                })?;
+                self.post_direct(qpn, wr)?;
+            }
+        } else {
+            self.rdma_write_tx
+                .send(RdmaWriteTask::new_doorbell(qpn, Arc::clone(ring)));
+        }
+
+        Ok(())
+    }
+
+    fn export_send_queue(
+        &mut self,
+        qpn: u32,
+        fd: i32,
+        offset: u64,
+        length: usize,
+    ) -> Result<ExportedSendQueue> {
+        if self.qp_attr_table.get_qp(qpn).is_none() {
+            return Err(RdmaError::QpError(format!("QP {qpn} not found")));
+        }
+        if self.exported.owns(qpn) {
+            return Err(RdmaError::InvalidInput(format!(
+                "send queue of QP {qpn} is already exported"
+            )));
+        }
+        let depth = self.config.rings().send;
+        let ring_len = depth * DESC_SIZE;
+        if length < ring_len || offset % PAGE_SIZE as u64 != 0 {
+            return Err(RdmaError::InvalidInput(format!(
+                "send queue ring of 0x{length:x} bytes at offset 0x{offset:x}, expected 0x{ring_len:x} bytes at a page boundary"
+            )));
+        }
+        // The exporter keeps the pages resident while they are mapped
+        let mapping = DmabufMapping::map(fd, offset, ring_len)?;
+        let phys_addrs = self
+            .device
+            .new_umem_handler()
+            .virt_to_phys_range(mapping.addr(), ring_len.div_ceil(PAGE_SIZE))?
+            .into_iter()
+            .collect::<Option<Vec<_>>>()
+            .ok_or(RdmaError::MemoryError("dma-buf page not mapped".into()))?;
+        let ring_addr = phys_addrs
+            .first()
+            .copied()
+            .unwrap_or_else(|| unreachable!("ring of at least one page"));
+        // The hardware reads the ring from a single base address
+        if phys_addrs
+            .iter()
+            .zip(0u64..)
+            .any(|(&addr, i)| addr != ring_addr + i * PAGE_SIZE as u64)
+        {
+            return Err(RdmaError::MemoryError(
+                "send queue ring is not contiguous for the device".into(),
+            ));
+        }
+        let lent = self.exported.lend(qpn, ring_addr, mapping)?;
+        let (head, tail, start) = lent.ok_or(RdmaError::ResourceExhausted(
+            "no GPU send channel left".into(),
+        ))?;
+        let doorbell = match self.device.map_csr_page(head) {
+            Ok(doorbell) => doorbell,
+            Err(err) => {
+                let _ignore = self.exported.release(qpn);
+                return Err(err);
+            }
+        };
+        let page = doorbell.len();
+        let base = head - head % page;
+        let Some(tail) = tail.checked_sub(base).filter(|&x| x < page) else {
+            let _ignore = self.exported.release(qpn);
+            return Err(RdmaError::DeviceError(
+                "head and tail CSRs of the channel are on different pages".into(),
+            ));
+        };
+
+        Ok(ExportedSendQueue {
+            depth,
+            start,
+            doorbell,
+            head: head - base,
+            tail,
+        })
+    }
+
+    fn release_send_queue(&mut self, qpn: u32) -> Result<()> {
+        if !self.exported.release(qpn) {
+            return Err(RdmaError::NotFound(format!(
+                "send queue of QP {qpn} is not exported"
+            )));
+        }
+        Ok(())
+    }
+
+    fn poll_cq(&mut self, handle: u32, max_num_entries: usize) -> Vec<Completion> {
+        self.progress_recv_rings();
+        self.progress_datagrams();
+        self.progress_dc();
+        self.progress_prefetches();
+        self.apply_neighbour_changes();
+        let Some(cq) = self.cq_table.get_cq_mut(handle) else {
+            return vec![];
+        };
+        let completions: Vec<_> = iter::repeat_with(|| cq.pop_front())
+            .take_while(Option::is_some)
+            .take(max_num_entries)
+            .flatten()
+            .collect();
+        sdt_probe!("poll_cq", handle, completions.len() as u64);
+        if !self.srq_table.is_empty() {
+            self.srq_consumed(completions.iter().filter_map(|x| match *x {
+                Completion::Recv { qpn, .. } => Some(qpn),
+                _ => None,
+            }));
+        }
+
+        completions
+    }
+
+    fn poll_cq_into(&mut self, handle: u32, wc: &mut [ibverbs_sys::ibv_wc]) -> usize {
+        self.progress_recv_rings();
+        self.progress_datagrams();
+        self.progress_dc();
+        self.progress_prefetches();
+        self.apply_neighbour_changes();
+        let num = self
+            .cq_table
+            .get_cq_mut(handle)
+            .map_or(0, |cq| cq.poll_into(wc));
+        if !self.srq_table.is_empty() {
+            let recv_qpns: Vec<_> = wc
+                .iter()
+                .take(num)
+                .filter(|x| x.opcode == ibverbs_sys::ibv_wc_opcode::IBV_WC_RECV)
+                .map(|x| x.qp_num)
+                .collect();
+            self.srq_consumed(recv_qpns);
+        }
+
+        num
+    }
+
+    fn poll_cq_slot(&mut self, handle: u32, start: bool) -> Option<CqSlot> {
+        // Receive rings are progressed once per batch rather than once per completion
+        if start {
+            self.progress_recv_rings();
+            self.progress_datagrams();
+            self.progress_dc();
+            self.progress_prefetches();
+            self.apply_neighbour_changes();
+        }
+        let slot = self.cq_table.get_cq_mut(handle)?.pop_slot()?;
+        if !self.srq_table.is_empty() {
+            if let Completion::Recv { qpn, .. } = *slot.completion() {
+                self.srq_consumed([qpn]);
+            }
+        }
+
+        Some(slot)
+    }
+
+    fn req_notify_cq(&mut self, handle: u32, solicited_only: bool) -> Result<()> {
+        let cq = self
+            .cq_table
+            .get_cq_mut(handle)
+            .ok_or(RdmaError::NotFound(format!("CQ {handle} not found")))?;
+        cq.notify().arm(solicited_only);
+
+        Ok(())
+    }
+
+    fn modify_cq(&mut self, handle: u32, count: u16, period_us: u16) -> Result<()> {
+        let cq = self
+            .cq_table
+            .get_cq_mut(handle)
+            .ok_or(RdmaError::NotFound(format!("CQ {handle} not found")))?;
+        cq.notify()
+            .moderate(count, Duration::from_micros(period_us.into()));
+        let notify = Arc::clone(cq.shared_notify());
+        if !notify.has_period() {
+            if let Some(moderator) = self.cq_moderator.as_ref() {
+                moderator.unwatch(handle);
+            }
+            return Ok(());
+        }
+        if self.cq_moderator.is_none() {
+            self.cq_moderator = Some(CqModerator::spawn()?);
+        }
+        self.cq_moderator
+            .as_ref()
+            .unwrap_or_else(|| unreachable!("moderator spawned above"))
+            .watch(handle, notify);
+
+        Ok(())
+    }
+
+    fn bind_comp_channel(&mut self, handle: u32, channel_fd: RawFd, cq_cookie: u64) -> Result<()> {
+        let tx = self.comp_channels.sender(channel_fd, cq_cookie)?;
+        let cq = self
+            .cq_table
+            .get_cq_mut(handle)
+            .ok_or(RdmaError::NotFound(format!("CQ {handle} not found")))?;
+        if !cq.notify().bind(tx) {
+            return Err(RdmaError::InvalidInput(format!(
+                "CQ {handle} is already bound to a completion channel"
+            )));
+        }
+
+        Ok(())
+    }
+
+    fn register_cq_waker(&mut self, handle: u32, waker: &Waker) -> Result<()> {
+        let cq = self
+            .cq_table
+            .get_cq_mut(handle)
+            .ok_or(RdmaError::NotFound(format!("CQ {handle} not found")))?;
+        cq.notify().register_waker(waker);
+
+        Ok(())
+    }
+
+    fn get_async_event(&mut self) -> Option<AsyncEvent> {
+        self.async_events.pop()
+    }
+
+    fn post_recv(&mut self, qpn: u32, wr: RecvWr) -> Result<()> {
+        self.post_recv_batch(qpn, std::slice::from_ref(&wr))
+            .map_err(|(_, err)| err)
+    }
+
+    fn post_recv_batch(
+        &mut self,
+        qpn: u32,
+        wrs: &[RecvWr],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        let qp = self
+            .qp_attr_table
+            .get_qp(qpn)
+            .ok_or((0, RdmaError::QpError(format!("QP {qpn} not found",))))?;
+        if self.srq_table.srq_of(qpn).is_some() {
+            return Err((
+                0,
+                RdmaError::InvalidInput(format!("QP {qpn} receives from a SRQ")),
+            ));
+        }
+        if self.ud_qps.contains(qpn) {
+            for (i, wr) in wrs.iter().copied().enumerate() {
+                self.ud_qps.post_recv(qpn, wr).map_err(|err| (i, err))?;
+            }
+            return Ok(());
+        }
+        if self.raw_qps.contains(qpn) {
+            for (i, wr) in wrs.iter().copied().enumerate() {
+                self.raw_qps.post_recv(qpn, wr).map_err(|err| (i, err))?;
+            }
+            return Ok(());
+        }
+        if is_xrc(qp.qp_type) {
+            return Err((
+                0,
+                RdmaError::InvalidInput(format!(
+                    "XRC QP {qpn} receives through the SRQs of its XRCD"
+                )),
+            ));
+        }
+        if self.dc_qps.contains(qpn) {
+            return Err((
+                0,
+                RdmaError::InvalidInput(format!("DC QP {qpn} only carries RDMA operations")),
+            ));
+        }
+
+        match *wrs {
+            [] => Ok(()),
+            [wr] => self.advertise_recv(qpn, wr),
+            _ => self.advertise_recvs(qpn, wrs),
+        }
+        .map_err(|err| (0, err))
+    }
+
+    fn create_ah(&mut self, dest: Ipv4Addr) -> Result<u32> {
+        Ok(self.ah_table.create(dest))
+    }
+
+    fn destroy_ah(&mut self, handle: u32) -> Result<()> {
+        if self.ah_table.destroy(handle) {
+            Ok(())
+        } else {
+            Err(RdmaError::InvalidInput(format!("AH {handle} not present")))
+        }
+    }
+
+    fn post_send_ud(
+        &mut self,
+        qpn: u32,
+        wrs: &[UdSendWr],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        for (i, wr) in wrs.iter().enumerate() {
+            let dest = self.ah_table.get(wr.ah).ok_or((
+                i,
+                RdmaError::InvalidInput(format!("AH {} not present", wr.ah)),
+            ))?;
+            self.ud_qps.send(qpn, dest, wr).map_err(|err| (i, err))?;
+            // The datagram is handed to the socket, there is no ACK to wait for
+            if wr.base.send_flags & ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0 != 0 {
+                self.completion_tx.send(CompletionTask::Untracked {
+                    qpn,
+                    completion: Completion::Send {
+                        qpn,
+                        wr_id: wr.base.wr_id,
+                    },
+                    solicited: false,
+                });
+            }
+        }
+        Ok(())
+    }
+
+    fn attach_mcast(&mut self, qpn: u32, group: Ipv4Addr) -> Result<()> {
+        if !self.ud_qps.contains(qpn) {
+            return Err(RdmaError::InvalidInput(format!(
+                "QP {qpn} is not a UD QP, only UD QPs join multicast groups"
+            )));
+        }
+        self.ud_qps.attach_mcast(qpn, group)
+    }
+
+    fn detach_mcast(&mut self, qpn: u32, group: Ipv4Addr) -> Result<()> {
+        self.ud_qps.detach_mcast(qpn, group)
+    }
+
+    fn post_send_raw(
+        &mut self,
+        qpn: u32,
+        wrs: &[SendWrBase],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        for (i, wr) in wrs.iter().enumerate() {
+            self.raw_qps
+                .send(&mut self.raw_tx, wr)
+                .map_err(|err| (i, err))?;
+            // The frame is queued on the ring, there is no ACK to wait for
+            if wr.send_flags & ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0 != 0 {
+                self.completion_tx.send(CompletionTask::Untracked {
+                    qpn,
+                    completion: Completion::Send {
+                        qpn,
+                        wr_id: wr.wr_id,
+                    },
+                    solicited: false,
+                });
+            }
+        }
+        Ok(())
+    }
+
+    fn create_flow(&mut self, qpn: u32, spec: FlowSpec) -> Result<u32> {
+        self.raw_qps.create_flow(qpn, spec)
+    }
+
+    fn destroy_flow(&mut self, handle: u32) -> Result<()> {
+        self.raw_qps.destroy_flow(handle)
+    }
+
+    fn post_send_dc(
+        &mut self,
+        qpn: u32,
+        wrs: &[DcSendWr],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        for (i, wr) in wrs.iter().enumerate() {
+            // The target contexts have no receive WRs, only RDMA operations reach the peer
+            if matches!(wr.wr, SendWr::Send(_)) {
+                return Err((
+                    i,
+                    RdmaError::InvalidInput(format!("DC QP {qpn} only carries RDMA operations")),
+                ));
+            }
+            let ip = self.ah_table.get(wr.ah).ok_or((
+                i,
+                RdmaError::InvalidInput(format!("AH {} not present", wr.ah)),
+            ))?;
+            let peer = DcPeer {
+                ip,
+                qpn: wr.remote_qpn,
+                srqn: None,
+            };
+            let context = match self.dc_qps.lookup(qpn, peer) {
+                Some(context) => context,
+                None => self.bind_initiator(qpn, peer).map_err(|err| (i, err))?,
+            };
+            self.post_send(context, wr.wr).map_err(|err| (i, err))?;
+        }
+        Ok(())
+    }
+
+    fn post_send_xrc(
+        &mut self,
+        qpn: u32,
+        wrs: &[XrcSendWr],
+    ) -> std::result::Result<(), (usize, RdmaError)> {
+        let (ip, tgt_qpn) = self
+            .qp_attr_table
+            .map_qp(qpn, |current| (current.dqp_ip, current.dqpn))
+            .ok_or((0, RdmaError::QpError(format!("QP {qpn} not found"))))?;
+        if ip == 0 || tgt_qpn == 0 {
+            return Err((
+                0,
+                RdmaError::InvalidInput(format!("XRC QP {qpn} is not connected to a TGT QP")),
+            ));
+        }
+        for (i, wr) in wrs.iter().enumerate() {
+            let peer = DcPeer {
+                ip: Ipv4Addr::from_bits(ip),
+                qpn: tgt_qpn,
+                srqn: Some(wr.remote_srqn),
+            };
+            let context = match self.dc_qps.lookup(qpn, peer) {
+                Some(context) => context,
+                None => self.bind_initiator(qpn, peer).map_err(|err| (i, err))?,
+            };
+            self.post_send(context, wr.wr).map_err(|err| (i, err))?;
+        }
+        Ok(())
+    }
+
+    fn alloc_mw(&mut self, pd_handle: u32) -> Result<u32> {
+        let rkey = self.mtt.register_window()?;
+        if let Some(snapshot) = self.snapshot.as_deref() {
+            snapshot.record_key(rkey);
+        }
+        Ok(self.mw_table.alloc(rkey, pd_handle))
+    }
+
+    fn dealloc_mw(&mut self, handle: u32) -> Result<()> {
+        if let Some(rkey) = self.mw_table.dealloc(handle)? {
+            self.revoke_window(rkey);
+        }
+        self.mtt.deregister_window(handle);
+        if let Some(snapshot) = self.snapshot.as_deref() {
+            snapshot.clear_key(handle);
+        }
+        Ok(())
+    }
+
+    fn post_mw(&mut self, qpn: u32, wr: MwWr) -> Result<()> {
+        // The entry is written before the WR completes, accesses of the peer through the new
+        // key succeed, and accesses through a revoked key fail, once the completion is polled
+        let completion = match wr {
+            MwWr::Bind {
+                wr_id,
+                handle,
+                rkey,
+                mr_key,
+                addr,
+                length,
+                access,
+                ..
+            } => {
+                let (binding, previous) = self
+                    .mw_table
+                    .bind(handle, rkey, mr_key, addr, length, access)?;
+                if let Some(previous) = previous {
+                    // The entry of the window is overwritten, only the atomics see the old key
+                    self.atomics.remove_target(previous);
+                }
+                let ticket = self.cmd_controller.submit([binding.update.into()]);
+                self.cmd_controller.wait(ticket);
+                self.add_atomic_target(binding.rkey, binding.addr, binding.length, binding.access);
+                Completion::BindMw { qpn, wr_id }
+            }
+            MwWr::LocalInv { wr_id, rkey, .. } => {
+                self.mw_table.invalidate(rkey)?;
+                self.revoke_window(rkey);
+                Completion::LocalInv { qpn, wr_id }
+            }
+        };
+        if wr.send_flags() & ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0 != 0 {
+            self.completion_tx.send(CompletionTask::Untracked {
+                qpn,
+                completion,
+                solicited: false,
+            });
+        }
+        Ok(())
+    }
+
+    fn create_srq(&mut self, max_wr: u32, srq_limit: u32) -> Result<u32> {
+        let handle = self.srq_table.create(max_wr, srq_limit)?;
+        // Receive completions of SRQ QPs refill the SRQs in `poll_cq`
+        self.poll_rings_through_driver();
+        Ok(handle)
+    }
+
+    fn destroy_srq(&mut self, handle: u32) -> Result<()> {
+        self.srq_table.destroy(handle)?;
+        self.xrc.remove_srq(handle);
+        Ok(())
+    }
+
+    fn modify_srq(
+        &mut self,
+        handle: u32,
+        max_wr: Option<u32>,
+        srq_limit: Option<u32>,
+    ) -> Result<()> {
+        self.srq_table.modify(handle, max_wr, srq_limit)
+    }
+
+    fn query_srq(&mut self, handle: u32) -> Result<(u32, u32)> {
+        self.srq_table.query(handle)
+    }
+
+    fn post_srq_recv(&mut self, handle: u32, wr: RecvWr) -> Result<()> {
+        self.srq_table.post(handle, wr)?;
+        self.refill_srq(handle)
+    }
+
+    fn open_xrcd(&mut self) -> Result<u32> {
+        Ok(self.xrc.open())
+    }
+
+    fn close_xrcd(&mut self, handle: u32) -> Result<()> {
+        self.xrc.close(handle)
+    }
+
+    fn create_xrc_srq(&mut self, xrcd: u32, cq: u32, max_wr: u32, srq_limit: u32) -> Result<u32> {
+        if !self.xrc.contains(xrcd) {
+            return Err(RdmaError::NotFound(format!("XRCD {xrcd} not found")));
+        }
+        if self.cq_table.get_cq_mut(cq).is_none() {
+            return Err(RdmaError::NotFound(format!("CQ {cq} not found")));
+        }
+        let handle = self.create_srq(max_wr, srq_limit)?;
+        if let Err(err) = self.xrc.insert_srq(handle, XrcSrq { xrcd, cq }) {
+            let _ignore = self.srq_table.destroy(handle);
+            return Err(err);
+        }
+        Ok(handle)
+    }
+
+    fn get_srq_num(&mut self, handle: u32) -> Result<u32> {
+        self.xrc
+            .srq(handle)
+            .map(|_srq| handle)
+            .ok_or(RdmaError::InvalidInput(format!(
+                "SRQ {handle} is not a XRC SRQ"
+            )))
+    }
+
+    fn create_xrc_target(&mut self, xrcd: u32) -> Result<u32> {
+        if !self.xrc.contains(xrcd) {
+            return Err(RdmaError::NotFound(format!("XRCD {xrcd} not found")));
+        }
+        let qpn = self.create_qp(IbvQpInitAttr {
+            qp_type: ibverbs_sys::ibv_qp_type::IBV_QPT_XRC_RECV as u8,
+            send_cq: None,
+            recv_cq: None,
+            srq: None,
+            max_send_wr: 0,
+        })?;
+        if let Err(err) = self.xrc.insert_target(qpn, xrcd) {
+            let _ignore = self.destroy_qp(qpn);
+            return Err(err);
+        }
+        Ok(qpn)
+    }
+
+    fn alloc_td(&mut self) -> Result<u32> {
+        let channel = self.doorbell.scheduler().dedicate_channel();
+        if channel.is_none() {
+            warn!("no send channel left to dedicate, the new TD shares the balanced channels");
+        }
+        Ok(self.tds.alloc(channel))
+    }
+
+    fn dealloc_td(&mut self, handle: u32) -> Result<()> {
+        if let Some(channel) = self.tds.dealloc(handle)? {
+            self.doorbell.scheduler().release_channel(channel);
+        }
+        Ok(())
+    }
+
+    fn attach_td(&mut self, qpn: u32, td: u32) -> Result<()> {
+        if self.qp_attr_table.get_qp(qpn).is_none() {
+            return Err(RdmaError::QpError(format!("QP {qpn} not found")));
+        }
+        // A single thread posts to the QP, posting on that thread takes no hop through the
+        // `RdmaWriteWorker`
+        if let Some(channel) = self.tds.attach(qpn, td)? {
+            self.doorbell.scheduler().pin(qpn, channel);
+        }
+        let _ignore = self.direct_qps.replace(qpn, true);
+        Ok(())
+    }
+
+    fn modify_qp_rate_limit(&mut self, qpn: u32, rate_kbps: u32, max_burst: u32) -> Result<()> {
+        if self.rate.set_limit(qpn, rate_kbps, max_burst) {
+            Ok(())
+        } else {
+            Err(RdmaError::InvalidInput(format!("QPN {qpn} not present")))
+        }
+    }
+
+    fn modify_qp_chunk_size(&mut self, qpn: u32, chunk_size: u32) -> Result<()> {
+        let config = self.config.chunk();
+        let chunk_size = if chunk_size == 0 {
+            config.size
+        } else {
+            chunk_size
+        };
+        if !config.allows(chunk_size) {
+            return Err(RdmaError::InvalidInput(format!(
+                "Chunk size {chunk_size:#x} is not a power of two in {MIN_WR_CHUNK_SIZE:#x}..={:#x}",
+                config.max_size
+            )));
+        }
+        let updated = self.qp_attr_table.map_qp_mut(qpn, |current| {
+            let present = current.qpn == qpn;
+            if present {
+                current.chunk_size = chunk_size;
+            }
+            present
+        });
+        if updated == Some(true) {
+            Ok(())
+        } else {
+            Err(RdmaError::InvalidInput(format!("QPN {qpn} not present")))
+        }
+    }
+
+    fn read_counters(&self, values: &mut [u64]) -> Result<()> {
+        let device = self.counters.read();
+        for (i, value) in values.iter_mut().enumerate() {
+            *value = device.get(i).copied().unwrap_or(0);
+        }
+        Ok(())
+    }
+
+    fn dump_counters(&self) -> Result<String> {
+        Ok(format!(
+            "{}{}{}{}",
+            self.counters,
+            self.startup,
+            self.send_policy,
+            self.launcher.dump_utilization()
+        ))
+    }
+
+    fn dump_memory(&self) -> Result<String> {
+        // The pools accounted as they grow are shared by the contexts of the process, the
+        // queues of the context are sampled
+        let cq_rings: usize = self.cq_table.iter().map(CompletionQueue::ring_bytes).sum();
+        let (channels, channels_peak) = [
+            self.rdma_write_tx.queued_bytes(),
+            self.ack_timeout_tx.queued_bytes(),
+            self.completion_tx.queued_bytes(),
+        ]
+        .into_iter()
+        .fold((0, 0), |(bytes, peak), (b, p)| (bytes + b, peak + p));
+        Ok(format!(
+            "{MemoryUsage}cq_rings_bytes {cq_rings}\nchannels_bytes {channels}\n\
+             channels_peak_bytes {channels_peak}\n"
+        ))
+    }
+
+    #[cfg(feature = "debug_csrs")]
+    fn inject_loss(&self, loopback: bool, seed: u32, drop_thresh: u8) -> Result<()> {
+        self.device.inject_loss(loopback, seed, drop_thresh)?;
+        if let Some(secondary) = self.secondary.as_ref() {
+            secondary.inject_loss(loopback, seed, drop_thresh)?;
+        }
+        Ok(())
+    }
+
+    fn alloc_pd(&mut self) -> Result<u32> {
+        self.pd_table
+            .alloc()
+            .ok_or(RdmaError::ResourceExhausted("No PD available".into()))
+    }
+
+    fn dealloc_pd(&mut self, handle: u32) -> Result<()> {
+        if self.pd_table.dealloc(handle) {
+            Ok(())
+        } else {
+            Err(RdmaError::InvalidInput(format!(
+                "PD handle {handle} not present"
+            )))
+        }
+    }
+}
+
+/// Opens the meta report interrupts of the card if they are enabled, the `MetaWorker`s fall back
+/// to the park timeout when the card has none
+fn meta_interrupts<H: HwDevice>(
+    device: &H,
+    config: &DeviceConfig,
+) -> Result<Option<MetaInterrupts>> {
+    let interrupt = config.interrupt();
+    if !interrupt.enabled {
+        return Ok(None);
+    }
+    let interrupts = device.meta_interrupts(interrupt)?;
+    if interrupts.is_none() {
+        warn!(
+            "meta report interrupts are not supported by card {}",
+            device.net_index()
+        );
+    }
+
+    Ok(interrupts)
+}
+
+/// Invalidates the keys the previous owner of the share left in the MTT, their pages died with
+/// it. The receive WR rings are invalidated too while the restored QPs are reattached, the
+/// peers keep writing to them until the rings are registered again.
+fn invalidate_recorded_keys<A: DeviceAdaptor>(
+    cmd_controller: &CommandConfigurator<A>,
+    snapshot: &StateSnapshot,
+    restoring: bool,
+) {
+    let mut keys = snapshot.keys();
+    if restoring {
+        keys.push(RECV_RING_MR_KEY);
+    }
+    if keys.is_empty() {
+        return;
+    }
+    cmd_controller.submit_batch(keys.iter().map(|&key| MttUpdate::invalidate(key).into()));
+    for key in keys {
+        snapshot.clear_key(key);
+    }
+}
+
+/// Returns the thread name of the shard `index` of a worker split into `num` shards, a worker
+/// that isn't split keeps its name
+fn shard_name(name: &str, index: usize, num: usize) -> String {
+    if num == 1 {
+        name.to_owned()
+    } else {
+        format!("{name}{index}")
+    }
+}
+
+/// Returns the QP context of the current attributes of a connected QP
+fn qp_context(current: &QpAttr) -> UpdateQp {
+    UpdateQp {
+        qpn: current.qpn,
+        ip_addr: current.dqp_ip,
+        local_udp_port: current.udp_port,
+        peer_mac_addr: current.mac_addr,
+        qp_type: current.qp_type,
+        peer_qpn: current.dqpn,
+        rq_access_flags: current.access_flags,
+        pmtu: current.pmtu,
+        max_dest_rd_atomic: current.max_dest_rd_atomic,
+    }
+}
+
+/// Returns the attributes connecting a context to the context `dqpn` of the peer at `ip`
+fn context_attr(ip: Ipv4Addr, dqpn: u32) -> IbvQpAttr {
+    let access = ibverbs_sys::ibv_access_flags::IBV_ACCESS_LOCAL_WRITE.0
+        | ibverbs_sys::ibv_access_flags::IBV_ACCESS_REMOTE_WRITE.0
+        | ibverbs_sys::ibv_access_flags::IBV_ACCESS_REMOTE_READ.0;
+    IbvQpAttr {
+        dest_qp_num: Some(dqpn),
+        dest_qp_ip: Some(ip),
+        qp_access_flags: Some(access),
+        max_dest_rd_atomic: Some(CONTEXT_RD_ATOMIC),
+        ..Default::default()
+    }
+}
+
+/// Returns `true` for the QP types of the XRC INI and TGT QPs
+fn is_xrc(qp_type: u8) -> bool {
+    qp_type == ibverbs_sys::ibv_qp_type::IBV_QPT_XRC_SEND as u8
+        || qp_type == ibverbs_sys::ibv_qp_type::IBV_QPT_XRC_RECV as u8
+}
+
+/// Error of a post to a QP whose outstanding WRs took all its send queue credits
+fn send_queue_full(qpn: u32) -> RdmaError {
+    RdmaError::QueueFull(format!("send queue of QP {qpn} is full"))
+}
+
+/// Pins a range and resolves the physical addresses of its pages
+fn pin_and_resolve_slice<U: UmemHandler>(
+    handler: &U,
+    addr: u64,
+    length: usize,
+    num_pages: usize,
+) -> Result<Vec<u64>> {
+    handler.pin_pages(addr, length)?;
+    handler
+        .virt_to_phys_range(addr, num_pages)?
+        .into_iter()
+        .collect::<Option<Vec<_>>>()
+        .ok_or(RdmaError::MemoryError("Physical address not found".into()))
+}
+
+/// Builds the policy of the send paths, the largest copied send is tuned against the CSR reads
+/// of `mode` unless configured, see `SendPathConfig`
+fn tune_send_policy<A: DeviceAdaptor>(mode: &ModeProxy<A>, config: &DeviceConfig) -> SendPolicy {
+    let staged_max = if config.staging().slots == 0 {
+        0
+    } else {
+        STAGING_SLOT_SIZES.last().copied().unwrap_or(0)
+    };
+    let rendezvous = config.rendezvous();
+    let rendezvous_min = rendezvous.enabled.then_some(rendezvous.threshold);
+    let fixed = |copy_max: usize| {
+        let copy_max = copy_max.min(staged_max.max(MAX_INLINE_DATA));
+        let thresholds = SendThresholds {
+            copy_max,
+            staged_max,
+            rendezvous_min,
+        };
+        SendPolicy::new(thresholds, None)
+    };
+    let SendPathConfig {
+        auto_copy,
+        copy_max,
+    } = config.send_path();
+    if !auto_copy {
+        return fixed(0);
+    }
+    if let Some(copy_max) = copy_max {
+        return fixed(copy_max);
+    }
+    match SendCosts::measure(|| mode.mode()) {
+        Ok(costs) => {
+            let thresholds = SendThresholds::tune(&costs, staged_max, rendezvous_min);
+            info!(
+                "sends of up to {} bytes are copied, CSR round trip {:?}",
+                thresholds.copy_max, costs.round_trip
+            );
+            SendPolicy::new(thresholds, Some(costs))
+        }
+        Err(err) => {
+            warn!("failed to tune the send paths, no send is copied: {err}");
+            fixed(0)
         }
     }
 }
@@ -1,17 +1,28 @@
 use std::{
     fs, io,
     path::{Path, PathBuf},
+    sync::Arc,
+    time::Duration,
 };
 
+use log::warn;
 use pci_info::PciInfo;
 
 use crate::{
-    constants::{DEVICE_ID, PCI_SYSFS_BUS_PATH, VENDER_ID},
-    csr::{emulated::EmulatedDevice, hardware::SysfsPciCsrAdaptor},
-    error::Result,
+    config::InterruptConfig,
+    constants::{
+        BLUE_RDMA_IBDEV_NAME_PREFIX, DEVICE_ID, PCI_SYSFS_BUS_PATH, UVERBS_SYSFS_CLASS_PATH,
+        VENDER_ID,
+    },
+    csr::{
+        emulated::EmulatedDevice,
+        hardware::{map_bar_page, SysfsPciCsrAdaptor},
+        irq::MetaInterrupts,
+    },
+    error::{RdmaError, Result},
     mem::{
-        page::EmulatedPageAllocator, sim_alloc, u_dma_buf::UDmaBufAllocator, EmulatedUmemHandler,
-        HostUmemHandler,
+        iommu::IommuDomain, kernel_pin::KernelPinner, page::EmulatedPageAllocator, sim_alloc,
+        u_dma_buf::UDmaBufAllocator, EmulatedUmemHandler, HostUmemHandler,
     },
 };
 
@@ -25,31 +36,148 @@ pub(crate) trait HwDevice {
     fn new_adaptor(&self) -> Result<Self::Adaptor>;
     fn new_dma_buf_allocator(&self) -> Result<Self::DmaBufAllocator>;
     fn new_umem_handler(&self) -> Self::UmemHandler;
+
+    /// Returns the CPU cores local to the device, if known
+    fn local_cpus(&self) -> Option<Vec<usize>> {
+        None
+    }
+
+    /// Returns the index of the card, which selects its netdev and its sysfs attributes
+    fn net_index(&self) -> usize {
+        0
+    }
+
+    /// Returns the interrupts of the meta report channels, `None` if the device has none
+    fn meta_interrupts(&self, _config: InterruptConfig) -> Result<Option<MetaInterrupts>> {
+        Ok(None)
+    }
+
+    /// Maps the page of the BAR holding the CSR at `offset`, for a GPU writing the CSR itself
+    fn map_csr_page(&self, _offset: usize) -> Result<memmap2::MmapMut> {
+        Err(RdmaError::Unimplemented("map_csr_page".into()))
+    }
+
+    /// Makes the card loop its packets back if `loopback`, and drop the packets whose random
+    /// number, drawn from `seed`, is below `drop_thresh`
+    #[cfg(feature = "debug_csrs")]
+    fn inject_loss(&self, _loopback: bool, _seed: u32, _drop_thresh: u8) -> Result<()> {
+        Err(RdmaError::Unimplemented("inject_loss".into()))
+    }
 }
 
 pub(crate) struct PciHwDevice {
     sysfs_path: PathBuf,
+    /// Index of the card, the card `N` is registered as `bluerdmaN` with the netdev `blueN`
+    index: usize,
+    /// Write doorbells through a write-combined mapping of the BAR
+    write_combining: bool,
+    /// IOMMU domain the registered memory is mapped into, `None` translates the pages through
+    /// the pagemap
+    iommu: Option<Arc<IommuDomain>>,
+    /// Pins the registered memory through the kernel module, `None` locks the pages
+    kernel_pin: Option<Arc<KernelPinner>>,
 }
 
 impl PciHwDevice {
     pub(crate) fn new(sysfs_path: impl AsRef<Path>) -> Self {
         Self {
             sysfs_path: sysfs_path.as_ref().into(),
+            index: 0,
+            write_combining: false,
+            iommu: None,
+            kernel_pin: None,
         }
     }
 
-    pub(crate) fn open_default() -> io::Result<Self> {
-        let build_err = || io::Error::new(io::ErrorKind::Other, "Failed to open device");
+    /// Returns the sysfs paths of the cards ordered by PCI location.
+    ///
+    /// The kernel module registers one IB device per card in the same order, so the card at
+    /// position `N` is `bluerdmaN`.
+    pub(crate) fn enumerate() -> io::Result<Vec<PathBuf>> {
+        let build_err = || io::Error::new(io::ErrorKind::Other, "Failed to enumerate devices");
         let info = PciInfo::enumerate_pci().map_err(|_err| build_err())?;
-        let device = info
+        let mut paths = info
             .iter()
             .flatten()
-            .find(|d| d.vendor_id() == VENDER_ID && d.device_id() == DEVICE_ID)
-            .ok_or_else(build_err)?;
-        let location = device.location().map_err(|_err| build_err())?;
-        let sysfs_path = PathBuf::from(PCI_SYSFS_BUS_PATH).join(location.to_string());
+            .filter(|d| d.vendor_id() == VENDER_ID && d.device_id() == DEVICE_ID)
+            .map(|d| {
+                d.location()
+                    .map(|location| PathBuf::from(PCI_SYSFS_BUS_PATH).join(location.to_string()))
+                    .map_err(|_err| build_err())
+            })
+            .collect::<io::Result<Vec<_>>>()?;
+        paths.sort();
+
+        Ok(paths)
+    }
+
+    /// Opens the card `index` of `enumerate`
+    pub(crate) fn open(index: usize) -> io::Result<Self> {
+        let sysfs_path = Self::enumerate()?.into_iter().nth(index).ok_or_else(|| {
+            io::Error::new(
+                io::ErrorKind::NotFound,
+                format!("Failed to open device {index}"),
+            )
+        })?;
+
+        Ok(Self {
+            sysfs_path,
+            index,
+            write_combining: false,
+            iommu: None,
+            kernel_pin: None,
+        })
+    }
+
+    pub(crate) fn open_default() -> io::Result<Self> {
+        Self::open(0)
+    }
 
-        Ok(Self { sysfs_path })
+    /// Returns the index of the card of the uverbs device `sysfs_name`, such as `uverbs1`,
+    /// from the name of the IB device it belongs to
+    pub(crate) fn device_index(sysfs_name: &str) -> io::Result<usize> {
+        let path = PathBuf::from(UVERBS_SYSFS_CLASS_PATH)
+            .join(sysfs_name)
+            .join("ibdev");
+        let ibdev = fs::read_to_string(path)?;
+        let ibdev = ibdev.trim();
+        parse_index(ibdev, BLUE_RDMA_IBDEV_NAME_PREFIX).ok_or_else(|| {
+            io::Error::new(
+                io::ErrorKind::InvalidData,
+                format!("{sysfs_name} belongs to {ibdev}, not a blue-rdma device"),
+            )
+        })
+    }
+
+    /// Returns the index of the card
+    pub(crate) fn index(&self) -> usize {
+        self.index
+    }
+
+    /// Sets whether adaptors created afterwards write doorbells through a write-combined mapping
+    pub(crate) fn set_write_combining(&mut self, enabled: bool) {
+        self.write_combining = enabled;
+    }
+
+    /// Maps the memory of the device into its VFIO IOMMU domain at IOVA = VA, instead of
+    /// handing it the physical addresses of the pages. The device must be bound to `vfio-pci`.
+    pub(crate) fn enable_vfio_iommu(&mut self) -> io::Result<()> {
+        self.iommu = Some(Arc::new(IommuDomain::open(&self.sysfs_path)?));
+        Ok(())
+    }
+
+    /// Pins the registered memory through the IB device of the card in the kernel module,
+    /// which returns the DMA addresses of the pages
+    pub(crate) fn enable_kernel_pin(&mut self) -> io::Result<()> {
+        self.kernel_pin = Some(Arc::new(KernelPinner::open(self.index)?));
+        Ok(())
+    }
+
+    /// Returns the NUMA node of the device, if the platform reports one
+    pub(crate) fn numa_node(&self) -> Option<u32> {
+        fs::read_to_string(self.sysfs_path.join("numa_node"))
+            .ok()
+            .and_then(|s| s.trim().parse().ok())
     }
 
     pub(crate) fn reset(&self) -> io::Result<()> {
@@ -58,27 +186,23 @@ impl PciHwDevice {
     }
 
     #[cfg(feature = "debug_csrs")]
-    pub(crate) fn set_custom(&self) -> io::Result<()> {
+    pub(crate) fn set_custom(&self) -> Result<()> {
         use log::info;
 
-        use crate::csr::hardware::CustomCsrConfigurator;
-
-        let mut cfg = CustomCsrConfigurator::new(&self.sysfs_path)?;
-        if std::env::var("ENABLE_LOOPBACK").unwrap_or_default() == "1" {
-            cfg.set_loopback();
-            info!("loopback enabled");
-        }
+        let loopback = std::env::var("ENABLE_LOOPBACK").unwrap_or_default() == "1";
         let drop_thresh = std::env::var("DROP_THRESHOLD")
             .ok()
             .and_then(|s| s.parse::<u8>().ok())
             .unwrap_or(1);
-        cfg.set_drop_thresh(drop_thresh);
-        info!("packet drop threshold set to: {drop_thresh}");
         let seed = std::env::var("SEED")
             .ok()
             .and_then(|s| u32::from_str_radix(&s, 16).ok())
             .unwrap_or(0x3131_3131);
-        cfg.set_seed(seed);
+        self.inject_loss(loopback, seed, drop_thresh)?;
+        if loopback {
+            info!("loopback enabled");
+        }
+        info!("packet drop threshold set to: {drop_thresh}");
         info!("packet drop rng seed set to: {seed}");
 
         Ok(())
@@ -93,16 +217,95 @@ impl HwDevice for PciHwDevice {
     type UmemHandler = HostUmemHandler;
 
     fn new_adaptor(&self) -> Result<Self::Adaptor> {
+        if self.write_combining {
+            return SysfsPciCsrAdaptor::new_write_combined(&self.sysfs_path).map_err(Into::into);
+        }
         SysfsPciCsrAdaptor::new(&self.sysfs_path).map_err(Into::into)
     }
 
     fn new_dma_buf_allocator(&self) -> Result<Self::DmaBufAllocator> {
-        UDmaBufAllocator::open().map_err(Into::into)
+        let allocator = UDmaBufAllocator::open(self.numa_node())?;
+        // The u-dma-buf memory is reserved by the kernel module, its node can only be checked
+        if let (Some(dev_node), Some(buf_node)) = (self.numa_node(), allocator.numa_node()) {
+            if dev_node != buf_node {
+                warn!(
+                    "DMA buffers are on NUMA node {buf_node}, but the device is on node {dev_node}"
+                );
+            }
+        }
+        // The rings are handed the physical addresses of the u-dma-bufs
+        if let Some(iommu) = self.iommu.as_ref() {
+            for (addr, size, phys_addr) in allocator.regions() {
+                iommu.map_at(phys_addr, addr, size)?;
+            }
+        }
+        Ok(allocator)
     }
 
     fn new_umem_handler(&self) -> Self::UmemHandler {
-        HostUmemHandler::new()
+        if let Some(pinner) = self.kernel_pin.as_ref() {
+            return HostUmemHandler::with_kernel_pin(Arc::clone(pinner));
+        }
+        match self.iommu.as_ref() {
+            Some(iommu) => HostUmemHandler::with_iommu(Arc::clone(iommu)),
+            None => HostUmemHandler::new(),
+        }
+    }
+
+    fn local_cpus(&self) -> Option<Vec<usize>> {
+        fs::read_to_string(self.sysfs_path.join("local_cpulist"))
+            .ok()
+            .and_then(|s| parse_cpu_list(&s))
+    }
+
+    fn net_index(&self) -> usize {
+        self.index
+    }
+
+    fn meta_interrupts(&self, config: InterruptConfig) -> Result<Option<MetaInterrupts>> {
+        let moderation = Duration::from_micros(config.moderation_us);
+        MetaInterrupts::open(self.index, moderation, config.steering)
+            .map(Some)
+            .map_err(Into::into)
+    }
+
+    fn map_csr_page(&self, offset: usize) -> Result<memmap2::MmapMut> {
+        map_bar_page(&self.sysfs_path, offset).map_err(Into::into)
+    }
+
+    #[cfg(feature = "debug_csrs")]
+    fn inject_loss(&self, loopback: bool, seed: u32, drop_thresh: u8) -> Result<()> {
+        use crate::csr::hardware::CustomCsrConfigurator;
+
+        let mut cfg = CustomCsrConfigurator::new(&self.sysfs_path)?;
+        cfg.set_loopback(loopback);
+        cfg.set_seed(seed);
+        cfg.set_drop_thresh(drop_thresh);
+        Ok(())
+    }
+}
+
+/// Parses the index off a device name such as `bluerdma1` or `uverbs1`
+pub(crate) fn parse_index(name: &str, prefix: &str) -> Option<usize> {
+    name.strip_prefix(prefix)
+        .filter(|x| !x.is_empty() && x.bytes().all(|b| b.is_ascii_digit()))
+        .and_then(|x| x.parse().ok())
+}
+
+/// Parses a kernel CPU list such as `0-3,8,10-11`
+fn parse_cpu_list(list: &str) -> Option<Vec<usize>> {
+    let mut cpus = Vec::new();
+    for range in list.trim().split(',').filter(|x| !x.is_empty()) {
+        if let Some((start, end)) = range.split_once('-') {
+            let start: usize = start.parse().ok()?;
+            let end: usize = end.parse().ok()?;
+            cpus.extend(start..=end);
+        } else {
+            cpus.push(range.parse().ok()?);
+        }
     }
+
+    (!cpus.is_empty()).then_some(cpus)
 }
 
 pub(crate) struct EmulatedHwDevice {
@@ -159,3 +362,26 @@ impl HwDevice for MockHwDevice {
         MockUmemHandler
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn parse_kernel_cpu_list() {
+        assert_eq!(parse_cpu_list("0-3,8,10-11\n"), Some(vec![0, 1, 2, 3, 8, 10, 11]));
+        assert_eq!(parse_cpu_list("5"), Some(vec![5]));
+        assert_eq!(parse_cpu_list(""), None);
+        assert_eq!(parse_cpu_list("a-b"), None);
+    }
+
+    #[test]
+    fn parse_device_index() {
+        assert_eq!(parse_index("bluerdma0", "bluerdma"), Some(0));
+        assert_eq!(parse_index("bluerdma12", "bluerdma"), Some(12));
+        assert_eq!(parse_index("uverbs1", "uverbs"), Some(1));
+        assert_eq!(parse_index("bluerdma", "bluerdma"), None);
+        assert_eq!(parse_index("bluerdma+1", "bluerdma"), None);
+        assert_eq!(parse_index("mlx5_0", "bluerdma"), None);
+    }
+}
@@ -0,0 +1,106 @@
+use std::{ffi::c_void, ptr};
+
+/// An allocation of device memory, starting as the rdma-core `ibv_dm`.
+///
+/// The allocation is host memory of the arena of the context, mapped in the process, so the
+/// `memcpy` callbacks copy directly without entering the driver.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub(super) struct BlueDm {
+    /// Must stay the first field, the consumer only sees a pointer to it
+    dm: ibverbs_sys::ibv_dm,
+    /// Host address of the allocation
+    addr: u64,
+    length: usize,
+}
+
+impl BlueDm {
+    /// Allocates the device memory `handle` of `length` bytes at `addr`, the caller owns the
+    /// returned pointer
+    pub(super) fn alloc(
+        context: *mut ibverbs_sys::ibv_context,
+        handle: u32,
+        addr: u64,
+        length: usize,
+    ) -> *mut ibverbs_sys::ibv_dm {
+        let dm = Self {
+            dm: ibverbs_sys::ibv_dm {
+                context,
+                memcpy_to_dm: Some(memcpy_to_dm),
+                memcpy_from_dm: Some(memcpy_from_dm),
+                comp_mask: 0,
+                handle,
+            },
+            addr,
+            length,
+        };
+        Box::into_raw(Box::new(dm)).cast()
+    }
+
+    /// Frees device memory returned by `alloc`
+    ///
+    /// # Safety
+    ///
+    /// `dm` must come from `alloc` and must not be used afterwards
+    pub(super) unsafe fn free(dm: *mut ibverbs_sys::ibv_dm) {
+        drop(unsafe { Box::from_raw(dm.cast::<Self>()) });
+    }
+
+    /// Returns the device memory of `dm`
+    ///
+    /// # Safety
+    ///
+    /// `dm` must be null or come from `alloc`
+    #[allow(clippy::cast_ptr_alignment)]
+    pub(super) unsafe fn get(dm: *mut ibverbs_sys::ibv_dm) -> Option<Self> {
+        unsafe { dm.cast::<Self>().as_ref() }.copied()
+    }
+
+    pub(super) fn handle(&self) -> u32 {
+        self.dm.handle
+    }
+
+    pub(super) fn context(&self) -> *mut ibverbs_sys::ibv_context {
+        self.dm.context
+    }
+
+    /// Returns the address of the `length` bytes at `dm_offset`, `None` if they are outside of
+    /// the allocation
+    #[allow(clippy::as_conversions)]
+    fn at(&self, dm_offset: u64, length: usize) -> Option<*mut u8> {
+        let end = dm_offset.checked_add(length as u64)?;
+        (end <= self.length as u64).then(|| (self.addr + dm_offset) as *mut u8)
+    }
+}
+
+/// `ibv_memcpy_to_dm`
+unsafe extern "C" fn memcpy_to_dm(
+    dm: *mut ibverbs_sys::ibv_dm,
+    dm_offset: u64,
+    host_addr: *const c_void,
+    length: usize,
+) -> core::ffi::c_int {
+    let Some(dst) = unsafe { BlueDm::get(dm) }.and_then(|x| x.at(dm_offset, length)) else {
+        return libc::EINVAL;
+    };
+    // SAFETY: the destination is within the allocation, the caller passes `length` readable
+    // bytes at `host_addr`
+    unsafe { ptr::copy_nonoverlapping(host_addr.cast::<u8>(), dst, length) };
+    0
+}
+
+/// `ibv_memcpy_from_dm`
+unsafe extern "C" fn memcpy_from_dm(
+    host_addr: *mut c_void,
+    dm: *mut ibverbs_sys::ibv_dm,
+    dm_offset: u64,
+    length: usize,
+) -> core::ffi::c_int {
+    let Some(src) = unsafe { BlueDm::get(dm) }.and_then(|x| x.at(dm_offset, length)) else {
+        return libc::EINVAL;
+    };
+    // SAFETY: the source is within the allocation, the caller passes `length` writable bytes
+    // at `host_addr`
+    unsafe { ptr::copy_nonoverlapping(src, host_addr.cast::<u8>(), length) };
+    0
+}
@@ -1,6 +1,10 @@
-use std::net::Ipv4Addr;
+use std::{net::Ipv4Addr, ptr::NonNull};
 
-use crate::{mem::sim_alloc, verbs::dev::PciHwDevice};
+use parking_lot::{Mutex, RwLock, RwLockReadGuard, RwLockWriteGuard};
+
+use crate::{
+    error::Result, mem::sim_alloc, rdma_utils::types::SendWr, verbs::dev::PciHwDevice, RdmaError,
+};
 
 use super::{
     ctx::{HwDeviceCtx, VerbsOps},
@@ -25,6 +29,18 @@ pub unsafe trait RdmaCtxOps {
 
     fn dealloc_pd(pd: *mut ibverbs_sys::ibv_pd) -> ::std::os::raw::c_int;
 
+    fn create_ah(
+        pd: *mut ibverbs_sys::ibv_pd,
+        attr: *mut ibverbs_sys::ibv_ah_attr,
+    ) -> *mut ibverbs_sys::ibv_ah;
+
+    fn destroy_ah(ah: *mut ibverbs_sys::ibv_ah) -> ::std::os::raw::c_int;
+
+    fn alloc_mw(pd: *mut ibverbs_sys::ibv_pd, type_: core::ffi::c_uint)
+        -> *mut ibverbs_sys::ibv_mw;
+
+    fn dealloc_mw(mw: *mut ibverbs_sys::ibv_mw) -> ::std::os::raw::c_int;
+
     fn query_device_ex(
         blue_context: *mut ibverbs_sys::ibv_context,
         _input: *const ibverbs_sys::ibv_query_device_ex_input,
@@ -32,6 +48,12 @@ pub unsafe trait RdmaCtxOps {
         _attr_size: usize,
     ) -> ::std::os::raw::c_int;
 
+    /// Reads the device clock, to convert the completion timestamps to the time of the host
+    fn query_rt_values(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        values: *mut ibverbs_sys::ibv_values_ex,
+    ) -> ::std::os::raw::c_int;
+
     fn query_port(
         blue_context: *mut ibverbs_sys::ibv_context,
         port_num: u8,
@@ -45,13 +67,35 @@ pub unsafe trait RdmaCtxOps {
         comp_vector: core::ffi::c_int,
     ) -> *mut ibverbs_sys::ibv_cq;
 
+    fn create_cq_ex(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        cq_attr: *mut ibverbs_sys::ibv_cq_init_attr_ex,
+    ) -> *mut ibverbs_sys::ibv_cq_ex;
+
     fn destroy_cq(cq: *mut ibverbs_sys::ibv_cq) -> ::std::os::raw::c_int;
 
+    /// Resizes the CQ without dropping the completions it holds
+    fn resize_cq(cq: *mut ibverbs_sys::ibv_cq, cqe: core::ffi::c_int) -> ::std::os::raw::c_int;
+
     fn create_qp(
         pd: *mut ibverbs_sys::ibv_pd,
         init_attr: *mut ibverbs_sys::ibv_qp_init_attr,
     ) -> *mut ibverbs_sys::ibv_qp;
 
+    /// Creates `num_qps` QPs of `pd` at once and writes them to `qps`, either all of them are
+    /// created or none. The contexts of the QPs are written to the device in a single batch.
+    fn create_qps(
+        pd: *mut ibverbs_sys::ibv_pd,
+        init_attrs: *mut ibverbs_sys::ibv_qp_init_attr,
+        num_qps: u32,
+        qps: *mut *mut ibverbs_sys::ibv_qp,
+    ) -> ::std::os::raw::c_int;
+
+    fn create_qp_ex(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        qp_attr: *mut ibverbs_sys::ibv_qp_init_attr_ex,
+    ) -> *mut ibverbs_sys::ibv_qp;
+
     fn destroy_qp(qp: *mut ibverbs_sys::ibv_qp) -> ::std::os::raw::c_int;
 
     fn modify_qp(
@@ -60,6 +104,30 @@ pub unsafe trait RdmaCtxOps {
         attr_mask: core::ffi::c_int,
     ) -> ::std::os::raw::c_int;
 
+    /// Modifies `num_qps` QPs of a device at once, each with the attributes of the same index
+    /// and the shared `attr_mask`. The contexts of the QPs are written to the device in a
+    /// single batch.
+    ///
+    /// If an update fails, `bad_index` is set to its index, all updates before it have been
+    /// applied.
+    fn modify_qps(
+        qps: *mut *mut ibverbs_sys::ibv_qp,
+        attrs: *mut ibverbs_sys::ibv_qp_attr,
+        attr_mask: core::ffi::c_int,
+        num_qps: u32,
+        bad_index: *mut u32,
+    ) -> ::std::os::raw::c_int;
+
+    fn modify_qp_rate_limit(
+        qp: *mut ibverbs_sys::ibv_qp,
+        attr: *mut ibverbs_sys::ibv_qp_rate_limit_attr,
+    ) -> ::std::os::raw::c_int;
+
+    /// Sets the size in bytes of the chunks the WRs of `qp` are split into, 0 restores the
+    /// configured size
+    fn modify_qp_chunk_size(qp: *mut ibverbs_sys::ibv_qp, chunk_size: u32)
+        -> ::std::os::raw::c_int;
+
     fn query_qp(
         qp: *mut ibverbs_sys::ibv_qp,
         attr: *mut ibverbs_sys::ibv_qp_attr,
@@ -67,6 +135,26 @@ pub unsafe trait RdmaCtxOps {
         init_attr: *mut ibverbs_sys::ibv_qp_init_attr,
     ) -> ::std::os::raw::c_int;
 
+    /// Attaches a UD QP to the multicast group `gid`, an IPv4 mapped multicast address
+    fn attach_mcast(
+        qp: *mut ibverbs_sys::ibv_qp,
+        gid: *const ibverbs_sys::ibv_gid,
+        lid: u16,
+    ) -> ::std::os::raw::c_int;
+
+    fn detach_mcast(
+        qp: *mut ibverbs_sys::ibv_qp,
+        gid: *const ibverbs_sys::ibv_gid,
+        lid: u16,
+    ) -> ::std::os::raw::c_int;
+
+    fn create_flow(
+        qp: *mut ibverbs_sys::ibv_qp,
+        flow_attr: *mut ibverbs_sys::ibv_flow_attr,
+    ) -> *mut ibverbs_sys::ibv_flow;
+
+    fn destroy_flow(flow_id: *mut ibverbs_sys::ibv_flow) -> ::std::os::raw::c_int;
+
     fn reg_mr(
         pd: *mut ibverbs_sys::ibv_pd,
         addr: *mut ::std::os::raw::c_void,
@@ -77,6 +165,47 @@ pub unsafe trait RdmaCtxOps {
 
     fn dereg_mr(mr: *mut ibverbs_sys::ibv_mr) -> ::std::os::raw::c_int;
 
+    fn rereg_mr(
+        mr: *mut ibverbs_sys::ibv_mr,
+        flags: core::ffi::c_int,
+        pd: *mut ibverbs_sys::ibv_pd,
+        addr: *mut ::std::os::raw::c_void,
+        length: usize,
+        access: core::ffi::c_int,
+    ) -> ::std::os::raw::c_int;
+
+    fn reg_dmabuf_mr(
+        pd: *mut ibverbs_sys::ibv_pd,
+        offset: u64,
+        length: usize,
+        iova: u64,
+        fd: core::ffi::c_int,
+        access: core::ffi::c_int,
+    ) -> *mut ibverbs_sys::ibv_mr;
+
+    fn alloc_dm(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        dm_attr: *mut ibverbs_sys::ibv_alloc_dm_attr,
+    ) -> *mut ibverbs_sys::ibv_dm;
+
+    fn free_dm(dm: *mut ibverbs_sys::ibv_dm) -> ::std::os::raw::c_int;
+
+    fn reg_dm_mr(
+        pd: *mut ibverbs_sys::ibv_pd,
+        dm: *mut ibverbs_sys::ibv_dm,
+        dm_offset: u64,
+        length: usize,
+        access: core::ffi::c_uint,
+    ) -> *mut ibverbs_sys::ibv_mr;
+
+    fn advise_mr(
+        pd: *mut ibverbs_sys::ibv_pd,
+        advice: core::ffi::c_uint,
+        flags: u32,
+        sg_list: *mut ibverbs_sys::ibv_sge,
+        num_sge: u32,
+    ) -> ::std::os::raw::c_int;
+
     fn post_send(
         qp: *mut ibverbs_sys::ibv_qp,
         wr: *mut ibverbs_sys::ibv_send_wr,
@@ -91,33 +220,237 @@ pub unsafe trait RdmaCtxOps {
 
     fn poll_cq(cq: *mut ibverbs_sys::ibv_cq, num_entries: i32, wc: *mut ibverbs_sys::ibv_wc)
         -> i32;
+
+    fn req_notify_cq(
+        cq: *mut ibverbs_sys::ibv_cq,
+        solicited_only: core::ffi::c_int,
+    ) -> ::std::os::raw::c_int;
+
+    fn modify_cq(
+        cq: *mut ibverbs_sys::ibv_cq,
+        attr: *mut ibverbs_sys::ibv_modify_cq_attr,
+    ) -> ::std::os::raw::c_int;
+
+    fn create_srq(
+        pd: *mut ibverbs_sys::ibv_pd,
+        srq_init_attr: *mut ibverbs_sys::ibv_srq_init_attr,
+    ) -> *mut ibverbs_sys::ibv_srq;
+
+    fn modify_srq(
+        srq: *mut ibverbs_sys::ibv_srq,
+        srq_attr: *mut ibverbs_sys::ibv_srq_attr,
+        srq_attr_mask: core::ffi::c_int,
+    ) -> ::std::os::raw::c_int;
+
+    fn query_srq(
+        srq: *mut ibverbs_sys::ibv_srq,
+        srq_attr: *mut ibverbs_sys::ibv_srq_attr,
+    ) -> ::std::os::raw::c_int;
+
+    fn destroy_srq(srq: *mut ibverbs_sys::ibv_srq) -> ::std::os::raw::c_int;
+
+    fn post_srq_recv(
+        srq: *mut ibverbs_sys::ibv_srq,
+        recv_wr: *mut ibverbs_sys::ibv_recv_wr,
+        bad_recv_wr: *mut *mut ibverbs_sys::ibv_recv_wr,
+    ) -> ::std::os::raw::c_int;
+
+    /// Opens a XRC domain of the context, the domain is not shared with other processes
+    fn open_xrcd(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        xrcd_init_attr: *mut ibverbs_sys::ibv_xrcd_init_attr,
+    ) -> *mut ibverbs_sys::ibv_xrcd;
+
+    fn close_xrcd(xrcd: *mut ibverbs_sys::ibv_xrcd) -> ::std::os::raw::c_int;
+
+    /// Creates a basic SRQ, or a XRC SRQ completing to its own CQ
+    fn create_srq_ex(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        srq_init_attr_ex: *mut ibverbs_sys::ibv_srq_init_attr_ex,
+    ) -> *mut ibverbs_sys::ibv_srq;
+
+    /// Writes the number the WRs of the remote XRC INI QPs name to reach a XRC SRQ
+    fn get_srq_num(srq: *mut ibverbs_sys::ibv_srq, srq_num: *mut u32) -> ::std::os::raw::c_int;
+
+    /// Allocates a thread domain, its QPs post on the calling thread into a dedicated send
+    /// channel
+    fn alloc_td(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        init_attr: *mut ibverbs_sys::ibv_td_init_attr,
+    ) -> *mut ibverbs_sys::ibv_td;
+
+    fn dealloc_td(td: *mut ibverbs_sys::ibv_td) -> ::std::os::raw::c_int;
+
+    /// Allocates a parent domain of a PD, carrying a thread domain and an allocator of the
+    /// QP objects. Freed by `dealloc_pd`.
+    fn alloc_parent_domain(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        attr: *mut ibverbs_sys::ibv_parent_domain_init_attr,
+    ) -> *mut ibverbs_sys::ibv_pd;
+
+    fn create_counters(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        init_attr: *mut ibverbs_sys::ibv_counters_init_attr,
+    ) -> *mut ibverbs_sys::ibv_counters;
+
+    fn destroy_counters(counters: *mut ibverbs_sys::ibv_counters) -> ::std::os::raw::c_int;
+
+    fn read_counters(
+        counters: *mut ibverbs_sys::ibv_counters,
+        counters_value: *mut u64,
+        ncounters: u32,
+        flags: u32,
+    ) -> ::std::os::raw::c_int;
+
+    /// Writes the text dump of the device and per-QP counters to `buf`, truncated and NUL
+    /// terminated like `snprintf`, and returns the length of the whole dump
+    fn dump_counters(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        buf: *mut std::ffi::c_char,
+        len: usize,
+    ) -> ::std::os::raw::c_int;
+
+    /// Writes the memory held by the driver to `buf` like `dump_counters`, as the bytes and
+    /// the highest bytes of each pool
+    fn dump_memory(
+        blue_context: *mut ibverbs_sys::ibv_context,
+        buf: *mut std::ffi::c_char,
+        len: usize,
+    ) -> ::std::os::raw::c_int;
+
+    /// Writes the records of the hot path trace ring to `buf` like `dump_counters`, empty
+    /// unless the driver is built with the `trace_ring` feature
+    fn dump_trace(buf: *mut std::ffi::c_char, len: usize) -> ::std::os::raw::c_int;
+
+    /// Writes the descriptors recorded from the rings of the device to the file at `path`
+    /// and returns their number, fails with `ENOTSUP` unless the driver is built with the
+    /// `desc_trace` feature
+    fn dump_desc_trace(path: *const std::ffi::c_char) -> ::std::os::raw::c_int;
+
+    /// Returns the completion ring of the CQ the provider polls in place, or null if the
+    /// CQ must be polled through `poll_cq`
+    fn cq_ring(cq: *mut ibverbs_sys::ibv_cq) -> *const core::ffi::c_void;
 }
 
 #[repr(C)]
 // this struct represent the `bluerdma_device` struct in `bluerdma.h` at `rdma-core/providers/bluerdma/`
 // the padding size should match the C's definition. 
-struct BlueRdmaDevice {
+pub(crate) struct BlueRdmaDevice {
     pad: [u8; 712],
     driver: *mut core::ffi::c_void,
     abi_version: core::ffi::c_int,
 }
 
-pub(super) fn get_device(context: *mut ibverbs_sys::ibv_context) -> &'static mut dyn VerbsOps {
-    let dev_ptr = unsafe { *context }.device.cast::<BlueRdmaDevice>();
-    let driver_ptr = unsafe { (*dev_ptr).driver };
-    unsafe {
-        #[cfg(feature = "hw")]
-        {
-            driver_ptr.cast::<HwDeviceCtx<PciHwDevice>>().as_mut()
-        }
-        #[cfg(feature = "sim")]
-        {
-            driver_ptr.cast::<HwDeviceCtx<EmulatedHwDevice>>().as_mut()
-        }
-        #[cfg(feature = "mock")]
-        {
-            driver_ptr.cast::<MockDeviceCtx>().as_mut()
+impl BlueRdmaDevice {
+    /// Wraps the driver data returned by `RdmaCtxOps::new` the way the provider does, for
+    /// callers of the verbs that have no provider in front of the driver
+    pub(crate) fn new(driver: *mut core::ffi::c_void) -> Self {
+        Self {
+            pad: [0; 712],
+            driver,
+            abi_version: 0,
         }
     }
-    .unwrap_or_else(|| unreachable!("null device pointer"))
+}
+
+/// The verbs context of the device selected by the build features
+#[cfg(feature = "hw")]
+pub(super) type DeviceCtx = HwDeviceCtx<PciHwDevice>;
+#[cfg(feature = "sim")]
+pub(super) type DeviceCtx = HwDeviceCtx<EmulatedHwDevice>;
+#[cfg(feature = "mock")]
+pub(super) type DeviceCtx = MockDeviceCtx;
+
+/// Driver data of a device, the context behind a reader-writer lock.
+///
+/// The control path verbs take the lock exclusively. The data path verbs that only need
+/// `&self` share it, so that threads posting to different QPs do not serialize on the
+/// device, their per-QP state is synchronized by the context itself.
+pub(super) type DeviceLock = RwLock<DeviceCtx>;
+
+/// Driver data of a closed context kept for the next open, see `DeviceConfig::resident`
+struct ResidentCtx(NonNull<DeviceLock>);
+
+// SAFETY: the driver data is already shared by all threads of the process through the
+// `ibv_context`, once parked it is only reached through `RESIDENT`
+#[allow(unsafe_code)]
+unsafe impl Send for ResidentCtx {}
+
+/// The resident context of the process, the driver only opens the default device
+static RESIDENT: Mutex<Option<ResidentCtx>> = Mutex::new(None);
+
+/// Takes the resident context, if a closed context was kept
+pub(super) fn take_resident() -> Option<NonNull<DeviceLock>> {
+    RESIDENT.lock().take().map(|ctx| ctx.0)
+}
+
+/// Keeps the driver data of a closed context for the next open, returns it back if another
+/// context is already resident
+pub(super) fn park_resident(
+    driver_data: NonNull<DeviceLock>,
+) -> std::result::Result<(), NonNull<DeviceLock>> {
+    let mut resident = RESIDENT.lock();
+    if resident.is_some() {
+        return Err(driver_data);
+    }
+    *resident = Some(ResidentCtx(driver_data));
+    Ok(())
+}
+
+/// Returns the lock of the device context from the driver data of `context`
+///
+/// The lock holds the concrete `DeviceCtx`, the verbs called through its guards are resolved
+/// at build time rather than through a vtable.
+fn device_lock(context: *mut ibverbs_sys::ibv_context) -> &'static DeviceLock {
+    let dev_ptr = unsafe { *context }.device.cast::<BlueRdmaDevice>();
+    let driver_ptr = unsafe { (*dev_ptr).driver };
+    unsafe { driver_ptr.cast::<DeviceLock>().as_ref() }
+        .unwrap_or_else(|| unreachable!("null device pointer"))
+}
+
+/// Returns the device context locked exclusively, for the verbs that take `&mut self`
+pub(super) fn get_device(
+    context: *mut ibverbs_sys::ibv_context,
+) -> RwLockWriteGuard<'static, DeviceCtx> {
+    device_lock(context).write()
+}
+
+/// Returns the device context locked shared, for the data path verbs that take `&self`
+pub(super) fn get_device_shared(
+    context: *mut ibverbs_sys::ibv_context,
+) -> RwLockReadGuard<'static, DeviceCtx> {
+    device_lock(context).read()
+}
+
+/// Registers a MR. The pages are pinned and the device is waited for through the shared
+/// lock if the context can, so that concurrent registrations only serialize on the allocation
+/// of their MTT entries and the staging of their page tables
+pub(super) fn register_mr(
+    context: *mut ibverbs_sys::ibv_context,
+    addr: u64,
+    length: usize,
+    pd_handle: u32,
+    access: u8,
+) -> Result<u32> {
+    // The shared guard is released before the exclusive lock is taken
+    let pinned = get_device_shared(context).pin_mr(addr, length, access);
+    let Some(pinned) = pinned else {
+        return get_device(context).reg_mr(addr, length, pd_handle, access);
+    };
+    let registered = get_device(context).reg_pinned_mr(pinned?, pd_handle, access);
+    let (mr_key, ticket) = registered?;
+    get_device_shared(context).wait_cmd(ticket);
+    Ok(mr_key)
+}
+
+/// Posts a chain of send WRs, through the shared lock if the context can post them without
+/// exclusive access
+pub(super) fn post_send_batch(
+    context: *mut ibverbs_sys::ibv_context,
+    qpn: u32,
+    wrs: &[SendWr],
+) -> std::result::Result<(), (usize, RdmaError)> {
+    // The shared guard is released before the exclusive lock is taken
+    let shared = get_device_shared(context).post_send_shared(qpn, wrs);
+    shared.unwrap_or_else(|| get_device(context).post_send_batch(qpn, wrs))
 }
@@ -30,7 +30,7 @@ use crate::{
         qp::QpTable,
         types::{
             ibv_qp_attr::{IbvQpAttr, IbvQpInitAttr},
-            RecvWr, SendWr,
+            RecvWr, SendWr, SgList,
         },
     },
 };
@@ -148,7 +148,7 @@ impl MockDeviceCtx {
     fn rand_qpn(&mut self) -> u32 {
         loop {
             let qpn = random::<u32>() % 10000;
-            if !self.qpn_set.insert(qpn) {
+            if self.qpn_set.insert(qpn) {
                 break qpn;
             }
         }
@@ -248,7 +248,11 @@ impl VerbsOps for MockDeviceCtx {
                 }) => {
                     write_local_addr(&mr_table, raddr, &data);
                     if let Some(x) = recv_cq.as_ref() {
-                        let completion = Completion::RecvRdmaWithImm { imm };
+                        let completion = Completion::RecvRdmaWithImm {
+                            qpn,
+                            imm,
+                            byte_len: data.len() as u32,
+                        };
                         info!("new completion, qpn: {qpn}, completion: {completion:?}");
                         x.push(completion);
                     }
@@ -271,7 +275,13 @@ impl VerbsOps for MockDeviceCtx {
 
                     write_local_addr(&mr_table, req.wr.addr, &data);
                     if let Some(x) = recv_cq.as_ref() {
-                        let completion = Completion::Recv { wr_id, imm };
+                        let completion = Completion::Recv {
+                            qpn,
+                            wr_id,
+                            imm,
+                            byte_len: data.len() as u32,
+                            offset: 0,
+                        };
                         info!("new completion, qpn: {qpn}, completion: {completion:?}");
                         x.push(completion);
                     }
@@ -296,14 +306,14 @@ impl VerbsOps for MockDeviceCtx {
                     if ack_req =>
                 {
                     if let Some(x) = send_cq.as_ref() {
-                        let completion = Completion::RdmaWrite { wr_id };
+                        let completion = Completion::RdmaWrite { qpn, wr_id };
                         info!("new completion, qpn: {qpn}, completion: {completion:?}");
                         x.push(completion);
                     }
                 }
                 QpTransportMessage::SendResp(WriteOrSendResp { wr_id, ack_req }) if ack_req => {
                     if let Some(x) = send_cq.as_ref() {
-                        let completion = Completion::Send { wr_id };
+                        let completion = Completion::Send { qpn, wr_id };
                         info!("new completion, qpn: {qpn}, completion: {completion:?}");
                         x.push(completion);
                     }
@@ -318,7 +328,7 @@ impl VerbsOps for MockDeviceCtx {
                     write_local_addr(&mr_table, laddr, &data);
                     if ack_req {
                         if let Some(x) = recv_cq.as_ref() {
-                            let completion = Completion::RdmaRead { wr_id };
+                            let completion = Completion::RdmaRead { qpn, wr_id };
                             info!("new completion, qpn: {qpn}, completion: {completion:?}");
                             x.push(completion);
                         }
@@ -379,7 +389,7 @@ impl VerbsOps for MockDeviceCtx {
         Ok(())
     }
 
-    fn create_cq(&mut self) -> crate::error::Result<u32> {
+    fn create_cq(&mut self, _cqe: u32) -> crate::error::Result<u32> {
         self.cq_handle += 1;
         let _ignore = self.cq_table.insert(self.cq_handle, CompletionQueue::new());
         info!("mock create cq, handle: {}", self.cq_handle);
@@ -392,6 +402,12 @@ impl VerbsOps for MockDeviceCtx {
         Ok(())
     }
 
+    fn resize_cq(&mut self, handle: u32, cqe: u32) -> crate::error::Result<()> {
+        info!("mock resize cq, handle: {handle}, cqe: {cqe}");
+
+        Ok(())
+    }
+
     fn poll_cq(&mut self, handle: u32, max_num_entries: usize) -> Vec<Completion> {
         let completions = if let Some(cq) = self.cq_table.get_mut(&handle) {
             iter::repeat_with(|| cq.pop())
@@ -413,7 +429,7 @@ impl VerbsOps for MockDeviceCtx {
         let to_send = match wr {
             SendWr::Rdma(x) => match x.opcode() {
                 WorkReqOpCode::RdmaWrite => {
-                    let data = read_local_addr(x.laddr(), x.length() as usize);
+                    let data = read_sg_list(x.sg_list());
                     QpTransportMessage::WriteReq(RdmaWriteReq {
                         raddr: x.raddr(),
                         imm: x.imm(),
@@ -423,7 +439,7 @@ impl VerbsOps for MockDeviceCtx {
                     })
                 }
                 WorkReqOpCode::RdmaWriteWithImm => {
-                    let data = read_local_addr(x.laddr(), x.length() as usize);
+                    let data = read_sg_list(x.sg_list());
                     QpTransportMessage::WriteWithImmReq(RdmaWriteReq {
                         raddr: x.raddr(),
                         imm: x.imm(),
@@ -447,7 +463,7 @@ impl VerbsOps for MockDeviceCtx {
                 }
             },
             SendWr::Send(x) => {
-                let data = read_local_addr(x.laddr, x.length as usize);
+                let data = read_sg_list(&x.sg_list);
                 QpTransportMessage::SendReq(SendReq {
                     data,
                     wr_id: wr.wr_id(),
@@ -499,6 +515,14 @@ impl VerbsOps for MockDeviceCtx {
     }
 }
 
+fn read_sg_list(sg_list: &SgList) -> Vec<u8> {
+    sg_list
+        .as_slice()
+        .iter()
+        .flat_map(|sge| read_local_addr(sge.addr, sge.length as usize))
+        .collect()
+}
+
 fn read_local_addr(addr: u64, len: usize) -> Vec<u8> {
     let mut data = vec![0u8; len];
     let slice = unsafe { std::slice::from_raw_parts(addr as *const u8, len) };
@@ -868,7 +892,7 @@ mod tests {
     fn create_dev(ip: Ipv4Addr) -> Ctx {
         let mut dev = MockDeviceCtx::default();
         dev.self_ip = ip.to_bits();
-        let cq = dev.create_cq().unwrap();
+        let cq = dev.create_cq(64).unwrap();
         let mut attr_init = IbvQpInitAttr::new_rc();
         attr_init.send_cq = Some(cq);
         attr_init.recv_cq = Some(cq);
@@ -883,6 +907,22 @@ mod tests {
         x.dev.update_qp(x.qpn, attr).unwrap();
     }
 
+    #[test]
+    fn bulk_qp_updates_stop_at_the_first_failure() {
+        let mut dev = MockDeviceCtx::default();
+        dev.self_ip = Ipv4Addr::new(127, 0, 0, 3).to_bits();
+        let qpns = dev.create_qps(&[IbvQpInitAttr::new_rc(); 2]).unwrap();
+        assert_eq!(qpns.len(), 2);
+        let attr = IbvQpAttr {
+            dest_qp_num: Some(1),
+            dest_qp_ip: Some(Ipv4Addr::LOCALHOST),
+            ..Default::default()
+        };
+        let updates = [(qpns[0], attr), (u32::MAX, attr), (qpns[1], attr)];
+        assert!(matches!(dev.update_qps(&updates), Err((1, _))));
+        dev.update_qps(&[(qpns[1], attr)]).unwrap();
+    }
+
     #[test]
     fn rdma_write_basic() {
         let mut dev0 = create_dev(Ipv4Addr::new(127, 0, 0, 1));
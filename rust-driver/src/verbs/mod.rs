@@ -1,6 +1,17 @@
 pub(crate) mod core;
+#[allow(unsafe_code)]
+mod cq_ex;
 pub(crate) mod ctx;
 pub(crate) mod dev;
 #[allow(unsafe_code)]
+mod dm;
+#[allow(unsafe_code)]
 pub(crate) mod ffi;
 pub(crate) mod mock;
+/// Native Rust API on the verbs context, without libibverbs
+pub mod native;
+pub(crate) mod partition;
+#[allow(unsafe_code)]
+mod pd;
+#[allow(unsafe_code)]
+mod qp_ex;
@@ -0,0 +1,1004 @@
+use std::{
+    collections::{HashMap, HashSet, VecDeque},
+    fmt,
+    future::Future,
+    io::{Read, Write},
+    marker::PhantomData,
+    mem,
+    net::Ipv4Addr,
+    ops::{Deref, DerefMut},
+    pin::Pin,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc,
+    },
+    task::{Context, Poll, Wake, Waker},
+};
+
+use bytemuck::Pod;
+use ibverbs_sys::ibv_access_flags;
+use parking_lot::{Mutex, RwLock};
+
+use crate::{
+    counters::{Counter, NUM_COUNTERS},
+    error::{RdmaError, Result},
+    rdma_utils::types::{
+        ibv_qp_attr::{IbvQpAttr, IbvQpInitAttr},
+        RecvWr, SendWr, SendWrBase, SendWrRdma,
+    },
+    workers::{
+        completion::Completion,
+        send::{ExportedSendQueue, WorkReqOpCode},
+        sq_ring::{SqEntry, SqRing},
+    },
+};
+
+use super::{core::BlueRdmaCore, ctx::VerbsOps, ffi::DeviceCtx};
+
+/// Completions taken from the CQ at a time
+const POLL_BATCH: usize = 32;
+
+/// `wr_id` bit of the work requests submitted through a `SubmissionRing`, their completions
+/// are reaped instead of resolving a future
+const RING_WR_ID: u64 = 1 << 63;
+
+/// Access of the registered buffers, the peers may read and write them
+#[allow(clippy::as_conversions, clippy::cast_possible_truncation)]
+const BUF_ACCESS: u8 = (ibv_access_flags::IBV_ACCESS_LOCAL_WRITE.0
+    | ibv_access_flags::IBV_ACCESS_REMOTE_WRITE.0
+    | ibv_access_flags::IBV_ACCESS_REMOTE_READ.0) as u8;
+
+/// Length of the connection message exchanged by `Device::connect_qp`
+const CONN_MSG_LEN: usize = 8;
+
+/// ACK timeout exponent of the QPs connected by `Device::connect_qp`, about 67ms
+const CONN_TIMEOUT: u8 = 14;
+
+/// Retries of the QPs connected by `Device::connect_qp`, on timeout and on RNR NAK
+const CONN_RETRY: u8 = 7;
+
+/// Device opened by the native Rust API, without going through libibverbs.
+///
+/// The verbs are called on the driver's context directly. A work request completes as a
+/// future woken by the `CompletionWorker` once it pushes the completion to the CQ, so no
+/// `ibv_wc` is marshalled and no thread spins on the CQ.
+#[derive(Clone)]
+pub struct Device {
+    shared: Arc<Shared>,
+}
+
+/// Context of the device and the PD of the registered buffers
+struct Shared {
+    ctx: RwLock<DeviceCtx>,
+    pd: u32,
+}
+
+impl Drop for Shared {
+    fn drop(&mut self) {
+        let _ignore = self.ctx.get_mut().dealloc_pd(self.pd);
+    }
+}
+
+impl fmt::Debug for Device {
+    #[inline]
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("Device")
+            .field("pd", &self.shared.pd)
+            .finish()
+    }
+}
+
+impl Device {
+    /// Opens the uverbs device `sysfs_name`, such as `uverbs0`
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the device can't be initialized
+    #[inline]
+    pub fn open(sysfs_name: &str) -> Result<Self> {
+        let mut ctx = BlueRdmaCore::new_ctx(sysfs_name)?;
+        let pd = ctx.alloc_pd()?;
+        Ok(Self {
+            shared: Arc::new(Shared {
+                ctx: RwLock::new(ctx),
+                pd,
+            }),
+        })
+    }
+
+    /// Registers `buf`, which stays registered until the returned buffer is dropped
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the registration fails
+    #[inline]
+    #[allow(clippy::as_conversions)]
+    pub fn register<T: Pod>(&self, buf: Box<[T]>) -> Result<RegisteredBuf<T>> {
+        let key = self.shared.ctx.write().reg_mr(
+            buf.as_ptr() as u64,
+            mem::size_of_val(&*buf),
+            self.shared.pd,
+            BUF_ACCESS,
+        )?;
+        Ok(RegisteredBuf {
+            buf,
+            key,
+            device: Arc::clone(&self.shared),
+        })
+    }
+
+    /// Creates a CQ of at least `cqe` entries
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if no CQ is left
+    #[inline]
+    pub fn create_cq(&self, cqe: u32) -> Result<CompletionQueue> {
+        let handle = self.shared.ctx.write().create_cq(cqe)?;
+        Ok(CompletionQueue {
+            inner: Arc::new(CqInner {
+                device: Arc::clone(&self.shared),
+                handle,
+                next_wr_id: AtomicU64::new(1),
+                state: Mutex::new(CqState::default()),
+                wakers: Arc::new(CqWakers::default()),
+            }),
+        })
+    }
+
+    /// Creates a RC QP completing its sends and receives to `cq`
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if no QP is left
+    #[inline]
+    pub fn create_qp(&self, cq: &CompletionQueue) -> Result<QueuePair> {
+        let mut attr = IbvQpInitAttr::new_rc();
+        attr.send_cq = Some(cq.inner.handle);
+        attr.recv_cq = Some(cq.inner.handle);
+        let qpn = self.shared.ctx.write().create_qp(attr)?;
+        Ok(QueuePair {
+            device: Arc::clone(&self.shared),
+            cq: Arc::clone(&cq.inner),
+            qpn,
+        })
+    }
+
+    /// Creates a RC QP completing to `cq` and connects it to the QP of the peer at the other
+    /// end of `stream`, which calls `connect_qp` as well.
+    ///
+    /// Both ends write their QP number and address before reading those of the peer, so the
+    /// connection takes a single round trip on `stream`. The post receive channel listens
+    /// meanwhile, and the QP context is written once, already in RTS: the QP is usable as
+    /// soon as this returns.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if no QP is left or the exchange on `stream` fails
+    #[inline]
+    pub fn connect_qp<S: Read + Write>(
+        &self,
+        cq: &CompletionQueue,
+        stream: &mut S,
+    ) -> Result<QueuePair> {
+        let mut attr = IbvQpInitAttr::new_rc();
+        attr.send_cq = Some(cq.inner.handle);
+        attr.recv_cq = Some(cq.inner.handle);
+        let (qpn, ip) = self.shared.ctx.write().create_pending_qp(attr)?;
+        // Destroys the QP if the exchange fails
+        let qp = QueuePair {
+            device: Arc::clone(&self.shared),
+            cq: Arc::clone(&cq.inner),
+            qpn,
+        };
+        stream.write_all(&conn_msg(qpn, ip))?;
+        stream.flush()?;
+        let mut msg = [0; CONN_MSG_LEN];
+        stream.read_exact(&mut msg)?;
+        let (dqpn, dest_ip) = parse_conn_msg(msg);
+        let conn = IbvQpAttr {
+            qp_state: Some(ibverbs_sys::ibv_qp_state::IBV_QPS_RTS),
+            path_mtu: Some(ibverbs_sys::IBV_MTU_4096),
+            dest_qp_num: Some(dqpn),
+            dest_qp_ip: Some(dest_ip),
+            qp_access_flags: Some(u32::from(BUF_ACCESS)),
+            timeout: Some(CONN_TIMEOUT),
+            retry_cnt: Some(CONN_RETRY),
+            rnr_retry: Some(CONN_RETRY),
+            ..Default::default()
+        };
+        self.shared.ctx.write().update_qp(qpn, conn)?;
+
+        Ok(qp)
+    }
+
+    /// Returns the QPs left connected by the previous process that opened the device, to
+    /// reattach with `reattach_qp`. Empty unless `snapshot_dir` is configured.
+    #[inline]
+    pub fn restored_qps(&self) -> Vec<u32> {
+        self.shared.ctx.read().restored_qps()
+    }
+
+    /// Reattaches the restored QP `qpn`, completing to `cq`, to the peer it was connected to.
+    ///
+    /// The QP resumes at the first work request the previous process did not see completed,
+    /// those have to be posted again, and the buffers registered again.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if `qpn` is not a restored QP
+    #[inline]
+    pub fn reattach_qp(&self, cq: &CompletionQueue, qpn: u32) -> Result<QueuePair> {
+        let mut init = IbvQpInitAttr::new_rc();
+        init.send_cq = Some(cq.inner.handle);
+        init.recv_cq = Some(cq.inner.handle);
+        let attr = IbvQpAttr {
+            timeout: Some(CONN_TIMEOUT),
+            retry_cnt: Some(CONN_RETRY),
+            rnr_retry: Some(CONN_RETRY),
+            ..Default::default()
+        };
+        self.shared.ctx.write().reattach_qp(qpn, init, attr)?;
+        Ok(QueuePair {
+            device: Arc::clone(&self.shared),
+            cq: Arc::clone(&cq.inner),
+            qpn,
+        })
+    }
+
+    /// Returns the counters of the device as `(name, value)`, such as `("retransmits", 2)`
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the device has no counters
+    #[inline]
+    pub fn counters(&self) -> Result<Vec<(&'static str, u64)>> {
+        let mut values = [0; NUM_COUNTERS];
+        self.shared.ctx.read().read_counters(&mut values)?;
+        Ok(Counter::ALL.iter().map(|c| c.name()).zip(values).collect())
+    }
+
+    /// Makes the card loop its packets back if `loopback`, and drop the packets whose random
+    /// number, drawn from `seed`, is below `drop_thresh`
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the card has no loss injection CSRs
+    #[cfg(feature = "debug_csrs")]
+    #[inline]
+    pub fn inject_loss(&self, loopback: bool, seed: u32, drop_thresh: u8) -> Result<()> {
+        self.shared
+            .ctx
+            .read()
+            .inject_loss(loopback, seed, drop_thresh)
+    }
+}
+
+/// Buffer of `T` registered with the device, deregistered once dropped
+pub struct RegisteredBuf<T: Pod> {
+    buf: Box<[T]>,
+    key: u32,
+    device: Arc<Shared>,
+}
+
+impl<T: Pod> RegisteredBuf<T> {
+    /// Returns the key of the buffer, handed to the peers accessing it
+    #[inline]
+    pub fn key(&self) -> u32 {
+        self.key
+    }
+
+    /// Returns the address of the buffer, handed to the peers accessing it
+    #[inline]
+    #[allow(clippy::as_conversions)]
+    pub fn addr(&self) -> u64 {
+        self.buf.as_ptr() as u64
+    }
+
+    /// Deregisters the buffer and returns it
+    #[inline]
+    pub fn into_inner(mut self) -> Box<[T]> {
+        mem::take(&mut self.buf)
+    }
+
+    /// Returns the local buffer of a work request
+    fn local(&self) -> Result<(u64, u32, u32)> {
+        let length = u32::try_from(mem::size_of_val(&*self.buf))
+            .map_err(|_err| RdmaError::InvalidInput("buffer longer than 4GB".into()))?;
+        Ok((self.addr(), length, self.key))
+    }
+}
+
+impl<T: Pod> Deref for RegisteredBuf<T> {
+    type Target = [T];
+
+    #[inline]
+    fn deref(&self) -> &Self::Target {
+        &self.buf
+    }
+}
+
+impl<T: Pod> DerefMut for RegisteredBuf<T> {
+    #[inline]
+    fn deref_mut(&mut self) -> &mut Self::Target {
+        &mut self.buf
+    }
+}
+
+impl<T: Pod> Drop for RegisteredBuf<T> {
+    #[inline]
+    fn drop(&mut self) {
+        let _ignore = self.device.ctx.write().dereg_mr(self.key);
+    }
+}
+
+impl<T: Pod> fmt::Debug for RegisteredBuf<T> {
+    #[inline]
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("RegisteredBuf")
+            .field("addr", &format_args!("{:x}", self.addr()))
+            .field("len", &self.buf.len())
+            .field("key", &self.key)
+            .finish()
+    }
+}
+
+/// CQ the futures of the work requests of its QPs are resolved from
+pub struct CompletionQueue {
+    inner: Arc<CqInner>,
+}
+
+impl fmt::Debug for CompletionQueue {
+    #[inline]
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("CompletionQueue")
+            .field("handle", &self.inner.handle)
+            .finish()
+    }
+}
+
+impl CompletionQueue {
+    /// Appends the completions of the work requests submitted through the submission rings
+    /// of the CQ's QPs to `out`, as `(wr_id, completion)`, returns the number appended
+    #[inline]
+    pub fn reap(&self, out: &mut Vec<(u64, WorkCompletion)>) -> usize {
+        let mut state = self.inner.state.lock();
+        self.inner.drain(&mut state);
+        let num = state.reaped.len();
+        out.extend(
+            state
+                .reaped
+                .drain(..)
+                .map(|(wr_id, completion)| (wr_id, completion.into())),
+        );
+        num
+    }
+}
+
+struct CqInner {
+    device: Arc<Shared>,
+    handle: u32,
+    /// `wr_id` of the next work request, 0 is left to the completions carrying none
+    next_wr_id: AtomicU64,
+    state: Mutex<CqState>,
+    /// Tasks waiting on the CQ, woken by the `CompletionWorker`
+    wakers: Arc<CqWakers>,
+}
+
+#[derive(Default)]
+struct CqState {
+    /// Completions taken from the CQ and not awaited yet, keyed by `wr_id`
+    done: HashMap<u64, Completion>,
+    /// Work requests whose future was dropped before they completed
+    abandoned: HashSet<u64>,
+    /// Completions of the work requests of the submission rings, not reaped yet
+    reaped: VecDeque<(u64, Completion)>,
+}
+
+/// Wakers of the futures waiting on a CQ, woken together by the next completion
+#[derive(Default)]
+struct CqWakers {
+    inner: Mutex<HashMap<u64, Waker>>,
+}
+
+impl Wake for CqWakers {
+    fn wake(self: Arc<Self>) {
+        self.wake_by_ref();
+    }
+
+    fn wake_by_ref(self: &Arc<Self>) {
+        let wakers = mem::take(&mut *self.inner.lock());
+        for waker in wakers.into_values() {
+            waker.wake();
+        }
+    }
+}
+
+impl CqInner {
+    fn next_wr_id(&self) -> u64 {
+        self.next_wr_id.fetch_add(1, Ordering::Relaxed)
+    }
+
+    fn poll_wr(&self, wr_id: u64, cx: &mut Context<'_>) -> Poll<Result<WorkCompletion>> {
+        if let Some(completion) = self.take(wr_id) {
+            return Poll::Ready(Ok(completion));
+        }
+        let _ignore = self.wakers.inner.lock().insert(wr_id, cx.waker().clone());
+        let waker = Waker::from(Arc::clone(&self.wakers));
+        let registered = self
+            .device
+            .ctx
+            .write()
+            .register_cq_waker(self.handle, &waker);
+        match registered {
+            Ok(()) => {}
+            // Polled again right away by contexts that can't wake the task
+            Err(RdmaError::Unimplemented(_)) => cx.waker().wake_by_ref(),
+            Err(err) => return Poll::Ready(Err(err)),
+        }
+        // A completion pushed before the waker was registered wakes nothing
+        match self.take(wr_id) {
+            Some(completion) => {
+                let _ignore = self.wakers.inner.lock().remove(&wr_id);
+                Poll::Ready(Ok(completion))
+            }
+            None => Poll::Pending,
+        }
+    }
+
+    /// Takes the completion of `wr_id`, draining the CQ if it is not taken yet
+    fn take(&self, wr_id: u64) -> Option<WorkCompletion> {
+        let mut state = self.state.lock();
+        if let Some(completion) = state.done.remove(&wr_id) {
+            return Some(completion.into());
+        }
+        self.drain(&mut state);
+        state.done.remove(&wr_id).map(Into::into)
+    }
+
+    /// Takes the completions of the CQ until it is empty
+    fn drain(&self, state: &mut CqState) {
+        loop {
+            let completions = self.device.ctx.write().poll_cq(self.handle, POLL_BATCH);
+            let drained = completions.len() < POLL_BATCH;
+            for completion in completions {
+                let id = completion.wr_id();
+                if id & RING_WR_ID != 0 {
+                    state.reaped.push_back((id & !RING_WR_ID, completion));
+                } else if id != 0 && !state.abandoned.remove(&id) {
+                    let _ignore = state.done.insert(id, completion);
+                }
+            }
+            if drained {
+                break;
+            }
+        }
+    }
+
+    /// Forgets the work request of a dropped future
+    fn abandon(&self, wr_id: u64) {
+        let _ignore = self.wakers.inner.lock().remove(&wr_id);
+        let mut state = self.state.lock();
+        if state.done.remove(&wr_id).is_none() {
+            let _ignore = state.abandoned.insert(wr_id);
+        }
+    }
+}
+
+impl Drop for CqInner {
+    fn drop(&mut self) {
+        let _ignore = self.device.ctx.write().destroy_cq(self.handle);
+    }
+}
+
+/// RC QP of a `Device`, destroyed once dropped
+pub struct QueuePair {
+    device: Arc<Shared>,
+    cq: Arc<CqInner>,
+    qpn: u32,
+}
+
+impl fmt::Debug for QueuePair {
+    #[inline]
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("QueuePair")
+            .field("qpn", &self.qpn)
+            .field("cq", &self.cq.handle)
+            .finish()
+    }
+}
+
+impl QueuePair {
+    /// Returns the QP number, handed to the peer
+    #[inline]
+    pub fn qpn(&self) -> u32 {
+        self.qpn
+    }
+
+    /// Modifies the attributes of the QP selected by `attr_mask`, as `ibv_modify_qp`
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the attributes are invalid for the QP
+    #[inline]
+    pub fn modify(&self, attr: &ibverbs_sys::ibv_qp_attr, attr_mask: u32) -> Result<()> {
+        self.device
+            .ctx
+            .write()
+            .update_qp(self.qpn, IbvQpAttr::new(*attr, attr_mask))
+    }
+
+    /// Posts the work requests in a single submission, each future resolves once its work
+    /// request completes
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if a work request can't be posted. The work requests before it are
+    /// posted, they complete without being reported.
+    #[inline]
+    pub fn submit<'a>(&self, ops: &[Op<'a>]) -> Result<Vec<WrFuture<'a>>> {
+        let wrs: Vec<SendWr> = ops
+            .iter()
+            .map(|op| op.to_wr(self.cq.next_wr_id()))
+            .collect();
+        let result = self.device.ctx.write().post_send_batch(self.qpn, &wrs);
+        if let Err((posted, err)) = result {
+            for wr in wrs.iter().take(posted) {
+                self.cq.abandon(wr.wr_id());
+            }
+            return Err(err);
+        }
+        Ok(wrs
+            .iter()
+            .map(|wr| WrFuture::new(&self.cq, wr.wr_id()))
+            .collect())
+    }
+
+    /// Writes `local` to `raddr` of the peer
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the write can't be posted
+    #[inline]
+    pub async fn write<T: Pod>(
+        &self,
+        local: &RegisteredBuf<T>,
+        raddr: u64,
+        rkey: u32,
+    ) -> Result<WorkCompletion> {
+        self.submit_one(Op::write(local, raddr, rkey)?)?.await
+    }
+
+    /// Reads `raddr` of the peer into `local`
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the read can't be posted
+    #[inline]
+    pub async fn read<T: Pod>(
+        &self,
+        local: &mut RegisteredBuf<T>,
+        raddr: u64,
+        rkey: u32,
+    ) -> Result<WorkCompletion> {
+        self.submit_one(Op::read(local, raddr, rkey)?)?.await
+    }
+
+    /// Sends `local` to a receive posted by the peer
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the send can't be posted
+    #[inline]
+    pub async fn send<T: Pod>(&self, local: &RegisteredBuf<T>) -> Result<WorkCompletion> {
+        self.submit_one(Op::send(local)?)?.await
+    }
+
+    /// Receives a send of the peer into `local`
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the receive can't be posted
+    #[inline]
+    pub async fn recv<T: Pod>(&self, local: &mut RegisteredBuf<T>) -> Result<WorkCompletion> {
+        let (addr, length, lkey) = local.local()?;
+        let wr_id = self.cq.next_wr_id();
+        self.device.ctx.write().post_recv(
+            self.qpn,
+            RecvWr {
+                wr_id,
+                addr,
+                length,
+                lkey,
+            },
+        )?;
+        WrFuture::new(&self.cq, wr_id).await
+    }
+
+    /// Creates a submission ring of at least `depth` entries, the work requests written to it
+    /// are posted together by its doorbell
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if `depth` is 0 or too large
+    #[inline]
+    pub fn submission_ring<'a>(&self, depth: usize) -> Result<SubmissionRing<'a>> {
+        let capacity = depth
+            .checked_next_power_of_two()
+            .filter(|&n| depth > 0 && u32::try_from(n).is_ok())
+            .ok_or_else(|| RdmaError::InvalidInput(format!("invalid ring depth {depth}")))?;
+        Ok(SubmissionRing {
+            device: Arc::clone(&self.device),
+            qpn: self.qpn,
+            ring: Arc::new(SqRing::new(capacity)),
+            _buf: PhantomData,
+        })
+    }
+
+    /// Lends a send channel to the QP, whose descriptors are then built by a GPU in the ring of
+    /// `length` bytes at `offset` of the dma-buf `fd` and rung through the returned doorbell.
+    /// The work requests of the GPU are not completed to the CQ.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if no channel is withheld for the GPUs or left, or if the ring is not
+    /// contiguous for the device
+    #[inline]
+    pub fn export_send_queue(&self, fd: i32, offset: u64, length: usize) -> Result<GpuSendQueue> {
+        let queue = self
+            .device
+            .ctx
+            .write()
+            .export_send_queue(self.qpn, fd, offset, length)?;
+        Ok(GpuSendQueue {
+            device: Arc::clone(&self.device),
+            qpn: self.qpn,
+            queue,
+        })
+    }
+
+    fn submit_one<'a>(&self, op: Op<'a>) -> Result<WrFuture<'a>> {
+        let future = self.submit(&[op])?.pop();
+        Ok(future.unwrap_or_else(|| unreachable!("one future per op")))
+    }
+}
+
+impl Drop for QueuePair {
+    #[inline]
+    fn drop(&mut self) {
+        let _ignore = self.device.ctx.write().destroy_qp(self.qpn);
+    }
+}
+
+/// Submission ring of a QP, shared with the driver's `RdmaWriteWorker`.
+///
+/// Work requests are written to the ring as compact records, without calling into the
+/// driver, and `doorbell` hands all of them to the worker at once. Their completions are
+/// taken by `CompletionQueue::reap` with the `wr_id` they were pushed with. The local
+/// buffers stay borrowed as long as the ring.
+pub struct SubmissionRing<'a> {
+    device: Arc<Shared>,
+    qpn: u32,
+    ring: Arc<SqRing>,
+    _buf: PhantomData<&'a ()>,
+}
+
+impl fmt::Debug for SubmissionRing<'_> {
+    #[inline]
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("SubmissionRing")
+            .field("qpn", &self.qpn)
+            .field("ring", &self.ring)
+            .finish()
+    }
+}
+
+impl<'a> SubmissionRing<'a> {
+    /// Writes a RDMA write or read to the ring, returns `false` if the ring is full. It is
+    /// posted by the next doorbell.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error for a send, and if the top bit of `wr_id` is set
+    #[inline]
+    pub fn push(&mut self, op: Op<'a>, wr_id: u64) -> Result<bool> {
+        if wr_id & RING_WR_ID != 0 {
+            return Err(RdmaError::InvalidInput(format!(
+                "wr_id 0x{wr_id:x} uses the top bit"
+            )));
+        }
+        if op.opcode == WorkReqOpCode::Send {
+            return Err(RdmaError::InvalidInput(
+                "sends are posted by QueuePair::submit".into(),
+            ));
+        }
+        Ok(self.ring.push(SqEntry {
+            wr_id: wr_id | RING_WR_ID,
+            laddr: op.laddr,
+            raddr: op.raddr,
+            length: op.length,
+            lkey: op.lkey,
+            rkey: op.rkey,
+            imm_data: 0,
+            opcode: op.opcode,
+            signaled: true,
+        }))
+    }
+
+    /// Posts the work requests written since the last doorbell, returns their number
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the QP is gone
+    #[inline]
+    pub fn doorbell(&mut self) -> Result<u32> {
+        let num = self.ring.publish();
+        if num > 0 {
+            self.device
+                .ctx
+                .read()
+                .ring_sq_doorbell(self.qpn, &self.ring)?;
+        }
+        Ok(num)
+    }
+}
+
+/// Send queue of a QP written by a GPU, given back to the driver once dropped.
+///
+/// The kernels write the `SendQueueReqDescSeg0` and `SendQueueReqDescSeg1` descriptors of the
+/// work requests to the ring from index `start`, and the new head to the head CSR in the
+/// doorbell page, which they access once the page is registered with the GPU, for example by
+/// `cuMemHostRegister` with `CU_MEMHOSTREGISTER_IOMEMORY`.
+pub struct GpuSendQueue {
+    device: Arc<Shared>,
+    qpn: u32,
+    queue: ExportedSendQueue,
+}
+
+impl fmt::Debug for GpuSendQueue {
+    #[inline]
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("GpuSendQueue")
+            .field("qpn", &self.qpn)
+            .field("depth", &self.queue.depth)
+            .field("start", &self.queue.start)
+            .finish()
+    }
+}
+
+impl GpuSendQueue {
+    /// Returns the number of descriptors of the ring, the head and the tail CSRs wrap around
+    /// at twice the depth
+    #[inline]
+    pub fn depth(&self) -> usize {
+        self.queue.depth
+    }
+
+    /// Returns the index of the first descriptor written by the GPU
+    #[inline]
+    pub fn start(&self) -> u32 {
+        self.queue.start
+    }
+
+    /// Returns the mapping of the page holding the head and the tail CSRs
+    #[inline]
+    pub fn doorbell_page(&self) -> *mut u8 {
+        self.queue.doorbell.as_ptr().cast_mut()
+    }
+
+    /// Returns the length of the doorbell page
+    #[inline]
+    pub fn doorbell_page_len(&self) -> usize {
+        self.queue.doorbell.len()
+    }
+
+    /// Returns the offset of the head CSR in the doorbell page
+    #[inline]
+    pub fn head_offset(&self) -> usize {
+        self.queue.head
+    }
+
+    /// Returns the offset of the tail CSR in the doorbell page, read to reclaim descriptors
+    #[inline]
+    pub fn tail_offset(&self) -> usize {
+        self.queue.tail
+    }
+}
+
+impl Drop for GpuSendQueue {
+    #[inline]
+    fn drop(&mut self) {
+        let _ignore = self.device.ctx.write().release_send_queue(self.qpn);
+    }
+}
+
+/// Work request of a batch posted by `QueuePair::submit`, borrowing its local buffer until
+/// its future is dropped
+#[derive(Debug, Clone, Copy)]
+pub struct Op<'a> {
+    opcode: WorkReqOpCode,
+    laddr: u64,
+    length: u32,
+    lkey: u32,
+    raddr: u64,
+    rkey: u32,
+    _buf: PhantomData<&'a ()>,
+}
+
+impl<'a> Op<'a> {
+    /// Writes `local` to `raddr` of the peer
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the buffer is longer than a work request
+    #[inline]
+    pub fn write<T: Pod>(local: &'a RegisteredBuf<T>, raddr: u64, rkey: u32) -> Result<Self> {
+        Self::new(WorkReqOpCode::RdmaWrite, local, raddr, rkey)
+    }
+
+    /// Reads `raddr` of the peer into `local`
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the buffer is longer than a work request
+    #[inline]
+    pub fn read<T: Pod>(local: &'a mut RegisteredBuf<T>, raddr: u64, rkey: u32) -> Result<Self> {
+        Self::new(WorkReqOpCode::RdmaRead, local, raddr, rkey)
+    }
+
+    /// Sends `local` to a receive posted by the peer
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the buffer is longer than a work request
+    #[inline]
+    pub fn send<T: Pod>(local: &'a RegisteredBuf<T>) -> Result<Self> {
+        Self::new(WorkReqOpCode::Send, local, 0, 0)
+    }
+
+    fn new<T: Pod>(
+        opcode: WorkReqOpCode,
+        local: &RegisteredBuf<T>,
+        raddr: u64,
+        rkey: u32,
+    ) -> Result<Self> {
+        let (laddr, length, lkey) = local.local()?;
+        Ok(Self {
+            opcode,
+            laddr,
+            length,
+            lkey,
+            raddr,
+            rkey,
+            _buf: PhantomData,
+        })
+    }
+
+    fn to_wr(self, wr_id: u64) -> SendWr {
+        let base = SendWrBase::new(
+            wr_id,
+            ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0,
+            self.laddr,
+            self.length,
+            self.lkey,
+            0,
+            self.opcode,
+        );
+        if self.opcode == WorkReqOpCode::Send {
+            return base.into();
+        }
+        SendWrRdma::new_from_base(base, self.raddr, self.rkey).into()
+    }
+}
+
+/// Completion of a work request posted through the native API
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct WorkCompletion {
+    byte_len: u32,
+    imm: Option<u32>,
+}
+
+impl WorkCompletion {
+    /// Returns the length of a received message, 0 for the other work requests
+    #[inline]
+    pub fn byte_len(&self) -> u32 {
+        self.byte_len
+    }
+
+    /// Returns the immediate data of a received message
+    #[inline]
+    pub fn imm(&self) -> Option<u32> {
+        self.imm
+    }
+}
+
+impl From<Completion> for WorkCompletion {
+    #[inline]
+    fn from(completion: Completion) -> Self {
+        Self {
+            byte_len: completion.byte_len(),
+            imm: completion.imm(),
+        }
+    }
+}
+
+/// Future of a posted work request, resolved once the work request completes
+#[must_use = "a work request is only reported once its future is polled"]
+pub struct WrFuture<'a> {
+    cq: Arc<CqInner>,
+    wr_id: u64,
+    finished: bool,
+    _bufs: PhantomData<&'a ()>,
+}
+
+impl WrFuture<'_> {
+    fn new(cq: &Arc<CqInner>, wr_id: u64) -> Self {
+        Self {
+            cq: Arc::clone(cq),
+            wr_id,
+            finished: false,
+            _bufs: PhantomData,
+        }
+    }
+}
+
+impl Future for WrFuture<'_> {
+    type Output = Result<WorkCompletion>;
+
+    #[inline]
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        let poll = self.cq.poll_wr(self.wr_id, cx);
+        if poll.is_ready() {
+            self.finished = true;
+        }
+        poll
+    }
+}
+
+impl Drop for WrFuture<'_> {
+    #[inline]
+    fn drop(&mut self) {
+        if !self.finished {
+            self.cq.abandon(self.wr_id);
+        }
+    }
+}
+
+impl fmt::Debug for WrFuture<'_> {
+    #[inline]
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("WrFuture")
+            .field("cq", &self.cq.handle)
+            .field("wr_id", &self.wr_id)
+            .finish()
+    }
+}
+
+/// Encodes the QP number and the address of a QP, as read by the peer in `connect_qp`
+fn conn_msg(qpn: u32, ip: Ipv4Addr) -> [u8; CONN_MSG_LEN] {
+    let mut msg = [0; CONN_MSG_LEN];
+    let (qpn_bytes, ip_bytes) = msg.split_at_mut(4);
+    qpn_bytes.copy_from_slice(&qpn.to_be_bytes());
+    ip_bytes.copy_from_slice(&ip.octets());
+    msg
+}
+
+/// Decodes the QP number and the address of the peer QP
+fn parse_conn_msg(msg: [u8; CONN_MSG_LEN]) -> (u32, Ipv4Addr) {
+    let [q0, q1, q2, q3, a, b, c, d] = msg;
+    (
+        u32::from_be_bytes([q0, q1, q2, q3]),
+        Ipv4Addr::new(a, b, c, d),
+    )
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn conn_msgs_round_trip() {
+        let ip = Ipv4Addr::new(10, 0, 0, 2);
+        assert_eq!(parse_conn_msg(conn_msg(0x0102_0304, ip)), (0x0102_0304, ip));
+    }
+}
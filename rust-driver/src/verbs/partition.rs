@@ -0,0 +1,185 @@
+use std::{
+    fs::{File, OpenOptions},
+    io,
+    ops::Range,
+    os::fd::AsRawFd,
+    path::PathBuf,
+};
+
+use log::info;
+
+use crate::config::PartitionConfig;
+
+/// Directory of the lock files marking the shares held by the processes of the host
+const LOCK_DIR: &str = "/tmp";
+
+/// The share of the device owned by a context, out of `contexts` equal shares
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct Partition {
+    index: usize,
+    contexts: usize,
+}
+
+impl Partition {
+    /// The whole device, owned by a single context
+    pub(crate) const WHOLE: Self = Self {
+        index: 0,
+        contexts: 1,
+    };
+
+    pub(crate) fn index(self) -> usize {
+        self.index
+    }
+
+    pub(crate) fn contexts(self) -> usize {
+        self.contexts
+    }
+
+    /// Returns the range of the share out of `total` items, the last share also takes the
+    /// remainder
+    pub(crate) fn share(self, total: usize) -> Range<usize> {
+        let per = total / self.contexts;
+        let start = per * self.index;
+        if self.index + 1 == self.contexts {
+            start..total
+        } else {
+            start..start + per
+        }
+    }
+
+    /// Returns the channels of the share out of `channel_ids`, empty if there are fewer
+    /// channels than shares
+    pub(crate) fn channels(self, channel_ids: &[usize]) -> Vec<usize> {
+        if channel_ids.len() < self.contexts {
+            return Vec::new();
+        }
+        channel_ids
+            .get(self.share(channel_ids.len()))
+            .map(<[usize]>::to_vec)
+            .unwrap_or_default()
+    }
+}
+
+/// A share of the device held by the process until it is dropped.
+///
+/// Each share is marked by an exclusive `flock` on its lock file, so that the shares of
+/// processes that exited are released by the kernel.
+#[derive(Debug)]
+pub(crate) struct ClaimedPartition {
+    partition: Partition,
+    /// Name of the device the lock files belong to
+    device: String,
+    /// Lock file of the share, `None` for the whole device of the emulator
+    _lock: Option<File>,
+}
+
+impl ClaimedPartition {
+    /// Returns the whole device, without marking it as held
+    pub(crate) fn unclaimed() -> Self {
+        Self {
+            partition: Partition::WHOLE,
+            device: String::new(),
+            _lock: None,
+        }
+    }
+
+    /// Claims the configured share of `device`, or the first share no other process holds
+    pub(crate) fn claim(config: PartitionConfig, device: &str) -> io::Result<Self> {
+        let contexts = config.contexts();
+        let candidates = match config.index {
+            Some(index) => index..index + 1,
+            None => 0..contexts,
+        };
+        for index in candidates {
+            if let Some(lock) = try_lock(&lock_path(device, index))? {
+                info!("claimed share {index} of {contexts} of {device}");
+                return Ok(Self {
+                    partition: Partition { index, contexts },
+                    device: device.to_owned(),
+                    _lock: Some(lock),
+                });
+            }
+        }
+        Err(io::Error::new(
+            io::ErrorKind::AddrInUse,
+            format!("all requested shares of {device} are held by other processes"),
+        ))
+    }
+
+    pub(crate) fn partition(&self) -> Partition {
+        self.partition
+    }
+
+    /// Returns whether no other process holds a share of the device
+    pub(crate) fn is_sole_opener(&self) -> bool {
+        (0..self.partition.contexts)
+            .filter(|&index| index != self.partition.index)
+            .all(|index| matches!(try_lock(&lock_path(&self.device, index)), Ok(Some(_))))
+    }
+}
+
+fn lock_path(device: &str, index: usize) -> PathBuf {
+    PathBuf::from(LOCK_DIR).join(format!("blue-rdma-{device}.{index}.lock"))
+}
+
+/// Locks the file at `path` exclusively, `None` if another process holds it
+#[allow(unsafe_code)]
+fn try_lock(path: &PathBuf) -> io::Result<Option<File>> {
+    let file = OpenOptions::new()
+        .read(true)
+        .write(true)
+        .create(true)
+        .truncate(false)
+        .open(path)?;
+    // SAFETY: the descriptor is owned by `file`
+    if unsafe { libc::flock(file.as_raw_fd(), libc::LOCK_EX | libc::LOCK_NB) } == 0 {
+        return Ok(Some(file));
+    }
+    let err = io::Error::last_os_error();
+    if err.kind() == io::ErrorKind::WouldBlock {
+        Ok(None)
+    } else {
+        Err(err)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn shares_cover_the_device() {
+        let shares: Vec<_> = (0..3)
+            .map(|index| Partition { index, contexts: 3 }.share(10))
+            .collect();
+        assert_eq!(shares, [0..3, 3..6, 6..10]);
+        assert_eq!(Partition::WHOLE.share(10), 0..10);
+    }
+
+    #[test]
+    fn channels_are_split_between_shares() {
+        let second = Partition {
+            index: 1,
+            contexts: 2,
+        };
+        assert_eq!(second.channels(&[0, 1, 2, 3]), [2, 3]);
+        assert!(second.channels(&[0]).is_empty());
+    }
+
+    #[test]
+    fn held_shares_are_skipped() {
+        let device = format!("test{}", std::process::id());
+        let config = PartitionConfig {
+            contexts: 2,
+            index: None,
+        };
+        let first = ClaimedPartition::claim(config, &device).unwrap();
+        assert!(first.is_sole_opener());
+        let second = ClaimedPartition::claim(config, &device).unwrap();
+        assert_eq!(second.partition().index(), 1);
+        assert!(!first.is_sole_opener());
+        assert!(ClaimedPartition::claim(config, &device).is_err());
+        drop(second);
+        assert!(first.is_sole_opener());
+    }
+}
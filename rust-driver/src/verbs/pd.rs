@@ -0,0 +1,202 @@
+use std::{
+    ffi::c_void,
+    mem::{align_of, size_of},
+    ptr,
+};
+
+use ibverbs_sys::ibv_parent_domain_init_attr_mask as init_mask;
+
+use crate::error::{RdmaError, Result};
+
+/// `resource_type` passed to the allocator of a parent domain for the objects of its QPs
+pub(super) const BLUERDMA_RES_TYPE_QP: u64 = 1;
+
+/// `IBV_ALLOCATOR_USE_DEFAULT`, returned by an allocator that leaves a resource to the driver
+const ALLOCATOR_USE_DEFAULT: usize = usize::MAX;
+
+type AllocFn = unsafe extern "C" fn(
+    pd: *mut ibverbs_sys::ibv_pd,
+    pd_context: *mut c_void,
+    size: usize,
+    alignment: usize,
+    resource_type: u64,
+) -> *mut c_void;
+
+type FreeFn = unsafe extern "C" fn(
+    pd: *mut ibverbs_sys::ibv_pd,
+    pd_context: *mut c_void,
+    ptr: *mut c_void,
+    resource_type: u64,
+);
+
+/// Allocator supplied by the application through a parent domain
+#[derive(Debug, Clone, Copy)]
+pub(super) struct PdAllocator {
+    /// The parent domain, passed back to the callbacks
+    pd: *mut ibverbs_sys::ibv_pd,
+    pd_context: *mut c_void,
+    alloc: AllocFn,
+    free: FreeFn,
+}
+
+impl PdAllocator {
+    /// Moves `value` into memory of the allocator
+    ///
+    /// # Returns
+    ///
+    /// `None` if the allocator leaves the resource to the driver
+    pub(super) fn place<T>(&self, value: T, resource_type: u64) -> Result<Option<*mut T>> {
+        // SAFETY: the callback comes from the application, which guarantees it for the lifetime
+        // of the parent domain
+        let mem = unsafe {
+            (self.alloc)(
+                self.pd,
+                self.pd_context,
+                size_of::<T>(),
+                align_of::<T>(),
+                resource_type,
+            )
+        };
+        if mem as usize == ALLOCATOR_USE_DEFAULT {
+            return Ok(None);
+        }
+        let mem = mem.cast::<T>();
+        if mem.is_null() || !mem.is_aligned() {
+            return Err(RdmaError::ResourceExhausted(
+                "the parent domain allocator returned no suitable memory".into(),
+            ));
+        }
+        // SAFETY: the memory is valid for a `T` and aligned
+        unsafe { mem.write(value) };
+        Ok(Some(mem))
+    }
+
+    /// Drops and frees a value moved by `place`
+    ///
+    /// # Safety
+    ///
+    /// `mem` must come from `place` with the same `resource_type` and must not be used
+    /// afterwards
+    pub(super) unsafe fn free<T>(&self, mem: *mut T, resource_type: u64) {
+        unsafe {
+            ptr::drop_in_place(mem);
+            (self.free)(self.pd, self.pd_context, mem.cast(), resource_type);
+        }
+    }
+}
+
+/// A protection domain, or a parent domain of one, starting as the rdma-core `ibv_pd`.
+///
+/// A parent domain shares the handle of its protection domain, so that the MRs registered
+/// through either are usable by the QPs of both. The QPs created under a parent domain with a
+/// thread domain are attached to it, and their objects are placed by the allocator of the
+/// parent domain if it has one, with `BLUERDMA_RES_TYPE_QP` as the `resource_type`. The send
+/// queues and CQ rings of the driver are carved from the DMA buffers allocated when the
+/// device is opened, so they do not go through the allocator.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub(super) struct BluePd {
+    /// Must stay the first field, the consumer only sees a pointer to it
+    pd: ibverbs_sys::ibv_pd,
+    /// Whether the PD is a parent domain
+    parent: bool,
+    /// Thread domain of the QPs of the parent domain
+    td: Option<u32>,
+    allocator: Option<PdAllocator>,
+}
+
+impl BluePd {
+    /// Allocates the PD `handle`, the caller owns the returned pointer
+    pub(super) fn alloc(
+        context: *mut ibverbs_sys::ibv_context,
+        handle: u32,
+    ) -> *mut ibverbs_sys::ibv_pd {
+        let pd = Self {
+            pd: ibverbs_sys::ibv_pd { context, handle },
+            parent: false,
+            td: None,
+            allocator: None,
+        };
+        Box::into_raw(Box::new(pd)).cast()
+    }
+
+    /// Allocates a parent domain of the protection domain `pd`, the caller owns the returned
+    /// pointer
+    pub(super) fn alloc_parent(
+        pd: &ibverbs_sys::ibv_pd,
+        td: Option<u32>,
+        attr: &ibverbs_sys::ibv_parent_domain_init_attr,
+    ) -> Result<*mut ibverbs_sys::ibv_pd> {
+        let mask = attr.comp_mask;
+        let allocators_mask = init_mask::IBV_PARENT_DOMAIN_INIT_ATTR_ALLOCATORS.0;
+        let context_mask = init_mask::IBV_PARENT_DOMAIN_INIT_ATTR_PD_CONTEXT.0;
+        if mask & !(allocators_mask | context_mask) != 0 {
+            return Err(RdmaError::InvalidInput(format!(
+                "unsupported parent domain comp_mask {mask:#x}"
+            )));
+        }
+        let pd_context = if mask & context_mask != 0 {
+            attr.pd_context
+        } else {
+            ptr::null_mut()
+        };
+        let callbacks = (mask & allocators_mask != 0)
+            .then_some((attr.alloc, attr.free))
+            .map(|x| match x {
+                (Some(alloc), Some(free)) => Ok((alloc, free)),
+                _ => Err(RdmaError::InvalidInput(
+                    "a parent domain allocator needs both alloc and free".into(),
+                )),
+            })
+            .transpose()?;
+        let parent = Box::into_raw(Box::new(Self {
+            pd: *pd,
+            parent: true,
+            td,
+            allocator: None,
+        }));
+        // The callbacks get the parent domain itself
+        let allocator = callbacks.map(|(alloc, free)| PdAllocator {
+            pd: parent.cast(),
+            pd_context,
+            alloc,
+            free,
+        });
+        // SAFETY: the parent domain was just allocated
+        unsafe { (*parent).allocator = allocator };
+        Ok(parent.cast())
+    }
+
+    /// Frees a PD or a parent domain returned by `alloc` or `alloc_parent`
+    ///
+    /// # Safety
+    ///
+    /// `pd` must come from `alloc` or `alloc_parent` and must not be used afterwards
+    pub(super) unsafe fn free(pd: *mut ibverbs_sys::ibv_pd) {
+        drop(unsafe { Box::from_raw(pd.cast::<Self>()) });
+    }
+
+    /// Returns the PD or the parent domain of `pd`
+    ///
+    /// # Safety
+    ///
+    /// `pd` must be null or come from `alloc` or `alloc_parent`
+    #[allow(clippy::cast_ptr_alignment)]
+    pub(super) unsafe fn get(pd: *mut ibverbs_sys::ibv_pd) -> Option<Self> {
+        unsafe { pd.cast::<Self>().as_ref() }.copied()
+    }
+
+    pub(super) fn is_parent(&self) -> bool {
+        self.parent
+    }
+
+    /// Returns the thread domain of the QPs of the parent domain
+    pub(super) fn td(&self) -> Option<u32> {
+        self.td
+    }
+
+    /// Returns the allocator of the QP objects of the parent domain
+    pub(super) fn allocator(&self) -> Option<PdAllocator> {
+        self.allocator
+    }
+}
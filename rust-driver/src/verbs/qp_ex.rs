@@ -0,0 +1,537 @@
+use std::ffi::c_void;
+
+use ibverbs_sys::ibv_qp_create_send_ops_flags as send_ops;
+use log::error;
+
+use crate::{
+    constants::MAX_SGE,
+    error::{RdmaError, Result},
+    net::dc::DcSendWr,
+    rdma_utils::types::{SendWr, SendWrBase, SendWrRdma, SgList, Sge},
+    workers::send::WorkReqOpCode,
+};
+
+use super::{
+    ctx::VerbsOps,
+    ffi::{get_device, post_send_batch},
+    pd::{PdAllocator, BLUERDMA_RES_TYPE_QP},
+};
+
+/// `VERBS_QP_EX` of the rdma-core `verbs_qp_mask`
+const VERBS_QP_EX: u32 = 1 << 1;
+
+/// An extended QP.
+///
+/// The layout starts as the rdma-core `verbs_qp`, so that `ibv_qp_to_qp_ex` finds the
+/// `ibv_qp_ex`, and is followed by the WRs built since `ibv_wr_start`.
+#[repr(C)]
+pub(super) struct BlueQpEx {
+    /// Must stay the first field, the consumer only sees a pointer to it
+    qp: ibverbs_sys::ibv_qp_ex,
+    /// `comp_mask` of `verbs_qp`, read by `ibv_qp_to_qp_ex`
+    #[allow(dead_code)]
+    comp_mask: u32,
+    /// `xrcd` of `verbs_qp`, always null
+    #[allow(dead_code)]
+    xrcd: *mut c_void,
+    /// WRs built since `wr_start`
+    staging: WrStaging,
+    /// Allocator of the parent domain that placed the QP, `None` if it is boxed
+    allocator: Option<PdAllocator>,
+}
+
+impl BlueQpEx {
+    /// Returns the `send_ops_flags` of `ibv_qp_init_attr_ex` that have a WR builder
+    pub(super) fn supported_send_ops() -> u64 {
+        let flags = send_ops::IBV_QP_EX_WITH_RDMA_WRITE
+            | send_ops::IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM
+            | send_ops::IBV_QP_EX_WITH_SEND
+            | send_ops::IBV_QP_EX_WITH_SEND_WITH_IMM
+            | send_ops::IBV_QP_EX_WITH_RDMA_READ;
+        u64::from(flags.0)
+    }
+
+    /// Allocates the extended QP of `qp_base`, through `allocator` if the QP belongs to a
+    /// parent domain that has one. The caller owns the returned pointer.
+    pub(super) fn alloc(
+        qp_base: ibverbs_sys::ibv_qp,
+        allocator: Option<PdAllocator>,
+    ) -> Result<*mut ibverbs_sys::ibv_qp> {
+        let qp = ibverbs_sys::ibv_qp_ex {
+            qp_base,
+            comp_mask: 0,
+            wr_id: 0,
+            wr_flags: 0,
+            wr_atomic_cmp_swp: None,
+            wr_atomic_fetch_add: None,
+            wr_bind_mw: None,
+            wr_local_inv: None,
+            wr_rdma_read: Some(wr_rdma_read),
+            wr_rdma_write: Some(wr_rdma_write),
+            wr_rdma_write_imm: Some(wr_rdma_write_imm),
+            wr_send: Some(wr_send),
+            wr_send_imm: Some(wr_send_imm),
+            wr_send_inv: None,
+            wr_send_tso: None,
+            wr_set_ud_addr: Some(wr_set_ud_addr),
+            wr_set_xrc_srqn: None,
+            wr_set_inline_data: Some(wr_set_inline_data),
+            wr_set_inline_data_list: Some(wr_set_inline_data_list),
+            wr_set_sge: Some(wr_set_sge),
+            wr_set_sge_list: Some(wr_set_sge_list),
+            wr_start: Some(wr_start),
+            wr_complete: Some(wr_complete),
+            wr_abort: Some(wr_abort),
+            wr_atomic_write: None,
+            wr_flush: None,
+        };
+        let build = move |allocator| Self {
+            qp,
+            comp_mask: VERBS_QP_EX,
+            xrcd: std::ptr::null_mut(),
+            staging: WrStaging::default(),
+            allocator,
+        };
+        if let Some(allocator) = allocator {
+            if let Some(placed) = allocator.place(build(Some(allocator)), BLUERDMA_RES_TYPE_QP)? {
+                return Ok(placed.cast());
+            }
+        }
+        // Also when the allocator leaves the QP to the driver
+        Ok(Box::into_raw(Box::new(build(None))).cast())
+    }
+
+    /// Frees an extended QP returned by `alloc`
+    ///
+    /// # Safety
+    ///
+    /// `qp` must come from `alloc` and must not be used afterwards
+    #[allow(clippy::cast_ptr_alignment)]
+    pub(super) unsafe fn free(qp: *mut ibverbs_sys::ibv_qp) {
+        let qp = qp.cast::<Self>();
+        match unsafe { (*qp).allocator } {
+            Some(allocator) => unsafe { allocator.free(qp, BLUERDMA_RES_TYPE_QP) },
+            None => drop(unsafe { Box::from_raw(qp) }),
+        }
+    }
+}
+
+/// Header of the WR being built, waiting for its local buffers
+#[derive(Debug, Clone, Copy)]
+struct WrHeader {
+    wr_id: u64,
+    send_flags: u32,
+    opcode: WorkReqOpCode,
+    imm_data: u32,
+    /// Remote address and key of RDMA operations
+    remote: Option<(u64, u32)>,
+    /// Address handle and remote QPN of the WRs of DC QPs
+    dest: Option<(u32, u32)>,
+}
+
+/// Staging area of the WR builders.
+///
+/// Builders write into a reused buffer, `wr_complete` submits it as one batch without
+/// walking an `ibv_send_wr` chain. Errors are deferred to `wr_complete`, as the builders
+/// return nothing.
+#[derive(Debug, Default)]
+struct WrStaging {
+    /// Complete WRs
+    wrs: Vec<SendWr>,
+    /// Destinations of the complete WRs
+    dests: Vec<Option<(u32, u32)>>,
+    /// WR started by the last opcode builder
+    current: Option<WrHeader>,
+    /// First error met since `wr_start`
+    error: Option<RdmaError>,
+}
+
+impl WrStaging {
+    /// Discards all staged WRs, the buffer is kept for the next batch
+    fn clear(&mut self) {
+        self.wrs.clear();
+        self.dests.clear();
+        self.current = None;
+        self.error = None;
+    }
+
+    /// Records the first error of the batch
+    fn fail(&mut self, err: RdmaError) {
+        if self.error.is_none() {
+            self.error = Some(err);
+        }
+    }
+
+    /// Starts a new WR, the previous one must have its buffers set
+    fn begin(&mut self, header: WrHeader) {
+        if self.current.is_some() {
+            self.fail(RdmaError::InvalidInput("WR posted without an SGE".into()));
+        }
+        self.current = Some(header);
+    }
+
+    /// Sets the local buffers of the current WR and stages it
+    fn set_data(&mut self, sg_list: Result<SgList>, inline: bool) {
+        let Some(header) = self.current.take() else {
+            self.fail(RdmaError::InvalidInput("SGE set without a WR".into()));
+            return;
+        };
+        match Self::build(header, sg_list, inline) {
+            Ok(wr) => {
+                self.wrs.push(wr);
+                self.dests.push(header.dest);
+            }
+            Err(err) => self.fail(err),
+        }
+    }
+
+    /// Sets the destination of the current WR, or of the last staged one if its buffers are
+    /// already set
+    fn set_dest(&mut self, ah: u32, remote_qpn: u32) {
+        if let Some(header) = self.current.as_mut() {
+            header.dest = Some((ah, remote_qpn));
+        } else if let Some(dest) = self.dests.last_mut() {
+            *dest = Some((ah, remote_qpn));
+        } else {
+            self.fail(RdmaError::InvalidInput("Address set without a WR".into()));
+        }
+    }
+
+    /// Builds a WR from its header and its local buffers
+    fn build(header: WrHeader, sg_list: Result<SgList>, inline: bool) -> Result<SendWr> {
+        let sg_list = sg_list?;
+        // TODO: scatter RDMA read responses into multiple local buffers
+        if header.opcode == WorkReqOpCode::RdmaRead && sg_list.len() > 1 {
+            return Err(RdmaError::Unimplemented(
+                "Only support for single SGE in RDMA read".into(),
+            ));
+        }
+        let send_flags = if inline {
+            header.send_flags | ibverbs_sys::ibv_send_flags::IBV_SEND_INLINE.0
+        } else {
+            header.send_flags
+        };
+        let base = SendWrBase::new_with_sg_list(
+            header.wr_id,
+            send_flags,
+            sg_list,
+            header.imm_data,
+            header.opcode,
+        )?;
+        Ok(match header.remote {
+            Some((raddr, rkey)) => SendWr::Rdma(SendWrRdma::new_from_base(base, raddr, rkey)),
+            None => SendWr::Send(base),
+        })
+    }
+
+    /// Returns the WRs of the batch, or the first error met while building them
+    fn finish(&mut self) -> Result<&[SendWr]> {
+        if self.current.is_some() {
+            self.fail(RdmaError::InvalidInput("WR posted without an SGE".into()));
+        }
+        match self.error.take() {
+            Some(err) => Err(err),
+            None => Ok(&self.wrs),
+        }
+    }
+
+    /// Returns the WRs of the batch of a DC QP along with their destinations
+    fn finish_dc(&mut self) -> Result<Vec<DcSendWr>> {
+        let _ignore = self.finish()?;
+        self.wrs
+            .iter()
+            .zip(&self.dests)
+            .map(|(&wr, dest)| {
+                let (ah, remote_qpn) = dest.ok_or(RdmaError::InvalidInput(
+                    "WR of a DC QP posted without an address".into(),
+                ))?;
+                Ok(DcSendWr { wr, ah, remote_qpn })
+            })
+            .collect()
+    }
+}
+
+/// Returns the extended QP of `qp`
+///
+/// # Safety
+///
+/// `qp` must be null or come from `BlueQpEx::alloc`
+#[allow(clippy::cast_ptr_alignment)]
+unsafe fn as_qp_ex(qp: *mut ibverbs_sys::ibv_qp_ex) -> Option<&'static mut BlueQpEx> {
+    unsafe { qp.cast::<BlueQpEx>().as_mut() }
+}
+
+/// Starts a WR carrying the `wr_id` and `wr_flags` currently set on the QP
+///
+/// # Safety
+///
+/// `qp` must be null or come from `BlueQpEx::alloc`
+unsafe fn begin(
+    qp: *mut ibverbs_sys::ibv_qp_ex,
+    opcode: WorkReqOpCode,
+    imm_data: u32,
+    remote: Option<(u64, u32)>,
+) {
+    if let Some(qp) = unsafe { as_qp_ex(qp) } {
+        qp.staging.begin(WrHeader {
+            wr_id: qp.qp.wr_id,
+            send_flags: qp.qp.wr_flags,
+            opcode,
+            imm_data,
+            remote,
+            dest: None,
+        });
+    }
+}
+
+/// Sets the local buffers of the current WR
+///
+/// # Safety
+///
+/// `qp` must be null or come from `BlueQpEx::alloc`
+unsafe fn set_data(qp: *mut ibverbs_sys::ibv_qp_ex, sg_list: Result<SgList>, inline: bool) {
+    if let Some(qp) = unsafe { as_qp_ex(qp) } {
+        qp.staging.set_data(sg_list, inline);
+    }
+}
+
+/// `ibv_wr_start`
+unsafe extern "C" fn wr_start(qp: *mut ibverbs_sys::ibv_qp_ex) {
+    if let Some(qp) = unsafe { as_qp_ex(qp) } {
+        qp.staging.clear();
+    }
+}
+
+/// `ibv_wr_complete`, posts all WRs built since `ibv_wr_start`.
+///
+/// Nothing is posted if a builder failed. Otherwise the WRs preceding the first WR that
+/// failed to post are submitted, as with `ibv_post_send`.
+unsafe extern "C" fn wr_complete(qp: *mut ibverbs_sys::ibv_qp_ex) -> core::ffi::c_int {
+    let Some(qp) = (unsafe { as_qp_ex(qp) }) else {
+        return libc::EINVAL;
+    };
+    let qpn = qp.qp.qp_base.qp_num;
+    let context = qp.qp.qp_base.context;
+    let result = if qp.qp.qp_base.qp_type == ibverbs_sys::ibv_qp_type::IBV_QPT_DRIVER {
+        qp.staging.finish_dc().and_then(|wrs| {
+            get_device(context)
+                .post_send_dc(qpn, &wrs)
+                .map_err(|(_, err)| err)
+        })
+    } else {
+        match qp.staging.finish() {
+            Ok(wrs) => post_send_batch(context, qpn, wrs).map_err(|(_, err)| err),
+            Err(err) => Err(err),
+        }
+    };
+    qp.staging.clear();
+    match result {
+        Ok(()) => 0,
+        Err(err) => {
+            error!("Failed to post send WRs of QP {qpn}: {err}");
+            err.to_errno()
+        }
+    }
+}
+
+/// `ibv_wr_abort`, discards the WRs built since `ibv_wr_start`
+unsafe extern "C" fn wr_abort(qp: *mut ibverbs_sys::ibv_qp_ex) {
+    if let Some(qp) = unsafe { as_qp_ex(qp) } {
+        qp.staging.clear();
+    }
+}
+
+/// `ibv_wr_rdma_write`
+unsafe extern "C" fn wr_rdma_write(qp: *mut ibverbs_sys::ibv_qp_ex, rkey: u32, remote_addr: u64) {
+    unsafe { begin(qp, WorkReqOpCode::RdmaWrite, 0, Some((remote_addr, rkey))) }
+}
+
+/// `ibv_wr_rdma_write_imm`
+unsafe extern "C" fn wr_rdma_write_imm(
+    qp: *mut ibverbs_sys::ibv_qp_ex,
+    rkey: u32,
+    remote_addr: u64,
+    imm_data: ibverbs_sys::__be32,
+) {
+    let remote = Some((remote_addr, rkey));
+    unsafe { begin(qp, WorkReqOpCode::RdmaWriteWithImm, imm_data, remote) }
+}
+
+/// `ibv_wr_rdma_read`
+unsafe extern "C" fn wr_rdma_read(qp: *mut ibverbs_sys::ibv_qp_ex, rkey: u32, remote_addr: u64) {
+    unsafe { begin(qp, WorkReqOpCode::RdmaRead, 0, Some((remote_addr, rkey))) }
+}
+
+/// `ibv_wr_send`
+unsafe extern "C" fn wr_send(qp: *mut ibverbs_sys::ibv_qp_ex) {
+    unsafe { begin(qp, WorkReqOpCode::Send, 0, None) }
+}
+
+/// `ibv_wr_send_imm`
+unsafe extern "C" fn wr_send_imm(qp: *mut ibverbs_sys::ibv_qp_ex, imm_data: ibverbs_sys::__be32) {
+    unsafe { begin(qp, WorkReqOpCode::SendWithImm, imm_data, None) }
+}
+
+/// `ibv_wr_set_ud_addr`, sets the destination of a WR of a DC QP, the Q_Key is unused as the
+/// peer is bound to a context of the DC QP
+unsafe extern "C" fn wr_set_ud_addr(
+    qp: *mut ibverbs_sys::ibv_qp_ex,
+    ah: *mut ibverbs_sys::ibv_ah,
+    remote_qpn: u32,
+    _remote_qkey: u32,
+) {
+    let Some(qp) = (unsafe { as_qp_ex(qp) }) else {
+        return;
+    };
+    match unsafe { ah.as_ref() } {
+        Some(ah) => qp.staging.set_dest(ah.handle, remote_qpn),
+        None => qp
+            .staging
+            .fail(RdmaError::InvalidInput("Null address handle".into())),
+    }
+}
+
+/// `ibv_wr_set_sge`
+unsafe extern "C" fn wr_set_sge(
+    qp: *mut ibverbs_sys::ibv_qp_ex,
+    lkey: u32,
+    addr: u64,
+    length: u32,
+) {
+    unsafe { set_data(qp, Ok(SgList::single(addr, length, lkey)), false) }
+}
+
+/// `ibv_wr_set_sge_list`
+unsafe extern "C" fn wr_set_sge_list(
+    qp: *mut ibverbs_sys::ibv_qp_ex,
+    num_sge: usize,
+    sg_list: *const ibverbs_sys::ibv_sge,
+) {
+    let sg_list = i32::try_from(num_sge)
+        .map_err(|e| RdmaError::InvalidInput(format!("Invalid SGE count: {e}")))
+        // SAFETY: the verbs API requires `sg_list` to hold `num_sge` elements
+        .and_then(|num_sge| unsafe { SgList::from_ibv(sg_list, num_sge) });
+    unsafe { set_data(qp, sg_list, false) }
+}
+
+/// `ibv_wr_set_inline_data`, the data is copied when the batch is posted
+#[allow(clippy::as_conversions)]
+unsafe extern "C" fn wr_set_inline_data(
+    qp: *mut ibverbs_sys::ibv_qp_ex,
+    addr: *mut c_void,
+    length: usize,
+) {
+    let sg_list = u32::try_from(length)
+        .map(|length| SgList::single(addr as u64, length, 0))
+        .map_err(|e| RdmaError::InvalidInput(format!("Invalid inline length: {e}")));
+    unsafe { set_data(qp, sg_list, true) }
+}
+
+/// `ibv_wr_set_inline_data_list`, the data is copied when the batch is posted
+#[allow(clippy::as_conversions)]
+unsafe extern "C" fn wr_set_inline_data_list(
+    qp: *mut ibverbs_sys::ibv_qp_ex,
+    num_buf: usize,
+    buf_list: *const ibverbs_sys::ibv_data_buf,
+) {
+    let sg_list = if num_buf == 0 || num_buf > MAX_SGE || buf_list.is_null() {
+        Err(RdmaError::InvalidInput(format!(
+            "Inline buffer count {num_buf} out of range, expected 1..={MAX_SGE}"
+        )))
+    } else {
+        // SAFETY: the verbs API requires `buf_list` to hold `num_buf` elements
+        let bufs = unsafe { std::slice::from_raw_parts(buf_list, num_buf) };
+        let mut sges = [Sge::default(); MAX_SGE];
+        bufs.iter()
+            .zip(sges.iter_mut())
+            .try_for_each(|(buf, sge)| {
+                let length = u32::try_from(buf.length)
+                    .map_err(|e| RdmaError::InvalidInput(format!("Invalid inline length: {e}")))?;
+                *sge = Sge::new(buf.addr as u64, length, 0);
+                Ok(())
+            })
+            .and_then(|()| {
+                sges.get(..num_buf)
+                    .and_then(SgList::from_slice)
+                    .ok_or(RdmaError::InvalidInput("Too many inline buffers".into()))
+            })
+    };
+    unsafe { set_data(qp, sg_list, true) }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn header(opcode: WorkReqOpCode, remote: Option<(u64, u32)>) -> WrHeader {
+        WrHeader {
+            wr_id: 7,
+            send_flags: 0,
+            opcode,
+            imm_data: 0,
+            remote,
+            dest: None,
+        }
+    }
+
+    #[test]
+    fn builders_stage_a_batch() {
+        let mut staging = WrStaging::default();
+        staging.begin(header(WorkReqOpCode::RdmaWrite, Some((0x2000, 3))));
+        staging.set_data(Ok(SgList::single(0x1000, 64, 1)), false);
+        staging.begin(header(WorkReqOpCode::Send, None));
+        staging.set_data(Ok(SgList::single(0x3000, 16, 0)), true);
+        let wrs = staging.finish().unwrap();
+        assert_eq!(wrs.len(), 2);
+        assert!(
+            matches!(wrs[0], SendWr::Rdma(wr) if wr.raddr() == 0x2000 && wr.rkey() == 3 && wr.length() == 64)
+        );
+        assert_ne!(
+            wrs[1].send_flags() & ibverbs_sys::ibv_send_flags::IBV_SEND_INLINE.0,
+            0
+        );
+        staging.clear();
+        assert!(staging.finish().unwrap().is_empty());
+    }
+
+    #[test]
+    fn builder_errors_fail_the_batch() {
+        let mut staging = WrStaging::default();
+        // WR without an SGE
+        staging.begin(header(WorkReqOpCode::Send, None));
+        staging.begin(header(WorkReqOpCode::Send, None));
+        staging.set_data(Ok(SgList::single(0x1000, 8, 1)), false);
+        assert!(staging.finish().is_err());
+
+        staging.clear();
+        let sges = [Sge::new(0x1000, 8, 1), Sge::new(0x2000, 8, 1)];
+        staging.begin(header(WorkReqOpCode::RdmaRead, Some((0x4000, 2))));
+        staging.set_data(Ok(SgList::from_slice(&sges).unwrap()), false);
+        assert!(staging.finish().is_err());
+
+        staging.clear();
+        staging.set_data(Ok(SgList::single(0x1000, 8, 1)), false);
+        assert!(staging.finish().is_err());
+    }
+
+    #[test]
+    fn dc_wrs_carry_their_destination() {
+        let mut staging = WrStaging::default();
+        staging.begin(header(WorkReqOpCode::RdmaWrite, Some((0x2000, 3))));
+        staging.set_dest(4, 17);
+        staging.set_data(Ok(SgList::single(0x1000, 64, 1)), false);
+        staging.begin(header(WorkReqOpCode::RdmaRead, Some((0x4000, 3))));
+        staging.set_data(Ok(SgList::single(0x3000, 64, 1)), false);
+        staging.set_dest(5, 18);
+        let wrs = staging.finish_dc().unwrap();
+        assert_eq!(
+            wrs.iter().map(|x| (x.ah, x.remote_qpn)).collect::<Vec<_>>(),
+            [(4, 17), (5, 18)]
+        );
+
+        staging.clear();
+        staging.begin(header(WorkReqOpCode::RdmaWrite, Some((0x2000, 3))));
+        staging.set_data(Ok(SgList::single(0x1000, 64, 1)), false);
+        assert!(staging.finish_dc().is_err());
+    }
+}
@@ -1,4 +1,8 @@
-use std::net::Ipv4Addr;
+use std::{
+    mem,
+    net::Ipv4Addr,
+    time::{Duration, Instant},
+};
 
 use bilge::prelude::*;
 use log::error;
@@ -6,16 +10,22 @@ use pnet::{
     packet::{
         ethernet::{EtherTypes, MutableEthernetPacket},
         ip::IpNextHeaderProtocols,
-        ipv4::{Ipv4Flags, MutableIpv4Packet},
+        ipv4::{self, Ipv4Flags, MutableIpv4Packet},
         udp::MutableUdpPacket,
     },
     util::MacAddr,
 };
 
 use crate::{
+    config::AckCoalesceConfig,
     constants::{CARD_MAC_ADDRESS, CARD_MAC_ADDRESS_OCTETS, PSN_MASK},
     net::simple_nic::FrameTx,
-    rdma_utils::{psn::Psn, qp::QpTableShared, types::QpAttr},
+    rdma_utils::{
+        psn::Psn,
+        qp::{QpTable, QpTableSeqLock},
+        types::QpAttr,
+    },
+    reload::TunablesWatch,
     workers::spawner::SingleThreadTaskWorker,
 };
 
@@ -31,61 +41,238 @@ pub(crate) enum AckResponse {
         base_psn: Psn,
         ack_req_packet_psn: Psn,
     },
+    /// ACK of the atomic request at `psn`, with the original value of its target
+    AtomicAck {
+        qpn: u32,
+        psn: Psn,
+        orig: u64,
+    },
 }
 
 impl AckResponse {
     fn qpn(&self) -> u32 {
         match *self {
-            AckResponse::Ack { qpn, .. } | AckResponse::Nak { qpn, .. } => qpn,
+            AckResponse::Ack { qpn, .. }
+            | AckResponse::Nak { qpn, .. }
+            | AckResponse::AtomicAck { qpn, .. } => qpn,
         }
     }
 }
 
 pub(crate) struct AckResponder {
-    qp_table: QpTableShared<QpAttr>,
+    qp_table: QpTableSeqLock<QpAttr>,
+    qps: QpTable<AckQp>,
+    /// QPs that had an ACK pending since the last flush
+    pending_qpns: Vec<u32>,
+    /// Maximum number of ACKs merged into one frame
+    max_acks: u32,
+    /// Maximum time the first merged ACK waits for its frame
+    max_delay: Duration,
+    /// Frames waiting to be queued to the simple NIC with one doorbell
+    staged: Vec<[u8; ACK_FRAME_LEN]>,
     raw_frame_tx: Box<dyn FrameTx + Send + 'static>,
+    /// Reloaded coalescing window, `None` if the config is never reloaded
+    tunables: Option<TunablesWatch>,
+}
+
+/// ACK state of a QP
+#[derive(Default)]
+struct AckQp {
+    /// ACK frame of the QP, built on the first ACK after the QP is connected
+    template: Option<AckFrameTemplate>,
+    /// Cumulative ACK of the ACKs not sent yet
+    pending: Option<PendingAck>,
+}
+
+/// ACKs of a QP merged into one
+struct PendingAck {
+    /// Highest PSN acknowledged by the merged ACKs
+    last_psn: Psn,
+    /// Number of merged ACKs
+    count: u32,
+    /// Time of the first merged ACK
+    since: Instant,
 }
 
 impl SingleThreadTaskWorker for AckResponder {
     type Task = AckResponse;
 
     fn process(&mut self, task: Self::Task) {
-        let qp_attr = self.qp_table.get_qp(task.qpn()).expect("invalid qpn");
-        let frame_builder = AckFrameBuilder::new(qp_attr.ip, qp_attr.dqp_ip, qp_attr.dqpn);
-        let frame = match task {
-            AckResponse::Ack { qpn, msn, last_psn } => {
-                frame_builder.build_ack(last_psn, u128::MAX, 0.into(), 0, false, false)
-            }
+        match task {
+            AckResponse::Ack { qpn, last_psn, .. } => self.coalesce(qpn, last_psn),
             AckResponse::Nak {
                 qpn,
                 base_psn,
                 ack_req_packet_psn,
-            } => frame_builder.build_ack(ack_req_packet_psn + 1, 0, base_psn, 0, true, true),
-        };
-        if let Err(e) = self.raw_frame_tx.send(&frame) {
-            error!("failed to send ack frame");
+            } => {
+                // The merged ACKs were generated before the NAK
+                self.flush(qpn);
+                self.stage_frame(qpn, |template| {
+                    template.patch(ack_req_packet_psn + 1, 0, base_psn, 0, true, true)
+                });
+                self.send_staged();
+            }
+            AckResponse::AtomicAck { qpn, psn, orig } => {
+                // The atomic ACK also acknowledges the PSNs of the merged ACKs
+                self.flush(qpn);
+                self.stage_frame(qpn, |template| template.patch_atomic(psn + 1, orig));
+            }
         }
     }
 
-    fn maintainance(&mut self) {}
+    /// Sends the pending ACKs, called once the responder runs out of work
+    fn maintainance(&mut self) {
+        let mut qpns = mem::take(&mut self.pending_qpns);
+        for qpn in qpns.drain(..) {
+            self.flush(qpn);
+        }
+        self.pending_qpns = qpns;
+        self.send_staged();
+        if let Some(tunables) = self.tunables.as_mut().and_then(TunablesWatch::changed) {
+            self.set_window(tunables.ack_coalesce);
+        }
+    }
 }
 
 impl AckResponder {
     pub(crate) fn new(
-        qp_table: QpTableShared<QpAttr>,
+        qp_table: QpTableSeqLock<QpAttr>,
         raw_frame_tx: Box<dyn FrameTx + Send + 'static>,
+        config: AckCoalesceConfig,
     ) -> Self {
         Self {
             qp_table,
+            qps: QpTable::new(),
+            pending_qpns: Vec::new(),
+            max_acks: config.max_acks,
+            max_delay: Duration::from_micros(config.max_delay_us),
+            staged: Vec::with_capacity(ACK_BATCH),
             raw_frame_tx,
+            tunables: None,
+        }
+    }
+
+    /// Applies the coalescing window reloaded into `tunables`
+    pub(crate) fn with_tunables(self, tunables: TunablesWatch) -> Self {
+        Self {
+            tunables: Some(tunables),
+            ..self
+        }
+    }
+
+    /// Replaces the coalescing window, called once the pending ACKs are flushed
+    fn set_window(&mut self, config: AckCoalesceConfig) {
+        self.max_acks = config.max_acks;
+        self.max_delay = Duration::from_micros(config.max_delay_us);
+    }
+
+    /// Merges an ACK into the pending ACK of the QP, and sends it once the window is full
+    fn coalesce(&mut self, qpn: u32, last_psn: Psn) {
+        if self.max_acks <= 1 {
+            self.stage_ack(qpn, last_psn);
+            return;
+        }
+        let qp = self.qps.get_qp_mut(qpn).expect("invalid qpn");
+        let full = match qp.pending.as_mut() {
+            Some(pending) => {
+                pending.last_psn = pending.last_psn.max(last_psn);
+                pending.count = pending.count.saturating_add(1);
+                pending.count >= self.max_acks || pending.since.elapsed() >= self.max_delay
+            }
+            None => {
+                qp.pending = Some(PendingAck {
+                    last_psn,
+                    count: 1,
+                    since: Instant::now(),
+                });
+                self.pending_qpns.push(qpn);
+                false
+            }
+        };
+        if full {
+            self.flush(qpn);
+        }
+    }
+
+    /// Sends the pending ACK of the QP, if any
+    fn flush(&mut self, qpn: u32) {
+        let pending = self.qps.get_qp_mut(qpn).and_then(|qp| qp.pending.take());
+        if let Some(pending) = pending {
+            self.stage_ack(qpn, pending.last_psn);
         }
     }
+
+    /// Stages a cumulative ACK of every PSN up to `last_psn`
+    fn stage_ack(&mut self, qpn: u32, last_psn: Psn) {
+        self.stage_frame(qpn, |template| {
+            template.patch(last_psn, u128::MAX, 0.into(), 0, false, false)
+        });
+    }
+
+    /// Patches the ACK frame of the QP with `patch` and stages it, the staged frames are sent
+    /// once `ACK_BATCH` of them are staged
+    fn stage_frame<F>(&mut self, qpn: u32, patch: F)
+    where
+        F: FnOnce(&mut AckFrameTemplate) -> &[u8; ACK_FRAME_LEN],
+    {
+        let (src_ip, dst_ip, dqpn, dst_mac) = self
+            .qp_table
+            .map_qp(qpn, |attr| (attr.ip, attr.dqp_ip, attr.dqpn, attr.mac_addr))
+            .expect("invalid qpn");
+        let slot = &mut self.qps.get_qp_mut(qpn).expect("invalid qpn").template;
+        let template = match slot.take() {
+            Some(template) if template.is_for(src_ip, dst_ip, dqpn, dst_mac) => template,
+            _ => AckFrameTemplate::new(src_ip, dst_ip, dqpn, dst_mac),
+        };
+        self.staged.push(*patch(slot.insert(template)));
+        if self.staged.len() >= ACK_BATCH {
+            self.send_staged();
+        }
+    }
+
+    /// Queues the staged frames to the simple NIC, ringing its doorbell once
+    fn send_staged(&mut self) {
+        for chunk in self.staged.chunks(ACK_BATCH) {
+            let mut frames: [&[u8]; ACK_BATCH] = [&[]; ACK_BATCH];
+            for (frame, staged) in frames.iter_mut().zip(chunk) {
+                *frame = staged;
+            }
+            if let Err(err) = self
+                .raw_frame_tx
+                .send_batch(frames.get(..chunk.len()).unwrap_or_default())
+            {
+                error!("failed to send ack frames: {err}");
+            }
+        }
+        self.staged.clear();
+    }
 }
 
-struct AckFrameBuilder {
+const ETH_HEADER_LEN: usize = 14;
+const IP_HEADER_LEN: usize = 20;
+const UDP_HEADER_LEN: usize = 8;
+/// Offset of the BTH in an ACK frame
+const BTH_OFFSET: usize = ETH_HEADER_LEN + IP_HEADER_LEN + UDP_HEADER_LEN;
+/// Length of the BTH, the two bitmaps and the AETH of an ACK
+const ACK_PAYLOAD_LEN: usize = 48;
+pub(crate) const ACK_FRAME_LEN: usize = BTH_OFFSET + ACK_PAYLOAD_LEN;
+/// Maximum number of ACK frames queued to the simple NIC with one doorbell
+const ACK_BATCH: usize = 32;
+const TRANS_TYPE_RC: u8 = 0x00;
+const OPCODE_ACKNOWLEDGE: u8 = 0x11;
+const OPCODE_ATOMIC_ACKNOWLEDGE: u8 = 0x12;
+
+/// Ethernet frame of the ACKs of a QP.
+///
+/// Only the PSN of the BTH, the bitmaps and the AETH differ between two ACKs of a QP, the
+/// headers and their checksum are computed once and the ACK fields are patched in place.
+struct AckFrameTemplate {
     src_ip: u32,
     dst_ip: u32,
     dqpn: u32,
+    /// MAC address of the next hop to `dst_ip`
+    dst_mac: u64,
+    frame: [u8; ACK_FRAME_LEN],
 }
 
 #[allow(
@@ -95,36 +282,59 @@ struct AckFrameBuilder {
     clippy::cast_possible_truncation,
     clippy::big_endian_bytes
 )]
-impl AckFrameBuilder {
-    fn new(src_ip: u32, dst_ip: u32, dqpn: u32) -> Self {
+impl AckFrameTemplate {
+    fn new(src_ip: u32, dst_ip: u32, dqpn: u32, dst_mac: u64) -> Self {
+        let src_mac = MacAddr::from(CARD_MAC_ADDRESS_OCTETS);
+        let [_, _, a, b, c, d, e, f] = dst_mac.to_be_bytes();
+        let mut payload = [0u8; ACK_PAYLOAD_LEN];
+
+        let mut bth = Bth::default();
+        bth.set_opcode(u5::from_u8(OPCODE_ACKNOWLEDGE));
+        bth.set_dqpn(u24::from_u32(dqpn));
+        bth.set_trans_type(u3::from_u8(TRANS_TYPE_RC));
+        payload[..12].copy_from_slice(&bth.value.to_be_bytes());
+
+        let mut frame = [0u8; ACK_FRAME_LEN];
+        Self::build_ethernet_frame(
+            &mut frame,
+            src_ip,
+            dst_ip,
+            src_mac,
+            MacAddr::new(a, b, c, d, e, f),
+            &payload,
+        );
         Self {
             src_ip,
             dst_ip,
             dqpn,
+            dst_mac,
+            frame,
         }
     }
 
-    fn build_ack(
-        &self,
+    /// Returns whether the template was built for the given addresses
+    fn is_for(&self, src_ip: u32, dst_ip: u32, dqpn: u32, dst_mac: u64) -> bool {
+        self.src_ip == src_ip
+            && self.dst_ip == dst_ip
+            && self.dqpn == dqpn
+            && self.dst_mac == dst_mac
+    }
+
+    /// Writes the ACK fields into the frame and returns it
+    fn patch(
+        &mut self,
         now_psn: Psn,
         now_bitmap: u128,
         pre_psn: Psn,
         prev_bitmap: u128,
         is_packet_loss: bool,
         is_window_slided: bool,
-    ) -> Vec<u8> {
-        const TRANS_TYPE_RC: u8 = 0x00;
-        const OPCODE_ACKNOWLEDGE: u8 = 0x11;
-        const PAYLOAD_SIZE: usize = 48;
-        let mac = MacAddr::from(CARD_MAC_ADDRESS_OCTETS);
-        let mut payload = [0u8; PAYLOAD_SIZE];
-
-        let mut bth = Bth::default();
-        bth.set_opcode(u5::from_u8(OPCODE_ACKNOWLEDGE));
-        bth.set_psn(u24::from_u32(now_psn.into_inner()));
-        bth.set_dqpn(u24::from_u32(self.dqpn));
-        bth.set_trans_type(u3::from_u8(TRANS_TYPE_RC));
-        payload[..12].copy_from_slice(&bth.value.to_be_bytes());
+    ) -> &[u8; ACK_FRAME_LEN] {
+        let payload = &mut self.frame[BTH_OFFSET..];
+        // The transport type and the opcode are the first byte of the big endian BTH
+        payload[0] = TRANS_TYPE_RC << 5 | OPCODE_ACKNOWLEDGE;
+        // The PSN is the last 24 bits of the big endian BTH
+        payload[9..12].copy_from_slice(&now_psn.into_inner().to_be_bytes()[1..]);
 
         let mut aeth_seg0 = AethSeg0::default();
         aeth_seg0.set_is_send_by_driver(true);
@@ -135,26 +345,28 @@ impl AckFrameBuilder {
         payload[28..44].copy_from_slice(&now_bitmap.to_be_bytes());
         payload[44..].copy_from_slice(&aeth_seg0.value.to_be_bytes());
 
-        Self::build_ethernet_frame(self.src_ip, self.dst_ip, mac, mac, &payload)
+        &self.frame
+    }
+
+    /// Writes the atomic ACK of the request before `now_psn` into the frame and returns it,
+    /// the original value takes the low half of the previous bitmap
+    fn patch_atomic(&mut self, now_psn: Psn, orig: u64) -> &[u8; ACK_FRAME_LEN] {
+        let _ignore = self.patch(now_psn, u128::MAX, 0.into(), u128::from(orig), false, false);
+        self.frame[BTH_OFFSET] = TRANS_TYPE_RC << 5 | OPCODE_ATOMIC_ACKNOWLEDGE;
+        &self.frame
     }
 
     fn build_ethernet_frame(
+        buffer: &mut [u8],
         src_ip: u32,
         dst_ip: u32,
         src_mac: MacAddr,
         dst_mac: MacAddr,
         payload: &[u8],
-    ) -> Vec<u8> {
+    ) {
         const UDP_PORT: u16 = 4791;
-        const ETH_HEADER_LEN: usize = 14;
-        const IP_HEADER_LEN: usize = 20;
-        const UDP_HEADER_LEN: usize = 8;
-
-        let total_len = ETH_HEADER_LEN + IP_HEADER_LEN + UDP_HEADER_LEN + payload.len();
 
-        let mut buffer = vec![0u8; total_len];
-
-        let mut eth_packet = MutableEthernetPacket::new(&mut buffer)
+        let mut eth_packet = MutableEthernetPacket::new(buffer)
             .unwrap_or_else(|| unreachable!("Failed to create ethernet packet"));
         eth_packet.set_source(src_mac);
         eth_packet.set_destination(dst_mac);
@@ -174,17 +386,16 @@ impl AckFrameBuilder {
         ipv4_packet.set_next_level_protocol(IpNextHeaderProtocols::Udp);
         ipv4_packet.set_source(Ipv4Addr::from_bits(src_ip));
         ipv4_packet.set_destination(Ipv4Addr::from_bits(dst_ip));
-        ipv4_packet.set_checksum(ipv4_packet.get_checksum());
+        // None of the IPv4 header changes between ACKs, so the checksum holds for all of them
+        ipv4_packet.set_checksum(ipv4::checksum(&ipv4_packet.to_immutable()));
 
-        let mut udp_packet = MutableUdpPacket::new(&mut buffer[ETH_HEADER_LEN + IP_HEADER_LEN..])
+        // The UDP checksum is left zero, which disables it
+        let mut udp_packet = MutableUdpPacket::new(&mut buffer[BTH_OFFSET - UDP_HEADER_LEN..])
             .unwrap_or_else(|| unreachable!("Failed to create UDP packet"));
         udp_packet.set_source(UDP_PORT);
         udp_packet.set_destination(UDP_PORT);
         udp_packet.set_length((UDP_HEADER_LEN + payload.len()) as u16);
         udp_packet.set_payload(payload);
-        udp_packet.set_checksum(udp_packet.get_checksum());
-
-        buffer
     }
 }
 
@@ -229,24 +440,27 @@ mod test {
             Ok(())
         }
     }
-    const TRANS_TYPE_RC: u8 = 0x00;
-    const OPCODE_ACKNOWLEDGE: u8 = 0x11;
 
     #[test]
     fn test_ack_response() {
         let (tx, rx) = flume::unbounded();
         let frame_tx = Tx(tx);
-        let qp_table = QpTableShared::default();
+        let qp_table = QpTableSeqLock::default();
         let qpn = 11;
         qp_table
             .map_qp_mut(qpn, |attr: &mut QpAttr| attr.dqpn = 13)
             .unwrap();
-        let mut responder = AckResponder::new(qp_table.clone(), Box::new(frame_tx));
+        let mut responder = AckResponder::new(
+            qp_table.clone(),
+            Box::new(frame_tx),
+            AckCoalesceConfig::default(),
+        );
         responder.process(AckResponse::Ack {
             qpn: 11,
             msn: 20,
             last_psn: Psn(101),
         });
+        responder.maintainance();
         let frame = rx.recv().unwrap();
         assert_eq!(frame.len(), 90);
         let mut bth = Bth::default();
@@ -261,12 +475,16 @@ mod test {
     fn test_nak_response() {
         let (tx, rx) = flume::unbounded();
         let frame_tx = Tx(tx);
-        let qp_table = QpTableShared::default();
+        let qp_table = QpTableSeqLock::default();
         let qpn = 11;
         qp_table
             .map_qp_mut(qpn, |attr: &mut QpAttr| attr.dqpn = 13)
             .unwrap();
-        let mut responder = AckResponder::new(qp_table.clone(), Box::new(frame_tx));
+        let mut responder = AckResponder::new(
+            qp_table.clone(),
+            Box::new(frame_tx),
+            AckCoalesceConfig::default(),
+        );
         responder.process(AckResponse::Nak {
             qpn: 11,
             base_psn: Psn(71),
@@ -288,4 +506,151 @@ mod test {
         aeth_seg0.set_pre_psn(u24::from_u32(71));
         assert_eq!(aeth_seg0.value.to_be_bytes(), frame[86..90]);
     }
+
+    #[test]
+    fn test_ack_template_is_patched_and_rebuilt() {
+        let (tx, rx) = flume::unbounded();
+        let qp_table = QpTableSeqLock::default();
+        let qpn = 11;
+        qp_table
+            .map_qp_mut(qpn, |attr: &mut QpAttr| attr.dqpn = 13)
+            .unwrap();
+        let mut responder = AckResponder::new(
+            qp_table.clone(),
+            Box::new(Tx(tx)),
+            AckCoalesceConfig::default(),
+        );
+        responder.process(AckResponse::Nak {
+            qpn,
+            base_psn: Psn(71),
+            ack_req_packet_psn: Psn(101),
+        });
+        responder.process(AckResponse::Ack {
+            qpn,
+            msn: 20,
+            last_psn: Psn(0x12_3456),
+        });
+        responder.maintainance();
+        let _nak = rx.recv().unwrap();
+        let frame = rx.recv().unwrap();
+        let ip = pnet::packet::ipv4::Ipv4Packet::new(frame.get(14..).unwrap()).unwrap();
+        assert_ne!(ip.get_checksum(), 0);
+        assert_eq!(ip.get_checksum(), ipv4::checksum(&ip));
+        assert_eq!(frame.get(51..54).unwrap(), [0x12, 0x34, 0x56]);
+        // The NAK flags and bitmaps are not left over in the ACK
+        let mut aeth_seg0 = AethSeg0::default();
+        aeth_seg0.set_is_send_by_driver(true);
+        assert_eq!(frame.get(86..90).unwrap(), aeth_seg0.value.to_be_bytes());
+        assert_eq!(frame.get(70..86).unwrap(), u128::MAX.to_be_bytes());
+
+        qp_table
+            .map_qp_mut(qpn, |attr: &mut QpAttr| {
+                attr.dqpn = 17;
+                attr.mac_addr = 0x0102_0304_0506;
+            })
+            .unwrap();
+        responder.process(AckResponse::Ack {
+            qpn,
+            msn: 21,
+            last_psn: Psn(5),
+        });
+        responder.maintainance();
+        let frame = rx.recv().unwrap();
+        let mut bth = Bth::default();
+        bth.set_opcode(u5::from_u8(OPCODE_ACKNOWLEDGE));
+        bth.set_psn(u24::from_u32(5));
+        bth.set_dqpn(u24::from_u32(17));
+        bth.set_trans_type(u3::from_u8(TRANS_TYPE_RC));
+        assert_eq!(frame.get(42..54).unwrap(), bth.value.to_be_bytes());
+        assert_eq!(frame.get(..6).unwrap(), [1, 2, 3, 4, 5, 6]);
+    }
+
+    #[test]
+    fn test_atomic_ack_response() {
+        let (tx, rx) = flume::unbounded();
+        let qp_table = QpTableSeqLock::default();
+        qp_table
+            .map_qp_mut(11, |attr: &mut QpAttr| attr.dqpn = 13)
+            .unwrap();
+        let mut responder = AckResponder::new(
+            qp_table.clone(),
+            Box::new(Tx(tx)),
+            AckCoalesceConfig::default(),
+        );
+        responder.process(AckResponse::AtomicAck {
+            qpn: 11,
+            psn: Psn(100),
+            orig: 0x0102_0304_0506_0708,
+        });
+        responder.process(AckResponse::Ack {
+            qpn: 11,
+            msn: 0,
+            last_psn: Psn(102),
+        });
+        responder.maintainance();
+        let frame = rx.recv().unwrap();
+        let mut bth = Bth::default();
+        bth.set_opcode(u5::from_u8(OPCODE_ATOMIC_ACKNOWLEDGE));
+        bth.set_psn(u24::from_u32(101));
+        bth.set_dqpn(u24::from_u32(13));
+        bth.set_trans_type(u3::from_u8(TRANS_TYPE_RC));
+        assert_eq!(frame.get(42..54).unwrap(), bth.value.to_be_bytes());
+        assert_eq!(
+            frame.get(54..70).unwrap(),
+            0x0102_0304_0506_0708u128.to_be_bytes()
+        );
+
+        // The next ACK of the QP is a plain ACK again
+        let frame = rx.recv().unwrap();
+        assert_eq!(frame.get(42).unwrap() & 0x1f, OPCODE_ACKNOWLEDGE);
+        assert_eq!(frame.get(54..70).unwrap(), [0; 16]);
+    }
+
+    #[test]
+    fn test_ack_coalescing() {
+        let (tx, rx) = flume::unbounded();
+        let qp_table = QpTableSeqLock::default();
+        qp_table
+            .map_qp_mut(11, |attr: &mut QpAttr| attr.dqpn = 13)
+            .unwrap();
+        let config = AckCoalesceConfig {
+            max_acks: 3,
+            max_delay_us: 1_000_000,
+        };
+        let mut responder = AckResponder::new(qp_table.clone(), Box::new(Tx(tx)), config);
+        let psn_of = |frame: Vec<u8>| frame.get(51..54).unwrap().to_vec();
+        let ack = |last_psn| AckResponse::Ack {
+            qpn: 11,
+            msn: 0,
+            last_psn: Psn(last_psn),
+        };
+
+        // A full window is closed with the highest PSN, the frames are sent once the
+        // responder runs out of work
+        responder.process(ack(10));
+        responder.process(ack(12));
+        responder.process(ack(11));
+        responder.process(ack(13));
+        assert!(rx.try_recv().is_err());
+        responder.maintainance();
+        assert_eq!(psn_of(rx.try_recv().unwrap()), [0, 0, 12]);
+        assert_eq!(psn_of(rx.try_recv().unwrap()), [0, 0, 13]);
+
+        // A NAK flushes the pending ACK before it
+        responder.process(ack(20));
+        responder.process(AckResponse::Nak {
+            qpn: 11,
+            base_psn: Psn(15),
+            ack_req_packet_psn: Psn(30),
+        });
+        assert_eq!(psn_of(rx.try_recv().unwrap()), [0, 0, 20]);
+        assert_eq!(psn_of(rx.try_recv().unwrap()), [0, 0, 31]);
+
+        // Running out of work flushes a partial window
+        responder.process(ack(40));
+        responder.maintainance();
+        assert_eq!(psn_of(rx.try_recv().unwrap()), [0, 0, 40]);
+        responder.maintainance();
+        assert!(rx.try_recv().is_err());
+    }
 }
@@ -0,0 +1,484 @@
+use std::{
+    collections::HashMap,
+    io,
+    os::fd::{OwnedFd, RawFd},
+    sync::{
+        atomic::{self, AtomicU8, Ordering},
+        mpsc, Arc, OnceLock,
+    },
+    task::Waker,
+    thread,
+    time::{Duration, Instant},
+};
+
+use log::{debug, error};
+use parking_lot::Mutex;
+
+/// The CQ is not armed
+const NOTIFY_NONE: u8 = 0;
+/// The next solicited completion generates a CQ event
+const NOTIFY_SOLICITED: u8 = 1;
+/// The next completion generates a CQ event
+const NOTIFY_NEXT: u8 = 2;
+
+/// Granularity of the moderation periods enforced by the `CqModerator`
+const MODERATION_TICK: Duration = Duration::from_micros(20);
+
+/// Notification state of a CQ, shared by the `CompletionWorker` and the verbs context.
+///
+/// Arming is one-shot as in `ibv_req_notify_cq`, the first matching completion pushed after
+/// the CQ is armed writes a single CQ event to the completion channel and disarms the CQ.
+/// A CQ moderated by `ibv_modify_cq` holds the event back until `cq_count` completions were
+/// pushed or `cq_period` elapsed since the first of them, solicited completions are never held.
+#[derive(Debug, Default)]
+pub(crate) struct CqNotify {
+    /// One of `NOTIFY_NONE`, `NOTIFY_SOLICITED` or `NOTIFY_NEXT`
+    armed: AtomicU8,
+    /// Completion channel the CQ was created with
+    channel: OnceLock<CqEventTx>,
+    /// Event moderation of the CQ
+    moderation: Mutex<Moderation>,
+    /// Task of the native API waiting on the CQ, woken by the next completion
+    waker: Mutex<Option<Waker>>,
+}
+
+/// Completions held back from generating a CQ event
+#[derive(Debug, Default)]
+struct Moderation {
+    /// Number of completions generating an event, 0 leaves only the period
+    count: u16,
+    /// Time after the first held completion at which the event is generated, zero leaves only
+    /// the count
+    period: Duration,
+    /// Number of completions held since the last event
+    held: u16,
+    /// Time the first of them was pushed
+    held_since: Option<Instant>,
+}
+
+impl Moderation {
+    /// Returns `true` if the event of a completion pushed at `now` is held back
+    fn hold(&mut self, now: Instant) -> bool {
+        if self.count <= 1 && self.period.is_zero() {
+            return false;
+        }
+        self.held = self.held.saturating_add(1);
+        let since = *self.held_since.get_or_insert(now);
+        let due = (self.count != 0 && self.held >= self.count)
+            || (!self.period.is_zero() && now.duration_since(since) >= self.period);
+        if due {
+            self.release();
+        }
+        !due
+    }
+
+    /// Returns `true` if the period of the held completions has elapsed at `now`
+    fn expire(&mut self, now: Instant) -> bool {
+        let expired = self.held_since.is_some_and(|since| {
+            !self.period.is_zero() && now.duration_since(since) >= self.period
+        });
+        if expired {
+            self.release();
+        }
+        expired
+    }
+
+    fn release(&mut self) {
+        self.held = 0;
+        self.held_since = None;
+    }
+}
+
+impl CqNotify {
+    /// Binds the CQ to a completion channel, returns `false` if it is already bound
+    pub(crate) fn bind(&self, tx: CqEventTx) -> bool {
+        self.channel.set(tx).is_ok()
+    }
+
+    /// Arms the CQ for its next completion, or its next solicited completion
+    pub(crate) fn arm(&self, solicited_only: bool) {
+        let mode = if solicited_only {
+            NOTIFY_SOLICITED
+        } else {
+            NOTIFY_NEXT
+        };
+        // A pending request for any completion is not narrowed by a solicited only request
+        let _prev = self.armed.fetch_max(mode, Ordering::SeqCst);
+        // Orders the arming before the consumer's next poll of the CQ, pairs with the fence in
+        // `completed`
+        atomic::fence(Ordering::SeqCst);
+    }
+
+    /// Sets the event moderation of the CQ, a `count` of 0 or 1 and a zero `period` disable it
+    pub(crate) fn moderate(&self, count: u16, period: Duration) {
+        let mut moderation = self.moderation.lock();
+        moderation.count = count;
+        moderation.period = period;
+        moderation.release();
+    }
+
+    /// Returns `true` if the CQ has a moderation period the `CqModerator` has to enforce
+    pub(crate) fn has_period(&self) -> bool {
+        !self.moderation.lock().period.is_zero()
+    }
+
+    /// Wakes `waker` on the next completion pushed to the CQ, replacing the waker registered
+    /// before. The consumer polls the CQ again after registering it, as a completion pushed
+    /// before the registration wakes nothing
+    pub(crate) fn register_waker(&self, waker: &Waker) {
+        let mut slot = self.waker.lock();
+        if !slot.as_ref().is_some_and(|x| x.will_wake(waker)) {
+            *slot = Some(waker.clone());
+        }
+    }
+
+    /// Generates a CQ event if the CQ is armed for a completion just pushed to it
+    pub(crate) fn completed(&self, solicited: bool) {
+        if let Some(waker) = self.waker.lock().take() {
+            waker.wake();
+        }
+        let Some(channel) = self.channel.get() else {
+            return;
+        };
+        atomic::fence(Ordering::SeqCst);
+        let threshold = if solicited {
+            NOTIFY_SOLICITED
+        } else {
+            NOTIFY_NEXT
+        };
+        let armed = self.armed.load(Ordering::SeqCst);
+        if armed == NOTIFY_NONE || armed < threshold {
+            return;
+        }
+        let mut moderation = self.moderation.lock();
+        let held = !solicited && moderation.hold(Instant::now());
+        if held {
+            return;
+        }
+        // A solicited completion also releases the completions held before it
+        moderation.release();
+        self.fire(channel, threshold);
+    }
+
+    /// Generates the CQ event of the held completions whose moderation period has elapsed
+    pub(crate) fn expire(&self, now: Instant) {
+        let Some(channel) = self.channel.get() else {
+            return;
+        };
+        let mut moderation = self.moderation.lock();
+        if moderation.expire(now) {
+            self.fire(channel, NOTIFY_NEXT);
+        }
+    }
+
+    /// Disarms the CQ and writes its event if it is still armed for `threshold`
+    fn fire(&self, channel: &CqEventTx, threshold: u8) {
+        let fired = self
+            .armed
+            .fetch_update(Ordering::SeqCst, Ordering::SeqCst, |x| {
+                (x != NOTIFY_NONE && x >= threshold).then_some(NOTIFY_NONE)
+            })
+            .is_ok();
+        if fired {
+            if let Err(err) = channel.send() {
+                error!("failed to write cq event: {err}");
+            }
+        }
+    }
+}
+
+/// Updates of the CQs watched by the `CqModerator`
+enum CqModerationTask {
+    Watch { handle: u32, notify: Arc<CqNotify> },
+    Unwatch { handle: u32 },
+}
+
+/// Enforces the moderation periods of the CQs on a background thread.
+///
+/// The `CompletionWorker` blocks while no task is queued, so the event of completions held
+/// last is generated by the thread once their period elapses. Spawned on the first CQ
+/// moderated with a period, the thread exits once the `CqModerator` is dropped.
+pub(crate) struct CqModerator {
+    tx: mpsc::Sender<CqModerationTask>,
+}
+
+impl CqModerator {
+    /// Spawns the background thread
+    pub(crate) fn spawn() -> io::Result<Self> {
+        let (tx, rx) = mpsc::channel();
+        let _handle = thread::Builder::new()
+            .name("cq-moderation".into())
+            .spawn(move || {
+                let mut cqs: HashMap<u32, Arc<CqNotify>> = HashMap::new();
+                loop {
+                    let task = if cqs.is_empty() {
+                        rx.recv().map_err(|_| mpsc::RecvTimeoutError::Disconnected)
+                    } else {
+                        rx.recv_timeout(MODERATION_TICK)
+                    };
+                    match task {
+                        Ok(CqModerationTask::Watch { handle, notify }) => {
+                            let _ignore = cqs.insert(handle, notify);
+                        }
+                        Ok(CqModerationTask::Unwatch { handle }) => {
+                            let _ignore = cqs.remove(&handle);
+                        }
+                        Err(mpsc::RecvTimeoutError::Timeout) => {}
+                        Err(mpsc::RecvTimeoutError::Disconnected) => break,
+                    }
+                    let now = Instant::now();
+                    for notify in cqs.values() {
+                        notify.expire(now);
+                    }
+                }
+                debug!("cq moderation thread exited");
+            })?;
+
+        Ok(Self { tx })
+    }
+
+    /// Enforces the moderation period of the CQ `handle`
+    pub(crate) fn watch(&self, handle: u32, notify: Arc<CqNotify>) {
+        let _ignore = self.tx.send(CqModerationTask::Watch { handle, notify });
+    }
+
+    /// Stops enforcing the moderation period of the CQ `handle`
+    pub(crate) fn unwatch(&self, handle: u32) {
+        let _ignore = self.tx.send(CqModerationTask::Unwatch { handle });
+    }
+}
+
+/// Writes the CQ events of a CQ to its completion channel
+#[derive(Debug)]
+pub(crate) struct CqEventTx {
+    /// Write end of the pipe read by `ibv_get_cq_event`
+    fd: Arc<OwnedFd>,
+    /// The `ibv_cq` pointer reported to `ibv_get_cq_event`
+    cq_cookie: u64,
+}
+
+impl CqEventTx {
+    /// Writes a `ib_uverbs_comp_event_desc` carrying the CQ cookie
+    fn send(&self) -> io::Result<()> {
+        sys::write_u64(&self.fd, self.cq_cookie)
+    }
+}
+
+/// Completion channels created by the verbs consumer.
+///
+/// `ibv_get_cq_event` reads a `ib_uverbs_comp_event_desc`, a single `u64` holding the
+/// `ibv_cq` pointer, from the fd of the channel. The fd returned by the kernel is replaced, when
+/// the first CQ is bound to it, by the read end of a pipe whose write end is owned by the
+/// driver. Consumers keep using `ibv_get_cq_event`, `poll` or `epoll` on `channel->fd`.
+#[derive(Debug, Default)]
+pub(crate) struct CompChannels {
+    /// Write end of each channel keyed by the channel fd
+    inner: HashMap<RawFd, CompChannel>,
+}
+
+/// A completion channel whose fd is served by the driver
+#[derive(Debug)]
+struct CompChannel {
+    /// Write end of the pipe
+    tx: Arc<OwnedFd>,
+    /// Device and inode of the read end, detects a channel fd that was closed and reused
+    id: (u64, u64),
+}
+
+impl CompChannels {
+    /// Creates an empty `CompChannels`
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    /// Returns the sender of the CQ events of `cq_cookie` to the channel `channel_fd`
+    pub(crate) fn sender(&mut self, channel_fd: RawFd, cq_cookie: u64) -> io::Result<CqEventTx> {
+        let id = sys::file_id(channel_fd)?;
+        if let Some(channel) = self.inner.get(&channel_fd).filter(|x| x.id == id) {
+            return Ok(CqEventTx {
+                fd: Arc::clone(&channel.tx),
+                cq_cookie,
+            });
+        }
+        let (rx, tx) = sys::pipe()?;
+        // Events are dropped rather than blocking the `CompletionWorker` if the consumer
+        // stops reading
+        sys::set_nonblocking(&tx)?;
+        sys::dup_onto(&rx, channel_fd)?;
+        let channel = CompChannel {
+            tx: Arc::new(tx),
+            id: sys::file_id(channel_fd)?,
+        };
+        let fd = Arc::clone(&channel.tx);
+        let _ignore = self.inner.insert(channel_fd, channel);
+
+        Ok(CqEventTx { fd, cq_cookie })
+    }
+}
+
+#[allow(unsafe_code)]
+mod sys {
+    use std::{
+        io,
+        os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd},
+    };
+
+    /// Creates a pipe, returns the read and the write end
+    pub(super) fn pipe() -> io::Result<(OwnedFd, OwnedFd)> {
+        let mut fds = [0; 2];
+        if unsafe { libc::pipe2(fds.as_mut_ptr(), libc::O_CLOEXEC) } < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let [rx, tx] = fds;
+        Ok(unsafe { (OwnedFd::from_raw_fd(rx), OwnedFd::from_raw_fd(tx)) })
+    }
+
+    /// Sets `O_NONBLOCK` on the file of `fd`
+    pub(super) fn set_nonblocking(fd: &OwnedFd) -> io::Result<()> {
+        let flags = unsafe { libc::fcntl(fd.as_raw_fd(), libc::F_GETFL) };
+        if flags < 0
+            || unsafe { libc::fcntl(fd.as_raw_fd(), libc::F_SETFL, flags | libc::O_NONBLOCK) } < 0
+        {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(())
+    }
+
+    /// Makes `target` refer to the same file as `fd`, the file `target` referred to is closed
+    pub(super) fn dup_onto(fd: &OwnedFd, target: RawFd) -> io::Result<()> {
+        if unsafe { libc::dup3(fd.as_raw_fd(), target, libc::O_CLOEXEC) } < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(())
+    }
+
+    /// Returns the device and inode numbers of the file `fd` refers to
+    pub(super) fn file_id(fd: RawFd) -> io::Result<(u64, u64)> {
+        let mut stat = unsafe { std::mem::zeroed::<libc::stat>() };
+        if unsafe { libc::fstat(fd, &mut stat) } < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok((stat.st_dev, stat.st_ino))
+    }
+
+    /// Writes `value` in native byte order
+    pub(super) fn write_u64(fd: &OwnedFd, value: u64) -> io::Result<()> {
+        let bytes = value.to_ne_bytes();
+        if unsafe { libc::write(fd.as_raw_fd(), bytes.as_ptr().cast(), bytes.len()) } < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{fs::File, io::Read, os::fd::AsRawFd};
+
+    use super::*;
+
+    /// Returns a channel fd standing in for the one created by the kernel, and its cq event sender
+    fn channel(channels: &mut CompChannels, cq_cookie: u64) -> (OwnedFd, CqEventTx) {
+        let (placeholder, _tx) = sys::pipe().unwrap();
+        let tx = channels.sender(placeholder.as_raw_fd(), cq_cookie).unwrap();
+        (placeholder, tx)
+    }
+
+    /// Reads a CQ event without blocking
+    fn read_event(fd: OwnedFd) -> Option<u64> {
+        sys::set_nonblocking(&fd).unwrap();
+        let mut file = File::from(fd);
+        let mut buf = [0u8; 8];
+        file.read_exact(&mut buf)
+            .ok()
+            .map(|()| u64::from_ne_bytes(buf))
+    }
+
+    #[test]
+    fn armed_cq_generates_one_event() {
+        let mut channels = CompChannels::new();
+        let (rx, tx) = channel(&mut channels, 0xcafe);
+        let notify = CqNotify::default();
+        assert!(notify.bind(tx));
+        // not armed
+        notify.completed(true);
+        notify.arm(false);
+        notify.completed(false);
+        notify.completed(false);
+        assert_eq!(read_event(rx.try_clone().unwrap()), Some(0xcafe));
+        assert_eq!(read_event(rx), None);
+    }
+
+    #[test]
+    fn solicited_only_skips_unsolicited_completions() {
+        let mut channels = CompChannels::new();
+        let (rx, tx) = channel(&mut channels, 7);
+        let notify = CqNotify::default();
+        assert!(notify.bind(tx));
+        notify.arm(true);
+        notify.completed(false);
+        assert_eq!(read_event(rx.try_clone().unwrap()), None);
+        // a request for any completion is not narrowed
+        notify.arm(false);
+        notify.arm(true);
+        notify.completed(false);
+        assert_eq!(read_event(rx), Some(7));
+    }
+
+    #[test]
+    fn moderated_cq_holds_events_until_count_or_period() {
+        let mut channels = CompChannels::new();
+        let (rx, tx) = channel(&mut channels, 3);
+        let notify = CqNotify::default();
+        assert!(notify.bind(tx));
+        notify.moderate(3, Duration::from_millis(1));
+        notify.arm(false);
+        notify.completed(false);
+        notify.completed(false);
+        assert_eq!(read_event(rx.try_clone().unwrap()), None);
+        notify.completed(false);
+        assert_eq!(read_event(rx.try_clone().unwrap()), Some(3));
+
+        notify.arm(false);
+        notify.completed(false);
+        let start = Instant::now();
+        notify.expire(start);
+        assert_eq!(read_event(rx.try_clone().unwrap()), None);
+        notify.expire(start + Duration::from_millis(2));
+        assert_eq!(read_event(rx.try_clone().unwrap()), Some(3));
+
+        // solicited completions are never held
+        notify.arm(true);
+        notify.completed(true);
+        assert_eq!(read_event(rx), Some(3));
+    }
+
+    #[test]
+    fn cqs_share_a_channel() {
+        let mut channels = CompChannels::new();
+        let (rx, tx0) = channel(&mut channels, 1);
+        let tx1 = channels.sender(rx.as_raw_fd(), 2).unwrap();
+        assert_eq!(channels.inner.len(), 1);
+        tx1.send().unwrap();
+        tx0.send().unwrap();
+        assert_eq!(read_event(rx.try_clone().unwrap()), Some(2));
+        assert_eq!(read_event(rx), Some(1));
+    }
+
+    #[test]
+    fn completion_wakes_the_registered_task() {
+        struct Flag(AtomicU8);
+        impl std::task::Wake for Flag {
+            fn wake(self: Arc<Self>) {
+                self.0.fetch_add(1, Ordering::SeqCst);
+            }
+        }
+        let flag = Arc::new(Flag(AtomicU8::new(0)));
+        let notify = CqNotify::default();
+        notify.register_waker(&Waker::from(Arc::clone(&flag)));
+        notify.completed(false);
+        notify.completed(false);
+        // the waker is one-shot, the task registers it again before it sleeps
+        assert_eq!(flag.0.load(Ordering::SeqCst), 1);
+    }
+}
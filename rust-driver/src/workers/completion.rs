@@ -1,23 +1,40 @@
-use std::{collections::VecDeque, iter, ops::ControlFlow, sync::Arc};
+use std::{
+    collections::VecDeque,
+    iter, mem,
+    ops::ControlFlow,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, OnceLock,
+    },
+    time::Instant,
+};
 
 use bitvec::vec::BitVec;
 use crossbeam_queue::SegQueue;
-use log::{debug, trace};
+use log::{debug, error, trace};
 use parking_lot::Mutex;
 
 use crate::{
-    constants::MAX_CQ_CNT,
+    constants::{MAX_CQE, MAX_CQ_CNT, MIN_CQE},
+    counters::{Counter, DeviceCounters},
+    latency::{Stage, Stamp},
     rdma_utils::{
         msn::Msn,
         psn::Psn,
-        qp::{QpTable, QpTableShared, qpn_to_index},
+        psn_tracker::PsnTracker,
+        qp::{QpTable, QpTableSeqLock, qpn_to_index},
+        snapshot::StateSnapshot,
         types::QpAttr,
     },
+    sdt::sdt_probe,
+    trace::hot_trace,
     workers::{
         ack_responder::AckResponse,
+        comp_channel::CqNotify,
         qp_timeout::AckTimeoutTask,
         rdma::RdmaWriteTask,
         spawner::{SingleThreadTaskWorker, TaskTx},
+        wc_ring::WcRing,
     },
 };
 
@@ -54,30 +71,187 @@ impl CompletionQueueRegistry {
 #[derive(Debug, PartialEq, Eq)]
 #[allow(variant_size_differences)]
 pub(crate) enum CompletionTask {
-    Register { qpn: u32, event: Event },
-    AckSend { qpn: u32, base_psn: Psn },
-    AckRecv { qpn: u32, base_psn: Psn },
+    Register {
+        qpn: u32,
+        event: Event,
+    },
+    /// Registers the receive WRs of a chain posted at once
+    RegisterRecvs {
+        qpn: u32,
+        events: Vec<PostRecvEvent>,
+    },
+    /// `arrived` is the time the meta report was handled, `reported` the same time on the
+    /// device clock, the completion timestamp of the messages it completes
+    AckSend {
+        qpn: u32,
+        base_psn: Psn,
+        arrived: Stamp,
+        reported: ReportTime,
+    },
+    AckRecv {
+        qpn: u32,
+        base_psn: Psn,
+        arrived: Stamp,
+        reported: ReportTime,
+    },
+    /// PSNs of `bitmap` from `psn` received by the peer while PSNs before them are missing,
+    /// reported by a NAK. They complete the messages of the QPs with relaxed completion
+    AckSendBitmap {
+        qpn: u32,
+        psn: Psn,
+        bitmap: u128,
+        arrived: Stamp,
+        reported: ReportTime,
+    },
+    /// Hands the producer side of a newly created CQ to the worker
+    CreateCq {
+        producer: CqProducer,
+    },
+    /// Moves a CQ to the ring of `producer`, created by `CompletionQueue::resize`
+    ResizeCq {
+        producer: CqProducer,
+    },
+    DestroyCq {
+        handle: u32,
+    },
+    /// Completion of a WR not tracked by the PSNs, the messages of UD QPs and the memory
+    /// window operations executed by the driver
+    Untracked {
+        qpn: u32,
+        completion: Completion,
+        solicited: bool,
+    },
+}
+
+impl CompletionTask {
+    pub(crate) fn new_ack_send(qpn: u32, base_psn: Psn) -> Self {
+        Self::AckSend {
+            qpn,
+            base_psn,
+            arrived: Stamp::now(),
+            reported: ReportTime::now(),
+        }
+    }
+
+    pub(crate) fn new_ack_recv(qpn: u32, base_psn: Psn) -> Self {
+        Self::AckRecv {
+            qpn,
+            base_psn,
+            arrived: Stamp::now(),
+            reported: ReportTime::now(),
+        }
+    }
+
+    pub(crate) fn new_ack_send_bitmap(qpn: u32, psn: Psn, bitmap: u128) -> Self {
+        Self::AckSendBitmap {
+            qpn,
+            psn,
+            bitmap,
+            arrived: Stamp::now(),
+            reported: ReportTime::now(),
+        }
+    }
+
+    /// Returns the shard key of the task, the index of its QP. The tasks of the CQs go to
+    /// the first shard.
+    pub(crate) fn shard_key(&self) -> usize {
+        match *self {
+            Self::Register { qpn, .. }
+            | Self::RegisterRecvs { qpn, .. }
+            | Self::AckSend { qpn, .. }
+            | Self::AckRecv { qpn, .. }
+            | Self::AckSendBitmap { qpn, .. }
+            | Self::Untracked { qpn, .. } => qpn_to_index(qpn),
+            Self::CreateCq { .. } | Self::ResizeCq { .. } | Self::DestroyCq { .. } => 0,
+        }
+    }
+}
+
+/// Time a meta report was handled in nanoseconds of the device clock.
+///
+/// The card doesn't timestamp its reports, the time the driver handles one is the closest
+/// to the arrival of the packet. Times always compare equal so that the tasks carrying them
+/// keep their equality.
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct ReportTime(u64);
+
+impl ReportTime {
+    pub(crate) fn now() -> Self {
+        Self(device_clock_ns())
+    }
+}
+
+impl PartialEq for ReportTime {
+    fn eq(&self, _other: &Self) -> bool {
+        true
+    }
 }
 
+impl Eq for ReportTime {}
+
 pub(crate) struct CompletionWorker {
     tracker_table: QpTable<QueuePairMessageTracker>,
-    cq_table: CompletionQueueTable,
-    qp_table: QpTableShared<QpAttr>,
+    cq_table: CqProducerTable,
+    async_events: AsyncEventQueue,
+    qp_table: QpTableSeqLock<QpAttr>,
     ack_resp_tx: TaskTx<AckResponse>,
     ack_timeout_tx: TaskTx<AckTimeoutTask>,
     rdma_write_tx: TaskTx<RdmaWriteTask>,
+    /// Bytes of the strides the receive WRs are split into
+    recv_stride: u32,
+    /// Snapshot the positions of the QPs are recorded in
+    snapshot: Option<Arc<StateSnapshot>>,
 }
 
 impl SingleThreadTaskWorker for CompletionWorker {
     type Task = CompletionTask;
 
     fn process(&mut self, task: Self::Task) {
-        debug!("CompletionWorker got task: {:?}", task);
         let qpn = match task {
             CompletionTask::Register { qpn, .. }
+            | CompletionTask::RegisterRecvs { qpn, .. }
             | CompletionTask::AckSend { qpn, .. }
-            | CompletionTask::AckRecv { qpn, .. } => qpn,
+            | CompletionTask::AckRecv { qpn, .. }
+            | CompletionTask::AckSendBitmap { qpn, .. }
+            | CompletionTask::Untracked { qpn, .. } => qpn,
+            CompletionTask::CreateCq { producer } => {
+                self.cq_table.insert(producer);
+                return;
+            }
+            CompletionTask::ResizeCq { producer } => {
+                self.cq_table.resize(producer);
+                return;
+            }
+            CompletionTask::DestroyCq { handle } => {
+                self.cq_table.remove(handle);
+                return;
+            }
         };
+        hot_trace!("completion task", qpn);
+        if let CompletionTask::Untracked {
+            completion,
+            solicited,
+            ..
+        } = task
+        {
+            let qp_attr = self.qp_table.get_qp(qpn).expect("invalid qpn: {qpn}");
+            let handle = if matches!(
+                completion,
+                Completion::Send { .. } | Completion::BindMw { .. } | Completion::LocalInv { .. }
+            ) {
+                qp_attr.send_cq
+            } else {
+                qp_attr.recv_cq
+            };
+            self.cq_table.push(
+                handle.expect("no associated cq"),
+                completion,
+                solicited,
+                None,
+                &self.async_events,
+            );
+            return;
+        }
         let tracker = self
             .tracker_table
             .get_qp_mut(qpn)
@@ -87,35 +261,88 @@ impl SingleThreadTaskWorker for CompletionWorker {
             CompletionTask::Register { event, .. } => {
                 tracker.append(event);
             }
-            CompletionTask::AckSend { base_psn, .. } => {
-                let handle = qp_attr.send_cq.expect("no associated cq");
-                let send_cq = self.cq_table.get_cq(handle).expect("invalid cq: {handle}");
-                tracker.ack_send(base_psn);
+            CompletionTask::RegisterRecvs { events, .. } => {
+                for event in events {
+                    tracker.append(Event::PostRecv(event));
+                }
+            }
+            CompletionTask::AckSend {
+                base_psn,
+                arrived,
+                reported,
+                ..
+            } => {
+                tracker.ack_send(base_psn, qp_attr.relaxed_completion);
+                let mut acked = AckedSends::default();
                 while let Some((event, completion)) = tracker.poll_send_completion() {
-                    send_cq.push_back(completion);
-                    self.ack_timeout_tx.send(AckTimeoutTask::ack(qpn));
-                    self.rdma_write_tx
-                        .send(RdmaWriteTask::new_complete(qpn, event.meta().msn));
+                    checkpoint_send(self.snapshot.as_deref(), qpn, event.meta());
+                    if let Some(completion) = completion {
+                        let completion = completion.reported_by(&qp_attr);
+                        let handle = send_completion_cq(&qp_attr, &completion);
+                        self.cq_table.push(
+                            handle.expect("no associated cq"),
+                            completion,
+                            false,
+                            Some(reported),
+                            &self.async_events,
+                        );
+                        arrived.record(Stage::Completion);
+                    }
+                    acked.record(event.meta().msn);
                 }
+                self.send_acked(qpn, acked);
             }
-            CompletionTask::AckRecv { base_psn, .. } => {
-                let send_handle = qp_attr.send_cq.expect("no associated cq");
+            CompletionTask::AckSendBitmap {
+                psn,
+                bitmap,
+                arrived,
+                reported,
+                ..
+            } => {
+                tracker.ack_send_bitmap(psn, bitmap);
+                // The WRs stay tracked until acked in order, which releases their slots
+                while let Some(completion) = tracker.poll_early_send_completion() {
+                    let completion = completion.reported_by(&qp_attr);
+                    self.cq_table.push(
+                        qp_attr.send_cq.expect("no associated cq"),
+                        completion,
+                        false,
+                        Some(reported),
+                        &self.async_events,
+                    );
+                    arrived.record(Stage::Completion);
+                }
+            }
+            CompletionTask::AckRecv {
+                base_psn,
+                arrived,
+                reported,
+                ..
+            } => {
                 let recv_handle = qp_attr.recv_cq.expect("no associated cq");
-                let send_cq = self
-                    .cq_table
-                    .get_cq(send_handle)
-                    .expect("invalid cq: {send_handle}");
-                let recv_cq = self
-                    .cq_table
-                    .get_cq(recv_handle)
-                    .expect("invalid cq: {send_handle}");
+                // Recorded before the peer is acknowledged, the PSNs are not expected again
+                if let Some(snapshot) = self.snapshot.as_ref() {
+                    snapshot.record_recv(qpn, base_psn);
+                }
                 tracker.ack_recv(base_psn);
+                let mut acked = AckedSends::default();
                 while let Some((event, completion)) = tracker.poll_send_completion() {
-                    send_cq.push_back(completion);
-                    self.ack_timeout_tx.send(AckTimeoutTask::ack(qpn));
-                    self.rdma_write_tx
-                        .send(RdmaWriteTask::new_complete(qpn, event.meta().msn));
+                    checkpoint_send(self.snapshot.as_deref(), qpn, event.meta());
+                    if let Some(completion) = completion {
+                        let completion = completion.reported_by(&qp_attr);
+                        let handle = send_completion_cq(&qp_attr, &completion);
+                        self.cq_table.push(
+                            handle.expect("no associated cq"),
+                            completion,
+                            false,
+                            Some(reported),
+                            &self.async_events,
+                        );
+                        arrived.record(Stage::Completion);
+                    }
+                    acked.record(event.meta().msn);
                 }
+                self.send_acked(qpn, acked);
                 while let Some((event, completion)) = tracker.poll_recv_completion() {
                     if event.ack_req {
                         self.ack_resp_tx.send(AckResponse::Ack {
@@ -125,10 +352,22 @@ impl SingleThreadTaskWorker for CompletionWorker {
                         });
                     }
                     if let Some(c) = completion {
-                        recv_cq.push_back(c);
+                        let c = c.reported_by(&qp_attr);
+                        self.cq_table.push(
+                            recv_handle,
+                            c,
+                            event.solicited,
+                            Some(reported),
+                            &self.async_events,
+                        );
+                        arrived.record(Stage::Completion);
                     }
                 }
             }
+            CompletionTask::CreateCq { .. }
+            | CompletionTask::ResizeCq { .. }
+            | CompletionTask::DestroyCq { .. }
+            | CompletionTask::Untracked { .. } => unreachable!(),
         }
     }
 
@@ -137,75 +376,112 @@ impl SingleThreadTaskWorker for CompletionWorker {
 
 impl CompletionWorker {
     pub(crate) fn new(
-        cq_table: CompletionQueueTable,
-        qp_table: QpTableShared<QpAttr>,
+        async_events: AsyncEventQueue,
+        qp_table: QpTableSeqLock<QpAttr>,
         ack_resp_tx: TaskTx<AckResponse>,
         ack_timeout_tx: TaskTx<AckTimeoutTask>,
         rdma_write_tx: TaskTx<RdmaWriteTask>,
+        counters: Arc<DeviceCounters>,
+        recv_stride: u32,
     ) -> Self {
         Self {
-            tracker_table: QpTable::new(),
-            cq_table,
+            tracker_table: QpTable::new_with(move || {
+                QueuePairMessageTracker::with_stride(recv_stride)
+            }),
+            cq_table: CqProducerTable::new(counters),
+            async_events,
             qp_table,
             ack_resp_tx,
             ack_timeout_tx,
             rdma_write_tx,
+            recv_stride,
+            snapshot: None,
         }
     }
-}
 
-pub(crate) struct EventWithQpn {
-    qpn: u32,
-    event: Event,
-}
+    /// Records the positions of the QPs in `snapshot`, the shards record in it too
+    pub(crate) fn with_snapshot(mut self, snapshot: Option<Arc<StateSnapshot>>) -> Self {
+        self.snapshot = snapshot;
+        self
+    }
 
-impl EventWithQpn {
-    pub(crate) fn new(qpn: u32, event: Event) -> Self {
-        Self { qpn, event }
+    /// Creates another shard of the worker, sharing the CQs and the channels of this one.
+    ///
+    /// Each shard tracks the messages of the QPs routed to it by `CompletionTask::shard_key`.
+    pub(crate) fn new_shard(&self) -> Self {
+        let recv_stride = self.recv_stride;
+        Self {
+            tracker_table: QpTable::new_with(move || {
+                QueuePairMessageTracker::with_stride(recv_stride)
+            }),
+            cq_table: self.cq_table.clone(),
+            async_events: self.async_events.clone(),
+            qp_table: self.qp_table.clone(),
+            ack_resp_tx: self.ack_resp_tx.clone(),
+            ack_timeout_tx: self.ack_timeout_tx.clone(),
+            rdma_write_tx: self.rdma_write_tx.clone(),
+            recv_stride,
+            snapshot: self.snapshot.clone(),
+        }
     }
-}
 
-/// Used for merge a read request/response
-#[derive(Default)]
-struct MergeQueue {
-    send: VecDeque<SendEvent>,
-    recv: VecDeque<RecvEvent>,
-    recv_read_resp: VecDeque<RecvEvent>,
+    /// Reports the sends completed by an ACK to the timeout and RDMA write workers.
+    ///
+    /// The two updates are cumulative, so an ACK completing many sends costs a single task
+    /// to each worker rather than one per completion.
+    fn send_acked(&self, qpn: u32, acked: AckedSends) {
+        let Some(msn) = acked.last_msn else {
+            return;
+        };
+        self.ack_timeout_tx
+            .send(AckTimeoutTask::acked(qpn, acked.count));
+        self.rdma_write_tx
+            .send(RdmaWriteTask::new_complete(qpn, msn));
+    }
 }
 
-impl MergeQueue {
-    fn push_send(&mut self, event: SendEvent) {
-        self.send.push_back(event);
+/// Records the completion of a send in the snapshot before it is reported, so that a QP
+/// reattached after a restart never resumes before a WR the application saw complete
+fn checkpoint_send(snapshot: Option<&StateSnapshot>, qpn: u32, meta: MessageMeta) {
+    if let Some(snapshot) = snapshot {
+        snapshot.record_send(qpn, meta.msn.wrapping_add(1), meta.end_psn);
     }
+}
 
-    fn push_recv(&mut self, event: RecvEvent) {
-        match event.op {
-            RecvEventOp::ReadResp => {
-                self.recv_read_resp.push_back(event);
-            }
-            RecvEventOp::Write
-            | RecvEventOp::WriteWithImm { .. }
-            | RecvEventOp::Recv
-            | RecvEventOp::RecvWithImm { .. }
-            | RecvEventOp::RecvRead => {
-                self.recv.push_back(event);
-            }
-        }
+/// Returns the CQ of a completion of the send queue, the read pulling a send of the peer
+/// completes a receive WR
+fn send_completion_cq(qp_attr: &QpAttr, completion: &Completion) -> Option<u32> {
+    if matches!(completion, Completion::Recv { .. }) {
+        qp_attr.recv_cq
+    } else {
+        qp_attr.send_cq
     }
+}
 
-    fn pop_send(&mut self) -> Option<SendEvent> {
-        let event = self.send.front()?;
-        match event.op {
-            SendEventOp::WriteSignaled | SendEventOp::SendSignaled => self.send.pop_front(),
-            SendEventOp::ReadSignaled => self
-                .recv_read_resp
-                .pop_front()
-                .and_then(|_e| self.send.pop_front()),
-        }
+/// Sends of a QP completed by a single ACK
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+struct AckedSends {
+    /// Number of completed sends
+    count: usize,
+    /// MSN of the latest completed send
+    last_msn: Option<u16>,
+}
+
+impl AckedSends {
+    fn record(&mut self, msn: u16) {
+        self.count = self.count.saturating_add(1);
+        self.last_msn = Some(msn);
     }
+}
+
+pub(crate) struct EventWithQpn {
+    qpn: u32,
+    event: Event,
+}
 
-    fn pop_recv(&mut self) -> Option<RecvEvent> {
-        self.recv.pop_front()
+impl EventWithQpn {
+    pub(crate) fn new(qpn: u32, event: Event) -> Self {
+        Self { qpn, event }
     }
 }
 
@@ -213,63 +489,175 @@ impl MergeQueue {
 struct QueuePairMessageTracker {
     send: MessageTracker<SendEvent>,
     recv: MessageTracker<RecvEvent>,
-    read_resp_queue: VecDeque<RecvEvent>,
     post_recv_queue: VecDeque<PostRecvEvent>,
-    merge: MergeQueue,
+    /// Read responses acked whose read requests haven't completed yet, a read request
+    /// completes with the oldest of them
+    read_resps: usize,
+    /// Bytes of the strides the receive WRs are split into, 0 if a message takes a whole WR
+    stride: u32,
+    /// Bytes of the receive WR at the front of the queue filled by earlier messages
+    filled: u32,
+    /// PSNs acknowledged by the peer past the base PSN, tracked from the first ACK of a QP
+    /// with relaxed completion
+    acked_ahead: Option<PsnTracker>,
 }
 
 impl QueuePairMessageTracker {
+    fn with_stride(stride: u32) -> Self {
+        Self {
+            stride,
+            ..Self::default()
+        }
+    }
+
     fn append(&mut self, event: Event) {
         match event {
-            Event::Send(x) => self.send.append(x),
-            Event::Recv(x) => self.recv.append(x),
+            Event::Send(x) => {
+                let _acked = self.send.append(x);
+            }
+            Event::Recv(x) => {
+                if self.recv.append(x) && matches!(x.op, RecvEventOp::ReadResp) {
+                    self.read_resps += 1;
+                }
+            }
             Event::PostRecv(x) => {
                 self.post_recv_queue.push_back(x);
             }
         }
     }
 
-    fn ack_send(&mut self, psn: Psn) {
-        self.send.ack(psn);
-        while let Some(event) = self.send.pop() {
-            self.merge.push_send(event);
+    /// Acks the sent PSNs before `psn`, `relaxed` if the messages may complete out of order
+    fn ack_send(&mut self, psn: Psn, relaxed: bool) {
+        self.send.ack(psn, |_event| {});
+        match self.acked_ahead.as_mut() {
+            Some(acked_ahead) => {
+                let _base = acked_ahead.ack_before(psn);
+            }
+            None if relaxed => self.acked_ahead = Some(PsnTracker::new(psn)),
+            None => {}
         }
     }
 
-    fn ack_recv(&mut self, psn: Psn) {
-        self.recv.ack(psn);
-        while let Some(event) = self.recv.pop() {
-            self.merge.push_recv(event);
+    /// Records the sent PSNs of `bitmap` from `psn` acknowledged ahead of the base PSN
+    fn ack_send_bitmap(&mut self, psn: Psn, bitmap: u128) {
+        if let Some(acked_ahead) = self.acked_ahead.as_mut() {
+            let _base = acked_ahead.ack_bitmap(psn, bitmap);
         }
     }
 
-    fn poll_send_completion(&mut self) -> Option<(SendEvent, Completion)> {
-        let event = self.merge.pop_send()?;
+    /// Returns the completion of a signaled send or RDMA write whose PSNs are all acked while
+    /// the messages before it are not, the message is taken in order later without
+    /// completing again.
+    ///
+    /// The reads and the atomics wait for their responses, which arrive in order.
+    fn poll_early_send_completion(&mut self) -> Option<Completion> {
+        let acked_ahead = self.acked_ahead.as_ref()?;
+        let event = self.send.unacked_mut().find(|event| {
+            !event.completed
+                && matches!(
+                    event.op,
+                    SendEventOp::WriteSignaled | SendEventOp::SendSignaled
+                )
+                && event.first_psn.is_some_and(|first| {
+                    let len = (event.meta.end_psn - first).into_inner();
+                    (0..len).all(|i| acked_ahead.is_acked(first + i))
+                })
+        })?;
+        event.completed = true;
+        let (qpn, wr_id) = (event.qpn, event.wr_id);
+        Some(if matches!(event.op, SendEventOp::WriteSignaled) {
+            Completion::RdmaWrite { qpn, wr_id }
+        } else {
+            Completion::Send { qpn, wr_id }
+        })
+    }
+
+    fn ack_recv(&mut self, psn: Psn) {
+        let read_resps = &mut self.read_resps;
+        self.recv.ack(psn, |event| {
+            if matches!(event.op, RecvEventOp::ReadResp) {
+                *read_resps += 1;
+            }
+        });
+    }
+
+    /// Takes the oldest acked message, along with its completion unless it completed out of
+    /// order
+    fn poll_send_completion(&mut self) -> Option<(SendEvent, Option<Completion>)> {
+        let front = self.send.peek()?;
+        if matches!(
+            front.op,
+            SendEventOp::ReadSignaled | SendEventOp::Pull { .. }
+        ) {
+            // a read completes once its response arrived
+            self.read_resps = self.read_resps.checked_sub(1)?;
+        }
+        let event = self.send.pop()?;
+        if event.completed {
+            return Some((event, None));
+        }
+        let (qpn, wr_id) = (event.qpn, event.wr_id);
         let completion = match event.op {
-            SendEventOp::WriteSignaled => Completion::RdmaWrite { wr_id: event.wr_id },
-            SendEventOp::SendSignaled => Completion::Send { wr_id: event.wr_id },
-            SendEventOp::ReadSignaled => Completion::RdmaRead { wr_id: event.wr_id },
+            SendEventOp::WriteSignaled => Completion::RdmaWrite { qpn, wr_id },
+            SendEventOp::SendSignaled => Completion::Send { qpn, wr_id },
+            SendEventOp::ReadSignaled => Completion::RdmaRead { qpn, wr_id },
+            SendEventOp::CmpAndSwpSignaled => Completion::CompSwap { qpn, wr_id },
+            SendEventOp::FetchAndAddSignaled => Completion::FetchAdd { qpn, wr_id },
+            SendEventOp::AtomicWriteSignaled => Completion::AtomicWrite { qpn, wr_id },
+            SendEventOp::FlushSignaled => Completion::Flush { qpn, wr_id },
+            SendEventOp::Pull { addr, len } => {
+                let pos = self
+                    .post_recv_queue
+                    .iter()
+                    .position(|x| x.addr == addr)
+                    .expect("no posted recv wr");
+                let x = self.post_recv_queue.remove(pos).expect("no posted recv wr");
+                Completion::Recv {
+                    qpn,
+                    wr_id: x.wr_id,
+                    imm: None,
+                    byte_len: len,
+                    offset: 0,
+                }
+            }
         };
 
-        Some((event, completion))
+        Some((event, Some(completion)))
     }
 
     fn poll_recv_completion(&mut self) -> Option<(RecvEvent, Option<Completion>)> {
-        let event = self.merge.pop_recv()?;
+        // read responses were counted once acked, they complete the read requests
+        let event = loop {
+            let event = self.recv.pop()?;
+            if !matches!(event.op, RecvEventOp::ReadResp) {
+                break event;
+            }
+        };
+        let qpn = event.qpn;
         let completion = match event.op {
-            RecvEventOp::WriteWithImm { imm } => Some(Completion::RecvRdmaWithImm { imm }),
-            RecvEventOp::Recv => {
-                let x = self.post_recv_queue.pop_back().expect("no posted recv wr");
+            RecvEventOp::WriteWithImm { imm, len } => Some(Completion::RecvRdmaWithImm {
+                qpn,
+                imm,
+                byte_len: len,
+            }),
+            RecvEventOp::Recv { len } => {
+                let (wr_id, offset) = self.take_post_recv(len).expect("no posted recv wr");
                 Some(Completion::Recv {
-                    wr_id: x.wr_id,
+                    qpn,
+                    wr_id,
                     imm: None,
+                    byte_len: len,
+                    offset,
                 })
             }
-            RecvEventOp::RecvWithImm { imm } => {
-                let x = self.post_recv_queue.pop_back().expect("no posted recv wr");
+            RecvEventOp::RecvWithImm { imm, len } => {
+                let (wr_id, offset) = self.take_post_recv(len).expect("no posted recv wr");
                 Some(Completion::Recv {
-                    wr_id: x.wr_id,
+                    qpn,
+                    wr_id,
                     imm: Some(imm),
+                    byte_len: len,
+                    offset,
                 })
             }
             RecvEventOp::ReadResp => unreachable!("invalid branch"),
@@ -278,57 +666,188 @@ impl QueuePairMessageTracker {
 
         Some((event, completion))
     }
+
+    /// Takes the receive WR a message of `len` bytes landed in, returns its `wr_id` and the
+    /// offset of the message in the buffer.
+    ///
+    /// With striding the strides are consumed the same way the sender placed the message, see
+    /// `RecvWrQueue`.
+    fn take_post_recv(&mut self, len: u32) -> Option<(u64, u32)> {
+        if self.stride == 0 {
+            return self.post_recv_queue.pop_back().map(|x| (x.wr_id, 0));
+        }
+        let front = loop {
+            let front = *self.post_recv_queue.front()?;
+            if self.filled == 0 || len <= front.length.saturating_sub(self.filled) {
+                break front;
+            }
+            self.retire_front();
+        };
+        let offset = self.filled;
+        self.filled = self.filled.saturating_add(stride_span(self.stride, len));
+        if front.length.saturating_sub(self.filled) < self.stride {
+            self.retire_front();
+        }
+        Some((front.wr_id, offset))
+    }
+
+    fn retire_front(&mut self) {
+        let _ignore = self.post_recv_queue.pop_front();
+        self.filled = 0;
+    }
 }
 
+/// Slots of a message tracker allocated for the first messages of a QP
+const MIN_TRACKER_SLOTS: usize = 64;
+
+/// Messages of a QP in MSN order, waiting for the PSNs they span to be acked.
+///
+/// The messages are held in a ring of slots indexed by `msn & mask`, so a message is
+/// registered and completed in constant time whatever the order the messages arrive in. The
+/// MSNs a QP skips, such as those of unsignaled WRs, leave their slots empty. The ring holds
+/// the MSNs from `head` to `tail`, the messages before `acked` are acked and only wait to be
+/// taken. A message is at `head` and `acked` unless they reached `tail`.
 #[derive(Debug)]
 struct MessageTracker<E> {
-    inner: VecDeque<E>,
+    slots: Box<[Option<E>]>,
+    /// MSN of the oldest message not taken yet
+    head: Msn,
+    /// MSN of the oldest message not acked yet
+    acked: Msn,
+    /// MSN following the newest message
+    tail: Msn,
     base_psn: Psn,
 }
 
 impl<E> Default for MessageTracker<E> {
     fn default() -> Self {
         Self {
-            inner: VecDeque::default(),
+            slots: Box::default(),
+            head: Msn::default(),
+            acked: Msn::default(),
+            tail: Msn::default(),
             base_psn: Psn::default(),
         }
     }
 }
 
 impl<E: EventMeta> MessageTracker<E> {
-    fn append(&mut self, event: E) {
-        let pos = self
-            .inner
-            .iter()
-            .rev()
-            .position(|e| Msn(e.meta().msn) < Msn(event.meta().msn))
-            .unwrap_or(self.inner.len());
-        let index = self.inner.len() - pos;
-        if self
-            .inner
-            .get(index)
-            .is_none_or(|e| e.meta().msn != event.meta().msn)
-        {
-            self.inner.insert(index, event);
+    /// Registers `event`, returns `true` if the PSNs it spans are already acked.
+    ///
+    /// A message whose MSN is already tracked is ignored.
+    fn append(&mut self, event: E) -> bool {
+        let meta = event.meta();
+        let msn = Msn(meta.msn);
+        if self.head == self.tail && !(msn < self.tail) {
+            self.head = msn;
+            self.acked = msn;
+            self.tail = msn;
         }
+        if msn < self.head {
+            self.reserve(self.tail.distance(msn));
+            self.head = msn;
+        } else if !(msn < self.tail) {
+            self.reserve(msn.distance(self.head) + 1);
+            self.tail = msn.advance(1);
+        }
+        let index = self.index(msn);
+        let Some(slot) = self.slots.get_mut(index) else {
+            unreachable!("slot out of range");
+        };
+        if slot.is_some() {
+            return false;
+        }
+        *slot = Some(event);
+        if !(msn < self.acked) {
+            return false;
+        }
+        // A message arriving after the later ones were acked
+        if meta.end_psn <= self.base_psn {
+            return true;
+        }
+        self.acked = msn;
+        false
     }
 
-    fn ack(&mut self, base_psn: Psn) {
+    /// Acks the PSNs before `base_psn`, `on_acked` is called on every message this acks
+    fn ack<F: FnMut(&E)>(&mut self, base_psn: Psn, mut on_acked: F) {
         self.base_psn = base_psn;
+        while self.acked != self.tail {
+            if let Some(event) = self
+                .slots
+                .get(self.index(self.acked))
+                .and_then(Option::as_ref)
+            {
+                if event.meta().end_psn > base_psn {
+                    break;
+                }
+                on_acked(event);
+            }
+            self.acked = self.acked.advance(1);
+        }
     }
 
+    /// Returns the oldest message if it is acked
     fn peek(&self) -> Option<&E> {
-        let front = self.inner.front()?;
-        (front.meta().end_psn <= self.base_psn).then_some(front)
+        if self.head == self.acked {
+            return None;
+        }
+        self.slots.get(self.index(self.head))?.as_ref()
     }
 
+    /// Takes the oldest message if it is acked
     fn pop(&mut self) -> Option<E> {
-        let front = self.inner.front()?;
-        if front.meta().end_psn <= self.base_psn {
-            self.inner.pop_front()
-        } else {
-            None
+        if self.head == self.acked {
+            return None;
+        }
+        let index = self.index(self.head);
+        let event = self.slots.get_mut(index)?.take();
+        self.head = self.head.advance(1);
+        while self.head != self.tail
+            && self
+                .slots
+                .get(self.index(self.head))
+                .is_some_and(Option::is_none)
+        {
+            self.head = self.head.advance(1);
         }
+        event
+    }
+
+    /// Returns the messages not acked yet by MSN
+    fn unacked_mut(&mut self) -> impl Iterator<Item = &mut E> {
+        let len = self.tail.distance(self.acked);
+        let start = if len == 0 { 0 } else { self.index(self.acked) };
+        let (front, back) = self.slots.split_at_mut(start);
+        back.iter_mut()
+            .chain(front)
+            .take(len)
+            .filter_map(Option::as_mut)
+    }
+
+    fn index(&self, msn: Msn) -> usize {
+        usize::from(msn.0) & self.slots.len().wrapping_sub(1)
+    }
+
+    /// Grows the ring to hold `span` MSNs from `head`
+    fn reserve(&mut self, span: usize) {
+        if span <= self.slots.len() {
+            return;
+        }
+        let len = span.next_power_of_two().max(MIN_TRACKER_SLOTS);
+        let mut slots: Box<[Option<E>]> = iter::repeat_with(|| None).take(len).collect();
+        let mut msn = self.head;
+        while msn != self.tail {
+            let index = self.index(msn);
+            if let (Some(event), Some(slot)) = (
+                self.slots.get_mut(index).and_then(Option::take),
+                slots.get_mut(usize::from(msn.0) & (len - 1)),
+            ) {
+                *slot = Some(event);
+            }
+            msn = msn.advance(1);
+        }
+        self.slots = slots;
     }
 }
 
@@ -352,6 +871,10 @@ pub(crate) struct SendEvent {
     op: SendEventOp,
     meta: MessageMeta,
     wr_id: u64,
+    /// First PSN of the message, `None` if it only completes in order
+    first_psn: Option<Psn>,
+    /// The message completed ahead of the messages before it
+    completed: bool,
 }
 
 impl SendEvent {
@@ -361,8 +884,16 @@ impl SendEvent {
             op,
             meta,
             wr_id,
+            first_psn: None,
+            completed: false,
         }
     }
+
+    /// Sets the first PSN of the message, which may then complete out of order
+    pub(crate) fn with_first_psn(mut self, psn: Psn) -> Self {
+        self.first_psn = Some(psn);
+        self
+    }
 }
 
 impl EventMeta for SendEvent {
@@ -377,6 +908,18 @@ pub(crate) enum SendEventOp {
     WriteSignaled,
     SendSignaled,
     ReadSignaled,
+    /// Completes once the atomic ACK wrote the original value to the local buffer
+    CmpAndSwpSignaled,
+    FetchAndAddSignaled,
+    /// Completes once the atomic ACK reports the write placed by the responder
+    AtomicWriteSignaled,
+    /// Completes once the atomic ACK reports the range placed at the requested placement type
+    FlushSignaled,
+    /// Read of a send of the peer into the receive WR at `addr`, completes the receive WR
+    Pull {
+        addr: u64,
+        len: u32,
+    },
 }
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
@@ -385,6 +928,8 @@ pub(crate) struct RecvEvent {
     pub(crate) op: RecvEventOp,
     pub(crate) meta: MessageMeta,
     pub(crate) ack_req: bool,
+    /// Whether the message carries the solicited event bit
+    pub(crate) solicited: bool,
 }
 
 impl RecvEvent {
@@ -394,8 +939,15 @@ impl RecvEvent {
             op,
             meta,
             ack_req,
+            solicited: false,
         }
     }
+
+    /// Sets the solicited event bit of the message
+    pub(crate) fn with_solicited(mut self, solicited: bool) -> Self {
+        self.solicited = solicited;
+        self
+    }
 }
 
 impl EventMeta for RecvEvent {
@@ -407,9 +959,9 @@ impl EventMeta for RecvEvent {
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub(crate) enum RecvEventOp {
     Write,
-    WriteWithImm { imm: u32 },
-    Recv,
-    RecvWithImm { imm: u32 },
+    WriteWithImm { imm: u32, len: u32 },
+    Recv { len: u32 },
+    RecvWithImm { imm: u32, len: u32 },
     ReadResp,
     RecvRead,
 }
@@ -418,11 +970,20 @@ pub(crate) enum RecvEventOp {
 pub(crate) struct PostRecvEvent {
     qpn: u32,
     wr_id: u64,
+    /// Address of the receive buffer
+    addr: u64,
+    /// Length of the receive buffer
+    length: u32,
 }
 
 impl PostRecvEvent {
-    pub(crate) fn new(qpn: u32, wr_id: u64) -> Self {
-        Self { qpn, wr_id }
+    pub(crate) fn new(qpn: u32, wr_id: u64, addr: u64, length: u32) -> Self {
+        Self {
+            qpn,
+            wr_id,
+            addr,
+            length,
+        }
     }
 }
 
@@ -438,52 +999,563 @@ impl MessageMeta {
     }
 }
 
-pub(crate) struct CompletionQueueTable {
-    inner: Arc<[CompletionQueue]>,
+/// Asynchronous events reported to the verbs consumer
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum AsyncEvent {
+    /// The CQ ring overflowed and completions were dropped
+    CqErr { handle: u32 },
+    /// The number of WRs in the pool of the SRQ dropped below its armed limit
+    SrqLimit { handle: u32 },
 }
 
-impl CompletionQueueTable {
+/// Queue of asynchronous events, events are rare so a shared queue is sufficient
+#[derive(Debug, Default, Clone)]
+pub(crate) struct AsyncEventQueue {
+    inner: Arc<SegQueue<AsyncEvent>>,
+}
+
+impl AsyncEventQueue {
     pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    pub(crate) fn push(&self, event: AsyncEvent) {
+        self.inner.push(event);
+    }
+
+    pub(crate) fn pop(&self) -> Option<AsyncEvent> {
+        self.inner.pop()
+    }
+}
+
+/// A cache line sized slot of the completion ring, so that the producer writing
+/// the next entry never shares a line with the entry being read by the consumer
+#[repr(align(64))]
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct CqSlot {
+    completion: Completion,
+    /// Time the meta report completing the message was handled, or the completion was
+    /// pushed if it has no report, in nanoseconds of the device clock. 0 if the CQ does not
+    /// record timestamps
+    timestamp: u64,
+    /// Time the completion was pushed
+    pushed: Stamp,
+}
+
+impl CqSlot {
+    pub(crate) fn new(completion: Completion, timestamp: u64) -> Self {
+        Self {
+            completion,
+            timestamp,
+            pushed: Stamp::now(),
+        }
+    }
+
+    pub(crate) fn completion(&self) -> &Completion {
+        &self.completion
+    }
+
+    pub(crate) fn timestamp(&self) -> u64 {
+        self.timestamp
+    }
+}
+
+/// Frequency of the device clock in kHz, the clock counts nanoseconds
+pub(crate) const DEVICE_CLOCK_KHZ: u64 = 1_000_000;
+
+/// Returns the device clock in nanoseconds.
+///
+/// The clock is the monotonic clock of the host counted from the first call, so that
+/// completion timestamps of all CQs are comparable.
+pub(crate) fn device_clock_ns() -> u64 {
+    /// Origin of the device clock
+    static EPOCH: OnceLock<Instant> = OnceLock::new();
+    let elapsed = EPOCH.get_or_init(Instant::now).elapsed();
+    u64::try_from(elapsed.as_nanos()).unwrap_or(u64::MAX)
+}
+
+/// Creates a completion queue with room for at least `cqe` entries.
+///
+/// The returned producer is owned by the `CompletionWorker`, the consumer is polled by the
+/// verbs context. Returns `None` if `cqe` exceeds `MAX_CQE`.
+pub(crate) fn completion_queue(handle: u32, cqe: usize) -> Option<(CqProducer, CompletionQueue)> {
+    let capacity = cq_capacity(cqe)?;
+    let (producer, consumer) = rtrb::RingBuffer::new(capacity);
+    Some(cq_pair(
+        handle,
+        capacity,
+        ProducerRing::Slots(producer),
+        ConsumerRing::Slots(consumer),
+    ))
+}
+
+/// Creates a completion queue whose entries are kept in a `WcRing`, so that the C provider
+/// polls the CQ in place. Completions of such a CQ are neither timestamped nor recorded in
+/// the latency histograms.
+pub(crate) fn shared_completion_queue(
+    handle: u32,
+    cqe: usize,
+) -> Option<(CqProducer, CompletionQueue)> {
+    let capacity = cq_capacity(cqe)?;
+    let ring = Arc::new(WcRing::new(capacity));
+    Some(cq_pair(
+        handle,
+        capacity,
+        ProducerRing::Shared(Arc::clone(&ring)),
+        ConsumerRing::Shared(ring),
+    ))
+}
+
+/// Returns the number of entries of a CQ of at least `cqe` entries
+fn cq_capacity(cqe: usize) -> Option<usize> {
+    (cqe <= MAX_CQE).then(|| cqe.max(MIN_CQE).next_power_of_two())
+}
+
+fn cq_pair(
+    handle: u32,
+    capacity: usize,
+    producer: ProducerRing,
+    consumer: ConsumerRing,
+) -> (CqProducer, CompletionQueue) {
+    let overrun = Arc::new(AtomicBool::new(false));
+    let notify = Arc::new(CqNotify::default());
+    let sealed = Arc::new(AtomicBool::new(false));
+    (
+        CqProducer {
+            handle,
+            inner: producer,
+            sealed: Arc::clone(&sealed),
+            overrun: Arc::clone(&overrun),
+            notify: Arc::clone(&notify),
+            timestamps: false,
+        },
+        CompletionQueue {
+            inner: consumer,
+            sealed,
+            retired: VecDeque::new(),
+            overrun,
+            notify,
+            capacity,
+        },
+    )
+}
+
+/// Entries of a CQ as written by the `CompletionWorker`
+enum ProducerRing {
+    Slots(rtrb::Producer<CqSlot>),
+    Shared(Arc<WcRing>),
+}
+
+/// Entries of a CQ as read by the verbs context
+enum ConsumerRing {
+    Slots(rtrb::Consumer<CqSlot>),
+    Shared(Arc<WcRing>),
+}
+
+impl ConsumerRing {
+    fn pop(&mut self) -> Option<CqSlot> {
+        match *self {
+            ConsumerRing::Slots(ref mut slots) => {
+                let slot = slots.pop().ok()?;
+                slot.pushed.record(Stage::PollCq);
+                Some(slot)
+            }
+            ConsumerRing::Shared(ref ring) => loop {
+                // Only valid completions are written to the ring
+                if let Some(completion) = Completion::from_wc(&ring.pop()?) {
+                    return Some(CqSlot::new(completion, 0));
+                }
+            },
+        }
+    }
+}
+
+/// A ring a CQ was moved out of by a resize
+struct RetiredRing {
+    ring: ConsumerRing,
+    /// Set once the producer moved to a newer ring, the ring is dropped once it is drained
+    sealed: Arc<AtomicBool>,
+}
+
+/// Producer side of a completion queue
+pub(crate) struct CqProducer {
+    handle: u32,
+    inner: ProducerRing,
+    /// Set once the producer moved to the ring of a resize, nothing is pushed to `inner`
+    /// afterwards
+    sealed: Arc<AtomicBool>,
+    overrun: Arc<AtomicBool>,
+    /// Notification state shared with the consumer
+    notify: Arc<CqNotify>,
+    /// Whether completions are timestamped when pushed
+    timestamps: bool,
+}
+
+impl CqProducer {
+    /// Pushes a completion to the CQ.
+    ///
+    /// Returns `false` if the ring is full, in which case the CQ is marked as overrun.
+    pub(crate) fn push(&mut self, completion: Completion) -> bool {
+        self.push_reported(completion, None)
+    }
+
+    /// Pushes a completion of a message reported at `reported`, the completion is
+    /// timestamped with the time of the push if it has no report.
+    ///
+    /// Returns `false` if the ring is full, in which case the CQ is marked as overrun.
+    pub(crate) fn push_reported(
+        &mut self,
+        completion: Completion,
+        reported: Option<ReportTime>,
+    ) -> bool {
+        let timestamp = match reported {
+            _ if !self.timestamps => 0,
+            Some(ReportTime(ns)) => ns,
+            None => device_clock_ns(),
+        };
+        let pushed = match self.inner {
+            ProducerRing::Slots(ref mut slots) => {
+                slots.push(CqSlot::new(completion, timestamp)).is_ok()
+            }
+            ProducerRing::Shared(ref ring) => {
+                let mut wc = ibverbs_sys::ibv_wc::default();
+                completion.fill_wc(&mut wc);
+                ring.push(wc)
+            }
+        };
+        if pushed {
+            return true;
+        }
+        self.overrun.store(true, Ordering::Release);
+        false
+    }
+
+    pub(crate) fn handle(&self) -> u32 {
+        self.handle
+    }
+
+    /// Records the time of each completion, as read by `ibv_wc_read_completion_ts`
+    pub(crate) fn enable_timestamps(&mut self) {
+        self.timestamps = true;
+    }
+
+    /// Pushes the next completions to the ring of `resized`, then seals the current ring
+    /// so that the consumer moves on once it drained it
+    fn move_to(&mut self, resized: CqProducer) {
+        self.inner = resized.inner;
+        mem::replace(&mut self.sealed, resized.sealed).store(true, Ordering::Release);
+    }
+}
+
+impl std::fmt::Debug for CqProducer {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("CqProducer")
+            .field("handle", &self.handle)
+            .finish()
+    }
+}
+
+impl PartialEq for CqProducer {
+    fn eq(&self, other: &Self) -> bool {
+        self.handle == other.handle
+    }
+}
+
+impl Eq for CqProducer {}
+
+/// Producers of all CQs, shared by the shards of the `CompletionWorker`.
+///
+/// A CQ may be fed by QPs of every shard, its producer is locked for each push. The lock is
+/// uncontended unless QPs of different shards complete on one CQ at the same time.
+#[derive(Clone)]
+struct CqProducerTable {
+    inner: Arc<[Mutex<Option<CqProducer>>]>,
+    /// Counts the completions dropped by overruns
+    counters: Arc<DeviceCounters>,
+}
+
+impl CqProducerTable {
+    fn new(counters: Arc<DeviceCounters>) -> Self {
         Self {
-            inner: iter::repeat_with(CompletionQueue::default)
+            inner: iter::repeat_with(|| Mutex::new(None))
                 .take(MAX_CQ_CNT)
                 .collect(),
+            counters,
+        }
+    }
+
+    fn insert(&self, producer: CqProducer) {
+        if let Some(slot) = self.inner.get(producer.handle() as usize) {
+            *slot.lock() = Some(producer);
+        }
+    }
+
+    fn remove(&self, handle: u32) {
+        if let Some(slot) = self.inner.get(handle as usize) {
+            *slot.lock() = None;
+        }
+    }
+
+    fn resize(&self, resized: CqProducer) {
+        let handle = resized.handle();
+        let mut slot = self.inner.get(handle as usize).map(|slot| slot.lock());
+        match slot.as_deref_mut().and_then(Option::as_mut) {
+            Some(producer) => producer.move_to(resized),
+            None => error!("invalid cq: {handle}"),
+        }
+    }
+
+    /// Pushes a completion to the CQ and generates a CQ event if the CQ is armed for it
+    fn push(
+        &self,
+        handle: u32,
+        completion: Completion,
+        solicited: bool,
+        reported: Option<ReportTime>,
+        async_events: &AsyncEventQueue,
+    ) {
+        let mut slot = self.inner.get(handle as usize).map(|slot| slot.lock());
+        let Some(producer) = slot.as_deref_mut().and_then(Option::as_mut) else {
+            error!("invalid cq: {handle}");
+            return;
+        };
+        if producer.push_reported(completion, reported) {
+            sdt_probe!("completion", completion.qpn(), handle);
+            producer.notify.completed(solicited);
+        } else {
+            error!("cq {handle} overrun, completion dropped: {completion:?}");
+            self.counters.add(completion.qpn(), Counter::CqOverruns, 1);
+            async_events.push(AsyncEvent::CqErr { handle });
         }
     }
+}
+
+/// Consumer side of all CQs, owned by the verbs context
+pub(crate) struct CompletionQueueTable {
+    inner: Box<[Option<CompletionQueue>]>,
+}
 
-    pub(crate) fn clone_arc(&self) -> Self {
+impl CompletionQueueTable {
+    pub(crate) fn new() -> Self {
         Self {
-            inner: Arc::clone(&self.inner),
+            inner: iter::repeat_with(|| None).take(MAX_CQ_CNT).collect(),
+        }
+    }
+
+    pub(crate) fn insert(&mut self, handle: u32, cq: CompletionQueue) {
+        if let Some(slot) = self.inner.get_mut(handle as usize) {
+            *slot = Some(cq);
         }
     }
 
-    pub(crate) fn get_cq(&self, handle: u32) -> Option<&CompletionQueue> {
-        self.inner.get(handle as usize)
+    pub(crate) fn remove(&mut self, handle: u32) -> Option<CompletionQueue> {
+        self.inner.get_mut(handle as usize).and_then(Option::take)
+    }
+
+    pub(crate) fn get_cq_mut(&mut self, handle: u32) -> Option<&mut CompletionQueue> {
+        self.inner.get_mut(handle as usize).and_then(Option::as_mut)
+    }
+
+    pub(crate) fn iter(&self) -> impl Iterator<Item = &CompletionQueue> {
+        self.inner.iter().flatten()
     }
 }
 
-#[derive(Default)]
+/// Consumer side of a completion queue
 pub(crate) struct CompletionQueue {
-    inner: SegQueue<Completion>,
+    inner: ConsumerRing,
+    /// Seal of `inner`, set by the producer once it moved to a newer ring
+    sealed: Arc<AtomicBool>,
+    /// Rings left by `resize` that may still hold completions, oldest first. They are
+    /// drained before `inner`, so the completions keep their order.
+    retired: VecDeque<RetiredRing>,
+    overrun: Arc<AtomicBool>,
+    /// Notification state shared with the producer
+    notify: Arc<CqNotify>,
+    capacity: usize,
 }
 
 impl CompletionQueue {
-    pub(crate) fn push_back(&self, event: Completion) {
-        self.inner.push(event);
+    pub(crate) fn pop_front(&mut self) -> Option<Completion> {
+        self.pop_slot().map(|slot| slot.completion)
     }
 
-    pub(crate) fn pop_front(&self) -> Option<Completion> {
+    /// Pops the next slot, along with its timestamp
+    pub(crate) fn pop_slot(&mut self) -> Option<CqSlot> {
+        while let Some(retired) = self.retired.front_mut() {
+            if let Some(slot) = retired.ring.pop() {
+                return Some(slot);
+            }
+            // The completions pushed before the seal are visible once it is seen
+            if !retired.sealed.load(Ordering::Acquire) {
+                return None;
+            }
+            if let Some(slot) = retired.ring.pop() {
+                return Some(slot);
+            }
+            let _drained = self.retired.pop_front();
+        }
         self.inner.pop()
     }
+
+    /// Pops completions directly into the given work completion array.
+    ///
+    /// Returns the number of entries written.
+    pub(crate) fn poll_into(&mut self, wc: &mut [ibverbs_sys::ibv_wc]) -> usize {
+        if !self.retired.is_empty() {
+            let mut n = 0;
+            for entry in wc.iter_mut() {
+                let Some(slot) = self.pop_slot() else {
+                    break;
+                };
+                slot.completion.fill_wc(entry);
+                n += 1;
+            }
+            return n;
+        }
+        let slots = match self.inner {
+            ConsumerRing::Slots(ref mut slots) => slots,
+            ConsumerRing::Shared(ref ring) => return ring.poll_into(wc),
+        };
+        let n = slots.slots().min(wc.len());
+        if n == 0 {
+            return 0;
+        }
+        let Ok(chunk) = slots.read_chunk(n) else {
+            return 0;
+        };
+        for (entry, slot) in wc.iter_mut().zip(chunk) {
+            slot.completion.fill_wc(entry);
+            slot.pushed.record(Stage::PollCq);
+        }
+        n
+    }
+
+    /// Returns the number of entries the CQ can hold
+    pub(crate) fn capacity(&self) -> usize {
+        self.capacity
+    }
+
+    /// Moves the CQ to a new ring of at least `cqe` entries, returns the producer of the
+    /// ring to hand to the `CompletionWorker` with `CompletionTask::ResizeCq`.
+    ///
+    /// The completions pushed until the worker moves to the new ring are still polled,
+    /// before those of the new ring. A CQ polled in place by the C provider is polled
+    /// through the driver from now on, the provider keeps the address of its ring. Returns
+    /// `None` if `cqe` exceeds `MAX_CQE`.
+    pub(crate) fn resize(&mut self, handle: u32, cqe: usize) -> Option<CqProducer> {
+        let capacity = cq_capacity(cqe)?;
+        if let ConsumerRing::Shared(ref ring) = self.inner {
+            ring.poll_through_driver();
+        }
+        let (producer, consumer) = rtrb::RingBuffer::new(capacity);
+        let sealed = Arc::new(AtomicBool::new(false));
+        self.retired.push_back(RetiredRing {
+            ring: mem::replace(&mut self.inner, ConsumerRing::Slots(consumer)),
+            sealed: mem::replace(&mut self.sealed, Arc::clone(&sealed)),
+        });
+        self.capacity = capacity;
+        Some(CqProducer {
+            handle,
+            inner: ProducerRing::Slots(producer),
+            sealed,
+            overrun: Arc::clone(&self.overrun),
+            notify: Arc::clone(&self.notify),
+            timestamps: false,
+        })
+    }
+
+    /// Returns the bytes of the ring of the CQ
+    pub(crate) fn ring_bytes(&self) -> usize {
+        match self.inner {
+            ConsumerRing::Slots(_) => self.capacity * size_of::<CqSlot>(),
+            ConsumerRing::Shared(ref ring) => ring.capacity() * size_of::<ibverbs_sys::ibv_wc>(),
+        }
+    }
+
+    /// Returns `true` if completions were dropped because the CQ was full
+    pub(crate) fn is_overrun(&self) -> bool {
+        self.overrun.load(Ordering::Acquire)
+    }
+
+    /// Returns the notification state of the CQ
+    pub(crate) fn notify(&self) -> &CqNotify {
+        &self.notify
+    }
+
+    /// Returns the notification state of the CQ, shared with the `CqModerator`
+    pub(crate) fn shared_notify(&self) -> &Arc<CqNotify> {
+        &self.notify
+    }
+
+    /// Returns the ring polled in place by the C provider, if the CQ has one
+    pub(crate) fn shared_ring(&self) -> Option<&Arc<WcRing>> {
+        match self.inner {
+            ConsumerRing::Slots(_) => None,
+            ConsumerRing::Shared(ref ring) => Some(ring),
+        }
+    }
 }
 
-#[derive(Debug, Clone, Copy)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub(crate) enum Completion {
-    Send { wr_id: u64 },
-    RdmaWrite { wr_id: u64 },
-    RdmaRead { wr_id: u64 },
-    Recv { wr_id: u64, imm: Option<u32> },
-    RecvRdmaWithImm { imm: u32 },
+    Send {
+        qpn: u32,
+        wr_id: u64,
+    },
+    RdmaWrite {
+        qpn: u32,
+        wr_id: u64,
+    },
+    RdmaRead {
+        qpn: u32,
+        wr_id: u64,
+    },
+    CompSwap {
+        qpn: u32,
+        wr_id: u64,
+    },
+    FetchAdd {
+        qpn: u32,
+        wr_id: u64,
+    },
+    AtomicWrite {
+        qpn: u32,
+        wr_id: u64,
+    },
+    Flush {
+        qpn: u32,
+        wr_id: u64,
+    },
+    BindMw {
+        qpn: u32,
+        wr_id: u64,
+    },
+    LocalInv {
+        qpn: u32,
+        wr_id: u64,
+    },
+    Recv {
+        qpn: u32,
+        wr_id: u64,
+        imm: Option<u32>,
+        byte_len: u32,
+        /// Offset of the message in the receive buffer, non-zero only with striding
+        offset: u32,
+    },
+    RecvRdmaWithImm {
+        qpn: u32,
+        imm: u32,
+        byte_len: u32,
+    },
+    /// Receive of a UD QP, `byte_len` includes the GRH
+    RecvDatagram {
+        qpn: u32,
+        wr_id: u64,
+        imm: Option<u32>,
+        byte_len: u32,
+        src_qp: u32,
+    },
 }
 
 impl Completion {
@@ -492,12 +1564,188 @@ impl Completion {
             Completion::Send { .. } => ibverbs_sys::ibv_wc_opcode::IBV_WC_SEND,
             Completion::RdmaWrite { .. } => ibverbs_sys::ibv_wc_opcode::IBV_WC_RDMA_WRITE,
             Completion::RdmaRead { .. } => ibverbs_sys::ibv_wc_opcode::IBV_WC_RDMA_READ,
-            Completion::Recv { .. } => ibverbs_sys::ibv_wc_opcode::IBV_WC_RECV,
+            Completion::CompSwap { .. } => ibverbs_sys::ibv_wc_opcode::IBV_WC_COMP_SWAP,
+            Completion::FetchAdd { .. } => ibverbs_sys::ibv_wc_opcode::IBV_WC_FETCH_ADD,
+            Completion::AtomicWrite { .. } => ibverbs_sys::ibv_wc_opcode::IBV_WC_ATOMIC_WRITE,
+            Completion::Flush { .. } => ibverbs_sys::ibv_wc_opcode::IBV_WC_FLUSH,
+            Completion::BindMw { .. } => ibverbs_sys::ibv_wc_opcode::IBV_WC_BIND_MW,
+            Completion::LocalInv { .. } => ibverbs_sys::ibv_wc_opcode::IBV_WC_LOCAL_INV,
+            Completion::Recv { .. } | Completion::RecvDatagram { .. } => {
+                ibverbs_sys::ibv_wc_opcode::IBV_WC_RECV
+            }
             Completion::RecvRdmaWithImm { .. } => {
                 ibverbs_sys::ibv_wc_opcode::IBV_WC_RECV_RDMA_WITH_IMM
             }
         }
     }
+
+    /// Converts back a work completion written by `fill_wc`
+    #[allow(unsafe_code)]
+    fn from_wc(wc: &ibverbs_sys::ibv_wc) -> Option<Self> {
+        let qpn = wc.qp_num;
+        let wr_id = wc.wr_id;
+        let byte_len = wc.byte_len;
+        let imm = (wc.wc_flags & ibverbs_sys::ibv_wc_flags::IBV_WC_WITH_IMM.0 != 0)
+            // SAFETY: `fill_wc` writes the immediate data along with the flag
+            .then(|| unsafe { wc.__bindgen_anon_1.imm_data });
+        match wc.opcode {
+            ibverbs_sys::ibv_wc_opcode::IBV_WC_SEND => Some(Completion::Send { qpn, wr_id }),
+            ibverbs_sys::ibv_wc_opcode::IBV_WC_RDMA_WRITE => {
+                Some(Completion::RdmaWrite { qpn, wr_id })
+            }
+            ibverbs_sys::ibv_wc_opcode::IBV_WC_RDMA_READ => {
+                Some(Completion::RdmaRead { qpn, wr_id })
+            }
+            ibverbs_sys::ibv_wc_opcode::IBV_WC_COMP_SWAP => {
+                Some(Completion::CompSwap { qpn, wr_id })
+            }
+            ibverbs_sys::ibv_wc_opcode::IBV_WC_FETCH_ADD => {
+                Some(Completion::FetchAdd { qpn, wr_id })
+            }
+            ibverbs_sys::ibv_wc_opcode::IBV_WC_ATOMIC_WRITE => {
+                Some(Completion::AtomicWrite { qpn, wr_id })
+            }
+            ibverbs_sys::ibv_wc_opcode::IBV_WC_FLUSH => Some(Completion::Flush { qpn, wr_id }),
+            ibverbs_sys::ibv_wc_opcode::IBV_WC_BIND_MW => Some(Completion::BindMw { qpn, wr_id }),
+            ibverbs_sys::ibv_wc_opcode::IBV_WC_LOCAL_INV => {
+                Some(Completion::LocalInv { qpn, wr_id })
+            }
+            ibverbs_sys::ibv_wc_opcode::IBV_WC_RECV
+                if wc.wc_flags & ibverbs_sys::ibv_wc_flags::IBV_WC_GRH.0 != 0 =>
+            {
+                Some(Completion::RecvDatagram {
+                    qpn,
+                    wr_id,
+                    imm,
+                    byte_len,
+                    src_qp: wc.src_qp,
+                })
+            }
+            ibverbs_sys::ibv_wc_opcode::IBV_WC_RECV => Some(Completion::Recv {
+                qpn,
+                wr_id,
+                imm,
+                byte_len,
+                offset: wc.src_qp,
+            }),
+            ibverbs_sys::ibv_wc_opcode::IBV_WC_RECV_RDMA_WITH_IMM => {
+                Some(Completion::RecvRdmaWithImm {
+                    qpn,
+                    imm: imm.unwrap_or(0),
+                    byte_len,
+                })
+            }
+            _ => None,
+        }
+    }
+
+    /// Returns the QPN, the WR ID, the immediate data and the byte length of the completion
+    fn fields(&self) -> (u32, u64, Option<u32>, u32) {
+        match *self {
+            Completion::Send { qpn, wr_id }
+            | Completion::RdmaWrite { qpn, wr_id }
+            | Completion::RdmaRead { qpn, wr_id }
+            | Completion::CompSwap { qpn, wr_id }
+            | Completion::FetchAdd { qpn, wr_id }
+            | Completion::AtomicWrite { qpn, wr_id }
+            | Completion::Flush { qpn, wr_id }
+            | Completion::BindMw { qpn, wr_id }
+            | Completion::LocalInv { qpn, wr_id } => (qpn, wr_id, None, 0),
+            Completion::Recv {
+                qpn,
+                wr_id,
+                imm,
+                byte_len,
+                ..
+            }
+            | Completion::RecvDatagram {
+                qpn,
+                wr_id,
+                imm,
+                byte_len,
+                ..
+            } => (qpn, wr_id, imm, byte_len),
+            Completion::RecvRdmaWithImm { qpn, imm, byte_len } => (qpn, 0, Some(imm), byte_len),
+        }
+    }
+
+    pub(crate) fn qpn(&self) -> u32 {
+        self.fields().0
+    }
+
+    pub(crate) fn wr_id(&self) -> u64 {
+        self.fields().1
+    }
+
+    pub(crate) fn imm(&self) -> Option<u32> {
+        self.fields().2
+    }
+
+    pub(crate) fn byte_len(&self) -> u32 {
+        self.fields().3
+    }
+
+    /// Returns the completion as reported to the user of the QP `qp_attr`, the completions of
+    /// a DC context report the DC QP
+    pub(crate) fn reported_by(self, qp_attr: &QpAttr) -> Self {
+        let Some(owner) = qp_attr.owner_qpn else {
+            return self;
+        };
+        let mut completion = self;
+        match completion {
+            Completion::Send { ref mut qpn, .. }
+            | Completion::RdmaWrite { ref mut qpn, .. }
+            | Completion::RdmaRead { ref mut qpn, .. }
+            | Completion::CompSwap { ref mut qpn, .. }
+            | Completion::FetchAdd { ref mut qpn, .. }
+            | Completion::AtomicWrite { ref mut qpn, .. }
+            | Completion::Flush { ref mut qpn, .. }
+            | Completion::BindMw { ref mut qpn, .. }
+            | Completion::LocalInv { ref mut qpn, .. }
+            | Completion::Recv { ref mut qpn, .. }
+            | Completion::RecvRdmaWithImm { ref mut qpn, .. }
+            | Completion::RecvDatagram { ref mut qpn, .. } => *qpn = owner,
+        }
+        completion
+    }
+
+    /// Returns the source QPN of a UD receive, the offset of the message in the buffer of a
+    /// striding receive, 0 for other completions
+    pub(crate) fn src_qp(&self) -> u32 {
+        match *self {
+            Completion::RecvDatagram { src_qp, .. } => src_qp,
+            Completion::Recv { offset, .. } => offset,
+            _ => 0,
+        }
+    }
+
+    /// Returns the `ibv_wc_flags` of the completion
+    pub(crate) fn wc_flags(&self) -> u32 {
+        let mut flags = 0;
+        if self.imm().is_some() {
+            flags |= ibverbs_sys::ibv_wc_flags::IBV_WC_WITH_IMM.0;
+        }
+        if matches!(self, Completion::RecvDatagram { .. }) {
+            flags |= ibverbs_sys::ibv_wc_flags::IBV_WC_GRH.0;
+        }
+        flags
+    }
+
+    /// Writes this completion into an `ibv_wc`, all fields that we report are overwritten.
+    pub(crate) fn fill_wc(&self, wc: &mut ibverbs_sys::ibv_wc) {
+        let (qpn, wr_id, imm, byte_len) = self.fields();
+        wc.wr_id = wr_id;
+        wc.status = ibverbs_sys::ibv_wc_status::IBV_WC_SUCCESS;
+        wc.opcode = self.opcode();
+        wc.vendor_err = 0;
+        wc.byte_len = byte_len;
+        wc.qp_num = qpn;
+        wc.src_qp = self.src_qp();
+        if let Some(imm) = imm {
+            wc.__bindgen_anon_1.imm_data = imm;
+        }
+        wc.wc_flags = self.wc_flags();
+    }
 }
 
 /// Manages CQs
@@ -530,4 +1778,303 @@ impl CqManager {
 
         ret
     }
+
+    /// Returns `true` if no CQ is allocated
+    pub(crate) fn is_empty(&self) -> bool {
+        self.bitmap.not_any()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    #[allow(clippy::unwrap_used)]
+    fn pulled_sends_complete_their_recv_wrs() {
+        let mut tracker = QueuePairMessageTracker::default();
+        tracker.append(Event::PostRecv(PostRecvEvent::new(1, 10, 0x1000, 4096)));
+        tracker.append(Event::PostRecv(PostRecvEvent::new(1, 11, 0x2000, 4096)));
+        let op = SendEventOp::Pull {
+            addr: 0x2000,
+            len: 64,
+        };
+        tracker.append(Event::Send(SendEvent::new(
+            1,
+            op,
+            MessageMeta::new(0, Psn(1)),
+            0,
+        )));
+        tracker.ack_send(Psn(1), false);
+        // the read response has not arrived yet
+        assert!(tracker.poll_send_completion().is_none());
+        tracker.append(Event::Recv(RecvEvent::new(
+            1,
+            RecvEventOp::ReadResp,
+            MessageMeta::new(0, Psn(1)),
+            false,
+        )));
+        tracker.ack_recv(Psn(1));
+        let (_event, completion) = tracker.poll_send_completion().unwrap();
+        assert_eq!(
+            completion,
+            Some(Completion::Recv {
+                qpn: 1,
+                wr_id: 11,
+                imm: None,
+                byte_len: 64,
+                offset: 0,
+            })
+        );
+        assert_eq!(tracker.post_recv_queue.front().map(|x| x.wr_id), Some(10));
+        assert!(tracker.poll_send_completion().is_none());
+    }
+
+    #[test]
+    #[allow(clippy::unwrap_used)]
+    fn relaxed_writes_complete_ahead_of_a_missing_one() {
+        let mut tracker = QueuePairMessageTracker::default();
+        for (msn, first_psn) in [(0, Psn(0)), (1, Psn(2))] {
+            let event = SendEvent::new(
+                1,
+                SendEventOp::WriteSignaled,
+                MessageMeta::new(msn, first_psn + 2),
+                msn.into(),
+            );
+            tracker.append(Event::Send(event.with_first_psn(first_psn)));
+        }
+        tracker.ack_send(Psn(0), true);
+        assert!(tracker.poll_early_send_completion().is_none());
+        // the PSNs of the first write are missing
+        tracker.ack_send_bitmap(Psn(0), 0b1100);
+        assert_eq!(
+            tracker.poll_early_send_completion(),
+            Some(Completion::RdmaWrite { qpn: 1, wr_id: 1 })
+        );
+        assert!(tracker.poll_early_send_completion().is_none());
+        assert!(tracker.poll_send_completion().is_none());
+        tracker.ack_send(Psn(4), true);
+        let (_event, completion) = tracker.poll_send_completion().unwrap();
+        assert_eq!(completion, Some(Completion::RdmaWrite { qpn: 1, wr_id: 0 }));
+        let (_event, completion) = tracker.poll_send_completion().unwrap();
+        assert!(completion.is_none());
+    }
+
+    #[test]
+    fn messages_complete_in_msn_order_whatever_their_arrival() {
+        // the MSNs wrap and outgrow the first slots of the ring
+        let send = |i: u16| {
+            SendEvent::new(
+                1,
+                SendEventOp::WriteSignaled,
+                MessageMeta::new(i.wrapping_sub(100), Psn(u32::from(i) + 1)),
+                i.into(),
+            )
+        };
+        let mut tracker = MessageTracker::default();
+        let late = 170;
+        let order = (1..200).rev().step_by(2).chain((0..200).step_by(2));
+        for i in order.filter(|&i| i != late) {
+            assert!(!tracker.append(send(i)));
+        }
+        assert!(!tracker.append(send(0)));
+        let mut popped = Vec::new();
+        tracker.ack(Psn(151), |_| {});
+        while let Some(event) = tracker.pop() {
+            popped.push(event.wr_id);
+        }
+        assert_eq!(popped, (0..=150).collect::<Vec<_>>());
+        popped.clear();
+        tracker.ack(Psn(200), |_| {});
+        while let Some(event) = tracker.pop() {
+            popped.push(event.wr_id);
+        }
+        let expected: Vec<_> = (151..200).filter(|&i| i != u64::from(late)).collect();
+        assert_eq!(popped, expected);
+        // a message registered after the later ones completed is acked at once
+        assert!(tracker.append(send(late)));
+        assert_eq!(tracker.pop().map(|e| e.wr_id), Some(late.into()));
+        assert!(tracker.pop().is_none());
+    }
+
+    #[test]
+    fn striding_recvs_report_their_offsets() {
+        let mut tracker = QueuePairMessageTracker::with_stride(64);
+        tracker.append(Event::PostRecv(PostRecvEvent::new(1, 10, 0x1000, 256)));
+        tracker.append(Event::PostRecv(PostRecvEvent::new(1, 11, 0x2000, 256)));
+        for (msn, len) in [(1_u16, 8), (2, 64), (3, 150), (4, 0)] {
+            tracker.append(Event::Recv(RecvEvent::new(
+                1,
+                RecvEventOp::Recv { len },
+                MessageMeta::new(msn, Psn(msn.into())),
+                false,
+            )));
+        }
+        tracker.ack_recv(Psn(5));
+        let mut recvs = Vec::new();
+        while let Some((_event, completion)) = tracker.poll_recv_completion() {
+            if let Some(Completion::Recv { wr_id, offset, .. }) = completion {
+                recvs.push((wr_id, offset));
+            }
+        }
+        // the 150 byte message does not fit in the last 128 bytes of the first WR
+        assert_eq!(recvs, [(10, 0), (10, 64), (11, 0), (11, 192)]);
+        assert!(tracker.post_recv_queue.is_empty());
+    }
+
+    #[test]
+    #[allow(unsafe_code)]
+    fn poll_into_fills_work_completions() {
+        let (mut producer, mut cq) = completion_queue(0, 4).unwrap();
+        assert!(producer.push(Completion::RdmaWrite { qpn: 1, wr_id: 10 }));
+        assert!(producer.push(Completion::Recv {
+            qpn: 2,
+            wr_id: 11,
+            imm: Some(0xdead),
+            byte_len: 4096,
+            offset: 0,
+        }));
+        assert!(producer.push(Completion::Send { qpn: 3, wr_id: 12 }));
+
+        let mut wc = [ibverbs_sys::ibv_wc::default(); 2];
+        assert_eq!(cq.poll_into(&mut wc), 2);
+        assert_eq!(wc[0].wr_id, 10);
+        assert_eq!(wc[0].qp_num, 1);
+        assert_eq!(wc[0].wc_flags, 0);
+        assert_eq!(wc[0].opcode, ibverbs_sys::ibv_wc_opcode::IBV_WC_RDMA_WRITE);
+        assert_eq!(wc[1].wr_id, 11);
+        assert_eq!(wc[1].qp_num, 2);
+        assert_eq!(wc[1].byte_len, 4096);
+        assert_eq!(
+            wc[1].wc_flags,
+            ibverbs_sys::ibv_wc_flags::IBV_WC_WITH_IMM.0
+        );
+        assert_eq!(unsafe { wc[1].__bindgen_anon_1.imm_data }, 0xdead);
+
+        let mut wc = [ibverbs_sys::ibv_wc::default(); 4];
+        assert_eq!(cq.poll_into(&mut wc), 1);
+        assert_eq!(wc[0].qp_num, 3);
+        assert_eq!(cq.poll_into(&mut wc), 0);
+    }
+
+    #[test]
+    fn shared_queue_round_trips_completions() {
+        let (mut producer, mut cq) = shared_completion_queue(0, 4).unwrap();
+        assert_eq!(cq.shared_ring().unwrap().capacity(), cq.capacity());
+        assert!(producer.push(Completion::Recv {
+            qpn: 2,
+            wr_id: 11,
+            imm: Some(0xdead),
+            byte_len: 4096,
+            offset: 0,
+        }));
+        assert!(producer.push(Completion::RecvRdmaWithImm {
+            qpn: 3,
+            imm: 7,
+            byte_len: 8,
+        }));
+        assert!(producer.push(Completion::Send { qpn: 4, wr_id: 12 }));
+        assert!(matches!(
+            cq.pop_front(),
+            Some(Completion::Recv {
+                wr_id: 11,
+                imm: Some(0xdead),
+                byte_len: 4096,
+                ..
+            })
+        ));
+        assert!(matches!(
+            cq.pop_front(),
+            Some(Completion::RecvRdmaWithImm { qpn: 3, imm: 7, .. })
+        ));
+        let mut wc = [ibverbs_sys::ibv_wc::default(); 4];
+        assert_eq!(cq.poll_into(&mut wc), 1);
+        assert_eq!(wc.first().map(|x| x.qp_num), Some(4));
+    }
+
+    #[test]
+    fn completion_queue_capacity() {
+        let (_, cq) = completion_queue(0, 1).unwrap();
+        assert_eq!(cq.capacity(), MIN_CQE);
+        let (_, cq) = completion_queue(0, MIN_CQE + 1).unwrap();
+        assert_eq!(cq.capacity(), MIN_CQE * 2);
+        assert!(completion_queue(0, MAX_CQE + 1).is_none());
+    }
+
+    #[test]
+    fn resized_queue_keeps_the_order_of_completions() {
+        let (producer, mut cq) = shared_completion_queue(3, MIN_CQE).unwrap();
+        let mut table = CqProducerTable::new(Arc::new(DeviceCounters::new(4)));
+        table.insert(producer);
+        let events = AsyncEventQueue::new();
+        let push = |table: &mut CqProducerTable, wr_id| {
+            table.push(3, Completion::Send { qpn: 1, wr_id }, false, None, &events);
+        };
+        for wr_id in 0..MIN_CQE as u64 {
+            push(&mut table, wr_id);
+        }
+        let resized = cq.resize(3, MIN_CQE * 4).unwrap();
+        assert_eq!(cq.capacity(), MIN_CQE * 4);
+        assert!(cq.shared_ring().is_none());
+        assert!(matches!(
+            cq.pop_front(),
+            Some(Completion::Send { wr_id: 0, .. })
+        ));
+        // Pushed to the old ring until the worker moves to the new one
+        push(&mut table, MIN_CQE as u64);
+        table.resize(resized);
+        for wr_id in MIN_CQE as u64 + 1..MIN_CQE as u64 * 3 {
+            push(&mut table, wr_id);
+        }
+        assert!(!cq.is_overrun());
+        let mut wc = vec![ibverbs_sys::ibv_wc::default(); MIN_CQE * 4];
+        assert_eq!(cq.poll_into(&mut wc), MIN_CQE * 3 - 1);
+        assert!(wc
+            .iter()
+            .zip(1..MIN_CQE as u64 * 3)
+            .all(|(wc, wr_id)| wc.wr_id == wr_id));
+        assert!(cq.retired.is_empty());
+    }
+
+    #[test]
+    fn completion_queue_overrun() {
+        let (producer, mut cq) = completion_queue(7, MIN_CQE).unwrap();
+        let counters = Arc::new(DeviceCounters::new(4));
+        let mut table = CqProducerTable::new(Arc::clone(&counters));
+        table.insert(producer);
+        let events = AsyncEventQueue::new();
+        for wr_id in 0..=MIN_CQE as u64 {
+            table.push(7, Completion::Send { qpn: 1, wr_id }, false, None, &events);
+        }
+        assert!(cq.is_overrun());
+        assert_eq!(counters.read(), [0, 0, 0, 0, 0, 0, 1, 0]);
+        assert_eq!(events.pop(), Some(AsyncEvent::CqErr { handle: 7 }));
+        assert!(events.pop().is_none());
+        for wr_id in 0..MIN_CQE as u64 {
+            assert!(matches!(cq.pop_front(), Some(Completion::Send { wr_id: x, .. }) if x == wr_id));
+        }
+        assert!(cq.pop_front().is_none());
+    }
+
+    #[test]
+    fn timestamped_slots() {
+        let (mut producer, mut cq) = completion_queue(0, 4).unwrap();
+        assert!(producer.push(Completion::Send { qpn: 1, wr_id: 1 }));
+        producer.enable_timestamps();
+        let before = device_clock_ns();
+        assert!(producer.push(Completion::Send { qpn: 1, wr_id: 2 }));
+        assert!(producer.push(Completion::Send { qpn: 1, wr_id: 3 }));
+        assert_eq!(cq.pop_slot().unwrap().timestamp(), 0);
+        let first = cq.pop_slot().unwrap();
+        let second = cq.pop_slot().unwrap();
+        assert_eq!(first.completion().wr_id(), 2);
+        assert!(first.timestamp() >= before);
+        assert!(second.timestamp() >= first.timestamp());
+        assert!(cq.pop_slot().is_none());
+
+        // A reported completion carries the time of its report rather than of the push
+        let reported = ReportTime::now();
+        assert!(producer.push_reported(Completion::Send { qpn: 1, wr_id: 4 }, Some(reported)));
+        assert_eq!(cq.pop_slot().unwrap().timestamp(), reported.0);
+    }
 }
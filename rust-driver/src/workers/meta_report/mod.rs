@@ -2,63 +2,140 @@ mod types;
 mod worker;
 
 use std::{
-    io,
+    io, iter,
     sync::{atomic::AtomicBool, Arc},
 };
 
 use types::{MetaReportQueue, MetaReportQueueCtx, MetaReportQueueHandler};
-use worker::{MetaHandler, MetaWorker};
+use worker::MetaShard;
 
 use crate::{
-    csr::{mode::Mode, proxy::build_meta_report_queue_proxies, CsrBaseAddrAdaptor, DeviceAdaptor},
+    counters::DeviceCounters,
+    csr::{
+        irq::MetaInterrupts, proxy::build_meta_report_queue_proxies, CsrBaseAddrAdaptor,
+        DeviceAdaptor,
+    },
     mem::DmaBuf,
+    net::rendezvous::PendingPulls,
+    rdma_utils::{atomic::Atomics, snapshot::QpRecord},
     ringbuf::DescRingBuffer,
     workers::{
         ack_responder::AckResponse,
-        qp_timeout::AckTimeoutTask,
         completion::CompletionTask,
+        qp_timeout::QpActivity,
         rdma::RdmaWriteTask,
         retransmit::PacketRetransmitTask,
-        spawner::{AbortSignal, SingleThreadPollingWorker, TaskTx},
+        send::RateControl,
+        spawner::{
+            task_channel, AbortSignal, PollPolicy, Poller, SingleThreadPollingWorker, TaskTx,
+            WorkerAffinity,
+        },
     },
 };
 
 pub(crate) use types::*;
+pub(crate) use worker::{FusedWorkers, MetaHandler, MetaWorker};
 
 #[allow(clippy::too_many_arguments)]
 pub(crate) fn spawn<Dev>(
     dev: &Dev,
     pages: Vec<DmaBuf>,
-    mode: Mode,
+    depth: usize,
+    channel_ids: &[usize],
     ack_tx: TaskTx<AckResponse>,
-    retransmit_tx: TaskTx<AckTimeoutTask>,
+    activity: Arc<QpActivity>,
     packet_retransmit_tx: TaskTx<PacketRetransmitTask>,
     completion_tx: TaskTx<CompletionTask>,
     rdma_write_tx: TaskTx<RdmaWriteTask>,
+    rate: Arc<RateControl>,
+    counters: Arc<DeviceCounters>,
+    range_retransmit: bool,
+    native_read: bool,
+    atomics: Atomics,
+    pulls: PendingPulls,
+    psn_window: usize,
+    resumed: &[QpRecord],
+    fused: Option<FusedWorkers>,
+    per_channel: bool,
     abort: AbortSignal,
+    policy: PollPolicy,
+    interrupts: Option<&MetaInterrupts>,
+    affinity: &WorkerAffinity,
 ) -> io::Result<()>
 where
     Dev: Clone + DeviceAdaptor + Send + 'static,
 {
-    let mut mrq_proxies = build_meta_report_queue_proxies(dev.clone(), mode);
+    let mut mrq_proxies = build_meta_report_queue_proxies(dev.clone(), channel_ids);
     for (proxy, page) in mrq_proxies.iter_mut().zip(pages.iter()) {
         proxy.write_base_addr(page.phys_addr)?;
     }
     let ctxs: Vec<_> = pages
         .into_iter()
-        .map(|p| MetaReportQueue::new(DescRingBuffer::new(p.buf)))
+        .zip(channel_ids)
+        .map(|(p, id)| {
+            let ring =
+                DescRingBuffer::with_depth(p.buf, depth).recorded(format!("meta{id}"), false);
+            MetaReportQueue::new(ring)
+        })
         .zip(mrq_proxies)
         .map(|(q, p)| MetaReportQueueCtx::new(q, p))
         .collect();
 
-    let handler = MetaHandler::new(
-        ack_tx,
-        retransmit_tx,
-        packet_retransmit_tx,
-        completion_tx,
-        rdma_write_tx,
-    );
-    MetaWorker::new(MetaReportQueueHandler::new(ctxs), handler).spawn("MetaWorker", abort);
+    let new_handler = || {
+        MetaHandler::new(
+            ack_tx.clone(),
+            Arc::clone(&activity),
+            packet_retransmit_tx.clone(),
+            completion_tx.clone(),
+            rdma_write_tx.clone(),
+            Arc::clone(&rate),
+            Arc::clone(&counters),
+            range_retransmit,
+            native_read,
+            atomics.clone(),
+            pulls.clone(),
+            psn_window,
+        )
+        .resume(resumed, psn_window)
+    };
+    // Metas are produced by the device, a parked `MetaWorker` is only woken up by the timeout,
+    // or by the interrupts of its channels
+    let new_poller = |channel_ids: &[usize]| -> io::Result<Poller> {
+        Ok(match interrupts {
+            Some(x) => Poller::with_interrupt(policy, Box::new(x.bind(channel_ids)?)),
+            None => Poller::new(policy),
+        })
+    };
+    // The fused pipeline owns the CQ producers, it can't be split across channels
+    if !per_channel || fused.is_some() || ctxs.len() == 1 {
+        MetaWorker::new(MetaReportQueueHandler::new(ctxs), new_handler(), fused).spawn(
+            "MetaWorker",
+            abort,
+            new_poller(channel_ids)?,
+            affinity,
+        );
+        return Ok(());
+    }
+
+    let num_workers = ctxs.len();
+    let (txs, rxs): (Vec<_>, Vec<_>) = iter::repeat_with(task_channel).take(num_workers).unzip();
+    let pollers = channel_ids
+        .iter()
+        .take(num_workers)
+        .map(|&id| new_poller(&[id]))
+        .collect::<io::Result<Vec<_>>>()?;
+    let peers: Vec<_> = txs.into_iter().zip(pollers.iter().cloned()).collect();
+    for (index, ((ctx, rx), poller)) in ctxs.into_iter().zip(rxs).zip(pollers).enumerate() {
+        let shard = MetaShard::new(index, rx, peers.clone());
+        MetaWorker::new(MetaReportQueueHandler::new(vec![ctx]), new_handler(), None)
+            .with_shard(shard)
+            .spawn(
+                &format!("MetaWorker{index}"),
+                abort.clone(),
+                poller,
+                affinity,
+            );
+    }
 
     Ok(())
 }
@@ -1,19 +1,19 @@
-use std::io;
+use std::{collections::VecDeque, io};
 
-use log::{error, debug};
+use log::{debug, error, log_enabled, Level};
 
 use crate::{
-    constants::PSN_MASK,
+    constants::{META_REPORT_BURST, PSN_MASK},
     csr::{proxy::MetaReportQueueProxy, CsrReaderAdaptor},
-    rdma_utils::psn::Psn,
-    ringbuf::DescRingBuffer,
+    rdma_utils::{atomic::AtomicOperands, psn::Psn},
+    ringbuf::{DescDeserialize, DescRingBuffer},
 };
 
 use crate::{
     csr::{mode::Mode, proxy::build_meta_report_queue_proxies, CsrBaseAddrAdaptor, DeviceAdaptor},
     descriptors::{
-        MetaReportQueueAckDesc, MetaReportQueueAckExtraDesc, MetaReportQueueDescFirst,
-        MetaReportQueueDescNext, MetaReportQueuePacketBasicInfoDesc,
+        MetaClass, MetaReportQueueAckDesc, MetaReportQueueAckExtraDesc,
+        MetaReportQueueAtomicReqExtendInfoDesc, MetaReportQueuePacketBasicInfoDesc,
         MetaReportQueueReadReqExtendInfoDesc,
     },
     mem::DmaBuf,
@@ -40,134 +40,55 @@ pub(crate) struct MetaReportQueueHandler<Dev> {
     inner: Vec<MetaReportQueueCtx<Dev>>,
     /// Current position, used for round robin polling
     pos: usize,
+    /// Metas of the last burst not yet returned
+    pending: VecDeque<ReportMeta>,
 }
 
 impl<Dev> MetaReportQueueHandler<Dev> {
     pub(crate) fn new(inner: Vec<MetaReportQueueCtx<Dev>>) -> Self {
-        Self { inner, pos: 0 }
-    }
-
-    fn remap_psn(psn: Psn) -> Psn {
-        // 128 (window size) - 16 (first stride)
-        const OFFSET: u32 = 112;
-        psn - OFFSET
+        Self {
+            inner,
+            pos: 0,
+            pending: VecDeque::with_capacity(META_REPORT_BURST),
+        }
     }
 }
 
 impl<Dev: DeviceAdaptor> MetaReportQueueHandler<Dev> {
+    /// Returns the next meta, descriptors are drained from the queues in bursts of up to
+    /// `META_REPORT_BURST` and the tail is written back once per burst
     #[allow(clippy::arithmetic_side_effects, clippy::indexing_slicing)] // should never overflow
     pub(crate) fn try_recv_meta(&mut self) -> Option<ReportMeta> {
+        if let Some(meta) = self.pending.pop_front() {
+            return Some(meta);
+        }
         let num_queues = self.inner.len();
+        let log_metas = log_enabled!(Level::Debug);
         for i in 0..num_queues {
             let idx = (self.pos + i) % num_queues;
             let ctx = &mut self.inner[idx];
-            let Some(desc) = ctx.queue.pop() else {
+            let pending = &mut self.pending;
+            let num = ctx.queue.pop_burst(META_REPORT_BURST, |meta| {
+                if log_metas {
+                    debug!("meta report queue {idx} got new desc: {meta:?}");
+                }
+                pending.push_back(meta);
+            });
+            if num == 0 {
                 continue;
-            };
+            }
             let _ignore = ctx.proxy.write_tail(ctx.queue.tail());
             if let Ok(head_ptr) = ctx.proxy.read_head() {
                 ctx.queue.set_head(head_ptr);
             }
 
             self.pos = (idx + 1) % num_queues;
-            let meta = match desc {
-                MetaReportQueueDesc::WritePacketInfo(d) => {
-                    ReportMeta::HeaderWrite(HeaderWriteMeta {
-                        pos: d.packet_pos(),
-                        msn: d.msn(),
-                        psn: d.psn().into(),
-                        solicited: d.solicited(),
-                        ack_req: d.ack_req(),
-                        is_retry: d.is_retry(),
-                        dqpn: d.dqpn(),
-                        total_len: d.total_len(),
-                        raddr: d.raddr(),
-                        rkey: d.rkey(),
-                        imm: d.imm_data(),
-                        header_type: d.header_type(),
-                    })
-                }
-                MetaReportQueueDesc::ReadPacketInfo((f, n)) => {
-                    ReportMeta::HeaderRead(HeaderReadMeta {
-                        dqpn: f.dqpn(),
-                        raddr: f.raddr(),
-                        rkey: f.rkey(),
-                        total_len: n.total_len(),
-                        laddr: n.laddr(),
-                        lkey: n.lkey(),
-                        ack_req: f.ack_req(),
-                        msn: f.msn(),
-                        psn: f.psn().into(),
-                    })
-                }
-                MetaReportQueueDesc::CnpPacketInfo(d) => ReportMeta::Cnp(CnpMeta { qpn: d.dqpn() }),
-                MetaReportQueueDesc::Ack(d) => {
-                    match (d.is_send_by_driver(), d.is_send_by_local_hw()) {
-                        (true, false) => ReportMeta::AckRemoteDriver(AckMetaRemoteDriver {
-                            qpn: d.qpn(),
-                            psn_now: d.psn_now().into(),
-                        }),
-                        (false, true) => ReportMeta::AckLocalHw(AckMetaLocalHw {
-                            qpn: d.qpn(),
-                            psn_now: Self::remap_psn(d.psn_now().into()),
-                            now_bitmap: d.now_bitmap(),
-                        }),
-                        (false, false) | (true, true) => unreachable!("invalid ack branch"),
-                    }
-                }
-                MetaReportQueueDesc::Nak((f, n)) => {
-                    match (f.is_send_by_driver(), f.is_send_by_local_hw()) {
-                        (true, false) => ReportMeta::NakRemoteDriver(NakMetaRemoteDriver {
-                            qpn: f.qpn(),
-                            psn_now: f.psn_now().into(),
-                            psn_pre: f.psn_before_slide().into(),
-                        }),
-                        (false, true) => ReportMeta::NakLocalHw(NakMetaLocalHw {
-                            qpn: f.qpn(),
-                            msn: f.msn(),
-                            psn_now: Self::remap_psn(f.psn_now().into()),
-                            now_bitmap: f.now_bitmap(),
-                            psn_pre: Self::remap_psn(f.psn_before_slide().into()),
-                            pre_bitmap: n.pre_bitmap(),
-                        }),
-                        (false, false) => ReportMeta::NakRemoteHw(NakMetaRemoteHw {
-                            qpn: f.qpn(),
-                            msn: f.msn(),
-                            psn_now: Self::remap_psn(f.psn_now().into()),
-                            now_bitmap: f.now_bitmap(),
-                            psn_pre: Self::remap_psn(f.psn_before_slide().into()),
-                            pre_bitmap: n.pre_bitmap(),
-                        }),
-                        (true, true) => unreachable!("invalid nak branch"),
-                    }
-                }
-            };
-            debug!("meta report queue {i} got new desc: {meta:?}");
-            return Some(meta);
+            return self.pending.pop_front();
         }
         None
     }
 }
 
-/// Meta report queue descriptors
-pub(crate) enum MetaReportQueueDesc {
-    /// Packet info for write operations
-    WritePacketInfo(MetaReportQueuePacketBasicInfoDesc),
-    /// Packet info for read operations
-    ReadPacketInfo(
-        (
-            MetaReportQueuePacketBasicInfoDesc,
-            MetaReportQueueReadReqExtendInfoDesc,
-        ),
-    ),
-    /// Packet info for congestion event
-    CnpPacketInfo(MetaReportQueuePacketBasicInfoDesc),
-    /// Ack
-    Ack(MetaReportQueueAckDesc),
-    /// Nak
-    Nak((MetaReportQueueAckDesc, MetaReportQueueAckExtraDesc)),
-}
-
 /// A transmit queue for the simple NIC device.
 pub(crate) struct MetaReportQueue {
     /// Inner ring buffer
@@ -180,34 +101,28 @@ impl MetaReportQueue {
     }
 
     /// Tries to poll next valid entry from the queue
-    pub(crate) fn pop(&mut self) -> Option<MetaReportQueueDesc> {
-        let (first, next) = self.inner.pop_two();
-        #[allow(clippy::wildcard_enum_match_arm)] // too verbose
-        match (first, next) {
-            (None, None) => None,
-            (Some(MetaReportQueueDescFirst::PacketInfo(d)), None) if d.ecn_marked() => {
-                Some(MetaReportQueueDesc::CnpPacketInfo(d))
-            }
-            (Some(MetaReportQueueDescFirst::PacketInfo(d)), None) => {
-                Some(MetaReportQueueDesc::WritePacketInfo(d))
-            }
-            (Some(MetaReportQueueDescFirst::Ack(d)), None) => Some(MetaReportQueueDesc::Ack(d)),
-            (
-                Some(MetaReportQueueDescFirst::PacketInfo(f)),
-                Some(MetaReportQueueDescNext::ReadInfo(n)),
-            ) => Some(MetaReportQueueDesc::ReadPacketInfo((f, n))),
-            (
-                Some(MetaReportQueueDescFirst::Ack(f)),
-                Some(MetaReportQueueDescNext::AckExtra(n)),
-            ) => Some(MetaReportQueueDesc::Nak((f, n))),
-            _ => {
-                unreachable!("invalid descriptor format")
-            }
+    pub(crate) fn pop(&mut self) -> Option<ReportMeta> {
+        match self.inner.pop_two() {
+            (Some(first), next) => Some(ReportMeta::decode(first, next)),
+            (None, _) => None,
         }
     }
 
+    /// Polls up to `max` valid reports from the queue
+    ///
+    /// # Returns
+    ///
+    /// The number of ring buffer entries consumed
+    pub(crate) fn pop_burst<F>(&mut self, max: usize, mut sink: F) -> usize
+    where
+        F: FnMut(ReportMeta),
+    {
+        self.inner
+            .pop_burst(max, |first, next| sink(ReportMeta::decode(first, next)))
+    }
+
     pub(crate) fn tail(&self) -> u32 {
-        self.inner.tail() as u32
+        self.inner.released() as u32
     }
 
     pub(crate) fn set_head(&mut self, head: u32) {
@@ -239,10 +154,14 @@ pub(crate) enum ReportMeta {
     HeaderWrite(HeaderWriteMeta),
     /// Read operation header
     HeaderRead(HeaderReadMeta),
+    /// Atomic operation header
+    HeaderAtomic(HeaderAtomicMeta),
     /// ACK generated by the local hardware
     AckLocalHw(AckMetaLocalHw),
     /// ACK generated by the remote driver
     AckRemoteDriver(AckMetaRemoteDriver),
+    /// Atomic ACK generated by the remote driver
+    AtomicAck(AtomicAckMeta),
     /// NAK generated by the local hardware
     NakLocalHw(NakMetaLocalHw),
     /// NAK generated by the remote hardware
@@ -258,14 +177,178 @@ impl ReportMeta {
         match *self {
             ReportMeta::HeaderWrite(x) => x.dqpn,
             ReportMeta::HeaderRead(x) => x.dqpn,
+            ReportMeta::HeaderAtomic(x) => x.dqpn,
             ReportMeta::AckLocalHw(x) => x.qpn,
             ReportMeta::AckRemoteDriver(x) => x.qpn,
+            ReportMeta::AtomicAck(x) => x.qpn,
             ReportMeta::NakLocalHw(x) => x.qpn,
             ReportMeta::NakRemoteHw(x) => x.qpn,
             ReportMeta::NakRemoteDriver(x) => x.qpn,
             ReportMeta::Cnp(x) => x.qpn,
         }
     }
+
+    /// Returns the PSN reported by the meta, `None` for a CNP
+    pub(crate) fn psn(&self) -> Option<Psn> {
+        match *self {
+            ReportMeta::HeaderWrite(x) => Some(x.psn),
+            ReportMeta::HeaderRead(x) => Some(x.psn),
+            ReportMeta::HeaderAtomic(x) => Some(x.psn),
+            ReportMeta::AckLocalHw(x) => Some(x.psn_now),
+            ReportMeta::AckRemoteDriver(x) => Some(x.psn_now),
+            ReportMeta::AtomicAck(x) => Some(x.psn_now),
+            ReportMeta::NakLocalHw(x) => Some(x.psn_now),
+            ReportMeta::NakRemoteHw(x) => Some(x.psn_now),
+            ReportMeta::NakRemoteDriver(x) => Some(x.psn_now),
+            ReportMeta::Cnp(_) => None,
+        }
+    }
+
+    /// Decodes the report made of the raw descriptor `first` and the descriptor after it if
+    /// the next bit of `first` is set
+    #[inline]
+    pub(crate) fn decode(first: [u8; 32], next: Option<[u8; 32]>) -> Self {
+        let class = MetaClass::of(&first, next.as_ref());
+        // Only read by the classes made of two descriptors
+        let next = next.unwrap_or_default();
+        match class {
+            MetaClass::Write => Self::header_write(DescDeserialize::deserialize(first)),
+            MetaClass::Cnp => Self::Cnp(CnpMeta {
+                qpn: MetaReportQueuePacketBasicInfoDesc::deserialize(first).dqpn(),
+            }),
+            MetaClass::Read => Self::header_read(
+                DescDeserialize::deserialize(first),
+                DescDeserialize::deserialize(next),
+            ),
+            MetaClass::Atomic => Self::header_atomic(
+                DescDeserialize::deserialize(first),
+                DescDeserialize::deserialize(next),
+            ),
+            MetaClass::AckRemoteDriver => {
+                let d = MetaReportQueueAckDesc::deserialize(first);
+                Self::AckRemoteDriver(AckMetaRemoteDriver {
+                    qpn: d.qpn(),
+                    psn_now: d.psn_now().into(),
+                })
+            }
+            MetaClass::AckLocalHw => {
+                let d = MetaReportQueueAckDesc::deserialize(first);
+                Self::AckLocalHw(AckMetaLocalHw {
+                    qpn: d.qpn(),
+                    psn_now: remap_psn(d.psn_now().into()),
+                    now_bitmap: d.now_bitmap(),
+                })
+            }
+            MetaClass::AtomicAck => Self::atomic_ack(
+                DescDeserialize::deserialize(first),
+                DescDeserialize::deserialize(next),
+            ),
+            MetaClass::NakRemoteDriver => {
+                let f = MetaReportQueueAckDesc::deserialize(first);
+                Self::NakRemoteDriver(NakMetaRemoteDriver {
+                    qpn: f.qpn(),
+                    psn_now: f.psn_now().into(),
+                    psn_pre: f.psn_before_slide().into(),
+                })
+            }
+            MetaClass::NakLocalHw => Self::nak_local_hw(
+                DescDeserialize::deserialize(first),
+                DescDeserialize::deserialize(next),
+            ),
+            MetaClass::NakRemoteHw => Self::nak_remote_hw(
+                DescDeserialize::deserialize(first),
+                DescDeserialize::deserialize(next),
+            ),
+            MetaClass::Invalid => unreachable!("invalid descriptor format"),
+        }
+    }
+
+    fn header_write(d: MetaReportQueuePacketBasicInfoDesc) -> Self {
+        Self::HeaderWrite(HeaderWriteMeta {
+            pos: d.packet_pos(),
+            msn: d.msn(),
+            psn: d.psn().into(),
+            solicited: d.solicited(),
+            ack_req: d.ack_req(),
+            is_retry: d.is_retry(),
+            dqpn: d.dqpn(),
+            total_len: d.total_len(),
+            raddr: d.raddr(),
+            rkey: d.rkey(),
+            imm: d.imm_data(),
+            header_type: d.header_type(),
+        })
+    }
+
+    fn header_read(
+        f: MetaReportQueuePacketBasicInfoDesc,
+        n: MetaReportQueueReadReqExtendInfoDesc,
+    ) -> Self {
+        Self::HeaderRead(HeaderReadMeta {
+            dqpn: f.dqpn(),
+            raddr: f.raddr(),
+            rkey: f.rkey(),
+            total_len: n.total_len(),
+            laddr: n.laddr(),
+            lkey: n.lkey(),
+            ack_req: f.ack_req(),
+            msn: f.msn(),
+            psn: f.psn().into(),
+        })
+    }
+
+    fn header_atomic(
+        f: MetaReportQueuePacketBasicInfoDesc,
+        n: MetaReportQueueAtomicReqExtendInfoDesc,
+    ) -> Self {
+        Self::HeaderAtomic(HeaderAtomicMeta {
+            msn: f.msn(),
+            psn: f.psn().into(),
+            dqpn: f.dqpn(),
+            raddr: f.raddr(),
+            rkey: f.rkey(),
+            is_retry: f.is_retry(),
+            header_type: f.header_type(),
+            operands: AtomicOperands::new(n.compare_add(), n.swap()),
+        })
+    }
+
+    fn atomic_ack(f: MetaReportQueueAckDesc, n: MetaReportQueueAckExtraDesc) -> Self {
+        Self::AtomicAck(AtomicAckMeta {
+            qpn: f.qpn(),
+            psn_now: f.psn_now().into(),
+            orig: n.pre_bitmap() as u64,
+        })
+    }
+
+    fn nak_local_hw(f: MetaReportQueueAckDesc, n: MetaReportQueueAckExtraDesc) -> Self {
+        Self::NakLocalHw(NakMetaLocalHw {
+            qpn: f.qpn(),
+            msn: f.msn(),
+            psn_now: remap_psn(f.psn_now().into()),
+            now_bitmap: f.now_bitmap(),
+            psn_pre: remap_psn(f.psn_before_slide().into()),
+            pre_bitmap: n.pre_bitmap(),
+        })
+    }
+
+    fn nak_remote_hw(f: MetaReportQueueAckDesc, n: MetaReportQueueAckExtraDesc) -> Self {
+        Self::NakRemoteHw(NakMetaRemoteHw {
+            qpn: f.qpn(),
+            msn: f.msn(),
+            psn_now: remap_psn(f.psn_now().into()),
+            now_bitmap: f.now_bitmap(),
+            psn_pre: remap_psn(f.psn_before_slide().into()),
+            pre_bitmap: n.pre_bitmap(),
+        })
+    }
+}
+
+/// Maps a PSN of the ACK windows reported by the local hardware to the PSN of the QP
+fn remap_psn(psn: Psn) -> Psn {
+    // 128 (window size) - 16 (first stride)
+    const OFFSET: u32 = 112;
+    psn - OFFSET
 }
 
 #[derive(Debug, Clone, Copy)]
@@ -297,6 +380,18 @@ pub(crate) struct HeaderReadMeta {
     pub(crate) ack_req: bool,
 }
 
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct HeaderAtomicMeta {
+    pub(crate) msn: u16,
+    pub(crate) psn: Psn,
+    pub(crate) dqpn: u32,
+    pub(crate) raddr: u64,
+    pub(crate) rkey: u32,
+    pub(crate) is_retry: bool,
+    pub(crate) header_type: HeaderType,
+    pub(crate) operands: AtomicOperands,
+}
+
 #[derive(Debug, Clone, Copy)]
 pub(crate) struct CnpMeta {
     /// The initiator's QP number
@@ -316,6 +411,15 @@ pub(crate) struct AckMetaRemoteDriver {
     pub(crate) psn_now: Psn,
 }
 
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct AtomicAckMeta {
+    pub(crate) qpn: u32,
+    /// PSN after the atomic request
+    pub(crate) psn_now: Psn,
+    /// Value of the target before the operation
+    pub(crate) orig: u64,
+}
+
 #[derive(Debug, Clone, Copy)]
 pub(crate) struct NakMetaLocalHw {
     pub(crate) qpn: u32,
@@ -350,4 +454,8 @@ pub(crate) enum HeaderType {
     Send,
     SendWithImm,
     ReadResp,
+    CompareSwap,
+    FetchAdd,
+    Flush,
+    AtomicWrite,
 }
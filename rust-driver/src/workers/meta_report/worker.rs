@@ -1,4 +1,5 @@
 use std::{
+    collections::VecDeque,
     io,
     sync::{
         atomic::{fence, AtomicBool, Ordering},
@@ -11,40 +12,71 @@ use std::{
 use log::{debug, error};
 
 use crate::{
+    counters::{Counter, DeviceCounters},
     csr::DeviceAdaptor,
+    net::rendezvous::PendingPulls,
     rdma_utils::{
+        atomic::Atomics,
         psn::Psn,
         psn_tracker::{LocalAckTracker, RemoteAckTracker},
-        qp::QpTable,
+        qp::{qpn_to_index, QpTable},
+        snapshot::QpRecord,
         types::{SendWrBase, SendWrRdma},
     },
+    sdt::sdt_probe,
     workers::{
-        ack_responder::AckResponse,
-        completion::{CompletionTask, Event, MessageMeta, RecvEvent, RecvEventOp},
-        qp_timeout::AckTimeoutTask,
+        ack_responder::{AckResponder, AckResponse},
+        completion::{
+            CompletionTask, CompletionWorker, Event, MessageMeta, RecvEvent, RecvEventOp,
+        },
+        qp_timeout::QpActivity,
         rdma::RdmaWriteTask,
         retransmit::PacketRetransmitTask,
-        send::WorkReqOpCode,
-        spawner::{SingleThreadPollingWorker, TaskTx},
+        send::{RateControl, WorkReqOpCode},
+        spawner::{
+            Poller, SingleThreadPollingWorker, SingleThreadTaskWorker, TaskRx, TaskSource, TaskTx,
+        },
     },
 };
 
 use super::types::{
-    AckMetaLocalHw, AckMetaRemoteDriver, HeaderReadMeta, HeaderType, HeaderWriteMeta,
-    MetaReportQueueHandler, NakMetaLocalHw, NakMetaRemoteDriver, NakMetaRemoteHw, PacketPos,
-    ReportMeta,
+    AckMetaLocalHw, AckMetaRemoteDriver, AtomicAckMeta, CnpMeta, HeaderAtomicMeta, HeaderReadMeta,
+    HeaderType, HeaderWriteMeta, MetaReportQueueHandler, NakMetaLocalHw, NakMetaRemoteDriver,
+    NakMetaRemoteHw, PacketPos, ReportMeta,
 };
 
+/// Number of executed atomic requests of a QP whose replies are kept for their retries
+const ATOMIC_REPLAY_DEPTH: usize = 16;
+
 /// A worker for processing packet meta
 pub(crate) struct MetaWorker<Dev> {
     /// Inner meta report queue
     inner: MetaReportQueueHandler<Dev>,
     handler: MetaHandler,
+    /// Workers run inline after each meta in the run-to-completion pipeline
+    fused: Option<FusedWorkers>,
+    /// Routing of the metas when each channel has its own worker
+    shard: Option<MetaShard>,
 }
 
 impl<Dev> MetaWorker<Dev> {
-    pub(crate) fn new(inner: MetaReportQueueHandler<Dev>, handler: MetaHandler) -> Self {
-        Self { inner, handler }
+    pub(crate) fn new(
+        inner: MetaReportQueueHandler<Dev>,
+        handler: MetaHandler,
+        fused: Option<FusedWorkers>,
+    ) -> Self {
+        Self {
+            inner,
+            handler,
+            fused,
+            shard: None,
+        }
+    }
+
+    /// Makes the worker the owner of the QPs of `shard`
+    pub(crate) fn with_shard(mut self, shard: MetaShard) -> Self {
+        self.shard = Some(shard);
+        self
     }
 }
 
@@ -52,66 +84,260 @@ impl<Dev: DeviceAdaptor + Send + 'static> SingleThreadPollingWorker for MetaWork
     type Task = ReportMeta;
 
     fn poll(&mut self) -> Option<Self::Task> {
-        self.inner.try_recv_meta()
+        let Some(shard) = self.shard.as_ref() else {
+            let meta = self.inner.try_recv_meta();
+            if meta.is_none() {
+                // Picks up the tasks of the other producers, such as new CQs, while idle
+                if let Some(fused) = self.fused.as_mut() {
+                    fused.run();
+                }
+            }
+            return meta;
+        };
+        if let Some(meta) = shard.rx.try_recv() {
+            return Some(meta);
+        }
+        while let Some(meta) = self.inner.try_recv_meta() {
+            if let Some(meta) = shard.route(meta) {
+                return Some(meta);
+            }
+        }
+        None
     }
 
     fn process(&mut self, meta: Self::Task) {
         if self.handler.handle_meta(meta).is_none() {
             error!("invalid meta: {meta:?}");
         }
+        if let Some(fused) = self.fused.as_mut() {
+            fused.run();
+        }
+    }
+
+    /// The metas forwarded by the other workers, those of the ring are not counted
+    fn backlog(&self) -> usize {
+        self.shard.as_ref().map_or(0, |shard| shard.rx.len())
+    }
+}
+
+/// Routing of the metas between the per channel `MetaWorker`s.
+///
+/// The ACK trackers of a QP live in the `MetaHandler` of the worker owning it. A QP may change
+/// send channel, so its metas are not guaranteed to be reported on one channel, a meta polled
+/// by a worker that doesn't own its QP is forwarded to the owner.
+pub(crate) struct MetaShard {
+    index: usize,
+    /// Metas forwarded by the other workers
+    rx: TaskRx<ReportMeta>,
+    /// Forwarding channel and poller of each worker
+    peers: Vec<(TaskTx<ReportMeta>, Poller)>,
+}
+
+impl MetaShard {
+    pub(crate) fn new(
+        index: usize,
+        rx: TaskRx<ReportMeta>,
+        peers: Vec<(TaskTx<ReportMeta>, Poller)>,
+    ) -> Self {
+        Self { index, rx, peers }
+    }
+
+    /// Returns the index of the worker owning `qpn`
+    fn owner(&self, qpn: u32) -> usize {
+        qpn_to_index(qpn) % self.peers.len().max(1)
+    }
+
+    /// Returns the meta if the QP is owned by this worker, forwards it to its owner otherwise
+    fn route(&self, meta: ReportMeta) -> Option<ReportMeta> {
+        let owner = self.owner(meta.qpn());
+        if owner == self.index {
+            return Some(meta);
+        }
+        let (tx, poller) = self.peers.get(owner)?;
+        tx.send(meta);
+        poller.wake();
+        None
+    }
+}
+
+/// The `CompletionWorker` and the `AckResponder` of the run-to-completion pipeline.
+///
+/// They are run on the `MetaWorker` thread right after each meta, the tasks the meta produced
+/// are completed before the next meta is polled. The completion and ACK channels are still
+/// drained in order, so a WR registered by `WrPoster` before it was posted is tracked before
+/// the ACK of its meta. A CQ is fed by a single producer and may be shared by QPs of every
+/// channel, so the fused pipeline runs on the one `MetaWorker`.
+pub(crate) struct FusedWorkers {
+    completion: CompletionWorker,
+    completion_rx: TaskRx<CompletionTask>,
+    ack_responder: AckResponder,
+    ack_rx: TaskRx<AckResponse>,
+}
+
+impl FusedWorkers {
+    pub(crate) fn new(
+        completion: CompletionWorker,
+        completion_rx: TaskRx<CompletionTask>,
+        ack_responder: AckResponder,
+        ack_rx: TaskRx<AckResponse>,
+    ) -> Self {
+        Self {
+            completion,
+            completion_rx,
+            ack_responder,
+            ack_rx,
+        }
+    }
+
+    /// Processes the queued completion tasks, then the ACK responses they produced
+    fn run(&mut self) {
+        while let Some(task) = self.completion_rx.try_recv() {
+            self.completion.process(task);
+        }
+        while let Some(task) = self.ack_rx.try_recv() {
+            self.ack_responder.process(task);
+        }
+        self.ack_responder.maintainance();
+    }
+}
+
+/// PSN trackers of both directions of a QP, kept in a single entry so that a meta looks up
+/// one table
+#[derive(Default)]
+pub(super) struct QpAckTrackers {
+    /// PSNs of the sent packets acknowledged by the peer
+    pub(super) send: RemoteAckTracker,
+    /// PSNs of the packets received from the peer
+    pub(super) recv: LocalAckTracker,
+    /// Original values of the last atomic requests executed for the peer, by PSN, so that a
+    /// retried request is answered without being executed again
+    pub(super) atomic_replies: VecDeque<(Psn, u64)>,
+}
+
+impl QpAckTrackers {
+    /// Creates the trackers of a QP, each tracking a window of `psn_window` PSNs
+    fn new(psn_window: usize) -> Self {
+        Self {
+            send: RemoteAckTracker::new(psn_window),
+            recv: LocalAckTracker::new(psn_window),
+            atomic_replies: VecDeque::new(),
+        }
     }
 }
 
 pub(crate) struct MetaHandler {
-    pub(super) send_table: QpTable<RemoteAckTracker>,
-    pub(super) recv_table: QpTable<LocalAckTracker>,
+    pub(super) qps: QpTable<QpAckTrackers>,
     pub(super) ack_tx: TaskTx<AckResponse>,
-    pub(super) ack_timeout_tx: TaskTx<AckTimeoutTask>,
+    /// Time of the last meta of each QP, sampled by the ack timeout worker
+    pub(super) activity: Arc<QpActivity>,
     pub(super) packet_retransmit_tx: TaskTx<PacketRetransmitTask>,
     pub(super) completion_tx: TaskTx<CompletionTask>,
     pub(super) rdma_write_tx: TaskTx<RdmaWriteTask>,
+    /// Send rate limits cut by the CNPs
+    pub(super) rate: Arc<RateControl>,
+    /// Counters of the device, for the received NAKs
+    pub(super) counters: Arc<DeviceCounters>,
+    /// Replay the whole PSN range of a NAK instead of the PSNs missing from its bitmaps
+    pub(super) range_retransmit: bool,
+    /// The RDMA READ requests are served by the hardware responder, only their PSNs are
+    /// tracked here
+    pub(super) native_read: bool,
+    /// Targets of the atomic requests of the peers and results of the local atomic WRs
+    pub(super) atomics: Atomics,
+    /// Sends the peers were asked to read, completed by the responses to their reads
+    pub(super) pulls: PendingPulls,
 }
 
 impl MetaHandler {
     pub(crate) fn new(
         ack_tx: TaskTx<AckResponse>,
-        ack_timeout_tx: TaskTx<AckTimeoutTask>,
+        activity: Arc<QpActivity>,
         packet_retransmit_tx: TaskTx<PacketRetransmitTask>,
         completion_tx: TaskTx<CompletionTask>,
         rdma_write_tx: TaskTx<RdmaWriteTask>,
+        rate: Arc<RateControl>,
+        counters: Arc<DeviceCounters>,
+        range_retransmit: bool,
+        native_read: bool,
+        atomics: Atomics,
+        pulls: PendingPulls,
+        psn_window: usize,
     ) -> Self {
         Self {
-            send_table: QpTable::new(),
-            recv_table: QpTable::new(),
+            qps: QpTable::new_with(move || QpAckTrackers::new(psn_window)),
             ack_tx,
-            ack_timeout_tx,
+            activity,
             packet_retransmit_tx,
             completion_tx,
             rdma_write_tx,
+            rate,
+            counters,
+            range_retransmit,
+            native_read,
+            atomics,
+            pulls,
+        }
+    }
+
+    /// Starts the trackers of the QPs restored from a snapshot at their recorded PSNs
+    pub(crate) fn resume(mut self, qps: &[QpRecord], psn_window: usize) -> Self {
+        for qp in qps {
+            if let Some(trackers) = self.qps.get_qp_mut(qp.qpn) {
+                trackers.send = RemoteAckTracker::resume(qp.send_msn, qp.send_psn, psn_window);
+                trackers.recv = LocalAckTracker::resume(qp.recv_psn, psn_window);
+            }
         }
+        self
     }
 
     pub(super) fn handle_meta(&mut self, meta: ReportMeta) -> Option<()> {
+        sdt_probe!(
+            "meta_report",
+            meta.qpn(),
+            meta.psn().map_or(0, Psn::into_inner)
+        );
         self.update_ack_timer(&meta);
-        match meta {
+        let qpn = meta.qpn();
+        let handled = match meta {
             ReportMeta::HeaderWrite(x) => self.handle_header_write(x),
             ReportMeta::HeaderRead(x) => self.handle_header_read(x),
+            ReportMeta::HeaderAtomic(x) => self.handle_header_atomic(x),
             ReportMeta::AckLocalHw(x) => self.handle_ack_local_hw(x),
             ReportMeta::AckRemoteDriver(x) => self.handle_ack_remote_driver(x),
+            ReportMeta::AtomicAck(x) => self.handle_atomic_ack(x),
             ReportMeta::NakLocalHw(x) => self.handle_nak_local_hw(x),
             ReportMeta::NakRemoteHw(x) => self.handle_nak_remote_hw(x),
             ReportMeta::NakRemoteDriver(x) => self.handle_nak_remote_driver(x),
-            ReportMeta::Cnp { .. } => todo!(),
+            ReportMeta::Cnp(x) => self.handle_cnp(x),
+        };
+        self.count_window_drops(qpn);
+        handled
+    }
+
+    /// Counts the PSNs the trackers of the QP dropped beyond their window
+    fn count_window_drops(&mut self, qpn: u32) {
+        let Some(qp) = self.qps.get_qp_mut(qpn) else {
+            return;
+        };
+        let dropped = qp.send.take_dropped() + qp.recv.take_dropped();
+        if dropped != 0 {
+            self.counters.add(qpn, Counter::PsnWindowDrops, dropped);
         }
     }
 
     fn update_ack_timer(&self, meta: &ReportMeta) {
-        self.ack_timeout_tx
-            .send(AckTimeoutTask::recv_meta(meta.qpn()));
+        self.activity.touch(meta.qpn());
+    }
+
+    fn handle_cnp(&self, meta: CnpMeta) -> Option<()> {
+        debug!("cnp: {meta:?}");
+        self.rate.on_cnp(meta.qpn);
+
+        Some(())
     }
 
     fn handle_ack_local_hw(&mut self, meta: AckMetaLocalHw) -> Option<()> {
-        let tracker = self.recv_table.get_qp_mut(meta.qpn)?;
+        let tracker = &mut self.qps.get_qp_mut(meta.qpn)?.recv;
         if let Some(psn) = tracker.ack_bitmap(meta.psn_now, meta.now_bitmap) {
             self.receiver_updates(meta.qpn, psn);
         }
@@ -120,7 +346,22 @@ impl MetaHandler {
     }
 
     fn handle_ack_remote_driver(&mut self, meta: AckMetaRemoteDriver) -> Option<()> {
-        let tracker = self.send_table.get_qp_mut(meta.qpn)?;
+        let tracker = &mut self.qps.get_qp_mut(meta.qpn)?.send;
+        if let Some(psn) = tracker.ack_before(meta.psn_now) {
+            self.sender_updates(meta.qpn, psn);
+        }
+
+        Some(())
+    }
+
+    /// Writes the original value of an atomic WR to its local buffer, then acknowledges the
+    /// WR like any ACK of the remote driver
+    fn handle_atomic_ack(&mut self, meta: AtomicAckMeta) -> Option<()> {
+        debug!("atomic ack: {meta:?}");
+        let _ignore = self
+            .atomics
+            .write_result(meta.qpn, meta.psn_now - 1, meta.orig);
+        let tracker = &mut self.qps.get_qp_mut(meta.qpn)?.send;
         if let Some(psn) = tracker.ack_before(meta.psn_now) {
             self.sender_updates(meta.qpn, psn);
         }
@@ -131,7 +372,7 @@ impl MetaHandler {
     fn handle_nak_local_hw(&mut self, meta: NakMetaLocalHw) -> Option<()> {
         debug!("nak local hw: {meta:?}");
 
-        let tracker = self.recv_table.get_qp_mut(meta.qpn)?;
+        let tracker = &mut self.qps.get_qp_mut(meta.qpn)?.recv;
         if let Some(psn) =
             tracker.nak_bitmap(meta.psn_pre, meta.pre_bitmap, meta.psn_now, meta.now_bitmap)
         {
@@ -143,8 +384,9 @@ impl MetaHandler {
 
     fn handle_nak_remote_hw(&mut self, meta: NakMetaRemoteHw) -> Option<()> {
         debug!("nak remote hw: {meta:?}");
+        self.counters.add(meta.qpn, Counter::NaksReceived, 1);
 
-        let tracker = self.send_table.get_qp_mut(meta.qpn)?;
+        let tracker = &mut self.qps.get_qp_mut(meta.qpn)?.send;
         if let Some(psn) = tracker.nak_bitmap(
             meta.msn,
             meta.psn_pre,
@@ -154,22 +396,85 @@ impl MetaHandler {
         ) {
             self.sender_updates(meta.qpn, psn);
         }
+        // The PSNs received past the missing ones complete the WRs of a QP with relaxed
+        // completion ahead of the WRs before them
+        for (psn, bitmap) in [
+            (meta.psn_pre, meta.pre_bitmap),
+            (meta.psn_now, meta.now_bitmap),
+        ] {
+            if bitmap != 0 {
+                self.completion_tx
+                    .send(CompletionTask::new_ack_send_bitmap(meta.qpn, psn, bitmap));
+            }
+        }
 
-        self.packet_retransmit_tx
-            .send(PacketRetransmitTask::RetransmitRange {
-                qpn: meta.qpn,
-                psn_low: meta.psn_pre,
-                psn_high: meta.psn_now + 128,
-            });
+        if self.range_retransmit {
+            self.packet_retransmit_tx
+                .send(PacketRetransmitTask::RetransmitRange {
+                    qpn: meta.qpn,
+                    psn_low: meta.psn_pre,
+                    psn_high: meta.psn_now + 128,
+                });
+        } else {
+            self.retransmit_missing(&meta);
+        }
 
         Some(())
     }
 
+    /// Retransmits the PSNs a NAK reports as missing.
+    ///
+    /// A PSN is missing if its bit is clear in the `psn_pre` window, or in the `psn_now` window
+    /// below the highest PSN received. PSNs between two disjoint windows have no bitmap and
+    /// are replayed as a range, PSNs lost after the highest PSN received are left to the ack
+    /// timeout.
+    fn retransmit_missing(&self, meta: &NakMetaRemoteHw) {
+        let gap = if meta.psn_now > meta.psn_pre {
+            (meta.psn_now - meta.psn_pre).into_inner()
+        } else {
+            0
+        };
+        // The part of the `psn_pre` window overlapped by the `psn_now` window is described by
+        // `now_bitmap`
+        let pre_mask = if gap < u128::BITS {
+            (1u128 << gap) - 1
+        } else {
+            u128::MAX
+        };
+        let now_mask = meta
+            .now_bitmap
+            .checked_ilog2()
+            .map_or(0, |highest| (1u128 << highest) - 1);
+        let windows = [
+            (meta.psn_pre, !meta.pre_bitmap & pre_mask),
+            (meta.psn_now, !meta.now_bitmap & now_mask),
+        ];
+        for (psn_base, bitmap) in windows {
+            if bitmap != 0 {
+                self.packet_retransmit_tx
+                    .send(PacketRetransmitTask::RetransmitBitmap {
+                        qpn: meta.qpn,
+                        psn_base,
+                        bitmap,
+                    });
+            }
+        }
+        if gap > u128::BITS {
+            self.packet_retransmit_tx
+                .send(PacketRetransmitTask::RetransmitRange {
+                    qpn: meta.qpn,
+                    psn_low: meta.psn_pre + u128::BITS,
+                    psn_high: meta.psn_now,
+                });
+        }
+    }
+
     #[allow(clippy::unnecessary_wraps)]
     fn handle_nak_remote_driver(&mut self, meta: NakMetaRemoteDriver) -> Option<()> {
         debug!("nak remote driver: {meta:?}");
+        self.counters.add(meta.qpn, Counter::NaksReceived, 1);
 
-        let tracker = self.send_table.get_qp_mut(meta.qpn)?;
+        let tracker = &mut self.qps.get_qp_mut(meta.qpn)?.send;
         if let Some(psn) = tracker.ack_before(meta.psn_pre) {
             self.sender_updates(meta.qpn, psn);
         }
@@ -187,7 +492,7 @@ impl MetaHandler {
     pub(crate) fn sender_updates(&self, qpn: u32, base_psn: Psn) {
         debug!("MetaHandler sender_updates qpn={:?}, base_psn={:?}", qpn, base_psn);
         self.completion_tx
-            .send(CompletionTask::AckSend { qpn, base_psn });
+            .send(CompletionTask::new_ack_send(qpn, base_psn));
         self.packet_retransmit_tx
             .send(PacketRetransmitTask::Ack { qpn, psn: base_psn });
         self.rdma_write_tx
@@ -197,7 +502,7 @@ impl MetaHandler {
     pub(crate) fn receiver_updates(&self, qpn: u32, base_psn: Psn) {
         debug!("MetaHandler receiver_updates qpn={:?}, base_psn={:?}", qpn, base_psn);
         self.completion_tx
-            .send(CompletionTask::AckRecv { qpn, base_psn });
+            .send(CompletionTask::new_ack_recv(qpn, base_psn));
         self.packet_retransmit_tx
             .send(PacketRetransmitTask::Ack { qpn, psn: base_psn });
     }
@@ -216,24 +521,31 @@ impl MetaHandler {
                 qpn: meta.dqpn,
                 event,
             });
-            let tracker = self.recv_table.get_qp_mut(meta.dqpn)?;
+            let tracker = &mut self.qps.get_qp_mut(meta.dqpn)?.recv;
             if let Some(base_psn) = tracker.ack_one(meta.psn) {
                 debug!("send ack 111");
-                self.completion_tx.send(CompletionTask::AckRecv {
-                    qpn: meta.dqpn,
-                    base_psn,
-                });
+                self.completion_tx
+                    .send(CompletionTask::new_ack_recv(meta.dqpn, base_psn));
             }
         }
+        if self.native_read {
+            return Some(());
+        }
 
-        let flags = if meta.ack_req {
+        let mut flags = if meta.ack_req {
             ibverbs_sys::ibv_send_flags::IBV_SEND_SOLICITED.0
         } else {
             0
         };
+        // The response to the read of a pulled send completes the send once acknowledged
+        let mut wr_id = 0;
+        if let Some(pull) = self.pulls.take(meta.dqpn, meta.raddr, meta.total_len) {
+            wr_id = pull.wr_id;
+            flags |= pull.send_flags & ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0;
+        }
 
         let base = SendWrBase::new(
-            0,
+            wr_id,
             flags,
             meta.raddr,
             meta.total_len,
@@ -248,6 +560,65 @@ impl MetaHandler {
         Some(())
     }
 
+    /// Executes an atomic request of the peer and answers it with an atomic ACK.
+    ///
+    /// A request is executed once, its retries are answered with the cached original value.
+    /// The atomic ACK also acknowledges the PSNs before the request, it is only sent once all
+    /// of them are received, otherwise the retry of the request is answered.
+    #[allow(clippy::wildcard_enum_match_arm)]
+    pub(super) fn handle_header_atomic(&mut self, meta: HeaderAtomicMeta) -> Option<()> {
+        debug!("MetaHandler handle_header_atomic got meta = {:?}", meta);
+        let qp = self.qps.get_qp_mut(meta.dqpn)?;
+        let cached = qp
+            .atomic_replies
+            .iter()
+            .find(|&&(psn, _)| psn == meta.psn)
+            .map(|&(_, orig)| orig);
+        let orig = if let Some(orig) = cached {
+            orig
+        } else {
+            let opcode = match meta.header_type {
+                HeaderType::CompareSwap => WorkReqOpCode::AtomicCmpAndSwp,
+                HeaderType::Flush => WorkReqOpCode::Flush,
+                HeaderType::AtomicWrite => WorkReqOpCode::AtomicWrite,
+                _ => WorkReqOpCode::AtomicFetchAndAdd,
+            };
+            // A flush or an atomic write must not be executed ahead of the writes before it,
+            // it is left unacknowledged until they arrive and executed on its retry
+            if matches!(opcode, WorkReqOpCode::Flush | WorkReqOpCode::AtomicWrite)
+                && qp.recv.base_psn() < meta.psn
+            {
+                debug!("defer {opcode:?} until the packets before {:?}", meta.psn);
+                return Some(());
+            }
+            let Some(orig) = self
+                .atomics
+                .execute(meta.rkey, meta.raddr, opcode, meta.operands)
+            else {
+                error!("invalid atomic target: {meta:?}");
+                return None;
+            };
+            if qp.atomic_replies.len() >= ATOMIC_REPLAY_DEPTH {
+                let _ignore = qp.atomic_replies.pop_front();
+            }
+            qp.atomic_replies.push_back((meta.psn, orig));
+            orig
+        };
+        if let Some(base_psn) = qp.recv.ack_one(meta.psn) {
+            self.completion_tx
+                .send(CompletionTask::new_ack_recv(meta.dqpn, base_psn));
+        }
+        if qp.recv.base_psn() > meta.psn {
+            self.ack_tx.send(AckResponse::AtomicAck {
+                qpn: meta.dqpn,
+                psn: meta.psn,
+                orig,
+            });
+        }
+
+        Some(())
+    }
+
     pub(super) fn handle_header_write(&mut self, meta: HeaderWriteMeta) -> Option<()> {
         let HeaderWriteMeta {
             pos,
@@ -264,7 +635,7 @@ impl MetaHandler {
             header_type,
         } = meta;
         debug!("Meta Handler got meta = {:?}", meta);
-        let tracker = self.recv_table.get_qp_mut(dqpn)?;
+        let tracker = &mut self.qps.get_qp_mut(dqpn)?.recv;
 
         if matches!(pos, PacketPos::Last | PacketPos::Only) {
             let end_psn = psn + 1;
@@ -283,10 +654,14 @@ impl MetaHandler {
                 HeaderType::WriteWithImm => {
                     let event = Event::Recv(RecvEvent::new(
                         meta.dqpn,
-                        RecvEventOp::WriteWithImm { imm },
+                        RecvEventOp::WriteWithImm {
+                            imm,
+                            len: total_len,
+                        },
                         MessageMeta::new(msn, end_psn),
                         ack_req,
-                    ));
+                    ))
+                    .with_solicited(solicited);
                     debug!("send event to completion_tx queue: event={:?}", event);
                     self.completion_tx
                         .send(CompletionTask::Register { qpn: dqpn, event });
@@ -294,10 +669,11 @@ impl MetaHandler {
                 HeaderType::Send => {
                     let event = Event::Recv(RecvEvent::new(
                         meta.dqpn,
-                        RecvEventOp::Recv,
+                        RecvEventOp::Recv { len: total_len },
                         MessageMeta::new(msn, end_psn),
                         ack_req,
-                    ));
+                    ))
+                    .with_solicited(solicited);
                     debug!("send event to completion_tx queue: event={:?}", event);
                     self.completion_tx
                         .send(CompletionTask::Register { qpn: dqpn, event });
@@ -305,10 +681,14 @@ impl MetaHandler {
                 HeaderType::SendWithImm => {
                     let event = Event::Recv(RecvEvent::new(
                         meta.dqpn,
-                        RecvEventOp::RecvWithImm { imm },
+                        RecvEventOp::RecvWithImm {
+                            imm,
+                            len: total_len,
+                        },
                         MessageMeta::new(msn, end_psn),
                         ack_req,
-                    ));
+                    ))
+                    .with_solicited(solicited);
                     debug!("send event to completion_tx queue: event={:?}", event);
                     self.completion_tx
                         .send(CompletionTask::Register { qpn: dqpn, event });
@@ -324,14 +704,18 @@ impl MetaHandler {
                     self.completion_tx
                         .send(CompletionTask::Register { qpn: dqpn, event });
                 }
+                HeaderType::CompareSwap
+                | HeaderType::FetchAdd
+                | HeaderType::Flush
+                | HeaderType::AtomicWrite => {
+                    error!("atomic request without operands: {meta:?}");
+                }
             }
         }
         if let Some(base_psn) = tracker.ack_one(psn) {
             debug!("send event 222222222");
-            self.completion_tx.send(CompletionTask::AckRecv {
-                qpn: dqpn,
-                base_psn,
-            });
+            self.completion_tx
+                .send(CompletionTask::new_ack_recv(dqpn, base_psn));
         }
         /// Timeout of an `AckReq` message, notify retransmission
         if matches!(pos, PacketPos::Last | PacketPos::Only) && is_retry && ack_req {
@@ -349,8 +733,14 @@ impl MetaHandler {
 #[cfg(test)]
 mod test {
     use crate::{
-        rdma_utils::psn_tracker::{LocalAckTracker, RemoteAckTracker},
-        workers::spawner::{task_channel, TaskRx},
+        config::CongestionConfig,
+        constants::{DEFAULT_PSN_WINDOW, QPN_KEY_PART_WIDTH},
+        net::rendezvous::PendingPull,
+        rdma_utils::{
+            atomic::AtomicOperands,
+            psn_tracker::{LocalAckTracker, RemoteAckTracker},
+        },
+        workers::spawner::{task_channel, PollPolicy, TaskRx},
     };
 
     use super::*;
@@ -358,7 +748,6 @@ mod test {
     #[allow(clippy::struct_field_names)]
     struct Rxs {
         ack_rx: TaskRx<AckResponse>,
-        ack_timeout_rx: TaskRx<AckTimeoutTask>,
         packet_retransmit_rx: TaskRx<PacketRetransmitTask>,
         completion_rx: TaskRx<CompletionTask>,
         rdma_write_rx: TaskRx<RdmaWriteTask>,
@@ -376,11 +765,6 @@ mod test {
             assert_eq!(task, recv);
         }
 
-        fn assert_ack_timeout(&self, task: AckTimeoutTask) {
-            let recv = self.ack_timeout_rx.recv().unwrap();
-            assert_eq!(task, recv);
-        }
-
         fn assert_packet_retransmit(&self, task: PacketRetransmitTask) {
             let recv = self.packet_retransmit_rx.recv().unwrap();
             assert_eq!(task, recv);
@@ -394,20 +778,25 @@ mod test {
 
     fn init_handler() -> (MetaHandler, Rxs) {
         let (ack_tx, ack_rx) = task_channel();
-        let (ack_timeout_tx, ack_timeout_rx) = task_channel();
         let (packet_retransmit_tx, packet_retransmit_rx) = task_channel();
         let (completion_tx, completion_rx) = task_channel();
         let (rdma_write_tx, rdma_write_rx) = task_channel();
         let handler = MetaHandler::new(
             ack_tx,
-            ack_timeout_tx,
+            Arc::new(QpActivity::new()),
             packet_retransmit_tx,
             completion_tx,
             rdma_write_tx,
+            Arc::new(RateControl::new(&CongestionConfig::default())),
+            Arc::new(DeviceCounters::new(4)),
+            false,
+            false,
+            Atomics::new(),
+            PendingPulls::default(),
+            DEFAULT_PSN_WINDOW,
         );
         let rxs = Rxs {
             ack_rx,
-            ack_timeout_rx,
             packet_retransmit_rx,
             completion_rx,
             rdma_write_rx,
@@ -425,11 +814,8 @@ mod test {
             now_bitmap: u128::MAX,
         };
         handler.handle_meta(ReportMeta::AckLocalHw(meta)).unwrap();
-        rxs.assert_ack_timeout(AckTimeoutTask::RecvMeta { qpn });
-        rxs.assert_completion(CompletionTask::AckRecv {
-            qpn,
-            base_psn: Psn(128),
-        });
+        assert!(handler.activity.last_activity(qpn).is_some());
+        rxs.assert_completion(CompletionTask::new_ack_recv(qpn, Psn(128)));
         rxs.assert_packet_retransmit(PacketRetransmitTask::Ack { qpn, psn: Psn(128) });
     }
 
@@ -439,7 +825,7 @@ mod test {
         let qpn = 456;
 
         // Initialize tracker for the QP
-        handler.send_table.get_qp_mut(qpn).unwrap();
+        handler.qps.get_qp_mut(qpn).unwrap();
 
         let meta = AckMetaRemoteDriver {
             qpn,
@@ -448,11 +834,7 @@ mod test {
         handler
             .handle_meta(ReportMeta::AckRemoteDriver(meta))
             .unwrap();
-        rxs.assert_ack_timeout(AckTimeoutTask::RecvMeta { qpn });
-        rxs.assert_completion(CompletionTask::AckSend {
-            qpn,
-            base_psn: Psn(200),
-        });
+        rxs.assert_completion(CompletionTask::new_ack_send(qpn, Psn(200)));
         rxs.assert_packet_retransmit(PacketRetransmitTask::Ack { qpn, psn: Psn(200) });
     }
 
@@ -470,17 +852,14 @@ mod test {
             pre_bitmap: u128::MAX - 2,
         };
         handler.handle_meta(ReportMeta::NakLocalHw(meta)).unwrap();
-        rxs.assert_ack_timeout(AckTimeoutTask::RecvMeta { qpn });
-        rxs.assert_completion(CompletionTask::AckRecv {
-            qpn,
-            base_psn: Psn(1),
-        });
+        rxs.assert_completion(CompletionTask::new_ack_recv(qpn, Psn(1)));
         rxs.assert_packet_retransmit(PacketRetransmitTask::Ack { qpn, psn: Psn(1) });
     }
 
     #[test]
     fn test_handle_nak_remote_hw() {
         let (mut handler, rxs) = init_handler();
+        handler.range_retransmit = true;
         let qpn = 101;
         let meta = NakMetaRemoteHw {
             qpn,
@@ -492,11 +871,7 @@ mod test {
         };
 
         handler.handle_meta(ReportMeta::NakRemoteHw(meta)).unwrap();
-        rxs.assert_ack_timeout(AckTimeoutTask::RecvMeta { qpn });
-        rxs.assert_completion(CompletionTask::AckSend {
-            qpn,
-            base_psn: Psn(1),
-        });
+        rxs.assert_completion(CompletionTask::new_ack_send(qpn, Psn(1)));
         rxs.assert_packet_retransmit(PacketRetransmitTask::Ack { qpn, psn: Psn(1) });
         rxs.assert_packet_retransmit(PacketRetransmitTask::RetransmitRange {
             qpn,
@@ -505,6 +880,37 @@ mod test {
         });
     }
 
+    #[test]
+    fn test_handle_nak_remote_hw_selective() {
+        let (mut handler, rxs) = init_handler();
+        let qpn = 102;
+        let meta = NakMetaRemoteHw {
+            qpn,
+            msn: 15,
+            psn_now: Psn(64),
+            // PSN 64, 65 and 68 received
+            now_bitmap: 0b1_0011,
+            psn_pre: Psn(0),
+            // PSN 1 lost, the bits from PSN 64 are covered by `now_bitmap`
+            pre_bitmap: !0b10,
+        };
+
+        handler.handle_meta(ReportMeta::NakRemoteHw(meta)).unwrap();
+        rxs.assert_completion(CompletionTask::new_ack_send(qpn, Psn(1)));
+        rxs.assert_packet_retransmit(PacketRetransmitTask::Ack { qpn, psn: Psn(1) });
+        rxs.assert_packet_retransmit(PacketRetransmitTask::RetransmitBitmap {
+            qpn,
+            psn_base: Psn(0),
+            bitmap: 0b10,
+        });
+        rxs.assert_packet_retransmit(PacketRetransmitTask::RetransmitBitmap {
+            qpn,
+            psn_base: Psn(64),
+            bitmap: 0b1100,
+        });
+        assert!(rxs.packet_retransmit_rx.try_recv().is_none());
+    }
+
     #[test]
     fn test_handle_nak_remote_driver() {
         let (mut handler, rxs) = init_handler();
@@ -519,17 +925,14 @@ mod test {
         let result = handler.handle_meta(ReportMeta::NakRemoteDriver(meta));
         assert!(result.is_some());
 
-        rxs.assert_ack_timeout(AckTimeoutTask::RecvMeta { qpn });
-        rxs.assert_completion(CompletionTask::AckSend {
-            qpn,
-            base_psn: Psn(450),
-        });
+        rxs.assert_completion(CompletionTask::new_ack_send(qpn, Psn(450)));
         rxs.assert_packet_retransmit(PacketRetransmitTask::Ack { qpn, psn: Psn(450) });
         rxs.assert_packet_retransmit(PacketRetransmitTask::RetransmitRange {
             qpn,
             psn_low: Psn(450),
             psn_high: Psn(500),
         });
+        assert_eq!(handler.counters.read(), [0, 0, 0, 1, 0, 0, 0, 0]);
     }
 
     #[test]
@@ -571,7 +974,194 @@ mod test {
         let send_wr = SendWrRdma::new_from_base(base, meta.laddr, meta.lkey);
         let task = RdmaWriteTask::new_write(meta.dqpn, send_wr);
         rxs.assert_rdma_write(task);
-        rxs.assert_ack_timeout(AckTimeoutTask::RecvMeta { qpn });
+    }
+
+    #[test]
+    fn native_reads_are_not_converted_to_writes() {
+        let (mut handler, rxs) = init_handler();
+        handler.native_read = true;
+        let qpn = 304;
+        let meta = HeaderReadMeta {
+            msn: 21,
+            psn: Psn(0),
+            dqpn: qpn,
+            raddr: 0x1000,
+            rkey: 0x2000,
+            total_len: 1024,
+            laddr: 0x3000,
+            lkey: 0x4000,
+            ack_req: true,
+        };
+
+        handler.handle_meta(ReportMeta::HeaderRead(meta)).unwrap();
+        rxs.assert_completion(CompletionTask::Register {
+            qpn,
+            event: Event::Recv(RecvEvent::new(
+                qpn,
+                RecvEventOp::RecvRead,
+                MessageMeta::new(21, Psn(1)),
+                true,
+            )),
+        });
+        rxs.assert_completion(CompletionTask::new_ack_recv(qpn, Psn(1)));
+        assert!(rxs.rdma_write_rx.try_recv().is_none());
+    }
+
+    #[test]
+    fn pulled_sends_are_completed_by_the_read_response() {
+        let (mut handler, rxs) = init_handler();
+        let qpn = 306;
+        let signaled = ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0;
+        handler.pulls.insert(
+            qpn,
+            PendingPull {
+                addr: 0x1000,
+                length: 1024,
+                wr_id: 77,
+                send_flags: signaled,
+            },
+        );
+        let meta = HeaderReadMeta {
+            msn: 23,
+            psn: Psn(0),
+            dqpn: qpn,
+            raddr: 0x1000,
+            rkey: 0x2000,
+            total_len: 1024,
+            laddr: 0x3000,
+            lkey: 0x4000,
+            ack_req: false,
+        };
+
+        handler.handle_meta(ReportMeta::HeaderRead(meta)).unwrap();
+        let base = SendWrBase::new(
+            77,
+            signaled,
+            0x1000,
+            1024,
+            0x2000,
+            0,
+            WorkReqOpCode::RdmaReadResp,
+        );
+        let send_wr = SendWrRdma::new_from_base(base, meta.laddr, meta.lkey);
+        rxs.assert_rdma_write(RdmaWriteTask::new_write(qpn, send_wr));
+
+        // a retried read is answered without completing the send again
+        handler.handle_meta(ReportMeta::HeaderRead(meta)).unwrap();
+        let base = SendWrBase::new(0, 0, 0x1000, 1024, 0x2000, 0, WorkReqOpCode::RdmaReadResp);
+        let send_wr = SendWrRdma::new_from_base(base, meta.laddr, meta.lkey);
+        rxs.assert_rdma_write(RdmaWriteTask::new_write(qpn, send_wr));
+    }
+
+    #[test]
+    #[allow(clippy::as_conversions)]
+    fn atomic_requests_are_executed_once() {
+        let (mut handler, rxs) = init_handler();
+        let qpn = 305;
+        let mut target = 10u64;
+        let addr = std::ptr::addr_of_mut!(target) as u64;
+        handler.atomics.add_target(
+            0x2000,
+            addr,
+            8,
+            ibverbs_sys::ibv_access_flags::IBV_ACCESS_REMOTE_ATOMIC.0 as u8,
+        );
+        let mut meta = HeaderAtomicMeta {
+            msn: 22,
+            psn: Psn(0),
+            dqpn: qpn,
+            raddr: addr,
+            rkey: 0x2000,
+            is_retry: false,
+            header_type: HeaderType::FetchAdd,
+            operands: AtomicOperands::new(5, 0),
+        };
+
+        handler.handle_meta(ReportMeta::HeaderAtomic(meta)).unwrap();
+        rxs.assert_completion(CompletionTask::new_ack_recv(qpn, Psn(1)));
+        rxs.assert_ack(AckResponse::AtomicAck {
+            qpn,
+            psn: Psn(0),
+            orig: 10,
+        });
+
+        // The retry is answered with the original value of the first execution
+        meta.is_retry = true;
+        handler.handle_meta(ReportMeta::HeaderAtomic(meta)).unwrap();
+        rxs.assert_ack(AckResponse::AtomicAck {
+            qpn,
+            psn: Psn(0),
+            orig: 10,
+        });
+        assert_eq!(target, 15);
+
+        meta.rkey = 0x3000;
+        meta.psn = Psn(1);
+        assert!(handler
+            .handle_meta(ReportMeta::HeaderAtomic(meta))
+            .is_none());
+    }
+
+    #[test]
+    #[allow(clippy::as_conversions)]
+    fn flushes_and_atomic_writes_wait_for_earlier_packets() {
+        let (mut handler, rxs) = init_handler();
+        let qpn = 307;
+        let mut target = 10u64;
+        let addr = std::ptr::addr_of_mut!(target) as u64;
+        handler.atomics.add_target(
+            0x2000,
+            addr,
+            8,
+            ibverbs_sys::ibv_access_flags::IBV_ACCESS_REMOTE_WRITE.0 as u8,
+        );
+        let mut meta = HeaderAtomicMeta {
+            msn: 23,
+            psn: Psn(1),
+            dqpn: qpn,
+            raddr: addr,
+            rkey: 0x2000,
+            is_retry: false,
+            header_type: HeaderType::AtomicWrite,
+            operands: AtomicOperands::atomic_write(20),
+        };
+
+        // PSN 0 is missing, the write is neither executed nor acknowledged
+        handler.handle_meta(ReportMeta::HeaderAtomic(meta)).unwrap();
+        assert!(rxs.ack_rx.try_recv().is_none());
+        assert_eq!(target, 10);
+
+        let _ignore = handler.qps.get_qp_mut(qpn).unwrap().recv.ack_one(Psn(0));
+        meta.is_retry = true;
+        handler.handle_meta(ReportMeta::HeaderAtomic(meta)).unwrap();
+        rxs.assert_completion(CompletionTask::new_ack_recv(qpn, Psn(2)));
+        rxs.assert_ack(AckResponse::AtomicAck {
+            qpn,
+            psn: Psn(1),
+            orig: 0,
+        });
+        assert_eq!(target, 20);
+    }
+
+    #[test]
+    #[allow(clippy::as_conversions)]
+    fn atomic_acks_write_the_original_value() {
+        let (mut handler, rxs) = init_handler();
+        let qpn = 306;
+        let mut result = 0u64;
+        handler.qps.get_qp_mut(qpn).unwrap();
+        handler
+            .atomics
+            .expect_result(qpn, Psn(7), std::ptr::addr_of_mut!(result) as u64);
+
+        let meta = AtomicAckMeta {
+            qpn,
+            psn_now: Psn(8),
+            orig: 42,
+        };
+        handler.handle_meta(ReportMeta::AtomicAck(meta)).unwrap();
+        assert_eq!(result, 42);
+        rxs.assert_completion(CompletionTask::new_ack_send(qpn, Psn(8)));
     }
 
     #[test]
@@ -602,11 +1192,7 @@ mod test {
             true,
         ));
         rxs.assert_completion(CompletionTask::Register { qpn, event });
-        rxs.assert_completion(CompletionTask::AckRecv {
-            qpn,
-            base_psn: Psn(1),
-        });
-        rxs.assert_ack_timeout(AckTimeoutTask::RecvMeta { qpn });
+        rxs.assert_completion(CompletionTask::new_ack_recv(qpn, Psn(1)));
     }
 
     #[test]
@@ -633,8 +1219,6 @@ mod test {
 
         // Should not send completion task for middle packet
         assert!(rxs.completion_rx.try_recv().is_none());
-
-        rxs.assert_ack_timeout(AckTimeoutTask::RecvMeta { qpn });
     }
 
     #[test]
@@ -650,4 +1234,39 @@ mod test {
         let result = handler.handle_meta(meta);
         assert!(result.is_none());
     }
+
+    #[test]
+    fn test_meta_shard_forwards_foreign_qps() {
+        let (tx0, rx0) = task_channel();
+        let (tx1, rx1) = task_channel();
+        let peers = vec![
+            (tx0, Poller::new(PollPolicy::default())),
+            (tx1, Poller::new(PollPolicy::default())),
+        ];
+        let shard = MetaShard::new(0, rx0, peers);
+        let owned = 2 << QPN_KEY_PART_WIDTH;
+        let foreign = 3 << QPN_KEY_PART_WIDTH;
+
+        let meta = shard
+            .route(ReportMeta::Cnp(CnpMeta { qpn: owned }))
+            .unwrap();
+        assert_eq!(meta.qpn(), owned);
+        assert!(shard
+            .route(ReportMeta::Cnp(CnpMeta { qpn: foreign }))
+            .is_none());
+        assert_eq!(rx1.try_recv().unwrap().qpn(), foreign);
+        assert!(shard.rx.try_recv().is_none());
+    }
+
+    #[test]
+    fn test_handle_cnp() {
+        let (mut handler, rxs) = init_handler();
+        let qpn = 3 << 8;
+
+        handler
+            .handle_meta(ReportMeta::Cnp(CnpMeta { qpn }))
+            .unwrap();
+
+        assert!(handler.rate.is_limited(qpn));
+    }
 }
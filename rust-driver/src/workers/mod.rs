@@ -1,4 +1,5 @@
 pub(crate) mod ack_responder;
+pub(crate) mod comp_channel;
 pub(crate) mod completion;
 pub(crate) mod meta_report;
 pub(crate) mod qp_timeout;
@@ -6,3 +7,6 @@ pub(crate) mod rdma;
 pub(crate) mod retransmit;
 pub(crate) mod send;
 pub(crate) mod spawner;
+pub(crate) mod sq_ring;
+pub(crate) mod wc_ring;
+pub(crate) mod wr_arena;
@@ -1,5 +1,10 @@
 use std::{
-    io, iter, thread,
+    io, iter, mem,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc,
+    },
+    thread,
     time::{Duration, Instant},
 };
 
@@ -11,7 +16,10 @@ use crate::{
         DEFAULT_INIT_RETRY_COUNT, DEFAULT_LOCAL_ACK_TIMEOUT, DEFAULT_TIMEOUT_CHECK_DURATION,
         MAX_QP_CNT, QPN_KEY_PART_WIDTH,
     },
+    counters::{Counter, DeviceCounters},
     rdma_utils::qp::{qpn_to_index, QpTable},
+    reload::TunablesWatch,
+    sdt::sdt_probe,
     workers::{
         retransmit::PacketRetransmitTask,
         send::SendHandle,
@@ -19,13 +27,17 @@ use crate::{
     },
 };
 
-#[derive(Debug, Clone, Copy, Serialize, Deserialize)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
 pub(crate) struct AckTimeoutConfig {
     // 4.096 uS * 2^(CHECK DURATION)
     pub(crate) check_duration_exp: u8,
     // 4.096 uS * 2^(Local ACK Timeout)
     pub(crate) local_ack_timeout_exp: u8,
     pub(crate) init_retry_count: usize,
+    /// Keeps the timeout at `local_ack_timeout_exp` rather than deriving it from the RTT
+    /// estimated from the ACKs of each QP
+    #[serde(default)]
+    pub(crate) static_timeout: bool,
 }
 
 impl Default for AckTimeoutConfig {
@@ -34,6 +46,7 @@ impl Default for AckTimeoutConfig {
             check_duration_exp: DEFAULT_TIMEOUT_CHECK_DURATION,
             local_ack_timeout_exp: DEFAULT_LOCAL_ACK_TIMEOUT,
             init_retry_count: DEFAULT_INIT_RETRY_COUNT,
+            static_timeout: false,
         }
     }
 }
@@ -44,8 +57,16 @@ impl AckTimeoutConfig {
             check_duration_exp: check_duration,
             local_ack_timeout_exp: local_ack_timeout,
             init_retry_count,
+            static_timeout: false,
         }
     }
+
+    /// Returns the time after which a message is either acknowledged or has exhausted its
+    /// retransmissions
+    pub(crate) fn retransmit_span(&self) -> Duration {
+        let timeout = Duration::from_nanos(4096u64 << self.local_ack_timeout_exp);
+        timeout * (self.init_retry_count as u32 + 1)
+    }
 }
 
 #[allow(variant_size_differences)]
@@ -55,13 +76,19 @@ pub(crate) enum AckTimeoutTask {
     NewAckReq {
         qpn: u32,
     },
-    // A new meta is received
-    RecvMeta {
+    /// The previous `count` messages are successfully acknowledged
+    Ack {
         qpn: u32,
+        count: usize,
     },
-    /// The previous message is successfully acknowledged
-    Ack {
+    /// The QP is modified with the `timeout` or the `retry_cnt` of `ibv_modify_qp`, `None`
+    /// keeps the current value
+    SetTimeout {
         qpn: u32,
+        /// Bounds the timeout of the QP
+        local_ack_timeout: Option<u8>,
+        /// Number of retransmissions after a timeout before the QP gives up
+        retry_cnt: Option<u8>,
     },
 }
 
@@ -70,26 +97,101 @@ impl AckTimeoutTask {
         Self::NewAckReq { qpn }
     }
 
-    pub(crate) fn recv_meta(qpn: u32) -> Self {
-        Self::RecvMeta { qpn }
+    pub(crate) fn ack(qpn: u32) -> Self {
+        Self::acked(qpn, 1)
     }
 
-    pub(crate) fn ack(qpn: u32) -> Self {
-        Self::Ack { qpn }
+    /// Acknowledges the `count` oldest messages at once
+    pub(crate) fn acked(qpn: u32, count: usize) -> Self {
+        Self::Ack { qpn, count }
+    }
+
+    pub(crate) fn set_timeout(
+        qpn: u32,
+        local_ack_timeout: Option<u8>,
+        retry_cnt: Option<u8>,
+    ) -> Self {
+        Self::SetTimeout {
+            qpn,
+            local_ack_timeout,
+            retry_cnt,
+        }
     }
 
     pub(crate) fn qpn(self) -> u32 {
         match self {
             AckTimeoutTask::NewAckReq { qpn }
-            | AckTimeoutTask::RecvMeta { qpn }
-            | AckTimeoutTask::Ack { qpn } => qpn,
+            | AckTimeoutTask::Ack { qpn, .. }
+            | AckTimeoutTask::SetTimeout { qpn, .. } => qpn,
         }
     }
 }
 
+/// Time of the last meta received by each QP, and the smoothed RTT of each QP.
+///
+/// Written by the meta worker for every meta and sampled by the timeout worker when a timer is
+/// due, a received meta restarts the timer without a message to the timeout worker. The RTT is
+/// written by the timeout worker and read by the retransmit worker.
+#[derive(Debug)]
+pub(crate) struct QpActivity {
+    origin: Instant,
+    /// Nanoseconds from `origin` to the last meta, 0 if the QP received none
+    last: Box<[AtomicU64]>,
+    /// Smoothed RTT in nanoseconds, 0 if the QP has no estimate
+    srtt: Box<[AtomicU64]>,
+}
+
+impl QpActivity {
+    pub(crate) fn new() -> Self {
+        Self {
+            origin: Instant::now(),
+            last: iter::repeat_with(AtomicU64::default)
+                .take(MAX_QP_CNT)
+                .collect(),
+            srtt: iter::repeat_with(AtomicU64::default)
+                .take(MAX_QP_CNT)
+                .collect(),
+        }
+    }
+
+    /// Records the smoothed RTT of `qpn`, `None` clears the estimate
+    fn set_srtt(&self, qpn: u32, srtt: Option<Duration>) {
+        if let Some(x) = self.srtt.get(qpn_to_index(qpn)) {
+            let nanos = srtt.map_or(0, |d| (d.as_nanos() as u64).max(1));
+            x.store(nanos, Ordering::Relaxed);
+        }
+    }
+
+    /// Returns the smoothed RTT of `qpn`, `None` before the first sample
+    pub(crate) fn srtt(&self, qpn: u32) -> Option<Duration> {
+        let nanos = self.srtt.get(qpn_to_index(qpn))?.load(Ordering::Relaxed);
+        (nanos != 0).then(|| Duration::from_nanos(nanos))
+    }
+
+    /// Records a meta received by `qpn`
+    pub(crate) fn touch(&self, qpn: u32) {
+        self.touch_at(qpn, Instant::now());
+    }
+
+    fn touch_at(&self, qpn: u32, now: Instant) {
+        if let Some(last) = self.last.get(qpn_to_index(qpn)) {
+            let nanos = now.saturating_duration_since(self.origin).as_nanos() as u64;
+            last.store(nanos.max(1), Ordering::Relaxed);
+        }
+    }
+
+    /// Returns the time of the last meta received by `qpn`
+    pub(crate) fn last_activity(&self, qpn: u32) -> Option<Instant> {
+        let nanos = self.last.get(qpn_to_index(qpn))?.load(Ordering::Relaxed);
+        (nanos != 0).then(|| self.origin + Duration::from_nanos(nanos))
+    }
+}
+
 #[derive(Debug, Clone)]
 pub(crate) struct TransportTimer {
     timeout_interval: Option<Duration>,
+    /// Bound of `timeout_interval`, set by the local ACK timeout
+    max_interval: Option<Duration>,
     last_start: Option<Instant>,
     init_retry_counter: usize,
     current_retry_counter: usize,
@@ -97,31 +199,67 @@ pub(crate) struct TransportTimer {
 
 impl TransportTimer {
     pub(crate) fn new(local_ack_timeout: u8, init_retry_counter: usize) -> Self {
-        let timeout_nanos = if local_ack_timeout == 0 {
-            // disabled
-            None
-        } else {
-            // 4.096 uS * 2^(Local ACK Timeout)
-            Some(4096u64 << local_ack_timeout)
-        };
+        let timeout_interval = Self::interval_of(local_ack_timeout);
 
         Self {
-            timeout_interval: timeout_nanos.map(Duration::from_nanos),
+            timeout_interval,
+            max_interval: timeout_interval,
             last_start: None,
             init_retry_counter,
             current_retry_counter: init_retry_counter,
         }
     }
 
+    /// Returns the timeout of a local ACK timeout exponent, `None` if it is disabled
+    fn interval_of(local_ack_timeout: u8) -> Option<Duration> {
+        if local_ack_timeout == 0 {
+            // disabled
+            None
+        } else {
+            // 4.096 uS * 2^(Local ACK Timeout)
+            Some(Duration::from_nanos(4096u64 << local_ack_timeout))
+        }
+    }
+
+    /// Bounds the timeout by a local ACK timeout exponent, the timeout restarts at the bound
+    fn set_limit(&mut self, local_ack_timeout: u8) {
+        self.max_interval = Self::interval_of(local_ack_timeout);
+        self.timeout_interval = self.max_interval;
+    }
+
+    /// Sets the number of retransmissions, the retries left restart at `count`
+    fn set_retry_count(&mut self, count: usize) {
+        self.init_retry_counter = count;
+        self.current_retry_counter = count;
+    }
+
+    /// Sets the timeout to the estimated `rto`, within the bound
+    fn adapt(&mut self, rto: Duration) {
+        if let Some(max) = self.max_interval {
+            self.timeout_interval = Some(rto.min(max));
+        }
+    }
+
+    /// Doubles the timeout after an expiry, within the bound
+    fn back_off(&mut self) {
+        if let (Some(interval), Some(max)) = (self.timeout_interval, self.max_interval) {
+            self.timeout_interval = Some(interval.saturating_mul(2).min(max));
+        }
+    }
+
     /// Returns `Ok(true)` if timeout
     pub(crate) fn check_timeout(&mut self) -> TimerResult {
+        self.check_timeout_at(Instant::now())
+    }
+
+    fn check_timeout_at(&mut self, now: Instant) -> TimerResult {
         let Some(timeout_interval) = self.timeout_interval else {
             return TimerResult::Ok;
         };
         let Some(start_time) = self.last_start else {
             return TimerResult::Ok;
         };
-        let elapsed = start_time.elapsed();
+        let elapsed = now.saturating_duration_since(start_time);
         if elapsed < timeout_interval {
             return TimerResult::Ok;
         }
@@ -129,6 +267,7 @@ impl TransportTimer {
             return TimerResult::RetryLimitExceeded;
         }
         self.current_retry_counter -= 1;
+        self.back_off();
         self.reset();
         TimerResult::Timeout
     }
@@ -137,13 +276,22 @@ impl TransportTimer {
         self.last_start.is_some()
     }
 
+    /// Returns the instant the running timer expires at, `None` if it is stopped or disabled
+    fn deadline(&self) -> Option<Instant> {
+        self.last_start?.checked_add(self.timeout_interval?)
+    }
+
     fn stop(&mut self) {
         self.last_start = None;
     }
 
     fn restart(&mut self) {
+        self.restart_at(Instant::now());
+    }
+
+    fn restart_at(&mut self, start: Instant) {
         self.current_retry_counter = self.init_retry_counter;
-        self.last_start = Some(Instant::now());
+        self.last_start = Some(start);
     }
 
     fn reset(&mut self) {
@@ -151,6 +299,43 @@ impl TransportTimer {
     }
 }
 
+/// Smoothed round-trip time of a QP, estimated from its ACKs as in RFC 6298
+#[derive(Debug, Clone, Copy, Default)]
+struct RttEstimator {
+    /// Smoothed RTT, `None` before the first sample
+    srtt: Option<Duration>,
+    /// RTT variation
+    rttvar: Duration,
+}
+
+impl RttEstimator {
+    fn sample(&mut self, rtt: Duration) {
+        let Some(srtt) = self.srtt else {
+            self.srtt = Some(rtt);
+            self.rttvar = rtt / 2;
+            return;
+        };
+        let delta = srtt.saturating_sub(rtt).max(rtt.saturating_sub(srtt));
+        self.rttvar = (self.rttvar * 3 + delta) / 4;
+        self.srtt = Some((srtt * 7 + rtt) / 8);
+    }
+
+    /// Returns the retransmission timeout, the variation term is at least the `granularity`
+    /// the timers are checked at. `None` before the first sample.
+    fn rto(&self, granularity: Duration) -> Option<Duration> {
+        self.srtt
+            .map(|srtt| srtt.saturating_add((self.rttvar * 4).max(granularity)))
+    }
+}
+
+/// A message timed for an RTT sample
+#[derive(Debug, Clone, Copy)]
+struct RttSample {
+    sent: Instant,
+    /// Number of ACKs left until the message is acknowledged
+    position: usize,
+}
+
 #[derive(Debug, Clone, Copy)]
 pub(crate) enum TimerResult {
     Ok,
@@ -158,12 +343,139 @@ pub(crate) enum TimerResult {
     RetryLimitExceeded,
 }
 
+/// Number of slots of the timer wheel, must be a power of two
+const WHEEL_SLOTS: usize = 256;
+
+/// A timer hashed into the wheel
+#[derive(Debug, Clone, Copy)]
+struct WheelEntry {
+    qpn: u32,
+    /// Tick the timer is due at
+    deadline: u64,
+}
+
+/// Hashed timing wheel of the armed transport timers.
+///
+/// Each timer is hashed into the slot of the tick it expires at, so a tick only visits the
+/// timers of its own slot. Timers due more than one revolution ahead stay in their slot until
+/// their tick comes.
+#[derive(Debug)]
+struct TimerWheel {
+    slots: Box<[Vec<WheelEntry>]>,
+    origin: Instant,
+    tick_nanos: u128,
+    /// Next tick to visit
+    current: u64,
+}
+
+impl TimerWheel {
+    fn new(tick: Duration, origin: Instant) -> Self {
+        Self {
+            slots: iter::repeat_with(Vec::new).take(WHEEL_SLOTS).collect(),
+            origin,
+            tick_nanos: tick.as_nanos().max(1),
+            current: 0,
+        }
+    }
+
+    /// Returns the duration of a tick
+    fn tick(&self) -> Duration {
+        Duration::from_nanos(self.tick_nanos as u64)
+    }
+
+    /// Returns the tick that `instant` falls in
+    fn tick_of(&self, instant: Instant) -> u64 {
+        (instant.saturating_duration_since(self.origin).as_nanos() / self.tick_nanos) as u64
+    }
+
+    fn slot_mut(&mut self, tick: u64) -> &mut Vec<WheelEntry> {
+        let index = tick as usize & (WHEEL_SLOTS - 1);
+        self.slots
+            .get_mut(index)
+            .unwrap_or_else(|| unreachable!("slot index out of range"))
+    }
+
+    /// Hashes the timer of `qpn` expiring at `deadline` into the wheel
+    fn insert(&mut self, qpn: u32, deadline: Instant) {
+        // Rounds up so that the timer is never visited before its deadline
+        let nanos = deadline.saturating_duration_since(self.origin).as_nanos();
+        let tick = nanos.div_ceil(self.tick_nanos) as u64;
+        let deadline = tick.max(self.current);
+        self.slot_mut(deadline).push(WheelEntry { qpn, deadline });
+    }
+
+    /// Advances the wheel to `now`, moving the QPNs of the timers due into `expired`
+    fn expire(&mut self, now: Instant, expired: &mut Vec<u32>) {
+        let target = self.tick_of(now);
+        if target < self.current {
+            return;
+        }
+        // Visiting every slot once is enough to catch up after a long stall
+        let start = self
+            .current
+            .max(target.saturating_sub(WHEEL_SLOTS as u64 - 1));
+        for tick in start..=target {
+            self.slot_mut(tick).retain(|entry| {
+                if entry.deadline > target {
+                    return true;
+                }
+                expired.push(entry.qpn);
+                false
+            });
+        }
+        self.current = target + 1;
+    }
+}
+
+/// Timer state of a QP, every field is updated by the same task so they share an entry
+struct QpTimerState {
+    timer: TransportTimer,
+    // TODO: maintain this value as atomic variable
+    outstanding_ack_req_cnt: usize,
+    /// Whether the timer has an entry in the wheel
+    in_wheel: bool,
+    rtt: RttEstimator,
+    /// Outstanding message timed for the next RTT sample, one at a time
+    sample: Option<RttSample>,
+    /// Whether the timeout was set by `ibv_modify_qp`, a reload keeps it
+    modified: bool,
+}
+
+impl QpTimerState {
+    fn new(config: AckTimeoutConfig) -> Self {
+        Self {
+            timer: TransportTimer::new(config.local_ack_timeout_exp, config.init_retry_count),
+            outstanding_ack_req_cnt: 0,
+            in_wheel: false,
+            rtt: RttEstimator::default(),
+            sample: None,
+            modified: false,
+        }
+    }
+}
+
+/// Tracks the transport timers of the QPs.
+///
+/// Only the armed timers are hashed into the timer wheel. Restarting an armed timer only
+/// moves its start, the wheel entry is checked when it is due and hashed again at the new
+/// deadline. The received metas restart an armed timer through the `QpActivity` sampled when
+/// its entry is due.
+///
+/// Unless the timeout is static, the timeout of each QP is the RTO derived from its smoothed
+/// RTT, bounded by the local ACK timeout of the QP. One message at a time is timed from its
+/// `NewAckReq` to the `Ack` acknowledging it, and a message outstanding across a timeout is
+/// never sampled, as its ACK may answer a retransmission (Karn's algorithm).
 pub(crate) struct QpAckTimeoutWorker {
     packet_retransmit_tx: TaskTx<PacketRetransmitTask>,
-    timer_table: QpTable<TransportTimer>,
-    // TODO: maintain this value as atomic variable
-    outstanding_ack_req_cnt: QpTable<usize>,
+    qps: QpTable<QpTimerState>,
     config: AckTimeoutConfig,
+    wheel: TimerWheel,
+    activity: Arc<QpActivity>,
+    /// Buffer of the QPs whose wheel entry is due
+    expired: Vec<u32>,
+    counters: Arc<DeviceCounters>,
+    /// Reloaded timeouts, `None` if the config is never reloaded
+    tunables: Option<TunablesWatch>,
 }
 
 impl SingleThreadTaskWorker for QpAckTimeoutWorker {
@@ -171,46 +483,72 @@ impl SingleThreadTaskWorker for QpAckTimeoutWorker {
 
     fn process(&mut self, task: Self::Task) {
         let qpn = task.qpn();
+        let adaptive = !self.config.static_timeout;
+        let granularity = self.wheel.tick();
         match task {
             AckTimeoutTask::NewAckReq { qpn } => {
                 trace!("new ack req, qpn: {qpn}");
-                let _ignore = self.outstanding_ack_req_cnt.map_qp_mut(qpn, |x| *x += 1);
-                let _ignore = self.timer_table.map_qp_mut(qpn, TransportTimer::restart);
+                let _ignore = self.qps.map_qp_mut(qpn, |x| {
+                    x.outstanding_ack_req_cnt += 1;
+                    if adaptive && x.sample.is_none() {
+                        x.sample = Some(RttSample {
+                            sent: Instant::now(),
+                            position: x.outstanding_ack_req_cnt,
+                        });
+                    }
+                });
+                self.restart(qpn);
             }
-            AckTimeoutTask::RecvMeta { qpn } => {
-                trace!("recv meta, qpn: {qpn}");
-                let _ignore = self.timer_table.map_qp_mut(qpn, TransportTimer::restart);
+            AckTimeoutTask::Ack { qpn, count } => {
+                let _ignore = self.qps.map_qp_mut(qpn, |x| {
+                    if let Some(sample) = x.sample.as_mut() {
+                        if sample.position <= count {
+                            x.rtt.sample(sample.sent.elapsed());
+                            x.sample = None;
+                            self.activity.set_srtt(qpn, x.rtt.srtt);
+                            if let Some(rto) = x.rtt.rto(granularity) {
+                                x.timer.adapt(rto);
+                            }
+                        } else {
+                            sample.position -= count;
+                        }
+                    }
+                    x.outstanding_ack_req_cnt = x.outstanding_ack_req_cnt.saturating_sub(count);
+                    trace!(
+                        "ack, qpn: {qpn}, outstanding: {}",
+                        x.outstanding_ack_req_cnt
+                    );
+                    if x.outstanding_ack_req_cnt == 0 {
+                        x.timer.stop();
+                    }
+                });
             }
-            AckTimeoutTask::Ack { qpn } => {
-                if self
-                    .outstanding_ack_req_cnt
-                    .map_qp_mut(qpn, |x| {
-                        *x -= 1;
-                        trace!("ack, qpn: {qpn}, outstanding: {x}");
-                        *x == 0
-                    })
-                    .unwrap_or(false)
-                {
-                    let _ignore = self.timer_table.map_qp_mut(qpn, TransportTimer::stop);
-                }
+            AckTimeoutTask::SetTimeout {
+                qpn,
+                local_ack_timeout,
+                retry_cnt,
+            } => {
+                let _ignore = self.qps.map_qp_mut(qpn, |x| {
+                    x.modified = true;
+                    if let Some(local_ack_timeout) = local_ack_timeout {
+                        x.timer.set_limit(local_ack_timeout);
+                        x.rtt = RttEstimator::default();
+                        x.sample = None;
+                        self.activity.set_srtt(qpn, None);
+                    }
+                    if let Some(retry_cnt) = retry_cnt {
+                        x.timer.set_retry_count(retry_cnt.into());
+                    }
+                });
             }
         }
     }
 
     fn maintainance(&mut self) {
-        for (index, timer) in self.timer_table.iter_mut().enumerate() {
-            match timer.check_timeout() {
-                TimerResult::Ok => {}
-                TimerResult::Timeout => {
-                    warn!("timeout, qp index: {index}");
-                    // no need for exact qpn, as it will be later converted to index anyway
-                    let qpn = (index << QPN_KEY_PART_WIDTH) as u32;
-                    self.packet_retransmit_tx
-                        .send(PacketRetransmitTask::RetransmitAll { qpn });
-                }
-                TimerResult::RetryLimitExceeded => todo!("handle retry failures"),
-            }
+        if let Some(tunables) = self.tunables.as_mut().and_then(TunablesWatch::changed) {
+            self.reconfigure(tunables.ack);
         }
+        self.maintainance_at(Instant::now());
     }
 }
 
@@ -218,17 +556,111 @@ impl QpAckTimeoutWorker {
     pub(crate) fn new(
         packet_retransmit_tx: TaskTx<PacketRetransmitTask>,
         config: AckTimeoutConfig,
+        activity: Arc<QpActivity>,
+        counters: Arc<DeviceCounters>,
     ) -> Self {
-        let timer_table = QpTable::new_with(|| {
-            TransportTimer::new(config.local_ack_timeout_exp, config.init_retry_count)
-        });
+        let qps = QpTable::new_with(move || QpTimerState::new(config));
+        let tick = Duration::from_nanos(4096u64 << config.check_duration_exp);
         Self {
             packet_retransmit_tx,
-            timer_table,
+            qps,
             config,
-            outstanding_ack_req_cnt: QpTable::new(),
+            wheel: TimerWheel::new(tick, Instant::now()),
+            activity,
+            expired: Vec::new(),
+            counters,
+            tunables: None,
+        }
+    }
+
+    /// Applies the timeouts reloaded into `tunables`
+    pub(crate) fn with_tunables(self, tunables: TunablesWatch) -> Self {
+        Self {
+            tunables: Some(tunables),
+            ..self
+        }
+    }
+
+    /// Applies reloaded timeouts to the QPs whose timeout wasn't set by `ibv_modify_qp` and
+    /// to the QPs allocated from now on. The check interval is the tick of the wheel and
+    /// is kept.
+    fn reconfigure(&mut self, config: AckTimeoutConfig) {
+        let config = AckTimeoutConfig {
+            check_duration_exp: self.config.check_duration_exp,
+            ..config
+        };
+        if config == self.config {
+            return;
+        }
+        debug!("ack timeouts reconfigured: {config:?}");
+        self.config = config;
+        self.qps.set_init(move || QpTimerState::new(config));
+        // A shorter timeout takes effect once the wheel entry of an armed timer is due
+        for state in self.qps.iter_mut().filter(|state| !state.modified) {
+            state.timer.set_limit(config.local_ack_timeout_exp);
+            state.timer.set_retry_count(config.init_retry_count);
+            if config.static_timeout {
+                state.sample = None;
+            }
+        }
+    }
+
+    fn restart(&mut self, qpn: u32) {
+        let _ignore = self.qps.map_qp_mut(qpn, |x| x.timer.restart());
+        self.arm(qpn);
+    }
+
+    /// Hashes the timer of `qpn` into the wheel unless it already has an entry
+    fn arm(&mut self, qpn: u32) {
+        let Some(state) = self.qps.get_qp_mut(qpn) else {
+            return;
+        };
+        let Some(deadline) = state.timer.deadline() else {
+            return;
+        };
+        if !mem::replace(&mut state.in_wheel, true) {
+            self.wheel.insert(qpn, deadline);
         }
     }
+
+    fn maintainance_at(&mut self, now: Instant) {
+        let mut expired = mem::take(&mut self.expired);
+        self.wheel.expire(now, &mut expired);
+        for qpn in expired.drain(..) {
+            let Some(state) = self.qps.get_qp_mut(qpn) else {
+                continue;
+            };
+            state.in_wheel = false;
+            let timer = &mut state.timer;
+            if let Some(activity) = self.activity.last_activity(qpn) {
+                if timer.last_start.is_some_and(|start| start < activity) {
+                    trace!("recv meta, qpn: {qpn}");
+                    timer.restart_at(activity);
+                }
+            }
+            match timer.check_timeout_at(now) {
+                // Restarted since it was hashed, or stopped
+                TimerResult::Ok => {}
+                TimerResult::Timeout => {
+                    warn!("timeout, qpn: {qpn}");
+                    state.sample = None;
+                    self.counters.add(qpn, Counter::Timeouts, 1);
+                    sdt_probe!("timeout", qpn);
+                    self.packet_retransmit_tx
+                        .send(PacketRetransmitTask::RetransmitAll { qpn });
+                }
+                TimerResult::RetryLimitExceeded => {
+                    // TODO: move the QP to the error state and flush its WRs
+                    error!("retry limit exceeded, qpn: {qpn}");
+                    state.timer.stop();
+                    state.outstanding_ack_req_cnt = 0;
+                    state.sample = None;
+                }
+            }
+            self.arm(qpn);
+        }
+        self.expired = expired;
+    }
 }
 
 #[allow(clippy::unchecked_duration_subtraction)]
@@ -238,6 +670,10 @@ mod tests {
     use crate::workers::spawner::task_channel;
     use std::time::Duration;
 
+    fn counters() -> Arc<DeviceCounters> {
+        Arc::new(DeviceCounters::new(4))
+    }
+
     #[test]
     fn test_transport_timer_disabled() {
         let mut timer = TransportTimer::new(0, 3); // timeout disabled
@@ -324,7 +760,8 @@ mod tests {
     fn test_qp_ack_timeout_worker_new_ack_req() {
         let (tx, rx) = task_channel();
         let config = AckTimeoutConfig::default();
-        let mut worker = QpAckTimeoutWorker::new(tx, config);
+        let mut worker =
+            QpAckTimeoutWorker::new(tx, config, Arc::new(QpActivity::new()), counters());
 
         let qpn = 42;
         let task = AckTimeoutTask::new_ack_req(qpn);
@@ -334,44 +771,82 @@ mod tests {
 
         // Verify outstanding count increased
         let count = worker
-            .outstanding_ack_req_cnt
-            .map_qp_mut(qpn, |x| *x)
+            .qps
+            .map_qp(qpn, |x| x.outstanding_ack_req_cnt)
             .unwrap_or(0);
         assert_eq!(count, 1);
 
         // Verify timer is running
         let is_running = worker
-            .timer_table
-            .map_qp_mut(qpn, |timer| timer.is_running())
+            .qps
+            .map_qp(qpn, |x| x.timer.is_running())
             .unwrap_or(false);
         assert!(is_running);
     }
 
     #[test]
-    fn test_qp_ack_timeout_worker_recv_meta() {
+    fn test_qp_ack_timeout_worker_activity() {
         let (tx, rx) = task_channel();
-        let config = AckTimeoutConfig::default();
-        let mut worker = QpAckTimeoutWorker::new(tx, config);
+        // 4.096 uS ticks, 8.192 uS timeout
+        let config = AckTimeoutConfig::new(0, 1, 3);
+        let activity = Arc::new(QpActivity::new());
+        let mut worker = QpAckTimeoutWorker::new(tx, config, Arc::clone(&activity), counters());
+        let qpn = 1 << QPN_KEY_PART_WIDTH;
+        let now = Instant::now();
+        assert!(activity.last_activity(qpn).is_none());
 
-        let qpn = 42;
-        let task = AckTimeoutTask::recv_meta(qpn);
+        worker.process(AckTimeoutTask::new_ack_req(qpn));
+        // A meta received after the ack req restarts the timer
+        activity.touch_at(qpn, now + Duration::from_millis(1));
+        worker.maintainance_at(now + Duration::from_millis(1));
+        assert!(rx.try_recv().is_none());
+        assert_eq!(worker.qps.map_qp(qpn, |x| x.in_wheel), Some(true));
 
-        // Process recv meta task
-        worker.process(task);
+        worker.maintainance_at(now + Duration::from_millis(2));
+        assert_eq!(
+            rx.try_recv(),
+            Some(PacketRetransmitTask::RetransmitAll { qpn })
+        );
+    }
 
-        // Verify timer is running (restarted)
-        let is_running = worker
-            .timer_table
-            .map_qp_mut(qpn, |timer| timer.is_running())
-            .unwrap_or(false);
-        assert!(is_running);
+    #[test]
+    fn reload_keeps_the_timeouts_set_by_modify_qp() {
+        let (tx, _rx) = task_channel();
+        let config = AckTimeoutConfig::new(0, 1, 3);
+        let mut worker =
+            QpAckTimeoutWorker::new(tx, config, Arc::new(QpActivity::new()), counters());
+        let (set, unset) = (1 << QPN_KEY_PART_WIDTH, 2 << QPN_KEY_PART_WIDTH);
+        worker.process(AckTimeoutTask::set_timeout(set, Some(2), Some(1)));
+        worker.process(AckTimeoutTask::new_ack_req(unset));
+
+        worker.reconfigure(AckTimeoutConfig::new(4, 5, 6));
+        let interval = |worker: &QpAckTimeoutWorker, qpn| {
+            worker.qps.map_qp(qpn, |x| x.timer.max_interval).flatten()
+        };
+        assert_eq!(
+            interval(&worker, set),
+            Some(Duration::from_nanos(4096 << 2))
+        );
+        assert_eq!(
+            interval(&worker, unset),
+            Some(Duration::from_nanos(4096 << 5))
+        );
+        // the check interval stays the tick of the wheel
+        assert_eq!(worker.config.check_duration_exp, 0);
+        let fresh = 3 << QPN_KEY_PART_WIDTH;
+        worker.process(AckTimeoutTask::new_ack_req(fresh));
+        assert_eq!(
+            interval(&worker, fresh),
+            Some(Duration::from_nanos(4096 << 5))
+        );
     }
 
     #[test]
     fn test_qp_ack_timeout_worker_ack_single() {
         let (tx, rx) = task_channel();
         let config = AckTimeoutConfig::default();
-        let mut worker = QpAckTimeoutWorker::new(tx, config);
+        let mut worker =
+            QpAckTimeoutWorker::new(tx, config, Arc::new(QpActivity::new()), counters());
 
         let qpn = 42;
 
@@ -380,13 +855,13 @@ mod tests {
 
         // Verify timer is running and count is 1
         let count = worker
-            .outstanding_ack_req_cnt
-            .map_qp_mut(qpn, |x| *x)
+            .qps
+            .map_qp(qpn, |x| x.outstanding_ack_req_cnt)
             .unwrap_or(0);
         assert_eq!(count, 1);
         let is_running = worker
-            .timer_table
-            .map_qp_mut(qpn, |timer| timer.is_running())
+            .qps
+            .map_qp(qpn, |x| x.timer.is_running())
             .unwrap_or(false);
         assert!(is_running);
 
@@ -395,13 +870,13 @@ mod tests {
 
         // Verify count decreased and timer stopped
         let count = worker
-            .outstanding_ack_req_cnt
-            .map_qp_mut(qpn, |x| *x)
+            .qps
+            .map_qp(qpn, |x| x.outstanding_ack_req_cnt)
             .unwrap_or(0);
         assert_eq!(count, 0);
         let is_running = worker
-            .timer_table
-            .map_qp_mut(qpn, |timer| timer.is_running())
+            .qps
+            .map_qp(qpn, |x| x.timer.is_running())
             .unwrap_or(false);
         assert!(!is_running);
     }
@@ -410,7 +885,8 @@ mod tests {
     fn test_qp_ack_timeout_worker_ack_multiple() {
         let (tx, rx) = task_channel();
         let config = AckTimeoutConfig::default();
-        let mut worker = QpAckTimeoutWorker::new(tx, config);
+        let mut worker =
+            QpAckTimeoutWorker::new(tx, config, Arc::new(QpActivity::new()), counters());
 
         let qpn = 42;
 
@@ -420,13 +896,13 @@ mod tests {
 
         // Verify count is 2 and timer is running
         let count = worker
-            .outstanding_ack_req_cnt
-            .map_qp_mut(qpn, |x| *x)
+            .qps
+            .map_qp(qpn, |x| x.outstanding_ack_req_cnt)
             .unwrap_or(0);
         assert_eq!(count, 2);
         let is_running = worker
-            .timer_table
-            .map_qp_mut(qpn, |timer| timer.is_running())
+            .qps
+            .map_qp(qpn, |x| x.timer.is_running())
             .unwrap_or(false);
         assert!(is_running);
 
@@ -435,13 +911,13 @@ mod tests {
 
         // Verify count decreased but timer still running
         let count = worker
-            .outstanding_ack_req_cnt
-            .map_qp_mut(qpn, |x| *x)
+            .qps
+            .map_qp(qpn, |x| x.outstanding_ack_req_cnt)
             .unwrap_or(0);
         assert_eq!(count, 1);
         let is_running = worker
-            .timer_table
-            .map_qp_mut(qpn, |timer| timer.is_running())
+            .qps
+            .map_qp(qpn, |x| x.timer.is_running())
             .unwrap_or(false);
         assert!(is_running);
 
@@ -450,17 +926,224 @@ mod tests {
 
         // Verify count is 0 and timer stopped
         let count = worker
-            .outstanding_ack_req_cnt
-            .map_qp_mut(qpn, |x| *x)
+            .qps
+            .map_qp(qpn, |x| x.outstanding_ack_req_cnt)
             .unwrap_or(0);
         assert_eq!(count, 0);
         let is_running = worker
-            .timer_table
-            .map_qp_mut(qpn, |timer| timer.is_running())
+            .qps
+            .map_qp(qpn, |x| x.timer.is_running())
             .unwrap_or(false);
         assert!(!is_running);
     }
 
+    #[test]
+    fn test_qp_ack_timeout_worker_acked_batch() {
+        let (tx, _rx) = task_channel();
+        let mut worker = QpAckTimeoutWorker::new(
+            tx,
+            AckTimeoutConfig::default(),
+            Arc::new(QpActivity::new()),
+            counters(),
+        );
+        let qpn = 7;
+        for _ in 0..3 {
+            worker.process(AckTimeoutTask::new_ack_req(qpn));
+        }
+        worker.process(AckTimeoutTask::acked(qpn, 2));
+        assert_eq!(
+            worker.qps.map_qp(qpn, |x| x.outstanding_ack_req_cnt),
+            Some(1)
+        );
+        assert_eq!(worker.qps.map_qp(qpn, |x| x.timer.is_running()), Some(true));
+        // a late batch never wraps the count
+        worker.process(AckTimeoutTask::acked(qpn, 4));
+        assert_eq!(
+            worker.qps.map_qp(qpn, |x| x.outstanding_ack_req_cnt),
+            Some(0)
+        );
+        assert_eq!(
+            worker.qps.map_qp(qpn, |x| x.timer.is_running()),
+            Some(false)
+        );
+    }
+
+    #[test]
+    fn test_rtt_estimator() {
+        let mut rtt = RttEstimator::default();
+        let tick = Duration::from_micros(1);
+        assert_eq!(rtt.rto(tick), None);
+        rtt.sample(Duration::from_micros(8));
+        // srtt + 4 * srtt / 2
+        assert_eq!(rtt.rto(tick), Some(Duration::from_micros(24)));
+        rtt.sample(Duration::from_micros(16));
+        // srtt = 7/8 * 8 + 1/8 * 16, rttvar = 3/4 * 4 + 1/4 * 8
+        assert_eq!(rtt.srtt, Some(Duration::from_micros(9)));
+        assert_eq!(rtt.rttvar, Duration::from_micros(5));
+        // the variation term is at least the granularity
+        assert_eq!(
+            rtt.rto(Duration::from_micros(100)),
+            Some(Duration::from_micros(109))
+        );
+    }
+
+    #[test]
+    fn test_qp_ack_timeout_worker_adapts_to_rtt() {
+        let (tx, _rx) = task_channel();
+        // 4.096 uS ticks, 268 mS timeout
+        let config = AckTimeoutConfig::new(0, 16, 3);
+        let mut worker =
+            QpAckTimeoutWorker::new(tx, config, Arc::new(QpActivity::new()), counters());
+        let qpn = 5;
+        let max = Duration::from_nanos(4096 << 16);
+        worker.process(AckTimeoutTask::new_ack_req(qpn));
+        worker.process(AckTimeoutTask::new_ack_req(qpn));
+        // the second message is not timed
+        worker.process(AckTimeoutTask::ack(qpn));
+        let interval = worker
+            .qps
+            .map_qp(qpn, |x| x.timer.timeout_interval)
+            .flatten();
+        assert!(interval.is_some_and(|x| x < max));
+        assert!(worker
+            .qps
+            .map_qp(qpn, |x| x.sample.is_none())
+            .unwrap_or(false));
+        assert!(worker.activity.srtt(qpn).is_some());
+
+        // a new timeout bound resets the estimate
+        worker.process(AckTimeoutTask::set_timeout(qpn, Some(10), None));
+        let interval = worker
+            .qps
+            .map_qp(qpn, |x| x.timer.timeout_interval)
+            .flatten();
+        assert_eq!(interval, Some(Duration::from_nanos(4096 << 10)));
+    }
+
+    #[test]
+    fn test_qp_ack_timeout_worker_per_qp_retry_cnt() {
+        let (tx, rx) = task_channel();
+        // 4.096 uS ticks, 8.192 uS timeout by default
+        let config = AckTimeoutConfig {
+            static_timeout: true,
+            ..AckTimeoutConfig::new(0, 1, 3)
+        };
+        let mut worker =
+            QpAckTimeoutWorker::new(tx, config, Arc::new(QpActivity::new()), counters());
+        let (strict, lenient) = (1, 2);
+        worker.process(AckTimeoutTask::set_timeout(strict, None, Some(0)));
+        // 4.096 uS * 2^3
+        worker.process(AckTimeoutTask::set_timeout(lenient, Some(3), Some(7)));
+        worker.process(AckTimeoutTask::new_ack_req(strict));
+        worker.process(AckTimeoutTask::new_ack_req(lenient));
+        let interval = |worker: &QpAckTimeoutWorker, qpn| {
+            worker
+                .qps
+                .map_qp(qpn, |x| x.timer.timeout_interval)
+                .flatten()
+        };
+        assert_eq!(interval(&worker, strict), Some(Duration::from_nanos(8192)));
+        assert_eq!(
+            interval(&worker, lenient),
+            Some(Duration::from_nanos(32768))
+        );
+
+        let start = Instant::now();
+        worker.maintainance_at(start + Duration::from_micros(20));
+        // the strict QP gives up without a retransmission, the lenient one has not timed out
+        assert!(rx.try_recv().is_none());
+        assert_eq!(
+            worker.qps.map_qp(strict, |x| x.timer.is_running()),
+            Some(false)
+        );
+        worker.maintainance_at(start + Duration::from_micros(80));
+        assert!(matches!(
+            rx.try_recv(),
+            Some(PacketRetransmitTask::RetransmitAll { qpn: 2 })
+        ));
+    }
+
+    #[test]
+    fn test_transport_timer_backs_off_within_bound() {
+        let mut timer = TransportTimer::new(4, 3);
+        timer.adapt(Duration::from_micros(20));
+        timer.restart();
+        timer.last_start = Some(Instant::now() - Duration::from_millis(100));
+        assert!(matches!(timer.check_timeout(), TimerResult::Timeout));
+        assert_eq!(timer.timeout_interval, Some(Duration::from_micros(40)));
+        timer.last_start = Some(Instant::now() - Duration::from_millis(100));
+        assert!(matches!(timer.check_timeout(), TimerResult::Timeout));
+        // 4.096 uS * 2^4
+        assert_eq!(
+            timer.timeout_interval,
+            Some(Duration::from_nanos(4096 << 4))
+        );
+    }
+
+    #[test]
+    fn test_qp_ack_timeout_worker_timeout() {
+        let (tx, rx) = task_channel();
+        // 4.096 uS ticks, 8.192 uS timeout
+        let config = AckTimeoutConfig::new(0, 1, 3);
+        let counters = counters();
+        let mut worker = QpAckTimeoutWorker::new(
+            tx,
+            config,
+            Arc::new(QpActivity::new()),
+            Arc::clone(&counters),
+        );
+        let (qpn_a, qpn_b) = (1 << QPN_KEY_PART_WIDTH, 2 << QPN_KEY_PART_WIDTH);
+        let now = Instant::now();
+
+        worker.process(AckTimeoutTask::new_ack_req(qpn_a));
+        worker.process(AckTimeoutTask::new_ack_req(qpn_b));
+        worker.process(AckTimeoutTask::ack(qpn_b));
+        worker.maintainance_at(now);
+        assert!(rx.try_recv().is_none());
+
+        worker.maintainance_at(now + Duration::from_millis(1));
+        assert_eq!(
+            rx.try_recv(),
+            Some(PacketRetransmitTask::RetransmitAll { qpn: qpn_a })
+        );
+        assert!(rx.try_recv().is_none());
+        assert_eq!(counters.read_qp(qpn_a), Some([0, 0, 0, 0, 1, 0, 0, 0]));
+        assert_eq!(counters.read_qp(qpn_b), Some([0; 8]));
+        // Rearmed after the timeout
+        assert_eq!(worker.qps.map_qp(qpn_a, |x| x.in_wheel), Some(true));
+        assert_eq!(worker.qps.map_qp(qpn_b, |x| x.in_wheel), Some(false));
+    }
+
+    #[test]
+    fn test_timer_wheel_expire() {
+        let origin = Instant::now();
+        let tick = Duration::from_micros(10);
+        let mut wheel = TimerWheel::new(tick, origin);
+        let mut expired = Vec::new();
+
+        wheel.insert(1, origin + tick * 3);
+        // More than one revolution ahead
+        wheel.insert(2, origin + tick * (WHEEL_SLOTS as u32 + 3));
+
+        wheel.expire(origin + tick * 2, &mut expired);
+        assert!(expired.is_empty());
+        wheel.expire(origin + tick * 3, &mut expired);
+        assert_eq!(expired, [1]);
+        expired.clear();
+
+        wheel.expire(origin + tick * (WHEEL_SLOTS as u32 + 2), &mut expired);
+        assert!(expired.is_empty());
+        // Catches up after a stall of several revolutions
+        wheel.expire(origin + tick * (WHEEL_SLOTS as u32 * 4), &mut expired);
+        assert_eq!(expired, [2]);
+        expired.clear();
+
+        // A deadline in the past is due on the next tick
+        wheel.insert(3, origin);
+        wheel.expire(origin + tick * (WHEEL_SLOTS as u32 * 4 + 1), &mut expired);
+        assert_eq!(expired, [3]);
+    }
+
     #[test]
     fn test_transport_timer_restart_resets_retry_counter() {
         let mut timer = TransportTimer::new(1, 3);
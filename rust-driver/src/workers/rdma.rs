@@ -1,35 +1,58 @@
-use std::io;
+use std::{
+    io,
+    sync::Arc,
+    time::{Duration, Instant},
+};
 
 use log::debug;
 use parking_lot::Mutex;
 
 use crate::{
-    constants::PSN_MASK,
+    config::WriteCoalesceConfig,
+    constants::{PSN_MASK, WR_CHUNK_SIZE},
+    latency::Stage,
+    net::rendezvous::SEND_FLAG_PULL,
     rdma_utils::{
-        fragmenter::{WrChunkFragmenter, WrPacketFragmenter},
+        atomic::Atomics,
+        fragmenter::{read_request, WrChunkFragmenter, WrPacketFragmenter},
+        inline::InlineSlots,
         psn::Psn,
-        qp::{num_psn, QpTable, QpTableShared, SendQueueContext, qpn_to_index},
-        types::{QpAttr, SendWrRdma},
+        qp::{num_psn, num_psn_sg_list, QpTableSeqLock, QpTableShared, SendCredits, SendQueueContext, qpn_to_index},
+        types::{QpAttr, SendWrRdma, SgList},
     },
     workers::{
         completion::{Completion, CompletionTask, Event, MessageMeta, SendEvent, SendEventOp},
         qp_timeout::AckTimeoutTask,
         retransmit::{PacketRetransmitTask, SendQueueElem},
-        send::{ChunkPos, QpParams, SendHandle, WorkReqOpCode, WrChunkBuilder},
+        send::{ChunkPos, SendHandle, WorkReqOpCode, WrChunk, WrChunkBuilder},
         spawner::{SingleThreadTaskWorker, TaskTx},
+        sq_ring::SqRing,
+        wr_arena::StagedWr,
     },
 };
 
 #[derive(Debug, PartialEq, Eq)]
 pub(crate) enum RdmaWriteTask {
-    Write { qpn: u32, wr: SendWrRdma },
+    /// A WR staged in the arena of the WRs in flight, the task stays a few words
+    Write { qpn: u32, wr: StagedWr },
+    /// A chain of work requests posted to the same QP, processed in order
+    WriteBatch { qpn: u32, wrs: Vec<SendWrRdma> },
     Ack { qpn: u32, base_psn: Psn },
     NewComplete { qpn: u32, msn: u16 },
+    /// The entries published to the submission ring of a QP, posted until the ring is empty
+    Doorbell { qpn: u32, ring: Arc<SqRing> },
 }
 
 impl RdmaWriteTask {
     pub(crate) fn new_write(qpn: u32, wr: SendWrRdma) -> Self {
-        Self::Write { qpn, wr }
+        Self::Write {
+            qpn,
+            wr: StagedWr::new(wr),
+        }
+    }
+
+    pub(crate) fn new_write_batch(qpn: u32, wrs: Vec<SendWrRdma>) -> Self {
+        Self::WriteBatch { qpn, wrs }
     }
 
     pub(crate) fn new_ack(qpn: u32, base_psn: Psn) -> Self {
@@ -39,15 +62,28 @@ impl RdmaWriteTask {
     pub(crate) fn new_complete(qpn: u32, msn: u16) -> Self {
         Self::NewComplete { qpn, msn }
     }
+
+    pub(crate) fn new_doorbell(qpn: u32, ring: Arc<SqRing>) -> Self {
+        Self::Doorbell { qpn, ring }
+    }
+
+    /// Returns the shard key of the task, the index of its QP
+    pub(crate) fn shard_key(&self) -> usize {
+        match *self {
+            Self::Write { qpn, .. }
+            | Self::WriteBatch { qpn, .. }
+            | Self::Ack { qpn, .. }
+            | Self::NewComplete { qpn, .. }
+            | Self::Doorbell { qpn, .. } => qpn_to_index(qpn),
+        }
+    }
 }
 
 pub(crate) struct RdmaWriteWorker {
-    sq_ctx_table: QpTable<SendQueueContext>,
-    qp_attr_table: QpTableShared<QpAttr>,
+    poster: WrPoster,
     send_handle: SendHandle,
-    timeout_tx: TaskTx<AckTimeoutTask>,
-    retransmit_tx: TaskTx<PacketRetransmitTask>,
-    completion_tx: TaskTx<CompletionTask>,
+    /// Merges the small writes, `None` if disabled
+    combiner: Option<WriteCombiner>,
 }
 
 impl SingleThreadTaskWorker for RdmaWriteWorker {
@@ -55,76 +91,348 @@ impl SingleThreadTaskWorker for RdmaWriteWorker {
 
     fn process(&mut self, task: Self::Task) {
         match task {
-            RdmaWriteTask::Write { qpn, wr } => {
-                #[allow(clippy::wildcard_enum_match_arm)]
-                let _resp = match wr.opcode() {
-                    WorkReqOpCode::RdmaWrite
-                    | WorkReqOpCode::RdmaWriteWithImm
-                    | WorkReqOpCode::Send
-                    | WorkReqOpCode::SendWithImm
-                    | WorkReqOpCode::RdmaReadResp => self.write(qpn, wr),
-                    WorkReqOpCode::RdmaRead => self.rdma_read(qpn, wr),
-                    _ => unreachable!("opcode unsupported"),
-                };
+            RdmaWriteTask::Write { qpn, wr } => self.post(qpn, wr.into_wr()),
+            RdmaWriteTask::WriteBatch { qpn, wrs } => {
+                for wr in wrs {
+                    self.post(qpn, wr);
+                }
             }
             RdmaWriteTask::Ack { qpn, base_psn } => {
-                let ctx = self.sq_ctx_table.get_qp_mut(qpn).expect("invalid qpn");
-                ctx.update_psn_acked(base_psn);
+                self.poster
+                    .sq_ctx_table
+                    .map_qp_mut(qpn, |ctx| ctx.update_psn_acked(base_psn))
+                    .expect("invalid qpn");
             }
             RdmaWriteTask::NewComplete { qpn, msn } => {
-                let ctx = self.sq_ctx_table.get_qp_mut(qpn).expect("invalid qpn");
-                ctx.update_msn_acked(msn);
+                let completed = self
+                    .poster
+                    .sq_ctx_table
+                    .map_qp_mut(qpn, |ctx| ctx.update_msn_acked(msn))
+                    .expect("invalid qpn");
+                self.poster.credits.give_back(qpn, completed);
+            }
+            RdmaWriteTask::Doorbell { qpn, ring } => {
+                while let Some(entry) = ring.pop() {
+                    let Some(wr) = entry.to_wr() else {
+                        debug!("unsupported opcode in submission ring of QP {qpn}");
+                        continue;
+                    };
+                    self.post(qpn, wr);
+                }
             }
         }
     }
 
-    fn maintainance(&mut self) {}
+    /// Posts the merged write once the worker runs out of work
+    fn maintainance(&mut self) {
+        self.flush_combined();
+    }
 }
 
 impl RdmaWriteWorker {
+    pub(crate) fn new(poster: WrPoster, send_handle: SendHandle) -> Self {
+        Self {
+            poster,
+            send_handle,
+            combiner: None,
+        }
+    }
+
+    /// Merges the consecutive small writes of each QP as configured by `config`
+    pub(crate) fn with_write_coalesce(self, config: WriteCoalesceConfig) -> Self {
+        Self {
+            combiner: config.enabled.then(|| WriteCombiner::new(config)),
+            ..self
+        }
+    }
+
+    /// Posts a WR, a small write is held to merge the writes following it
+    fn post(&mut self, qpn: u32, wr: SendWrRdma) {
+        wr.posted().record(Stage::Dequeue);
+        let Some(combiner) = self.combiner.as_mut() else {
+            self.submit(qpn, wr);
+            return;
+        };
+        if combiner.merge(qpn, &wr) {
+            return;
+        }
+        // The held write precedes the WR
+        let held = combiner.take();
+        let wr = combiner.hold(qpn, wr);
+        if let Some(held) = held {
+            self.submit_merged(held);
+        }
+        if let Some(wr) = wr {
+            self.submit(qpn, wr);
+        }
+    }
+
+    fn flush_combined(&mut self) {
+        if let Some(held) = self.combiner.as_mut().and_then(WriteCombiner::take) {
+            self.submit_merged(held);
+        }
+    }
+
+    fn submit_merged(&self, held: HeldWrite) {
+        // The merged write takes a single MSN, the credits of the WRs merged into it are
+        // not returned by the MSN of their completion
+        self.poster
+            .credits
+            .give_back(held.qpn, held.merged.saturating_sub(1));
+        self.submit(held.qpn, held.wr);
+    }
+
+    fn submit(&self, qpn: u32, wr: SendWrRdma) {
+        let _resp = self.poster.post(qpn, wr, |c| self.send_handle.send(c));
+    }
+}
+
+/// A write of a QP the following writes are merged into
+#[derive(Debug)]
+struct HeldWrite {
+    qpn: u32,
+    wr: SendWrRdma,
+    /// Number of WRs merged into the write
+    merged: u32,
+    /// Time the first WR was held
+    since: Instant,
+}
+
+/// Merges consecutive small RDMA writes of a QP covering contiguous local and remote ranges
+#[derive(Debug)]
+struct WriteCombiner {
+    max_bytes: u32,
+    max_delay: Duration,
+    held: Option<HeldWrite>,
+}
+
+impl WriteCombiner {
+    fn new(config: WriteCoalesceConfig) -> Self {
+        Self {
+            max_bytes: config.max_bytes,
+            max_delay: Duration::from_micros(config.max_delay_us),
+            held: None,
+        }
+    }
+
+    /// Returns `true` if the WR is a single buffer unsignaled write leaving room to merge
+    /// another
+    fn is_mergeable(&self, wr: &SendWrRdma) -> bool {
+        wr.opcode() == WorkReqOpCode::RdmaWrite
+            && wr.send_flags() == 0
+            && wr.sg_list().len() == 1
+            && wr.length() < self.max_bytes
+    }
+
+    /// Merges `wr` into the held write, returns `false` if it doesn't extend it
+    fn merge(&mut self, qpn: u32, wr: &SendWrRdma) -> bool {
+        let mergeable = self.is_mergeable(wr);
+        let Some(held) = self.held.as_mut() else {
+            return false;
+        };
+        let length = held.wr.length();
+        let extends = mergeable
+            && held.qpn == qpn
+            && held.wr.lkey() == wr.lkey()
+            && held.wr.rkey() == wr.rkey()
+            && held.wr.laddr().checked_add(u64::from(length)) == Some(wr.laddr())
+            && held.wr.raddr().checked_add(u64::from(length)) == Some(wr.raddr())
+            && length.saturating_add(wr.length()) <= self.max_bytes
+            && held.since.elapsed() < self.max_delay;
+        if !extends {
+            return false;
+        }
+        let length = length + wr.length();
+        held.wr.base.length = length;
+        held.wr.base.sg_list = SgList::single(held.wr.laddr(), length, held.wr.lkey());
+        held.merged += 1;
+
+        true
+    }
+
+    /// Holds `wr` to merge the following writes into it, returns it if it can't be merged
+    fn hold(&mut self, qpn: u32, wr: SendWrRdma) -> Option<SendWrRdma> {
+        if self.held.is_some() || !self.is_mergeable(&wr) {
+            return Some(wr);
+        }
+        self.held = Some(HeldWrite {
+            qpn,
+            wr,
+            merged: 1,
+            since: Instant::now(),
+        });
+        None
+    }
+
+    /// Takes the held write
+    fn take(&mut self) -> Option<HeldWrite> {
+        self.held.take()
+    }
+}
+
+/// Turns work requests into chunks and dispatches the bookkeeping tasks of each WR.
+///
+/// Used by the `RdmaWriteWorker` and by the posting threads of QPs in direct doorbell mode,
+/// the PSN/MSN allocation is serialized by the lock of the per-QP `SendQueueContext`.
+#[derive(Clone)]
+pub(crate) struct WrPoster {
+    sq_ctx_table: QpTableShared<SendQueueContext>,
+    /// Credits of the send queues, taken by the posting threads
+    credits: Arc<SendCredits>,
+    qp_attr_table: QpTableSeqLock<QpAttr>,
+    timeout_tx: TaskTx<AckTimeoutTask>,
+    retransmit_tx: TaskTx<PacketRetransmitTask>,
+    completion_tx: TaskTx<CompletionTask>,
+    /// Bounce slots of inline WRs
+    inline_slots: InlineSlots,
+    /// Local buffers of the atomic WRs waiting for their ACK
+    atomics: Atomics,
+}
+
+impl WrPoster {
     pub(crate) fn new(
-        qp_attr_table: QpTableShared<QpAttr>,
-        send_handle: SendHandle,
+        qp_attr_table: QpTableSeqLock<QpAttr>,
         timeout_tx: TaskTx<AckTimeoutTask>,
         retransmit_tx: TaskTx<PacketRetransmitTask>,
         completion_tx: TaskTx<CompletionTask>,
+        inline_slots: InlineSlots,
+        atomics: Atomics,
     ) -> Self {
         Self {
-            sq_ctx_table: QpTable::new(),
+            sq_ctx_table: QpTableShared::new(),
+            credits: Arc::new(SendCredits::new()),
             qp_attr_table,
-            send_handle,
             timeout_tx,
             retransmit_tx,
             completion_tx,
+            inline_slots,
+            atomics,
+        }
+    }
+
+    /// Returns the send queue credits of the QPs
+    pub(crate) fn credits(&self) -> &SendCredits {
+        &self.credits
+    }
+
+    /// Returns `true` if all packets of the QP before `psn` are acknowledged
+    pub(crate) fn is_acked(&self, qpn: u32, psn: Psn) -> bool {
+        self.sq_ctx_table
+            .map_qp(qpn, |ctx| ctx.psn_acked >= psn)
+            .unwrap_or(true)
+    }
+
+    /// Resumes the send queue of a QP restored from a snapshot at the WR `msn` starting at
+    /// `psn`
+    pub(crate) fn resume(&self, qpn: u32, msn: u16, psn: Psn) {
+        let _ignore = self
+            .sq_ctx_table
+            .map_qp_mut(qpn, |ctx| *ctx = SendQueueContext::resume(msn, psn));
+    }
+
+    /// Posts a work request, the chunks are passed to `submit` in PSN order
+    pub(crate) fn post<F: FnMut(WrChunk)>(
+        &self,
+        qpn: u32,
+        wr: SendWrRdma,
+        submit: F,
+    ) -> io::Result<()> {
+        #[allow(clippy::wildcard_enum_match_arm)]
+        match wr.opcode() {
+            WorkReqOpCode::RdmaWrite
+            | WorkReqOpCode::RdmaWriteWithImm
+            | WorkReqOpCode::Send
+            | WorkReqOpCode::SendWithImm
+            | WorkReqOpCode::RdmaReadResp => self.write(qpn, wr, submit),
+            WorkReqOpCode::RdmaRead => self.rdma_read(qpn, wr, submit),
+            WorkReqOpCode::AtomicCmpAndSwp
+            | WorkReqOpCode::AtomicFetchAndAdd
+            | WorkReqOpCode::AtomicWrite
+            | WorkReqOpCode::Flush => self.atomic(qpn, wr, submit),
+            _ => unreachable!("opcode unsupported"),
         }
     }
 
-    fn rdma_read(&mut self, qpn: u32, wr: SendWrRdma) -> io::Result<()> {
+    /// Allocates the MSN and the PSN range of a WR
+    fn next_wr(&self, qpn: u32, num_psn: u32) -> io::Result<(u16, Psn)> {
+        self.sq_ctx_table
+            .map_qp_mut(qpn, |ctx| ctx.next_wr(num_psn))
+            .flatten()
+            .ok_or(io::Error::from(io::ErrorKind::InvalidInput))
+    }
+
+    fn rdma_read<F: FnMut(WrChunk)>(
+        &self,
+        qpn: u32,
+        wr: SendWrRdma,
+        mut submit: F,
+    ) -> io::Result<()> {
         let qp = self
             .qp_attr_table
             .get_qp(qpn)
             .ok_or(io::Error::from(io::ErrorKind::InvalidInput))?;
 
-        let addr = wr.raddr();
-        let length = wr.length();
-        let num_psn = 1;
-        let (msn, psn) = self
-            .sq_ctx_table
-            .get_qp_mut(qpn)
-            .and_then(|ctx| ctx.next_wr(num_psn))
+        let requests = split_read(wr, qp.max_rd_atomic, qp.chunk_size);
+        // Each request takes a PSN, the WR keeps a single MSN
+        let num_psn = requests.len() as u32;
+        let (msn, psn) = self.next_wr(qpn, num_psn)?;
+        let end_psn = psn + num_psn;
+        let qp_params = qp.qp_params(msn);
+        let flags = wr.send_flags();
+        let mut ack_req = false;
+        if flags & ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0 != 0 {
+            ack_req = true;
+            let wr_id = wr.wr_id();
+            let send_cq_handle = qp
+                .send_cq
+                .ok_or(io::Error::from(io::ErrorKind::InvalidInput))?;
+            let op = if flags & SEND_FLAG_PULL == 0 {
+                SendEventOp::ReadSignaled
+            } else {
+                SendEventOp::Pull {
+                    addr: wr.laddr(),
+                    len: wr.length(),
+                }
+            };
+            let event = Event::Send(SendEvent::new(
+                qpn,
+                op,
+                MessageMeta::new(msn, end_psn),
+                wr_id,
+            ));
+            self.completion_tx
+                .send(CompletionTask::Register { qpn, event });
+        }
+
+        if ack_req {
+            self.timeout_tx.send(AckTimeoutTask::new_ack_req(qpn));
+        }
+
+        for (request, psn) in requests.into_iter().zip((0..).map(|i| psn + i)) {
+            self.retransmit_tx.send(PacketRetransmitTask::NewWr {
+                qpn,
+                wr: SendQueueElem::new(request, psn, qp_params),
+            });
+            submit(read_request(request, qp_params, psn));
+        }
+
+        Ok(())
+    }
+
+    /// Posts an atomic WR, a single packet whose original value is written to the local
+    /// buffer once its atomic ACK arrives. Atomic writes and flushes are posted the same way,
+    /// they complete once their atomic ACK arrives.
+    fn atomic<F: FnMut(WrChunk)>(&self, qpn: u32, wr: SendWrRdma, mut submit: F) -> io::Result<()> {
+        let qp = self
+            .qp_attr_table
+            .get_qp(qpn)
             .ok_or(io::Error::from(io::ErrorKind::InvalidInput))?;
+
+        let num_psn = 1;
+        let (msn, psn) = self.next_wr(qpn, num_psn)?;
         let end_psn = psn + num_psn;
-        let qp_params = QpParams::new(
-            msn,
-            qp.qp_type,
-            qp.qpn,
-            qp.mac_addr,
-            qp.dqpn,
-            qp.dqp_ip,
-            qp.pmtu,
-        );
-        let opcode = WorkReqOpCode::RdmaRead;
-        let chunk = WrChunkBuilder::new_with_opcode(opcode)
+        let qp_params = qp.qp_params(msn);
+        let chunk = WrChunkBuilder::new_with_opcode(wr.opcode())
             .set_qp_params(qp_params)
             .set_ibv_params(
                 wr.send_flags() as u8,
@@ -134,20 +442,29 @@ impl RdmaWriteWorker {
                 wr.imm(),
             )
             .set_chunk_meta(psn, wr.laddr(), wr.raddr(), wr.length(), ChunkPos::Only)
+            .set_atomic(wr.atomic())
+            .set_posted(wr.posted())
             .build();
+        // The atomic writes and the flushes have no original value to return
+        if wr.opcode().is_atomic() {
+            self.atomics.expect_result(qpn, psn, wr.laddr());
+        }
         let flags = wr.send_flags();
         let mut ack_req = false;
         if flags & ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0 != 0 {
             ack_req = true;
-            let wr_id = wr.wr_id();
-            let send_cq_handle = qp
-                .send_cq
-                .ok_or(io::Error::from(io::ErrorKind::InvalidInput))?;
+            #[allow(clippy::wildcard_enum_match_arm)]
+            let op = match wr.opcode() {
+                WorkReqOpCode::AtomicCmpAndSwp => SendEventOp::CmpAndSwpSignaled,
+                WorkReqOpCode::AtomicWrite => SendEventOp::AtomicWriteSignaled,
+                WorkReqOpCode::Flush => SendEventOp::FlushSignaled,
+                _ => SendEventOp::FetchAndAddSignaled,
+            };
             let event = Event::Send(SendEvent::new(
                 qpn,
-                SendEventOp::ReadSignaled,
+                op,
                 MessageMeta::new(msn, end_psn),
-                wr_id,
+                wr.wr_id(),
             ));
             self.completion_tx
                 .send(CompletionTask::Register { qpn, event });
@@ -162,12 +479,12 @@ impl RdmaWriteWorker {
             wr: SendQueueElem::new(wr, psn, qp_params),
         });
 
-        self.send_handle.send(chunk);
+        submit(chunk);
 
         Ok(())
     }
 
-    fn write(&mut self, qpn: u32, wr: SendWrRdma) -> io::Result<()> {
+    fn write<F: FnMut(WrChunk)>(&self, qpn: u32, wr: SendWrRdma, submit: F) -> io::Result<()> {
         
         let qp = self
             .qp_attr_table
@@ -178,15 +495,18 @@ impl RdmaWriteWorker {
 
         let addr = wr.raddr();
         let length = wr.length();
-        let num_psn =
-            num_psn(qp.pmtu, addr, length).ok_or(io::Error::from(io::ErrorKind::InvalidInput))?;
-        let (msn, psn) = self
-            .sq_ctx_table
-            .get_qp_mut(qpn)
-            .and_then(|ctx| ctx.next_wr(num_psn))
-            .ok_or(io::Error::from(io::ErrorKind::InvalidInput))?;
+        let num_psn = if wr.sg_list().len() > 1 {
+            num_psn_sg_list(qp.pmtu, addr, wr.sg_list())
+        } else {
+            num_psn(qp.pmtu, addr, length)
+        }
+        .ok_or(io::Error::from(io::ErrorKind::InvalidInput))?;
+        let (msn, psn) = self.next_wr(qpn, num_psn)?;
         let end_psn = psn + num_psn;
         let flags = wr.send_flags();
+        if flags & ibverbs_sys::ibv_send_flags::IBV_SEND_INLINE.0 != 0 {
+            self.inline_slots.posted(wr.laddr(), qpn, end_psn);
+        }
         let mut ack_req = false;
         if flags & ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0 != 0 {
             ack_req = true;
@@ -199,32 +519,25 @@ impl RdmaWriteWorker {
                 WorkReqOpCode::RdmaWrite | WorkReqOpCode::RdmaWriteWithImm => {
                     SendEventOp::WriteSignaled
                 }
-                WorkReqOpCode::Send | WorkReqOpCode::SendWithImm => SendEventOp::SendSignaled,
+                // The read response of a pulled send completes the send
+                WorkReqOpCode::Send | WorkReqOpCode::SendWithImm | WorkReqOpCode::RdmaReadResp => {
+                    SendEventOp::SendSignaled
+                }
                 WorkReqOpCode::RdmaRead => SendEventOp::ReadSignaled,
                 _ => return Err(io::ErrorKind::Unsupported.into()),
             };
-            let event = Event::Send(SendEvent::new(
-                qpn,
-                op,
-                MessageMeta::new(msn, end_psn),
-                wr_id,
-            ));
+            let event = Event::Send(
+                SendEvent::new(qpn, op, MessageMeta::new(msn, end_psn), wr_id).with_first_psn(psn),
+            );
             self.completion_tx
                 .send(CompletionTask::Register { qpn, event });
         }
-        let qp_params = QpParams::new(
-            msn,
-            qp.qp_type,
-            qp.qpn,
-            qp.mac_addr,
-            qp.dqpn,
-            qp.dqp_ip,
-            qp.pmtu,
-        );
+        let qp_params = qp.qp_params(msn);
 
         if ack_req {
-            let fragmenter = WrPacketFragmenter::new(wr, qp_params, psn);
-            let Some(last_packet_chunk) = fragmenter.into_iter().last() else {
+            let Some(last_packet_chunk) =
+                WrPacketFragmenter::last_packet(wr, qp_params, psn, end_psn)
+            else {
                 debug!("RdmaWriteWorker handle write early return");
                 return Ok(());
             };
@@ -236,10 +549,9 @@ impl RdmaWriteWorker {
             wr: SendQueueElem::new(wr, psn, qp_params),
         });
 
-        let fragmenter = WrChunkFragmenter::new(wr, qp_params, psn);
-        for chunk in fragmenter {
-            self.send_handle.send(chunk);
-        }
+        WrChunkFragmenter::new(wr, qp_params, psn, qp.chunk_size)
+            .into_iter()
+            .for_each(submit);
 
 
         debug!("RdmaWriteWorker handle write done");
@@ -247,15 +559,62 @@ impl RdmaWriteWorker {
     }
 }
 
+/// Splits a large read into requests of at least `chunk_size` bytes, 0 selects
+/// `WR_CHUNK_SIZE`, so that up to `max_rd_atomic` of them are outstanding at once and their
+/// responses are sent by the responder as separate WRs. Only the last request is signaled.
+///
+/// The reads into several local buffers and the reads of a pulled send, which the responder
+/// matches by address and length, are requested whole.
+fn split_read(wr: SendWrRdma, max_rd_atomic: u8, chunk_size: u32) -> Vec<SendWrRdma> {
+    let chunk_size = if chunk_size == 0 {
+        WR_CHUNK_SIZE
+    } else {
+        chunk_size
+    };
+    let length = wr.length();
+    if max_rd_atomic <= 1
+        || length <= chunk_size
+        || wr.sg_list().len() > 1
+        || wr.send_flags() & SEND_FLAG_PULL != 0
+    {
+        return vec![wr];
+    }
+    let request_len = length
+        .div_ceil(u32::from(max_rd_atomic))
+        .next_multiple_of(chunk_size);
+    let signaled = ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0;
+    (0..length)
+        .step_by(request_len as usize)
+        .map(|offset| {
+            let len = request_len.min(length - offset);
+            let mut request = wr;
+            request.base.laddr = wr.laddr() + u64::from(offset);
+            request.base.length = len;
+            request.base.sg_list = SgList::single(request.base.laddr, len, wr.lkey());
+            request.raddr = wr.raddr() + u64::from(offset);
+            if offset + len < length {
+                request.base.send_flags &= !signaled;
+            }
+            request
+        })
+        .collect()
+}
+
 #[cfg(test)]
 mod tests {
-    use crossbeam_deque::Injector;
-
     use super::*;
     use crate::{
+        config::CongestionConfig,
+        latency::Stamp,
         net::config::MacAddress,
-        rdma_utils::types::SendWrBase,
-        workers::spawner::{task_channel, TaskRx},
+        rdma_utils::{
+            atomic::AtomicOperands,
+            types::{SendWrBase, SgList},
+        },
+        workers::{
+            send::{QpParams, QpPriorities, QpScheduler, RateControl},
+            spawner::{task_channel, TaskRx},
+        },
     };
     use std::{net::Ipv4Addr, str::FromStr, sync::Arc};
 
@@ -305,16 +664,19 @@ mod tests {
             lkey: 0x456,
             imm_data: 0,
             opcode,
+            sg_list: SgList::single(0x1000, 1024, 0x456),
+            posted: Stamp::default(),
         };
         SendWrRdma {
             base,
             raddr: 0x2000,
             rkey: 0x789,
+            atomic: AtomicOperands::default(),
         }
     }
 
     fn create_test_qp_attr() -> QpAttr {
-        QpAttr {
+        let mut attr = QpAttr {
             qp_type: ibverbs_sys::ibv_qp_type::IBV_QPT_RC as u8,
             qpn: 1,
             mac_addr: 0xAABB_CCDD_EE0A,
@@ -325,39 +687,37 @@ mod tests {
             send_cq: Some(1),
             recv_cq: Some(2),
             access_flags: 4,
-        }
+            ..Default::default()
+        };
+        attr.refresh_send_template();
+        attr
     }
 
     fn create_test_qp_param(msn: u16) -> QpParams {
-        QpParams {
-            msn,
-            qp_type: ibverbs_sys::ibv_qp_type::IBV_QPT_RC as u8,
-            sqpn: 1,
-            mac_addr: 0xAABB_CCDD_EE0A,
-            dqpn: 2,
-            dqp_ip: 0x14,
-            pmtu: 1,
-        }
+        create_test_qp_attr().qp_params(msn)
     }
 
     fn init_worker() -> (RdmaWriteWorker, Rxs) {
-        let qp_attr_table = QpTableShared::new();
+        let qp_attr_table = QpTableSeqLock::new();
         let qp_attr = create_test_qp_attr();
         qp_attr_table.map_qp_mut(1, |attr| *attr = qp_attr).unwrap();
 
-        let injector = Arc::new(Injector::new());
-        let send_handle = SendHandle::new(injector);
+        let rate = Arc::new(RateControl::new(&CongestionConfig::default()));
+        let scheduler = QpScheduler::new(1, rate, Arc::new(QpPriorities::new()));
+        let send_handle = SendHandle::new(Arc::new(scheduler), Arc::from([]));
         let (timeout_tx, timeout_rx) = task_channel();
         let (retransmit_tx, retransmit_rx) = task_channel();
         let (completion_tx, completion_rx) = task_channel();
 
-        let worker = RdmaWriteWorker::new(
+        let poster = WrPoster::new(
             qp_attr_table,
-            send_handle,
             timeout_tx,
             retransmit_tx,
             completion_tx,
+            InlineSlots::new(),
+            Atomics::new(),
         );
+        let worker = RdmaWriteWorker::new(poster, send_handle);
 
         let rxs = Rxs {
             timeout_rx,
@@ -385,6 +745,41 @@ mod tests {
         rxs.assert_no_completion();
     }
 
+    #[test]
+    fn contiguous_unsignaled_writes_are_merged() {
+        let (worker, rxs) = init_worker();
+        let config = WriteCoalesceConfig {
+            enabled: true,
+            max_bytes: 4096,
+            max_delay_us: 1_000_000,
+        };
+        let mut worker = worker.with_write_coalesce(config);
+
+        let wrs: Vec<_> = (0..3u32)
+            .map(|i| {
+                let mut wr = create_test_send_wr_rdma(WorkReqOpCode::RdmaWrite);
+                let offset = u64::from(i * 64);
+                wr.base.laddr += offset;
+                wr.base.length = 64;
+                wr.base.sg_list = SgList::single(wr.base.laddr, 64, wr.base.lkey);
+                wr.raddr += offset;
+                wr
+            })
+            .collect();
+        worker.process(RdmaWriteTask::new_write_batch(1, wrs.clone()));
+        rxs.assert_no_retransmit();
+        worker.maintainance();
+
+        let mut merged = wrs[0];
+        merged.base.length = 192;
+        merged.base.sg_list = SgList::single(merged.base.laddr, 192, merged.base.lkey);
+        rxs.assert_retransmit(PacketRetransmitTask::NewWr {
+            qpn: 1,
+            wr: SendQueueElem::new(merged, Psn(0), create_test_qp_param(0)),
+        });
+        rxs.assert_no_retransmit();
+    }
+
     #[test]
     fn test_process_rdma_read_task() {
         let (mut worker, rxs) = init_worker();
@@ -435,12 +830,15 @@ mod tests {
         });
         rxs.assert_completion(CompletionTask::Register {
             qpn: 1,
-            event: Event::Send(SendEvent::new(
-                1,
-                SendEventOp::WriteSignaled,
-                MessageMeta::new(0, Psn(4)),
-                123,
-            )),
+            event: Event::Send(
+                SendEvent::new(
+                    1,
+                    SendEventOp::WriteSignaled,
+                    MessageMeta::new(0, Psn(4)),
+                    123,
+                )
+                .with_first_psn(Psn(0)),
+            ),
         });
 
         rxs.assert_timeout(AckTimeoutTask::NewAckReq { qpn: 1 });
@@ -473,12 +871,71 @@ mod tests {
         rxs.assert_timeout(AckTimeoutTask::NewAckReq { qpn: 1 });
     }
 
+    #[test]
+    fn large_reads_are_split_up_to_max_rd_atomic() {
+        let signaled = ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0;
+        let mut wr = create_test_send_wr_rdma(WorkReqOpCode::RdmaRead);
+        wr.base.send_flags = signaled;
+        wr.base.length = 1 << 20;
+        wr.base.sg_list = SgList::single(wr.base.laddr, 1 << 20, wr.base.lkey);
+
+        let requests = split_read(wr, 4, 0);
+        assert_eq!(requests.len(), 4);
+        for (i, request) in (0..).zip(&requests) {
+            assert_eq!(request.length(), 256 << 10);
+            assert_eq!(request.laddr(), 0x1000 + i * (256 << 10));
+            assert_eq!(request.raddr(), 0x2000 + i * (256 << 10));
+            assert_eq!(request.send_flags() & signaled != 0, i == 3);
+        }
+        // The requests are at least a chunk long
+        assert_eq!(split_read(wr, 16, 0).len(), 16);
+        assert_eq!(split_read(wr, 16, 1 << 19).len(), 2);
+        assert_eq!(split_read(wr, 1, 0), vec![wr]);
+        wr.base.send_flags |= SEND_FLAG_PULL;
+        assert_eq!(split_read(wr, 4, 0), vec![wr]);
+    }
+
+    #[test]
+    fn test_process_signaled_atomic() {
+        let (worker, rxs) = init_worker();
+
+        let mut wr = create_test_send_wr_rdma(WorkReqOpCode::AtomicFetchAndAdd);
+        wr.base.send_flags = ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0;
+        wr.base.length = 8;
+        wr.atomic = AtomicOperands::new(0x1122_3344_5566_7788, 0);
+        let mut chunks = Vec::new();
+        worker.poster.post(1, wr, |c| chunks.push(c)).unwrap();
+
+        let [chunk] = chunks.as_slice() else {
+            panic!("expected a single chunk");
+        };
+        assert!(chunk.is_first && chunk.is_last);
+        assert_eq!(
+            (chunk.imm, chunk.lkey, chunk.len),
+            (0x1122_3344, 0x5566_7788, 0)
+        );
+        rxs.assert_completion(CompletionTask::Register {
+            qpn: 1,
+            event: Event::Send(SendEvent::new(
+                1,
+                SendEventOp::FetchAndAddSignaled,
+                MessageMeta::new(0, Psn(1)),
+                123,
+            )),
+        });
+        rxs.assert_timeout(AckTimeoutTask::NewAckReq { qpn: 1 });
+        rxs.assert_retransmit(PacketRetransmitTask::NewWr {
+            qpn: 1,
+            wr: SendQueueElem::new(wr, Psn(0), create_test_qp_param(0)),
+        });
+    }
+
     #[test]
     fn test_process_ack_task() {
         let (mut worker, rxs) = init_worker();
 
-        let ctx = worker.sq_ctx_table.get_qp_mut(1).unwrap();
-        let initial_psn_acked = ctx.psn_acked;
+        let sq_ctx_table = worker.poster.sq_ctx_table.clone();
+        let initial_psn_acked = sq_ctx_table.map_qp(1, |ctx| ctx.psn_acked).unwrap();
 
         let psn = Psn(100);
         let task = RdmaWriteTask::new_ack(1, psn);
@@ -486,8 +943,8 @@ mod tests {
         worker.process(task);
 
         // Verify PSN was updated
-        let ctx = worker.sq_ctx_table.get_qp(1).unwrap();
-        assert_ne!(ctx.psn_acked, initial_psn_acked);
+        let psn_acked = sq_ctx_table.map_qp(1, |ctx| ctx.psn_acked).unwrap();
+        assert_ne!(psn_acked, initial_psn_acked);
 
         rxs.assert_no_timeout();
         rxs.assert_no_retransmit();
@@ -498,16 +955,16 @@ mod tests {
     fn test_process_complete_task() {
         let (mut worker, rxs) = init_worker();
 
-        let ctx = worker.sq_ctx_table.get_qp_mut(1).unwrap();
-        let initial_msn_acked = ctx.msn_acked;
+        let sq_ctx_table = worker.poster.sq_ctx_table.clone();
+        let initial_msn_acked = sq_ctx_table.map_qp(1, |ctx| ctx.msn_acked).unwrap();
 
         let task = RdmaWriteTask::new_complete(1, 50);
 
         worker.process(task);
 
         // Verify MSN was updated
-        let ctx = worker.sq_ctx_table.get_qp(1).unwrap();
-        assert_ne!(ctx.msn_acked, initial_msn_acked);
+        let msn_acked = sq_ctx_table.map_qp(1, |ctx| ctx.msn_acked).unwrap();
+        assert_ne!(msn_acked, initial_msn_acked);
 
         rxs.assert_no_timeout();
         rxs.assert_no_retransmit();
@@ -537,6 +994,80 @@ mod tests {
         rxs.assert_no_completion();
     }
 
+    #[test]
+    fn test_process_doorbell_task() {
+        let (mut worker, rxs) = init_worker();
+
+        let ring = Arc::new(SqRing::new(8));
+        for wr_id in 0..3 {
+            assert!(ring.push(crate::workers::sq_ring::SqEntry {
+                wr_id,
+                length: 1024,
+                signaled: true,
+                ..Default::default()
+            }));
+        }
+        assert_eq!(ring.publish(), 3);
+        worker.process(RdmaWriteTask::new_doorbell(1, Arc::clone(&ring)));
+
+        // the published entries are all posted by the one doorbell
+        for _ in 0..3 {
+            assert!(rxs.retransmit_rx.try_recv().is_some());
+        }
+        assert!(rxs.retransmit_rx.try_recv().is_none());
+        assert!(ring.pop().is_none());
+        rxs.assert_no_timeout();
+        rxs.assert_no_completion();
+    }
+
+    #[test]
+    fn test_process_write_batch_task() {
+        let (mut worker, rxs) = init_worker();
+
+        let wr0 = create_test_send_wr_rdma(WorkReqOpCode::RdmaWrite);
+        let mut wr1 = create_test_send_wr_rdma(WorkReqOpCode::RdmaWrite);
+        wr1.base.wr_id = 124;
+        let mut wr2 = create_test_send_wr_rdma(WorkReqOpCode::RdmaRead);
+        wr2.base.wr_id = 125;
+        let task = RdmaWriteTask::new_write_batch(1, vec![wr0, wr1, wr2]);
+
+        worker.process(task);
+
+        // each 1024 bytes write spans 4 PSNs with pmtu 256
+        rxs.assert_retransmit(PacketRetransmitTask::NewWr {
+            qpn: 1,
+            wr: SendQueueElem::new(wr0, Psn(0), create_test_qp_param(0)),
+        });
+        rxs.assert_retransmit(PacketRetransmitTask::NewWr {
+            qpn: 1,
+            wr: SendQueueElem::new(wr1, Psn(4), create_test_qp_param(1)),
+        });
+        rxs.assert_retransmit(PacketRetransmitTask::NewWr {
+            qpn: 1,
+            wr: SendQueueElem::new(wr2, Psn(8), create_test_qp_param(2)),
+        });
+        rxs.assert_no_timeout();
+        rxs.assert_no_completion();
+    }
+
+    #[test]
+    fn test_poster_submits_chunks_in_order() {
+        let (worker, rxs) = init_worker();
+
+        let wr = create_test_send_wr_rdma(WorkReqOpCode::RdmaWrite);
+        let mut chunks = Vec::new();
+        worker.poster.post(1, wr, |c| chunks.push(c)).unwrap();
+        worker.poster.post(1, wr, |c| chunks.push(c)).unwrap();
+
+        assert_eq!(chunks.len(), 2);
+        assert_eq!(chunks[0].psn, Psn(0));
+        assert_eq!(chunks[0].msn, 0);
+        assert_eq!(chunks[1].psn, Psn(4));
+        assert_eq!(chunks[1].msn, 1);
+        assert!(rxs.retransmit_rx.try_recv().is_some());
+        assert!(rxs.retransmit_rx.try_recv().is_some());
+    }
+
     #[test]
     fn test_signaled_operations_generate_completion_and_timeout() {
         let (mut worker, rxs) = init_worker();
@@ -1,21 +1,38 @@
-use std::{cmp::Ordering, collections::VecDeque, iter, thread};
+use std::{
+    cmp::Ordering,
+    collections::VecDeque,
+    iter,
+    sync::Arc,
+    thread,
+    time::{Duration, Instant},
+};
 
 use log::debug;
 
 use crate::{
+    config::RetransmitConfig,
     constants::{MAX_PSN_WINDOW, MAX_QP_CNT},
+    mem::usage::{self, Pool},
     rdma_utils::{
-        fragmenter::WrPacketFragmenter,
+        fragmenter::{read_request, IntoIterChunk, WrPacketFragmenter},
         psn::Psn,
         qp::{qpn_to_index, QpTable},
         types::SendWrRdma,
     },
+    sdt::sdt_probe,
     workers::{
-        send::{QpParams, SendHandle, WorkReqOpCode},
+        qp_timeout::QpActivity,
+        send::{QpParams, SendHandle, WorkReqOpCode, WrChunk},
         spawner::SingleThreadTaskWorker,
     },
 };
 
+/// Maximum number of PSN ranges of a QP held after their retransmission for a NAK
+const MAX_RESENT_RANGES: usize = 64;
+
+/// Maximum number of retransmitted packets of a QP kept with their descriptors encoded
+const MAX_ENCODED_PACKETS: usize = 256;
+
 #[derive(Debug, PartialEq, Eq)]
 #[allow(variant_size_differences)]
 pub(crate) enum PacketRetransmitTask {
@@ -30,6 +47,12 @@ pub(crate) enum PacketRetransmitTask {
         // Exclusive
         psn_high: Psn,
     },
+    /// Retransmits PSN `psn_base + i` for each bit `i` set in `bitmap`
+    RetransmitBitmap {
+        qpn: u32,
+        psn_base: Psn,
+        bitmap: u128,
+    },
     RetransmitAll {
         qpn: u32,
     },
@@ -43,6 +66,7 @@ impl PacketRetransmitTask {
     fn qpn(&self) -> u32 {
         match *self {
             PacketRetransmitTask::RetransmitRange { qpn, .. }
+            | PacketRetransmitTask::RetransmitBitmap { qpn, .. }
             | PacketRetransmitTask::NewWr { qpn, .. }
             | PacketRetransmitTask::RetransmitAll { qpn }
             | PacketRetransmitTask::Ack { qpn, .. } => qpn,
@@ -50,9 +74,24 @@ impl PacketRetransmitTask {
     }
 }
 
+/// Retransmits the packets of the QPs.
+///
+/// A NAK retransmits the packets it reports at once. An ACK timeout starts a go-back-N
+/// recovery from the base PSN that is clocked by the ACKs: only a window of retransmitted
+/// packets is unacknowledged at a time, so the retransmissions of a deep send window share
+/// the send channels with the new WRs instead of flooding them.
+///
+/// Every NAK following a hole reports it again, so the PSNs retransmitted for a NAK are held
+/// for a RTT, during which the NAKs reporting them again are ignored.
+///
+/// The packets retransmitted are kept with their descriptors encoded until they are acked, a
+/// packet lost again is sent from them without being fragmented and encoded again.
 pub(crate) struct PacketRetransmitWorker {
     wr_sender: SendHandle,
     table: QpTable<IbvSendQueue>,
+    config: RetransmitConfig,
+    /// Smoothed RTTs of the QPs, estimated by the `QpAckTimeoutWorker`
+    activity: Arc<QpActivity>,
 }
 
 impl SingleThreadTaskWorker for PacketRetransmitWorker {
@@ -71,34 +110,59 @@ impl SingleThreadTaskWorker for PacketRetransmitWorker {
                 psn_low, psn_high, ..
             } => {
                 debug!("retransmit range, qpn: {qpn}, low: {psn_low}, high: {psn_high}");
-
-                let sqes = sq.range(psn_low, psn_high);
-                let packets = sqes
-                    .into_iter()
-                    .flat_map(|sqe| WrPacketFragmenter::new(sqe.wr(), sqe.qp_param(), sqe.psn()))
-                    .skip_while(|x| x.psn < psn_low)
-                    .take_while(|x| x.psn < psn_high);
-                for mut packet in packets {
-                    packet.set_is_retry();
-                    self.wr_sender.send(packet);
+                sdt_probe!(
+                    "retransmit",
+                    qpn,
+                    psn_low.into_inner(),
+                    psn_high.into_inner()
+                );
+
+                let packets = packets_from(sq.range(psn_low, psn_high), psn_low, &sq.encoded)
+                    .take_while(|x| x.psn < psn_high)
+                    .collect::<Vec<_>>();
+                let hold = hold_time(&self.config, &self.activity, qpn);
+                let packets = sq.suppress_resent(packets, Instant::now(), hold);
+                resend(&self.wr_sender, sq, packets);
+            }
+            PacketRetransmitTask::RetransmitBitmap {
+                psn_base, bitmap, ..
+            } => {
+                debug!("retransmit bitmap, qpn: {qpn}, base: {psn_base}, bitmap: {bitmap:#x}");
+                if bitmap == 0 {
+                    return;
                 }
+                let psn_low = psn_base + bitmap.trailing_zeros();
+                let psn_high = psn_base + (u128::BITS - bitmap.leading_zeros());
+                sdt_probe!(
+                    "retransmit",
+                    qpn,
+                    psn_low.into_inner(),
+                    psn_high.into_inner()
+                );
+                let base_psn = sq.base_psn;
+                let packets = packets_from(sq.covering(psn_low, psn_high), psn_low, &sq.encoded)
+                    .take_while(|x| x.psn < psn_high)
+                    .filter(|x| {
+                        let offset = (x.psn - psn_base).into_inner();
+                        x.psn >= base_psn && bitmap.wrapping_shr(offset) & 1 == 1
+                    })
+                    .collect::<Vec<_>>();
+                let hold = hold_time(&self.config, &self.activity, qpn);
+                let packets = sq.suppress_resent(packets, Instant::now(), hold);
+                resend(&self.wr_sender, sq, packets);
             }
             PacketRetransmitTask::RetransmitAll { qpn } => {
                 debug!("retransmit all, qpn: {qpn}");
-
-                let packets = sq
-                    .inner
-                    .iter()
-                    .flat_map(|sqe| WrPacketFragmenter::new(sqe.wr(), sqe.qp_param(), sqe.psn()))
-                    .skip_while(|x| x.psn < sq.base_psn);
-                for mut packet in packets {
-                    packet.set_is_retry();
-                    self.wr_sender.send(packet);
-                }
+                sdt_probe!("retransmit_all", qpn, sq.base_psn.into_inner());
+                sq.go_back(&self.config);
+                let packets = sq.recovery_packets();
+                resend(&self.wr_sender, sq, packets);
             }
 
             PacketRetransmitTask::Ack { psn, .. } => {
                 sq.pop_until(psn);
+                let packets = sq.recovery_packets();
+                resend(&self.wr_sender, sq, packets);
             }
         }
     }
@@ -106,30 +170,301 @@ impl SingleThreadTaskWorker for PacketRetransmitWorker {
     fn maintainance(&mut self) {}
 }
 
+/// Returns the time the PSNs retransmitted for a NAK of `qpn` are held
+fn hold_time(config: &RetransmitConfig, activity: &QpActivity, qpn: u32) -> Duration {
+    let min = Duration::from_micros(config.min_hold_us);
+    activity.srtt(qpn).map_or(min, |srtt| srtt.max(min))
+}
+
+/// Sends the packets again, keeping their descriptors encoded for their next retransmission
+fn resend(wr_sender: &SendHandle, sq: &mut IbvSendQueue, packets: Vec<WrChunk>) {
+    for mut packet in packets {
+        packet.set_is_retry();
+        sq.encoded.insert(&mut packet);
+        wr_sender.send(packet);
+    }
+}
+
+/// Returns the packets of the SQEs from `psn_low` on, the packets of a SQE before `psn_low`
+/// are skipped without being fragmented. The packets retransmitted before are taken from
+/// `encoded`, only the others are fragmented.
+///
+/// A read request takes a single PSN, it is sent again whole. The requests a large read is
+/// split into are SQEs of their own, only the lost ones are sent again.
+fn packets_from<'a, I>(
+    sqes: I,
+    psn_low: Psn,
+    encoded: &'a EncodedPackets,
+) -> impl Iterator<Item = WrChunk> + 'a
+where
+    I: IntoIterator<Item = SendQueueElem>,
+    I::IntoIter: 'a,
+{
+    sqes.into_iter().flat_map(move |sqe| {
+        let is_read = sqe.opcode() == WorkReqOpCode::RdmaRead;
+        let request = (is_read && sqe.psn() >= psn_low).then(|| {
+            encoded
+                .get(&sqe, sqe.psn())
+                .unwrap_or_else(|| read_request(sqe.wr(), sqe.qp_param(), sqe.psn()))
+        });
+        let next = if sqe.psn() > psn_low {
+            sqe.psn()
+        } else {
+            psn_low
+        };
+        let packets = (!is_read)
+            .then(|| SqePackets {
+                sqe,
+                next,
+                encoded,
+                fragmenter: None,
+                done: false,
+            })
+            .into_iter()
+            .flatten();
+        request.into_iter().chain(packets)
+    })
+}
+
+/// Packets of a SQE from a PSN on, the packets kept encoded are taken as they are and the
+/// others are fragmented
+struct SqePackets<'a> {
+    sqe: SendQueueElem,
+    /// PSN of the next packet
+    next: Psn,
+    encoded: &'a EncodedPackets,
+    /// Fragmenter of the packets from `next`, dropped by the packets kept encoded
+    fragmenter: Option<IntoIterChunk>,
+    /// Whether the last packet of the SQE was returned
+    done: bool,
+}
+
+impl Iterator for SqePackets<'_> {
+    type Item = WrChunk;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.done {
+            return None;
+        }
+        let packet = if let Some(packet) = self.encoded.get(&self.sqe, self.next) {
+            self.fragmenter = None;
+            packet
+        } else {
+            let sqe = self.sqe;
+            let next = self.next;
+            let fragmenter = self.fragmenter.get_or_insert_with(|| {
+                WrPacketFragmenter::new_from(sqe.wr(), sqe.qp_param(), sqe.psn(), next).into_iter()
+            });
+            let Some(packet) = fragmenter.next() else {
+                self.done = true;
+                return None;
+            };
+            packet
+        };
+        self.next = packet.psn + 1;
+        self.done = packet.is_last;
+        Some(packet)
+    }
+}
+
 impl PacketRetransmitWorker {
-    pub(crate) fn new(wr_sender: SendHandle) -> Self {
+    pub(crate) fn new(
+        wr_sender: SendHandle,
+        config: RetransmitConfig,
+        activity: Arc<QpActivity>,
+    ) -> Self {
         Self {
             wr_sender,
             table: QpTable::new(),
+            config,
+            activity,
+        }
+    }
+}
+
+/// PSNs retransmitted for a NAK
+#[derive(Debug, Clone, Copy)]
+struct ResentRange {
+    /// Inclusive
+    low: Psn,
+    /// Exclusive
+    high: Psn,
+    /// The NAKs reporting the PSNs again are ignored until this instant
+    until: Instant,
+}
+
+impl ResentRange {
+    fn contains(&self, psn: Psn) -> bool {
+        self.low <= psn && psn < self.high
+    }
+}
+
+/// Packets of a QP retransmitted and not acked yet, by PSN, with their descriptors encoded
+#[derive(Default)]
+struct EncodedPackets {
+    inner: VecDeque<WrChunk>,
+}
+
+impl EncodedPackets {
+    /// Seals the descriptors of `packet` and keeps it, the packets of the highest PSNs are
+    /// dropped past `MAX_ENCODED_PACKETS` as the lowest ones are the first lost again
+    fn insert(&mut self, packet: &mut WrChunk) {
+        let pos = self.inner.partition_point(|x| x.psn < packet.psn);
+        if self.inner.get(pos).is_some_and(|x| x.psn == packet.psn) {
+            return;
+        }
+        packet.seal();
+        if pos >= MAX_ENCODED_PACKETS {
+            return;
         }
+        let capacity = self.inner.capacity();
+        self.inner.insert(pos, *packet);
+        self.inner.truncate(MAX_ENCODED_PACKETS);
+        if self.inner.capacity() != capacity {
+            let grown = (self.inner.capacity() - capacity) * size_of::<WrChunk>();
+            usage::alloc(Pool::RetransmitQueues, grown);
+        }
+    }
+
+    /// Drops the packets before `psn`
+    fn pop_until(&mut self, psn: Psn) {
+        let acked = self.inner.partition_point(|x| x.psn < psn);
+        let _drop = self.inner.drain(..acked);
+    }
+
+    /// Returns the packet `psn` of `sqe` if it is kept
+    fn get(&self, sqe: &SendQueueElem, psn: Psn) -> Option<WrChunk> {
+        if self.inner.is_empty() {
+            return None;
+        }
+        let pos = self.inner.partition_point(|x| x.psn < psn);
+        // A packet of another WR is left from before the QP was reset
+        self.inner
+            .get(pos)
+            .filter(|x| x.psn == psn && x.msn == sqe.qp_param().msn && x.opcode == sqe.opcode())
+            .copied()
     }
 }
 
+/// Go-back-N recovery of a QP after an ACK timeout
+#[derive(Debug, Clone, Copy)]
+struct Recovery {
+    /// Next PSN to retransmit
+    next: Psn,
+    /// Maximum number of retransmitted packets past the base PSN
+    window: u32,
+}
+
 #[derive(Default)]
 pub(crate) struct IbvSendQueue {
     inner: VecDeque<SendQueueElem>,
     base_psn: Psn,
+    recovery: Option<Recovery>,
+    /// Number of timeouts since the base PSN last advanced
+    timeouts: u32,
+    /// PSNs retransmitted for the recent NAKs
+    resent: VecDeque<ResentRange>,
+    /// Packets retransmitted, sent from their encoded descriptors when lost again
+    encoded: EncodedPackets,
+}
+
+impl Drop for IbvSendQueue {
+    fn drop(&mut self) {
+        usage::free(
+            Pool::RetransmitQueues,
+            self.inner.capacity() * size_of::<SendQueueElem>()
+                + self.encoded.inner.capacity() * size_of::<WrChunk>(),
+        );
+    }
 }
 
 impl IbvSendQueue {
     pub(crate) fn push(&mut self, elem: SendQueueElem) {
+        let capacity = self.inner.capacity();
         self.inner.push_back(elem);
+        if self.inner.capacity() != capacity {
+            let grown = (self.inner.capacity() - capacity) * size_of::<SendQueueElem>();
+            usage::alloc(Pool::RetransmitQueues, grown);
+        }
     }
 
     pub(crate) fn pop_until(&mut self, psn: Psn) {
         let mut a = self.inner.partition_point(|x| x.psn < psn);
         let _drop = self.inner.drain(..a.saturating_sub(1));
+        if psn > self.base_psn {
+            self.timeouts = 0;
+        }
         self.base_psn = psn;
+        self.resent.retain(|x| x.high > psn);
+        self.encoded.pop_until(psn);
+    }
+
+    /// Drops the packets retransmitted for an earlier NAK whose hold has not passed, and
+    /// holds the PSNs of the remaining packets until `now + hold`
+    fn suppress_resent<I>(&mut self, packets: I, now: Instant, hold: Duration) -> Vec<WrChunk>
+    where
+        I: IntoIterator<Item = WrChunk>,
+    {
+        self.resent.retain(|x| x.until > now);
+        let fresh: Vec<_> = packets
+            .into_iter()
+            .filter(|packet| !self.resent.iter().any(|x| x.contains(packet.psn)))
+            .collect();
+        let until = now + hold;
+        for packet in &fresh {
+            match self.resent.back_mut() {
+                Some(last) if last.until == until && last.high == packet.psn => {
+                    last.high = packet.psn + 1;
+                }
+                _ => self.resent.push_back(ResentRange {
+                    low: packet.psn,
+                    high: packet.psn + 1,
+                    until,
+                }),
+            }
+        }
+        let excess = self.resent.len().saturating_sub(MAX_RESENT_RANGES);
+        let _drop = self.resent.drain(..excess);
+        fresh
+    }
+
+    /// Restarts the recovery from the base PSN, with a window halved by each timeout the
+    /// base PSN did not advance across
+    fn go_back(&mut self, config: &RetransmitConfig) {
+        // The retransmissions held for the NAKs were lost as well
+        self.resent.clear();
+        self.recovery = Some(Recovery {
+            next: self.base_psn,
+            window: config.window_after(self.timeouts),
+        });
+        self.timeouts = self.timeouts.saturating_add(1);
+    }
+
+    /// Returns the packets of the recovery that fit in its window, the recovery ends with the
+    /// last packet of the queue
+    fn recovery_packets(&mut self) -> Vec<WrChunk> {
+        let Some(recovery) = self.recovery.as_mut() else {
+            return Vec::new();
+        };
+        let next = recovery.next.max(self.base_psn);
+        let in_flight = (next - self.base_psn).into_inner();
+        let budget = recovery.window.saturating_sub(in_flight) as usize;
+        if budget == 0 {
+            return Vec::new();
+        }
+        let first = self.covering_index(next);
+        let sqes = self.inner.range(first..).copied();
+        // One packet past the budget tells whether the queue is exhausted
+        let mut packets: Vec<_> = packets_from(sqes, next, &self.encoded)
+            .take(budget + 1)
+            .collect();
+        if packets.len() > budget {
+            let _ignore = packets.pop();
+            recovery.next = packets.last().map_or(next, |x| x.psn + 1);
+        } else {
+            self.recovery = None;
+        }
+        packets
     }
 
     /// Find range [`psn_low`, `psn_high`)
@@ -141,6 +476,25 @@ impl IbvSendQueue {
         }
         self.inner.range(a..b).copied().collect()
     }
+
+    /// Binary searches the index of the element `psn` falls into, the PSN comparison handles
+    /// the wrap of the 24 bit PSN within the PSN window
+    pub(crate) fn covering_index(&self, psn: Psn) -> usize {
+        self.inner
+            .partition_point(|x| x.psn <= psn)
+            .saturating_sub(1)
+    }
+
+    /// Find the elements holding the PSNs in [`psn_low`, `psn_high`), including the element
+    /// `psn_low` falls into
+    pub(crate) fn covering(&self, psn_low: Psn, psn_high: Psn) -> Vec<SendQueueElem> {
+        let a = self.covering_index(psn_low);
+        let b = self.inner.partition_point(|x| x.psn < psn_high);
+        if (a..b).is_empty() {
+            return Vec::new();
+        }
+        self.inner.range(a..b).copied().collect()
+    }
 }
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
@@ -176,7 +530,11 @@ impl SendQueueElem {
 mod tests {
     use super::*;
     use crate::{
-        rdma_utils::types::SendWrBase,
+        latency::Stamp,
+        rdma_utils::{
+            atomic::AtomicOperands,
+            types::{SendWrBase, SgList},
+        },
         workers::send::{QpParams, SendHandle},
     };
     use std::sync::{Arc, Mutex};
@@ -220,24 +578,27 @@ mod tests {
             lkey: 0x123,
             imm_data: 0,
             opcode: WorkReqOpCode::RdmaWrite,
+            sg_list: SgList::single(0x1000, 1024, 0x123),
+            posted: Stamp::default(),
         };
         SendWrRdma {
             base,
             raddr: 0x2000,
             rkey: 0x456,
+            atomic: AtomicOperands::default(),
         }
     }
 
     fn create_test_qp_params() -> QpParams {
-        QpParams {
-            sqpn: 1,
-            pmtu: 1,
-            dqpn: 2,
-            msn: 0,
-            qp_type: ibverbs_sys::ibv_qp_type::IBV_QPT_RC as u8,
-            mac_addr: 0xAABB_CCDD_EE0A,
-            dqp_ip: 13,
-        }
+        QpParams::new(
+            0,
+            ibverbs_sys::ibv_qp_type::IBV_QPT_RC as u8,
+            1,
+            0xAABB_CCDD_EE0A,
+            2,
+            13,
+            1,
+        )
     }
 
     #[test]
@@ -328,6 +689,136 @@ mod tests {
         assert!(range.is_empty());
     }
 
+    #[test]
+    fn test_ibv_send_queue_covering() {
+        let mut queue = IbvSendQueue::default();
+        let wr = create_test_send_wr();
+        let qp_param = create_test_qp_params();
+
+        queue.push(SendQueueElem::new(wr, Psn(100), qp_param));
+        queue.push(SendQueueElem::new(wr, Psn(200), qp_param));
+        queue.push(SendQueueElem::new(wr, Psn(300), qp_param));
+
+        // PSN 150 is a packet of the element starting at 100
+        let range = queue.covering(Psn(150), Psn(250));
+        assert_eq!(
+            range,
+            [
+                SendQueueElem::new(wr, Psn(100), qp_param),
+                SendQueueElem::new(wr, Psn(200), qp_param)
+            ]
+        );
+
+        let range = queue.covering(Psn(200), Psn(201));
+        assert_eq!(range, [SendQueueElem::new(wr, Psn(200), qp_param)]);
+
+        assert!(queue.covering(Psn(0), Psn(50)).is_empty());
+    }
+
+    #[test]
+    fn test_go_back_n_recovery_is_clocked_by_acks() {
+        let mut queue = IbvSendQueue::default();
+        let wr = create_test_send_wr();
+        // 256 byte packets, 4 packets per WR
+        let qp_param = create_test_qp_params();
+        for i in 0..4 {
+            queue.push(SendQueueElem::new(wr, Psn(i * 4), qp_param));
+        }
+        let psns = |packets: Vec<WrChunk>| packets.iter().map(|x| x.psn.0).collect::<Vec<_>>();
+        let config = RetransmitConfig {
+            window: 6,
+            min_window: 2,
+        };
+
+        queue.go_back(&config);
+        assert_eq!(psns(queue.recovery_packets()), [0, 1, 2, 3, 4, 5]);
+        assert!(queue.recovery_packets().is_empty());
+        queue.pop_until(Psn(2));
+        assert_eq!(psns(queue.recovery_packets()), [6, 7]);
+
+        // successive timeouts halve the window
+        queue.go_back(&config);
+        queue.go_back(&config);
+        assert_eq!(psns(queue.recovery_packets()), [2, 3, 4]);
+        queue.go_back(&config);
+        assert_eq!(psns(queue.recovery_packets()), [2, 3]);
+
+        // an ACK resets the backoff, the recovery ends with the queue
+        queue.pop_until(Psn(12));
+        assert_eq!(psns(queue.recovery_packets()), [12, 13]);
+        queue.pop_until(Psn(14));
+        assert_eq!(psns(queue.recovery_packets()), [14, 15]);
+        assert!(queue.recovery.is_none());
+    }
+
+    #[test]
+    fn test_repeated_naks_retransmit_once_per_hold() {
+        let mut queue = IbvSendQueue::default();
+        let wr = create_test_send_wr();
+        let qp_param = create_test_qp_params();
+        queue.push(SendQueueElem::new(wr, Psn(0), qp_param));
+        queue.push(SendQueueElem::new(wr, Psn(4), qp_param));
+        let psns = |packets: Vec<WrChunk>| packets.iter().map(|x| x.psn.0).collect::<Vec<_>>();
+        let nak = |queue: &IbvSendQueue, low: u32, high: u32| {
+            packets_from(queue.range(Psn(0), Psn(high)), Psn(low), &queue.encoded)
+                .take_while(|x| x.psn < Psn(high))
+                .collect::<Vec<_>>()
+        };
+        let hold = Duration::from_micros(10);
+        let now = Instant::now();
+
+        let packets = nak(&queue, 1, 3);
+        assert_eq!(psns(queue.suppress_resent(packets, now, hold)), [1, 2]);
+        // later NAKs of the same hole within the hold
+        for _ in 0..8 {
+            let packets = nak(&queue, 1, 3);
+            assert!(queue.suppress_resent(packets, now, hold).is_empty());
+        }
+        // a wider hole only retransmits the new PSNs
+        let packets = nak(&queue, 1, 6);
+        assert_eq!(psns(queue.suppress_resent(packets, now, hold)), [3, 4, 5]);
+        // the hold has passed
+        let packets = nak(&queue, 1, 3);
+        let later = now + hold;
+        assert_eq!(psns(queue.suppress_resent(packets, later, hold)), [1, 2]);
+
+        // an ACK past the holes releases them
+        queue.pop_until(Psn(6));
+        assert!(queue.resent.is_empty());
+    }
+
+    #[test]
+    fn test_packets_lost_again_are_taken_encoded() {
+        let mut queue = IbvSendQueue::default();
+        let wr = create_test_send_wr();
+        let qp_param = create_test_qp_params();
+        queue.push(SendQueueElem::new(wr, Psn(0), qp_param));
+        queue.push(SendQueueElem::new(wr, Psn(4), qp_param));
+        let packets = |queue: &IbvSendQueue, low: u32| {
+            packets_from(queue.range(Psn(0), Psn(8)), Psn(low), &queue.encoded)
+                .map(|x| (x.psn.0, x.imm))
+                .collect::<Vec<_>>()
+        };
+        // PSNs 1, 2 and 5 retransmitted, marked to tell them apart
+        for psn in [1, 2, 5] {
+            let mut packet = packets_from(queue.range(Psn(0), Psn(8)), Psn(psn), &queue.encoded)
+                .next()
+                .unwrap();
+            packet.imm = 7;
+            queue.encoded.insert(&mut packet);
+        }
+        assert_eq!(
+            packets(&queue, 1),
+            [(1, 7), (2, 7), (3, 0), (4, 0), (5, 7), (6, 0), (7, 0)]
+        );
+        // the acked packets are dropped
+        queue.pop_until(Psn(2));
+        assert_eq!(
+            packets(&queue, 1),
+            [(1, 0), (2, 7), (3, 0), (4, 0), (5, 7), (6, 0), (7, 0)]
+        );
+    }
+
     #[test]
     fn test_ibv_send_queue_multiple_operations() {
         let mut queue = IbvSendQueue::default();
@@ -0,0 +1,88 @@
+use std::sync::Arc;
+
+use crate::net::bond::BondPeers;
+
+use super::{stripe::is_middle_chunk, SendDescTemplate, SendHandle, WrChunk};
+
+/// Send workers of the second card of a bonded pair.
+///
+/// The middle chunks of large RDMA writes alternate between the two cards by their offset in
+/// the WR, the first and the last chunk always take the first card. The meta report workers of
+/// both cards feed the same trackers, so a WR is completed once, when all of its chunks are
+/// acknowledged, whichever card carried them.
+pub(crate) struct BondRail {
+    /// Handle of the send workers of the second card
+    send: SendHandle,
+    /// Peers of the second card
+    peers: Arc<BondPeers>,
+    /// Minimum length of the striped WRs
+    stripe_min_bytes: u32,
+}
+
+impl BondRail {
+    pub(crate) fn new(send: SendHandle, peers: Arc<BondPeers>, stripe_min_bytes: u32) -> Self {
+        Self {
+            send,
+            peers,
+            stripe_min_bytes,
+        }
+    }
+
+    /// Sends the chunk through the second card, returns it back if it takes the first card.
+    ///
+    /// A chunk whose peer has no cached neighbour entry on the second card takes the first card.
+    pub(crate) fn try_send(&self, wr: WrChunk) -> Result<(), WrChunk> {
+        if !is_striped(&wr, self.stripe_min_bytes) {
+            return Err(wr);
+        }
+        let dqp_ip = self.peers.peer_ip(wr.dqp_ip);
+        let Some(mac_addr) = self.peers.lookup(dqp_ip) else {
+            return Err(wr);
+        };
+        let template =
+            SendDescTemplate::new(wr.qp_type, wr.sqpn, mac_addr, wr.dqpn, dqp_ip, wr.pmtu);
+        self.send.send(WrChunk {
+            dqp_ip,
+            mac_addr,
+            template,
+            ..wr
+        });
+
+        Ok(())
+    }
+}
+
+/// Returns `true` if the chunk is a middle chunk of an RDMA write of at least `min_bytes` at an
+/// odd chunk offset
+fn is_striped(wr: &WrChunk, min_bytes: u32) -> bool {
+    is_middle_chunk(wr, min_bytes) && (wr.raddr / u64::from(wr.len)) % 2 == 1
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::workers::send::WorkReqOpCode;
+
+    #[test]
+    fn middle_chunks_alternate() {
+        let chunk = |raddr: u64, is_first, is_last| WrChunk {
+            opcode: WorkReqOpCode::RdmaWrite,
+            total_len: 4 << 20,
+            raddr,
+            len: 1 << 20,
+            is_first,
+            is_last,
+            ..WrChunk::default()
+        };
+        assert!(!is_striped(&chunk(0, true, false), 1 << 20));
+        assert!(is_striped(&chunk(1 << 20, false, false), 1 << 20));
+        assert!(!is_striped(&chunk(2 << 20, false, false), 1 << 20));
+        assert!(!is_striped(&chunk(3 << 20, false, true), 1 << 20));
+        assert!(!is_striped(&chunk(1 << 20, false, false), 8 << 20));
+        let read = WrChunk {
+            opcode: WorkReqOpCode::RdmaRead,
+            ..chunk(1 << 20, false, false)
+        };
+        assert!(!is_striped(&read, 1 << 20));
+    }
+}
@@ -0,0 +1,96 @@
+use std::io;
+
+use log::debug;
+
+use crate::{
+    csr::{
+        proxy::{build_send_queue_proxies, SendQueueProxy},
+        CsrBaseAddrAdaptor, CsrWriterAdaptor, DeviceAdaptor, RingBufferCsrAddr,
+    },
+    mem::dmabuf::DmabufMapping,
+};
+
+/// Send queue of a channel lent to a QP, written by a GPU instead of the `SendWorker`s
+#[derive(Debug)]
+pub(crate) struct ExportedSendQueue {
+    /// Number of descriptors of the ring, the head and the tail wrap around at twice the depth
+    pub(crate) depth: usize,
+    /// Tail of the channel when it was lent, the first descriptor is written at this index
+    pub(crate) start: u32,
+    /// Mapping of the BAR page holding the head and the tail CSRs of the channel
+    pub(crate) doorbell: memmap2::MmapMut,
+    /// Offset of the head CSR in `doorbell`
+    pub(crate) head: usize,
+    /// Offset of the tail CSR in `doorbell`
+    pub(crate) tail: usize,
+}
+
+/// Send channels withheld from the `SendWorker`s, each lent to a single QP.
+///
+/// The descriptors of the QP are built by a GPU in a ring in its memory, registered through
+/// the dma-buf of the ring, and the GPU writes the head CSR through a mapping of the CSR page,
+/// so no CPU thread is on the path of a work request. The driver never sees these work
+/// requests, they are neither retransmitted nor reported to the CQ.
+pub(crate) struct ExportedChannels<Dev> {
+    channels: Vec<ExportedChannel<Dev>>,
+}
+
+struct ExportedChannel<Dev> {
+    proxy: SendQueueProxy<Dev>,
+    /// QP the channel is lent to, and the mapping keeping its ring resident
+    owner: Option<(u32, DmabufMapping)>,
+}
+
+impl<Dev: DeviceAdaptor> ExportedChannels<Dev> {
+    pub(crate) fn new(dev: Dev, channel_ids: &[usize]) -> Self {
+        let channels = build_send_queue_proxies(dev, channel_ids)
+            .into_iter()
+            .map(|proxy| ExportedChannel { proxy, owner: None })
+            .collect();
+        Self { channels }
+    }
+
+    /// Returns `true` if a channel is lent to the QP
+    pub(crate) fn owns(&self, qpn: u32) -> bool {
+        self.channels
+            .iter()
+            .any(|c| c.owner.as_ref().is_some_and(|&(owner, _)| owner == qpn))
+    }
+
+    /// Lends a free channel to the QP, the ring at `ring_addr` is kept resident by `mapping`
+    ///
+    /// # Returns
+    ///
+    /// The CSR offsets of the head and the tail of the channel and its current tail, `None` if
+    /// every channel is lent
+    pub(crate) fn lend(
+        &mut self,
+        qpn: u32,
+        ring_addr: u64,
+        mapping: DmabufMapping,
+    ) -> io::Result<Option<(usize, usize, u32)>> {
+        let Some(channel) = self.channels.iter_mut().find(|c| c.owner.is_none()) else {
+            return Ok(None);
+        };
+        channel.proxy.write_base_addr(ring_addr)?;
+        let start = channel.proxy.read_tail()?;
+        channel.owner = Some((qpn, mapping));
+        debug!("send channel lent to qp {qpn}: ring=0x{ring_addr:x}, start={start}");
+
+        Ok(Some((channel.proxy.head(), channel.proxy.tail(), start)))
+    }
+
+    /// Takes back the channel lent to the QP, returns `false` if it has none
+    pub(crate) fn release(&mut self, qpn: u32) -> bool {
+        let Some(channel) = self
+            .channels
+            .iter_mut()
+            .find(|c| c.owner.as_ref().is_some_and(|&(owner, _)| owner == qpn))
+        else {
+            return false;
+        };
+        channel.owner = None;
+        debug!("send channel of qp {qpn} released");
+        true
+    }
+}
@@ -1,64 +1,91 @@
 use std::{io, iter, sync::Arc};
 
-use types::{WrInjector, WrWorker};
+use parking_lot::Mutex;
 use worker::{SendQueueSync, SendWorker};
 
 use crate::{
-    csr::{mode::Mode, proxy::build_send_queue_proxies, CsrBaseAddrAdaptor, DeviceAdaptor},
+    config::DoorbellConfig,
+    counters::DeviceCounters,
+    csr::{proxy::build_send_queue_proxies, CsrBaseAddrAdaptor, DeviceAdaptor},
     mem::DmaBuf,
     ringbuf::DescRingBuffer,
-    workers::spawner::{AbortSignal, SingleThreadPollingWorker},
+    workers::spawner::{
+        AbortSignal, PollPolicy, Poller, SingleThreadPollingWorker, WorkerAffinity,
+    },
 };
 
+mod bond;
+mod export;
+mod priority;
+mod rate;
+mod scheduler;
+mod stripe;
 mod types;
 mod worker;
 
+pub(crate) use bond::BondRail;
+pub(crate) use export::{ExportedChannels, ExportedSendQueue};
+pub(crate) use priority::QpPriorities;
+pub(crate) use rate::RateControl;
+pub(crate) use scheduler::QpScheduler;
+pub(crate) use stripe::ChannelStripe;
 pub(crate) use types::*;
-pub(crate) use worker::SendHandle;
+pub(crate) use worker::{DirectDoorbell, SendHandle};
 
+/// Spawns the `SendWorker`s, returns the handle for submitting chunks to the workers and the
+/// doorbell for QPs that write to the send queues directly
+#[allow(clippy::too_many_arguments)]
 pub(crate) fn spawn<Dev>(
     dev: &Dev,
     bufs: Vec<DmaBuf>,
-    mode: Mode,
+    depth: usize,
+    channel_ids: &[usize],
     abort: &AbortSignal,
-) -> io::Result<SendHandle>
+    policy: PollPolicy,
+    doorbell: DoorbellConfig,
+    rate: Arc<RateControl>,
+    priorities: Arc<QpPriorities>,
+    counters: &Arc<DeviceCounters>,
+    affinity: &WorkerAffinity,
+) -> io::Result<(SendHandle, DirectDoorbell<Dev>)>
 where
     Dev: DeviceAdaptor + Clone + Send + 'static,
 {
-    let injector = Arc::new(WrInjector::new());
-    let handle = SendHandle::new(Arc::clone(&injector));
-    let mut sq_proxies = build_send_queue_proxies(dev.clone(), mode);
+    let scheduler = Arc::new(QpScheduler::new(bufs.len(), rate, priorities));
+    let pollers: Arc<[_]> = iter::repeat_with(|| Poller::new(policy))
+        .take(bufs.len())
+        .collect();
+    let handle = SendHandle::new(Arc::clone(&scheduler), Arc::clone(&pollers));
+    let mut sq_proxies = build_send_queue_proxies(dev.clone(), channel_ids);
     for (proxy, buf) in sq_proxies.iter_mut().zip(bufs.iter()) {
         proxy.write_base_addr(buf.phys_addr)?;
     }
     let send_queues: Vec<_> = bufs
         .into_iter()
-        .map(|p| SendQueue::new(DescRingBuffer::new(p.buf)))
-        .collect();
-    let workers: Vec<_> = iter::repeat_with(WrWorker::new_fifo)
-        .take(send_queues.len())
+        .zip(channel_ids)
+        .map(|(p, id)| {
+            let ring = DescRingBuffer::with_depth(p.buf, depth).recorded(format!("send{id}"), true);
+            SendQueue::new(ring)
+        })
         .collect();
-    let stealers: Vec<_> = workers.iter().map(WrWorker::stealer).collect();
-    let sqs = send_queues
+    let sqs: Arc<[_]> = send_queues
         .into_iter()
         .zip(sq_proxies)
-        .map(|(sq, proxy)| SendQueueSync::new(sq, proxy));
-    for (id, (local, sq)) in workers.into_iter().zip(sqs).enumerate() {
-        let worker = SendWorker::new(
-            id,
-            local,
-            Arc::clone(&injector),
-            stealers
-                .clone()
-                .into_iter()
-                .enumerate()
-                .filter_map(|(i, x)| (i != id).then_some(x))
-                .collect(),
-            sq,
-        );
+        .map(|(sq, proxy)| {
+            Mutex::new(SendQueueSync::new(
+                sq,
+                proxy,
+                doorbell,
+                Arc::clone(counters),
+            ))
+        })
+        .collect();
+    for (id, poller) in pollers.iter().enumerate() {
+        let worker = SendWorker::new(id, Arc::clone(&scheduler), Arc::clone(&sqs));
         let name = format!("SendWorker{id}");
-        worker.spawn(&name, abort.clone());
+        worker.spawn(&name, abort.clone(), poller.clone(), affinity);
     }
+    let doorbell = DirectDoorbell::new(sqs, handle.clone());
 
-    Ok(handle)
+    Ok((handle, doorbell))
 }
@@ -0,0 +1,149 @@
+use std::{
+    collections::{HashMap, VecDeque},
+    iter,
+    sync::atomic::{AtomicU8, Ordering},
+};
+
+use crate::{constants::MAX_QP_CNT, rdma_utils::qp::qpn_to_index};
+
+use super::WrChunk;
+
+/// Number of priority classes of the send path, the chunks of a higher class are always sent
+/// before the chunks of a lower class
+pub(crate) const PRIORITY_CLASSES: usize = 4;
+
+/// Priority classes of the QPs, set by `ibv_modify_qp`
+pub(crate) struct QpPriorities {
+    classes: Box<[AtomicU8]>,
+}
+
+impl QpPriorities {
+    pub(crate) fn new() -> Self {
+        Self {
+            classes: iter::repeat_with(|| AtomicU8::new(0))
+                .take(MAX_QP_CNT)
+                .collect(),
+        }
+    }
+
+    /// Sets the class of the QP from the service level of its address vector, or from the
+    /// precedence bits of the traffic class for a global route, capped to the highest class
+    pub(crate) fn set_from_ah(&self, qpn: u32, ah_attr: &ibverbs_sys::ibv_ah_attr) {
+        let precedence = if ah_attr.is_global != 0 {
+            ah_attr.grh.traffic_class >> 5
+        } else {
+            0
+        };
+        self.set(qpn, ah_attr.sl.max(precedence));
+    }
+
+    /// Sets the class of the QP, capped to the highest class
+    pub(crate) fn set(&self, qpn: u32, class: u8) {
+        if let Some(x) = self.classes.get(qpn_to_index(qpn)) {
+            x.store(class.min(PRIORITY_CLASSES as u8 - 1), Ordering::Relaxed);
+        }
+    }
+
+    /// Returns the class of the QP
+    pub(crate) fn class(&self, qpn: u32) -> usize {
+        self.classes
+            .get(qpn_to_index(qpn))
+            .map_or(0, |x| x.load(Ordering::Relaxed).into())
+    }
+}
+
+/// Deficit round robin between the QPs of a priority class.
+///
+/// Each backlogged QP is given `quantum` bytes per round and sends its chunks in order while
+/// they fit in its deficit, so that a QP with a large backlog doesn't hold back the other QPs
+/// of the class for more than a round.
+pub(super) struct DeficitRoundRobin {
+    quantum: u32,
+    /// Chunks of each backlogged QP, in order
+    queues: HashMap<u32, VecDeque<WrChunk>>,
+    /// Backlogged QPs in round robin order, with their deficit in bytes
+    rounds: VecDeque<(u32, u32)>,
+}
+
+impl DeficitRoundRobin {
+    pub(super) fn new(quantum: u32) -> Self {
+        Self {
+            quantum: quantum.max(1),
+            queues: HashMap::new(),
+            rounds: VecDeque::new(),
+        }
+    }
+
+    pub(super) fn push(&mut self, wr: WrChunk) {
+        let queue = self.queues.entry(wr.sqpn).or_default();
+        if queue.is_empty() {
+            self.rounds.push_back((wr.sqpn, 0));
+        }
+        queue.push_back(wr);
+    }
+
+    /// Takes the next chunk to send
+    pub(super) fn pop(&mut self) -> Option<WrChunk> {
+        loop {
+            let &mut (qpn, ref mut deficit) = self.rounds.front_mut()?;
+            let Some(queue) = self.queues.get_mut(&qpn) else {
+                let _ignore = self.rounds.pop_front();
+                continue;
+            };
+            let len = queue.front().map_or(0, |x| x.len);
+            if len <= *deficit {
+                *deficit -= len;
+                let wr = queue.pop_front();
+                if queue.is_empty() {
+                    let _ignore = self.queues.remove(&qpn);
+                    let _ignore = self.rounds.pop_front();
+                }
+                return wr;
+            }
+            // The QP is out of deficit, its next round comes after the other QPs
+            let (qpn, deficit) = self.rounds.pop_front()?;
+            self.rounds
+                .push_back((qpn, deficit.saturating_add(self.quantum)));
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn chunk(sqpn: u32, len: u32) -> WrChunk {
+        WrChunk {
+            sqpn,
+            len,
+            ..Default::default()
+        }
+    }
+
+    #[test]
+    fn backlogged_qp_shares_rounds_with_small_qps() {
+        let mut drr = DeficitRoundRobin::new(0x10000);
+        for _ in 0..4 {
+            drr.push(chunk(1, 0x10000));
+        }
+        drr.push(chunk(2, 64));
+        drr.push(chunk(3, 64));
+        let order: Vec<_> = iter::from_fn(|| drr.pop()).map(|x| x.sqpn).collect();
+        assert_eq!(order, [1, 2, 3, 1, 1, 1]);
+    }
+
+    #[test]
+    fn classes_follow_the_address_vector() {
+        let priorities = QpPriorities::new();
+        // SAFETY: the address vector is plain data, all zeros is a valid value
+        let mut ah_attr: ibverbs_sys::ibv_ah_attr = unsafe { std::mem::zeroed() };
+        ah_attr.sl = 1;
+        priorities.set_from_ah(0x100, &ah_attr);
+        assert_eq!(priorities.class(0x100), 1);
+        ah_attr.is_global = 1;
+        ah_attr.grh.traffic_class = 0xb8;
+        priorities.set_from_ah(0x100, &ah_attr);
+        assert_eq!(priorities.class(0x100), PRIORITY_CLASSES - 1);
+        assert_eq!(priorities.class(0x200), 0);
+    }
+}
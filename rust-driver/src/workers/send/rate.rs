@@ -0,0 +1,471 @@
+use std::{
+    iter,
+    sync::atomic::{AtomicBool, Ordering},
+    time::{Duration, Instant},
+};
+
+use log::error;
+use parking_lot::{Mutex, RwLock};
+
+use crate::{config::CongestionConfig, constants::MAX_QP_CNT, rdma_utils::qp::qpn_to_index};
+
+/// Fixed point representation of an alpha of 1
+const ALPHA_ONE: u64 = 1 << 20;
+/// Alpha moves towards its target with a gain of `1 / 2^ALPHA_G_SHIFT`
+const ALPHA_G_SHIFT: u32 = 8;
+/// Maximum number of timer periods caught up by a single update, a QP idle for longer is back
+/// at line rate long before
+const MAX_CATCH_UP: u32 = 1024;
+/// Tokens are counted in microbits, the unit of one nanosecond at one kbps
+const MICROBITS_PER_BYTE: i64 = 8_000_000;
+
+/// DCQCN parameters derived from the `CongestionConfig`
+#[derive(Debug, Clone, Copy)]
+struct Params {
+    line_rate: u64,
+    min_rate: u64,
+    alpha_period: Duration,
+    increase_period: Duration,
+    byte_counter: u64,
+    fast_recovery_stages: u32,
+    ai_rate: u64,
+    hai_rate: u64,
+    /// Default bucket capacity in microbits
+    burst: i64,
+}
+
+impl Params {
+    fn new(config: &CongestionConfig) -> Self {
+        let line_rate = config.line_rate_mbps.max(1);
+        Self {
+            line_rate,
+            min_rate: config.min_rate_mbps.clamp(1, line_rate),
+            alpha_period: Duration::from_micros(config.alpha_update_us.max(1)),
+            increase_period: Duration::from_micros(config.rate_increase_us.max(1)),
+            byte_counter: config.byte_counter.max(1),
+            fast_recovery_stages: config.fast_recovery_stages,
+            ai_rate: config.ai_rate_mbps,
+            hai_rate: config.hai_rate_mbps,
+            burst: bucket_size(config.burst_bytes),
+        }
+    }
+}
+
+/// Send rate limits of the QPs, cut by the CNPs reported in the meta report queue and capped
+/// by `ibv_modify_qp_rate_limit`.
+///
+/// Each QP runs the DCQCN reaction point algorithm. A CNP cuts the current rate by
+/// `alpha / 2` and moves alpha up, alpha decays while no CNP arrives, and the rate recovers
+/// through the fast recovery, additive and hyper increase stages driven by a timer and a byte
+/// counter. The lower of the DCQCN rate and the rate limit is enforced by a token bucket in
+/// the `SendWorker`. A QP without rate limit that recovers to line rate is no longer paced.
+pub(crate) struct RateControl {
+    enabled: AtomicBool,
+    /// Replaced by `reconfigure`, each update reads a copy
+    params: RwLock<Params>,
+    /// Whether each QP is paced, checked before locking its limiter
+    limited: Box<[AtomicBool]>,
+    /// Limiter of each QP, `None` while the QP is not paced
+    qps: Box<[Mutex<Option<QpRate>>]>,
+}
+
+impl RateControl {
+    pub(crate) fn new(config: &CongestionConfig) -> Self {
+        Self {
+            enabled: AtomicBool::new(config.enabled),
+            params: RwLock::new(Params::new(config)),
+            limited: iter::repeat_with(|| AtomicBool::new(false))
+                .take(MAX_QP_CNT)
+                .collect(),
+            qps: iter::repeat_with(|| Mutex::new(None))
+                .take(MAX_QP_CNT)
+                .collect(),
+        }
+    }
+
+    /// Returns `true` if the chunks are sent ECN capable, so that congested switches mark
+    /// them instead of dropping them
+    pub(crate) fn ecn_enabled(&self) -> bool {
+        self.enabled.load(Ordering::Relaxed)
+    }
+
+    /// Applies a new `CongestionConfig`, the paced QPs keep their current rate and move
+    /// with the new parameters from their next update
+    pub(crate) fn reconfigure(&self, config: &CongestionConfig) {
+        *self.params.write() = Params::new(config);
+        self.enabled.store(config.enabled, Ordering::Relaxed);
+    }
+
+    /// Cuts the rate of the QP on a CNP
+    pub(crate) fn on_cnp(&self, qpn: u32) {
+        self.on_cnp_at(qpn, Instant::now());
+    }
+
+    /// Returns `true` if the chunks of the QP must be admitted by `try_admit`
+    pub(crate) fn is_limited(&self, qpn: u32) -> bool {
+        self.limited
+            .get(qpn_to_index(qpn))
+            .is_some_and(|x| x.load(Ordering::Acquire))
+    }
+
+    /// Caps the rate of the QP to `rate_kbps` with bursts of up to `max_burst` bytes, a rate of
+    /// 0 removes the limit and a burst of 0 selects the configured `burst_bytes`
+    pub(crate) fn set_limit(&self, qpn: u32, rate_kbps: u32, max_burst: u32) -> bool {
+        let index = qpn_to_index(qpn);
+        let (Some(limited), Some(qp)) = (self.limited.get(index), self.qps.get(index)) else {
+            return false;
+        };
+        let params = *self.params.read();
+        let mut qp = qp.lock();
+        if rate_kbps == 0 {
+            if let Some(rate) = qp.as_mut() {
+                rate.cap = None;
+                rate.burst = params.burst;
+            }
+        } else {
+            let burst = if max_burst == 0 {
+                params.burst
+            } else {
+                bucket_size(max_burst.into())
+            };
+            let rate = qp.get_or_insert_with(|| QpRate::new(&params, Instant::now()));
+            rate.cap = Some(rate_kbps.into());
+            rate.burst = burst;
+            rate.tokens = rate.tokens.min(burst);
+        }
+        if qp.as_ref().is_some_and(QpRate::is_idle) {
+            *qp = None;
+        }
+        limited.store(qp.is_some(), Ordering::Release);
+        true
+    }
+
+    /// Removes the limiter of a destroyed QP
+    pub(crate) fn reset(&self, qpn: u32) {
+        let index = qpn_to_index(qpn);
+        if let (Some(limited), Some(qp)) = (self.limited.get(index), self.qps.get(index)) {
+            *qp.lock() = None;
+            limited.store(false, Ordering::Release);
+        }
+    }
+
+    /// Takes the tokens of a chunk of `len` bytes, returns `false` if the chunk must wait.
+    ///
+    /// A chunk is admitted as long as the bucket is not in debt, so chunks larger
+    /// than the bucket are sent too.
+    pub(crate) fn try_admit(&self, qpn: u32, len: u32) -> bool {
+        self.try_admit_at(qpn, len, Instant::now())
+    }
+
+    fn on_cnp_at(&self, qpn: u32, now: Instant) {
+        if !self.ecn_enabled() {
+            return;
+        }
+        let index = qpn_to_index(qpn);
+        let (Some(limited), Some(qp)) = (self.limited.get(index), self.qps.get(index)) else {
+            error!("invalid qpn: {qpn}");
+            return;
+        };
+        let params = *self.params.read();
+        let mut qp = qp.lock();
+        qp.get_or_insert_with(|| QpRate::new(&params, now))
+            .dcqcn
+            .get_or_insert_with(|| Dcqcn::new(&params, now))
+            .on_cnp(&params, now);
+        limited.store(true, Ordering::Release);
+    }
+
+    fn try_admit_at(&self, qpn: u32, len: u32, now: Instant) -> bool {
+        let index = qpn_to_index(qpn);
+        let (Some(limited), Some(qp)) = (self.limited.get(index), self.qps.get(index)) else {
+            return true;
+        };
+        let params = *self.params.read();
+        let mut qp = qp.lock();
+        let Some(rate) = qp.as_mut() else {
+            return true;
+        };
+        if !rate.try_admit(&params, len, now) {
+            return false;
+        }
+        if rate.is_idle() {
+            *qp = None;
+            limited.store(false, Ordering::Release);
+        }
+        true
+    }
+}
+
+/// Token bucket of a paced QP
+#[derive(Debug)]
+struct QpRate {
+    /// DCQCN state, `None` once the QP recovered to line rate
+    dcqcn: Option<Dcqcn>,
+    /// Rate limit in kbps
+    cap: Option<u64>,
+    /// Bucket capacity in microbits
+    burst: i64,
+    /// Tokens in microbits, negative while the bucket is in debt
+    tokens: i64,
+    last_refill: Instant,
+}
+
+impl QpRate {
+    fn new(params: &Params, now: Instant) -> Self {
+        Self {
+            dcqcn: None,
+            cap: None,
+            burst: params.burst,
+            tokens: params.burst,
+            last_refill: now,
+        }
+    }
+
+    /// Returns `true` if the QP no longer needs pacing
+    fn is_idle(&self) -> bool {
+        self.dcqcn.is_none() && self.cap.is_none()
+    }
+
+    fn try_admit(&mut self, params: &Params, len: u32, now: Instant) -> bool {
+        if let Some(dcqcn) = self.dcqcn.as_mut() {
+            dcqcn.update(params, now);
+        }
+        let rate = self
+            .dcqcn
+            .as_ref()
+            .map(|x| x.current.saturating_mul(1000))
+            .into_iter()
+            .chain(self.cap)
+            .min()
+            .unwrap_or(params.line_rate.saturating_mul(1000));
+        let elapsed = now.saturating_duration_since(self.last_refill).as_nanos();
+        self.last_refill = now;
+        let refill = elapsed.saturating_mul(u128::from(rate));
+        self.tokens = i64::try_from(refill)
+            .map_or(self.burst, |x| self.tokens.saturating_add(x))
+            .min(self.burst);
+        if self.tokens < 0 {
+            return false;
+        }
+        self.tokens = self
+            .tokens
+            .saturating_sub(i64::from(len).saturating_mul(MICROBITS_PER_BYTE));
+        if let Some(dcqcn) = self.dcqcn.as_mut() {
+            dcqcn.on_sent(params, len);
+        }
+        if self
+            .dcqcn
+            .as_ref()
+            .is_some_and(|x| x.current >= params.line_rate)
+        {
+            self.dcqcn = None;
+        }
+        true
+    }
+}
+
+/// DCQCN reaction point state of a QP
+#[derive(Debug)]
+struct Dcqcn {
+    /// Current rate in Mbps
+    current: u64,
+    /// Target rate in Mbps
+    target: u64,
+    /// Alpha in units of `1 / ALPHA_ONE`
+    alpha: u64,
+    /// Timer expirations since the last CNP
+    timer_stage: u32,
+    /// Byte counter expirations since the last CNP
+    byte_stage: u32,
+    /// Bytes sent since the last byte counter expiration
+    bytes: u64,
+    last_alpha_update: Instant,
+    last_increase: Instant,
+}
+
+impl Dcqcn {
+    fn new(params: &Params, now: Instant) -> Self {
+        Self {
+            current: params.line_rate,
+            target: params.line_rate,
+            alpha: ALPHA_ONE,
+            timer_stage: 0,
+            byte_stage: 0,
+            bytes: 0,
+            last_alpha_update: now,
+            last_increase: now,
+        }
+    }
+
+    fn on_cnp(&mut self, params: &Params, now: Instant) {
+        self.update(params, now);
+        self.target = self.current;
+        let cut = self.current.saturating_mul(self.alpha) / (2 * ALPHA_ONE);
+        self.current = self.current.saturating_sub(cut).max(params.min_rate);
+        self.alpha = self.alpha - (self.alpha >> ALPHA_G_SHIFT) + (ALPHA_ONE >> ALPHA_G_SHIFT);
+        self.timer_stage = 0;
+        self.byte_stage = 0;
+        self.bytes = 0;
+        self.last_alpha_update = now;
+        self.last_increase = now;
+    }
+
+    /// Runs the alpha decay and the rate increase timers up to `now`
+    fn update(&mut self, params: &Params, now: Instant) {
+        for _ in 0..elapsed_periods(&mut self.last_alpha_update, now, params.alpha_period) {
+            self.alpha -= self.alpha >> ALPHA_G_SHIFT;
+        }
+        for _ in 0..elapsed_periods(&mut self.last_increase, now, params.increase_period) {
+            self.timer_stage = self.timer_stage.saturating_add(1);
+            self.increase(params);
+        }
+    }
+
+    fn increase(&mut self, params: &Params) {
+        let stage_max = self.timer_stage.max(self.byte_stage);
+        let stage_min = self.timer_stage.min(self.byte_stage);
+        if stage_min > params.fast_recovery_stages {
+            let i = u64::from(stage_min - params.fast_recovery_stages);
+            let step = params.hai_rate.saturating_mul(i);
+            self.target = self.target.saturating_add(step);
+        } else if stage_max >= params.fast_recovery_stages {
+            self.target = self.target.saturating_add(params.ai_rate);
+        }
+        // Fast recovery only moves the current rate halfway to the target
+        self.target = self.target.min(params.line_rate);
+        self.current = self.current.saturating_add(self.target).div_ceil(2);
+    }
+
+    /// Runs the byte counter for `len` bytes sent
+    fn on_sent(&mut self, params: &Params, len: u32) {
+        self.bytes += u64::from(len);
+        while self.bytes >= params.byte_counter {
+            self.bytes -= params.byte_counter;
+            self.byte_stage = self.byte_stage.saturating_add(1);
+            self.increase(params);
+        }
+    }
+}
+
+/// Returns the capacity in microbits of a bucket of `bytes`
+fn bucket_size(bytes: u64) -> i64 {
+    i64::try_from(bytes)
+        .unwrap_or(i64::MAX)
+        .saturating_mul(MICROBITS_PER_BYTE)
+}
+
+/// Advances `last` by the number of whole periods elapsed until `now`, returns that number
+fn elapsed_periods(last: &mut Instant, now: Instant, period: Duration) -> u32 {
+    let mut n = 0;
+    while n < MAX_CATCH_UP && now.saturating_duration_since(*last) >= period {
+        *last += period;
+        n += 1;
+    }
+    if n == MAX_CATCH_UP {
+        *last = now;
+    }
+    n
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn config() -> CongestionConfig {
+        CongestionConfig {
+            line_rate_mbps: 100_000,
+            min_rate_mbps: 100,
+            burst_bytes: 8192,
+            ..Default::default()
+        }
+    }
+
+    #[test]
+    fn cnp_cuts_rate_and_timer_recovers_it() {
+        let params = Params::new(&config());
+        let now = Instant::now();
+        let mut rate = Dcqcn::new(&params, now);
+        rate.on_cnp(&params, now);
+        // alpha starts at 1, and stays there while CNPs keep coming
+        assert_eq!(rate.current, 50_000);
+        assert_eq!(rate.target, 100_000);
+        rate.on_cnp(&params, now);
+        assert_eq!(rate.current, 25_000);
+        assert_eq!(rate.target, 50_000);
+        assert_eq!(rate.alpha, ALPHA_ONE);
+        let mut at = now + params.alpha_period;
+        rate.update(&params, at);
+        assert_eq!(rate.alpha, ALPHA_ONE - (ALPHA_ONE >> ALPHA_G_SHIFT));
+
+        at = now;
+        for _ in 1..params.fast_recovery_stages {
+            at += params.increase_period;
+            let prev = rate.current;
+            rate.update(&params, at);
+            // fast recovery, halfway towards the rate before the last cut
+            assert_eq!(rate.current, (prev + 50_000).div_ceil(2));
+        }
+        // additive increase up to line rate
+        for _ in 0..4 {
+            at += params.increase_period * MAX_CATCH_UP;
+            rate.update(&params, at);
+        }
+        assert_eq!(rate.current, params.line_rate);
+    }
+
+    #[test]
+    fn token_bucket_paces_chunks() {
+        let rate = RateControl::new(&config());
+        let qpn = 3 << 8;
+        let now = Instant::now();
+        assert!(!rate.is_limited(qpn));
+        rate.on_cnp_at(qpn, now);
+        assert!(rate.is_limited(qpn));
+        // the bucket starts full, the chunk that empties it may overdraw it
+        assert!(rate.try_admit_at(qpn, 4096, now));
+        assert!(rate.try_admit_at(qpn, 8192, now));
+        assert!(!rate.try_admit_at(qpn, 4096, now));
+        // 4096 bytes at 50 Gbps take 655.36 ns
+        assert!(!rate.try_admit_at(qpn, 4096, now + Duration::from_nanos(600)));
+        assert!(rate.try_admit_at(qpn, 4096, now + Duration::from_nanos(700)));
+        assert!(rate.is_limited(qpn));
+    }
+
+    #[test]
+    fn rate_limit_caps_the_qp() {
+        let rate = RateControl::new(&config());
+        let qpn = 5 << 8;
+        let now = Instant::now();
+        assert!(rate.set_limit(qpn, 1_000_000, 4096));
+        assert!(rate.is_limited(qpn));
+        assert!(rate.try_admit_at(qpn, 4096, now));
+        assert!(rate.try_admit_at(qpn, 4096, now));
+        // 4096 bytes at 1 Gbps take 32.768 us
+        assert!(!rate.try_admit_at(qpn, 64, now + Duration::from_micros(32)));
+        assert!(rate.try_admit_at(qpn, 64, now + Duration::from_micros(33)));
+        // a QP cut by a CNP stays paced once its limit is removed
+        rate.on_cnp_at(qpn, now);
+        assert!(rate.set_limit(qpn, 0, 0));
+        assert!(rate.is_limited(qpn));
+        rate.reset(qpn);
+        assert!(!rate.is_limited(qpn));
+        assert!(rate.set_limit(qpn, 1_000_000, 0));
+        assert!(rate.set_limit(qpn, 0, 0));
+        assert!(!rate.is_limited(qpn));
+    }
+
+    #[test]
+    fn disabled_rate_control_ignores_cnps() {
+        let rate = RateControl::new(&CongestionConfig {
+            enabled: false,
+            ..config()
+        });
+        rate.on_cnp(0);
+        assert!(!rate.is_limited(0));
+        assert!(rate.try_admit(0, u32::MAX));
+        rate.reconfigure(&config());
+        assert!(rate.ecn_enabled());
+        rate.on_cnp(0);
+        assert!(rate.is_limited(0));
+    }
+}
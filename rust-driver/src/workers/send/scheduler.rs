@@ -0,0 +1,478 @@
+use std::{
+    iter,
+    sync::{
+        atomic::{AtomicBool, AtomicU32, AtomicUsize, Ordering},
+        Arc,
+    },
+};
+
+use log::{debug, error};
+
+use crate::{
+    constants::{
+        MAX_QP_CNT, SEND_CHANNEL_REBALANCE_THRESHOLD, SEND_CHANNEL_SCALE_DOWN_IDLE_PUSHES,
+    },
+    rdma_utils::qp::qpn_to_index,
+};
+
+use super::{
+    priority::{QpPriorities, PRIORITY_CLASSES},
+    rate::RateControl,
+    types::WrInjector,
+    WrChunk,
+};
+
+/// Schedules chunks to send channels.
+///
+/// Each QP is pinned to a single channel so that its chunks are injected to the hardware in
+/// order. A QP is only moved to another channel when it has no chunks queued, and only when
+/// the backlog of its current channel exceeds the least loaded channel by
+/// `SEND_CHANNEL_REBALANCE_THRESHOLD`.
+///
+/// QPs are only assigned to the first `active` channels. A channel is added when every active
+/// channel is backlogged, and the last one is retired once the channels stayed empty for
+/// `SEND_CHANNEL_SCALE_DOWN_IDLE_PUSHES` pushes, so that the workers of the unused channels
+/// park while the process is mostly idle.
+///
+/// Each channel has one queue per priority class. The class of a QP is likewise only changed
+/// when it has no chunks queued, so that its chunks never overtake each other.
+///
+/// A channel dedicated to a thread domain is left out of the balancing, only the QPs pinned
+/// to it are queued there. Channel 0 is never dedicated.
+pub(crate) struct QpScheduler {
+    /// Per channel work request queues, indexed by `channel * PRIORITY_CLASSES + class`
+    injectors: Box<[WrInjector]>,
+    /// Channel assigned to each QP
+    affinity: Box<[AtomicUsize]>,
+    /// Number of channels the quiescent QPs are assigned to
+    active: AtomicUsize,
+    /// Number of consecutive pushes of quiescent QPs that found every channel empty
+    idle_pushes: AtomicU32,
+    /// Number of chunks of each QP that are not yet written to a send queue
+    pending: Box<[AtomicU32]>,
+    /// Class each QP is queued in
+    class: Box<[AtomicUsize]>,
+    /// Whether each channel is dedicated to a thread domain
+    dedicated: Box<[AtomicBool]>,
+    /// Whether each QP stays on its channel
+    pinned: Box<[AtomicBool]>,
+    /// Classes of the QPs set by `ibv_modify_qp`, taken when the QP is quiescent
+    priorities: Arc<QpPriorities>,
+    /// Send rate limits of the QPs
+    rate: Arc<RateControl>,
+}
+
+impl QpScheduler {
+    pub(crate) fn new(
+        num_channel: usize,
+        rate: Arc<RateControl>,
+        priorities: Arc<QpPriorities>,
+    ) -> Self {
+        let num_channel = num_channel.max(1);
+        Self {
+            injectors: iter::repeat_with(WrInjector::new)
+                .take(num_channel * PRIORITY_CLASSES)
+                .collect(),
+            affinity: iter::repeat_with(|| AtomicUsize::new(0))
+                .take(MAX_QP_CNT)
+                .collect(),
+            active: AtomicUsize::new(1),
+            idle_pushes: AtomicU32::new(0),
+            pending: iter::repeat_with(|| AtomicU32::new(0))
+                .take(MAX_QP_CNT)
+                .collect(),
+            class: iter::repeat_with(|| AtomicUsize::new(0))
+                .take(MAX_QP_CNT)
+                .collect(),
+            dedicated: iter::repeat_with(|| AtomicBool::new(false))
+                .take(num_channel)
+                .collect(),
+            pinned: iter::repeat_with(|| AtomicBool::new(false))
+                .take(MAX_QP_CNT)
+                .collect(),
+            priorities,
+            rate,
+        }
+    }
+
+    /// Queues a chunk on the channel of its QP, returns the channel
+    pub(crate) fn push(&self, wr: WrChunk) -> Option<usize> {
+        let index = qpn_to_index(wr.sqpn);
+        let (Some(affinity), Some(pending), Some(class)) = (
+            self.affinity.get(index),
+            self.pending.get(index),
+            self.class.get(index),
+        ) else {
+            error!("invalid qpn: {}", wr.sqpn);
+            return None;
+        };
+        let (channel, class) = if pending
+            .compare_exchange(0, 1, Ordering::AcqRel, Ordering::Acquire)
+            .is_ok()
+        {
+            // The QP is quiescent, it is safe to move it to another channel or class
+            let current = affinity.load(Ordering::Relaxed);
+            let target = if self.is_pinned(index) {
+                current
+            } else {
+                self.rebalance_target(current)
+            };
+            affinity.store(target, Ordering::Relaxed);
+            let target_class = self.priorities.class(wr.sqpn);
+            class.store(target_class, Ordering::Relaxed);
+            (target, target_class)
+        } else {
+            let _prev = pending.fetch_add(1, Ordering::AcqRel);
+            (
+                affinity.load(Ordering::Relaxed),
+                class.load(Ordering::Relaxed),
+            )
+        };
+        self.injector(channel, class)?.push(wr);
+
+        Some(channel)
+    }
+
+    /// Queues a chunk of a striped WR on the channel of its stripe, returns the channel.
+    ///
+    /// The stripes go round the `width` channels not dedicated to a thread domain from the
+    /// channel of the QP, all of them if `width` is 0. The chunk counts as queued for the QP, so
+    /// the QP keeps its channel until all of its chunks are written. The chunks of pinned and
+    /// paced QPs stay on the channel of the QP.
+    pub(crate) fn push_stripe(&self, wr: WrChunk, stripe: usize, width: usize) -> Option<usize> {
+        let index = qpn_to_index(wr.sqpn);
+        if self.is_pinned(index) || self.rate.is_limited(wr.sqpn) {
+            return self.push(wr);
+        }
+        let (Some(affinity), Some(pending), Some(class)) = (
+            self.affinity.get(index),
+            self.pending.get(index),
+            self.class.get(index),
+        ) else {
+            error!("invalid qpn: {}", wr.sqpn);
+            return None;
+        };
+        let _prev = pending.fetch_add(1, Ordering::AcqRel);
+        let home = affinity.load(Ordering::Relaxed);
+        let shared = || (0..self.num_channel()).filter(|&id| !self.is_dedicated(id));
+        let num = shared().count().max(1);
+        let width = if width == 0 { num } else { width.min(num) };
+        let start = shared().position(|id| id == home).unwrap_or(0);
+        let channel = shared().nth((start + stripe % width) % num).unwrap_or(home);
+        self.injector(channel, class.load(Ordering::Relaxed))?
+            .push(wr);
+
+        Some(channel)
+    }
+
+    /// Marks a chunk of the QP as written to the send queue
+    pub(crate) fn complete(&self, qpn: u32) {
+        if let Some(pending) = self.pending.get(qpn_to_index(qpn)) {
+            let _prev = pending.fetch_sub(1, Ordering::AcqRel);
+        }
+    }
+
+    /// Returns `true` if chunks of the QP are queued for a `SendWorker`
+    pub(crate) fn has_pending(&self, qpn: u32) -> bool {
+        self.pending
+            .get(qpn_to_index(qpn))
+            .is_some_and(|x| x.load(Ordering::Acquire) != 0)
+    }
+
+    pub(crate) fn rate(&self) -> &RateControl {
+        &self.rate
+    }
+
+    /// Returns the channel currently assigned to the QP
+    pub(crate) fn channel(&self, qpn: u32) -> Option<usize> {
+        self.affinity
+            .get(qpn_to_index(qpn))
+            .map(|x| x.load(Ordering::Relaxed))
+    }
+
+    /// Dedicates the last free channel to a thread domain, `None` if only channel 0 is left
+    pub(crate) fn dedicate_channel(&self) -> Option<usize> {
+        (1..self.num_channel()).rev().find(|&id| {
+            self.dedicated.get(id).is_some_and(|x| {
+                x.compare_exchange(false, true, Ordering::AcqRel, Ordering::Relaxed)
+                    .is_ok()
+            })
+        })
+    }
+
+    /// Returns a dedicated channel to the balancing
+    pub(crate) fn release_channel(&self, channel: usize) {
+        if let Some(dedicated) = self.dedicated.get(channel) {
+            dedicated.store(false, Ordering::Release);
+        }
+    }
+
+    /// Pins a QP to `channel`, the QP must have no chunks queued
+    pub(crate) fn pin(&self, qpn: u32, channel: usize) {
+        let index = qpn_to_index(qpn);
+        if let (Some(affinity), Some(pinned)) = (self.affinity.get(index), self.pinned.get(index)) {
+            affinity.store(channel, Ordering::Relaxed);
+            pinned.store(true, Ordering::Release);
+        }
+    }
+
+    /// Lets the QP move again, it leaves its channel once quiescent
+    pub(crate) fn unpin(&self, qpn: u32) {
+        if let Some(pinned) = self.pinned.get(qpn_to_index(qpn)) {
+            pinned.store(false, Ordering::Release);
+        }
+    }
+
+    fn is_pinned(&self, index: usize) -> bool {
+        self.pinned
+            .get(index)
+            .is_some_and(|x| x.load(Ordering::Acquire))
+    }
+
+    fn is_dedicated(&self, channel: usize) -> bool {
+        self.dedicated
+            .get(channel)
+            .is_some_and(|x| x.load(Ordering::Acquire))
+    }
+
+    pub(super) fn injector(&self, channel: usize, class: usize) -> Option<&WrInjector> {
+        if class >= PRIORITY_CLASSES {
+            return None;
+        }
+        self.injectors.get(channel * PRIORITY_CLASSES + class)
+    }
+
+    /// Returns the number of chunks queued on the channel over all classes
+    pub(super) fn load(&self, channel: usize) -> usize {
+        (0..PRIORITY_CLASSES)
+            .filter_map(|class| self.injector(channel, class))
+            .map(WrInjector::len)
+            .sum()
+    }
+
+    /// Returns the number of channels
+    fn num_channel(&self) -> usize {
+        self.injectors.len() / PRIORITY_CLASSES
+    }
+
+    /// Returns the least loaded active channel if the imbalance crosses the threshold, or if
+    /// the channel of the QP was retired or dedicated
+    fn rebalance_target(&self, current: usize) -> usize {
+        let active = self.scale();
+        let least_loaded = || {
+            (0..active)
+                .filter(|&id| !self.is_dedicated(id))
+                .map(|id| (id, self.load(id)))
+                .min_by_key(|&(_, load)| load)
+        };
+        if current >= active || self.is_dedicated(current) {
+            return least_loaded().map_or(0, |(id, _)| id);
+        }
+        let current_load = self.load(current);
+        if current_load < SEND_CHANNEL_REBALANCE_THRESHOLD {
+            return current;
+        }
+        least_loaded()
+            .filter(|&(_, load)| current_load - load >= SEND_CHANNEL_REBALANCE_THRESHOLD)
+            .map_or(current, |(id, _)| id)
+    }
+
+    /// Adds or retires a channel according to the backlog of the active channels, returns the
+    /// number of active channels
+    fn scale(&self) -> usize {
+        let active = self.active.load(Ordering::Relaxed);
+        let loads = (0..active)
+            .filter(|&id| !self.is_dedicated(id))
+            .map(|id| self.load(id));
+        let (min, total) = loads.fold((usize::MAX, 0), |(min, total), load| {
+            (min.min(load), total + load)
+        });
+        let target = if min >= SEND_CHANNEL_REBALANCE_THRESHOLD && active < self.num_channel() {
+            active + 1
+        } else if total == 0 && active > 1 {
+            let idle = self.idle_pushes.fetch_add(1, Ordering::Relaxed) + 1;
+            if idle < SEND_CHANNEL_SCALE_DOWN_IDLE_PUSHES {
+                return active;
+            }
+            active - 1
+        } else {
+            active
+        };
+        if total != 0 || target != active {
+            self.idle_pushes.store(0, Ordering::Relaxed);
+        }
+        if target == active {
+            return active;
+        }
+        match self
+            .active
+            .compare_exchange(active, target, Ordering::Relaxed, Ordering::Relaxed)
+        {
+            Ok(_) => {
+                debug!("send channels scaled from {active} to {target}");
+                target
+            }
+            Err(current) => current,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{config::CongestionConfig, rdma_utils::psn::Psn};
+
+    fn chunk(sqpn: u32, psn: u32) -> WrChunk {
+        WrChunk {
+            sqpn,
+            psn: Psn(psn),
+            ..Default::default()
+        }
+    }
+
+    fn scheduler(num_channel: usize) -> QpScheduler {
+        let rate = Arc::new(RateControl::new(&CongestionConfig::default()));
+        QpScheduler::new(num_channel, rate, Arc::new(QpPriorities::new()))
+    }
+
+    fn drain(scheduler: &QpScheduler, channel: usize, class: usize) -> Vec<WrChunk> {
+        let injector = scheduler.injector(channel, class).unwrap();
+        iter::repeat_with(|| injector.steal().success())
+            .map_while(|x| x)
+            .collect()
+    }
+
+    #[test]
+    fn qps_are_pinned_to_channels() {
+        let scheduler = scheduler(2);
+        // qpn index 0 and 1
+        let (qp0, qp1) = (0, 1 << 8);
+        for psn in 0..4 {
+            // A single channel is active while the QPs are not backlogged
+            assert_eq!(scheduler.push(chunk(qp0, psn)), Some(0));
+            assert_eq!(scheduler.push(chunk(qp1, psn)), Some(0));
+        }
+        assert_eq!(scheduler.channel(qp0), Some(0));
+        assert_eq!(scheduler.channel(qp1), Some(0));
+        let chunks = drain(&scheduler, 0, 0);
+        for qpn in [qp0, qp1] {
+            let psns: Vec<_> = chunks
+                .iter()
+                .filter(|c| c.sqpn == qpn)
+                .map(|c| c.psn.into_inner())
+                .collect();
+            assert_eq!(psns, [0, 1, 2, 3]);
+        }
+    }
+
+    #[test]
+    fn quiescent_qp_moves_to_idle_channel() {
+        let scheduler = scheduler(2);
+        let (qp0, qp2) = (0, 2 << 8);
+        for psn in 0..SEND_CHANNEL_REBALANCE_THRESHOLD as u32 {
+            let _channel = scheduler.push(chunk(qp0, psn));
+        }
+        // qp2 maps to channel 0 initially, but channel 0 is overloaded
+        assert_eq!(scheduler.push(chunk(qp2, 0)), Some(1));
+        assert_eq!(scheduler.channel(qp2), Some(1));
+        // qp0 still has pending chunks and stays on channel 0
+        assert_eq!(scheduler.push(chunk(qp0, 0)), Some(0));
+        assert_eq!(scheduler.channel(qp0), Some(0));
+    }
+
+    #[test]
+    fn idle_channels_are_retired() {
+        let scheduler = scheduler(2);
+        let (qp0, qp2) = (0, 2 << 8);
+        for psn in 0..SEND_CHANNEL_REBALANCE_THRESHOLD as u32 {
+            let _channel = scheduler.push(chunk(qp0, psn));
+        }
+        assert_eq!(scheduler.push(chunk(qp2, 0)), Some(1));
+        for (qpn, channel) in [(qp0, 0), (qp2, 1)] {
+            for c in drain(&scheduler, channel, 0) {
+                assert_eq!(c.sqpn, qpn);
+                scheduler.complete(qpn);
+            }
+        }
+        for psn in 1..SEND_CHANNEL_SCALE_DOWN_IDLE_PUSHES {
+            assert_eq!(scheduler.push(chunk(qp0, psn)), Some(0));
+            let _chunks = drain(&scheduler, 0, 0);
+            scheduler.complete(qp0);
+        }
+        // The last empty push retires channel 1, qp2 moves back to channel 0
+        assert_eq!(scheduler.push(chunk(qp2, 1)), Some(0));
+        assert_eq!(scheduler.active.load(Ordering::Relaxed), 1);
+    }
+
+    #[test]
+    fn dedicated_channels_only_serve_pinned_qps() {
+        let scheduler = scheduler(2);
+        let (qp0, qp1, qp2) = (0, 1 << 8, 2 << 8);
+        assert_eq!(scheduler.dedicate_channel(), Some(1));
+        // Channel 0 stays with the balancing
+        assert_eq!(scheduler.dedicate_channel(), None);
+        scheduler.pin(qp1, 1);
+        for psn in 0..SEND_CHANNEL_REBALANCE_THRESHOLD as u32 * 2 {
+            assert_eq!(scheduler.push(chunk(qp0, psn)), Some(0));
+            assert_eq!(scheduler.push(chunk(qp1, psn)), Some(1));
+        }
+        // Channel 0 is overloaded but the dedicated channel takes no other QP
+        assert_eq!(scheduler.push(chunk(qp2, 0)), Some(0));
+
+        scheduler.unpin(qp1);
+        scheduler.release_channel(1);
+        for c in drain(&scheduler, 1, 0) {
+            scheduler.complete(c.sqpn);
+        }
+        assert_eq!(scheduler.push(chunk(qp1, 0)), Some(1));
+        assert_eq!(scheduler.dedicate_channel(), Some(1));
+    }
+
+    #[test]
+    fn stripes_go_round_the_shared_channels() {
+        let scheduler = scheduler(4);
+        let qp = 1 << 8;
+        assert_eq!(scheduler.push(chunk(qp, 0)), Some(0));
+        let channels: Vec<_> = (1..6)
+            .map(|stripe| scheduler.push_stripe(chunk(qp, stripe), stripe as usize, 0))
+            .collect();
+        assert_eq!(channels, [1, 2, 3, 0, 1].map(Some));
+        assert_eq!(scheduler.push_stripe(chunk(qp, 6), 3, 2), Some(1));
+        // The QP keeps its channel until the stripes are written
+        assert_eq!(scheduler.channel(qp), Some(0));
+        for channel in 0..4 {
+            for c in drain(&scheduler, channel, 0) {
+                scheduler.complete(c.sqpn);
+            }
+        }
+        assert!(!scheduler.has_pending(qp));
+
+        // The dedicated channels take no stripes
+        assert_eq!(scheduler.dedicate_channel(), Some(3));
+        let channels: Vec<_> = (1..4)
+            .map(|stripe| scheduler.push_stripe(chunk(qp, stripe), stripe as usize, 0))
+            .collect();
+        assert_eq!(channels, [1, 2, 0].map(Some));
+    }
+
+    #[test]
+    fn class_changes_wait_for_quiescent_qp() {
+        let scheduler = scheduler(1);
+        let qp = 1 << 8;
+        let _channel = scheduler.push(chunk(qp, 0));
+        scheduler.priorities.set(qp, 2);
+        // The QP still has a chunk queued in class 0
+        let _channel = scheduler.push(chunk(qp, 1));
+        scheduler.complete(qp);
+        scheduler.complete(qp);
+        let _channel = scheduler.push(chunk(qp, 2));
+        let psns = |class| {
+            drain(&scheduler, 0, class)
+                .iter()
+                .map(|c| c.psn.into_inner())
+                .collect::<Vec<_>>()
+        };
+        assert_eq!(psns(0), [0, 1]);
+        assert_eq!(psns(2), [2]);
+    }
+}
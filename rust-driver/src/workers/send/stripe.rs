@@ -0,0 +1,81 @@
+use crate::config::StripeConfig;
+
+use super::{WorkReqOpCode, WrChunk};
+
+/// Striping of the large RDMA writes of the QPs over the send channels.
+///
+/// A QP is pinned to one channel so that its chunks reach the card in order, which caps a
+/// single large write at the bandwidth of one channel. The middle chunks of the RDMA writes of
+/// at least `min_bytes` are spread over the channels by their offset in the WR instead, the
+/// first and the last chunk stay on the channel of the QP. The stripes keep the PSNs of the
+/// QP, so the WR is completed once, when all of its chunks are acknowledged.
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct ChannelStripe {
+    /// Minimum length of the striped WRs
+    min_bytes: u32,
+    /// Number of channels of the stripes, 0 for all of them
+    width: usize,
+}
+
+impl ChannelStripe {
+    pub(crate) fn new(config: StripeConfig) -> Self {
+        Self {
+            min_bytes: config.min_bytes(),
+            width: config.channels,
+        }
+    }
+
+    /// Returns the stripe of the chunk, `None` if it takes the channel of its QP
+    #[allow(clippy::cast_possible_truncation)] // only the stripe count of the offset matters
+    pub(crate) fn stripe(&self, wr: &WrChunk) -> Option<usize> {
+        is_middle_chunk(wr, self.min_bytes).then(|| (wr.raddr / u64::from(wr.len)) as usize)
+    }
+
+    pub(crate) fn width(&self) -> usize {
+        self.width
+    }
+}
+
+/// Returns `true` if the chunk is neither the first nor the last chunk of an RDMA write of at
+/// least `min_bytes`
+pub(super) fn is_middle_chunk(wr: &WrChunk, min_bytes: u32) -> bool {
+    matches!(
+        wr.opcode,
+        WorkReqOpCode::RdmaWrite | WorkReqOpCode::RdmaWriteWithImm
+    ) && !wr.is_first
+        && !wr.is_last
+        && wr.len != 0
+        && wr.total_len >= min_bytes
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn middle_chunks_are_striped_by_offset() {
+        let stripe = ChannelStripe::new(StripeConfig {
+            enabled: true,
+            min_bytes: 1 << 20,
+            channels: 0,
+        });
+        let chunk = |raddr: u64, is_first, is_last| WrChunk {
+            opcode: WorkReqOpCode::RdmaWrite,
+            total_len: 4 << 20,
+            raddr,
+            len: 1 << 20,
+            is_first,
+            is_last,
+            ..WrChunk::default()
+        };
+        assert_eq!(stripe.stripe(&chunk(0, true, false)), None);
+        assert_eq!(stripe.stripe(&chunk(1 << 20, false, false)), Some(1));
+        assert_eq!(stripe.stripe(&chunk(2 << 20, false, false)), Some(2));
+        assert_eq!(stripe.stripe(&chunk(3 << 20, false, true)), None);
+        let send = WrChunk {
+            opcode: WorkReqOpCode::Send,
+            ..chunk(1 << 20, false, false)
+        };
+        assert_eq!(stripe.stripe(&send), None);
+    }
+}
@@ -1,19 +1,16 @@
 use std::marker::PhantomData;
 
-use crossbeam_deque::{Injector, Stealer, Worker};
+use crossbeam_deque::Injector;
 
 use crate::{
     descriptors::{SendQueueReqDescSeg0, SendQueueReqDescSeg1},
-    rdma_utils::{psn::Psn, qp::convert_ibv_mtu_to_u16},
+    latency::Stamp,
+    rdma_utils::{atomic::AtomicOperands, psn::Psn, qp::convert_ibv_mtu_to_u16},
     ringbuf::{DescRingBuffer, DescSerialize},
 };
 
 /// Injector
 pub(super) type WrInjector = Injector<WrChunk>;
-/// Stealer
-pub(super) type WrStealer = Stealer<WrChunk>;
-/// Worker
-pub(super) type WrWorker = Worker<WrChunk>;
 
 /// Send queue descriptor types that can be submitted
 #[derive(Debug, Clone, Copy)]
@@ -48,6 +45,11 @@ impl SendQueue {
         self.inner.push(&desc)
     }
 
+    /// Writes the encoded descriptor pair of a chunk, nothing is written unless both fit
+    pub(crate) fn push_pair(&mut self, descs: [[u8; 32]; 2]) -> bool {
+        self.inner.push_pair(descs)
+    }
+
     /// Returns the head pointer of the buffer
     pub(crate) fn head(&self) -> u32 {
         self.inner.head() as u32
@@ -107,6 +109,7 @@ impl WrChunkBuilder<Initial> {
         self.inner.dqp_ip = qp_params.dqp_ip;
         self.inner.pmtu = qp_params.pmtu;
         self.inner.msn = qp_params.msn;
+        self.inner.template = qp_params.template;
 
         WrChunkBuilder {
             inner: self.inner,
@@ -181,11 +184,35 @@ impl WrChunkBuilder<WithChunkInfo> {
         self
     }
 
+    /// Overrides the local key, used when the chunk refers to a non-first SGE
+    pub(crate) fn set_lkey(mut self, lkey: u32) -> Self {
+        self.inner.lkey = lkey;
+        self
+    }
+
     pub(crate) fn set_enable_ecn(mut self) -> Self {
         self.inner.enable_ecn = true;
         self
     }
 
+    /// Carries the operands of an atomic, atomic write or flush WR in the local buffer fields
+    /// of the descriptors, such a request has no payload: the swap value takes `laddr`, the
+    /// compare or add value takes `imm` for its high half and `lkey` for its low half
+    #[allow(clippy::as_conversions, clippy::cast_possible_truncation)]
+    pub(crate) fn set_atomic(mut self, operands: AtomicOperands) -> Self {
+        self.inner.laddr = operands.swap;
+        self.inner.imm = (operands.compare_add >> 32) as u32;
+        self.inner.lkey = operands.compare_add as u32;
+        self.inner.len = 0;
+        self
+    }
+
+    /// Sets the time the WR of the chunk was posted
+    pub(crate) fn set_posted(mut self, posted: Stamp) -> Self {
+        self.inner.posted = posted;
+        self
+    }
+
     pub(crate) fn build(self) -> WrChunk {
         self.inner
     }
@@ -215,14 +242,154 @@ pub(crate) struct WrChunk {
     pub(crate) psn: Psn,
     pub(crate) is_retry: bool,
     pub(crate) enable_ecn: bool,
+    /// Descriptors with the fields of the QP encoded
+    pub(crate) template: SendDescTemplate,
+    /// Time the WR of the chunk was posted, not taken for retransmitted chunks
+    pub(crate) posted: Stamp,
 }
 
 impl WrChunk {
     pub(crate) fn set_is_retry(&mut self) {
         self.is_retry = true;
     }
+
+    /// Encodes the descriptor pair of the chunk, `ecn` sends it ECN capable
+    pub(crate) fn encode(&self, ecn: bool) -> [[u8; 32]; 2] {
+        self.template.encode(self, ecn)
+    }
+
+    /// Encodes the fields of the chunk into its template, so that it is not encoded again each
+    /// time it is retransmitted
+    pub(crate) fn seal(&mut self) {
+        self.template = self.template.sealed(self);
+    }
+
+    /// Returns the number of packets of the chunk, a zero length chunk is a single packet
+    pub(crate) fn num_packets(&self) -> u32 {
+        convert_ibv_mtu_to_u16(self.pmtu).map_or(1, |pmtu| self.len.div_ceil(pmtu.into()).max(1))
+    }
+}
+
+/// Descriptor pair of the chunks of a work request with the fields of the QP already encoded.
+///
+/// Encoding a chunk only patches the fields that differ between chunks into a copy of the
+/// template and serializes it, the descriptors are never assembled field by field. The
+/// template of a retransmitted chunk is sealed with all the fields of the chunk, sending it
+/// again only patches its retry and ECN bits.
+#[derive(Clone, Copy, Debug)]
+pub(crate) struct SendDescTemplate {
+    /// First segment
+    seg0: SendQueueReqDescSeg0,
+    /// Second segment
+    seg1: SendQueueReqDescSeg1,
+    /// Whether the fields of the chunk are encoded as well
+    sealed: bool,
+}
+
+impl SendDescTemplate {
+    pub(crate) fn new(
+        qp_type: u8,
+        sqpn: u32,
+        mac_addr: u64,
+        dqpn: u32,
+        dqp_ip: u32,
+        pmtu: u8,
+    ) -> Self {
+        let seg0 = SendQueueReqDescSeg0::new(
+            WorkReqOpCode::default(),
+            0,
+            0,
+            qp_type,
+            dqpn,
+            0,
+            dqp_ip,
+            0,
+            0,
+            0,
+        );
+        let seg1 = SendQueueReqDescSeg1::new(
+            WorkReqOpCode::default(),
+            pmtu,
+            false,
+            false,
+            false,
+            false,
+            sqpn,
+            0,
+            mac_addr,
+            0,
+            0,
+            0,
+        );
+        Self {
+            seg0,
+            seg1,
+            sealed: false,
+        }
+    }
+
+    /// Encodes the descriptor pair of `wr`, `ecn` sends it ECN capable
+    pub(crate) fn encode(&self, wr: &WrChunk, ecn: bool) -> [[u8; 32]; 2] {
+        let (seg0, mut seg1) = if self.sealed {
+            (self.seg0, self.seg1)
+        } else {
+            self.patch(wr)
+        };
+        seg1.set_is_retry(wr.is_retry);
+        seg1.set_enable_ecn(wr.enable_ecn || ecn);
+
+        [seg0.serialize(), seg1.serialize()]
+    }
+
+    /// Returns the template with the fields of `wr` encoded
+    fn sealed(&self, wr: &WrChunk) -> Self {
+        let (seg0, seg1) = self.patch(wr);
+        Self {
+            seg0,
+            seg1,
+            sealed: true,
+        }
+    }
+
+    /// Patches the fields of `wr` but the retry and ECN bits into a copy of the template
+    fn patch(&self, wr: &WrChunk) -> (SendQueueReqDescSeg0, SendQueueReqDescSeg1) {
+        let mut seg0 = self.seg0;
+        seg0.set_op_code(wr.opcode);
+        seg0.set_msn(wr.msn);
+        seg0.set_psn(wr.psn.into_inner());
+        seg0.set_flags(wr.flags);
+        seg0.set_raddr(wr.raddr);
+        seg0.set_rkey(wr.rkey);
+        seg0.set_total_len(wr.total_len);
+
+        let mut seg1 = self.seg1;
+        seg1.set_op_code(wr.opcode);
+        seg1.set_is_first(wr.is_first);
+        seg1.set_is_last(wr.is_last);
+        seg1.set_imm(wr.imm);
+        seg1.set_lkey(wr.lkey);
+        seg1.set_len(wr.len);
+        seg1.set_laddr(wr.laddr);
+
+        (seg0, seg1)
+    }
 }
 
+impl Default for SendDescTemplate {
+    fn default() -> Self {
+        Self::new(0, 0, 0, 0, 0, 0)
+    }
+}
+
+impl PartialEq for SendDescTemplate {
+    fn eq(&self, other: &Self) -> bool {
+        self.seg0.serialize() == other.seg0.serialize()
+            && self.seg1.serialize() == other.seg1.serialize()
+    }
+}
+
+impl Eq for SendDescTemplate {}
+
 #[derive(Default, Debug, Clone, Copy, PartialEq, Eq)]
 pub(crate) enum ChunkPos {
     #[default]
@@ -251,6 +418,8 @@ pub(crate) struct QpParams {
     pub(crate) dqpn: u32,
     pub(crate) dqp_ip: u32,
     pub(crate) pmtu: u8,
+    /// Descriptors with the above fields encoded
+    pub(crate) template: SendDescTemplate,
 }
 
 impl QpParams {
@@ -262,6 +431,22 @@ impl QpParams {
         dqpn: u32,
         dqp_ip: u32,
         pmtu: u8,
+    ) -> Self {
+        let template = SendDescTemplate::new(qp_type, sqpn, mac_addr, dqpn, dqp_ip, pmtu);
+        Self::with_template(msn, qp_type, sqpn, mac_addr, dqpn, dqp_ip, pmtu, template)
+    }
+
+    /// Creates the parameters with a `template` encoded from the same fields beforehand
+    #[allow(clippy::too_many_arguments)]
+    pub(crate) fn with_template(
+        msn: u16,
+        qp_type: u8,
+        sqpn: u32,
+        mac_addr: u64,
+        dqpn: u32,
+        dqp_ip: u32,
+        pmtu: u8,
+        template: SendDescTemplate,
     ) -> Self {
         Self {
             msn,
@@ -271,6 +456,7 @@ impl QpParams {
             dqpn,
             dqp_ip,
             pmtu,
+            template,
         }
     }
 }
@@ -296,3 +482,107 @@ pub(crate) enum WorkReqOpCode {
     Flush = 14,
     AtomicWrite = 15,
 }
+
+impl WorkReqOpCode {
+    /// Returns whether the opcode is a compare-and-swap or a fetch-and-add
+    pub(crate) fn is_atomic(self) -> bool {
+        matches!(self, Self::AtomicCmpAndSwp | Self::AtomicFetchAndAdd)
+    }
+
+    /// Returns whether the request is executed by the driver of the responder and answered
+    /// with an atomic ACK: the atomics, the atomic writes and the flushes
+    pub(crate) fn is_executed_by_responder(self) -> bool {
+        self.is_atomic() || matches!(self, Self::AtomicWrite | Self::Flush)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::rdma_utils::types::QpAttr;
+
+    fn encode_fields(wr: &WrChunk, ecn: bool) -> [[u8; 32]; 2] {
+        let seg0 = SendQueueReqDescSeg0::new(
+            wr.opcode,
+            wr.msn,
+            wr.psn.into_inner(),
+            wr.qp_type,
+            wr.dqpn,
+            wr.flags,
+            wr.dqp_ip,
+            wr.raddr,
+            wr.rkey,
+            wr.total_len,
+        );
+        let seg1 = SendQueueReqDescSeg1::new(
+            wr.opcode,
+            wr.pmtu,
+            wr.is_first,
+            wr.is_last,
+            wr.is_retry,
+            wr.enable_ecn || ecn,
+            wr.sqpn,
+            wr.imm,
+            wr.mac_addr,
+            wr.lkey,
+            wr.len,
+            wr.laddr,
+        );
+        [seg0.serialize(), seg1.serialize()]
+    }
+
+    #[test]
+    fn template_encodes_as_fields() {
+        let qp_params = QpParams::new(7, 2, 0x12_3456, 0xa1b2_c3d4_e5f6, 0xab_cdef, 0x0a00_0001, 5);
+        let opcodes = [
+            WorkReqOpCode::RdmaWrite,
+            WorkReqOpCode::SendWithImm,
+            WorkReqOpCode::RdmaRead,
+        ];
+        let positions = [
+            ChunkPos::First,
+            ChunkPos::Middle,
+            ChunkPos::Last,
+            ChunkPos::Only,
+        ];
+        for (i, (opcode, pos)) in opcodes.into_iter().zip(positions).enumerate() {
+            let builder = WrChunkBuilder::new_with_opcode(opcode)
+                .set_qp_params(qp_params)
+                .set_ibv_params(0x1f, 0xdead_beef, 1 << 20, 0x1234, 0x5678)
+                .set_chunk_meta(Psn(0xff_fff0 + i as u32), 0x1000, 0x2000, 4096, pos);
+            let builder = if i & 1 == 0 {
+                builder.set_is_retry()
+            } else {
+                builder.set_enable_ecn()
+            };
+            let wr = builder.build();
+            let mut sealed = wr;
+            sealed.seal();
+            // retransmitted with the retry bit set
+            let mut retry = sealed;
+            retry.set_is_retry();
+            for ecn in [false, true] {
+                assert_eq!(wr.encode(ecn), encode_fields(&wr, ecn));
+                assert_eq!(sealed.encode(ecn), encode_fields(&wr, ecn));
+                assert_eq!(retry.encode(ecn), encode_fields(&retry, ecn));
+            }
+        }
+    }
+
+    #[test]
+    fn qp_attr_template_follows_modify() {
+        let mut attr = QpAttr {
+            qp_type: 2,
+            qpn: 0x100,
+            mac_addr: 0xa1b2_c3d4_e5f6,
+            pmtu: 5,
+            ..Default::default()
+        };
+        attr.refresh_send_template();
+        attr.dqpn = 0x200;
+        attr.dqp_ip = 0x0a00_0002;
+        attr.refresh_send_template();
+        let expected = QpParams::new(3, 2, 0x100, 0xa1b2_c3d4_e5f6, 0x200, 0x0a00_0002, 5);
+        assert_eq!(attr.qp_params(3), expected);
+    }
+}
@@ -1,66 +1,287 @@
-use std::{io, iter, sync::Arc, time::Duration};
+use std::{
+    collections::{BTreeMap, VecDeque},
+    io, iter, mem,
+    sync::Arc,
+    time::{Duration, Instant},
+};
 
-use crossbeam_deque::{Injector, Steal, Stealer, Worker};
+use crossbeam_deque::Steal;
 use log::error;
+use parking_lot::Mutex;
 
 use crate::{
-    descriptors::{SendQueueReqDescSeg0, SendQueueReqDescSeg1},
+    config::DoorbellConfig,
+    constants::WR_CHUNK_SIZE,
+    counters::{Counter, DeviceCounters},
     csr::{proxy::SendQueueProxy, CsrWriterAdaptor, DeviceAdaptor},
-    workers::spawner::{SingleThreadPollingWorker, SingleThreadTaskWorker},
+    latency::{Stage, Stamp},
+    sdt::sdt_probe,
+    workers::spawner::{Poller, SingleThreadPollingWorker, SingleThreadTaskWorker},
 };
 
 use super::{
-    types::{SendQueue, SendQueueDesc, WrInjector, WrStealer, WrWorker},
+    bond::BondRail,
+    priority::{DeficitRoundRobin, PRIORITY_CLASSES},
+    scheduler::QpScheduler,
+    stripe::ChannelStripe,
+    types::SendQueue,
     WrChunk,
 };
 
+/// Maximum number of chunks moved from the queue of a class to its round robin at once
+const ROUND_ROBIN_REFILL: usize = 16;
+/// Number of descriptors written for a chunk
+const CHUNK_DESCS: usize = 2;
+
 #[derive(Clone)]
 pub(crate) struct SendHandle {
-    pub(super) injector: Arc<WrInjector>,
+    pub(super) scheduler: Arc<QpScheduler>,
+    /// Pollers of the `SendWorker`s, indexed by channel
+    pollers: Arc<[Poller]>,
+    /// Second card of a bonded pair carrying part of the large RDMA writes
+    rail: Option<Arc<BondRail>>,
+    /// Striping of the large RDMA writes over the channels
+    stripe: Option<ChannelStripe>,
 }
 
 impl SendHandle {
-    pub(crate) fn new(injector: Arc<WrInjector>) -> Self {
-        Self { injector }
+    pub(crate) fn new(scheduler: Arc<QpScheduler>, pollers: Arc<[Poller]>) -> Self {
+        Self {
+            scheduler,
+            pollers,
+            rail: None,
+            stripe: None,
+        }
+    }
+
+    /// Stripes the large RDMA writes sent through the handle over the send channels
+    pub(crate) fn with_stripe(self, stripe: ChannelStripe) -> Self {
+        Self {
+            stripe: Some(stripe),
+            ..self
+        }
+    }
+
+    /// Stripes the large RDMA writes sent through the handle across `rail`
+    pub(crate) fn with_rail(self, rail: BondRail) -> Self {
+        Self {
+            rail: Some(Arc::new(rail)),
+            ..self
+        }
     }
 
     pub(crate) fn send(&self, wr: WrChunk) {
-        self.injector.push(wr);
+        let wr = match self.rail.as_deref().map(|rail| rail.try_send(wr)) {
+            Some(Ok(())) => return,
+            Some(Err(wr)) => wr,
+            None => wr,
+        };
+        let channel = match self
+            .stripe
+            .and_then(|x| x.stripe(&wr).map(|s| (s, x.width())))
+        {
+            Some((stripe, width)) => self.scheduler.push_stripe(wr, stripe, width),
+            None => self.scheduler.push(wr),
+        };
+        if let Some(poller) = channel.and_then(|channel| self.pollers.get(channel)) {
+            poller.wake();
+        }
     }
 }
 
+/// Send queues shared with the posting threads of QPs in direct doorbell mode.
+///
+/// The posting thread writes the descriptors and rings the head CSR itself, skipping the
+/// hops through the `RdmaWriteWorker` and the `SendWorker`.
+pub(crate) struct DirectDoorbell<Dev> {
+    sqs: Arc<[Mutex<SendQueueSync<Dev>>]>,
+    /// Handle for the chunks that do not fit in the send queue
+    fallback: SendHandle,
+}
+
+impl<Dev> Clone for DirectDoorbell<Dev> {
+    fn clone(&self) -> Self {
+        Self {
+            sqs: Arc::clone(&self.sqs),
+            fallback: self.fallback.clone(),
+        }
+    }
+}
+
+impl<Dev: DeviceAdaptor> DirectDoorbell<Dev> {
+    pub(crate) fn new(sqs: Arc<[Mutex<SendQueueSync<Dev>>]>, fallback: SendHandle) -> Self {
+        Self { sqs, fallback }
+    }
+
+    /// Returns the scheduler assigning the QPs to the send queues
+    pub(crate) fn scheduler(&self) -> &QpScheduler {
+        &self.fallback.scheduler
+    }
+
+    /// Writes the chunks of a work request to the send queue of the QP and rings the doorbell.
+    ///
+    /// The send queue is the channel the QP is pinned to. Chunks that do not fit are handed to
+    /// the `SendWorker` of that channel instead, as are all chunks of a paced QP or of a QP with
+    /// chunks still queued for the `SendWorker`.
+    pub(crate) fn submit(&self, qpn: u32, chunks: Vec<WrChunk>) {
+        let scheduler = &self.fallback.scheduler;
+        let Some(sq) = scheduler
+            .channel(qpn)
+            .filter(|_| !scheduler.rate().is_limited(qpn) && !scheduler.has_pending(qpn))
+            .and_then(|i| self.sqs.get(i))
+        else {
+            chunks.into_iter().for_each(|c| self.fallback.send(c));
+            return;
+        };
+        let ecn = scheduler.rate().ecn_enabled();
+        let mut sq = sq.lock();
+        let mut chunks = chunks.into_iter();
+        for chunk in chunks.by_ref() {
+            if !sq.send(&chunk, ecn) {
+                self.fallback.send(chunk);
+                break;
+            }
+            chunk.posted.record(Stage::RingWrite);
+        }
+        // Also rings the descriptors left unrung by the `SendWorker`
+        sq.flush();
+        drop(sq);
+        chunks.for_each(|c| self.fallback.send(c));
+    }
+}
+
+/// A send queue with lazily synchronized head and tail CSRs.
+///
+/// The hardware has no tail write-back, the tail CSR is only read when the queue appears full,
+/// and at most once per `tail_sync_interval_us`. Head CSR writes are batched according to the
+/// `DoorbellConfig`.
 pub(crate) struct SendQueueSync<Dev> {
     /// Queue for submitting send requests to the NIC
     send_queue: SendQueue,
     /// Csr proxy
     csr_adaptor: SendQueueProxy<Dev>,
+    /// Number of descriptors before the head CSR is written
+    batch: usize,
+    /// Maximum time a written descriptor waits for the head CSR write
+    max_delay: Duration,
+    /// Minimum time between two tail CSR reads
+    tail_sync_interval: Duration,
+    /// Number of descriptors written since the last head CSR write
+    unrung: usize,
+    /// Time the oldest unrung descriptor was written
+    unrung_since: Option<Instant>,
+    /// Stamp of the oldest unrung descriptor
+    unrung_stamp: Stamp,
+    /// Time of the last tail CSR read
+    tail_synced_at: Option<Instant>,
+    counters: Arc<DeviceCounters>,
 }
 
 impl<Dev: DeviceAdaptor> SendQueueSync<Dev> {
-    pub(crate) fn new(send_queue: SendQueue, csr_adaptor: SendQueueProxy<Dev>) -> Self {
+    pub(crate) fn new(
+        send_queue: SendQueue,
+        csr_adaptor: SendQueueProxy<Dev>,
+        config: DoorbellConfig,
+        counters: Arc<DeviceCounters>,
+    ) -> Self {
         Self {
             send_queue,
             csr_adaptor,
+            batch: config.batch.max(1),
+            max_delay: Duration::from_micros(config.max_delay_us),
+            tail_sync_interval: Duration::from_micros(config.tail_sync_interval_us),
+            unrung: 0,
+            unrung_since: None,
+            unrung_stamp: Stamp::default(),
+            tail_synced_at: None,
+            counters,
         }
     }
 
-    fn send(&mut self, descs: Vec<SendQueueDesc>) -> bool {
-        if self.send_queue.remaining() < descs.len() {
-            self.sync_tail();
-        }
-        if self.send_queue.remaining() < descs.len() {
+    /// Writes the descriptors of a chunk, returns `false` if the queue is full
+    fn send(&mut self, chunk: &WrChunk, ecn: bool) -> bool {
+        let descs = chunk.encode(ecn);
+        if !self.has_room(descs.len()) {
+            self.counters.add(chunk.sqpn, Counter::RingFullStalls, 1);
             return false;
         }
-        for desc in descs {
-            assert!(self.send_queue.push(desc), "full send queue");
+        assert!(self.send_queue.push_pair(descs), "full send queue");
+        sdt_probe!("ring_push", chunk.sqpn, chunk.psn.into_inner(), chunk.len);
+        let num_packets = u64::from(chunk.num_packets());
+        self.counters
+            .add(chunk.sqpn, Counter::TxPackets, num_packets);
+        self.counters
+            .add(chunk.sqpn, Counter::TxBytes, u64::from(chunk.len));
+        if chunk.is_retry {
+            self.counters
+                .add(chunk.sqpn, Counter::Retransmits, num_packets);
+            self.counters
+                .add(chunk.sqpn, Counter::RetransmitBytes, u64::from(chunk.len));
+        }
+        if self.unrung == 0 {
+            self.unrung_stamp = Stamp::now();
         }
+        self.unrung += 2;
+        let _since = self.unrung_since.get_or_insert_with(Instant::now);
         true
     }
 
-    fn sync_head(&self) {
+    /// Returns `true` if `num` descriptors fit in the queue, the tail CSR is read if they don't
+    /// fit with the last tail read
+    fn has_room(&mut self, num: usize) -> bool {
+        if self.send_queue.remaining() < num {
+            // The hardware never consumes unrung descriptors
+            self.flush();
+            self.try_sync_tail();
+        }
+        self.send_queue.remaining() >= num
+    }
+
+    /// Returns `true` if descriptors are waiting for the doorbell
+    fn has_unrung(&self) -> bool {
+        self.unrung != 0
+    }
+
+    /// Rings the doorbell if the batch is full or the oldest descriptor waited too long
+    fn ring_batched(&mut self) {
+        if self.unrung >= self.batch
+            || self
+                .unrung_since
+                .is_some_and(|t| t.elapsed() >= self.max_delay)
+        {
+            self.sync_head();
+        }
+    }
+
+    /// Rings the doorbell for all written descriptors
+    fn flush(&mut self) {
+        if self.has_unrung() {
+            self.sync_head();
+        }
+    }
+
+    fn sync_head(&mut self) {
+        let head = self.send_queue.head();
         self.csr_adaptor
-            .write_head(self.send_queue.head())
+            .write_head(head)
             .expect("failed to write head csr");
+        sdt_probe!("doorbell", head, self.unrung as u64);
+        self.unrung = 0;
+        self.unrung_since = None;
+        mem::take(&mut self.unrung_stamp).record(Stage::Doorbell);
+    }
+
+    /// Reads the tail CSR unless it was read within `tail_sync_interval`
+    fn try_sync_tail(&mut self) {
+        let now = Instant::now();
+        if self
+            .tail_synced_at
+            .is_some_and(|t| now.duration_since(t) < self.tail_sync_interval)
+        {
+            return;
+        }
+        self.tail_synced_at = Some(now);
+        self.sync_tail();
     }
 
     fn sync_tail(&mut self) {
@@ -76,102 +297,166 @@ impl<Dev: DeviceAdaptor> SendQueueSync<Dev> {
 pub(crate) struct SendWorker<Dev> {
     /// id of the worker
     id: usize,
-    /// Local work request queue for this worker
-    local: WrWorker,
-    /// Global work request injector shared across workers
-    global: Arc<WrInjector>,
-    /// Work stealers for taking work from other workers
-    remotes: Box<[WrStealer]>,
-    sq: SendQueueSync<Dev>,
+    /// Round robins between the QPs of each priority class, indexed by class
+    classes: [DeficitRoundRobin; PRIORITY_CLASSES],
+    /// Scheduler that queues the chunks of the QPs pinned to this worker's channel
+    scheduler: Arc<QpScheduler>,
+    /// Send queues of all channels, shared with the direct doorbell path
+    sq: Arc<[Mutex<SendQueueSync<Dev>>]>,
+    /// Whether descriptors written by this worker may be waiting for the doorbell
+    unrung: bool,
+    /// Admitted chunks that did not fit in the send queue, in order
+    unsent: VecDeque<WrChunk>,
+    /// Whether the send queue was found full, nothing is written until the tail moves
+    stalled: bool,
+    /// Chunks of the paced QPs waiting for tokens, in order
+    paced: BTreeMap<u32, VecDeque<WrChunk>>,
 }
 
 impl<Dev> SendWorker<Dev> {
     pub(crate) fn new(
         id: usize,
-        local: WrWorker,
-        global: Arc<WrInjector>,
-        remotes: Box<[WrStealer]>,
-        sq: SendQueueSync<Dev>,
+        scheduler: Arc<QpScheduler>,
+        sq: Arc<[Mutex<SendQueueSync<Dev>>]>,
     ) -> Self {
         Self {
             id,
-            local,
-            global,
-            remotes,
+            classes: std::array::from_fn(|_| DeficitRoundRobin::new(WR_CHUNK_SIZE)),
+            scheduler,
             sq,
+            unrung: false,
+            unsent: VecDeque::new(),
+            stalled: false,
+            paced: BTreeMap::new(),
+        }
+    }
+
+    /// Returns the chunk if it may be sent now, otherwise queues it behind the chunks of its QP
+    /// waiting for tokens
+    fn admit(&mut self, wr: WrChunk) -> Option<WrChunk> {
+        if let Some(queue) = self.paced.get_mut(&wr.sqpn) {
+            queue.push_back(wr);
+            return None;
+        }
+        let rate = self.scheduler.rate();
+        if rate.is_limited(wr.sqpn) && !rate.try_admit(wr.sqpn, wr.len) {
+            self.paced.entry(wr.sqpn).or_default().push_back(wr);
+            return None;
+        }
+        Some(wr)
+    }
+
+    /// Takes the next chunk of the highest class with chunks queued
+    fn next_chunk(&mut self) -> Option<WrChunk> {
+        for (class, drr) in self.classes.iter_mut().enumerate().rev() {
+            // Chunks are never stolen from other channels, as that would reorder the chunks
+            // of a QP
+            if let Some(injector) = self.scheduler.injector(self.id, class) {
+                for _ in 0..ROUND_ROBIN_REFILL {
+                    let Some(wr) = iter::repeat_with(|| injector.steal())
+                        // Loop while the steal operation needs to be retried.
+                        .find(|s| !s.is_retry())
+                        .and_then(Steal::success)
+                    else {
+                        break;
+                    };
+                    drr.push(wr);
+                }
+            }
+            if let Some(wr) = drr.pop() {
+                return Some(wr);
+            }
         }
+        None
+    }
+
+    /// Moves the chunks of the paced QPs that were given tokens to `wrs`
+    fn release_paced(&mut self, wrs: &mut Vec<WrChunk>, limit: usize) {
+        let rate = self.scheduler.rate();
+        self.paced.retain(|&qpn, queue| {
+            while wrs.len() < limit {
+                let Some(wr) = queue.front() else {
+                    break;
+                };
+                if !rate.try_admit(qpn, wr.len) {
+                    break;
+                }
+                wrs.extend(queue.pop_front());
+            }
+            !queue.is_empty()
+        });
     }
 }
 
 impl<Dev: DeviceAdaptor + Send + 'static> SingleThreadPollingWorker for SendWorker<Dev> {
-    type Task = Vec<Option<WrChunk>>;
+    type Task = Vec<WrChunk>;
 
     fn poll(&mut self) -> Option<Self::Task> {
-        // Pop a task from the local queue, if not empty.
-        let mut ret_val = Vec::new();
-        ret_val.reserve(16);
-
-        for _ in 0..16 {
-            let wqe = self.local.pop().or_else(|| {
-                // Otherwise, we need to look for a task elsewhere.
-                iter::repeat_with(|| {
-                    // Try stealing a batch of tasks from the global queue.
-                    self.global
-                        .steal_batch_and_pop(&self.local)
-                        // Or try stealing a task from one of the other threads.
-                        .or_else(|| self.remotes.iter().map(Stealer::steal).collect())
-                })
-                // Loop while no task was stolen and any steal operation needs to be retried.
-                .find(|s| !s.is_retry())
-                // Extract the stolen task, if there is one.
-                .and_then(Steal::success)
-            });
-            ret_val.push(wqe);
-        }
-        
-        Some(ret_val)
+        /// Maximum number of chunks written to the send queue before ringing the doorbell
+        const BATCH_SIZE: usize = 16;
+
+        if self.stalled {
+            // The device has not consumed the descriptors yet, retrying the rejected chunk
+            // now would only fail again
+            let sq = self.sq.get(self.id)?;
+            if !sq.lock().has_room(CHUNK_DESCS) {
+                return None;
+            }
+            self.stalled = false;
+        }
+        // Allocates only when a chunk is available
+        let mut wrs = Vec::new();
+        while wrs.len() < BATCH_SIZE {
+            let Some(wr) = self.unsent.pop_front() else {
+                break;
+            };
+            wrs.push(wr);
+        }
+        self.release_paced(&mut wrs, BATCH_SIZE);
+        while wrs.len() < BATCH_SIZE {
+            let Some(wqe) = self.next_chunk() else {
+                break;
+            };
+            wrs.extend(self.admit(wqe));
+        }
+        if wrs.is_empty() && self.unrung {
+            // Out of work, rings the descriptors of a partial batch
+            if let Some(sq) = self.sq.get(self.id) {
+                sq.lock().flush();
+            }
+            self.unrung = false;
+        }
+
+        (!wrs.is_empty()).then_some(wrs)
     }
 
     fn process(&mut self, wrs: Self::Task) {
-        let mut has_new_desc = false;
-        for wr in wrs{
-            if let Some(wr) = wr {
-                let fst = SendQueueReqDescSeg0::new(
-            wr.opcode,
-                    wr.msn,
-                    wr.psn.into_inner(),
-                    wr.qp_type,
-                    wr.dqpn,
-                    wr.flags,
-                    wr.dqp_ip,
-                    wr.raddr,
-                    wr.rkey,
-                    wr.total_len,
-                );
-                let snd = SendQueueReqDescSeg1::new(
-                    wr.opcode,
-                    wr.pmtu,
-                    wr.is_first,
-                    wr.is_last,
-                    wr.is_retry,
-                    wr.enable_ecn,
-                    wr.sqpn,
-                    wr.imm,
-                    wr.mac_addr,
-                    wr.lkey,
-                    wr.len,
-                    wr.laddr,
-                );
-                let descs = vec![SendQueueDesc::Seg0(fst), SendQueueDesc::Seg1(snd)];
-                if !self.sq.send(descs) {
-                    self.local.push(wr);
-                } else {
-                    has_new_desc = true;
-                }
+        let Some(sq) = self.sq.get(self.id) else {
+            error!("no send queue for worker {}", self.id);
+            return;
+        };
+        let ecn = self.scheduler.rate().ecn_enabled();
+        let mut sq = sq.lock();
+        let mut wrs = wrs.into_iter();
+        for wr in wrs.by_ref() {
+            if sq.send(&wr, ecn) {
+                wr.posted.record(Stage::RingWrite);
+                self.scheduler.complete(wr.sqpn);
+            } else {
+                // Retried first once the tail moves, the chunks behind it keep their order
+                self.unsent.push_back(wr);
+                self.stalled = true;
+                break;
             }
         }
-        if has_new_desc {
-            self.sq.sync_head();
-        }
+        self.unsent.extend(wrs);
+        sq.ring_batched();
+        self.unrung = sq.has_unrung();
+    }
+
+    /// The chunks queued on the channel and those rejected by the ring, the paced chunks
+    /// waiting for tokens are not counted
+    fn backlog(&self) -> usize {
+        self.scheduler.load(self.id) + self.unsent.len()
     }
 }
@@ -1,12 +1,17 @@
 use std::{
+    collections::HashMap,
+    fmt, hint, io, iter, mem,
     sync::{
-        atomic::{AtomicBool, Ordering},
-        Arc,
+        atomic::{fence, AtomicBool, AtomicU32, AtomicU64, AtomicUsize, Ordering},
+        Arc, OnceLock, Weak,
     },
-    time::Duration,
+    thread::{self, Thread},
+    time::{Duration, Instant},
 };
 
-use log::{error, info};
+use log::{debug, error, info, trace, warn};
+use parking_lot::Mutex;
+use serde::{Deserialize, Serialize};
 
 pub(crate) trait SingleThreadPollingWorker {
     type Task;
@@ -15,29 +20,275 @@ pub(crate) trait SingleThreadPollingWorker {
 
     fn process(&mut self, task: Self::Task);
 
-    fn spawn(mut self, name: &str, abort: AbortSignal)
+    /// Returns the number of tasks queued for the worker, reported with its utilization
+    fn backlog(&self) -> usize {
+        0
+    }
+
+    /// Spawns the worker, it backs off according to the policy of the `poller` when idle
+    fn spawn(mut self, name: &str, abort: AbortSignal, poller: Poller, affinity: &WorkerAffinity)
     where
         Self: Sized + Send + 'static,
         Self::Task: Send + 'static,
     {
         let name = name.to_owned();
+        let cores = affinity.cores(&name);
         let abort = AbortSignal::new();
         let abort_c = abort.clone();
-        let _handle = std::thread::Builder::new()
-            .name(name.clone())
-            .spawn(move || {
-                info!("worker {name} running");
-                loop {
-                    if abort.should_abort() {
-                        break;
+        affinity.track(&poller);
+        let mut usage = UtilizationRecorder::new(affinity.utilization(&name));
+        affinity.launch(name.clone(), move || {
+            pin_current_thread(&name, &cores);
+            info!("worker {name} running");
+            poller.register();
+            poller.steer(&cores);
+            let mut stats = PollStatsSnapshot::default();
+            let mut idle: u32 = 0;
+            loop {
+                if abort.should_abort() {
+                    break;
+                }
+                if let Some(task) = self.poll() {
+                    stats.busy += 1;
+                    idle = 0;
+                    usage.task(|| self.backlog());
+                    self.process(task);
+                    continue;
+                }
+                usage.empty_poll();
+                if idle == 0 {
+                    usage.idle();
+                    poller.publish(stats);
+                }
+                idle = idle.saturating_add(1);
+                match poller.idle_action(idle) {
+                    IdleAction::Spin => {
+                        stats.spin += 1;
+                        hint::spin_loop();
                     }
-                    if let Some(task) = self.poll() {
-                        self.process(task);
+                    IdleAction::Yield => {
+                        stats.yielded += 1;
+                        thread::yield_now();
+                    }
+                    IdleAction::Park => {
+                        stats.parked += 1;
+                        usage.idle();
+                        poller.publish(stats);
+                        poller.set_parked(true);
+                        poller.arm();
+                        // Poll again after announcing the park, so that a wakeup sent
+                        // before the flag is visible is not lost.
+                        if let Some(task) = self.poll() {
+                            poller.set_parked(false);
+                            stats.busy += 1;
+                            idle = 0;
+                            usage.task(|| self.backlog());
+                            self.process(task);
+                            continue;
+                        }
+                        trace!("worker {name} parking");
+                        poller.park();
+                        poller.set_parked(false);
                     }
                 }
-                info!("worker {name} exited");
-            })
-            .expect("failed to spawn worker");
+            }
+            usage.idle();
+            poller.publish(stats);
+            info!("worker {name} exited, stats: {:?}", poller.stats());
+        });
+    }
+}
+
+/// Backoff policy of an idle polling worker.
+///
+/// The worker spins for `spin_count` empty polls, then yields its time slice for another
+/// `yield_count` empty polls, then parks until it is woken up by a producer or until
+/// `park_timeout_us` has elapsed.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct PollPolicy {
+    pub(crate) spin_count: u32,
+    pub(crate) yield_count: u32,
+    pub(crate) park_timeout_us: u64,
+}
+
+impl Default for PollPolicy {
+    fn default() -> Self {
+        Self {
+            spin_count: 4096,
+            yield_count: 256,
+            park_timeout_us: 100,
+        }
+    }
+}
+
+/// Device interrupt waking up a parked polling worker in place of the park timeout
+pub(crate) trait Interrupt: fmt::Debug + Send + Sync {
+    /// Unmasks the interrupt, the worker polls once more before it waits
+    fn arm(&self);
+
+    /// Blocks until the interrupt fires, `notify` is called or `timeout` elapses
+    fn wait(&self, timeout: Duration);
+
+    /// Wakes up the waiting worker
+    fn notify(&self);
+
+    /// Steers the device writes the interrupt signals to the cache of `core`
+    fn steer(&self, _core: usize) {}
+}
+
+/// Action taken by an idle polling worker
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum IdleAction {
+    Spin,
+    Yield,
+    Park,
+}
+
+/// Counters of a polling worker
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct PollStatsSnapshot {
+    /// Number of polls that returned a task
+    pub(crate) busy: u64,
+    /// Number of empty polls followed by a spin
+    pub(crate) spin: u64,
+    /// Number of empty polls followed by a yield
+    pub(crate) yielded: u64,
+    /// Number of times the worker parked
+    pub(crate) parked: u64,
+}
+
+/// Handle of a polling worker, producers use it to wake up the worker when it is parked
+#[derive(Debug, Clone)]
+pub(crate) struct Poller {
+    inner: Arc<PollerInner>,
+}
+
+#[derive(Debug)]
+struct PollerInner {
+    /// Fields of the `PollPolicy`, replaced by `set_policy` while the worker runs
+    spin_count: AtomicU32,
+    yield_count: AtomicU32,
+    park_timeout_us: AtomicU64,
+    /// Interrupt the parked worker waits on, if any
+    interrupt: Option<Box<dyn Interrupt>>,
+    /// The worker thread, set once the worker is running
+    thread: OnceLock<Thread>,
+    parked: AtomicBool,
+    busy: AtomicU64,
+    spin: AtomicU64,
+    yielded: AtomicU64,
+    num_parked: AtomicU64,
+}
+
+impl Poller {
+    pub(crate) fn new(policy: PollPolicy) -> Self {
+        Self::new_inner(policy, None)
+    }
+
+    /// Creates a poller whose parked worker waits on `interrupt`
+    pub(crate) fn with_interrupt(policy: PollPolicy, interrupt: Box<dyn Interrupt>) -> Self {
+        Self::new_inner(policy, Some(interrupt))
+    }
+
+    fn new_inner(policy: PollPolicy, interrupt: Option<Box<dyn Interrupt>>) -> Self {
+        Self {
+            inner: Arc::new(PollerInner {
+                spin_count: AtomicU32::new(policy.spin_count),
+                yield_count: AtomicU32::new(policy.yield_count),
+                park_timeout_us: AtomicU64::new(policy.park_timeout_us),
+                interrupt,
+                thread: OnceLock::new(),
+                parked: AtomicBool::new(false),
+                busy: AtomicU64::new(0),
+                spin: AtomicU64::new(0),
+                yielded: AtomicU64::new(0),
+                num_parked: AtomicU64::new(0),
+            }),
+        }
+    }
+
+    /// Wakes up the worker if it is parked, this is a single load when the worker is running
+    pub(crate) fn wake(&self) {
+        fence(Ordering::SeqCst);
+        if self.inner.parked.load(Ordering::Relaxed) {
+            if let Some(interrupt) = self.inner.interrupt.as_deref() {
+                interrupt.notify();
+            } else if let Some(thread) = self.inner.thread.get() {
+                thread.unpark();
+            }
+        }
+    }
+
+    /// Replaces the backoff policy, the worker follows it from its next empty poll
+    pub(crate) fn set_policy(&self, policy: PollPolicy) {
+        let inner = &self.inner;
+        inner.spin_count.store(policy.spin_count, Ordering::Relaxed);
+        inner
+            .yield_count
+            .store(policy.yield_count, Ordering::Relaxed);
+        inner
+            .park_timeout_us
+            .store(policy.park_timeout_us, Ordering::Relaxed);
+    }
+
+    /// Returns the counters of the worker, updated whenever the worker becomes idle
+    pub(crate) fn stats(&self) -> PollStatsSnapshot {
+        PollStatsSnapshot {
+            busy: self.inner.busy.load(Ordering::Relaxed),
+            spin: self.inner.spin.load(Ordering::Relaxed),
+            yielded: self.inner.yielded.load(Ordering::Relaxed),
+            parked: self.inner.num_parked.load(Ordering::Relaxed),
+        }
+    }
+
+    fn register(&self) {
+        let _ignore = self.inner.thread.set(thread::current());
+    }
+
+    fn idle_action(&self, idle: u32) -> IdleAction {
+        let spin_count = self.inner.spin_count.load(Ordering::Relaxed);
+        let yield_count = self.inner.yield_count.load(Ordering::Relaxed);
+        if idle <= spin_count {
+            IdleAction::Spin
+        } else if idle <= spin_count.saturating_add(yield_count) {
+            IdleAction::Yield
+        } else {
+            IdleAction::Park
+        }
+    }
+
+    fn set_parked(&self, parked: bool) {
+        self.inner.parked.store(parked, Ordering::Relaxed);
+        fence(Ordering::SeqCst);
+    }
+
+    fn arm(&self) {
+        if let Some(interrupt) = self.inner.interrupt.as_deref() {
+            interrupt.arm();
+        }
+    }
+
+    /// Steers the interrupt to the core of a worker pinned to a single core
+    fn steer(&self, cores: &[usize]) {
+        if let (Some(interrupt), &[core]) = (self.inner.interrupt.as_deref(), cores) {
+            interrupt.steer(core);
+        }
+    }
+
+    fn park(&self) {
+        let timeout = Duration::from_micros(self.inner.park_timeout_us.load(Ordering::Relaxed));
+        match self.inner.interrupt.as_deref() {
+            Some(interrupt) => interrupt.wait(timeout),
+            None => thread::park_timeout(timeout),
+        }
+    }
+
+    fn publish(&self, stats: PollStatsSnapshot) {
+        self.inner.busy.store(stats.busy, Ordering::Relaxed);
+        self.inner.spin.store(stats.spin, Ordering::Relaxed);
+        self.inner.yielded.store(stats.yielded, Ordering::Relaxed);
+        self.inner.num_parked.store(stats.parked, Ordering::Relaxed);
     }
 }
 
@@ -46,34 +297,46 @@ pub(crate) trait SingleThreadTaskWorker {
 
     fn process(&mut self, task: Self::Task);
 
+    /// Runs after each batch of tasks, and at each interval of `spawn_polling`
     fn maintainance(&mut self);
 
-    fn spawn(mut self, rx: TaskRx<Self::Task>, name: &str, abort: AbortSignal)
+    /// Spawns the worker, it blocks on `rx` and processes up to a batch of tasks per wakeup
+    fn spawn<R>(mut self, mut rx: R, name: &str, abort: AbortSignal, affinity: &WorkerAffinity)
     where
         Self: Sized + Send + 'static,
         Self::Task: Send + 'static,
+        R: TaskSource<Self::Task> + Send + 'static,
     {
         let name = name.to_owned();
+        let cores = affinity.cores(&name);
         let abort = AbortSignal::new();
         let abort_c = abort.clone();
-        let _handle = std::thread::Builder::new()
-            .name(name.clone())
-            .spawn(move || {
-                info!("worker {name} running");
-                loop {
-                    if abort.should_abort() {
-                        break;
-                    }
-                    if let Some(task) = rx.recv() {
-                        self.process(task);
-                    } else {
-                        error!("failed to recv task from channel");
-                        break;
-                    }
+        let mut usage = UtilizationRecorder::new(affinity.utilization(&name));
+        affinity.launch(name.clone(), move || {
+            pin_current_thread(&name, &cores);
+            info!("worker {name} running");
+            let mut batch = Vec::with_capacity(rx.batch());
+            loop {
+                if abort.should_abort() {
+                    break;
                 }
-                info!("worker {name} exited");
-            })
-            .expect("failed to spawn worker");
+                if !rx.recv_batch(&mut batch) {
+                    error!("failed to recv task from channel");
+                    break;
+                }
+                usage.wake(batch.len() + rx.len());
+                usage.add_tasks(batch.len());
+                for task in batch.drain(..) {
+                    self.process(task);
+                }
+                self.maintainance();
+                usage.idle();
+            }
+            info!(
+                "worker {name} exited, queue high-water: {}",
+                rx.high_water()
+            );
+        });
     }
 
     fn spawn_polling(
@@ -82,42 +345,545 @@ pub(crate) trait SingleThreadTaskWorker {
         name: &str,
         abort: AbortSignal,
         interval: Duration,
+        affinity: &WorkerAffinity,
     ) where
         Self: Sized + Send + 'static,
         Self::Task: Send + 'static,
     {
         let name = name.to_owned();
+        let cores = affinity.cores(&name);
         let abort = AbortSignal::new();
         let abort_c = abort.clone();
-        let _handle = std::thread::Builder::new()
-            .name(name.clone())
-            .spawn(move || {
-                info!("worker {name} running");
-                loop {
-                    spin_sleep::sleep(interval);
-                    if abort.should_abort() {
-                        break;
-                    }
-                    for task in rx.try_iter() {
-                        self.process(task);
-                    }
-                    self.maintainance();
+        let mut usage = UtilizationRecorder::new(affinity.utilization(&name));
+        affinity.launch(name.clone(), move || {
+            pin_current_thread(&name, &cores);
+            info!("worker {name} running");
+            loop {
+                spin_sleep::sleep(interval);
+                if abort.should_abort() {
+                    break;
+                }
+                let depth = rx.inner.len();
+                rx.record_depth(depth);
+                // The worker wakes up at each interval, an interval without tasks is an
+                // empty poll
+                if depth == 0 {
+                    usage.empty_poll();
                 }
-                info!("worker {name} exited");
-            })
-            .expect("failed to spawn worker");
+                usage.wake(depth);
+                for task in rx.try_iter() {
+                    usage.add_tasks(1);
+                    self.process(task);
+                }
+                self.maintainance();
+                usage.idle();
+            }
+            info!(
+                "worker {name} exited, queue high-water: {}",
+                rx.high_water()
+            );
+        });
+    }
+}
+
+/// CPU cores of the worker threads, keyed by worker name
+#[derive(Debug, Clone, Default)]
+pub(crate) struct WorkerAffinity {
+    workers: HashMap<String, Vec<usize>>,
+    /// Cores of the workers without an entry, an empty list leaves them unpinned
+    default: Vec<usize>,
+    /// Holds the threads of the workers until the launcher is started, `None` spawns them
+    /// right away
+    launcher: Option<WorkerLauncher>,
+}
+
+impl WorkerAffinity {
+    pub(crate) fn new(workers: HashMap<String, Vec<usize>>, default: Vec<usize>) -> Self {
+        Self {
+            workers,
+            default,
+            launcher: None,
+        }
+    }
+
+    /// Defers the threads of the workers spawned through the affinity until `launcher` is
+    /// started
+    pub(crate) fn with_launcher(self, launcher: WorkerLauncher) -> Self {
+        Self {
+            launcher: Some(launcher),
+            ..self
+        }
+    }
+
+    fn cores(&self, name: &str) -> Vec<usize> {
+        self.workers.get(name).unwrap_or(&self.default).clone()
+    }
+
+    /// Creates the utilization of the worker `name`, registered on the launcher if any
+    fn utilization(&self, name: &str) -> Arc<WorkerUtilization> {
+        let utilization = Arc::new(WorkerUtilization::new(name.to_owned()));
+        if let Some(launcher) = self.launcher.as_ref() {
+            launcher.workers.lock().push(Arc::clone(&utilization));
+        }
+        utilization
+    }
+
+    /// Registers the poller of a worker on the launcher, so that `set_poll_policy` reaches it
+    fn track(&self, poller: &Poller) {
+        if let Some(launcher) = self.launcher.as_ref() {
+            launcher.pollers.lock().push(Arc::downgrade(&poller.inner));
+        }
+    }
+
+    /// Spawns the thread of a worker, or queues it on the launcher until it is started
+    fn launch<F>(&self, name: String, body: F)
+    where
+        F: FnOnce() + Send + 'static,
+    {
+        let spawn = move || {
+            let _handle = std::thread::Builder::new()
+                .name(name)
+                .spawn(body)
+                .expect("failed to spawn worker");
+        };
+        match self.launcher.as_ref() {
+            Some(launcher) => launcher.launch(Box::new(spawn)),
+            None => spawn(),
+        }
+    }
+}
+
+/// Threads of workers queued until the first use of the data path.
+///
+/// A context that never creates a QP, such as the one of a tool only querying the device,
+/// doesn't start the workers of the data path.
+#[derive(Clone)]
+pub(crate) struct WorkerLauncher {
+    /// Spawns the queued threads, `None` once the launcher is started
+    pending: Arc<Mutex<Option<Vec<Box<dyn FnOnce() + Send>>>>>,
+    /// Pollers of the polling workers spawned through the launcher
+    pollers: Arc<Mutex<Vec<Weak<PollerInner>>>>,
+    /// Utilization of the workers spawned through the launcher, in spawn order
+    workers: Arc<Mutex<Vec<Arc<WorkerUtilization>>>>,
+}
+
+impl WorkerLauncher {
+    pub(crate) fn new() -> Self {
+        Self {
+            pending: Arc::new(Mutex::new(Some(Vec::new()))),
+            pollers: Arc::new(Mutex::new(Vec::new())),
+            workers: Arc::new(Mutex::new(Vec::new())),
+        }
+    }
+
+    /// Dumps the utilization of the workers over their last window as
+    /// `worker/<name>/<counter> <value>` lines
+    pub(crate) fn dump_utilization(&self) -> String {
+        self.workers
+            .lock()
+            .iter()
+            .map(|worker| worker.to_string())
+            .collect()
+    }
+
+    /// Replaces the backoff policy of the polling workers spawned through the launcher
+    pub(crate) fn set_poll_policy(&self, policy: PollPolicy) {
+        self.pollers.lock().retain(|inner| {
+            let Some(inner) = inner.upgrade() else {
+                return false;
+            };
+            Poller { inner }.set_policy(policy);
+            true
+        });
+    }
+
+    /// Spawns the queued threads, the threads launched afterwards are spawned right away
+    pub(crate) fn start(&self) {
+        let Some(pending) = self.pending.lock().take() else {
+            return;
+        };
+        debug!("starting {} workers", pending.len());
+        for spawn in pending {
+            spawn();
+        }
+    }
+
+    fn launch(&self, spawn: Box<dyn FnOnce() + Send>) {
+        let mut pending = self.pending.lock();
+        match pending.as_mut() {
+            Some(queued) => queued.push(spawn),
+            None => {
+                drop(pending);
+                spawn();
+            }
+        }
+    }
+}
+
+impl fmt::Debug for WorkerLauncher {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("WorkerLauncher")
+            .field("started", &self.pending.lock().is_none())
+            .finish()
+    }
+}
+
+/// Utilization counters of a worker, cumulative since the worker started
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct UtilizationSnapshot {
+    /// Nanoseconds spent processing tasks, from a wakeup to the next idle poll or wait
+    pub(crate) busy_ns: u64,
+    /// Number of wakeups, a polling worker wakes up at the first task after an empty poll
+    pub(crate) wakeups: u64,
+    /// Number of tasks processed
+    pub(crate) tasks: u64,
+    /// Number of polls that found no task
+    pub(crate) empty_polls: u64,
+    /// Tasks queued at the last wakeup, a gauge rather than a counter
+    pub(crate) backlog: u64,
+}
+
+impl UtilizationSnapshot {
+    /// Returns the counters accumulated since `base`
+    fn since(self, base: Self) -> Self {
+        Self {
+            busy_ns: self.busy_ns.wrapping_sub(base.busy_ns),
+            wakeups: self.wakeups.wrapping_sub(base.wakeups),
+            tasks: self.tasks.wrapping_sub(base.tasks),
+            empty_polls: self.empty_polls.wrapping_sub(base.empty_polls),
+            backlog: self.backlog,
+        }
     }
 }
 
+/// Length of the windows of the utilization of the workers
+const UTILIZATION_WINDOW: Duration = Duration::from_secs(1);
+
+/// Utilization of a worker thread.
+///
+/// The counters are written by the worker only, once per wakeup. They are reported over
+/// rolling windows: a read at least `UTILIZATION_WINDOW` after the start of the current window
+/// closes it, and reports it until the next window closes.
+#[derive(Debug)]
+pub(crate) struct WorkerUtilization {
+    name: String,
+    busy_ns: AtomicU64,
+    wakeups: AtomicU64,
+    tasks: AtomicU64,
+    empty_polls: AtomicU64,
+    backlog: AtomicU64,
+    window: Mutex<UtilizationWindow>,
+}
+
+#[derive(Debug)]
+struct UtilizationWindow {
+    start: Instant,
+    /// Counters at the start of the window
+    base: UtilizationSnapshot,
+    /// Last closed window and its length
+    last: Option<(UtilizationSnapshot, Duration)>,
+}
+
+impl WorkerUtilization {
+    fn new(name: String) -> Self {
+        Self {
+            name,
+            busy_ns: AtomicU64::new(0),
+            wakeups: AtomicU64::new(0),
+            tasks: AtomicU64::new(0),
+            empty_polls: AtomicU64::new(0),
+            backlog: AtomicU64::new(0),
+            window: Mutex::new(UtilizationWindow {
+                start: Instant::now(),
+                base: UtilizationSnapshot::default(),
+                last: None,
+            }),
+        }
+    }
+
+    fn publish(&self, usage: UtilizationSnapshot) {
+        self.busy_ns.store(usage.busy_ns, Ordering::Relaxed);
+        self.wakeups.store(usage.wakeups, Ordering::Relaxed);
+        self.tasks.store(usage.tasks, Ordering::Relaxed);
+        self.empty_polls.store(usage.empty_polls, Ordering::Relaxed);
+        self.backlog.store(usage.backlog, Ordering::Relaxed);
+    }
+
+    /// Returns the counters published so far
+    pub(crate) fn load(&self) -> UtilizationSnapshot {
+        UtilizationSnapshot {
+            busy_ns: self.busy_ns.load(Ordering::Relaxed),
+            wakeups: self.wakeups.load(Ordering::Relaxed),
+            tasks: self.tasks.load(Ordering::Relaxed),
+            empty_polls: self.empty_polls.load(Ordering::Relaxed),
+            backlog: self.backlog.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Returns the counters of the last closed window and its length, or those of the
+    /// current window until one closes
+    pub(crate) fn window(&self) -> (UtilizationSnapshot, Duration) {
+        let current = self.load();
+        let now = Instant::now();
+        let mut window = self.window.lock();
+        let elapsed = now.saturating_duration_since(window.start);
+        if elapsed >= UTILIZATION_WINDOW {
+            window.last = Some((current.since(window.base), elapsed));
+            window.base = current;
+            window.start = now;
+        }
+        window
+            .last
+            .unwrap_or_else(|| (current.since(window.base), elapsed))
+    }
+}
+
+impl fmt::Display for WorkerUtilization {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        let (usage, len) = self.window();
+        let len_ns = u64::try_from(len.as_nanos()).unwrap_or(u64::MAX).max(1);
+        let busy_ns = usage.busy_ns.min(len_ns);
+        let name = &self.name;
+        let busy_permille = u128::from(busy_ns) * 1000 / u128::from(len_ns);
+        let busy_pct = Tenths(busy_permille);
+        writeln!(f, "worker/{name}/busy_pct {busy_pct}")?;
+        writeln!(f, "worker/{name}/busy_ns {busy_ns}")?;
+        writeln!(f, "worker/{name}/idle_ns {}", len_ns - busy_ns)?;
+        writeln!(f, "worker/{name}/wakeups {}", usage.wakeups)?;
+        writeln!(f, "worker/{name}/tasks {}", usage.tasks)?;
+        let tasks_per_wakeup =
+            Tenths(u128::from(usage.tasks) * 10 / u128::from(usage.wakeups.max(1)));
+        writeln!(f, "worker/{name}/tasks_per_wakeup {tasks_per_wakeup}")?;
+        writeln!(f, "worker/{name}/empty_polls {}", usage.empty_polls)?;
+        writeln!(f, "worker/{name}/backlog {}", usage.backlog)
+    }
+}
+
+/// A value in tenths, shown with one decimal
+struct Tenths(u128);
+
+impl fmt::Display for Tenths {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "{}.{}", self.0 / 10, self.0 % 10)
+    }
+}
+
+/// Utilization counted by a worker thread, published at the end of each busy period
+struct UtilizationRecorder {
+    shared: Arc<WorkerUtilization>,
+    usage: UtilizationSnapshot,
+    /// Start of the current busy period
+    busy_since: Option<Instant>,
+}
+
+impl UtilizationRecorder {
+    fn new(shared: Arc<WorkerUtilization>) -> Self {
+        Self {
+            shared,
+            usage: UtilizationSnapshot::default(),
+            busy_since: None,
+        }
+    }
+
+    /// Starts a busy period with `backlog` tasks queued, unless one is running
+    fn wake(&mut self, backlog: usize) {
+        if self.busy_since.is_none() {
+            self.busy_since = Some(Instant::now());
+            self.usage.wakeups += 1;
+            self.usage.backlog = backlog as u64;
+        }
+    }
+
+    /// Counts a polled task, the backlog is read at the start of a busy period only
+    fn task<F: FnOnce() -> usize>(&mut self, backlog: F) {
+        if self.busy_since.is_none() {
+            self.wake(backlog());
+        }
+        self.usage.tasks += 1;
+    }
+
+    fn add_tasks(&mut self, num: usize) {
+        self.usage.tasks += num as u64;
+    }
+
+    fn empty_poll(&mut self) {
+        self.usage.empty_polls += 1;
+    }
+
+    /// Ends the busy period and publishes the counters
+    fn idle(&mut self) {
+        if let Some(since) = self.busy_since.take() {
+            let busy = u64::try_from(since.elapsed().as_nanos()).unwrap_or(u64::MAX);
+            self.usage.busy_ns = self.usage.busy_ns.saturating_add(busy);
+        }
+        self.shared.publish(self.usage);
+    }
+}
+
+/// Pins the calling worker thread to the given cores, logs a warning on failure
+fn pin_current_thread(name: &str, cores: &[usize]) {
+    if cores.is_empty() {
+        return;
+    }
+    match set_affinity(cores) {
+        Ok(()) => info!("worker {name} pinned to cores {cores:?}"),
+        Err(err) => warn!("failed to pin worker {name} to cores {cores:?}: {err}"),
+    }
+}
+
+#[allow(unsafe_code)]
+fn set_affinity(cores: &[usize]) -> io::Result<()> {
+    let max_cores = mem::size_of::<libc::cpu_set_t>() * 8;
+    // SAFETY: `cpu_set_t` is a plain bitmask, all zeros is an empty set
+    let mut set: libc::cpu_set_t = unsafe { mem::zeroed() };
+    for &core in cores {
+        if core >= max_cores {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                format!("core {core} out of range"),
+            ));
+        }
+        // SAFETY: `core` is within the bounds of the set
+        unsafe { libc::CPU_SET(core, &mut set) };
+    }
+    // SAFETY: `set` is a valid `cpu_set_t` of the given size, pid 0 is the calling thread
+    let ret = unsafe { libc::sched_setaffinity(0, mem::size_of::<libc::cpu_set_t>(), &set) };
+    if ret != 0 {
+        return Err(io::Error::last_os_error());
+    }
+
+    Ok(())
+}
+
+/// Capacity and batching of the task channels of the workers.
+///
+/// A producer blocks on a full channel until its worker catches up. The channels of workers
+/// that feed each other, such as the `CompletionWorker` and the `RdmaWriteWorker`, must be
+/// deep enough for the bursts of both.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(default)]
+pub(crate) struct ChannelPolicy {
+    /// Maximum number of tasks queued in a channel, 0 leaves the channels unbounded
+    pub(crate) capacity: usize,
+    /// Maximum number of tasks a worker drains per wakeup
+    pub(crate) batch: usize,
+}
+
+impl Default for ChannelPolicy {
+    fn default() -> Self {
+        Self {
+            capacity: 1 << 16,
+            batch: 64,
+        }
+    }
+}
+
+/// Receiving end of a task channel drained by a `SingleThreadTaskWorker`
+pub(crate) trait TaskSource<T> {
+    /// Blocks until a task is available, then moves up to `batch` queued tasks into `tasks`.
+    ///
+    /// Returns `false` if every producer is gone.
+    fn recv_batch(&mut self, tasks: &mut Vec<T>) -> bool;
+
+    /// Returns the maximum number of tasks moved by `recv_batch`
+    fn batch(&self) -> usize;
+
+    /// Returns the deepest queue seen at a wakeup of the worker
+    fn high_water(&self) -> usize;
+
+    /// Returns the number of tasks queued
+    fn len(&self) -> usize;
+}
+
+/// Counters of a task channel, shared by its producers and its worker
+#[derive(Debug, Default)]
+struct ChannelStats {
+    /// Deepest queue seen by the worker at a wakeup
+    high_water: AtomicUsize,
+    /// Number of sends that found the channel full and blocked
+    full: AtomicU64,
+}
+
 pub(crate) struct TaskTx<T> {
     inner: flume::Sender<T>,
+    stats: Arc<ChannelStats>,
+    /// Channels of all shards if the worker is sharded, `inner` is the first of them
+    shards: Option<Arc<TaskShards<T>>>,
+}
+
+/// Channels of the shards of a worker, each shard owns the tasks of some keys
+struct TaskShards<T> {
+    txs: Box<[(flume::Sender<T>, Arc<ChannelStats>)]>,
+    /// Key of a task, such as the index of its QP, sent to the shard `key % txs.len()`
+    key: fn(&T) -> usize,
 }
 
 impl<T> TaskTx<T> {
+    /// Sends a task, blocks while the channel is full
     pub(crate) fn send(&self, task: T) {
-        self.inner
-            .send(task)
-            .expect("failed to send task to channel");
+        let (tx, stats) = match self.shards.as_deref() {
+            Some(shards) => {
+                let shard = (shards.key)(&task) % shards.txs.len();
+                shards
+                    .txs
+                    .get(shard)
+                    .map_or((&self.inner, &self.stats), |x| (&x.0, &x.1))
+            }
+            None => (&self.inner, &self.stats),
+        };
+        let task = match tx.try_send(task) {
+            Ok(()) => return,
+            Err(flume::TrySendError::Full(task)) => {
+                let _ignore = stats.full.fetch_add(1, Ordering::Relaxed);
+                task
+            }
+            Err(flume::TrySendError::Disconnected(_)) => {
+                error!("failed to send task, the worker has exited");
+                return;
+            }
+        };
+        if tx.send(task).is_err() {
+            error!("failed to send task, the worker has exited");
+        }
+    }
+
+    /// Sends the tasks in order, blocks while the channel is full
+    pub(crate) fn send_batch<I>(&self, tasks: I)
+    where
+        I: IntoIterator<Item = T>,
+    {
+        for task in tasks {
+            self.send(task);
+        }
+    }
+
+    /// Returns the number of sends that blocked on a full channel
+    pub(crate) fn num_full(&self) -> u64 {
+        self.channels()
+            .map(|(_, stats)| stats.full.load(Ordering::Relaxed))
+            .sum()
+    }
+
+    /// Returns the bytes of the tasks queued, and of the deepest queue seen by the worker.
+    ///
+    /// The queues of a sharded worker are added up.
+    pub(crate) fn queued_bytes(&self) -> (usize, usize) {
+        let (queued, high_water) = self.channels().fold((0, 0), |(queued, high_water), x| {
+            (
+                queued + x.0.len(),
+                high_water + x.1.high_water.load(Ordering::Relaxed),
+            )
+        });
+        (queued * size_of::<T>(), high_water * size_of::<T>())
+    }
+
+    /// Returns the channel of each shard
+    fn channels(&self) -> impl Iterator<Item = (&flume::Sender<T>, &Arc<ChannelStats>)> {
+        let shards: &[_] = self.shards.as_deref().map_or(&[], |shards| &shards.txs);
+        let single = shards.is_empty().then_some((&self.inner, &self.stats));
+        single
+            .into_iter()
+            .chain(shards.iter().map(|x| (&x.0, &x.1)))
     }
 }
 
@@ -125,12 +891,17 @@ impl<T> Clone for TaskTx<T> {
     fn clone(&self) -> Self {
         Self {
             inner: self.inner.clone(),
+            stats: Arc::clone(&self.stats),
+            shards: self.shards.clone(),
         }
     }
 }
 
 pub(crate) struct TaskRx<T> {
     inner: flume::Receiver<T>,
+    stats: Arc<ChannelStats>,
+    /// Maximum number of tasks returned by `recv_batch`
+    batch: usize,
 }
 
 impl<T> TaskRx<T> {
@@ -142,14 +913,252 @@ impl<T> TaskRx<T> {
         self.inner.try_recv().ok()
     }
 
+    /// Updates the high-water mark with the depth of the queue at a wakeup
+    fn record_depth(&self, depth: usize) {
+        let high_water = self.high_water();
+        if raise_high_water(high_water, depth) {
+            self.stats.high_water.store(depth, Ordering::Relaxed);
+        }
+    }
+
     fn try_iter(&self) -> flume::TryIter<'_, T> {
         self.inner.try_iter()
     }
 }
 
+impl<T> TaskSource<T> for TaskRx<T> {
+    fn recv_batch(&mut self, tasks: &mut Vec<T>) -> bool {
+        let Ok(task) = self.inner.recv() else {
+            return false;
+        };
+        tasks.push(task);
+        self.record_depth(self.inner.len() + 1);
+        tasks.extend(self.inner.try_iter().take(self.batch.saturating_sub(1)));
+        true
+    }
+
+    fn batch(&self) -> usize {
+        self.batch
+    }
+
+    fn high_water(&self) -> usize {
+        self.stats.high_water.load(Ordering::Relaxed)
+    }
+
+    fn len(&self) -> usize {
+        self.inner.len()
+    }
+}
+
+/// Returns `true` if `depth` is a new high-water mark, it is reported each time it doubles
+fn raise_high_water(high_water: usize, depth: usize) -> bool {
+    if depth <= high_water {
+        return false;
+    }
+    if depth.ilog2() > high_water.max(1).ilog2() {
+        debug!("task queue depth reached {depth}");
+    }
+    true
+}
+
+/// Producer of a single producer task channel
+pub(crate) struct SpscTx<T> {
+    inner: rtrb::Producer<T>,
+    /// Wakes up the consumer when it is parked
+    poller: Poller,
+    /// Number of sends that found the ring full
+    full: u64,
+}
+
+impl<T> SpscTx<T> {
+    /// Sends a task, spins while the ring is full
+    pub(crate) fn send(&mut self, mut task: T) {
+        loop {
+            match self.inner.push(task) {
+                Ok(()) => break,
+                Err(rtrb::PushError::Full(t)) => {
+                    if self.inner.is_abandoned() {
+                        error!("failed to send task, the worker has exited");
+                        return;
+                    }
+                    self.full = self.full.wrapping_add(1);
+                    task = t;
+                    thread::yield_now();
+                }
+            }
+        }
+        self.poller.wake();
+    }
+
+    /// Sends the tasks in order, spins while the ring is full
+    pub(crate) fn send_batch<I>(&mut self, tasks: I)
+    where
+        I: IntoIterator<Item = T>,
+    {
+        for task in tasks {
+            self.send(task);
+        }
+    }
+
+    /// Returns the number of sends that found the ring full
+    pub(crate) fn num_full(&self) -> u64 {
+        self.full
+    }
+}
+
+/// Consumer of a single producer task channel.
+///
+/// An empty ring is polled with the backoff of the `PollPolicy`, the consumer parks once the
+/// policy runs out and is woken up by the next send.
+pub(crate) struct SpscRx<T> {
+    inner: rtrb::Consumer<T>,
+    poller: Poller,
+    batch: usize,
+    high_water: usize,
+}
+
+impl<T> SpscRx<T> {
+    pub(crate) fn try_recv(&mut self) -> Option<T> {
+        self.inner.pop().ok()
+    }
+
+    /// Blocks until a task is available, returns `None` if the producer is gone
+    pub(crate) fn recv(&mut self) -> Option<T> {
+        let mut idle: u32 = 0;
+        loop {
+            if let Ok(task) = self.inner.pop() {
+                return Some(task);
+            }
+            if self.inner.is_abandoned() {
+                // The producer may have pushed before it was dropped
+                return self.inner.pop().ok();
+            }
+            idle = idle.saturating_add(1);
+            match self.poller.idle_action(idle) {
+                IdleAction::Spin => hint::spin_loop(),
+                IdleAction::Yield => thread::yield_now(),
+                IdleAction::Park => {
+                    self.poller.register();
+                    self.poller.set_parked(true);
+                    if self.inner.is_empty() && !self.inner.is_abandoned() {
+                        self.poller.park();
+                    }
+                    self.poller.set_parked(false);
+                }
+            }
+        }
+    }
+}
+
+impl<T> TaskSource<T> for SpscRx<T> {
+    fn recv_batch(&mut self, tasks: &mut Vec<T>) -> bool {
+        let Some(task) = self.recv() else {
+            return false;
+        };
+        tasks.push(task);
+        let queued = self.inner.slots();
+        if raise_high_water(self.high_water, queued + 1) {
+            self.high_water = queued + 1;
+        }
+        let n = queued.min(self.batch.saturating_sub(1));
+        tasks.extend(iter::from_fn(|| self.inner.pop().ok()).take(n));
+        true
+    }
+
+    fn batch(&self) -> usize {
+        self.batch
+    }
+
+    fn high_water(&self) -> usize {
+        self.high_water
+    }
+
+    fn len(&self) -> usize {
+        self.inner.slots()
+    }
+}
+
+/// Creates a single producer task channel of `capacity` tasks, for a link fed by one
+/// producer thread.
+///
+/// A ring avoids the lock of the MPSC channel on every send and receive. The idle consumer
+/// backs off according to `poll`.
+pub(crate) fn spsc_task_channel<T>(
+    capacity: usize,
+    batch: usize,
+    poll: PollPolicy,
+) -> (SpscTx<T>, SpscRx<T>) {
+    let (producer, consumer) = rtrb::RingBuffer::new(capacity.max(1));
+    let poller = Poller::new(poll);
+    let tx = SpscTx {
+        inner: producer,
+        poller: poller.clone(),
+        full: 0,
+    };
+    let rx = SpscRx {
+        inner: consumer,
+        poller,
+        batch: batch.max(1),
+        high_water: 0,
+    };
+    (tx, rx)
+}
+
+/// Creates an unbounded task channel
 pub(crate) fn task_channel<T>() -> (TaskTx<T>, TaskRx<T>) {
-    let (tx, rx) = flume::unbounded();
-    (TaskTx { inner: tx }, TaskRx { inner: rx })
+    task_channel_with(ChannelPolicy {
+        capacity: 0,
+        ..ChannelPolicy::default()
+    })
+}
+
+/// Creates a task channel with the capacity and batch size of `policy`
+pub(crate) fn task_channel_with<T>(policy: ChannelPolicy) -> (TaskTx<T>, TaskRx<T>) {
+    let (tx, rx) = if policy.capacity == 0 {
+        flume::unbounded()
+    } else {
+        flume::bounded(policy.capacity)
+    };
+    let stats = Arc::new(ChannelStats::default());
+    let tx = TaskTx {
+        inner: tx,
+        stats: Arc::clone(&stats),
+        shards: None,
+    };
+    let rx = TaskRx {
+        inner: rx,
+        stats,
+        batch: policy.batch.max(1),
+    };
+    (tx, rx)
+}
+
+/// Creates the channels of a worker sharded `num` ways, the task channel sends each task to
+/// the shard of its `key`, so that the tasks of a key are processed in order by one shard.
+///
+/// A single shard gets a plain channel.
+pub(crate) fn sharded_task_channel_with<T>(
+    policy: ChannelPolicy,
+    num: usize,
+    key: fn(&T) -> usize,
+) -> (TaskTx<T>, Vec<TaskRx<T>>) {
+    let (txs, rxs): (Vec<_>, Vec<_>) = iter::repeat_with(|| task_channel_with(policy))
+        .take(num.max(1))
+        .unzip();
+    let mut txs = txs.into_iter();
+    let first = txs.next().unwrap_or_else(|| unreachable!());
+    if txs.as_slice().is_empty() {
+        return (first, rxs);
+    }
+    let shards = iter::once(&first)
+        .chain(txs.as_slice())
+        .map(|tx| (tx.inner.clone(), Arc::clone(&tx.stats)))
+        .collect();
+    let tx = TaskTx {
+        shards: Some(Arc::new(TaskShards { txs: shards, key })),
+        ..first
+    };
+    (tx, rxs)
 }
 
 #[derive(Debug, Clone)]
@@ -172,3 +1181,264 @@ impl AbortSignal {
         self.inner.store(true, Ordering::Relaxed);
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    struct Counter {
+        rx: TaskRx<u32>,
+        done: TaskTx<u32>,
+    }
+
+    impl SingleThreadPollingWorker for Counter {
+        type Task = u32;
+
+        fn poll(&mut self) -> Option<Self::Task> {
+            self.rx.try_recv()
+        }
+
+        fn process(&mut self, task: Self::Task) {
+            self.done.send(task);
+        }
+    }
+
+    #[test]
+    fn idle_action_follows_policy() {
+        let poller = Poller::new(PollPolicy {
+            spin_count: 2,
+            yield_count: 1,
+            park_timeout_us: 10,
+        });
+        assert_eq!(poller.idle_action(1), IdleAction::Spin);
+        assert_eq!(poller.idle_action(2), IdleAction::Spin);
+        assert_eq!(poller.idle_action(3), IdleAction::Yield);
+        assert_eq!(poller.idle_action(4), IdleAction::Park);
+    }
+
+    #[test]
+    fn launcher_updates_the_policy_of_its_pollers() {
+        let (_tx, rx) = task_channel();
+        let (done_tx, _done_rx) = task_channel();
+        let launcher = WorkerLauncher::new();
+        let affinity = WorkerAffinity::default().with_launcher(launcher.clone());
+        let poller = Poller::new(PollPolicy::default());
+        Counter { rx, done: done_tx }.spawn(
+            "Counter",
+            AbortSignal::new(),
+            poller.clone(),
+            &affinity,
+        );
+        launcher.set_poll_policy(PollPolicy {
+            spin_count: 0,
+            yield_count: 1,
+            park_timeout_us: 10,
+        });
+        assert_eq!(poller.idle_action(1), IdleAction::Yield);
+        assert_eq!(poller.idle_action(2), IdleAction::Park);
+    }
+
+    #[test]
+    fn launcher_reports_the_utilization_of_its_workers() {
+        let (tx, rx) = task_channel();
+        let (done_tx, done_rx) = task_channel();
+        let launcher = WorkerLauncher::new();
+        let affinity = WorkerAffinity::default().with_launcher(launcher.clone());
+        let poller = Poller::new(PollPolicy::default());
+        Counter { rx, done: done_tx }.spawn("Counter", AbortSignal::new(), poller, &affinity);
+        tx.send_batch(0..3);
+        launcher.start();
+        for _ in 0..3 {
+            assert!(done_rx.recv().is_some());
+        }
+        let worker = Arc::clone(&launcher.workers.lock()[0]);
+        while worker.load().empty_polls == 0 {
+            thread::yield_now();
+        }
+        let usage = worker.load();
+        assert_eq!(usage.tasks, 3);
+        assert!(usage.wakeups >= 1);
+
+        let dump = launcher.dump_utilization();
+        assert!(dump.lines().any(|line| line == "worker/Counter/tasks 3"));
+        let counters: Vec<_> = dump
+            .lines()
+            .map(|line| line.split(' ').next().unwrap())
+            .collect();
+        assert_eq!(
+            counters,
+            [
+                "worker/Counter/busy_pct",
+                "worker/Counter/busy_ns",
+                "worker/Counter/idle_ns",
+                "worker/Counter/wakeups",
+                "worker/Counter/tasks",
+                "worker/Counter/tasks_per_wakeup",
+                "worker/Counter/empty_polls",
+                "worker/Counter/backlog",
+            ]
+        );
+        assert_eq!(Tenths(1234).to_string(), "123.4");
+    }
+
+    #[test]
+    fn parked_worker_is_woken_up() {
+        let (tx, rx) = task_channel();
+        let (done_tx, done_rx) = task_channel();
+        let poller = Poller::new(PollPolicy {
+            spin_count: 0,
+            yield_count: 0,
+            // long enough that only an explicit wakeup finishes the test in time
+            park_timeout_us: 60_000_000,
+        });
+        Counter { rx, done: done_tx }.spawn(
+            "Counter",
+            AbortSignal::new(),
+            poller.clone(),
+            &WorkerAffinity::default(),
+        );
+        while poller.stats().parked == 0 {
+            thread::yield_now();
+        }
+        tx.send(7);
+        poller.wake();
+        assert_eq!(done_rx.recv(), Some(7));
+    }
+
+    #[derive(Debug, Default)]
+    struct TestInterrupt {
+        armed: AtomicU64,
+        fired: parking_lot::Mutex<bool>,
+        cond: parking_lot::Condvar,
+    }
+
+    impl Interrupt for Arc<TestInterrupt> {
+        fn arm(&self) {
+            let _prev = self.armed.fetch_add(1, Ordering::Relaxed);
+        }
+
+        fn wait(&self, timeout: Duration) {
+            let mut fired = self.fired.lock();
+            if !*fired {
+                let _result = self.cond.wait_for(&mut fired, timeout);
+            }
+            *fired = false;
+        }
+
+        fn notify(&self) {
+            *self.fired.lock() = true;
+            let _woken = self.cond.notify_one();
+        }
+    }
+
+    #[test]
+    fn parked_worker_waits_on_its_interrupt() {
+        let (tx, rx) = task_channel();
+        let (done_tx, done_rx) = task_channel();
+        let interrupt = Arc::new(TestInterrupt::default());
+        let policy = PollPolicy {
+            spin_count: 0,
+            yield_count: 0,
+            park_timeout_us: 60_000_000,
+        };
+        let poller = Poller::with_interrupt(policy, Box::new(Arc::clone(&interrupt)));
+        Counter { rx, done: done_tx }.spawn(
+            "Counter",
+            AbortSignal::new(),
+            poller.clone(),
+            &WorkerAffinity::default(),
+        );
+        while poller.stats().parked == 0 {
+            thread::yield_now();
+        }
+        assert_ne!(interrupt.armed.load(Ordering::Relaxed), 0);
+        tx.send(7);
+        poller.wake();
+        assert_eq!(done_rx.recv(), Some(7));
+    }
+
+    #[test]
+    fn bounded_channel_drains_in_batches() {
+        let (tx, mut rx) = task_channel_with(ChannelPolicy {
+            capacity: 4,
+            batch: 3,
+        });
+        tx.send_batch(0..4);
+        assert_eq!(tx.num_full(), 0);
+
+        let mut tasks = Vec::new();
+        assert!(rx.recv_batch(&mut tasks));
+        assert_eq!(tasks, [0, 1, 2]);
+        assert_eq!(rx.high_water(), 4);
+        tasks.clear();
+        assert!(rx.recv_batch(&mut tasks));
+        assert_eq!(tasks, [3]);
+
+        // The fifth send blocks until the worker catches up
+        tx.send_batch(0..4);
+        let tx_c = tx.clone();
+        let sender = thread::spawn(move || tx_c.send(4));
+        while tx.num_full() == 0 {
+            thread::yield_now();
+        }
+        tasks.clear();
+        assert!(rx.recv_batch(&mut tasks));
+        sender.join().unwrap();
+        assert_eq!(tasks, [0, 1, 2]);
+        assert_eq!(rx.try_recv(), Some(3));
+        assert_eq!(rx.try_recv(), Some(4));
+        assert_eq!(tx.num_full(), 1);
+
+        drop(tx);
+        assert!(!rx.recv_batch(&mut tasks));
+    }
+
+    #[test]
+    fn sharded_channel_keeps_the_tasks_of_a_key_on_one_shard() {
+        let (tx, rxs) = sharded_task_channel_with(ChannelPolicy::default(), 3, |x: &usize| x / 10);
+        tx.send_batch([0, 10, 1, 20, 11, 30, 2]);
+        let shards: Vec<Vec<usize>> = rxs.iter().map(|rx| rx.try_iter().collect()).collect();
+        assert_eq!(shards, [vec![0, 1, 30, 2], vec![10, 11], vec![20]]);
+        assert_eq!(tx.queued_bytes().0, 0);
+
+        let (tx, rxs) = sharded_task_channel_with(ChannelPolicy::default(), 1, |x: &usize| *x);
+        tx.send(7);
+        assert_eq!(rxs.len(), 1);
+        assert_eq!(tx.queued_bytes().0, size_of::<usize>());
+    }
+
+    #[test]
+    fn spsc_channel_drains_in_batches() {
+        let (mut tx, rx) = spsc_task_channel(4, 3, PollPolicy::default());
+        tx.send_batch(0..4);
+        let (done_tx, done_rx) = spsc_task_channel(8, 8, PollPolicy::default());
+        let consumer = thread::spawn(move || {
+            let (mut rx, mut done_tx) = (rx, done_tx);
+            let mut tasks = Vec::new();
+            while rx.recv_batch(&mut tasks) {
+                done_tx.send(tasks.len());
+                tasks.clear();
+            }
+            rx.high_water()
+        });
+        let mut done_rx = done_rx;
+        assert_eq!(done_rx.recv(), Some(3));
+        assert_eq!(done_rx.recv(), Some(1));
+
+        // The parked consumer is woken up by a send
+        tx.send(4);
+        assert_eq!(done_rx.recv(), Some(1));
+        drop(tx);
+        assert_eq!(consumer.join().unwrap(), 4);
+        assert_eq!(done_rx.recv(), None);
+    }
+
+    #[test]
+    fn worker_affinity_falls_back_to_default() {
+        let workers = HashMap::from([("MetaWorker".to_owned(), vec![2, 3])]);
+        let affinity = WorkerAffinity::new(workers, vec![0, 1]);
+        assert_eq!(affinity.cores("MetaWorker"), [2, 3]);
+        assert_eq!(affinity.cores("SendWorker0"), [0, 1]);
+        assert!(WorkerAffinity::default().cores("MetaWorker").is_empty());
+    }
+}
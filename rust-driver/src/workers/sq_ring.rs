@@ -0,0 +1,229 @@
+use std::{
+    iter, ptr,
+    sync::atomic::{AtomicU32, Ordering},
+};
+
+use crate::{
+    rdma_utils::types::{SendWrBase, SendWrRdma},
+    workers::send::WorkReqOpCode,
+};
+
+use super::wc_ring::RingIndex;
+
+/// Compact record of an RDMA work request written to a `SqRing`
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct SqEntry {
+    pub(crate) wr_id: u64,
+    pub(crate) laddr: u64,
+    pub(crate) raddr: u64,
+    pub(crate) length: u32,
+    pub(crate) lkey: u32,
+    pub(crate) rkey: u32,
+    pub(crate) imm_data: u32,
+    /// A RDMA write, a RDMA write with immediate or a RDMA read
+    pub(crate) opcode: WorkReqOpCode,
+    /// Whether the WR is reported to the CQ once it completes
+    pub(crate) signaled: bool,
+}
+
+impl SqEntry {
+    /// Returns the work request of the entry, `None` for an opcode the ring does not carry
+    pub(crate) fn to_wr(self) -> Option<SendWrRdma> {
+        if !matches!(
+            self.opcode,
+            WorkReqOpCode::RdmaWrite | WorkReqOpCode::RdmaWriteWithImm | WorkReqOpCode::RdmaRead
+        ) {
+            return None;
+        }
+        let send_flags = if self.signaled {
+            ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0
+        } else {
+            0
+        };
+        let base = SendWrBase::new(
+            self.wr_id,
+            send_flags,
+            self.laddr,
+            self.length,
+            self.lkey,
+            self.imm_data,
+            self.opcode,
+        );
+        Some(SendWrRdma::new_from_base(base, self.raddr, self.rkey))
+    }
+}
+
+/// Submission ring of a QP, shared between the application and the `RdmaWriteWorker`.
+///
+/// The application writes the entries in place and publishes them all with one doorbell,
+/// the worker takes them from the ring and posts them without a task per work request.
+/// There is a single producer and a single consumer, both indices count entries and wrap
+/// around like the ones of `WcRing`.
+#[repr(C)]
+pub(crate) struct SqRing {
+    /// Index of the next entry published to the consumer
+    head: RingIndex,
+    /// Index of the next entry read by the consumer
+    tail: RingIndex,
+    /// Index of the next entry written by the producer, ahead of `head` until the doorbell
+    pending: RingIndex,
+    /// Number of entries minus one, the number of entries is a power of two
+    mask: u32,
+    /// The entries, owned by the ring
+    entries: *mut SqEntry,
+}
+
+// SAFETY: the entries are owned by the ring, an entry is only accessed by the producer
+// before `head` publishes it and by the consumer before `tail` releases it.
+#[allow(unsafe_code)]
+unsafe impl Send for SqRing {}
+
+// SAFETY: see `Send`, there is a single producer and a single consumer
+#[allow(unsafe_code)]
+unsafe impl Sync for SqRing {}
+
+#[allow(unsafe_code, clippy::as_conversions)]
+impl SqRing {
+    /// Creates a ring of `capacity` entries, `capacity` must be a power of two
+    pub(crate) fn new(capacity: usize) -> Self {
+        debug_assert!(
+            capacity.is_power_of_two(),
+            "capacity must be a power of two"
+        );
+        let entries: Box<[SqEntry]> = iter::repeat_with(SqEntry::default).take(capacity).collect();
+        Self {
+            head: RingIndex(AtomicU32::new(0)),
+            tail: RingIndex(AtomicU32::new(0)),
+            pending: RingIndex(AtomicU32::new(0)),
+            mask: u32::try_from(capacity.saturating_sub(1))
+                .unwrap_or_else(|_| unreachable!("SQ ring capacity exceeds u32")),
+            entries: Box::into_raw(entries).cast(),
+        }
+    }
+
+    /// Returns the number of entries of the ring
+    pub(crate) fn capacity(&self) -> usize {
+        (self.mask as usize).saturating_add(1)
+    }
+
+    /// Returns a pointer to the entry of `index`
+    fn entry(&self, index: u32) -> *mut SqEntry {
+        // SAFETY: the masked index is within the entries
+        unsafe { self.entries.add((index & self.mask) as usize) }
+    }
+
+    /// Writes an entry without publishing it, returns `false` if the ring is full
+    pub(crate) fn push(&self, entry: SqEntry) -> bool {
+        let pending = self.pending.0.load(Ordering::Relaxed);
+        let tail = self.tail.0.load(Ordering::Acquire);
+        if pending.wrapping_sub(tail) > self.mask {
+            return false;
+        }
+        // SAFETY: the entry was released by the consumer and is not visible to it until
+        // `head` is advanced past it
+        unsafe { self.entry(pending).write(entry) };
+        self.pending
+            .0
+            .store(pending.wrapping_add(1), Ordering::Relaxed);
+        true
+    }
+
+    /// Publishes the entries written since the last call, returns their number
+    pub(crate) fn publish(&self) -> u32 {
+        let pending = self.pending.0.load(Ordering::Relaxed);
+        let head = self.head.0.swap(pending, Ordering::Release);
+        pending.wrapping_sub(head)
+    }
+
+    /// Reads the next published entry
+    pub(crate) fn pop(&self) -> Option<SqEntry> {
+        let tail = self.tail.0.load(Ordering::Relaxed);
+        let head = self.head.0.load(Ordering::Acquire);
+        if head == tail {
+            return None;
+        }
+        // SAFETY: the entry was published by the producer and is not overwritten until
+        // `tail` is advanced
+        let entry = unsafe { self.entry(tail).read() };
+        self.tail.0.store(tail.wrapping_add(1), Ordering::Release);
+        Some(entry)
+    }
+}
+
+#[allow(unsafe_code)]
+impl Drop for SqRing {
+    fn drop(&mut self) {
+        // SAFETY: the entries were allocated by `new` as a boxed slice of `capacity` entries
+        drop(unsafe {
+            Box::from_raw(ptr::slice_from_raw_parts_mut(self.entries, self.capacity()))
+        });
+    }
+}
+
+/// Rings are compared by identity, a doorbell refers to the ring it drains
+impl PartialEq for SqRing {
+    fn eq(&self, other: &Self) -> bool {
+        ptr::eq(self, other)
+    }
+}
+
+impl Eq for SqRing {}
+
+impl std::fmt::Debug for SqRing {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("SqRing")
+            .field("capacity", &self.capacity())
+            .finish()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn entries_are_consumed_once_published() {
+        let ring = SqRing::new(4);
+        let entry = |wr_id| SqEntry {
+            wr_id,
+            ..Default::default()
+        };
+        for round in 0..3 {
+            for i in 0..4 {
+                assert!(ring.push(entry(round * 4 + i)));
+            }
+            assert!(!ring.push(entry(99)));
+            assert!(ring.pop().is_none());
+            assert_eq!(ring.publish(), 4);
+            assert_eq!(ring.publish(), 0);
+            for i in 0..4 {
+                assert_eq!(ring.pop().map(|e| e.wr_id), Some(round * 4 + i));
+            }
+            assert!(ring.pop().is_none());
+        }
+    }
+
+    #[test]
+    fn only_rdma_opcodes_are_carried() {
+        let entry = SqEntry {
+            wr_id: 7,
+            length: 64,
+            opcode: WorkReqOpCode::RdmaRead,
+            signaled: true,
+            ..Default::default()
+        };
+        let wr = entry.to_wr().unwrap();
+        assert_eq!(wr.base.wr_id, 7);
+        assert_eq!(wr.length(), 64);
+        assert_eq!(
+            wr.base.send_flags,
+            ibverbs_sys::ibv_send_flags::IBV_SEND_SIGNALED.0
+        );
+        let send = SqEntry {
+            opcode: WorkReqOpCode::Send,
+            ..entry
+        };
+        assert!(send.to_wr().is_none());
+    }
+}
@@ -0,0 +1,169 @@
+use std::{
+    iter, ptr,
+    sync::atomic::{AtomicU32, Ordering},
+};
+
+/// An index of the ring alone in its cache line
+#[repr(C, align(64))]
+pub(super) struct RingIndex(pub(super) AtomicU32);
+
+/// Completion ring of a CQ polled in place by the C provider.
+///
+/// The layout is `struct bluerdma_wc_ring` of `providers/bluerdma/bluerdma.h`. The
+/// `CompletionWorker` is the only producer, the consumer is either the provider's
+/// `bluerdma_poll_cq` or the verbs context, so that polling a CQ does not have to call into
+/// the driver. Both indices count entries and wrap around, the entry of an index is at
+/// `index & mask`.
+#[repr(C)]
+pub(crate) struct WcRing {
+    /// Index of the next entry written by the producer
+    head: RingIndex,
+    /// Index of the next entry read by the consumer
+    tail: RingIndex,
+    /// Number of entries minus one, the number of entries is a power of two
+    mask: u32,
+    /// Whether the provider may poll the ring in place, cleared once the completions need
+    /// the bookkeeping of the driver's `poll_cq`
+    in_place: AtomicU32,
+    /// The entries, owned by the ring
+    entries: *mut ibverbs_sys::ibv_wc,
+}
+
+// SAFETY: the entries are owned by the ring, an entry is only accessed by the producer
+// before `head` publishes it and by the consumer before `tail` releases it.
+#[allow(unsafe_code)]
+unsafe impl Send for WcRing {}
+
+// SAFETY: see `Send`, there is a single producer and a single consumer
+#[allow(unsafe_code)]
+unsafe impl Sync for WcRing {}
+
+#[allow(unsafe_code, clippy::as_conversions)]
+impl WcRing {
+    /// Creates a ring of `capacity` entries, `capacity` must be a power of two
+    pub(crate) fn new(capacity: usize) -> Self {
+        debug_assert!(
+            capacity.is_power_of_two(),
+            "capacity must be a power of two"
+        );
+        let entries: Box<[ibverbs_sys::ibv_wc]> = iter::repeat_with(ibverbs_sys::ibv_wc::default)
+            .take(capacity)
+            .collect();
+        Self {
+            head: RingIndex(AtomicU32::new(0)),
+            tail: RingIndex(AtomicU32::new(0)),
+            mask: u32::try_from(capacity.saturating_sub(1))
+                .unwrap_or_else(|_| unreachable!("CQ capacity exceeds u32")),
+            in_place: AtomicU32::new(1),
+            entries: Box::into_raw(entries).cast(),
+        }
+    }
+
+    /// Returns the number of entries of the ring
+    pub(crate) fn capacity(&self) -> usize {
+        (self.mask as usize).saturating_add(1)
+    }
+
+    /// Makes the provider poll the ring through the driver from now on
+    pub(crate) fn poll_through_driver(&self) {
+        self.in_place.store(0, Ordering::Release);
+    }
+
+    /// Returns a pointer to the entry of `index`
+    fn entry(&self, index: u32) -> *mut ibverbs_sys::ibv_wc {
+        // SAFETY: the masked index is within the entries
+        unsafe { self.entries.add((index & self.mask) as usize) }
+    }
+
+    /// Writes a work completion, returns `false` if the ring is full
+    pub(crate) fn push(&self, wc: ibverbs_sys::ibv_wc) -> bool {
+        let head = self.head.0.load(Ordering::Relaxed);
+        let tail = self.tail.0.load(Ordering::Acquire);
+        if head.wrapping_sub(tail) > self.mask {
+            return false;
+        }
+        // SAFETY: the entry was released by the consumer and is not visible to it until
+        // `head` is advanced
+        unsafe { self.entry(head).write(wc) };
+        self.head.0.store(head.wrapping_add(1), Ordering::Release);
+        true
+    }
+
+    /// Reads up to `wc.len()` work completions into `wc`, returns the number read
+    pub(crate) fn poll_into(&self, wc: &mut [ibverbs_sys::ibv_wc]) -> usize {
+        let tail = self.tail.0.load(Ordering::Relaxed);
+        let head = self.head.0.load(Ordering::Acquire);
+        let n = (head.wrapping_sub(tail) as usize).min(wc.len());
+        for (offset, entry) in wc.iter_mut().take(n).enumerate() {
+            // SAFETY: the entry was published by the producer and is not overwritten until
+            // `tail` is advanced
+            *entry = unsafe { self.entry(tail.wrapping_add(offset as u32)).read() };
+        }
+        self.tail
+            .0
+            .store(tail.wrapping_add(n as u32), Ordering::Release);
+        n
+    }
+
+    /// Reads the next work completion
+    pub(crate) fn pop(&self) -> Option<ibverbs_sys::ibv_wc> {
+        let mut wc = [ibverbs_sys::ibv_wc::default()];
+        let polled = self.poll_into(&mut wc) == 1;
+        let [wc] = wc;
+        polled.then_some(wc)
+    }
+}
+
+#[allow(unsafe_code)]
+impl Drop for WcRing {
+    fn drop(&mut self) {
+        // SAFETY: the entries were allocated by `new` as a boxed slice of `capacity` entries
+        drop(unsafe {
+            Box::from_raw(ptr::slice_from_raw_parts_mut(self.entries, self.capacity()))
+        });
+    }
+}
+
+impl std::fmt::Debug for WcRing {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("WcRing")
+            .field("capacity", &self.capacity())
+            .finish()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::mem;
+
+    use super::*;
+
+    #[test]
+    fn layout_matches_provider() {
+        assert_eq!(mem::offset_of!(WcRing, head), 0);
+        assert_eq!(mem::offset_of!(WcRing, tail), 64);
+        assert_eq!(mem::offset_of!(WcRing, mask), 128);
+        assert_eq!(mem::offset_of!(WcRing, in_place), 132);
+        assert_eq!(mem::offset_of!(WcRing, entries), 136);
+    }
+
+    #[test]
+    fn ring_wraps_and_fills() {
+        let ring = WcRing::new(4);
+        let wc = |wr_id| ibverbs_sys::ibv_wc {
+            wr_id,
+            ..Default::default()
+        };
+        for round in 0..3 {
+            for i in 0..4 {
+                assert!(ring.push(wc(round * 4 + i)));
+            }
+            assert!(!ring.push(wc(99)));
+            assert_eq!(ring.pop().map(|x| x.wr_id), Some(round * 4));
+            let mut out = [ibverbs_sys::ibv_wc::default(); 8];
+            assert_eq!(ring.poll_into(&mut out), 3);
+            assert_eq!(out.get(2).map(|x| x.wr_id), Some(round * 4 + 3));
+            assert!(ring.pop().is_none());
+        }
+    }
+}
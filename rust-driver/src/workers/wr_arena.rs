@@ -0,0 +1,133 @@
+//! Records of the WRs in flight between the verbs and the `RdmaWriteWorker`.
+//!
+//! A WR posted to a worker is copied once into a preallocated slot and only the index of the
+//! slot travels through the task channel, so a task is a few words whatever the number of
+//! SGEs of the WR. The worker takes the WR out and the slot returns to the free list once its
+//! `StagedWr` is dropped. The slots are shared by all QPs and devices of the process, a WR
+//! posted while every slot is taken is boxed instead.
+
+use std::{fmt, iter, sync::OnceLock};
+
+use crossbeam_queue::ArrayQueue;
+use parking_lot::Mutex;
+
+use crate::{constants::MAX_STAGED_WR, rdma_utils::types::SendWrRdma};
+
+/// The slots of the WRs in flight, allocated by the first staged WR
+static ARENA: OnceLock<WrArena> = OnceLock::new();
+
+struct WrArena {
+    /// Each slot is only accessed by the owner of its `StagedWr`, its lock is never contended
+    slots: Box<[Mutex<Option<SendWrRdma>>]>,
+    /// Indices of the free slots
+    free: ArrayQueue<u32>,
+}
+
+impl WrArena {
+    fn get() -> &'static Self {
+        ARENA.get_or_init(|| {
+            let free = ArrayQueue::new(MAX_STAGED_WR);
+            for index in 0..MAX_STAGED_WR as u32 {
+                let _ignore = free.push(index);
+            }
+            Self {
+                slots: iter::repeat_with(|| Mutex::new(None))
+                    .take(MAX_STAGED_WR)
+                    .collect(),
+                free,
+            }
+        })
+    }
+
+    fn slot(&self, index: u32) -> &Mutex<Option<SendWrRdma>> {
+        self.slots
+            .get(index as usize)
+            .unwrap_or_else(|| unreachable!("slot out of range"))
+    }
+}
+
+/// A WR handed to a worker, held in a slot of the arena unless every slot was taken
+pub(crate) enum StagedWr {
+    Slot(u32),
+    Boxed(Box<SendWrRdma>),
+}
+
+impl StagedWr {
+    /// Copies `wr` into a free slot
+    pub(crate) fn new(wr: SendWrRdma) -> Self {
+        let arena = WrArena::get();
+        let Some(index) = arena.free.pop() else {
+            return Self::Boxed(Box::new(wr));
+        };
+        *arena.slot(index).lock() = Some(wr);
+        Self::Slot(index)
+    }
+
+    /// Returns a copy of the WR
+    pub(crate) fn wr(&self) -> SendWrRdma {
+        match *self {
+            Self::Slot(index) => WrArena::get()
+                .slot(index)
+                .lock()
+                .unwrap_or_else(|| unreachable!("empty slot")),
+            Self::Boxed(ref wr) => **wr,
+        }
+    }
+
+    /// Takes the WR, its slot is freed
+    pub(crate) fn into_wr(self) -> SendWrRdma {
+        self.wr()
+    }
+}
+
+impl Drop for StagedWr {
+    fn drop(&mut self) {
+        if let Self::Slot(index) = *self {
+            let arena = WrArena::get();
+            *arena.slot(index).lock() = None;
+            let _ignore = arena.free.push(index);
+        }
+    }
+}
+
+impl fmt::Debug for StagedWr {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        fmt::Debug::fmt(&self.wr(), f)
+    }
+}
+
+/// Staged WRs are equal if their WRs are, whichever slot holds them
+impl PartialEq for StagedWr {
+    fn eq(&self, other: &Self) -> bool {
+        self.wr() == other.wr()
+    }
+}
+
+impl Eq for StagedWr {}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{rdma_utils::types::SendWrBase, workers::send::WorkReqOpCode};
+
+    fn wr(wr_id: u64) -> SendWrRdma {
+        let base = SendWrBase::new(wr_id, 0, 0x1000, 64, 1, 0, WorkReqOpCode::RdmaWrite);
+        SendWrRdma::new_from_base(base, 0x2000, 2)
+    }
+
+    #[test]
+    fn staged_wrs_free_their_slots() {
+        let staged = StagedWr::new(wr(1));
+        assert!(matches!(staged, StagedWr::Slot(_)));
+        assert_eq!(staged, StagedWr::new(wr(1)));
+        assert_ne!(staged, StagedWr::new(wr(2)));
+        assert_eq!(staged.into_wr().base.wr_id, 1);
+
+        // Past the last slot the WRs are boxed
+        let held: Vec<_> = iter::repeat_with(|| StagedWr::new(wr(2)))
+            .take(MAX_STAGED_WR + 1)
+            .collect();
+        assert!(held.iter().any(|x| matches!(x, StagedWr::Boxed(_))));
+        assert!(held.iter().all(|x| x.wr().base.wr_id == 2));
+    }
+}